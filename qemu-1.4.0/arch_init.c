@@ -27,6 +27,7 @@
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <zlib.h>
 #endif
 #include "config.h"
 #include "monitor/monitor.h"
@@ -39,14 +40,21 @@
 #include "hw/pci/pci.h"
 #include "hw/audiodev.h"
 #include "sysemu/kvm.h"
+#include "sysemu/cpus.h"
 #include "migration/migration.h"
 #include "exec/gdbstub.h"
 #include "hw/smbios.h"
+#include "hw/xen.h"
 #include "exec/address-spaces.h"
 #include "hw/pcspk.h"
 #include "migration/page_cache.h"
+#include "migration/page_compress.h"
+#include "migration/postcopy.h"
+#include "migration/channel.h"
+#include "migration/file.h"
 #include "qemu/config-file.h"
 #include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
 
@@ -106,33 +114,16 @@ const uint32_t arch_type = QEMU_ARCH;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+#define RAM_SAVE_FLAG_CHANNEL  0x01 /* was FULL, which is not used anymore */
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
-
-#ifdef __ALTIVEC__
-#include <altivec.h>
-#define VECTYPE        vector unsigned char
-#define SPLAT(p)       vec_splat(vec_ld(0, p), 0)
-#define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
-/* altivec.h may redefine the bool macro as vector type.
- * Reset it to POSIX semantics. */
-#undef bool
-#define bool _Bool
-#elif defined __SSE2__
-#include <emmintrin.h>
-#define VECTYPE        __m128i
-#define SPLAT(p)       _mm_set1_epi8(*(p))
-#define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
-#else
-#define VECTYPE        unsigned long
-#define SPLAT(p)       (*(p) * (~0UL / 255))
-#define ALL_EQ(v1, v2) ((v1) == (v2))
-#endif
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x80
+#define RAM_SAVE_FLAG_POSTCOPY 0x100
+#define RAM_SAVE_FLAG_DISCARD  0x200
 
 
 static struct defconfig_file {
@@ -164,7 +155,7 @@ int qemu_read_default_config_files(bool userconfig)
     return 0;
 }
 
-static int is_dup_page(uint8_t *page)
+int is_dup_page(uint8_t *page)
 {
     VECTYPE *p = (VECTYPE *)page;
     VECTYPE val = SPLAT(page);
@@ -282,6 +273,26 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return size;
 }
 
+/* Read a RAMBlock's idstr off @f and find the block */
+static RAMBlock *ram_block_from_stream(QEMUFile *f)
+{
+    RAMBlock *block;
+    char id[256];
+    uint8_t len;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id)))
+            return block;
+    }
+
+    fprintf(stderr, "Can't find block %s!\n", id);
+    return NULL;
+}
+
 #define ENCODING_FLAG_XBZRLE 0x1
 
 static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
@@ -293,8 +304,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
 
     if (!cache_is_cached(XBZRLE.cache, current_addr)) {
         if (!last_stage) {
-            cache_insert(XBZRLE.cache, current_addr,
-                         g_memdup(current_data, TARGET_PAGE_SIZE));
+            cache_insert(XBZRLE.cache, current_addr, current_data);
         }
         acct_info.xbzrle_cache_miss++;
         return -1;
@@ -340,6 +350,17 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
 
 /* This is the last block that we have visited serching for dirty pages
  */
+/* Pages are deflated in batches by a pool of worker threads.  A batch is
+   sent in the order it was queued, and always before the end of the section
+   so that the destination never sees two versions of a page in one section
+   and can inflate a whole batch at once. */
+#define RAM_COMPRESS_THREADS 4
+#define RAM_COMPRESS_BATCH   128
+#define RAM_COMPRESS_LEVEL   1
+
+static PageCompressPool *compress_pool;
+static PageCompressPool *decompress_pool;
+
 static RAMBlock *last_seen_block;
 /* This is the last block from where we have sent data */
 static RAMBlock *last_sent_block;
@@ -347,6 +368,47 @@ static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
+static uint64_t bytes_transferred;
+
+/* auto-converge: throttle the guest harder each time it has dirtied memory
+   faster than half the transfer rate for AUTO_CONVERGE_ROUNDS periods of
+   migration_bitmap_sync() in a row */
+#define AUTO_CONVERGE_ROUNDS    4
+#define THROTTLE_PCT_INITIAL    20
+#define THROTTLE_PCT_INCREMENT  10
+static int dirty_rate_high_cnt;
+static uint64_t bytes_xfer_prev;
+
+/* post-copy: switch once this many full passes over RAM are done, and after
+   the switch send this many pages between looking at the destination's
+   requests */
+#define POSTCOPY_PRECOPY_PASSES 2
+#define POSTCOPY_BATCH          64
+static int ram_passes;
+static bool ram_postcopy;
+
+/* Parallel channels carrying the pages, if any; each takes stripes of
+   RAM_CHANNEL_STRIPE_BITS worth of guest addresses in turn */
+#define RAM_CHANNEL_STRIPE_BITS 18
+static int ram_channels;
+
+/* Migration to a file: every page goes to its own place in the file, where
+   pages never written read as zeroes; ram_file_written has those that were */
+static int ram_file_fd = -1;
+static unsigned long *ram_file_written;
+
+static void mig_throttle_guest_down(void)
+{
+    int pct;
+
+    if (!cpu_throttle_active()) {
+        pct = THROTTLE_PCT_INITIAL;
+    } else {
+        pct = cpu_throttle_get_percentage() + THROTTLE_PCT_INCREMENT;
+    }
+    trace_migration_throttle(pct);
+    cpu_throttle_set(pct);
+}
 
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -365,24 +427,9 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
-                                              ram_addr_t offset)
-{
-    bool ret;
-    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
-
-    ret = test_and_set_bit(nr, migration_bitmap);
-
-    if (!ret) {
-        migration_dirty_pages++;
-    }
-    return ret;
-}
-
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
-    ram_addr_t addr;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
@@ -396,14 +443,13 @@ static void migration_bitmap_sync(void)
     trace_migration_bitmap_sync_start();
     memory_global_sync_dirty_bitmap(get_system_memory());
 
+    /* migration_bitmap is indexed by ram_addr_t page like the dirty
+       flags, so whole words of it are merged at a time */
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
-            }
-        }
+        migration_dirty_pages +=
+            memory_region_merge_and_clear_dirty(block->mr,
+                                                DIRTY_MEMORY_MIGRATION,
+                                                migration_bitmap);
     }
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
@@ -412,6 +458,18 @@ static void migration_bitmap_sync(void)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
+        if (migrate_auto_converge()) {
+            if (num_dirty_pages_period * TARGET_PAGE_SIZE >
+                (bytes_transferred - bytes_xfer_prev) / 2) {
+                if (++dirty_rate_high_cnt >= AUTO_CONVERGE_ROUNDS) {
+                    dirty_rate_high_cnt = 0;
+                    mig_throttle_guest_down();
+                }
+            } else {
+                dirty_rate_high_cnt = 0;
+            }
+            bytes_xfer_prev = bytes_transferred;
+        }
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
         start_time = end_time;
@@ -419,19 +477,200 @@ static void migration_bitmap_sync(void)
     }
 }
 
+/* Deflate the queued pages and send them */
+static void ram_compress_flush(QEMUFile *f)
+{
+    PageCompressJob *job;
+    RAMBlock *block;
+    int i, cont;
+
+    if (!compress_pool) {
+        return;
+    }
+
+    page_compress_run(compress_pool);
+    for (i = 0; i < page_compress_count(compress_pool); i++) {
+        job = page_compress_job(compress_pool, i);
+        block = job->opaque;
+        cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+        if (job->len) {
+            bytes_transferred += save_block_hdr(f, block, job->offset, cont,
+                                                RAM_SAVE_FLAG_COMPRESS_PAGE);
+            qemu_put_be16(f, job->len);
+            qemu_put_buffer(f, job->data, job->len);
+            bytes_transferred += 2 + job->len;
+        } else {
+            bytes_transferred += save_block_hdr(f, block, job->offset, cont,
+                                                RAM_SAVE_FLAG_PAGE);
+            qemu_put_buffer(f, job->page, TARGET_PAGE_SIZE);
+            bytes_transferred += TARGET_PAGE_SIZE;
+        }
+        acct_info.norm_pages++;
+        last_sent_block = block;
+    }
+    page_compress_reset(compress_pool);
+}
+
+/* Hand a page to the channel its address maps to */
+static void ram_channel_queue_page(QEMUFile *f, RAMBlock *block,
+                                   ram_addr_t offset, uint8_t *p)
+{
+    int nr = ((block->offset + offset) >> RAM_CHANNEL_STRIPE_BITS) %
+             ram_channels;
+    size_t size = 8;
+    int fill = -1;
+    int ret;
+
+    if (is_dup_page(p)) {
+        acct_info.dup_pages++;
+        fill = *p;
+        size += 1;
+    } else {
+        acct_info.norm_pages++;
+        size += TARGET_PAGE_SIZE;
+    }
+
+    ret = migration_channel_queue(nr, block, offset, p, fill, size);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    bytes_transferred += size;
+}
+
+/* Runs in the channel's thread, see migration/channel.h */
+static void ram_channel_send(QEMUFile *f, void *opaque, uint64_t offset,
+                             void *host, int fill, void **last)
+{
+    RAMBlock *block = opaque;
+    int cont;
+
+    if (!block) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return;
+    }
+
+    cont = (block == *last) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    if (fill >= 0) {
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, fill);
+    } else {
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, host, TARGET_PAGE_SIZE);
+    }
+    *last = block;
+}
+
+/* Runs in the channel's thread.  block->host is used directly, as
+   memory_region_get_ram_ptr() updates ram_list.mru_block. */
+static int ram_channel_load(QEMUFile *f, void **last)
+{
+    RAMBlock *block = *last;
+    ram_addr_t addr;
+    uint8_t *host;
+    int flags;
+
+    addr = qemu_get_be64(f);
+    flags = addr & ~TARGET_PAGE_MASK;
+    addr &= TARGET_PAGE_MASK;
+
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (flags & RAM_SAVE_FLAG_EOS) {
+        return 1;
+    }
+
+    if (!(flags & RAM_SAVE_FLAG_CONTINUE)) {
+        block = ram_block_from_stream(f);
+        *last = block;
+    }
+    if (!block || !block->host || addr >= block->length) {
+        fprintf(stderr, "Ack, bad migration channel stream!\n");
+        return -EINVAL;
+    }
+    host = block->host + addr;
+
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        uint8_t ch = qemu_get_byte(f);
+
+        memset(host, ch, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+        if (ch == 0 &&
+            (!kvm_enabled() || kvm_has_sync_mmu()) &&
+            getpagesize() <= TARGET_PAGE_SIZE) {
+            qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+        }
+#endif
+    } else if (flags & RAM_SAVE_FLAG_PAGE) {
+        qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+    } else {
+        fprintf(stderr, "Unexpected flags %#x on migration channel\n", flags);
+        return -EINVAL;
+    }
+    return qemu_file_get_error(f);
+}
+
+static const MigrationChannelOps ram_channel_ops = {
+    .send = ram_channel_send,
+    .load = ram_channel_load,
+};
+
+/* Have the destination wait until every page queued so far is in */
+static int ram_channels_sync(QEMUFile *f)
+{
+    int ret;
+
+    if (!ram_channels) {
+        return 0;
+    }
+    ret = migration_channels_barrier();
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL);
+    bytes_transferred += 8;
+    return 0;
+}
+
 /*
- * ram_save_block: Writes a page of memory to the stream f
+ * ram_save_block: Writes a page of memory to the stream f, or queues it for
+ * compression or for a channel.  Bytes written are added to bytes_transferred.
  *
- * Returns:  The number of bytes written.
+ * Returns:  The number of pages written or queued.
  *           0 means no dirty pages
  */
 
+static void ram_file_save_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset, uint8_t *p)
+{
+    unsigned long nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+    int ret;
+
+    if (is_dup_page(p) && *p == 0 && !test_bit(nr, ram_file_written)) {
+        acct_info.dup_pages++;
+        return;
+    }
+
+    ret = migration_file_write(p, TARGET_PAGE_SIZE, block->file_offset + offset);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return;
+    }
+    set_bit(nr, ram_file_written);
+    acct_info.norm_pages++;
+    bytes_transferred += TARGET_PAGE_SIZE;
+    /* the stream does not see it, but it counts against the rate limit */
+    migrate_get_current()->bytes_xfer += TARGET_PAGE_SIZE;
+}
+
 static int ram_save_block(QEMUFile *f, bool last_stage)
 {
     RAMBlock *block = last_seen_block;
     ram_addr_t offset = last_offset;
     bool complete_round = false;
     int bytes_sent = 0;
+    int pages = 0;
     MemoryRegion *mr;
     ram_addr_t current_addr;
 
@@ -451,6 +690,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
             if (!block) {
                 block = QTAILQ_FIRST(&ram_list.blocks);
                 complete_round = true;
+                ram_passes++;
             }
         } else {
             uint8_t *p;
@@ -459,6 +699,17 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
 
             p = memory_region_get_ram_ptr(mr) + offset;
 
+            if (ram_channels) {
+                ram_channel_queue_page(f, block, offset, p);
+                pages = 1;
+                break;
+            }
+            if (ram_file_fd >= 0) {
+                ram_file_save_page(f, block, offset, p);
+                pages = 1;
+                break;
+            }
+
             /* In doubt sent page as normal */
             bytes_sent = -1;
             if (is_dup_page(p)) {
@@ -467,7 +718,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
                                             RAM_SAVE_FLAG_COMPRESS);
                 qemu_put_byte(f, *p);
                 bytes_sent += 1;
-            } else if (migrate_use_xbzrle()) {
+            } else if (migrate_use_xbzrle() && !ram_postcopy) {
                 current_addr = block->offset + offset;
                 bytes_sent = save_xbzrle_page(f, p, current_addr, block,
                                               offset, cont, last_stage);
@@ -477,9 +728,26 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
             }
 
             /* XBZRLE overflow or normal page */
-            if (bytes_sent == -1) {
+            if (bytes_sent == -1 && compress_pool) {
+                PageCompressJob *job = page_compress_get(compress_pool);
+
+                /* p may point into the XBZRLE cache, so copy it now */
+                job->opaque = block;
+                job->offset = offset;
+                memcpy(job->page, p, TARGET_PAGE_SIZE);
+                if (page_compress_full(compress_pool)) {
+                    ram_compress_flush(f);
+                }
+                pages = 1;
+                break;
+            } else if (bytes_sent == -1) {
                 bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                if (migrate_use_xbzrle()) {
+                    /* p may point into the XBZRLE cache */
+                    qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                } else {
+                    qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+                }
                 bytes_sent += TARGET_PAGE_SIZE;
                 acct_info.norm_pages++;
             }
@@ -487,6 +755,8 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
                 last_sent_block = block;
+                bytes_transferred += bytes_sent;
+                pages = 1;
                 break;
             }
         }
@@ -494,11 +764,9 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     last_seen_block = block;
     last_offset = offset;
 
-    return bytes_sent;
+    return pages;
 }
 
-static uint64_t bytes_transferred;
-
 static ram_addr_t ram_save_remaining(void)
 {
     return migration_dirty_pages;
@@ -541,10 +809,25 @@ static void migration_end(void)
         g_free(XBZRLE.decoded_buf);
         XBZRLE.cache = NULL;
     }
+
+    if (compress_pool) {
+        page_compress_pool_free(compress_pool);
+        compress_pool = NULL;
+    }
+
+    migration_channels_close(false);
+    ram_channels = 0;
+
+    g_free(ram_file_written);
+    ram_file_written = NULL;
+    ram_file_fd = -1;
+
+    cpu_throttle_stop();
 }
 
 static void ram_migration_cancel(void *opaque)
 {
+    migration_channels_close(true);
     migration_end();
 }
 
@@ -569,9 +852,17 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
+    bytes_xfer_prev = 0;
+    dirty_rate_high_cnt = 0;
+    ram_passes = 0;
+    ram_postcopy = false;
     reset_ram_globals();
 
-    if (migrate_use_xbzrle()) {
+    /* in a file every page has its place, so there is nothing for XBZRLE,
+       compression or channels to save */
+    ram_file_fd = migration_file_fd();
+
+    if (migrate_use_xbzrle() && ram_file_fd < 0) {
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
                                   TARGET_PAGE_SIZE,
                                   TARGET_PAGE_SIZE);
@@ -584,6 +875,40 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (migrate_compress_pages() && ram_file_fd < 0) {
+        compress_pool = page_compress_pool_new(RAM_COMPRESS_THREADS,
+                                               RAM_COMPRESS_BATCH,
+                                               TARGET_PAGE_SIZE,
+                                               RAM_COMPRESS_LEVEL);
+    }
+
+    /* XBZRLE and compressed pages stay on the main connection */
+    ram_channels = 0;
+    if (!migrate_use_xbzrle() && !compress_pool && ram_file_fd < 0) {
+        ram_channels = migration_channels_connect(&ram_channel_ops);
+        if (ram_channels < 0) {
+            ram_channels = 0;
+            qemu_mutex_unlock_ramlist();
+            return -1;
+        }
+    }
+
+    if (ram_file_fd >= 0) {
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (migration_file_add_block(block->idstr, block->length,
+                                         &block->file_offset) < 0) {
+                qemu_mutex_unlock_ramlist();
+                return -1;
+            }
+        }
+        if (migration_file_write_header() < 0) {
+            fprintf(stderr, "Failed to write the migration file header\n");
+            qemu_mutex_unlock_ramlist();
+            return -1;
+        }
+        ram_file_written = bitmap_new(ram_pages);
+    }
+
     memory_global_dirty_log_start();
     migration_bitmap_sync();
 
@@ -595,6 +920,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_be64(f, block->length);
     }
 
+    if (ram_channels) {
+        qemu_put_be64(f, ((uint64_t)ram_channels << TARGET_PAGE_BITS) |
+                         RAM_SAVE_FLAG_CHANNEL);
+    }
+
     qemu_mutex_unlock_ramlist();
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
@@ -606,7 +936,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     int ret;
     int i;
     int64_t t0;
-    int total_sent = 0;
+    uint64_t start = bytes_transferred;
 
     qemu_mutex_lock_ramlist();
 
@@ -617,14 +947,10 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     t0 = qemu_get_clock_ns(rt_clock);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
-
-        bytes_sent = ram_save_block(f, false);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (ram_save_block(f, false) == 0) {
             break;
         }
-        total_sent += bytes_sent;
         acct_info.iterations++;
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
@@ -642,22 +968,29 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
 
+    ram_compress_flush(f);
+    /* pages sent with qemu_put_buffer_async() or queued for a channel
+       must be written out while their RAMBlocks cannot go away */
+    qemu_fflush(f);
+    if (ram_channels && ret >= 0) {
+        ret = migration_channels_flush();
+    }
     qemu_mutex_unlock_ramlist();
 
     if (ret < 0) {
-        bytes_transferred += total_sent;
         return ret;
     }
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-    total_sent += 8;
-    bytes_transferred += total_sent;
+    bytes_transferred += 8;
 
-    return total_sent;
+    return bytes_transferred - start;
 }
 
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret;
+
     qemu_mutex_lock_ramlist();
     migration_bitmap_sync();
 
@@ -665,23 +998,193 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     /* flush all remaining blocks regardless of rate limiting */
     while (true) {
-        int bytes_sent;
-
-        bytes_sent = ram_save_block(f, true);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (ram_save_block(f, true) == 0) {
             break;
         }
-        bytes_transferred += bytes_sent;
     }
+    ram_compress_flush(f);
+    qemu_fflush(f);
+    ret = ram_channels_sync(f);
     migration_end();
 
     qemu_mutex_unlock_ramlist();
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
+    return ret;
+}
+
+/*
+ * Switch to post-copy: rather than sending the pages dirtied since they
+ * were last sent, tell the destination to drop its stale copies of them.
+ * It will ask for those it needs first; ram_postcopy_iterate() sends them
+ * and the rest.
+ */
+static int ram_save_postcopy(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+    unsigned long base, size, nr, end;
+    int cont, ret;
+
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+
+    ram_compress_flush(f);
+    if (compress_pool) {
+        page_compress_pool_free(compress_pool);
+        compress_pool = NULL;
+    }
+
+    /* Pages still on their way over a channel must not land after the
+       discards; from here on everything goes on the main connection */
+    ret = ram_channels_sync(f);
+    migration_channels_close(ret < 0);
+    ram_channels = 0;
+    if (ret < 0) {
+        qemu_mutex_unlock_ramlist();
+        return ret;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    bytes_transferred += 8;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        base = block->mr->ram_addr >> TARGET_PAGE_BITS;
+        size = base + (block->length >> TARGET_PAGE_BITS);
+
+        nr = find_next_bit(migration_bitmap, size, base);
+        while (nr < size) {
+            end = find_next_zero_bit(migration_bitmap, size, nr);
+            cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+            bytes_transferred += save_block_hdr(f, block,
+                                                (ram_addr_t)(nr - base) <<
+                                                TARGET_PAGE_BITS,
+                                                cont, RAM_SAVE_FLAG_DISCARD);
+            qemu_put_be64(f, (uint64_t)(end - nr) << TARGET_PAGE_BITS);
+            bytes_transferred += 8;
+            last_sent_block = block;
+            nr = find_next_bit(migration_bitmap, size, end);
+        }
+    }
+    trace_migration_postcopy_start(migration_dirty_pages);
+    ram_postcopy = true;
+
+    qemu_fflush(f);
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
     return 0;
 }
 
+void ram_free_page_hint(uint64_t addr, uint64_t len)
+{
+    unsigned long nr = addr >> TARGET_PAGE_BITS;
+    unsigned long end = (addr + len) >> TARGET_PAGE_BITS;
+    uint64_t pages = 0;
+
+    /* Nothing to skip outside of a migration, and after the switch to
+       post-copy the pages are the destination's business */
+    if (!migration_bitmap || ram_postcopy) {
+        return;
+    }
+
+    /* A page written after this gets its bit back from the dirty log */
+    for (; nr < end; nr++) {
+        if (test_and_clear_bit(nr, migration_bitmap)) {
+            pages++;
+        }
+    }
+    migration_dirty_pages -= pages;
+    trace_migration_free_page_hint(addr, len, pages);
+}
+
+bool ram_postcopy_ready(void)
+{
+    return ram_passes >= POSTCOPY_PRECOPY_PASSES;
+}
+
+/* Post-copy: send a page the destination lacks, dirty or not */
+static void ram_save_postcopy_page(QEMUFile *f, RAMBlock *block,
+                                   ram_addr_t offset)
+{
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    int nr = (block->mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    if (test_and_clear_bit(nr, migration_bitmap)) {
+        migration_dirty_pages--;
+    }
+
+    if (is_dup_page(p)) {
+        acct_info.dup_pages++;
+        bytes_transferred += save_block_hdr(f, block, offset, cont,
+                                            RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_transferred += 1;
+    } else {
+        bytes_transferred += save_block_hdr(f, block, offset, cont,
+                                            RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_transferred += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+    last_sent_block = block;
+}
+
+/*
+ * Post-copy: send the pages the destination is waiting for, then a batch
+ * of those it still lacks.
+ *
+ * Returns: 1 once every page is sent, 0 if there are more, or a negative
+ *          error
+ */
+int ram_postcopy_iterate(QEMUFile *f)
+{
+    RAMBlock *block;
+    char idstr[256];
+    uint64_t offset;
+    int i, ret = 0;
+
+    qemu_mutex_lock_ramlist();
+
+    while (postcopy_outgoing_get_request(idstr, &offset)) {
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strcmp(idstr, block->idstr)) {
+                break;
+            }
+        }
+        if (!block || offset >= block->length ||
+            (offset & ~TARGET_PAGE_MASK)) {
+            fprintf(stderr, "post-copy: destination asked for bad page "
+                    "%s:%#" PRIx64 "\n", idstr, offset);
+            ret = -EINVAL;
+            goto out;
+        }
+        ram_save_postcopy_page(f, block, offset);
+    }
+
+    for (i = 0; i < POSTCOPY_BATCH; i++) {
+        if (ram_save_block(f, true) == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            bytes_transferred += 8;
+            ret = 1;
+            break;
+        }
+    }
+
+out:
+    qemu_fflush(f);
+    if (ret == 1) {
+        migration_end();
+    }
+    qemu_mutex_unlock_ramlist();
+
+    if (ret >= 0 && qemu_file_get_error(f)) {
+        ret = qemu_file_get_error(f);
+    }
+    return ret;
+}
+
 static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 {
     uint64_t remaining_size;
@@ -741,8 +1244,6 @@ static inline void *host_from_stream_offset(QEMUFile *f,
                                             int flags)
 {
     static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
         if (!block) {
@@ -753,17 +1254,68 @@ static inline void *host_from_stream_offset(QEMUFile *f,
         return memory_region_get_ram_ptr(block->mr) + offset;
     }
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
+    block = ram_block_from_stream(f);
+    if (!block) {
+        return NULL;
+    }
+    return memory_region_get_ram_ptr(block->mr) + offset;
+}
+
+/* Whether the migration file may be mapped over the block: only plain
+   anonymous memory can be replaced, and KVM must notice that it was */
+static bool ram_file_can_map(RAMBlock *block)
+{
+    return !mem_path && !(block->flags & RAM_PREALLOC_MASK) &&
+           !xen_enabled() && (!kvm_enabled() || kvm_has_sync_mmu());
+}
+
+/* The destination's half of ram_save_postcopy() */
+static int ram_postcopy_incoming_init(QEMUFile *f)
+{
+    RAMBlock *block;
+    int ret;
+
+    if (TARGET_PAGE_SIZE != qemu_real_host_page_size) {
+        fprintf(stderr, "post-copy: target and host page size differ\n");
+        return -EINVAL;
+    }
+
+    ret = postcopy_incoming_init(qemu_get_fd(f));
+    if (ret < 0) {
+        return ret;
+    }
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return memory_region_get_ram_ptr(block->mr) + offset;
+        if (mem_path || (block->flags & RAM_PREALLOC_MASK)) {
+            fprintf(stderr, "post-copy: RAM block %s is not anonymous memory\n",
+                    block->idstr);
+            return -EINVAL;
+        }
+        ret = postcopy_incoming_register(memory_region_get_ram_ptr(block->mr),
+                                         block->length, block->idstr);
+        if (ret < 0) {
+            return ret;
+        }
     }
+    return 0;
+}
 
-    fprintf(stderr, "Can't find block %s!\n", id);
-    return NULL;
+/* Inflate the queued pages into guest memory */
+static int ram_decompress_flush(void)
+{
+    int ret;
+
+    if (!decompress_pool) {
+        return 0;
+    }
+
+    ret = page_compress_run(decompress_pool);
+    page_compress_reset(decompress_pool);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to load compressed page - inflate error!\n");
+        return -EINVAL;
+    }
+    return 0;
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
@@ -818,8 +1370,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                         goto done;
                     }
 
+                    /* from a file, RAM is not in the stream */
+                    if (migration_file_incoming()) {
+                        ret = migration_file_load_block(id,
+                                    memory_region_get_ram_ptr(block->mr),
+                                    length, ram_file_can_map(block));
+                        if (ret < 0) {
+                            goto done;
+                        }
+                    }
+
                     total_ram_bytes -= length;
                 }
+                if (migration_file_incoming()) {
+                    migration_file_prefetch_start();
+                }
             }
         }
 
@@ -860,6 +1425,65 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            PageCompressJob *job;
+            unsigned int len;
+
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+
+            if (!decompress_pool) {
+                decompress_pool = page_compress_pool_new(RAM_COMPRESS_THREADS,
+                                                         RAM_COMPRESS_BATCH,
+                                                         TARGET_PAGE_SIZE, 0);
+            }
+
+            len = qemu_get_be16(f);
+            if (len == 0 || len > page_compress_bound(decompress_pool)) {
+                fprintf(stderr, "Failed to load compressed page - "
+                        "bad length %u!\n", len);
+                ret = -EINVAL;
+                goto done;
+            }
+
+            job = page_compress_get(decompress_pool);
+            job->page = host;
+            job->len = len;
+            qemu_get_buffer(f, job->data, len);
+            if (page_compress_full(decompress_pool)) {
+                ret = ram_decompress_flush();
+                if (ret < 0) {
+                    goto done;
+                }
+            }
+        } else if (flags & RAM_SAVE_FLAG_CHANNEL) {
+            /* the channels to accept, or a sync point without a count */
+            if (addr) {
+                ret = migration_channels_accept(addr >> TARGET_PAGE_BITS,
+                                                &ram_channel_ops);
+            } else {
+                ret = migration_channels_wait();
+            }
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            ret = ram_postcopy_incoming_init(f);
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_DISCARD) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            uint64_t len = qemu_get_be64(f);
+
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+            postcopy_incoming_discard(host, len);
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -869,20 +1493,293 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    /* Pages queued before an error are inflated all the same: the pool must
+       be empty for the next section */
+    if (ram_decompress_flush() < 0 && ret == 0) {
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
 }
 
+/* The page stream that follows the switch to post-copy.  It is loaded in a
+ * thread of its own, as the guest already runs on the destination.
+ */
+int ram_load_postcopy(QEMUFile *f)
+{
+    uint8_t *buf = g_malloc(TARGET_PAGE_SIZE);
+    const uint8_t *data;
+    ram_addr_t addr;
+    int flags, ret = 0;
+    void *host;
+    uint8_t ch;
+
+    do {
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+
+            data = buf;
+            if (flags & RAM_SAVE_FLAG_COMPRESS) {
+                ch = qemu_get_byte(f);
+                memset(buf, ch, TARGET_PAGE_SIZE);
+                if (ch == 0) {
+                    data = NULL;
+                }
+            } else {
+                qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+            }
+            ret = qemu_file_get_error(f);
+            if (ret == 0) {
+                ret = postcopy_incoming_place_page(host, data);
+            }
+        } else if (!(flags & RAM_SAVE_FLAG_EOS)) {
+            fprintf(stderr, "Unexpected RAM flags %#x after the switch to "
+                    "post-copy\n", flags);
+            ret = -EINVAL;
+        }
+        if (ret == 0) {
+            ret = qemu_file_get_error(f);
+        }
+    } while (ret == 0 && !(flags & RAM_SAVE_FLAG_EOS));
+
+    g_free(buf);
+    DPRINTF("Completed post-copy load of RAM with exit code %d\n", ret);
+    return ret;
+}
+
 SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
+    .save_live_postcopy = ram_save_postcopy,
     .save_live_pending = ram_save_pending,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
 };
 
+/*
+ * Dirty rate measurement
+ *
+ * calc-dirty-rate picks pages spread evenly over each RAM block and hashes
+ * them; when the measurement ends, the pages whose hash changed are taken as
+ * a sample of the pages the guest dirtied.  Only guest memory is read, so
+ * this works the same with TCG, KVM and Xen, and leaves dirty logging to
+ * migration.
+ */
+
+#define DIRTY_RATE_CALC_TIME_MAX    60
+#define DIRTY_RATE_SAMPLE_PAGES     512
+#define DIRTY_RATE_SAMPLE_PAGES_MAX 65536
+
+typedef struct DirtyRateRecord {
+    char idstr[256];
+    ram_addr_t length;
+    int nb_samples;
+    ram_addr_t *offsets;
+    uint32_t *hashes;
+} DirtyRateRecord;
+
+static struct {
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    QEMUTimer *timer;
+    DirtyRateRecord *records;
+    int nb_records;
+    int64_t dirty_rate;
+    DirtyRateBlockInfoList *blocks;
+} dirty_rate;
+
+static uint32_t dirty_rate_hash_page(RAMBlock *block, ram_addr_t offset)
+{
+    void *p = qemu_get_ram_ptr(block->offset + offset);
+    uint32_t hash = crc32(0, p, TARGET_PAGE_SIZE);
+
+    qemu_put_ram_ptr(p);
+    return hash;
+}
+
+static void dirty_rate_free_records(void)
+{
+    int i;
+
+    for (i = 0; i < dirty_rate.nb_records; i++) {
+        g_free(dirty_rate.records[i].offsets);
+        g_free(dirty_rate.records[i].hashes);
+    }
+    g_free(dirty_rate.records);
+    dirty_rate.records = NULL;
+    dirty_rate.nb_records = 0;
+}
+
+static void dirty_rate_sample_block(DirtyRateRecord *rec, RAMBlock *block,
+                                    int64_t sample_pages)
+{
+    ram_addr_t pages = block->length >> TARGET_PAGE_BITS;
+    ram_addr_t chunk;
+    int i;
+
+    pstrcpy(rec->idstr, sizeof(rec->idstr), block->idstr);
+    rec->length = block->length;
+    rec->nb_samples = MAX(1, MIN(pages, (block->length * sample_pages) >> 30));
+    rec->offsets = g_new(ram_addr_t, rec->nb_samples);
+    rec->hashes = g_new(uint32_t, rec->nb_samples);
+
+    /* one page at random in each of nb_samples equal chunks */
+    chunk = pages / rec->nb_samples;
+    for (i = 0; i < rec->nb_samples; i++) {
+        ram_addr_t page = i * chunk + g_random_int_range(0, chunk);
+
+        rec->offsets[i] = page << TARGET_PAGE_BITS;
+        rec->hashes[i] = dirty_rate_hash_page(block, rec->offsets[i]);
+    }
+}
+
+static void dirty_rate_complete(void *opaque)
+{
+    int64_t elapsed = qemu_get_clock_ms(rt_clock) - dirty_rate.start_time;
+    DirtyRateBlockInfoList **tail = &dirty_rate.blocks;
+    double rate, total = 0;
+    RAMBlock *block;
+    int i, j;
+
+    for (i = 0; i < dirty_rate.nb_records; i++) {
+        DirtyRateRecord *rec = &dirty_rate.records[i];
+        DirtyRateBlockInfoList *entry;
+        DirtyRateBlockInfo *info;
+        int dirty = 0;
+
+        /* skip blocks that were resized or went away meanwhile */
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strcmp(block->idstr, rec->idstr)) {
+                break;
+            }
+        }
+        if (!block || block->length != rec->length) {
+            continue;
+        }
+
+        for (j = 0; j < rec->nb_samples; j++) {
+            if (dirty_rate_hash_page(block, rec->offsets[j]) !=
+                rec->hashes[j]) {
+                dirty++;
+            }
+        }
+        rate = (double)dirty / rec->nb_samples *
+               (rec->length >> TARGET_PAGE_BITS) * 1000 / MAX(elapsed, 1);
+        total += rate;
+
+        info = g_malloc0(sizeof(*info));
+        info->id = g_strdup(rec->idstr);
+        info->size = rec->length;
+        info->sampled = rec->nb_samples;
+        info->dirty = dirty;
+        info->dirty_rate = rate;
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    dirty_rate.dirty_rate = total;
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURED;
+    dirty_rate_free_records();
+    trace_dirty_rate_complete(elapsed, dirty_rate.dirty_rate);
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    RAMBlock *block;
+    int i;
+
+    if (dirty_rate.status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "a dirty rate measurement is already running");
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTY_RATE_CALC_TIME_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                  "a number of seconds from 1 to 60");
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTY_RATE_SAMPLE_PAGES;
+    } else if (sample_pages < 1 ||
+               sample_pages > DIRTY_RATE_SAMPLE_PAGES_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                  "a number of pages from 1 to 65536");
+        return;
+    }
+
+    qapi_free_DirtyRateBlockInfoList(dirty_rate.blocks);
+    dirty_rate.blocks = NULL;
+    dirty_rate.dirty_rate = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        dirty_rate.nb_records++;
+    }
+    dirty_rate.records = g_new0(DirtyRateRecord, dirty_rate.nb_records);
+    i = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        dirty_rate_sample_block(&dirty_rate.records[i++], block, sample_pages);
+    }
+
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURING;
+    dirty_rate.calc_time = calc_time;
+    dirty_rate.start_time = qemu_get_clock_ms(rt_clock);
+    if (!dirty_rate.timer) {
+        dirty_rate.timer = qemu_new_timer_ms(rt_clock, dirty_rate_complete,
+                                             NULL);
+    }
+    qemu_mod_timer(dirty_rate.timer, dirty_rate.start_time + calc_time * 1000);
+    trace_dirty_rate_start(calc_time, sample_pages, dirty_rate.nb_records);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+    DirtyRateBlockInfoList *entry, **tail = &info->blocks;
+
+    info->status = dirty_rate.status;
+    if (dirty_rate.status == DIRTY_RATE_STATUS_UNSTARTED) {
+        return info;
+    }
+
+    info->has_start_time = true;
+    info->start_time = dirty_rate.start_time;
+    info->has_calc_time = true;
+    info->calc_time = dirty_rate.calc_time;
+    info->has_page_size = true;
+    info->page_size = TARGET_PAGE_SIZE;
+    if (dirty_rate.status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate.dirty_rate;
+    info->has_blocks = true;
+    for (entry = dirty_rate.blocks; entry; entry = entry->next) {
+        DirtyRateBlockInfo *block = g_malloc0(sizeof(*block));
+
+        *block = *entry->value;
+        block->id = g_strdup(entry->value->id);
+        *tail = g_malloc0(sizeof(**tail));
+        (*tail)->value = block;
+        tail = &(*tail)->next;
+    }
+    return info;
+}
+
 #ifdef HAS_AUDIO
 struct soundhw {
     const char *name;
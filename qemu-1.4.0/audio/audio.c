@@ -25,6 +25,8 @@
 #include "audio.h"
 #include "monitor/monitor.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
 #include "sysemu/sysemu.h"
 
 #define AUDIO_CAP "audio"
@@ -35,6 +37,10 @@
 pthread_mutex_t audio_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
 /* #define DEBUG_PLIVE */
 /* #define DEBUG_LIVE */
 /* #define DEBUG_OUT */
@@ -75,6 +81,8 @@ static struct {
     int log_to_monitor;
     int try_poll_in;
     int try_poll_out;
+    int thread;
+    int thread_rt;
 } conf = {
     .fixed_out = { /* DAC fixed settings */
         .enabled = 1,
@@ -1149,6 +1157,9 @@ static int audio_is_timer_needed (void)
 
 static void audio_reset_timer (AudioState *s)
 {
+    if (conf.thread) {
+        return;
+    }
     if (audio_is_timer_needed ()) {
         qemu_mod_timer (s->ts, qemu_get_clock_ns (vm_clock) + 1);
     }
@@ -1162,6 +1173,63 @@ static void audio_timer (void *opaque)
     audio_run ("timer");
     audio_reset_timer (opaque);
 }
+
+/*
+ * Mixer thread
+ *
+ * The timer runs once per main loop iteration, after all the file
+ * descriptor handlers, so a busy main loop delays the mixer directly.
+ * The thread wakes up on its own every period instead.  Device models
+ * still expect the global mutex, so it is held while mixing.
+ */
+static void audio_thread_set_rt (void)
+{
+#ifndef _WIN32
+    struct sched_param param;
+    int err;
+
+    memset (&param, 0, sizeof (param));
+    param.sched_priority = sched_get_priority_min (SCHED_FIFO);
+    err = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+    if (err) {
+        dolog ("warning: Could not give the mixer thread real-time "
+               "priority: %s\n", strerror (err));
+    }
+#else
+    dolog ("warning: Real-time mixer thread not supported\n");
+#endif
+}
+
+static void *audio_thread (void *opaque)
+{
+    AudioState *s = opaque;
+    int64_t period = conf.period.hertz > 0 ? conf.period.ticks : SCALE_MS;
+    int64_t next = get_clock ();
+
+    if (conf.thread_rt) {
+        audio_thread_set_rt ();
+    }
+
+    for (;;) {
+        int64_t now = get_clock ();
+
+        /* Do not try to catch up after a long stall, just restart */
+        next += period;
+        if (next > now) {
+            g_usleep ((next - now) / 1000);
+        } else {
+            next = now;
+        }
+
+        qemu_mutex_lock_iothread ();
+        if (s->vm_running && audio_is_timer_needed ()) {
+            audio_run ("thread");
+        }
+        qemu_mutex_unlock_iothread ();
+    }
+
+    return NULL;
+}
 #endif
 
 /*
@@ -1692,6 +1760,18 @@ static struct audio_option audio_options[] = {
         .valp  = &conf.log_to_monitor,
         .descr = "Print logging messages to monitor instead of stderr"
     },
+    {
+        .name  = "THREAD",
+        .tag   = AUD_OPT_BOOL,
+        .valp  = &conf.thread,
+        .descr = "Mix in a thread of its own every TIMER_PERIOD"
+    },
+    {
+        .name  = "THREAD_RT",
+        .tag   = AUD_OPT_BOOL,
+        .valp  = &conf.thread_rt,
+        .descr = "Give the mixer thread real-time (SCHED_FIFO) priority"
+    },
     { /* End of list */ }
 };
 
@@ -1870,16 +1950,18 @@ static void audio_init (void)
     QLIST_INIT (&s->cap_head);
     atexit (audio_atexit);
 
+    audio_process_options ("AUDIO", audio_options);
+
 /* OXT: Remove QEMU Timer calls to use pthread instead. */
 #ifndef CONFIG_XEN_ALSA
-    s->ts = qemu_new_timer_ns (vm_clock, audio_timer, s);
-    if (!s->ts) {
-        hw_error("Could not create audio timer\n");
+    if (!conf.thread) {
+        s->ts = qemu_new_timer_ns (vm_clock, audio_timer, s);
+        if (!s->ts) {
+            hw_error("Could not create audio timer\n");
+        }
     }
 #endif
 
-    audio_process_options ("AUDIO", audio_options);
-
     s->nb_hw_voices_out = conf.fixed_out.nb_voices;
     s->nb_hw_voices_in = conf.fixed_in.nb_voices;
 
@@ -1959,6 +2041,10 @@ static void audio_init (void)
 /* OXT: Remove QEMU Timer calls to use pthread instead. */
 #ifdef CONFIG_XEN_ALSA
     pthread_create(&s->audio_thread, NULL, audio_worker_thread, (void *)s);
+#else
+    if (conf.thread) {
+        qemu_thread_create (&s->thread, audio_thread, s, QEMU_THREAD_DETACHED);
+    }
 #endif
 }
 
@@ -29,6 +29,7 @@
 /* #define RECIPROCAL */
 #endif
 #include "mixeng.h"
+#include "qemu/thread.h"
 
 struct audio_pcm_ops;
 
@@ -204,6 +205,8 @@ struct AudioState {
      * Performance and audio quality seems better when QEMU is running in a stubdomain. */
 #ifdef CONFIG_XEN_ALSA
     pthread_t audio_thread;
+#else
+    QemuThread thread;
 #endif
 };
 
@@ -349,20 +349,21 @@ void mixeng_clear (struct st_sample *buf, int len)
 void mixeng_volume (struct st_sample *buf, int len, struct mixeng_volume *vol)
 {
 #ifdef CONFIG_MIXEMU
+    int i;
+
     if (vol->mute) {
         mixeng_clear (buf, len);
         return;
     }
 
-    while (len--) {
+    for (i = 0; i < len; i++) {
 #ifdef FLOAT_MIXENG
-        buf->l = buf->l * vol->l;
-        buf->r = buf->r * vol->r;
+        buf[i].l = buf[i].l * vol->l;
+        buf[i].r = buf[i].r * vol->r;
 #else
-        buf->l = (buf->l * vol->l) >> 32;
-        buf->r = (buf->r * vol->r) >> 32;
+        buf[i].l = (buf[i].l * vol->l) >> 32;
+        buf[i].r = (buf[i].r * vol->r) >> 32;
 #endif
-        buf += 1;
     }
 #else
     (void) buf;
@@ -54,20 +54,25 @@ static mixeng_real inline glue (conv_, ET) (IN_T v)
 #endif
 }
 
+/*
+ * The clip functions use selects rather than early returns so that the
+ * loops below can be vectorized.  The value is computed from v clamped to
+ * the valid range first, out of range float to int conversions being
+ * undefined.
+ */
 static IN_T inline glue (clip_, ET) (mixeng_real v)
 {
-    if (v >= 0.5) {
-        return IN_MAX;
-    }
-    else if (v < -0.5) {
-        return IN_MIN;
-    }
+    mixeng_real c = v >= 0.5 ? 0.5 : v < -0.5 ? -0.5 : v;
+    IN_T r;
 
 #ifdef SIGNED
-    return ENDIAN_CONVERT ((IN_T) (v * ((mixeng_real) IN_MAX - IN_MIN)));
+    r = ENDIAN_CONVERT ((IN_T) (c * ((mixeng_real) IN_MAX - IN_MIN)));
 #else
-    return ENDIAN_CONVERT ((IN_T) ((v * IN_MAX) + HALF));
+    r = ENDIAN_CONVERT ((IN_T) ((c * IN_MAX) + HALF));
 #endif
+    r = v >= 0.5 ? IN_MAX : r;
+    r = v < -0.5 ? IN_MIN : r;
+    return r;
 }
 
 #else  /* !FLOAT_MIXENG */
@@ -82,33 +87,33 @@ static inline int64_t glue (conv_, ET) (IN_T v)
 #endif
 }
 
+/* Branch-free so that the loops below can be vectorized */
 static inline IN_T glue (clip_, ET) (int64_t v)
 {
-    if (v >= 0x7f000000) {
-        return IN_MAX;
-    }
-    else if (v < -2147483648LL) {
-        return IN_MIN;
-    }
+    IN_T r;
 
 #ifdef SIGNED
-    return ENDIAN_CONVERT ((IN_T) (v >> (32 - SHIFT)));
+    r = ENDIAN_CONVERT ((IN_T) (v >> (32 - SHIFT)));
 #else
-    return ENDIAN_CONVERT ((IN_T) ((v >> (32 - SHIFT)) + HALF));
+    r = ENDIAN_CONVERT ((IN_T) ((v >> (32 - SHIFT)) + HALF));
 #endif
+    r = v >= 0x7f000000 ? IN_MAX : r;
+    r = v < -2147483648LL ? IN_MIN : r;
+    return r;
 }
 #endif
 
+/* Counted loops over indices, which the vectorizer handles best */
 static void glue (glue (conv_, ET), _to_stereo)
     (struct st_sample *dst, const void *src, int samples)
 {
     struct st_sample *out = dst;
-    IN_T *in = (IN_T *) src;
+    const IN_T *in = (const IN_T *) src;
+    int i;
 
-    while (samples--) {
-        out->l = glue (conv_, ET) (*in++);
-        out->r = glue (conv_, ET) (*in++);
-        out += 1;
+    for (i = 0; i < samples; i++) {
+        out[i].l = glue (conv_, ET) (in[2 * i]);
+        out[i].r = glue (conv_, ET) (in[2 * i + 1]);
     }
 }
 
@@ -116,13 +121,12 @@ static void glue (glue (conv_, ET), _to_mono)
     (struct st_sample *dst, const void *src, int samples)
 {
     struct st_sample *out = dst;
-    IN_T *in = (IN_T *) src;
+    const IN_T *in = (const IN_T *) src;
+    int i;
 
-    while (samples--) {
-        out->l = glue (conv_, ET) (in[0]);
-        out->r = out->l;
-        out += 1;
-        in += 1;
+    for (i = 0; i < samples; i++) {
+        out[i].l = glue (conv_, ET) (in[i]);
+        out[i].r = out[i].l;
     }
 }
 
@@ -131,10 +135,11 @@ static void glue (glue (clip_, ET), _from_stereo)
 {
     const struct st_sample *in = src;
     IN_T *out = (IN_T *) dst;
-    while (samples--) {
-        *out++ = glue (clip_, ET) (in->l);
-        *out++ = glue (clip_, ET) (in->r);
-        in += 1;
+    int i;
+
+    for (i = 0; i < samples; i++) {
+        out[2 * i] = glue (clip_, ET) (in[i].l);
+        out[2 * i + 1] = glue (clip_, ET) (in[i].r);
     }
 }
 
@@ -143,9 +148,10 @@ static void glue (glue (clip_, ET), _from_mono)
 {
     const struct st_sample *in = src;
     IN_T *out = (IN_T *) dst;
-    while (samples--) {
-        *out++ = glue (clip_, ET) (in->l + in->r);
-        in += 1;
+    int i;
+
+    for (i = 0; i < samples; i++) {
+        out[i] = glue (clip_, ET) (in[i].l + in[i].r);
     }
 }
 
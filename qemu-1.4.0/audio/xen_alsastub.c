@@ -5,6 +5,8 @@
 #include <sys/mman.h>
 #include <libv4v.h>
 #include <alsa/asoundlib.h>
+#include <poll.h>
+#include "qemu/queue.h"
 #include "audio.h"
 
 #define AUDIO_CAP "xen_alsa"
@@ -14,6 +16,14 @@ typedef struct ALSAVoiceOut {
     HWVoiceOut hw;
     void *pcm_buf;
     snd_pcm_t *handle;
+
+    /* Streaming playback: frames sent, and the helper's last status */
+    bool streaming;
+    uint64_t sent;
+    uint64_t played;
+    int helper_avail;
+    int helper_state;
+    QLIST_ENTRY(ALSAVoiceOut) entries;
 } ALSAVoiceOut;
 
 typedef struct ALSAVoiceIn {
@@ -89,6 +99,25 @@ struct alsa_params_obt {
 #define AUDIO_SND_PCM_READI                    0x10
 #define AUDIO_SND_PCM_RESUME                   0x11
 
+/* Streaming playback.  Instead of an AUDIO_SND_PCM_WRITEI round trip per
+ * chunk, frames are pushed into the v4v ring with AUDIO_PCM_STREAM_WRITE
+ * and never answered.  The helper queues them on its side and, whenever
+ * it hands frames to ALSA or the PCM changes state, sends an unsolicited
+ * AUDIO_PCM_STREAM_STATUS carrying the stream position it has consumed up
+ * to, snd_pcm_avail() at that point and snd_pcm_state().  It recovers from
+ * xruns by itself.  AUDIO_PCM_STREAM_START answers 0 if the helper does
+ * all of this, otherwise the voice keeps using AUDIO_SND_PCM_WRITEI.
+ */
+#define AUDIO_PCM_STREAM_START                 0x12
+#define AUDIO_PCM_STREAM_WRITE                 0x13
+#define AUDIO_PCM_STREAM_STATUS                0x14
+
+struct audio_stream_status {
+    uint64_t position;
+    int32_t avail;
+    int32_t state;
+};
+
 #define MAX_V4V_MSG_SIZE (V4V_AUDIO_RING_SIZE)
 
 struct audio_helper {
@@ -101,6 +130,66 @@ struct audio_helper {
 
 struct audio_helper *ah;
 
+static QLIST_HEAD(, ALSAVoiceOut) streaming_voices =
+    QLIST_HEAD_INITIALIZER(streaming_voices);
+
+static void audio_helper_stream_status(const uint8_t *v4v_buf)
+{
+    struct audio_stream_status status;
+    snd_pcm_t *handle;
+    ALSAVoiceOut *alsa;
+
+    v4v_buf++;
+    memcpy(&handle, v4v_buf, sizeof(handle));
+    v4v_buf += sizeof(handle);
+    memcpy(&status, v4v_buf, sizeof(status));
+
+    QLIST_FOREACH(alsa, &streaming_voices, entries) {
+        if (alsa->handle == handle) {
+            alsa->played = status.position;
+            alsa->helper_avail = status.avail;
+            alsa->helper_state = status.state;
+            return;
+        }
+    }
+}
+
+/* Status messages can arrive ahead of the reply to a request */
+static int audio_helper_recv_reply(void)
+{
+    int r;
+
+    for (;;) {
+        r = v4v_recvfrom(ah->fd, ah->io_buf, MAX_V4V_MSG_SIZE, 0,
+                         &ah->remote_addr);
+        if (r <= 0 || ah->io_buf[0] != AUDIO_PCM_STREAM_STATUS) {
+            return r;
+        }
+        audio_helper_stream_status(ah->io_buf);
+    }
+}
+
+/* Voices run from the audio worker thread, which is also the only reader
+ * of the socket; the main loop must not race it for replies.
+ */
+static void audio_helper_poll_status(void)
+{
+    struct pollfd pfd = { .fd = ah->fd, .events = POLLIN };
+    int r;
+
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        r = v4v_recvfrom(ah->fd, ah->io_buf, MAX_V4V_MSG_SIZE, 0,
+                         &ah->remote_addr);
+        if (r <= 0) {
+            break;
+        }
+        if (ah->io_buf[0] == AUDIO_PCM_STREAM_STATUS) {
+            audio_helper_stream_status(ah->io_buf);
+        } else if (conf.verbose) {
+            dolog("Ignoring unexpected message from the audio helper\n");
+        }
+    }
+}
 
 
 static int common_snd_pcm_op(snd_pcm_t *handle, uint8_t op)
@@ -117,7 +206,7 @@ static int common_snd_pcm_op(snd_pcm_t *handle, uint8_t op)
     r = v4v_sendto(ah->fd, ah->io_buf, v4v_buf - ah->io_buf,
                    0, &ah->remote_addr);
 
-    r = v4v_recvfrom(ah->fd, ah->io_buf, MAX_V4V_MSG_SIZE, 0, &ah->remote_addr);
+    r = audio_helper_recv_reply();
 
     v4v_buf = ah->io_buf;
     v4v_buf++;
@@ -152,6 +241,11 @@ static int snd_pcm_avail_update_wrapper(snd_pcm_t *handle)
     return common_snd_pcm_op(handle, AUDIO_SND_PCM_AVAIL_UPDATE);
 }
 
+static int snd_pcm_stream_start_wrapper(snd_pcm_t *handle)
+{
+    return common_snd_pcm_op(handle, AUDIO_PCM_STREAM_START);
+}
+
 static int snd_pcm_state_wrapper(snd_pcm_t *handle)
 {
     return common_snd_pcm_op(handle, AUDIO_SND_PCM_STATE);
@@ -213,7 +307,7 @@ static int snd_pcm_writei_wrapper(snd_pcm_t *handle, uint8_t *dst, int len)
     r = v4v_sendto(ah->fd, ah->io_buf, v4v_buf - ah->io_buf,
                    0, &ah->remote_addr);
 
-    r = v4v_recvfrom(ah->fd, ah->io_buf, MAX_V4V_MSG_SIZE, 0, &ah->remote_addr);
+    r = audio_helper_recv_reply();
 
     v4v_buf = ah->io_buf;
     v4v_buf++;
@@ -223,6 +317,45 @@ static int snd_pcm_writei_wrapper(snd_pcm_t *handle, uint8_t *dst, int len)
     return r;
 }
 
+/* Returns without waiting for the helper, see AUDIO_PCM_STREAM_START */
+static int snd_pcm_stream_write(ALSAVoiceOut *alsa, uint8_t *dst, int len)
+{
+    const int hdr = 1 + sizeof(alsa->handle) + sizeof(alsa->sent) + sizeof(int);
+    uint8_t *v4v_buf;
+    int chunk, r;
+
+    while (len) {
+        chunk = audio_MIN(len, (MAX_V4V_MSG_SIZE - hdr) / 4);
+
+        v4v_buf = ah->io_buf;
+        v4v_buf[0] = AUDIO_PCM_STREAM_WRITE;
+        v4v_buf += 1;
+
+        memcpy(v4v_buf, &alsa->handle, sizeof(alsa->handle));
+        v4v_buf += sizeof(alsa->handle);
+
+        memcpy(v4v_buf, &alsa->sent, sizeof(alsa->sent));
+        v4v_buf += sizeof(alsa->sent);
+
+        memcpy(v4v_buf, &chunk, sizeof(int));
+        v4v_buf += sizeof(int);
+
+        memcpy(v4v_buf, dst, (chunk*4));
+        v4v_buf += (chunk*4);
+
+        r = v4v_sendto(ah->fd, ah->io_buf, v4v_buf - ah->io_buf,
+                       0, &ah->remote_addr);
+        if (r < 0) {
+            return -errno;
+        }
+
+        alsa->sent += chunk;
+        dst += chunk * 4;
+        len -= chunk;
+    }
+    return 0;
+}
+
 static int snd_pcm_readi_wrapper(snd_pcm_t *handle, uint8_t *src, int len)
 {
     uint8_t *v4v_buf = ah->io_buf;
@@ -240,7 +373,7 @@ static int snd_pcm_readi_wrapper(snd_pcm_t *handle, uint8_t *src, int len)
     r = v4v_sendto(ah->fd, ah->io_buf, v4v_buf - ah->io_buf,
                    0, &ah->remote_addr);
 
-    r = v4v_recvfrom(ah->fd, ah->io_buf, MAX_V4V_MSG_SIZE, 0, &ah->remote_addr);
+    r = audio_helper_recv_reply();
 
     v4v_buf = ah->io_buf;
     v4v_buf++;
@@ -334,7 +467,7 @@ static int alsa_open(int in, struct alsa_params_req *req,
     r = v4v_sendto(ah->fd, ah->io_buf, v4v_buf - ah->io_buf,
                    0, &ah->remote_addr);
 
-    r = v4v_recvfrom(ah->fd, ah->io_buf, MAX_V4V_MSG_SIZE, 0, &ah->remote_addr);
+    r = audio_helper_recv_reply();
 
     v4v_buf = ah->io_buf;
     v4v_buf++;
@@ -397,6 +530,50 @@ static void alsa_resume(snd_pcm_t *h)
     }
 }
 
+static int alsa_stream_run_out(ALSAVoiceOut *alsa)
+{
+    HWVoiceOut *hw = &alsa->hw;
+    int rpos, decr, samples, live, err;
+    int64_t avail;
+
+    audio_helper_poll_status();
+    if (alsa->helper_state == SND_PCM_STATE_SUSPENDED) {
+        alsa_resume(alsa->handle);
+        alsa->helper_state = SND_PCM_STATE_PREPARED;
+    }
+
+    live = xc_audio_pcm_hw_get_live_out(hw);
+    if (!live) {
+        return 0;
+    }
+
+    /* Frames still on their way to the helper will take room as well */
+    avail = alsa->helper_avail - (int64_t)(alsa->sent - alsa->played);
+    if (avail <= 0) {
+        return 0;
+    }
+
+    decr = audio_MIN(live, avail);
+    samples = decr;
+    rpos = hw->rpos;
+    while (samples) {
+        int len = audio_MIN(samples, hw->samples - rpos);
+        uint8_t *dst = advance(alsa->pcm_buf, rpos << hw->info.shift);
+
+        hw->clip(dst, hw->mix_buf + rpos, len);
+        err = snd_pcm_stream_write(alsa, dst, len);
+        if (err < 0) {
+            alsa_logerr(err, "Failed to send %d frames\n", len);
+            break;
+        }
+        rpos = (rpos + len) % hw->samples;
+        samples -= len;
+    }
+
+    hw->rpos = rpos;
+    return decr - samples;
+}
+
 static int alsa_run_out(HWVoiceOut *hw, int live)
 {
     ALSAVoiceOut *alsa = (ALSAVoiceOut *) hw;
@@ -406,6 +583,10 @@ static int alsa_run_out(HWVoiceOut *hw, int live)
     struct st_sample *src;
     snd_pcm_sframes_t avail;
 
+    if (alsa->streaming) {
+        return alsa_stream_run_out(alsa);
+    }
+
     if (snd_pcm_state_wrapper(alsa->handle) == SND_PCM_STATE_SUSPENDED) {
         alsa_resume(alsa->handle);
     }
@@ -486,6 +667,10 @@ static void alsa_fini_out(HWVoiceOut *hw)
     ALSAVoiceOut *alsa = (ALSAVoiceOut *) hw;
 
     ldebug("alsa_fini\n");
+    if (alsa->streaming) {
+        QLIST_REMOVE(alsa, entries);
+        alsa->streaming = false;
+    }
     alsa_anal_close(&alsa->handle);
 
     if (alsa->pcm_buf) {
@@ -532,6 +717,13 @@ static int alsa_init_out(HWVoiceOut *hw, struct audsettings *as)
     }
 
     alsa->handle = handle;
+    if (snd_pcm_stream_start_wrapper(handle) == 0) {
+        alsa->streaming = true;
+        alsa->sent = alsa->played = 0;
+        alsa->helper_avail = hw->samples;
+        alsa->helper_state = SND_PCM_STATE_PREPARED;
+        QLIST_INSERT_HEAD(&streaming_voices, alsa, entries);
+    }
     return 0;
 }
 
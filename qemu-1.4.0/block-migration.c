@@ -21,7 +21,9 @@
 #include "migration/block.h"
 #include "migration/migration.h"
 #include "sysemu/blockdev.h"
+#include "block/thread-pool.h"
 #include <assert.h>
+#include <zlib.h>
 
 #define BLOCK_SIZE                       (1 << 20)
 #define BDRV_SECTORS_PER_DIRTY_CHUNK     (BLOCK_SIZE >> BDRV_SECTOR_BITS)
@@ -29,6 +31,8 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
+#define BLK_MIG_FLAG_COMPRESSED_BLOCK   0x10
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -64,12 +68,17 @@ typedef struct BlkMigBlock {
     QEMUIOVector qiov;
     BlockDriverAIOCB *aiocb;
     int ret;
+    bool zero;                  /* send as BLK_MIG_FLAG_ZERO_BLOCK */
+    uint8_t *cbuf;              /* if not NULL, compressed contents */
+    uLongf clen;
     QSIMPLEQ_ENTRY(BlkMigBlock) entry;
 } BlkMigBlock;
 
 typedef struct BlkMigState {
     int blk_enable;
     int shared_base;
+    bool zero_blocks;
+    bool compress_blocks;
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
     int submitted;
@@ -83,19 +92,68 @@ typedef struct BlkMigState {
 
 static BlkMigState block_mig_state;
 
+static void blk_free(BlkMigBlock *blk)
+{
+    g_free(blk->cbuf);
+    g_free(blk->buf);
+    g_free(blk);
+}
+
+/* Zero detection and compression of a chunk that has been read.  This
+ * runs in a worker thread when compress-blocks is on, so it only looks
+ * at @blk and at settings that are fixed for the whole migration.
+ */
+static int blk_prepare(void *opaque)
+{
+    BlkMigBlock *blk = opaque;
+    uLong len = blk->nr_sectors * BDRV_SECTOR_SIZE;
+
+    if (block_mig_state.zero_blocks && buffer_is_zero(blk->buf, len)) {
+        blk->zero = true;
+        return 0;
+    }
+    if (!block_mig_state.compress_blocks) {
+        return 0;
+    }
+
+    blk->clen = compressBound(len);
+    blk->cbuf = g_malloc(blk->clen);
+    if (compress2(blk->cbuf, &blk->clen, blk->buf, len, Z_BEST_SPEED) != Z_OK ||
+        blk->clen >= len) {
+        /* incompressible, send it as is */
+        g_free(blk->cbuf);
+        blk->cbuf = NULL;
+    }
+    return 0;
+}
+
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
     int len;
+    int flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    if (blk->zero) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    } else if (blk->cbuf) {
+        flags |= BLK_MIG_FLAG_COMPRESSED_BLOCK;
+    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
     len = strlen(blk->bmds->bs->device_name);
     qemu_put_byte(f, len);
     qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 
+    if (blk->zero) {
+        return;
+    }
+    if (blk->cbuf) {
+        qemu_put_be32(f, blk->clen);
+        qemu_put_buffer(f, blk->cbuf, blk->clen);
+        return;
+    }
     qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
 }
 
@@ -177,6 +235,24 @@ static void alloc_aio_bitmap(BlkMigDevState *bmds)
     bmds->aio_bitmap = g_malloc0(bitmap_size);
 }
 
+/* The chunk stays marked in flight until it is queued for sending, so
+ * that mig_save_device_dirty cannot read it again in the meanwhile.
+ */
+static void blk_mig_ready(BlkMigBlock *blk)
+{
+    QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+    bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
+
+    block_mig_state.submitted--;
+    block_mig_state.read_done++;
+    assert(block_mig_state.submitted >= 0);
+}
+
+static void blk_mig_prepare_cb(void *opaque, int ret)
+{
+    blk_mig_ready(opaque);
+}
+
 static void blk_mig_read_cb(void *opaque, int ret)
 {
     long double curr_time = qemu_get_clock_ns(rt_clock);
@@ -186,12 +262,16 @@ static void blk_mig_read_cb(void *opaque, int ret)
 
     block_mig_state.prev_time_offset = curr_time;
 
-    QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
-    bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
-
-    block_mig_state.submitted--;
-    block_mig_state.read_done++;
-    assert(block_mig_state.submitted >= 0);
+    if (ret < 0) {
+        blk_mig_ready(blk);
+    } else if (block_mig_state.compress_blocks) {
+        blk->aiocb = thread_pool_submit_aio(blk_prepare, blk,
+                                            blk_mig_prepare_cb, blk);
+    } else {
+        /* zero detection alone is cheap enough for the main loop */
+        blk_prepare(blk);
+        blk_mig_ready(blk);
+    }
 }
 
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
@@ -226,7 +306,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
         nr_sectors = total_sectors - cur_sector;
     }
 
-    blk = g_malloc(sizeof(BlkMigBlock));
+    blk = g_malloc0(sizeof(BlkMigBlock));
     blk->buf = g_malloc(BLOCK_SIZE);
     blk->bmds = bmds;
     blk->sector = cur_sector;
@@ -301,6 +381,8 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.total_sector_sum = 0;
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
+    block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.compress_blocks = migrate_compress_blocks();
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
@@ -371,7 +453,7 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
             } else {
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
-            blk = g_malloc(sizeof(BlkMigBlock));
+            blk = g_malloc0(sizeof(BlkMigBlock));
             blk->buf = g_malloc(BLOCK_SIZE);
             blk->bmds = bmds;
             blk->sector = sector;
@@ -395,10 +477,10 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                 if (ret < 0) {
                     goto error;
                 }
+                blk_prepare(blk);
                 blk_send(f, blk);
 
-                g_free(blk->buf);
-                g_free(blk);
+                blk_free(blk);
             }
 
             bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
@@ -412,8 +494,7 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
-    g_free(blk->buf);
-    g_free(blk);
+    blk_free(blk);
     return ret;
 }
 
@@ -456,8 +537,7 @@ static int flush_blks(QEMUFile *f)
         blk_send(f, blk);
 
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
-        g_free(blk->buf);
-        g_free(blk);
+        blk_free(blk);
 
         block_mig_state.read_done--;
         block_mig_state.transferred++;
@@ -501,8 +581,7 @@ static void blk_mig_cleanup(void)
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
-        g_free(blk->buf);
-        g_free(blk);
+        blk_free(blk);
     }
 }
 
@@ -646,7 +725,8 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
     char device_name[256];
     int64_t addr;
     BlockDriverState *bs, *bs_prev = NULL;
-    uint8_t *buf;
+    uint8_t *buf, *cbuf;
+    uLongf clen, ulen;
     int64_t total_sectors = 0;
     int nr_sectors;
     int ret;
@@ -688,7 +768,30 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
 
             buf = g_malloc(BLOCK_SIZE);
 
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                memset(buf, 0, nr_sectors * BDRV_SECTOR_SIZE);
+            } else if (flags & BLK_MIG_FLAG_COMPRESSED_BLOCK) {
+                clen = qemu_get_be32(f);
+                if (clen > compressBound(BLOCK_SIZE)) {
+                    error_report("Bad compressed block size %lu",
+                                 (unsigned long)clen);
+                    g_free(buf);
+                    return -EINVAL;
+                }
+                cbuf = g_malloc(clen);
+                qemu_get_buffer(f, cbuf, clen);
+                ulen = BLOCK_SIZE;
+                ret = uncompress(buf, &ulen, cbuf, clen);
+                g_free(cbuf);
+                if (ret != Z_OK || ulen != nr_sectors * BDRV_SECTOR_SIZE) {
+                    error_report("Error decompressing block for device %s",
+                                 device_name);
+                    g_free(buf);
+                    return -EINVAL;
+                }
+            } else {
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+            }
             ret = bdrv_write(bs, addr, buf, nr_sectors);
 
             g_free(buf);
@@ -34,6 +34,7 @@
 #include "block/coroutine.h"
 #include "qmp-commands.h"
 #include "qemu/timer.h"
+#include "qemu/error-report.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -57,6 +58,13 @@ typedef enum {
 } BdrvRequestFlags;
 
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
+static void bdrv_save_dirty_bitmaps(BlockDriverState *bs);
+static void bdrv_free_latency_histograms(BlockDriverState *bs);
+static void bdrv_dirty_bitmaps_set(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors);
+static void bdrv_alloc_cache_invalidate(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors);
+static void bdrv_alloc_cache_clear(BlockDriverState *bs);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -86,10 +94,6 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
 
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-        double elapsed_time, uint64_t *wait);
 static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
         bool is_write, int64_t *wait);
 
@@ -99,6 +103,19 @@ static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
 static QLIST_HEAD(, BlockDriver) bdrv_drivers =
     QLIST_HEAD_INITIALIZER(bdrv_drivers);
 
+struct BlockThrottleGroup {
+    char *name;             /* NULL for a drive's private buckets */
+    int refcnt;
+    BlockIOLimit io_limits;
+    BlockIOBucket bps[3];
+    BlockIOBucket iops[3];
+    int64_t previous_leak;  /* vm_clock time the buckets were drained to */
+    QLIST_ENTRY(BlockThrottleGroup) list;
+};
+
+static QLIST_HEAD(, BlockThrottleGroup) bdrv_throttle_groups =
+    QLIST_HEAD_INITIALIZER(bdrv_throttle_groups);
+
 /* The device to use for VM snapshots */
 static BlockDriverState *bs_snapshots;
 
@@ -137,11 +154,6 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
         qemu_free_timer(bs->block_timer);
         bs->block_timer = NULL;
     }
-
-    bs->slice_start = 0;
-    bs->slice_end   = 0;
-    bs->slice_time  = 0;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
 }
 
 static void bdrv_block_timer(void *opaque)
@@ -151,8 +163,86 @@ static void bdrv_block_timer(void *opaque)
     qemu_co_queue_next(&bs->throttled_reqs);
 }
 
+static BlockThrottleGroup *bdrv_throttle_group_new(const char *name,
+                                                  BlockIOLimit *io_limits)
+{
+    BlockThrottleGroup *tg = g_malloc0(sizeof(*tg));
+
+    tg->refcnt = 1;
+    tg->io_limits = *io_limits;
+    tg->previous_leak = qemu_get_clock_ns(vm_clock);
+    if (name) {
+        tg->name = g_strdup(name);
+        QLIST_INSERT_HEAD(&bdrv_throttle_groups, tg, list);
+    }
+    return tg;
+}
+
+static void bdrv_throttle_group_unref(BlockThrottleGroup *tg)
+{
+    if (--tg->refcnt > 0) {
+        return;
+    }
+    if (tg->name) {
+        QLIST_REMOVE(tg, list);
+        g_free(tg->name);
+    }
+    g_free(tg);
+}
+
+/* Make @bs share its buckets with every other drive in group @name, or give
+ * it private buckets again if @name is NULL.  A drive joining without limits
+ * of its own adopts the group's; one with limits imposes them on the group.
+ */
+void bdrv_set_throttle_group(BlockDriverState *bs, const char *name)
+{
+    BlockThrottleGroup *tg, *old = bs->throttle_group;
+
+    if (!name) {
+        bs->throttle_group = NULL;
+    } else {
+        QLIST_FOREACH(tg, &bdrv_throttle_groups, list) {
+            if (!strcmp(tg->name, name)) {
+                break;
+            }
+        }
+        if (tg) {
+            tg->refcnt++;
+        } else {
+            tg = bdrv_throttle_group_new(name, &bs->io_limits);
+        }
+        bs->throttle_group = tg;
+        if (bdrv_io_limits_enabled(bs)) {
+            bdrv_set_io_limits(bs, &bs->io_limits);
+        } else {
+            bdrv_set_io_limits(bs, &tg->io_limits);
+        }
+    }
+
+    if (old) {
+        bdrv_throttle_group_unref(old);
+    }
+}
+
+const char *bdrv_get_throttle_group(BlockDriverState *bs)
+{
+    return bs->throttle_group ? bs->throttle_group->name : NULL;
+}
+
 void bdrv_io_limits_enable(BlockDriverState *bs)
 {
+    BlockThrottleGroup *tg = bs->throttle_group;
+
+    if (!tg) {
+        bs->throttle_group = bdrv_throttle_group_new(NULL, &bs->io_limits);
+    } else if (!tg->name) {
+        /* start private buckets empty, as if the drive had been idle */
+        memset(tg->bps, 0, sizeof(tg->bps));
+        memset(tg->iops, 0, sizeof(tg->iops));
+        tg->io_limits = bs->io_limits;
+        tg->previous_leak = qemu_get_clock_ns(vm_clock);
+    }
+
     qemu_co_queue_init(&bs->throttled_reqs);
     bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
     bs->io_limits_enabled = true;
@@ -690,6 +780,7 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
     } else {
         assert(file != NULL);
         bs->file = file;
+        file->thread_pool = bs->thread_pool;
         ret = drv->bdrv_open(bs, open_flags);
     }
 
@@ -1147,6 +1238,8 @@ void bdrv_close(BlockDriverState *bs)
     }
     bdrv_drain_all();
     notifier_list_notify(&bs->close_notifiers, bs);
+    bdrv_save_dirty_bitmaps(bs);
+    bdrv_alloc_cache_clear(bs);
 
     if (bs->drv) {
         if (bs == bs_snapshots) {
@@ -1230,7 +1323,7 @@ void bdrv_drain_all(void)
 
     /* If requests are still pending there is a bug somewhere */
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        assert(QLIST_EMPTY(&bs->tracked_requests));
+        assert(interval_tree_empty(&bs->tracked_requests));
         assert(qemu_co_queue_empty(&bs->throttled_reqs));
     }
 }
@@ -1267,16 +1360,16 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-    /* i/o timing parameters */
-    bs_dest->slice_time         = bs_src->slice_time;
-    bs_dest->slice_start        = bs_src->slice_start;
-    bs_dest->slice_end          = bs_src->slice_end;
+    /* i/o throttling */
     bs_dest->io_limits          = bs_src->io_limits;
-    bs_dest->io_base            = bs_src->io_base;
+    bs_dest->throttle_group     = bs_src->throttle_group;
     bs_dest->throttled_reqs     = bs_src->throttled_reqs;
     bs_dest->block_timer        = bs_src->block_timer;
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
+    /* worker threads */
+    bs_dest->thread_pool        = bs_src->thread_pool;
+
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
     bs_dest->on_write_error     = bs_src->on_write_error;
@@ -1287,6 +1380,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     /* dirty bitmap */
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
     /* job */
     bs_dest->in_use             = bs_src->in_use;
@@ -1317,11 +1411,13 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
     assert(bs_new->dirty_bitmap == NULL);
+    assert(QSLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
     assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1341,6 +1437,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
     assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -1382,6 +1479,11 @@ void bdrv_delete(BlockDriverState *bs)
 
     bdrv_close(bs);
 
+    if (bs->throttle_group) {
+        bdrv_throttle_group_unref(bs->throttle_group);
+    }
+    bdrv_free_latency_histograms(bs);
+
     assert(bs != bs_snapshots);
     g_free(bs);
 }
@@ -1594,6 +1696,7 @@ int bdrv_commit(BlockDriverState *bs)
 
     if (drv->bdrv_make_empty) {
         ret = drv->bdrv_make_empty(bs);
+        bdrv_alloc_cache_clear(bs);
         bdrv_flush(bs);
     }
 
@@ -1633,7 +1736,7 @@ struct BdrvTrackedRequest {
     int64_t sector_num;
     int nb_sectors;
     bool is_write;
-    QLIST_ENTRY(BdrvTrackedRequest) list;
+    IntervalTreeNode node; /* in bs->tracked_requests */
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 };
@@ -1645,7 +1748,9 @@ struct BdrvTrackedRequest {
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
-    QLIST_REMOVE(req, list);
+    if (req->nb_sectors > 0) {
+        interval_tree_remove(&req->bs->tracked_requests, &req->node);
+    }
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -1667,7 +1772,12 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_queue_init(&req->wait_queue);
 
-    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    /* empty requests cannot overlap anything, so they are not tracked */
+    if (nb_sectors > 0) {
+        req->node.start = sector_num;
+        req->node.last = sector_num + nb_sectors - 1;
+        interval_tree_insert(&bs->tracked_requests, &req->node);
+    }
 }
 
 /**
@@ -1691,26 +1801,13 @@ void bdrv_round_to_clusters(BlockDriverState *bs,
     }
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t sector_num, int nb_sectors) {
-    /*        aaaa   bbbb */
-    if (sector_num >= req->sector_num + req->nb_sectors) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->sector_num >= sector_num + nb_sectors) {
-        return false;
-    }
-    return true;
-}
-
 static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors)
 {
     BdrvTrackedRequest *req;
+    IntervalTreeNode *node;
     int64_t cluster_sector_num;
     int cluster_nb_sectors;
-    bool retry;
 
     /* If we touch the same cluster it counts as an overlap.  This guarantees
      * that allocating writes will be serialized and not race with each other
@@ -1721,23 +1818,24 @@ static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
     bdrv_round_to_clusters(bs, sector_num, nb_sectors,
                            &cluster_sector_num, &cluster_nb_sectors);
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (tracked_request_overlaps(req, cluster_sector_num,
-                                         cluster_nb_sectors)) {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                qemu_co_queue_wait(&req->wait_queue);
-                retry = true;
-                break;
-            }
-        }
-    } while (retry);
+    if (cluster_nb_sectors <= 0) {
+        return;
+    }
+
+    while ((node = interval_tree_find(&bs->tracked_requests,
+                                      cluster_sector_num,
+                                      cluster_sector_num +
+                                      cluster_nb_sectors - 1))) {
+        req = container_of(node, BdrvTrackedRequest, node);
+
+        /* Hitting this means there was a reentrant request, for
+         * example, a block driver issuing nested requests.  This must
+         * never happen since it means deadlock.
+         */
+        assert(qemu_coroutine_self() != req->co);
+
+        qemu_co_queue_wait(&req->wait_queue);
+    }
 }
 
 /*
@@ -1967,27 +2065,21 @@ static void coroutine_fn bdrv_rw_co_entry(void *opaque)
 }
 
 /*
- * Process a synchronous request using coroutines
+ * Process a vectored synchronous request using coroutines
  */
-static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
-                      int nb_sectors, bool is_write)
+static int bdrv_rwv_co(BlockDriverState *bs, int64_t sector_num,
+                       QEMUIOVector *qiov, bool is_write)
 {
-    QEMUIOVector qiov;
-    struct iovec iov = {
-        .iov_base = (void *)buf,
-        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
-    };
     Coroutine *co;
     RwCo rwco = {
         .bs = bs,
         .sector_num = sector_num,
-        .nb_sectors = nb_sectors,
-        .qiov = &qiov,
+        .nb_sectors = qiov->size >> BDRV_SECTOR_BITS,
+        .qiov = qiov,
         .is_write = is_write,
         .ret = NOT_DONE,
     };
-
-    qemu_iovec_init_external(&qiov, &iov, 1);
+    assert((qiov->size & (BDRV_SECTOR_SIZE - 1)) == 0);
 
     /**
      * In sync call context, when the vcpu is blocked, this throttling timer
@@ -2013,6 +2105,22 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
     return rwco.ret;
 }
 
+/*
+ * Process a synchronous request using coroutines
+ */
+static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
+                      int nb_sectors, bool is_write)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return bdrv_rwv_co(bs, sector_num, &qiov, is_write);
+}
+
 /* return < 0 if error. See bdrv_write() for the return codes */
 int bdrv_read(BlockDriverState *bs, int64_t sector_num,
               uint8_t *buf, int nb_sectors)
@@ -2046,6 +2154,11 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
     return bdrv_rw_co(bs, sector_num, (uint8_t *)buf, nb_sectors, true);
 }
 
+int bdrv_writev(BlockDriverState *bs, int64_t sector_num, QEMUIOVector *qiov)
+{
+    return bdrv_rwv_co(bs, sector_num, qiov, true);
+}
+
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf, int count1)
 {
@@ -2140,6 +2253,61 @@ int bdrv_pwrite(BlockDriverState *bs, int64_t offset,
     return count1;
 }
 
+/* Like bdrv_pwrite(), but the data comes from qiov; only the unaligned head
+ * and tail are bounced, everything in between is written in place */
+int bdrv_pwritev(BlockDriverState *bs, int64_t offset, QEMUIOVector *qiov)
+{
+    uint8_t tmp_buf[BDRV_SECTOR_SIZE];
+    int len, nb_sectors, count;
+    int64_t sector_num;
+    int ret;
+
+    count = qiov->size;
+    /* first write to align to sector start */
+    len = (BDRV_SECTOR_SIZE - offset) & (BDRV_SECTOR_SIZE - 1);
+    if (len > count)
+        len = count;
+    sector_num = offset >> BDRV_SECTOR_BITS;
+    if (len > 0) {
+        if ((ret = bdrv_read(bs, sector_num, tmp_buf, 1)) < 0)
+            return ret;
+        qemu_iovec_to_buf(qiov, 0, tmp_buf + (offset & (BDRV_SECTOR_SIZE - 1)),
+                          len);
+        if ((ret = bdrv_write(bs, sector_num, tmp_buf, 1)) < 0)
+            return ret;
+        count -= len;
+        if (count == 0)
+            return qiov->size;
+        sector_num++;
+    }
+
+    /* write the sectors "in place" */
+    nb_sectors = count >> BDRV_SECTOR_BITS;
+    if (nb_sectors > 0) {
+        QEMUIOVector qiov_inplace;
+
+        qemu_iovec_init(&qiov_inplace, qiov->niov);
+        qemu_iovec_concat(&qiov_inplace, qiov, len,
+                          nb_sectors << BDRV_SECTOR_BITS);
+        ret = bdrv_writev(bs, sector_num, &qiov_inplace);
+        qemu_iovec_destroy(&qiov_inplace);
+        if (ret < 0)
+            return ret;
+        sector_num += nb_sectors;
+        count -= nb_sectors << BDRV_SECTOR_BITS;
+    }
+
+    /* add data from the last sector */
+    if (count > 0) {
+        if ((ret = bdrv_read(bs, sector_num, tmp_buf, 1)) < 0)
+            return ret;
+        qemu_iovec_to_buf(qiov, qiov->size - count, tmp_buf, count);
+        if ((ret = bdrv_write(bs, sector_num, tmp_buf, 1)) < 0)
+            return ret;
+    }
+    return qiov->size;
+}
+
 /*
  * Writes to the file and ensures that no writes are reordered across this
  * request (acts as a barrier)
@@ -2212,6 +2380,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         ret = drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
                                   &bounce_qiov);
     }
+    bdrv_alloc_cache_invalidate(bs, cluster_sector_num, cluster_nb_sectors);
 
     if (ret < 0) {
         /* It might be okay to ignore write errors for guest requests.  If this
@@ -2377,6 +2546,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     } else {
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
     }
+    bdrv_alloc_cache_invalidate(bs, sector_num, nb_sectors);
 
     if (ret == 0 && !bs->enable_write_cache) {
         ret = bdrv_co_flush(bs);
@@ -2385,6 +2555,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     if (bs->dirty_bitmap) {
         bdrv_set_dirty(bs, sector_num, nb_sectors);
     }
+    bdrv_dirty_bitmaps_set(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -2428,6 +2599,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     if (bdrv_in_use(bs))
         return -EBUSY;
     ret = drv->bdrv_truncate(bs, offset);
+    bdrv_alloc_cache_clear(bs);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
         bdrv_dev_resize_cb(bs);
@@ -2483,12 +2655,44 @@ void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr)
     *nb_sectors_ptr = length;
 }
 
-/* throttling disk io limits */
+static void bdrv_apply_io_limits(BlockDriverState *bs,
+                                 BlockIOLimit *io_limits)
+{
+    bs->io_limits = *io_limits;
+
+    if (!bs->drv) {
+        /* bdrv_open() starts throttling */
+        bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
+    } else if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
+        bdrv_io_limits_enable(bs);
+    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
+        bdrv_io_limits_disable(bs);
+    } else if (bs->block_timer) {
+        /* let waiting requests re-evaluate against the new limits */
+        qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
+    }
+}
+
+/* throttling disk io limits; the limits of a throttling group are changed
+ * for all of its members */
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits)
 {
-    bs->io_limits = *io_limits;
-    bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
+    BlockThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *other;
+    BlockIOLimit limits = *io_limits;
+
+    if (tg) {
+        tg->io_limits = limits;
+    }
+    if (tg && tg->name) {
+        QTAILQ_FOREACH(other, &bdrv_states, list) {
+            if (other != bs && other->throttle_group == tg) {
+                bdrv_apply_io_limits(other, &limits);
+            }
+        }
+    }
+    bdrv_apply_io_limits(bs, &limits);
 }
 
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
@@ -2679,6 +2883,25 @@ int bdrv_has_zero_init(BlockDriverState *bs)
     return 1;
 }
 
+/*
+ * Return a file descriptor from which the data of @bs can be read directly,
+ * or a negative errno.  Anything that the block layer does on reads (I/O
+ * limits, copy-on-read) rules this out.
+ */
+int bdrv_get_passthrough_fd(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (bs->io_limits_enabled || bs->copy_on_read || bs->backing_hd) {
+        return -ENOTSUP;
+    }
+    if (bs->drv->bdrv_get_passthrough_fd) {
+        return bs->drv->bdrv_get_passthrough_fd(bs);
+    }
+    return -ENOTSUP;
+}
+
 typedef struct BdrvCoIsAllocatedData {
     BlockDriverState *bs;
     int64_t sector_num;
@@ -2688,6 +2911,84 @@ typedef struct BdrvCoIsAllocatedData {
     bool done;
 } BdrvCoIsAllocatedData;
 
+/*
+ * Allocation status cache
+ *
+ * Copy jobs and qemu-img ask bdrv_co_is_allocated() about the same ranges
+ * over and over, and every answer may cost a metadata walk or an
+ * lseek(SEEK_DATA) system call.  Answers are therefore kept as disjoint
+ * extents in bs->alloc_cache until something changes what is allocated
+ * there.
+ */
+
+#define ALLOC_CACHE_MAX_ENTRIES 1024
+
+typedef struct BdrvAllocExtent {
+    IntervalTreeNode node;  /* in bs->alloc_cache, sectors */
+    bool allocated;
+} BdrvAllocExtent;
+
+static void bdrv_alloc_cache_drop(BlockDriverState *bs, int64_t start,
+                                  int64_t last)
+{
+    IntervalTreeNode *node;
+
+    while ((node = interval_tree_find(&bs->alloc_cache, start, last))) {
+        interval_tree_remove(&bs->alloc_cache, node);
+        g_free(container_of(node, BdrvAllocExtent, node));
+        bs->alloc_cache_entries--;
+    }
+}
+
+static void bdrv_alloc_cache_invalidate(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors)
+{
+    bs->alloc_cache_gen++;
+    if (nb_sectors > 0) {
+        bdrv_alloc_cache_drop(bs, sector_num, sector_num + nb_sectors - 1);
+    }
+}
+
+static void bdrv_alloc_cache_clear(BlockDriverState *bs)
+{
+    bs->alloc_cache_gen++;
+    bdrv_alloc_cache_drop(bs, 0, INT64_MAX);
+}
+
+static int bdrv_alloc_cache_lookup(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors, int *pnum)
+{
+    IntervalTreeNode *node;
+    BdrvAllocExtent *e;
+
+    node = interval_tree_find(&bs->alloc_cache, sector_num, sector_num);
+    if (!node) {
+        return -ENOENT;
+    }
+    e = container_of(node, BdrvAllocExtent, node);
+    *pnum = MIN(nb_sectors, node->last - sector_num + 1);
+    return e->allocated;
+}
+
+static void bdrv_alloc_cache_insert(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, bool allocated)
+{
+    BdrvAllocExtent *e;
+
+    /* The new answer is the freshest, so it replaces what it overlaps */
+    bdrv_alloc_cache_drop(bs, sector_num, sector_num + nb_sectors - 1);
+    if (bs->alloc_cache_entries >= ALLOC_CACHE_MAX_ENTRIES) {
+        bdrv_alloc_cache_drop(bs, 0, INT64_MAX);
+    }
+
+    e = g_new0(BdrvAllocExtent, 1);
+    e->node.start = sector_num;
+    e->node.last = sector_num + nb_sectors - 1;
+    e->allocated = allocated;
+    interval_tree_insert(&bs->alloc_cache, &e->node);
+    bs->alloc_cache_entries++;
+}
+
 /*
  * Returns true iff the specified sector is present in the disk image. Drivers
  * not implementing the functionality are assumed to not support backing files,
@@ -2706,7 +3007,9 @@ typedef struct BdrvCoIsAllocatedData {
 int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
                                       int nb_sectors, int *pnum)
 {
+    uint64_t gen;
     int64_t n;
+    int ret;
 
     if (sector_num >= bs->total_sectors) {
         *pnum = 0;
@@ -2723,7 +3026,21 @@ int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
         return 1;
     }
 
-    return bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+    ret = bdrv_alloc_cache_lookup(bs, sector_num, nb_sectors, pnum);
+    if (ret >= 0) {
+        trace_bdrv_co_is_allocated_cached(bs, sector_num, nb_sectors, *pnum,
+                                          ret);
+        return ret;
+    }
+
+    gen = bs->alloc_cache_gen;
+    ret = bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+
+    /* Nothing may have changed the image while the driver was looking */
+    if (ret >= 0 && *pnum > 0 && gen == bs->alloc_cache_gen) {
+        bdrv_alloc_cache_insert(bs, sector_num, *pnum, ret);
+    }
+    return ret;
 }
 
 /* Coroutine wrapper for bdrv_is_allocated() */
@@ -2813,6 +3130,31 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+static void bdrv_query_burst_limits(BlockDriverState *bs,
+                                    BlockDeviceInfo *info)
+{
+    BlockIOLimit *l = &bs->io_limits;
+
+#define SET_LIMIT(field, value)             \
+    if (value) {                            \
+        info->has_##field = true;           \
+        info->field = value;                \
+    }
+    SET_LIMIT(bps_max, l->bps_max[BLOCK_IO_LIMIT_TOTAL]);
+    SET_LIMIT(bps_rd_max, l->bps_max[BLOCK_IO_LIMIT_READ]);
+    SET_LIMIT(bps_wr_max, l->bps_max[BLOCK_IO_LIMIT_WRITE]);
+    SET_LIMIT(iops_max, l->iops_max[BLOCK_IO_LIMIT_TOTAL]);
+    SET_LIMIT(iops_rd_max, l->iops_max[BLOCK_IO_LIMIT_READ]);
+    SET_LIMIT(iops_wr_max, l->iops_max[BLOCK_IO_LIMIT_WRITE]);
+#undef SET_LIMIT
+
+    if (info->has_bps_max || info->has_bps_rd_max || info->has_bps_wr_max ||
+        info->has_iops_max || info->has_iops_rd_max || info->has_iops_wr_max) {
+        info->has_burst_length = true;
+        info->burst_length = l->burst_length ?: BLOCK_IO_BURST_LENGTH;
+    }
+}
+
 BlockInfo *bdrv_query_info(BlockDriverState *bs)
 {
     BlockInfo *info = g_malloc0(sizeof(*info));
@@ -2839,6 +3181,28 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
             ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bs->dirty_bitmap));
     }
 
+    if (!QSLIST_EMPTY(&bs->dirty_bitmaps)) {
+        BlockDirtyBitmapInfoList **p = &info->dirty_bitmaps;
+        BdrvDirtyBitmap *bitmap;
+
+        info->has_dirty_bitmaps = true;
+        QSLIST_FOREACH(bitmap, &bs->dirty_bitmaps, next) {
+            BlockDirtyBitmapInfo *value = g_malloc0(sizeof(*value));
+
+            value->name = g_strdup(bitmap->name);
+            value->count = hbitmap_count(bitmap->bitmap) * BDRV_SECTOR_SIZE;
+            value->granularity =
+                (int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
+            value->has_file = bitmap->file != NULL;
+            value->file = g_strdup(bitmap->file);
+            value->busy = bitmap->busy;
+
+            *p = g_malloc0(sizeof(**p));
+            (*p)->value = value;
+            p = &(*p)->next;
+        }
+    }
+
     if (bs->drv) {
         info->has_inserted = true;
         info->inserted = g_malloc0(sizeof(*info->inserted));
@@ -2868,6 +3232,11 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
                            bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
             info->inserted->iops_wr =
                            bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+            bdrv_query_burst_limits(bs, info->inserted);
+        }
+        if (bdrv_get_throttle_group(bs)) {
+            info->inserted->has_group = true;
+            info->inserted->group = g_strdup(bdrv_get_throttle_group(bs));
         }
     }
     return info;
@@ -2910,6 +3279,24 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->rd_merged = bs->nr_merged[BDRV_ACCT_READ];
+    s->stats->wr_merged = bs->nr_merged[BDRV_ACCT_WRITE];
+
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        bs->drv->bdrv_get_cache_stats(bs, s->stats);
+    }
+
+    if (bs->latency_hist[BDRV_ACCT_READ]) {
+        s->stats->has_rd_latency_histogram = true;
+        s->stats->rd_latency_histogram =
+            latency_histogram_info(bs->latency_hist[BDRV_ACCT_READ]);
+        s->stats->has_wr_latency_histogram = true;
+        s->stats->wr_latency_histogram =
+            latency_histogram_info(bs->latency_hist[BDRV_ACCT_WRITE]);
+        s->stats->has_flush_latency_histogram = true;
+        s->stats->flush_latency_histogram =
+            latency_histogram_info(bs->latency_hist[BDRV_ACCT_FLUSH]);
+    }
 
     if (bs->file) {
         s->has_parent = true;
@@ -2955,6 +3342,8 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    int ret;
+
     if (!drv)
         return -ENOMEDIUM;
     if (!drv->bdrv_write_compressed)
@@ -2964,7 +3353,9 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(!bs->dirty_bitmap);
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    ret = drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    bdrv_alloc_cache_invalidate(bs, sector_num, nb_sectors);
+    return ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -2980,14 +3371,26 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 
 int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
                       int64_t pos, int size)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base   = (void *) buf,
+        .iov_len    = size,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return bdrv_writev_vmstate(bs, &qiov, pos);
+}
+
+int bdrv_writev_vmstate(BlockDriverState *bs, QEMUIOVector *qiov, int64_t pos)
 {
     BlockDriver *drv = bs->drv;
     if (!drv)
         return -ENOMEDIUM;
     if (drv->bdrv_save_vmstate)
-        return drv->bdrv_save_vmstate(bs, buf, pos, size);
+        return drv->bdrv_save_vmstate(bs, qiov, pos);
     if (bs->file)
-        return bdrv_save_vmstate(bs->file, buf, pos, size);
+        return bdrv_writev_vmstate(bs->file, qiov, pos);
     return -ENOTSUP;
 }
 
@@ -3119,6 +3522,7 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (!drv)
         return -ENOMEDIUM;
+    bdrv_alloc_cache_clear(bs);
     if (drv->bdrv_snapshot_goto)
         return drv->bdrv_snapshot_goto(bs, snapshot_id);
 
@@ -3521,6 +3925,7 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
 
     // Check for mergable requests
     num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    bdrv_acct_merged(bs, BDRV_ACCT_WRITE, mcb->num_callbacks - num_reqs);
 
     trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
 
@@ -3534,173 +3939,139 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
     return 0;
 }
 
-void bdrv_aio_cancel(BlockDriverAIOCB *acb)
+/*
+ * Drivers without their own batching pass the plug on to the protocol below
+ * them, which is where the requests end up.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
 {
-    acb->aiocb_info->cancel(acb);
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
 }
 
-/* block I/O throttling */
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-                 bool is_write, double elapsed_time, uint64_t *wait)
+void bdrv_io_unplug(BlockDriverState *bs)
 {
-    uint64_t bps_limit = 0;
-    double   bytes_limit, bytes_base, bytes_res;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bps_limit = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.bps[is_write]) {
-        bps_limit = bs->io_limits.bps[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
+    BlockDriver *drv = bs->drv;
 
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    bytes_limit = bps_limit * slice_time;
-    bytes_base  = bs->nr_bytes[is_write] - bs->io_base.bytes[is_write];
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bytes_base += bs->nr_bytes[!is_write] - bs->io_base.bytes[!is_write];
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
     }
+}
 
-    /* bytes_base: the bytes of data which have been read/written; and
-     *             it is obtained from the history statistic info.
-     * bytes_res: the remaining bytes of data which need to be read/written.
-     * (bytes_base + bytes_res) / bps_limit: used to calcuate
-     *             the total time for completing reading/writting all data.
-     */
-    bytes_res   = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+void bdrv_aio_cancel(BlockDriverAIOCB *acb)
+{
+    acb->aiocb_info->cancel(acb);
+}
 
-    if (bytes_base + bytes_res <= bytes_limit) {
-        if (wait) {
-            *wait = 0;
-        }
+/* block I/O throttling */
+static void bdrv_bucket_leak(BlockIOBucket *bkt, int64_t avg, int64_t max,
+                             double delta)
+{
+    bkt->level = MAX(bkt->level - avg * delta, 0);
+    bkt->burst_level = MAX(bkt->burst_level - max * delta, 0);
+}
 
-        return false;
+static void bdrv_bucket_account(BlockIOBucket *bkt, int64_t avg, int64_t max,
+                                double units)
+{
+    /* a bucket that does not drain must not fill up either */
+    if (avg) {
+        bkt->level += units;
     }
-
-    /* Calc approx time to dispatch */
-    wait_time = (bytes_base + bytes_res) / bps_limit - elapsed_time;
-
-    /* When the I/O rate at runtime exceeds the limits,
-     * bs->slice_end need to be extended in order that the current statistic
-     * info can be kept until the timer fire, so it is increased and tuned
-     * based on the result of experiment.
-     */
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
+    if (max) {
+        bkt->burst_level += units;
     }
-
-    return true;
 }
 
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-                             double elapsed_time, uint64_t *wait)
+/* Nanoseconds until @bkt can take a new request, 0 if it can right away.
+ * A request is let through as long as the bucket is not full, even if it
+ * overflows it: the next one pays for it by waiting longer.
+ */
+static int64_t bdrv_bucket_wait(BlockIOBucket *bkt, int64_t avg, int64_t max,
+                                int64_t burst_length)
 {
-    uint64_t iops_limit = 0;
-    double   ios_limit, ios_base;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        iops_limit = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.iops[is_write]) {
-        iops_limit = bs->io_limits.iops[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
+    double size, burst_size, extra;
 
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    ios_limit  = iops_limit * slice_time;
-    ios_base   = bs->nr_ops[is_write] - bs->io_base.ios[is_write];
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        ios_base += bs->nr_ops[!is_write] - bs->io_base.ios[!is_write];
+    if (!avg) {
+        return 0;
     }
 
-    if (ios_base + 1 <= ios_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
+    if (!max) {
+        size = avg / 10.0;
+        burst_size = 0;
+    } else {
+        size = (double)max * burst_length;
+        burst_size = max / 10.0;
     }
 
-    /* Calc approx time to dispatch */
-    wait_time = (ios_base + 1) / iops_limit;
-    if (wait_time > elapsed_time) {
-        wait_time = wait_time - elapsed_time;
-    } else {
-        wait_time = 0;
+    extra = bkt->level - size;
+    if (extra > 0) {
+        return extra / avg * NANOSECONDS_PER_SECOND;
     }
 
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
+    extra = bkt->burst_level - burst_size;
+    if (burst_size && extra > 0) {
+        return extra / max * NANOSECONDS_PER_SECOND;
     }
 
-    return true;
+    return 0;
 }
 
 static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
                            bool is_write, int64_t *wait)
 {
-    int64_t  now, max_wait;
-    uint64_t bps_wait = 0, iops_wait = 0;
-    double   elapsed_time;
-    int      bps_ret, iops_ret;
+    BlockThrottleGroup *tg = bs->throttle_group;
+    BlockIOLimit *l = &tg->io_limits;
+    int64_t burst_length = l->burst_length ?: BLOCK_IO_BURST_LENGTH;
+    int64_t now, max_wait = 0;
+    double delta;
+    int types[2] = { BLOCK_IO_LIMIT_TOTAL, is_write };
+    int i, t;
 
     now = qemu_get_clock_ns(vm_clock);
-    if ((bs->slice_start < now)
-        && (bs->slice_end > now)) {
-        bs->slice_end = now + bs->slice_time;
-    } else {
-        bs->slice_time  =  5 * BLOCK_IO_SLICE_TIME;
-        bs->slice_start = now;
-        bs->slice_end   = now + bs->slice_time;
-
-        bs->io_base.bytes[is_write]  = bs->nr_bytes[is_write];
-        bs->io_base.bytes[!is_write] = bs->nr_bytes[!is_write];
-
-        bs->io_base.ios[is_write]    = bs->nr_ops[is_write];
-        bs->io_base.ios[!is_write]   = bs->nr_ops[!is_write];
+    delta = (now - tg->previous_leak) / NANOSECONDS_PER_SECOND;
+    if (delta > 0) {
+        for (t = 0; t < 3; t++) {
+            bdrv_bucket_leak(&tg->bps[t], l->bps[t], l->bps_max[t], delta);
+            bdrv_bucket_leak(&tg->iops[t], l->iops[t], l->iops_max[t], delta);
+        }
+        tg->previous_leak = now;
     }
 
-    elapsed_time  = now - bs->slice_start;
-    elapsed_time  /= (NANOSECONDS_PER_SECOND);
+    for (i = 0; i < 2; i++) {
+        t = types[i];
+        max_wait = MAX(max_wait, bdrv_bucket_wait(&tg->bps[t], l->bps[t],
+                                                  l->bps_max[t],
+                                                  burst_length));
+        max_wait = MAX(max_wait, bdrv_bucket_wait(&tg->iops[t], l->iops[t],
+                                                  l->iops_max[t],
+                                                  burst_length));
+    }
 
-    bps_ret  = bdrv_exceed_bps_limits(bs, nb_sectors,
-                                      is_write, elapsed_time, &bps_wait);
-    iops_ret = bdrv_exceed_iops_limits(bs, is_write,
-                                      elapsed_time, &iops_wait);
-    if (bps_ret || iops_ret) {
-        max_wait = bps_wait > iops_wait ? bps_wait : iops_wait;
+    if (max_wait > 0) {
         if (wait) {
             *wait = max_wait;
         }
-
-        now = qemu_get_clock_ns(vm_clock);
-        if (bs->slice_end < now + max_wait) {
-            bs->slice_end = now + max_wait;
-        }
-
         return true;
     }
 
+    for (i = 0; i < 2; i++) {
+        t = types[i];
+        bdrv_bucket_account(&tg->bps[t], l->bps[t], l->bps_max[t],
+                            (double)nb_sectors * BDRV_SECTOR_SIZE);
+        bdrv_bucket_account(&tg->iops[t], l->iops[t], l->iops_max[t], 1);
+    }
+
     if (wait) {
         *wait = 0;
     }
-
     return false;
 }
 
@@ -4081,6 +4452,7 @@ flush_parent:
 
 void bdrv_invalidate_cache(BlockDriverState *bs)
 {
+    bdrv_alloc_cache_clear(bs);
     if (bs->drv && bs->drv->bdrv_invalidate_cache) {
         bs->drv->bdrv_invalidate_cache(bs);
     }
@@ -4136,6 +4508,8 @@ static void coroutine_fn bdrv_discard_co_entry(void *opaque)
 int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
                                  int nb_sectors)
 {
+    int ret;
+
     if (!bs->drv) {
         return -ENOMEDIUM;
     } else if (bdrv_check_request(bs, sector_num, nb_sectors)) {
@@ -4148,8 +4522,13 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         bdrv_reset_dirty(bs, sector_num, nb_sectors);
     }
 
+    /* What a backup has of these sectors is not what the guest reads
+     * any more.
+     */
+    bdrv_dirty_bitmaps_set(bs, sector_num, nb_sectors);
+
     if (bs->drv->bdrv_co_discard) {
-        return bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
+        ret = bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
     } else if (bs->drv->bdrv_aio_discard) {
         BlockDriverAIOCB *acb;
         CoroutineIOCompletion co = {
@@ -4159,14 +4538,16 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         acb = bs->drv->bdrv_aio_discard(bs, sector_num, nb_sectors,
                                         bdrv_co_io_em_complete, &co);
         if (acb == NULL) {
-            return -EIO;
+            ret = -EIO;
         } else {
             qemu_coroutine_yield();
-            return co.ret;
+            ret = co.ret;
         }
     } else {
-        return 0;
+        ret = 0;
     }
+    bdrv_alloc_cache_invalidate(bs, sector_num, nb_sectors);
+    return ret;
 }
 
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
@@ -4298,6 +4679,9 @@ bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
         if ((uintptr_t) qiov->iov[i].iov_base % bs->buffer_alignment) {
             return false;
         }
+        if (qiov->iov[i].iov_len % BDRV_SECTOR_SIZE) {
+            return false;
+        }
     }
 
     return true;
@@ -4357,6 +4741,212 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs)
     }
 }
 
+/*
+ * Named dirty bitmaps can be kept in a file of their own across restarts.
+ * The file starts with a header, all fields big-endian, followed by the
+ * bitmap in hbitmap_serialize format.  While QEMU runs the file holds
+ * only the header with DIRTY_BITMAP_IN_USE set, so that a bitmap that
+ * was not saved by a clean shutdown is never trusted.
+ */
+#define DIRTY_BITMAP_MAGIC      0x5144424d  /* "QDBM" */
+#define DIRTY_BITMAP_VERSION    1
+#define DIRTY_BITMAP_IN_USE     1
+
+typedef struct QEMU_PACKED DirtyBitmapHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t granularity;       /* in bytes */
+    uint64_t sectors;
+} DirtyBitmapHeader;
+
+static bool bdrv_write_dirty_bitmap(BdrvDirtyBitmap *bitmap, bool in_use,
+                                    Error **errp)
+{
+    DirtyBitmapHeader *header;
+    GError *gerr = NULL;
+    uint64_t len;
+    uint8_t *buf;
+    bool ok;
+
+    len = sizeof(*header);
+    if (!in_use) {
+        len += hbitmap_serialization_size(bitmap->bitmap);
+    }
+    buf = g_malloc0(len);
+    header = (DirtyBitmapHeader *)buf;
+    header->magic = cpu_to_be32(DIRTY_BITMAP_MAGIC);
+    header->version = cpu_to_be32(DIRTY_BITMAP_VERSION);
+    header->flags = cpu_to_be32(in_use ? DIRTY_BITMAP_IN_USE : 0);
+    header->granularity = cpu_to_be32(BDRV_SECTOR_SIZE <<
+                                      hbitmap_granularity(bitmap->bitmap));
+    header->sectors = cpu_to_be64(bitmap->sectors);
+    if (!in_use) {
+        hbitmap_serialize(bitmap->bitmap, buf + sizeof(*header));
+    }
+
+    ok = g_file_set_contents(bitmap->file, (gchar *)buf, len, &gerr);
+    if (!ok) {
+        error_setg(errp, "could not write dirty bitmap to %s: %s",
+                   bitmap->file, gerr->message);
+        g_error_free(gerr);
+    }
+    g_free(buf);
+    return ok;
+}
+
+/* Fill @bitmap from its file.  A file that does not exist yet gives an
+ * empty bitmap, a stale or mismatching one a full one.
+ */
+static bool bdrv_read_dirty_bitmap(BdrvDirtyBitmap *bitmap, int granularity,
+                                   Error **errp)
+{
+    DirtyBitmapHeader header = { 0 };
+    GError *gerr = NULL;
+    gchar *buf;
+    gsize len;
+
+    if (!g_file_get_contents(bitmap->file, &buf, &len, &gerr)) {
+        bool missing = g_error_matches(gerr, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+
+        if (!missing) {
+            error_setg(errp, "could not read dirty bitmap from %s: %s",
+                       bitmap->file, gerr->message);
+        }
+        g_error_free(gerr);
+        return missing;
+    }
+
+    if (len >= sizeof(header)) {
+        memcpy(&header, buf, sizeof(header));
+        be32_to_cpus(&header.magic);
+        be32_to_cpus(&header.version);
+        be32_to_cpus(&header.flags);
+        be32_to_cpus(&header.granularity);
+        be64_to_cpus(&header.sectors);
+    }
+
+    if (len == sizeof(header) +
+               hbitmap_serialization_size(bitmap->bitmap) &&
+        header.magic == DIRTY_BITMAP_MAGIC &&
+        header.version == DIRTY_BITMAP_VERSION &&
+        header.flags == 0 &&
+        header.granularity == (uint32_t)granularity &&
+        header.sectors == (uint64_t)bitmap->sectors) {
+        hbitmap_deserialize(bitmap->bitmap, (uint8_t *)buf + sizeof(header));
+    } else {
+        error_report("%s: dirty bitmap '%s' was not saved cleanly or does "
+                     "not match the disk, considering the whole disk dirty",
+                     bitmap->file, bitmap->name);
+        if (bitmap->sectors) {
+            hbitmap_set(bitmap->bitmap, 0, bitmap->sectors);
+        }
+    }
+    g_free(buf);
+    return true;
+}
+
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name, int granularity,
+                                          const char *file, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t length;
+
+    assert((granularity & (granularity - 1)) == 0);
+    assert(granularity >= BDRV_SECTOR_SIZE);
+
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Dirty bitmap '%s' already exists", name);
+        return NULL;
+    }
+    length = bdrv_getlength(bs);
+    if (length < 0) {
+        error_setg(errp, "Could not get the size of %s", bs->device_name);
+        return NULL;
+    }
+
+    bitmap = g_malloc0(sizeof(*bitmap));
+    bitmap->name = g_strdup(name);
+    bitmap->file = g_strdup(file);
+    bitmap->sectors = length >> BDRV_SECTOR_BITS;
+    bitmap->bitmap = hbitmap_alloc(bitmap->sectors,
+                                   ffs(granularity >> BDRV_SECTOR_BITS) - 1);
+
+    if (file && (!bdrv_read_dirty_bitmap(bitmap, granularity, errp) ||
+                 !bdrv_write_dirty_bitmap(bitmap, true, errp))) {
+        hbitmap_free(bitmap->bitmap);
+        g_free(bitmap->file);
+        g_free(bitmap->name);
+        g_free(bitmap);
+        return NULL;
+    }
+
+    QSLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, next);
+    return bitmap;
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QSLIST_FOREACH(bitmap, &bs->dirty_bitmaps, next) {
+        if (!strcmp(bitmap->name, name)) {
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+/* The file, if any, is left marked as in use: once the bitmap is gone,
+ * nothing tracks writes any more.
+ */
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    BdrvDirtyBitmap **p = &QSLIST_FIRST(&bs->dirty_bitmaps);
+
+    assert(!bitmap->busy);
+    while (*p != bitmap) {
+        p = &QSLIST_NEXT(*p, next);
+    }
+    *p = QSLIST_NEXT(bitmap, next);
+    hbitmap_free(bitmap->bitmap);
+    g_free(bitmap->file);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
+
+static void bdrv_save_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    while ((bitmap = QSLIST_FIRST(&bs->dirty_bitmaps)) != NULL) {
+        Error *local_err = NULL;
+
+        if (bitmap->file && !bdrv_write_dirty_bitmap(bitmap, false,
+                                                     &local_err)) {
+            error_report("%s", error_get_pretty(local_err));
+            error_free(local_err);
+        }
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+}
+
+static void bdrv_dirty_bitmaps_set(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QSLIST_FOREACH(bitmap, &bs->dirty_bitmaps, next) {
+        /* The device may have grown since the bitmap was created */
+        if (cur_sector < bitmap->sectors) {
+            hbitmap_set(bitmap->bitmap, cur_sector,
+                        MIN(nr_sectors, bitmap->sectors - cur_sector));
+        }
+    }
+}
+
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
 {
     assert(bs->in_use != in_use);
@@ -4422,11 +5012,59 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    int64_t latency_ns = get_clock() - cookie->start_time_ns;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+    if (bs->latency_hist[cookie->type]) {
+        latency_histogram_add(bs->latency_hist[cookie->type], latency_ns);
+    }
+}
+
+void bdrv_acct_merged(BlockDriverState *bs, enum BlockAcctType type, int num)
+{
+    assert(type < BDRV_MAX_IOTYPE);
+
+    bs->nr_merged[type] += num;
+}
+
+static void bdrv_free_latency_histograms(BlockDriverState *bs)
+{
+    int i;
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (bs->latency_hist[i]) {
+            latency_histogram_free(bs->latency_hist[i]);
+            bs->latency_hist[i] = NULL;
+        }
+    }
+}
+
+void bdrv_set_latency_histograms(BlockDriverState *bs, bool enable,
+                                 int64_t min_ns, int64_t nbins, Error **errp)
+{
+    LatencyHistogram *hist[BDRV_MAX_IOTYPE];
+    int i;
+
+    if (enable) {
+        for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+            hist[i] = latency_histogram_new(min_ns, nbins, errp);
+            if (!hist[i]) {
+                while (i--) {
+                    latency_histogram_free(hist[i]);
+                }
+                return;
+            }
+        }
+    }
+
+    bdrv_free_latency_histograms(bs);
+    if (enable) {
+        memcpy(bs->latency_hist, hist, sizeof(hist));
+    }
 }
 
 void bdrv_img_create(const char *filename, const char *fmt,
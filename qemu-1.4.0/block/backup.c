@@ -0,0 +1,211 @@
+/*
+ * Incremental backup
+ *
+ * Copies to the target only the clusters that a named dirty bitmap has
+ * recorded as written since the previous backup.  There is no
+ * copy-before-write here: the backup is consistent as of the moment the
+ * job finds the bitmap empty, not as of its start.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block/block_int.h"
+#include "block/blockjob.h"
+#include "qemu/ratelimit.h"
+
+enum {
+    /* Largest single copy; adjacent dirty chunks are merged up to this */
+    BACKUP_BUFFER_SIZE = 1024 * 1024, /* in bytes */
+};
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct BackupBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *target;
+    BdrvDirtyBitmap *bitmap;
+
+    /* What was taken off the bitmap so far, given back on failure */
+    HBitmap *copied;
+} BackupBlockJob;
+
+static int coroutine_fn backup_copy(BackupBlockJob *s, int64_t sector_num,
+                                    int nb_sectors, void *buf)
+{
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_readv(s->common.bs, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_co_writev(s->target, sector_num, nb_sectors, &qiov);
+}
+
+static void coroutine_fn backup_run(void *opaque)
+{
+    BackupBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    HBitmap *hb = s->bitmap->bitmap;
+    HBitmapIter hbi;
+    int64_t sectors_per_chunk, max_sectors, end;
+    int64_t next_sector = 0;
+    bool done = false;
+    void *buf;
+    int ret = 0;
+
+    end = bdrv_getlength(bs);
+    if (end < 0) {
+        ret = end;
+        goto out;
+    }
+    end >>= BDRV_SECTOR_BITS;
+    if (end == 0 || s->bitmap->sectors == 0) {
+        done = true;
+        goto out;
+    }
+    if (end < s->bitmap->sectors) {
+        /* The disk shrank, there is nothing to copy past its end */
+        hbitmap_reset(hb, end, s->bitmap->sectors - end);
+    } else {
+        end = s->bitmap->sectors;
+    }
+
+    sectors_per_chunk = 1 << hbitmap_granularity(hb);
+    max_sectors = MAX(BACKUP_BUFFER_SIZE >> BDRV_SECTOR_BITS,
+                      sectors_per_chunk);
+    buf = qemu_blockalign(bs, max_sectors * BDRV_SECTOR_SIZE);
+    s->common.len = hbitmap_count(hb) * BDRV_SECTOR_SIZE;
+
+    while (!block_job_is_cancelled(&s->common)) {
+        uint64_t delay_ns;
+        int64_t sector_num;
+        int nb_sectors;
+
+        if (next_sector >= end) {
+            next_sector = 0;
+        }
+        hbitmap_iter_init(&hbi, hb, next_sector);
+        sector_num = hbitmap_iter_next(&hbi);
+        if ((sector_num < 0 || sector_num >= end) && next_sector > 0) {
+            next_sector = 0;
+            continue;
+        }
+
+        if (sector_num < 0 || sector_num >= end) {
+            /* Caught up.  Once the target is stable, and no guest write
+             * is still on its way to the bitmap, the backup is complete.
+             */
+            ret = bdrv_co_flush(s->target);
+            if (ret < 0) {
+                break;
+            }
+            bdrv_drain_all();
+            if (hbitmap_count(hb) == 0) {
+                done = true;
+                break;
+            }
+            continue;
+        }
+
+        nb_sectors = sectors_per_chunk;
+        while (nb_sectors < max_sectors && sector_num + nb_sectors < end &&
+               hbitmap_get(hb, sector_num + nb_sectors)) {
+            nb_sectors += sectors_per_chunk;
+        }
+        nb_sectors = MIN(nb_sectors, end - sector_num);
+
+        /* Clear the bits first, so that guest writes racing with the
+         * copy dirty them again.
+         */
+        hbitmap_reset(hb, sector_num, nb_sectors);
+        hbitmap_set(s->copied, sector_num, nb_sectors);
+        ret = backup_copy(s, sector_num, nb_sectors, buf);
+        if (ret < 0) {
+            break;
+        }
+        next_sector = sector_num + nb_sectors;
+
+        /* Publish progress; new writes make the job longer */
+        s->common.offset += nb_sectors * BDRV_SECTOR_SIZE;
+        s->common.len = s->common.offset + hbitmap_count(hb) * BDRV_SECTOR_SIZE;
+
+        delay_ns = block_job_bandwidth_delay(&s->common, nb_sectors);
+        if (delay_ns == 0 && s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, nb_sectors);
+        }
+
+        /* Note that even when no rate limit is applied we need to yield
+         * with no pending I/O here so that bdrv_drain_all() returns.
+         */
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+    }
+    qemu_vfree(buf);
+
+out:
+    if (!done) {
+        /* The next backup must still copy whatever this one did not
+         * finish.
+         */
+        hbitmap_merge(hb, s->copied);
+    }
+    hbitmap_free(s->copied);
+    s->bitmap->busy = false;
+    bdrv_delete(s->target);
+    block_job_completed(&s->common, ret);
+}
+
+static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static BlockJobType backup_job_type = {
+    .instance_size = sizeof(BackupBlockJob),
+    .job_type      = "backup",
+    .set_speed     = backup_set_speed,
+};
+
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  BdrvDirtyBitmap *bitmap, int64_t speed,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp)
+{
+    BackupBlockJob *s;
+
+    if (bitmap->busy) {
+        error_setg(errp, "Dirty bitmap '%s' is already being backed up",
+                   bitmap->name);
+        return;
+    }
+
+    s = block_job_create(&backup_job_type, bs, speed, cb, opaque, errp);
+    if (!s) {
+        return;
+    }
+
+    s->target = target;
+    s->bitmap = bitmap;
+    s->copied = hbitmap_alloc(bitmap->sectors,
+                              hbitmap_granularity(bitmap->bitmap));
+    bitmap->busy = true;
+
+    s->common.co = qemu_coroutine_create(backup_run);
+    trace_backup_start(bs, target, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
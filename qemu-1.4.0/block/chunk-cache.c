@@ -0,0 +1,138 @@
+/*
+ * Cache of decompressed chunks for compressed read-only image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <zlib.h>
+#include "block/chunk-cache.h"
+#include "block/thread-pool.h"
+#include "qemu/queue.h"
+
+typedef struct ChunkCacheEntry {
+    uint32_t index;
+    uint8_t *data;
+    size_t len;
+    QTAILQ_ENTRY(ChunkCacheEntry) next;
+} ChunkCacheEntry;
+
+struct ChunkCache {
+    GHashTable *entries;            /* index -> ChunkCacheEntry */
+    QTAILQ_HEAD(, ChunkCacheEntry) lru;     /* least recently used first */
+    uint64_t bytes;
+    uint64_t max_bytes;
+};
+
+ChunkCache *chunk_cache_new(uint64_t max_bytes)
+{
+    ChunkCache *c = g_malloc0(sizeof(*c));
+
+    c->entries = g_hash_table_new(g_int_hash, g_int_equal);
+    QTAILQ_INIT(&c->lru);
+    c->max_bytes = max_bytes ? max_bytes : CHUNK_CACHE_DEFAULT_SIZE;
+    return c;
+}
+
+static void chunk_cache_evict(ChunkCache *c, ChunkCacheEntry *e)
+{
+    QTAILQ_REMOVE(&c->lru, e, next);
+    g_hash_table_remove(c->entries, &e->index);
+    c->bytes -= e->len;
+    g_free(e->data);
+    g_free(e);
+}
+
+void chunk_cache_free(ChunkCache *c)
+{
+    ChunkCacheEntry *e, *next;
+
+    if (!c) {
+        return;
+    }
+    QTAILQ_FOREACH_SAFE(e, &c->lru, next, next) {
+        chunk_cache_evict(c, e);
+    }
+    g_hash_table_destroy(c->entries);
+    g_free(c);
+}
+
+uint8_t *chunk_cache_lookup(ChunkCache *c, uint32_t index)
+{
+    ChunkCacheEntry *e = g_hash_table_lookup(c->entries, &index);
+
+    if (!e) {
+        return NULL;
+    }
+    QTAILQ_REMOVE(&c->lru, e, next);
+    QTAILQ_INSERT_TAIL(&c->lru, e, next);
+    return e->data;
+}
+
+void chunk_cache_insert(ChunkCache *c, uint32_t index, uint8_t *data,
+                        size_t len)
+{
+    ChunkCacheEntry *e = g_hash_table_lookup(c->entries, &index);
+
+    if (e) {
+        chunk_cache_evict(c, e);
+    }
+
+    while (!QTAILQ_EMPTY(&c->lru) && c->bytes + len > c->max_bytes) {
+        chunk_cache_evict(c, QTAILQ_FIRST(&c->lru));
+    }
+
+    e = g_malloc(sizeof(*e));
+    e->index = index;
+    e->data = data;
+    e->len = len;
+    QTAILQ_INSERT_TAIL(&c->lru, e, next);
+    g_hash_table_insert(c->entries, &e->index, e);
+    c->bytes += len;
+}
+
+typedef struct ChunkInflate {
+    const uint8_t *in;
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len;
+} ChunkInflate;
+
+static int chunk_inflate_worker(void *opaque)
+{
+    ChunkInflate *ci = opaque;
+    z_stream zstream;
+    int ret;
+
+    memset(&zstream, 0, sizeof(zstream));
+    if (inflateInit(&zstream) != Z_OK) {
+        return -EIO;
+    }
+
+    zstream.next_in = (Bytef *)ci->in;
+    zstream.avail_in = ci->in_len;
+    zstream.next_out = ci->out;
+    zstream.avail_out = ci->out_len;
+    ret = inflate(&zstream, Z_FINISH);
+    if (ret != Z_STREAM_END || zstream.total_out != ci->out_len) {
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&zstream);
+    return ret;
+}
+
+int coroutine_fn chunk_inflate_co(const uint8_t *in, size_t in_len,
+                                  uint8_t *out, size_t out_len)
+{
+    ChunkInflate ci = {
+        .in = in,
+        .in_len = in_len,
+        .out = out,
+        .out_len = out_len,
+    };
+
+    return thread_pool_submit_co(chunk_inflate_worker, &ci);
+}
@@ -24,7 +24,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
-#include <zlib.h>
+#include "block/chunk-cache.h"
 
 typedef struct BDRVCloopState {
     CoMutex lock;
@@ -34,8 +34,9 @@ typedef struct BDRVCloopState {
     uint32_t sectors_per_block;
     uint32_t current_block;
     uint8_t *compressed_block;
-    uint8_t *uncompressed_block;
-    z_stream zstream;
+    ChunkCache *cache;              /* decompressed blocks */
+    bool prefetching;
+    uint32_t prefetch_block;
 } BDRVCloopState;
 
 static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -93,13 +94,8 @@ static int cloop_open(BlockDriverState *bs, int flags)
         }
     }
 
-    /* initialize zlib engine */
     s->compressed_block = g_malloc(max_compressed_block_size + 1);
-    s->uncompressed_block = g_malloc(s->block_size);
-    if (inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
-        goto fail;
-    }
+    s->cache = chunk_cache_new(bs->chunk_cache_size);
     s->current_block = s->n_blocks;
 
     s->sectors_per_block = s->block_size/512;
@@ -110,44 +106,93 @@ static int cloop_open(BlockDriverState *bs, int flags)
 fail:
     g_free(s->offsets);
     g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
     return ret;
 }
 
-static inline int cloop_read_block(BlockDriverState *bs, int block_num)
+/* Read and decompress a block, called with s->lock held */
+static coroutine_fn int cloop_load_block(BlockDriverState *bs,
+                                         uint32_t block_num)
 {
     BDRVCloopState *s = bs->opaque;
+    uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    uint8_t *data;
+    int ret;
 
-    if (s->current_block != block_num) {
-        int ret;
-        uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    ret = bdrv_pread(bs->file, s->offsets[block_num], s->compressed_block,
+                     bytes);
+    if (ret != bytes) {
+        return -1;
+    }
 
-        ret = bdrv_pread(bs->file, s->offsets[block_num], s->compressed_block,
-                         bytes);
-        if (ret != bytes) {
-            return -1;
-        }
+    /* Inflating is left to a worker thread so that it does not stall the
+     * main loop.
+     */
+    data = g_malloc(s->block_size);
+    if (chunk_inflate_co(s->compressed_block, bytes, data,
+                         s->block_size) < 0) {
+        g_free(data);
+        return -1;
+    }
 
-        s->zstream.next_in = s->compressed_block;
-        s->zstream.avail_in = bytes;
-        s->zstream.next_out = s->uncompressed_block;
-        s->zstream.avail_out = s->block_size;
-        ret = inflateReset(&s->zstream);
-        if (ret != Z_OK) {
-            return -1;
-        }
-        ret = inflate(&s->zstream, Z_FINISH);
-        if (ret != Z_STREAM_END || s->zstream.total_out != s->block_size) {
-            return -1;
+    chunk_cache_insert(s->cache, block_num, data, s->block_size);
+    return 0;
+}
+
+static coroutine_fn void cloop_prefetch_co(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVCloopState *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (!chunk_cache_lookup(s->cache, s->prefetch_block)) {
+        cloop_load_block(bs, s->prefetch_block);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    s->prefetching = false;
+}
+
+/* Decompress the block after a run of sequential reads ahead of time */
+static void cloop_prefetch(BlockDriverState *bs, uint32_t block_num)
+{
+    BDRVCloopState *s = bs->opaque;
+    Coroutine *co;
+
+    if (s->prefetching || block_num + 1 >= s->n_blocks ||
+        chunk_cache_lookup(s->cache, block_num)) {
+        return;
+    }
+
+    s->prefetching = true;
+    s->prefetch_block = block_num;
+    co = qemu_coroutine_create(cloop_prefetch_co);
+    qemu_coroutine_enter(co, bs);
+}
+
+static coroutine_fn uint8_t *cloop_read_block(BlockDriverState *bs,
+                                              uint32_t block_num)
+{
+    BDRVCloopState *s = bs->opaque;
+    uint8_t *data;
+
+    data = chunk_cache_lookup(s->cache, block_num);
+    if (!data) {
+        if (cloop_load_block(bs, block_num) < 0) {
+            return NULL;
         }
+        data = chunk_cache_lookup(s->cache, block_num);
+    }
 
+    if (block_num != s->current_block) {
+        if (block_num == s->current_block + 1) {
+            cloop_prefetch(bs, block_num + 1);
+        }
         s->current_block = block_num;
     }
-    return 0;
+    return data;
 }
 
-static int cloop_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static coroutine_fn int cloop_read(BlockDriverState *bs, int64_t sector_num,
+                                   uint8_t *buf, int nb_sectors)
 {
     BDRVCloopState *s = bs->opaque;
     int i;
@@ -156,11 +201,12 @@ static int cloop_read(BlockDriverState *bs, int64_t sector_num,
         uint32_t sector_offset_in_block =
             ((sector_num + i) % s->sectors_per_block),
             block_num = (sector_num + i) / s->sectors_per_block;
-        if (cloop_read_block(bs, block_num) != 0) {
+        uint8_t *data = cloop_read_block(bs, block_num);
+
+        if (!data) {
             return -1;
         }
-        memcpy(buf + i * 512,
-            s->uncompressed_block + sector_offset_in_block * 512, 512);
+        memcpy(buf + i * 512, data + sector_offset_in_block * 512, 512);
     }
     return 0;
 }
@@ -179,12 +225,15 @@ static coroutine_fn int cloop_co_read(BlockDriverState *bs, int64_t sector_num,
 static void cloop_close(BlockDriverState *bs)
 {
     BDRVCloopState *s = bs->opaque;
+
+    while (s->prefetching) {
+        qemu_aio_wait();
+    }
     if (s->n_blocks > 0) {
         g_free(s->offsets);
     }
     g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
-    inflateEnd(&s->zstream);
+    chunk_cache_free(s->cache);
 }
 
 static BlockDriver bdrv_cloop = {
@@ -114,11 +114,12 @@ wait:
         copy = (ret == 1);
         trace_commit_one_iteration(s, sector_num, n, ret);
         if (copy) {
-            if (s->common.speed) {
+            delay_ns = block_job_bandwidth_delay(&s->common, n);
+            if (delay_ns == 0 && s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
-                }
+            }
+            if (delay_ns > 0) {
+                goto wait;
             }
             ret = commit_populate(top, base, sector_num, n, buf);
             bytes_written += n * BDRV_SECTOR_SIZE;
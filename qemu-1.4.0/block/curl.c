@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "qemu/queue.h"
 #include <curl/curl.h>
 
 // #define DEBUG
@@ -38,10 +39,15 @@
                    CURLPROTO_FTP | CURLPROTO_FTPS | \
                    CURLPROTO_TFTP)
 
-#define CURL_NUM_STATES 8
+#define CURL_NUM_STATES 16
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_SIZE (256 * 1024)
+#define MAX_READ_AHEAD_SIZE (8 * 1024 * 1024)
+
+/* Completed transfers are kept in an LRU cache of fixed size blocks */
+#define CACHE_BLOCK_SIZE    (64 * 1024)
+#define CACHE_SIZE          (16 * 1024 * 1024)
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -75,12 +81,28 @@ typedef struct CURLState
     char in_use;
 } CURLState;
 
+typedef struct CURLCacheBlock {
+    int64_t index;
+    size_t len;
+    char *data;
+    QTAILQ_ENTRY(CURLCacheBlock) lru;
+} CURLCacheBlock;
+
 typedef struct BDRVCURLState {
     CURLM *multi;
     size_t len;
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+
+    /* Sequential reads double the readahead, up to MAX_READ_AHEAD_SIZE */
+    size_t cur_readahead;
+    size_t next_seq_start;
+
+    size_t cache_size;
+    size_t cache_used;
+    GHashTable *cache;
+    QTAILQ_HEAD(CURLCacheLRU, CURLCacheBlock) cache_lru;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
@@ -156,6 +178,101 @@ read_end:
     return realsize;
 }
 
+static void curl_cache_free_block(gpointer p)
+{
+    CURLCacheBlock *block = p;
+
+    g_free(block->data);
+    g_free(block);
+}
+
+static void curl_cache_init(BDRVCURLState *s)
+{
+    s->cache = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                     curl_cache_free_block);
+    QTAILQ_INIT(&s->cache_lru);
+}
+
+/* Keep the whole blocks that a finished transfer has downloaded */
+static void curl_cache_insert(BDRVCURLState *s, CURLState *state)
+{
+    size_t end = state->buf_start + state->buf_off;
+    int64_t index = DIV_ROUND_UP(state->buf_start, CACHE_BLOCK_SIZE);
+    size_t off;
+
+    if (!s->cache_size) {
+        return;
+    }
+
+    for (off = index * CACHE_BLOCK_SIZE; off < end;
+         off += CACHE_BLOCK_SIZE, index++) {
+        CURLCacheBlock *block;
+        size_t len = MIN(CACHE_BLOCK_SIZE, s->len - off);
+
+        if (off + len > end) {
+            break;
+        }
+        if (g_hash_table_lookup(s->cache, &index)) {
+            continue;
+        }
+
+        while (s->cache_used + len > s->cache_size &&
+               !QTAILQ_EMPTY(&s->cache_lru)) {
+            CURLCacheBlock *victim = QTAILQ_LAST(&s->cache_lru, CURLCacheLRU);
+
+            QTAILQ_REMOVE(&s->cache_lru, victim, lru);
+            s->cache_used -= victim->len;
+            g_hash_table_remove(s->cache, &victim->index);
+        }
+
+        block = g_malloc(sizeof(*block));
+        block->index = index;
+        block->len = len;
+        block->data = g_memdup(state->orig_buf + (off - state->buf_start), len);
+        g_hash_table_insert(s->cache, &block->index, block);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, block, lru);
+        s->cache_used += len;
+    }
+}
+
+/* Complete @acb from the cache if all the blocks it needs are there */
+static bool curl_cache_read(BDRVCURLState *s, size_t start, size_t len,
+                            CURLAIOCB *acb)
+{
+    int64_t first = start / CACHE_BLOCK_SIZE;
+    int64_t last = (start + len - 1) / CACHE_BLOCK_SIZE;
+    int64_t index;
+    size_t done = 0;
+
+    if (!s->cache_used) {
+        return false;
+    }
+    for (index = first; index <= last; index++) {
+        CURLCacheBlock *block = g_hash_table_lookup(s->cache, &index);
+
+        if (!block || block->index * CACHE_BLOCK_SIZE + block->len <
+                      MIN(start + len, (index + 1) * CACHE_BLOCK_SIZE)) {
+            return false;
+        }
+    }
+
+    for (index = first; index <= last; index++) {
+        CURLCacheBlock *block = g_hash_table_lookup(s->cache, &index);
+        size_t off = MAX(start, index * CACHE_BLOCK_SIZE) -
+                     index * CACHE_BLOCK_SIZE;
+        size_t n = MIN(block->len - off, len - done);
+
+        qemu_iovec_from_buf(acb->qiov, done, block->data + off, n);
+        done += n;
+
+        QTAILQ_REMOVE(&s->cache_lru, block, lru);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, block, lru);
+    }
+
+    acb->common.cb(acb->common.opaque, 0);
+    return true;
+}
+
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
                          CURLAIOCB *acb)
 {
@@ -254,6 +371,8 @@ static void curl_multi_do(void *arg)
                         qemu_aio_release(acb);
                         state->acb[i] = NULL;
                     }
+                } else {
+                    curl_cache_insert(s, state);
                 }
 
                 curl_clean_state(state);
@@ -335,47 +454,59 @@ static void curl_clean_state(CURLState *s)
     s->in_use = 0;
 }
 
+/*
+ * Strip a trailing ":name=#:" option from @file, leaving its leading colon
+ * in place so that options can be stacked.  Returns whether one was found.
+ */
+static bool curl_parse_opt(char *file, const char *name, size_t *val)
+{
+    size_t len = strlen(file), nlen = strlen(name);
+    char *digits, *opt;
+
+    if (len < 2 || file[len - 1] != ':') {
+        return false;
+    }
+    digits = file + len - 1;
+    while (digits > file && qemu_isdigit(digits[-1])) {
+        digits--;
+    }
+    if (digits == file + len - 1 || digits - file < nlen + 2) {
+        return false;
+    }
+
+    opt = digits - nlen - 2;
+    if (opt == file || opt[0] != ':' || strncmp(opt + 1, name, nlen) ||
+        opt[nlen + 1] != '=') {
+        return false;
+    }
+    *val = strtoull(digits, NULL, 10);
+    opt[1] = '\0';
+    return true;
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
     double d;
 
-    #define RA_OPTSTR ":readahead="
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
+    bool found, parsed = false;
 
     static int inited = 0;
 
     file = g_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
+    s->cache_size = CACHE_SIZE;
 
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        ra--;
+    /* Parse trailing ":readahead=#:" and ":cache=#:" params, if present. */
+    do {
+        found = curl_parse_opt(file, "readahead", &s->readahead_size) ||
+                curl_parse_opt(file, "cache", &s->cache_size);
+        parsed |= found;
+    } while (found);
+    if (parsed) {
+        file[strlen(file) - 1] = '\0';
     }
 
     if ((s->readahead_size & 0x1ff) != 0) {
@@ -383,6 +514,7 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
                 s->readahead_size);
         goto out_noclean;
     }
+    s->cur_readahead = s->readahead_size;
 
     if (!inited) {
         curl_global_init(CURL_GLOBAL_ALL);
@@ -420,6 +552,14 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     s->multi = curl_multi_init();
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s); 
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb ); 
+#if LIBCURL_VERSION_NUM >= 0x071003
+    /* Keep one connection alive per state, and pipeline range requests on
+     * them when the server allows it.
+     */
+    curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, 1L);
+    curl_multi_setopt(s->multi, CURLMOPT_MAXCONNECTS, (long)CURL_NUM_STATES);
+#endif
+    curl_cache_init(s);
     curl_multi_do(s);
 
     return 0;
@@ -470,11 +610,20 @@ static void curl_readv_bh_cb(void *p)
     acb->bh = NULL;
 
     size_t start = acb->sector_num * SECTOR_SIZE;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
     size_t end;
+    bool sequential = (start == s->next_seq_start);
+
+    s->next_seq_start = start + len;
+
+    if (curl_cache_read(s, start, len, acb)) {
+        qemu_aio_release(acb);
+        return;
+    }
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
             qemu_aio_release(acb);
             // fall through
@@ -493,13 +642,23 @@ static void curl_readv_bh_cb(void *p)
     }
 
     acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
+    acb->end = len;
+
+    /* A reader streaming through the image gets a window that doubles with
+     * every request that has to go to the server; a seek starts over.
+     */
+    if (sequential) {
+        s->cur_readahead = MIN(s->cur_readahead * 2, MAX_READ_AHEAD_SIZE);
+        s->cur_readahead = MAX(s->cur_readahead, s->readahead_size);
+    } else {
+        s->cur_readahead = s->readahead_size;
+    }
 
     state->buf_off = 0;
     if (state->orig_buf)
         g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
+    state->buf_len = acb->end + s->cur_readahead;
     end = MIN(start + state->buf_len, s->len) - 1;
     state->orig_buf = g_malloc(state->buf_len);
     state->acb[0] = acb;
@@ -557,6 +716,9 @@ static void curl_close(BlockDriverState *bs)
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
+    if (s->cache) {
+        g_hash_table_destroy(s->cache);
+    }
     g_free(s->url);
 }
 
@@ -25,7 +25,7 @@
 #include "block/block_int.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
-#include <zlib.h>
+#include "block/chunk-cache.h"
 
 typedef struct BDRVDMGState {
     CoMutex lock;
@@ -45,8 +45,10 @@ typedef struct BDRVDMGState {
     uint64_t* sectorcounts;
     uint32_t current_chunk;
     uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
+    uint8_t *zero_chunk;
+    ChunkCache *cache;              /* decompressed and copied chunks */
+    bool prefetching;
+    uint32_t prefetch_chunk;
 } BDRVDMGState;
 
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -219,13 +221,9 @@ static int dmg_open(BlockDriverState *bs, int flags)
 	}
     }
 
-    /* initialize zlib engine */
     s->compressed_chunk = g_malloc(max_compressed_size+1);
-    s->uncompressed_chunk = g_malloc(512*max_sectors_per_chunk);
-    if(inflateInit(&s->zstream) != Z_OK) {
-        ret = -EINVAL;
-        goto fail;
-    }
+    s->zero_chunk = g_malloc0(512*max_sectors_per_chunk);
+    s->cache = chunk_cache_new(bs->chunk_cache_size);
 
     s->current_chunk = s->n_chunks;
 
@@ -239,7 +237,6 @@ fail:
     g_free(s->sectors);
     g_free(s->sectorcounts);
     g_free(s->compressed_chunk);
-    g_free(s->uncompressed_chunk);
     return ret;
 }
 
@@ -269,74 +266,130 @@ static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BlockDriverState *bs, int sector_num)
+/* Read and decompress a chunk, called with s->lock held */
+static coroutine_fn int dmg_load_chunk(BlockDriverState *bs, uint32_t chunk)
 {
     BDRVDMGState *s = bs->opaque;
+    size_t len = 512 * s->sectorcounts[chunk];
+    uint8_t *data;
+    int ret;
 
-    if(!is_sector_in_chunk(s,s->current_chunk,sector_num)) {
-	int ret;
-	uint32_t chunk = search_chunk(s,sector_num);
-
-	if(chunk>=s->n_chunks)
-	    return -1;
+    switch (s->types[chunk]) {
+    case 0x80000005: /* zlib compressed */
+        /* we need to buffer, because only the chunk as whole can be
+         * inflated. */
+        ret = bdrv_pread(bs->file, s->offsets[chunk],
+                         s->compressed_chunk, s->lengths[chunk]);
+        if (ret != s->lengths[chunk]) {
+            return -1;
+        }
 
-	s->current_chunk = s->n_chunks;
-	switch(s->types[chunk]) {
-	case 0x80000005: { /* zlib compressed */
-	    int i;
-
-	    /* we need to buffer, because only the chunk as whole can be
-	     * inflated. */
-	    i=0;
-	    do {
-                ret = bdrv_pread(bs->file, s->offsets[chunk] + i,
-                                 s->compressed_chunk+i, s->lengths[chunk]-i);
-		if(ret<0 && errno==EINTR)
-		    ret=0;
-		i+=ret;
-	    } while(ret>=0 && ret+i<s->lengths[chunk]);
-
-	    if (ret != s->lengths[chunk])
-		return -1;
-
-	    s->zstream.next_in = s->compressed_chunk;
-	    s->zstream.avail_in = s->lengths[chunk];
-	    s->zstream.next_out = s->uncompressed_chunk;
-	    s->zstream.avail_out = 512*s->sectorcounts[chunk];
-	    ret = inflateReset(&s->zstream);
-	    if(ret != Z_OK)
-		return -1;
-	    ret = inflate(&s->zstream, Z_FINISH);
-	    if(ret != Z_STREAM_END || s->zstream.total_out != 512*s->sectorcounts[chunk])
-		return -1;
-	    break; }
-	case 1: /* copy */
-	    ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->uncompressed_chunk, s->lengths[chunk]);
-	    if (ret != s->lengths[chunk])
-		return -1;
-	    break;
-	case 2: /* zero */
-	    memset(s->uncompressed_chunk, 0, 512*s->sectorcounts[chunk]);
-	    break;
-	}
-	s->current_chunk = chunk;
+        /* Inflating is left to a worker thread so that it does not stall
+         * the main loop.
+         */
+        data = g_malloc(len);
+        if (chunk_inflate_co(s->compressed_chunk, s->lengths[chunk],
+                             data, len) < 0) {
+            g_free(data);
+            return -1;
+        }
+        break;
+    case 1: /* copy */
+        data = g_malloc0(len);
+        ret = bdrv_pread(bs->file, s->offsets[chunk], data,
+                         MIN(s->lengths[chunk], len));
+        if (ret != MIN(s->lengths[chunk], len)) {
+            g_free(data);
+            return -1;
+        }
+        break;
+    default:
+        return -1;
     }
+
+    chunk_cache_insert(s->cache, chunk, data, len);
     return 0;
 }
 
-static int dmg_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static coroutine_fn void dmg_prefetch_co(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVDMGState *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (!chunk_cache_lookup(s->cache, s->prefetch_chunk)) {
+        dmg_load_chunk(bs, s->prefetch_chunk);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    s->prefetching = false;
+}
+
+/* Decompress the chunk after a run of sequential reads ahead of time */
+static void dmg_prefetch(BlockDriverState *bs, uint32_t chunk)
+{
+    BDRVDMGState *s = bs->opaque;
+    Coroutine *co;
+
+    if (s->prefetching || chunk >= s->n_chunks || s->types[chunk] == 2 ||
+        chunk_cache_lookup(s->cache, chunk)) {
+        return;
+    }
+
+    s->prefetching = true;
+    s->prefetch_chunk = chunk;
+    co = qemu_coroutine_create(dmg_prefetch_co);
+    qemu_coroutine_enter(co, bs);
+}
+
+static coroutine_fn uint8_t *dmg_read_chunk(BlockDriverState *bs,
+                                            int sector_num, uint32_t *pchunk)
+{
+    BDRVDMGState *s = bs->opaque;
+    uint32_t chunk = s->current_chunk;
+    uint8_t *data;
+
+    if (!is_sector_in_chunk(s, chunk, sector_num)) {
+        chunk = search_chunk(s, sector_num);
+        if (chunk >= s->n_chunks) {
+            return NULL;
+        }
+    }
+
+    if (s->types[chunk] == 2) { /* zero */
+        data = s->zero_chunk;
+    } else {
+        data = chunk_cache_lookup(s->cache, chunk);
+        if (!data) {
+            if (dmg_load_chunk(bs, chunk) < 0) {
+                return NULL;
+            }
+            data = chunk_cache_lookup(s->cache, chunk);
+        }
+    }
+
+    if (chunk != s->current_chunk) {
+        if (chunk == s->current_chunk + 1) {
+            dmg_prefetch(bs, chunk + 1);
+        }
+        s->current_chunk = chunk;
+    }
+    *pchunk = chunk;
+    return data;
+}
+
+static coroutine_fn int dmg_read(BlockDriverState *bs, int64_t sector_num,
+                                 uint8_t *buf, int nb_sectors)
 {
     BDRVDMGState *s = bs->opaque;
     int i;
 
     for(i=0;i<nb_sectors;i++) {
-	uint32_t sector_offset_in_chunk;
-	if(dmg_read_chunk(bs, sector_num+i) != 0)
+	uint32_t sector_offset_in_chunk, chunk;
+	uint8_t *data = dmg_read_chunk(bs, sector_num+i, &chunk);
+	if (!data)
 	    return -1;
-	sector_offset_in_chunk = sector_num+i-s->sectors[s->current_chunk];
-	memcpy(buf+i*512,s->uncompressed_chunk+sector_offset_in_chunk*512,512);
+	sector_offset_in_chunk = sector_num+i-s->sectors[chunk];
+	memcpy(buf+i*512,data+sector_offset_in_chunk*512,512);
     }
     return 0;
 }
@@ -356,15 +409,17 @@ static void dmg_close(BlockDriverState *bs)
 {
     BDRVDMGState *s = bs->opaque;
 
+    while (s->prefetching) {
+        qemu_aio_wait();
+    }
     g_free(s->types);
     g_free(s->offsets);
     g_free(s->lengths);
     g_free(s->sectors);
     g_free(s->sectorcounts);
     g_free(s->compressed_chunk);
-    g_free(s->uncompressed_chunk);
-
-    inflateEnd(&s->zstream);
+    g_free(s->zero_chunk);
+    chunk_cache_free(s->cache);
 }
 
 static BlockDriver bdrv_dmg = {
@@ -3,7 +3,7 @@
  *
  * Copyright (C) 2012 Bharata B Rao <bharata@linux.vnet.ibm.com>
  *
- * Pipe handling mechanism in AIO implementation is derived from
+ * AIO completion handling is derived from
  * block/rbd.c. Hence,
  *
  * Copyright (C) 2010-2011 Christian Brunner <chb@muc.de>,
@@ -19,6 +19,8 @@
 #include "block/block_int.h"
 #include "qemu/sockets.h"
 #include "qemu/uri.h"
+#include "qemu/event_notifier.h"
+#include "qemu/timer.h"
 
 typedef struct GlusterAIOCB {
     BlockDriverAIOCB common;
@@ -26,19 +28,23 @@ typedef struct GlusterAIOCB {
     int ret;
     bool *finished;
     QEMUBH *bh;
+    int64_t start_ns;
+    struct GlusterAIOCB *next;
 } GlusterAIOCB;
 
 typedef struct BDRVGlusterState {
     struct glfs *glfs;
-    int fds[2];
+    EventNotifier e;
     struct glfs_fd *fd;
     int qemu_aio_count;
-    int event_reader_pos;
-    GlusterAIOCB *event_acb;
-} BDRVGlusterState;
 
-#define GLUSTER_FD_READ  0
-#define GLUSTER_FD_WRITE 1
+    /* Pushed to by gluster threads, drained by qemu_gluster_aio_event_reader() */
+    GlusterAIOCB *volatile completed;
+
+    /* for query-blockstats */
+    int64_t ops;
+    int64_t ops_total_time_ns;
+} BDRVGlusterState;
 
 typedef struct GlusterConf {
     char *server;
@@ -248,6 +254,7 @@ static void qemu_gluster_complete_aio(GlusterAIOCB *acb, BDRVGlusterState *s)
     }
 
     s->qemu_aio_count--;
+    s->ops_total_time_ns += get_clock() - acb->start_ns;
     qemu_aio_release(acb);
     cb(opaque, ret);
     if (finished) {
@@ -255,29 +262,35 @@ static void qemu_gluster_complete_aio(GlusterAIOCB *acb, BDRVGlusterState *s)
     }
 }
 
-static void qemu_gluster_aio_event_reader(void *opaque)
+/*
+ * Complete all the requests that gluster finished since the handler last
+ * ran, in the order they finished.
+ */
+static void qemu_gluster_aio_event_reader(EventNotifier *e)
 {
-    BDRVGlusterState *s = opaque;
-    ssize_t ret;
+    BDRVGlusterState *s = container_of(e, BDRVGlusterState, e);
+    GlusterAIOCB *acb, *next, *list = NULL;
 
-    do {
-        char *p = (char *)&s->event_acb;
-
-        ret = read(s->fds[GLUSTER_FD_READ], p + s->event_reader_pos,
-                   sizeof(s->event_acb) - s->event_reader_pos);
-        if (ret > 0) {
-            s->event_reader_pos += ret;
-            if (s->event_reader_pos == sizeof(s->event_acb)) {
-                s->event_reader_pos = 0;
-                qemu_gluster_complete_aio(s->event_acb, s);
-            }
-        }
-    } while (ret < 0 && errno == EINTR);
+    event_notifier_test_and_clear(e);
+
+    /* The list was built by pushing at the head */
+    acb = __sync_lock_test_and_set(&s->completed, NULL);
+    while (acb) {
+        next = acb->next;
+        acb->next = list;
+        list = acb;
+        acb = next;
+    }
+
+    for (acb = list; acb; acb = next) {
+        next = acb->next;
+        qemu_gluster_complete_aio(acb, s);
+    }
 }
 
-static int qemu_gluster_aio_flush_cb(void *opaque)
+static int qemu_gluster_aio_flush_cb(EventNotifier *e)
 {
-    BDRVGlusterState *s = opaque;
+    BDRVGlusterState *s = container_of(e, BDRVGlusterState, e);
 
     return (s->qemu_aio_count > 0);
 }
@@ -312,14 +325,13 @@ static int qemu_gluster_open(BlockDriverState *bs, const char *filename,
         goto out;
     }
 
-    ret = qemu_pipe(s->fds);
+    s->completed = NULL;
+    ret = event_notifier_init(&s->e, false);
     if (ret < 0) {
-        ret = -errno;
         goto out;
     }
-    fcntl(s->fds[GLUSTER_FD_READ], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ],
-        qemu_gluster_aio_event_reader, NULL, qemu_gluster_aio_flush_cb, s);
+    qemu_aio_set_event_notifier(&s->e, qemu_gluster_aio_event_reader,
+                                qemu_gluster_aio_flush_cb);
 
 out:
     qemu_gluster_gconf_free(gconf);
@@ -393,38 +405,54 @@ static const AIOCBInfo gluster_aiocb_info = {
     .cancel = qemu_gluster_aio_cancel,
 };
 
+/*
+ * Runs in a gluster thread, so only push the request to the completed list
+ * and leave the rest to qemu_gluster_aio_event_reader().  Only the push
+ * that finds the list empty has to kick the event notifier.
+ */
 static void gluster_finish_aiocb(struct glfs_fd *fd, ssize_t ret, void *arg)
 {
     GlusterAIOCB *acb = (GlusterAIOCB *)arg;
-    BlockDriverState *bs = acb->common.bs;
-    BDRVGlusterState *s = bs->opaque;
-    int retval;
+    BDRVGlusterState *s = acb->common.bs->opaque;
+    GlusterAIOCB *old;
 
     acb->ret = ret;
-    retval = qemu_write_full(s->fds[GLUSTER_FD_WRITE], &acb, sizeof(acb));
-    if (retval != sizeof(acb)) {
-        /*
-         * Gluster AIO callback thread failed to notify the waiting
-         * QEMU thread about IO completion.
-         *
-         * Complete this IO request and make the disk inaccessible for
-         * subsequent reads and writes.
-         */
-        error_report("Gluster failed to notify QEMU about IO completion");
-
-        qemu_mutex_lock_iothread(); /* We are in gluster thread context */
-        acb->common.cb(acb->common.opaque, -EIO);
-        qemu_aio_release(acb);
-        s->qemu_aio_count--;
-        close(s->fds[GLUSTER_FD_READ]);
-        close(s->fds[GLUSTER_FD_WRITE]);
-        qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ], NULL, NULL, NULL,
-            NULL);
-        bs->drv = NULL; /* Make the disk inaccessible */
-        qemu_mutex_unlock_iothread();
+    do {
+        old = s->completed;
+        acb->next = old;
+    } while (!__sync_bool_compare_and_swap(&s->completed, old, acb));
+
+    if (!old) {
+        event_notifier_set(&s->e);
     }
 }
 
+static GlusterAIOCB *qemu_gluster_aio_get(BlockDriverState *bs, int64_t size,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVGlusterState *s = bs->opaque;
+    GlusterAIOCB *acb;
+
+    acb = qemu_aio_get(&gluster_aiocb_info, bs, cb, opaque);
+    acb->size = size;
+    acb->ret = 0;
+    acb->finished = NULL;
+    acb->start_ns = get_clock();
+    s->qemu_aio_count++;
+    s->ops++;
+    return acb;
+}
+
+/* Drop a request that gluster refused to start */
+static void qemu_gluster_aio_put(GlusterAIOCB *acb)
+{
+    BDRVGlusterState *s = acb->common.bs->opaque;
+
+    s->qemu_aio_count--;
+    s->ops--;
+    qemu_aio_release(acb);
+}
+
 static BlockDriverAIOCB *qemu_gluster_aio_rw(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int write)
@@ -437,12 +465,7 @@ static BlockDriverAIOCB *qemu_gluster_aio_rw(BlockDriverState *bs,
 
     offset = sector_num * BDRV_SECTOR_SIZE;
     size = nb_sectors * BDRV_SECTOR_SIZE;
-    s->qemu_aio_count++;
-
-    acb = qemu_aio_get(&gluster_aiocb_info, bs, cb, opaque);
-    acb->size = size;
-    acb->ret = 0;
-    acb->finished = NULL;
+    acb = qemu_gluster_aio_get(bs, size, cb, opaque);
 
     if (write) {
         ret = glfs_pwritev_async(s->fd, qiov->iov, qiov->niov, offset, 0,
@@ -453,14 +476,10 @@ static BlockDriverAIOCB *qemu_gluster_aio_rw(BlockDriverState *bs,
     }
 
     if (ret < 0) {
-        goto out;
+        qemu_gluster_aio_put(acb);
+        return NULL;
     }
     return &acb->common;
-
-out:
-    s->qemu_aio_count--;
-    qemu_aio_release(acb);
-    return NULL;
 }
 
 static BlockDriverAIOCB *qemu_gluster_aio_readv(BlockDriverState *bs,
@@ -484,22 +503,45 @@ static BlockDriverAIOCB *qemu_gluster_aio_flush(BlockDriverState *bs,
     GlusterAIOCB *acb;
     BDRVGlusterState *s = bs->opaque;
 
-    acb = qemu_aio_get(&gluster_aiocb_info, bs, cb, opaque);
-    acb->size = 0;
-    acb->ret = 0;
-    acb->finished = NULL;
-    s->qemu_aio_count++;
-
+    acb = qemu_gluster_aio_get(bs, 0, cb, opaque);
     ret = glfs_fsync_async(s->fd, &gluster_finish_aiocb, acb);
     if (ret < 0) {
-        goto out;
+        qemu_gluster_aio_put(acb);
+        return NULL;
     }
     return &acb->common;
+}
 
-out:
-    s->qemu_aio_count--;
-    qemu_aio_release(acb);
-    return NULL;
+#ifdef CONFIG_GLUSTERFS_DISCARD
+static BlockDriverAIOCB *qemu_gluster_aio_discard(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, BlockDriverCompletionFunc *cb,
+        void *opaque)
+{
+    int ret;
+    GlusterAIOCB *acb;
+    BDRVGlusterState *s = bs->opaque;
+
+    acb = qemu_gluster_aio_get(bs, 0, cb, opaque);
+    ret = glfs_discard_async(s->fd, sector_num * BDRV_SECTOR_SIZE,
+            nb_sectors * BDRV_SECTOR_SIZE, &gluster_finish_aiocb, acb);
+    if (ret < 0) {
+        qemu_gluster_aio_put(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+#endif
+
+static void qemu_gluster_get_stats(const BlockDriverState *bs,
+                                   BlockDeviceStats *stats)
+{
+    BDRVGlusterState *s = bs->opaque;
+
+    stats->has_backend_inflight = stats->has_backend_operations = true;
+    stats->has_backend_total_time_ns = true;
+    stats->backend_inflight = s->qemu_aio_count;
+    stats->backend_operations = s->ops;
+    stats->backend_total_time_ns = s->ops_total_time_ns;
 }
 
 static int64_t qemu_gluster_getlength(BlockDriverState *bs)
@@ -533,9 +575,8 @@ static void qemu_gluster_close(BlockDriverState *bs)
 {
     BDRVGlusterState *s = bs->opaque;
 
-    close(s->fds[GLUSTER_FD_READ]);
-    close(s->fds[GLUSTER_FD_WRITE]);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ], NULL, NULL, NULL, NULL);
+    qemu_aio_set_event_notifier(&s->e, NULL, NULL);
+    event_notifier_cleanup(&s->e);
 
     if (s->fd) {
         glfs_close(s->fd);
@@ -565,6 +606,10 @@ static BlockDriver bdrv_gluster = {
     .bdrv_aio_readv               = qemu_gluster_aio_readv,
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
+#ifdef CONFIG_GLUSTERFS_DISCARD
+    .bdrv_aio_discard             = qemu_gluster_aio_discard,
+#endif
+    .bdrv_get_cache_stats         = qemu_gluster_get_stats,
     .create_options               = qemu_gluster_create_options,
 };
 
@@ -580,6 +625,10 @@ static BlockDriver bdrv_gluster_tcp = {
     .bdrv_aio_readv               = qemu_gluster_aio_readv,
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
+#ifdef CONFIG_GLUSTERFS_DISCARD
+    .bdrv_aio_discard             = qemu_gluster_aio_discard,
+#endif
+    .bdrv_get_cache_stats         = qemu_gluster_get_stats,
     .create_options               = qemu_gluster_create_options,
 };
 
@@ -595,6 +644,10 @@ static BlockDriver bdrv_gluster_unix = {
     .bdrv_aio_readv               = qemu_gluster_aio_readv,
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
+#ifdef CONFIG_GLUSTERFS_DISCARD
+    .bdrv_aio_discard             = qemu_gluster_aio_discard,
+#endif
+    .bdrv_get_cache_stats         = qemu_gluster_get_stats,
     .create_options               = qemu_gluster_create_options,
 };
 
@@ -610,6 +663,10 @@ static BlockDriver bdrv_gluster_rdma = {
     .bdrv_aio_readv               = qemu_gluster_aio_readv,
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
+#ifdef CONFIG_GLUSTERFS_DISCARD
+    .bdrv_aio_discard             = qemu_gluster_aio_discard,
+#endif
+    .bdrv_get_cache_stats         = qemu_gluster_get_stats,
     .create_options               = qemu_gluster_create_options,
 };
 
@@ -41,39 +41,70 @@
 #include <hw/scsi-defs.h>
 #endif
 
+#define ISCSI_MAX_SESSIONS 8
+
+struct IscsiLun;
+
+typedef struct IscsiSession {
+    struct IscsiLun *iscsilun;
+    struct iscsi_context *iscsi;
+    int events;
+} IscsiSession;
+
+typedef struct IscsiAIOCB IscsiAIOCB;
+
 typedef struct IscsiLun {
+    /* sessions[0].iscsi; everything but reads and writes goes there */
     struct iscsi_context *iscsi;
+    IscsiSession sessions[ISCSI_MAX_SESSIONS];
+    int nb_sessions;
+    int next_session;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
+
+    /* Reads and writes past max_outstanding (0 for no limit) wait here */
+    int outstanding;
+    int max_outstanding;
+    QTAILQ_HEAD(, IscsiAIOCB) queued;
 } IscsiLun;
 
-typedef struct IscsiAIOCB {
+struct IscsiAIOCB {
     BlockDriverAIOCB common;
     QEMUIOVector *qiov;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiSession *session;
     struct scsi_task *task;
     uint8_t *buf;
     int status;
     int canceled;
+    int64_t sector_num;
+    int nb_sectors;
+    bool is_write;
+    bool outstanding;
+    bool queued;
+    QTAILQ_ENTRY(IscsiAIOCB) entry;
     size_t read_size;
     size_t read_offset;
 #ifdef __linux__
     sg_io_hdr_t *ioh;
 #endif
-} IscsiAIOCB;
+};
 
 #define NOP_INTERVAL 5000
 #define MAX_NOP_FAILURES 3
 
+static void iscsi_dispatch_queued(IscsiLun *iscsilun);
+
 static void
 iscsi_bh_cb(void *p)
 {
     IscsiAIOCB *acb = p;
+    IscsiLun *iscsilun = acb->iscsilun;
+    bool outstanding = acb->outstanding;
 
     qemu_bh_delete(acb->bh);
 
@@ -90,6 +121,11 @@ iscsi_bh_cb(void *p)
     }
 
     qemu_aio_release(acb);
+
+    if (outstanding) {
+        iscsilun->outstanding--;
+        iscsi_dispatch_queued(iscsilun);
+    }
 }
 
 static void
@@ -125,8 +161,17 @@ iscsi_aio_cancel(BlockDriverAIOCB *blockacb)
 
     acb->canceled = 1;
 
+    /* still queued, nothing was sent */
+    if (acb->queued) {
+        QTAILQ_REMOVE(&iscsilun->queued, acb, entry);
+        acb->queued = false;
+        acb->status = -ECANCELED;
+        iscsi_schedule_bh(acb);
+        return;
+    }
+
     /* send a task mgmt call to the target to cancel the task on the target */
-    iscsi_task_mgmt_abort_task_async(iscsilun->iscsi, acb->task,
+    iscsi_task_mgmt_abort_task_async(acb->session->iscsi, acb->task,
                                      iscsi_abort_task_cb, acb);
 
     while (acb->status == -EINPROGRESS) {
@@ -145,50 +190,50 @@ static void iscsi_process_write(void *arg);
 
 static int iscsi_process_flush(void *arg)
 {
-    IscsiLun *iscsilun = arg;
+    IscsiSession *session = arg;
 
-    return iscsi_queue_length(iscsilun->iscsi) > 0;
+    return iscsi_queue_length(session->iscsi) > 0;
 }
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev;
 
     /* We always register a read handler.  */
     ev = POLLIN;
     ev |= iscsi_which_events(iscsi);
-    if (ev != iscsilun->events) {
+    if (ev != session->events) {
         qemu_aio_set_fd_handler(iscsi_get_fd(iscsi),
                       iscsi_process_read,
                       (ev & POLLOUT) ? iscsi_process_write : NULL,
                       iscsi_process_flush,
-                      iscsilun);
+                      session);
 
     }
 
-    iscsilun->events = ev;
+    session->events = ev;
 }
 
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
 }
 
 
@@ -222,15 +267,11 @@ static int64_t sector_qemu2lun(int64_t sector, IscsiLun *iscsilun)
     return sector * BDRV_SECTOR_SIZE / iscsilun->block_size;
 }
 
-static BlockDriverAIOCB *
-iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
-                 QEMUIOVector *qiov, int nb_sectors,
-                 BlockDriverCompletionFunc *cb,
-                 void *opaque)
+static int
+iscsi_aio_writev_submit(IscsiAIOCB *acb)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
-    IscsiAIOCB *acb;
+    IscsiLun *iscsilun = acb->iscsilun;
+    struct iscsi_context *iscsi = acb->session->iscsi;
     size_t size;
     uint32_t num_sectors;
     uint64_t lba;
@@ -239,19 +280,8 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
 #endif
     int ret;
 
-    acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
-    trace_iscsi_aio_writev(iscsi, sector_num, nb_sectors, opaque, acb);
-
-    acb->iscsilun = iscsilun;
-    acb->qiov     = qiov;
-
-    acb->canceled   = 0;
-    acb->bh         = NULL;
-    acb->status     = -EINPROGRESS;
-    acb->buf        = NULL;
-
     /* this will allow us to get rid of 'buf' completely */
-    size = nb_sectors * BDRV_SECTOR_SIZE;
+    size = acb->nb_sectors * BDRV_SECTOR_SIZE;
 
 #if !defined(LIBISCSI_FEATURE_IOVECTOR)
     data.size = MIN(size, acb->qiov->size);
@@ -270,15 +300,16 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
     if (acb->task == NULL) {
         error_report("iSCSI: Failed to allocate task for scsi WRITE16 "
                      "command. %s", iscsi_get_error(iscsi));
-        qemu_aio_release(acb);
-        return NULL;
+        g_free(acb->buf);
+        acb->buf = NULL;
+        return -ENOMEM;
     }
     memset(acb->task, 0, sizeof(struct scsi_task));
 
     acb->task->xfer_dir = SCSI_XFER_WRITE;
     acb->task->cdb_size = 16;
     acb->task->cdb[0] = 0x8a;
-    lba = sector_qemu2lun(sector_num, iscsilun);
+    lba = sector_qemu2lun(acb->sector_num, iscsilun);
     *(uint32_t *)&acb->task->cdb[2]  = htonl(lba >> 32);
     *(uint32_t *)&acb->task->cdb[6]  = htonl(lba & 0xffffffff);
     num_sectors = size / iscsilun->block_size;
@@ -298,18 +329,17 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
 #endif
     if (ret != 0) {
         scsi_free_scsi_task(acb->task);
+        acb->task = NULL;
         g_free(acb->buf);
-        qemu_aio_release(acb);
-        return NULL;
+        acb->buf = NULL;
+        return -EIO;
     }
 
 #if defined(LIBISCSI_FEATURE_IOVECTOR)
     scsi_task_set_iov_out(acb->task, (struct scsi_iovec*) acb->qiov->iov, acb->qiov->niov);
 #endif
 
-    iscsi_set_events(iscsilun);
-
-    return &acb->common;
+    return 0;
 }
 
 static void
@@ -334,15 +364,11 @@ iscsi_aio_read16_cb(struct iscsi_context *iscsi, int status,
     iscsi_schedule_bh(acb);
 }
 
-static BlockDriverAIOCB *
-iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
-                QEMUIOVector *qiov, int nb_sectors,
-                BlockDriverCompletionFunc *cb,
-                void *opaque)
+static int
+iscsi_aio_readv_submit(IscsiAIOCB *acb)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
-    IscsiAIOCB *acb;
+    IscsiLun *iscsilun = acb->iscsilun;
+    struct iscsi_context *iscsi = acb->session->iscsi;
     size_t qemu_read_size;
 #if !defined(LIBISCSI_FEATURE_IOVECTOR)
     int i;
@@ -351,19 +377,8 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
     uint64_t lba;
     uint32_t num_sectors;
 
-    qemu_read_size = BDRV_SECTOR_SIZE * (size_t)nb_sectors;
-
-    acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
-    trace_iscsi_aio_readv(iscsi, sector_num, nb_sectors, opaque, acb);
-
-    acb->iscsilun = iscsilun;
-    acb->qiov     = qiov;
-
-    acb->canceled    = 0;
-    acb->bh          = NULL;
-    acb->status      = -EINPROGRESS;
-    acb->read_size   = qemu_read_size;
-    acb->buf         = NULL;
+    qemu_read_size = BDRV_SECTOR_SIZE * (size_t)acb->nb_sectors;
+    acb->read_size = qemu_read_size;
 
     /* If LUN blocksize is bigger than BDRV_BLOCK_SIZE a read from QEMU
      * may be misaligned to the LUN, so we may need to read some extra
@@ -371,7 +386,7 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
      */
     acb->read_offset = 0;
     if (iscsilun->block_size > BDRV_SECTOR_SIZE) {
-        uint64_t bdrv_offset = BDRV_SECTOR_SIZE * sector_num;
+        uint64_t bdrv_offset = BDRV_SECTOR_SIZE * acb->sector_num;
 
         acb->read_offset  = bdrv_offset % iscsilun->block_size;
     }
@@ -384,13 +399,12 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
     if (acb->task == NULL) {
         error_report("iSCSI: Failed to allocate task for scsi READ16 "
                      "command. %s", iscsi_get_error(iscsi));
-        qemu_aio_release(acb);
-        return NULL;
+        return -ENOMEM;
     }
     memset(acb->task, 0, sizeof(struct scsi_task));
 
     acb->task->xfer_dir = SCSI_XFER_READ;
-    lba = sector_qemu2lun(sector_num, iscsilun);
+    lba = sector_qemu2lun(acb->sector_num, iscsilun);
     acb->task->expxferlen = qemu_read_size;
 
     switch (iscsilun->type) {
@@ -415,8 +429,8 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                    acb);
     if (ret != 0) {
         scsi_free_scsi_task(acb->task);
-        qemu_aio_release(acb);
-        return NULL;
+        acb->task = NULL;
+        return -EIO;
     }
 
 #if defined(LIBISCSI_FEATURE_IOVECTOR)
@@ -429,11 +443,116 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
     }
 #endif
 
-    iscsi_set_events(iscsilun);
+    return 0;
+}
+
+/* Send a read or write on the next session, round robin */
+static int
+iscsi_start_rw(IscsiAIOCB *acb)
+{
+    IscsiLun *iscsilun = acb->iscsilun;
+    int ret;
+
+    acb->session = &iscsilun->sessions[iscsilun->next_session];
+    iscsilun->next_session = (iscsilun->next_session + 1) %
+                             iscsilun->nb_sessions;
+
+    if (acb->is_write) {
+        ret = iscsi_aio_writev_submit(acb);
+    } else {
+        ret = iscsi_aio_readv_submit(acb);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    acb->outstanding = true;
+    iscsilun->outstanding++;
+    iscsi_set_events(acb->session);
+    return 0;
+}
+
+static void
+iscsi_dispatch_queued(IscsiLun *iscsilun)
+{
+    IscsiAIOCB *acb;
+
+    while ((acb = QTAILQ_FIRST(&iscsilun->queued)) != NULL &&
+           (!iscsilun->max_outstanding ||
+            iscsilun->outstanding < iscsilun->max_outstanding)) {
+        QTAILQ_REMOVE(&iscsilun->queued, acb, entry);
+        acb->queued = false;
+        if (iscsi_start_rw(acb) < 0) {
+            acb->status = -EIO;
+            iscsi_schedule_bh(acb);
+        }
+    }
+}
 
+static BlockDriverAIOCB *
+iscsi_aio_rw(BlockDriverState *bs, int64_t sector_num,
+             QEMUIOVector *qiov, int nb_sectors,
+             BlockDriverCompletionFunc *cb,
+             void *opaque, bool is_write)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    IscsiAIOCB *acb;
+
+    acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
+    if (is_write) {
+        trace_iscsi_aio_writev(iscsilun->iscsi, sector_num, nb_sectors,
+                               opaque, acb);
+    } else {
+        trace_iscsi_aio_readv(iscsilun->iscsi, sector_num, nb_sectors,
+                              opaque, acb);
+    }
+
+    acb->iscsilun    = iscsilun;
+    acb->qiov        = qiov;
+    acb->sector_num  = sector_num;
+    acb->nb_sectors  = nb_sectors;
+    acb->is_write    = is_write;
+    acb->outstanding = false;
+    acb->queued      = false;
+    acb->task        = NULL;
+
+    acb->canceled    = 0;
+    acb->bh          = NULL;
+    acb->status      = -EINPROGRESS;
+    acb->buf         = NULL;
+
+    if (iscsilun->max_outstanding &&
+        iscsilun->outstanding >= iscsilun->max_outstanding) {
+        QTAILQ_INSERT_TAIL(&iscsilun->queued, acb, entry);
+        acb->queued = true;
+        return &acb->common;
+    }
+
+    if (iscsi_start_rw(acb) < 0) {
+        qemu_aio_release(acb);
+        return NULL;
+    }
     return &acb->common;
 }
 
+static BlockDriverAIOCB *
+iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                 QEMUIOVector *qiov, int nb_sectors,
+                 BlockDriverCompletionFunc *cb,
+                 void *opaque)
+{
+    return iscsi_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque, true);
+}
+
+static BlockDriverAIOCB *
+iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
+                QEMUIOVector *qiov, int nb_sectors,
+                BlockDriverCompletionFunc *cb,
+                void *opaque)
+{
+    return iscsi_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque, false);
+}
+
 
 static void
 iscsi_synccache10_cb(struct iscsi_context *iscsi, int status,
@@ -466,6 +585,9 @@ iscsi_aio_flush(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->session  = &iscsilun->sessions[0];
+    acb->outstanding = false;
+    acb->queued   = false;
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
@@ -482,7 +604,7 @@ iscsi_aio_flush(BlockDriverState *bs,
         return NULL;
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(acb->session);
 
     return &acb->common;
 }
@@ -520,6 +642,9 @@ iscsi_aio_discard(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->session  = &iscsilun->sessions[0];
+    acb->outstanding = false;
+    acb->queued   = false;
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
@@ -539,7 +664,7 @@ iscsi_aio_discard(BlockDriverState *bs,
         return NULL;
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(acb->session);
 
     return &acb->common;
 }
@@ -596,6 +721,9 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->session  = &iscsilun->sessions[0];
+    acb->outstanding = false;
+    acb->queued   = false;
     acb->canceled    = 0;
     acb->bh          = NULL;
     acb->status      = -EINPROGRESS;
@@ -648,7 +776,7 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
                                      acb->ioh->dxferp);
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(acb->session);
 
     return &acb->common;
 }
@@ -803,71 +931,74 @@ static char *parse_initiator_name(const char *target)
     }
 }
 
+static int parse_num_opt(const char *target, const char *name, int def)
+{
+    QemuOptsList *list;
+    QemuOpts *opts;
+
+    list = qemu_find_opts("iscsi");
+    if (!list) {
+        return def;
+    }
+
+    opts = qemu_opts_find(list, target);
+    if (opts == NULL) {
+        opts = QTAILQ_FIRST(&list->head);
+        if (!opts) {
+            return def;
+        }
+    }
+
+    return qemu_opt_get_number(opts, name, def);
+}
+
 #if defined(LIBISCSI_FEATURE_NOP_COUNTER)
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) > MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsi_reconnect(iscsilun->iscsi);
-    }
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
 
-    if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+        if (iscsi_get_nops_in_flight(session->iscsi) > MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            iscsi_reconnect(session->iscsi);
+        }
+
+        if (iscsi_nop_out_async(session->iscsi, NULL, NULL, 0, NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            return;
+        }
+        iscsi_set_events(session);
     }
 
     qemu_mod_timer(iscsilun->nop_timer, qemu_get_clock_ms(rt_clock) + NOP_INTERVAL);
-    iscsi_set_events(iscsilun);
 }
 #endif
 
 /*
- * We support iscsi url's on the form
- * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ * Log in to the target of @iscsi_url.  Each call opens a session of its
+ * own; the target tells them apart by their ISID.
  */
-static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
+static int iscsi_connect_session(struct iscsi_url *iscsi_url,
+                                 const char *initiator_name,
+                                 struct iscsi_context **piscsi)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = NULL;
-    struct iscsi_url *iscsi_url = NULL;
-    struct scsi_task *task = NULL;
-    struct scsi_inquiry_standard *inq = NULL;
-    struct scsi_readcapacity10 *rc10 = NULL;
-    struct scsi_readcapacity16 *rc16 = NULL;
-    char *initiator_name = NULL;
+    struct iscsi_context *iscsi;
     int ret;
 
-    if ((BDRV_SECTOR_SIZE % 512) != 0) {
-        error_report("iSCSI: Invalid BDRV_SECTOR_SIZE. "
-                     "BDRV_SECTOR_SIZE(%lld) is not a multiple "
-                     "of 512", BDRV_SECTOR_SIZE);
-        return -EINVAL;
-    }
-
-    iscsi_url = iscsi_parse_full_url(iscsi, filename);
-    if (iscsi_url == NULL) {
-        error_report("Failed to parse URL : %s", filename);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    memset(iscsilun, 0, sizeof(IscsiLun));
-
-    initiator_name = parse_initiator_name(iscsi_url->target);
-
     iscsi = iscsi_create_context(initiator_name);
     if (iscsi == NULL) {
         error_report("iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
+        return -ENOMEM;
     }
 
     if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
         error_report("iSCSI: Failed to set target name.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_url->user != NULL) {
@@ -876,7 +1007,7 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
         if (ret != 0) {
             error_report("Failed to set initiator username and password");
             ret = -EINVAL;
-            goto out;
+            goto fail;
         }
     }
 
@@ -884,13 +1015,13 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
     if (parse_chap(iscsi, iscsi_url->target) != 0) {
         error_report("iSCSI: Failed to set CHAP user/password");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
         error_report("iSCSI: Failed to set session type to normal.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
@@ -902,9 +1033,98 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
         error_report("iSCSI: Failed to connect to LUN : %s",
             iscsi_get_error(iscsi));
         ret = -EINVAL;
+        goto fail;
+    }
+
+    *piscsi = iscsi;
+    return 0;
+
+fail:
+    iscsi_destroy_context(iscsi);
+    return ret;
+}
+
+static void iscsi_destroy_sessions(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
+
+        if (iscsilun->sessions[i].events) {
+            qemu_aio_set_fd_handler(iscsi_get_fd(iscsi), NULL, NULL, NULL,
+                                    NULL);
+        }
+        iscsi_destroy_context(iscsi);
+    }
+    iscsilun->nb_sessions = 0;
+    iscsilun->iscsi = NULL;
+}
+
+/*
+ * We support iscsi url's on the form
+ * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ */
+static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct iscsi_context *iscsi = NULL;
+    struct iscsi_url *iscsi_url = NULL;
+    struct scsi_task *task = NULL;
+    struct scsi_inquiry_standard *inq = NULL;
+    struct scsi_readcapacity10 *rc10 = NULL;
+    struct scsi_readcapacity16 *rc16 = NULL;
+    char *initiator_name = NULL;
+    int nb_sessions;
+    int ret;
+
+    if ((BDRV_SECTOR_SIZE % 512) != 0) {
+        error_report("iSCSI: Invalid BDRV_SECTOR_SIZE. "
+                     "BDRV_SECTOR_SIZE(%lld) is not a multiple "
+                     "of 512", BDRV_SECTOR_SIZE);
+        return -EINVAL;
+    }
+
+    iscsi_url = iscsi_parse_full_url(iscsi, filename);
+    if (iscsi_url == NULL) {
+        error_report("Failed to parse URL : %s", filename);
+        ret = -EINVAL;
         goto out;
     }
 
+    memset(iscsilun, 0, sizeof(IscsiLun));
+
+    initiator_name = parse_initiator_name(iscsi_url->target);
+
+    nb_sessions = parse_num_opt(iscsi_url->target, "sessions", 1);
+    if (nb_sessions < 1 || nb_sessions > ISCSI_MAX_SESSIONS) {
+        error_report("iSCSI: sessions must be between 1 and %d",
+                     ISCSI_MAX_SESSIONS);
+        ret = -EINVAL;
+        goto out;
+    }
+    iscsilun->max_outstanding = parse_num_opt(iscsi_url->target,
+                                              "max-outstanding", 0);
+    if (iscsilun->max_outstanding < 0) {
+        error_report("iSCSI: max-outstanding must not be negative");
+        ret = -EINVAL;
+        goto out;
+    }
+    QTAILQ_INIT(&iscsilun->queued);
+
+    while (iscsilun->nb_sessions < nb_sessions) {
+        IscsiSession *session = &iscsilun->sessions[iscsilun->nb_sessions];
+
+        ret = iscsi_connect_session(iscsi_url, initiator_name,
+                                    &session->iscsi);
+        if (ret < 0) {
+            goto out;
+        }
+        session->iscsilun = iscsilun;
+        iscsilun->nb_sessions++;
+    }
+
+    iscsi = iscsilun->sessions[0].iscsi;
     iscsilun->iscsi = iscsi;
     iscsilun->lun   = iscsi_url->lun;
 
@@ -1001,9 +1221,7 @@ out:
     }
 
     if (ret) {
-        if (iscsi != NULL) {
-            iscsi_destroy_context(iscsi);
-        }
+        iscsi_destroy_sessions(iscsilun);
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
     return ret;
@@ -1012,14 +1230,12 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
 
     if (iscsilun->nop_timer) {
         qemu_del_timer(iscsilun->nop_timer);
         qemu_free_timer(iscsilun->nop_timer);
     }
-    qemu_aio_set_fd_handler(iscsi_get_fd(iscsi), NULL, NULL, NULL, NULL);
-    iscsi_destroy_context(iscsi);
+    iscsi_destroy_sessions(iscsilun);
     memset(iscsilun, 0, sizeof(IscsiLun));
 }
 
@@ -1066,9 +1282,7 @@ static int iscsi_create(const char *filename, QEMUOptionParameter *options)
 
     ret = 0;
 out:
-    if (iscsilun->iscsi != NULL) {
-        iscsi_destroy_context(iscsilun->iscsi);
-    }
+    iscsi_destroy_sessions(iscsilun);
     g_free(bs.opaque);
     return ret;
 }
@@ -1128,6 +1342,16 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "initiator-name",
             .type = QEMU_OPT_STRING,
             .help = "Initiator iqn name to use when connecting",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions to open per LUN, reads and writes "
+                    "are spread over them round robin",
+        },{
+            .name = "max-outstanding",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of reads and writes in flight per LUN, "
+                    "0 for no limit",
         },
         { /* end of list */ }
     },
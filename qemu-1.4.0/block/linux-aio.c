@@ -12,6 +12,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "trace.h"
 
 #include <libaio.h>
 
@@ -25,6 +26,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Requests held back while plugged, before they are handed to io_submit() */
+#define MAX_QUEUED_IO 128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -36,10 +40,17 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+typedef struct {
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    int plugged;
+    unsigned int idx;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
     int count;
+    LaioQueue io_q;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -77,6 +88,74 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+/*
+ * Submits all queued requests with as few io_submit() calls as the kernel
+ * allows.  Requests it refuses are completed with the error right away.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    LaioQueue *q = &s->io_q;
+    unsigned int done = 0;
+    int ret = 0;
+
+    while (done < q->idx) {
+        do {
+            ret = io_submit(s->ctx, q->idx - done, &q->iocbs[done]);
+        } while (ret == -EINTR);
+
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    trace_laio_submit_batch(s, q->idx, done);
+
+    /* Fail whatever could not be submitted */
+    for (; done < q->idx; done++) {
+        struct qemu_laiocb *laiocb =
+                container_of(q->iocbs[done], struct qemu_laiocb, iocb);
+
+        laiocb->ret = (ret < 0) ? ret : -EIO;
+        qemu_laio_process_completion(s, laiocb);
+    }
+    q->idx = 0;
+}
+
+static void ioq_enqueue(struct qemu_laio_state *s, struct iocb *iocb)
+{
+    LaioQueue *q = &s->io_q;
+
+    /* Make room first, so that a failure can't complete the new request
+     * before laio_submit() returns it */
+    if (q->idx == MAX_QUEUED_IO) {
+        ioq_submit(s);
+    }
+    q->iocbs[q->idx++] = iocb;
+}
+
+/*
+ * Between laio_io_plug() and laio_io_unplug(), requests are only queued and
+ * then passed to the kernel together, so that a device model that starts
+ * several requests at once pays for a single system call.  Plugs nest.
+ */
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+}
+
 static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
@@ -105,18 +184,37 @@ static int qemu_laio_flush_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
+    /* Whoever waits for requests to finish must not wait for an unplug */
+    if (s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+
     return (s->count > 0) ? 1 : 0;
 }
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    LaioQueue *q = &laiocb->ctx->io_q;
     struct io_event event;
+    unsigned int i;
     int ret;
 
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* Requests still waiting in the plug queue were never submitted */
+    for (i = 0; i < q->idx; i++) {
+        if (q->iocbs[i] == &laiocb->iocb) {
+            memmove(&q->iocbs[i], &q->iocbs[i + 1],
+                    (q->idx - i - 1) * sizeof(q->iocbs[0]));
+            q->idx--;
+            laiocb->ctx->count--;
+            qemu_aio_release(laiocb);
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -179,6 +277,11 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
     s->count++;
 
+    if (s->io_q.plugged) {
+        ioq_enqueue(s, iocbs);
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
@@ -0,0 +1,220 @@
+/*
+ * Asynchronous SG_IO for Linux sg devices
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/raw-aio.h"
+#include "trace.h"
+
+#include <sys/ioctl.h>
+#include <scsi/sg.h>
+
+/*
+ * /dev/sg* devices accept sg_io_hdr_t commands with write() and return
+ * them with read() once they complete.  This lets many passthrough
+ * commands be in flight without tying up a thread-pool worker for each
+ * one, as the SG_IO ioctl does.
+ *
+ * The sg driver queues at most SG_MAX_QUEUE commands per file descriptor.
+ * Any others wait in s->waiting and are written as earlier ones finish.
+ */
+
+struct qemu_sgaiocb {
+    BlockDriverAIOCB common;
+    struct qemu_sg_state *s;
+    sg_io_hdr_t *hdr;       /* the caller's, updated on completion */
+    void *usr_ptr;          /* the caller's hdr->usr_ptr, ours is the ACB */
+    bool *done;             /* set on completion, for sg_aio_cancel() */
+    QSIMPLEQ_ENTRY(qemu_sgaiocb) next;
+};
+
+struct qemu_sg_state {
+    int fd;
+    int inflight;
+    QSIMPLEQ_HEAD(, qemu_sgaiocb) waiting;
+};
+
+static void qemu_sg_complete(struct qemu_sgaiocb *acb, int ret)
+{
+    trace_sg_aio_complete(acb->s, acb, ret);
+    if (acb->done) {
+        *acb->done = true;
+    }
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+/*
+ * Hand @acb to the kernel.  Returns 0 on success, -EAGAIN if the sg queue
+ * is full and the command must wait, or another -errno on failure.
+ */
+static int qemu_sg_write(struct qemu_sg_state *s, struct qemu_sgaiocb *acb)
+{
+    sg_io_hdr_t hdr = *acb->hdr;
+    ssize_t len;
+
+    if (s->inflight >= SG_MAX_QUEUE) {
+        return -EAGAIN;
+    }
+
+    hdr.usr_ptr = acb;
+    do {
+        len = write(s->fd, &hdr, sizeof(hdr));
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0) {
+        /* The driver could not get a request slot; only worth retrying
+         * if a completion is going to free one.
+         */
+        if ((errno == EAGAIN || errno == EDOM) && s->inflight > 0) {
+            return -EAGAIN;
+        }
+        return -errno;
+    }
+    s->inflight++;
+    return 0;
+}
+
+static void qemu_sg_submit_waiting(struct qemu_sg_state *s)
+{
+    struct qemu_sgaiocb *acb;
+    int ret;
+
+    while ((acb = QSIMPLEQ_FIRST(&s->waiting)) != NULL) {
+        ret = qemu_sg_write(s, acb);
+        if (ret == -EAGAIN) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&s->waiting, next);
+        if (ret < 0) {
+            qemu_sg_complete(acb, ret);
+        }
+    }
+}
+
+static void qemu_sg_completion_cb(void *opaque)
+{
+    struct qemu_sg_state *s = opaque;
+    struct qemu_sgaiocb *acb;
+    sg_io_hdr_t hdr;
+    ssize_t len;
+
+    while (s->inflight > 0) {
+        do {
+            len = read(s->fd, &hdr, sizeof(hdr));
+        } while (len < 0 && errno == EINTR);
+        if (len != sizeof(hdr)) {
+            break;
+        }
+
+        s->inflight--;
+        acb = hdr.usr_ptr;
+        hdr.usr_ptr = acb->usr_ptr;
+        *acb->hdr = hdr;
+        qemu_sg_complete(acb, 0);
+    }
+
+    qemu_sg_submit_waiting(s);
+}
+
+static int qemu_sg_flush_cb(void *opaque)
+{
+    struct qemu_sg_state *s = opaque;
+
+    return (s->inflight > 0 || !QSIMPLEQ_EMPTY(&s->waiting)) ? 1 : 0;
+}
+
+static void sg_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    struct qemu_sgaiocb *acb = (struct qemu_sgaiocb *)blockacb;
+    struct qemu_sgaiocb *w;
+    struct qemu_sg_state *s = acb->s;
+    bool done = false;
+
+    /* Commands that the kernel has not seen yet can simply be dropped */
+    QSIMPLEQ_FOREACH(w, &s->waiting, next) {
+        if (w == acb) {
+            QSIMPLEQ_REMOVE(&s->waiting, acb, qemu_sgaiocb, next);
+            qemu_aio_release(acb);
+            return;
+        }
+    }
+
+    /* The sg driver cannot abort a command, so wait for it to complete */
+    acb->done = &done;
+    while (!done) {
+        qemu_aio_wait();
+    }
+}
+
+static const AIOCBInfo sg_aiocb_info = {
+    .aiocb_size         = sizeof(struct qemu_sgaiocb),
+    .cancel             = sg_aio_cancel,
+};
+
+/*
+ * Start @hdr, which must be a complete SG_IO request.  Returns NULL if the
+ * command could not even be queued, so that the caller can fall back to
+ * the ioctl.
+ */
+BlockDriverAIOCB *sg_aio_submit(BlockDriverState *bs, void *sg_ctx,
+                                sg_io_hdr_t *hdr,
+                                BlockDriverCompletionFunc *cb, void *opaque)
+{
+    struct qemu_sg_state *s = sg_ctx;
+    struct qemu_sgaiocb *acb;
+    int ret;
+
+    acb = qemu_aio_get(&sg_aiocb_info, bs, cb, opaque);
+    acb->s = s;
+    acb->hdr = hdr;
+    acb->usr_ptr = hdr->usr_ptr;
+    acb->done = NULL;
+
+    /* Keep the command order even when the kernel queue is full */
+    ret = QSIMPLEQ_EMPTY(&s->waiting) ? qemu_sg_write(s, acb) : -EAGAIN;
+    trace_sg_aio_submit(s, acb, hdr->cmdp[0], hdr->dxfer_len, ret);
+    if (ret == -EAGAIN) {
+        QSIMPLEQ_INSERT_TAIL(&s->waiting, acb, next);
+    } else if (ret < 0) {
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+
+void *sg_aio_init(int fd)
+{
+    struct qemu_sg_state *s;
+    int version, flags;
+
+    /* The asynchronous interface with sg_io_hdr_t needs sg version 3 */
+    if (ioctl(fd, SG_GET_VERSION_NUM, &version) < 0 || version < 30000) {
+        return NULL;
+    }
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->fd = fd;
+    QSIMPLEQ_INIT(&s->waiting);
+    qemu_aio_set_fd_handler(fd, qemu_sg_completion_cb, NULL,
+                            qemu_sg_flush_cb, s);
+    return s;
+}
+
+void sg_aio_cleanup(void *sg_ctx)
+{
+    struct qemu_sg_state *s = sg_ctx;
+
+    /* bdrv_close() drained all requests already */
+    assert(s->inflight == 0 && QSIMPLEQ_EMPTY(&s->waiting));
+    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL);
+    g_free(s);
+}
@@ -18,7 +18,16 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define MAX_IN_FLIGHT 64
+
+/* Largest single copy operation.  Adjacent dirty chunks are merged up to
+ * this size; above it, splitting the work lets more operations overlap
+ * instead of one request eating the whole buffer.
+ */
+#define MAX_IO_SECTORS ((1 << 20) >> BDRV_SECTOR_BITS)
+
+/* Buffer for committing the active layer, same as drive-mirror's default */
+#define COMMIT_ACTIVE_BUF_SIZE (10 << 20)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -31,6 +40,9 @@ typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *target;
+    BlockDriverState *base;     /* copy only what is allocated above it */
+    bool is_commit;             /* committing the active layer into @base */
+    int orig_base_flags;
     MirrorSyncMode mode;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
@@ -47,6 +59,21 @@ typedef struct MirrorBlockJob {
     unsigned long *in_flight_bitmap;
     int in_flight;
     int ret;
+
+    /* Current cap on the size of a MirrorOp, between one chunk and
+     * MAX_IO_SECTORS.  It shrinks while the guest dirties the disk about
+     * as fast as we copy it, and grows back when it does not.
+     */
+    int max_io_sectors;
+
+    /* Rate sampling, refreshed every SLICE_TIME by mirror_update_rates */
+    int64_t last_sample_ns;
+    int64_t last_dirty_count;
+    int64_t sectors_reset;
+    int64_t sectors_copied;
+    double dirty_rate;          /* sectors per second */
+    double copy_rate;           /* sectors per second */
+    int64_t eta;                /* seconds, or -1 if not converging */
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -111,6 +138,8 @@ static void mirror_write_complete(void *opaque, int ret)
         if (action == BDRV_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
         }
+    } else {
+        s->sectors_copied += op->nb_sectors;
     }
     mirror_iteration_done(op, ret);
 }
@@ -141,6 +170,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     BlockDriverState *source = s->common.bs;
     int nb_sectors, sectors_per_chunk, nb_chunks;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    int64_t dirty_count;
     MirrorOp *op;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
@@ -167,7 +197,9 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
      *
      * We also want to extend the QEMUIOVector to include more adjacent
      * dirty blocks if possible, to limit the number of I/O operations and
-     * run efficiently even with a small granularity.
+     * run efficiently even with a small granularity.  This stops at
+     * s->max_io_sectors, so that the next dirty area can be read while
+     * this one is being written.
      */
     nb_chunks = 0;
     nb_sectors = 0;
@@ -207,6 +239,9 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
         added_sectors = MIN(added_sectors, end - (sector_num + nb_sectors));
         added_chunks = (added_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
+        if (nb_sectors > 0 && nb_sectors + added_sectors > s->max_io_sectors) {
+            break;
+        }
 
         /* When doing COW, it may happen that there is not enough space for
          * a full cluster.  Wait if that is the case.
@@ -256,7 +291,9 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         next_sector += sectors_per_chunk;
     }
 
+    dirty_count = bdrv_get_dirty_count(source);
     bdrv_reset_dirty(source, sector_num, nb_sectors);
+    s->sectors_reset += dirty_count - bdrv_get_dirty_count(source);
 
     /* Copy the dirty cluster.  */
     s->in_flight++;
@@ -282,6 +319,56 @@ static void mirror_free_init(MirrorBlockJob *s)
     }
 }
 
+/* Sample the copy and dirty rates, resize s->max_io_sectors accordingly
+ * and recompute the convergence estimate.  @cnt is the current dirty count.
+ */
+static void mirror_update_rates(MirrorBlockJob *s, int64_t cnt)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int64_t elapsed = now - s->last_sample_ns;
+    int64_t dirtied;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+
+    if (elapsed < SLICE_TIME) {
+        return;
+    }
+
+    /* Whatever left the bitmap because we picked it up, plus the growth
+     * of the bitmap, is what the guest wrote in the meanwhile.
+     */
+    dirtied = MAX(cnt - s->last_dirty_count + s->sectors_reset, 0);
+    s->dirty_rate = (s->dirty_rate + dirtied * 1e9 / elapsed) / 2;
+    s->copy_rate = (s->copy_rate + s->sectors_copied * 1e9 / elapsed) / 2;
+
+    s->last_sample_ns = now;
+    s->last_dirty_count = cnt;
+    s->sectors_reset = 0;
+    s->sectors_copied = 0;
+
+    /* A large copy of a hot area is likely to be redirtied before it
+     * completes, and it holds every chunk it covers in the in-flight
+     * bitmap meanwhile.  Copy smaller pieces when the guest is writing
+     * at more than half our speed.
+     */
+    if (s->dirty_rate * 2 > s->copy_rate) {
+        s->max_io_sectors = MAX(s->max_io_sectors / 2, sectors_per_chunk);
+    } else if (s->dirty_rate * 8 < s->copy_rate) {
+        s->max_io_sectors = MIN(s->max_io_sectors * 2,
+                                MAX(MAX_IO_SECTORS, sectors_per_chunk));
+    }
+
+    if (cnt == 0 && s->in_flight == 0) {
+        s->eta = 0;
+    } else if (s->copy_rate > s->dirty_rate) {
+        s->eta = (cnt + s->in_flight * s->max_io_sectors) /
+                 (s->copy_rate - s->dirty_rate) + 1;
+    } else {
+        s->eta = -1;
+    }
+    trace_mirror_update_rates(s, (int64_t)s->dirty_rate,
+                              (int64_t)s->copy_rate, s->max_io_sectors, s->eta);
+}
+
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
@@ -334,11 +421,9 @@ static void coroutine_fn mirror_run(void *opaque)
 
     if (s->mode != MIRROR_SYNC_MODE_NONE) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
-        BlockDriverState *base;
-        base = s->mode == MIRROR_SYNC_MODE_FULL ? NULL : bs->backing_hd;
         for (sector_num = 0; sector_num < end; ) {
             int64_t next = (sector_num | (sectors_per_chunk - 1)) + 1;
-            ret = bdrv_co_is_allocated_above(bs, base,
+            ret = bdrv_co_is_allocated_above(bs, s->base,
                                              sector_num, next - sector_num, &n);
 
             if (ret < 0) {
@@ -357,6 +442,8 @@ static void coroutine_fn mirror_run(void *opaque)
 
     bdrv_dirty_iter_init(bs, &s->hbi);
     last_pause_ns = qemu_get_clock_ns(rt_clock);
+    s->last_sample_ns = last_pause_ns;
+    s->last_dirty_count = bdrv_get_dirty_count(bs);
     for (;;) {
         uint64_t delay_ns;
         int64_t cnt;
@@ -387,6 +474,8 @@ static void coroutine_fn mirror_run(void *opaque)
             }
         }
 
+        mirror_update_rates(s, cnt);
+
         should_complete = false;
         if (s->in_flight == 0 && cnt == 0) {
             trace_mirror_before_flush(s);
@@ -433,10 +522,10 @@ static void coroutine_fn mirror_run(void *opaque)
             /* Publish progress */
             s->common.offset = (end - cnt) * BDRV_SECTOR_SIZE;
 
-            if (s->common.speed) {
+            delay_ns = block_job_bandwidth_delay(&s->common,
+                                                 sectors_per_chunk);
+            if (delay_ns == 0 && s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, sectors_per_chunk);
-            } else {
-                delay_ns = 0;
             }
 
             block_job_sleep_ns(&s->common, rt_clock, delay_ns);
@@ -450,7 +539,7 @@ static void coroutine_fn mirror_run(void *opaque)
             /* The two disks are in sync.  Exit and report successful
              * completion.
              */
-            assert(QLIST_EMPTY(&bs->tracked_requests));
+            assert(interval_tree_empty(&bs->tracked_requests));
             s->common.cancelled = false;
             break;
         }
@@ -477,7 +566,21 @@ immediate_exit:
         if (bdrv_get_flags(s->target) != bdrv_get_flags(s->common.bs)) {
             bdrv_reopen(s->target, bdrv_get_flags(s->common.bs), NULL);
         }
+        if (s->is_commit) {
+            /* Unhook the base from the chain, so that after the swap
+             * the old active layer and everything down to the base can
+             * be deleted together below.
+             */
+            bdrv_find_overlay(bs, s->base)->backing_hd = NULL;
+        }
         bdrv_swap(s->target, s->common.bs);
+    } else if (s->is_commit) {
+        /* The base stays in the chain, just give it back its flags */
+        if (s->orig_base_flags != bdrv_get_flags(s->base)) {
+            bdrv_reopen(s->base, s->orig_base_flags, NULL);
+        }
+        block_job_completed(&s->common, ret);
+        return;
     }
     bdrv_close(s->target);
     bdrv_delete(s->target);
@@ -507,7 +610,8 @@ static void mirror_complete(BlockJob *job, Error **errp)
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
     int ret;
 
-    ret = bdrv_open_backing_file(s->target);
+    /* When committing, the target is already the bottom of the chain */
+    ret = s->is_commit ? 0 : bdrv_open_backing_file(s->target);
     if (ret < 0) {
         char backing_filename[PATH_MAX];
         bdrv_get_full_backing_filename(s->target, backing_filename,
@@ -524,20 +628,46 @@ static void mirror_complete(BlockJob *job, Error **errp)
     block_job_resume(job);
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (s->eta >= 0) {
+        info->has_eta = true;
+        info->eta = s->eta;
+    }
+    info->has_dirty_bytes = true;
+    info->dirty_bytes = bdrv_get_dirty_count(s->common.bs) * BDRV_SECTOR_SIZE;
+}
+
 static BlockJobType mirror_job_type = {
     .instance_size = sizeof(MirrorBlockJob),
     .job_type      = "mirror",
     .set_speed     = mirror_set_speed,
     .iostatus_reset= mirror_iostatus_reset,
     .complete      = mirror_complete,
+    .query         = mirror_query,
 };
 
-void mirror_start(BlockDriverState *bs, BlockDriverState *target,
-                  int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
-                  BlockdevOnError on_target_error,
-                  BlockDriverCompletionFunc *cb,
-                  void *opaque, Error **errp)
+static BlockJobType commit_active_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "commit",
+    .set_speed     = mirror_set_speed,
+    .iostatus_reset= mirror_iostatus_reset,
+    .complete      = mirror_complete,
+    .query         = mirror_query,
+};
+
+static MirrorBlockJob *mirror_start_job(const BlockJobType *driver,
+                                        BlockDriverState *bs,
+                                        BlockDriverState *target,
+                                        BlockDriverState *base,
+                                        int64_t speed, int64_t granularity,
+                                        int64_t buf_size, MirrorSyncMode mode,
+                                        BlockdevOnError on_source_error,
+                                        BlockdevOnError on_target_error,
+                                        BlockDriverCompletionFunc *cb,
+                                        void *opaque, Error **errp)
 {
     MirrorBlockJob *s;
 
@@ -559,26 +689,96 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
          on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
         !bdrv_iostatus_is_enabled(bs)) {
         error_set(errp, QERR_INVALID_PARAMETER, "on-source-error");
-        return;
+        return NULL;
     }
 
-    s = block_job_create(&mirror_job_type, bs, speed, cb, opaque, errp);
+    s = block_job_create(driver, bs, speed, cb, opaque, errp);
     if (!s) {
-        return;
+        return NULL;
     }
 
     s->on_source_error = on_source_error;
     s->on_target_error = on_target_error;
     s->target = target;
+    s->base = base;
     s->mode = mode;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_io_sectors = MAX(MAX_IO_SECTORS, granularity >> BDRV_SECTOR_BITS);
+    s->eta = -1;
 
     bdrv_set_dirty_tracking(bs, granularity);
     bdrv_set_enable_write_cache(s->target, true);
     bdrv_set_on_error(s->target, on_target_error, on_target_error);
     bdrv_iostatus_enable(s->target);
+    return s;
+}
+
+static void mirror_enter(MirrorBlockJob *s, void *opaque)
+{
     s->common.co = qemu_coroutine_create(mirror_run);
-    trace_mirror_start(bs, s, s->common.co, opaque);
+    trace_mirror_start(s->common.bs, s, s->common.co, opaque);
     qemu_coroutine_enter(s->common.co, s);
 }
+
+void mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, int64_t granularity, int64_t buf_size,
+                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp)
+{
+    MirrorBlockJob *s;
+    BlockDriverState *base;
+
+    base = mode == MIRROR_SYNC_MODE_TOP ? bs->backing_hd : NULL;
+    s = mirror_start_job(&mirror_job_type, bs, target, base, speed,
+                         granularity, buf_size, mode, on_source_error,
+                         on_target_error, cb, opaque, errp);
+    if (s) {
+        mirror_enter(s, opaque);
+    }
+}
+
+void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
+                         int64_t speed, BlockdevOnError on_error,
+                         BlockDriverCompletionFunc *cb,
+                         void *opaque, Error **errp)
+{
+    MirrorBlockJob *s;
+    Error *local_err = NULL;
+    int orig_base_flags;
+
+    if (bs == base) {
+        error_setg(errp, "Invalid files for merge: top and base are the same");
+        return;
+    }
+
+    orig_base_flags = bdrv_get_flags(base);
+    if (!(orig_base_flags & BDRV_O_RDWR)) {
+        bdrv_reopen(base, orig_base_flags | BDRV_O_RDWR, &local_err);
+        if (error_is_set(&local_err)) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    /* Everything above the base is copied down, with the usual mirror
+     * machinery: the guest keeps writing to the active layer, and what it
+     * writes is picked up again through the dirty bitmap.  Completing the
+     * job switches the device over to the base.
+     */
+    s = mirror_start_job(&commit_active_job_type, bs, base, base, speed, 0,
+                         COMMIT_ACTIVE_BUF_SIZE, MIRROR_SYNC_MODE_TOP,
+                         on_error, on_error, cb, opaque, errp);
+    if (!s) {
+        if (orig_base_flags != bdrv_get_flags(base)) {
+            bdrv_reopen(base, orig_base_flags, NULL);
+        }
+        return;
+    }
+
+    s->is_commit = true;
+    s->orig_base_flags = orig_base_flags;
+    mirror_enter(s, opaque);
+}
@@ -48,14 +48,37 @@
 #endif
 
 #define MAX_NBD_REQUESTS	16
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define MAX_NBD_CONNECTIONS	16
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-typedef struct BDRVNBDState {
+/* Delay before retrying a connection that could not be re-established;
+ * it doubles after each failed attempt, up to the maximum.
+ */
+#define NBD_RECONNECT_MIN_DELAY  250000000LL   /* ns */
+#define NBD_RECONNECT_MAX_DELAY  30000000000LL /* ns */
+
+typedef enum {
+    NBD_POLICY_LEAST_OUTSTANDING,
+    NBD_POLICY_ROUND_ROBIN,
+} NBDPolicy;
+
+typedef struct NBDReconnect NBDReconnect;
+
+typedef struct NBDConnection {
     int sock;
-    uint32_t nbdflags;
-    off_t size;
-    size_t blocksize;
+
+    /* Set on a transport error.  Requests still in flight fail over to
+     * other connections; the last one out closes the socket, and it is
+     * reopened on demand.
+     */
+    bool broken;
+    bool failing;
+
+    /* Reconnection in progress, and when the next one may start */
+    NBDReconnect *reconnect;
+    int64_t retry_at;
+    int64_t backoff;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -63,7 +86,22 @@ typedef struct BDRVNBDState {
     int in_flight;
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    bool receiving[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NBDConnection;
+
+typedef struct BDRVNBDState {
+    NBDConnection conns[MAX_NBD_CONNECTIONS];
+    int nb_conns;
+    NBDPolicy policy;
+    int next_conn;
+
+    /* Requests waiting for a connection to be re-established */
+    CoQueue reconnect_queue;
+
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
 
     int is_unix;
     char *host_spec;
@@ -75,7 +113,9 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
     URI *uri;
     const char *p;
     QueryParams *qp = NULL;
+    char *end;
     int ret = 0;
+    int i;
 
     uri = uri_parse(filename);
     if (!uri) {
@@ -100,19 +140,42 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
         s->export_name = g_strdup(p);
     }
 
+    /* ?socket=path (unix only), ?connections=N, ?policy=... */
     qp = query_params_parse(uri->query);
-    if (qp->n > 1 || (s->is_unix && !qp->n) || (!s->is_unix && qp->n)) {
-        ret = -EINVAL;
-        goto out;
+    for (i = 0; i < qp->n; i++) {
+        const char *name = qp->p[i].name;
+        const char *value = qp->p[i].value ? qp->p[i].value : "";
+
+        if (!strcmp(name, "socket") && s->is_unix && !s->host_spec) {
+            s->host_spec = g_strdup(value);
+        } else if (!strcmp(name, "connections")) {
+            s->nb_conns = strtol(value, &end, 10);
+            if (*end || s->nb_conns < 1 ||
+                s->nb_conns > MAX_NBD_CONNECTIONS) {
+                ret = -EINVAL;
+                goto out;
+            }
+        } else if (!strcmp(name, "policy")) {
+            if (!strcmp(value, "least-outstanding")) {
+                s->policy = NBD_POLICY_LEAST_OUTSTANDING;
+            } else if (!strcmp(value, "round-robin")) {
+                s->policy = NBD_POLICY_ROUND_ROBIN;
+            } else {
+                ret = -EINVAL;
+                goto out;
+            }
+        } else {
+            ret = -EINVAL;
+            goto out;
+        }
     }
 
     if (s->is_unix) {
         /* nbd+unix:///export?socket=path */
-        if (uri->server || uri->port || strcmp(qp->p[0].name, "socket")) {
+        if (uri->server || uri->port || !s->host_spec) {
             ret = -EINVAL;
             goto out;
         }
-        s->host_spec = g_strdup(qp->p[0].value);
     } else {
         /* nbd[+tcp]://host:port/export */
         if (!uri->server) {
@@ -126,6 +189,11 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
     }
 
 out:
+    if (ret < 0) {
+        g_free(s->export_name);
+        g_free(s->host_spec);
+        s->export_name = s->host_spec = NULL;
+    }
     if (qp) {
         query_params_free(qp);
     }
@@ -182,53 +250,89 @@ out:
     return err;
 }
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_start(NBDConnection *conn,
+                                struct nbd_request *request)
 {
     int i;
 
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (conn->in_flight >= MAX_NBD_REQUESTS - 1) {
+        qemu_co_mutex_lock(&conn->free_sema);
+        assert(conn->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    conn->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+        if (conn->recv_coroutine[i] == NULL) {
+            conn->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(conn, i);
 }
 
 static int nbd_have_request(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
 
-    return s->in_flight > 0;
+    return conn->in_flight > 0;
+}
+
+/* Mark @conn as broken and wake up everything that waits on its socket,
+ * so that the requests can be resubmitted elsewhere.
+ */
+static void nbd_conn_fail(NBDConnection *conn)
+{
+    Coroutine *self = qemu_in_coroutine() ? qemu_coroutine_self() : NULL;
+    int i;
+
+    if (conn->broken) {
+        return;
+    }
+
+    logout("Lost connection to NBD server\n");
+    conn->broken = true;
+    conn->failing = true;
+    conn->reply.handle = 0;
+    qemu_aio_set_fd_handler(conn->sock, NULL, NULL, NULL, NULL);
+    shutdown(conn->sock, 2);
+
+    if (conn->send_coroutine && conn->send_coroutine != self) {
+        qemu_coroutine_enter(conn->send_coroutine, NULL);
+    }
+    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+        if (conn->receiving[i] && conn->recv_coroutine[i] != self) {
+            qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
+        }
+    }
+    conn->failing = false;
+
+    if (conn->in_flight == 0) {
+        closesocket(conn->sock);
+        conn->sock = -1;
+    }
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (conn->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(conn->sock, &conn->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            conn->reply.handle = 0;
             goto fail;
         }
     }
@@ -236,94 +340,154 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    i = HANDLE_TO_INDEX(conn, conn->reply.handle);
     if (i >= MAX_NBD_REQUESTS) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (conn->receiving[i]) {
+        qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
-        }
-    }
+    nbd_conn_fail(conn);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BDRVNBDState *s = opaque;
-    qemu_coroutine_enter(s->send_coroutine, NULL);
+    NBDConnection *conn = opaque;
+    qemu_coroutine_enter(conn->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(NBDConnection *conn,
+                               struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
     int rc, ret;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write,
-                            nbd_have_request, s);
-    rc = nbd_send_request(s->sock, request);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    if (conn->broken) {
+        qemu_co_mutex_unlock(&conn->send_mutex);
+        return -EIO;
+    }
+
+    conn->send_coroutine = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, nbd_restart_write,
+                            nbd_have_request, conn);
+    rc = nbd_send_request(conn->sock, request);
     if (rc >= 0 && qiov) {
-        ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+        ret = qemu_co_sendv(conn->sock, qiov->iov, qiov->niov,
                             offset, request->len);
         if (ret != request->len) {
-            return -EIO;
+            rc = -EIO;
         }
     }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    conn->send_coroutine = NULL;
+
+    if (rc < 0 || conn->broken) {
+        qemu_co_mutex_unlock(&conn->send_mutex);
+        nbd_conn_fail(conn);
+        return -EIO;
+    }
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, NULL,
+                            nbd_have_request, conn);
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
-                                 struct nbd_reply *reply,
-                                 QEMUIOVector *qiov, int offset)
+/* Returns 0 if a reply was received, whatever its error code, or -EIO if
+ * the connection broke in the meanwhile.
+ */
+static int nbd_co_receive_reply(NBDConnection *conn,
+                                struct nbd_request *request,
+                                struct nbd_reply *reply,
+                                QEMUIOVector *qiov, int offset)
 {
-    int ret;
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    int ret = 0;
+
+    if (conn->broken) {
+        return -EIO;
+    }
 
     /* Wait until we're woken up by the read handler.  TODO: perhaps
      * peek at the next reply and avoid yielding if it's ours?  */
+    conn->receiving[i] = true;
     qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
-            }
+    if (conn->broken || conn->reply.handle != request->handle) {
+        ret = -EIO;
+        goto out;
+    }
+
+    *reply = conn->reply;
+    if (qiov && reply->error == 0) {
+        ret = qemu_co_recvv(conn->sock, qiov->iov, qiov->niov,
+                            offset, request->len);
+        if (ret != request->len || conn->broken) {
+            ret = -EIO;
+            goto out;
         }
+        ret = 0;
+    }
 
-        /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+    /* Tell the read handler to read another header.  */
+    conn->reply.handle = 0;
+
+out:
+    conn->receiving[i] = false;
+    if (ret < 0) {
+        nbd_conn_fail(conn);
     }
+    return ret;
 }
 
-static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_end(NBDConnection *conn,
+                              struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    conn->recv_coroutine[i] = NULL;
+    if (conn->in_flight-- == MAX_NBD_REQUESTS) {
+        qemu_co_mutex_unlock(&conn->free_sema);
+    }
+    if (conn->broken && conn->in_flight == 0 && !conn->failing) {
+        closesocket(conn->sock);
+        conn->sock = -1;
     }
 }
 
-static int nbd_establish_connection(BlockDriverState *bs)
+/* Start using @sock, which went through the NBD handshake, for @conn */
+static int nbd_attach_connection(BDRVNBDState *s, NBDConnection *conn,
+                                 int sock, uint32_t nbdflags, off_t size,
+                                 size_t blocksize)
+{
+    /* Extra connections and reconnections must see the same export */
+    if (s->size && (size != s->size || nbdflags != s->nbdflags)) {
+        logout("NBD export changed across connections\n");
+        return -EIO;
+    }
+
+    /* Now that we're connected, set the socket to be non-blocking and
+     * kick the reply mechanism.  */
+    socket_set_nonblock(sock);
+    qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL,
+                            nbd_have_request, conn);
+
+    conn->sock = sock;
+    conn->broken = false;
+    s->nbdflags = nbdflags;
+    s->size = size;
+    s->blocksize = blocksize;
+
+    logout("Established connection with NBD server\n");
+    return 0;
+}
+
+static int nbd_establish_connection(BDRVNBDState *s, NBDConnection *conn)
 {
-    BDRVNBDState *s = bs->opaque;
     int sock;
     int ret;
+    uint32_t nbdflags;
     off_t size;
     size_t blocksize;
 
@@ -340,7 +504,7 @@ static int nbd_establish_connection(BlockDriverState *bs)
     }
 
     /* NBD handshake */
-    ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
+    ret = nbd_receive_negotiate(sock, s->export_name, &nbdflags, &size,
                                 &blocksize);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
@@ -348,41 +512,276 @@ static int nbd_establish_connection(BlockDriverState *bs)
         return ret;
     }
 
-    /* Now that we're connected, set the socket to be non-blocking and
-     * kick the reply mechanism.  */
-    socket_set_nonblock(sock);
-    qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
+    ret = nbd_attach_connection(s, conn, sock, nbdflags, size, blocksize);
+    if (ret < 0) {
+        closesocket(sock);
+    }
+    return ret;
+}
 
-    s->sock = sock;
-    s->size = size;
-    s->blocksize = blocksize;
+/* Broken connections are reopened from the main loop, without blocking
+ * it: the connect is non-blocking and the handshake runs in a coroutine.
+ * The state lives apart from the BDRVNBDState so that nbd_close() can
+ * leave it behind; it is freed when the attempt completes.
+ */
+struct NBDReconnect {
+    BDRVNBDState *s;            /* NULL once the device is closed */
+    NBDConnection *conn;
+    char *export_name;
+    int sock;
+    Coroutine *co;
+};
 
-    logout("Established connection with NBD server\n");
-    return 0;
+static void nbd_reconnect_done(NBDReconnect *r, int ret)
+{
+    BDRVNBDState *s = r->s;
+    NBDConnection *conn = r->conn;
+
+    if (s) {
+        conn->reconnect = NULL;
+        if (ret < 0) {
+            logout("Failed to re-establish connection to NBD server\n");
+            conn->retry_at = qemu_get_clock_ns(rt_clock) + conn->backoff;
+            conn->backoff = MIN(conn->backoff * 2, NBD_RECONNECT_MAX_DELAY);
+        } else {
+            conn->backoff = NBD_RECONNECT_MIN_DELAY;
+        }
+        qemu_co_queue_restart_all(&s->reconnect_queue);
+    }
+    g_free(r->export_name);
+    g_free(r);
+}
+
+static void coroutine_fn nbd_co_reconnect(void *opaque)
+{
+    NBDReconnect *r = opaque;
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+    int ret;
+
+    ret = nbd_receive_negotiate(r->sock, r->export_name, &nbdflags, &size,
+                                &blocksize);
+    qemu_set_fd_handler(r->sock, NULL, NULL, NULL);
+    if (ret == 0) {
+        ret = r->s ? nbd_attach_connection(r->s, r->conn, r->sock, nbdflags,
+                                           size, blocksize)
+                   : -EIO;
+    }
+    if (ret < 0) {
+        closesocket(r->sock);
+    }
+    nbd_reconnect_done(r, ret);
+}
+
+static void nbd_reconnect_ready(void *opaque)
+{
+    NBDReconnect *r = opaque;
+
+    qemu_coroutine_enter(r->co, r);
+}
+
+static void nbd_reconnect_connected(int fd, void *opaque)
+{
+    NBDReconnect *r = opaque;
+
+    if (fd < 0 || !r->s) {
+        if (fd >= 0) {
+            closesocket(fd);
+        }
+        nbd_reconnect_done(r, -EIO);
+        return;
+    }
+
+    /* The handshake yields whenever the socket has no data yet */
+    r->sock = fd;
+    socket_set_nonblock(fd);
+    qemu_set_fd_handler(fd, nbd_reconnect_ready, NULL, r);
+    r->co = qemu_coroutine_create(nbd_co_reconnect);
+    qemu_coroutine_enter(r->co, r);
+}
+
+static void nbd_reconnect_start(BDRVNBDState *s, NBDConnection *conn)
+{
+    NBDReconnect *r = g_malloc0(sizeof(*r));
+    int sock;
+
+    r->s = s;
+    r->conn = conn;
+    r->export_name = g_strdup(s->export_name);
+    r->sock = -1;
+    conn->reconnect = r;
+
+    if (s->is_unix) {
+        sock = unix_nonblocking_connect(s->host_spec,
+                                        nbd_reconnect_connected, r, NULL);
+    } else {
+        sock = inet_nonblocking_connect(s->host_spec,
+                                        nbd_reconnect_connected, r, NULL);
+    }
+
+    /* Otherwise the callback has been or will be called */
+    if (sock < 0) {
+        nbd_reconnect_done(r, -EIO);
+    }
+}
+
+/* Reopen the broken connections that nobody uses anymore, unless the
+ * last attempt failed too recently.
+ */
+static void nbd_reconnect(BDRVNBDState *s)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        if (!conn->broken || conn->in_flight || conn->failing ||
+            conn->reconnect) {
+            continue;
+        }
+        if (now < conn->retry_at) {
+            continue;
+        }
+        nbd_reconnect_start(s, conn);
+    }
+}
+
+static bool nbd_reconnecting(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].reconnect) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static NBDConnection *nbd_pick_connection_1(BDRVNBDState *s)
+{
+    NBDConnection *best = NULL;
+    int i, n;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        n = (s->next_conn + i) % s->nb_conns;
+        if (s->conns[n].broken) {
+            continue;
+        }
+        if (!best || s->conns[n].in_flight < best->in_flight) {
+            best = &s->conns[n];
+        }
+        if (s->policy == NBD_POLICY_ROUND_ROBIN) {
+            break;
+        }
+    }
+
+    if (best) {
+        s->next_conn = (best - s->conns + 1) % s->nb_conns;
+    }
+    return best;
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+/* With no usable connection left, wait for the reconnections in progress
+ * rather than failing the request straight away.
+ */
+static NBDConnection *coroutine_fn nbd_pick_connection(BDRVNBDState *s)
+{
+    NBDConnection *conn;
+
+    for (;;) {
+        nbd_reconnect(s);
+        conn = nbd_pick_connection_1(s);
+        if (conn || !nbd_reconnecting(s)) {
+            return conn;
+        }
+        qemu_co_queue_wait(&s->reconnect_queue);
+    }
+}
+
+/* Send @request on @conn and wait for the reply.  Returns -EIO if the
+ * connection failed, otherwise 0 with the server's answer in @reply.
+ */
+static int nbd_co_request_conn(NBDConnection *conn,
+                               struct nbd_request *request,
+                               struct nbd_reply *reply,
+                               QEMUIOVector *qiov, int offset)
+{
+    bool is_read = (request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ;
+    int ret;
+
+    nbd_coroutine_start(conn, request);
+    ret = nbd_co_send_request(conn, request, is_read ? NULL : qiov, offset);
+    if (ret >= 0) {
+        ret = nbd_co_receive_reply(conn, request, reply,
+                                   is_read ? qiov : NULL, offset);
+    }
+    nbd_coroutine_end(conn, request);
+    return ret < 0 ? -EIO : 0;
+}
+
+/* Send @request and wait for the reply.  If the connection fails, the
+ * request is resubmitted on another one (possibly reopened), so that
+ * the failure is not visible to the guest as long as the server can be
+ * reached at all.  NBD requests can be repeated safely.
+ */
+static int nbd_co_request(BlockDriverState *bs, struct nbd_request *request,
+                          QEMUIOVector *qiov, int offset)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDConnection *conn;
+    struct nbd_reply reply;
+    int attempts;
+
+    for (attempts = 0; attempts <= s->nb_conns; attempts++) {
+        conn = nbd_pick_connection(s);
+        if (!conn) {
+            break;
+        }
+        if (nbd_co_request_conn(conn, request, &reply, qiov, offset) == 0) {
+            return -reply.error;
+        }
+    }
+    return -EIO;
+}
+
+static void nbd_teardown_connection(NBDConnection *conn)
+{
     struct nbd_request request;
 
-    request.type = NBD_CMD_DISC;
-    request.from = 0;
-    request.len = 0;
-    nbd_send_request(s->sock, &request);
+    if (conn->sock < 0) {
+        return;
+    }
+
+    if (!conn->broken) {
+        request.type = NBD_CMD_DISC;
+        request.from = 0;
+        request.len = 0;
+        nbd_send_request(conn->sock, &request);
+    }
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL);
-    closesocket(s->sock);
+    qemu_aio_set_fd_handler(conn->sock, NULL, NULL, NULL, NULL);
+    closesocket(conn->sock);
+    conn->sock = -1;
 }
 
 static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
 {
     BDRVNBDState *s = bs->opaque;
     int result;
+    int i;
 
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    s->nb_conns = 1;
+    s->policy = NBD_POLICY_LEAST_OUTSTANDING;
+    qemu_co_queue_init(&s->reconnect_queue);
+    for (i = 0; i < MAX_NBD_CONNECTIONS; i++) {
+        s->conns[i].sock = -1;
+        s->conns[i].backoff = NBD_RECONNECT_MIN_DELAY;
+        qemu_co_mutex_init(&s->conns[i].send_mutex);
+        qemu_co_mutex_init(&s->conns[i].free_sema);
+    }
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, filename);
@@ -390,37 +789,35 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
         return result;
     }
 
-    /* establish TCP connection, return error if it fails
+    /* establish TCP connections, return error if any fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    result = nbd_establish_connection(bs);
+    for (i = 0; i < s->nb_conns; i++) {
+        result = nbd_establish_connection(s, &s->conns[i]);
+        if (result < 0) {
+            while (--i >= 0) {
+                nbd_teardown_connection(&s->conns[i]);
+            }
+            g_free(s->export_name);
+            g_free(s->host_spec);
+            return result;
+        }
+    }
 
-    return result;
+    return 0;
 }
 
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors, QEMUIOVector *qiov,
                           int offset)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_READ;
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
-
+    return nbd_co_request(bs, &request, qiov, offset);
 }
 
 static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
@@ -429,8 +826,6 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_WRITE;
     if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
@@ -440,15 +835,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, qiov, offset);
 }
 
 /* qemu-nbd has a limit of slightly less than 1M per request.  Try to
@@ -494,7 +881,8 @@ static int nbd_co_flush(BlockDriverState *bs)
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
     struct nbd_reply reply;
-    ssize_t ret;
+    bool flushed = false;
+    int i;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -508,15 +896,23 @@ static int nbd_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+    /* Writes completed on any connection must reach the disk, and the
+     * server need not treat its connections as one stream.  Flush on
+     * each of them; writes acknowledged on a broken one are covered by
+     * the others, which reach the same export.
+     */
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].broken ||
+            nbd_co_request_conn(&s->conns[i], &request, &reply,
+                                NULL, 0) < 0) {
+            continue;
+        }
+        if (reply.error) {
+            return -reply.error;
+        }
+        flushed = true;
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return flushed ? 0 : nbd_co_request(bs, &request, NULL, 0);
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -524,34 +920,37 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
     request.type = NBD_CMD_TRIM;
-    request.from = sector_num * 512;;
+    request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, 0);
 }
 
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    int i;
+
     g_free(s->export_name);
     g_free(s->host_spec);
 
-    nbd_teardown_connection(bs);
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDReconnect *r = s->conns[i].reconnect;
+
+        /* Let a pending reconnection fail on its own */
+        if (r) {
+            r->s = NULL;
+            if (r->sock >= 0) {
+                shutdown(r->sock, 2);
+            }
+        }
+        nbd_teardown_connection(&s->conns[i]);
+    }
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
@@ -0,0 +1,262 @@
+/*
+ * Null block drivers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qemu/option.h"
+
+/*
+ * null-co and null-aio complete every request without doing any I/O, which
+ * leaves only the cost of the device model and the block layer to measure.
+ * null-co completes in the request coroutine; null-aio completes from a
+ * bottom half, like an AIO backend would.  Filenames look like
+ *
+ *     null-co://[size=SIZE][,latency-ns=NS][,read-zeroes=on|off]
+ *
+ * With a latency, each request sleeps in the thread pool, so the main loop
+ * keeps running and bdrv_drain_all() still waits for it.  Reads fill the
+ * buffer with zeroes, so that the format probe and the guest never see
+ * stale memory; read-zeroes=off skips that for benchmarks that want the
+ * bare cost of a request.
+ */
+
+typedef struct BDRVNullState {
+    int64_t length;
+    int64_t latency_ns;
+    bool read_zeroes;
+} BDRVNullState;
+
+static QemuOptsList null_opts = {
+    .name = "null",
+    .head = QTAILQ_HEAD_INITIALIZER(null_opts.head),
+    .desc = {
+        {
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the device in bytes (default 1G)",
+        },
+        {
+            .name = "latency-ns",
+            .type = QEMU_OPT_NUMBER,
+            .help = "time each request takes, in nanoseconds (default 0)",
+        },
+        {
+            .name = "read-zeroes",
+            .type = QEMU_OPT_BOOL,
+            .help = "fill the buffer of read requests with zeroes "
+                    "(default on)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int null_open_common(BlockDriverState *bs, const char *filename,
+                            const char *prefix)
+{
+    BDRVNullState *s = bs->opaque;
+    QemuOpts *opts;
+    int ret = 0;
+
+    if (!strstart(filename, prefix, &filename)) {
+        return -EINVAL;
+    }
+    strstart(filename, "//", &filename);
+
+    opts = qemu_opts_create_nofail(&null_opts);
+    if (qemu_opts_do_parse(opts, filename, NULL) < 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->length = qemu_opt_get_size(opts, "size", 1 << 30);
+    s->latency_ns = qemu_opt_get_number(opts, "latency-ns", 0);
+    s->read_zeroes = qemu_opt_get_bool(opts, "read-zeroes", true);
+    if (s->length < 0 || s->latency_ns < 0) {
+        ret = -EINVAL;
+    }
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int64_t null_getlength(BlockDriverState *bs)
+{
+    BDRVNullState *s = bs->opaque;
+
+    return s->length;
+}
+
+static int null_sleep(void *opaque)
+{
+    int64_t *latency_ns = opaque;
+
+    g_usleep(*latency_ns / 1000);
+    return 0;
+}
+
+static void null_read_zeroes(BlockDriverState *bs, QEMUIOVector *qiov,
+                             int nb_sectors)
+{
+    BDRVNullState *s = bs->opaque;
+
+    if (s->read_zeroes) {
+        qemu_iovec_memset(qiov, 0, 0, nb_sectors * BDRV_SECTOR_SIZE);
+    }
+}
+
+/*
+ * null-co
+ */
+
+static int null_co_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    return null_open_common(bs, filename, "null-co:");
+}
+
+static int coroutine_fn null_co_common(BlockDriverState *bs)
+{
+    BDRVNullState *s = bs->opaque;
+
+    if (s->latency_ns) {
+        return thread_pool_submit_co(null_sleep, &s->latency_ns);
+    }
+    return 0;
+}
+
+static int coroutine_fn null_co_readv(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      QEMUIOVector *qiov)
+{
+    null_read_zeroes(bs, qiov, nb_sectors);
+    return null_co_common(bs);
+}
+
+static int coroutine_fn null_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    return null_co_common(bs);
+}
+
+static int coroutine_fn null_co_flush(BlockDriverState *bs)
+{
+    return null_co_common(bs);
+}
+
+static BlockDriver bdrv_null_co = {
+    .format_name            = "null-co",
+    .protocol_name          = "null-co",
+    .instance_size          = sizeof(BDRVNullState),
+
+    .bdrv_file_open         = null_co_open,
+    .bdrv_getlength         = null_getlength,
+
+    .bdrv_co_readv          = null_co_readv,
+    .bdrv_co_writev         = null_co_writev,
+    .bdrv_co_flush_to_disk  = null_co_flush,
+};
+
+/*
+ * null-aio
+ */
+
+typedef struct NullAIOCB {
+    BlockDriverAIOCB common;
+    QEMUBH *bh;
+} NullAIOCB;
+
+static void null_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    NullAIOCB *acb = container_of(blockacb, NullAIOCB, common);
+
+    qemu_bh_delete(acb->bh);
+    qemu_aio_release(acb);
+}
+
+static const AIOCBInfo null_aiocb_info = {
+    .aiocb_size         = sizeof(NullAIOCB),
+    .cancel             = null_aio_cancel,
+};
+
+static void null_bh_cb(void *opaque)
+{
+    NullAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->common.cb(acb->common.opaque, 0);
+    qemu_aio_release(acb);
+}
+
+static BlockDriverAIOCB *null_aio_common(BlockDriverState *bs,
+                                         BlockDriverCompletionFunc *cb,
+                                         void *opaque)
+{
+    BDRVNullState *s = bs->opaque;
+    NullAIOCB *acb;
+
+    if (s->latency_ns) {
+        return thread_pool_submit_aio(null_sleep, &s->latency_ns, cb, opaque);
+    }
+
+    acb = qemu_aio_get(&null_aiocb_info, bs, cb, opaque);
+    acb->bh = qemu_bh_new(null_bh_cb, acb);
+    qemu_bh_schedule(acb->bh);
+    return &acb->common;
+}
+
+static int null_aio_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    return null_open_common(bs, filename, "null-aio:");
+}
+
+static BlockDriverAIOCB *null_aio_readv(BlockDriverState *bs,
+                                        int64_t sector_num, QEMUIOVector *qiov,
+                                        int nb_sectors,
+                                        BlockDriverCompletionFunc *cb,
+                                        void *opaque)
+{
+    null_read_zeroes(bs, qiov, nb_sectors);
+    return null_aio_common(bs, cb, opaque);
+}
+
+static BlockDriverAIOCB *null_aio_writev(BlockDriverState *bs,
+                                         int64_t sector_num, QEMUIOVector *qiov,
+                                         int nb_sectors,
+                                         BlockDriverCompletionFunc *cb,
+                                         void *opaque)
+{
+    return null_aio_common(bs, cb, opaque);
+}
+
+static BlockDriverAIOCB *null_aio_flush(BlockDriverState *bs,
+                                        BlockDriverCompletionFunc *cb,
+                                        void *opaque)
+{
+    return null_aio_common(bs, cb, opaque);
+}
+
+static BlockDriver bdrv_null_aio = {
+    .format_name            = "null-aio",
+    .protocol_name          = "null-aio",
+    .instance_size          = sizeof(BDRVNullState),
+
+    .bdrv_file_open         = null_aio_open,
+    .bdrv_getlength         = null_getlength,
+
+    .bdrv_aio_readv         = null_aio_readv,
+    .bdrv_aio_writev        = null_aio_writev,
+    .bdrv_aio_flush         = null_aio_flush,
+};
+
+static void bdrv_null_init(void)
+{
+    bdrv_register(&bdrv_null_co);
+    bdrv_register(&bdrv_null_aio);
+}
+
+block_init(bdrv_null_init);
@@ -167,12 +167,19 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     uint64_t old_l2_offset;
     uint64_t *l2_table;
     int64_t l2_offset;
-    int ret;
+    int i, ret;
 
     old_l2_offset = s->l1_table[l1_index];
 
     trace_qcow2_l2_allocate(bs, l1_index);
 
+    /* The clusters of a table shared with a snapshot must have their
+     * refcounts right before the active copy can start freeing them */
+    ret = qcow2_deferred_refcount_l2(bs, l1_index);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* allocate a new l2 entry */
 
     l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
@@ -212,6 +219,11 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
         memcpy(l2_table, old_table, s->cluster_size);
 
+        /* The old table is shared, so are all clusters it points to */
+        for (i = 0; i < s->l2_size; i++) {
+            l2_table[i] &= ~cpu_to_be64(QCOW_OFLAG_COPIED);
+        }
+
         ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
         if (ret < 0) {
             goto fail;
@@ -820,7 +832,6 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
 static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *host_offset, unsigned int *nb_clusters)
 {
-    BDRVQcowState *s = bs->opaque;
     int ret;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
@@ -833,22 +844,12 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == 0) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
-        if (cluster_offset < 0) {
-            return cluster_offset;
-        }
-        *host_offset = cluster_offset;
-        return 0;
-    } else {
-        ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
-        if (ret < 0) {
-            return ret;
-        }
-        *nb_clusters = ret;
-        return 0;
+    ret = qcow2_alloc_data_clusters(bs, host_offset, *nb_clusters);
+    if (ret < 0) {
+        return ret;
     }
+    *nb_clusters = ret;
+    return 0;
 }
 
 /*
@@ -1149,18 +1150,26 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     nb_clusters = size_to_clusters(s, end_offset - offset);
 
+    /* Collect the host clusters that become free so that they can be
+     * punched out of the image file in one go */
+    s->cache_discards = true;
+
     /* Each L2 table is handled by its own loop iteration */
+    ret = 0;
     while (nb_clusters > 0) {
         ret = discard_single_l2(bs, offset, nb_clusters);
         if (ret < 0) {
-            return ret;
+            break;
         }
 
         nb_clusters -= ret;
         offset += (ret * s->cluster_size);
     }
 
-    return 0;
+    s->cache_discards = false;
+    qcow2_process_discards(bs, ret);
+
+    return ret < 0 ? ret : 0;
 }
 
 /*
@@ -1190,9 +1199,13 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
 
         old_offset = be64_to_cpu(l2_table[l2_index + i]);
 
-        /* Update L2 entries */
+        /*
+         * Update L2 entries.  A zero flag on top of a host cluster would
+         * keep the cluster from being reused by the next write, which
+         * allocates a new one instead, so drop the host cluster as well.
+         */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
+        if (old_offset & (QCOW_OFLAG_COMPRESSED | L2E_OFFSET_MASK)) {
             l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1);
         } else {
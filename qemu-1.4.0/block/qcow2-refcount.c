@@ -25,6 +25,8 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "qemu/bitmap.h"
+#include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -413,6 +415,56 @@ fail_block:
 }
 
 /* XXX: cache several refcount block clusters ? */
+/*
+ * Queues a freed host range for qcow2_process_discards(), merging it with the
+ * previous one where possible: a discard request usually frees a run of
+ * adjacent clusters.
+ */
+static void update_refcount_discard(BlockDriverState *bs,
+                                    uint64_t offset, uint64_t length)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DiscardRegion *d = QTAILQ_LAST(&s->discards, Qcow2DiscardRegionHead);
+
+    if (d && d->offset + d->bytes == offset) {
+        d->bytes += length;
+        return;
+    }
+    if (d && offset + length == d->offset) {
+        d->offset = offset;
+        d->bytes += length;
+        return;
+    }
+
+    d = g_malloc(sizeof(*d));
+    d->offset = offset;
+    d->bytes = length;
+    QTAILQ_INSERT_TAIL(&s->discards, d, next);
+}
+
+/*
+ * Passes the queued ranges down to the image file, or just drops them if ret
+ * is an error (the refcount update may have been undone). Must be called
+ * with s->lock held so that none of the clusters can be reused meanwhile.
+ */
+void qcow2_process_discards(BlockDriverState *bs, int ret)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DiscardRegion *d, *next_d;
+
+    QTAILQ_FOREACH_SAFE(d, &s->discards, next, next_d) {
+        QTAILQ_REMOVE(&s->discards, d, next);
+
+        /* Discard is only a hint, so errors are not reported */
+        if (ret >= 0) {
+            bdrv_discard(bs->file, d->offset >> BDRV_SECTOR_BITS,
+                         d->bytes >> BDRV_SECTOR_BITS);
+        }
+
+        g_free(d);
+    }
+}
+
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
     int64_t offset, int64_t length, int addend)
 {
@@ -479,6 +531,9 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
+        if (refcount == 0 && s->cache_discards) {
+            update_refcount_discard(bs, cluster_offset, s->cluster_size);
+        }
         refcount_block[block_index] = cpu_to_be16(refcount);
     }
 
@@ -583,6 +638,64 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
     return offset;
 }
 
+/*
+ * Allocates up to nb_clusters contiguous clusters for guest data. If
+ * *host_offset is non-zero, the clusters must start there and 0 may be
+ * returned; otherwise *host_offset is set to wherever they were found.
+ *
+ * Clusters are taken from a pool that is reserved QCOW2_ALLOC_POOL_SIZE bytes
+ * at a time with a single refcount update, so that most allocating writes
+ * only need to bump a pointer while holding s->lock. The pool is given back
+ * by qcow2_release_alloc_pool(); after a crash its clusters are leaks.
+ *
+ * Returns the number of clusters allocated, or -errno.
+ */
+int qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t *host_offset,
+    unsigned int nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    unsigned int n;
+
+    if (*host_offset != 0 &&
+        (s->alloc_pool_clusters == 0 || *host_offset != s->alloc_pool_offset))
+    {
+        return qcow2_alloc_clusters_at(bs, *host_offset, nb_clusters);
+    }
+
+    if (s->alloc_pool_clusters == 0) {
+        int64_t offset;
+
+        n = MAX(nb_clusters, MAX(QCOW2_ALLOC_POOL_SIZE >> s->cluster_bits, 1));
+        offset = qcow2_alloc_clusters(bs, (int64_t) n << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        trace_qcow2_alloc_pool_refill(qemu_coroutine_self(), offset, n);
+        s->alloc_pool_offset = offset;
+        s->alloc_pool_clusters = n;
+    }
+
+    n = MIN(nb_clusters, s->alloc_pool_clusters);
+    *host_offset = s->alloc_pool_offset;
+    s->alloc_pool_offset += (uint64_t) n << s->cluster_bits;
+    s->alloc_pool_clusters -= n;
+
+    return n;
+}
+
+void qcow2_release_alloc_pool(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->alloc_pool_clusters == 0) {
+        return;
+    }
+
+    qcow2_free_clusters(bs, s->alloc_pool_offset,
+                        (int64_t) s->alloc_pool_clusters << s->cluster_bits);
+    s->alloc_pool_clusters = 0;
+}
+
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters)
 {
@@ -704,8 +817,14 @@ void qcow2_free_any_clusters(BlockDriverState *bs,
         qcow2_free_clusters(bs, l2_entry & L2E_OFFSET_MASK,
                             nb_clusters << s->cluster_bits);
         break;
-    case QCOW2_CLUSTER_UNALLOCATED:
     case QCOW2_CLUSTER_ZERO:
+        /* Older images may still have a host cluster behind the flag */
+        if (l2_entry & L2E_OFFSET_MASK) {
+            qcow2_free_clusters(bs, l2_entry & L2E_OFFSET_MASK,
+                                nb_clusters << s->cluster_bits);
+        }
+        break;
+    case QCOW2_CLUSTER_UNALLOCATED:
         break;
     default:
         abort();
@@ -719,17 +838,92 @@ void qcow2_free_any_clusters(BlockDriverState *bs,
 
 
 
+/*
+ * Update the refcounts of the clusters that the L2 table at l2_offset points
+ * to, and their QCOW_OFLAG_COPIED flags.  The refcount of the L2 table
+ * itself is left alone.
+ */
+static int update_l2_refcounts(BlockDriverState *bs, uint64_t l2_offset,
+    int addend)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table, offset;
+    int64_t old_offset;
+    int j, nb_csectors, refcount;
+    int ret;
+
+    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
+        (void**) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for(j = 0; j < s->l2_size; j++) {
+        offset = be64_to_cpu(l2_table[j]);
+        if (offset != 0) {
+            old_offset = offset;
+            offset &= ~QCOW_OFLAG_COPIED;
+            if (offset & QCOW_OFLAG_COMPRESSED) {
+                nb_csectors = ((offset >> s->csize_shift) &
+                               s->csize_mask) + 1;
+                if (addend != 0) {
+                    ret = update_refcount(bs,
+                        (offset & s->cluster_offset_mask) & ~511,
+                        nb_csectors * 512, addend);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+
+                    /* TODO Flushing once for the whole function should
+                     * be enough */
+                    bdrv_flush(bs->file);
+                }
+                /* compressed clusters are never modified */
+                refcount = 2;
+            } else {
+                uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+                if (addend != 0) {
+                    refcount = update_cluster_refcount(bs, cluster_index, addend);
+                } else {
+                    refcount = get_refcount(bs, cluster_index);
+                }
+
+                if (refcount < 0) {
+                    ret = -EIO;
+                    goto fail;
+                }
+            }
+
+            if (refcount == 1) {
+                offset |= QCOW_OFLAG_COPIED;
+            }
+            if (offset != old_offset) {
+                if (addend > 0) {
+                    qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                        s->refcount_block_cache);
+                }
+                l2_table[j] = cpu_to_be64(offset);
+                qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+            }
+        }
+    }
+
+    ret = 0;
+fail:
+    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    return ret;
+}
+
 /* update the refcounts of snapshots and the copied flag */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
-    int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors, refcount;
+    uint64_t *l1_table, l2_offset, l1_size2, l1_allocated;
+    int64_t old_l2_offset;
+    int i, l1_modified = 0, refcount;
     int ret;
 
-    l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -760,69 +954,11 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             old_l2_offset = l2_offset;
             l2_offset &= L1E_OFFSET_MASK;
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
+            ret = update_l2_refcounts(bs, l2_offset, addend);
             if (ret < 0) {
                 goto fail;
             }
 
-            for(j = 0; j < s->l2_size; j++) {
-                offset = be64_to_cpu(l2_table[j]);
-                if (offset != 0) {
-                    old_offset = offset;
-                    offset &= ~QCOW_OFLAG_COPIED;
-                    if (offset & QCOW_OFLAG_COMPRESSED) {
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            int ret;
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-
-                            /* TODO Flushing once for the whole function should
-                             * be enough */
-                            bdrv_flush(bs->file);
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                    } else {
-                        uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (addend != 0) {
-                            refcount = update_cluster_refcount(bs, cluster_index, addend);
-                        } else {
-                            refcount = get_refcount(bs, cluster_index);
-                        }
-
-                        if (refcount < 0) {
-                            ret = -EIO;
-                            goto fail;
-                        }
-                    }
-
-                    if (refcount == 1) {
-                        offset |= QCOW_OFLAG_COPIED;
-                    }
-                    if (offset != old_offset) {
-                        if (addend > 0) {
-                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                s->refcount_block_cache);
-                        }
-                        l2_table[j] = cpu_to_be64(offset);
-                        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-                    }
-                }
-            }
-
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
-
             if (addend != 0) {
                 refcount = update_cluster_refcount(bs, l2_offset >> s->cluster_bits, addend);
             } else {
@@ -843,10 +979,6 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     ret = 0;
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-    }
-
     /* Update L1 only if it isn't deleted anyway (addend = -1) */
     if (addend >= 0 && l1_modified) {
         for(i = 0; i < l1_size; i++)
@@ -862,6 +994,89 @@ fail:
     return ret;
 }
 
+/*
+ * Take a reference for a new snapshot of the active L1 table, but only on
+ * the L2 tables.  The clusters they point to still have the refcounts of
+ * before the snapshot; each L2 table is marked in s->deferred_l2 until
+ * qcow2_deferred_refcount_l2() has caught up with it.  The caller must have
+ * marked the image dirty, so that a crash in between is repaired on open.
+ */
+int qcow2_defer_snapshot_refcount(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l1_table;
+    int i, refcount;
+    int ret;
+
+    assert(s->incompatible_features & QCOW2_INCOMPAT_DIRTY);
+    assert(s->nb_deferred_l2 == 0);
+
+    g_free(s->deferred_l2);
+    s->deferred_l2 = bitmap_new(s->l1_size);
+    s->deferred_l2_size = s->l1_size;
+
+    for (i = 0; i < s->l1_size; i++) {
+        uint64_t l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+
+        if (!l2_offset) {
+            continue;
+        }
+
+        refcount = update_cluster_refcount(bs, l2_offset >> s->cluster_bits, 1);
+        if (refcount < 0) {
+            /* the tables before this one keep a reference that is now
+             * leaked, but the clusters they point to are handled normally */
+            return refcount;
+        }
+
+        /* The L2 table is shared now, the next write to it copies it */
+        s->l1_table[i] = l2_offset;
+        set_bit(i, s->deferred_l2);
+        s->nb_deferred_l2++;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l1_table = g_malloc(s->l1_size * sizeof(uint64_t));
+    for (i = 0; i < s->l1_size; i++) {
+        l1_table[i] = cpu_to_be64(s->l1_table[i]);
+    }
+    ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset, l1_table,
+                           s->l1_size * sizeof(uint64_t));
+    g_free(l1_table);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Catch up with the snapshot refcount increments deferred for the L2 table
+ * that l1_index points to, if any.  This must be done before that L2 table
+ * is copied for the active L1 table, and before anything else looks at the
+ * refcounts of the clusters it points to.
+ */
+int qcow2_deferred_refcount_l2(BlockDriverState *bs, int l1_index)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (l1_index >= s->deferred_l2_size ||
+        !test_bit(l1_index, s->deferred_l2)) {
+        return 0;
+    }
+
+    ret = update_l2_refcounts(bs, s->l1_table[l1_index] & L1E_OFFSET_MASK, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    clear_bit(l1_index, s->deferred_l2);
+    s->nb_deferred_l2--;
+    return 0;
+}
+
 
 
 
@@ -916,26 +1131,19 @@ static void inc_refcounts(BlockDriverState *bs,
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table, which the caller has read from disk. While
+ * doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
-    uint16_t *refcount_table, int refcount_table_size, int64_t l2_offset,
+    uint16_t *refcount_table, int refcount_table_size, uint64_t *l2_table,
     int check_copied)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
-    int i, l2_size, nb_csectors, refcount;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
-        goto fail;
+    uint64_t l2_entry;
+    int i, nb_csectors, refcount;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -1006,15 +1214,69 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
 
 fail:
     fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-    g_free(l2_table);
     return -EIO;
 }
 
+/*
+ * L2 tables are read ahead asynchronously while earlier ones are checked,
+ * so that checking a large image is not one disk round trip per L2 table.
+ */
+#define CHECK_L2_READAHEAD 32
+
+typedef struct CheckL2Read {
+    uint64_t *l2_table;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int *in_flight;
+    bool done;
+    int ret;
+} CheckL2Read;
+
+static void check_l2_read_cb(void *opaque, int ret)
+{
+    CheckL2Read *r = opaque;
+
+    r->ret = ret;
+    r->done = true;
+    (*r->in_flight)--;
+}
+
+static void check_l2_read_start(BlockDriverState *bs, CheckL2Read *r,
+                                uint64_t l2_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    int l2_size = s->l2_size * sizeof(uint64_t);
+    BlockDriverAIOCB *acb;
+
+    r->done = false;
+    r->ret = 0;
+
+    /* Only a corrupted L1 entry is not sector aligned */
+    if (!(l2_offset & (BDRV_SECTOR_SIZE - 1))) {
+        r->iov.iov_base = r->l2_table;
+        r->iov.iov_len = l2_size;
+        qemu_iovec_init_external(&r->qiov, &r->iov, 1);
+        (*r->in_flight)++;
+        acb = bdrv_aio_readv(bs->file, l2_offset >> BDRV_SECTOR_BITS,
+                             &r->qiov, l2_size >> BDRV_SECTOR_BITS,
+                             check_l2_read_cb, r);
+        if (acb) {
+            return;
+        }
+        (*r->in_flight)--;
+    }
+
+    r->ret = bdrv_pread(bs->file, l2_offset, r->l2_table, l2_size);
+    if (r->ret >= 0 && r->ret != l2_size) {
+        r->ret = -EIO;
+    }
+    r->done = true;
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
@@ -1032,8 +1294,11 @@ static int check_refcounts_l1(BlockDriverState *bs,
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t *l1_table, l2_offset, l1_size2;
-    int i, refcount, ret;
+    CheckL2Read reads[CHECK_L2_READAHEAD];
+    int i, j, nb_l2, refcount, ret;
+    int in_flight = 0;
 
+    memset(reads, 0, sizeof(reads));
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
@@ -1052,7 +1317,10 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
-    /* Do the actual checks */
+    /* Do the actual checks.  The L2 offsets are collected at the start of
+     * l1_table, so that their tables can be read ahead afterwards.
+     */
+    nb_l2 = 0;
     for(i = 0; i < l1_size; i++) {
         l2_offset = l1_table[i];
         if (l2_offset) {
@@ -1084,20 +1352,54 @@ static int check_refcounts_l1(BlockDriverState *bs,
                 res->corruptions++;
             }
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                refcount_table_size, l2_offset, check_copied);
-            if (ret < 0) {
-                goto fail;
-            }
+            l1_table[nb_l2++] = l2_offset;
         }
     }
+
+    /* Process and check L2 entries */
+    for (j = 0; j < CHECK_L2_READAHEAD && j < nb_l2; j++) {
+        reads[j].l2_table = qemu_blockalign(bs->file, s->cluster_size);
+        reads[j].in_flight = &in_flight;
+        check_l2_read_start(bs, &reads[j], l1_table[j]);
+    }
+
+    for (i = 0; i < nb_l2; i++) {
+        CheckL2Read *r = &reads[i % CHECK_L2_READAHEAD];
+
+        while (!r->done) {
+            qemu_aio_wait();
+        }
+        if (r->ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            goto fail;
+        }
+
+        ret = check_refcounts_l2(bs, res, refcount_table,
+            refcount_table_size, r->l2_table, check_copied);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        if (i + CHECK_L2_READAHEAD < nb_l2) {
+            check_l2_read_start(bs, r, l1_table[i + CHECK_L2_READAHEAD]);
+        }
+    }
+
+    for (j = 0; j < CHECK_L2_READAHEAD; j++) {
+        qemu_vfree(reads[j].l2_table);
+    }
     g_free(l1_table);
     return 0;
 
 fail:
     fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
     res->check_errors++;
+    while (in_flight > 0) {
+        qemu_aio_wait();
+    }
+    for (j = 0; j < CHECK_L2_READAHEAD; j++) {
+        qemu_vfree(reads[j].l2_table);
+    }
     g_free(l1_table);
     return -EIO;
 }
@@ -23,6 +23,8 @@
  */
 
 #include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qemu/bitops.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
 
@@ -311,6 +313,96 @@ static int find_snapshot_by_id_or_name(BlockDriverState *bs, const char *name)
     return -1;
 }
 
+/*
+ * Taking a snapshot only increments the refcounts of the L2 tables; the
+ * clusters they point to are caught up in the background, a few L2 tables
+ * at a time, while the guest keeps running.
+ */
+#define DEFERRED_REFCOUNT_BATCH     8
+#define DEFERRED_REFCOUNT_DELAY_NS  (10 * 1000 * 1000)
+
+static void coroutine_fn qcow2_deferred_refcount_co(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    int i, n = 0;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = find_first_bit(s->deferred_l2, s->deferred_l2_size);
+         i < s->deferred_l2_size && n < DEFERRED_REFCOUNT_BATCH;
+         i = find_next_bit(s->deferred_l2, s->deferred_l2_size, i + 1)) {
+        ret = qcow2_deferred_refcount_l2(bs, i);
+        if (ret < 0) {
+            break;
+        }
+        n++;
+    }
+
+    /* Without lazy refcounts the image is clean again once the refcounts
+     * are all there and on disk */
+    if (ret == 0 && s->nb_deferred_l2 == 0 &&
+        !(s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS)) {
+        ret = qcow2_cache_flush(bs, s->l2_table_cache);
+        if (ret == 0) {
+            ret = bdrv_co_flush(bs->file);
+        }
+        if (ret == 0) {
+            s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+            ret = qcow2_update_header(bs);
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    s->deferred_co = NULL;
+
+    /* On errors the remaining work is left to the next snapshot operation
+     * or to qcow2_close(); the image stays dirty until then. */
+    if (ret == 0 && s->nb_deferred_l2 > 0) {
+        qemu_mod_timer(s->deferred_timer, qemu_get_clock_ns(rt_clock) +
+                       DEFERRED_REFCOUNT_DELAY_NS);
+    }
+}
+
+static void qcow2_deferred_refcount_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+
+    s->deferred_co = qemu_coroutine_create(qcow2_deferred_refcount_co);
+    qemu_coroutine_enter(s->deferred_co, bs);
+}
+
+/*
+ * Do all refcount updates left over from the last snapshot right now.  Must
+ * be called before anything that reads or changes snapshot refcounts.
+ */
+int qcow2_finish_deferred_refcounts(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, ret;
+
+    if (!s->deferred_timer) {
+        return 0;
+    }
+
+    while (s->deferred_co) {
+        qemu_aio_wait();
+    }
+    qemu_del_timer(s->deferred_timer);
+
+    for (i = find_first_bit(s->deferred_l2, s->deferred_l2_size);
+         i < s->deferred_l2_size;
+         i = find_next_bit(s->deferred_l2, s->deferred_l2_size, i + 1)) {
+        ret = qcow2_deferred_refcount_l2(bs, i);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 /* if no id is provided, a new one is constructed */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 {
@@ -324,6 +416,11 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 
     memset(sn, 0, sizeof(*sn));
 
+    ret = qcow2_finish_deferred_refcounts(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Generate an ID if it wasn't passed */
     if (sn_info->id_str[0] == '\0') {
         find_new_snapshot_id(bs, sn_info->id_str, sizeof(sn_info->id_str));
@@ -372,8 +469,29 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
      * Increase the refcounts of all clusters and make sure everything is
      * stable on disk before updating the snapshot table to contain a pointer
      * to the new L1 table.
+     *
+     * Version 3 images only take the references on the L2 tables here and
+     * leave the data clusters for later.  The dirty bit makes sure that a
+     * crash in between is repaired on the next open.
      */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1);
+    if (s->qcow_version >= 3) {
+        ret = qcow2_mark_dirty(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (!s->deferred_timer) {
+            s->deferred_timer = qemu_new_timer_ns(rt_clock,
+                qcow2_deferred_refcount_cb, bs);
+        }
+        ret = qcow2_defer_snapshot_refcount(bs);
+        if (s->nb_deferred_l2 > 0) {
+            qemu_mod_timer(s->deferred_timer, qemu_get_clock_ns(rt_clock) +
+                           DEFERRED_REFCOUNT_DELAY_NS);
+        }
+    } else {
+        ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset,
+                                             s->l1_size, 1);
+    }
     if (ret < 0) {
         goto fail;
     }
@@ -428,6 +546,11 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     int ret;
     uint64_t *sn_l1_table = NULL;
 
+    ret = qcow2_finish_deferred_refcounts(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
@@ -538,6 +661,11 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
     QCowSnapshot sn;
     int snapshot_index, ret;
 
+    ret = qcow2_finish_deferred_refcounts(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
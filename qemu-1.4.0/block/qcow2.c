@@ -24,6 +24,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
+#include "qemu/timer.h"
 #include <zlib.h>
 #include "block/aes.h"
 #include "block/qcow2.h"
@@ -274,21 +275,81 @@ static int qcow2_mark_clean(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    /* With lazy refcounts the dirty bit is set until the image is closed
+     * cleanly.  Images with eager refcounts never set it, so they always
+     * get the full check.
+     */
+    if ((fix & BDRV_CHECK_IF_DIRTY) &&
+        (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS) &&
+        !(s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        result->skipped = true;
+        return 0;
+    }
+
+    ret = qcow2_finish_deferred_refcounts(bs);
     if (ret < 0) {
         return ret;
     }
 
-    if (fix && result->check_errors == 0 && result->corruptions == 0) {
+    ret = qcow2_check_refcounts(bs, result, fix);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Refcounts that were too low, like after a crash while a snapshot was
+     * still catching up, leave QCOW_OFLAG_COPIED set in shared L2 tables */
+    if ((fix & BDRV_FIX_ERRORS) && result->corruptions_fixed) {
+        ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset,
+                                             s->l1_size, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if ((fix & BDRV_FIX_MASK) &&
+        result->check_errors == 0 && result->corruptions == 0) {
         return qcow2_mark_clean(bs);
     }
     return ret;
 }
 
+/*
+ * Number of tables in the L2 and refcount block caches. Unless the drive
+ * asked for a size, the L2 cache is made large enough to map the whole
+ * image (up to L2_CACHE_AUTO_MAX_SIZE), and the refcount cache a quarter of
+ * that.
+ */
+static void qcow2_get_cache_sizes(BlockDriverState *bs, int *l2_cache_size,
+                                  int *refcount_cache_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_bytes = bs->l2_cache_size;
+    uint64_t refcount_bytes = bs->refcount_cache_size;
+
+    if (l2_bytes) {
+        *l2_cache_size = MAX(l2_bytes / s->cluster_size, MIN_L2_CACHE_SIZE);
+    } else {
+        l2_bytes = MIN((uint64_t) s->l1_size * s->cluster_size,
+                       L2_CACHE_AUTO_MAX_SIZE);
+        *l2_cache_size = MAX(l2_bytes / s->cluster_size, L2_CACHE_SIZE);
+    }
+
+    if (refcount_bytes) {
+        *refcount_cache_size = MAX(refcount_bytes / s->cluster_size,
+                                   REFCOUNT_CACHE_SIZE);
+    } else {
+        *refcount_cache_size = MAX(*l2_cache_size / 4, REFCOUNT_CACHE_SIZE);
+    }
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
+    int l2_cache_size, refcount_cache_size;
     QCowHeader header;
     uint64_t ext_end;
 
@@ -430,8 +491,9 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    qcow2_get_cache_sizes(bs, &l2_cache_size, &refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -446,6 +508,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QTAILQ_INIT(&s->discards);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL)) {
@@ -745,6 +808,25 @@ fail:
     return ret;
 }
 
+/*
+ * Whole-cluster writes of zeroes are recorded with the zero flag instead of
+ * allocating and filling host clusters, which keeps sparse images sparse.
+ * Encrypted images are left alone: the flag would reveal what the guest wrote.
+ */
+static bool qcow2_is_zero_write(BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->qcow_version < 3 || s->crypt_method) {
+        return false;
+    }
+    if ((sector_num | nb_sectors) & (s->cluster_sectors - 1)) {
+        return false;
+    }
+    return qemu_iovec_is_zero(qiov, 0, (size_t) nb_sectors * BDRV_SECTOR_SIZE);
+}
+
 static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                            int64_t sector_num,
                            int remaining_sectors,
@@ -764,6 +846,17 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     trace_qcow2_writev_start_req(qemu_coroutine_self(), sector_num,
                                  remaining_sectors);
 
+    if (qcow2_is_zero_write(bs, sector_num, remaining_sectors, qiov)) {
+        trace_qcow2_writev_zero(qemu_coroutine_self(), sector_num,
+                                remaining_sectors);
+        s->cluster_cache_offset = -1; /* disable compressed cache */
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+                                  remaining_sectors);
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
@@ -871,12 +964,24 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_finish_deferred_refcounts(bs);
+    if (s->deferred_timer) {
+        qemu_free_timer(s->deferred_timer);
+        g_free(s->deferred_l2);
+    }
+
     g_free(s->l1_table);
 
+    qcow2_release_alloc_pool(bs);
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
-    qcow2_mark_clean(bs);
+    /* Refcounts that are still missing are repaired on the next open */
+    if (ret == 0) {
+        qcow2_mark_clean(bs);
+    }
 
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
@@ -1584,6 +1689,23 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static void qcow2_get_cache_stats(const BlockDriverState *bs,
+                                  BlockDeviceStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t hits, misses;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses);
+    stats->has_l2_cache_hits = stats->has_l2_cache_misses = true;
+    stats->l2_cache_hits = hits;
+    stats->l2_cache_misses = misses;
+
+    qcow2_cache_get_stats(s->refcount_block_cache, &hits, &misses);
+    stats->has_refcount_cache_hits = stats->has_refcount_cache_misses = true;
+    stats->refcount_cache_hits = hits;
+    stats->refcount_cache_misses = misses;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -1605,8 +1727,8 @@ static void dump_refcounts(BlockDriverState *bs)
 }
 #endif
 
-static int qcow2_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
-                              int64_t pos, int size)
+static int qcow2_save_vmstate(BlockDriverState *bs, QEMUIOVector *qiov,
+                              int64_t pos)
 {
     BDRVQcowState *s = bs->opaque;
     int growable = bs->growable;
@@ -1614,7 +1736,7 @@ static int qcow2_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
 
     BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_SAVE);
     bs->growable = 1;
-    ret = bdrv_pwrite(bs, qcow2_vm_state_offset(s) + pos, buf, size);
+    ret = bdrv_pwritev(bs, qcow2_vm_state_offset(s) + pos, qiov);
     bs->growable = growable;
 
     return ret;
@@ -1707,6 +1829,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_cache_stats = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -53,6 +53,14 @@
 
 #define L2_CACHE_SIZE 16
 
+/* Bytes of data clusters reserved at once for allocating writes (at least
+ * one cluster); this is also what a crash can leak */
+#define QCOW2_ALLOC_POOL_SIZE (4 * 1024 * 1024)
+
+#define MIN_L2_CACHE_SIZE 2
+/* Upper bound when sizing the L2 cache to cover the whole image */
+#define L2_CACHE_AUTO_MAX_SIZE (32 * 1024 * 1024)
+
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
@@ -118,6 +126,14 @@ enum {
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY,
 };
 
+/* Host clusters freed by a guest discard, punched out of the image file once
+ * the request is done */
+typedef struct Qcow2DiscardRegion {
+    uint64_t offset;
+    uint64_t bytes;
+    QTAILQ_ENTRY(Qcow2DiscardRegion) next;
+} Qcow2DiscardRegion;
+
 /* Compatible feature bits */
 enum {
     QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR = 0,
@@ -154,14 +170,33 @@ typedef struct BDRVQcowState {
     uint64_t cluster_cache_offset;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
+    /* while set, clusters whose refcount drops to zero are queued in
+     * discards instead of just being left allocated in the host file */
+    bool cache_discards;
+    QTAILQ_HEAD(Qcow2DiscardRegionHead, Qcow2DiscardRegion) discards;
+
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
+    /* data clusters whose refcount is already 1 but that no L2 entry
+     * points to yet, handed out by qcow2_alloc_data_clusters() */
+    uint64_t alloc_pool_offset;
+    unsigned int alloc_pool_clusters;
+
     CoMutex lock;
 
+    /* L2 tables whose clusters still lack the refcount increment for the
+     * newest snapshot, indexed like l1_table.  deferred_timer periodically
+     * starts deferred_co to catch up with a few of them. */
+    unsigned long *deferred_l2;
+    int deferred_l2_size;
+    int nb_deferred_l2;
+    QEMUTimer *deferred_timer;
+    Coroutine *deferred_co;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -319,9 +354,15 @@ void qcow2_free_clusters(BlockDriverState *bs,
     int64_t offset, int64_t size);
 void qcow2_free_any_clusters(BlockDriverState *bs,
     uint64_t cluster_offset, int nb_clusters);
+int qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t *host_offset,
+    unsigned int nb_clusters);
+void qcow2_release_alloc_pool(BlockDriverState *bs);
+void qcow2_process_discards(BlockDriverState *bs, int ret);
 
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
+int qcow2_defer_snapshot_refcount(BlockDriverState *bs);
+int qcow2_deferred_refcount_l2(BlockDriverState *bs, int l1_index);
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
@@ -354,6 +395,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
 int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id);
 int qcow2_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab);
 int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name);
+int qcow2_finish_deferred_refcounts(BlockDriverState *bs);
 
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
@@ -361,6 +403,7 @@ int qcow2_read_snapshots(BlockDriverState *bs);
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
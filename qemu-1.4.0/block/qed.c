@@ -284,6 +284,86 @@ static CachedL2Table *qed_new_l2_table(BDRVQEDState *s)
 }
 
 static void qed_aio_next_io(void *opaque, int ret);
+static void qed_aio_write_data(void *opaque, int ret,
+                               uint64_t offset, size_t len);
+static void qed_start_need_check_timer(BDRVQEDState *s);
+
+/**
+ * Check whether an allocating write has to wait
+ *
+ * A request may not allocate while the queue is plugged, while another
+ * request allocates into the same L2 table, or while another request
+ * allocates a new L2 table if it needs one itself.  The last rule keeps
+ * updates to the same L1 table sector from overtaking each other.
+ */
+static bool qed_allocating_write_blocked(BDRVQEDState *s, QEDAIOCB *acb)
+{
+    unsigned int index = qed_l1_index(s, acb->cur_pos);
+    QEDAIOCB *other;
+
+    if (s->allocating_write_reqs_plugged) {
+        return true;
+    }
+    if (acb->find_cluster_ret == QED_CLUSTER_L1 &&
+        s->l1_alloc_acb && s->l1_alloc_acb != acb) {
+        return true;
+    }
+    QLIST_FOREACH(other, &s->allocating_writes, alloc_next) {
+        if (other != acb && other->alloc_l1_index == index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Restart the waiting allocating writes that may proceed now
+ */
+static void qed_wake_allocating_write_reqs(BDRVQEDState *s)
+{
+    QSIMPLEQ_HEAD(, QEDAIOCB) waiting = QSIMPLEQ_HEAD_INITIALIZER(waiting);
+    QSIMPLEQ_HEAD(, QEDAIOCB) woken = QSIMPLEQ_HEAD_INITIALIZER(woken);
+    QEDAIOCB *acb;
+
+    /* Sort the requests first, restarted requests may queue up again */
+    QSIMPLEQ_CONCAT(&waiting, &s->allocating_write_reqs);
+    while ((acb = QSIMPLEQ_FIRST(&waiting))) {
+        QSIMPLEQ_REMOVE_HEAD(&waiting, next);
+        if (qed_allocating_write_blocked(s, acb)) {
+            QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
+        } else {
+            QSIMPLEQ_INSERT_TAIL(&woken, acb, next);
+        }
+    }
+
+    /* Looking up the cluster again decides whether they still allocate */
+    while ((acb = QSIMPLEQ_FIRST(&woken))) {
+        QSIMPLEQ_REMOVE_HEAD(&woken, next);
+        qed_aio_next_io(acb, 0);
+    }
+}
+
+/**
+ * Let go of the L2 table once an allocating write step is done
+ */
+static void qed_release_allocating_write(BDRVQEDState *s, QEDAIOCB *acb)
+{
+    assert(acb->alloc_locked);
+
+    QLIST_REMOVE(acb, alloc_next);
+    acb->alloc_locked = false;
+    if (s->l1_alloc_acb == acb) {
+        s->l1_alloc_acb = NULL;
+    }
+    s->allocating_writes_gen++;
+
+    if (!QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
+        qed_wake_allocating_write_reqs(s);
+    } else if (QLIST_EMPTY(&s->allocating_writes) &&
+               (s->header.features & QED_F_NEED_CHECK)) {
+        qed_start_need_check_timer(s);
+    }
+}
 
 static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 {
@@ -294,16 +374,11 @@ static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 
 static void qed_unplug_allocating_write_reqs(BDRVQEDState *s)
 {
-    QEDAIOCB *acb;
-
     assert(s->allocating_write_reqs_plugged);
 
     s->allocating_write_reqs_plugged = false;
 
-    acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-    if (acb) {
-        qed_aio_next_io(acb, 0);
-    }
+    qed_wake_allocating_write_reqs(s);
 }
 
 static void qed_finish_clear_need_check(void *opaque, int ret)
@@ -340,6 +415,7 @@ static void qed_need_check_timer_cb(void *opaque)
 
     /* The timer should only fire when allocating writes have drained */
     assert(!QSIMPLEQ_FIRST(&s->allocating_write_reqs));
+    assert(QLIST_EMPTY(&s->allocating_writes));
 
     trace_qed_need_check_timer_cb(s);
 
@@ -373,6 +449,26 @@ static void bdrv_qed_rebind(BlockDriverState *bs)
     s->bs = bs;
 }
 
+/*
+ * Number of tables in the L2 cache.  Unless the drive asked for a size, the
+ * cache is made large enough to map the whole image, within limits.
+ */
+static unsigned int qed_l2_cache_size(BDRVQEDState *s)
+{
+    uint64_t table_bytes = (uint64_t)s->header.cluster_size *
+                           s->header.table_size;
+    uint64_t n;
+
+    if (s->bs->l2_cache_size) {
+        n = s->bs->l2_cache_size / table_bytes;
+        return MAX(MIN(n, s->table_nelems), QED_MIN_L2_CACHE_SIZE);
+    }
+
+    n = DIV_ROUND_UP(s->header.image_size, 1ULL << s->l1_shift);
+    n = MIN(n, QED_MAX_AUTO_L2_CACHE_BYTES / table_bytes);
+    return MAX(n, QED_DEFAULT_L2_CACHE_SIZE);
+}
+
 static int bdrv_qed_open(BlockDriverState *bs, int flags)
 {
     BDRVQEDState *s = bs->opaque;
@@ -382,6 +478,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
 
     s->bs = bs;
     QSIMPLEQ_INIT(&s->allocating_write_reqs);
+    QLIST_INIT(&s->allocating_writes);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
     if (ret < 0) {
@@ -469,7 +566,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     }
 
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+    qed_init_l2_cache(&s->l2_cache, qed_l2_cache_size(s));
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -880,26 +977,17 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
         acb->qiov->iov[0].iov_base = NULL;
     }
 
+    /* Let requests waiting for this one's L2 table go on; this may restart
+     * them right away, so do it last.
+     */
+    if (acb->alloc_locked) {
+        qed_release_allocating_write(s, acb);
+    }
+
     /* Arrange for a bh to invoke the completion function */
     acb->bh_ret = ret;
     acb->bh = qemu_bh_new(qed_aio_complete_bh, acb);
     qemu_bh_schedule(acb->bh);
-
-    /* Start next allocating write request waiting behind this one.  Note that
-     * requests enqueue themselves when they first hit an unallocated cluster
-     * but they wait until the entire request is finished before waking up the
-     * next request in the queue.  This ensures that we don't cycle through
-     * requests multiple times but rather finish one at a time completely.
-     */
-    if (acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
-        acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-        if (acb) {
-            qed_aio_next_io(acb, 0);
-        } else if (s->header.features & QED_F_NEED_CHECK) {
-            qed_start_need_check_timer(s);
-        }
-    }
 }
 
 /**
@@ -1103,6 +1191,40 @@ static void qed_aio_write_zero_cluster(void *opaque, int ret)
     qed_aio_write_l2_update(acb, 0, 1);
 }
 
+/**
+ * Check whether an allocating write only stores zeroes in whole clusters
+ *
+ * @acb:        Write request
+ * @len:        Length in bytes
+ *
+ * Such writes are turned into zero cluster markers in the L2 table so that no
+ * data clusters are allocated for them.
+ */
+static bool qed_is_zero_write(QEDAIOCB *acb, size_t len)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+
+    if (qed_offset_into_cluster(s, acb->cur_pos) != 0 ||
+        qed_offset_into_cluster(s, len) != 0) {
+        return false;
+    }
+    return qemu_iovec_is_zero(acb->qiov, acb->qiov_offset, len);
+}
+
+typedef struct {
+    GenericCB gencb;
+    BDRVQEDState *s;
+} QEDSetNeedCheckCB;
+
+static void qed_set_need_check_cb(void *opaque, int ret)
+{
+    QEDSetNeedCheckCB *need_check_cb = opaque;
+    BDRVQEDState *s = need_check_cb->s;
+
+    gencb_complete(&need_check_cb->gencb, ret);
+    qed_unplug_allocating_write_reqs(s);
+}
+
 /**
  * Write new data cluster
  *
@@ -1110,6 +1232,11 @@ static void qed_aio_write_zero_cluster(void *opaque, int ret)
  * @len:        Length in bytes
  *
  * This path is taken when writing to previously unallocated clusters.
+ *
+ * Requests allocating into different L2 tables proceed in parallel; one that
+ * has to wait is queued on allocating_write_reqs and looks up its cluster
+ * again when woken.  The L2 table is held until the request moves on to the
+ * next cluster range or completes.
  */
 static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
 {
@@ -1117,24 +1244,44 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     BlockDriverCompletionFunc *cb;
 
     /* Cancel timer when the first allocating request comes in */
-    if (QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
+    if (QLIST_EMPTY(&s->allocating_writes) &&
+        QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
         qed_cancel_need_check_timer(s);
     }
 
-    /* Freeze this request if another allocating write is in progress */
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
+    /* Freeze this request if another one allocates into its L2 table */
+    if (qed_allocating_write_blocked(s, acb)) {
         QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
-    }
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs) ||
-        s->allocating_write_reqs_plugged) {
+        if (acb->alloc_locked) {
+            qed_release_allocating_write(s, acb);
+        }
         return; /* wait for existing request to finish */
     }
 
+    if (!acb->alloc_locked) {
+        acb->alloc_locked = true;
+        acb->alloc_l1_index = qed_l1_index(s, acb->cur_pos);
+        QLIST_INSERT_HEAD(&s->allocating_writes, acb, alloc_next);
+
+        /* Clusters may have been allocated while the lookup was reading the
+         * L2 table, look again now that nobody else can.
+         */
+        if (acb->lookup_gen != s->allocating_writes_gen) {
+            qed_find_cluster(s, &acb->request, acb->cur_pos,
+                             acb->end_pos - acb->cur_pos,
+                             qed_aio_write_data, acb);
+            return;
+        }
+    }
+    if (acb->find_cluster_ret == QED_CLUSTER_L1) {
+        s->l1_alloc_acb = acb;
+    }
+
     acb->cur_nclusters = qed_bytes_to_clusters(s,
             qed_offset_into_cluster(s, acb->cur_pos) + len);
     qemu_iovec_concat(&acb->cur_qiov, acb->qiov, acb->qiov_offset, len);
 
-    if (acb->flags & QED_AIOCB_ZERO) {
+    if ((acb->flags & QED_AIOCB_ZERO) || qed_is_zero_write(acb, len)) {
         /* Skip ahead if the clusters are already zero */
         if (acb->find_cluster_ret == QED_CLUSTER_ZERO) {
             qed_aio_next_io(acb, 0);
@@ -1148,8 +1295,15 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     }
 
     if (qed_should_set_need_check(s)) {
+        QEDSetNeedCheckCB *need_check_cb;
+
+        /* Nobody may update an L2 table before the flag is on disk */
+        qed_plug_allocating_write_reqs(s);
+        need_check_cb = gencb_alloc(sizeof(*need_check_cb), cb, acb);
+        need_check_cb->s = s;
+
         s->header.features |= QED_F_NEED_CHECK;
-        qed_write_header(s, cb, acb);
+        qed_write_header(s, qed_set_need_check_cb, need_check_cb);
     } else {
         cb(acb, 0);
     }
@@ -1283,6 +1437,11 @@ static void qed_aio_next_io(void *opaque, int ret)
 
     trace_qed_aio_next_io(s, acb, ret, acb->cur_pos + acb->cur_qiov.size);
 
+    /* Done with the L2 table, if this step allocated */
+    if (acb->alloc_locked) {
+        qed_release_allocating_write(s, acb);
+    }
+
     /* Handle I/O error */
     if (ret) {
         qed_aio_complete(acb, ret);
@@ -1300,6 +1459,7 @@ static void qed_aio_next_io(void *opaque, int ret)
     }
 
     /* Find next cluster and start I/O */
+    acb->lookup_gen = s->allocating_writes_gen;
     qed_find_cluster(s, &acb->request,
                       acb->cur_pos, acb->end_pos - acb->cur_pos,
                       io_fn, acb);
@@ -1323,6 +1483,7 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
     acb->cur_pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
     acb->end_pos = acb->cur_pos + nb_sectors * BDRV_SECTOR_SIZE;
     acb->request.l2_table = NULL;
+    acb->alloc_locked = false;
     qemu_iovec_init(&acb->cur_qiov, qiov->niov);
 
     /* Start request */
@@ -1407,6 +1568,73 @@ static int coroutine_fn bdrv_qed_co_write_zeroes(BlockDriverState *bs,
     return cb.ret;
 }
 
+typedef struct {
+    Coroutine *co;
+    bool done;
+    int ret;
+    uint64_t offset;
+    size_t len;
+} QEDDiscardCB;
+
+static void qed_co_discard_cb(void *opaque, int ret, uint64_t offset,
+                              size_t len)
+{
+    QEDDiscardCB *cb = opaque;
+
+    cb->done = true;
+    cb->ret = ret;
+    cb->offset = offset;
+    cb->len = len;
+    if (cb->co) {
+        qemu_coroutine_enter(cb->co, NULL);
+    }
+}
+
+/* QED has no reference counts, so discarded clusters stay mapped.  Passing
+ * the discard on still lets the image file deallocate the space behind them;
+ * reads of discarded sectors are undefined anyway.
+ */
+static int coroutine_fn bdrv_qed_co_discard(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors)
+{
+    BDRVQEDState *s = bs->opaque;
+    uint64_t pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
+    uint64_t end = pos + (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    QEDRequest request = { .l2_table = NULL };
+    int ret = 0;
+
+    /* Only whole clusters can be deallocated */
+    pos = qed_start_of_cluster(s, pos + s->header.cluster_size - 1);
+    end = qed_start_of_cluster(s, end);
+
+    while (pos < end) {
+        QEDDiscardCB cb = { .done = false };
+
+        qed_find_cluster(s, &request, pos, end - pos, qed_co_discard_cb, &cb);
+        while (!cb.done) {
+            cb.co = qemu_coroutine_self();
+            qemu_coroutine_yield();
+        }
+
+        if (cb.ret < 0) {
+            ret = cb.ret;
+            break;
+        }
+        if (cb.ret == QED_CLUSTER_FOUND) {
+            ret = bdrv_co_discard(bs->file, cb.offset / BDRV_SECTOR_SIZE,
+                                  cb.len / BDRV_SECTOR_SIZE);
+            if (ret < 0) {
+                break;
+            }
+        }
+        pos += cb.len;
+    }
+
+    qed_unref_l2_cache_entry(request.l2_table);
+    return ret;
+}
+
 static int bdrv_qed_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVQEDState *s = bs->opaque;
@@ -1534,7 +1762,12 @@ static int bdrv_qed_check(BlockDriverState *bs, BdrvCheckResult *result,
 {
     BDRVQEDState *s = bs->opaque;
 
-    return qed_check(s, result, !!fix);
+    if ((fix & BDRV_CHECK_IF_DIRTY) &&
+        !(s->header.features & QED_F_NEED_CHECK)) {
+        result->skipped = true;
+        return 0;
+    }
+    return qed_check(s, result, !!(fix & BDRV_FIX_MASK));
 }
 
 static QEMUOptionParameter qed_create_options[] = {
@@ -1579,6 +1812,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_aio_readv           = bdrv_qed_aio_readv,
     .bdrv_aio_writev          = bdrv_qed_aio_writev,
     .bdrv_co_write_zeroes     = bdrv_qed_co_write_zeroes,
+    .bdrv_co_discard          = bdrv_qed_co_discard,
     .bdrv_truncate            = bdrv_qed_truncate,
     .bdrv_getlength           = bdrv_qed_getlength,
     .bdrv_get_info            = bdrv_qed_get_info,
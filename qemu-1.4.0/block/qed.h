@@ -81,6 +81,14 @@ enum {
 
     /* Delay to flush and clean image after last allocating write completes */
     QED_NEED_CHECK_TIMEOUT = 5,    /* in seconds */
+
+    /* L2 cache size, unless the drive asks for one (l2-cache-size): enough
+     * tables to map the whole image, but at least QED_DEFAULT_L2_CACHE_SIZE
+     * tables and at most QED_MAX_AUTO_L2_CACHE_BYTES worth of them.
+     */
+    QED_MIN_L2_CACHE_SIZE = 4,     /* in tables */
+    QED_DEFAULT_L2_CACHE_SIZE = 50,
+    QED_MAX_AUTO_L2_CACHE_BYTES = 32 * 1024 * 1024,
 };
 
 typedef struct {
@@ -115,8 +123,10 @@ typedef struct CachedL2Table {
 } CachedL2Table;
 
 typedef struct {
-    QTAILQ_HEAD(, CachedL2Table) entries;
+    QTAILQ_HEAD(CachedL2TableList, CachedL2Table) entries;  /* LRU first */
+    GHashTable *offsets;            /* table offset -> entry */
     unsigned int n_entries;
+    unsigned int max_entries;
 } L2TableCache;
 
 typedef struct QEDRequest {
@@ -133,6 +143,7 @@ typedef struct QEDAIOCB {
     QEMUBH *bh;
     int bh_ret;                     /* final return status for completion bh */
     QSIMPLEQ_ENTRY(QEDAIOCB) next;  /* next request */
+    QLIST_ENTRY(QEDAIOCB) alloc_next; /* allocating writes in progress */
     int flags;                      /* QED_AIOCB_* bits ORed together */
     bool *finished;                 /* signal for cancel completion */
     uint64_t end_pos;               /* request end on block device, in bytes */
@@ -148,6 +159,13 @@ typedef struct QEDAIOCB {
     unsigned int cur_nclusters;     /* number of clusters being accessed */
     int find_cluster_ret;           /* used for L1/L2 update */
 
+    /* Allocating writes to one L2 table are serialized, see
+     * qed_aio_write_alloc()
+     */
+    bool alloc_locked;              /* on allocating_writes list? */
+    unsigned int alloc_l1_index;    /* L2 table being allocated into */
+    unsigned int lookup_gen;        /* allocating_writes_gen at lookup */
+
     QEDRequest request;
 } QEDAIOCB;
 
@@ -163,8 +181,14 @@ typedef struct {
     uint32_t l2_shift;
     uint32_t l2_mask;
 
-    /* Allocating write request queue */
+    /* Allocating writes waiting for their L2 table, and those in progress.
+     * At most one request allocates into a given L2 table at a time, and at
+     * most one allocates a new L2 table (l1_alloc_acb).
+     */
     QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_reqs;
+    QLIST_HEAD(, QEDAIOCB) allocating_writes;
+    QEDAIOCB *l1_alloc_acb;
+    unsigned int allocating_writes_gen; /* bumped when one finishes a step */
     bool allocating_write_reqs_plugged;
 
     /* Periodic flush and clear need check flag */
@@ -218,7 +242,7 @@ int qed_write_header_sync(BDRVQEDState *s);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
@@ -36,6 +36,18 @@ void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx);
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx);
+#endif
+
+/* linux-sg.c - asynchronous SG_IO on /dev/sg* */
+#ifdef CONFIG_LINUX
+#include <scsi/sg.h>
+void *sg_aio_init(int fd);
+void sg_aio_cleanup(void *sg_ctx);
+BlockDriverAIOCB *sg_aio_submit(BlockDriverState *bs, void *sg_ctx,
+                                sg_io_hdr_t *hdr,
+                                BlockDriverCompletionFunc *cb, void *opaque);
 #endif
 
 #ifdef _WIN32
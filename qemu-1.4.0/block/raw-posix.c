@@ -133,6 +133,8 @@ typedef struct BDRVRawState {
     int64_t fd_error_time;
     int fd_got_error;
     int fd_media_changed;
+    /* asynchronous SG_IO state for /dev/sg*, NULL if unavailable */
+    void *sg_ctx;
 #endif
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
@@ -398,6 +400,12 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     s->open_flags = raw_s->open_flags;
 
+#if defined(__linux__)
+    if (s->sg_ctx) {
+        sg_aio_cleanup(s->sg_ctx);
+        s->sg_ctx = sg_aio_init(raw_s->fd);
+    }
+#endif
     qemu_close(s->fd);
     s->fd = raw_s->fd;
 #ifdef CONFIG_LINUX_AIO
@@ -561,41 +569,45 @@ static ssize_t handle_aiocb_rw_linear(RawPosixAIOData *aiocb, char *buf)
     return offset;
 }
 
+static ssize_t handle_aiocb_rw_split(RawPosixAIOData *aiocb);
+
 static ssize_t handle_aiocb_rw(RawPosixAIOData *aiocb)
 {
     ssize_t nbytes;
     char *buf;
 
-    if (!(aiocb->aio_type & QEMU_AIO_MISALIGNED)) {
-        /*
-         * If there is just a single buffer, and it is properly aligned
-         * we can just use plain pread/pwrite without any problems.
-         */
-        if (aiocb->aio_niov == 1) {
-             return handle_aiocb_rw_linear(aiocb, aiocb->aio_iov->iov_base);
-        }
-        /*
-         * We have more than one iovec, and all are properly aligned.
-         *
-         * Try preadv/pwritev first and fall back to linearizing the
-         * buffer if it's not supported.
-         */
-        if (preadv_present) {
-            nbytes = handle_aiocb_rw_vector(aiocb);
-            if (nbytes == aiocb->aio_nbytes ||
-                (nbytes < 0 && nbytes != -ENOSYS)) {
-                return nbytes;
-            }
-            preadv_present = false;
-        }
+    if (aiocb->aio_type & QEMU_AIO_MISALIGNED) {
+        return handle_aiocb_rw_split(aiocb);
+    }
 
-        /*
-         * XXX(hch): short read/write.  no easy way to handle the reminder
-         * using these interfaces.  For now retry using plain
-         * pread/pwrite?
-         */
+    /*
+     * If there is just a single buffer, and it is properly aligned
+     * we can just use plain pread/pwrite without any problems.
+     */
+    if (aiocb->aio_niov == 1) {
+         return handle_aiocb_rw_linear(aiocb, aiocb->aio_iov->iov_base);
+    }
+    /*
+     * We have more than one iovec, and all are properly aligned.
+     *
+     * Try preadv/pwritev first and fall back to linearizing the
+     * buffer if it's not supported.
+     */
+    if (preadv_present) {
+        nbytes = handle_aiocb_rw_vector(aiocb);
+        if (nbytes == aiocb->aio_nbytes ||
+            (nbytes < 0 && nbytes != -ENOSYS)) {
+            return nbytes;
+        }
+        preadv_present = false;
     }
 
+    /*
+     * XXX(hch): short read/write.  no easy way to handle the reminder
+     * using these interfaces.  For now retry using plain
+     * pread/pwrite?
+     */
+
     /*
      * Ok, we have to do it the hard way, copy all segments into
      * a single aligned buffer.
@@ -632,6 +644,118 @@ static ssize_t handle_aiocb_rw(RawPosixAIOData *aiocb)
     return nbytes;
 }
 
+/* Move the (@idx, @off) position in the request vector forward by @bytes */
+static void raw_iov_advance(RawPosixAIOData *aiocb, int *idx, size_t *off,
+                            size_t bytes)
+{
+    struct iovec *iov = aiocb->aio_iov;
+
+    while (*idx < aiocb->aio_niov && bytes + *off >= iov[*idx].iov_len) {
+        bytes -= iov[*idx].iov_len - *off;
+        (*idx)++;
+        *off = 0;
+    }
+    *off += bytes;
+}
+
+/*
+ * Number of bytes from request offset @pos, which is at byte @off of
+ * iovec @idx, that can be passed to the kernel as a single O_DIRECT
+ * segment, or 0 if the data there has to be bounced.
+ */
+static size_t raw_direct_len(RawPosixAIOData *aiocb, int idx, size_t off,
+                             uint64_t pos)
+{
+    struct iovec *iov = &aiocb->aio_iov[idx];
+    size_t len = MIN(iov->iov_len - off, aiocb->aio_nbytes - pos);
+
+    if (((uintptr_t)iov->iov_base + off) % aiocb->bs->buffer_alignment) {
+        return 0;
+    }
+    return len & ~(BDRV_SECTOR_SIZE - 1);
+}
+
+/*
+ * Misaligned O_DIRECT request: runs of the vector that are suitably
+ * aligned are passed to the kernel as they are, and only the blocks in
+ * between go through a bounce buffer.  A guest buffer that is merely
+ * split at odd places then costs a copy of a few blocks, not of the
+ * whole request.
+ *
+ * Returns the number of bytes transferred or -errno, like
+ * handle_aiocb_rw().
+ */
+static ssize_t handle_aiocb_rw_split(RawPosixAIOData *aiocb)
+{
+    RawPosixAIOData sub = *aiocb;
+    uint64_t nbytes = aiocb->aio_nbytes;
+    uint64_t start, pos = 0;
+    struct iovec *direct, bounce;
+    int idx = 0, ndirect;
+    size_t off = 0, len;
+    ssize_t ret = 0;
+
+    direct = g_new(struct iovec, MIN(aiocb->aio_niov, IOV_MAX));
+    sub.aio_type &= ~QEMU_AIO_MISALIGNED;
+    raw_iov_advance(aiocb, &idx, &off, 0);
+
+    while (pos < nbytes) {
+        start = pos;
+        ndirect = 0;
+        while (pos < nbytes && ndirect < IOV_MAX &&
+               (len = raw_direct_len(aiocb, idx, off, pos))) {
+            direct[ndirect].iov_base = aiocb->aio_iov[idx].iov_base;
+            direct[ndirect].iov_base += off;
+            direct[ndirect].iov_len = len;
+            ndirect++;
+            raw_iov_advance(aiocb, &idx, &off, len);
+            pos += len;
+        }
+
+        if (ndirect) {
+            sub.aio_iov = direct;
+            sub.aio_niov = ndirect;
+        } else {
+            /* Bounce up to the next sector the kernel can take directly */
+            do {
+                raw_iov_advance(aiocb, &idx, &off, BDRV_SECTOR_SIZE);
+                pos += BDRV_SECTOR_SIZE;
+            } while (pos < nbytes && !raw_direct_len(aiocb, idx, off, pos));
+            bounce.iov_base = qemu_blockalign(aiocb->bs, pos - start);
+            bounce.iov_len = pos - start;
+            if (aiocb->aio_type & QEMU_AIO_WRITE) {
+                iov_to_buf(aiocb->aio_iov, aiocb->aio_niov, start,
+                           bounce.iov_base, bounce.iov_len);
+            }
+            sub.aio_iov = &bounce;
+            sub.aio_niov = 1;
+        }
+
+        sub.aio_offset = aiocb->aio_offset + start;
+        sub.aio_nbytes = pos - start;
+        ret = handle_aiocb_rw(&sub);
+
+        if (!ndirect) {
+            if (!(aiocb->aio_type & QEMU_AIO_WRITE) && ret > 0) {
+                iov_from_buf(aiocb->aio_iov, aiocb->aio_niov, start,
+                             bounce.iov_base, ret);
+            }
+            qemu_vfree(bounce.iov_base);
+        }
+        if (ret < 0) {
+            break;
+        }
+        ret += start;
+        if (ret < pos) {
+            /* Short read at the end of the file */
+            break;
+        }
+    }
+
+    g_free(direct);
+    return ret;
+}
+
 #ifdef CONFIG_XFS
 static int xfs_discard(BDRVRawState *s, int64_t offset, uint64_t bytes)
 {
@@ -763,7 +887,8 @@ static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb->aio_offset = sector_num * 512;
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
-    return thread_pool_submit_aio(aio_worker, acb, cb, opaque);
+    return thread_pool_submit_aio_pool(bs->thread_pool, aio_worker, acb,
+                                       cb, opaque);
 }
 
 static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
@@ -795,6 +920,26 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
                        cb, opaque, type);
 }
 
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx);
+    }
+#endif
+}
+
 static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -825,12 +970,24 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+#if defined(__linux__)
+    if (s->sg_ctx) {
+        sg_aio_cleanup(s->sg_ctx);
+        s->sg_ctx = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
     }
 }
 
+static int raw_get_passthrough_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    return s->fd;
+}
+
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVRawState *s = bs->opaque;
@@ -1171,11 +1328,14 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
     .bdrv_aio_discard = raw_aio_discard,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
+    .bdrv_get_passthrough_fd = raw_get_passthrough_fd,
 
     .create_options = raw_create_options,
 };
@@ -1347,6 +1507,12 @@ static int hdev_open(BlockDriverState *bs, const char *filename, int flags)
         }
     }
 
+#if defined(__linux__)
+    if (bs->sg) {
+        s->sg_ctx = sg_aio_init(s->fd);
+    }
+#endif
+
     return ret;
 }
 
@@ -1417,6 +1583,14 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+    if (s->sg_ctx && req == SG_IO) {
+        BlockDriverAIOCB *sg_acb = sg_aio_submit(bs, s->sg_ctx, buf,
+                                                 cb, opaque);
+        if (sg_acb) {
+            return sg_acb;
+        }
+    }
+
     acb = g_slice_new(RawPosixAIOData);
     acb->bs = bs;
     acb->aio_type = QEMU_AIO_IOCTL;
@@ -1424,7 +1598,8 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
-    return thread_pool_submit_aio(aio_worker, acb, cb, opaque);
+    return thread_pool_submit_aio_pool(bs->thread_pool, aio_worker, acb,
+                                       cb, opaque);
 }
 
 #elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -1512,6 +1687,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
     .bdrv_aio_discard   = hdev_aio_discard,
+    .bdrv_io_plug       = raw_aio_plug,
+    .bdrv_io_unplug     = raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -114,6 +114,11 @@ static int raw_has_zero_init(BlockDriverState *bs)
     return bdrv_has_zero_init(bs->file);
 }
 
+static int raw_get_passthrough_fd(BlockDriverState *bs)
+{
+    return bdrv_get_passthrough_fd(bs->file);
+}
+
 static BlockDriver bdrv_raw = {
     .format_name        = "raw",
 
@@ -145,6 +150,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_create        = raw_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = raw_has_zero_init,
+    .bdrv_get_passthrough_fd = raw_get_passthrough_fd,
 };
 
 static void bdrv_raw_init(void)
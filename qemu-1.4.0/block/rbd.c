@@ -15,6 +15,8 @@
 
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/timer.h"
 #include "block/block_int.h"
 
 #include <rbd/librbd.h>
@@ -60,6 +62,11 @@
 #define RBD_MAX_SNAP_NAME_SIZE 128
 #define RBD_MAX_SNAPS 100
 
+/* Writes submitted in the same main loop iteration that continue each other
+ * are sent to the cluster as one op, up to this size.
+ */
+#define RBD_MAX_MERGE_SIZE OBJ_MAX_SIZE
+
 typedef enum {
     RBD_AIO_READ,
     RBD_AIO_WRITE,
@@ -74,10 +81,14 @@ typedef struct RBDAIOCB {
     char *bounce;
     RBDAIOCmd cmd;
     int64_t sector_num;
+    int64_t size;
     int error;
     struct BDRVRBDState *s;
     int cancelled;
     int status;
+    /* the other requests merged into the same op */
+    struct RBDAIOCB *merge_next;
+    QSIMPLEQ_ENTRY(RBDAIOCB) pending;
 } RBDAIOCB;
 
 typedef struct RADOSCB {
@@ -87,22 +98,32 @@ typedef struct RADOSCB {
     int done;
     int64_t size;
     char *buf;
+    char *merged_buf;
     int64_t ret;
+    int64_t start_ns;
+    struct RADOSCB *next;
 } RADOSCB;
 
-#define RBD_FD_READ 0
-#define RBD_FD_WRITE 1
-
 typedef struct BDRVRBDState {
-    int fds[2];
+    EventNotifier e;
     rados_t cluster;
     rados_ioctx_t io_ctx;
     rbd_image_t image;
     char name[RBD_MAX_IMAGE_NAME_SIZE];
     int qemu_aio_count;
     char *snap;
-    int event_reader_pos;
-    RADOSCB *event_rcb;
+
+    /* Pushed to by librbd threads, drained by qemu_rbd_aio_event_reader() */
+    RADOSCB *volatile completed;
+
+    QEMUBH *submit_bh;
+    QSIMPLEQ_HEAD(, RBDAIOCB) pending_writes;
+
+    /* for query-blockstats */
+    int64_t ops_inflight;
+    int64_t ops;
+    int64_t ops_total_time_ns;
+    int64_t ops_merged;
 } BDRVRBDState;
 
 static void rbd_aio_bh_cb(void *opaque);
@@ -367,25 +388,15 @@ static int qemu_rbd_create(const char *filename, QEMUOptionParameter *options)
     return ret;
 }
 
-/*
- * This aio completion is being called from qemu_rbd_aio_event_reader()
- * and runs in qemu context. It schedules a bh, but just in case the aio
- * was not cancelled before.
- */
-static void qemu_rbd_complete_aio(RADOSCB *rcb)
+static void qemu_rbd_set_acb_ret(RBDAIOCB *acb, RADOSCB *rcb, int64_t r)
 {
-    RBDAIOCB *acb = rcb->acb;
-    int64_t r;
-
-    r = rcb->ret;
-
     if (acb->cmd == RBD_AIO_WRITE ||
         acb->cmd == RBD_AIO_DISCARD) {
         if (r < 0) {
             acb->ret = r;
             acb->error = 1;
         } else if (!acb->error) {
-            acb->ret = rcb->size;
+            acb->ret = acb->size;
         }
     } else {
         if (r < 0) {
@@ -401,46 +412,78 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
             acb->ret = r;
         }
     }
-    /* Note that acb->bh can be NULL in case where the aio was cancelled */
-    acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
-    qemu_bh_schedule(acb->bh);
-    g_free(rcb);
 }
 
 /*
- * aio fd read handler. It runs in the qemu context and calls the
- * completion handling of completed rados aio operations.
+ * This aio completion is being called from qemu_rbd_aio_event_reader()
+ * and runs in qemu context. It schedules a bh, but just in case the aio
+ * was not cancelled before.
  */
-static void qemu_rbd_aio_event_reader(void *opaque)
+static void qemu_rbd_complete_aio(RADOSCB *rcb)
 {
-    BDRVRBDState *s = opaque;
+    BDRVRBDState *s = rcb->s;
+    RBDAIOCB *acb, *next;
 
-    ssize_t ret;
+    s->ops_inflight--;
+    s->ops_total_time_ns += get_clock() - rcb->start_ns;
 
-    do {
-        char *p = (char *)&s->event_rcb;
-
-        /* now read the rcb pointer that was sent from a non qemu thread */
-        ret = read(s->fds[RBD_FD_READ], p + s->event_reader_pos,
-                   sizeof(s->event_rcb) - s->event_reader_pos);
-        if (ret > 0) {
-            s->event_reader_pos += ret;
-            if (s->event_reader_pos == sizeof(s->event_rcb)) {
-                s->event_reader_pos = 0;
-                qemu_rbd_complete_aio(s->event_rcb);
-                s->qemu_aio_count--;
-            }
-        }
-    } while (ret < 0 && errno == EINTR);
+    for (acb = rcb->acb; acb; acb = next) {
+        next = acb->merge_next;
+        acb->merge_next = NULL;
+        qemu_rbd_set_acb_ret(acb, rcb, rcb->ret);
+
+        /* Note that acb->bh can be NULL in case where the aio was cancelled */
+        acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
+        qemu_bh_schedule(acb->bh);
+        s->qemu_aio_count--;
+    }
+    qemu_vfree(rcb->merged_buf);
+    g_free(rcb);
+}
+
+/*
+ * aio event notifier handler. It runs in the qemu context and calls the
+ * completion handling of all the rados aio operations that completed
+ * since it last ran.
+ */
+static void qemu_rbd_aio_event_reader(EventNotifier *e)
+{
+    BDRVRBDState *s = container_of(e, BDRVRBDState, e);
+    RADOSCB *rcb, *next, *list = NULL;
+
+    event_notifier_test_and_clear(e);
+
+    /* The list was built by pushing at the head; complete in order */
+    rcb = __sync_lock_test_and_set(&s->completed, NULL);
+    while (rcb) {
+        next = rcb->next;
+        rcb->next = list;
+        list = rcb;
+        rcb = next;
+    }
+
+    for (rcb = list; rcb; rcb = next) {
+        next = rcb->next;
+        qemu_rbd_complete_aio(rcb);
+    }
 }
 
-static int qemu_rbd_aio_flush_cb(void *opaque)
+static void qemu_rbd_submit_pending(BDRVRBDState *s);
+
+static int qemu_rbd_aio_flush_cb(EventNotifier *e)
 {
-    BDRVRBDState *s = opaque;
+    BDRVRBDState *s = container_of(e, BDRVRBDState, e);
 
+    /* Whoever waits for requests to finish must not wait for the bh */
+    qemu_rbd_submit_pending(s);
     return (s->qemu_aio_count > 0);
 }
 
+static void qemu_rbd_submit_bh(void *opaque)
+{
+    qemu_rbd_submit_pending(opaque);
+}
+
 static int qemu_rbd_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVRBDState *s = bs->opaque;
@@ -516,17 +559,17 @@ static int qemu_rbd_open(BlockDriverState *bs, const char *filename, int flags)
 
     bs->read_only = (s->snap != NULL);
 
-    s->event_reader_pos = 0;
-    r = qemu_pipe(s->fds);
+    s->completed = NULL;
+    r = event_notifier_init(&s->e, false);
     if (r < 0) {
         error_report("error opening eventfd");
         goto failed;
     }
-    fcntl(s->fds[0], F_SETFL, O_NONBLOCK);
-    fcntl(s->fds[1], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], qemu_rbd_aio_event_reader,
-                            NULL, qemu_rbd_aio_flush_cb, s);
+    qemu_aio_set_event_notifier(&s->e, qemu_rbd_aio_event_reader,
+                                qemu_rbd_aio_flush_cb);
 
+    QSIMPLEQ_INIT(&s->pending_writes);
+    s->submit_bh = qemu_bh_new(qemu_rbd_submit_bh, s);
 
     return 0;
 
@@ -544,9 +587,10 @@ static void qemu_rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
-    close(s->fds[0]);
-    close(s->fds[1]);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], NULL, NULL, NULL, NULL);
+    qemu_rbd_submit_pending(s);
+    qemu_bh_delete(s->submit_bh);
+    qemu_aio_set_event_notifier(&s->e, NULL, NULL);
+    event_notifier_cleanup(&s->e);
 
     rbd_close(s->image);
     rados_ioctx_destroy(s->io_ctx);
@@ -575,54 +619,31 @@ static const AIOCBInfo rbd_aiocb_info = {
     .cancel = qemu_rbd_aio_cancel,
 };
 
-static int qemu_rbd_send_pipe(BDRVRBDState *s, RADOSCB *rcb)
-{
-    int ret = 0;
-    while (1) {
-        fd_set wfd;
-        int fd = s->fds[RBD_FD_WRITE];
-
-        /* send the op pointer to the qemu thread that is responsible
-           for the aio/op completion. Must do it in a qemu thread context */
-        ret = write(fd, (void *)&rcb, sizeof(rcb));
-        if (ret >= 0) {
-            break;
-        }
-        if (errno == EINTR) {
-            continue;
-        }
-        if (errno != EAGAIN) {
-            break;
-        }
-
-        FD_ZERO(&wfd);
-        FD_SET(fd, &wfd);
-        do {
-            ret = select(fd + 1, NULL, &wfd, NULL, NULL);
-        } while (ret < 0 && errno == EINTR);
-    }
-
-    return ret;
-}
-
 /*
  * This is the callback function for rbd_aio_read and _write
  *
  * Note: this function is being called from a non qemu thread so
  * we need to be careful about what we do here. Generally we only
- * write to the block notification pipe, and do the rest of the
- * io completion handling from qemu_rbd_aio_event_reader() which
- * runs in a qemu context.
+ * push the op to the completed list, and do the rest of the io
+ * completion handling from qemu_rbd_aio_event_reader() which runs
+ * in a qemu context.  Only the push that finds the list empty has to
+ * kick the event notifier; the reader takes the whole list at once.
  */
 static void rbd_finish_aiocb(rbd_completion_t c, RADOSCB *rcb)
 {
-    int ret;
+    BDRVRBDState *s = rcb->s;
+    RADOSCB *old;
+
     rcb->ret = rbd_aio_get_return_value(c);
     rbd_aio_release(c);
-    ret = qemu_rbd_send_pipe(rcb->s, rcb);
-    if (ret < 0) {
-        error_report("failed writing to acb->s->fds");
-        g_free(rcb);
+
+    do {
+        old = s->completed;
+        rcb->next = old;
+    } while (!__sync_bool_compare_and_swap(&s->completed, old, rcb));
+
+    if (!old) {
+        event_notifier_set(&s->e);
     }
 }
 
@@ -658,6 +679,106 @@ static int rbd_aio_discard_wrapper(rbd_image_t image,
 #endif
 }
 
+/* Send the requests chained from @acb through merge_next as one op */
+static int rbd_submit_aio(BDRVRBDState *s, RBDAIOCB *acb, int64_t off,
+                          int64_t size, char *buf, char *merged_buf)
+{
+    RADOSCB *rcb;
+    rbd_completion_t c;
+    int r;
+
+    rcb = g_malloc(sizeof(RADOSCB));
+    rcb->done = 0;
+    rcb->acb = acb;
+    rcb->buf = buf;
+    rcb->merged_buf = merged_buf;
+    rcb->s = s;
+    rcb->size = size;
+    rcb->start_ns = get_clock();
+    r = rbd_aio_create_completion(rcb, (rbd_callback_t) rbd_finish_aiocb, &c);
+    if (r < 0) {
+        g_free(rcb);
+        return r;
+    }
+
+    switch (acb->cmd) {
+    case RBD_AIO_WRITE:
+        r = rbd_aio_write(s->image, off, size, buf, c);
+        break;
+    case RBD_AIO_READ:
+        r = rbd_aio_read(s->image, off, size, buf, c);
+        break;
+    case RBD_AIO_DISCARD:
+        r = rbd_aio_discard_wrapper(s->image, off, size, c);
+        break;
+    default:
+        r = -EINVAL;
+    }
+
+    if (r < 0) {
+        rbd_aio_release(c);
+        g_free(rcb);
+        return r;
+    }
+
+    s->ops++;
+    s->ops_inflight++;
+    return 0;
+}
+
+/*
+ * Send the queued writes, merging runs of them that continue each other.
+ * A run that cannot be sent fails all its requests.
+ */
+static void qemu_rbd_submit_pending(BDRVRBDState *s)
+{
+    while (!QSIMPLEQ_EMPTY(&s->pending_writes)) {
+        RBDAIOCB *first = QSIMPLEQ_FIRST(&s->pending_writes);
+        RBDAIOCB *acb, *last = first;
+        int64_t off = first->sector_num * BDRV_SECTOR_SIZE;
+        int64_t size = first->size;
+        char *buf = first->bounce, *merged_buf = NULL;
+        int r;
+
+        QSIMPLEQ_REMOVE_HEAD(&s->pending_writes, pending);
+        while ((acb = QSIMPLEQ_FIRST(&s->pending_writes)) &&
+               acb->sector_num * BDRV_SECTOR_SIZE == off + size &&
+               size + acb->size <= RBD_MAX_MERGE_SIZE) {
+            QSIMPLEQ_REMOVE_HEAD(&s->pending_writes, pending);
+            last->merge_next = acb;
+            last = acb;
+            size += acb->size;
+            s->ops_merged++;
+        }
+
+        if (first != last) {
+            int64_t pos = 0;
+
+            buf = merged_buf = qemu_blockalign(first->common.bs, size);
+            for (acb = first; acb; acb = acb->merge_next) {
+                memcpy(merged_buf + pos, acb->bounce, acb->size);
+                pos += acb->size;
+            }
+        }
+
+        r = rbd_submit_aio(s, first, off, size, buf, merged_buf);
+        if (r < 0) {
+            RADOSCB *rcb = g_malloc0(sizeof(RADOSCB));
+
+            /* complete the run as if the cluster had failed it */
+            rcb->acb = first;
+            rcb->s = s;
+            rcb->buf = buf;
+            rcb->merged_buf = merged_buf;
+            rcb->size = size;
+            rcb->ret = r;
+            rcb->start_ns = get_clock();
+            s->ops_inflight++;
+            qemu_rbd_complete_aio(rcb);
+        }
+    }
+}
+
 static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
                                        int64_t sector_num,
                                        QEMUIOVector *qiov,
@@ -667,10 +788,7 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
                                        RBDAIOCmd cmd)
 {
     RBDAIOCB *acb;
-    RADOSCB *rcb;
-    rbd_completion_t c;
     int64_t off, size;
-    char *buf;
     int r;
 
     BDRVRBDState *s = bs->opaque;
@@ -689,43 +807,27 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb->cancelled = 0;
     acb->bh = NULL;
     acb->status = -EINPROGRESS;
+    acb->merge_next = NULL;
 
     if (cmd == RBD_AIO_WRITE) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
-    buf = acb->bounce;
-
     off = sector_num * BDRV_SECTOR_SIZE;
     size = nb_sectors * BDRV_SECTOR_SIZE;
+    acb->sector_num = sector_num;
+    acb->size = size;
 
-    s->qemu_aio_count++; /* All the RADOSCB */
+    s->qemu_aio_count++;
 
-    rcb = g_malloc(sizeof(RADOSCB));
-    rcb->done = 0;
-    rcb->acb = acb;
-    rcb->buf = buf;
-    rcb->s = acb->s;
-    rcb->size = size;
-    r = rbd_aio_create_completion(rcb, (rbd_callback_t) rbd_finish_aiocb, &c);
-    if (r < 0) {
-        goto failed;
-    }
-
-    switch (cmd) {
-    case RBD_AIO_WRITE:
-        r = rbd_aio_write(s->image, off, size, buf, c);
-        break;
-    case RBD_AIO_READ:
-        r = rbd_aio_read(s->image, off, size, buf, c);
-        break;
-    case RBD_AIO_DISCARD:
-        r = rbd_aio_discard_wrapper(s->image, off, size, c);
-        break;
-    default:
-        r = -EINVAL;
+    /* Small writes wait for the bh so that they can be merged */
+    if (cmd == RBD_AIO_WRITE && size < RBD_MAX_MERGE_SIZE) {
+        QSIMPLEQ_INSERT_TAIL(&s->pending_writes, acb, pending);
+        qemu_bh_schedule(s->submit_bh);
+        return &acb->common;
     }
 
+    r = rbd_submit_aio(s, acb, off, size, acb->bounce, NULL);
     if (r < 0) {
         goto failed;
     }
@@ -733,8 +835,8 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     return &acb->common;
 
 failed:
-    g_free(rcb);
     s->qemu_aio_count--;
+    qemu_vfree(acb->bounce);
     qemu_aio_release(acb);
     return NULL;
 }
@@ -766,12 +868,27 @@ static int qemu_rbd_co_flush(BlockDriverState *bs)
 #if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(0, 1, 1)
     /* rbd_flush added in 0.1.1 */
     BDRVRBDState *s = bs->opaque;
+
+    qemu_rbd_submit_pending(s);
     return rbd_flush(s->image);
 #else
     return 0;
 #endif
 }
 
+static void qemu_rbd_get_stats(const BlockDriverState *bs,
+                               BlockDeviceStats *stats)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    stats->has_backend_inflight = stats->has_backend_operations = true;
+    stats->has_backend_total_time_ns = stats->has_backend_merged = true;
+    stats->backend_inflight = s->ops_inflight;
+    stats->backend_operations = s->ops;
+    stats->backend_total_time_ns = s->ops_total_time_ns;
+    stats->backend_merged = s->ops_merged;
+}
+
 static int qemu_rbd_getinfo(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVRBDState *s = bs->opaque;
@@ -941,6 +1058,7 @@ static BlockDriver bdrv_rbd = {
     .bdrv_close         = qemu_rbd_close,
     .bdrv_create        = qemu_rbd_create,
     .bdrv_get_info      = qemu_rbd_getinfo,
+    .bdrv_get_cache_stats = qemu_rbd_get_stats,
     .create_options     = qemu_rbd_create_options,
     .bdrv_getlength     = qemu_rbd_getlength,
     .bdrv_truncate      = qemu_rbd_truncate,
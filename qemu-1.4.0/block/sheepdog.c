@@ -17,6 +17,7 @@
 #include "qemu/sockets.h"
 #include "block/block_int.h"
 #include "qemu/bitops.h"
+#include "qemu/iov.h"
 
 #define SD_PROTO_VER 0x01
 
@@ -86,6 +87,7 @@
 #define SD_DATA_OBJ_SIZE (UINT64_C(1) << 22)
 #define SD_MAX_VDI_SIZE (SD_DATA_OBJ_SIZE * MAX_DATA_OBJS)
 #define SECTOR_SIZE 512
+#define SD_NR_CONNS 4
 
 #define SD_INODE_SIZE (sizeof(SheepdogInode))
 #define CURRENT_VDI_ID 0
@@ -248,9 +250,21 @@ static inline bool is_snapshot(struct SheepdogInode *inode)
 #endif
 
 typedef struct SheepdogAIOCB SheepdogAIOCB;
+typedef struct BDRVSheepdogState BDRVSheepdogState;
+
+/* A connection to the sheep daemon which carries object requests */
+typedef struct SheepdogConn {
+    BDRVSheepdogState *s;
+    int fd;
+
+    CoMutex lock;
+    Coroutine *co_send;
+    Coroutine *co_recv;
+} SheepdogConn;
 
 typedef struct AIOReq {
     SheepdogAIOCB *aiocb;
+    SheepdogConn *conn;
     unsigned int iov_offset;
 
     uint64_t oid;
@@ -287,7 +301,7 @@ struct SheepdogAIOCB {
     int nr_pending;
 };
 
-typedef struct BDRVSheepdogState {
+struct BDRVSheepdogState {
     SheepdogInode inode;
 
     uint32_t min_dirty_data_idx;
@@ -299,16 +313,12 @@ typedef struct BDRVSheepdogState {
 
     char *addr;
     char *port;
-    int fd;
-
-    CoMutex lock;
-    Coroutine *co_send;
-    Coroutine *co_recv;
+    SheepdogConn conns[SD_NR_CONNS];
 
     uint32_t aioreq_seq_num;
     QLIST_HEAD(inflight_aio_head, AIOReq) inflight_aio_head;
     QLIST_HEAD(pending_aio_head, AIOReq) pending_aio_head;
-} BDRVSheepdogState;
+};
 
 static const char * sd_strerror(int err)
 {
@@ -360,10 +370,14 @@ static const char * sd_strerror(int err)
  * 1. In sd_co_rw_vector, we send the I/O requests to the server and
  *    link the requests to the inflight_list in the
  *    BDRVSheepdogState.  The function exits without waiting for
- *    receiving the response.
+ *    receiving the response.  There are SD_NR_CONNS connections per
+ *    image and each object always uses the same one, so requests to
+ *    different objects go out in parallel while those to one object
+ *    keep their order.  Any number of requests can be in flight on a
+ *    connection; responses are matched by their id.
  *
  * 2. We receive the response in aio_read_response, the fd handler to
- *    the sheepdog connection.  If metadata update is needed, we send
+ *    the sheepdog connections.  If metadata update is needed, we send
  *    the write request to the vdi object in sd_write_done, the write
  *    completion function.  We switch back to sd_co_readv/writev after
  *    all the requests belonging to the AIOCB are finished.
@@ -378,6 +392,7 @@ static inline AIOReq *alloc_aio_req(BDRVSheepdogState *s, SheepdogAIOCB *acb,
 
     aio_req = g_malloc(sizeof(*aio_req));
     aio_req->aiocb = acb;
+    aio_req->conn = &s->conns[oid % SD_NR_CONNS];
     aio_req->iov_offset = iov_offset;
     aio_req->oid = oid;
     aio_req->base_oid = base_oid;
@@ -661,13 +676,14 @@ static void coroutine_fn send_pending_req(BDRVSheepdogState *s, uint64_t oid)
  * Receive responses of the I/O requests.
  *
  * This function is registered as a fd handler, and called from the
- * main loop when s->fd is ready for reading responses.
+ * main loop when the fd of a connection is ready for reading responses.
  */
 static void coroutine_fn aio_read_response(void *opaque)
 {
     SheepdogObjRsp rsp;
-    BDRVSheepdogState *s = opaque;
-    int fd = s->fd;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
+    int fd = conn->fd;
     int ret;
     AIOReq *aio_req = NULL;
     SheepdogAIOCB *acb;
@@ -701,7 +717,7 @@ static void coroutine_fn aio_read_response(void *opaque)
     case AIOCB_WRITE_UDATA:
         /* this coroutine context is no longer suitable for co_recv
          * because we may send data to update vdi objects */
-        s->co_recv = NULL;
+        conn->co_recv = NULL;
         if (!is_data_obj(aio_req->oid)) {
             break;
         }
@@ -758,30 +774,31 @@ static void coroutine_fn aio_read_response(void *opaque)
         acb->aio_done_func(acb);
     }
 out:
-    s->co_recv = NULL;
+    conn->co_recv = NULL;
 }
 
 static void co_read_response(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    if (!s->co_recv) {
-        s->co_recv = qemu_coroutine_create(aio_read_response);
+    if (!conn->co_recv) {
+        conn->co_recv = qemu_coroutine_create(aio_read_response);
     }
 
-    qemu_coroutine_enter(s->co_recv, opaque);
+    qemu_coroutine_enter(conn->co_recv, opaque);
 }
 
 static void co_write_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    qemu_coroutine_enter(s->co_send, NULL);
+    qemu_coroutine_enter(conn->co_send, NULL);
 }
 
 static int aio_flush_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
 
     return !QLIST_EMPTY(&s->inflight_aio_head) ||
         !QLIST_EMPTY(&s->pending_aio_head);
@@ -802,7 +819,7 @@ static int set_nodelay(int fd)
  * We cannot use this discriptor for other operations because
  * the block driver may be on waiting response from the server.
  */
-static int get_sheep_fd(BDRVSheepdogState *s)
+static int get_sheep_fd(BDRVSheepdogState *s, SheepdogConn *conn)
 {
     int ret, fd;
 
@@ -821,10 +838,26 @@ static int get_sheep_fd(BDRVSheepdogState *s)
         return -errno;
     }
 
-    qemu_aio_set_fd_handler(fd, co_read_response, NULL, aio_flush_request, s);
+    qemu_aio_set_fd_handler(fd, co_read_response, NULL, aio_flush_request,
+                            conn);
     return fd;
 }
 
+static void close_sheep_conns(BDRVSheepdogState *s)
+{
+    int i;
+
+    for (i = 0; i < SD_NR_CONNS; i++) {
+        SheepdogConn *conn = &s->conns[i];
+
+        if (conn->fd >= 0) {
+            qemu_aio_set_fd_handler(conn->fd, NULL, NULL, NULL, NULL);
+            closesocket(conn->fd);
+            conn->fd = -1;
+        }
+    }
+}
+
 /*
  * Parse a filename
  *
@@ -955,7 +988,10 @@ static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
                            enum AIOCBState aiocb_type)
 {
     int nr_copies = s->inode.nr_copies;
+    SheepdogConn *conn = aio_req->conn;
     SheepdogObjReq hdr;
+    struct iovec *send_iov;
+    unsigned int send_niov;
     unsigned int wlen = 0;
     int ret;
     uint64_t oid = aio_req->oid;
@@ -1002,35 +1038,35 @@ static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 
     hdr.id = aio_req->id;
 
-    qemu_co_mutex_lock(&s->lock);
-    s->co_send = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->fd, co_read_response, co_write_request,
-                            aio_flush_request, s);
-    socket_set_cork(s->fd, 1);
+    /* the header and the data go out with a single sendmsg() if possible */
+    send_iov = g_new(struct iovec, niov + 1);
+    send_iov[0].iov_base = &hdr;
+    send_iov[0].iov_len = sizeof(hdr);
+    send_niov = 1;
+    if (wlen) {
+        send_niov += iov_copy(send_iov + 1, niov, iov, niov,
+                              aio_req->iov_offset, wlen);
+    }
 
-    /* send a header */
-    ret = qemu_co_send(s->fd, &hdr, sizeof(hdr));
+    qemu_co_mutex_lock(&conn->lock);
+    conn->co_send = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, co_write_request,
+                            aio_flush_request, conn);
+
+    ret = qemu_co_sendv(conn->fd, send_iov, send_niov, 0, sizeof(hdr) + wlen);
     if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
+        ret = -errno;
         error_report("failed to send a req, %s", strerror(errno));
-        return -errno;
-    }
-
-    if (wlen) {
-        ret = qemu_co_sendv(s->fd, iov, niov, aio_req->iov_offset, wlen);
-        if (ret < 0) {
-            qemu_co_mutex_unlock(&s->lock);
-            error_report("failed to send a data, %s", strerror(errno));
-            return -errno;
-        }
+    } else {
+        ret = 0;
     }
 
-    socket_set_cork(s->fd, 0);
-    qemu_aio_set_fd_handler(s->fd, co_read_response, NULL,
-                            aio_flush_request, s);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, NULL,
+                            aio_flush_request, conn);
+    qemu_co_mutex_unlock(&conn->lock);
+    g_free(send_iov);
 
-    return 0;
+    return ret;
 }
 
 static int read_write_object(int fd, char *buf, uint64_t oid, int copies,
@@ -1099,7 +1135,7 @@ static int write_object(int fd, char *buf, uint64_t oid, int copies,
 
 static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 {
-    int ret, fd;
+    int ret, fd, i;
     uint32_t vid = 0;
     BDRVSheepdogState *s = bs->opaque;
     char vdi[SD_MAX_VDI_LEN], tag[SD_MAX_VDI_TAG_LEN];
@@ -1110,7 +1146,11 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 
     QLIST_INIT(&s->inflight_aio_head);
     QLIST_INIT(&s->pending_aio_head);
-    s->fd = -1;
+    for (i = 0; i < SD_NR_CONNS; i++) {
+        s->conns[i].s = s;
+        s->conns[i].fd = -1;
+        qemu_co_mutex_init(&s->conns[i].lock);
+    }
 
     memset(vdi, 0, sizeof(vdi));
     memset(tag, 0, sizeof(tag));
@@ -1118,10 +1158,13 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
         ret = -EINVAL;
         goto out;
     }
-    s->fd = get_sheep_fd(s);
-    if (s->fd < 0) {
-        ret = s->fd;
-        goto out;
+    for (i = 0; i < SD_NR_CONNS; i++) {
+        fd = get_sheep_fd(s, &s->conns[i]);
+        if (fd < 0) {
+            ret = fd;
+            goto out;
+        }
+        s->conns[i].fd = fd;
     }
 
     ret = find_vdi_name(s, vdi, snapid, tag, &vid, 0);
@@ -1166,14 +1209,10 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 
     bs->total_sectors = s->inode.vdi_size / SECTOR_SIZE;
     pstrcpy(s->name, sizeof(s->name), vdi);
-    qemu_co_mutex_init(&s->lock);
     g_free(buf);
     return 0;
 out:
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL);
-    if (s->fd >= 0) {
-        closesocket(s->fd);
-    }
+    close_sheep_conns(s);
     g_free(buf);
     return ret;
 }
@@ -1398,8 +1437,7 @@ static void sd_close(BlockDriverState *bs)
         error_report("%s, %s", sd_strerror(rsp->result), s->name);
     }
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL);
-    closesocket(s->fd);
+    close_sheep_conns(s);
     g_free(s->addr);
 }
 
@@ -2027,12 +2065,19 @@ cleanup:
     return ret;
 }
 
-static int sd_save_vmstate(BlockDriverState *bs, const uint8_t *data,
-                           int64_t pos, int size)
+static int sd_save_vmstate(BlockDriverState *bs, QEMUIOVector *qiov,
+                           int64_t pos)
 {
     BDRVSheepdogState *s = bs->opaque;
+    void *buf;
+    int ret;
 
-    return do_load_save_vmstate(s, (uint8_t *)data, pos, size, 0);
+    buf = qemu_blockalign(bs, qiov->size);
+    qemu_iovec_to_buf(qiov, 0, buf, qiov->size);
+    ret = do_load_save_vmstate(s, (uint8_t *) buf, pos, qiov->size, 0);
+    qemu_vfree(buf);
+
+    return ret;
 }
 
 static int sd_load_vmstate(BlockDriverState *bs, uint8_t *data,
@@ -23,6 +23,15 @@ enum {
      * contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /*
+     * Allocation status is queried this much at a time, so that holes and
+     * already-allocated areas are skipped in a single step.
+     */
+    STREAM_ALLOC_SPAN = 1024 * 1024 * 1024, /* in bytes */
+
+    /* Populate requests kept in flight while the guest is idle */
+    STREAM_MAX_IN_FLIGHT = 4,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -33,8 +42,23 @@ typedef struct StreamBlockJob {
     BlockDriverState *base;
     BlockdevOnError on_error;
     char backing_file_id[1024];
+
+    void *free_bufs[STREAM_MAX_IN_FLIGHT];
+    int nb_free_bufs;
+    int in_flight;
+    bool waiting;               /* stream_run waits for a request */
+    int error_ret;              /* first error of the in-flight requests */
+    int64_t error_sector;       /* lowest sector of a failed request */
+    uint64_t last_guest_reads;
 } StreamBlockJob;
 
+typedef struct StreamOp {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+} StreamOp;
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -51,6 +75,57 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+static void coroutine_fn stream_co_populate(void *opaque)
+{
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+    int ret;
+
+    ret = stream_populate(s->common.bs, op->sector_num, op->nb_sectors,
+                          op->buf);
+    trace_stream_populate_done(s, op->sector_num, op->nb_sectors, ret);
+    if (ret < 0) {
+        if (s->error_ret == 0) {
+            s->error_ret = ret;
+            s->error_sector = op->sector_num;
+        } else {
+            s->error_sector = MIN(s->error_sector, op->sector_num);
+        }
+    } else {
+        /* Publish progress */
+        s->common.offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    s->free_bufs[s->nb_free_bufs++] = op->buf;
+    g_free(op);
+    s->in_flight--;
+    if (s->waiting) {
+        s->waiting = false;
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn stream_wait_for_requests(StreamBlockJob *s, int max)
+{
+    while (s->in_flight > max) {
+        s->waiting = true;
+        qemu_coroutine_yield();
+    }
+}
+
+/* Prefetching competes with the guest for the backing chain, so fall back
+ * to one request at a time while the guest is reading.  With copy-on-read
+ * enabled, its reads of areas we have not reached yet stream them anyway.
+ */
+static int stream_max_in_flight(StreamBlockJob *s)
+{
+    uint64_t reads = s->common.bs->nr_ops[BDRV_ACCT_READ];
+    bool guest_active = reads != s->last_guest_reads;
+
+    s->last_guest_reads = reads;
+    return guest_active ? 1 : STREAM_MAX_IN_FLIGHT;
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -78,11 +153,14 @@ static void coroutine_fn stream_run(void *opaque)
     StreamBlockJob *s = opaque;
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
-    int64_t sector_num, end;
+    int64_t sector_num, end, copy_end;
+    uint64_t last_pause_ns;
+    bool need_sleep = true;
+    int max_in_flight = 1;
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
+    int i;
 
     s->common.len = bdrv_getlength(bs);
     if (s->common.len < 0) {
@@ -91,7 +169,10 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    for (i = 0; i < STREAM_MAX_IN_FLIGHT; i++) {
+        s->free_bufs[s->nb_free_bufs++] = qemu_blockalign(bs,
+                                                          STREAM_BUFFER_SIZE);
+    }
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -102,53 +183,38 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    /* [sector_num, copy_end) is known to need copying */
+    copy_end = 0;
+    last_pause_ns = qemu_get_clock_ns(rt_clock);
+    s->last_guest_reads = bs->nr_ops[BDRV_ACCT_READ];
+
+    for (sector_num = 0; ; sector_num += n) {
         uint64_t delay_ns = 0;
+        StreamOp *op;
         bool copy;
 
-wait:
-        /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
-         */
-        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
-            break;
+        n = 0;
+        if (sector_num == end) {
+            stream_wait_for_requests(s, 0);
         }
 
-        ret = bdrv_co_is_allocated(bs, sector_num,
-                                   STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-            copy = false;
-        } else {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
-                                             sector_num, n, &n);
-
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = end - sector_num;
-            }
+        if (s->error_ret < 0) {
+            BlockErrorAction action;
 
-            copy = (ret == 1);
-        }
-        trace_stream_one_iteration(s, sector_num, n, ret);
-        if (ret >= 0 && copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
-                }
-            }
-            ret = stream_populate(bs, sector_num, n, buf);
-        }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->common.bs, s->on_error,
-                                       true, -ret);
+            stream_wait_for_requests(s, 0);
+            ret = s->error_ret;
+            s->error_ret = 0;
+            action = block_job_error_action(&s->common, s->common.bs,
+                                            s->on_error, true, -ret);
             if (action == BDRV_ACTION_STOP) {
-                n = 0;
+                /* Retry from the first failed request.  Everything before
+                 * it was done, everything after it will be counted again
+                 * on the way.
+                 */
+                sector_num = s->error_sector;
+                s->common.offset = sector_num * BDRV_SECTOR_SIZE;
+                copy_end = 0;
+                need_sleep = true;
                 continue;
             }
             if (error == 0) {
@@ -160,10 +226,99 @@ wait:
         }
         ret = 0;
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        if (sector_num == end) {
+            break;
+        }
+
+wait:
+        /* Note that even when no rate limit is applied we need to yield
+         * periodically with no pending I/O here so that bdrv_drain_all()
+         * returns.
+         */
+        if (need_sleep || delay_ns > 0 ||
+            qemu_get_clock_ns(rt_clock) - last_pause_ns >= SLICE_TIME) {
+            stream_wait_for_requests(s, 0);
+            block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+            if (block_job_is_cancelled(&s->common)) {
+                break;
+            }
+            need_sleep = false;
+            last_pause_ns = qemu_get_clock_ns(rt_clock);
+            max_in_flight = stream_max_in_flight(s);
+        }
+
+        if (sector_num < copy_end) {
+            ret = 1;
+            n = copy_end - sector_num;
+            copy = true;
+        } else {
+            ret = bdrv_co_is_allocated(bs, sector_num,
+                                       MIN(end - sector_num,
+                                           STREAM_ALLOC_SPAN / BDRV_SECTOR_SIZE),
+                                       &n);
+            if (ret == 1) {
+                /* Allocated in the top, no need to copy.  */
+                copy = false;
+            } else {
+                /* Copy if allocated in the intermediate images.  Limit to
+                 * the known-unallocated area [sector_num, sector_num+n).  */
+                ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
+                                                 sector_num, n, &n);
+
+                /* Finish early if end of backing file has been reached */
+                if (ret == 0 && n == 0) {
+                    n = end - sector_num;
+                }
+
+                copy = (ret == 1);
+                if (copy) {
+                    copy_end = sector_num + n;
+                }
+            }
+        }
+        trace_stream_one_iteration(s, sector_num, n, ret);
+
+        if (ret < 0) {
+            /* Treat a failed allocation query like a failed request. */
+            stream_wait_for_requests(s, 0);
+            s->error_ret = ret;
+            s->error_sector = sector_num;
+            n = 0;
+            continue;
+        }
+
+        if (!copy) {
+            /* Publish progress */
+            s->common.offset += n * BDRV_SECTOR_SIZE;
+            continue;
+        }
+
+        n = MIN(n, STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+        delay_ns = block_job_bandwidth_delay(&s->common, n);
+        if (delay_ns == 0 && s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+        }
+        if (delay_ns > 0) {
+            goto wait;
+        }
+
+        stream_wait_for_requests(s, max_in_flight - 1);
+        if (s->error_ret < 0) {
+            n = 0;
+            continue;
+        }
+
+        op = g_new(StreamOp, 1);
+        op->s = s;
+        op->sector_num = sector_num;
+        op->nb_sectors = n;
+        op->buf = s->free_bufs[--s->nb_free_bufs];
+        s->in_flight++;
+        qemu_coroutine_enter(qemu_coroutine_create(stream_co_populate), op);
     }
 
+    stream_wait_for_requests(s, 0);
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
@@ -183,7 +338,10 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
+    assert(s->nb_free_bufs == STREAM_MAX_IN_FLIGHT);
+    for (i = 0; i < STREAM_MAX_IN_FLIGHT; i++) {
+        qemu_vfree(s->free_bufs[i]);
+    }
     block_job_completed(&s->common, ret);
 }
 
@@ -27,6 +27,7 @@
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "migration/migration.h"
+#include "block/thread-pool.h"
 #include <zlib.h>
 
 #define VMDK3_MAGIC (('C' << 24) | ('O' << 16) | ('W' << 8) | 'D')
@@ -66,7 +67,12 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
+/* Grain tables cached per sparse extent unless l2-cache-size is given; the
+ * cache is shared by all extents but never smaller than
+ * L2_CACHE_MIN_BYTES.
+ */
 #define L2_CACHE_SIZE 16
+#define L2_CACHE_MIN_BYTES (1024 * 1024)
 
 typedef struct VmdkExtent {
     BlockDriverState *file;
@@ -84,13 +90,17 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
-    uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
 
     unsigned int cluster_sectors;
 } VmdkExtent;
 
+typedef struct VmdkL2Table {
+    uint64_t key;                   /* extent index << 32 | L2 offset */
+    uint32_t *table;
+    size_t bytes;
+    QTAILQ_ENTRY(VmdkL2Table) next;
+} VmdkL2Table;
+
 typedef struct BDRVVmdkState {
     CoMutex lock;
     int desc_offset;
@@ -99,7 +109,14 @@ typedef struct BDRVVmdkState {
     int num_extents;
     /* Extent array with num_extents entries, ascend ordered by address */
     VmdkExtent *extents;
+    int last_extent;                /* hint for find_extent() */
     Error *migration_blocker;
+
+    /* Grain tables of all extents, least recently used first */
+    GHashTable *l2_tables;
+    QTAILQ_HEAD(, VmdkL2Table) l2_lru;
+    uint64_t l2_cache_bytes;
+    uint64_t l2_cache_max_bytes;
 } BDRVVmdkState;
 
 typedef struct VmdkMetaData {
@@ -186,16 +203,32 @@ static int vmdk_probe(const uint8_t *buf, int buf_size, const char *filename)
 #define BUF_SIZE 4096
 #define HEADER_SIZE 512                 /* first sector of 512 bytes */
 
+static void vmdk_evict_l2_table(BDRVVmdkState *s, VmdkL2Table *t)
+{
+    QTAILQ_REMOVE(&s->l2_lru, t, next);
+    g_hash_table_remove(s->l2_tables, &t->key);
+    s->l2_cache_bytes -= t->bytes;
+    g_free(t->table);
+    g_free(t);
+}
+
 static void vmdk_free_extents(BlockDriverState *bs)
 {
     int i;
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *e;
 
+    if (s->l2_tables) {
+        while (!QTAILQ_EMPTY(&s->l2_lru)) {
+            vmdk_evict_l2_table(s, QTAILQ_FIRST(&s->l2_lru));
+        }
+        g_hash_table_destroy(s->l2_tables);
+        s->l2_tables = NULL;
+    }
+
     for (i = 0; i < s->num_extents; i++) {
         e = &s->extents[i];
         g_free(e->l1_table);
-        g_free(e->l2_cache);
         g_free(e->l1_backup_table);
         if (e->file != bs->file) {
             bdrv_delete(e->file);
@@ -435,8 +468,6 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
         }
     }
 
-    extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -725,9 +756,12 @@ static int vmdk_open_desc_file(BlockDriverState *bs, int flags,
 
 static int vmdk_open(BlockDriverState *bs, int flags)
 {
-    int ret;
+    int ret, i;
     BDRVVmdkState *s = bs->opaque;
 
+    s->l2_tables = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->l2_lru);
+
     if (vmdk_open_sparse(bs, bs->file, flags) == 0) {
         s->desc_offset = 0x200;
     } else {
@@ -744,6 +778,17 @@ static int vmdk_open(BlockDriverState *bs, int flags)
     s->parent_cid = vmdk_read_cid(bs, 1);
     qemu_co_mutex_init(&s->lock);
 
+    s->l2_cache_max_bytes = bs->l2_cache_size;
+    if (!s->l2_cache_max_bytes) {
+        for (i = 0; i < s->num_extents; i++) {
+            if (!s->extents[i].flat) {
+                s->l2_cache_max_bytes += L2_CACHE_SIZE *
+                    s->extents[i].l2_size * sizeof(uint32_t);
+            }
+        }
+        s->l2_cache_max_bytes = MAX(s->l2_cache_max_bytes, L2_CACHE_MIN_BYTES);
+    }
+
     /* Disable migration when VMDK images are used */
     error_set(&s->migration_blocker,
               QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
@@ -821,6 +866,47 @@ static int vmdk_L2update(VmdkExtent *extent, VmdkMetaData *m_data)
     return 0;
 }
 
+/*
+ * Return the grain table at @l2_offset of @extent from the cache, reading it
+ * in if necessary, or NULL on I/O error.  The table stays valid while
+ * s->lock is held and no other table is looked up.
+ */
+static uint32_t *vmdk_get_l2_table(BlockDriverState *bs, VmdkExtent *extent,
+                                   uint32_t l2_offset)
+{
+    BDRVVmdkState *s = bs->opaque;
+    uint64_t key = ((uint64_t)(extent - s->extents) << 32) | l2_offset;
+    size_t bytes = extent->l2_size * sizeof(uint32_t);
+    VmdkL2Table *t;
+
+    t = g_hash_table_lookup(s->l2_tables, &key);
+    if (t) {
+        QTAILQ_REMOVE(&s->l2_lru, t, next);
+        QTAILQ_INSERT_TAIL(&s->l2_lru, t, next);
+        return t->table;
+    }
+
+    t = g_malloc(sizeof(*t));
+    t->key = key;
+    t->bytes = bytes;
+    t->table = g_malloc(bytes);
+    if (bdrv_pread(extent->file, (int64_t)l2_offset * 512,
+                   t->table, bytes) != bytes) {
+        g_free(t->table);
+        g_free(t);
+        return NULL;
+    }
+
+    while (!QTAILQ_EMPTY(&s->l2_lru) &&
+           s->l2_cache_bytes + bytes > s->l2_cache_max_bytes) {
+        vmdk_evict_l2_table(s, QTAILQ_FIRST(&s->l2_lru));
+    }
+    QTAILQ_INSERT_TAIL(&s->l2_lru, t, next);
+    g_hash_table_insert(s->l2_tables, &t->key, t);
+    s->l2_cache_bytes += bytes;
+    return t->table;
+}
+
 static int get_cluster_offset(BlockDriverState *bs,
                                     VmdkExtent *extent,
                                     VmdkMetaData *m_data,
@@ -829,8 +915,7 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     uint64_t *cluster_offset)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table, tmp = 0;
+    uint32_t *l2_table, tmp = 0;
 
     if (m_data) {
         m_data->valid = 0;
@@ -849,40 +934,11 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return -1;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
-            }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
-        }
-    }
-    /* not found: load a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    l2_table = extent->l2_cache + (min_index * extent->l2_size);
-    if (bdrv_pread(
-                extent->file,
-                (int64_t)l2_offset * 512,
-                l2_table,
-                extent->l2_size * sizeof(uint32_t)
-            ) != extent->l2_size * sizeof(uint32_t)) {
+    l2_table = vmdk_get_l2_table(bs, extent, l2_offset);
+    if (!l2_table) {
         return -1;
     }
 
-    extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
- found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     *cluster_offset = le32_to_cpu(l2_table[l2_index]);
 
@@ -926,21 +982,53 @@ static int get_cluster_offset(BlockDriverState *bs,
     return 0;
 }
 
+static bool vmdk_extent_has_sector(VmdkExtent *extent, int64_t sector_num)
+{
+    return sector_num < extent->end_sector &&
+           sector_num >= extent->end_sector - extent->sectors;
+}
+
 static VmdkExtent *find_extent(BDRVVmdkState *s,
                                 int64_t sector_num, VmdkExtent *start_hint)
 {
     VmdkExtent *extent = start_hint;
+    int lo, hi;
 
-    if (!extent) {
-        extent = &s->extents[0];
+    if (!extent && s->last_extent < s->num_extents) {
+        extent = &s->extents[s->last_extent];
     }
-    while (extent < &s->extents[s->num_extents]) {
-        if (sector_num < extent->end_sector) {
+
+    /* Requests mostly stay within an extent or move on to the next one */
+    if (extent) {
+        if (vmdk_extent_has_sector(extent, sector_num)) {
             return extent;
         }
-        extent++;
+        if (extent + 1 < &s->extents[s->num_extents] &&
+            vmdk_extent_has_sector(extent + 1, sector_num)) {
+            s->last_extent = extent + 1 - s->extents;
+            return extent + 1;
+        }
     }
-    return NULL;
+
+    /* end_sector grows with the index, look for the first extent that
+     * ends after sector_num
+     */
+    lo = 0;
+    hi = s->num_extents;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (s->extents[mid].end_sector <= sector_num) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == s->num_extents) {
+        return NULL;
+    }
+    s->last_extent = lo;
+    return &s->extents[lo];
 }
 
 static int coroutine_fn vmdk_co_is_allocated(BlockDriverState *bs,
@@ -1012,17 +1100,77 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
+/* Grains of streamOptimized extents being inflated for one read request */
+typedef struct VmdkReadBatch {
+    Coroutine *co;
+    int pending;
+    int ret;
+} VmdkReadBatch;
+
+typedef struct VmdkGrainRead {
+    VmdkReadBatch *batch;
+    uint8_t *cluster_buf;
+    const uint8_t *compressed_data;
+    uint32_t data_len;
+    int cluster_bytes;
+    int64_t offset_in_cluster;
+    uint8_t *buf;
+    int bytes;
+} VmdkGrainRead;
+
+static int vmdk_inflate_grain(void *opaque)
+{
+    VmdkGrainRead *grain = opaque;
+    uLongf buf_len = grain->cluster_bytes;
+    uint8_t *uncomp_buf = g_malloc(grain->cluster_bytes);
+    int ret = 0;
+
+    if (uncompress(uncomp_buf, &buf_len, grain->compressed_data,
+                   grain->data_len) != Z_OK) {
+        ret = -EINVAL;
+    } else if (grain->offset_in_cluster < 0 ||
+               grain->offset_in_cluster + grain->bytes > buf_len) {
+        ret = -EINVAL;
+    } else {
+        memcpy(grain->buf, uncomp_buf + grain->offset_in_cluster,
+               grain->bytes);
+    }
+
+    g_free(uncomp_buf);
+    return ret;
+}
+
+static void vmdk_inflate_grain_cb(void *opaque, int ret)
+{
+    VmdkGrainRead *grain = opaque;
+    VmdkReadBatch *batch = grain->batch;
+
+    if (ret < 0 && !batch->ret) {
+        batch->ret = ret;
+    }
+    g_free(grain->cluster_buf);
+    g_free(grain);
+
+    if (--batch->pending == 0 && batch->co) {
+        qemu_coroutine_enter(batch->co, NULL);
+    }
+}
+
+/*
+ * Compressed grains are read here but inflated in the thread pool, so that
+ * the grains of one request decompress in parallel.  Wait for them with
+ * vmdk_read_batch_wait() before using buf.
+ */
 static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
                             int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+                            int nb_sectors, VmdkReadBatch *batch)
 {
     int ret;
     int cluster_bytes, buf_bytes;
     uint8_t *cluster_buf, *compressed_data;
-    uint8_t *uncomp_buf;
     uint32_t data_len;
     VmdkGrainMarker *marker;
-    uLongf buf_len;
+    VmdkGrainRead *grain;
 
 
     if (!extent->compressed) {
@@ -1039,59 +1187,70 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     /* Read two clusters in case GrainMarker + compressed data > one cluster */
     buf_bytes = cluster_bytes * 2;
     cluster_buf = g_malloc(buf_bytes);
-    uncomp_buf = g_malloc(cluster_bytes);
     ret = bdrv_pread(extent->file,
                 cluster_offset,
                 cluster_buf, buf_bytes);
     if (ret < 0) {
-        goto out;
+        goto fail;
     }
     compressed_data = cluster_buf;
-    buf_len = cluster_bytes;
     data_len = cluster_bytes;
     if (extent->has_marker) {
         marker = (VmdkGrainMarker *)cluster_buf;
         compressed_data = marker->data;
         data_len = le32_to_cpu(marker->size);
     }
-    if (!data_len || data_len > buf_bytes) {
+    if (!data_len || data_len > buf_bytes - (compressed_data - cluster_buf)) {
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
-    if (ret != Z_OK) {
-        ret = -EINVAL;
-        goto out;
 
-    }
-    if (offset_in_cluster < 0 ||
-            offset_in_cluster + nb_sectors * 512 > buf_len) {
-        ret = -EINVAL;
-        goto out;
-    }
-    memcpy(buf, uncomp_buf + offset_in_cluster, nb_sectors * 512);
-    ret = 0;
+    grain = g_malloc(sizeof(*grain));
+    grain->batch = batch;
+    grain->cluster_buf = cluster_buf;
+    grain->compressed_data = compressed_data;
+    grain->data_len = data_len;
+    grain->cluster_bytes = cluster_bytes;
+    grain->offset_in_cluster = offset_in_cluster;
+    grain->buf = buf;
+    grain->bytes = nb_sectors * 512;
 
- out:
-    g_free(uncomp_buf);
+    batch->pending++;
+    thread_pool_submit_aio(vmdk_inflate_grain, grain,
+                           vmdk_inflate_grain_cb, grain);
+    return 0;
+
+ fail:
     g_free(cluster_buf);
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int coroutine_fn vmdk_read_batch_wait(VmdkReadBatch *batch)
+{
+    while (batch->pending) {
+        batch->co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    batch->co = NULL;
+    return batch->ret;
+}
+
+static int coroutine_fn vmdk_read(BlockDriverState *bs, int64_t sector_num,
+                                  uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
-    int ret;
+    int ret = 0, batch_ret;
     uint64_t n, index_in_cluster;
     uint64_t extent_begin_sector, extent_relative_sector_num;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    VmdkReadBatch batch = { .pending = 0 };
 
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            break;
         }
         ret = get_cluster_offset(
                             bs, extent, NULL,
@@ -1107,28 +1266,33 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd) {
                 if (!vmdk_is_cid_valid(bs)) {
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    break;
                 }
                 ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
                 if (ret < 0) {
-                    return ret;
+                    break;
                 }
             } else {
                 memset(buf, 0, 512 * n);
             }
+            ret = 0;
         } else {
             ret = vmdk_read_extent(extent,
                             cluster_offset, index_in_cluster * 512,
-                            buf, n);
+                            buf, n, &batch);
             if (ret) {
-                return ret;
+                break;
             }
         }
         nb_sectors -= n;
         sector_num += n;
         buf += n * 512;
     }
-    return 0;
+
+    /* buf must not go away under the workers, even on error */
+    batch_ret = vmdk_read_batch_wait(&batch);
+    return ret ? ret : batch_ret;
 }
 
 static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
@@ -26,6 +26,7 @@
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "migration/migration.h"
+#include "qemu/bitmap.h"
 #if defined(CONFIG_UUID)
 #include <uuid/uuid.h>
 #endif
@@ -34,7 +35,8 @@
 
 #define HEADER_SIZE 512
 
-//#define CACHE
+/* Number of per-block sector bitmaps kept in memory */
+#define VPC_BITMAP_CACHE_SIZE 32
 
 enum vhd_type {
     VHD_FIXED           = 2,
@@ -113,6 +115,15 @@ struct vhd_dyndisk_header {
     } parent_locator[8];
 };
 
+/* A cached sector bitmap: bit (7 - n % 8) of byte n / 8 is set if sector n
+ * of the block holds data */
+typedef struct VPCBitmapEntry {
+    int64_t index;          /* block index, -1 if unused */
+    uint64_t lru;
+    bool dirty;             /* needs to be written back */
+    uint8_t *bitmap;
+} VPCBitmapEntry;
+
 typedef struct BDRVVPCState {
     CoMutex lock;
     uint8_t footer_buf[HEADER_SIZE];
@@ -120,18 +131,17 @@ typedef struct BDRVVPCState {
     int max_table_entries;
     uint32_t *pagetable;
     uint64_t bat_offset;
-    uint64_t last_bitmap_offset;
+    /* Blocks whose sector bitmap is known to be all ones, so that writes
+     * to them don't need to touch metadata */
+    unsigned long *bitmap_full;
 
     uint32_t block_size;
     uint32_t bitmap_size;
+    /* sectors missing from the bitmap come from the parent image */
+    bool differencing;
 
-#ifdef CACHE
-    uint8_t *pageentry_u8;
-    uint32_t *pageentry_u32;
-    uint16_t *pageentry_u16;
-
-    uint64_t last_bitmap;
-#endif
+    VPCBitmapEntry bitmap_cache[VPC_BITMAP_CACHE_SIZE];
+    uint64_t bitmap_lru;
 
     Error *migration_blocker;
 } BDRVVPCState;
@@ -155,13 +165,69 @@ static int vpc_probe(const uint8_t *buf, int buf_size, const char *filename)
     return 0;
 }
 
+#define VHD_PLATFORM_MACX 0x4d616358 /* "MacX": UTF-8 file URL */
+
+/*
+ * Fills bs->backing_file from a differencing disk header: the MacX parent
+ * locator if there is one, the (UTF-16 big endian) parent name otherwise.
+ * Relative names are resolved against the image by the block layer.
+ */
+static int vpc_read_parent_name(BlockDriverState *bs,
+                                struct vhd_dyndisk_header *dyndisk_header)
+{
+    gunichar2 name[sizeof(dyndisk_header->parent_name) / 2];
+    char locator[PATH_MAX];
+    char *utf8;
+    int i, ret;
+
+    for (i = 0; i < ARRAY_SIZE(dyndisk_header->parent_locator); i++) {
+        uint32_t platform, len;
+        uint64_t offset;
+
+        platform = be32_to_cpu(dyndisk_header->parent_locator[i].platform);
+        len = be32_to_cpu(dyndisk_header->parent_locator[i].data_length);
+        offset = be64_to_cpu(dyndisk_header->parent_locator[i].data_offset);
+        if (platform != VHD_PLATFORM_MACX || len == 0 ||
+            len >= sizeof(locator)) {
+            continue;
+        }
+
+        ret = bdrv_pread(bs->file, offset, locator, len);
+        if (ret < 0) {
+            return ret;
+        }
+        locator[len] = '\0';
+        /* vhd-util writes "file://./name" for relative parents */
+        utf8 = locator;
+        strstart(utf8, "file://", (const char **) &utf8);
+        strstart(utf8, "./", (const char **) &utf8);
+        pstrcpy(bs->backing_file, sizeof(bs->backing_file), utf8);
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(name); i++) {
+        name[i] = lduw_be_p(&dyndisk_header->parent_name[2 * i]);
+        if (name[i] == 0) {
+            break;
+        }
+    }
+    utf8 = g_utf16_to_utf8(name, i, NULL, NULL, NULL);
+    if (utf8 == NULL || utf8[0] == '\0') {
+        g_free(utf8);
+        return -EINVAL;
+    }
+    pstrcpy(bs->backing_file, sizeof(bs->backing_file), utf8);
+    g_free(utf8);
+    return 0;
+}
+
 static int vpc_open(BlockDriverState *bs, int flags)
 {
     BDRVVPCState *s = bs->opaque;
     int i;
     struct vhd_footer* footer;
     struct vhd_dyndisk_header* dyndisk_header;
-    uint8_t buf[HEADER_SIZE];
+    uint8_t buf[2 * HEADER_SIZE];
     uint32_t checksum;
     int disk_type = VHD_DYNAMIC;
     int ret;
@@ -218,7 +284,7 @@ static int vpc_open(BlockDriverState *bs, int flags)
 
     if (disk_type == VHD_DYNAMIC) {
         ret = bdrv_pread(bs->file, be64_to_cpu(footer->data_offset), buf,
-                         HEADER_SIZE);
+                         sizeof(buf));
         if (ret < 0) {
             goto fail;
         }
@@ -230,6 +296,14 @@ static int vpc_open(BlockDriverState *bs, int flags)
             goto fail;
         }
 
+        if (be32_to_cpu(footer->type) == VHD_DIFFERENCING) {
+            ret = vpc_read_parent_name(bs, dyndisk_header);
+            if (ret < 0) {
+                goto fail;
+            }
+            s->differencing = true;
+        }
+
         s->block_size = be32_to_cpu(dyndisk_header->block_size);
         s->bitmap_size = ((s->block_size / (8 * 512)) + 511) & ~511;
 
@@ -259,14 +333,12 @@ static int vpc_open(BlockDriverState *bs, int flags)
             }
         }
 
-        s->last_bitmap_offset = (int64_t) -1;
+        s->bitmap_full = bitmap_new(s->max_table_entries);
 
-#ifdef CACHE
-        s->pageentry_u8 = g_malloc(512);
-        s->pageentry_u32 = s->pageentry_u8;
-        s->pageentry_u16 = s->pageentry_u8;
-        s->last_pagetable = -1;
-#endif
+        for (i = 0; i < VPC_BITMAP_CACHE_SIZE; i++) {
+            s->bitmap_cache[i].index = -1;
+            s->bitmap_cache[i].bitmap = g_malloc(s->bitmap_size);
+        }
     }
 
     qemu_co_mutex_init(&s->lock);
@@ -281,9 +353,7 @@ static int vpc_open(BlockDriverState *bs, int flags)
 
 fail:
     g_free(s->pagetable);
-#ifdef CACHE
-    g_free(s->pageentry_u8);
-#endif
+    g_free(s->bitmap_full);
     return ret;
 }
 
@@ -297,11 +367,11 @@ static int vpc_reopen_prepare(BDRVReopenState *state,
  * Returns the absolute byte offset of the given sector in the image file.
  * If the sector is not allocated, -1 is returned instead.
  *
- * The parameter write must be 1 if the offset will be used for a write
- * operation (the block bitmaps is updated then), 0 otherwise.
+ * This only looks at the in-memory BAT and never yields, so it is safe to
+ * call without holding s->lock.
  */
 static inline int64_t get_sector_offset(BlockDriverState *bs,
-    int64_t sector_num, int write)
+    int64_t sector_num)
 {
     BDRVVPCState *s = bs->opaque;
     uint64_t offset = sector_num * 512;
@@ -317,51 +387,10 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
     bitmap_offset = 512 * (uint64_t) s->pagetable[pagetable_index];
     block_offset = bitmap_offset + s->bitmap_size + (512 * pageentry_index);
 
-    // We must ensure that we don't write to any sectors which are marked as
-    // unused in the bitmap. We get away with setting all bits in the block
-    // bitmap each time we write to a new block. This might cause Virtual PC to
-    // miss sparse read optimization, but it's not a problem in terms of
-    // correctness.
-    if (write && (s->last_bitmap_offset != bitmap_offset)) {
-        uint8_t bitmap[s->bitmap_size];
-
-        s->last_bitmap_offset = bitmap_offset;
-        memset(bitmap, 0xff, s->bitmap_size);
-        bdrv_pwrite_sync(bs->file, bitmap_offset, bitmap, s->bitmap_size);
-    }
-
 //    printf("sector: %" PRIx64 ", index: %x, offset: %x, bioff: %" PRIx64 ", bloff: %" PRIx64 "\n",
 //	sector_num, pagetable_index, pageentry_index,
 //	bitmap_offset, block_offset);
 
-// disabled by reason
-#if 0
-#ifdef CACHE
-    if (bitmap_offset != s->last_bitmap)
-    {
-	lseek(s->fd, bitmap_offset, SEEK_SET);
-
-	s->last_bitmap = bitmap_offset;
-
-	// Scary! Bitmap is stored as big endian 32bit entries,
-	// while we used to look it up byte by byte
-	read(s->fd, s->pageentry_u8, 512);
-	for (i = 0; i < 128; i++)
-	    be32_to_cpus(&s->pageentry_u32[i]);
-    }
-
-    if ((s->pageentry_u8[pageentry_index / 8] >> (pageentry_index % 8)) & 1)
-	return -1;
-#else
-    lseek(s->fd, bitmap_offset + (pageentry_index / 8), SEEK_SET);
-
-    read(s->fd, &bitmap_entry, 1);
-
-    if ((bitmap_entry >> (pageentry_index % 8)) & 1)
-	return -1; // not allocated
-#endif
-#endif
-
     return block_offset;
 }
 
@@ -384,36 +413,184 @@ static int rewrite_footer(BlockDriverState* bs)
     return 0;
 }
 
+/* -------- sector bitmap cache -------- */
+
+static bool vpc_bitmap_test_range(const uint8_t *bitmap, int first, int count)
+{
+    int i;
+
+    for (i = first; i < first + count; i++) {
+        if (!(bitmap[i / 8] & (0x80 >> (i % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Returns true if any bit changed */
+static bool vpc_bitmap_set_range(uint8_t *bitmap, int first, int count)
+{
+    bool changed = false;
+    int i;
+
+    for (i = first; i < first + count; i++) {
+        if (!(bitmap[i / 8] & (0x80 >> (i % 8)))) {
+            bitmap[i / 8] |= 0x80 >> (i % 8);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/* Never yields, safe without s->lock */
+static VPCBitmapEntry *vpc_bitmap_lookup(BDRVVPCState *s, uint32_t index)
+{
+    int i;
+
+    for (i = 0; i < VPC_BITMAP_CACHE_SIZE; i++) {
+        if (s->bitmap_cache[i].index == index) {
+            return &s->bitmap_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static int vpc_bitmap_writeback(BlockDriverState *bs, VPCBitmapEntry *e)
+{
+    BDRVVPCState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_pwrite(bs->file, 512 * (uint64_t) s->pagetable[e->index],
+                      e->bitmap, s->bitmap_size);
+    if (ret < 0) {
+        return ret;
+    }
+    e->dirty = false;
+    return 0;
+}
+
+/*
+ * Frees up the least recently used cache entry, writing it back first if
+ * needed. Must be called with s->lock held.
+ */
+static VPCBitmapEntry *vpc_bitmap_evict(BlockDriverState *bs)
+{
+    BDRVVPCState *s = bs->opaque;
+    VPCBitmapEntry *e = &s->bitmap_cache[0];
+    int i;
+
+    for (i = 0; i < VPC_BITMAP_CACHE_SIZE; i++) {
+        if (s->bitmap_cache[i].index == -1) {
+            e = &s->bitmap_cache[i];
+            break;
+        }
+        if (s->bitmap_cache[i].lru < e->lru) {
+            e = &s->bitmap_cache[i];
+        }
+    }
+
+    if (e->index != -1 && e->dirty && vpc_bitmap_writeback(bs, e) < 0) {
+        return NULL;
+    }
+    e->index = -1;
+    e->dirty = false;
+    return e;
+}
+
+/*
+ * Returns the cached bitmap of an allocated block, reading it from the
+ * image on a miss. Must be called with s->lock held.
+ */
+static VPCBitmapEntry *vpc_bitmap_get(BlockDriverState *bs, uint32_t index)
+{
+    BDRVVPCState *s = bs->opaque;
+    VPCBitmapEntry *e;
+
+    e = vpc_bitmap_lookup(s, index);
+    if (e == NULL) {
+        e = vpc_bitmap_evict(bs);
+        if (e == NULL) {
+            return NULL;
+        }
+        if (bdrv_pread(bs->file, 512 * (uint64_t) s->pagetable[index],
+                       e->bitmap, s->bitmap_size) < 0) {
+            return NULL;
+        }
+        e->index = index;
+        if (vpc_bitmap_test_range(e->bitmap, 0,
+                                  s->block_size >> BDRV_SECTOR_BITS)) {
+            set_bit(index, s->bitmap_full);
+        }
+    }
+
+    e->lru = ++s->bitmap_lru;
+    return e;
+}
+
+/*
+ * Returns true if a write of nb_sectors at sector_num doesn't need any
+ * metadata update. Never yields, safe without s->lock.
+ */
+static bool vpc_bitmap_covers(BDRVVPCState *s, int64_t sector_num,
+                              int nb_sectors)
+{
+    uint32_t sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+    uint32_t index = sector_num / sectors_per_block;
+    VPCBitmapEntry *e;
+
+    if (test_bit(index, s->bitmap_full)) {
+        return true;
+    }
+    e = vpc_bitmap_lookup(s, index);
+    return e && vpc_bitmap_test_range(e->bitmap,
+                                      sector_num % sectors_per_block,
+                                      nb_sectors);
+}
+
 /*
  * Allocates a new block. This involves writing a new footer and updating
  * the Block Allocation Table to use the space at the old end of the image
  * file (overwriting the old footer)
  *
+ * The block's bitmap is written with the nb_sectors about to be written
+ * already marked, and stays in the cache. The in-memory BAT entry is only
+ * set once the block is on disk, so that concurrent readers keep seeing
+ * zeroes until then.
+ *
+ * Must be called with s->lock held.
+ *
  * Returns the sectors' offset in the image file on success and < 0 on error
  */
-static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
+static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num,
+                           int nb_sectors)
 {
     BDRVVPCState *s = bs->opaque;
-    int64_t bat_offset;
+    uint32_t sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+    int64_t bat_offset, block_offset;
     uint32_t index, bat_value;
+    VPCBitmapEntry *e;
     int ret;
-    uint8_t bitmap[s->bitmap_size];
 
     // Check if sector_num is valid
     if ((sector_num < 0) || (sector_num > bs->total_sectors))
         return -1;
 
-    // Write entry into in-memory BAT
     index = (sector_num * 512) / s->block_size;
     if (s->pagetable[index] != 0xFFFFFFFF)
         return -1;
 
-    s->pagetable[index] = s->free_data_block_offset / 512;
+    e = vpc_bitmap_evict(bs);
+    if (e == NULL) {
+        return -1;
+    }
+
+    block_offset = s->free_data_block_offset;
 
     // Initialize the block's bitmap
-    memset(bitmap, 0xff, s->bitmap_size);
-    ret = bdrv_pwrite_sync(bs->file, s->free_data_block_offset, bitmap,
-        s->bitmap_size);
+    memset(e->bitmap, 0, s->bitmap_size);
+    vpc_bitmap_set_range(e->bitmap, sector_num % sectors_per_block,
+                         nb_sectors);
+    ret = bdrv_pwrite_sync(bs->file, block_offset, e->bitmap, s->bitmap_size);
     if (ret < 0) {
         return ret;
     }
@@ -426,115 +603,318 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
 
     // Write BAT entry to disk
     bat_offset = s->bat_offset + (4 * index);
-    bat_value = be32_to_cpu(s->pagetable[index]);
+    bat_value = cpu_to_be32(block_offset / 512);
     ret = bdrv_pwrite_sync(bs->file, bat_offset, &bat_value, 4);
     if (ret < 0)
         goto fail;
 
-    return get_sector_offset(bs, sector_num, 0);
+    // Publish the entry in the in-memory BAT
+    s->pagetable[index] = block_offset / 512;
+    e->index = index;
+    e->lru = ++s->bitmap_lru;
+    if (nb_sectors == sectors_per_block) {
+        set_bit(index, s->bitmap_full);
+    }
+
+    return get_sector_offset(bs, sector_num);
 
 fail:
     s->free_data_block_offset -= (s->block_size + s->bitmap_size);
     return -1;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Makes sure that the block containing sector_num can be written to: it is
+ * allocated if needed, and the written sectors are marked in its bitmap.
+ * Bitmap changes stay in the cache until the next flush.
+ *
+ * Returns the sector's offset in the image file on success and < 0 on error
+ */
+static coroutine_fn int64_t vpc_prepare_write(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors)
 {
     BDRVVPCState *s = bs->opaque;
-    int ret;
+    uint32_t sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+    uint32_t index = sector_num / sectors_per_block;
+    VPCBitmapEntry *e;
     int64_t offset;
-    int64_t sectors, sectors_per_block;
-    struct vhd_footer *footer = (struct vhd_footer *) s->footer_buf;
 
-    if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_read(bs->file, sector_num, buf, nb_sectors);
+    qemu_co_mutex_lock(&s->lock);
+
+    /* Somebody else may have done it while we were waiting */
+    offset = get_sector_offset(bs, sector_num);
+    if (offset == -1) {
+        offset = alloc_block(bs, sector_num, nb_sectors);
+    } else if (!vpc_bitmap_covers(s, sector_num, nb_sectors)) {
+        e = vpc_bitmap_get(bs, index);
+        if (e == NULL) {
+            offset = -1;
+        } else if (vpc_bitmap_set_range(e->bitmap,
+                                        sector_num % sectors_per_block,
+                                        nb_sectors)) {
+            e->dirty = true;
+            if (vpc_bitmap_test_range(e->bitmap, 0, sectors_per_block)) {
+                set_bit(index, s->bitmap_full);
+            }
+        }
     }
-    while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 0);
 
-        sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
-        sectors = sectors_per_block - (sector_num % sectors_per_block);
-        if (sectors > nb_sectors) {
-            sectors = nb_sectors;
+    qemu_co_mutex_unlock(&s->lock);
+    return offset;
+}
+
+/* Length of the run of sectors in the same state as 'first' */
+static int vpc_bitmap_run(const uint8_t *bitmap, int first, int count,
+                          bool *present)
+{
+    bool p = vpc_bitmap_test_range(bitmap, first, 1);
+    int i;
+
+    for (i = first + 1; i < first + count; i++) {
+        if (vpc_bitmap_test_range(bitmap, i, 1) != p) {
+            break;
         }
+    }
+    *present = p;
+    return i - first;
+}
 
-        if (offset == -1) {
-            memset(buf, 0, sectors * BDRV_SECTOR_SIZE);
+/*
+ * Finds the longest run starting at sector_num, of at most nb_sectors, that
+ * is either all present in this image or all absent from it. Present runs
+ * end at block boundaries, absent runs may span several blocks.
+ *
+ * On success, *offset is the offset of the run in the image file, or -1 if
+ * it is absent, and *pnum its length in sectors.
+ */
+static coroutine_fn int vpc_co_get_run(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       int *pnum, int64_t *offset)
+{
+    BDRVVPCState *s = bs->opaque;
+    uint32_t sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+    int n = 0;
+
+    *offset = -1;
+    while (n < nb_sectors) {
+        int64_t sector = sector_num + n;
+        uint32_t index = sector / sectors_per_block;
+        int first = sector % sectors_per_block;
+        int count = MIN(sectors_per_block - first, nb_sectors - n);
+        int64_t block_offset = get_sector_offset(bs, sector);
+        VPCBitmapEntry *e;
+        bool present;
+        int len;
+
+        if (block_offset == -1) {
+            present = false;
+            len = count;
+        } else if (!s->differencing || test_bit(index, s->bitmap_full)) {
+            present = true;
+            len = count;
+        } else if ((e = vpc_bitmap_lookup(s, index)) != NULL) {
+            len = vpc_bitmap_run(e->bitmap, first, count, &present);
         } else {
-            ret = bdrv_pread(bs->file, offset, buf,
-                sectors * BDRV_SECTOR_SIZE);
-            if (ret != sectors * BDRV_SECTOR_SIZE) {
-                return -1;
+            qemu_co_mutex_lock(&s->lock);
+            e = vpc_bitmap_get(bs, index);
+            if (e == NULL) {
+                qemu_co_mutex_unlock(&s->lock);
+                return -EIO;
             }
+            len = vpc_bitmap_run(e->bitmap, first, count, &present);
+            qemu_co_mutex_unlock(&s->lock);
         }
 
-        nb_sectors -= sectors;
-        sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        if (n > 0 && present) {
+            break;
+        }
+        if (n == 0 && present) {
+            *offset = block_offset;
+        }
+        n += len;
+        if (present || len < count) {
+            break;
+        }
+    }
+
+    *pnum = n;
+    return 0;
+}
+
+/* Reads a run that is absent from this image */
+static coroutine_fn int vpc_co_read_absent(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    int64_t backing_sectors;
+    int n = 0;
+
+    if (bs->backing_hd) {
+        /* The parent may be smaller than the child */
+        backing_sectors = bdrv_getlength(bs->backing_hd) >> BDRV_SECTOR_BITS;
+        if (sector_num < backing_sectors) {
+            n = MIN(nb_sectors, backing_sectors - sector_num);
+        }
+    }
+
+    if (n < nb_sectors) {
+        qemu_iovec_memset(qiov, n * BDRV_SECTOR_SIZE, 0,
+                          (nb_sectors - n) * BDRV_SECTOR_SIZE);
+    }
+    if (n > 0) {
+        QEMUIOVector head;
+        int ret;
+
+        qemu_iovec_init(&head, qiov->niov);
+        qemu_iovec_concat(&head, qiov, 0, n * BDRV_SECTOR_SIZE);
+        ret = bdrv_co_readv(bs->backing_hd, sector_num, n, &head);
+        qemu_iovec_destroy(&head);
+        return ret;
     }
     return 0;
 }
 
-static coroutine_fn int vpc_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
-    int ret;
     BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    int ret = 0;
+    int64_t offset;
+    int n;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+    struct vhd_footer *footer = (struct vhd_footer *) s->footer_buf;
+
+    if (cpu_to_be32(footer->type) == VHD_FIXED) {
+        return bdrv_co_readv(bs->file, sector_num, nb_sectors, qiov);
+    }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    /* One request per run of present or absent sectors */
+    while (nb_sectors > 0) {
+        ret = vpc_co_get_run(bs, sector_num, nb_sectors, &n, &offset);
+        if (ret < 0) {
+            break;
+        }
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_concat(&hd_qiov, qiov, bytes_done, n * BDRV_SECTOR_SIZE);
+        if (offset == -1) {
+            ret = vpc_co_read_absent(bs, sector_num, n, &hd_qiov);
+        } else {
+            ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                                n, &hd_qiov);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
+    }
+
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
-static int vpc_write(BlockDriverState *bs, int64_t sector_num,
-    const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_is_allocated(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
 {
     BDRVVPCState *s = bs->opaque;
+    struct vhd_footer *footer = (struct vhd_footer *) s->footer_buf;
     int64_t offset;
-    int64_t sectors, sectors_per_block;
     int ret;
+
+    if (cpu_to_be32(footer->type) == VHD_FIXED) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+
+    ret = vpc_co_get_run(bs, sector_num, nb_sectors, pnum, &offset);
+    if (ret < 0) {
+        *pnum = 0;
+        return ret;
+    }
+    return offset != -1;
+}
+
+static coroutine_fn int vpc_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVVPCState *s = bs->opaque;
+    int64_t offset;
+    int64_t sectors, sectors_per_block;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+    QEMUIOVector hd_qiov;
     struct vhd_footer *footer =  (struct vhd_footer *) s->footer_buf;
 
     if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_write(bs->file, sector_num, buf, nb_sectors);
+        return bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
     }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
     while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 1);
+        offset = get_sector_offset(bs, sector_num);
 
-        sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
         if (sectors > nb_sectors) {
             sectors = nb_sectors;
         }
 
-        if (offset == -1) {
-            offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
+        /* Only allocation and bitmap updates are serialized, data
+         * writes to blocks that are ready go out in parallel */
+        if (offset == -1 || !vpc_bitmap_covers(s, sector_num, sectors)) {
+            offset = vpc_prepare_write(bs, sector_num, sectors);
+            if (offset < 0) {
+                ret = -EIO;
+                break;
+            }
         }
 
-        ret = bdrv_pwrite(bs->file, offset, buf, sectors * BDRV_SECTOR_SIZE);
-        if (ret != sectors * BDRV_SECTOR_SIZE) {
-            return -1;
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                          sectors * BDRV_SECTOR_SIZE);
+        ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                             sectors, &hd_qiov);
+        if (ret < 0) {
+            break;
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
 
-    return 0;
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
 }
 
-static coroutine_fn int vpc_co_write(BlockDriverState *bs, int64_t sector_num,
-                                     const uint8_t *buf, int nb_sectors)
+/* Writes back the dirty sector bitmaps */
+static coroutine_fn int vpc_co_flush(BlockDriverState *bs)
 {
-    int ret;
     BDRVVPCState *s = bs->opaque;
+    int i, ret = 0;
+
     qemu_co_mutex_lock(&s->lock);
-    ret = vpc_write(bs, sector_num, buf, nb_sectors);
+    for (i = 0; i < VPC_BITMAP_CACHE_SIZE; i++) {
+        VPCBitmapEntry *e = &s->bitmap_cache[i];
+
+        if (e->index != -1 && e->dirty) {
+            ret = vpc_bitmap_writeback(bs, e);
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
     qemu_co_mutex_unlock(&s->lock);
+
     return ret;
 }
 
@@ -789,10 +1169,13 @@ static int vpc_create(const char *filename, QEMUOptionParameter *options)
 static void vpc_close(BlockDriverState *bs)
 {
     BDRVVPCState *s = bs->opaque;
+    int i;
+
     g_free(s->pagetable);
-#ifdef CACHE
-    g_free(s->pageentry_u8);
-#endif
+    g_free(s->bitmap_full);
+    for (i = 0; i < VPC_BITMAP_CACHE_SIZE; i++) {
+        g_free(s->bitmap_cache[i].bitmap);
+    }
 
     migrate_del_blocker(s->migration_blocker);
     error_free(s->migration_blocker);
@@ -824,8 +1207,10 @@ static BlockDriver bdrv_vpc = {
     .bdrv_reopen_prepare = vpc_reopen_prepare,
     .bdrv_create    = vpc_create,
 
-    .bdrv_read              = vpc_co_read,
-    .bdrv_write             = vpc_co_write,
+    .bdrv_co_readv          = vpc_co_readv,
+    .bdrv_co_writev         = vpc_co_writev,
+    .bdrv_co_flush_to_os    = vpc_co_flush,
+    .bdrv_co_is_allocated   = vpc_co_is_allocated,
 
     .create_options = vpc_create_options,
 };
@@ -17,6 +17,7 @@
 #include "qapi/qmp/types.h"
 #include "sysemu/sysemu.h"
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "sysemu/arch_init.h"
@@ -277,6 +278,31 @@ static bool do_check_io_limits(BlockIOLimit *io_limits)
     return true;
 }
 
+/* a burst rate is only meaningful on top of an average rate it exceeds */
+static bool do_check_burst_limits(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps_max[i] &&
+            io_limits->bps_max[i] < io_limits->bps[i]) {
+            return false;
+        }
+        if (io_limits->bps_max[i] && !io_limits->bps[i]) {
+            return false;
+        }
+        if (io_limits->iops_max[i] &&
+            io_limits->iops_max[i] < io_limits->iops[i]) {
+            return false;
+        }
+        if (io_limits->iops_max[i] && !io_limits->iops[i]) {
+            return false;
+        }
+    }
+
+    return io_limits->burst_length >= 0;
+}
+
 DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
 {
     const char *buf;
@@ -432,6 +458,20 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
                            qemu_opt_get_number(opts, "iops_rd", 0);
     io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
                            qemu_opt_get_number(opts, "iops_wr", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL]  =
+                           qemu_opt_get_number(opts, "bps_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]   =
+                           qemu_opt_get_number(opts, "bps_rd_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE]  =
+                           qemu_opt_get_number(opts, "bps_wr_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ]  =
+                           qemu_opt_get_number(opts, "iops_rd_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr_max", 0);
+    io_limits.burst_length =
+                           qemu_opt_get_number(opts, "burst_length", 0);
 
     if (!do_check_io_limits(&io_limits)) {
         error_report("bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
@@ -439,6 +479,12 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
         return NULL;
     }
 
+    if (!do_check_burst_limits(&io_limits)) {
+        error_report("bps_max(iops_max) and friends need the matching "
+                     "average limit, and must not be lower than it");
+        return NULL;
+    }
+
     if (qemu_opt_get(opts, "boot") != NULL) {
         fprintf(stderr, "qemu-kvm: boot=on|off is deprecated and will be "
                 "ignored. Future versions will reject this parameter. Please "
@@ -559,6 +605,23 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
 
     /* disk I/O throttling */
     bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    if ((buf = qemu_opt_get(opts, "throttle_group")) != NULL) {
+        bdrv_set_throttle_group(dinfo->bdrv, buf);
+    }
+
+    dinfo->bdrv->l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
+    dinfo->bdrv->refcount_cache_size =
+        qemu_opt_get_size(opts, "refcount-cache-size", 0);
+    dinfo->bdrv->chunk_cache_size =
+        qemu_opt_get_size(opts, "chunk-cache-size", 0);
+
+    if ((buf = qemu_opt_get(opts, "aio-pool")) != NULL) {
+        dinfo->bdrv->thread_pool = thread_pool_find(buf);
+        if (!dinfo->bdrv->thread_pool) {
+            error_report("aio-pool '%s' not found", buf);
+            goto err;
+        }
+    }
 
     switch(type) {
     case IF_ATAPI_PT: /* XenClient: ATAPI Pass Through */
@@ -966,10 +1029,19 @@ void qmp_change_blockdev(const char *device, const char *filename,
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t iops_wr,
+                               bool has_bps_max, int64_t bps_max,
+                               bool has_bps_rd_max, int64_t bps_rd_max,
+                               bool has_bps_wr_max, int64_t bps_wr_max,
+                               bool has_iops_max, int64_t iops_max,
+                               bool has_iops_rd_max, int64_t iops_rd_max,
+                               bool has_iops_wr_max, int64_t iops_wr_max,
+                               bool has_burst_length, int64_t burst_length,
+                               Error **errp)
 {
     BlockIOLimit io_limits;
     BlockDriverState *bs;
+    int i;
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -977,6 +1049,7 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
+    io_limits = bs->io_limits;
     io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = bps;
     io_limits.bps[BLOCK_IO_LIMIT_READ]  = bps_rd;
     io_limits.bps[BLOCK_IO_LIMIT_WRITE] = bps_wr;
@@ -984,23 +1057,64 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
     io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
 
-    if (!do_check_io_limits(&io_limits)) {
+    /* burst rates are kept unless given, but go away with their average */
+    for (i = 0; i < 3; i++) {
+        if (!io_limits.bps[i]) {
+            io_limits.bps_max[i] = 0;
+        }
+        if (!io_limits.iops[i]) {
+            io_limits.iops_max[i] = 0;
+        }
+    }
+    if (has_bps_max) {
+        io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL] = bps_max;
+    }
+    if (has_bps_rd_max) {
+        io_limits.bps_max[BLOCK_IO_LIMIT_READ] = bps_rd_max;
+    }
+    if (has_bps_wr_max) {
+        io_limits.bps_max[BLOCK_IO_LIMIT_WRITE] = bps_wr_max;
+    }
+    if (has_iops_max) {
+        io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] = iops_max;
+    }
+    if (has_iops_rd_max) {
+        io_limits.iops_max[BLOCK_IO_LIMIT_READ] = iops_rd_max;
+    }
+    if (has_iops_wr_max) {
+        io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] = iops_wr_max;
+    }
+    if (has_burst_length) {
+        io_limits.burst_length = burst_length;
+    }
+
+    if (!do_check_io_limits(&io_limits) ||
+        !do_check_burst_limits(&io_limits)) {
         error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
         return;
     }
 
-    bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
+    bdrv_set_io_limits(bs, &io_limits);
+}
 
-    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_disable(bs);
-    } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
-        }
+void qmp_block_latency_histogram_set(const char *device, bool has_enable,
+                                     bool enable, bool has_min_ns,
+                                     int64_t min_ns, bool has_bins,
+                                     int64_t bins, Error **errp)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
     }
+
+    bdrv_set_latency_histograms(bs, has_enable ? enable : true,
+                                has_min_ns ? min_ns :
+                                LATENCY_HISTOGRAM_DEFAULT_MIN_NS,
+                                has_bins ? bins :
+                                LATENCY_HISTOGRAM_DEFAULT_BINS, errp);
 }
 
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
@@ -1186,8 +1300,13 @@ void qmp_block_commit(const char *device,
         return;
     }
 
-    commit_start(bs, base_bs, top_bs, speed, on_error, block_job_cb, bs,
-                &local_err);
+    if (top_bs == bs) {
+        commit_active_start(bs, base_bs, speed, on_error, block_job_cb,
+                            bs, &local_err);
+    } else {
+        commit_start(bs, base_bs, top_bs, speed, on_error, block_job_cb, bs,
+                    &local_err);
+    }
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         return;
@@ -1343,6 +1462,156 @@ void qmp_drive_mirror(const char *device, const char *target,
     drive_get_ref(drive_get_by_blockdev(bs));
 }
 
+#define DEFAULT_DIRTY_BITMAP_GRANULARITY 65536
+
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_file, const char *file,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!has_granularity) {
+        granularity = DEFAULT_DIRTY_BITMAP_GRANULARITY;
+    }
+    if (granularity < 512 || granularity > 1048576 * 64 ||
+        (granularity & (granularity - 1))) {
+        error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    bdrv_create_dirty_bitmap(bs, name, granularity, has_file ? file : NULL,
+                             errp);
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        return;
+    }
+    if (bitmap->busy) {
+        error_setg(errp, "Dirty bitmap '%s' is in use by a backup job", name);
+        return;
+    }
+    bdrv_release_dirty_bitmap(bs, bitmap);
+}
+
+void qmp_drive_backup_incremental(const char *device, const char *bitmap,
+                                  const char *target,
+                                  bool has_format, const char *format,
+                                  bool has_mode, enum NewImageMode mode,
+                                  bool has_speed, int64_t speed,
+                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BlockDriverState *target_bs;
+    BlockDriver *drv = NULL;
+    BdrvDirtyBitmap *dirty_bitmap;
+    Error *local_err = NULL;
+    int flags;
+    int ret;
+
+    if (!has_speed) {
+        speed = 0;
+    }
+    if (!has_mode) {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    dirty_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+    if (!dirty_bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+        return;
+    }
+
+    if (!has_format) {
+        format = mode == NEW_IMAGE_MODE_EXISTING ? NULL : bs->drv->format_name;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+            return;
+        }
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+
+    if (mode != NEW_IMAGE_MODE_EXISTING) {
+        /* Only the changed clusters go in, so no backing file either */
+        assert(format && drv);
+        bdrv_img_create(target, format, NULL, NULL, NULL,
+                        bdrv_getlength(bs), flags, &local_err);
+        if (error_is_set(&local_err)) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    /* The backup may be stacked on the previous one, but it is never
+     * read here.
+     */
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags | BDRV_O_NO_BACKING, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    backup_start(bs, target_bs, dirty_bitmap, speed, block_job_cb, bs,
+                 &local_err);
+    if (local_err != NULL) {
+        bdrv_delete(target_bs);
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.
+     */
+    drive_get_ref(drive_get_by_blockdev(bs));
+}
+
 static BlockJob *find_block_job(const char *device)
 {
     BlockDriverState *bs;
@@ -1366,6 +1635,37 @@ void qmp_block_job_set_speed(const char *device, int64_t speed, Error **errp)
     block_job_set_speed(job, speed, errp);
 }
 
+void qmp_block_job_set_weight(const char *device, int64_t weight,
+                              Error **errp)
+{
+    BlockJob *job = find_block_job(device);
+
+    if (!job) {
+        error_set(errp, QERR_BLOCK_JOB_NOT_ACTIVE, device);
+        return;
+    }
+
+    block_job_set_weight(job, weight, errp);
+}
+
+void qmp_block_job_set_bandwidth(int64_t speed, bool has_latency_target,
+                                 int64_t latency_target, Error **errp)
+{
+    if (!has_latency_target) {
+        latency_target = 0;
+    }
+    if (latency_target > INT64_MAX / 1000) {
+        error_set(errp, QERR_INVALID_PARAMETER, "latency-target");
+        return;
+    }
+    block_job_set_bandwidth(speed, latency_target * 1000, errp);
+}
+
+BlockJobBandwidthInfo *qmp_query_block_job_bandwidth(Error **errp)
+{
+    return block_job_query_bandwidth();
+}
+
 void qmp_block_job_cancel(const char *device,
                           bool has_force, bool force, Error **errp)
 {
@@ -1554,10 +1854,58 @@ QemuOptsList qemu_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total I/O operations per second during bursts",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read operations per second during bursts",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write operations per second during bursts",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes per second during bursts",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read bytes per second during bursts",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write bytes per second during bursts",
+        },{
+            .name = "burst_length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "seconds a burst may last (default 1)",
+        },{
+            .name = "throttle_group",
+            .type = QEMU_OPT_STRING,
+            .help = "share I/O limits with the other drives in this group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the qcow2, QED and VMDK L2 table cache",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the qcow2 refcount block cache",
+        },{
+            .name = "chunk-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cache of decompressed cloop and dmg chunks",
+        },{
+            .name = "aio-pool",
+            .type = QEMU_OPT_STRING,
+            .help = "thread pool (see -aio-pool) for blocking requests",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
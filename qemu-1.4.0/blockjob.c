@@ -35,6 +35,182 @@
 #include "qmp-commands.h"
 #include "qemu/timer.h"
 
+#define BLOCK_JOB_WEIGHT_DEFAULT    100
+#define BLOCK_JOB_WEIGHT_MAX        1000
+#define BLOCK_JOB_SLICE_TIME        100000000ULL /* ns */
+
+/*
+ * Bandwidth shared by all jobs.  Each slice allows speed * slice time
+ * bytes, split between the jobs that ran in the last two slices according
+ * to their weights.  A job that was held back in the last slice is given
+ * its share as credit, which it keeps adding up until it can afford its
+ * next request; that way a job gets its share even when its requests are
+ * bigger than that.  Bandwidth that nobody is waiting for goes to whoever
+ * asks for it.
+ *
+ * At the start of each slice the average latency of guest requests since
+ * the last one is compared with the target: above it, the bandwidth is
+ * halved (down to 1/16 of what was set); below it, it grows back by 1/16
+ * per slice.
+ */
+static struct {
+    uint64_t speed;
+    uint64_t cur_speed;
+    int64_t latency_target_ns;
+    int64_t latency_ns;
+
+    uint64_t slice;
+    int64_t slice_end;
+    uint64_t slice_quota;
+    uint64_t slice_dispatched;
+
+    uint64_t guest_ops;
+    uint64_t guest_time_ns;
+} job_bandwidth;
+
+static bool block_job_bandwidth_active(BlockJob *job)
+{
+    return job->slice_active + 1 >= job_bandwidth.slice;
+}
+
+static bool block_job_bandwidth_waiting(BlockJob *job)
+{
+    return job->slice_throttled + 1 >= job_bandwidth.slice;
+}
+
+static void block_job_bandwidth_adjust(void)
+{
+    BlockDriverState *bs = NULL;
+    uint64_t ops = 0, time_ns = 0, floor;
+
+    while ((bs = bdrv_next(bs))) {
+        ops += bs->nr_ops[BDRV_ACCT_READ] + bs->nr_ops[BDRV_ACCT_WRITE];
+        time_ns += bs->total_time_ns[BDRV_ACCT_READ] +
+                   bs->total_time_ns[BDRV_ACCT_WRITE];
+    }
+    if (ops > job_bandwidth.guest_ops) {
+        job_bandwidth.latency_ns = (time_ns - job_bandwidth.guest_time_ns) /
+                                   (ops - job_bandwidth.guest_ops);
+    } else {
+        job_bandwidth.latency_ns = 0;
+    }
+    job_bandwidth.guest_ops = ops;
+    job_bandwidth.guest_time_ns = time_ns;
+
+    floor = MAX(job_bandwidth.speed / 16, 1);
+    if (job_bandwidth.latency_target_ns &&
+        job_bandwidth.latency_ns > job_bandwidth.latency_target_ns) {
+        job_bandwidth.cur_speed = MAX(job_bandwidth.cur_speed / 2, floor);
+    } else {
+        job_bandwidth.cur_speed = MIN(job_bandwidth.cur_speed + floor,
+                                      job_bandwidth.speed);
+    }
+}
+
+static void block_job_bandwidth_new_slice(int64_t now)
+{
+    BlockDriverState *bs = NULL;
+    unsigned total_weight = 0;
+    uint64_t share;
+
+    block_job_bandwidth_adjust();
+
+    job_bandwidth.slice++;
+    job_bandwidth.slice_end = now + BLOCK_JOB_SLICE_TIME;
+    job_bandwidth.slice_dispatched = 0;
+    job_bandwidth.slice_quota = (double)job_bandwidth.cur_speed *
+                                BLOCK_JOB_SLICE_TIME / 1000000000ULL;
+
+    while ((bs = bdrv_next(bs))) {
+        if (bs->job && block_job_bandwidth_active(bs->job)) {
+            total_weight += bs->job->weight;
+        }
+    }
+    while ((bs = bdrv_next(bs))) {
+        BlockJob *job = bs->job;
+
+        if (!job || !block_job_bandwidth_active(job)) {
+            continue;
+        }
+        share = job_bandwidth.slice_quota * job->weight / total_weight;
+        if (block_job_bandwidth_waiting(job)) {
+            job->credit = MIN(job->credit + share,
+                              MAX(job_bandwidth.slice_quota,
+                                  job->last_request));
+        } else {
+            job->credit = share;
+        }
+    }
+}
+
+int64_t block_job_bandwidth_delay(BlockJob *job, uint64_t n)
+{
+    BlockDriverState *bs = NULL;
+    uint64_t bytes = n * BDRV_SECTOR_SIZE;
+    bool others_waiting = false;
+    int64_t now;
+
+    if (!job_bandwidth.speed) {
+        return 0;
+    }
+
+    now = qemu_get_clock_ns(rt_clock);
+    if (now >= job_bandwidth.slice_end) {
+        block_job_bandwidth_new_slice(now);
+    }
+    job->slice_active = job_bandwidth.slice;
+
+    while ((bs = bdrv_next(bs))) {
+        if (bs->job && bs->job != job && block_job_bandwidth_waiting(bs->job)) {
+            others_waiting = true;
+        }
+    }
+
+    if (bytes <= job->credit) {
+        job->credit -= bytes;
+    } else if (!others_waiting &&
+               (job_bandwidth.slice_dispatched == 0 ||
+                job_bandwidth.slice_dispatched + bytes <=
+                job_bandwidth.slice_quota)) {
+        job->credit = 0;
+    } else {
+        job->slice_throttled = job_bandwidth.slice;
+        job->last_request = bytes;
+        return job_bandwidth.slice_end - now;
+    }
+
+    job_bandwidth.slice_dispatched += bytes;
+    return 0;
+}
+
+void block_job_set_bandwidth(int64_t speed, int64_t latency_ns, Error **errp)
+{
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    if (latency_ns < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "latency-target");
+        return;
+    }
+
+    job_bandwidth.speed = speed;
+    job_bandwidth.cur_speed = speed;
+    job_bandwidth.latency_target_ns = latency_ns;
+    job_bandwidth.slice_end = 0;
+}
+
+BlockJobBandwidthInfo *block_job_query_bandwidth(void)
+{
+    BlockJobBandwidthInfo *info = g_new0(BlockJobBandwidthInfo, 1);
+
+    info->speed = job_bandwidth.speed;
+    info->current_speed = job_bandwidth.cur_speed;
+    info->latency_target = job_bandwidth.latency_target_ns / 1000;
+    info->latency = job_bandwidth.latency_ns / 1000;
+    return info;
+}
+
 void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
                        int64_t speed, BlockDriverCompletionFunc *cb,
                        void *opaque, Error **errp)
@@ -53,6 +229,7 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
     job->cb            = cb;
     job->opaque        = opaque;
     job->busy          = true;
+    job->weight        = BLOCK_JOB_WEIGHT_DEFAULT;
     bs->job = job;
 
     /* Only set speed when necessary to avoid NotSupported error */
@@ -99,6 +276,16 @@ void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp)
     job->speed = speed;
 }
 
+void block_job_set_weight(BlockJob *job, int64_t weight, Error **errp)
+{
+    if (weight < 1 || weight > BLOCK_JOB_WEIGHT_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "weight",
+                  "a value between 1 and 1000");
+        return;
+    }
+    job->weight = weight;
+}
+
 void block_job_complete(BlockJob *job, Error **errp)
 {
     if (job->paused || job->cancelled || !job->job_type->complete) {
@@ -215,7 +402,11 @@ BlockJobInfo *block_job_query(BlockJob *job)
     info->paused    = job->paused;
     info->offset    = job->offset;
     info->speed     = job->speed;
+    info->weight    = job->weight;
     info->io_status = job->iostatus;
+    if (job->job_type->query) {
+        job->job_type->query(job, info);
+    }
     return info;
 }
 
@@ -27,26 +27,33 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <ucontext.h>
+#include <sys/mman.h>
 #include "qemu-common.h"
 #include "block/coroutine_int.h"
+#include "trace.h"
 
 #ifdef CONFIG_VALGRIND_H
 #include <valgrind/valgrind.h>
 #endif
 
 enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
+    /* Each thread keeps as many freed coroutines as it ever had alive at
+     * once, between these bounds.  Stacks are only touched as deep as they
+     * were used, so a big pool mostly costs address space.
+     */
+    POOL_MIN_SIZE = 64,
+    POOL_MAX_SIZE = 1024,
+
+    STACK_SIZE = 1 << 20,
 };
 
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
+typedef struct CoroutineThreadState CoroutineThreadState;
 
 typedef struct {
     Coroutine base;
-    void *stack;
+    void *stack;                /* above a guard page */
     jmp_buf env;
+    CoroutineThreadState *owner; /* thread that handed it out */
 
 #ifdef CONFIG_VALGRIND_H
     unsigned int valgrind_stack_id;
@@ -57,13 +64,28 @@ typedef struct {
 /**
  * Per-thread coroutine bookkeeping
  */
-typedef struct {
+struct CoroutineThreadState {
     /** Currently executing coroutine */
     Coroutine *current;
 
     /** The default coroutine */
     CoroutineUContext leader;
-} CoroutineThreadState;
+
+    /** Free list to speed up creation */
+    QSLIST_HEAD(, Coroutine) pool;
+    unsigned int pool_size;
+    unsigned int pool_max;
+
+    /** Coroutines created by this thread and not deleted yet, plus one
+     * for the thread itself.  Coroutines can be deleted from any thread,
+     * so this is updated atomically; the state is freed when it drops to
+     * zero, which keeps it valid for coroutines outliving their thread.
+     */
+    unsigned int nr_alive;
+
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+};
 
 static pthread_key_t thread_state_key;
 
@@ -84,26 +106,86 @@ static CoroutineThreadState *coroutine_get_thread_state(void)
     if (!s) {
         s = g_malloc0(sizeof(*s));
         s->current = &s->leader.base;
+        QSLIST_INIT(&s->pool);
+        s->pool_max = POOL_MIN_SIZE;
+        s->nr_alive = 1;
         pthread_setspecific(thread_state_key, s);
     }
     return s;
 }
 
+/* The stack is mapped with an inaccessible page below it, so that running
+ * off its end faults instead of corrupting whatever lies there.
+ */
+static void *coroutine_stack_alloc(void)
+{
+    size_t guard = getpagesize();
+    void *ptr;
+
+    ptr = mmap(NULL, STACK_SIZE + guard, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        abort();
+    }
+    if (mprotect(ptr, guard, PROT_NONE) != 0) {
+        abort();
+    }
+    return ptr + guard;
+}
+
+static void coroutine_stack_free(void *stack)
+{
+    size_t guard = getpagesize();
+
+    munmap(stack - guard, STACK_SIZE + guard);
+}
+
+#ifdef CONFIG_VALGRIND_H
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+/* Work around an unused variable in the valgrind.h macro... */
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#endif
+static inline void valgrind_stack_deregister(CoroutineUContext *co)
+{
+    VALGRIND_STACK_DEREGISTER(co->valgrind_stack_id);
+}
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+#pragma GCC diagnostic error "-Wunused-but-set-variable"
+#endif
+#endif
+
+static void coroutine_free(CoroutineUContext *co)
+{
+#ifdef CONFIG_VALGRIND_H
+    valgrind_stack_deregister(co);
+#endif
+
+    coroutine_stack_free(co->stack);
+    g_free(co);
+}
+
 static void qemu_coroutine_thread_cleanup(void *opaque)
 {
     CoroutineThreadState *s = opaque;
+    Coroutine *co;
+    Coroutine *tmp;
 
-    g_free(s);
+    QSLIST_FOREACH_SAFE(co, &s->pool, pool_next, tmp) {
+        coroutine_free(DO_UPCAST(CoroutineUContext, base, co));
+    }
+    if (__sync_sub_and_fetch(&s->nr_alive, 1) == 0) {
+        g_free(s);
+    }
 }
 
 static void __attribute__((destructor)) coroutine_cleanup(void)
 {
-    Coroutine *co;
-    Coroutine *tmp;
+    CoroutineThreadState *s = pthread_getspecific(thread_state_key);
 
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        g_free(DO_UPCAST(CoroutineUContext, base, co)->stack);
-        g_free(co);
+    /* Threads still running at exit keep theirs, it does not matter */
+    if (s) {
+        pthread_setspecific(thread_state_key, NULL);
+        qemu_coroutine_thread_cleanup(s);
     }
 }
 
@@ -142,7 +224,7 @@ static void coroutine_trampoline(int i0, int i1)
 
 static Coroutine *coroutine_new(void)
 {
-    const size_t stack_size = 1 << 20;
+    const size_t stack_size = STACK_SIZE;
     CoroutineUContext *co;
     ucontext_t old_uc, uc;
     jmp_buf old_env;
@@ -160,7 +242,7 @@ static Coroutine *coroutine_new(void)
     }
 
     co = g_malloc0(sizeof(*co));
-    co->stack = g_malloc(stack_size);
+    co->stack = coroutine_stack_alloc();
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
 
     uc.uc_link = &old_uc;
@@ -187,49 +269,56 @@ static Coroutine *coroutine_new(void)
 
 Coroutine *qemu_coroutine_new(void)
 {
+    CoroutineThreadState *s = coroutine_get_thread_state();
     Coroutine *co;
+    unsigned int alive;
 
-    co = QSLIST_FIRST(&pool);
+    co = QSLIST_FIRST(&s->pool);
     if (co) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        pool_size--;
+        QSLIST_REMOVE_HEAD(&s->pool, pool_next);
+        s->pool_size--;
+        s->pool_hits++;
     } else {
         co = coroutine_new();
+        s->pool_misses++;
+        trace_qemu_coroutine_pool_miss(co, s->pool_hits, s->pool_misses);
     }
-    return co;
-}
 
-#ifdef CONFIG_VALGRIND_H
-#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
-/* Work around an unused variable in the valgrind.h macro... */
-#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
-#endif
-static inline void valgrind_stack_deregister(CoroutineUContext *co)
-{
-    VALGRIND_STACK_DEREGISTER(co->valgrind_stack_id);
+    DO_UPCAST(CoroutineUContext, base, co)->owner = s;
+
+    /* Grow the pool to cover the busiest burst seen so far, so the next
+     * one is served from it.
+     */
+    alive = __sync_add_and_fetch(&s->nr_alive, 1) - 1;
+    if (alive > s->pool_max && s->pool_max < POOL_MAX_SIZE) {
+        s->pool_max = MIN(alive, POOL_MAX_SIZE);
+        trace_qemu_coroutine_pool_grow(s->pool_max);
+    }
+    return co;
 }
-#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
-#pragma GCC diagnostic error "-Wunused-but-set-variable"
-#endif
-#endif
 
 void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
+    CoroutineThreadState *s = coroutine_get_thread_state();
+    CoroutineThreadState *owner = co->owner;
 
-    if (pool_size < POOL_MAX_SIZE) {
-        QSLIST_INSERT_HEAD(&pool, &co->base, pool_next);
+    /* A coroutine may end in another thread than the one that made it.
+     * It is accounted against the thread that handed it out, but goes to
+     * the pool of the thread deleting it.
+     */
+    co->owner = NULL;
+    if (__sync_sub_and_fetch(&owner->nr_alive, 1) == 0) {
+        g_free(owner);
+    }
+    if (s->pool_size < s->pool_max) {
+        QSLIST_INSERT_HEAD(&s->pool, &co->base, pool_next);
         co->base.caller = NULL;
-        pool_size++;
+        s->pool_size++;
         return;
     }
 
-#ifdef CONFIG_VALGRIND_H
-    valgrind_stack_deregister(co);
-#endif
-
-    g_free(co->stack);
-    g_free(co);
+    coroutine_free(co);
 }
 
 CoroutineAction qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
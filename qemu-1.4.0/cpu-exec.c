@@ -95,12 +95,14 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
+    h = tb_phys_hash_func(phys_pc, pc, flags);
     ptb1 = &tb_phys_hash[h];
+    tb_phys_hash_lookups++;
     for(;;) {
         tb = *ptb1;
         if (!tb)
             goto not_found;
+        tb_phys_hash_probes++;
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
@@ -123,6 +125,9 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
  not_found:
    /* if no translated code available, then translate it now */
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
+    /* it is at the head of its list already, and ptb1 may point into a
+       hash table that tb_gen_code() resized */
+    goto add_jmp_cache;
 
  found:
     /* Move the last found TB to the head of the list */
@@ -131,6 +136,7 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
         tb->phys_hash_next = tb_phys_hash[h];
         tb_phys_hash[h] = tb;
     }
+ add_jmp_cache:
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -150,10 +156,31 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
         tb = tb_find_slow(env, pc, cs_base, flags);
+    } else {
+        env->tb_jmp_cache_hits++;
     }
     return tb;
 }
 
+/* Look the TB up in the CPU's own jump cache only, NULL on a miss.  The
+   cache is only written by other threads to clear entries, so this is
+   safe without tb_lock.  */
+static inline TranslationBlock *tb_find_cached(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return NULL;
+    }
+    env->tb_jmp_cache_hits++;
+    return tb;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -563,29 +590,36 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
-                tb = tb_find_fast(env);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tb_invalidated_flag = 0;
+                /* Only a jump cache miss or a jump to patch needs
+                   tb_lock; guest threads coming back here through
+                   indirect branches then do not contend.  */
+                tb = next_tb == 0 ? tb_find_cached(env) : NULL;
+                if (!tb) {
+                    spin_lock(&tb_lock);
+                    tb = tb_find_fast(env);
+                    /* Note: we do it here to avoid a gcc bug on Mac OS X when
+                       doing it in tb_find_slow */
+                    if (tb_invalidated_flag) {
+                        /* as some TB could have been invalidated because
+                           of memory exceptions while generating the code, we
+                           must recompute the hash index here */
+                        next_tb = 0;
+                        tb_invalidated_flag = 0;
+                    }
+                    /* see if we can patch the calling TB. When the TB
+                       spans two pages, we cannot safely do a direct
+                       jump. */
+                    if (next_tb != 0 && tb->page_addr[1] == -1) {
+                        tb_add_jump((TranslationBlock *)(next_tb & ~3),
+                                    next_tb & 3, tb);
+                    }
+                    spin_unlock(&tb_lock);
                 }
 #ifdef CONFIG_DEBUG_EXEC
                 qemu_log_mask(CPU_LOG_EXEC, "Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc,
                              lookup_symbol(tb->pc));
 #endif
-                /* see if we can patch the calling TB. When the TB
-                   spans two pages, we cannot safely do a direct
-                   jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
-                }
-                spin_unlock(&tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -619,6 +619,17 @@ static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
 
+/* Whether this thread holds qemu_global_mutex.  Set by whoever takes it,
+ * be it through qemu_mutex_lock_iothread() or directly as the vcpu threads
+ * do on startup.  Waiting on a condition variable keeps it set: the thread
+ * holds the mutex again by the time it can look. */
+static DEFINE_TLS(bool, iothread_locked);
+
+bool qemu_mutex_iothread_locked(void)
+{
+    return tls_var(iothread_locked);
+}
+
 static QemuThread io_thread;
 
 static QemuThread *tcg_cpu_thread;
@@ -653,6 +664,7 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 
     wi.func = func;
     wi.data = data;
+    wi.free = false;
     if (cpu->queued_work_first == NULL) {
         cpu->queued_work_first = &wi;
     } else {
@@ -671,6 +683,31 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     }
 }
 
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(cpu)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(cpu);
+}
+
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
@@ -682,7 +719,11 @@ static void flush_queued_work(CPUState *cpu)
     while ((wi = cpu->queued_work_first)) {
         cpu->queued_work_first = wi->next;
         wi->func(wi->data);
-        wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        } else {
+            wi->done = true;
+        }
     }
     cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
@@ -738,6 +779,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     int r;
 
     qemu_mutex_lock(&qemu_global_mutex);
+    tls_var(iothread_locked) = true;
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     cpu_single_env = env;
@@ -822,6 +864,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     /* signal CPU creation */
     qemu_mutex_lock(&qemu_global_mutex);
+    tls_var(iothread_locked) = true;
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         cpu = ENV_GET_CPU(env);
         cpu->thread_id = qemu_get_thread_id();
@@ -916,10 +959,12 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
@@ -938,6 +983,85 @@ static int all_vcpus_paused(void)
     return 1;
 }
 
+/* CPU throttling: every vCPU is made to sleep for a share of each time
+ * slice.  The slice grows with the sleep so that the guest still runs for
+ * CPU_THROTTLE_TIMESLICE_NS between two sleeps.
+ */
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static unsigned int throttle_percentage;
+
+static void cpu_throttle_thread(void *opaque)
+{
+    double pct;
+    long sleeptime_ns;
+
+    /* the throttle may have been stopped since this was queued */
+    if (!throttle_percentage) {
+        return;
+    }
+
+    pct = (double)throttle_percentage / 100;
+    sleeptime_ns = (long)(pct / (1 - pct) * CPU_THROTTLE_TIMESLICE_NS);
+
+    qemu_mutex_unlock_iothread();
+    g_usleep(sleeptime_ns / 1000);
+    qemu_mutex_lock_iothread();
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+    double pct;
+
+    if (!throttle_percentage) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        async_run_on_cpu(ENV_GET_CPU(env), cpu_throttle_thread, NULL);
+    }
+
+    pct = (double)throttle_percentage / 100;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    bool was_active = throttle_percentage != 0;
+
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    throttle_percentage = new_throttle_pct;
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+    if (!was_active) {
+        qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                       CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+}
+
+bool cpu_throttle_active(void)
+{
+    return throttle_percentage != 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 void pause_all_vcpus(void)
 {
     CPUArchState *penv = first_cpu;
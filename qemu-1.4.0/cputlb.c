@@ -70,9 +70,18 @@ void tlb_flush(CPUArchState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
+    env->vtlb_index = 0;
+    env->tlb_nb_large = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
     tlb_flush_count++;
@@ -90,6 +99,56 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
+static inline bool tlb_addr_in(target_ulong tlb_addr, target_ulong base,
+                               target_ulong mask)
+{
+    return !(tlb_addr & TLB_INVALID_MASK) && (tlb_addr & mask) == base;
+}
+
+static inline void tlb_flush_entry_range(CPUTLBEntry *tlb_entry,
+                                         target_ulong base, target_ulong mask)
+{
+    if (tlb_addr_in(tlb_entry->addr_read, base, mask) ||
+        tlb_addr_in(tlb_entry->addr_write, base, mask) ||
+        tlb_addr_in(tlb_entry->addr_code, base, mask)) {
+        *tlb_entry = s_cputlb_empty_entry;
+    }
+}
+
+/* Flush the large pages that contain addr.  The entries they cover may
+   sit at any index, so the whole TLB is scanned, but entries of other
+   pages stay. */
+static void tlb_flush_large_pages(CPUArchState *env, target_ulong addr)
+{
+    CPUTLBLargePage *lp;
+    int i, j, mmu_idx;
+
+    for (i = 0; i < env->tlb_nb_large; ) {
+        lp = &env->tlb_large[i];
+        if ((addr & lp->mask) != lp->addr) {
+            i++;
+            continue;
+        }
+#if defined(DEBUG_TLB)
+        printf("tlb_flush_page: large page " TARGET_FMT_lx "/" TARGET_FMT_lx
+               "\n", lp->addr, lp->mask);
+#endif
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            for (j = 0; j < CPU_TLB_SIZE; j++) {
+                tlb_flush_entry_range(&env->tlb_table[mmu_idx][j],
+                                      lp->addr, lp->mask);
+            }
+            for (j = 0; j < CPU_VTLB_SIZE; j++) {
+                tlb_flush_entry_range(&env->tlb_v_table[mmu_idx][j],
+                                      lp->addr, lp->mask);
+            }
+        }
+        /* a large page spans more jump cache chunks than there are */
+        memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+        *lp = env->tlb_large[--env->tlb_nb_large];
+    }
+}
+
 void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
     int i;
@@ -112,10 +171,17 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
        links while we are modifying them */
     env->current_tb = NULL;
 
+    tlb_flush_large_pages(env, addr);
+
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
     }
 
     tb_flush_jmp_cache(env, addr);
@@ -185,6 +251,10 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -206,16 +276,37 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
     }
 }
 
-/* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
+/* Our TLB entries only map TARGET_PAGE_SIZE, so remember the large pages
+   they come from and flush all of their entries if one is invalidated.
+   Once there are too many to keep apart, remember the area they cover
+   and trigger a full TLB flush if something in it is invalidated.  */
 static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
                                target_ulong size)
 {
     target_ulong mask = ~(size - 1);
+    int i;
+
+    for (i = 0; i < env->tlb_nb_large; i++) {
+        if (env->tlb_large[i].mask == mask &&
+            env->tlb_large[i].addr == (vaddr & mask)) {
+            return;
+        }
+    }
+    if (env->tlb_nb_large < CPU_TLB_LARGE_MAX) {
+        env->tlb_large[env->tlb_nb_large].addr = vaddr & mask;
+        env->tlb_large[env->tlb_nb_large].mask = mask;
+        env->tlb_nb_large++;
+        return;
+    }
 
     if (env->tlb_flush_addr == (target_ulong)-1) {
         env->tlb_flush_addr = vaddr & mask;
@@ -233,6 +324,51 @@ static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
     env->tlb_flush_mask = mask;
 }
 
+static inline bool tlb_entry_is_empty(CPUTLBEntry *te)
+{
+    return (te->addr_read & te->addr_write & te->addr_code &
+            TLB_INVALID_MASK) != 0;
+}
+
+static inline bool tlb_entry_has_page(CPUTLBEntry *te, target_ulong vaddr)
+{
+    return tlb_addr_in(te->addr_read, vaddr & TARGET_PAGE_MASK,
+                       TARGET_PAGE_MASK) ||
+           tlb_addr_in(te->addr_write, vaddr & TARGET_PAGE_MASK,
+                       TARGET_PAGE_MASK) ||
+           tlb_addr_in(te->addr_code, vaddr & TARGET_PAGE_MASK,
+                       TARGET_PAGE_MASK);
+}
+
+/* Look for addr in the victim TLB after it missed in tlb_table.  On a hit
+   the victim entry is swapped with the one at index, so the caller can
+   simply retry.  access_type is that of tlb_fill(). */
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    int access_type, target_ulong addr)
+{
+    CPUTLBEntry *tv, tmp;
+    target_ulong tlb_addr;
+    hwaddr tmpio;
+    int vidx;
+
+    addr &= TARGET_PAGE_MASK;
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        tv = &env->tlb_v_table[mmu_idx][vidx];
+        tlb_addr = access_type == 2 ? tv->addr_code :
+                   access_type == 1 ? tv->addr_write : tv->addr_read;
+        if ((tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == addr) {
+            tmp = env->tlb_table[mmu_idx][index];
+            env->tlb_table[mmu_idx][index] = *tv;
+            *tv = tmp;
+            tmpio = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = tmpio;
+            return true;
+        }
+    }
+    return false;
+}
+
 /* Add a new TLB entry. At most one entry for a given virtual address
    is permitted. Only a single TARGET_PAGE_SIZE region is mapped, the
    supplied size is only used by tlb_flush_page.  */
@@ -247,6 +383,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     uintptr_t addend;
     CPUTLBEntry *te;
     hwaddr iotlb;
+    int vidx;
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
@@ -278,8 +415,21 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* Keep the entry being replaced in the victim TLB, unless it is an
+       older copy of this very page, which must not survive anywhere */
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][vidx],
+                        vaddr & TARGET_PAGE_MASK);
+    }
+    if (!tlb_entry_is_empty(te) && !tlb_entry_has_page(te, vaddr)) {
+        vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -19,6 +19,14 @@
 
 #include "disas/bfd.h"
 #include "tcg/tcg.h"
+#include "tcg/tci/tci-fused.h"
+
+static const char *const tci_fused_names[] = {
+#define FUSED(first, second) \
+    [INDEX_op_tci_##first##_##second - NB_OPS] = #first "+" #second,
+    TCI_FUSED_OPS(FUSED)
+#undef FUSED
+};
 
 /* Disassemble TCI bytecode. */
 int print_insn_tci(bfd_vma addr, disassemble_info *info)
@@ -26,7 +34,7 @@ int print_insn_tci(bfd_vma addr, disassemble_info *info)
     int length;
     uint8_t byte;
     int status;
-    TCGOpcode op;
+    int op;
 
     status = info->read_memory_func(addr, &byte, 1, info);
     if (status != 0) {
@@ -43,7 +51,9 @@ int print_insn_tci(bfd_vma addr, disassemble_info *info)
     }
     length = byte;
 
-    if (op >= tcg_op_defs_max) {
+    if (op >= NB_OPS && op < TCI_NB_OPS) {
+        info->fprintf_func(info->stream, "%s", tci_fused_names[op - NB_OPS]);
+    } else if (op >= tcg_op_defs_max) {
         info->fprintf_func(info->stream, "illegal opcode %d", op);
     } else {
         const TCGOpDef *def = &tcg_op_defs[op];
@@ -24,6 +24,16 @@
 #include "qapi/error.h"
 #include "qmp-commands.h"
 #include "exec/gdbstub.h"
+#include "qemu/thread.h"
+#include "qapi/qmp/qjson.h"
+#include "sysemu/arch_init.h"
+#include <zlib.h>
+#ifdef CONFIG_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef CONFIG_SNAPPY
+#include <snappy-c.h>
+#endif
 
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
 {
@@ -58,7 +68,39 @@ static uint64_t cpu_convert_to_target64(uint64_t val, int endian)
     return val;
 }
 
-typedef struct DumpState {
+/* A RAM block as seen by the kdump writer */
+typedef struct DumpRange {
+    ram_addr_t offset;
+    ram_addr_t length;
+    uint8_t *host;
+} DumpRange;
+
+/* A run of pages compressed by one worker */
+#define DUMP_BATCH_PAGES    256
+
+typedef struct DumpBatch {
+    bool done;
+    int nr_pages;
+    uint8_t *host[DUMP_BATCH_PAGES];
+    uint32_t size[DUMP_BATCH_PAGES];    /* 0 for pages of zeroes */
+    uint32_t flags[DUMP_BATCH_PAGES];
+    uint8_t *buf;                       /* page data back to back */
+    size_t buf_len;
+} DumpBatch;
+
+typedef struct DumpState DumpState;
+
+typedef struct DumpWorker {
+    DumpState *s;
+    QemuThread thread;
+    uint8_t *scratch;
+    size_t scratch_size;
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem;
+#endif
+} DumpWorker;
+
+struct DumpState {
     ArchDumpInfo dump_info;
     MemoryMappingList list;
     uint16_t phdr_num;
@@ -75,7 +117,42 @@ typedef struct DumpState {
     int64_t begin;
     int64_t length;
     Error **errp;
-} DumpState;
+
+    DumpGuestMemoryFormat format;
+    int nr_cpus;
+    uint32_t ram_version;
+
+    /* detached dumps */
+    QemuThread thread;
+    QEMUBH *bh;
+    const char *error;
+
+    /* kdump-compressed format */
+    uint32_t flag_compress;
+    uint8_t *note_buf;
+    size_t note_buf_offset;
+    DumpRange *ranges;
+    int nr_ranges;
+    uint64_t max_mapnr;
+    uint64_t num_dumpable;
+    size_t len_dump_bitmap;
+    off_t offset_dump_bitmap;
+    off_t offset_page;
+
+    QemuMutex batch_lock;
+    QemuCond batch_cond;
+    QemuCond done_cond;
+    DumpBatch *batches;
+    int nr_batches;
+    uint64_t batches_filled;
+    uint64_t batches_taken;
+    bool quit;
+    DumpWorker *workers;
+    int nr_workers;
+};
+
+/* A detached dump still writing memory */
+static DumpState *dump_detached;
 
 static int dump_cleanup(DumpState *s)
 {
@@ -84,8 +161,12 @@ static int dump_cleanup(DumpState *s)
     memory_mapping_list_free(&s->list);
     if (s->fd != -1) {
         close(s->fd);
+        s->fd = -1;
     }
+    g_free(s->ranges);
+    s->ranges = NULL;
     if (s->resume) {
+        s->resume = false;
         vm_start();
     }
 
@@ -94,6 +175,9 @@ static int dump_cleanup(DumpState *s)
 
 static void dump_error(DumpState *s, const char *reason)
 {
+    if (!s->error) {
+        s->error = reason;
+    }
     dump_cleanup(s);
 }
 
@@ -268,7 +352,7 @@ static int write_elf64_note(DumpState *s)
     return 0;
 }
 
-static int write_elf64_notes(DumpState *s)
+static int write_elf64_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -276,7 +360,7 @@ static int write_elf64_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf64_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf64_note(f, env, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -284,7 +368,7 @@ static int write_elf64_notes(DumpState *s)
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf64_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf64_qemunote(f, env, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -318,7 +402,7 @@ static int write_elf32_note(DumpState *s)
     return 0;
 }
 
-static int write_elf32_notes(DumpState *s)
+static int write_elf32_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -326,7 +410,7 @@ static int write_elf32_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf32_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf32_note(f, env, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -334,7 +418,7 @@ static int write_elf32_notes(DumpState *s)
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf32_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf32_qemunote(f, env, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -553,7 +637,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf64_notes(s) < 0) {
+        if (write_elf64_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
 
@@ -576,7 +660,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf32_notes(s) < 0) {
+        if (write_elf32_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
     }
@@ -665,6 +749,722 @@ static int create_vmcore(DumpState *s)
     return 0;
 }
 
+/*
+ * kdump-compressed format, as written by makedumpfile and read by crash.
+ * Offsets are in units of the block size, which is the target page size:
+ *
+ *   -------------------------
+ *   | disk_dump_header      |  block 0
+ *   -------------------------
+ *   | kdump_sub_header      |
+ *   | elf notes             |  sub_hdr_size blocks
+ *   -------------------------
+ *   | 1st bitmap            |  bitmap_blocks / 2 blocks
+ *   -------------------------
+ *   | 2nd bitmap            |  bitmap_blocks / 2 blocks
+ *   -------------------------
+ *   | page descriptors      |  one per page set in the bitmaps
+ *   -------------------------
+ *   | page data             |
+ *   -------------------------
+ *
+ * Both bitmaps mark every page of guest RAM.  Pages of zeroes are not
+ * left out, but all point to a single copy of the zero page that comes
+ * first in the page data.
+ */
+
+#define KDUMP_SIGNATURE             "KDUMP   "
+#define KDUMP_SIG_LEN               (sizeof(KDUMP_SIGNATURE) - 1)
+#define KDUMP_HEADER_VERSION        6
+#define KDUMP_HEADER_BLOCKS         1
+#define KDUMP_DUMP_LEVEL            1
+
+#define DUMP_DH_COMPRESSED_ZLIB     0x1
+#define DUMP_DH_COMPRESSED_LZO      0x2
+#define DUMP_DH_COMPRESSED_SNAPPY   0x4
+
+#define DUMP_MAX_WORKERS            8
+
+typedef struct QEMU_PACKED NewUtsname {
+    char sysname[65];
+    char nodename[65];
+    char release[65];
+    char version[65];
+    char machine[65];
+    char domainname[65];
+} NewUtsname;
+
+/* The timestamp fields include the padding before struct timeval */
+typedef struct QEMU_PACKED DiskDumpHeader32 {
+    char signature[KDUMP_SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    char timestamp[10];
+    uint32_t status;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} DiskDumpHeader32;
+
+typedef struct QEMU_PACKED DiskDumpHeader64 {
+    char signature[KDUMP_SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    char timestamp[22];
+    uint32_t status;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} DiskDumpHeader64;
+
+typedef struct QEMU_PACKED KdumpSubHeader32 {
+    uint32_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint32_t start_pfn;
+    uint32_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint32_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint32_t note_size;
+    uint64_t offset_eraseinfo;
+    uint32_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} KdumpSubHeader32;
+
+typedef struct QEMU_PACKED KdumpSubHeader64 {
+    uint64_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint64_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint64_t note_size;
+    uint64_t offset_eraseinfo;
+    uint64_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} KdumpSubHeader64;
+
+typedef struct QEMU_PACKED PageDescriptor {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint64_t page_flags;
+} PageDescriptor;
+
+static int fd_pwrite_vmcore(DumpState *s, const void *buf, size_t size,
+                            off_t offset)
+{
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    while (size) {
+        ret = pwrite(s->fd, p, size, offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += ret;
+        size -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+static int buf_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (s->note_buf_offset + size > s->note_size) {
+        return -1;
+    }
+    memcpy(s->note_buf + s->note_buf_offset, buf, size);
+    s->note_buf_offset += size;
+
+    return 0;
+}
+
+static const char *kdump_machine_name(DumpState *s)
+{
+    switch (s->dump_info.d_machine) {
+    case EM_X86_64:
+        return "x86_64";
+    case EM_386:
+        return "i686";
+    default:
+        return "";
+    }
+}
+
+static int write_kdump_header(DumpState *s)
+{
+    int endian = s->dump_info.d_endian;
+    size_t block_size = TARGET_PAGE_SIZE;
+    uint32_t sub_hdr_size, bitmap_blocks;
+    uint64_t offset_note;
+    uint8_t *buf;
+    size_t size;
+    int ret;
+
+    bitmap_blocks = DIV_ROUND_UP(s->len_dump_bitmap, block_size) * 2;
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        DiskDumpHeader64 *dh;
+        KdumpSubHeader64 *kh;
+
+        size = sizeof(KdumpSubHeader64);
+        sub_hdr_size = DIV_ROUND_UP(size + s->note_size, block_size);
+        buf = g_malloc0((KDUMP_HEADER_BLOCKS + sub_hdr_size) * block_size);
+
+        dh = (DiskDumpHeader64 *)buf;
+        memcpy(dh->signature, KDUMP_SIGNATURE, KDUMP_SIG_LEN);
+        dh->header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION,
+                                                     endian);
+        pstrcpy(dh->utsname.machine, sizeof(dh->utsname.machine),
+                kdump_machine_name(s));
+        dh->status = cpu_convert_to_target32(s->flag_compress, endian);
+        dh->block_size = cpu_convert_to_target32(block_size, endian);
+        dh->sub_hdr_size = cpu_convert_to_target32(sub_hdr_size, endian);
+        dh->bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+        /* may be truncated, the full value is in max_mapnr_64 */
+        dh->max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT32_MAX),
+                                                endian);
+        dh->nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+        kh = (KdumpSubHeader64 *)(buf + KDUMP_HEADER_BLOCKS * block_size);
+        offset_note = KDUMP_HEADER_BLOCKS * block_size + size;
+        kh->dump_level = cpu_convert_to_target32(KDUMP_DUMP_LEVEL, endian);
+        kh->offset_note = cpu_convert_to_target64(offset_note, endian);
+        kh->note_size = cpu_convert_to_target64(s->note_size, endian);
+        kh->max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    } else {
+        DiskDumpHeader32 *dh;
+        KdumpSubHeader32 *kh;
+
+        size = sizeof(KdumpSubHeader32);
+        sub_hdr_size = DIV_ROUND_UP(size + s->note_size, block_size);
+        buf = g_malloc0((KDUMP_HEADER_BLOCKS + sub_hdr_size) * block_size);
+
+        dh = (DiskDumpHeader32 *)buf;
+        memcpy(dh->signature, KDUMP_SIGNATURE, KDUMP_SIG_LEN);
+        dh->header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION,
+                                                     endian);
+        pstrcpy(dh->utsname.machine, sizeof(dh->utsname.machine),
+                kdump_machine_name(s));
+        dh->status = cpu_convert_to_target32(s->flag_compress, endian);
+        dh->block_size = cpu_convert_to_target32(block_size, endian);
+        dh->sub_hdr_size = cpu_convert_to_target32(sub_hdr_size, endian);
+        dh->bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+        dh->max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT32_MAX),
+                                                endian);
+        dh->nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+        kh = (KdumpSubHeader32 *)(buf + KDUMP_HEADER_BLOCKS * block_size);
+        offset_note = KDUMP_HEADER_BLOCKS * block_size + size;
+        kh->dump_level = cpu_convert_to_target32(KDUMP_DUMP_LEVEL, endian);
+        kh->offset_note = cpu_convert_to_target64(offset_note, endian);
+        kh->note_size = cpu_convert_to_target32(s->note_size, endian);
+        kh->max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    }
+
+    /* the notes follow the sub header */
+    s->note_buf = buf + offset_note;
+    s->note_buf_offset = 0;
+    if (s->dump_info.d_class == ELFCLASS64) {
+        ret = write_elf64_notes(buf_write_note, s);
+    } else {
+        ret = write_elf32_notes(buf_write_note, s);
+    }
+    s->note_buf = NULL;
+    if (ret < 0) {
+        g_free(buf);
+        return -1;
+    }
+
+    s->offset_dump_bitmap = (KDUMP_HEADER_BLOCKS + sub_hdr_size) * block_size;
+    s->offset_page = s->offset_dump_bitmap + bitmap_blocks * block_size;
+
+    ret = fd_pwrite_vmcore(s, buf, s->offset_dump_bitmap, 0);
+    g_free(buf);
+    if (ret < 0) {
+        dump_error(s, "failed to write the kdump header");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_kdump_bitmap(DumpState *s)
+{
+    size_t len = DIV_ROUND_UP(s->len_dump_bitmap, TARGET_PAGE_SIZE) *
+                 TARGET_PAGE_SIZE;
+    uint8_t *bitmap = g_malloc0(len);
+    uint64_t pfn, last;
+    int i, ret;
+
+    for (i = 0; i < s->nr_ranges; i++) {
+        pfn = s->ranges[i].offset >> TARGET_PAGE_BITS;
+        last = pfn + (s->ranges[i].length >> TARGET_PAGE_BITS);
+        for (; pfn < last; pfn++) {
+            bitmap[pfn >> 3] |= 1 << (pfn & 7);
+        }
+    }
+
+    /* nothing is filtered, so both bitmaps are the same */
+    ret = fd_pwrite_vmcore(s, bitmap, len, s->offset_dump_bitmap);
+    if (ret == 0) {
+        ret = fd_pwrite_vmcore(s, bitmap, len, s->offset_dump_bitmap + len);
+    }
+    g_free(bitmap);
+    if (ret < 0) {
+        dump_error(s, "failed to write the kdump bitmaps");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns the size of the page as stored, 0 for a page of zeroes */
+static uint32_t kdump_compress_page(DumpWorker *w, uint8_t *page,
+                                    uint8_t *out, uint32_t *flags)
+{
+    DumpState *s = w->s;
+
+    if (is_dup_page(page) && page[0] == 0) {
+        *flags = 0;
+        return 0;
+    }
+
+    switch (s->format) {
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB: {
+        uLongf len = w->scratch_size;
+
+        if (compress2(w->scratch, &len, page, TARGET_PAGE_SIZE,
+                      Z_BEST_SPEED) == Z_OK && len < TARGET_PAGE_SIZE) {
+            memcpy(out, w->scratch, len);
+            *flags = DUMP_DH_COMPRESSED_ZLIB;
+            return len;
+        }
+        break;
+    }
+#ifdef CONFIG_LZO
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO: {
+        lzo_uint len = w->scratch_size;
+
+        if (lzo1x_1_compress(page, TARGET_PAGE_SIZE, w->scratch, &len,
+                             w->wrkmem) == LZO_E_OK &&
+            len < TARGET_PAGE_SIZE) {
+            memcpy(out, w->scratch, len);
+            *flags = DUMP_DH_COMPRESSED_LZO;
+            return len;
+        }
+        break;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY: {
+        size_t len = w->scratch_size;
+
+        if (snappy_compress((char *)page, TARGET_PAGE_SIZE,
+                            (char *)w->scratch, &len) == SNAPPY_OK &&
+            len < TARGET_PAGE_SIZE) {
+            memcpy(out, w->scratch, len);
+            *flags = DUMP_DH_COMPRESSED_SNAPPY;
+            return len;
+        }
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    /* did not compress, store it as is */
+    memcpy(out, page, TARGET_PAGE_SIZE);
+    *flags = 0;
+    return TARGET_PAGE_SIZE;
+}
+
+static void *kdump_worker(void *opaque)
+{
+    DumpWorker *w = opaque;
+    DumpState *s = w->s;
+    DumpBatch *b;
+    int i;
+
+    qemu_mutex_lock(&s->batch_lock);
+    for (;;) {
+        while (!s->quit && s->batches_taken == s->batches_filled) {
+            qemu_cond_wait(&s->batch_cond, &s->batch_lock);
+        }
+        if (s->quit) {
+            break;
+        }
+        b = &s->batches[s->batches_taken++ % s->nr_batches];
+        qemu_mutex_unlock(&s->batch_lock);
+
+        b->buf_len = 0;
+        for (i = 0; i < b->nr_pages; i++) {
+            b->size[i] = kdump_compress_page(w, b->host[i],
+                                             b->buf + b->buf_len,
+                                             &b->flags[i]);
+            b->buf_len += b->size[i];
+        }
+
+        qemu_mutex_lock(&s->batch_lock);
+        b->done = true;
+        qemu_cond_broadcast(&s->done_cond);
+    }
+    qemu_mutex_unlock(&s->batch_lock);
+
+    return NULL;
+}
+
+static void kdump_start_workers(DumpState *s)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    DumpWorker *w;
+    int i;
+
+    s->nr_workers = MAX(1, MIN(ncpus, DUMP_MAX_WORKERS));
+    s->nr_batches = s->nr_workers * 2;
+    s->batches = g_new0(DumpBatch, s->nr_batches);
+    for (i = 0; i < s->nr_batches; i++) {
+        s->batches[i].buf = g_malloc(DUMP_BATCH_PAGES * TARGET_PAGE_SIZE);
+    }
+    s->batches_filled = s->batches_taken = 0;
+    s->quit = false;
+    qemu_mutex_init(&s->batch_lock);
+    qemu_cond_init(&s->batch_cond);
+    qemu_cond_init(&s->done_cond);
+
+    s->workers = g_new0(DumpWorker, s->nr_workers);
+    for (i = 0; i < s->nr_workers; i++) {
+        w = &s->workers[i];
+        w->s = s;
+        switch (s->format) {
+#ifdef CONFIG_LZO
+        case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO:
+            w->scratch_size = TARGET_PAGE_SIZE + TARGET_PAGE_SIZE / 16 + 64 + 3;
+            w->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+            break;
+#endif
+#ifdef CONFIG_SNAPPY
+        case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY:
+            w->scratch_size = snappy_max_compressed_length(TARGET_PAGE_SIZE);
+            break;
+#endif
+        default:
+            w->scratch_size = compressBound(TARGET_PAGE_SIZE);
+            break;
+        }
+        w->scratch = g_malloc(w->scratch_size);
+        qemu_thread_create(&w->thread, kdump_worker, w, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void kdump_stop_workers(DumpState *s)
+{
+    int i;
+
+    qemu_mutex_lock(&s->batch_lock);
+    s->quit = true;
+    qemu_cond_broadcast(&s->batch_cond);
+    qemu_mutex_unlock(&s->batch_lock);
+
+    for (i = 0; i < s->nr_workers; i++) {
+        qemu_thread_join(&s->workers[i].thread);
+        g_free(s->workers[i].scratch);
+#ifdef CONFIG_LZO
+        g_free(s->workers[i].wrkmem);
+#endif
+    }
+    g_free(s->workers);
+    s->workers = NULL;
+
+    for (i = 0; i < s->nr_batches; i++) {
+        g_free(s->batches[i].buf);
+    }
+    g_free(s->batches);
+    s->batches = NULL;
+
+    qemu_cond_destroy(&s->done_cond);
+    qemu_cond_destroy(&s->batch_cond);
+    qemu_mutex_destroy(&s->batch_lock);
+}
+
+/* Collect the next pages in pfn order, false when there are none left */
+static bool kdump_fill_batch(DumpState *s, DumpBatch *b, int *range,
+                             ram_addr_t *offset)
+{
+    b->nr_pages = 0;
+    while (*range < s->nr_ranges && b->nr_pages < DUMP_BATCH_PAGES) {
+        DumpRange *r = &s->ranges[*range];
+
+        if (*offset >= r->length) {
+            (*range)++;
+            *offset = 0;
+            continue;
+        }
+        b->host[b->nr_pages++] = r->host + *offset;
+        *offset += TARGET_PAGE_SIZE;
+    }
+    b->done = false;
+
+    return b->nr_pages > 0;
+}
+
+static int write_kdump_pages(DumpState *s)
+{
+    int endian = s->dump_info.d_endian;
+    size_t descs_per_block = TARGET_PAGE_SIZE / sizeof(PageDescriptor);
+    PageDescriptor *descs = g_new0(PageDescriptor, descs_per_block);
+    PageDescriptor zero_desc;
+    uint8_t *zero_page;
+    off_t offset_desc, offset_data;
+    uint64_t written = 0;
+    size_t nr_descs = 0;
+    ram_addr_t offset = 0;
+    int range = 0;
+    bool more = true;
+    DumpBatch *b;
+    int i, ret = 0;
+
+    offset_desc = s->offset_page;
+    offset_data = offset_desc + sizeof(PageDescriptor) * s->num_dumpable;
+
+    /* every page of zeroes refers to this one */
+    zero_page = g_malloc0(TARGET_PAGE_SIZE);
+    memset(&zero_desc, 0, sizeof(zero_desc));
+    zero_desc.offset = cpu_convert_to_target64(offset_data, endian);
+    zero_desc.size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    ret = fd_pwrite_vmcore(s, zero_page, TARGET_PAGE_SIZE, offset_data);
+    g_free(zero_page);
+    offset_data += TARGET_PAGE_SIZE;
+
+    kdump_start_workers(s);
+
+    while (ret == 0) {
+        /* keep all workers busy */
+        qemu_mutex_lock(&s->batch_lock);
+        while (more && s->batches_filled - written < s->nr_batches) {
+            b = &s->batches[s->batches_filled % s->nr_batches];
+            more = kdump_fill_batch(s, b, &range, &offset);
+            if (more) {
+                s->batches_filled++;
+                qemu_cond_signal(&s->batch_cond);
+            }
+        }
+        if (written == s->batches_filled) {
+            qemu_mutex_unlock(&s->batch_lock);
+            break;
+        }
+
+        /* write out the oldest batch, descriptors and data stay in order */
+        b = &s->batches[written % s->nr_batches];
+        while (!b->done) {
+            qemu_cond_wait(&s->done_cond, &s->batch_lock);
+        }
+        qemu_mutex_unlock(&s->batch_lock);
+
+        ret = fd_pwrite_vmcore(s, b->buf, b->buf_len, offset_data);
+        for (i = 0; i < b->nr_pages && ret == 0; i++) {
+            PageDescriptor *pd = &descs[nr_descs++];
+
+            if (b->size[i]) {
+                pd->offset = cpu_convert_to_target64(offset_data, endian);
+                pd->size = cpu_convert_to_target32(b->size[i], endian);
+                pd->flags = cpu_convert_to_target32(b->flags[i], endian);
+                pd->page_flags = 0;
+                offset_data += b->size[i];
+            } else {
+                *pd = zero_desc;
+            }
+            if (nr_descs == descs_per_block) {
+                ret = fd_pwrite_vmcore(s, descs,
+                                       nr_descs * sizeof(PageDescriptor),
+                                       offset_desc);
+                offset_desc += nr_descs * sizeof(PageDescriptor);
+                nr_descs = 0;
+            }
+        }
+        written++;
+    }
+
+    if (ret == 0 && nr_descs) {
+        ret = fd_pwrite_vmcore(s, descs, nr_descs * sizeof(PageDescriptor),
+                               offset_desc);
+    }
+
+    kdump_stop_workers(s);
+    g_free(descs);
+    if (ret < 0) {
+        dump_error(s, "failed to write guest memory");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int kdump_range_compare(const void *a, const void *b)
+{
+    const DumpRange *ra = a, *rb = b;
+
+    return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+static int kdump_init(DumpState *s, Error **errp)
+{
+    RAMBlock *block;
+    int i;
+
+    switch (s->format) {
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB:
+        s->flag_compress = DUMP_DH_COMPRESSED_ZLIB;
+        break;
+#ifdef CONFIG_LZO
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO:
+        if (lzo_init() != LZO_E_OK) {
+            error_set(errp, QERR_FEATURE_DISABLED, "lzo");
+            return -1;
+        }
+        s->flag_compress = DUMP_DH_COMPRESSED_LZO;
+        break;
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY:
+        s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
+        break;
+#endif
+    default:
+        error_set(errp, QERR_FEATURE_DISABLED,
+                  DumpGuestMemoryFormat_lookup[s->format]);
+        return -1;
+    }
+
+    /* descriptors and bitmaps are written at their place */
+    if (lseek(s->fd, 0, SEEK_CUR) == (off_t)-1) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "protocol",
+                  "a seekable file for the kdump-compressed format");
+        return -1;
+    }
+
+    /* the pfn of a page is its RAM offset, as in the ELF PT_LOADs */
+    s->nr_ranges = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        s->nr_ranges++;
+    }
+    s->ranges = g_new0(DumpRange, s->nr_ranges);
+    i = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        s->ranges[i].offset = block->offset;
+        s->ranges[i].length = block->length;
+        s->ranges[i].host = block->host;
+        i++;
+    }
+    qsort(s->ranges, s->nr_ranges, sizeof(DumpRange), kdump_range_compare);
+
+    s->max_mapnr = 0;
+    s->num_dumpable = 0;
+    for (i = 0; i < s->nr_ranges; i++) {
+        uint64_t end = (s->ranges[i].offset + s->ranges[i].length) >>
+                       TARGET_PAGE_BITS;
+
+        s->max_mapnr = MAX(s->max_mapnr, end);
+        s->num_dumpable += s->ranges[i].length >> TARGET_PAGE_BITS;
+    }
+    s->len_dump_bitmap = DIV_ROUND_UP(s->max_mapnr, CHAR_BIT);
+
+    return 0;
+}
+
+/* write everything but the memory */
+static int kdump_begin(DumpState *s)
+{
+    if (write_kdump_header(s) < 0) {
+        return -1;
+    }
+
+    return write_kdump_bitmap(s);
+}
+
+static int create_kdump_vmcore(DumpState *s)
+{
+    if (kdump_begin(s) < 0) {
+        return -1;
+    }
+    if (write_kdump_pages(s) < 0) {
+        return -1;
+    }
+
+    dump_completed(s);
+    return 0;
+}
+
+static void dump_bh(void *opaque)
+{
+    DumpState *s = opaque;
+    QObject *data;
+
+    qemu_thread_join(&s->thread);
+    qemu_bh_delete(s->bh);
+
+    if (s->error) {
+        data = qobject_from_jsonf("{ 'error': %s }", s->error);
+    } else {
+        data = qobject_from_jsonf("{ }");
+    }
+    monitor_protocol_event(QEVENT_DUMP_COMPLETED, data);
+    qobject_decref(data);
+
+    dump_detached = NULL;
+    g_free(s);
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    /* Keep RAM blocks from going away under the dump; a block added or
+     * removed since the headers were written would make them wrong.
+     */
+    qemu_mutex_lock_ramlist();
+    if (ram_list.version != s->ram_version) {
+        dump_error(s, "guest memory layout changed");
+    } else if (s->format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        if (dump_iterate(s) < 0 && !s->error) {
+            s->error = "failed to write guest memory";
+        }
+    } else if (write_kdump_pages(s) == 0) {
+        dump_completed(s);
+    }
+    qemu_mutex_unlock_ramlist();
+
+    qemu_bh_schedule(s->bh);
+    return NULL;
+}
+
 static ram_addr_t get_start_block(DumpState *s)
 {
     RAMBlock *block;
@@ -694,7 +1494,8 @@ static ram_addr_t get_start_block(DumpState *s)
 }
 
 static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
-                     int64_t begin, int64_t length, Error **errp)
+                     int64_t begin, int64_t length,
+                     DumpGuestMemoryFormat format, Error **errp)
 {
     CPUArchState *env;
     int nr_cpus;
@@ -709,6 +1510,8 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
 
     s->errp = errp;
     s->fd = fd;
+    s->format = format;
+    s->ram_version = ram_list.version;
     s->has_filter = has_filter;
     s->begin = begin;
     s->length = length;
@@ -732,6 +1535,8 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         nr_cpus++;
     }
 
+    s->nr_cpus = nr_cpus;
+
     ret = cpu_get_dump_info(&s->dump_info);
     if (ret < 0) {
         error_set(errp, QERR_UNSUPPORTED);
@@ -745,6 +1550,13 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         goto cleanup;
     }
 
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        if (kdump_init(s, errp) < 0) {
+            goto cleanup;
+        }
+        return 0;
+    }
+
     /* get memory mapping */
     memory_mapping_list_init(&s->list);
     if (paging) {
@@ -802,6 +1614,7 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
     return 0;
 
 cleanup:
+    g_free(s->ranges);
     if (s->resume) {
         vm_start();
     }
@@ -811,13 +1624,25 @@ cleanup:
 
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
-                           Error **errp)
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_detach, bool detach, Error **errp)
 {
     const char *p;
     int fd = -1;
     DumpState *s;
     int ret;
 
+    if (!has_format) {
+        format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+    }
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF && (paging || has_begin)) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+    if (dump_detached) {
+        error_setg(errp, "a detached dump is still in progress");
+        return;
+    }
     if (has_begin && !has_length) {
         error_set(errp, QERR_MISSING_PARAMETER, "length");
         return;
@@ -849,15 +1674,46 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc(sizeof(DumpState));
+    s = g_malloc0(sizeof(DumpState));
 
-    ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
+    ret = dump_init(s, fd, paging, has_begin, begin, length, format, errp);
     if (ret < 0) {
+        close(fd);
         g_free(s);
         return;
     }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
+    if (has_detach && detach) {
+        /* Only the headers and the CPU state are written with the guest
+         * stopped; memory follows from a thread.
+         */
+        if (format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+            ret = dump_begin(s);
+        } else {
+            ret = kdump_begin(s);
+        }
+        if (ret < 0) {
+            error_set(errp, QERR_IO_ERROR);
+            g_free(s);
+            return;
+        }
+        if (s->resume) {
+            s->resume = false;
+            vm_start();
+        }
+        s->errp = NULL;
+        s->bh = qemu_bh_new(dump_bh, s);
+        dump_detached = s;
+        qemu_thread_create(&s->thread, dump_thread, s, QEMU_THREAD_JOINABLE);
+        return;
+    }
+
+    if (format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        ret = create_vmcore(s);
+    } else {
+        ret = create_kdump_vmcore(s);
+    }
+    if (ret < 0 && !error_is_set(s->errp)) {
         error_set(errp, QERR_IO_ERROR);
     }
 
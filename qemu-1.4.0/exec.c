@@ -35,12 +35,14 @@
 #include "qemu/timer.h"
 #include "qemu/config-file.h"
 #include "exec/memory.h"
+#include "qemu/bitops.h"
 #include "sysemu/dma.h"
 #include "exec/address-spaces.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #else /* !CONFIG_USER_ONLY */
 #include "sysemu/xen-mapcache.h"
+#include "sysemu/sysemu.h"
 #include "trace.h"
 #endif
 #include "exec/cpu-all.h"
@@ -93,7 +95,8 @@ static uint16_t phys_section_watch;
 static PhysPageEntry (*phys_map_nodes)[L2_SIZE];
 static unsigned phys_map_nodes_nb, phys_map_nodes_nb_alloc;
 
-#define PHYS_MAP_NODE_NIL (((uint16_t)~0) >> 1)
+#define PHYS_MAP_NODE_NIL (((uint32_t)~0) >> 6)
+#define PHYS_SECTION_NONE ((uint16_t)~0)
 
 static void io_mem_init(void);
 static void memory_map_init(void);
@@ -116,16 +119,16 @@ static void phys_map_node_reserve(unsigned nodes)
     }
 }
 
-static uint16_t phys_map_node_alloc(void)
+static uint32_t phys_map_node_alloc(void)
 {
     unsigned i;
-    uint16_t ret;
+    uint32_t ret;
 
     ret = phys_map_nodes_nb++;
     assert(ret != PHYS_MAP_NODE_NIL);
     assert(ret != phys_map_nodes_nb_alloc);
     for (i = 0; i < L2_SIZE; ++i) {
-        phys_map_nodes[ret][i].is_leaf = 0;
+        phys_map_nodes[ret][i].skip = 1;
         phys_map_nodes[ret][i].ptr = PHYS_MAP_NODE_NIL;
     }
     return ret;
@@ -145,12 +148,12 @@ static void phys_page_set_level(PhysPageEntry *lp, hwaddr *index,
     int i;
     hwaddr step = (hwaddr)1 << (level * L2_BITS);
 
-    if (!lp->is_leaf && lp->ptr == PHYS_MAP_NODE_NIL) {
+    if (lp->skip && lp->ptr == PHYS_MAP_NODE_NIL) {
         lp->ptr = phys_map_node_alloc();
         p = phys_map_nodes[lp->ptr];
         if (level == 0) {
             for (i = 0; i < L2_SIZE; i++) {
-                p[i].is_leaf = 1;
+                p[i].skip = 0;
                 p[i].ptr = phys_section_unassigned;
             }
         }
@@ -161,7 +164,7 @@ static void phys_page_set_level(PhysPageEntry *lp, hwaddr *index,
 
     while (*nb && lp < &p[L2_SIZE]) {
         if ((*index & (step - 1)) == 0 && *nb >= step) {
-            lp->is_leaf = true;
+            lp->skip = 0;
             lp->ptr = leaf;
             *index += step;
             *nb -= step;
@@ -179,27 +182,86 @@ static void phys_page_set(AddressSpaceDispatch *d,
     /* Wildly overreserve - it doesn't matter much. */
     phys_map_node_reserve(3 * P_L2_LEVELS);
 
+    d->mru_section = PHYS_SECTION_NONE;
     phys_page_set_level(&d->phys_map, &index, &nb, leaf, P_L2_LEVELS - 1);
 }
 
+/* Once the map is complete, let every entry whose node has a single
+   used slot point straight to what that slot points to.  RAM usually
+   sits in a few large aligned sections, so most lookups then take fewer
+   levels; phys_page_find() checks the section it ends at, since the
+   levels skipped no longer tell unassigned pages apart. */
+static void phys_page_compact(PhysPageEntry *lp)
+{
+    PhysPageEntry *p;
+    unsigned i, valid = 0, valid_ptr = 0;
+
+    if (!lp->skip || lp->ptr == PHYS_MAP_NODE_NIL) {
+        return;
+    }
+
+    p = phys_map_nodes[lp->ptr];
+    for (i = 0; i < L2_SIZE; ++i) {
+        if (p[i].ptr == PHYS_MAP_NODE_NIL) {
+            continue;
+        }
+        valid_ptr = i;
+        valid++;
+        phys_page_compact(&p[i]);
+    }
+
+    if (valid != 1 || !p[valid_ptr].skip ||
+        lp->skip + p[valid_ptr].skip >= (1 << 6)) {
+        return;
+    }
+    lp->skip += p[valid_ptr].skip;
+    lp->ptr = p[valid_ptr].ptr;
+}
+
+static inline bool phys_section_covers(MemoryRegionSection *section,
+                                       hwaddr index)
+{
+    hwaddr first = section->offset_within_address_space >> TARGET_PAGE_BITS;
+
+    return index - first < (section->size >> TARGET_PAGE_BITS);
+}
+
 MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr index)
 {
-    PhysPageEntry lp = d->phys_map;
+    PhysPageEntry lp;
     PhysPageEntry *p;
+    MemoryRegionSection *section;
     int i;
-    uint16_t s_index = phys_section_unassigned;
 
-    for (i = P_L2_LEVELS - 1; i >= 0 && !lp.is_leaf; i--) {
+    if (d->mru_section != PHYS_SECTION_NONE) {
+        section = &phys_sections[d->mru_section];
+        if (phys_section_covers(section, index)) {
+            return section;
+        }
+    }
+
+    lp = d->phys_map;
+    for (i = P_L2_LEVELS; lp.skip && (i -= lp.skip) >= 0;) {
         if (lp.ptr == PHYS_MAP_NODE_NIL) {
             goto not_found;
         }
         p = phys_map_nodes[lp.ptr];
         lp = p[(index >> (i * L2_BITS)) & (L2_SIZE - 1)];
     }
+    if (lp.skip) {
+        goto not_found;
+    }
 
-    s_index = lp.ptr;
+    section = &phys_sections[lp.ptr];
+    if (lp.ptr != phys_section_unassigned &&
+        phys_section_covers(section, index)) {
+        /* The map is only changed by the memory listeners, under the
+           global mutex like every lookup, so this needs no locking */
+        d->mru_section = lp.ptr;
+        return section;
+    }
 not_found:
-    return &phys_sections[s_index];
+    return &phys_sections[phys_section_unassigned];
 }
 
 bool memory_region_is_unassigned(MemoryRegion *mr)
@@ -598,6 +660,181 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 }
 
+/* Copy and clear the dirty flags of a range, eight pages at a time. */
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+    (ram_addr_t start, ram_addr_t length, int dirty_flags)
+{
+    uint64_t mask = (uint8_t)dirty_flags * 0x0101010101010101ULL;
+    ram_addr_t first, nr, i, j;
+    DirtyBitmapSnapshot *snap;
+    uint8_t *flags;
+    uint64_t word;
+
+    start &= TARGET_PAGE_MASK;
+    first = start >> TARGET_PAGE_BITS;
+    nr = (TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS) - first;
+
+    snap = g_malloc0(sizeof(*snap) + BITS_TO_LONGS(nr) * sizeof(unsigned long));
+    snap->start = start;
+    snap->end = start + (nr << TARGET_PAGE_BITS);
+    if (nr == 0) {
+        return snap;
+    }
+
+    flags = ram_list.phys_dirty + first;
+    for (i = 0; i + 8 <= nr; i += 8) {
+        memcpy(&word, flags + i, sizeof(word));
+        if (!(word & mask)) {
+            continue;
+        }
+        for (j = i; j < i + 8; j++) {
+            if (flags[j] & dirty_flags) {
+                set_bit(j, snap->dirty);
+            }
+        }
+        word &= ~mask;
+        memcpy(flags + i, &word, sizeof(word));
+    }
+    for (; i < nr; i++) {
+        if (flags[i] & dirty_flags) {
+            set_bit(i, snap->dirty);
+            flags[i] &= ~dirty_flags;
+        }
+    }
+
+    if (tcg_enabled()) {
+        tlb_reset_dirty_range_all(snap->start, snap->end,
+                                  snap->end - snap->start);
+    }
+    return snap;
+}
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length)
+{
+    unsigned long page, end;
+
+    assert(start >= snap->start);
+    assert(start + length <= snap->end);
+    page = (start - snap->start) >> TARGET_PAGE_BITS;
+    end = (TARGET_PAGE_ALIGN(start + length) - snap->start) >> TARGET_PAGE_BITS;
+
+    return find_next_bit(snap->dirty, end, page) < end;
+}
+
+/* The flag at @bit of the eight page flags in @word, one per bit */
+static inline unsigned int dirty_flags_gather(uint64_t word, int bit)
+{
+    word = (word >> bit) & 0x0101010101010101ULL;
+    return (word * 0x0102040810204080ULL) >> 56;
+}
+
+/* Merge one dirty flag of a range into @bitmap, which is indexed by page
+ * number like ram_list.phys_dirty, and clear the flag.  Whole words of the
+ * bitmap are done at once: the flags of their pages are read eight at a
+ * time and skipped if clean, which is what most of a large guest is.
+ */
+uint64_t cpu_physical_memory_merge_and_clear_dirty(ram_addr_t start,
+                                                   ram_addr_t length,
+                                                   int dirty_flags,
+                                                   unsigned long *bitmap)
+{
+    uint64_t mask = (uint8_t)dirty_flags * 0x0101010101010101ULL;
+    int bit = ffs(dirty_flags) - 1;
+    unsigned long page, end, bits, old;
+    uint64_t raw[BITS_PER_LONG / 8], any;
+    uint8_t *flags = ram_list.phys_dirty;
+    uint64_t count = 0;
+    bool cleared = false;
+    int i;
+
+    start &= TARGET_PAGE_MASK;
+    page = start >> TARGET_PAGE_BITS;
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+
+    while (page < end) {
+        if (page % BITS_PER_LONG || page + BITS_PER_LONG > end) {
+            /* the unaligned ends of the range, a page at a time */
+            if (flags[page] & dirty_flags) {
+                flags[page] &= ~dirty_flags;
+                cleared = true;
+                if (!test_and_set_bit(page, bitmap)) {
+                    count++;
+                }
+            }
+            page++;
+            continue;
+        }
+
+        any = 0;
+        for (i = 0; i < BITS_PER_LONG / 8; i++) {
+            memcpy(&raw[i], flags + page + i * 8, 8);
+            any |= raw[i];
+        }
+        if (any & mask) {
+            bits = 0;
+            for (i = 0; i < BITS_PER_LONG / 8; i++) {
+                bits |= (unsigned long)
+                    dirty_flags_gather(le64_to_cpu(raw[i]), bit) << (i * 8);
+                raw[i] &= ~mask;
+                memcpy(flags + page + i * 8, &raw[i], 8);
+            }
+            old = bitmap[BIT_WORD(page)];
+            bitmap[BIT_WORD(page)] = old | bits;
+            count += ctpop64(bits & ~old);
+            cleared = true;
+        }
+        page += BITS_PER_LONG;
+    }
+
+    if (cleared && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, end << TARGET_PAGE_BITS,
+                                  (end << TARGET_PAGE_BITS) - start);
+    }
+    return count;
+}
+
+/* Mark every page set in @bitmap dirty for all clients.  @bitmap has a
+ * bit per host page from @start, in little-endian longs, as
+ * KVM_GET_DIRTY_LOG returns it.  Runs of dirty pages take one memset, and
+ * clean words, which most of a large guest is, are skipped four at a time.
+ */
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages)
+{
+    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+    unsigned long len = BITS_TO_LONGS(pages);
+    uint8_t *flags = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
+    unsigned long i, c;
+    int j, n;
+
+    for (i = 0; i < len; i++) {
+        if (i + 4 <= len &&
+            !(bitmap[i] | bitmap[i + 1] | bitmap[i + 2] | bitmap[i + 3])) {
+            i += 3;
+            continue;
+        }
+        c = leul_to_cpu(bitmap[i]);
+        while (c) {
+            j = ffsl(c) - 1;
+#if HOST_LONG_BITS == 64
+            n = cto64(c >> j);
+#else
+            n = cto32(c >> j);
+#endif
+            memset(flags + (i * HOST_LONG_BITS + j) * hpratio, 0xff,
+                   n * hpratio);
+            if (j + n == HOST_LONG_BITS) {
+                break;
+            }
+            c &= ~(((1UL << n) - 1) << j);
+        }
+    }
+    xen_modified_memory(start, pages * getpagesize());
+}
+
 static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -687,13 +924,13 @@ static void destroy_l2_mapping(PhysPageEntry *lp, unsigned level)
 
     p = phys_map_nodes[lp->ptr];
     for (i = 0; i < L2_SIZE; ++i) {
-        if (!p[i].is_leaf) {
-            destroy_l2_mapping(&p[i], level - 1);
+        if (p[i].skip) {
+            destroy_l2_mapping(&p[i], level - p[i].skip);
         } else {
             destroy_page_desc(p[i].ptr);
         }
     }
-    lp->is_leaf = 0;
+    lp->skip = 1;
     lp->ptr = PHYS_MAP_NODE_NIL;
 }
 
@@ -799,6 +1036,9 @@ void qemu_flush_coalesced_mmio_buffer(void)
 {
     if (kvm_enabled())
         kvm_flush_coalesced_mmio_buffer();
+    if (xen_enabled()) {
+        xen_flush_coalesced_mmio_buffer();
+    }
 }
 
 void qemu_mutex_lock_ramlist(void)
@@ -844,9 +1084,7 @@ static void *file_ram_alloc(RAMBlock *block,
     char *filename;
     void *area;
     int fd;
-#ifdef MAP_POPULATE
     int flags;
-#endif
     unsigned long hpagesize;
 
     hpagesize = gethugepagesize(path);
@@ -885,16 +1123,13 @@ static void *file_ram_alloc(RAMBlock *block,
     if (ftruncate(fd, memory))
         perror("ftruncate");
 
-#ifdef MAP_POPULATE
-    /* NB: MAP_POPULATE won't exhaustively alloc all phys pages in the case
-     * MAP_PRIVATE is requested.  For mem_prealloc we mmap as MAP_SHARED
-     * to sidestep this quirk.
+    /* NB: touching MAP_PRIVATE pages does not exhaustively alloc all
+     * hugepages of the file.  For mem_prealloc we mmap as MAP_SHARED to
+     * sidestep this quirk; the pages are faulted in by ram_prefault() once
+     * the NUMA policy is in place.
      */
-    flags = mem_prealloc ? MAP_POPULATE | MAP_SHARED : MAP_PRIVATE;
+    flags = mem_prealloc ? MAP_SHARED : MAP_PRIVATE;
     area = mmap(0, memory, PROT_READ | PROT_WRITE, flags, fd, 0);
-#else
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-#endif
     if (area == MAP_FAILED) {
         perror("file_ram_alloc: can't mmap RAM pages");
         close(fd);
@@ -905,6 +1140,121 @@ static void *file_ram_alloc(RAMBlock *block,
 }
 #endif
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_mbind)
+
+#define QEMU_MPOL_BIND 2
+
+/* Bind the guest's main RAM to the host nodes given with -numa hostnode=.
+ * Guest nodes take consecutive ranges of the block in node order, which is
+ * the layout described to the firmware.  Boundaries are rounded to
+ * @pagesize since hugetlbfs mappings can only be bound in whole pages.
+ */
+static void ram_block_bind_numa(RAMBlock *block, size_t pagesize)
+{
+    static bool bound;
+    unsigned long mask[BITS_TO_LONGS(MAX_NODES)];
+    ram_addr_t start, end;
+    int i;
+
+    if (bound || block->length != ram_size) {
+        return;
+    }
+    bound = true;
+
+    for (i = 0, start = 0; i < nb_numa_nodes && start < block->length;
+         i++, start = end) {
+        end = (start + node_mem[i] + pagesize - 1) & ~(pagesize - 1);
+        end = MIN(end, block->length);
+        if (node_host[i] < 0 || end == start) {
+            continue;
+        }
+
+        memset(mask, 0, sizeof(mask));
+        set_bit(node_host[i], mask);
+        if (syscall(__NR_mbind, block->host + start, end - start,
+                    QEMU_MPOL_BIND, mask, MAX_NODES + 1, 0) < 0) {
+            fprintf(stderr, "Warning: cannot bind memory of NUMA node %d "
+                    "to host node %d: %s\n", i, node_host[i],
+                    strerror(errno));
+        }
+    }
+}
+#else
+static void ram_block_bind_numa(RAMBlock *block, size_t pagesize)
+{
+}
+#endif
+
+#ifndef _WIN32
+
+#define RAM_PREFAULT_MAX_THREADS 16
+#define RAM_PREFAULT_MIN_CHUNK   (64 * 1024 * 1024)
+
+typedef struct RAMPrefault {
+    QemuThread thread;
+    uint8_t *start;
+    size_t len;
+    size_t pagesize;
+} RAMPrefault;
+
+static void *ram_prefault_thread(void *opaque)
+{
+    RAMPrefault *p = opaque;
+    size_t off;
+
+    for (off = 0; off < p->len; off += p->pagesize) {
+        volatile uint8_t *b = p->start + off;
+        *b = *b;
+    }
+    return NULL;
+}
+
+/* Fault in every page of a new block for -mem-prealloc.  The time goes into
+ * the kernel's page fault path, which scales with the number of faulting
+ * threads, so large blocks are split across up to one thread per host CPU.
+ * Pages land wherever the block's NUMA policy says, whichever CPU touches
+ * them.
+ */
+static void ram_prefault(void *host, size_t size, size_t pagesize)
+{
+    RAMPrefault p[RAM_PREFAULT_MAX_THREADS];
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t chunk;
+    int i, n;
+
+    n = MIN(MAX(ncpus, 1), RAM_PREFAULT_MAX_THREADS);
+    chunk = (DIV_ROUND_UP(size, n) + pagesize - 1) & ~(pagesize - 1);
+    chunk = MAX(chunk, RAM_PREFAULT_MIN_CHUNK);
+    n = DIV_ROUND_UP(size, chunk);
+
+    for (i = 0; i < n; i++) {
+        p[i].start = (uint8_t *)host + i * chunk;
+        p[i].len = MIN(chunk, size - i * chunk);
+        p[i].pagesize = pagesize;
+        if (n > 1) {
+            qemu_thread_create(&p[i].thread, ram_prefault_thread, &p[i],
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+
+    if (n > 1) {
+        for (i = 0; i < n; i++) {
+            qemu_thread_join(&p[i].thread);
+        }
+    } else if (n == 1) {
+        ram_prefault_thread(&p[0]);
+    }
+}
+#else
+static void ram_prefault(void *host, size_t size, size_t pagesize)
+{
+}
+#endif
+
 static ram_addr_t find_ram_offset(ram_addr_t size)
 {
     RAMBlock *block, *next_block;
@@ -1019,6 +1369,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr)
 {
     RAMBlock *block, *new_block;
+    size_t pagesize = getpagesize();
 
     size = TARGET_PAGE_ALIGN(size);
     new_block = g_malloc0(sizeof(*new_block));
@@ -1034,7 +1385,9 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
         if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
             new_block->host = file_ram_alloc(new_block, size, mem_path);
-            if (!new_block->host) {
+            if (new_block->host) {
+                pagesize = gethugepagesize(mem_path);
+            } else {
                 new_block->host = qemu_vmalloc(size);
                 memory_try_enable_merging(new_block->host, size);
             }
@@ -1081,6 +1434,16 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     qemu_ram_setup_dump(new_block->host, size);
     qemu_madvise(new_block->host, size, QEMU_MADV_HUGEPAGE);
 
+    /* The NUMA policy has to be set before the first touch, and the
+     * hugepage advice too, or prefaulting would populate small pages.
+     */
+    if (new_block->host && !(new_block->flags & RAM_PREALLOC_MASK)) {
+        ram_block_bind_numa(new_block, pagesize);
+        if (mem_prealloc) {
+            ram_prefault(new_block->host, size, pagesize);
+        }
+    }
+
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
 
@@ -1684,6 +2047,14 @@ static void mem_begin(MemoryListener *listener)
 
     destroy_all_mappings(d);
     d->phys_map.ptr = PHYS_MAP_NODE_NIL;
+    d->mru_section = PHYS_SECTION_NONE;
+}
+
+static void mem_commit(MemoryListener *listener)
+{
+    AddressSpaceDispatch *d = container_of(listener, AddressSpaceDispatch, listener);
+
+    phys_page_compact(&d->phys_map);
 }
 
 static void core_begin(MemoryListener *listener)
@@ -1756,9 +2127,11 @@ void address_space_init_dispatch(AddressSpace *as)
 {
     AddressSpaceDispatch *d = g_new(AddressSpaceDispatch, 1);
 
-    d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .is_leaf = 0 };
+    d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
+    d->mru_section = PHYS_SECTION_NONE;
     d->listener = (MemoryListener) {
         .begin = mem_begin,
+        .commit = mem_commit,
         .region_add = mem_add,
         .region_nop = mem_add,
         .priority = 0,
@@ -2011,13 +2384,24 @@ void cpu_physical_memory_write_rom(hwaddr addr,
     }
 }
 
-typedef struct {
+/* Guest memory that is not RAM is mapped through a bounce buffer.  Several
+ * mappings may hold one at once as long as they add up to BOUNCE_POOL_SIZE;
+ * a single mapping gets at most BOUNCE_MAP_MAX of it, so that one device's
+ * large transfer cannot keep the others waiting.
+ */
+#define BOUNCE_POOL_SIZE    (256 * 1024)
+#define BOUNCE_MAP_MAX      (64 * 1024)
+
+typedef struct BounceBuffer {
     void *buffer;
     hwaddr addr;
     hwaddr len;
+    QLIST_ENTRY(BounceBuffer) link;
 } BounceBuffer;
 
-static BounceBuffer bounce;
+static QLIST_HEAD(, BounceBuffer) bounce_list
+    = QLIST_HEAD_INITIALIZER(bounce_list);
+static hwaddr bounce_in_use;
 
 typedef struct MapClient {
     void *opaque;
@@ -2057,6 +2441,34 @@ static void cpu_notify_map_clients(void)
     }
 }
 
+static void *address_space_map_bounce(AddressSpace *as, hwaddr addr,
+                                      hwaddr *plen, bool is_write)
+{
+    BounceBuffer *b;
+    hwaddr len = MIN(*plen, BOUNCE_MAP_MAX);
+
+    /* a shorter mapping now beats none */
+    len = MIN(len, BOUNCE_POOL_SIZE - bounce_in_use);
+    if (len == 0) {
+        *plen = 0;
+        return NULL;
+    }
+
+    b = g_malloc(sizeof(*b));
+    b->buffer = qemu_memalign(TARGET_PAGE_SIZE, len);
+    b->addr = addr;
+    b->len = len;
+    QLIST_INSERT_HEAD(&bounce_list, b, link);
+    bounce_in_use += len;
+
+    if (!is_write) {
+        address_space_read(as, addr, b->buffer, len);
+    }
+
+    *plen = len;
+    return b->buffer;
+}
+
 /* Map a physical memory region into a host virtual address.
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
@@ -2087,18 +2499,11 @@ void *address_space_map(AddressSpace *as,
         section = phys_page_find(d, page >> TARGET_PAGE_BITS);
 
         if (!(memory_region_is_ram(section->mr) && !section->readonly)) {
-            if (todo || bounce.buffer) {
+            if (todo) {
                 break;
             }
-            bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
-            bounce.addr = addr;
-            bounce.len = l;
-            if (!is_write) {
-                address_space_read(as, addr, bounce.buffer, l);
-            }
-
-            *plen = l;
-            return bounce.buffer;
+            *plen = len;
+            return address_space_map_bounce(as, addr, plen, is_write);
         }
         if (!todo) {
             raddr = memory_region_get_ram_addr(section->mr)
@@ -2122,7 +2527,15 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *b;
+
+    QLIST_FOREACH(b, &bounce_list, link) {
+        if (b->buffer == buffer) {
+            break;
+        }
+    }
+
+    if (!b) {
         if (is_write) {
             ram_addr_t addr1 = qemu_ram_addr_from_host_nofail(buffer);
             while (access_len) {
@@ -2141,10 +2554,12 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, bounce.buffer, access_len);
+        address_space_write(as, b->addr, b->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
+    QLIST_REMOVE(b, link);
+    bounce_in_use -= b->len;
+    qemu_vfree(b->buffer);
+    g_free(b);
     cpu_notify_map_clients();
 }
 
@@ -40,6 +40,9 @@ these four paragraphs for those parts of this code that are retained.
  */
 #include "config.h"
 
+#include <float.h>
+#include <math.h>
+
 #include "fpu/softfloat.h"
 
 /*----------------------------------------------------------------------------
@@ -433,6 +436,79 @@ static float64 float64_squash_input_denormal(float64 a STATUS_PARAM)
     return a;
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast paths.  If every operand is zero or normal, the rounding mode
+| is round-to-nearest-even and the inexact flag is already raised (it almost
+| always is once a program has done some floating point), the host FPU
+| computes the same result as the code below and the only flag left to
+| raise is overflow.  Results that are zero or tiny are recomputed in
+| software, so that underflow, tininess detection and flush-to-zero keep
+| behaving as the target wants.  Hosts that evaluate float expressions in
+| wider precision (x87) would round twice and do not use this.
+*----------------------------------------------------------------------------*/
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define SOFTFLOAT_HOST_FPU
+
+INLINE flag can_use_host_fpu(float_status *status)
+{
+    return STATUS(float_rounding_mode) == float_round_nearest_even &&
+           (STATUS(float_exception_flags) & float_flag_inexact);
+}
+
+INLINE flag float32_is_zero_or_normal(float32 a)
+{
+    int_fast16_t aExp = extractFloat32Exp(a);
+
+    return aExp != 0xFF && (aExp != 0 || extractFloat32Frac(a) == 0);
+}
+
+INLINE flag float64_is_zero_or_normal(float64 a)
+{
+    int_fast16_t aExp = extractFloat64Exp(a);
+
+    return aExp != 0x7FF && (aExp != 0 || extractFloat64Frac(a) == 0);
+}
+
+INLINE float float32_to_host(float32 a)
+{
+    union { uint32_t i; float f; } u = { .i = float32_val(a) };
+    return u.f;
+}
+
+INLINE double float64_to_host(float64 a)
+{
+    union { uint64_t i; double d; } u = { .i = float64_val(a) };
+    return u.d;
+}
+
+/* Returns 0 if the result has to be computed in software after all */
+static flag float32_host_result(float f, float32 *z STATUS_PARAM)
+{
+    union { uint32_t i; float f; } u = { .f = f };
+
+    if (isinf(f)) {
+        float_raise(float_flag_overflow | float_flag_inexact STATUS_VAR);
+    } else if (fabsf(f) <= FLT_MIN) {
+        return 0;
+    }
+    *z = make_float32(u.i);
+    return 1;
+}
+
+static flag float64_host_result(double d, float64 *z STATUS_PARAM)
+{
+    union { uint64_t i; double d; } u = { .d = d };
+
+    if (isinf(d)) {
+        float_raise(float_flag_overflow | float_flag_inexact STATUS_VAR);
+    } else if (fabs(d) <= DBL_MIN) {
+        return 0;
+    }
+    *z = make_float64(u.i);
+    return 1;
+}
+#endif
+
 /*----------------------------------------------------------------------------
 | Normalizes the subnormal double-precision floating-point value represented
 | by the denormalized significand `aSig'.  The normalized exponent and
@@ -1864,7 +1940,7 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_add( float32 a, float32 b STATUS_PARAM )
+static float32 soft_float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a STATUS_VAR);
@@ -1881,13 +1957,28 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 
 }
 
+float32 float32_add( float32 a, float32 b STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float32 z;
+
+    if (can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b) &&
+        float32_host_result(float32_to_host(a) + float32_to_host(b),
+                            &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float32_add(a, b STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of subtracting the single-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sub( float32 a, float32 b STATUS_PARAM )
+static float32 soft_float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a STATUS_VAR);
@@ -1904,13 +1995,28 @@ float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 
 }
 
+float32 float32_sub( float32 a, float32 b STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float32 z;
+
+    if (can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b) &&
+        float32_host_result(float32_to_host(a) - float32_to_host(b),
+                            &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float32_sub(a, b STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of multiplying the single-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_mul( float32 a, float32 b STATUS_PARAM )
+static float32 soft_float32_mul( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -1967,13 +2073,28 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
 
 }
 
+float32 float32_mul( float32 a, float32 b STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float32 z;
+
+    if (can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b) &&
+        float32_host_result(float32_to_host(a) * float32_to_host(b),
+                            &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float32_mul(a, b STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of dividing the single-precision floating-point value `a'
 | by the corresponding value `b'.  The operation is performed according to the
 | IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_div( float32 a, float32 b STATUS_PARAM )
+static float32 soft_float32_div( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -2031,6 +2152,22 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
 
 }
 
+float32 float32_div( float32 a, float32 b STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float32 z;
+
+    if (can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b) &&
+        !float32_is_zero(b) &&
+        float32_host_result(float32_to_host(a) / float32_to_host(b),
+                            &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float32_div(a, b STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the remainder of the single-precision floating-point value `a'
 | with respect to the corresponding value `b'.  The operation is performed
@@ -2143,7 +2280,8 @@ float32 float32_rem( float32 a, float32 b STATUS_PARAM )
 | externally will flip the sign bit on NaNs.)
 *----------------------------------------------------------------------------*/
 
-float32 float32_muladd(float32 a, float32 b, float32 c, int flags STATUS_PARAM)
+static float32 soft_float32_muladd(float32 a, float32 b, float32 c,
+                               int flags STATUS_PARAM)
 {
     flag aSign, bSign, cSign, zSign;
     int_fast16_t aExp, bExp, cExp, pExp, zExp, expDiff;
@@ -2338,6 +2476,22 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags STATUS_PARAM)
     return roundAndPackFloat32(zSign, zExp, zSig64 STATUS_VAR);
 }
 
+float32 float32_muladd(float32 a, float32 b, float32 c, int flags STATUS_PARAM)
+{
+#if defined(SOFTFLOAT_HOST_FPU) && defined(FP_FAST_FMAF)
+    float32 z;
+
+    if (flags == 0 && can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b) &&
+        float32_is_zero_or_normal(c) &&
+        float32_host_result(fmaf(float32_to_host(a), float32_to_host(b),
+                            float32_to_host(c)), &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float32_muladd(a, b, c, flags STATUS_VAR);
+}
+
 
 /*----------------------------------------------------------------------------
 | Returns the square root of the single-precision floating-point value `a'.
@@ -2345,7 +2499,7 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags STATUS_PARAM)
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sqrt( float32 a STATUS_PARAM )
+static float32 soft_float32_sqrt( float32 a STATUS_PARAM )
 {
     flag aSign;
     int_fast16_t aExp, zExp;
@@ -2394,6 +2548,20 @@ float32 float32_sqrt( float32 a STATUS_PARAM )
 
 }
 
+float32 float32_sqrt( float32 a STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float32 z;
+
+    if (can_use_host_fpu(status) &&
+        float32_is_zero_or_normal(a) && !float32_is_neg(a) &&
+        float32_host_result(sqrtf(float32_to_host(a)), &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float32_sqrt(a STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the binary exponential of the single-precision floating-point value
 | `a'. The operation is performed according to the IEC/IEEE Standard for
@@ -3427,7 +3595,7 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_add( float64 a, float64 b STATUS_PARAM )
+static float64 soft_float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a STATUS_VAR);
@@ -3444,13 +3612,28 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 
 }
 
+float64 float64_add( float64 a, float64 b STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float64 z;
+
+    if (can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b) &&
+        float64_host_result(float64_to_host(a) + float64_to_host(b),
+                            &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float64_add(a, b STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of subtracting the double-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sub( float64 a, float64 b STATUS_PARAM )
+static float64 soft_float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a STATUS_VAR);
@@ -3467,13 +3650,28 @@ float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 
 }
 
+float64 float64_sub( float64 a, float64 b STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float64 z;
+
+    if (can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b) &&
+        float64_host_result(float64_to_host(a) - float64_to_host(b),
+                            &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float64_sub(a, b STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of multiplying the double-precision floating-point values
 | `a' and `b'.  The operation is performed according to the IEC/IEEE Standard
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_mul( float64 a, float64 b STATUS_PARAM )
+static float64 soft_float64_mul( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -3528,13 +3726,28 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
 
 }
 
+float64 float64_mul( float64 a, float64 b STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float64 z;
+
+    if (can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b) &&
+        float64_host_result(float64_to_host(a) * float64_to_host(b),
+                            &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float64_mul(a, b STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of dividing the double-precision floating-point value `a'
 | by the corresponding value `b'.  The operation is performed according to
 | the IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_div( float64 a, float64 b STATUS_PARAM )
+static float64 soft_float64_div( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -3600,6 +3813,22 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
 
 }
 
+float64 float64_div( float64 a, float64 b STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float64 z;
+
+    if (can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b) &&
+        !float64_is_zero(b) &&
+        float64_host_result(float64_to_host(a) / float64_to_host(b),
+                            &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float64_div(a, b STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the remainder of the double-precision floating-point value `a'
 | with respect to the corresponding value `b'.  The operation is performed
@@ -3697,7 +3926,8 @@ float64 float64_rem( float64 a, float64 b STATUS_PARAM )
 | externally will flip the sign bit on NaNs.)
 *----------------------------------------------------------------------------*/
 
-float64 float64_muladd(float64 a, float64 b, float64 c, int flags STATUS_PARAM)
+static float64 soft_float64_muladd(float64 a, float64 b, float64 c,
+                               int flags STATUS_PARAM)
 {
     flag aSign, bSign, cSign, zSign;
     int_fast16_t aExp, bExp, cExp, pExp, zExp, expDiff;
@@ -3906,13 +4136,29 @@ float64 float64_muladd(float64 a, float64 b, float64 c, int flags STATUS_PARAM)
     }
 }
 
+float64 float64_muladd(float64 a, float64 b, float64 c, int flags STATUS_PARAM)
+{
+#if defined(SOFTFLOAT_HOST_FPU) && defined(FP_FAST_FMA)
+    float64 z;
+
+    if (flags == 0 && can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b) &&
+        float64_is_zero_or_normal(c) &&
+        float64_host_result(fma(float64_to_host(a), float64_to_host(b),
+                            float64_to_host(c)), &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float64_muladd(a, b, c, flags STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the square root of the double-precision floating-point value `a'.
 | The operation is performed according to the IEC/IEEE Standard for Binary
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sqrt( float64 a STATUS_PARAM )
+static float64 soft_float64_sqrt( float64 a STATUS_PARAM )
 {
     flag aSign;
     int_fast16_t aExp, zExp;
@@ -3958,6 +4204,20 @@ float64 float64_sqrt( float64 a STATUS_PARAM )
 
 }
 
+float64 float64_sqrt( float64 a STATUS_PARAM )
+{
+#if defined(SOFTFLOAT_HOST_FPU)
+    float64 z;
+
+    if (can_use_host_fpu(status) &&
+        float64_is_zero_or_normal(a) && !float64_is_neg(a) &&
+        float64_host_result(sqrt(float64_to_host(a)), &z STATUS_VAR)) {
+        return z;
+    }
+#endif
+    return soft_float64_sqrt(a STATUS_VAR);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the binary log of the double-precision floating-point value `a'.
 | The operation is performed according to the IEC/IEEE Standard for Binary
@@ -75,6 +75,7 @@ typedef struct FsDriverEntry {
     char *fsdev_id;
     char *path;
     int export_flags;
+    int threads;
     FileOperations *ops;
 } FsDriverEntry;
 
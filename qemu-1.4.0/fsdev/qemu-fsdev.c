@@ -38,6 +38,7 @@ int qemu_fsdev_add(QemuOpts *opts)
     const char *fsdriver = qemu_opt_get(opts, "fsdriver");
     const char *writeout = qemu_opt_get(opts, "writeout");
     bool ro = qemu_opt_get_bool(opts, "readonly", 0);
+    uint64_t threads = qemu_opt_get_number(opts, "threads", 0);
 
     if (!fsdev_id) {
         fprintf(stderr, "fsdev: No id specified\n");
@@ -60,9 +61,16 @@ int qemu_fsdev_add(QemuOpts *opts)
         return -1;
     }
 
+    if (threads > 256) {
+        fprintf(stderr, "fsdev: threads must be at most 256\n");
+        return -1;
+    }
+
     fsle = g_malloc0(sizeof(*fsle));
     fsle->fse.fsdev_id = g_strdup(fsdev_id);
     fsle->fse.ops = FsDrivers[i].ops;
+    /* Without a limit glib starts a thread per outstanding request */
+    fsle->fse.threads = threads ? threads : -1;
     if (writeout) {
         if (!strcmp(writeout, "immediate")) {
             fsle->fse.export_flags |= V9FS_IMMEDIATE_WRITEOUT;
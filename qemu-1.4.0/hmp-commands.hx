@@ -95,6 +95,38 @@ STEXI
 @item block_job_set_speed
 @findex block_job_set_speed
 Set maximum speed for a background block operation.
+ETEXI
+
+    {
+        .name       = "block_job_set_weight",
+        .args_type  = "device:B,weight:i",
+        .params     = "device weight",
+        .help       = "set a background block operation's share of the"
+                      "\n\t\t\t bandwidth of all of them",
+        .mhandler.cmd = hmp_block_job_set_weight,
+    },
+
+STEXI
+@item block_job_set_weight
+@findex block_job_set_weight
+Set a background block operation's share of the bandwidth set with
+@code{block_job_set_bandwidth}.
+ETEXI
+
+    {
+        .name       = "block_job_set_bandwidth",
+        .args_type  = "speed:o,latency:i?",
+        .params     = "speed [latency-us]",
+        .help       = "set maximum combined speed of all background block"
+                      "\n\t\t\t operations, optionally backing off when"
+                      "\n\t\t\t guest requests take more than latency-us",
+        .mhandler.cmd = hmp_block_job_set_bandwidth,
+    },
+
+STEXI
+@item block_job_set_bandwidth
+@findex block_job_set_bandwidth
+Set maximum combined speed of all background block operations.
 ETEXI
 
     {
@@ -941,6 +973,24 @@ ETEXI
         .mhandler.cmd = hmp_migrate_set_speed,
     },
 
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "seconds:i,sample_pages:i?",
+        .params     = "seconds [sample_pages]",
+        .help       = "measure how fast the guest dirties its memory over "
+                      "the given number of seconds, sampling sample_pages "
+                      "pages per GiB (default 512)",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{seconds} [@var{sample_pages}]
+@findex calc_dirty_rate
+Measure how fast the guest dirties its memory over @var{seconds} seconds,
+by hashing @var{sample_pages} pages per GiB of RAM.  Use @code{info
+dirty_rate} for the result.
+ETEXI
+
 STEXI
 @item migrate_set_speed @var{value}
 @findex migrate_set_speed
@@ -973,6 +1023,21 @@ STEXI
 @item migrate_set_capability @var{capability} @var{state}
 @findex migrate_set_capability
 Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "mmio_profile",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "start or stop counting MMIO and port I/O accesses",
+        .mhandler.cmd = hmp_mmio_profile,
+    },
+
+STEXI
+@item mmio_profile on|off
+@findex mmio_profile
+Start counting the guest's MMIO and port I/O accesses per device register,
+from zero, or stop counting.  The counts are shown by @code{info mmio-profile}.
 ETEXI
 
     {
@@ -996,9 +1061,13 @@ ETEXI
 #if defined(CONFIG_HAVE_CORE_DUMP)
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,filename:F,begin:i?,length:i?",
-        .params     = "[-p] filename [begin] [length]",
+        .args_type  = "paging:-p,detach:-d,zlib:-z,lzo:-l,snappy:-s,"
+                      "filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-d] [-z|-l|-s] filename [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -d: write memory in the background"
+                      "\n\t\t\t -z|-l|-s: kdump-compressed format, with"
+                      "\n\t\t\t zlib, lzo or snappy compression"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .mhandler.cmd = hmp_dump_guest_memory,
@@ -1006,12 +1075,16 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-d] [-z|-l|-s] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   filename: dump file name
     paging: do paging to get guest's memory mapping
+    detach: -d, write guest memory in the background while the guest runs
+      zlib: -z, kdump-compressed format with zlib compression
+       lzo: -l, kdump-compressed format with lzo compression
+    snappy: -s, kdump-compressed format with snappy compression
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -1464,6 +1537,23 @@ ETEXI
         .mhandler.cmd = hmp_block_set_io_throttle,
     },
 
+STEXI
+@item block_set_latency_histogram @var{device} [@var{min_ns} [@var{bins}]]
+@findex block_set_latency_histogram
+Start or restart latency histograms of the requests to @var{device}, shown by
+@code{info blockstats}.  The first of the @var{bins} bins ends at
+@var{min_ns} nanoseconds and each of the next ones is twice as wide.  A
+@var{min_ns} of 0 stops collecting them.
+ETEXI
+
+    {
+        .name       = "block_set_latency_histogram",
+        .args_type  = "device:B,min_ns:l?,bins:l?",
+        .params     = "device [min_ns [bins]]",
+        .help       = "collect latency histograms for a block drive",
+        .mhandler.cmd = hmp_block_set_latency_histogram,
+    },
+
 STEXI
 @item block_passwd @var{device} @var{password}
 @findex block_passwd
@@ -1574,12 +1664,20 @@ Show various information about the system state.
 show the version of QEMU
 @item info network
 show the various VLANs and the associated devices
+@item info netdev-queues
+show the traffic through each tap queue, and the host thread and CPU of its vhost-net device
+@item info xen-backends
+show the I/O statistics of Xen PV backends
 @item info chardev
 show the character devices
 @item info block
 show the block devices
 @item info blockstats
 show block device statistics
+@item info thread-pools
+show the I/O thread pools with their queue depth and latency statistics
+@item info mmio-profile
+show the 20 device registers accessed most since @code{mmio_profile on}
 @item info registers
 show the cpu registers
 @item info cpus
@@ -1618,6 +1716,8 @@ show the current VM status (running|paused)
 show guest PCMCIA status
 @item info mice
 show which guest mouse is receiving events
+@item info input-latency
+show the latency of host input events, from their arrival to each stage
 @item info vnc
 show the vnc server status
 @item info name
@@ -1634,6 +1734,8 @@ show migration status
 show current migration capabilities
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info dirty_rate
+show the result of calc_dirty_rate
 @item info balloon
 show balloon information
 @item info qtree
@@ -1642,6 +1744,9 @@ show device tree
 show qdev device model list
 @item info roms
 show roms
+@item info timers
+show the number of timers pending on each clock, and the callbacks whose
+timers were re-armed most often since the last @code{info timers}
 @end table
 ETEXI
 
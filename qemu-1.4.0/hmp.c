@@ -22,6 +22,7 @@
 #include "qemu/sockets.h"
 #include "monitor/monitor.h"
 #include "ui/console.h"
+#include "block/thread-pool.h"
 
 static void hmp_handle_error(Monitor *mon, Error **errp)
 {
@@ -154,6 +155,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "Migration status: %s\n", info->status);
         monitor_printf(mon, "total time: %" PRIu64 " milliseconds\n",
                        info->total_time);
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                           info->cpu_throttle_percentage);
+        }
         if (info->has_expected_downtime) {
             monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
                            info->expected_downtime);
@@ -205,6 +210,21 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_postcopy) {
+        monitor_printf(mon, "postcopy requests: %" PRIu64 " pages\n",
+                       info->postcopy->requests);
+        if (info->postcopy->has_faults) {
+            monitor_printf(mon, "postcopy faults: %" PRIu64 "\n",
+                           info->postcopy->faults);
+        }
+        if (info->postcopy->has_fault_latency_avg) {
+            monitor_printf(mon, "postcopy fault latency: %" PRIu64
+                           " us average, %" PRIu64 " us max\n",
+                           info->postcopy->fault_latency_avg,
+                           info->postcopy->fault_latency_max);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -234,6 +254,30 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateBlockInfoList *entry;
+
+    monitor_printf(mon, "status: %s\n", DirtyRateStatus_lookup[info->status]);
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "dirty rate: %" PRId64 " pages/s, %" PRId64
+                       " kbytes/s over %" PRId64 " s\n",
+                       info->dirty_rate,
+                       info->dirty_rate * info->page_size >> 10,
+                       info->calc_time);
+    }
+    for (entry = info->blocks; entry; entry = entry->next) {
+        DirtyRateBlockInfo *block = entry->value;
+
+        monitor_printf(mon, "  %s: %" PRId64 " of %" PRId64
+                       " sampled pages dirty, %" PRId64 " pages/s\n",
+                       block->id, block->dirty, block->sampled,
+                       block->dirty_rate);
+    }
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -316,16 +360,52 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " group=%s",
+                               info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
 
         monitor_printf(mon, "\n");
+
+        if (info->value->has_dirty_bitmaps) {
+            BlockDirtyBitmapInfoList *bitmap;
+
+            for (bitmap = info->value->dirty_bitmaps; bitmap;
+                 bitmap = bitmap->next) {
+                monitor_printf(mon, "    dirty bitmap %s: %" PRId64
+                               " bytes dirty, granularity %" PRId64 "%s\n",
+                               bitmap->value->name, bitmap->value->count,
+                               bitmap->value->granularity,
+                               bitmap->value->busy ? ", backup running" : "");
+            }
+        }
     }
 
     qapi_free_BlockInfoList(block_list);
 }
 
+/* Only the bins that counted something, as "<start>ns:<count>" */
+static void hmp_print_latency_histogram(Monitor *mon, const char *name,
+                                        LatencyHistogramInfo *hist)
+{
+    LatencyHistogramBinList *bin;
+
+    if (!hist) {
+        return;
+    }
+    monitor_printf(mon, "    %s:", name);
+    for (bin = hist->bins; bin; bin = bin->next) {
+        if (bin->value->count) {
+            monitor_printf(mon, " %" PRId64 "ns:%" PRId64,
+                           bin->value->start_ns, bin->value->count);
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
 {
     BlockStatsList *stats_list, *stats;
@@ -346,6 +426,8 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
                        " flush_total_time_ns=%" PRId64
+                       " rd_merged=%" PRId64
+                       " wr_merged=%" PRId64
                        "\n",
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
@@ -354,12 +436,164 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
-                       stats->value->stats->flush_total_time_ns);
+                       stats->value->stats->flush_total_time_ns,
+                       stats->value->stats->rd_merged,
+                       stats->value->stats->wr_merged);
+        if (stats->value->stats->has_l2_cache_hits) {
+            monitor_printf(mon, "    l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64
+                           " refcount_cache_hits=%" PRId64
+                           " refcount_cache_misses=%" PRId64 "\n",
+                           stats->value->stats->l2_cache_hits,
+                           stats->value->stats->l2_cache_misses,
+                           stats->value->stats->refcount_cache_hits,
+                           stats->value->stats->refcount_cache_misses);
+        }
+        if (stats->value->stats->has_backend_operations) {
+            monitor_printf(mon, "    backend_inflight=%" PRId64
+                           " backend_operations=%" PRId64
+                           " backend_total_time_ns=%" PRId64
+                           " backend_merged=%" PRId64 "\n",
+                           stats->value->stats->backend_inflight,
+                           stats->value->stats->backend_operations,
+                           stats->value->stats->backend_total_time_ns,
+                           stats->value->stats->backend_merged);
+        }
+        hmp_print_latency_histogram(mon, "rd_latency",
+                                    stats->value->stats->rd_latency_histogram);
+        hmp_print_latency_histogram(mon, "wr_latency",
+                                    stats->value->stats->wr_latency_histogram);
+        hmp_print_latency_histogram(mon, "flush_latency",
+                                    stats->value->stats->flush_latency_histogram);
     }
 
     qapi_free_BlockStatsList(stats_list);
 }
 
+static void hmp_info_thread_pool(const char *name, int min_threads,
+                                 int max_threads, const ThreadPoolStats *stats,
+                                 void *opaque)
+{
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "%s: threads=%d-%d submitted=%" PRIu64
+                   " completed=%" PRIu64 " in_flight=%d max_in_flight=%d"
+                   " avg_latency_ns=%" PRIu64 " max_latency_ns=%" PRIu64 "\n",
+                   name, min_threads, max_threads,
+                   stats->submitted, stats->completed,
+                   stats->in_flight, stats->max_in_flight,
+                   stats->completed ? stats->total_ns / stats->completed : 0,
+                   stats->max_ns);
+}
+
+void hmp_info_thread_pools(Monitor *mon, const QDict *qdict)
+{
+    thread_pool_foreach(hmp_info_thread_pool, mon);
+}
+
+void hmp_info_netdev_queues(Monitor *mon, const QDict *qdict)
+{
+    NetdevQueueInfoList *list, *entry;
+    NetdevQueueInfo *info;
+
+    list = qmp_query_netdev_queues(NULL);
+    for (entry = list; entry; entry = entry->next) {
+        info = entry->value;
+        monitor_printf(mon, "%s.%" PRId64 ": rx_packets=%" PRId64
+                       " rx_bytes=%" PRId64 " tx_packets=%" PRId64
+                       " tx_bytes=%" PRId64,
+                       info->netdev, info->queue, info->rx_packets,
+                       info->rx_bytes, info->tx_packets, info->tx_bytes);
+        if (info->vhost) {
+            monitor_printf(mon, " vhost");
+            if (info->has_thread_id) {
+                monitor_printf(mon, " thread_id=%" PRId64, info->thread_id);
+            }
+            if (info->has_cpu) {
+                monitor_printf(mon, " cpu=%" PRId64, info->cpu);
+            }
+        }
+        monitor_printf(mon, "\n");
+    }
+    qapi_free_NetdevQueueInfoList(list);
+}
+
+void hmp_info_xen_backends(Monitor *mon, const QDict *qdict)
+{
+    XenBackendInfoList *list, *entry;
+    XenBackendInfo *info;
+    Error *err = NULL;
+
+    list = qmp_query_xen_backends(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    for (entry = list; entry; entry = entry->next) {
+        info = entry->value;
+        monitor_printf(mon, "%s-%" PRId64 " (domain %" PRId64 ", %s):"
+                       " rd_ops=%" PRId64 " rd_bytes=%" PRId64
+                       " wr_ops=%" PRId64 " wr_bytes=%" PRId64
+                       " errors=%" PRId64 " inflight=%" PRId64
+                       " inflight_max=%" PRId64 "\n",
+                       info->type, info->dev, info->domain, info->state,
+                       info->rd_ops, info->rd_bytes, info->wr_ops,
+                       info->wr_bytes, info->errors, info->inflight,
+                       info->inflight_max);
+        monitor_printf(mon, "    grant_maps=%" PRId64 " grant_unmaps=%" PRId64
+                       " grant_copies=%" PRId64 " notify_sent=%" PRId64
+                       " notify_received=%" PRId64 "\n",
+                       info->grant_maps, info->grant_unmaps,
+                       info->grant_copies, info->notify_sent,
+                       info->notify_received);
+    }
+    qapi_free_XenBackendInfoList(list);
+}
+
+void hmp_info_input_latency(Monitor *mon, const QDict *qdict)
+{
+    InputLatencyInfoList *list, *entry;
+
+    list = qmp_query_input_latency(false, false, NULL);
+    if (!list) {
+        monitor_printf(mon, "No timed input events\n");
+        return;
+    }
+    for (entry = list; entry; entry = entry->next) {
+        InputLatencyInfo *info = entry->value;
+
+        monitor_printf(mon, "%-8s %" PRId64 " events, p50 %" PRId64
+                       " ns, p99 %" PRId64 " ns, max %" PRId64 " ns\n",
+                       InputLatencyStage_lookup[info->stage], info->count,
+                       info->p50_ns, info->p99_ns, info->max_ns);
+    }
+    qapi_free_InputLatencyInfoList(list);
+}
+
+void hmp_info_mmio_profile(Monitor *mon, const QDict *qdict)
+{
+    MmioProfileEntryList *list, *entry;
+    MmioProfileEntry *info;
+
+    list = qmp_query_mmio_profile(true, 20, NULL);
+    for (entry = list; entry; entry = entry->next) {
+        info = entry->value;
+        monitor_printf(mon, "%s %s+0x%" PRIx64 ": reads=%" PRId64
+                       " writes=%" PRId64 " read_ns=%" PRId64
+                       " write_ns=%" PRId64 "\n",
+                       info->pio ? "pio" : "mmio", info->region, info->offset,
+                       info->reads, info->writes,
+                       info->read_ns, info->write_ns);
+    }
+    qapi_free_MmioProfileEntryList(list);
+}
+
+void hmp_mmio_profile(Monitor *mon, const QDict *qdict)
+{
+    qmp_mmio_profile_set(qdict_get_bool(qdict, "enable"), NULL);
+}
+
 void hmp_info_vnc(Monitor *mon, const QDict *qdict)
 {
     VncInfo *info;
@@ -538,6 +772,28 @@ static void hmp_info_pci_device(Monitor *mon, const PciDeviceInfo *dev)
 
     monitor_printf(mon, "      id \"%s\"\n", dev->qdev_id);
 
+    if (dev->has_config_access) {
+        PciConfigAccessInfoList *acc;
+
+        monitor_printf(mon, "      Config space accesses:\n");
+        for (acc = dev->config_access; acc; acc = acc->next) {
+            monitor_printf(mon, "        0x%02" PRIx64 ": %" PRId64 " reads"
+                           " (%" PRId64 " cached), %" PRId64 " writes\n",
+                           acc->value->offset, acc->value->reads,
+                           acc->value->cached, acc->value->writes);
+        }
+    }
+
+    if (dev->has_host_access) {
+        monitor_printf(mon, "      Host device: %" PRId64 " sysfs opens, "
+                       "%" PRId64 " config reads (%" PRId64 " from snapshot), "
+                       "%" PRId64 " config writes\n",
+                       dev->host_access->sysfs_opens,
+                       dev->host_access->config_reads,
+                       dev->host_access->snapshot_reads,
+                       dev->host_access->config_writes);
+    }
+
     if (dev->has_pci_bridge) {
         if (dev->pci_bridge->has_devices) {
             PciDeviceInfoList *cdev;
@@ -603,6 +859,14 @@ void hmp_info_block_jobs(Monitor *mon, const QDict *qdict)
                            list->value->len,
                            list->value->speed);
         }
+        if (list->value->has_eta) {
+            monitor_printf(mon, "    estimated convergence in %" PRId64
+                           " s\n", list->value->eta);
+        }
+        if (list->value->has_dirty_bytes) {
+            monitor_printf(mon, "    %" PRId64 " bytes left to copy\n",
+                           list->value->dirty_bytes);
+        }
         list = list->next;
     }
 }
@@ -868,6 +1132,20 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t seconds = qdict_get_int(qdict, "seconds");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(seconds, has_sample_pages, sample_pages, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -980,7 +1258,25 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, 0,
+                              false, 0, &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_block_set_latency_histogram(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    bool has_min_ns = qdict_haskey(qdict, "min_ns");
+    int64_t min_ns = qdict_get_try_int(qdict, "min_ns", 0);
+
+    qmp_block_latency_histogram_set(qdict_get_str(qdict, "device"),
+                                    true, !has_min_ns || min_ns,
+                                    has_min_ns && min_ns, min_ns,
+                                    qdict_haskey(qdict, "bins"),
+                                    qdict_get_try_int(qdict, "bins", 0),
+                                    &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1009,6 +1305,29 @@ void hmp_block_job_set_speed(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &error);
 }
 
+void hmp_block_job_set_weight(Monitor *mon, const QDict *qdict)
+{
+    Error *error = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t value = qdict_get_int(qdict, "weight");
+
+    qmp_block_job_set_weight(device, value, &error);
+
+    hmp_handle_error(mon, &error);
+}
+
+void hmp_block_job_set_bandwidth(Monitor *mon, const QDict *qdict)
+{
+    Error *error = NULL;
+    int64_t value = qdict_get_int(qdict, "speed");
+    bool has_latency = qdict_haskey(qdict, "latency");
+    int64_t latency = qdict_get_try_int(qdict, "latency", 0);
+
+    qmp_block_job_set_bandwidth(value, has_latency, latency, &error);
+
+    hmp_handle_error(mon, &error);
+}
+
 void hmp_block_job_cancel(Monitor *mon, const QDict *qdict)
 {
     Error *error = NULL;
@@ -1136,13 +1455,30 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *errp = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    int detach = qdict_get_try_bool(qdict, "detach", 0);
+    int zlib = qdict_get_try_bool(qdict, "zlib", 0);
+    int lzo = qdict_get_try_bool(qdict, "lzo", 0);
+    int snappy = qdict_get_try_bool(qdict, "snappy", 0);
     const char *file = qdict_get_str(qdict, "filename");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
     int64_t begin = 0;
     int64_t length = 0;
+    DumpGuestMemoryFormat format = DUMP_GUEST_MEMORY_FORMAT_ELF;
     char *prot;
 
+    if (zlib + lzo + snappy > 1) {
+        monitor_printf(mon, "only one of -z|-l|-s can be given\n");
+        return;
+    }
+    if (zlib) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB;
+    } else if (lzo) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO;
+    } else if (snappy) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY;
+    }
+
     if (has_begin) {
         begin = qdict_get_int(qdict, "begin");
     }
@@ -1153,7 +1489,7 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          &errp);
+                          true, format, true, detach, &errp);
     hmp_handle_error(mon, &errp);
     g_free(prot);
 }
@@ -26,7 +26,7 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             errno = 0;
             err = s->ops->readdir_r(&s->ctx, &fidp->fs, dent, result);
@@ -39,6 +39,87 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     return err;
 }
 
+/*
+ * Read as many entries as fit into @max_count bytes of an Rreaddir reply
+ * in a single trip to the worker, rather than one trip per entry.  The
+ * directory is left positioned after the last entry returned, and the
+ * position before the first one is stored in @start.  Returns the number
+ * of entries or a negative errno.
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         V9fsDirEnt **entries, int32_t max_count,
+                         off_t *start)
+{
+    int err;
+    V9fsState *s = pdu->s;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(s,
+        {
+            /* no commas at this level, this is a macro argument */
+            struct dirent *dent;
+            struct dirent *result;
+            V9fsDirEnt **tail = entries;
+            off_t saved_dir_pos;
+            size_t size = 0;
+
+            err = 0;
+            saved_dir_pos = s->ops->telldir(&s->ctx, &fidp->fs);
+            *start = saved_dir_pos;
+            if (saved_dir_pos < 0) {
+                err = -errno;
+            }
+            dent = g_malloc(sizeof(struct dirent));
+            while (err >= 0) {
+                errno = 0;
+                s->ops->readdir_r(&s->ctx, &fidp->fs, dent, &result);
+                if (!result) {
+                    if (errno) {
+                        err = -errno;
+                    }
+                    break;
+                }
+                /*
+                 * Size of each dirent on the wire: size of qid (13) +
+                 * size of offset (8) + size of type (1) +
+                 * size of name.size (2) + strlen(name.data)
+                 */
+                size += 24 + strlen(dent->d_name);
+                if (size > max_count) {
+                    /* No room left, read this one again next time */
+                    s->ops->seekdir(&s->ctx, &fidp->fs, saved_dir_pos);
+                    break;
+                }
+                *tail = g_malloc(sizeof(**tail));
+                (*tail)->dent = g_memdup(dent, sizeof(struct dirent));
+                (*tail)->next = NULL;
+                tail = &(*tail)->next;
+                saved_dir_pos = dent->d_off;
+                err++;
+            }
+            g_free(dent);
+        });
+    if (err < 0) {
+        v9fs_free_dirents(*entries);
+        *entries = NULL;
+    }
+    return err;
+}
+
+void v9fs_free_dirents(V9fsDirEnt *e)
+{
+    V9fsDirEnt *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        g_free(e->dent);
+        g_free(e);
+    }
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -47,7 +128,7 @@ off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->telldir(&s->ctx, &fidp->fs);
             if (err < 0) {
@@ -63,7 +144,7 @@ void v9fs_co_seekdir(V9fsPDU *pdu, V9fsFidState *fidp, off_t offset)
     if (v9fs_request_cancelled(pdu)) {
         return;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             s->ops->seekdir(&s->ctx, &fidp->fs, offset);
         });
@@ -75,7 +156,7 @@ void v9fs_co_rewinddir(V9fsPDU *pdu, V9fsFidState *fidp)
     if (v9fs_request_cancelled(pdu)) {
         return;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             s->ops->rewinddir(&s->ctx, &fidp->fs);
         });
@@ -97,7 +178,7 @@ int v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name,
     cred.fc_uid = uid;
     cred.fc_gid = gid;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->mkdir(&s->ctx, &fidp->path, name->data,  &cred);
             if (err < 0) {
@@ -127,7 +208,7 @@ int v9fs_co_opendir(V9fsPDU *pdu, V9fsFidState *fidp)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->opendir(&s->ctx, &fidp->path, &fidp->fs);
             if (err < 0) {
@@ -154,7 +235,7 @@ int v9fs_co_closedir(V9fsPDU *pdu, V9fsFidOpenState *fs)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->closedir(&s->ctx, fs);
             if (err < 0) {
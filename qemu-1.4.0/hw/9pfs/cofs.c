@@ -28,7 +28,7 @@ int v9fs_co_readlink(V9fsPDU *pdu, V9fsPath *path, V9fsString *buf)
     }
     buf->data = g_malloc(PATH_MAX);
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             len = s->ops->readlink(&s->ctx, path,
                                    buf->data, PATH_MAX - 1);
@@ -58,7 +58,7 @@ int v9fs_co_statfs(V9fsPDU *pdu, V9fsPath *path, struct statfs *stbuf)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->statfs(&s->ctx, path, stbuf);
             if (err < 0) {
@@ -81,7 +81,7 @@ int v9fs_co_chmod(V9fsPDU *pdu, V9fsPath *path, mode_t mode)
     cred_init(&cred);
     cred.fc_mode = mode;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->chmod(&s->ctx, path, &cred);
             if (err < 0) {
@@ -102,7 +102,7 @@ int v9fs_co_utimensat(V9fsPDU *pdu, V9fsPath *path,
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->utimensat(&s->ctx, path, times);
             if (err < 0) {
@@ -126,7 +126,7 @@ int v9fs_co_chown(V9fsPDU *pdu, V9fsPath *path, uid_t uid, gid_t gid)
     cred.fc_uid = uid;
     cred.fc_gid = gid;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->chown(&s->ctx, path, &cred);
             if (err < 0) {
@@ -146,7 +146,7 @@ int v9fs_co_truncate(V9fsPDU *pdu, V9fsPath *path, off_t size)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->truncate(&s->ctx, path, size);
             if (err < 0) {
@@ -174,7 +174,7 @@ int v9fs_co_mknod(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, uid_t uid,
     cred.fc_mode = mode;
     cred.fc_rdev = dev;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->mknod(&s->ctx, &fidp->path, name->data, &cred);
             if (err < 0) {
@@ -205,7 +205,7 @@ int v9fs_co_remove(V9fsPDU *pdu, V9fsPath *path)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->remove(&s->ctx, path->data);
             if (err < 0) {
@@ -225,7 +225,7 @@ int v9fs_co_unlinkat(V9fsPDU *pdu, V9fsPath *path, V9fsString *name, int flags)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->unlinkat(&s->ctx, path, name->data, flags);
             if (err < 0) {
@@ -245,7 +245,7 @@ int v9fs_co_rename(V9fsPDU *pdu, V9fsPath *oldpath, V9fsPath *newpath)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->rename(&s->ctx, oldpath->data, newpath->data);
             if (err < 0) {
@@ -264,7 +264,7 @@ int v9fs_co_renameat(V9fsPDU *pdu, V9fsPath *olddirpath, V9fsString *oldname,
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->renameat(&s->ctx, olddirpath, oldname->data,
                                    newdirpath, newname->data);
@@ -291,7 +291,7 @@ int v9fs_co_symlink(V9fsPDU *pdu, V9fsFidState *dfidp, V9fsString *name,
     cred.fc_gid = gid;
     cred.fc_mode = 0777;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->symlink(&s->ctx, oldpath, &dfidp->path,
                                   name->data, &cred);
@@ -332,7 +332,7 @@ int v9fs_co_name_to_path(V9fsPDU *pdu, V9fsPath *dirpath,
         if (v9fs_request_cancelled(pdu)) {
             return -EINTR;
         }
-        v9fs_co_run_in_worker(
+        v9fs_co_run_in_worker(s,
             {
                 err = s->ops->name_to_path(&s->ctx, dirpath, name, path);
                 if (err < 0) {
@@ -26,7 +26,7 @@ int v9fs_co_llistxattr(V9fsPDU *pdu, V9fsPath *path, void *value, size_t size)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->llistxattr(&s->ctx, path, value, size);
             if (err < 0) {
@@ -48,7 +48,7 @@ int v9fs_co_lgetxattr(V9fsPDU *pdu, V9fsPath *path,
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->lgetxattr(&s->ctx, path,
                                     xattr_name->data,
@@ -72,7 +72,7 @@ int v9fs_co_lsetxattr(V9fsPDU *pdu, V9fsPath *path,
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->lsetxattr(&s->ctx, path,
                                     xattr_name->data, value,
@@ -95,7 +95,7 @@ int v9fs_co_lremovexattr(V9fsPDU *pdu, V9fsPath *path,
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->lremovexattr(&s->ctx, path, xattr_name->data);
             if (err < 0) {
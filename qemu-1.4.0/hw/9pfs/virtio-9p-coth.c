@@ -17,13 +17,17 @@
 #include "block/coroutine.h"
 #include "virtio-9p-coth.h"
 
-/* v9fs glib thread pool */
+/*
+ * Every export has a glib thread pool of its own, so that a slow export
+ * cannot starve the others of workers.  Completions of all of them go
+ * through one notifier pipe.
+ */
 static V9fsThPool v9fs_pool;
 
 void co_run_in_worker_bh(void *opaque)
 {
-    Coroutine *co = opaque;
-    g_thread_pool_push(v9fs_pool.pool, co, NULL);
+    V9fsWorkerReq *req = opaque;
+    g_thread_pool_push(req->pool, req->co, NULL);
 }
 
 static void v9fs_qemu_process_req_done(void *arg)
@@ -55,34 +59,22 @@ static void v9fs_thread_routine(gpointer data, gpointer user_data)
     } while (len == -1 && errno == EINTR);
 }
 
-int v9fs_init_worker_threads(void)
+static int v9fs_init_completion_notifier(void)
 {
-    int ret = 0;
     int notifier_fds[2];
     V9fsThPool *p = &v9fs_pool;
-    sigset_t set, oldset;
 
-    sigfillset(&set);
-    /* Leave signal handling to the iothread.  */
-    pthread_sigmask(SIG_SETMASK, &set, &oldset);
-
-    if (qemu_pipe(notifier_fds) == -1) {
-        ret = -1;
-        goto err_out;
+    if (p->completed) {
+        return 0;
     }
-    p->pool = g_thread_pool_new(v9fs_thread_routine, p, -1, FALSE, NULL);
-    if (!p->pool) {
-        ret = -1;
-        goto err_out;
+    if (qemu_pipe(notifier_fds) == -1) {
+        return -1;
     }
     p->completed = g_async_queue_new();
     if (!p->completed) {
-        /*
-         * We are going to terminate.
-         * So don't worry about cleanup
-         */
-        ret = -1;
-        goto err_out;
+        close(notifier_fds[0]);
+        close(notifier_fds[1]);
+        return -1;
     }
     p->rfd = notifier_fds[0];
     p->wfd = notifier_fds[1];
@@ -91,6 +83,32 @@ int v9fs_init_worker_threads(void)
     fcntl(p->wfd, F_SETFL, O_NONBLOCK);
 
     qemu_set_fd_handler(p->rfd, v9fs_qemu_process_req_done, NULL, NULL);
+    return 0;
+}
+
+/*
+ * Create the worker pool of export @s; @max_threads of -1 means as many
+ * threads as there are outstanding requests.
+ */
+int v9fs_init_worker_threads(V9fsState *s, int max_threads)
+{
+    int ret = 0;
+    sigset_t set, oldset;
+
+    sigfillset(&set);
+    /* Leave signal handling to the iothread.  */
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+
+    if (v9fs_init_completion_notifier() < 0) {
+        ret = -1;
+        goto err_out;
+    }
+    s->pool = g_thread_pool_new(v9fs_thread_routine, NULL, max_threads,
+                                FALSE, NULL);
+    if (!s->pool) {
+        ret = -1;
+        goto err_out;
+    }
 err_out:
     pthread_sigmask(SIG_SETMASK, &oldset, NULL);
     return ret;
@@ -23,10 +23,20 @@
 typedef struct V9fsThPool {
     int rfd;
     int wfd;
-    GThreadPool *pool;
     GAsyncQueue *completed;
 } V9fsThPool;
 
+typedef struct V9fsWorkerReq {
+    Coroutine *co;
+    GThreadPool *pool;
+} V9fsWorkerReq;
+
+/* A directory entry read ahead by v9fs_co_readdir_many */
+typedef struct V9fsDirEnt {
+    struct dirent *dent;
+    struct V9fsDirEnt *next;
+} V9fsDirEnt;
+
 /*
  * we want to use bottom half because we want to make sure the below
  * sequence of events.
@@ -36,12 +46,17 @@ typedef struct V9fsThPool {
  *   3. Enter the coroutine in the worker thread.
  * we cannot swap step 1 and 2, because that would imply worker thread
  * can enter coroutine while step1 is still running
+ *
+ * The code block runs in a worker of the pool of export @s.
  */
-#define v9fs_co_run_in_worker(code_block)                               \
+#define v9fs_co_run_in_worker(s, code_block)                            \
     do {                                                                \
         QEMUBH *co_bh;                                                  \
-        co_bh = qemu_bh_new(co_run_in_worker_bh,                        \
-                            qemu_coroutine_self());                     \
+        V9fsWorkerReq co_req = {                                        \
+            .co = qemu_coroutine_self(),                                \
+            .pool = (s)->pool,                                          \
+        };                                                              \
+        co_bh = qemu_bh_new(co_run_in_worker_bh, &co_req);              \
         qemu_bh_schedule(co_bh);                                        \
         /*                                                              \
          * yield in qemu thread and re-enter back                       \
@@ -55,10 +70,13 @@ typedef struct V9fsThPool {
     } while (0)
 
 extern void co_run_in_worker_bh(void *);
-extern int v9fs_init_worker_threads(void);
+extern int v9fs_init_worker_threads(V9fsState *, int);
 extern int v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
 extern int v9fs_co_readdir_r(V9fsPDU *, V9fsFidState *,
                            struct dirent *, struct dirent **result);
+extern int v9fs_co_readdir_many(V9fsPDU *, V9fsFidState *,
+                                V9fsDirEnt **, int32_t, off_t *);
+extern void v9fs_free_dirents(V9fsDirEnt *);
 extern off_t v9fs_co_telldir(V9fsPDU *, V9fsFidState *);
 extern void v9fs_co_seekdir(V9fsPDU *, V9fsFidState *, off_t);
 extern void v9fs_co_rewinddir(V9fsPDU *, V9fsFidState *);
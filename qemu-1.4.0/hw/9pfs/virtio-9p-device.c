@@ -109,7 +109,7 @@ VirtIODevice *virtio_9p_init(DeviceState *dev, V9fsConf *conf)
                 " and export path:%s\n", conf->fsdev_id, s->ctx.fs_root);
         exit(1);
     }
-    if (v9fs_init_worker_threads() < 0) {
+    if (v9fs_init_worker_threads(s, fse->threads) < 0) {
         fprintf(stderr, "worker thread initialization failed\n");
         exit(1);
     }
@@ -1756,15 +1756,6 @@ out_nofid:
     complete_pdu(s, pdu, err);
 }
 
-static size_t v9fs_readdir_data_size(V9fsString *name)
-{
-    /*
-     * Size of each dirent on the wire: size of qid (13) + size of offset (8)
-     * size of type (1) + size of name.size (2) + strlen(name.data)
-     */
-    return 24 + v9fs_string_size(name);
-}
-
 static int v9fs_do_readdir(V9fsPDU *pdu,
                            V9fsFidState *fidp, int32_t max_count)
 {
@@ -1774,30 +1765,20 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
     int len, err = 0;
     int32_t count = 0;
     off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    V9fsDirEnt *entries, *e;
+    struct dirent *dent;
 
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
+    /* The worker only reads entries that fit into max_count */
+    err = v9fs_co_readdir_many(pdu, fidp, &entries, max_count,
+                               &saved_dir_pos);
+    if (err < 0) {
+        return err;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
-
-    while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
-        }
+    for (e = entries; e; e = e->next) {
+        dent = e->dent;
         v9fs_string_init(&name);
         v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return count;
-        }
         /*
          * Fill up just the path field of qid because the client uses
          * only that. To fill the entire qid structure we will have
@@ -1813,20 +1794,16 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
         len = pdu_marshal(pdu, 11 + count, "Qqbs",
                           &qid, dent->d_off,
                           dent->d_type, &name);
+        v9fs_string_free(&name);
         if (len < 0) {
             v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
+            v9fs_free_dirents(entries);
             return len;
         }
         count += len;
-        v9fs_string_free(&name);
         saved_dir_pos = dent->d_off;
     }
-    g_free(dent);
-    if (err < 0) {
-        return err;
-    }
+    v9fs_free_dirents(entries);
     return count;
 }
 
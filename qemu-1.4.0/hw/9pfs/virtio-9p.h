@@ -225,6 +225,8 @@ typedef struct V9fsState
     CoRwlock rename_lock;
     int32_t root_fid;
     Error *migration_blocker;
+    /* workers running the fs driver calls of this export */
+    GThreadPool *pool;
 } V9fsState;
 
 typedef struct V9fsStatState {
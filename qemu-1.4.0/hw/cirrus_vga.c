@@ -304,6 +304,7 @@ static void cirrus_bitblt_fill_nop(CirrusVGAState *s,
 
 #define ROP_NAME src
 #define ROP_FN(d, s) s
+#define ROP_IS_SRC 1
 #include "cirrus_vga_rop.h"
 
 #define ROP_NAME 1
@@ -615,6 +616,22 @@ static void cirrus_invalidate_region(CirrusVGAState * s, int off_begin,
     int off_cur;
     int off_cur_end;
 
+    if (lines <= 0) {
+        return;
+    }
+
+    /* Dirty tracking is per page, so one range covering all the lines
+       marks the same pages as a call per line unless it wraps */
+    off_cur = off_begin;
+    if (off_pitch < 0) {
+        off_cur += (lines - 1) * off_pitch;
+    }
+    off_cur_end = off_cur + (lines - 1) * abs(off_pitch) + bytesperline;
+    if (off_cur >= 0 && off_cur_end <= s->cirrus_addr_mask + 1) {
+        memory_region_set_dirty(&s->vga.vram, off_cur, off_cur_end - off_cur);
+        return;
+    }
+
     for (y = 0; y < lines; y++) {
 	off_cur = off_begin;
 	off_cur_end = (off_cur + bytesperline) & s->cirrus_addr_mask;
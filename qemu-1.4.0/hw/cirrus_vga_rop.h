@@ -22,6 +22,12 @@
  * THE SOFTWARE.
  */
 
+/* ROP_IS_SRC is set for the plain copy ROP, whose rows can be moved with
+   memmove/memcpy rather than a byte at a time */
+#ifndef ROP_IS_SRC
+#define ROP_IS_SRC 0
+#endif
+
 static inline void glue(rop_8_,ROP_NAME)(uint8_t *dst, uint8_t src)
 {
     *dst = ROP_FN(*dst, src);
@@ -58,10 +64,18 @@ glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
     }
 
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x++) {
-            ROP_OP(dst, *src);
-            dst++;
-            src++;
+        /* a forward byte copy onto itself a little further on repeats the
+           start of the row; anything else is what memmove does */
+        if (ROP_IS_SRC && (dst <= src || dst >= src + bltwidth)) {
+            memmove(dst, src, bltwidth);
+            dst += bltwidth;
+            src += bltwidth;
+        } else {
+            for (x = 0; x < bltwidth; x++) {
+                ROP_OP(dst, *src);
+                dst++;
+                src++;
+            }
         }
         dst += dstpitch;
         src += srcpitch;
@@ -78,10 +92,16 @@ glue(cirrus_bitblt_rop_bkwd_, ROP_NAME)(CirrusVGAState *s,
     dstpitch += bltwidth;
     srcpitch += bltwidth;
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x++) {
-            ROP_OP(dst, *src);
-            dst--;
-            src--;
+        if (ROP_IS_SRC && (dst >= src || dst <= src - bltwidth)) {
+            memmove(dst - bltwidth + 1, src - bltwidth + 1, bltwidth);
+            dst -= bltwidth;
+            src -= bltwidth;
+        } else {
+            for (x = 0; x < bltwidth; x++) {
+                ROP_OP(dst, *src);
+                dst--;
+                src--;
+            }
         }
         dst += dstpitch;
         src += srcpitch;
@@ -203,6 +223,7 @@ glue(glue(cirrus_bitblt_rop_bkwd_transp_, ROP_NAME),_16)(CirrusVGAState *s,
 #include "cirrus_vga_rop2.h"
 
 #undef ROP_NAME
+#undef ROP_IS_SRC
 #undef ROP_OP
 #undef ROP_OP_16
 #undef ROP_OP_32
@@ -128,6 +128,12 @@ glue(glue(glue(cirrus_colorexpand_transp_, ROP_NAME), _),DEPTH)
             if ((bitmask & 0xff) == 0) {
                 bitmask = 0x80;
                 bits = *src++ ^ bits_xor;
+                if (bits == 0) {
+                    /* skip to the last of these eight pixels */
+                    x += 7 * (DEPTH / 8);
+                    d += 7 * (DEPTH / 8);
+                    bitmask = 0x01;
+                }
             }
             index = (bits & bitmask);
             if (index) {
@@ -208,7 +214,8 @@ glue(glue(glue(cirrus_colorexpand_pattern_transp_, ROP_NAME), _),DEPTH)
         bits = src[pattern_y] ^ bits_xor;
         bitpos = 7 - srcskipleft;
         d = dst + dstskipleft;
-        for (x = dstskipleft; x < bltwidth; x += (DEPTH / 8)) {
+        for (x = bits ? dstskipleft : bltwidth; x < bltwidth;
+             x += (DEPTH / 8)) {
             if ((bits >> bitpos) & 1) {
                 PUTPIXEL();
             }
@@ -263,15 +270,21 @@ glue(glue(glue(cirrus_fill_, ROP_NAME), _),DEPTH)
     uint8_t *d, *d1;
     uint32_t col;
     int x, y;
+    int len = QEMU_ALIGN_UP(width, DEPTH / 8);
 
     col = s->cirrus_blt_fgcol;
 
     d1 = dst;
     for(y = 0; y < height; y++) {
         d = d1;
-        for(x = 0; x < width; x += (DEPTH / 8)) {
-            PUTPIXEL();
-            d += (DEPTH / 8);
+        if (ROP_IS_SRC && y > 0 && ABS(dst_pitch) >= len) {
+            /* every line of a plain fill is a copy of the first */
+            memcpy(d, dst, len);
+        } else {
+            for(x = 0; x < width; x += (DEPTH / 8)) {
+                PUTPIXEL();
+                d += (DEPTH / 8);
+            }
         }
         d1 += dst_pitch;
     }
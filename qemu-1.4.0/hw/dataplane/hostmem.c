@@ -58,6 +58,47 @@ out:
     return host_addr;
 }
 
+static void *hostmem_region_map(HostMemRegion *region, hwaddr phys,
+                                hwaddr len, bool is_write)
+{
+    hwaddr offset_within_region = phys - region->guest_addr;
+
+    if (is_write && region->readonly) {
+        return NULL;
+    }
+    if (len > region->size - offset_within_region) {
+        return NULL;
+    }
+    return region->host_addr + offset_within_region;
+}
+
+void *hostmem_lookup_cached(HostMem *hostmem, HostMemCache *cache,
+                            hwaddr phys, hwaddr len, bool is_write)
+{
+    HostMemRegion *region;
+    void *host_addr = NULL;
+
+    if (cache->generation == hostmem->generation &&
+        phys >= cache->region.guest_addr &&
+        phys - cache->region.guest_addr < cache->region.size) {
+        return hostmem_region_map(&cache->region, phys, len, is_write);
+    }
+
+    qemu_mutex_lock(&hostmem->current_regions_lock);
+    region = bsearch(&phys, hostmem->current_regions,
+                     hostmem->num_current_regions,
+                     sizeof(hostmem->current_regions[0]),
+                     hostmem_lookup_cmp);
+    if (region) {
+        cache->region = *region;
+        cache->generation = hostmem->generation;
+        host_addr = hostmem_region_map(region, phys, len, is_write);
+    }
+    qemu_mutex_unlock(&hostmem->current_regions_lock);
+
+    return host_addr;
+}
+
 /**
  * Install new regions list
  */
@@ -69,6 +110,7 @@ static void hostmem_listener_commit(MemoryListener *listener)
     g_free(hostmem->current_regions);
     hostmem->current_regions = hostmem->new_regions;
     hostmem->num_current_regions = hostmem->num_new_regions;
+    hostmem->generation++;
     qemu_mutex_unlock(&hostmem->current_regions_lock);
 
     /* Reset new regions list */
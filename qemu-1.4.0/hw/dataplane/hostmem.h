@@ -39,8 +39,17 @@ typedef struct {
     QemuMutex current_regions_lock;
     HostMemRegion *current_regions;
     size_t num_current_regions;
+    unsigned int generation;        /* bumped when regions are installed */
 } HostMem;
 
+/* The last region used by one thread, to skip the lock and the search
+ * when the next address falls in it too.  Zero-initialize before use.
+ */
+typedef struct {
+    HostMemRegion region;
+    unsigned int generation;
+} HostMemCache;
+
 void hostmem_init(HostMem *hostmem);
 void hostmem_finalize(HostMem *hostmem);
 
@@ -54,4 +63,12 @@ void hostmem_finalize(HostMem *hostmem);
  */
 void *hostmem_lookup(HostMem *hostmem, hwaddr phys, hwaddr len, bool is_write);
 
+/**
+ * Like hostmem_lookup(), but try the region cached in @cache first
+ *
+ * @cache must only be used by one thread at a time.
+ */
+void *hostmem_lookup_cached(HostMem *hostmem, HostMemCache *cache,
+                            hwaddr phys, hwaddr len, bool is_write);
+
 #endif /* HOSTMEM_H */
@@ -25,6 +25,7 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
     void *vring_ptr;
 
     vring->broken = false;
+    memset(&vring->hostmem_cache, 0, sizeof(vring->hostmem_cache));
 
     hostmem_init(&vring->hostmem);
     vring_ptr = hostmem_lookup(&vring->hostmem, vring_addr, vring_size, true);
@@ -113,6 +114,7 @@ static int get_indirect(Vring *vring,
                         struct vring_desc *indirect)
 {
     struct vring_desc desc;
+    struct vring_desc *table;
     unsigned int i = 0, count, found = 0;
 
     /* Sanity check */
@@ -133,13 +135,28 @@ static int get_indirect(Vring *vring,
         return -EFAULT;
     }
 
+    /* The table is normally in a single RAM region, so map it in one go.
+     * Otherwise, fall back to translating each descriptor.
+     */
+    table = NULL;
+    if (count) {
+        table = hostmem_lookup_cached(&vring->hostmem, &vring->hostmem_cache,
+                                      indirect->addr, indirect->len, false);
+    }
+
     do {
         struct vring_desc *desc_ptr;
 
         /* Translate indirect descriptor */
-        desc_ptr = hostmem_lookup(&vring->hostmem,
-                                  indirect->addr + found * sizeof(desc),
-                                  sizeof(desc), false);
+        if (table) {
+            desc_ptr = &table[found];
+        } else {
+            desc_ptr = hostmem_lookup_cached(&vring->hostmem,
+                                             &vring->hostmem_cache,
+                                             indirect->addr +
+                                             found * sizeof(desc),
+                                             sizeof(desc), false);
+        }
         if (!desc_ptr) {
             error_report("Failed to map indirect descriptor "
                          "addr %#" PRIx64 " len %zu",
@@ -171,8 +188,10 @@ static int get_indirect(Vring *vring,
             return -ENOBUFS;
         }
 
-        iov->iov_base = hostmem_lookup(&vring->hostmem, desc.addr, desc.len,
-                                       desc.flags & VRING_DESC_F_WRITE);
+        iov->iov_base = hostmem_lookup_cached(&vring->hostmem,
+                                              &vring->hostmem_cache,
+                                              desc.addr, desc.len,
+                                              desc.flags & VRING_DESC_F_WRITE);
         if (!iov->iov_base) {
             error_report("Failed to map indirect descriptor"
                          "addr %#" PRIx64 " len %u",
@@ -299,8 +318,10 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         }
 
         /* TODO handle non-contiguous memory across region boundaries */
-        iov->iov_base = hostmem_lookup(&vring->hostmem, desc.addr, desc.len,
-                                       desc.flags & VRING_DESC_F_WRITE);
+        iov->iov_base = hostmem_lookup_cached(&vring->hostmem,
+                                              &vring->hostmem_cache,
+                                              desc.addr, desc.len,
+                                              desc.flags & VRING_DESC_F_WRITE);
         if (!iov->iov_base) {
             error_report("Failed to map vring desc addr %#" PRIx64 " len %u",
                          (uint64_t)desc.addr, desc.len);
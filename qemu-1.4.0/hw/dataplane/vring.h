@@ -24,6 +24,7 @@
 
 typedef struct {
     HostMem hostmem;                /* guest memory mapper */
+    HostMemCache hostmem_cache;     /* last region used by vring_pop() */
     struct vring vr;                /* virtqueue vring mapped to host memory */
     uint16_t last_avail_idx;        /* last processed avail ring index */
     uint16_t last_used_idx;         /* last processed used ring index */
@@ -29,6 +29,7 @@
 #include "pci/pci.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/tap.h"
 #include "loader.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/dma.h"
@@ -64,6 +65,9 @@ static int debugflags = DBGBIT(TXERR) | DBGBIT(GENERAL);
 /* this is the size past which hardware will drop packets when setting LPE=1 */
 #define MAXIMUM_ETHERNET_LPE_SIZE 16384
 
+/* descriptors read from the guest in one go, for either ring */
+#define E1000_DESC_PREFETCH 32
+
 /*
  * HW models:
  *  E1000_DEV_ID_82540EM works with Windows and Linux
@@ -120,6 +124,7 @@ typedef struct E1000State_st {
         int8_t ip;
         int8_t tcp;
         char cptse;     // current packet tse bit
+        char gso;       // current TSO frame goes to the peer in one piece
     } tx;
 
     struct {
@@ -131,6 +136,31 @@ typedef struct E1000State_st {
     } eecd_state;
 
     QEMUTimer *autoneg_timer;
+
+    QEMUTimer *mit_timer;      /* Mitigation timer. */
+    bool mit_timer_on;         /* Mitigation timer is running. */
+    bool mit_irq_level;        /* Tracks interrupt pin level. */
+    uint32_t mit_ide;          /* Tracks E1000_TXD_CMD_IDE bit. */
+
+    /* The peer is a tap that takes a virtio_net_hdr with every packet */
+    bool has_vnet_hdr;
+
+    /* Receive descriptors read ahead from ring index rx_desc_head on.  The
+     * ones used since the last write back go to the guest in one go, when
+     * the interrupt is raised; within a receive batch that waits for its end.
+     */
+    struct e1000_rx_desc rx_desc[E1000_DESC_PREFETCH];
+    uint32_t rx_desc_head;
+    int rx_desc_count;
+    int rx_desc_used;
+    int rx_desc_written;
+    int rx_batch;
+    uint32_t rx_batch_cause;
+
+/* Compatibility flags for migration to/from qemu 1.3.0 and older */
+#define E1000_FLAG_MIT_BIT 0
+#define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
+    uint32_t compat_flags;
 } E1000State;
 
 #define	defreg(x)	x = (E1000_##x>>2)
@@ -145,7 +175,8 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(RDTR),	defreg(RADV),	defreg(TADV),
+    defreg(ITR),
 };
 
 static void
@@ -224,9 +255,20 @@ static const uint32_t mac_reg_init[] = {
                 E1000_MANC_RMCP_EN,
 };
 
+static inline void
+mit_update_delay(uint32_t *curr, uint32_t value)
+{
+    if (value && (*curr == 0 || value < *curr)) {
+        *curr = value;
+    }
+}
+
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    uint32_t pending_ints;
+    uint32_t mit_delay;
+
     if (val && (E1000_DEVID >= E1000_DEV_ID_82547EI_MOBILE)) {
         /* Only for 8257x */
         val |= E1000_ICR_INT_ASSERTED;
@@ -243,7 +285,51 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
      */
     s->mac_reg[ICS] = val;
 
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+    pending_ints = (s->mac_reg[IMS] & s->mac_reg[ICR]);
+    if (!s->mit_irq_level && pending_ints) {
+        /*
+         * Here we detect a potential raising edge.  We postpone raising the
+         * interrupt line if we are inside the mitigation delay window
+         * (s->mit_timer_on == 1).  Only the absolute timers are emulated:
+         * ITR in 256ns units, RADV and TADV in 1024ns units.  RDTR only
+         * enables RADV, and TADV only applies to descriptors with IDE set;
+         * the relative delays of RDTR and TIDV are not implemented.
+         */
+        if (s->mit_timer_on) {
+            return;
+        }
+        if (s->compat_flags & E1000_FLAG_MIT) {
+            mit_delay = 0;
+            if (s->mit_ide &&
+                (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
+                mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
+            }
+            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
+                mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
+            }
+            mit_update_delay(&mit_delay, s->mac_reg[ITR]);
+
+            if (mit_delay) {
+                s->mit_timer_on = 1;
+                qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) +
+                               mit_delay * 256);
+            }
+            s->mit_ide = 0;
+        }
+    }
+
+    s->mit_irq_level = (pending_ints != 0);
+    qemu_set_irq(s->dev.irq[0], s->mit_irq_level);
+}
+
+static void
+e1000_mit_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->mit_timer_on = 0;
+    /* Call set_interrupt_cause to update the irq level (if necessary). */
+    set_interrupt_cause(s, 0, s->mac_reg[ICR]);
 }
 
 static void
@@ -284,12 +370,18 @@ static void e1000_reset(void *opaque)
     int i;
 
     qemu_del_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    d->mit_timer_on = 0;
+    d->mit_irq_level = 0;
+    d->mit_ide = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
     memmove(d->mac_reg, mac_reg_init, sizeof mac_reg_init);
     d->rxbuf_min_shift = 1;
     memset(&d->tx, 0, sizeof d->tx);
+    d->rx_desc_count = d->rx_desc_used = d->rx_desc_written = 0;
+    d->rx_batch_cause = 0;
 
     if (qemu_get_queue(d->nic)->link_down) {
         e1000_link_down(d);
@@ -311,9 +403,83 @@ set_ctrl(E1000State *s, int index, uint32_t val)
     s->mac_reg[CTRL] = val & ~E1000_CTRL_RST;
 }
 
+static uint64_t rx_desc_base(E1000State *s)
+{
+    uint64_t bah = s->mac_reg[RDBAH];
+    uint64_t bal = s->mac_reg[RDBAL] & ~0xf;
+
+    return (bah << 32) + bal;
+}
+
+/* Write back the descriptors filled in since last time */
+static void e1000_rx_desc_flush(E1000State *s)
+{
+    int n = s->rx_desc_used - s->rx_desc_written;
+
+    if (n) {
+        pci_dma_write(&s->dev, rx_desc_base(s) +
+                      sizeof(struct e1000_rx_desc) *
+                      (s->rx_desc_head + s->rx_desc_written),
+                      &s->rx_desc[s->rx_desc_written],
+                      sizeof(struct e1000_rx_desc) * n);
+        s->rx_desc_written = s->rx_desc_used;
+    }
+}
+
+/* Forget the descriptors read ahead, before the ring or RDH changes */
+static void e1000_rx_desc_drop(E1000State *s)
+{
+    e1000_rx_desc_flush(s);
+    s->rx_desc_count = s->rx_desc_used = s->rx_desc_written = 0;
+}
+
+/* The descriptor at RDH, reading up to E1000_DESC_PREFETCH of them when
+ * those read so far are used up.  It only reads as far as RDT or the end of
+ * the ring, so all of them belong to the device.
+ */
+static struct e1000_rx_desc *e1000_rx_desc_next(E1000State *s)
+{
+    uint32_t rdh = s->mac_reg[RDH];
+    uint32_t ring = s->mac_reg[RDLEN] / sizeof(struct e1000_rx_desc);
+    int n = E1000_DESC_PREFETCH;
+
+    if (s->rx_desc_used == s->rx_desc_count) {
+        e1000_rx_desc_flush(s);
+        if (rdh < ring) {
+            n = MIN(n, ring - rdh);
+        } else {
+            n = 1;
+        }
+        if (s->mac_reg[RDT] > rdh) {
+            n = MIN(n, s->mac_reg[RDT] - rdh);
+        }
+        pci_dma_read(&s->dev,
+                     rx_desc_base(s) + sizeof(struct e1000_rx_desc) * rdh,
+                     s->rx_desc, sizeof(struct e1000_rx_desc) * n);
+        s->rx_desc_head = rdh;
+        s->rx_desc_count = n;
+        s->rx_desc_used = s->rx_desc_written = 0;
+    }
+    return &s->rx_desc[s->rx_desc_used++];
+}
+
+/* Write back what was received and raise @cause, or leave both for the end
+ * of the receive batch
+ */
+static void e1000_rx_interrupt(E1000State *s, uint32_t cause)
+{
+    if (s->rx_batch) {
+        s->rx_batch_cause |= cause;
+        return;
+    }
+    e1000_rx_desc_flush(s);
+    set_ics(s, 0, cause);
+}
+
 static void
 set_rx_control(E1000State *s, int index, uint32_t val)
 {
+    e1000_rx_desc_drop(s);
     s->mac_reg[RCTL] = val;
     s->rxbuf_size = rxbufsize(val);
     s->rxbuf_min_shift = ((val / E1000_RCTL_RDMTS_QUAT) & 3) + 1;
@@ -467,12 +633,23 @@ fcs_len(E1000State *s)
     return (s->mac_reg[RCTL] & E1000_RCTL_SECRC) ? 0 : 4;
 }
 
+static ssize_t e1000_receive_frame(E1000State *s, const uint8_t *buf,
+                                   size_t size);
+
 static void
 e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
 {
     NetClientState *nc = qemu_get_queue(s->nic);
+    struct virtio_net_hdr hdr = { };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (uint8_t *)buf, .iov_len = size },
+    };
+
     if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
-        nc->info->receive(nc, buf, size);
+        e1000_receive_frame(s, buf, size);
+    } else if (s->has_vnet_hdr) {
+        qemu_sendv_packet(nc, iov, 2);
     } else {
         qemu_send_packet(nc, buf, size);
     }
@@ -537,6 +714,74 @@ xmit_seg(E1000State *s)
         s->mac_reg[TOTH]++;
 }
 
+/* Whether the TSO frame starting now can go to the peer whole, leaving
+ * the segmentation to the host
+ */
+static bool
+e1000_can_gso(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    return s->has_vnet_hdr && tp->tcp && tp->mss &&
+           (tp->sum_needed & E1000_TXD_POPTS_TXSM) && !tp->vlan_needed &&
+           !(s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) &&
+           tp->hdr_len + tp->paylen < sizeof(tp->data);
+}
+
+static void
+xmit_gso(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+    NetClientState *nc = qemu_get_queue(s->nic);
+    struct virtio_net_hdr hdr = { };
+    struct iovec iov[2];
+    unsigned int css = tp->ipcss, frames, n, phsum;
+    uint16_t *sp;
+
+    if (tp->size <= tp->hdr_len + tp->mss) {
+        /* a single segment */
+        xmit_seg(s);
+        return;
+    }
+    if (!s->has_vnet_hdr) {
+        /* only after migrating in the middle of a frame */
+        DBGOUT(TXERR, "TSO frame for a peer without vnet header dropped\n");
+        return;
+    }
+
+    /* The host fills in lengths, sequence numbers and checksums for each
+     * segment, starting from the values for the whole frame
+     */
+    if (tp->ip) {
+        cpu_to_be16wu((uint16_t *)(tp->data + css + 2), tp->size - css);
+    } else {
+        cpu_to_be16wu((uint16_t *)(tp->data + css + 4), tp->size - css - 40);
+    }
+    sp = (uint16_t *)(tp->data + tp->tucso);
+    phsum = be16_to_cpup(sp) + tp->size - tp->tucss;
+    phsum = (phsum >> 16) + (phsum & 0xffff);
+    cpu_to_be16wu(sp, phsum);
+
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.gso_type = tp->ip ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+    hdr.hdr_len = tp->hdr_len;
+    hdr.gso_size = tp->mss;
+    hdr.csum_start = tp->tucss;
+    hdr.csum_offset = tp->tucso - tp->tucss;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = tp->data;
+    iov[1].iov_len = tp->size;
+    qemu_sendv_packet(nc, iov, 2);
+
+    frames = DIV_ROUND_UP(tp->size - tp->hdr_len, tp->mss);
+    s->mac_reg[TPT] += frames;
+    s->mac_reg[GPTC] += frames;
+    n = s->mac_reg[TOTL];
+    if ((s->mac_reg[TOTL] += tp->size + (frames - 1) * tp->hdr_len) < n)
+        s->mac_reg[TOTH]++;
+}
+
 static void
 process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
 {
@@ -578,6 +823,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
         // legacy descriptor
         tp->cptse = 0;
     }
+    s->mit_ide |= txd_lower & E1000_TXD_CMD_IDE;
 
     if (vlan_enabled(s) && is_vlan_txd(txd_lower) &&
         (tp->cptse || txd_lower & E1000_TXD_CMD_EOP)) {
@@ -589,7 +835,15 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     }
         
     addr = le64_to_cpu(dp->buffer_addr);
-    if (tp->tse && tp->cptse) {
+    if (tp->tse && tp->cptse && tp->size == 0) {
+        tp->gso = e1000_can_gso(s);
+    }
+    if (tp->tse && tp->cptse && tp->gso) {
+        hdr = tp->hdr_len;
+        split_size = MIN(sizeof(tp->data) - 1 - tp->size, split_size);
+        pci_dma_read(&s->dev, addr, tp->data + tp->size, split_size);
+        tp->size += split_size;
+    } else if (tp->tse && tp->cptse) {
         hdr = tp->hdr_len;
         msh = hdr + tp->mss;
         do {
@@ -620,13 +874,19 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
 
     if (!(txd_lower & E1000_TXD_CMD_EOP))
         return;
-    if (!(tp->tse && tp->cptse && tp->size < hdr))
+    if (tp->tse && tp->cptse && tp->gso) {
+        if (tp->size >= hdr) {
+            xmit_gso(s);
+        }
+    } else if (!(tp->tse && tp->cptse && tp->size < hdr)) {
         xmit_seg(s);
+    }
     tp->tso_frames = 0;
     tp->sum_needed = 0;
     tp->vlan_needed = 0;
     tp->size = 0;
     tp->cptse = 0;
+    tp->gso = 0;
 }
 
 static uint32_t
@@ -656,8 +916,10 @@ static void
 start_xmit(E1000State *s)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc descs[E1000_DESC_PREFETCH], *desc;
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    uint32_t tdh, ring;
+    int i, n;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
@@ -665,30 +927,41 @@ start_xmit(E1000State *s)
     }
 
     while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
-        base = tx_desc_base(s) +
-               sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(&s->dev, base, &desc, sizeof(desc));
-
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
-
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
-
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
-         */
-        if (s->mac_reg[TDH] == tdh_start) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+        /* read as many descriptors as there are up to TDT or the end of
+           the ring, but no more than E1000_DESC_PREFETCH */
+        tdh = s->mac_reg[TDH];
+        ring = s->mac_reg[TDLEN] / sizeof(struct e1000_tx_desc);
+        n = tdh < ring ? MIN(E1000_DESC_PREFETCH, ring - tdh) : 1;
+        if (s->mac_reg[TDT] > tdh) {
+            n = MIN(n, s->mac_reg[TDT] - tdh);
+        }
+        base = tx_desc_base(s) + sizeof(struct e1000_tx_desc) * tdh;
+        pci_dma_read(&s->dev, base, descs, sizeof(descs[0]) * n);
+
+        for (i = 0; i < n; i++) {
+            desc = &descs[i];
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)desc->buffer_addr, desc->lower.data,
+                   desc->upper.data);
+
+            process_tx_desc(s, desc);
+            cause |= txdesc_writeback(s, base + sizeof(*desc) * i, desc);
+
+            if (++s->mac_reg[TDH] * sizeof(*desc) >= s->mac_reg[TDLEN])
+                s->mac_reg[TDH] = 0;
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                goto out;
+            }
         }
     }
+out:
     set_ics(s, 0, cause);
 }
 
@@ -788,20 +1061,10 @@ e1000_can_receive(NetClientState *nc)
         (s->mac_reg[RCTL] & E1000_RCTL_EN) && e1000_has_rxbufs(s, 1);
 }
 
-static uint64_t rx_desc_base(E1000State *s)
-{
-    uint64_t bah = s->mac_reg[RDBAH];
-    uint64_t bal = s->mac_reg[RDBAL] & ~0xf;
-
-    return (bah << 32) + bal;
-}
-
 static ssize_t
-e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+e1000_receive_frame(E1000State *s, const uint8_t *buf, size_t size)
 {
-    E1000State *s = qemu_get_nic_opaque(nc);
-    struct e1000_rx_desc desc;
-    dma_addr_t base;
+    struct e1000_rx_desc *desc;
     unsigned int n, rdt;
     uint32_t rdh_start;
     uint16_t vlan_special = 0;
@@ -850,7 +1113,7 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
     desc_offset = 0;
     total_size = size + fcs_len(s);
     if (!e1000_has_rxbufs(s, total_size)) {
-            set_ics(s, 0, E1000_ICS_RXO);
+            e1000_rx_interrupt(s, E1000_ICS_RXO);
             return -1;
     }
     do {
@@ -858,40 +1121,38 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         if (desc_size > s->rxbuf_size) {
             desc_size = s->rxbuf_size;
         }
-        base = rx_desc_base(s) + sizeof(desc) * s->mac_reg[RDH];
-        pci_dma_read(&s->dev, base, &desc, sizeof(desc));
-        desc.special = vlan_special;
-        desc.status |= (vlan_status | E1000_RXD_STAT_DD);
-        if (desc.buffer_addr) {
+        desc = e1000_rx_desc_next(s);
+        desc->special = vlan_special;
+        desc->status |= (vlan_status | E1000_RXD_STAT_DD);
+        if (desc->buffer_addr) {
             if (desc_offset < size) {
                 size_t copy_size = size - desc_offset;
                 if (copy_size > s->rxbuf_size) {
                     copy_size = s->rxbuf_size;
                 }
-                pci_dma_write(&s->dev, le64_to_cpu(desc.buffer_addr),
+                pci_dma_write(&s->dev, le64_to_cpu(desc->buffer_addr),
                               buf + desc_offset + vlan_offset, copy_size);
             }
             desc_offset += desc_size;
-            desc.length = cpu_to_le16(desc_size);
+            desc->length = cpu_to_le16(desc_size);
             if (desc_offset >= total_size) {
-                desc.status |= E1000_RXD_STAT_EOP | E1000_RXD_STAT_IXSM;
+                desc->status |= E1000_RXD_STAT_EOP | E1000_RXD_STAT_IXSM;
             } else {
                 /* Guest zeroing out status is not a hardware requirement.
                    Clear EOP in case guest didn't do it. */
-                desc.status &= ~E1000_RXD_STAT_EOP;
+                desc->status &= ~E1000_RXD_STAT_EOP;
             }
         } else { // as per intel docs; skip descriptors with null buf addr
             DBGOUT(RX, "Null RX descriptor!!\n");
         }
-        pci_dma_write(&s->dev, base, &desc, sizeof(desc));
 
-        if (++s->mac_reg[RDH] * sizeof(desc) >= s->mac_reg[RDLEN])
+        if (++s->mac_reg[RDH] * sizeof(*desc) >= s->mac_reg[RDLEN])
             s->mac_reg[RDH] = 0;
         /* see comment in start_xmit; same here */
         if (s->mac_reg[RDH] == rdh_start) {
             DBGOUT(RXERR, "RDH wraparound @%x, RDT %x, RDLEN %x\n",
                    rdh_start, s->mac_reg[RDT], s->mac_reg[RDLEN]);
-            set_ics(s, 0, E1000_ICS_RXO);
+            e1000_rx_interrupt(s, E1000_ICS_RXO);
             return -1;
         }
     } while (desc_offset < total_size);
@@ -909,16 +1170,56 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 
     n = E1000_ICS_RXT0;
     if ((rdt = s->mac_reg[RDT]) < s->mac_reg[RDH])
-        rdt += s->mac_reg[RDLEN] / sizeof(desc);
-    if (((rdt - s->mac_reg[RDH]) * sizeof(desc)) <= s->mac_reg[RDLEN] >>
+        rdt += s->mac_reg[RDLEN] / sizeof(*desc);
+    if (((rdt - s->mac_reg[RDH]) * sizeof(*desc)) <= s->mac_reg[RDLEN] >>
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
-    set_ics(s, 0, n);
+    e1000_rx_interrupt(s, n);
 
     return size;
 }
 
+static ssize_t
+e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    E1000State *s = qemu_get_nic_opaque(nc);
+    ssize_t ret;
+
+    /* No offloads are enabled on the tap, so the header says nothing */
+    if (s->has_vnet_hdr) {
+        if (size < sizeof(struct virtio_net_hdr)) {
+            return size;
+        }
+        ret = e1000_receive_frame(s, buf + sizeof(struct virtio_net_hdr),
+                                  size - sizeof(struct virtio_net_hdr));
+        return ret < 0 ? ret : size;
+    }
+    return e1000_receive_frame(s, buf, size);
+}
+
+static void
+e1000_receive_batch(NetClientState *nc, bool start)
+{
+    E1000State *s = qemu_get_nic_opaque(nc);
+    uint32_t cause;
+
+    if (start) {
+        s->rx_batch++;
+        return;
+    }
+
+    assert(s->rx_batch > 0);
+    if (--s->rx_batch == 0) {
+        e1000_rx_desc_flush(s);
+        cause = s->rx_batch_cause;
+        s->rx_batch_cause = 0;
+        if (cause) {
+            set_ics(s, 0, cause);
+        }
+    }
+}
+
 static uint32_t
 mac_readreg(E1000State *s, int index)
 {
@@ -981,6 +1282,19 @@ set_dlen(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xfff80;
 }
 
+static void
+set_rx_ring(E1000State *s, int index, uint32_t val)
+{
+    e1000_rx_desc_drop(s);
+    if (index == RDLEN) {
+        set_dlen(s, index, val);
+    } else if (index == RDH) {
+        set_16bit(s, index, val);
+    } else {
+        s->mac_reg[index] = val;
+    }
+}
+
 static void
 set_tctl(E1000State *s, int index, uint32_t val)
 {
@@ -1018,7 +1332,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(RDTR),	getreg(RADV),
+    getreg(TADV),	getreg(ITR),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -1033,13 +1348,16 @@ enum { NREADOPS = ARRAY_SIZE(macreg_readops) };
 #define putreg(x)	[x] = mac_writereg
 static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     putreg(PBA),	putreg(EERD),	putreg(SWSM),	putreg(WUFC),
-    putreg(TDBAL),	putreg(TDBAH),	putreg(TXDCTL),	putreg(RDBAH),
-    putreg(RDBAL),	putreg(LEDCTL), putreg(VET),
-    [TDLEN] = set_dlen,	[RDLEN] = set_dlen,	[TCTL] = set_tctl,
+    putreg(TDBAL),	putreg(TDBAH),	putreg(TXDCTL),	putreg(LEDCTL),
+    putreg(VET),
+    [RDBAL] = set_rx_ring, [RDBAH] = set_rx_ring, [RDLEN] = set_rx_ring,
+    [RDH] = set_rx_ring, [TDLEN] = set_dlen,	[TCTL] = set_tctl,
     [TDT] = set_tctl,	[MDIC] = set_mdic,	[ICS] = set_ics,
-    [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
+    [TDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
+    [RDTR] = set_16bit,	[RADV] = set_16bit,	[TADV] = set_16bit,
+    [ITR] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1148,9 +1466,45 @@ static int e1000_post_load(void *opaque, int version_id)
         qemu_mod_timer(s->autoneg_timer, qemu_get_clock_ms(vm_clock) + 500);
     }
 
+    if (!(s->compat_flags & E1000_FLAG_MIT)) {
+        s->mac_reg[ITR] = s->mac_reg[RDTR] = s->mac_reg[RADV] =
+            s->mac_reg[TADV] = 0;
+        s->mit_irq_level = false;
+    }
+    /* Redo the interrupt state, and read the ring afresh */
+    s->mit_ide = 0;
+    s->rx_desc_count = s->rx_desc_used = s->rx_desc_written = 0;
+    s->mit_timer_on = true;
+    qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) + 1);
+
+    /* A frame only grows past one segment when it goes out whole */
+    s->tx.gso = s->tx.size > s->tx.hdr_len + s->tx.mss;
+
     return 0;
 }
 
+static bool e1000_mit_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->compat_flags & E1000_FLAG_MIT;
+}
+
+static const VMStateDescription vmstate_e1000_mit_state = {
+    .name = "e1000/mit_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields    = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_BOOL(mit_irq_level, E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
@@ -1228,6 +1582,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_e1000_mit_state,
+            .needed = e1000_mit_state_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1275,8 +1637,15 @@ pci_e1000_uninit(PCIDevice *dev)
 {
     E1000State *d = DO_UPCAST(E1000State, dev, dev);
 
+    NetClientState *nc = qemu_get_queue(d->nic);
+
     qemu_del_timer(d->autoneg_timer);
     qemu_free_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    qemu_free_timer(d->mit_timer);
+    if (d->has_vnet_hdr && nc->peer) {
+        tap_using_vnet_hdr(nc->peer, false);
+    }
     memory_region_destroy(&d->mmio);
     memory_region_destroy(&d->io);
     qemu_del_nic(d->nic);
@@ -1287,6 +1656,7 @@ static NetClientInfo net_e1000_info = {
     .size = sizeof(NICState),
     .can_receive = e1000_can_receive,
     .receive = e1000_receive,
+    .receive_batch = e1000_receive_batch,
     .cleanup = e1000_cleanup,
     .link_status_changed = e1000_set_link_status,
 };
@@ -1298,6 +1668,7 @@ static int pci_e1000_init(PCIDevice *pci_dev)
     uint16_t checksum = 0;
     int i;
     uint8_t *macaddr;
+    NetClientState *nc;
 
     pci_conf = d->dev.config;
 
@@ -1328,9 +1699,19 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     qemu_format_nic_info_str(qemu_get_queue(d->nic), macaddr);
 
+    /* With a vnet header, TSO frames can be left for the host to segment */
+    nc = qemu_get_queue(d->nic);
+    if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_TAP &&
+        tap_has_vnet_hdr(nc->peer) &&
+        tap_has_vnet_hdr_len(nc->peer, sizeof(struct virtio_net_hdr))) {
+        tap_using_vnet_hdr(nc->peer, true);
+        d->has_vnet_hdr = true;
+    }
+
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
     d->autoneg_timer = qemu_new_timer_ms(vm_clock, e1000_autoneg_timer, d);
+    d->mit_timer = qemu_new_timer_ns(vm_clock, e1000_mit_timer, d);
 
     return 0;
 }
@@ -1343,6 +1724,8 @@ static void qdev_e1000_reset(DeviceState *dev)
 
 static Property e1000_properties[] = {
     DEFINE_NIC_PROPERTIES(E1000State, conf),
+    DEFINE_PROP_BIT("mitigation", E1000State,
+                    compat_flags, E1000_FLAG_MIT_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -29,25 +29,33 @@
 #include "trace.h"
 #include "qemu/error-report.h"
 #include "qemu/config-file.h"
+#include "sysemu/dma.h"
 
 #define FW_CFG_SIZE 2
 #define FW_CFG_DATA_SIZE 1
+#define FW_CFG_DMA_SIZE 8
 
 typedef struct FWCfgEntry {
     uint32_t len;
     uint8_t *data;
     void *callback_opaque;
     FWCfgCallback callback;
+    void *read_callback_opaque;
+    FWCfgReadCallback read_callback;
 } FWCfgEntry;
 
 struct FWCfgState {
     SysBusDevice busdev;
-    MemoryRegion ctl_iomem, data_iomem, comb_iomem;
-    uint32_t ctl_iobase, data_iobase;
+    MemoryRegion ctl_iomem, data_iomem, comb_iomem, dma_iomem;
+    uint32_t ctl_iobase, data_iobase, dma_iobase;
+#define FW_CFG_FLAG_DMA_BIT 0
+#define FW_CFG_FLAG_DMA (1 << FW_CFG_FLAG_DMA_BIT)
+    uint32_t compat_flags;
     FWCfgEntry entries[2][FW_CFG_MAX_ENTRY];
     FWCfgFiles *files;
     uint16_t cur_entry;
     uint32_t cur_offset;
+    uint64_t dma_addr;
     Notifier machine_ready;
 };
 
@@ -240,6 +248,9 @@ static uint8_t fw_cfg_read(FWCfgState *s)
     FWCfgEntry *e = &s->entries[arch][s->cur_entry & FW_CFG_ENTRY_MASK];
     uint8_t ret;
 
+    if (s->cur_entry != FW_CFG_INVALID && !e->data && e->read_callback) {
+        e->data = e->read_callback(e->read_callback_opaque);
+    }
     if (s->cur_entry == FW_CFG_INVALID || !e->data || s->cur_offset >= e->len)
         ret = 0;
     else
@@ -249,6 +260,109 @@ static uint8_t fw_cfg_read(FWCfgState *s)
     return ret;
 }
 
+/*
+ * Copy the selected item to guest memory as described by the FWCfgDmaAccess
+ * at s->dma_addr, replacing one port access per byte with one exit.  Like
+ * the data port, reading past the end of the item gives zeroes.
+ */
+static void fw_cfg_dma_transfer(FWCfgState *s)
+{
+    FWCfgDmaAccess dma;
+    FWCfgEntry *e;
+    dma_addr_t dma_addr, len;
+    uint32_t control;
+    int arch;
+
+    /* The next access starts with a fresh address */
+    dma_addr = s->dma_addr;
+    s->dma_addr = 0;
+
+    if (dma_memory_read(&dma_context_memory, dma_addr, &dma, sizeof(dma))) {
+        stl_be_dma(&dma_context_memory,
+                   dma_addr + offsetof(FWCfgDmaAccess, control),
+                   FW_CFG_DMA_CTL_ERROR);
+        return;
+    }
+
+    dma.control = be32_to_cpu(dma.control);
+    dma.length = be32_to_cpu(dma.length);
+    dma.address = be64_to_cpu(dma.address);
+    trace_fw_cfg_dma_transfer(s, dma_addr, dma.control, dma.length);
+
+    if (dma.control & FW_CFG_DMA_CTL_SELECT) {
+        fw_cfg_select(s, dma.control >> 16);
+    }
+    if (!(dma.control & (FW_CFG_DMA_CTL_READ | FW_CFG_DMA_CTL_SKIP))) {
+        dma.length = 0;
+    }
+
+    arch = !!(s->cur_entry & FW_CFG_ARCH_LOCAL);
+    e = &s->entries[arch][s->cur_entry & FW_CFG_ENTRY_MASK];
+    if (s->cur_entry != FW_CFG_INVALID && !e->data && e->read_callback) {
+        e->data = e->read_callback(e->read_callback_opaque);
+    }
+
+    control = 0;
+    while (dma.length > 0 && !(control & FW_CFG_DMA_CTL_ERROR)) {
+        bool read = dma.control & FW_CFG_DMA_CTL_READ;
+
+        if (s->cur_entry == FW_CFG_INVALID || !e->data ||
+            s->cur_offset >= e->len) {
+            len = dma.length;
+            if (read && dma_memory_set(&dma_context_memory, dma.address,
+                                       0, len)) {
+                control |= FW_CFG_DMA_CTL_ERROR;
+            }
+        } else {
+            len = MIN(dma.length, e->len - s->cur_offset);
+            if (read && dma_memory_write(&dma_context_memory, dma.address,
+                                         &e->data[s->cur_offset], len)) {
+                control |= FW_CFG_DMA_CTL_ERROR;
+            }
+            s->cur_offset += len;
+        }
+
+        dma.address += len;
+        dma.length -= len;
+    }
+
+    stl_be_dma(&dma_context_memory,
+               dma_addr + offsetof(FWCfgDmaAccess, control), control);
+}
+
+static uint64_t fw_cfg_dma_mem_read(void *opaque, hwaddr addr,
+                                    unsigned size)
+{
+    /* Lets the firmware probe for the register at any access size */
+    return extract64(FW_CFG_DMA_SIGNATURE, (8 - addr - size) * 8, size * 8);
+}
+
+static void fw_cfg_dma_mem_write(void *opaque, hwaddr addr,
+                                 uint64_t value, unsigned size)
+{
+    FWCfgState *s = opaque;
+
+    /* Writing the low half of the address starts the transfer */
+    if (size == 4) {
+        if (addr == 0) {
+            s->dma_addr = value << 32;
+        } else if (addr == 4) {
+            s->dma_addr |= value;
+            fw_cfg_dma_transfer(s);
+        }
+    } else if (size == 8 && addr == 0) {
+        s->dma_addr = value;
+        fw_cfg_dma_transfer(s);
+    }
+}
+
+static bool fw_cfg_dma_mem_valid(void *opaque, hwaddr addr,
+                                 unsigned size, bool is_write)
+{
+    return !is_write || (size == 4 && (addr == 0 || addr == 4)) ||
+           (size == 8 && addr == 0);
+}
+
 static uint64_t fw_cfg_data_mem_read(void *opaque, hwaddr addr,
                                      unsigned size)
 {
@@ -321,11 +435,23 @@ static const MemoryRegionOps fw_cfg_comb_mem_ops = {
     .valid.accepts = fw_cfg_comb_valid,
 };
 
+static const MemoryRegionOps fw_cfg_dma_mem_ops = {
+    .read = fw_cfg_dma_mem_read,
+    .write = fw_cfg_dma_mem_write,
+    .endianness = DEVICE_BIG_ENDIAN,
+    .valid = {
+        .accepts = fw_cfg_dma_mem_valid,
+        .max_access_size = 8,
+    },
+    .impl.max_access_size = 8,
+};
+
 static void fw_cfg_reset(DeviceState *d)
 {
     FWCfgState *s = DO_UPCAST(FWCfgState, busdev.qdev, d);
 
     fw_cfg_select(s, 0);
+    s->dma_addr = 0;
 }
 
 /* Save restore 32 bit int as uint16_t
@@ -361,6 +487,25 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+/* Only between the two halves of an address written with 32-bit accesses */
+static bool fw_cfg_dma_addr_needed(void *opaque)
+{
+    FWCfgState *s = opaque;
+
+    return s->dma_addr != 0;
+}
+
+static const VMStateDescription vmstate_fw_cfg_dma = {
+    .name = "fw_cfg/dma",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT64(dma_addr, FWCfgState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_fw_cfg = {
     .name = "fw_cfg",
     .version_id = 2,
@@ -371,6 +516,14 @@ static const VMStateDescription vmstate_fw_cfg = {
         VMSTATE_UINT16_HACK(cur_offset, FWCfgState, is_version_1),
         VMSTATE_UINT32_V(cur_offset, FWCfgState, 2),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_fw_cfg_dma,
+            .needed = fw_cfg_dma_addr_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -437,8 +590,9 @@ void fw_cfg_add_callback(FWCfgState *s, uint16_t key, FWCfgCallback callback,
     s->entries[arch][key].callback = callback;
 }
 
-void fw_cfg_add_file(FWCfgState *s,  const char *filename,
-                     void *data, size_t len)
+static void fw_cfg_add_file_entry(FWCfgState *s, const char *filename,
+                                  void *data, FWCfgReadCallback read_callback,
+                                  void *read_callback_opaque, size_t len)
 {
     int i, index;
     size_t dsize;
@@ -453,6 +607,9 @@ void fw_cfg_add_file(FWCfgState *s,  const char *filename,
     assert(index < FW_CFG_FILE_SLOTS);
 
     fw_cfg_add_bytes(s, FW_CFG_FILE_FIRST + index, data, len);
+    s->entries[0][FW_CFG_FILE_FIRST + index].read_callback = read_callback;
+    s->entries[0][FW_CFG_FILE_FIRST + index].read_callback_opaque =
+        read_callback_opaque;
 
     pstrcpy(s->files->f[index].name, sizeof(s->files->f[index].name),
             filename);
@@ -470,6 +627,19 @@ void fw_cfg_add_file(FWCfgState *s,  const char *filename,
     s->files->count = cpu_to_be32(index+1);
 }
 
+void fw_cfg_add_file(FWCfgState *s,  const char *filename,
+                     void *data, size_t len)
+{
+    fw_cfg_add_file_entry(s, filename, data, NULL, NULL, len);
+}
+
+void fw_cfg_add_file_callback(FWCfgState *s, const char *filename,
+                              FWCfgReadCallback callback,
+                              void *callback_opaque, size_t len)
+{
+    fw_cfg_add_file_entry(s, filename, NULL, callback, callback_opaque, len);
+}
+
 static void fw_cfg_machine_ready(struct Notifier *n, void *data)
 {
     size_t len;
@@ -480,15 +650,17 @@ static void fw_cfg_machine_ready(struct Notifier *n, void *data)
 }
 
 FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
-                        hwaddr ctl_addr, hwaddr data_addr)
+                        uint32_t dma_port, hwaddr ctl_addr, hwaddr data_addr)
 {
     DeviceState *dev;
     SysBusDevice *d;
     FWCfgState *s;
+    uint32_t version = FW_CFG_VERSION;
 
     dev = qdev_create(NULL, "fw_cfg");
     qdev_prop_set_uint32(dev, "ctl_iobase", ctl_port);
     qdev_prop_set_uint32(dev, "data_iobase", data_port);
+    qdev_prop_set_uint32(dev, "dma_iobase", dma_port);
     qdev_init_nofail(dev);
     d = SYS_BUS_DEVICE(dev);
 
@@ -500,7 +672,11 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     if (data_addr) {
         sysbus_mmio_map(d, 1, data_addr);
     }
+    if (s->dma_iobase && (s->compat_flags & FW_CFG_FLAG_DMA)) {
+        version |= FW_CFG_VERSION_DMA;
+    }
     fw_cfg_add_bytes(s, FW_CFG_SIGNATURE, (char *)"QEMU", 4);
+    fw_cfg_add_i32(s, FW_CFG_ID, version);
     fw_cfg_add_bytes(s, FW_CFG_UUID, qemu_uuid, 16);
     fw_cfg_add_i16(s, FW_CFG_NOGRAPHIC, (uint16_t)(display_type == DT_NOGRAPHIC));
     fw_cfg_add_i16(s, FW_CFG_NB_CPUS, (uint16_t)smp_cpus);
@@ -527,6 +703,8 @@ static int fw_cfg_init1(SysBusDevice *dev)
     /* In case ctl and data overlap: */
     memory_region_init_io(&s->comb_iomem, &fw_cfg_comb_mem_ops, s,
                           "fwcfg", FW_CFG_SIZE);
+    memory_region_init_io(&s->dma_iomem, &fw_cfg_dma_mem_ops, s,
+                          "fwcfg.dma", FW_CFG_DMA_SIZE);
 
     if (s->ctl_iobase + 1 == s->data_iobase) {
         sysbus_add_io(dev, s->ctl_iobase, &s->comb_iomem);
@@ -538,12 +716,18 @@ static int fw_cfg_init1(SysBusDevice *dev)
             sysbus_add_io(dev, s->data_iobase, &s->data_iomem);
         }
     }
+    if (s->dma_iobase && (s->compat_flags & FW_CFG_FLAG_DMA)) {
+        sysbus_add_io(dev, s->dma_iobase, &s->dma_iomem);
+    }
     return 0;
 }
 
 static Property fw_cfg_properties[] = {
     DEFINE_PROP_HEX32("ctl_iobase", FWCfgState, ctl_iobase, -1),
     DEFINE_PROP_HEX32("data_iobase", FWCfgState, data_iobase, -1),
+    DEFINE_PROP_HEX32("dma_iobase", FWCfgState, dma_iobase, 0),
+    DEFINE_PROP_BIT("dma_enabled", FWCfgState, compat_flags,
+                    FW_CFG_FLAG_DMA_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -56,6 +56,9 @@ typedef struct HPETTimer {  /* timers */
     uint8_t wrap_flag;      /* timer pop will indicate wrap for one-shot 32-bit
                              * mode. Next pop will be actual timer expiration.
                              */
+    uint8_t lazy;           /* interrupt disabled, so no host timer is armed;
+                             * a periodic cmp is brought up to date on access
+                             */
 } HPETTimer;
 
 typedef struct HPETState {
@@ -205,12 +208,19 @@ static void update_irq(struct HPETTimer *timer, int set)
     }
 }
 
+static void hpet_sync_lazy_timer(HPETTimer *t);
+
 static void hpet_pre_save(void *opaque)
 {
     HPETState *s = opaque;
+    int i;
 
     /* save current counter value */
     s->hpet_counter = hpet_get_ticks(s);
+
+    for (i = 0; i < s->num_timers; i++) {
+        hpet_sync_lazy_timer(&s->timer[i]);
+    }
 }
 
 static int hpet_pre_load(void *opaque)
@@ -225,10 +235,18 @@ static int hpet_pre_load(void *opaque)
 static int hpet_post_load(void *opaque, int version_id)
 {
     HPETState *s = opaque;
+    int i;
 
     /* Recalculate the offset between the main counter and guest time */
     s->hpet_offset = ticks_to_ns(s->hpet_counter) - qemu_get_clock_ns(vm_clock);
 
+    /* Timers that were not armed because their interrupt is disabled */
+    for (i = 0; i < s->num_timers; i++) {
+        HPETTimer *t = &s->timer[i];
+
+        t->lazy = hpet_enabled(s) && !timer_enabled(t) && t->cmp != ~0ULL;
+    }
+
     /* Push number of timers into capability returned via HPET_ID */
     s->capability &= ~HPET_ID_NUM_TIM_MASK;
     s->capability |= (s->num_timers - 1) << HPET_ID_NUM_TIM_SHIFT;
@@ -307,6 +325,27 @@ static const VMStateDescription vmstate_hpet = {
 /*
  * timer expiration callback
  */
+/* Move a periodic comparator to the first period not before cur_tick.
+ * Ticks missed because the host timer fired late, or because none was
+ * armed, are skipped in one go.
+ */
+static void hpet_advance_cmp(HPETTimer *t, uint64_t cur_tick)
+{
+    uint64_t period = t->period;
+
+    if (t->config & HPET_TN_32BIT) {
+        if (hpet_time_after(cur_tick, t->cmp)) {
+            uint64_t d = (uint32_t)(cur_tick - t->cmp);
+            t->cmp = (uint32_t)(t->cmp + (d + period - 1) / period * period);
+        }
+    } else {
+        if (hpet_time_after64(cur_tick, t->cmp)) {
+            uint64_t d = cur_tick - t->cmp;
+            t->cmp += (d + period - 1) / period * period;
+        }
+    }
+}
+
 static void hpet_timer(void *opaque)
 {
     HPETTimer *t = opaque;
@@ -316,15 +355,7 @@ static void hpet_timer(void *opaque)
     uint64_t cur_tick = hpet_get_ticks(t->state);
 
     if (timer_is_periodic(t) && period != 0) {
-        if (t->config & HPET_TN_32BIT) {
-            while (hpet_time_after(cur_tick, t->cmp)) {
-                t->cmp = (uint32_t)(t->cmp + t->period);
-            }
-        } else {
-            while (hpet_time_after64(cur_tick, t->cmp)) {
-                t->cmp += period;
-            }
-        }
+        hpet_advance_cmp(t, cur_tick);
         diff = hpet_calculate_diff(t, cur_tick);
         qemu_mod_timer(t->qemu_timer,
                        qemu_get_clock_ns(vm_clock) + (int64_t)ticks_to_ns(diff));
@@ -339,12 +370,32 @@ static void hpet_timer(void *opaque)
     update_irq(t, 1);
 }
 
+/* Bring the comparator of a timer without a host timer up to date */
+static void hpet_sync_lazy_timer(HPETTimer *t)
+{
+    if (t->lazy && timer_is_periodic(t) && t->period != 0) {
+        hpet_advance_cmp(t, hpet_get_ticks(t->state));
+    }
+}
+
 static void hpet_set_timer(HPETTimer *t)
 {
     uint64_t diff;
     uint32_t wrap_diff;  /* how many ticks until we wrap? */
     uint64_t cur_tick = hpet_get_ticks(t->state);
 
+    /* With the interrupt disabled the expiry has no visible effect other
+     * than a periodic comparator moving on, which hpet_ram_read() derives.
+     * This saves guests that park timers this way a host wakeup per period.
+     */
+    if (!timer_enabled(t)) {
+        qemu_del_timer(t->qemu_timer);
+        t->lazy = 1;
+        return;
+    }
+    hpet_sync_lazy_timer(t);
+    t->lazy = 0;
+
     /* whenever new timer is being set up, make sure wrap_flag is 0 */
     t->wrap_flag = 0;
     diff = hpet_calculate_diff(t, cur_tick);
@@ -365,6 +416,8 @@ static void hpet_set_timer(HPETTimer *t)
 
 static void hpet_del_timer(HPETTimer *t)
 {
+    hpet_sync_lazy_timer(t);
+    t->lazy = 0;
     qemu_del_timer(t->qemu_timer);
     update_irq(t, 0);
 }
@@ -404,12 +457,12 @@ static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
         switch ((addr - 0x100) % 0x20) {
         case HPET_TN_CFG:
             return timer->config;
+        case HPET_TN_CMP:
+        case HPET_TN_CMP + 4:
+            hpet_sync_lazy_timer(timer);
+            return (addr & 4) ? timer->cmp >> 32 : timer->cmp;
         case HPET_TN_CFG + 4: // Interrupt capabilities
             return timer->config >> 32;
-        case HPET_TN_CMP: // comparator register
-            return timer->cmp;
-        case HPET_TN_CMP + 4:
-            return timer->cmp >> 32;
         case HPET_TN_ROUTE:
             return timer->fsb;
         case HPET_TN_ROUTE + 4:
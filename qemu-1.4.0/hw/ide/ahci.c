@@ -30,6 +30,7 @@
 #include "monitor/monitor.h"
 #include "sysemu/dma.h"
 #include "exec/cpu-common.h"
+#include "qemu/timer.h"
 #include "internal.h"
 #include <hw/ide/pci.h>
 #include <hw/ide/ahci.h>
@@ -140,8 +141,21 @@ static void ahci_irq_lower(AHCIState *s, AHCIDevice *dev)
     }
 }
 
+/* The HOST_IRQ_STAT bit of the CCC interrupt, the first unimplemented port */
+static int ahci_ccc_int(AHCIState *s)
+{
+    return (s->control_regs.ccc_ctl >> HOST_CCC_CTL_INT_SHIFT) & 0x1f;
+}
+
+static bool ahci_ccc_port(AHCIState *s, int port)
+{
+    return (s->control_regs.ccc_ctl & HOST_CCC_CTL_EN) &&
+           (s->control_regs.ccc_ports & (1 << port));
+}
+
 static void ahci_check_irq(AHCIState *s)
 {
+    uint32_t pending;
     int i;
 
     DPRINTF(-1, "check irq %#x\n", s->control_regs.irqstatus);
@@ -149,10 +163,19 @@ static void ahci_check_irq(AHCIState *s)
     s->control_regs.irqstatus = 0;
     for (i = 0; i < s->ports; i++) {
         AHCIPortRegs *pr = &s->dev[i].port_regs;
-        if (pr->irq_stat & pr->irq_mask) {
+
+        pending = pr->irq_stat & pr->irq_mask;
+        if (ahci_ccc_port(s, i)) {
+            /* command completions only interrupt through CCC */
+            pending &= ~PORT_IRQ_STAT_CCC;
+        }
+        if (pending) {
             s->control_regs.irqstatus |= (1 << i);
         }
     }
+    if (s->ccc_pending) {
+        s->control_regs.irqstatus |= (1 << ahci_ccc_int(s));
+    }
 
     if (s->control_regs.irqstatus &&
         (s->control_regs.ghc & HOST_CTL_IRQ_EN)) {
@@ -162,6 +185,44 @@ static void ahci_check_irq(AHCIState *s)
     }
 }
 
+static void ahci_ccc_fire(AHCIState *s)
+{
+    s->ccc_pending = true;
+    s->ccc_completed = 0;
+    qemu_del_timer(s->ccc_timer);
+}
+
+static void ahci_ccc_timer_cb(void *opaque)
+{
+    AHCIState *s = opaque;
+
+    if (s->ccc_completed) {
+        ahci_ccc_fire(s);
+        ahci_check_irq(s);
+    }
+}
+
+/* A command finished on port @d: with coalescing, interrupt once CC commands
+ * have completed, or TV ms after the first of them, whichever comes first.
+ */
+static void ahci_ccc_complete(AHCIState *s, AHCIDevice *d)
+{
+    uint32_t ctl = s->control_regs.ccc_ctl;
+    uint32_t cc = (ctl >> HOST_CCC_CTL_CC_SHIFT) & 0xff;
+    uint32_t tv = ctl >> HOST_CCC_CTL_TV_SHIFT;
+
+    if (!ahci_ccc_port(s, d->port_no)) {
+        return;
+    }
+
+    s->ccc_completed++;
+    if (cc && s->ccc_completed >= cc) {
+        ahci_ccc_fire(s);
+    } else if (!qemu_timer_pending(s->ccc_timer)) {
+        qemu_mod_timer(s->ccc_timer, qemu_get_clock_ms(vm_clock) + tv);
+    }
+}
+
 static void ahci_trigger_irq(AHCIState *s, AHCIDevice *d,
                              int irq_type)
 {
@@ -169,6 +230,10 @@ static void ahci_trigger_irq(AHCIState *s, AHCIDevice *d,
             irq_type, d->port_regs.irq_mask & irq_type);
 
     d->port_regs.irq_stat |= irq_type;
+    /* a D2H FIS ends a command, an SDB FIS ends an NCQ tag */
+    if (irq_type & (PORT_IRQ_STAT_DHRS | PORT_IRQ_STAT_SDBS)) {
+        ahci_ccc_complete(s, d);
+    }
     ahci_check_irq(s);
 }
 
@@ -302,6 +367,12 @@ static uint64_t ahci_mem_read(void *opaque, hwaddr addr,
         case HOST_VERSION:
             val = s->control_regs.version;
             break;
+        case HOST_CCC_CTL:
+            val = s->control_regs.ccc_ctl;
+            break;
+        case HOST_CCC_PORTS:
+            val = s->control_regs.ccc_ports;
+            break;
         }
 
         DPRINTF(-1, "(addr 0x%08X), val 0x%08X\n", (unsigned) addr, val);
@@ -317,6 +388,31 @@ static uint64_t ahci_mem_read(void *opaque, hwaddr addr,
 
 
 
+static uint32_t ahci_ccc_ctl_reset_value(AHCIState *s)
+{
+    return (1 << HOST_CCC_CTL_TV_SHIFT) | (1 << HOST_CCC_CTL_CC_SHIFT) |
+           ((s->ports & 0x1f) << HOST_CCC_CTL_INT_SHIFT);
+}
+
+static void ahci_set_ccc_ctl(AHCIState *s, uint32_t val)
+{
+    uint32_t ctl = s->control_regs.ccc_ctl;
+
+    if (!(s->control_regs.cap & HOST_CAP_CCC)) {
+        return;
+    }
+
+    ctl &= 0x1f << HOST_CCC_CTL_INT_SHIFT;
+    ctl |= val & ~(0x7f << 1);
+    if (!(ctl & HOST_CCC_CTL_EN)) {
+        /* completions counted so far are flushed through their ports */
+        s->ccc_completed = 0;
+        qemu_del_timer(s->ccc_timer);
+    }
+    s->control_regs.ccc_ctl = ctl;
+    ahci_check_irq(s);
+}
+
 static void ahci_mem_write(void *opaque, hwaddr addr,
                            uint64_t val, unsigned size)
 {
@@ -346,6 +442,9 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
                 }
                 break;
             case HOST_IRQ_STAT: /* R/WC, RO */
+                if (val & (1 << ahci_ccc_int(s))) {
+                    s->ccc_pending = false;
+                }
                 s->control_regs.irqstatus &= ~val;
                 ahci_check_irq(s);
                 break;
@@ -355,6 +454,15 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
             case HOST_VERSION: /* RO */
                 /* FIXME report write? */
                 break;
+            case HOST_CCC_CTL: /* R/W, INT RO */
+                ahci_set_ccc_ctl(s, val);
+                break;
+            case HOST_CCC_PORTS: /* R/W */
+                if (s->control_regs.cap & HOST_CAP_CCC) {
+                    s->control_regs.ccc_ports = val & s->control_regs.impl;
+                    ahci_check_irq(s);
+                }
+                break;
             default:
                 DPRINTF(-1, "write to unknown register 0x%x\n", (unsigned)addr);
         }
@@ -418,6 +526,10 @@ static void ahci_reg_init(AHCIState *s)
                           (AHCI_NUM_COMMAND_SLOTS << 8) |
                           (AHCI_SUPPORTED_SPEED_GEN1 << AHCI_SUPPORTED_SPEED) |
                           HOST_CAP_NCQ | HOST_CAP_AHCI;
+    if (s->ports < AHCI_MAX_PORTS) {
+        /* the CCC interrupt takes the HOST_IRQ_STAT bit of a free port */
+        s->control_regs.cap |= HOST_CAP_CCC;
+    }
 
     s->control_regs.impl = (1 << s->ports) - 1;
 
@@ -709,9 +821,8 @@ out:
     return r;
 }
 
-static void ncq_cb(void *opaque, int ret)
+static void ncq_finish(NCQTransferState *ncq_tfs, int ret)
 {
-    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
     IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
 
     /* Clear bit for this tag in SActive */
@@ -732,9 +843,17 @@ static void ncq_cb(void *opaque, int ret)
     DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
             ncq_tfs->tag);
 
+    ncq_tfs->aiocb = NULL;
+    ncq_tfs->used = 0;
+}
+
+static void ncq_cb(void *opaque, int ret)
+{
+    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
+
     bdrv_acct_done(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct);
     qemu_sglist_destroy(&ncq_tfs->sglist);
-    ncq_tfs->used = 0;
+    ncq_finish(ncq_tfs, ret);
 }
 
 static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
@@ -770,8 +889,13 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
             ncq_tfs->lba, ncq_tfs->lba + ncq_tfs->sector_count - 2,
             s->dev[port].port.ifs[0].nb_sectors - 1);
 
-    ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist, 0);
     ncq_tfs->tag = tag;
+    if (ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist, 0)) {
+        /* fail the tag rather than leave it taken for good */
+        DPRINTF(port, "error: bad PRDT for NCQ tag %d\n", tag);
+        ncq_finish(ncq_tfs, -EINVAL);
+        return;
+    }
 
     switch(ncq_fis->command) {
         case READ_FPDMA_QUEUED:
@@ -804,6 +928,7 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
         default:
             DPRINTF(port, "error: tried to process non-NCQ command as NCQ\n");
             qemu_sglist_destroy(&ncq_tfs->sglist);
+            ncq_finish(ncq_tfs, -EINVAL);
             break;
     }
 }
@@ -1159,6 +1284,8 @@ void ahci_init(AHCIState *s, DeviceState *qdev, DMAContext *dma, int ports)
     memory_region_init_io(&s->mem, &ahci_mem_ops, s, "ahci", AHCI_MEM_BAR_SIZE);
     memory_region_init_io(&s->idp, &ahci_idp_ops, s, "ahci-idp", 32);
 
+    s->ccc_timer = qemu_new_timer_ms(vm_clock, ahci_ccc_timer_cb, s);
+
     irqs = qemu_allocate_irqs(ahci_irq_set, s, s->ports);
 
     for (i = 0; i < s->ports; i++) {
@@ -1176,6 +1303,8 @@ void ahci_init(AHCIState *s, DeviceState *qdev, DMAContext *dma, int ports)
 
 void ahci_uninit(AHCIState *s)
 {
+    qemu_del_timer(s->ccc_timer);
+    qemu_free_timer(s->ccc_timer);
     memory_region_destroy(&s->mem);
     memory_region_destroy(&s->idp);
     g_free(s->dev);
@@ -1188,6 +1317,11 @@ void ahci_reset(AHCIState *s)
 
     s->control_regs.irqstatus = 0;
     s->control_regs.ghc = 0;
+    s->control_regs.ccc_ctl = ahci_ccc_ctl_reset_value(s);
+    s->control_regs.ccc_ports = 0;
+    s->ccc_completed = 0;
+    s->ccc_pending = false;
+    qemu_del_timer(s->ccc_timer);
 
     for (i = 0; i < s->ports; i++) {
         pr = &s->dev[i].port_regs;
@@ -1257,6 +1391,28 @@ static int ahci_state_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static bool ahci_ccc_needed(void *opaque)
+{
+    AHCIState *s = opaque;
+
+    return s->control_regs.ccc_ctl != ahci_ccc_ctl_reset_value(s) ||
+           s->control_regs.ccc_ports || s->ccc_pending;
+}
+
+static const VMStateDescription vmstate_ahci_ccc = {
+    .name = "ahci/ccc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_UINT32(control_regs.ccc_ctl, AHCIState),
+        VMSTATE_UINT32(control_regs.ccc_ports, AHCIState),
+        VMSTATE_UINT32(ccc_completed, AHCIState),
+        VMSTATE_BOOL(ccc_pending, AHCIState),
+        VMSTATE_TIMER(ccc_timer, AHCIState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 const VMStateDescription vmstate_ahci = {
     .name = "ahci",
     .version_id = 1,
@@ -1273,6 +1429,14 @@ const VMStateDescription vmstate_ahci = {
         VMSTATE_INT32(ports, AHCIState),
         VMSTATE_END_OF_LIST()
     },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_ahci_ccc,
+            .needed = ahci_ccc_needed,
+        }, {
+            /* empty */
+        }
+    },
 };
 
 typedef struct SysbusAHCIState {
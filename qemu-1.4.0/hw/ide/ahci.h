@@ -57,6 +57,8 @@
 #define HOST_IRQ_STAT             0x08 /* interrupt status */
 #define HOST_PORTS_IMPL           0x0c /* bitmap of implemented ports */
 #define HOST_VERSION              0x10 /* AHCI spec. version compliancy */
+#define HOST_CCC_CTL              0x14 /* command completion coalescing */
+#define HOST_CCC_PORTS            0x18 /* ports covered by coalescing */
 
 /* HOST_CTL bits */
 #define HOST_CTL_RESET            (1 << 0)  /* reset controller; self-clear */
@@ -64,6 +66,7 @@
 #define HOST_CTL_AHCI_EN          (1 << 31) /* AHCI enabled */
 
 /* HOST_CAP bits */
+#define HOST_CAP_CCC              (1 << 7)  /* Command completion coalescing */
 #define HOST_CAP_SSC              (1 << 14) /* Slumber capable */
 #define HOST_CAP_AHCI             (1 << 18) /* AHCI only */
 #define HOST_CAP_CLO              (1 << 24) /* Command List Override support */
@@ -71,6 +74,12 @@
 #define HOST_CAP_NCQ              (1 << 30) /* Native Command Queueing */
 #define HOST_CAP_64               (1 << 31) /* PCI DAC (64-bit DMA) support */
 
+/* HOST_CCC_CTL bits */
+#define HOST_CCC_CTL_EN           (1 << 0)  /* coalescing enabled */
+#define HOST_CCC_CTL_INT_SHIFT    3         /* interrupt used, RO */
+#define HOST_CCC_CTL_CC_SHIFT     8         /* completions per interrupt */
+#define HOST_CCC_CTL_TV_SHIFT     16        /* timeout in ms */
+
 /* registers for each SATA port */
 #define PORT_LST_ADDR             0x00 /* command list DMA addr */
 #define PORT_LST_ADDR_HI          0x04 /* command list DMA addr hi */
@@ -153,6 +162,11 @@
 #define PORT_IRQ_STAT_TFES        (1 << 30) /* Task File Error Status */
 #define PORT_IRQ_STAT_CPDS        (1 << 31) /* Code Port Detect Status */
 
+/* command completion interrupts, deferred on ports with coalescing */
+#define PORT_IRQ_STAT_CCC         (PORT_IRQ_STAT_DHRS | PORT_IRQ_STAT_PSS | \
+                                   PORT_IRQ_STAT_DSS | PORT_IRQ_STAT_SDBS | \
+                                   PORT_IRQ_STAT_DPS)
+
 /* ap->flags bits */
 #define AHCI_FLAG_NO_NCQ                  (1 << 24)
 #define AHCI_FLAG_IGN_IRQ_IF_ERR          (1 << 25) /* ignore IRQ_IF_ERR */
@@ -222,6 +236,8 @@ typedef struct AHCIControlRegs {
     uint32_t    irqstatus;
     uint32_t    impl;
     uint32_t    version;
+    uint32_t    ccc_ctl;
+    uint32_t    ccc_ports;
 } AHCIControlRegs;
 
 typedef struct AHCIPortRegs {
@@ -298,6 +314,9 @@ typedef struct AHCIState {
     int32_t ports;
     qemu_irq irq;
     DMAContext *dma;
+    QEMUTimer *ccc_timer;   /* Coalescing timeout */
+    uint32_t ccc_completed; /* Completions since the last CCC interrupt */
+    bool ccc_pending;       /* CCC interrupt bit set in HOST_IRQ_STAT */
 } AHCIState;
 
 typedef struct AHCIPCIState {
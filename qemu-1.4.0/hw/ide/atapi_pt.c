@@ -811,17 +811,338 @@ static int atapi_pt_do_dispatch(volatile IDEState *s)
     return r;
 }
 
+/* -- Read-ahead ------------------------------------------------------------
+ * ATAPI only allows one outstanding command, so the guest can't overlap its
+ * sequential reads by itself. Once a read that follows on from the previous
+ * one has been completed to the guest, the worker thread has a separate
+ * read-ahead thread fetch the sectors after it while the guest is busy
+ * consuming the data, and answers the next read from memory if it is
+ * covered, waiting for the fetch to complete if needed. */
+
+static int atapi_pt_read_cd_block_size(uint8_t const *io_buffer);
+
+static inline void cpu_to_ube24(uint8_t *buf, unsigned int val)
+{
+    buf[0] = val >> 16;
+    buf[1] = val >> 8;
+    buf[2] = val;
+}
+
+/* Decode a READ(10), READ(12) or READ CD that can go through the cache */
+static bool atapi_pt_parse_read(uint8_t const *req, uint32_t din_len,
+                                uint32_t *lba, uint32_t *count,
+                                uint32_t *key, uint32_t *block_size)
+{
+    int size;
+
+    switch (req[0]) {
+    case GPCMD_READ_10:
+    case GPCMD_READ_12:
+        if (req[1] & 0x08) { /* Force Unit Access */
+            return false;
+        }
+        *count = (req[0] == GPCMD_READ_10) ? ube16_to_cpu(req + 7) :
+                                             ube32_to_cpu(req + 6);
+        *key = GPCMD_READ_10;
+        *block_size = CD_FRAMESIZE;
+        break;
+    case GPCMD_READ_CD:
+        if (req[10] & 7) { /* Sub-channel data */
+            return false;
+        }
+        size = atapi_pt_read_cd_block_size(req);
+        if (size <= 0) {
+            return false;
+        }
+        *count = ube24_to_cpu(req + 6);
+        *key = (GPCMD_READ_CD << 16) | ((req[1] & 0x1c) << 8) | req[9];
+        *block_size = size;
+        break;
+    default:
+        return false;
+    }
+    *lba = ube32_to_cpu(req + 2);
+
+    return *count && (din_len == *count * *block_size);
+}
+
+/* Wait for the read-ahead thread to hand the cache back */
+static void atapi_pt_ra_wait(ATAPIPassThroughState *as)
+{
+    qemu_mutex_lock(&as->ra_lock);
+    while (as->ra_pending) {
+        qemu_cond_wait(&as->ra_cond, &as->ra_lock);
+    }
+    qemu_mutex_unlock(&as->ra_lock);
+}
+
+static void atapi_pt_ra_invalidate(ATAPIPassThroughState *as)
+{
+    atapi_pt_ra_wait(as);
+    as->ra_count = 0;
+    as->ra_limit = 0;
+    as->next_key = 0;
+}
+
+/* Commands that can't change the medium or what's on it */
+static bool atapi_pt_ra_keep(volatile IDEState *s)
+{
+    ATAPIPassThroughState *as = s->atapipts;
+
+    switch (as->request[0]) {
+    case GPCMD_GET_EVENT_STATUS_NOTIFICATION:
+        /* New or removed media */
+        return (s->io_buffer[4] != 2) && (s->io_buffer[4] != 3);
+    case GPCMD_TEST_UNIT_READY:
+    case GPCMD_REQUEST_SENSE:
+    case GPCMD_INQUIRY:
+    case GPCMD_MODE_SENSE_10:
+    case GPCMD_GET_CONFIGURATION:
+    case GPCMD_GET_PERFORMANCE:
+    case GPCMD_MECHANISM_STATUS:
+    case GPCMD_READ_CDVD_CAPACITY:
+    case GPCMD_READ_DISC_INFO:
+    case GPCMD_READ_DVD_STRUCTURE:
+    case GPCMD_READ_SUBCHANNEL:
+    case GPCMD_READ_TOC_PMA_ATIP:
+    case GPCMD_READ_TRACK_RZONE_INFO:
+    case GPCMD_SET_SPEED:
+    case GPCMD_SET_STREAMING:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Serve the current request from the cache, if it's all there */
+static bool atapi_pt_ra_lookup(volatile IDEState *s)
+{
+    ATAPIPassThroughState *as = s->atapipts;
+    uint32_t lba, count, key, block_size;
+    bool hit;
+
+    if (!as->ra_buf ||
+        !atapi_pt_parse_read(as->request, as->din_xfer_len,
+                             &lba, &count, &key, &block_size)) {
+        return false;
+    }
+
+    /* Sectors that are being fetched are worth waiting for */
+    qemu_mutex_lock(&as->ra_lock);
+    while (as->ra_pending && (key == as->ra_key) && (lba >= as->ra_lba) &&
+           (lba + count > as->ra_lba + as->ra_count) &&
+           (lba + count <= as->ra_fill_lba + as->ra_fill_count)) {
+        qemu_cond_wait(&as->ra_cond, &as->ra_lock);
+    }
+    hit = as->ra_count && (key == as->ra_key) && (lba >= as->ra_lba) &&
+          (lba + count <= as->ra_lba + as->ra_count);
+    qemu_mutex_unlock(&as->ra_lock);
+
+    /* The fetch only writes past ra_count, so this part is stable */
+    if (hit) {
+        memcpy(s->io_buffer,
+               as->ra_buf + (lba - as->ra_lba) * block_size,
+               count * block_size);
+        as->result = 0;
+        as->ra_hits++;
+        ATAPI_DPRINTF("read-ahead hit lba(%u) count(%u)", lba, count);
+        return true;
+    }
+
+    as->ra_misses++;
+    return false;
+}
+
+/* Called once the current command is done, before the guest is told:
+ * returns true if the sectors after it should be fetched. */
+static bool atapi_pt_ra_update(volatile IDEState *s)
+{
+    ATAPIPassThroughState *as = s->atapipts;
+    uint32_t lba, count, key, block_size;
+    uint32_t ra_end, ahead;
+    bool sequential;
+
+    if (!as->ra_buf) {
+        return false;
+    }
+
+    if (!atapi_pt_parse_read(as->request, as->din_xfer_len,
+                             &lba, &count, &key, &block_size)) {
+        if (as->result || !atapi_pt_ra_keep(s)) {
+            atapi_pt_ra_invalidate(as);
+        }
+        return false;
+    }
+
+    if (as->result) {
+        atapi_pt_ra_invalidate(as);
+        return false;
+    }
+
+    sequential = (key == as->next_key) && (lba == as->next_lba);
+    as->next_lba = lba + count;
+    as->next_key = key;
+    as->next_block_size = block_size;
+    if (!sequential) {
+        return false;
+    }
+    atapi_pt_ra_wait(as);
+    memcpy(as->ra_request, as->request, ATAPI_PACKET_SIZE);
+
+    /* Only refill once the guest has eaten into the second half */
+    ra_end = as->ra_lba + as->ra_count;
+    if (as->ra_count && (as->ra_key == key) &&
+        (as->next_lba >= as->ra_lba) && (as->next_lba <= ra_end)) {
+        ahead = ra_end - as->next_lba;
+        if (ahead >= (as->ra_size / block_size) / 2) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Slide the cache window up to where the guest is, and have the
+ * read-ahead thread fill the rest */
+static void atapi_pt_ra_fill(volatile IDEState *s)
+{
+    ATAPIPassThroughState *as = s->atapipts;
+    uint32_t block_size = as->next_block_size;
+    uint32_t start = as->next_lba;
+    uint32_t ra_end = as->ra_lba + as->ra_count;
+    uint32_t keep = 0, lba, n;
+    uint8_t *req = as->ra_request;
+
+    if (as->ra_count && (as->ra_key == as->next_key) &&
+        (start >= as->ra_lba) && (start <= ra_end)) {
+        keep = ra_end - start;
+        memmove(as->ra_buf, as->ra_buf + (start - as->ra_lba) * block_size,
+                keep * block_size);
+    } else {
+        as->ra_limit = 0;
+    }
+    as->ra_lba = start;
+    as->ra_count = keep;
+    as->ra_key = as->next_key;
+    as->ra_block_size = block_size;
+
+    lba = start + keep;
+    n = as->ra_size / block_size - keep;
+    if (as->ra_limit) {
+        /* Don't keep running into the end of the disc */
+        n = (as->ra_limit > lba) ? MIN(n, as->ra_limit - lba) : 0;
+    }
+    if (!n) {
+        return;
+    }
+
+    cpu_to_ube32(req + 2, lba);
+    switch (req[0]) {
+    case GPCMD_READ_10:
+        cpu_to_ube16(req + 7, n);
+        break;
+    case GPCMD_READ_12:
+        cpu_to_ube32(req + 6, n);
+        break;
+    case GPCMD_READ_CD:
+        cpu_to_ube24(req + 6, n);
+        break;
+    }
+
+    qemu_mutex_lock(&as->ra_lock);
+    as->ra_fill_lba = lba;
+    as->ra_fill_count = n;
+    as->ra_pending = true;
+    qemu_cond_broadcast(&as->ra_cond);
+    qemu_mutex_unlock(&as->ra_lock);
+}
+
+/* Fetch the sectors requested by atapi_pt_ra_fill() */
+static bool atapi_pt_ra_submit(volatile IDEState *s)
+{
+    ATAPIPassThroughState *as = s->atapipts;
+    uint32_t lba = as->ra_fill_lba;
+    uint32_t n = as->ra_fill_count;
+    uint32_t block_size = as->ra_block_size;
+    struct sg_io_v4 cmd;
+
+    memset(&cmd, 0, sizeof(struct sg_io_v4));
+    cmd.guard            = 'Q';
+    cmd.protocol         =  BSG_PROTOCOL_SCSI;
+    cmd.subprotocol      =  BSG_SUB_PROTOCOL_SCSI_CMD;
+    cmd.request_len      =  ATAPI_PACKET_SIZE;
+    cmd.request          =  (uintptr_t)as->ra_request;
+    cmd.response         =  (uintptr_t)&(as->ra_sense);
+    cmd.max_response_len =  sizeof(as->ra_sense);
+    cmd.timeout          =  15000;
+    cmd.din_xferp        =  (uintptr_t)(as->ra_buf +
+                                        (lba - as->ra_lba) * block_size);
+    cmd.din_xfer_len     =  n * block_size;
+
+    if (bdrv_ioctl(s->bs, SG_IO, &cmd) || cmd.driver_status ||
+        cmd.transport_status || cmd.device_status) {
+        ATAPI_DPRINTF("read-ahead failed at lba(%u) count(%u)", lba, n);
+        return false;
+    }
+
+    ATAPI_DPRINTF("read-ahead lba(%u) count(%u) hits(%"PRIu64") "
+                  "misses(%"PRIu64")", lba, n, as->ra_hits, as->ra_misses);
+    return true;
+}
+
+/* Read-ahead thread... Runs the fetches queued by the worker thread, so
+ * that the worker can take the next guest command meanwhile. */
+static void *atapi_pt_ra_thread(void *arg)
+{
+    volatile IDEState *s = (volatile IDEState *)arg;
+    ATAPIPassThroughState *as = s->atapipts;
+    bool ok;
+
+    qemu_mutex_lock(&as->ra_lock);
+    while (as->thread_continue) {
+        if (!as->ra_pending) {
+            qemu_cond_wait(&as->ra_cond, &as->ra_lock);
+            continue;
+        }
+        qemu_mutex_unlock(&as->ra_lock);
+        ok = atapi_pt_ra_submit(s);
+        qemu_mutex_lock(&as->ra_lock);
+
+        if (ok) {
+            as->ra_count += as->ra_fill_count;
+        } else {
+            /* Don't keep running into the end of the disc */
+            as->ra_limit = as->ra_fill_lba;
+        }
+        as->ra_pending = false;
+        qemu_cond_broadcast(&as->ra_cond);
+    }
+    qemu_mutex_unlock(&as->ra_lock);
+
+    qemu_thread_exit(NULL);
+    return NULL;
+}
+
 /* Worker thread... This thread is waiting for a signal from the main processus
  * and perform the command via the atapi_pt_do_dispatch function. */
 static void *atapi_pt_worker_thread(void *arg)
 {
     volatile IDEState *s = (volatile IDEState *)arg;
     ATAPIPassThroughState *as = s->atapipts;
+    bool read_ahead;
 
     while (as->thread_continue) {
         if (event_notifier_wait_and_clear(&as->e_cmd, 0) == 1) {
-            atapi_pt_do_dispatch(s);
+            if (!atapi_pt_ra_lookup(s)) {
+                atapi_pt_do_dispatch(s);
+            }
+            /* The request and its result belong to the main thread again
+             * as soon as it is notified */
+            read_ahead = atapi_pt_ra_update(s);
             event_notifier_set(&as->e_ret);
+            if (read_ahead) {
+                atapi_pt_ra_fill(s);
+            }
         }
     }
 
@@ -1017,6 +1338,15 @@ int atapi_pt_init(IDEState *s)
                        ~(CD_FRAMESIZE - 1);
     /* --------------------------------------------------------------------- */
 
+    /* -- Read-ahead cache, one transfer's worth --------------------------- */
+    qemu_mutex_init(&as->ra_lock);
+    qemu_cond_init(&as->ra_cond);
+    as->ra_size = as->max_xfer_len;
+    as->ra_buf = qemu_memalign(4096, as->ra_size);
+    qemu_thread_create(&as->ra_thread, atapi_pt_ra_thread,
+                       s, QEMU_THREAD_JOINABLE);
+    /* --------------------------------------------------------------------- */
+
     as->e_ret.opaque = s;
     event_notifier_set_handler(&as->e_ret, atapi_pt_event_read);
     bdrv_send_request_to_driver(s->bs, BLOCK_PT_CMD_SET_MEDIA_STATE_UNKNOWN);
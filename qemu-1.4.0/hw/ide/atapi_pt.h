@@ -141,6 +141,32 @@ typedef struct ATAPIPassThroughState {
      * descriptor */
     EventNotifier        e_cmd;
     EventNotifier        e_ret;
+    /* Read-ahead cache for sequential reads, owned by the worker thread.
+     * ra_key identifies the read format of the held sectors.  While
+     * ra_pending is set, the read-ahead thread is fetching ra_fill_count
+     * sectors at ra_fill_lba into the buffer, and ra_count and ra_limit
+     * are only accessed under ra_lock; it clears ra_pending when done. */
+    QemuThread           ra_thread;
+    QemuMutex            ra_lock;
+    QemuCond             ra_cond;
+    bool                 ra_pending;
+    uint32_t             ra_fill_lba;
+    uint32_t             ra_fill_count;
+    uint8_t              *ra_buf;
+    uint32_t             ra_size;
+    uint32_t             ra_lba;
+    uint32_t             ra_count;
+    uint32_t             ra_key;
+    uint32_t             ra_block_size;
+    uint32_t             ra_limit;
+    uint8_t              ra_request[ATAPI_PACKET_SIZE];
+    struct request_sense ra_sense;
+    /* Where the last guest read ended, to detect sequential access */
+    uint32_t             next_lba;
+    uint32_t             next_key;
+    uint32_t             next_block_size;
+    uint64_t             ra_hits;
+    uint64_t             ra_misses;
 } ATAPIPassThroughState;
 
 int32_t atapi_pt_init(IDEState *s);
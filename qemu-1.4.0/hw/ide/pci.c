@@ -51,46 +51,106 @@ static void bmdma_start_dma(IDEDMA *dma, IDEState *s,
     }
 }
 
-/* return 0 if buffer completed */
-static int bmdma_prepare_buf(IDEDMA *dma, int is_write)
+/* The rest of the PRD table, mapped on first use so that a long table is
+ * looked up once rather than with one DMA read per entry
+ */
+typedef struct BMDMAPRDTable {
+    uint8_t *ptr;
+    uint32_t base;
+    dma_addr_t len;
+    bool mapped;
+} BMDMAPRDTable;
+
+static void bmdma_unmap_prd_table(BMDMAState *bm, BMDMAPRDTable *t)
+{
+    if (t->ptr) {
+        pci_dma_unmap(&bm->pci_dev->dev, t->ptr, t->len,
+                      DMA_DIRECTION_TO_DEVICE, 0);
+        t->ptr = NULL;
+    }
+}
+
+/* Load the next PRD into cur_prd_*, return 0 at the end of the table */
+static int bmdma_next_prd(BMDMAState *bm, BMDMAPRDTable *t)
 {
-    BMDMAState *bm = DO_UPCAST(BMDMAState, dma, dma);
-    IDEState *s = bmdma_active_if(bm);
     struct {
         uint32_t addr;
         uint32_t size;
     } prd;
-    int l, len;
+    uint32_t off;
+    int len;
+
+    /* end of table (with a fail safe of one page) */
+    if (bm->cur_prd_last ||
+        (bm->cur_addr - bm->addr) >= BMDMA_PAGE_SIZE) {
+        return 0;
+    }
+
+    if (!t->mapped) {
+        t->mapped = true;
+        t->base = bm->cur_addr;
+        t->len = QEMU_ALIGN_UP(bm->addr + BMDMA_PAGE_SIZE - bm->cur_addr, 8);
+        t->ptr = pci_dma_map(&bm->pci_dev->dev, t->base, &t->len,
+                             DMA_DIRECTION_TO_DEVICE);
+    }
+
+    off = bm->cur_addr - t->base;
+    if (t->ptr && off + 8 <= t->len) {
+        memcpy(&prd, t->ptr + off, 8);
+    } else {
+        pci_dma_read(&bm->pci_dev->dev, bm->cur_addr, &prd, 8);
+    }
+    bm->cur_addr += 8;
+    prd.addr = le32_to_cpu(prd.addr);
+    prd.size = le32_to_cpu(prd.size);
+    len = prd.size & 0xfffe;
+    if (len == 0)
+        len = 0x10000;
+    bm->cur_prd_len = len;
+    bm->cur_prd_addr = prd.addr;
+    bm->cur_prd_last = (prd.size & 0x80000000);
+    return 1;
+}
+
+/* return 0 if buffer completed */
+static int bmdma_prepare_buf(IDEDMA *dma, int is_write)
+{
+    BMDMAState *bm = DO_UPCAST(BMDMAState, dma, dma);
+    IDEState *s = bmdma_active_if(bm);
+    BMDMAPRDTable t = { NULL };
+    dma_addr_t run_base = 0, run_len = 0;
+    int l;
 
     pci_dma_sglist_init(&s->sg, &bm->pci_dev->dev,
                         s->nsector / (BMDMA_PAGE_SIZE / 512) + 1);
     s->io_buffer_size = 0;
     for(;;) {
-        if (bm->cur_prd_len == 0) {
-            /* end of table (with a fail safe of one page) */
-            if (bm->cur_prd_last ||
-                (bm->cur_addr - bm->addr) >= BMDMA_PAGE_SIZE)
-                return s->io_buffer_size != 0;
-            pci_dma_read(&bm->pci_dev->dev, bm->cur_addr, &prd, 8);
-            bm->cur_addr += 8;
-            prd.addr = le32_to_cpu(prd.addr);
-            prd.size = le32_to_cpu(prd.size);
-            len = prd.size & 0xfffe;
-            if (len == 0)
-                len = 0x10000;
-            bm->cur_prd_len = len;
-            bm->cur_prd_addr = prd.addr;
-            bm->cur_prd_last = (prd.size & 0x80000000);
+        if (bm->cur_prd_len == 0 && !bmdma_next_prd(bm, &t)) {
+            break;
         }
         l = bm->cur_prd_len;
         if (l > 0) {
-            qemu_sglist_add(&s->sg, bm->cur_prd_addr, l);
+            /* PRDs that continue one another become a single entry, so
+               the request takes as few iovecs as the guest allows */
+            if (run_len && run_base + run_len == bm->cur_prd_addr) {
+                run_len += l;
+            } else {
+                if (run_len) {
+                    qemu_sglist_add(&s->sg, run_base, run_len);
+                }
+                run_base = bm->cur_prd_addr;
+                run_len = l;
+            }
             bm->cur_prd_addr += l;
             bm->cur_prd_len -= l;
             s->io_buffer_size += l;
         }
     }
-    return 1;
+    if (run_len) {
+        qemu_sglist_add(&s->sg, run_base, run_len);
+    }
+    bmdma_unmap_prd_table(bm, &t);
+    return s->io_buffer_size != 0;
 }
 
 /* return 0 if buffer completed */
@@ -98,31 +158,16 @@ static int bmdma_rw_buf(IDEDMA *dma, int is_write)
 {
     BMDMAState *bm = DO_UPCAST(BMDMAState, dma, dma);
     IDEState *s = bmdma_active_if(bm);
-    struct {
-        uint32_t addr;
-        uint32_t size;
-    } prd;
-    int l, len;
+    BMDMAPRDTable t = { NULL };
+    int l, ret = 1;
 
     for(;;) {
         l = s->io_buffer_size - s->io_buffer_index;
         if (l <= 0)
             break;
-        if (bm->cur_prd_len == 0) {
-            /* end of table (with a fail safe of one page) */
-            if (bm->cur_prd_last ||
-                (bm->cur_addr - bm->addr) >= BMDMA_PAGE_SIZE)
-                return 0;
-            pci_dma_read(&bm->pci_dev->dev, bm->cur_addr, &prd, 8);
-            bm->cur_addr += 8;
-            prd.addr = le32_to_cpu(prd.addr);
-            prd.size = le32_to_cpu(prd.size);
-            len = prd.size & 0xfffe;
-            if (len == 0)
-                len = 0x10000;
-            bm->cur_prd_len = len;
-            bm->cur_prd_addr = prd.addr;
-            bm->cur_prd_last = (prd.size & 0x80000000);
+        if (bm->cur_prd_len == 0 && !bmdma_next_prd(bm, &t)) {
+            ret = 0;
+            break;
         }
         if (l > bm->cur_prd_len)
             l = bm->cur_prd_len;
@@ -139,7 +184,8 @@ static int bmdma_rw_buf(IDEDMA *dma, int is_write)
             s->io_buffer_index += l;
         }
     }
-    return 1;
+    bmdma_unmap_prd_table(bm, &t);
+    return ret;
 }
 
 static int bmdma_set_unit(IDEDMA *dma, int unit)
@@ -24,7 +24,9 @@
 #include "migration/migration.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/event_notifier.h"
+#include "qemu/bitmap.h"
 #include "char/char.h"
+#include "xen.h"
 
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -34,6 +36,7 @@
 
 #define IVSHMEM_IOEVENTFD   0
 #define IVSHMEM_MSI     1
+#define IVSHMEM_POLL    2
 
 #define IVSHMEM_PEER    0
 #define IVSHMEM_MASTER  1
@@ -55,6 +58,7 @@ typedef struct Peer {
 
 typedef struct EventfdEntry {
     PCIDevice *pdev;
+    EventNotifier *notifier;
     int vector;
 } EventfdEntry;
 
@@ -64,7 +68,6 @@ typedef struct IVShmemState {
     uint32_t intrstatus;
     uint32_t doorbell;
 
-    CharDriverState **eventfd_chr;
     CharDriverState *server_chr;
     MemoryRegion ivshmem_mmio;
 
@@ -88,6 +91,10 @@ typedef struct IVShmemState {
     uint32_t features;
     EventfdEntry *eventfd_table;
 
+    /* vectors rung since notify_bh last ran */
+    unsigned long *pending;
+    QEMUBH *notify_bh;
+
     Error *migration_blocker;
 
     char * shmobj;
@@ -102,6 +109,7 @@ enum ivshmem_registers {
     INTRSTATUS = 4,
     IVPOSITION = 8,
     DOORBELL = 12,
+    PENDING = 16,
 };
 
 static inline uint32_t ivshmem_has_feature(IVShmemState *ivs,
@@ -206,6 +214,27 @@ static void ivshmem_io_write(void *opaque, hwaddr addr,
     }
 }
 
+/* In polled mode nobody waits on our eventfds; the guest reads back and
+ * clears the vectors that were rung, up to the first 32.
+ */
+static uint32_t ivshmem_pending_read(IVShmemState *s)
+{
+    uint32_t ret = 0;
+    int i, n;
+
+    if (!ivshmem_has_feature(s, IVSHMEM_POLL) || !s->peers || s->vm_id < 0) {
+        return 0;
+    }
+
+    n = MIN(s->peers[s->vm_id].nb_eventfds, 32);
+    for (i = 0; i < n; i++) {
+        if (event_notifier_test_and_clear(&s->peers[s->vm_id].eventfds[i])) {
+            ret |= 1U << i;
+        }
+    }
+    return ret;
+}
+
 static uint64_t ivshmem_io_read(void *opaque, hwaddr addr,
                                 unsigned size)
 {
@@ -232,6 +261,10 @@ static uint64_t ivshmem_io_read(void *opaque, hwaddr addr,
             }
             break;
 
+        case PENDING:
+            ret = ivshmem_pending_read(s);
+            break;
+
         default:
             IVSHMEM_DPRINTF("why are we reading " TARGET_FMT_plx "\n", addr);
             ret = 0;
@@ -250,15 +283,6 @@ static const MemoryRegionOps ivshmem_mmio_ops = {
     },
 };
 
-static void ivshmem_receive(void *opaque, const uint8_t *buf, int size)
-{
-    IVShmemState *s = opaque;
-
-    ivshmem_IntrStatus_write(s, *buf);
-
-    IVSHMEM_DPRINTF("ivshmem_receive 0x%02x\n", *buf);
-}
-
 static int ivshmem_can_receive(void * opaque)
 {
     return 8;
@@ -269,44 +293,66 @@ static void ivshmem_event(void *opaque, int event)
     IVSHMEM_DPRINTF("ivshmem_event %d\n", event);
 }
 
-static void fake_irqfd(void *opaque, const uint8_t *buf, int size) {
+/* Deliver every vector rung since the last run once: doorbells that
+ * arrive in the same main loop iteration cost a single interrupt.
+ */
+static void ivshmem_notify_bh(void *opaque)
+{
+    IVShmemState *s = opaque;
+    unsigned long vector;
+
+    for (vector = find_first_bit(s->pending, s->vectors);
+         vector < s->vectors;
+         vector = find_next_bit(s->pending, s->vectors, vector + 1)) {
+        clear_bit(vector, s->pending);
+        IVSHMEM_DPRINTF("interrupt on vector %lu\n", vector);
+        if (ivshmem_has_feature(s, IVSHMEM_MSI)) {
+            msix_notify(&s->dev, vector);
+        } else {
+            ivshmem_IntrStatus_write(s, 1);
+        }
+    }
+}
 
+static void ivshmem_doorbell_read(void *opaque)
+{
     EventfdEntry *entry = opaque;
-    PCIDevice *pdev = entry->pdev;
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, entry->pdev);
 
-    IVSHMEM_DPRINTF("interrupt on vector %p %d\n", pdev, entry->vector);
-    msix_notify(pdev, entry->vector);
+    if (event_notifier_test_and_clear(entry->notifier)) {
+        set_bit(entry->vector, s->pending);
+        qemu_bh_schedule(s->notify_bh);
+    }
 }
 
-static CharDriverState* create_eventfd_chr_device(void * opaque, EventNotifier *n,
-                                                  int vector)
+/* Our own eventfds are read directly from the main loop, not through an
+ * eventfd chardev; in polled mode they are not watched at all.
+ */
+static void watch_guest_eventfd(IVShmemState *s, EventNotifier *n,
+                                int vector)
 {
-    /* create a event character device based on the passed eventfd */
-    IVShmemState *s = opaque;
-    CharDriverState * chr;
-    int eventfd = event_notifier_get_fd(n);
+    EventfdEntry *entry = &s->eventfd_table[vector];
 
-    chr = qemu_chr_open_eventfd(eventfd);
+    entry->pdev = &s->dev;
+    entry->notifier = n;
+    entry->vector = vector;
 
-    if (chr == NULL) {
-        fprintf(stderr, "creating eventfd for eventfd %d failed\n", eventfd);
-        exit(-1);
+    if (!ivshmem_has_feature(s, IVSHMEM_POLL)) {
+        qemu_set_fd_handler(event_notifier_get_fd(n), ivshmem_doorbell_read,
+                            NULL, entry);
     }
+}
 
-    /* if MSI is supported we need multiple interrupts */
-    if (ivshmem_has_feature(s, IVSHMEM_MSI)) {
-        s->eventfd_table[vector].pdev = &s->dev;
-        s->eventfd_table[vector].vector = vector;
+static void unwatch_guest_eventfds(IVShmemState *s)
+{
+    Peer *peer = &s->peers[s->vm_id];
+    int i;
 
-        qemu_chr_add_handlers(chr, ivshmem_can_receive, fake_irqfd,
-                      ivshmem_event, &s->eventfd_table[vector]);
-    } else {
-        qemu_chr_add_handlers(chr, ivshmem_can_receive, ivshmem_receive,
-                      ivshmem_event, s);
+    for (i = 0; i < peer->nb_eventfds; i++) {
+        qemu_set_fd_handler(event_notifier_get_fd(&peer->eventfds[i]),
+                            NULL, NULL, NULL);
     }
-
-    return chr;
-
+    bitmap_zero(s->pending, s->vectors);
 }
 
 static int check_shm_size(IVShmemState *s, int fd) {
@@ -371,6 +417,10 @@ static void close_guest_eventfds(IVShmemState *s, int posn)
 {
     int i, guest_curr_max;
 
+    if (posn == s->vm_id) {
+        unwatch_guest_eventfds(s);
+    }
+
     if (!ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
         return;
     }
@@ -505,9 +555,8 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
     }
 
     if (incoming_posn == s->vm_id) {
-        s->eventfd_chr[guest_max_eventfd] = create_eventfd_chr_device(s,
-                   &s->peers[s->vm_id].eventfds[guest_max_eventfd],
-                   guest_max_eventfd);
+        watch_guest_eventfd(s, &s->peers[s->vm_id].eventfds[guest_max_eventfd],
+                            guest_max_eventfd);
     }
 
     if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
@@ -575,9 +624,6 @@ static void ivshmem_setup_msi(IVShmemState * s)
 
     IVSHMEM_DPRINTF("msix initialized (%d vectors)\n", s->vectors);
 
-    /* allocate QEMU char devices for receiving interrupts */
-    s->eventfd_table = g_malloc0(s->vectors * sizeof(EventfdEntry));
-
     ivshmem_use_msix(s);
 }
 
@@ -650,6 +696,15 @@ static int pci_ivshmem_init(PCIDevice *dev)
     register_savevm(&s->dev.qdev, "ivshmem", 0, 0, ivshmem_save, ivshmem_load,
                                                                         dev);
 
+    /* The BAR would be backed by pages of the domain, not by the shared
+     * object: Xen has no way to map memory of the device model process
+     * into the guest.
+     */
+    if (xen_enabled()) {
+        fprintf(stderr, "ivshmem: not supported with Xen\n");
+        exit(1);
+    }
+
     /* IRQFD requires MSI */
     if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD) &&
         !ivshmem_has_feature(s, IVSHMEM_MSI)) {
@@ -721,11 +776,12 @@ static int pci_ivshmem_init(PCIDevice *dev)
 
         /* allocate/initialize space for interrupt handling */
         s->peers = g_malloc0(s->nb_peers * sizeof(Peer));
+        s->eventfd_table = g_malloc0(s->vectors * sizeof(EventfdEntry));
+        s->pending = bitmap_new(s->vectors);
+        s->notify_bh = qemu_bh_new(ivshmem_notify_bh, s);
 
         pci_register_bar(&s->dev, 2, s->ivshmem_attr, &s->bar);
 
-        s->eventfd_chr = g_malloc0(s->vectors * sizeof(CharDriverState *));
-
         qemu_chr_add_handlers(s->server_chr, ivshmem_can_receive, ivshmem_read,
                      ivshmem_event, s);
     } else {
@@ -776,6 +832,15 @@ static void pci_ivshmem_uninit(PCIDevice *dev)
         error_free(s->migration_blocker);
     }
 
+    if (s->notify_bh) {
+        if (s->vm_id >= 0) {
+            unwatch_guest_eventfds(s);
+        }
+        qemu_bh_delete(s->notify_bh);
+        g_free(s->pending);
+        g_free(s->eventfd_table);
+    }
+
     memory_region_destroy(&s->ivshmem_mmio);
     memory_region_del_subregion(&s->bar, &s->ivshmem);
     vmstate_unregister_ram(&s->ivshmem, &s->dev.qdev);
@@ -790,6 +855,7 @@ static Property ivshmem_properties[] = {
     DEFINE_PROP_UINT32("vectors", IVShmemState, vectors, 1),
     DEFINE_PROP_BIT("ioeventfd", IVShmemState, features, IVSHMEM_IOEVENTFD, false),
     DEFINE_PROP_BIT("msi", IVShmemState, features, IVSHMEM_MSI, true),
+    DEFINE_PROP_BIT("poll", IVShmemState, features, IVSHMEM_POLL, false),
     DEFINE_PROP_STRING("shm", IVShmemState, shmobj),
     DEFINE_PROP_STRING("role", IVShmemState, role),
     DEFINE_PROP_UINT32("use64", IVShmemState, ivshmem_64bit, 1),
@@ -564,6 +564,31 @@ static void rom_insert(Rom *rom)
     QTAILQ_INSERT_TAIL(&roms, rom, next);
 }
 
+/* Most option ROMs exposed through fw_cfg are never read by the firmware,
+ * so their files are only loaded when the guest first selects them.  A
+ * file that cannot be read then shows up as zeroes.
+ */
+static void *rom_load_fw_file(void *opaque)
+{
+    Rom *rom = opaque;
+    int rc, fd;
+
+    rom->data = g_malloc0(rom->romsize);
+    fd = open(rom->path, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open option rom '%s': %s\n",
+                rom->path, strerror(errno));
+        return rom->data;
+    }
+    rc = read(fd, rom->data, rom->romsize);
+    if (rc != rom->romsize) {
+        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                rom->name, rc, rom->romsize);
+    }
+    close(fd);
+    return rom->data;
+}
+
 int rom_add_file(const char *file, const char *fw_dir,
                  hwaddr addr, int32_t bootindex)
 {
@@ -591,15 +616,22 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
     rom->addr    = addr;
     rom->romsize = lseek(fd, 0, SEEK_END);
-    rom->data    = g_malloc0(rom->romsize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->romsize);
-    if (rc != rom->romsize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->romsize);
-        goto err;
+    if (rom->fw_file && fw_cfg) {
+        /* Only read on the guest's first access, see rom_load_fw_file() */
+        close(fd);
+        fd = -1;
+    } else {
+        rom->data = g_malloc0(rom->romsize);
+        lseek(fd, 0, SEEK_SET);
+        rc = read(fd, rom->data, rom->romsize);
+        if (rc != rom->romsize) {
+            fprintf(stderr,
+                    "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                    rom->name, rc, rom->romsize);
+            goto err;
+        }
+        close(fd);
     }
-    close(fd);
     rom_insert(rom);
     if (rom->fw_file && fw_cfg) {
         const char *basename;
@@ -613,7 +645,8 @@ int rom_add_file(const char *file, const char *fw_dir,
         }
         snprintf(fw_file_name, sizeof(fw_file_name), "%s/%s", rom->fw_dir,
                  basename);
-        fw_cfg_add_file(fw_cfg, fw_file_name, rom->data, rom->romsize);
+        fw_cfg_add_file_callback(fw_cfg, fw_file_name, rom_load_fw_file, rom,
+                                 rom->romsize);
         snprintf(devpath, sizeof(devpath), "/rom@%s", fw_file_name);
     } else {
         snprintf(devpath, sizeof(devpath), "/rom@" TARGET_FMT_plx, addr);
@@ -75,6 +75,9 @@ typedef struct RTCState {
     /* update-ended timer */
     QEMUTimer *update_timer;
     uint64_t next_alarm_time;
+    /* UIE and AIE clear: UF/AF are latched on access, see check_update_timer */
+    bool update_lazy;
+    uint64_t next_update_time;
     uint16_t irq_reinject_on_ack_count;
     uint32_t irq_coalesced;
     uint32_t period;
@@ -140,11 +143,10 @@ static void rtc_coalesced_timer(void *opaque)
 }
 #endif
 
-/* handle periodic timer */
-static void periodic_timer_update(RTCState *s, int64_t current_time)
+/* period in 32 Khz cycles, 0 if no periodic interrupt is deliverable */
+static int periodic_period(RTCState *s)
 {
-    int period_code, period;
-    int64_t cur_clock, next_irq_clock;
+    int period_code;
 
     period_code = s->cmos_data[RTC_REG_A] & 0x0f;
     if (period_code != 0
@@ -152,8 +154,19 @@ static void periodic_timer_update(RTCState *s, int64_t current_time)
             || ((s->cmos_data[RTC_REG_B] & REG_B_SQWE) && s->sqw_irq))) {
         if (period_code <= 2)
             period_code += 7;
-        /* period in 32 Khz cycles */
-        period = 1 << (period_code - 1);
+        return 1 << (period_code - 1);
+    }
+    return 0;
+}
+
+/* handle periodic timer */
+static void periodic_timer_update(RTCState *s, int64_t current_time)
+{
+    int period;
+    int64_t cur_clock, next_irq_clock;
+
+    period = periodic_period(s);
+    if (period) {
 #ifdef TARGET_I386
         if (period != s->period) {
             s->irq_coalesced = (s->irq_coalesced * s->period) / period;
@@ -178,8 +191,24 @@ static void periodic_timer_update(RTCState *s, int64_t current_time)
 static void rtc_periodic_timer(void *opaque)
 {
     RTCState *s = opaque;
+    int64_t now = qemu_get_clock_ns(rtc_clock);
+    int64_t expired = s->next_periodic_time;
+#ifdef TARGET_I386
+    int period = periodic_period(s);
+    uint32_t missed = 0;
+
+    if (period && now > expired) {
+        missed = (now - expired) /
+            muldiv64(period, get_ticks_per_sec(), RTC_CLOCK_RATE);
+    }
+#endif
+
+    /* If the host timer fired late, raise one interrupt for all the ticks
+     * that went by rather than a burst of them; with lost_tick_policy slew
+     * they are made up for through irq_coalesced instead.
+     */
+    periodic_timer_update(s, MAX(expired, now));
 
-    periodic_timer_update(s, s->next_periodic_time);
     s->cmos_data[RTC_REG_C] |= REG_C_PF;
     if (s->cmos_data[RTC_REG_B] & REG_B_PIE) {
         s->cmos_data[RTC_REG_C] |= REG_C_IRQF;
@@ -187,6 +216,10 @@ static void rtc_periodic_timer(void *opaque)
         if (s->lost_tick_policy == LOST_TICK_SLEW) {
             if (s->irq_reinject_on_ack_count >= RTC_REINJECT_ON_ACK_COUNT)
                 s->irq_reinject_on_ack_count = 0;		
+            if (missed) {
+                s->irq_coalesced += missed;
+                rtc_coalesced_timer_update(s);
+            }
             apic_reset_irq_delivered();
             qemu_irq_raise(s->irq);
             if (!apic_get_irq_delivered()) {
@@ -206,6 +239,25 @@ static void rtc_periodic_timer(void *opaque)
     }
 }
 
+/* Set the flags rtc_update_timer() would have set had it been armed */
+static void rtc_latch_update_flags(RTCState *s)
+{
+    int64_t now;
+
+    if (!s->update_lazy) {
+        return;
+    }
+    now = qemu_get_clock_ns(rtc_clock);
+    if (now < s->next_update_time) {
+        return;
+    }
+    s->cmos_data[RTC_REG_C] |= REG_C_UF;
+    if (now >= s->next_alarm_time) {
+        s->cmos_data[RTC_REG_C] |= REG_C_AF;
+    }
+    s->update_lazy = false;
+}
+
 /* handle update-ended timer */
 static void check_update_timer(RTCState *s)
 {
@@ -213,6 +265,9 @@ static void check_update_timer(RTCState *s)
     uint64_t guest_nsec;
     int next_alarm_sec;
 
+    rtc_latch_update_flags(s);
+    s->update_lazy = false;
+
     /* From the data sheet: "Holding the dividers in reset prevents
      * interrupts from operating, while setting the SET bit allows"
      * them to occur.  However, it will prevent an alarm interrupt
@@ -249,6 +304,16 @@ static void check_update_timer(RTCState *s)
          * the alarm time.  */
         next_update_time = s->next_alarm_time;
     }
+
+    /* With UIE and AIE clear the flags can only be seen by reading
+     * register C, so there is no need to wake up every second for them.
+     */
+    if (!(s->cmos_data[RTC_REG_B] & (REG_B_UIE | REG_B_AIE))) {
+        qemu_del_timer(s->update_timer);
+        s->next_update_time = next_update_time;
+        s->update_lazy = true;
+        return;
+    }
     if (next_update_time != qemu_timer_expire_time_ns(s->update_timer)) {
         qemu_mod_timer(s->update_timer, next_update_time);
     }
@@ -464,6 +529,7 @@ static void cmos_ioport_write(void *opaque, hwaddr addr,
             }
             /* if an interrupt flag is already set when the interrupt
              * becomes enabled, raise an interrupt immediately.  */
+            rtc_latch_update_flags(s);
             if (data & s->cmos_data[RTC_REG_C] & REG_C_MASK) {
                 s->cmos_data[RTC_REG_C] |= REG_C_IRQF;
                 qemu_irq_raise(s->irq);
@@ -637,6 +703,7 @@ static uint64_t cmos_ioport_read(void *opaque, hwaddr addr,
             ret = s->cmos_data[s->cmos_index];
             break;
         case RTC_REG_C:
+            rtc_latch_update_flags(s);
             ret = s->cmos_data[s->cmos_index];
             qemu_irq_lower(s->irq);
             s->cmos_data[RTC_REG_C] = 0x00;
@@ -692,6 +759,13 @@ static void rtc_set_date_from_host(ISADevice *dev)
     rtc_set_cmos(s, &tm);
 }
 
+static void rtc_pre_save(void *opaque)
+{
+    RTCState *s = opaque;
+
+    rtc_latch_update_flags(s);
+}
+
 static int rtc_post_load(void *opaque, int version_id)
 {
     RTCState *s = opaque;
@@ -699,8 +773,9 @@ static int rtc_post_load(void *opaque, int version_id)
     if (version_id <= 2) {
         rtc_set_time(s);
         s->offset = 0;
-        check_update_timer(s);
     }
+    /* Also rearms, or goes back to latching lazily, as needed */
+    check_update_timer(s);
 
 #ifdef TARGET_I386
     if (version_id >= 2) {
@@ -717,6 +792,7 @@ static const VMStateDescription vmstate_rtc = {
     .version_id = 3,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .pre_save = rtc_pre_save,
     .post_load = rtc_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_BUFFER(cmos_data, RTCState),
@@ -332,6 +332,14 @@ static QEMUMachine pc_i440fx_machine_v1_4 = {
             .driver   = "virtio-net-pci", \
             .property = "mq", \
             .value    = "off", \
+        },{ \
+            .driver   = "e1000", \
+            .property = "mitigation", \
+            .value    = "off", \
+        },{ \
+            .driver   = "fw_cfg", \
+            .property = "dma_enabled", \
+            .value    = "off", \
         }
 
 static QEMUMachine pc_machine_v1_3 = {
@@ -80,6 +80,7 @@ static PCIBus *pci_find_bus_nr(PCIBus *bus, int bus_num);
 static void pci_update_mappings(PCIDevice *d);
 static void pci_set_irq(void *opaque, int irq_num, int level);
 static int pci_add_option_rom(PCIDevice *pdev, bool is_default_rom);
+static void pci_load_option_rom(PCIDevice *pdev);
 static void pci_del_option_rom(PCIDevice *pdev);
 
 static uint16_t pci_default_sub_vendor_id = PCI_SUBVENDOR_ID_REDHAT_QUMRANET;
@@ -1069,6 +1070,9 @@ static void pci_update_mappings(PCIDevice *d)
         }
         r->addr = new_addr;
         if (r->addr != PCI_BAR_UNMAPPED) {
+            if (i == PCI_ROM_SLOT) {
+                pci_load_option_rom(d);
+            }
             memory_region_add_subregion_overlap(r->address_space,
                                                 r->addr, r->memory, 1);
         }
@@ -1411,6 +1415,7 @@ static PciBridgeInfo *qmp_query_pci_bridge(PCIDevice *dev, PCIBus *bus,
 static PciDeviceInfo *qmp_query_pci_device(PCIDevice *dev, PCIBus *bus,
                                            int bus_num)
 {
+    PCIDeviceClass *pc = PCI_DEVICE_GET_CLASS(dev);
     const pci_class_desc *desc;
     PciDeviceInfo *info;
     uint8_t type;
@@ -1445,6 +1450,16 @@ static PciDeviceInfo *qmp_query_pci_device(PCIDevice *dev, PCIBus *bus,
         info->pci_bridge = qmp_query_pci_bridge(dev, bus, bus_num);
     }
 
+    if (pc->query_config_access) {
+        info->config_access = pc->query_config_access(dev);
+        info->has_config_access = info->config_access != NULL;
+    }
+
+    if (pc->query_host_access) {
+        info->host_access = pc->query_host_access(dev);
+        info->has_host_access = info->host_access != NULL;
+    }
+
     return info;
 }
 
@@ -1853,12 +1868,17 @@ static void pci_patch_ids(PCIDevice *pdev, uint8_t *ptr, int size)
     }
 }
 
+/* Migration and snapshots must carry the rom even if it was never mapped */
+static void pci_option_rom_savevm(Notifier *n, void *opaque)
+{
+    pci_load_option_rom(container_of(n, PCIDevice, rom_savevm_notifier));
+}
+
 /* Add an option rom for the device */
 static int pci_add_option_rom(PCIDevice *pdev, bool is_default_rom)
 {
     int size;
     char *path;
-    void *ptr;
     char name[32];
     const VMStateDescription *vmsd;
 
@@ -1907,27 +1927,62 @@ static int pci_add_option_rom(PCIDevice *pdev, bool is_default_rom)
     pdev->has_rom = true;
     memory_region_init_ram(&pdev->rom, name, size);
     vmstate_register_ram(&pdev->rom, &pdev->qdev);
-    ptr = memory_region_get_ram_ptr(&pdev->rom);
-    load_image(path, ptr);
-    g_free(path);
 
-    if (is_default_rom) {
-        /* Only the default rom images will be patched (if needed). */
-        pci_patch_ids(pdev, ptr, size);
+    /* Reading the image is left until the guest maps the rom bar, which
+     * firmware only does for the devices it boots from.  An incoming
+     * migration overwrites the rom anyway, so there is nothing to gain.
+     */
+    pdev->rom_pending_path = path;
+    pdev->rom_pending_patch = is_default_rom;
+    if (runstate_check(RUN_STATE_INMIGRATE)) {
+        pci_load_option_rom(pdev);
+    } else {
+        pdev->rom_savevm_notifier.notify = pci_option_rom_savevm;
+        qemu_add_savevm_begin_notifier(&pdev->rom_savevm_notifier);
     }
 
-    qemu_put_ram_ptr(ptr);
-
     pci_register_bar(pdev, PCI_ROM_SLOT, 0, &pdev->rom);
 
     return 0;
 }
 
+static void pci_load_option_rom(PCIDevice *pdev)
+{
+    int size = memory_region_size(&pdev->rom);
+    void *ptr;
+
+    if (!pdev->rom_pending_path) {
+        return;
+    }
+
+    ptr = memory_region_get_ram_ptr(&pdev->rom);
+    load_image(pdev->rom_pending_path, ptr);
+    if (pdev->rom_pending_patch) {
+        /* Only the default rom images will be patched (if needed). */
+        pci_patch_ids(pdev, ptr, size);
+    }
+    qemu_put_ram_ptr(ptr);
+    memory_region_set_dirty(&pdev->rom, 0, size);
+
+    g_free(pdev->rom_pending_path);
+    pdev->rom_pending_path = NULL;
+    if (pdev->rom_savevm_notifier.notify) {
+        notifier_remove(&pdev->rom_savevm_notifier);
+        pdev->rom_savevm_notifier.notify = NULL;
+    }
+}
+
 static void pci_del_option_rom(PCIDevice *pdev)
 {
     if (!pdev->has_rom)
         return;
 
+    if (pdev->rom_savevm_notifier.notify) {
+        notifier_remove(&pdev->rom_savevm_notifier);
+        pdev->rom_savevm_notifier.notify = NULL;
+    }
+    g_free(pdev->rom_pending_path);
+    pdev->rom_pending_path = NULL;
     vmstate_unregister_ram(&pdev->rom, &pdev->qdev);
     memory_region_destroy(&pdev->rom);
     pdev->has_rom = false;
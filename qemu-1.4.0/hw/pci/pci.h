@@ -2,6 +2,7 @@
 #define QEMU_PCI_H
 
 #include "qemu-common.h"
+#include "qemu/notify.h"
 
 #include "hw/qdev.h"
 #include "exec/memory.h"
@@ -166,6 +167,10 @@ typedef struct PCIDeviceClass {
     PCIUnregisterFunc *exit;
     PCIConfigReadFunc *config_read;
     PCIConfigWriteFunc *config_write;
+    /* optional config space access statistics for query-pci */
+    struct PciConfigAccessInfoList *(*query_config_access)(PCIDevice *dev);
+    /* optional host device access statistics, for passed-through devices */
+    struct PciHostAccessInfo *(*query_host_access)(PCIDevice *dev);
 
     uint16_t vendor_id;
     uint16_t device_id;
@@ -275,6 +280,10 @@ struct PCIDevice {
     bool has_rom;
     MemoryRegion rom;
     uint32_t rom_bar;
+    /* Image not yet copied into the rom, see pci_load_option_rom() */
+    char *rom_pending_path;
+    bool rom_pending_patch;
+    Notifier rom_savevm_notifier;
 
     /* INTx routing notifier */
     PCIINTxRoutingNotifier intx_routing_notifier;
@@ -168,6 +168,7 @@ static void ps2_put_keycode(void *opaque, int keycode)
         }
       }
     ps2_queue(&s->common, keycode);
+    qemu_input_latency(INPUT_LATENCY_STAGE_PS2, qemu_input_get_stamp());
 }
 
 uint32_t ps2_read_data(void *opaque)
@@ -383,6 +384,7 @@ static void ps2_mouse_event(void *opaque,
             if (s->mouse_dx == 0 && s->mouse_dy == 0 && s->mouse_dz == 0)
                 break;
         }
+        qemu_input_latency(INPUT_LATENCY_STAGE_PS2, qemu_input_get_stamp());
     }
 }
 
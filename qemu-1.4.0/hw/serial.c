@@ -261,6 +261,13 @@ static void serial_xmit(void *opaque)
     SerialState *s = opaque;
     uint64_t new_xmit_ts = qemu_get_clock_ns(vm_clock);
 
+    if (s->tsr_retry <= 0 && !(s->mcr & UART_MCR_LOOP) &&
+        !qemu_chr_fe_can_write(s->chr)) {
+        /* The backend is backed up: leave the byte in THR or the FIFO, as
+           a real UART does while CTS is down, until serial_chr_writable() */
+        return;
+    }
+
     if (s->tsr_retry <= 0) {
         if (s->fcr & UART_FCR_FE) {
             s->tsr = fifo_get(s,XMIT_FIFO);
@@ -303,6 +310,14 @@ static void serial_xmit(void *opaque)
     }
 }
 
+static void serial_chr_writable(Notifier *notifier, void *data)
+{
+    SerialState *s = container_of(notifier, SerialState, chr_writable);
+
+    if (!(s->lsr & UART_LSR_THRE)) {
+        serial_xmit(s);
+    }
+}
 
 static void serial_ioport_write(void *opaque, hwaddr addr, uint64_t val,
                                 unsigned size)
@@ -690,10 +705,13 @@ void serial_init_core(SerialState *s)
 
     qemu_chr_add_handlers(s->chr, serial_can_receive1, serial_receive1,
                           serial_event, s);
+    s->chr_writable.notify = serial_chr_writable;
+    qemu_chr_fe_add_write_notifier(s->chr, &s->chr_writable);
 }
 
 void serial_exit_core(SerialState *s)
 {
+    notifier_remove(&s->chr_writable);
     qemu_chr_add_handlers(s->chr, NULL, NULL, NULL, NULL);
     qemu_unregister_reset(serial_reset, s);
 }
@@ -80,6 +80,7 @@ struct SerialState {
 
     struct QEMUTimer *modem_status_poll;
     MemoryRegion io;
+    Notifier chr_writable;
 };
 
 extern const VMStateDescription vmstate_serial;
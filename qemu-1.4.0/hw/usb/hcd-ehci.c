@@ -28,6 +28,7 @@
  */
 
 #include "hw/usb/hcd-ehci.h"
+#include "qapi/visitor.h"
 
 /* Capability Registers Base Address - section 2.2 */
 #define CAPLENGTH        0x0000  /* 1-byte, 0x0001 reserved */
@@ -116,6 +117,7 @@
 #define MAX_QH           100      // Max allowable queue heads in a chain
 #define MIN_UFR_PER_TICK 24       /* Min frames to process when catching up */
 #define PERIODIC_ACTIVE  512      /* Micro-frames */
+#define PARKED_FRAMES    1024     /* Frames between polls of parked schedules */
 
 /*  Internal periodic / asynchronous schedule state machine states
  */
@@ -194,6 +196,7 @@ static int ehci_state_writeback(EHCIQueue *q);
 static int ehci_state_advqueue(EHCIQueue *q);
 static int ehci_fill_queue(EHCIPacket *p);
 static void ehci_free_packet(EHCIPacket *p);
+static void ehci_parked_catch_up(EHCIState *ehci);
 
 static const char *nr2str(const char **n, size_t len, uint32_t nr)
 {
@@ -934,6 +937,7 @@ static void ehci_reset(void *opaque)
     s->usbsts = USBSTS_HALT;
     s->usbsts_pending = 0;
     s->usbsts_frindex = 0;
+    s->parked = false;
 
     s->astate = EST_INACTIVE;
     s->pstate = EST_INACTIVE;
@@ -970,6 +974,9 @@ static uint64_t ehci_opreg_read(void *ptr, hwaddr addr,
 
     switch (addr) {
     case FRINDEX:
+        if (s->parked) {
+            ehci_parked_catch_up(s);
+        }
         /* Round down to mult of 8, else it can go backwards on migration */
         val = s->frindex & ~7;
         break;
@@ -2278,6 +2285,46 @@ static void ehci_update_frindex(EHCIState *ehci, int uframes)
     }
 }
 
+/*
+ * Nothing can happen on the schedules without the guest writing a register
+ * or a device completing or waking an endpoint: the async schedule is off,
+ * no periodic transfer has completed for a while, and every periodic queue
+ * is waiting for its device (in flight) or NAKing (the device wakes the
+ * endpoint when it has data).  The frame timer then only polls the
+ * periodic schedule every PARKED_FRAMES, to notice newly linked QHs.
+ */
+static bool ehci_schedules_parked(EHCIState *ehci)
+{
+    EHCIQueue *q;
+    EHCIPacket *p;
+
+    if (ehci_async_enabled(ehci) || ehci->astate != EST_INACTIVE ||
+        ehci->periodic_sched_active || ehci->usbsts_pending ||
+        ehci->async_stepdown < ehci->maxframes / 2 ||
+        (ehci->usbintr & USBSTS_FLR)) {
+        return false;
+    }
+
+    QTAILQ_FOREACH(q, &ehci->pqueues, next) {
+        p = QTAILQ_FIRST(&q->packets);
+        if (!p || (p->async != EHCI_ASYNC_INFLIGHT &&
+                   p->packet.status != USB_RET_NAK)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Bring frindex up to date while parked; the skipped frames had no work */
+static void ehci_parked_catch_up(EHCIState *ehci)
+{
+    uint64_t ns_elapsed = qemu_get_clock_ns(vm_clock) - ehci->last_run_ns;
+    int uframes = ns_elapsed / UFRAME_TIMER_NS;
+
+    ehci_update_frindex(ehci, uframes);
+    ehci->last_run_ns += UFRAME_TIMER_NS * uframes;
+}
+
 static void ehci_frame_timer(void *opaque)
 {
     EHCIState *ehci = opaque;
@@ -2285,9 +2332,21 @@ static void ehci_frame_timer(void *opaque)
     int64_t expire_time, t_now;
     uint64_t ns_elapsed;
     int uframes, skipped_uframes;
+    EHCIQueue *q;
     int i;
 
     t_now = qemu_get_clock_ns(vm_clock);
+    ehci->wakeups++;
+
+    if (ehci->parked) {
+        /* Time spent parked does not age the periodic queues, they were
+         * idle by definition and are not dropped for going unseen
+         */
+        QTAILQ_FOREACH(q, &ehci->pqueues, next) {
+            q->ts = t_now;
+        }
+        ehci->parked = false;
+    }
     ns_elapsed = t_now - ehci->last_run_ns;
     uframes = ns_elapsed / UFRAME_TIMER_NS;
 
@@ -2361,6 +2420,9 @@ static void ehci_frame_timer(void *opaque)
         if (ehci->int_req_by_async && (ehci->usbsts & USBSTS_INT)) {
             expire_time = t_now + get_ticks_per_sec() / (FRAME_TIMER_FREQ * 4);
             ehci->int_req_by_async = false;
+        } else if (ehci_schedules_parked(ehci)) {
+            ehci->parked = true;
+            expire_time = t_now + (int64_t)FRAME_TIMER_NS * PARKED_FRAMES;
         } else {
             expire_time = t_now + (get_ticks_per_sec()
                                * (ehci->async_stepdown+1) / FRAME_TIMER_FREQ);
@@ -2501,6 +2563,15 @@ const VMStateDescription vmstate_ehci = {
     }
 };
 
+static void ehci_get_wakeups(Object *obj, Visitor *v, void *opaque,
+                             const char *name, Error **errp)
+{
+    EHCIState *s = opaque;
+    int64_t value = s->wakeups;
+
+    visit_type_int(v, &value, name, errp);
+}
+
 void usb_ehci_initfn(EHCIState *s, DeviceState *dev)
 {
     int i;
@@ -2534,6 +2605,9 @@ void usb_ehci_initfn(EHCIState *s, DeviceState *dev)
     qemu_register_reset(ehci_reset, s);
     qemu_add_vm_change_state_handler(usb_ehci_vm_state_change, s);
 
+    object_property_add(OBJECT(dev), "wakeups", "int",
+                        ehci_get_wakeups, NULL, NULL, s, NULL);
+
     memory_region_init(&s->mem, "ehci", MMIO_SIZE);
     memory_region_init_io(&s->mem_caps, &ehci_mmio_caps_ops, s,
                           "capabilities", CAPA_SIZE);
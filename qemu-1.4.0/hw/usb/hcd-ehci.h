@@ -318,6 +318,8 @@ struct EHCIState {
     uint32_t async_stepdown;
     uint32_t periodic_sched_active;
     bool int_req_by_async;
+    bool parked;             /* frame timer slowed to PARKED_FRAMES       */
+    uint64_t wakeups;        /* runs of the frame timer and async bh      */
 };
 
 extern const VMStateDescription vmstate_ehci;
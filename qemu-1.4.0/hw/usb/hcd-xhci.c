@@ -135,6 +135,8 @@
 #define IMAN_IP         (1<<0)
 #define IMAN_IE         (1<<1)
 
+#define IMOD_IMODI_MASK 0xffff  /* interval, in 250ns units */
+
 #define ERDP_EHB        (1<<3)
 
 #define TRB_SIZE 16
@@ -425,6 +427,11 @@ typedef struct XHCIInterrupter {
     unsigned int ev_buffer_put;
     unsigned int ev_buffer_get;
 
+    /* interrupt moderation: none is sent before imod_expire, imod_timer
+       sends the one held back then */
+    XHCIState *xhci;
+    QEMUTimer *imod_timer;
+    int64_t imod_expire;
 } XHCIInterrupter;
 
 struct XHCIState {
@@ -727,13 +734,12 @@ static void xhci_msix_update(XHCIState *xhci, int v)
     }
 }
 
-static void xhci_intr_raise(XHCIState *xhci, int v)
+static void xhci_intr_notify(XHCIState *xhci, int v)
 {
-    xhci->intr[v].erdp_low |= ERDP_EHB;
-    xhci->intr[v].iman |= IMAN_IP;
-    xhci->usbsts |= USBSTS_EINT;
+    XHCIInterrupter *intr = &xhci->intr[v];
+    int64_t now;
 
-    if (!(xhci->intr[v].iman & IMAN_IE)) {
+    if (!(intr->iman & IMAN_IE)) {
         return;
     }
 
@@ -741,6 +747,19 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
         return;
     }
 
+    if (intr->imod & IMOD_IMODI_MASK) {
+        now = qemu_get_clock_ns(vm_clock);
+        if (now < intr->imod_expire) {
+            /* events that come in meanwhile share this interrupt */
+            trace_usb_xhci_irq_moderated(v);
+            if (!qemu_timer_pending(intr->imod_timer)) {
+                qemu_mod_timer(intr->imod_timer, intr->imod_expire);
+            }
+            return;
+        }
+        intr->imod_expire = now + (intr->imod & IMOD_IMODI_MASK) * 250;
+    }
+
     if (msix_enabled(&xhci->pci_dev)) {
         trace_usb_xhci_irq_msix(v);
         msix_notify(&xhci->pci_dev, v);
@@ -759,6 +778,26 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
     }
 }
 
+static void xhci_intr_raise(XHCIState *xhci, int v)
+{
+    xhci->intr[v].erdp_low |= ERDP_EHB;
+    xhci->intr[v].iman |= IMAN_IP;
+    xhci->usbsts |= USBSTS_EINT;
+
+    xhci_intr_notify(xhci, v);
+}
+
+static void xhci_imod_timer(void *opaque)
+{
+    XHCIInterrupter *intr = opaque;
+    XHCIState *xhci = intr->xhci;
+
+    /* nothing to send if the driver already took care of the events */
+    if (intr->iman & IMAN_IP) {
+        xhci_intr_notify(xhci, intr - xhci->intr);
+    }
+}
+
 static inline int xhci_running(XHCIState *xhci)
 {
     return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
@@ -2515,6 +2554,8 @@ static void xhci_reset(DeviceState *dev)
     for (i = 0; i < xhci->numintrs; i++) {
         xhci->intr[i].iman = 0;
         xhci->intr[i].imod = 0;
+        xhci->intr[i].imod_expire = 0;
+        qemu_del_timer(xhci->intr[i].imod_timer);
         xhci->intr[i].erstsz = 0;
         xhci->intr[i].erstba_low = 0;
         xhci->intr[i].erstba_high = 0;
@@ -3122,6 +3163,11 @@ static int usb_xhci_initfn(struct PCIDevice *dev)
     }
 
     xhci->mfwrap_timer = qemu_new_timer_ns(vm_clock, xhci_mfwrap_timer, xhci);
+    for (i = 0; i < xhci->numintrs; i++) {
+        xhci->intr[i].xhci = xhci;
+        xhci->intr[i].imod_timer = qemu_new_timer_ns(vm_clock, xhci_imod_timer,
+                                                     &xhci->intr[i]);
+    }
 
     xhci->irq = xhci->pci_dev.irq[0];
 
@@ -72,9 +72,17 @@ typedef int USBScanFunc(void *opaque, int bus_num, int addr, const char *port,
 
 /* endpoint association data */
 #define ISO_FRAME_DESC_PER_URB 32
+/* An endpoint whose iso urbs run out while the guest keeps the stream going
+   (it queues the next packet within ISO_DRY_MS) gets twice as many of them,
+   up to ISO_URB_COUNT_MAX */
+#define ISO_URB_COUNT_MAX 32
+#define ISO_DRY_MS        100
 
 /* devio.c limits single requests to 16k */
 #define MAX_USBFS_BUFFER_SIZE 16384
+/* Kernels since 3.3 take bulk urbs up to usbfs_memory_mb; older ones refuse
+   anything over MAX_USBFS_BUFFER_SIZE, which is then used from there on */
+#define MAX_USBFS_BULK_SIZE   (256 * 1024)
 
 typedef struct AsyncURB AsyncURB;
 
@@ -82,6 +90,8 @@ struct endp_data {
     uint8_t halted;
     uint8_t iso_started;
     AsyncURB *iso_urb;
+    int64_t iso_dry_time;
+    int iso_urb_count;
     int iso_urb_idx;
     int iso_buffer_used;
     int inflight;
@@ -110,6 +120,7 @@ typedef struct USBHostDevice {
     int       closing;
     uint32_t  iso_urb_count;
     uint32_t  options;
+    int       bulk_urb_size;
     Notifier  exit;
     QEMUBH    *bh;
 
@@ -355,6 +366,8 @@ static void async_complete(void *opaque)
             if (inflight == 0 && is_iso_started(s, pid, ep)) {
                 /* can be latency issues, or simply end of stream */
                 trace_usb_host_iso_out_of_bufs(s->bus_num, s->addr, ep);
+                get_endp(s, pid, ep)->iso_dry_time =
+                    qemu_get_clock_ms(rt_clock);
             }
             continue;
         }
@@ -394,7 +407,11 @@ static void async_complete(void *opaque)
             } else if (!aurb->more) {
                 trace_usb_host_req_complete(s->bus_num, s->addr, p,
                                             p->status, aurb->urb.actual_length);
-                usb_packet_complete(&s->dev, p);
+                if (p->pid == USB_TOKEN_IN && p->ep->pipeline) {
+                    usb_combined_input_packet_complete(&s->dev, p);
+                } else {
+                    usb_packet_complete(&s->dev, p);
+                }
             }
         }
 
@@ -407,6 +424,11 @@ static void usb_host_async_cancel(USBDevice *dev, USBPacket *p)
     USBHostDevice *s = DO_UPCAST(USBHostDevice, dev, dev);
     AsyncURB *aurb;
 
+    if (p->combined) {
+        usb_combined_packet_cancel(dev, p);
+        return;
+    }
+
     trace_usb_host_req_canceled(s->bus_num, s->addr, p);
 
     QLIST_FOREACH(aurb, &s->aurbs, next) {
@@ -674,11 +696,15 @@ static void usb_host_handle_destroy(USBDevice *dev)
    likely suffer a buffer underrun / overrun. */
 static AsyncURB *usb_host_alloc_iso(USBHostDevice *s, int pid, uint8_t ep)
 {
+    struct endp_data *e = get_endp(s, pid, ep);
     AsyncURB *aurb;
     int i, j, len = usb_ep_get_max_packet_size(&s->dev, pid, ep);
 
-    aurb = g_malloc0(s->iso_urb_count * sizeof(*aurb));
-    for (i = 0; i < s->iso_urb_count; i++) {
+    if (e->iso_urb_count < s->iso_urb_count) {
+        e->iso_urb_count = s->iso_urb_count;
+    }
+    aurb = g_malloc0(e->iso_urb_count * sizeof(*aurb));
+    for (i = 0; i < e->iso_urb_count; i++) {
         aurb[i].urb.endpoint      = ep;
         aurb[i].urb.buffer_length = ISO_FRAME_DESC_PER_URB * len;
         aurb[i].urb.buffer        = g_malloc(aurb[i].urb.buffer_length);
@@ -700,6 +726,7 @@ static AsyncURB *usb_host_alloc_iso(USBHostDevice *s, int pid, uint8_t ep)
 
 static void usb_host_stop_n_free_iso(USBHostDevice *s, int pid, uint8_t ep)
 {
+    struct endp_data *e = get_endp(s, pid, ep);
     AsyncURB *aurb;
     int i, ret, killed = 0, free = 1;
 
@@ -708,7 +735,7 @@ static void usb_host_stop_n_free_iso(USBHostDevice *s, int pid, uint8_t ep)
         return;
     }
 
-    for (i = 0; i < s->iso_urb_count; i++) {
+    for (i = 0; i < e->iso_urb_count; i++) {
         /* in flight? */
         if (aurb[i].iso_frame_idx == -1) {
             ret = ioctl(s->fd, USBDEVFS_DISCARDURB, &aurb[i]);
@@ -726,7 +753,7 @@ static void usb_host_stop_n_free_iso(USBHostDevice *s, int pid, uint8_t ep)
         async_complete(s);
     }
 
-    for (i = 0; i < s->iso_urb_count; i++) {
+    for (i = 0; i < e->iso_urb_count; i++) {
         g_free(aurb[i].urb.buffer);
     }
 
@@ -755,6 +782,7 @@ static void urb_status_to_usb_ret(int status, USBPacket *p)
 
 static void usb_host_handle_iso_data(USBHostDevice *s, USBPacket *p, int in)
 {
+    struct endp_data *e = get_endp(s, p->pid, p->ep->nr);
     AsyncURB *aurb;
     int i, j, max_packet_size, offset, len;
     uint8_t *buf;
@@ -766,6 +794,19 @@ static void usb_host_handle_iso_data(USBHostDevice *s, USBPacket *p, int in)
     }
 
     aurb = get_iso_urb(s, p->pid, p->ep->nr);
+    if (aurb && e->iso_dry_time && e->inflight == 0) {
+        /* The stream ran dry, so it has already skipped; restart it with
+           more buffering rather than skipping again on the next hiccup */
+        if (qemu_get_clock_ms(rt_clock) - e->iso_dry_time < ISO_DRY_MS &&
+            e->iso_urb_count < ISO_URB_COUNT_MAX) {
+            usb_host_stop_n_free_iso(s, p->pid, p->ep->nr);
+            e->iso_urb_count = MIN(e->iso_urb_count * 2, ISO_URB_COUNT_MAX);
+            trace_usb_host_iso_grow(s->bus_num, s->addr, p->ep->nr,
+                                    e->iso_urb_count);
+            aurb = NULL;
+        }
+        e->iso_dry_time = 0;
+    }
     if (!aurb) {
         aurb = usb_host_alloc_iso(s, p->pid, p->ep->nr);
     }
@@ -812,13 +853,14 @@ static void usb_host_handle_iso_data(USBHostDevice *s, USBPacket *p, int in)
             set_iso_buffer_used(s, p->pid, p->ep->nr, offset);
 
             /* Start the stream once we have buffered enough data */
-            if (!is_iso_started(s, p->pid, p->ep->nr) && i == 1 && j == 8) {
+            if (!is_iso_started(s, p->pid, p->ep->nr) &&
+                i == MAX(1, e->iso_urb_count / 4) && j == 8) {
                 set_iso_started(s, p->pid, p->ep->nr);
             }
         }
         aurb[i].iso_frame_idx++;
         if (aurb[i].iso_frame_idx == ISO_FRAME_DESC_PER_URB) {
-            i = (i + 1) % s->iso_urb_count;
+            i = (i + 1) % e->iso_urb_count;
             set_iso_urb_idx(s, p->pid, p->ep->nr, i);
         }
     } else {
@@ -831,7 +873,7 @@ static void usb_host_handle_iso_data(USBHostDevice *s, USBPacket *p, int in)
 
     if (is_iso_started(s, p->pid, p->ep->nr)) {
         /* (Re)-submit all fully consumed / filled urbs */
-        for (i = 0; i < s->iso_urb_count; i++) {
+        for (i = 0; i < e->iso_urb_count; i++) {
             if (aurb[i].iso_frame_idx == ISO_FRAME_DESC_PER_URB) {
                 if (ioctl(s->fd, USBDEVFS_SUBMITURB, &aurb[i]) < 0) {
                     perror("USBDEVFS_SUBMITURB");
@@ -859,7 +901,8 @@ static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
     USBHostDevice *s = DO_UPCAST(USBHostDevice, dev, dev);
     struct usbdevfs_urb *urb;
     AsyncURB *aurb;
-    int ret, rem, prem, v;
+    QEMUIOVector *iov;
+    int ret, rem, prem, v, max;
     uint8_t *pbuf;
     uint8_t ep;
 
@@ -874,6 +917,14 @@ static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
         return;
     }
 
+    /* Pipelined bulk in packets get queued, and then submitted combined by
+       usb_host_flush_ep_queue */
+    if (p->state == USB_PACKET_SETUP && p->pid == USB_TOKEN_IN &&
+            p->ep->pipeline) {
+        p->status = USB_RET_ADD_TO_QUEUE;
+        return;
+    }
+
     if (p->pid == USB_TOKEN_IN) {
         ep = p->ep->nr | 0x80;
     } else {
@@ -898,15 +949,17 @@ static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
         return;
     }
 
+    iov = p->combined ? &p->combined->iov : &p->iov;
+
     v = 0;
     prem = 0;
     pbuf = NULL;
-    rem = p->iov.size;
+    rem = iov->size;
     do {
         if (prem == 0 && rem > 0) {
-            assert(v < p->iov.niov);
-            prem = p->iov.iov[v].iov_len;
-            pbuf = p->iov.iov[v].iov_base;
+            assert(v < iov->niov);
+            prem = iov->iov[v].iov_len;
+            pbuf = iov->iov[v].iov_base;
             assert(prem <= rem);
             v++;
         }
@@ -920,13 +973,14 @@ static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
         urb->buffer        = pbuf;
         urb->buffer_length = prem;
 
-        if (urb->buffer_length > MAX_USBFS_BUFFER_SIZE) {
-            urb->buffer_length = MAX_USBFS_BUFFER_SIZE;
+        max = MAX_USBFS_BUFFER_SIZE;
+        if (urb->type == USBDEVFS_URB_TYPE_BULK) {
+            max = s->bulk_urb_size;
         }
-        pbuf += urb->buffer_length;
-        prem -= urb->buffer_length;
-        rem  -= urb->buffer_length;
-        if (rem) {
+        if (urb->buffer_length > max) {
+            urb->buffer_length = max;
+        }
+        if (rem - urb->buffer_length) {
             aurb->more         = 1;
         }
 
@@ -937,6 +991,16 @@ static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
         DPRINTF("husb: data submit: ep 0x%x, len %u, more %d, packet %p, aurb %p\n",
                 urb->endpoint, urb->buffer_length, aurb->more, p, aurb);
 
+        if (ret < 0 && (errno == EINVAL || errno == ENOMEM) &&
+            urb->buffer_length > MAX_USBFS_BUFFER_SIZE) {
+            /* old kernel, or out of usbfs memory: split as we used to */
+            DPRINTF("husb: bulk urb of %u refused, using %d from now on\n",
+                    urb->buffer_length, MAX_USBFS_BUFFER_SIZE);
+            s->bulk_urb_size = MAX_USBFS_BUFFER_SIZE;
+            async_free(aurb);
+            continue;
+        }
+
         if (ret < 0) {
             perror("USBDEVFS_SUBMITURB");
             async_free(aurb);
@@ -955,11 +1019,21 @@ static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
             }
             return;
         }
+        pbuf += urb->buffer_length;
+        prem -= urb->buffer_length;
+        rem  -= urb->buffer_length;
     } while (rem > 0);
 
     p->status = USB_RET_ASYNC;
 }
 
+static void usb_host_flush_ep_queue(USBDevice *dev, USBEndpoint *ep)
+{
+    if (ep->pid == USB_TOKEN_IN && ep->pipeline) {
+        usb_ep_combine_input_packets(ep);
+    }
+}
+
 static int ctrl_error(void)
 {
     if (errno == ETIMEDOUT) {
@@ -1240,8 +1314,7 @@ static void usb_linux_update_endp_table(USBHostDevice *s)
                 usb_ep_set_type(&s->dev, pid, ep, type);
                 usb_ep_set_ifnum(&s->dev, pid, ep, interface);
                 if ((s->options & (1 << USB_HOST_OPT_PIPELINE)) &&
-                    (type == USB_ENDPOINT_XFER_BULK) &&
-                    (pid == USB_TOKEN_OUT)) {
+                    (type == USB_ENDPOINT_XFER_BULK)) {
                     usb_ep_set_pipeline(&s->dev, pid, ep, true);
                 }
 
@@ -1480,6 +1553,7 @@ static int usb_host_initfn(USBDevice *dev)
     dev->auto_attach = 0;
     s->fd = -1;
     s->hub_fd = -1;
+    s->bulk_urb_size = MAX_USBFS_BULK_SIZE;
 
     QTAILQ_INSERT_TAIL(&hostdevs, s, next);
     s->exit.notify = usb_host_exit_notifier;
@@ -1528,6 +1602,7 @@ static void usb_host_class_initfn(ObjectClass *klass, void *data)
     uc->cancel_packet  = usb_host_async_cancel;
     uc->handle_data    = usb_host_handle_data;
     uc->handle_control = usb_host_handle_control;
+    uc->flush_ep_queue = usb_host_flush_ep_queue;
     uc->handle_reset   = usb_host_handle_reset;
     uc->handle_destroy = usb_host_handle_destroy;
     dc->vmsd = &vmstate_usb_host;
@@ -79,6 +79,8 @@ struct endp_data {
     QTAILQ_HEAD(, buf_packet) bufpq;
     int32_t bufpq_size;
     int32_t bufpq_target_size;
+    uint32_t bufpq_underruns; /* guest found the queue empty */
+    uint32_t bufpq_overruns;  /* packets dropped because the queue was full */
     USBPacket *pending_async_packet;
 };
 
@@ -101,6 +103,10 @@ struct USBRedirDevice {
     uint8_t debug;
     char *filter_str;
     int32_t bootindex;
+    uint32_t iso_buffer_ms;
+    uint32_t bulk_buffer_pkts;
+    uint32_t bulk_transfer_size;
+    uint8_t bulk_transfers;
     /* Data passed from chardev the fd_read cb to the usbredirparser read cb */
     const uint8_t *read_buf;
     int read_buf_size;
@@ -414,11 +420,9 @@ static USBPacket *usbredir_find_packet_by_id(USBRedirDevice *dev,
     return p;
 }
 
-static void bufp_alloc(USBRedirDevice *dev, uint8_t *data, uint16_t len,
-    uint8_t status, uint8_t ep, void *free_on_destroy)
+/* Returns true if the next packet for ep must be dropped */
+static bool bufp_overrun(USBRedirDevice *dev, uint8_t ep)
 {
-    struct buf_packet *bufp;
-
     if (!dev->endpoint[EP2I(ep)].bufpq_dropping_packets &&
         dev->endpoint[EP2I(ep)].bufpq_size >
             2 * dev->endpoint[EP2I(ep)].bufpq_target_size) {
@@ -430,11 +434,18 @@ static void bufp_alloc(USBRedirDevice *dev, uint8_t *data, uint16_t len,
     if (dev->endpoint[EP2I(ep)].bufpq_dropping_packets) {
         if (dev->endpoint[EP2I(ep)].bufpq_size >
                 dev->endpoint[EP2I(ep)].bufpq_target_size) {
-            free(data);
-            return;
+            dev->endpoint[EP2I(ep)].bufpq_overruns++;
+            return true;
         }
         dev->endpoint[EP2I(ep)].bufpq_dropping_packets = 0;
     }
+    return false;
+}
+
+static void bufp_queue(USBRedirDevice *dev, uint8_t *data, uint16_t len,
+    uint8_t status, uint8_t ep, void *free_on_destroy)
+{
+    struct buf_packet *bufp;
 
     bufp = g_malloc(sizeof(struct buf_packet));
     bufp->data   = data;
@@ -446,6 +457,16 @@ static void bufp_alloc(USBRedirDevice *dev, uint8_t *data, uint16_t len,
     dev->endpoint[EP2I(ep)].bufpq_size++;
 }
 
+static void bufp_alloc(USBRedirDevice *dev, uint8_t *data, uint16_t len,
+    uint8_t status, uint8_t ep, void *free_on_destroy)
+{
+    if (bufp_overrun(dev, ep)) {
+        free(data);
+        return;
+    }
+    bufp_queue(dev, data, len, status, ep, free_on_destroy);
+}
+
 static void bufp_free(USBRedirDevice *dev, struct buf_packet *bufp,
     uint8_t ep)
 {
@@ -457,11 +478,24 @@ static void bufp_free(USBRedirDevice *dev, struct buf_packet *bufp,
 
 static void usbredir_free_bufpq(USBRedirDevice *dev, uint8_t ep)
 {
+    struct endp_data *endp = &dev->endpoint[EP2I(ep)];
     struct buf_packet *buf, *buf_next;
 
-    QTAILQ_FOREACH_SAFE(buf, &dev->endpoint[EP2I(ep)].bufpq, next, buf_next) {
+    QTAILQ_FOREACH_SAFE(buf, &endp->bufpq, next, buf_next) {
         bufp_free(dev, buf, ep);
     }
+
+    /* The stream is over, say how well the buffer size suited it */
+    if (endp->bufpq_overruns) {
+        WARNING("ep %02X buffer target %d underruns %u overruns %u\n", ep,
+                endp->bufpq_target_size, endp->bufpq_underruns,
+                endp->bufpq_overruns);
+    } else if (endp->bufpq_underruns) {
+        INFO("ep %02X buffer target %d underruns %u\n", ep,
+             endp->bufpq_target_size, endp->bufpq_underruns);
+    }
+    endp->bufpq_underruns = 0;
+    endp->bufpq_overruns = 0;
 }
 
 /*
@@ -493,8 +527,10 @@ static void usbredir_handle_iso_data(USBRedirDevice *dev, USBPacket *p,
         } else {
             pkts_per_sec = 1000 / dev->endpoint[EP2I(ep)].interval;
         }
-        /* Testing has shown that we need circa 60 ms buffer */
-        dev->endpoint[EP2I(ep)].bufpq_target_size = (pkts_per_sec * 60) / 1000;
+        /* Testing has shown that we need circa 60 ms buffer on a LAN,
+           the iso_buffer_ms property allows more for slower links */
+        dev->endpoint[EP2I(ep)].bufpq_target_size =
+            MAX((pkts_per_sec * dev->iso_buffer_ms) / 1000, 1);
 
         /* Aim for approx 100 interrupts / second on the client to
            balance latency and interrupt load */
@@ -548,6 +584,9 @@ static void usbredir_handle_iso_data(USBRedirDevice *dev, USBPacket *p,
             /* Check iso_error for stream errors, otherwise its an underrun */
             status = dev->endpoint[EP2I(ep)].iso_error;
             dev->endpoint[EP2I(ep)].iso_error = 0;
+            if (!status && dev->endpoint[EP2I(ep)].iso_started) {
+                dev->endpoint[EP2I(ep)].bufpq_underruns++;
+            }
             p->status = status ? USB_RET_IOERROR : USB_RET_SUCCESS;
             return;
         }
@@ -690,10 +729,11 @@ static void usbredir_handle_buffered_bulk_in_data(USBRedirDevice *dev,
         struct usb_redir_start_bulk_receiving_header start = {
             .endpoint = ep,
             .stream_id = 0,
-            .no_transfers = 5,
+            .no_transfers = dev->bulk_transfers,
         };
         /* Round bytes_per_transfer up to a multiple of max_packet_size */
-        bpt = 512 + dev->endpoint[EP2I(ep)].max_packet_size - 1;
+        bpt = dev->bulk_transfer_size +
+              dev->endpoint[EP2I(ep)].max_packet_size - 1;
         bpt /= dev->endpoint[EP2I(ep)].max_packet_size;
         bpt *= dev->endpoint[EP2I(ep)].max_packet_size;
         start.bytes_per_transfer = bpt;
@@ -705,12 +745,13 @@ static void usbredir_handle_buffered_bulk_in_data(USBRedirDevice *dev,
         dev->endpoint[EP2I(ep)].bulk_receiving_started = 1;
         /* We don't really want to drop bulk packets ever, but
            having some upper limit to how much we buffer is good. */
-        dev->endpoint[EP2I(ep)].bufpq_target_size = 5000;
+        dev->endpoint[EP2I(ep)].bufpq_target_size = dev->bulk_buffer_pkts;
         dev->endpoint[EP2I(ep)].bufpq_dropping_packets = 0;
     }
 
     if (QTAILQ_EMPTY(&dev->endpoint[EP2I(ep)].bufpq)) {
         DPRINTF("bulk-token-in ep %02X, no bulkp\n", ep);
+        dev->endpoint[EP2I(ep)].bufpq_underruns++;
         assert(dev->endpoint[EP2I(ep)].pending_async_packet == NULL);
         dev->endpoint[EP2I(ep)].pending_async_packet = p;
         p->status = USB_RET_ASYNC;
@@ -1273,6 +1314,27 @@ static int usbredir_initfn(USBDevice *udev)
         }
     }
 
+    if (dev->iso_buffer_ms == 0 || dev->iso_buffer_ms > 10000) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "iso_buffer_ms",
+                      "a buffer length of 1 to 10000 ms");
+        return -1;
+    }
+    if (dev->bulk_buffer_pkts == 0 || dev->bulk_buffer_pkts > INT32_MAX / 2) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "bulk_buffer_pkts",
+                      "a positive packet count");
+        return -1;
+    }
+    if (dev->bulk_transfers == 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "bulk_transfers",
+                      "a positive transfer count");
+        return -1;
+    }
+    if (dev->bulk_transfer_size == 0 || dev->bulk_transfer_size > 65536) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "bulk_transfer_size",
+                      "a transfer size of 1 to 65536 bytes");
+        return -1;
+    }
+
     dev->chardev_close_bh = qemu_bh_new(usbredir_chardev_close_bh, dev);
     dev->attach_timer = qemu_new_timer_ms(vm_clock, usbredir_do_attach, dev);
 
@@ -1948,6 +2010,14 @@ static void usbredir_buffered_bulk_packet(void *priv, uint64_t id,
         return;
     }
 
+    /* The chunks below share data, so queue all of them or none */
+    if (bufp_overrun(dev, ep)) {
+        WARNING("bulk receive buffer full, dropping %d bytes ep %02X\n",
+                data_len, ep);
+        free(data);
+        return;
+    }
+
     /* Data must be in maxp chunks for buffered_bulk_add_*_data_to_packet */
     len = dev->endpoint[EP2I(ep)].max_packet_size;
     status = usb_redir_success;
@@ -1958,8 +2028,7 @@ static void usbredir_buffered_bulk_packet(void *priv, uint64_t id,
             status = buffered_bulk_packet->status;
             free_on_destroy = data;
         }
-        /* bufp_alloc also adds the packet to the ep queue */
-        bufp_alloc(dev, data + i, len, status, ep, free_on_destroy);
+        bufp_queue(dev, data + i, len, status, ep, free_on_destroy);
     }
 
     if (dev->endpoint[EP2I(ep)].pending_async_packet) {
@@ -2320,6 +2389,12 @@ static Property usbredir_properties[] = {
     DEFINE_PROP_UINT8("debug", USBRedirDevice, debug, usbredirparser_warning),
     DEFINE_PROP_STRING("filter", USBRedirDevice, filter_str),
     DEFINE_PROP_INT32("bootindex", USBRedirDevice, bootindex, -1),
+    DEFINE_PROP_UINT32("iso_buffer_ms", USBRedirDevice, iso_buffer_ms, 60),
+    DEFINE_PROP_UINT32("bulk_buffer_pkts", USBRedirDevice, bulk_buffer_pkts,
+                       5000),
+    DEFINE_PROP_UINT8("bulk_transfers", USBRedirDevice, bulk_transfers, 5),
+    DEFINE_PROP_UINT32("bulk_transfer_size", USBRedirDevice,
+                       bulk_transfer_size, 512),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -562,6 +562,30 @@ static int vfio_enable_vectors(VFIODevice *vdev, bool msix)
     return ret;
 }
 
+/*
+ * Attempt to enable route through KVM irqchip,
+ * default to userspace handling if unavailable.
+ */
+static void vfio_msix_vector_route(VFIOMSIVector *vector, MSIMessage *msg,
+                                   IOHandler *handler)
+{
+    int fd = event_notifier_get_fd(&vector->interrupt);
+
+    vector->virq = msg ? kvm_irqchip_add_msi_route(kvm_state, *msg) : -1;
+    if (vector->virq < 0 ||
+        kvm_irqchip_add_irqfd_notifier(kvm_state, &vector->interrupt,
+                                       vector->virq) < 0) {
+        if (vector->virq >= 0) {
+            kvm_irqchip_release_virq(kvm_state, vector->virq);
+            vector->virq = -1;
+        }
+        qemu_set_fd_handler(fd, handler, NULL, vector);
+    } else {
+        /* KVM picks up an interrupt that fired while we switched over */
+        qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    }
+}
+
 static int vfio_msix_vector_do_use(PCIDevice *pdev, unsigned int nr,
                                    MSIMessage *msg, IOHandler *handler)
 {
@@ -574,6 +598,13 @@ static int vfio_msix_vector_do_use(PCIDevice *pdev, unsigned int nr,
             vdev->host.function, nr);
 
     vector = &vdev->msi_vectors[nr];
+
+    /* Unmasked again, the host side is still set up */
+    if (vector->use) {
+        vfio_msix_vector_route(vector, msg, handler);
+        return 0;
+    }
+
     vector->vdev = vdev;
     vector->use = true;
 
@@ -583,21 +614,7 @@ static int vfio_msix_vector_do_use(PCIDevice *pdev, unsigned int nr,
         error_report("vfio: Error: event_notifier_init failed");
     }
 
-    /*
-     * Attempt to enable route through KVM irqchip,
-     * default to userspace handling if unavailable.
-     */
-    vector->virq = msg ? kvm_irqchip_add_msi_route(kvm_state, *msg) : -1;
-    if (vector->virq < 0 ||
-        kvm_irqchip_add_irqfd_notifier(kvm_state, &vector->interrupt,
-                                       vector->virq) < 0) {
-        if (vector->virq >= 0) {
-            kvm_irqchip_release_virq(kvm_state, vector->virq);
-            vector->virq = -1;
-        }
-        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                            handler, NULL, vector);
-    }
+    vfio_msix_vector_route(vector, msg, handler);
 
     /*
      * We don't want to have the host allocate all possible MSI vectors
@@ -645,54 +662,30 @@ static int vfio_msix_vector_use(PCIDevice *pdev,
     return vfio_msix_vector_do_use(pdev, nr, &msg, vfio_msi_interrupt);
 }
 
+/*
+ * A masked vector stays enabled on the host, it only stops bypassing QEMU.
+ * Its interrupts then reach msix_notify(), which sets the pending bit, and
+ * msix.c delivers them once the guest unmasks the vector again.  Guests
+ * that mask and unmask vectors around each interrupt thus no longer make
+ * us tear down and set up the host vector through VFIO every time.
+ */
 static void vfio_msix_vector_release(PCIDevice *pdev, unsigned int nr)
 {
     VFIODevice *vdev = DO_UPCAST(VFIODevice, pdev, pdev);
     VFIOMSIVector *vector = &vdev->msi_vectors[nr];
-    int argsz;
-    struct vfio_irq_set *irq_set;
-    int32_t *pfd;
 
     DPRINTF("%s(%04x:%02x:%02x.%x) vector %d released\n", __func__,
             vdev->host.domain, vdev->host.bus, vdev->host.slot,
             vdev->host.function, nr);
 
-    /*
-     * XXX What's the right thing to do here?  This turns off the interrupt
-     * completely, but do we really just want to switch the interrupt to
-     * bouncing through userspace and let msix.c drop it?  Not sure.
-     */
-    msix_vector_unuse(pdev, nr);
-
-    argsz = sizeof(*irq_set) + sizeof(*pfd);
-
-    irq_set = g_malloc0(argsz);
-    irq_set->argsz = argsz;
-    irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD |
-                     VFIO_IRQ_SET_ACTION_TRIGGER;
-    irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
-    irq_set->start = nr;
-    irq_set->count = 1;
-    pfd = (int32_t *)&irq_set->data;
-
-    *pfd = -1;
-
-    ioctl(vdev->fd, VFIO_DEVICE_SET_IRQS, irq_set);
-
-    g_free(irq_set);
-
-    if (vector->virq < 0) {
-        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                            NULL, NULL, NULL);
-    } else {
+    if (vector->virq >= 0) {
         kvm_irqchip_remove_irqfd_notifier(kvm_state, &vector->interrupt,
                                           vector->virq);
         kvm_irqchip_release_virq(kvm_state, vector->virq);
         vector->virq = -1;
     }
-
-    event_notifier_cleanup(&vector->interrupt);
-    vector->use = false;
+    qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                        vfio_msi_interrupt, NULL, vector);
 }
 
 static void vfio_enable_msix(VFIODevice *vdev)
@@ -712,9 +705,9 @@ static void vfio_enable_msix(VFIODevice *vdev)
      * can't rely on a vector_use callback (from request_irq() in the guest)
      * to switch the physical device into MSI-X mode because that may come a
      * long time after pci_enable_msix().  This code enables vector 0 with
-     * triggering to userspace, then immediately release the vector, leaving
-     * the physical device with no vectors enabled, but MSI-X enabled, just
-     * like the guest view.
+     * triggering to userspace, then immediately releases the vector, leaving
+     * the physical device with MSI-X enabled and vector 0 only recording
+     * pending interrupts, just like the guest view of a masked vector.
      */
     vfio_msix_vector_do_use(&vdev->pdev, 0, NULL, NULL);
     vfio_msix_vector_release(&vdev->pdev, 0);
@@ -817,12 +810,36 @@ static void vfio_disable_msi_common(VFIODevice *vdev)
 
 static void vfio_disable_msix(VFIODevice *vdev)
 {
+    int i;
+
     msix_unset_vector_notifiers(&vdev->pdev);
 
     if (vdev->nr_vectors) {
         vfio_disable_irqindex(vdev, VFIO_PCI_MSIX_IRQ_INDEX);
     }
 
+    /* Released vectors are still set up, see vfio_msix_vector_release() */
+    for (i = 0; i < vdev->nr_vectors; i++) {
+        VFIOMSIVector *vector = &vdev->msi_vectors[i];
+
+        if (!vector->use) {
+            continue;
+        }
+
+        if (vector->virq >= 0) {
+            kvm_irqchip_remove_irqfd_notifier(kvm_state,
+                                              &vector->interrupt, vector->virq);
+            kvm_irqchip_release_virq(kvm_state, vector->virq);
+            vector->virq = -1;
+        } else {
+            qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                                NULL, NULL, NULL);
+        }
+
+        event_notifier_cleanup(&vector->interrupt);
+        msix_vector_unuse(&vdev->pdev, i);
+    }
+
     vfio_disable_msi_common(vdev);
 
     DPRINTF("%s(%04x:%02x:%02x.%x)\n", __func__, vdev->host.domain,
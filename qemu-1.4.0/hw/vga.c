@@ -28,6 +28,7 @@
 #include "pci/pci.h"
 #include "vga_int.h"
 #include "ui/pixel_ops.h"
+#include "qemu/pixel-conv.h"
 #include "qemu/timer.h"
 #include "xen.h"
 #include "trace.h"
@@ -1678,7 +1679,8 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 {
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
     int width, height, shift_control, line_offset, bwidth, bits;
-    ram_addr_t page0, page1, page_min, page_max;
+    ram_addr_t page0, page1, region_start, region_end;
+    DirtyBitmapSnapshot *snap;
     int disp_width, multi_scan, multi_run;
     uint8_t *d;
     uint32_t v, addr1, addr;
@@ -1823,11 +1825,24 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
     y_start = -1;
-    page_min = -1;
-    page_max = 0;
     d = ds_get_data(s->ds);
     linesize = ds_get_linesize(s->ds);
     y1 = 0;
+
+    /* grab and clear the dirty state of the whole displayed area at once */
+    region_start = addr1;
+    region_end = MIN(addr1 + (ram_addr_t)line_offset * height + bwidth,
+                     s->vram_size);
+    if (s->line_compare < height) {
+        /* split screen mode */
+        region_start = 0;
+    }
+    if (region_start > region_end) {
+        region_start = region_end;
+    }
+    snap = memory_region_snapshot_and_clear_dirty(&s->vram, region_start,
+                                                  region_end - region_start,
+                                                  DIRTY_MEMORY_VGA);
     for(y = 0; y < height; y++) {
         addr = addr1;
         if (!(s->cr[VGA_CRTC_MODE] & 1)) {
@@ -1842,17 +1857,18 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         update = full_update;
         page0 = addr;
         page1 = addr + bwidth - 1;
-        update |= memory_region_get_dirty(&s->vram, page0, page1 - page0,
-                                          DIRTY_MEMORY_VGA);
+        if (page0 < region_start || page1 >= region_end) {
+            /* not covered by the snapshot (CGA line addressing) */
+            update = 1;
+        } else {
+            update |= memory_region_snapshot_get_dirty(&s->vram, snap, page0,
+                                                       page1 - page0);
+        }
         /* explicit invalidation for the hardware cursor */
         update |= (s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1;
         if (update) {
             if (y_start < 0)
                 y_start = y;
-            if (page0 < page_min)
-                page_min = page0;
-            if (page1 > page_max)
-                page_max = page1;
             if (!(is_buffer_shared(s->ds->surface))) {
                 vga_draw_line(s, d, s->vram_ptr + addr, width);
                 if (s->cursor_draw_line)
@@ -1885,13 +1901,7 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         dpy_gfx_update(s->ds, 0, y_start,
                        disp_width, y - y_start);
     }
-    /* reset modified pages */
-    if (page_max >= page_min) {
-        memory_region_reset_dirty(&s->vram,
-                                  page_min,
-                                  page_max - page_min,
-                                  DIRTY_MEMORY_VGA);
-    }
+    g_free(snap);
     memset(s->invalidated_y_table, 0, ((height + 31) >> 5) * 4);
 }
 
@@ -342,8 +342,18 @@ static void glue(vga_draw_line8_, DEPTH)(VGACommonState *s1, uint8_t *d,
 
 #endif /* DEPTH != 15 */
 
-
-/* XXX: optimize */
+/* The common little-endian guest to 32 bpp host conversions go through
+ * the vectorized helpers in util/pixel-conv.c.
+ */
+#if DEPTH == 32 && !defined(TARGET_WORDS_BIGENDIAN)
+#ifdef BGR_FORMAT
+#define PIXEL_CONV_32
+#else
+#define PIXEL_CONV_15
+#define PIXEL_CONV_16
+#define PIXEL_CONV_24
+#endif
+#endif
 
 /*
  * 15 bit color
@@ -353,6 +363,8 @@ static void glue(vga_draw_line15_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 {
 #if DEPTH == 15 && defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
     memcpy(d, s, width * 2);
+#elif defined(PIXEL_CONV_15)
+    pixel_conv_15_to_32(d, s, width);
 #else
     int w;
     uint32_t v, r, g, b;
@@ -378,6 +390,8 @@ static void glue(vga_draw_line16_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 {
 #if DEPTH == 16 && defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
     memcpy(d, s, width * 2);
+#elif defined(PIXEL_CONV_16)
+    pixel_conv_16_to_32(d, s, width);
 #else
     int w;
     uint32_t v, r, g, b;
@@ -401,6 +415,9 @@ static void glue(vga_draw_line16_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 static void glue(vga_draw_line24_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
                                           const uint8_t *s, int width)
 {
+#if defined(PIXEL_CONV_24)
+    pixel_conv_24_to_32(d, s, width);
+#else
     int w;
     uint32_t r, g, b;
 
@@ -419,6 +436,7 @@ static void glue(vga_draw_line24_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
         s += 3;
         d += BPP;
     } while (--w != 0);
+#endif
 }
 
 /*
@@ -429,6 +447,8 @@ static void glue(vga_draw_line32_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 {
 #if DEPTH == 32 && defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN) && !defined(BGR_FORMAT)
     memcpy(d, s, width * 4);
+#elif defined(PIXEL_CONV_32)
+    pixel_conv_32_to_32bgr(d, s, width);
 #else
     int w;
     uint32_t r, g, b;
@@ -452,6 +472,10 @@ static void glue(vga_draw_line32_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 }
 
 #undef PUT_PIXEL2
+#undef PIXEL_CONV_15
+#undef PIXEL_CONV_16
+#undef PIXEL_CONV_24
+#undef PIXEL_CONV_32
 #undef DEPTH
 #undef BPP
 #undef PIXEL_TYPE
@@ -14,6 +14,7 @@
  */
 
 #include <sys/ioctl.h>
+#include <dirent.h>
 #include "vhost.h"
 #include "hw/hw.h"
 #include "qemu/range.h"
@@ -771,9 +772,79 @@ static void vhost_virtqueue_cleanup(struct vhost_virtqueue *vq)
     event_notifier_cleanup(&vq->masked_notifier);
 }
 
+/* Add the threads in @dir named @comm to @tids */
+static void vhost_scan_threads(const char *dir, const char *comm, GArray *tids)
+{
+    char path[PATH_MAX], buf[32];
+    struct dirent *de;
+    DIR *d;
+    FILE *f;
+    pid_t tid;
+
+    d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    while ((de = readdir(d))) {
+        tid = atoi(de->d_name);
+        if (tid <= 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%d/comm", dir, tid);
+        f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        if (fgets(buf, sizeof(buf), f)) {
+            buf[strcspn(buf, "\n")] = '\0';
+            if (!strcmp(buf, comm)) {
+                g_array_append_val(tids, tid);
+            }
+        }
+        fclose(f);
+    }
+    closedir(d);
+}
+
+/* The kernel does the work of every vhost device we own in a thread named
+ * "vhost-<our pid>": a kernel thread on older kernels, one of our own
+ * threads on newer ones.  List them all.
+ */
+static GArray *vhost_list_workers(void)
+{
+    GArray *tids = g_array_new(false, false, sizeof(pid_t));
+    char *comm = g_strdup_printf("vhost-%d", getpid());
+
+    vhost_scan_threads("/proc/self/task", comm, tids);
+    vhost_scan_threads("/proc", comm, tids);
+    g_free(comm);
+    return tids;
+}
+
+/* The worker that is in @after but not in @before, 0 if none is */
+static pid_t vhost_new_worker(GArray *before, GArray *after)
+{
+    int i, j;
+
+    for (i = 0; i < after->len; i++) {
+        pid_t tid = g_array_index(after, pid_t, i);
+
+        for (j = 0; j < before->len; j++) {
+            if (g_array_index(before, pid_t, j) == tid) {
+                break;
+            }
+        }
+        if (j == before->len) {
+            return tid;
+        }
+    }
+    return 0;
+}
+
 int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
                    bool force)
 {
+    GArray *workers, *new_workers;
     uint64_t features;
     int i, r;
     if (devfd >= 0) {
@@ -784,10 +855,18 @@ int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
             return -errno;
         }
     }
+    /* VHOST_SET_OWNER starts the worker; find it to report it and let it
+       be pinned */
+    workers = vhost_list_workers();
     r = ioctl(hdev->control, VHOST_SET_OWNER, NULL);
     if (r < 0) {
+        g_array_free(workers, true);
         goto fail;
     }
+    new_workers = vhost_list_workers();
+    hdev->worker = vhost_new_worker(workers, new_workers);
+    g_array_free(workers, true);
+    g_array_free(new_workers, true);
 
     r = ioctl(hdev->control, VHOST_GET_FEATURES, &features);
     if (r < 0) {
@@ -45,6 +45,8 @@ struct vhost_dev {
     vhost_log_chunk_t *log;
     unsigned long long log_size;
     bool force;
+    /* the thread the kernel does the work of this device in, 0 if unknown */
+    pid_t worker;
 };
 
 int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
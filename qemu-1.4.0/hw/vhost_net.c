@@ -279,6 +279,53 @@ void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
 {
     vhost_virtqueue_mask(&net->dev, dev, idx, mask);
 }
+
+int vhost_net_get_worker(VHostNetState *net)
+{
+    return net->dev.worker;
+}
+
+int vhost_net_set_affinity(VHostNetState *net, const char *cpus)
+{
+    cpu_set_t set;
+
+    if (qemu_parse_cpu_list(cpus, &set) < 0) {
+        return -EINVAL;
+    }
+    if (!net->dev.worker) {
+        return -ESRCH;
+    }
+    if (sched_setaffinity(net->dev.worker, sizeof(set), &set) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int vhost_net_get_worker_cpu(VHostNetState *net)
+{
+    char path[64], *contents, *p;
+    int i, cpu = -1;
+
+    if (!net->dev.worker) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/stat", net->dev.worker);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return -1;
+    }
+
+    /* "processor" is field 39; the thread name in field 2 is in parentheses
+       and may itself hold spaces, so count from the closing one */
+    p = strrchr(contents, ')');
+    for (i = 2; p && i < 39; i++) {
+        p = strchr(p + 1, ' ');
+    }
+    if (p) {
+        cpu = atoi(p + 1);
+    }
+    g_free(contents);
+    return cpu;
+}
 #else
 struct vhost_net *vhost_net_init(NetClientState *backend, int devfd,
                                  bool force)
@@ -325,4 +372,19 @@ void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
                               int idx, bool mask)
 {
 }
+
+int vhost_net_get_worker(VHostNetState *net)
+{
+    return 0;
+}
+
+int vhost_net_set_affinity(VHostNetState *net, const char *cpus)
+{
+    return -ENOSYS;
+}
+
+int vhost_net_get_worker_cpu(VHostNetState *net)
+{
+    return -1;
+}
 #endif
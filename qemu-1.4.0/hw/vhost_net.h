@@ -20,4 +20,11 @@ void vhost_net_ack_features(VHostNetState *net, unsigned features);
 bool vhost_net_virtqueue_pending(VHostNetState *net, int n);
 void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
                               int idx, bool mask);
+
+/* The host thread that moves the packets of @net, 0 if it is not known */
+int vhost_net_get_worker(VHostNetState *net);
+/* Pin that thread to the host CPUs in list @cpus, e.g. "0-3,8" */
+int vhost_net_set_affinity(VHostNetState *net, const char *cpus);
+/* The host CPU that thread last ran on, -1 if not known */
+int vhost_net_get_worker_cpu(VHostNetState *net);
 #endif
@@ -23,6 +23,7 @@
 #include "virtio-balloon.h"
 #include "sysemu/kvm.h"
 #include "exec/address-spaces.h"
+#include "migration/migration.h"
 #include "qapi/visitor.h"
 
 #if defined(__linux__)
@@ -32,7 +33,7 @@
 typedef struct VirtIOBalloon
 {
     VirtIODevice vdev;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *hvq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
@@ -49,15 +50,73 @@ static VirtIOBalloon *to_virtio_balloon(VirtIODevice *vdev)
     return (VirtIOBalloon *)vdev;
 }
 
-static void balloon_page(void *addr, int deflate)
+static void balloon_page(void *addr, size_t len, int deflate)
 {
 #if defined(__linux__)
-    if (!kvm_enabled() || kvm_has_sync_mmu())
-        qemu_madvise(addr, TARGET_PAGE_SIZE,
-                deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+    uintptr_t start = (uintptr_t)addr, end = start + len;
+    uintptr_t mask = ~(qemu_real_host_page_size - 1);
+
+    if (kvm_enabled() && !kvm_has_sync_mmu()) {
+        return;
+    }
+
+    if (deflate) {
+        start &= mask;
+    } else {
+        /* hugetlbfs pages only go back whole, if the host lets them go
+           at all, so -mem-path RAM is left alone */
+        if (mem_path) {
+            return;
+        }
+        /* only whole host pages can be dropped; transparent huge pages
+           are not split when a range covers them */
+        start = (start + qemu_real_host_page_size - 1) & mask;
+        end &= mask;
+        if (start >= end) {
+            return;
+        }
+    }
+    qemu_madvise((void *)start, end - start,
+                 deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
 #endif
 }
 
+static int pfn_cmp(const void *a, const void *b)
+{
+    uint32_t pa = *(const uint32_t *)a, pb = *(const uint32_t *)b;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+/* Apply what vq asks for to the RAM in guest-physical [pa, pa + len) */
+static void balloon_range(VirtIOBalloon *s, VirtQueue *vq, hwaddr pa,
+                          hwaddr len)
+{
+    MemoryRegionSection section;
+    hwaddr end = pa + len;
+
+    while (pa < end) {
+        /* FIXME: remove get_system_memory(), but how? */
+        section = memory_region_find(get_system_memory(), pa, end - pa);
+        if (!section.size) {
+            break;
+        }
+        pa = section.offset_within_address_space + section.size;
+        if (!memory_region_is_ram(section.mr)) {
+            continue;
+        }
+
+        if (vq == s->hvq) {
+            ram_free_page_hint(section.mr->ram_addr +
+                               section.offset_within_region, section.size);
+        } else {
+            balloon_page(memory_region_get_ram_ptr(section.mr) +
+                         section.offset_within_region, section.size,
+                         vq == s->dvq);
+        }
+    }
+}
+
 static const char *balloon_stat_names[] = {
    [VIRTIO_BALLOON_S_SWAP_IN] = "stat-swap-in",
    [VIRTIO_BALLOON_S_SWAP_OUT] = "stat-swap-out",
@@ -194,34 +253,36 @@ static void balloon_stats_set_poll_interval(Object *obj, struct Visitor *v,
     balloon_stats_change_timer(s, 0);
 }
 
+/* Inflate, deflate and free page hint buffers all hold PFNs.  Each buffer
+ * is sorted and done a run of contiguous pages at a time, which makes one
+ * madvise() out of what the guest usually sends as a few long runs.
+ */
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = to_virtio_balloon(vdev);
     VirtQueueElement elem;
-    MemoryRegionSection section;
 
     while (virtqueue_pop(vq, &elem)) {
-        size_t offset = 0;
-        uint32_t pfn;
-
-        while (iov_to_buf(elem.out_sg, elem.out_num, offset, &pfn, 4) == 4) {
-            ram_addr_t pa;
-            ram_addr_t addr;
-
-            pa = (ram_addr_t)ldl_p(&pfn) << VIRTIO_BALLOON_PFN_SHIFT;
-            offset += 4;
-
-            /* FIXME: remove get_system_memory(), but how? */
-            section = memory_region_find(get_system_memory(), pa, 1);
-            if (!section.size || !memory_region_is_ram(section.mr))
-                continue;
-
-            /* Using memory_region_get_ram_ptr is bending the rules a bit, but
-               should be OK because we only want a single page.  */
-            addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
+        size_t offset = iov_size(elem.out_sg, elem.out_num) & ~3;
+        unsigned int i, j, n = offset / 4;
+        uint32_t *pfns = g_new(uint32_t, n);
+
+        iov_to_buf(elem.out_sg, elem.out_num, 0, pfns, offset);
+        for (i = 0; i < n; i++) {
+            pfns[i] = ldl_p(&pfns[i]);
+        }
+        qsort(pfns, n, sizeof(pfns[0]), pfn_cmp);
+
+        for (i = 0; i < n; i = j) {
+            for (j = i + 1; j < n && pfns[j] - pfns[j - 1] <= 1; j++) {
+                /* duplicates do not break the run */
+            }
+            balloon_range(s, vq,
+                          (hwaddr)pfns[i] << VIRTIO_BALLOON_PFN_SHIFT,
+                          (hwaddr)(pfns[j - 1] - pfns[i] + 1) <<
+                          VIRTIO_BALLOON_PFN_SHIFT);
         }
+        g_free(pfns);
 
         virtqueue_push(vq, &elem, offset);
         virtio_notify(vdev, vq);
@@ -298,6 +359,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
 static uint32_t virtio_balloon_get_features(VirtIODevice *vdev, uint32_t f)
 {
     f |= (1 << VIRTIO_BALLOON_F_STATS_VQ);
+    f |= (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT);
     return f;
 }
 
@@ -372,6 +434,7 @@ VirtIODevice *virtio_balloon_init(DeviceState *dev)
     s->ivq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(&s->vdev, 128, virtio_balloon_receive_stats);
+    s->hvq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
 
     s->qdev = dev;
     register_savevm(dev, "virtio-balloon", -1, 1,
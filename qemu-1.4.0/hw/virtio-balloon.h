@@ -26,6 +26,12 @@
 /* The feature bitmap for virtio balloon */
 #define VIRTIO_BALLOON_F_MUST_TELL_HOST 0 /* Tell before reclaiming pages */
 #define VIRTIO_BALLOON_F_STATS_VQ 1       /* Memory stats virtqueue */
+/* Free page hint virtqueue: the guest sends PFNs, as for inflating, of
+ * pages it took off its free lists and holds until the buffer comes back.
+ * They stay with the guest; a migration need not send them unless they
+ * are written to again.
+ */
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT 3
 
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
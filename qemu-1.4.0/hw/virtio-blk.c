@@ -49,15 +49,33 @@ static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
     struct virtio_scsi_inhdr *scsi;
     QEMUIOVector qiov;
+    uint64_t sector;
     struct VirtIOBlockReq *next;
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
+static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s,
+                                                VirtQueueElement *elem)
+{
+    VirtIOBlockReq *req = g_malloc(sizeof(*req));
+    req->dev = s;
+    req->elem = elem;
+    req->qiov.size = 0;
+    req->next = NULL;
+    return req;
+}
+
+static void virtio_blk_free_request(VirtIOBlockReq *req)
+{
+    virtqueue_elem_release(req->dev->vq, req->elem);
+    g_free(req);
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
 {
     VirtIOBlock *s = req->dev;
@@ -65,7 +83,7 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
+    virtqueue_push(s->vq, req->elem, req->qiov.size + sizeof(*req->in));
     virtio_notify(&s->vdev, s->vq);
 }
 
@@ -81,7 +99,7 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     } else if (action == BDRV_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         bdrv_acct_done(s->bs, &req->acct);
-        g_free(req);
+        virtio_blk_free_request(req);
     }
 
     bdrv_error_action(s->bs, action, is_read, error);
@@ -102,7 +120,7 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
 
     virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     bdrv_acct_done(req->dev->bs, &req->acct);
-    g_free(req);
+    virtio_blk_free_request(req);
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
@@ -117,30 +135,7 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
 
     virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     bdrv_acct_done(req->dev->bs, &req->acct);
-    g_free(req);
-}
-
-static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
-{
-    VirtIOBlockReq *req = g_malloc(sizeof(*req));
-    req->dev = s;
-    req->qiov.size = 0;
-    req->next = NULL;
-    return req;
-}
-
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
-{
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-
-    if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
-            g_free(req);
-            return NULL;
-        }
-    }
-
-    return req;
+    virtio_blk_free_request(req);
 }
 
 static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
@@ -158,9 +153,9 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
      * We also at least require the virtio_blk_inhdr, the virtio_scsi_inhdr
      * and the sense buffer pointer in the input segments.
      */
-    if (req->elem.out_num < 2 || req->elem.in_num < 3) {
+    if (req->elem->out_num < 2 || req->elem->in_num < 3) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
-        g_free(req);
+        virtio_blk_free_request(req);
         return;
     }
 
@@ -168,7 +163,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
      * The scsi inhdr is placed in the second-to-last input segment, just
      * before the regular inhdr.
      */
-    req->scsi = (void *)req->elem.in_sg[req->elem.in_num - 2].iov_base;
+    req->scsi = (void *)req->elem->in_sg[req->elem->in_num - 2].iov_base;
 
     if (!req->dev->blk->scsi) {
         status = VIRTIO_BLK_S_UNSUPP;
@@ -178,7 +173,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     /*
      * No support for bidirection commands yet.
      */
-    if (req->elem.out_num > 2 && req->elem.in_num > 3) {
+    if (req->elem->out_num > 2 && req->elem->in_num > 3) {
         status = VIRTIO_BLK_S_UNSUPP;
         goto fail;
     }
@@ -187,34 +182,34 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     struct sg_io_hdr hdr;
     memset(&hdr, 0, sizeof(struct sg_io_hdr));
     hdr.interface_id = 'S';
-    hdr.cmd_len = req->elem.out_sg[1].iov_len;
-    hdr.cmdp = req->elem.out_sg[1].iov_base;
+    hdr.cmd_len = req->elem->out_sg[1].iov_len;
+    hdr.cmdp = req->elem->out_sg[1].iov_base;
     hdr.dxfer_len = 0;
 
-    if (req->elem.out_num > 2) {
+    if (req->elem->out_num > 2) {
         /*
          * If there are more than the minimally required 2 output segments
          * there is write payload starting from the third iovec.
          */
         hdr.dxfer_direction = SG_DXFER_TO_DEV;
-        hdr.iovec_count = req->elem.out_num - 2;
+        hdr.iovec_count = req->elem->out_num - 2;
 
         for (i = 0; i < hdr.iovec_count; i++)
-            hdr.dxfer_len += req->elem.out_sg[i + 2].iov_len;
+            hdr.dxfer_len += req->elem->out_sg[i + 2].iov_len;
 
-        hdr.dxferp = req->elem.out_sg + 2;
+        hdr.dxferp = req->elem->out_sg + 2;
 
-    } else if (req->elem.in_num > 3) {
+    } else if (req->elem->in_num > 3) {
         /*
          * If we have more than 3 input segments the guest wants to actually
          * read data.
          */
         hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-        hdr.iovec_count = req->elem.in_num - 3;
+        hdr.iovec_count = req->elem->in_num - 3;
         for (i = 0; i < hdr.iovec_count; i++)
-            hdr.dxfer_len += req->elem.in_sg[i].iov_len;
+            hdr.dxfer_len += req->elem->in_sg[i].iov_len;
 
-        hdr.dxferp = req->elem.in_sg;
+        hdr.dxferp = req->elem->in_sg;
     } else {
         /*
          * Some SCSI commands don't actually transfer any data.
@@ -222,8 +217,8 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
         hdr.dxfer_direction = SG_DXFER_NONE;
     }
 
-    hdr.sbp = req->elem.in_sg[req->elem.in_num - 3].iov_base;
-    hdr.mx_sb_len = req->elem.in_sg[req->elem.in_num - 3].iov_len;
+    hdr.sbp = req->elem->in_sg[req->elem->in_num - 3].iov_base;
+    hdr.mx_sb_len = req->elem->in_sg[req->elem->in_num - 3].iov_len;
 
     ret = bdrv_ioctl(req->dev->bs, SG_IO, &hdr);
     if (ret) {
@@ -250,7 +245,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     stl_p(&req->scsi->data_len, hdr.dxfer_len);
 
     virtio_blk_req_complete(req, status);
-    g_free(req);
+    virtio_blk_free_request(req);
     return;
 #else
     abort();
@@ -260,14 +255,26 @@ fail:
     /* Just put anything nonzero so that the ioctl fails in the guest.  */
     stl_p(&req->scsi->errors, 255);
     virtio_blk_req_complete(req, status);
-    g_free(req);
+    virtio_blk_free_request(req);
 }
 
+/* Requests popped from the queue at once */
+#define VIRTIO_BLK_POP_BATCH 32
+
 typedef struct MultiReqBuffer {
     BlockRequest        blkreq[32];
     unsigned int        num_writes;
+    VirtIOBlockReq      *reads[32];
+    unsigned int        num_reads;
 } MultiReqBuffer;
 
+/* Adjacent reads submitted as one */
+typedef struct MergedRead {
+    QEMUIOVector qiov;
+    unsigned int num_reqs;
+    VirtIOBlockReq *reqs[32];
+} MergedRead;
+
 static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
 {
     int i, ret;
@@ -288,6 +295,93 @@ static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
     mrb->num_writes = 0;
 }
 
+static void virtio_blk_merged_read_complete(void *opaque, int ret)
+{
+    MergedRead *m = opaque;
+    unsigned int i;
+
+    for (i = 0; i < m->num_reqs; i++) {
+        virtio_blk_rw_complete(m->reqs[i], ret);
+    }
+    qemu_iovec_destroy(&m->qiov);
+    g_free(m);
+}
+
+static int virtio_blk_read_compare(const void *a, const void *b)
+{
+    const VirtIOBlockReq *req1 = *(VirtIOBlockReq **)a;
+    const VirtIOBlockReq *req2 = *(VirtIOBlockReq **)b;
+
+    if (req1->sector < req2->sector) {
+        return -1;
+    }
+    return req1->sector > req2->sector;
+}
+
+static void virtio_submit_read(BlockDriverState *bs, VirtIOBlockReq **reqs,
+                               unsigned int num)
+{
+    MergedRead *m;
+    unsigned int i;
+    int niov = 0;
+
+    if (num == 1) {
+        bdrv_aio_readv(bs, reqs[0]->sector, &reqs[0]->qiov,
+                       reqs[0]->qiov.size / BDRV_SECTOR_SIZE,
+                       virtio_blk_rw_complete, reqs[0]);
+        return;
+    }
+
+    m = g_malloc(sizeof(*m));
+    m->num_reqs = num;
+    for (i = 0; i < num; i++) {
+        niov += reqs[i]->qiov.niov;
+    }
+    qemu_iovec_init(&m->qiov, niov);
+    for (i = 0; i < num; i++) {
+        m->reqs[i] = reqs[i];
+        qemu_iovec_concat(&m->qiov, &reqs[i]->qiov, 0, reqs[i]->qiov.size);
+    }
+
+    bdrv_acct_merged(bs, BDRV_ACCT_READ, num - 1);
+    bdrv_aio_readv(bs, reqs[0]->sector, &m->qiov,
+                   m->qiov.size / BDRV_SECTOR_SIZE,
+                   virtio_blk_merged_read_complete, m);
+}
+
+/* Submit the reads collected in @mrb, each run of adjacent ones as a
+ * single request
+ */
+static void virtio_submit_multiread(BlockDriverState *bs, MultiReqBuffer *mrb)
+{
+    VirtIOBlockReq **reqs = mrb->reads;
+    unsigned int i, start = 0;
+    uint64_t end;
+    int niov;
+
+    if (!mrb->num_reads) {
+        return;
+    }
+
+    qsort(reqs, mrb->num_reads, sizeof(*reqs), &virtio_blk_read_compare);
+
+    end = reqs[0]->sector + reqs[0]->qiov.size / BDRV_SECTOR_SIZE;
+    niov = reqs[0]->qiov.niov;
+    for (i = 1; i < mrb->num_reads; i++) {
+        if (reqs[i]->sector != end || niov + reqs[i]->qiov.niov > IOV_MAX) {
+            virtio_submit_read(bs, reqs + start, i - start);
+            start = i;
+            niov = 0;
+        }
+        end = reqs[i]->sector + reqs[i]->qiov.size / BDRV_SECTOR_SIZE;
+        niov += reqs[i]->qiov.niov;
+    }
+    virtio_submit_read(bs, reqs + start, i - start);
+
+    trace_virtio_blk_submit_multiread(bs, mrb->num_reads);
+    mrb->num_reads = 0;
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     bdrv_acct_start(req->dev->bs, &req->acct, 0, BDRV_ACCT_FLUSH);
@@ -334,7 +428,7 @@ static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     mrb->num_writes++;
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_read(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     uint64_t sector;
 
@@ -352,9 +446,14 @@ static void virtio_blk_handle_read(VirtIOBlockReq *req)
         virtio_blk_rw_complete(req, -EIO);
         return;
     }
-    bdrv_aio_readv(req->dev->bs, sector, &req->qiov,
-                   req->qiov.size / BDRV_SECTOR_SIZE,
-                   virtio_blk_rw_complete, req);
+
+    if (mrb->num_reads == ARRAY_SIZE(mrb->reads)) {
+        virtio_submit_multiread(req->dev->bs, mrb);
+    }
+
+    /* the guest may change the header under us, so keep what was checked */
+    req->sector = sector;
+    mrb->reads[mrb->num_reads++] = req;
 }
 
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
@@ -362,19 +461,19 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
 {
     uint32_t type;
 
-    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+    if (req->elem->out_num < 1 || req->elem->in_num < 1) {
         error_report("virtio-blk missing headers");
         exit(1);
     }
 
-    if (req->elem.out_sg[0].iov_len < sizeof(*req->out) ||
-        req->elem.in_sg[req->elem.in_num - 1].iov_len < sizeof(*req->in)) {
+    if (req->elem->out_sg[0].iov_len < sizeof(*req->out) ||
+        req->elem->in_sg[req->elem->in_num - 1].iov_len < sizeof(*req->in)) {
         error_report("virtio-blk header not in correct element");
         exit(1);
     }
 
-    req->out = (void *)req->elem.out_sg[0].iov_base;
-    req->in = (void *)req->elem.in_sg[req->elem.in_num - 1].iov_base;
+    req->out = (void *)req->elem->out_sg[0].iov_base;
+    req->in = (void *)req->elem->in_sg[req->elem->in_num - 1].iov_base;
 
     type = ldl_p(&req->out->type);
 
@@ -389,30 +488,31 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
          * NB: per existing s/n string convention the string is
          * terminated by '\0' only when shorter than buffer.
          */
-        strncpy(req->elem.in_sg[0].iov_base,
+        strncpy(req->elem->in_sg[0].iov_base,
                 s->blk->serial ? s->blk->serial : "",
-                MIN(req->elem.in_sg[0].iov_len, VIRTIO_BLK_ID_BYTES));
+                MIN(req->elem->in_sg[0].iov_len, VIRTIO_BLK_ID_BYTES));
         virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-        g_free(req);
+        virtio_blk_free_request(req);
     } else if (type & VIRTIO_BLK_T_OUT) {
-        qemu_iovec_init_external(&req->qiov, &req->elem.out_sg[1],
-                                 req->elem.out_num - 1);
+        qemu_iovec_init_external(&req->qiov, &req->elem->out_sg[1],
+                                 req->elem->out_num - 1);
         virtio_blk_handle_write(req, mrb);
     } else if (type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_BARRIER) {
         /* VIRTIO_BLK_T_IN is 0, so we can't just & it. */
-        qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
-                                 req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        qemu_iovec_init_external(&req->qiov, &req->elem->in_sg[0],
+                                 req->elem->in_num - 1);
+        virtio_blk_handle_read(req, mrb);
     } else {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
-        g_free(req);
+        virtio_blk_free_request(req);
     }
 }
 
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
-    VirtIOBlockReq *req;
+    VirtQueueElement *elems[VIRTIO_BLK_POP_BATCH];
+    unsigned int i, num;
     MultiReqBuffer mrb = {
         .num_writes = 0,
     };
@@ -427,11 +527,19 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 #endif
 
-    while ((req = virtio_blk_get_request(s))) {
-        virtio_blk_handle_request(req, &mrb);
+    bdrv_io_plug(s->bs);
+
+    while ((num = virtqueue_pop_batch(s->vq, elems, ARRAY_SIZE(elems)))) {
+        for (i = 0; i < num; i++) {
+            virtio_blk_handle_request(virtio_blk_alloc_request(s, elems[i]),
+                                      &mrb);
+        }
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -459,6 +567,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -594,7 +703,7 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     
     while (req) {
         qemu_put_sbyte(f, 1);
-        qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        qemu_put_buffer(f, (unsigned char*)req->elem, sizeof(*req->elem));
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -614,15 +723,17 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-        qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        VirtIOBlockReq *req;
+
+        req = virtio_blk_alloc_request(s, virtqueue_elem_get(s->vq));
+        qemu_get_buffer(f, (unsigned char*)req->elem, sizeof(*req->elem));
         req->next = s->rq;
         s->rq = req;
 
-        virtqueue_map_sg(req->elem.in_sg, req->elem.in_addr,
-            req->elem.in_num, 1);
-        virtqueue_map_sg(req->elem.out_sg, req->elem.out_addr,
-            req->elem.out_num, 0);
+        virtqueue_map_sg(req->elem->in_sg, req->elem->in_addr,
+            req->elem->in_num, 1);
+        virtqueue_map_sg(req->elem->out_sg, req->elem->out_addr,
+            req->elem->out_num, 0);
     }
 
     return 0;
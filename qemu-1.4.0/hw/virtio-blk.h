@@ -106,6 +106,7 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    char *data_plane_thread;
 };
 
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
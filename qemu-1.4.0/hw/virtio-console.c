@@ -12,12 +12,14 @@
 
 #include "char/char.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "trace.h"
 #include "virtio-serial.h"
 
 typedef struct VirtConsole {
     VirtIOSerialPort port;
     CharDriverState *chr;
+    Notifier chr_writable;
 } VirtConsole;
 
 
@@ -32,6 +34,12 @@ static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
         return len;
     }
 
+    if (!qemu_chr_fe_can_write(vcon->chr)) {
+        /* Leave the data in the vq until chr_writable() */
+        virtio_serial_throttle_port(port, true);
+        return 0;
+    }
+
     ret = qemu_chr_fe_write(vcon->chr, buf, len);
     trace_virtio_console_flush_buf(port->id, len, ret);
 
@@ -52,6 +60,29 @@ static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
     return ret;
 }
 
+/* Same as flush_buf(), for a whole element at a time */
+static ssize_t flush_iov(VirtIOSerialPort *port, const struct iovec *iov,
+                         int iovcnt)
+{
+    VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
+    ssize_t ret;
+
+    if (!vcon->chr) {
+        return iov_size(iov, iovcnt);
+    }
+
+    if (!qemu_chr_fe_can_write(vcon->chr)) {
+        virtio_serial_throttle_port(port, true);
+        return 0;
+    }
+
+    ret = qemu_chr_fe_writev(vcon->chr, iov, iovcnt);
+    trace_virtio_console_flush_buf(port->id, iov_size(iov, iovcnt), ret);
+
+    /* See flush_buf() */
+    return ret < 0 ? 0 : ret;
+}
+
 /* Callback function that's called when the guest opens the port */
 static void guest_open(VirtIOSerialPort *port)
 {
@@ -91,6 +122,13 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
     virtio_serial_write(&vcon->port, buf, size);
 }
 
+static void chr_writable(Notifier *notifier, void *data)
+{
+    VirtConsole *vcon = container_of(notifier, VirtConsole, chr_writable);
+
+    virtio_serial_throttle_port(&vcon->port, false);
+}
+
 static void chr_event(void *opaque, int event)
 {
     VirtConsole *vcon = opaque;
@@ -119,11 +157,23 @@ static int virtconsole_initfn(VirtIOSerialPort *port)
     if (vcon->chr) {
         qemu_chr_add_handlers(vcon->chr, chr_can_read, chr_read, chr_event,
                               vcon);
+        vcon->chr_writable.notify = chr_writable;
+        qemu_chr_fe_add_write_notifier(vcon->chr, &vcon->chr_writable);
     }
 
     return 0;
 }
 
+static int virtconsole_exitfn(VirtIOSerialPort *port)
+{
+    VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
+
+    if (vcon->chr) {
+        notifier_remove(&vcon->chr_writable);
+    }
+    return 0;
+}
+
 static Property virtconsole_properties[] = {
     DEFINE_PROP_CHR("chardev", VirtConsole, chr),
     DEFINE_PROP_END_OF_LIST(),
@@ -136,7 +186,9 @@ static void virtconsole_class_init(ObjectClass *klass, void *data)
 
     k->is_console = true;
     k->init = virtconsole_initfn;
+    k->exit = virtconsole_exitfn;
     k->have_data = flush_buf;
+    k->have_datav = flush_iov;
     k->guest_open = guest_open;
     k->guest_close = guest_close;
     dc->props = virtconsole_properties;
@@ -160,7 +212,9 @@ static void virtserialport_class_init(ObjectClass *klass, void *data)
     VirtIOSerialPortClass *k = VIRTIO_SERIAL_PORT_CLASS(klass);
 
     k->init = virtconsole_initfn;
+    k->exit = virtconsole_exitfn;
     k->have_data = flush_buf;
+    k->have_datav = flush_iov;
     k->guest_open = guest_open;
     k->guest_close = guest_close;
     dc->props = virtserialport_properties;
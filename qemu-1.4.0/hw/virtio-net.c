@@ -18,6 +18,7 @@
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qapi-visit.h"
 #include "virtio-net.h"
 #include "vhost_net.h"
 
@@ -26,14 +27,25 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* Packets popped from a tx queue at once */
+#define VIRTIO_NET_TX_BATCH    32
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
+    int32_t tx_burst;
+    int64_t tx_holdoff;
+    uint32_t tx_kick_packets;
+    uint32_t tx_avg_packets;
+    uint64_t tx_kicks;
+    int64_t tx_kick_ns;     /* host clock at the notification being served */
+    int rx_batch;
+    bool rx_notify;
     struct {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         ssize_t len;
     } async_tx;
     struct VirtIONet *n;
@@ -47,6 +59,7 @@ typedef struct VirtIONet
     VirtIONetQueue vqs[MAX_QUEUE_NUM];
     VirtQueue *ctrl_vq;
     NICState *nic;
+    VirtioNetTxMode tx_mode;
     uint32_t tx_timeout;
     int32_t tx_burst;
     uint32_t has_vnet_hdr;
@@ -188,6 +201,38 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_tx_schedule(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+
+    switch (n->tx_mode) {
+    case VIRTIO_NET_TX_MODE_TIMER:
+        qemu_mod_timer(q->tx_timer,
+                       qemu_get_clock_ns(vm_clock) + n->tx_timeout);
+        break;
+    case VIRTIO_NET_TX_MODE_ADAPTIVE:
+        if (q->tx_holdoff) {
+            qemu_mod_timer(q->tx_timer,
+                           qemu_get_clock_ns(vm_clock) + q->tx_holdoff);
+            break;
+        }
+        /* fall through */
+    default:
+        qemu_bh_schedule(q->tx_bh);
+        break;
+    }
+}
+
+static void virtio_net_tx_cancel(VirtIONetQueue *q)
+{
+    if (q->tx_timer) {
+        qemu_del_timer(q->tx_timer);
+    }
+    if (q->tx_bh) {
+        qemu_bh_cancel(q->tx_bh);
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -211,18 +256,9 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
         }
 
         if (virtio_net_started(n, queue_status) && !n->vhost_started) {
-            if (q->tx_timer) {
-                qemu_mod_timer(q->tx_timer,
-                               qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-            } else {
-                qemu_bh_schedule(q->tx_bh);
-            }
+            virtio_net_tx_schedule(q);
         } else {
-            if (q->tx_timer) {
-                qemu_del_timer(q->tx_timer);
-            } else {
-                qemu_bh_cancel(q->tx_bh);
-            }
+            virtio_net_tx_cancel(q);
         }
     }
 }
@@ -652,12 +688,36 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 
 /* RX */
 
+/* Within a batch the guest is only notified once, at the end; with
+ * EVENT_IDX, vring_notify() still checks the event index against all the
+ * buffers used since the last notification.
+ */
+static void virtio_net_receive_batch(NetClientState *nc, bool start)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (start) {
+        q->rx_batch++;
+        return;
+    }
+
+    assert(q->rx_batch > 0);
+    if (--q->rx_batch == 0 && q->rx_notify) {
+        q->rx_notify = false;
+        virtio_notify(&n->vdev, q->rx_vq);
+    }
+}
+
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    virtio_net_receive_batch(nc, true);
+    qemu_flush_queued_packets(nc);
+    virtio_net_receive_batch(nc, false);
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -824,13 +884,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
-        const struct iovec *sg = elem.in_sg;
+        const struct iovec *sg;
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        if (!virtqueue_pop_batch(q->rx_vq, &elem, 1)) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -841,21 +901,22 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
             exit(1);
         }
 
-        if (elem.in_num < 1) {
+        if (elem->in_num < 1) {
             error_report("virtio-net receive queue contains no in buffers");
             exit(1);
         }
+        sg = elem->in_sg;
 
         if (i == 0) {
             assert(offset == 0);
             if (n->mergeable_rx_bufs) {
                 mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
-                                    sg, elem.in_num,
+                                    sg, elem->in_num,
                                     offsetof(typeof(mhdr), num_buffers),
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -864,7 +925,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num, guest_offset,
+        len = iov_from_buf(sg, elem->in_num, guest_offset,
                            buf + offset, size - offset);
         total += len;
         offset += len;
@@ -879,11 +940,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                          i, n->mergeable_rx_bufs,
                          offset, size, n->guest_hdr_len, n->host_hdr_len);
 #endif
+            virtqueue_elem_release(q->rx_vq, elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_elem_release(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -894,22 +957,45 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(&n->vdev, q->rx_vq);
+    if (q->rx_batch) {
+        q->rx_notify = true;
+    } else {
+        virtio_notify(&n->vdev, q->rx_vq);
+    }
 
     return size;
 }
 
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
+/* The clock is only read when somebody asked for the latencies */
+static void virtio_net_tx_kicked(VirtIONetQueue *q)
+{
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+
+    q->tx_kick_ns = qemu_get_subqueue(q->n->nic, queue_index)->tx_latency ?
+                    get_clock() : 0;
+}
+
+static void virtio_net_tx_done(VirtIONetQueue *q, NetClientState *nc)
+{
+    if (nc->tx_latency && q->tx_kick_ns) {
+        latency_histogram_add(nc->tx_latency, get_clock() - q->tx_kick_ns);
+    }
+}
+
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
+    virtio_net_tx_done(q, nc);
+    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(&n->vdev, q->tx_vq);
 
-    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    virtqueue_elem_release(q->tx_vq, q->async_tx.elem);
+    q->async_tx.elem = NULL;
+    q->async_tx.len = 0;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
@@ -919,66 +1005,76 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
-    VirtQueueElement elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int i, num;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
+
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
     assert(n->vdev.vm_running);
 
-    if (q->async_tx.elem.out_num) {
+    if (q->async_tx.elem) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
-        ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        struct iovec sg[VIRTQUEUE_MAX_SIZE];
-
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
-
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        len = n->guest_hdr_len;
+    while (num_packets < q->tx_burst &&
+           (num = virtqueue_pop_batch(q->tx_vq, elems,
+                                      MIN(ARRAY_SIZE(elems),
+                                          q->tx_burst - num_packets)))) {
+        for (i = 0; i < num; i++) {
+            VirtQueueElement *elem = elems[i];
+            ssize_t ret, len;
+            unsigned int out_num = elem->out_num;
+            struct iovec *out_sg = &elem->out_sg[0];
+            struct iovec sg[VIRTQUEUE_MAX_SIZE];
+
+            if (out_num < 1) {
+                error_report("virtio-net header not in first element");
+                exit(1);
+            }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            q->async_tx.len  = len;
-            return -EBUSY;
-        }
+            /*
+             * If host wants to see the guest header as is, we can
+             * pass it on unchanged. Otherwise, copy just the parts
+             * that host is interested in.
+             */
+            assert(n->host_hdr_len <= n->guest_hdr_len);
+            if (n->host_hdr_len != n->guest_hdr_len) {
+                unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                           out_sg, out_num,
+                                           0, n->host_hdr_len);
+                sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                                 out_sg, out_num,
+                                 n->guest_hdr_len, -1);
+                out_num = sg_num;
+                out_sg = sg;
+            }
 
-        len += ret;
+            len = n->guest_hdr_len;
+
+            ret = qemu_sendv_packet_async(nc, out_sg, out_num,
+                                          virtio_net_tx_complete);
+            if (ret == 0) {
+                virtio_queue_set_notification(q->tx_vq, 0);
+                q->async_tx.elem = elem;
+                q->async_tx.len  = len;
+                /* the rest of the batch waits for the packet to go out */
+                virtqueue_unpop(q->tx_vq, elems + i + 1, num - i - 1);
+                return -EBUSY;
+            }
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(&n->vdev, q->tx_vq);
+            len += ret;
 
-        if (++num_packets >= n->tx_burst) {
-            break;
+            virtio_net_tx_done(q, nc);
+            virtqueue_push(q->tx_vq, elem, 0);
+            virtio_notify(&n->vdev, q->tx_vq);
+            virtqueue_elem_release(q->tx_vq, elem);
+            num_packets++;
         }
     }
     return num_packets;
@@ -1004,6 +1100,8 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
         qemu_mod_timer(q->tx_timer,
                        qemu_get_clock_ns(vm_clock) + n->tx_timeout);
         q->tx_waiting = 1;
+        q->tx_kicks++;
+        virtio_net_tx_kicked(q);
         virtio_queue_set_notification(vq, 0);
     }
 }
@@ -1017,6 +1115,8 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
         return;
     }
     q->tx_waiting = 1;
+    q->tx_kicks++;
+    virtio_net_tx_kicked(q);
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
         return;
@@ -1025,6 +1125,55 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     qemu_bh_schedule(q->tx_bh);
 }
 
+static void virtio_net_handle_tx_adaptive(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    if (unlikely(q->tx_waiting)) {
+        return;
+    }
+    q->tx_waiting = 1;
+    q->tx_kicks++;
+    virtio_net_tx_kicked(q);
+    /* This happens when device was stopped but VCPU wasn't. */
+    if (!n->vdev.vm_running) {
+        return;
+    }
+    virtio_queue_set_notification(vq, 0);
+    virtio_net_tx_schedule(q);
+}
+
+/* Called when the guest has nothing more to send for now, with the number
+ * of packets sent since it kicked the queue.  Streams, which send many
+ * packets per kick, have the holdoff doubled up to x-txtimer so that the
+ * guest kicks less often; a kick with a single packet, or a low average,
+ * halves it again so that request/response traffic is sent right away.
+ */
+static void virtio_net_tx_adapt(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    uint32_t packets = q->tx_kick_packets;
+    int32_t avg;
+
+    q->tx_kick_packets = 0;
+    q->tx_avg_packets += ((int32_t)(packets << TX_AVG_SHIFT) -
+                          (int32_t)q->tx_avg_packets) >> TX_AVG_WEIGHT;
+    avg = q->tx_avg_packets >> TX_AVG_SHIFT;
+
+    if (avg >= TX_ADAPTIVE_STREAM && packets > 1) {
+        q->tx_holdoff = q->tx_holdoff ? q->tx_holdoff * 2 : TX_HOLDOFF_MIN;
+        q->tx_holdoff = MIN(q->tx_holdoff, n->tx_timeout);
+    } else if (avg < TX_ADAPTIVE_LATENCY || packets <= 1) {
+        q->tx_holdoff /= 2;
+        if (q->tx_holdoff < TX_HOLDOFF_MIN) {
+            q->tx_holdoff = 0;
+        }
+    }
+
+    q->tx_burst = MIN(MAX(avg * 4, TX_BURST_MIN), n->tx_burst);
+}
+
 static void virtio_net_tx_timer(void *opaque)
 {
     VirtIONetQueue *q = opaque;
@@ -1059,10 +1208,11 @@ static void virtio_net_tx_bh(void *opaque)
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
+    q->tx_kick_packets += ret;
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (ret >= q->tx_burst) {
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
         return;
@@ -1072,13 +1222,84 @@ static void virtio_net_tx_bh(void *opaque)
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
     virtio_queue_set_notification(q->tx_vq, 1);
-    if (virtio_net_flush_tx(q) > 0) {
+    ret = virtio_net_flush_tx(q);
+    if (ret > 0) {
+        q->tx_kick_packets += ret;
         virtio_queue_set_notification(q->tx_vq, 0);
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
+    } else if (ret == 0 && n->tx_mode == VIRTIO_NET_TX_MODE_ADAPTIVE) {
+        virtio_net_tx_adapt(q);
     }
 }
 
+static void virtio_net_init_tx(VirtIONet *n, int i)
+{
+    VirtIONetQueue *q = &n->vqs[i];
+
+    switch (n->tx_mode) {
+    case VIRTIO_NET_TX_MODE_TIMER:
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
+        if (!q->tx_timer) {
+            q->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, q);
+        }
+        break;
+    case VIRTIO_NET_TX_MODE_ADAPTIVE:
+        /* the holdoff timer does what the bottom half would */
+        q->tx_vq = virtio_add_queue(&n->vdev, 256,
+                                    virtio_net_handle_tx_adaptive);
+        if (!q->tx_timer) {
+            q->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_bh, q);
+        }
+        if (!q->tx_bh) {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        break;
+    default:
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
+        if (!q->tx_bh) {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        break;
+    }
+
+    q->tx_waiting = 0;
+    q->tx_burst = n->tx_burst;
+    q->tx_holdoff = 0;
+    q->tx_kick_packets = 0;
+    q->tx_avg_packets = 0;
+    q->n = n;
+}
+
+static void virtio_net_get_tx_mitigation(Object *obj, Visitor *v, void *opaque,
+                                         const char *name, Error **errp)
+{
+    VirtIONet *n = opaque;
+    VirtioNetTxInfo *info = g_malloc0(sizeof(*info));
+    VirtioNetTxQueueInfoList **tail = &info->queues;
+    VirtioNetTxQueueInfoList *entry;
+    int i;
+
+    info->mode = n->tx_mode;
+    for (i = 0; i < (n->multiqueue ? n->curr_queues : 1); i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->index = i;
+        entry->value->burst = q->tx_burst;
+        entry->value->holdoff = q->tx_holdoff;
+        entry->value->packets_per_kick =
+            (double)q->tx_avg_packets / (1 << TX_AVG_SHIFT);
+        entry->value->kicks = q->tx_kicks;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    visit_type_VirtioNetTxInfo(v, &info, name, errp);
+    qapi_free_VirtioNetTxInfo(info);
+}
+
 static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue, int ctrl)
 {
     VirtIODevice *vdev = &n->vdev;
@@ -1092,20 +1313,7 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue, int ctrl)
 
     for (i = 1; i < max; i++) {
         n->vqs[i].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
-        if (n->vqs[i].tx_timer) {
-            n->vqs[i].tx_vq =
-                virtio_add_queue(vdev, 256, virtio_net_handle_tx_timer);
-            n->vqs[i].tx_timer = qemu_new_timer_ns(vm_clock,
-                                                   virtio_net_tx_timer,
-                                                   &n->vqs[i]);
-        } else {
-            n->vqs[i].tx_vq =
-                virtio_add_queue(vdev, 256, virtio_net_handle_tx_bh);
-            n->vqs[i].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[i]);
-        }
-
-        n->vqs[i].tx_waiting = 0;
-        n->vqs[i].n = n;
+        virtio_net_init_tx(n, i);
     }
 
     if (ctrl) {
@@ -1279,7 +1487,9 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
         .cleanup = virtio_net_cleanup,
+    .tx_latency = true,
     .link_status_changed = virtio_net_set_link_status,
 };
 
@@ -1331,24 +1541,24 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->curr_queues = 1;
     n->vqs[0].n = n;
     n->tx_timeout = net->txtimer;
+    n->tx_burst = net->txburst;
 
-    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
-        error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
+    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh") &&
+        strcmp(net->tx, "adaptive")) {
+        error_report("virtio-net: Unknown option tx=%s, "
+                     "valid options: \"timer\" \"bh\" \"adaptive\"",
                      net->tx);
         error_report("Defaulting to \"bh\"");
     }
 
     if (net->tx && !strcmp(net->tx, "timer")) {
-        n->vqs[0].tx_vq = virtio_add_queue(&n->vdev, 256,
-                                           virtio_net_handle_tx_timer);
-        n->vqs[0].tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer,
-                                               &n->vqs[0]);
+        n->tx_mode = VIRTIO_NET_TX_MODE_TIMER;
+    } else if (net->tx && !strcmp(net->tx, "adaptive")) {
+        n->tx_mode = VIRTIO_NET_TX_MODE_ADAPTIVE;
     } else {
-        n->vqs[0].tx_vq = virtio_add_queue(&n->vdev, 256,
-                                           virtio_net_handle_tx_bh);
-        n->vqs[0].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[0]);
+        n->tx_mode = VIRTIO_NET_TX_MODE_BH;
     }
+    virtio_net_init_tx(n, 0);
     n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
     qemu_macaddr_default_if_unset(&conf->macaddr);
     memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
@@ -1367,8 +1577,6 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 
     qemu_format_nic_info_str(qemu_get_queue(n->nic), conf->macaddr.a);
 
-    n->vqs[0].tx_waiting = 0;
-    n->tx_burst = net->txburst;
     virtio_net_set_mrg_rx_bufs(n, 0);
     n->promisc = 1; /* for compatibility */
 
@@ -1382,6 +1590,9 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 
     add_boot_device_path(conf->bootindex, dev, "/ethernet-phy@0");
 
+    object_property_add(OBJECT(dev), "tx-mitigation", "VirtioNetTxInfo",
+                        virtio_net_get_tx_mitigation, NULL, NULL, n, NULL);
+
     return &n->vdev;
 }
 
@@ -1394,6 +1605,7 @@ void virtio_net_exit(VirtIODevice *vdev)
     virtio_net_set_status(vdev, 0);
 
     unregister_savevm(n->qdev, "virtio-net", n);
+    object_property_del(OBJECT(n->qdev), "tx-mitigation", NULL);
 
     g_free(n->mac_table.macs);
     g_free(n->vlans);
@@ -1407,7 +1619,8 @@ void virtio_net_exit(VirtIODevice *vdev)
         if (q->tx_timer) {
             qemu_del_timer(q->tx_timer);
             qemu_free_timer(q->tx_timer);
-        } else {
+        }
+        if (q->tx_bh) {
             qemu_bh_delete(q->tx_bh);
         }
     }
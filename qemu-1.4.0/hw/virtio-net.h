@@ -59,6 +59,18 @@
  * and latency. */
 #define TX_BURST 256
 
+/* tx=adaptive: the holdoff after a kick goes up, from TX_HOLDOFF_MIN to
+ * x-txtimer, while the guest averages TX_ADAPTIVE_STREAM packets per kick or
+ * more, and down below TX_ADAPTIVE_LATENCY; the burst follows the average
+ * between TX_BURST_MIN and x-txburst.
+ */
+#define TX_HOLDOFF_MIN 20000 /* 20 us */
+#define TX_ADAPTIVE_STREAM 16
+#define TX_ADAPTIVE_LATENCY 4
+#define TX_BURST_MIN 32
+#define TX_AVG_SHIFT 4 /* fixed point of the packets per kick average */
+#define TX_AVG_WEIGHT 3 /* each kick counts for 1/8 of it */
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
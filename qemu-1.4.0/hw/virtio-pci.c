@@ -28,6 +28,7 @@
 #include "pci/msix.h"
 #include "loader.h"
 #include "sysemu/kvm.h"
+#include "xen.h"
 #include "sysemu/blockdev.h"
 #include "virtio-pci.h"
 #include "qemu/range.h"
@@ -541,7 +542,7 @@ static int kvm_virtio_pci_vector_use(VirtIOPCIProxy *proxy, int nvqs)
     PCIDevice *dev = &proxy->pci_dev;
     VirtIODevice *vdev = proxy->vdev;
     unsigned int vector;
-    int ret, queue_no;
+    int ret, queue_no, irqfd_no = 0;
     MSIMessage msg;
 
     for (queue_no = 0; queue_no < nvqs; queue_no++) {
@@ -557,28 +558,40 @@ static int kvm_virtio_pci_vector_use(VirtIOPCIProxy *proxy, int nvqs)
         if (ret < 0) {
             goto undo;
         }
-        /* If guest supports masking, set up irqfd now.
-         * Otherwise, delay until unmasked in the frontend.
-         */
-        if (proxy->vdev->guest_notifier_mask) {
-            ret = kvm_virtio_pci_irqfd_use(proxy, queue_no, vector);
+    }
+
+    /* If guest supports masking, set up irqfd now.
+     * Otherwise, delay until unmasked in the frontend.
+     * Routes are all added by now, so the first irqfd commits them at once.
+     */
+    if (proxy->vdev->guest_notifier_mask) {
+        for (irqfd_no = 0; irqfd_no < queue_no; irqfd_no++) {
+            vector = virtio_queue_vector(vdev, irqfd_no);
+            if (vector >= msix_nr_vectors_allocated(dev)) {
+                continue;
+            }
+            ret = kvm_virtio_pci_irqfd_use(proxy, irqfd_no, vector);
             if (ret < 0) {
-                kvm_virtio_pci_vq_vector_release(proxy, vector);
-                goto undo;
+                goto undo_irqfd;
             }
         }
     }
     return 0;
 
+undo_irqfd:
+    while (--irqfd_no >= 0) {
+        vector = virtio_queue_vector(vdev, irqfd_no);
+        if (vector >= msix_nr_vectors_allocated(dev)) {
+            continue;
+        }
+        kvm_virtio_pci_irqfd_release(proxy, irqfd_no, vector);
+    }
 undo:
     while (--queue_no >= 0) {
         vector = virtio_queue_vector(vdev, queue_no);
         if (vector >= msix_nr_vectors_allocated(dev)) {
             continue;
         }
-        if (proxy->vdev->guest_notifier_mask) {
-            kvm_virtio_pci_irqfd_release(proxy, queue_no, vector);
-        }
         kvm_virtio_pci_vq_vector_release(proxy, vector);
     }
     return ret;
@@ -914,7 +927,7 @@ void virtio_init_pci(VirtIOPCIProxy *proxy, VirtIODevice *vdev)
     pci_register_bar(&proxy->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_IO,
                      &proxy->bar);
 
-    if (!kvm_has_many_ioeventfds()) {
+    if (!kvm_has_many_ioeventfds() && !xen_has_ioeventfds()) {
         proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IOEVENTFD;
     }
 
@@ -1091,6 +1104,8 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags, VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, blk.data_plane, 0, false),
+    DEFINE_PROP_STRING("x-data-plane-thread", VirtIOPCIProxy,
+                       blk.data_plane_thread),
 #endif
     DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
     DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
@@ -1354,7 +1369,7 @@ static void virtio_pci_device_plugged(DeviceState *d)
     pci_register_bar(&proxy->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_IO,
                      &proxy->bar);
 
-    if (!kvm_has_many_ioeventfds()) {
+    if (!kvm_has_many_ioeventfds() && !xen_has_ioeventfds()) {
         proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IOEVENTFD;
     }
 
@@ -14,8 +14,13 @@
  */
 
 #include "virtio-scsi.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include <hw/scsi.h>
 #include <hw/scsi-defs.h>
+#ifdef CONFIG_LINUX
+#include "sysemu/iothread.h"
+#endif
 
 #define VIRTIO_SCSI_VQ_SIZE     128
 #define VIRTIO_SCSI_CDB_SIZE    32
@@ -129,6 +134,8 @@ typedef struct {
     uint32_t max_lun;
 } QEMU_PACKED VirtIOSCSIConfig;
 
+typedef struct VirtIOSCSIIOThread VirtIOSCSIIOThread;
+
 typedef struct {
     VirtIODevice vdev;
     DeviceState *qdev;
@@ -139,15 +146,22 @@ typedef struct {
     uint32_t cdb_size;
     int resetting;
     bool events_dropped;
+    /* one per request queue with x-iothreads, NULL otherwise */
+    VirtIOSCSIIOThread *iothreads;
+    int nr_iothreads_started;
+    bool iothreads_stopping;
     VirtQueue *ctrl_vq;
     VirtQueue *event_vq;
     VirtQueue *cmd_vqs[0];
 } VirtIOSCSI;
 
+/* Commands popped from a queue at once */
+#define VIRTIO_SCSI_POP_BATCH 32
+
 typedef struct VirtIOSCSIReq {
     VirtIOSCSI *dev;
     VirtQueue *vq;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     QEMUSGList qsgl;
     SCSIRequest *sreq;
     union {
@@ -185,12 +199,13 @@ static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
-    virtqueue_push(vq, &req->elem, req->qsgl.size + req->elem.in_sg[0].iov_len);
+    virtqueue_push(vq, req->elem, req->qsgl.size + req->elem->in_sg[0].iov_len);
     qemu_sglist_destroy(&req->qsgl);
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
     }
+    virtqueue_elem_release(vq, req->elem);
     g_free(req);
     virtio_notify(&s->vdev, vq);
 }
@@ -210,40 +225,41 @@ static void qemu_sgl_init_external(QEMUSGList *qsgl, struct iovec *sg,
     }
 }
 
-static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
-                                  VirtIOSCSIReq *req)
+static VirtIOSCSIReq *virtio_scsi_new_req(VirtIOSCSI *s, VirtQueue *vq,
+                                         VirtQueueElement *elem)
 {
-    assert(req->elem.in_num);
+    VirtIOSCSIReq *req = g_malloc(sizeof(*req));
+
+    req->elem = elem;
+    assert(req->elem->in_num);
     req->vq = vq;
     req->dev = s;
     req->sreq = NULL;
-    if (req->elem.out_num) {
-        req->req.buf = req->elem.out_sg[0].iov_base;
+    if (req->elem->out_num) {
+        req->req.buf = req->elem->out_sg[0].iov_base;
     }
-    req->resp.buf = req->elem.in_sg[0].iov_base;
+    req->resp.buf = req->elem->in_sg[0].iov_base;
 
-    if (req->elem.out_num > 1) {
-        qemu_sgl_init_external(&req->qsgl, &req->elem.out_sg[1],
-                               &req->elem.out_addr[1],
-                               req->elem.out_num - 1);
+    if (req->elem->out_num > 1) {
+        qemu_sgl_init_external(&req->qsgl, &req->elem->out_sg[1],
+                               &req->elem->out_addr[1],
+                               req->elem->out_num - 1);
     } else {
-        qemu_sgl_init_external(&req->qsgl, &req->elem.in_sg[1],
-                               &req->elem.in_addr[1],
-                               req->elem.in_num - 1);
+        qemu_sgl_init_external(&req->qsgl, &req->elem->in_sg[1],
+                               &req->elem->in_addr[1],
+                               req->elem->in_num - 1);
     }
+    return req;
 }
 
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
-    VirtIOSCSIReq *req;
-    req = g_malloc(sizeof(*req));
-    if (!virtqueue_pop(vq, &req->elem)) {
-        g_free(req);
+    VirtQueueElement *elem;
+
+    if (!virtqueue_pop_batch(vq, &elem, 1)) {
         return NULL;
     }
-
-    virtio_scsi_parse_req(s, vq, req);
-    return req;
+    return virtio_scsi_new_req(s, vq, elem);
 }
 
 static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
@@ -253,27 +269,28 @@ static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
 
     assert(n < req->dev->conf->num_queues);
     qemu_put_be32s(f, &n);
-    qemu_put_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
+    qemu_put_buffer(f, (unsigned char *)req->elem, sizeof(*req->elem));
 }
 
 static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
 {
     SCSIBus *bus = sreq->bus;
     VirtIOSCSI *s = container_of(bus, VirtIOSCSI, bus);
+    VirtQueueElement *elem;
     VirtIOSCSIReq *req;
     uint32_t n;
 
-    req = g_malloc(sizeof(*req));
     qemu_get_be32s(f, &n);
     assert(n < s->conf->num_queues);
-    qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
-    virtio_scsi_parse_req(s, s->cmd_vqs[n], req);
+    elem = virtqueue_elem_get(s->cmd_vqs[n]);
+    qemu_get_buffer(f, (unsigned char *)elem, sizeof(*elem));
+    req = virtio_scsi_new_req(s, s->cmd_vqs[n], elem);
 
     scsi_req_ref(sreq);
     req->sreq = sreq;
     if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
         int req_mode =
-            (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
+            (req->elem->in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
 
         assert(req->sreq->cmd.mode == req_mode);
     }
@@ -393,13 +410,13 @@ static void virtio_scsi_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 
     while ((req = virtio_scsi_pop_req(s, vq))) {
         int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        if (req->elem->out_num < 1 || req->elem->in_num < 1) {
             virtio_scsi_bad_req();
             continue;
         }
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
+        out_size = req->elem->out_sg[0].iov_len;
+        in_size = req->elem->in_sg[0].iov_len;
         if (req->req.tmf->type == VIRTIO_SCSI_T_TMF) {
             if (out_size < sizeof(VirtIOSCSICtrlTMFReq) ||
                 in_size < sizeof(VirtIOSCSICtrlTMFResp)) {
@@ -467,57 +484,223 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
-static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
-    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
-    VirtIOSCSIReq *req;
+    SCSIDevice *d;
+    int out_size, in_size;
     int n;
 
-    while ((req = virtio_scsi_pop_req(s, vq))) {
-        SCSIDevice *d;
-        int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
-            virtio_scsi_bad_req();
-        }
+    if (req->elem->out_num < 1 || req->elem->in_num < 1) {
+        virtio_scsi_bad_req();
+    }
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
-        if (out_size < sizeof(VirtIOSCSICmdReq) + s->cdb_size ||
-            in_size < sizeof(VirtIOSCSICmdResp) + s->sense_size) {
-            virtio_scsi_bad_req();
-        }
+    out_size = req->elem->out_sg[0].iov_len;
+    in_size = req->elem->in_sg[0].iov_len;
+    if (out_size < sizeof(VirtIOSCSICmdReq) + s->cdb_size ||
+        in_size < sizeof(VirtIOSCSICmdResp) + s->sense_size) {
+        virtio_scsi_bad_req();
+    }
 
-        if (req->elem.out_num > 1 && req->elem.in_num > 1) {
-            virtio_scsi_fail_cmd_req(req);
-            continue;
-        }
+    if (req->elem->out_num > 1 && req->elem->in_num > 1) {
+        virtio_scsi_fail_cmd_req(req);
+        return;
+    }
 
-        d = virtio_scsi_device_find(s, req->req.cmd->lun);
-        if (!d) {
-            req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+    d = virtio_scsi_device_find(s, req->req.cmd->lun);
+    if (!d) {
+        req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+        virtio_scsi_complete_req(req);
+        return;
+    }
+    req->sreq = scsi_req_new(d, req->req.cmd->tag,
+                             virtio_scsi_get_lun(req->req.cmd->lun),
+                             req->req.cmd->cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
+        int req_mode =
+            (req->elem->in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
+
+        if (req->sreq->cmd.mode != req_mode ||
+            req->sreq->cmd.xfer > req->qsgl.size) {
+            req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
             virtio_scsi_complete_req(req);
-            continue;
+            return;
         }
-        req->sreq = scsi_req_new(d, req->req.cmd->tag,
-                                 virtio_scsi_get_lun(req->req.cmd->lun),
-                                 req->req.cmd->cdb, req);
-
-        if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
-            int req_mode =
-                (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
-
-            if (req->sreq->cmd.mode != req_mode ||
-                req->sreq->cmd.xfer > req->qsgl.size) {
-                req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
-                virtio_scsi_complete_req(req);
-                continue;
-            }
+    }
+
+    n = scsi_req_enqueue(req->sreq);
+    if (n) {
+        scsi_req_continue(req->sreq);
+    }
+}
+
+static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtQueueElement *elems[VIRTIO_SCSI_POP_BATCH];
+    VirtIOSCSIReq *req;
+    unsigned int i, num;
+
+    while ((num = virtqueue_pop_batch(vq, elems, ARRAY_SIZE(elems)))) {
+        for (i = 0; i < num; i++) {
+            req = virtio_scsi_new_req(s, vq, elems[i]);
+            virtio_scsi_handle_cmd_req(s, req);
         }
+    }
+}
+
+#ifdef CONFIG_LINUX
+/* With x-iothreads each request queue is kicked through its own thread,
+ * which pops and submits the requests.  The SCSI and block layers still
+ * need the global mutex, so the thread takes it around that; completions
+ * arrive in the main loop and go back to the queue of their request.
+ */
+struct VirtIOSCSIIOThread {
+    VirtIOSCSI *s;
+    VirtQueue *vq;
+    int n;
+    IOThread *iothread;
+    EventNotifier host_notifier;
+    bool stopping;
+};
+
+static void virtio_scsi_iothread_notify(EventNotifier *e)
+{
+    VirtIOSCSIIOThread *t = container_of(e, VirtIOSCSIIOThread,
+                                         host_notifier);
+
+    event_notifier_test_and_clear(e);
+
+    qemu_mutex_lock_iothread();
+    if (!t->stopping) {
+        virtio_scsi_handle_cmd(&t->s->vdev, t->vq);
+    }
+    qemu_mutex_unlock_iothread();
+}
+
+static int virtio_scsi_iothread_flush(EventNotifier *e)
+{
+    return true;
+}
+
+static void virtio_scsi_iothread_attach(void *opaque)
+{
+    VirtIOSCSIIOThread *t = opaque;
+
+    aio_set_event_notifier(iothread_get_aio_context(t->iothread),
+                           &t->host_notifier, virtio_scsi_iothread_notify,
+                           virtio_scsi_iothread_flush);
+}
+
+static void virtio_scsi_iothread_detach(void *opaque)
+{
+    VirtIOSCSIIOThread *t = opaque;
+
+    aio_set_event_notifier(iothread_get_aio_context(t->iothread),
+                           &t->host_notifier, NULL, NULL);
+}
+
+static void virtio_scsi_iothreads_stop(VirtIOSCSI *s)
+{
+    const VirtIOBindings *binding = s->vdev.binding;
+    VirtIOSCSIIOThread *t;
+    int i, n = s->nr_iothreads_started;
+
+    if (!n || s->iothreads_stopping) {
+        return;
+    }
+    s->iothreads_stopping = true;
+
+    /* A thread may be waiting for the global mutex; it has to get it and
+     * see that it is stopping before it can be detached and joined.
+     */
+    for (i = 0; i < n; i++) {
+        s->iothreads[i].stopping = true;
+    }
+    qemu_mutex_unlock_iothread();
+    for (i = 0; i < n; i++) {
+        t = &s->iothreads[i];
+        iothread_run(t->iothread, virtio_scsi_iothread_detach, t);
+    }
+    qemu_mutex_lock_iothread();
+
+    /* Detached threads no longer need the global mutex, so they can be
+     * joined while holding it; dropping the reference does need it.
+     */
+    for (i = 0; i < n; i++) {
+        t = &s->iothreads[i];
+        iothread_put(t->iothread);
+        t->iothread = NULL;
+    }
+
+    /* kicks that came in meanwhile are handled here, in the main loop */
+    for (i = 0; i < n; i++) {
+        binding->set_host_notifier(s->vdev.binding_opaque,
+                                   s->iothreads[i].n, false);
+    }
 
-        n = scsi_req_enqueue(req->sreq);
-        if (n) {
-            scsi_req_continue(req->sreq);
+    s->nr_iothreads_started = 0;
+    s->iothreads_stopping = false;
+}
+
+static void virtio_scsi_iothreads_start(VirtIOSCSI *s)
+{
+    const VirtIOBindings *binding = s->vdev.binding;
+    VirtIOSCSIIOThread *t;
+    int i;
+
+    if (s->nr_iothreads_started || s->iothreads_stopping) {
+        return;
+    }
+    if (!binding->set_host_notifier) {
+        error_report("virtio-scsi: x-iothreads not supported by the "
+                     "transport, using the main loop");
+        return;
+    }
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        t = &s->iothreads[i];
+        t->s = s;
+        t->vq = s->cmd_vqs[i];
+        t->n = virtio_queue_get_id(t->vq);
+        if (binding->set_host_notifier(s->vdev.binding_opaque, t->n,
+                                       true) != 0) {
+            error_report("virtio-scsi: could not set up the host notifier "
+                         "of queue %d, using the main loop", t->n);
+            virtio_scsi_iothreads_stop(s);
+            return;
         }
+        t->stopping = false;
+        t->iothread = iothread_get(NULL);
+        t->host_notifier = *virtio_queue_get_host_notifier(t->vq);
+        iothread_run(t->iothread, virtio_scsi_iothread_attach, t);
+        s->nr_iothreads_started++;
+
+        /* pick up requests queued before the thread listened */
+        event_notifier_set(&t->host_notifier);
+    }
+}
+#else
+static void virtio_scsi_iothreads_start(VirtIOSCSI *s)
+{
+}
+
+static void virtio_scsi_iothreads_stop(VirtIOSCSI *s)
+{
+}
+#endif
+
+static void virtio_scsi_set_status(VirtIODevice *vdev, uint8_t val)
+{
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+
+    if (!s->iothreads) {
+        return;
+    }
+    if ((val & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running) {
+        virtio_scsi_iothreads_start(s);
+    } else {
+        virtio_scsi_iothreads_stop(s);
     }
 }
 
@@ -611,7 +794,7 @@ static void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
         return;
     }
 
-    if (req->elem.out_num || req->elem.in_num != 1) {
+    if (req->elem->out_num || req->elem->in_num != 1) {
         virtio_scsi_bad_req();
     }
 
@@ -620,7 +803,7 @@ static void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
         s->events_dropped = false;
     }
 
-    in_size = req->elem.in_sg[0].iov_len;
+    in_size = req->elem->in_sg[0].iov_len;
     if (in_size < sizeof(VirtIOSCSIEvent)) {
         virtio_scsi_bad_req();
     }
@@ -719,6 +902,7 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
     s->vdev.set_config = virtio_scsi_set_config;
     s->vdev.get_features = virtio_scsi_get_features;
     s->vdev.reset = virtio_scsi_reset;
+    s->vdev.set_status = virtio_scsi_set_status;
 
     s->ctrl_vq = virtio_add_queue(&s->vdev, VIRTIO_SCSI_VQ_SIZE,
                                    virtio_scsi_handle_ctrl);
@@ -729,6 +913,14 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
                                          virtio_scsi_handle_cmd);
     }
 
+    if (s->conf->iothreads) {
+#ifdef CONFIG_LINUX
+        s->iothreads = g_new0(VirtIOSCSIIOThread, s->conf->num_queues);
+#else
+        error_report("virtio-scsi: x-iothreads is only supported on Linux");
+#endif
+    }
+
     scsi_bus_new(&s->bus, dev, &virtio_scsi_scsi_info);
     if (!dev->hotplugged) {
         scsi_bus_legacy_handle_cmdline(&s->bus);
@@ -744,5 +936,7 @@ void virtio_scsi_exit(VirtIODevice *vdev)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
     unregister_savevm(s->qdev, "virtio-scsi", s);
+    virtio_scsi_iothreads_stop(s);
+    g_free(s->iothreads);
     virtio_cleanup(vdev);
 }
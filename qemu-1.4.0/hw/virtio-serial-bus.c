@@ -141,6 +141,70 @@ static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
     virtio_notify(vdev, vq);
 }
 
+/* The most elements, and buffers, passed to one have_datav() call */
+#define FLUSH_BATCH_ELEMS   16
+#define FLUSH_BATCH_IOVS    256
+
+/*
+ * Hand the data of several elements to have_datav() at once.  If the port
+ * takes only part of it, the element it stopped in becomes port->elem, to
+ * be finished like any other, and the ones after it go back to the queue.
+ * Returns false if the queue was empty.
+ */
+static bool flush_batch(VirtIOSerialPort *port, VirtQueue *vq,
+                        VirtIOSerialPortClass *vsc)
+{
+    VirtQueueElement *elems[FLUSH_BATCH_ELEMS];
+    struct iovec iov[FLUSH_BATCH_IOVS];
+    unsigned int num, n, i, iovcnt;
+    size_t done, size;
+    ssize_t ret;
+
+    num = virtqueue_pop_batch(vq, elems, ARRAY_SIZE(elems));
+    if (!num) {
+        return false;
+    }
+
+    iovcnt = 0;
+    for (n = 0; n < num && iovcnt + elems[n]->out_num <= ARRAY_SIZE(iov);
+         n++) {
+        memcpy(iov + iovcnt, elems[n]->out_sg,
+               elems[n]->out_num * sizeof(iov[0]));
+        iovcnt += elems[n]->out_num;
+    }
+
+    ret = n ? vsc->have_datav(port, iov, iovcnt) : 0;
+    if (ret < 0 && ret != -EAGAIN) {
+        /* We don't handle any other type of errors here */
+        abort();
+    }
+    done = ret < 0 ? 0 : ret;
+
+    for (i = 0; i < n; i++) {
+        size = iov_size(elems[i]->out_sg, elems[i]->out_num);
+        if (done < size) {
+            break;
+        }
+        done -= size;
+        virtqueue_push(vq, elems[i], 0);
+        virtqueue_elem_release(vq, elems[i]);
+    }
+
+    if (i < num) {
+        port->elem = *elems[i];
+        port->iov_idx = 0;
+        while (port->iov_idx < port->elem.out_num &&
+               done >= port->elem.out_sg[port->iov_idx].iov_len) {
+            done -= port->elem.out_sg[port->iov_idx].iov_len;
+            port->iov_idx++;
+        }
+        port->iov_offset = done;
+        virtqueue_elem_release(vq, elems[i]);
+        virtqueue_unpop(vq, elems + i + 1, num - i - 1);
+    }
+    return true;
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -155,7 +219,14 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
         unsigned int i;
 
         /* Pop an elem only if we haven't left off a previous one mid-way */
-        if (!port->elem.out_num) {
+        if (!port->elem.out_num && vsc->have_datav) {
+            if (!flush_batch(port, vq, vsc)) {
+                break;
+            }
+            if (!port->elem.out_num || port->throttled) {
+                continue;
+            }
+        } else if (!port->elem.out_num) {
             if (!virtqueue_pop(vq, &port->elem)) {
                 break;
             }
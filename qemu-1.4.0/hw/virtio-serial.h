@@ -107,6 +107,12 @@ typedef struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          size_t len);
+    /*
+     * Optional: the same for the data of one or more whole elements,
+     * so that it can be passed on without being copied.
+     */
+    ssize_t (*have_datav)(VirtIOSerialPort *port, const struct iovec *iov,
+                          int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
@@ -17,6 +17,7 @@
 #include "qemu/error-report.h"
 #include "virtio.h"
 #include "qemu/atomic.h"
+#include "exec/address-spaces.h"
 #include "virtio-bus.h"
 
 /* The alignment to use between consumer and producer parts of vring.
@@ -77,6 +78,18 @@ struct VirtQueue
 
     int inuse;
 
+    /* The rings mapped once for all, or NULL if they are not in RAM.  The
+       mapping is redone when the memory map has changed since ring_gen. */
+    uint8_t *ring_ptr;
+    hwaddr ring_len;
+    MemoryRegion *ring_mr;
+    hwaddr ring_mr_offset;
+    unsigned int ring_gen;
+
+    /* Released elements kept for the next virtqueue_elem_get() */
+    VirtQueueElement *pool[VIRTQUEUE_POOL_SIZE];
+    unsigned int pool_count;
+
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
@@ -84,7 +97,75 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
+/* Bumped whenever the memory map changes, which may move or remove the RAM
+ * that a ring mapping points to.
+ */
+static unsigned int vring_map_gen;
+static bool vring_map_listener_registered;
+
+static void vring_map_commit(MemoryListener *listener)
+{
+    vring_map_gen++;
+}
+
+static MemoryListener vring_map_listener = {
+    .commit = vring_map_commit,
+    .priority = 10,
+};
+
 /* virt queue functions */
+static void virtqueue_unmap_ring(VirtQueue *vq)
+{
+    if (vq->ring_ptr) {
+        /* stores mark their own pages dirty, so none are reported here */
+        cpu_physical_memory_unmap(vq->ring_ptr, vq->ring_len, 1, 0);
+        vq->ring_ptr = NULL;
+    }
+}
+
+/* Map the descriptor table, avail and used rings, which are laid out one
+ * after the other.  If they are not all in one RAM region, accesses keep
+ * going through the address space.
+ */
+static void virtqueue_map_ring(VirtQueue *vq)
+{
+    MemoryRegionSection section;
+    hwaddr size, len;
+    void *ptr;
+
+    virtqueue_unmap_ring(vq);
+    vq->ring_gen = vring_map_gen;
+    if (!vq->vring.desc) {
+        return;
+    }
+
+    /* up to and including the avail event at the end of the used ring */
+    size = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]) +
+           sizeof(uint16_t) - vq->vring.desc;
+    section = memory_region_find(get_system_memory(), vq->vring.desc, size);
+    if (!section.mr || !memory_region_is_ram(section.mr) ||
+        section.readonly || section.size < size) {
+        trace_virtqueue_map_ring(vq, vq->vring.desc, size, NULL);
+        return;
+    }
+
+    len = size;
+    ptr = cpu_physical_memory_map(vq->vring.desc, &len, 1);
+    if (ptr && len < size) {
+        cpu_physical_memory_unmap(ptr, len, 1, 0);
+        ptr = NULL;
+    }
+    trace_virtqueue_map_ring(vq, vq->vring.desc, size, ptr);
+    if (!ptr) {
+        return;
+    }
+
+    vq->ring_ptr = ptr;
+    vq->ring_len = size;
+    vq->ring_mr = section.mr;
+    vq->ring_mr_offset = section.offset_within_region;
+}
+
 static void virtqueue_init(VirtQueue *vq)
 {
     hwaddr pa = vq->pa;
@@ -94,55 +175,122 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    virtqueue_map_ring(vq);
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+/* Host address of @size bytes of the rings at @pa, or NULL if they are not
+ * mapped; indirect descriptor tables live elsewhere and are never mapped.
+ */
+static inline uint8_t *vring_ptr(VirtQueue *vq, hwaddr pa, unsigned size)
+{
+    hwaddr offset = pa - vq->vring.desc;
+
+    if (unlikely(vq->ring_gen != vring_map_gen)) {
+        virtqueue_map_ring(vq);
+    }
+    if (likely(vq->ring_ptr && offset <= vq->ring_len - size)) {
+        return vq->ring_ptr + offset;
+    }
+    return NULL;
+}
+
+static inline uint64_t vring_ldq(VirtQueue *vq, hwaddr pa)
+{
+    uint8_t *ptr = vring_ptr(vq, pa, 8);
+
+    return ptr ? ldq_p(ptr) : ldq_phys(pa);
+}
+
+static inline uint32_t vring_ldl(VirtQueue *vq, hwaddr pa)
+{
+    uint8_t *ptr = vring_ptr(vq, pa, 4);
+
+    return ptr ? ldl_p(ptr) : ldl_phys(pa);
+}
+
+static inline uint16_t vring_lduw(VirtQueue *vq, hwaddr pa)
+{
+    uint8_t *ptr = vring_ptr(vq, pa, 2);
+
+    return ptr ? lduw_p(ptr) : lduw_phys(pa);
+}
+
+/* Stores through the mapping mark the page dirty themselves, as stl_phys
+ * and stw_phys would, so that migration sends the used ring again.
+ */
+static inline void vring_stl(VirtQueue *vq, hwaddr pa, uint32_t val)
+{
+    uint8_t *ptr = vring_ptr(vq, pa, 4);
+
+    if (ptr) {
+        stl_p(ptr, val);
+        memory_region_set_dirty(vq->ring_mr,
+                                vq->ring_mr_offset + (ptr - vq->ring_ptr), 4);
+    } else {
+        stl_phys(pa, val);
+    }
+}
+
+static inline void vring_stw(VirtQueue *vq, hwaddr pa, uint16_t val)
+{
+    uint8_t *ptr = vring_ptr(vq, pa, 2);
+
+    if (ptr) {
+        stw_p(ptr, val);
+        memory_region_set_dirty(vq->ring_mr,
+                                vq->ring_mr_offset + (ptr - vq->ring_ptr), 2);
+    } else {
+        stw_phys(pa, val);
+    }
+}
+
+static inline uint64_t vring_desc_addr(VirtQueue *vq, hwaddr desc_pa, int i)
 {
     hwaddr pa;
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
+    return vring_ldq(vq, pa);
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static inline uint32_t vring_desc_len(VirtQueue *vq, hwaddr desc_pa, int i)
 {
     hwaddr pa;
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
+    return vring_ldl(vq, pa);
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static inline uint16_t vring_desc_flags(VirtQueue *vq, hwaddr desc_pa, int i)
 {
     hwaddr pa;
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
+    return vring_lduw(vq, pa);
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+static inline uint16_t vring_desc_next(VirtQueue *vq, hwaddr desc_pa, int i)
 {
     hwaddr pa;
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+    return vring_lduw(vq, pa);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     hwaddr pa;
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return lduw_phys(pa);
+    return vring_lduw(vq, pa);
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     hwaddr pa;
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(pa);
+    return vring_lduw(vq, pa);
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     hwaddr pa;
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return lduw_phys(pa);
+    return vring_lduw(vq, pa);
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -154,42 +302,42 @@ static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(pa, val);
+    vring_stl(vq, pa, val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(pa, val);
+    vring_stl(vq, pa, val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return lduw_phys(pa);
+    return vring_lduw(vq, pa);
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(pa, val);
+    vring_stw(vq, pa, val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    vring_stw(vq, pa, vring_lduw(vq, pa) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    vring_stw(vq, pa, vring_lduw(vq, pa) & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
@@ -199,7 +347,7 @@ static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
         return;
     }
     pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    stw_phys(pa, val);
+    vring_stw(vq, pa, val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -316,17 +464,17 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
+static unsigned virtqueue_next_desc(VirtQueue *vq, hwaddr desc_pa,
                                     unsigned int i, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = vring_desc_next(vq, desc_pa, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -358,8 +506,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -372,9 +520,9 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
+            desc_pa = vring_desc_addr(vq, desc_pa, i);
         }
 
         do {
@@ -384,15 +532,15 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_WRITE) {
+                in_total += vring_desc_len(vq, desc_pa, i);
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += vring_desc_len(vq, desc_pa, i);
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -433,33 +581,28 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+/* Read the chain starting at descriptor @head into @elem and map it */
+static void virtqueue_read_elem(VirtQueue *vq, VirtQueueElement *elem,
+                                unsigned int head)
 {
-    unsigned int i, head, max;
+    unsigned int i, max;
     hwaddr desc_pa = vq->vring.desc;
 
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
-
     /* When we start there are none of either input nor output. */
     elem->out_num = elem->in_num = 0;
 
     max = vq->vring.num;
+    i = head;
 
-    i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
-        vring_avail_event(vq, vring_avail_idx(vq));
-    }
-
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
+        desc_pa = vring_desc_addr(vq, desc_pa, i);
         i = 0;
     }
 
@@ -467,30 +610,30 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] = vring_desc_addr(vq, desc_pa, i);
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = vring_desc_addr(vq, desc_pa, i);
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = vring_desc_len(vq, desc_pa, i);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -501,9 +644,95 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+}
+
+int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+{
+    unsigned int head;
+
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
+        return 0;
+
+    head = virtqueue_get_head(vq, vq->last_avail_idx++);
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(vq, vring_avail_idx(vq));
+    }
+
+    virtqueue_read_elem(vq, elem, head);
     return elem->in_num + elem->out_num;
 }
 
+VirtQueueElement *virtqueue_elem_get(VirtQueue *vq)
+{
+    if (vq->pool_count) {
+        return vq->pool[--vq->pool_count];
+    }
+    return g_malloc(sizeof(VirtQueueElement));
+}
+
+void virtqueue_elem_release(VirtQueue *vq, VirtQueueElement *elem)
+{
+    if (vq->pool_count < VIRTQUEUE_POOL_SIZE) {
+        vq->pool[vq->pool_count++] = elem;
+    } else {
+        g_free(elem);
+    }
+}
+
+static void virtqueue_pool_free(VirtQueue *vq)
+{
+    while (vq->pool_count) {
+        g_free(vq->pool[--vq->pool_count]);
+    }
+}
+
+unsigned int virtqueue_pop_batch(VirtQueue *vq, VirtQueueElement **elems,
+                                 unsigned int max)
+{
+    unsigned int i, num;
+
+    /* one read of the avail index, and one barrier, for the whole batch */
+    num = MIN(virtqueue_num_heads(vq, vq->last_avail_idx), max);
+    if (!num) {
+        return 0;
+    }
+
+    for (i = 0; i < num; i++) {
+        elems[i] = virtqueue_elem_get(vq);
+        virtqueue_read_elem(vq, elems[i],
+                            virtqueue_get_head(vq, vq->last_avail_idx++));
+    }
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(vq, vring_avail_idx(vq));
+    }
+
+    trace_virtqueue_pop_batch(vq, num, max);
+    return num;
+}
+
+void virtqueue_unpop(VirtQueue *vq, VirtQueueElement **elems,
+                     unsigned int num)
+{
+    VirtQueueElement *elem;
+    int i;
+
+    /* nothing was written to the buffers, so no page is dirtied */
+    while (num) {
+        elem = elems[--num];
+        for (i = 0; i < elem->in_num; i++) {
+            cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
+                                      elem->in_sg[i].iov_len, 1, 0);
+        }
+        for (i = 0; i < elem->out_num; i++) {
+            cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
+                                      elem->out_sg[i].iov_len, 0, 0);
+        }
+        vq->last_avail_idx--;
+        vq->inuse--;
+        virtqueue_elem_release(vq, elem);
+    }
+}
+
 /* virtio device */
 static void virtio_notify_vector(VirtIODevice *vdev, uint16_t vector)
 {
@@ -548,6 +777,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
+        virtqueue_unmap_ring(&vdev->vq[i]);
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
@@ -710,6 +940,8 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtqueue_unmap_ring(&vdev->vq[n]);
+    virtqueue_pool_free(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -889,7 +1121,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_common_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_unmap_ring(&vdev->vq[i]);
+        virtqueue_pool_free(&vdev->vq[i]);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
 }
@@ -923,6 +1161,11 @@ void virtio_init(VirtIODevice *vdev, const char *name,
                  uint16_t device_id, size_t config_size)
 {
     int i;
+
+    if (!vring_map_listener_registered) {
+        memory_listener_register(&vring_map_listener, NULL);
+        vring_map_listener_registered = true;
+    }
     vdev->device_id = device_id;
     vdev->status = 0;
     vdev->isr = 0;
@@ -90,6 +90,9 @@ typedef struct VirtQueueElement
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElement;
 
+/* Released elements each queue keeps for reuse */
+#define VIRTQUEUE_POOL_SIZE 32
+
 typedef struct {
     void (*notify)(DeviceState *d, uint16_t vector);
     void (*save_config)(DeviceState *d, QEMUFile *f);
@@ -192,6 +195,25 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write);
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
+
+/* Elements for a queue come from a small pool kept with it.  Once an
+ * element has been pushed, or is no longer needed, it goes back with
+ * virtqueue_elem_release().
+ */
+VirtQueueElement *virtqueue_elem_get(VirtQueue *vq);
+void virtqueue_elem_release(VirtQueue *vq, VirtQueueElement *elem);
+
+/* Pop up to @max available buffers into pool elements stored in @elems,
+ * and return how many were popped.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, VirtQueueElement **elems,
+                                 unsigned int max);
+
+/* Give back the last @num elements popped, in the order they came, so that
+ * they are popped again later.  The elements are released.
+ */
+void virtqueue_unpop(VirtQueue *vq, VirtQueueElement **elems,
+                     unsigned int num);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes);
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
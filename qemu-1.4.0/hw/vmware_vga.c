@@ -992,7 +992,8 @@ static inline void vmsvga_check_size(struct vmsvga_state_s *s)
 static void vmsvga_update_display(void *opaque)
 {
     struct vmsvga_state_s *s = opaque;
-    bool dirty = false;
+    DirtyBitmapSnapshot *snap;
+    int linesize, height, y, y_start;
 
     if (!s->enable) {
         s->vga.update(&s->vga);
@@ -1004,28 +1005,50 @@ static void vmsvga_update_display(void *opaque)
     vmsvga_fifo_run(s);
     vmsvga_update_rect_flush(s);
 
+    linesize = ds_get_linesize(s->vga.ds);
+    height = ds_get_height(s->vga.ds);
+    if (s->invalidated || !memory_region_is_logging(&s->vga.vram)) {
+        if (s->invalidated) {
+            s->invalidated = 0;
+            memcpy(ds_get_data(s->vga.ds), s->vga.vram_ptr, linesize * height);
+            dpy_gfx_update(s->vga.ds, 0, 0, ds_get_width(s->vga.ds), height);
+        }
+        if (memory_region_is_logging(&s->vga.vram)) {
+            memory_region_reset_dirty(&s->vga.vram, 0, linesize * height,
+                                      DIRTY_MEMORY_VGA);
+        }
+        return;
+    }
+
     /*
      * Is it more efficient to look at vram VGA-dirty bits or wait
-     * for the driver to issue SVGA_CMD_UPDATE?
+     * for the driver to issue SVGA_CMD_UPDATE?  Take both: copy only
+     * the runs of lines the snapshot reports dirty.
      */
-    if (memory_region_is_logging(&s->vga.vram)) {
-        vga_sync_dirty_bitmap(&s->vga);
-        dirty = memory_region_get_dirty(&s->vga.vram, 0,
-            ds_get_linesize(s->vga.ds) * ds_get_height(s->vga.ds),
-            DIRTY_MEMORY_VGA);
-    }
-    if (s->invalidated || dirty) {
-        s->invalidated = 0;
-        memcpy(ds_get_data(s->vga.ds), s->vga.vram_ptr,
-               ds_get_linesize(s->vga.ds) * ds_get_height(s->vga.ds));
-        dpy_gfx_update(s->vga.ds, 0, 0,
-                   ds_get_width(s->vga.ds), ds_get_height(s->vga.ds));
-    }
-    if (dirty) {
-        memory_region_reset_dirty(&s->vga.vram, 0,
-            ds_get_linesize(s->vga.ds) * ds_get_height(s->vga.ds),
-            DIRTY_MEMORY_VGA);
+    vga_sync_dirty_bitmap(&s->vga);
+    snap = memory_region_snapshot_and_clear_dirty(&s->vga.vram, 0,
+                                                  linesize * height,
+                                                  DIRTY_MEMORY_VGA);
+    y_start = -1;
+    for (y = 0; y <= height; y++) {
+        if (y < height &&
+            memory_region_snapshot_get_dirty(&s->vga.vram, snap,
+                                             y * linesize, linesize)) {
+            if (y_start < 0) {
+                y_start = y;
+            }
+            continue;
+        }
+        if (y_start >= 0) {
+            memcpy(ds_get_data(s->vga.ds) + y_start * linesize,
+                   s->vga.vram_ptr + y_start * linesize,
+                   (y - y_start) * linesize);
+            dpy_gfx_update(s->vga.ds, 0, y_start,
+                           ds_get_width(s->vga.ds), y - y_start);
+            y_start = -1;
+        }
     }
+    g_free(snap);
 }
 
 static void vmsvga_reset(DeviceState *dev)
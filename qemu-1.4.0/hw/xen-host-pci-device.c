@@ -62,6 +62,7 @@ static int xen_host_pci_get_resource(XenHostPCIDevice *d)
     if (rc) {
         return rc;
     }
+    d->sysfs_opens++;
     fd = open(path, O_RDONLY);
     if (fd == -1) {
         XEN_HOST_PCI_LOG("Error: Can't open %s: %s\n", path, strerror(errno));
@@ -154,6 +155,7 @@ static int xen_host_pci_get_value(XenHostPCIDevice *d, const char *name,
     if (rc) {
         return rc;
     }
+    d->sysfs_opens++;
     fd = open(path, O_RDONLY);
     if (fd == -1) {
         XEN_HOST_PCI_LOG("Error: Can't open %s: %s\n", path, strerror(errno));
@@ -215,6 +217,7 @@ static int xen_host_pci_config_open(XenHostPCIDevice *d)
     if (rc) {
         return rc;
     }
+    d->sysfs_opens++;
     d->config_fd = open(path, O_RDWR);
     if (d->config_fd < 0) {
         return -errno;
@@ -227,6 +230,14 @@ static int xen_host_pci_config_read(XenHostPCIDevice *d,
 {
     int rc;
 
+    if (pos >= 0 && len > 0 && pos + len <= PCIE_CONFIG_SPACE_SIZE &&
+        find_next_zero_bit(d->config_static, pos + len, pos) >= pos + len) {
+        memcpy(buf, d->config_snapshot + pos, len);
+        d->snapshot_reads++;
+        return 0;
+    }
+
+    d->config_reads++;
     do {
         rc = pread(d->config_fd, buf, len, pos);
     } while (rc < 0 && (errno == EINTR || errno == EAGAIN));
@@ -241,6 +252,12 @@ static int xen_host_pci_config_write(XenHostPCIDevice *d,
 {
     int rc;
 
+    /* whatever the guest gets to write is no longer known to us */
+    if (pos >= 0 && pos < PCIE_CONFIG_SPACE_SIZE) {
+        bitmap_clear(d->config_static, pos,
+                     MIN(len, PCIE_CONFIG_SPACE_SIZE - pos));
+    }
+    d->config_writes++;
     do {
         rc = pwrite(d->config_fd, buf, len, pos);
     } while (rc < 0 && (errno == EINTR || errno == EAGAIN));
@@ -341,6 +358,83 @@ int xen_host_pci_find_ext_cap_offset(XenHostPCIDevice *d, uint32_t cap)
     return -1;
 }
 
+static void xen_host_pci_config_set_static(XenHostPCIDevice *d, int pos,
+                                           int len, int size)
+{
+    if (pos >= 0 && pos + len <= size) {
+        bitmap_set(d->config_static, pos, len);
+    }
+}
+
+/* Read the whole config space once and mark what will not change */
+static int xen_host_pci_config_snapshot(XenHostPCIDevice *d)
+{
+    int size, pos, id, max_cap;
+    uint32_t header;
+
+    bitmap_zero(d->config_static, PCIE_CONFIG_SPACE_SIZE);
+    d->config_reads++;
+    do {
+        size = pread(d->config_fd, d->config_snapshot,
+                     PCIE_CONFIG_SPACE_SIZE, 0);
+    } while (size < 0 && (errno == EINTR || errno == EAGAIN));
+    if (size < PCI_CONFIG_HEADER_SIZE) {
+        /* less than the header; we are probably not allowed to see it */
+        return size < 0 ? -errno : -ENODEV;
+    }
+
+    xen_host_pci_config_set_static(d, PCI_VENDOR_ID, 4, size);
+    xen_host_pci_config_set_static(d, PCI_REVISION_ID, 4, size);
+    xen_host_pci_config_set_static(d, PCI_HEADER_TYPE, 1, size);
+    if ((d->config_snapshot[PCI_HEADER_TYPE] &
+         ~PCI_HEADER_TYPE_MULTI_FUNCTION) == PCI_HEADER_TYPE_NORMAL) {
+        xen_host_pci_config_set_static(d, PCI_SUBSYSTEM_VENDOR_ID, 4, size);
+    }
+    xen_host_pci_config_set_static(d, PCI_INTERRUPT_PIN, 1, size);
+
+    if (!(pci_get_word(d->config_snapshot + PCI_STATUS) &
+          PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+    xen_host_pci_config_set_static(d, PCI_CAPABILITY_LIST, 1, size);
+
+    /* capability links, and the read-only MSI-X and PCIe registers */
+    pos = d->config_snapshot[PCI_CAPABILITY_LIST] & ~3;
+    for (max_cap = 48; pos >= PCI_CONFIG_HEADER_SIZE &&
+         pos + PCI_CAP_SIZEOF <= PCI_CONFIG_SPACE_SIZE && max_cap > 0;
+         max_cap--) {
+        xen_host_pci_config_set_static(d, pos, PCI_CAP_SIZEOF, size);
+        id = d->config_snapshot[pos + PCI_CAP_LIST_ID];
+        if (id == PCI_CAP_ID_MSIX) {
+            xen_host_pci_config_set_static(d, pos + PCI_MSIX_TABLE, 8, size);
+        } else if (id == PCI_CAP_ID_EXP) {
+            xen_host_pci_config_set_static(d, pos + PCI_EXP_FLAGS, 2, size);
+            xen_host_pci_config_set_static(d, pos + PCI_EXP_DEVCAP, 4, size);
+            xen_host_pci_config_set_static(d, pos + PCI_EXP_LNKCAP, 4, size);
+        }
+        pos = d->config_snapshot[pos + PCI_CAP_LIST_NEXT] & ~3;
+    }
+
+    /* extended capability headers */
+    if (size < PCIE_CONFIG_SPACE_SIZE) {
+        return 0;
+    }
+    pos = PCI_CONFIG_SPACE_SIZE;
+    for (max_cap = XEN_HOST_PCI_MAX_EXT_CAP; max_cap > 0; max_cap--) {
+        header = pci_get_long(d->config_snapshot + pos);
+        xen_host_pci_config_set_static(d, pos, 4, size);
+        if (header == 0) {
+            break;
+        }
+        pos = PCI_EXT_CAP_NEXT(header);
+        if (pos < PCI_CONFIG_SPACE_SIZE || pos + 4 > size) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
 int xen_host_pci_device_get(XenHostPCIDevice *d, uint16_t domain,
                             uint8_t bus, uint8_t dev, uint8_t func)
 {
@@ -352,25 +446,39 @@ int xen_host_pci_device_get(XenHostPCIDevice *d, uint16_t domain,
     d->bus = bus;
     d->dev = dev;
     d->func = func;
+    d->sysfs_opens = d->config_reads = d->config_writes = 0;
+    d->snapshot_reads = 0;
 
     rc = xen_host_pci_config_open(d);
     if (rc) {
         goto error;
     }
-    rc = xen_host_pci_get_resource(d);
+    rc = xen_host_pci_config_snapshot(d);
     if (rc) {
         goto error;
     }
-    rc = xen_host_pci_get_hex_value(d, "vendor", &v);
+    rc = xen_host_pci_get_resource(d);
     if (rc) {
         goto error;
     }
-    d->vendor_id = v;
-    rc = xen_host_pci_get_hex_value(d, "device", &v);
-    if (rc) {
-        goto error;
+
+    /* SR-IOV virtual functions read all ones here; only sysfs knows */
+    d->vendor_id = pci_get_word(d->config_snapshot + PCI_VENDOR_ID);
+    if (d->vendor_id == 0xffff) {
+        rc = xen_host_pci_get_hex_value(d, "vendor", &v);
+        if (rc) {
+            goto error;
+        }
+        d->vendor_id = v;
+    }
+    d->device_id = pci_get_word(d->config_snapshot + PCI_DEVICE_ID);
+    if (d->device_id == 0xffff) {
+        rc = xen_host_pci_get_hex_value(d, "device", &v);
+        if (rc) {
+            goto error;
+        }
+        d->device_id = v;
     }
-    d->device_id = v;
     rc = xen_host_pci_get_dec_value(d, "irq", &v);
     if (rc) {
         goto error;
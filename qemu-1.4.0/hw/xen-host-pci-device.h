@@ -2,6 +2,7 @@
 #define XEN_HOST_PCI_DEVICE_H
 
 #include "pci/pci.h"
+#include "qemu/bitmap.h"
 
 enum {
     XEN_HOST_PCI_REGION_TYPE_IO = 1 << 1,
@@ -33,6 +34,20 @@ typedef struct XenHostPCIDevice {
     bool is_virtfn;
 
     int config_fd;
+
+    /* Config space as read at open.  Reads that only cover read-only
+     * registers (IDs, class, header type, capability list links and a few
+     * capability registers), marked in config_static, are answered from
+     * it; everything else goes to the device.
+     */
+    uint8_t config_snapshot[PCIE_CONFIG_SPACE_SIZE];
+    DECLARE_BITMAP(config_static, PCIE_CONFIG_SPACE_SIZE);
+
+    /* sysfs accesses, for query-pci */
+    uint64_t sysfs_opens;
+    uint64_t config_reads;
+    uint64_t config_writes;
+    uint64_t snapshot_reads;
 } XenHostPCIDevice;
 
 int xen_host_pci_device_get(XenHostPCIDevice *d, uint16_t domain,
@@ -37,6 +37,8 @@
 #include "hw.h"
 #include "char/char.h"
 #include "qemu/log.h"
+#include "qemu/timer.h"
+#include "trace.h"
 #include "xen_backend.h"
 #include "qmp-commands.h"
 
@@ -57,6 +59,12 @@ const char *xen_protocol;
 static QTAILQ_HEAD(XenDeviceHead, XenDevice) xendevs = QTAILQ_HEAD_INITIALIZER(xendevs);
 static int debug = 0;
 
+/* how many times a batched commit is retried when xenstored reports a
+ * conflicting transaction */
+#define XEN_BE_COMMIT_RETRIES   8
+/* watch events handled per wakeup of the xenstore fd */
+#define XENSTORE_WATCH_BUDGET   64
+
 /* ------------------------------------------------------------- */
 
 int xenstore_write_str(const char *base, const char *node, const char *val)
@@ -108,34 +116,189 @@ int xenstore_read_int(const char *base, const char *node, int *ival)
     return rc;
 }
 
+/*
+ * Per device xenstore access: reads are answered from be_cache/fe_cache
+ * until a watch event says the node changed, writes made by the state
+ * machine are queued and committed in one transaction.
+ */
+static void xen_be_account(struct XenDevice *xendev, int64_t ns)
+{
+    if (ns > xendev->xs_stats.max_ns) {
+        xendev->xs_stats.max_ns = ns;
+    }
+}
+
+static char *xenstore_read_cached(struct XenDevice *xendev, GHashTable *cache,
+                                  const char *base, const char *node)
+{
+    gpointer value;
+    int64_t ns;
+    char *ret;
+
+    if (cache && g_hash_table_lookup_extended(cache, node, NULL, &value)) {
+        xendev->xs_stats.cached++;
+        return g_strdup(value);
+    }
+
+    ns = get_clock();
+    ret = xenstore_read_str(base, node);
+    ns = get_clock() - ns;
+
+    xendev->xs_stats.reads++;
+    xendev->xs_stats.read_ns += ns;
+    xen_be_account(xendev, ns);
+    trace_xen_be_xs_read(xendev->name, node, ns);
+
+    if (cache) {
+        g_hash_table_insert(cache, g_strdup(node), g_strdup(ret));
+    }
+    return ret;
+}
+
+static int xenstore_read_cached_int(struct XenDevice *xendev,
+                                    GHashTable *cache, const char *base,
+                                    const char *node, int *ival)
+{
+    char *val;
+    int rc = -1;
+
+    val = xenstore_read_cached(xendev, cache, base, node);
+    if (val && 1 == sscanf(val, "%d", ival)) {
+        rc = 0;
+    }
+    g_free(val);
+    return rc;
+}
+
+static gboolean xen_be_node_under(gpointer key, gpointer value,
+                                  gpointer opaque)
+{
+    const char *node = key;
+    const char *changed = opaque;
+    size_t len = strlen(changed);
+
+    return len == 0 || (strncmp(node, changed, len) == 0 &&
+                        (node[len] == '\0' || node[len] == '/'));
+}
+
+/* 'node' (or the whole device when node is "") changed in xenstore */
+static void xen_be_invalidate(GHashTable *cache, const char *node)
+{
+    if (cache) {
+        g_hash_table_foreach_remove(cache, xen_be_node_under, (gpointer)node);
+    }
+}
+
+static int xen_be_flush_writes(struct XenDevice *xendev)
+{
+    char abspath[XEN_BUFSIZE];
+    GHashTableIter iter;
+    gpointer node, val;
+    xs_transaction_t t;
+    unsigned int nodes, retries = 0;
+    int64_t ns;
+    int rc = 0;
+
+    nodes = g_hash_table_size(xendev->xs_pending);
+    if (nodes == 0) {
+        return 0;
+    }
+
+    ns = get_clock();
+again:
+    t = xs_transaction_start(xenstore);
+    if (t == XBT_NULL) {
+        rc = -1;
+        goto out;
+    }
+    g_hash_table_iter_init(&iter, xendev->xs_pending);
+    while (g_hash_table_iter_next(&iter, &node, &val)) {
+        snprintf(abspath, sizeof(abspath), "%s/%s", xendev->be, (char *)node);
+        if (!xs_write(xenstore, t, abspath, val, strlen(val))) {
+            xs_transaction_end(xenstore, t, true);
+            rc = -1;
+            goto out;
+        }
+    }
+    if (!xs_transaction_end(xenstore, t, false)) {
+        if (errno == EAGAIN && retries++ < XEN_BE_COMMIT_RETRIES) {
+            goto again;
+        }
+        rc = -1;
+    }
+
+out:
+    ns = get_clock() - ns;
+    xendev->xs_stats.writes += nodes;
+    xendev->xs_stats.commits++;
+    xendev->xs_stats.retries += retries;
+    xendev->xs_stats.write_ns += ns;
+    xen_be_account(xendev, ns);
+    trace_xen_be_xs_commit(xendev->name, nodes, retries, ns);
+
+    if (rc < 0) {
+        xen_be_printf(xendev, 0, "committing %u backend nodes failed\n", nodes);
+    }
+    g_hash_table_remove_all(xendev->xs_pending);
+    return rc;
+}
+
 int xenstore_write_be_str(struct XenDevice *xendev, const char *node, const char *val)
 {
-    return xenstore_write_str(xendev->be, node, val);
+    int64_t ns;
+    int rc;
+
+    if (xendev->be_cache) {
+        g_hash_table_insert(xendev->be_cache, g_strdup(node), g_strdup(val));
+    }
+
+    if (xendev->xs_batch) {
+        g_hash_table_insert(xendev->xs_pending, g_strdup(node), g_strdup(val));
+        return 0;
+    }
+
+    ns = get_clock();
+    rc = xenstore_write_str(xendev->be, node, val);
+    ns = get_clock() - ns;
+
+    xendev->xs_stats.writes++;
+    xendev->xs_stats.commits++;
+    xendev->xs_stats.write_ns += ns;
+    xen_be_account(xendev, ns);
+    if (rc < 0 && xendev->be_cache) {
+        g_hash_table_remove(xendev->be_cache, node);
+    }
+    return rc;
 }
 
 int xenstore_write_be_int(struct XenDevice *xendev, const char *node, int ival)
 {
-    return xenstore_write_int(xendev->be, node, ival);
+    char val[32];
+
+    snprintf(val, sizeof(val), "%d", ival);
+    return xenstore_write_be_str(xendev, node, val);
 }
 
 char *xenstore_read_be_str(struct XenDevice *xendev, const char *node)
 {
-    return xenstore_read_str(xendev->be, node);
+    return xenstore_read_cached(xendev, xendev->be_cache, xendev->be, node);
 }
 
 int xenstore_read_be_int(struct XenDevice *xendev, const char *node, int *ival)
 {
-    return xenstore_read_int(xendev->be, node, ival);
+    return xenstore_read_cached_int(xendev, xendev->be_cache, xendev->be,
+                                    node, ival);
 }
 
 char *xenstore_read_fe_str(struct XenDevice *xendev, const char *node)
 {
-    return xenstore_read_str(xendev->fe, node);
+    return xenstore_read_cached(xendev, xendev->fe_cache, xendev->fe, node);
 }
 
 int xenstore_read_fe_int(struct XenDevice *xendev, const char *node, int *ival)
 {
-    return xenstore_read_int(xendev->fe, node, ival);
+    return xenstore_read_cached_int(xendev, xendev->fe_cache, xendev->fe,
+                                    node, ival);
 }
 
 /* ------------------------------------------------------------- */
@@ -159,6 +322,11 @@ int xen_be_set_state(struct XenDevice *xendev, enum xenbus_state state)
     int rc;
 
     rc = xenstore_write_be_int(xendev, "state", state);
+    if (rc == 0 && xendev->xs_batch) {
+        /* the frontend sees the new state together with everything the
+         * backend wrote to get there */
+        rc = xen_be_flush_writes(xendev);
+    }
     if (rc < 0) {
         return rc;
     }
@@ -219,10 +387,17 @@ static struct XenDevice *xen_be_get_xendev(const char *type, int dom, int dev,
 
     xendev->debug      = debug;
     xendev->local_port = -1;
+    /* the backend directory is watched by xenstore_scan() */
+    xendev->be_cache   = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    xendev->xs_pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
 
     xendev->evtchndev = xen_xc_evtchn_open(NULL, 0);
     if (xendev->evtchndev == XC_HANDLER_INITIAL_VALUE) {
         xen_be_printf(NULL, 0, "can't open evtchn device\n");
+        g_hash_table_destroy(xendev->be_cache);
+        g_hash_table_destroy(xendev->xs_pending);
         g_free(xendev);
         return NULL;
     }
@@ -233,6 +408,8 @@ static struct XenDevice *xen_be_get_xendev(const char *type, int dom, int dev,
         if (xendev->gnttabdev == XC_HANDLER_INITIAL_VALUE) {
             xen_be_printf(NULL, 0, "can't open gnttab device\n");
             xc_evtchn_close(xendev->evtchndev);
+            g_hash_table_destroy(xendev->be_cache);
+            g_hash_table_destroy(xendev->xs_pending);
             g_free(xendev);
             return NULL;
         }
@@ -290,6 +467,15 @@ static struct XenDevice *xen_be_del_xendev(int dom, int dev)
             xc_gnttab_close(xendev->gnttabdev);
         }
 
+        g_hash_table_destroy(xendev->be_cache);
+        if (xendev->fe_cache) {
+            g_hash_table_destroy(xendev->fe_cache);
+        }
+        g_hash_table_destroy(xendev->xs_pending);
+        if (xendev->io_stats.latency) {
+            latency_histogram_free(xendev->io_stats.latency);
+        }
+
         QTAILQ_REMOVE(&xendevs, xendev, next);
         g_free(xendev);
     }
@@ -388,6 +574,8 @@ static int xen_be_try_setup(struct XenDevice *xendev)
                       xendev->fe);
         return -1;
     }
+    xendev->fe_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, g_free);
     xen_be_set_state(xendev, XenbusStateInitialising);
 
     xen_be_backend_changed(xendev, NULL);
@@ -455,6 +643,15 @@ static int xen_be_try_initialise(struct XenDevice *xendev)
     }
 
     xen_be_set_state(xendev, XenbusStateConnected);
+    xen_be_printf(xendev, 1, "xenstore: %" PRIu64 " reads (%" PRIu64
+                  " cached) in %" PRIu64 " us, %" PRIu64 " writes in %" PRIu64
+                  " commits (%" PRIu64 " retries) in %" PRIu64
+                  " us, slowest %" PRIu64 " us\n",
+                  xendev->xs_stats.reads, xendev->xs_stats.cached,
+                  xendev->xs_stats.read_ns / 1000, xendev->xs_stats.writes,
+                  xendev->xs_stats.commits, xendev->xs_stats.retries,
+                  xendev->xs_stats.write_ns / 1000,
+                  xendev->xs_stats.max_ns / 1000);
     return 0;
 }
 
@@ -515,7 +712,7 @@ static int xen_be_try_reset(struct XenDevice *xendev)
 /*
  * state change dispatcher function
  */
-void xen_be_check_state(struct XenDevice *xendev)
+static void xen_be_run_state(struct XenDevice *xendev)
 {
     int rc = 0;
 
@@ -555,6 +752,20 @@ void xen_be_check_state(struct XenDevice *xendev)
     }
 }
 
+void xen_be_check_state(struct XenDevice *xendev)
+{
+    int64_t ns = get_clock();
+
+    xendev->xs_batch++;
+    xen_be_run_state(xendev);
+    if (--xendev->xs_batch == 0) {
+        xen_be_flush_writes(xendev);
+    }
+
+    trace_xen_be_check_state(xendev->name, xendev->be_state,
+                             get_clock() - ns);
+}
+
 /* ------------------------------------------------------------- */
 
 static int xenstore_scan(const char *type, int dom, struct XenDevOps *ops)
@@ -731,9 +942,14 @@ static void xenstore_update_be(char *watch, char *type, int dom,
     if (dev == -1) {
         return;
     }
+    if (strncmp(path, "statistics", strlen("statistics")) == 0) {
+        /* written by xen_be_export_stats() */
+        return;
+    }
 
     xendev = xen_be_get_xendev(type, dom, dev, ops);
     if (xendev != NULL) {
+        xen_be_invalidate(xendev->be_cache, path);
         bepath = xs_read(xenstore, 0, xendev->be, &len);
         if (bepath == NULL) {
             xen_be_del_xendev(dom, dev);
@@ -754,26 +970,84 @@ static void xenstore_update_fe(char *watch, struct XenDevice *xendev)
     if (strncmp(xendev->fe, watch, len) != 0) {
         return;
     }
+    if (watch[len] == '\0') {
+        /* the frontend directory itself */
+        xen_be_invalidate(xendev->fe_cache, "");
+        return;
+    }
     if (watch[len] != '/') {
         return;
     }
     node = watch + len + 1;
+    xen_be_invalidate(xendev->fe_cache, node);
 
     xen_be_frontend_changed(xendev, node);
     xen_be_check_state(xendev);
 }
 
-static void xenstore_update(void *unused)
+/* XenClient:
+ * Generic watches for emulated devices that only want to be told when a
+ * node (or anything below it) changed. The token carries a unique id
+ * rather than the address of the XenstoreWatch: after xs_unwatch() an
+ * event for it may still be queued, and is dropped when the id is no
+ * longer found. The device decides what to re-read. */
+struct XenstoreWatch {
+    unsigned int id;
+    char *path;
+    XenstoreWatchFunc *func;
+    void *opaque;
+    QTAILQ_ENTRY(XenstoreWatch) next;
+};
+
+static QTAILQ_HEAD(, XenstoreWatch) xenstore_watches =
+    QTAILQ_HEAD_INITIALIZER(xenstore_watches);
+static unsigned int xenstore_watch_id;
+
+XenstoreWatch *xenstore_add_watch(const char *path, XenstoreWatchFunc *func,
+                                  void *opaque)
 {
-    char **vec = NULL;
-    intptr_t type, ops, ptr;
-    unsigned int dom, count;
+    XenstoreWatch *w;
+    char token[XEN_BUFSIZE];
 
-    vec = xs_read_watch(xenstore, &count);
-    if (vec == NULL) {
-        goto cleanup;
+    w = g_malloc0(sizeof(*w));
+    w->id = ++xenstore_watch_id;
+    w->path = g_strdup(path);
+    w->func = func;
+    w->opaque = opaque;
+
+    snprintf(token, sizeof(token), "cb:%x", w->id);
+    if (!xs_watch(xenstore, path, token)) {
+        fprintf(stderr, "xen: watching path (%s) failed\n", path);
+        g_free(w->path);
+        g_free(w);
+        return NULL;
     }
 
+    QTAILQ_INSERT_TAIL(&xenstore_watches, w, next);
+    return w;
+}
+
+void xenstore_remove_watch(XenstoreWatch *w)
+{
+    char token[XEN_BUFSIZE];
+
+    if (!w) {
+        return;
+    }
+
+    snprintf(token, sizeof(token), "cb:%x", w->id);
+    xs_unwatch(xenstore, w->path, token);
+    QTAILQ_REMOVE(&xenstore_watches, w, next);
+    g_free(w->path);
+    g_free(w);
+}
+
+static void xenstore_dispatch_watch(char **vec)
+{
+    intptr_t type, ops, ptr;
+    unsigned int dom, id;
+    XenstoreWatch *w;
+
     if (sscanf(vec[XS_WATCH_TOKEN], "be:%" PRIxPTR ":%d:%" PRIxPTR,
                &type, &dom, &ops) == 3) {
         xenstore_update_be(vec[XS_WATCH_PATH], (void*)type, dom, (void*)ops);
@@ -786,9 +1060,35 @@ static void xenstore_update(void *unused)
     if (sscanf(vec[XS_WATCH_TOKEN], "ni:%" PRIxPTR, &ptr) == 1) {
         xenstore_update_nic(vec[XS_WATCH_PATH], (void *)ptr);
     }
+    if (sscanf(vec[XS_WATCH_TOKEN], "cb:%x", &id) == 1) {
+        QTAILQ_FOREACH(w, &xenstore_watches, next) {
+            if (w->id == id) {
+                /* func may remove the watch, don't touch w afterwards */
+                w->func(vec[XS_WATCH_PATH], w->opaque);
+                break;
+            }
+        }
+    }
+}
 
-cleanup:
-    free(vec);
+/* Drain as many pending watch events as possible per wakeup: a burst of
+ * backend writes by the toolstack shouldn't cost one main loop iteration
+ * per node. */
+static void xenstore_update(void *unused)
+{
+    char **vec;
+    unsigned int count;
+    int budget = XENSTORE_WATCH_BUDGET;
+
+    vec = xs_read_watch(xenstore, &count);
+    while (vec != NULL) {
+        xenstore_dispatch_watch(vec);
+        free(vec);
+        if (--budget == 0) {
+            break;
+        }
+        vec = xen_xs_check_watch(xenstore);
+    }
 }
 
 static void xen_be_evtchn_event(void *opaque)
@@ -803,12 +1103,82 @@ static void xen_be_evtchn_event(void *opaque)
         return;
     }
     xc_evtchn_unmask(xendev->evtchndev, port);
+    xendev->io_stats.notify_received++;
 
     if (xendev->ops->event) {
         xendev->ops->event(xendev);
     }
 }
 
+/*
+ * Every XEN_BE_STATS_INTERVAL_MS the counters of the devices that did I/O
+ * since the last time are written to "statistics/" in their backend
+ * directory, in a single transaction per device.  xenstore_update_be()
+ * ignores the watch events this causes.
+ */
+#define XEN_BE_STATS_INTERVAL_MS  10000
+
+static QEMUTimer *xen_be_stats_timer;
+
+static void xenstore_write_be_u64(struct XenDevice *xendev, const char *node,
+                                  uint64_t val)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%" PRIu64, val);
+    xenstore_write_be_str(xendev, node, buf);
+}
+
+static void xen_be_export_stats(struct XenDevice *xendev)
+{
+    struct XenIOStats *stats = &xendev->io_stats;
+    uint64_t ops = stats->ops[XEN_IO_READ] + stats->ops[XEN_IO_WRITE];
+
+    if (ops == stats->exported_ops) {
+        return;
+    }
+    stats->exported_ops = ops;
+
+    xendev->xs_batch++;
+    xenstore_write_be_u64(xendev, "statistics/rd_ops",
+                          stats->ops[XEN_IO_READ]);
+    xenstore_write_be_u64(xendev, "statistics/rd_bytes",
+                          stats->bytes[XEN_IO_READ]);
+    xenstore_write_be_u64(xendev, "statistics/wr_ops",
+                          stats->ops[XEN_IO_WRITE]);
+    xenstore_write_be_u64(xendev, "statistics/wr_bytes",
+                          stats->bytes[XEN_IO_WRITE]);
+    xenstore_write_be_u64(xendev, "statistics/errors", stats->errors);
+    xenstore_write_be_u64(xendev, "statistics/inflight_max",
+                          stats->inflight_max);
+    xenstore_write_be_u64(xendev, "statistics/grant_maps",
+                          stats->grant_maps);
+    xenstore_write_be_u64(xendev, "statistics/grant_unmaps",
+                          stats->grant_unmaps);
+    xenstore_write_be_u64(xendev, "statistics/grant_copies",
+                          stats->grant_copies);
+    xenstore_write_be_u64(xendev, "statistics/notify_sent",
+                          stats->notify_sent);
+    xenstore_write_be_u64(xendev, "statistics/notify_received",
+                          stats->notify_received);
+    if (--xendev->xs_batch == 0) {
+        xen_be_flush_writes(xendev);
+    }
+}
+
+static void xen_be_stats_tick(void *opaque)
+{
+    struct XenDevice *xendev;
+
+    QTAILQ_FOREACH(xendev, &xendevs, next) {
+        if (xendev->be_state == XenbusStateConnected) {
+            xen_be_export_stats(xendev);
+        }
+    }
+    qemu_mod_timer(xen_be_stats_timer, qemu_get_clock_ms(rt_clock) +
+                   XEN_BE_STATS_INTERVAL_MS);
+}
+
 /* -------------------------------------------------------------------- */
 
 int xen_be_init(void)
@@ -827,6 +1197,10 @@ int xen_be_init(void)
         /* Check if xen_init() have been called */
         goto err;
     }
+
+    xen_be_stats_timer = qemu_new_timer_ms(rt_clock, xen_be_stats_tick, NULL);
+    qemu_mod_timer(xen_be_stats_timer, qemu_get_clock_ms(rt_clock) +
+                   XEN_BE_STATS_INTERVAL_MS);
     return 0;
 
 err:
@@ -872,9 +1246,92 @@ void xen_be_unbind_evtchn(struct XenDevice *xendev)
 
 int xen_be_send_notify(struct XenDevice *xendev)
 {
+    xendev->io_stats.notify_sent++;
     return xc_evtchn_notify(xendev->evtchndev, xendev->local_port);
 }
 
+/*
+ * I/O accounting.  Devices that queue requests call xen_be_io_start() when
+ * they take one off the ring and xen_be_io_done() with the rt_clock time
+ * of that moment once they respond; devices that complete synchronously
+ * just call xen_be_io_count().
+ */
+void xen_be_io_start(struct XenDevice *xendev)
+{
+    struct XenIOStats *stats = &xendev->io_stats;
+
+    if (++stats->inflight > stats->inflight_max) {
+        stats->inflight_max = stats->inflight;
+    }
+}
+
+void xen_be_io_count(struct XenDevice *xendev, int dir, uint64_t bytes,
+                     bool error)
+{
+    struct XenIOStats *stats = &xendev->io_stats;
+
+    stats->ops[dir]++;
+    if (error) {
+        stats->errors++;
+    } else {
+        stats->bytes[dir] += bytes;
+    }
+}
+
+void xen_be_io_done(struct XenDevice *xendev, int dir, uint64_t bytes,
+                    bool error, int64_t start_ns)
+{
+    struct XenIOStats *stats = &xendev->io_stats;
+
+    stats->inflight--;
+    xen_be_io_count(xendev, dir, bytes, error);
+    if (!stats->latency) {
+        stats->latency = latency_histogram_new(
+            LATENCY_HISTOGRAM_DEFAULT_MIN_NS, LATENCY_HISTOGRAM_DEFAULT_BINS,
+            NULL);
+    }
+    latency_histogram_add(stats->latency,
+                          qemu_get_clock_ns(rt_clock) - start_ns);
+}
+
+XenBackendInfoList *qmp_query_xen_backends(Error **errp)
+{
+    XenBackendInfoList *head = NULL, **tail = &head, *entry;
+    struct XenDevice *xendev;
+    struct XenIOStats *stats;
+    XenBackendInfo *info;
+
+    QTAILQ_FOREACH(xendev, &xendevs, next) {
+        stats = &xendev->io_stats;
+        info = g_malloc0(sizeof(*info));
+        info->type = g_strdup(xendev->type);
+        info->domain = xendev->dom;
+        info->dev = xendev->dev;
+        info->state = g_strdup(xenbus_strstate(xendev->be_state));
+        info->rd_ops = stats->ops[XEN_IO_READ];
+        info->rd_bytes = stats->bytes[XEN_IO_READ];
+        info->wr_ops = stats->ops[XEN_IO_WRITE];
+        info->wr_bytes = stats->bytes[XEN_IO_WRITE];
+        info->errors = stats->errors;
+        info->inflight = stats->inflight;
+        info->inflight_max = stats->inflight_max;
+        info->grant_maps = stats->grant_maps;
+        info->grant_unmaps = stats->grant_unmaps;
+        info->grant_copies = stats->grant_copies;
+        info->notify_sent = stats->notify_sent;
+        info->notify_received = stats->notify_received;
+        if (stats->latency) {
+            info->has_latency_histogram = true;
+            info->latency_histogram = latency_histogram_info(stats->latency);
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 /*
  * msg_level:
  *  0 == errors (stderr + logfile).
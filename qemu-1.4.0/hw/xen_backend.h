@@ -4,6 +4,7 @@
 #include "xen_common.h"
 #include "sysemu/sysemu.h"
 #include "net/net.h"
+#include "qemu/histogram.h"
 
 /* ------------------------------------------------------------- */
 
@@ -30,6 +31,41 @@ struct XenDevOps {
     void      (*frontend_changed)(struct XenDevice *xendev, const char *node);
 };
 
+/* xenstore latency accounting, per backend device */
+struct XenStoreStats {
+    uint64_t reads;        /* round trips for reads */
+    uint64_t cached;       /* reads answered from the cache */
+    uint64_t read_ns;
+    uint64_t writes;       /* nodes written */
+    uint64_t commits;      /* round trips for writes (single or batched) */
+    uint64_t retries;      /* transactions restarted on EAGAIN */
+    uint64_t write_ns;
+    uint64_t max_ns;       /* slowest single round trip */
+};
+
+/* I/O accounting, per backend device.  Reads are rx for network devices,
+ * writes are tx. */
+enum {
+    XEN_IO_READ,
+    XEN_IO_WRITE,
+    XEN_IO_NR,
+};
+
+struct XenIOStats {
+    uint64_t ops[XEN_IO_NR];
+    uint64_t bytes[XEN_IO_NR];
+    uint64_t errors;
+    int64_t  inflight;       /* between xen_be_io_start() and _done() */
+    int64_t  inflight_max;
+    uint64_t grant_maps;     /* grant references mapped, rings excluded */
+    uint64_t grant_unmaps;
+    uint64_t grant_copies;   /* segments moved with grant copy */
+    uint64_t notify_sent;    /* event channel kicks, on every queue */
+    uint64_t notify_received;
+    LatencyHistogram *latency;  /* from xen_be_io_start() to _done() */
+    uint64_t exported_ops;   /* ops[] total last written to xenstore */
+};
+
 struct XenDevice {
     const char         *type;
     int                dom;
@@ -49,6 +85,18 @@ struct XenDevice {
     XenEvtchn          evtchndev;
     XenGnttab          gnttabdev;
 
+    /* node -> value (NULL if missing), dropped on watch events. The
+     * frontend cache only exists once the frontend watch is set up. */
+    GHashTable         *be_cache;
+    GHashTable         *fe_cache;
+    /* backend writes queued while the state machine runs, committed in a
+     * single transaction by xen_be_set_state() or at the end of
+     * xen_be_check_state() */
+    int                xs_batch;
+    GHashTable         *xs_pending;
+    struct XenStoreStats xs_stats;
+    struct XenIOStats  io_stats;
+
     struct XenDevOps   *ops;
     QTAILQ_ENTRY(XenDevice) next;
 };
@@ -73,6 +121,14 @@ int xenstore_read_be_int(struct XenDevice *xendev, const char *node, int *ival);
 char *xenstore_read_fe_str(struct XenDevice *xendev, const char *node);
 int xenstore_read_fe_int(struct XenDevice *xendev, const char *node, int *ival);
 
+/* Call func(path, opaque) whenever 'path' or one of its children changes.
+ * xenstored fires every new watch once, right after it is registered. */
+typedef struct XenstoreWatch XenstoreWatch;
+typedef void XenstoreWatchFunc(const char *path, void *opaque);
+XenstoreWatch *xenstore_add_watch(const char *path, XenstoreWatchFunc *func,
+                                  void *opaque);
+void xenstore_remove_watch(XenstoreWatch *w);
+
 const char *xenbus_strstate(enum xenbus_state state);
 struct XenDevice *xen_be_find_xendev(const char *type, int dom, int dev);
 void xen_be_check_state(struct XenDevice *xendev);
@@ -84,6 +140,11 @@ int xen_be_set_state(struct XenDevice *xendev, enum xenbus_state state);
 int xen_be_bind_evtchn(struct XenDevice *xendev);
 void xen_be_unbind_evtchn(struct XenDevice *xendev);
 int xen_be_send_notify(struct XenDevice *xendev);
+void xen_be_io_start(struct XenDevice *xendev);
+void xen_be_io_done(struct XenDevice *xendev, int dir, uint64_t bytes,
+                    bool error, int64_t start_ns);
+void xen_be_io_count(struct XenDevice *xendev, int dir, uint64_t bytes,
+                     bool error);
 void xen_be_printf(struct XenDevice *xendev, int msg_level, const char *fmt, ...)
     GCC_FMT_ATTR(3, 4);
 
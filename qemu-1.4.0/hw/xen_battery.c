@@ -25,6 +25,7 @@
 #include "xen_backend.h"
 #include "xen.h"
 #include "pci/pci.h"
+#include "qemu/bitmap.h"
 
 /* Uncomment the following line to have debug messages about
  * Battery Management */
@@ -72,6 +73,19 @@ enum xen_battery_selector {
     XEN_BATTERY_TYPE_PSR
 };
 
+/* Every /pm node the guest can ask about. The guest polls _BST/_STA far more
+ * often than dom0 changes them, so the values are cached and a watch on /pm
+ * only marks the affected node as stale: it is read again on the next guest
+ * access, instead of on every port poke. */
+enum xen_battery_node {
+    XBM_NODE_BATTERY_PRESENT = 0,
+    XBM_NODE_AC_ADAPTER,
+    XBM_NODE_LID_STATE,
+    XBM_NODE_BST,                         /* bst, bst1, ... */
+    XBM_NODE_BIF = XBM_NODE_BST + MAX_BATTERIES, /* bif, bif1, ... */
+    XBM_NODE_MAX = XBM_NODE_BIF + MAX_BATTERIES
+};
+
 /* From each battery, xenstore provides the Battery Status (_bst) and the
  * battery informatiom (_bif).
  *
@@ -96,6 +110,11 @@ struct xen_battery_manager {
     struct battery_buffer batteries[MAX_BATTERIES]; /* Battery array */
     uint8_t index;              /* battery selector */
 
+    /* Snapshot of /pm, kept up to date by a xenstore watch */
+    XenstoreWatch *watch;
+    char *pm_value[XBM_NODE_MAX];
+    DECLARE_BITMAP(pm_stale, XBM_NODE_MAX);
+
     /* TODO: find a better way than putting a static size */
     MemoryRegion mr[3];         /* MemoryRegion to register IO ops */
 };
@@ -122,6 +141,39 @@ bool xen_battery_get_option(void)
     return !!xen_battery_option;
 }
 
+/* --/ xenstore snapshot /------------------------------------------------ */
+
+static char const *xen_battery_node_key(enum xen_battery_node node,
+                                        char *buf, size_t len)
+{
+    switch (node) {
+    case XBM_NODE_BATTERY_PRESENT:
+        return "battery_present";
+    case XBM_NODE_AC_ADAPTER:
+        return "ac_adapter";
+    case XBM_NODE_LID_STATE:
+        return "lid_state";
+    default:
+        break;
+    }
+
+    if (node >= XBM_NODE_BIF) {
+        node -= XBM_NODE_BIF;
+        if (node == 0) {
+            return "bif";
+        }
+        snprintf(buf, len, "bif%d", node);
+    } else {
+        node -= XBM_NODE_BST;
+        if (node == 0) {
+            return "bst";
+        }
+        snprintf(buf, len, "bst%d", node);
+    }
+
+    return buf;
+}
+
 /* Read a string from the /pm/'key'
  * set the result in 'return_value'
  * retun 0 in success */
@@ -153,45 +205,88 @@ static int32_t xen_battery_pm_read_str(char const *key,
     return 0;
 }
 
-/* Read a signed integer from the /pm/'key'
+/* Return the cached content of /pm/'node', reading it from xenstore first if
+ * a watch said it changed (or if there is no watch at all).
+ * Return NULL if the node doesn't exist. */
+static char const *xen_battery_pm_get(struct xen_battery_manager *xbm,
+                                      enum xen_battery_node node)
+{
+    char buf[8];
+    char *value = NULL;
+
+    if (xbm->watch && !test_bit(node, xbm->pm_stale)) {
+        return xbm->pm_value[node];
+    }
+
+    if (0 != xen_battery_pm_read_str(xen_battery_node_key(node, buf,
+                                                          sizeof(buf)),
+                                     &value)) {
+        value = NULL;
+    }
+
+    free(xbm->pm_value[node]);
+    xbm->pm_value[node] = value;
+    clear_bit(node, xbm->pm_stale);
+
+    return value;
+}
+
+/* Read a signed integer from the /pm/'node'
  * set the result in 'return_value'
  * retun 0 in success */
-static int32_t xen_battery_pm_read_int(char const *key,
+static int32_t xen_battery_pm_read_int(struct xen_battery_manager *xbm,
+                                       enum xen_battery_node node,
                                        int32_t *return_value)
 {
-    char path[XEN_BUFSIZE];
-    char *value = NULL;
+    char const *value;
 
-    if ((NULL == key) || (NULL == return_value)) {
+    if (NULL == return_value) {
         XBM_DPRINTF("ERROR, argument couldn't be null\n");
         return -1;
     }
 
-    if (0 > snprintf(path, sizeof(path), "/pm/%s", key)) {
-        XBM_DPRINTF("ERROR, snprintf failed\n");
-        return -1;
-    }
-
-    value = xs_read(xenstore, XBT_NULL, path, NULL);
+    value = xen_battery_pm_get(xbm, node);
 
     if (NULL == value) {
-        XBM_DPRINTF("ERROR, unable to read the content of \"%s\"\n", path);
         return -1;
     }
 
     *return_value = strtoull(value, NULL, 10);
 
-    free(value);
-
     return 0;
 }
 
+/* Watch handler for /pm: only flag what changed, the guest will pay for the
+ * read if and when it asks. */
+static void xen_battery_pm_changed(const char *path, void *opaque)
+{
+    struct xen_battery_manager *xbm = opaque;
+    char buf[8];
+    char const *key;
+    int node;
+
+    if (strncmp(path, "/pm/", 4) != 0) {
+        /* /pm itself: the first event after xs_watch, or a removal */
+        bitmap_fill(xbm->pm_stale, XBM_NODE_MAX);
+        return;
+    }
+
+    key = path + 4;
+    for (node = 0; node < XBM_NODE_MAX; node++) {
+        if (!strcmp(key, xen_battery_node_key(node, buf, sizeof(buf)))) {
+            set_bit(node, xbm->pm_stale);
+            XBM_DPRINTF("%s changed\n", path);
+            return;
+        }
+    }
+}
+
 static int32_t
 xen_battery_update_battery_present(struct xen_battery_manager *xbm)
 {
     int32_t value;
 
-    if (0 != xen_battery_pm_read_int("battery_present", &value)) {
+    if (0 != xen_battery_pm_read_int(xbm, XBM_NODE_BATTERY_PRESENT, &value)) {
         XBM_DPRINTF("ERROR, unable to update the battery present status\"\n");
         /* in error case, it's preferable to show the worst situation */
         xbm->battery_present = 0;
@@ -207,7 +302,7 @@ static int32_t xen_battery_update_ac_adapter(struct xen_battery_manager *xbm)
 {
     int32_t value;
 
-    if (0 != xen_battery_pm_read_int("ac_adapter", &value)) {
+    if (0 != xen_battery_pm_read_int(xbm, XBM_NODE_AC_ADAPTER, &value)) {
         XBM_DPRINTF("ERROR, unable to update the ac_adapter present status\n");
         /* in error case, it's preferable to show the worst situation */
         xbm->ac_adapter_present = 0;
@@ -223,7 +318,7 @@ static int32_t xen_battery_update_lid_state(struct xen_battery_manager *xbm)
 {
     int32_t value;
 
-    if (0 != xen_battery_pm_read_int("lid_state", &value)) {
+    if (0 != xen_battery_pm_read_int(xbm, XBM_NODE_LID_STATE, &value)) {
         XBM_DPRINTF("ERROR, unable to update the lid_state status\"\n");
         /* in error case, it's preferable to show the worst situation */
         xbm->lid_state = 0;
@@ -235,92 +330,61 @@ static int32_t xen_battery_update_lid_state(struct xen_battery_manager *xbm)
     return 0;
 }
 
-static int32_t xen_battery_update_bst(struct battery_buffer *battery,
+/* The guest walks _bst/_bif byte by byte, so it gets its own copy of the
+ * snapshot: a watch firing in the middle of a read won't tear it. */
+static int32_t xen_battery_update_bst(struct xen_battery_manager *xbm,
                                       int32_t battery_num)
 {
-    char *value = NULL;
-    char *old_value = NULL;
-    char key[6];
-    int32_t rc;
-
-    old_value = battery->_bst;
+    struct battery_buffer *battery = &(xbm->batteries[battery_num]);
+    char const *value;
 
-    if (battery_num <= 0) {
-        rc = xen_battery_pm_read_str("bst", &value);
-    } else {
-        memset(key, 0, sizeof(key));
-
-        if (0 > snprintf(key, sizeof(key) - 1, "bst%d", battery_num)) {
-            XBM_DPRINTF("ERROR, snprintf failed\n");
-            return -1;
-        }
-
-        rc = xen_battery_pm_read_str(key, &value);
-    }
+    value = xen_battery_pm_get(xbm, XBM_NODE_BST + battery_num);
 
-    if (0 != rc) {
+    if (NULL == value) {
         XBM_DPRINTF("ERROR, unable to read the content of \"/pm/bst%d\"\n",
                     battery_num);
         /* TODO: determine what could be the best way to do that */
-        battery->_bst = old_value;
-        if (NULL != value) {
-            free(value);
-        }
         return -1;
     }
 
-    battery->_bst = value;
-
-    if (NULL != old_value) {
-        free(old_value);
+    if ((NULL != battery->_bst) && !strcmp(battery->_bst, value)) {
+        return 0;
     }
+
+    free(battery->_bst);
+    battery->_bst = strdup(value);
+
     return 0;
 }
 
 
-static int32_t xen_battery_update_bif(struct battery_buffer *battery,
+static int32_t xen_battery_update_bif(struct xen_battery_manager *xbm,
                                       int32_t battery_num)
 {
-    char *value = NULL;
-    char *old_value = NULL;
-    char key[6];
-    int32_t rc;
+    struct battery_buffer *battery = &(xbm->batteries[battery_num]);
+    char const *value;
 
-    old_value = battery->_bif;
+    value = xen_battery_pm_get(xbm, XBM_NODE_BIF + battery_num);
 
-    if (battery_num <= 0) {
-        rc = xen_battery_pm_read_str("bif", &value);
-    } else {
-        memset(key, 0, sizeof(key));
-
-        if (0 > snprintf(key, sizeof(key) - 1, "bif%d", battery_num)) {
-            XBM_DPRINTF("ERROR, snprintf failed\n");
-            return -1;
-        }
-
-        rc = xen_battery_pm_read_str(key, &value);
-    }
-
-    if (0 != rc) {
+    if (NULL == value) {
         XBM_DPRINTF("ERROR, unable to read the content of \"/pm/bif%d\"\n",
                     battery_num);
         /* TODO: determine what could be the best way to do that */
-        battery->_bif = old_value;
-        if (NULL != value) {
-            free(value);
-        }
         return -1;
     }
 
-    if ((NULL != old_value) && (NULL != value) &&
-        (strncmp(old_value, value, 70) != 0)) {
-        battery->bif_changed = 1;
+    if (NULL != battery->_bif) {
+        if (!strcmp(battery->_bif, value)) {
+            return 0;
+        }
+        if (strncmp(battery->_bif, value, 70) != 0) {
+            battery->bif_changed = 1;
+        }
+        free(battery->_bif);
     }
 
-    battery->_bif = value;
-    if (NULL != old_value) {
-        free(old_value);
-    }
+    battery->_bif = strdup(value);
+
     return 0;
 }
 
@@ -334,8 +398,8 @@ static int32_t xen_battery_update_status_info(struct xen_battery_manager *xbm)
     }
 
     for (index = 0; index < MAX_BATTERIES; index++) {
-        xen_battery_update_bif(&(xbm->batteries[index]), index);
-        xen_battery_update_bst(&(xbm->batteries[index]), index);
+        xen_battery_update_bif(xbm, index);
+        xen_battery_update_bst(xbm, index);
     }
 
     return 0;
@@ -407,12 +471,12 @@ static int battery_port_1_write_op_set_type(struct battery_buffer *bb,
         switch (bb->port_86_val) {
         case XEN_BATTERY_TYPE_BIF:
             bb->_selector = XEN_BATTERY_TYPE_BIF;
-            xen_battery_update_bif(bb, xbm->index);
+            xen_battery_update_bif(xbm, xbm->index);
             XBM_DPRINTF("BATTERY_OP_SET_INFO_TYPE (BIF)\n");
             break;
         case XEN_BATTERY_TYPE_BST:
             bb->_selector = XEN_BATTERY_TYPE_BST;
-            xen_battery_update_bst(bb, xbm->index);
+            xen_battery_update_bst(xbm, xbm->index);
             XBM_DPRINTF("BATTERY_OP_SET_INFO_TYPE (BST)\n");
             break;
         case XEN_BATTERY_TYPE_PSR:
@@ -556,7 +620,7 @@ static uint64_t battery_port_3_read(void *opaque, hwaddr addr, uint32_t size)
 
     xen_battery_update_battery_present(xbm);
 
-    xen_battery_update_bif(&(xbm->batteries[xbm->index]), xbm->index);
+    xen_battery_update_bif(xbm, xbm->index);
 
     if (NULL != xbm->batteries[xbm->index]._bif) {
         system_state |= 0x1F;
@@ -662,6 +726,14 @@ int32_t xen_battery_init(PCIDevice *device)
         goto error_init;
     }
 
+    /* Everything is stale until the first read. Without a watch, fall back
+     * to reading xenstore on each access. */
+    bitmap_fill(xbm->pm_stale, XBM_NODE_MAX);
+    xbm->watch = xenstore_add_watch("/pm", xen_battery_pm_changed, xbm);
+    if (NULL == xbm->watch) {
+        XBM_ERROR_MSG("unable to watch /pm, battery state won't be cached\n");
+    }
+
     if (0 != xen_battery_update_ac_adapter(xbm)) {
         goto error_init;
     }
@@ -697,6 +769,10 @@ int32_t xen_battery_init(PCIDevice *device)
 
     return 0;
 error_init:
+    xenstore_remove_watch(xbm->watch);
+    for (i = 0; i < XBM_NODE_MAX; i++) {
+        free(xbm->pm_value[i]);
+    }
     free(xbm);
     XBM_ERROR_MSG("unable to initialize the battery emulation\n");
     return -1;
@@ -152,6 +152,19 @@ static inline int xen_xc_hvm_inject_msi(XenXC xen_xc, domid_t dom,
 }
 #endif
 
+/* Xen before 4.2 has no non-blocking way to fetch the next watch event */
+#if CONFIG_XEN_CTRL_INTERFACE_VERSION < 420
+static inline char **xen_xs_check_watch(struct xs_handle *h)
+{
+    return NULL;
+}
+#else
+static inline char **xen_xs_check_watch(struct xs_handle *h)
+{
+    return xs_check_watch(h);
+}
+#endif
+
 /* We suppose that Xen is able to handle multiple device model */
 static inline int xen_xc_hvm_register_pcidev(XenXC xen_xc, domid_t dom,
         unsigned int serverid, uint16_t domain,
@@ -50,6 +50,7 @@ struct XenConsole {
     int               ring_ref;
     void              *sring;
     CharDriverState   *chr;
+    Notifier          chr_writable;
     int               backlog;
 };
 
@@ -149,6 +150,66 @@ static void xencons_receive(void *opaque, const uint8_t *buf, int len)
     xen_be_send_notify(&con->xendev);
 }
 
+static void xencons_backlog(struct XenConsole *con, bool piling_up)
+{
+    if (piling_up && !con->backlog) {
+        con->backlog = 1;
+        xen_be_printf(&con->xendev, 1, "backlog piling up, nobody listening?\n");
+    } else if (!piling_up && con->backlog) {
+        con->backlog = 0;
+        xen_be_printf(&con->xendev, 1, "backlog is gone\n");
+    }
+}
+
+/*
+ * Write what the guest put in the ring straight to the chardev, both
+ * halves of a wrapped ring in one go.  Only what the chardev does not
+ * take, or everything while it is pushing back, goes to con->buffer.
+ */
+static void xencons_send_ring(struct XenConsole *con)
+{
+    struct xencons_interface *intf = con->sring;
+    XENCONS_RING_IDX cons, prod, size, start;
+    struct iovec iov[2];
+    ssize_t len;
+
+    if (con->chr && !qemu_chr_fe_can_write(con->chr)) {
+        buffer_append(con);
+        return;
+    }
+
+    cons = intf->out_cons;
+    prod = intf->out_prod;
+    xen_mb();
+
+    size = prod - cons;
+    if ((size == 0) || (size > sizeof(intf->out)))
+        return;
+
+    if (con->chr) {
+        start = MASK_XENCONS_IDX(cons, intf->out);
+        iov[0].iov_base = &intf->out[start];
+        iov[0].iov_len = MIN(size, sizeof(intf->out) - start);
+        iov[1].iov_base = intf->out;
+        iov[1].iov_len = size - iov[0].iov_len;
+        len = qemu_chr_fe_writev(con->chr, iov, iov[1].iov_len ? 2 : 1);
+        if (len < 0) {
+            len = 0;
+        }
+    } else {
+        len = size;
+    }
+
+    xen_mb();
+    intf->out_cons = cons + len;
+    if (len < size) {
+        xencons_backlog(con, true);
+        buffer_append(con);
+    } else {
+        xen_be_send_notify(&con->xendev);
+    }
+}
+
 static void xencons_send(struct XenConsole *con)
 {
     ssize_t len, size;
@@ -160,21 +221,45 @@ static void xencons_send(struct XenConsole *con)
     else
         len = size;
     if (len < 1) {
-	if (!con->backlog) {
-	    con->backlog = 1;
-	    xen_be_printf(&con->xendev, 1, "backlog piling up, nobody listening?\n");
-	}
+        xencons_backlog(con, true);
     } else {
-	buffer_advance(&con->buffer, len);
-	if (con->backlog && len == size) {
-	    con->backlog = 0;
-	    xen_be_printf(&con->xendev, 1, "backlog is gone\n");
-	}
+        buffer_advance(&con->buffer, len);
+        if (len == size) {
+            xencons_backlog(con, false);
+        }
     }
 }
 
 /* -------------------------------------------------------------------- */
 
+static void con_event(struct XenDevice *xendev)
+{
+    struct XenConsole *con = container_of(xendev, struct XenConsole, xendev);
+
+    /* Older output goes first; only once it is gone may the ring bypass
+       the buffer */
+    if (con->buffer.size - con->buffer.consumed) {
+        if (!con->chr || qemu_chr_fe_can_write(con->chr)) {
+            xencons_send(con);
+        }
+    }
+    if (con->buffer.size - con->buffer.consumed) {
+        buffer_append(con);
+    } else if (con->sring) {
+        xencons_send_ring(con);
+    }
+}
+
+static void xencons_chr_writable(Notifier *notifier, void *data)
+{
+    struct XenConsole *con = container_of(notifier, struct XenConsole,
+                                          chr_writable);
+
+    if (con->sring) {
+        con_event(&con->xendev);
+    }
+}
+
 static int con_init(struct XenDevice *xendev)
 {
     struct XenConsole *con = container_of(xendev, struct XenConsole, xendev);
@@ -241,9 +326,14 @@ static int con_initialise(struct XenDevice *xendev)
 	return -1;
 
     xen_be_bind_evtchn(&con->xendev);
-    if (con->chr)
+    if (con->chr) {
         qemu_chr_add_handlers(con->chr, xencons_can_receive, xencons_receive,
                               NULL, con);
+        if (!con->chr_writable.notify) {
+            con->chr_writable.notify = xencons_chr_writable;
+            qemu_chr_fe_add_write_notifier(con->chr, &con->chr_writable);
+        }
+    }
 
     xen_be_printf(xendev, 1, "ring mfn %d, remote port %d, local port %d, limit %zd\n",
 		  con->ring_ref,
@@ -260,8 +350,13 @@ static void con_disconnect(struct XenDevice *xendev)
     if (!xendev->dev) {
         return;
     }
-    if (con->chr)
+    if (con->chr) {
         qemu_chr_add_handlers(con->chr, NULL, NULL, NULL, NULL);
+        if (con->chr_writable.notify) {
+            notifier_remove(&con->chr_writable);
+            con->chr_writable.notify = NULL;
+        }
+    }
     xen_be_unbind_evtchn(&con->xendev);
 
     if (con->sring) {
@@ -274,15 +369,6 @@ static void con_disconnect(struct XenDevice *xendev)
     }
 }
 
-static void con_event(struct XenDevice *xendev)
-{
-    struct XenConsole *con = container_of(xendev, struct XenConsole, xendev);
-
-    buffer_append(con);
-    if (con->buffer.size - con->buffer.consumed)
-	xencons_send(con);
-}
-
 /* -------------------------------------------------------------------- */
 
 struct XenDevOps xen_console_ops = {
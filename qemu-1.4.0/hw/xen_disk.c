@@ -39,13 +39,26 @@
 #include "xen_backend.h"
 #include "xen_blkif.h"
 #include "sysemu/blockdev.h"
+#include "qemu/timer.h"
 
 /* ------------------------------------------------------------- */
 
 static int batch_maps   = 0;
 
+/* requests per ring page */
 static int max_requests = 32;
 
+/* default number of responses a deferred notification may cover */
+#define NOTIFY_HOLDOFF_COUNT 16
+
+/* default upper bound for merged submissions, "max-merge-size" overrides */
+#define MAX_MERGE_SIZE      (256 * 1024)
+
+/* multi-page rings and multiple queues, as negotiated with blkfront */
+#define MAX_RING_PAGE_ORDER 4
+#define MAX_RING_PAGES      (1 << MAX_RING_PAGE_ORDER)
+#define MAX_QUEUES          4
+
 /* ------------------------------------------------------------- */
 
 #define BLOCK_SIZE  512
@@ -77,15 +90,63 @@ struct ioreq {
     void                *pages;
     int                 num_unmap;
 
+    /* grant copy: bounce buffer, kept across reuse of the ioreq */
+    uint8_t             *buf;
+
     /* aio status */
     int                 aio_inflight;
     int                 aio_errors;
+    int64_t             start_ns;   /* taken off the ring, rt_clock */
+
+    /* merged submission: members chained from the head, head owns merged */
+    struct ioreq        *merge_next;
+    QEMUIOVector        merged;
 
     struct XenBlkDev    *blkdev;
+    struct XenBlkQueue  *queue;
     QLIST_ENTRY(ioreq)   list;
     BlockAcctCookie     acct;
 };
 
+struct XenBlkQueue {
+    struct XenBlkDev    *blkdev;
+    unsigned int        id;
+    int                 ring_ref[MAX_RING_PAGES];
+    void                *sring;
+    blkif_back_rings_t  rings;
+    int                 more_work;
+    int                 max_requests;
+
+    /* event channel, queue 0 uses the one of the xendev */
+    XenEvtchn           evtchndev;
+    int                 remote_port;
+    int                 local_port;
+
+    /* request lists */
+    QLIST_HEAD(inflight_head, ioreq) inflight;
+    QLIST_HEAD(finished_head, ioreq) finished;
+    QLIST_HEAD(freelist_head, ioreq) freelist;
+    int                 requests_total;
+    int                 requests_inflight;
+    int                 requests_finished;
+
+    /* requests collected in one ring sweep, for batched grant copies */
+    struct ioreq        **batch;
+
+    /* deferred frontend notification */
+    QEMUTimer           *notify_timer;
+    bool                notify_owed;
+    int                 notify_pending;
+
+    /* contiguous requests waiting to be submitted as one */
+    struct ioreq        *merge_head;
+    struct ioreq        *merge_tail;
+    size_t              merge_size;
+    int                 merge_niov;
+
+    QEMUBH              *bh;
+};
+
 struct XenBlkDev {
     struct XenDevice    xendev;  /* must be first */
     char                *params;
@@ -95,22 +156,35 @@ struct XenBlkDev {
     char                *devtype;
     const char          *fileproto;
     const char          *filename;
-    int                 ring_ref;
-    void                *sring;
     int64_t             file_blk;
     int64_t             file_size;
     int                 protocol;
-    blkif_back_rings_t  rings;
-    int                 more_work;
     int                 cnt_map;
 
-    /* request lists */
-    QLIST_HEAD(inflight_head, ioreq) inflight;
-    QLIST_HEAD(finished_head, ioreq) finished;
-    QLIST_HEAD(freelist_head, ioreq) freelist;
-    int                 requests_total;
-    int                 requests_inflight;
-    int                 requests_finished;
+    /* rings */
+    unsigned int        nr_ring_pages;
+    unsigned int        nr_queues;
+    struct XenBlkQueue  queues[MAX_QUEUES];
+
+    /* Grant copy data path instead of grant mapping */
+    gboolean            feature_grant_copy;
+
+    /* completion notification holdoff, 0 us disables */
+    int                 notify_holdoff_us;
+    int                 notify_holdoff_count;
+
+    /* request merging, 0 disables */
+    int                 max_merge_size;
+    uint64_t            merged_requests;
+    uint64_t            merged_submits;
+
+    /* grant map vs. grant copy cost */
+    uint64_t            map_calls;
+    uint64_t            map_pages;
+    int64_t             map_ns;
+    uint64_t            copy_calls;
+    uint64_t            copy_segs;
+    int64_t             copy_ns;
 
     /* Persistent grants extension */
     gboolean            feature_persistent;
@@ -121,7 +195,6 @@ struct XenBlkDev {
     /* qemu block driver */
     DriveInfo           *dinfo;
     BlockDriverState    *bs;
-    QEMUBH              *bh;
 };
 
 /* ------------------------------------------------------------- */
@@ -143,12 +216,15 @@ static void ioreq_reset(struct ioreq *ioreq)
 
     ioreq->aio_inflight = 0;
     ioreq->aio_errors = 0;
+    ioreq->merge_next = NULL;
 
     ioreq->blkdev = NULL;
+    ioreq->queue = NULL;
     memset(&ioreq->list, 0, sizeof(ioreq->list));
     memset(&ioreq->acct, 0, sizeof(ioreq->acct));
 
     qemu_iovec_reset(&ioreq->v);
+    qemu_iovec_reset(&ioreq->merged);
 }
 
 static gint int_cmp(gconstpointer a, gconstpointer b, gpointer user_data)
@@ -169,31 +245,40 @@ static void destroy_grant(gpointer pgnt)
                       strerror(errno));
     }
     grant->blkdev->persistent_gnt_count--;
+    grant->blkdev->xendev.io_stats.grant_unmaps++;
     xen_be_printf(&grant->blkdev->xendev, 3,
                   "unmapped grant %p\n", grant->page);
     g_free(grant);
 }
 
-static struct ioreq *ioreq_start(struct XenBlkDev *blkdev)
+static struct ioreq *ioreq_start(struct XenBlkQueue *queue)
 {
     struct ioreq *ioreq = NULL;
 
-    if (QLIST_EMPTY(&blkdev->freelist)) {
-        if (blkdev->requests_total >= max_requests) {
+    if (QLIST_EMPTY(&queue->freelist)) {
+        if (queue->requests_total >= queue->max_requests) {
             goto out;
         }
         /* allocate new struct */
         ioreq = g_malloc0(sizeof(*ioreq));
-        ioreq->blkdev = blkdev;
-        blkdev->requests_total++;
+        ioreq->blkdev = queue->blkdev;
+        ioreq->queue = queue;
+        if (queue->blkdev->feature_grant_copy) {
+            ioreq->buf = qemu_memalign(XC_PAGE_SIZE, XC_PAGE_SIZE *
+                                       BLKIF_MAX_SEGMENTS_PER_REQUEST);
+        }
+        queue->requests_total++;
         qemu_iovec_init(&ioreq->v, BLKIF_MAX_SEGMENTS_PER_REQUEST);
+        qemu_iovec_init(&ioreq->merged, BLKIF_MAX_SEGMENTS_PER_REQUEST);
     } else {
         /* get one from freelist */
-        ioreq = QLIST_FIRST(&blkdev->freelist);
+        ioreq = QLIST_FIRST(&queue->freelist);
         QLIST_REMOVE(ioreq, list);
     }
-    QLIST_INSERT_HEAD(&blkdev->inflight, ioreq, list);
-    blkdev->requests_inflight++;
+    QLIST_INSERT_HEAD(&queue->inflight, ioreq, list);
+    queue->requests_inflight++;
+    ioreq->start_ns = qemu_get_clock_ns(rt_clock);
+    xen_be_io_start(&queue->blkdev->xendev);
 
 out:
     return ioreq;
@@ -201,26 +286,30 @@ out:
 
 static void ioreq_finish(struct ioreq *ioreq)
 {
-    struct XenBlkDev *blkdev = ioreq->blkdev;
+    struct XenBlkQueue *queue = ioreq->queue;
 
     QLIST_REMOVE(ioreq, list);
-    QLIST_INSERT_HEAD(&blkdev->finished, ioreq, list);
-    blkdev->requests_inflight--;
-    blkdev->requests_finished++;
+    QLIST_INSERT_HEAD(&queue->finished, ioreq, list);
+    queue->requests_inflight--;
+    queue->requests_finished++;
 }
 
 static void ioreq_release(struct ioreq *ioreq, bool finish)
 {
     struct XenBlkDev *blkdev = ioreq->blkdev;
+    struct XenBlkQueue *queue = ioreq->queue;
+    uint8_t *buf = ioreq->buf;
 
     QLIST_REMOVE(ioreq, list);
     ioreq_reset(ioreq);
     ioreq->blkdev = blkdev;
-    QLIST_INSERT_HEAD(&blkdev->freelist, ioreq, list);
+    ioreq->queue = queue;
+    ioreq->buf = buf;
+    QLIST_INSERT_HEAD(&queue->freelist, ioreq, list);
     if (finish) {
-        blkdev->requests_finished--;
+        queue->requests_finished--;
     } else {
-        blkdev->requests_inflight--;
+        queue->requests_inflight--;
     }
 }
 
@@ -299,11 +388,13 @@ err:
 static void ioreq_unmap(struct ioreq *ioreq)
 {
     XenGnttab gnt = ioreq->blkdev->xendev.gnttabdev;
+    int64_t start;
     int i;
 
     if (ioreq->num_unmap == 0 || ioreq->mapped == 0) {
         return;
     }
+    start = qemu_get_clock_ns(rt_clock);
     if (batch_maps) {
         if (!ioreq->pages) {
             return;
@@ -313,6 +404,7 @@ static void ioreq_unmap(struct ioreq *ioreq)
                           strerror(errno));
         }
         ioreq->blkdev->cnt_map -= ioreq->num_unmap;
+        ioreq->blkdev->xendev.io_stats.grant_unmaps += ioreq->num_unmap;
         ioreq->pages = NULL;
     } else {
         for (i = 0; i < ioreq->num_unmap; i++) {
@@ -324,10 +416,12 @@ static void ioreq_unmap(struct ioreq *ioreq)
                               strerror(errno));
             }
             ioreq->blkdev->cnt_map--;
+            ioreq->blkdev->xendev.io_stats.grant_unmaps++;
             ioreq->page[i] = NULL;
         }
     }
     ioreq->mapped = 0;
+    ioreq->blkdev->map_ns += qemu_get_clock_ns(rt_clock) - start;
 }
 
 static int ioreq_map(struct ioreq *ioreq)
@@ -338,6 +432,7 @@ static int ioreq_map(struct ioreq *ioreq)
     void *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
     int i, j, new_maps = 0;
     PersistentGrant *grant;
+    int64_t start;
     /* domids and refs variables will contain the information necessary
      * to map the grants that are needed to fulfill this request.
      *
@@ -349,6 +444,17 @@ static int ioreq_map(struct ioreq *ioreq)
     if (ioreq->v.niov == 0 || ioreq->mapped == 1) {
         return 0;
     }
+    if (ioreq->blkdev->feature_grant_copy) {
+        /* data is moved by blk_grant_copy(), point at the bounce buffer */
+        for (i = 0; i < ioreq->v.niov; i++) {
+            ioreq->v.iov[i].iov_base += (uintptr_t)(ioreq->buf +
+                                                    i * XC_PAGE_SIZE);
+        }
+        ioreq->mapped = 1;
+        ioreq->num_unmap = 0;
+        return 0;
+    }
+    start = qemu_get_clock_ns(rt_clock);
     if (ioreq->blkdev->feature_persistent) {
         for (i = 0; i < ioreq->v.niov; i++) {
             grant = g_tree_lookup(ioreq->blkdev->persistent_gnts,
@@ -396,6 +502,7 @@ static int ioreq_map(struct ioreq *ioreq)
             }
         }
         ioreq->blkdev->cnt_map += new_maps;
+        ioreq->blkdev->xendev.io_stats.grant_maps += new_maps;
     } else if (new_maps)  {
         for (i = 0; i < new_maps; i++) {
             ioreq->page[i] = xc_gnttab_map_grant_ref
@@ -408,6 +515,7 @@ static int ioreq_map(struct ioreq *ioreq)
                 return -1;
             }
             ioreq->blkdev->cnt_map++;
+            ioreq->blkdev->xendev.io_stats.grant_maps++;
         }
         for (i = 0, j = 0; i < ioreq->v.niov; i++) {
             if (page[i] == NULL) {
@@ -447,9 +555,91 @@ static int ioreq_map(struct ioreq *ioreq)
     }
     ioreq->mapped = 1;
     ioreq->num_unmap = new_maps;
+    if (new_maps) {
+        ioreq->blkdev->map_calls++;
+        ioreq->blkdev->map_pages += new_maps;
+    }
+    ioreq->blkdev->map_ns += qemu_get_clock_ns(rt_clock) - start;
     return 0;
 }
 
+#ifdef CONFIG_XEN_GRANT_COPY
+/*
+ * Copy the data of @n requests between their bounce buffers and the
+ * granted guest pages with a single hypercall: into the bounce buffers for
+ * writes, out of them for reads.  Requests whose copy fails get
+ * BLKIF_RSP_ERROR as status.
+ */
+static void blk_grant_copy(struct XenBlkQueue *queue, struct ioreq **ioreqs,
+                           int n)
+{
+    struct XenBlkDev *blkdev = queue->blkdev;
+    xc_gnttab_grant_copy_segment_t *segs;
+    int64_t start;
+    int i, j, count = 0, rc;
+
+    for (i = 0; i < n; i++) {
+        count += ioreqs[i]->v.niov;
+    }
+    if (count == 0) {
+        return;
+    }
+    segs = g_new0(xc_gnttab_grant_copy_segment_t, count);
+
+    for (i = 0, count = 0; i < n; i++) {
+        struct ioreq *ioreq = ioreqs[i];
+
+        for (j = 0; j < ioreq->v.niov; j++, count++) {
+            uint16_t offset = ioreq->req.seg[j].first_sect * blkdev->file_blk;
+
+            if (ioreq->req.operation == BLKIF_OP_READ) {
+                segs[count].flags = GNTCOPY_dest_gref;
+                segs[count].dest.foreign.ref = ioreq->refs[j];
+                segs[count].dest.foreign.domid = ioreq->domids[j];
+                segs[count].dest.foreign.offset = offset;
+                segs[count].source.virt = ioreq->v.iov[j].iov_base;
+            } else {
+                segs[count].flags = GNTCOPY_source_gref;
+                segs[count].source.foreign.ref = ioreq->refs[j];
+                segs[count].source.foreign.domid = ioreq->domids[j];
+                segs[count].source.foreign.offset = offset;
+                segs[count].dest.virt = ioreq->v.iov[j].iov_base;
+            }
+            segs[count].len = ioreq->v.iov[j].iov_len;
+        }
+    }
+
+    start = qemu_get_clock_ns(rt_clock);
+    rc = xc_gnttab_grant_copy(blkdev->xendev.gnttabdev, count, segs);
+    blkdev->copy_ns += qemu_get_clock_ns(rt_clock) - start;
+    blkdev->copy_calls++;
+    blkdev->copy_segs += count;
+    blkdev->xendev.io_stats.grant_copies += count;
+
+    if (rc) {
+        xen_be_printf(&blkdev->xendev, 0, "xc_gnttab_grant_copy failed: %s\n",
+                      strerror(errno));
+    }
+    for (i = 0, count = 0; i < n; i++) {
+        struct ioreq *ioreq = ioreqs[i];
+
+        for (j = 0; j < ioreq->v.niov; j++, count++) {
+            if (rc || segs[count].status != GNTST_okay) {
+                ioreq->status = BLKIF_RSP_ERROR;
+            }
+        }
+    }
+
+    g_free(segs);
+}
+#else
+static void blk_grant_copy(struct XenBlkQueue *queue, struct ioreq **ioreqs,
+                           int n)
+{
+    abort();
+}
+#endif
+
 static int ioreq_runio_qemu_aio(struct ioreq *ioreq);
 
 static void qemu_aio_complete(void *opaque, int ret)
@@ -482,7 +672,7 @@ static void qemu_aio_complete(void *opaque, int ret)
     ioreq_unmap(ioreq);
     ioreq_finish(ioreq);
     bdrv_acct_done(ioreq->blkdev->bs, &ioreq->acct);
-    qemu_bh_schedule(ioreq->blkdev->bh);
+    qemu_bh_schedule(ioreq->queue->bh);
 }
 
 static int ioreq_runio_qemu_aio(struct ioreq *ioreq)
@@ -536,11 +726,119 @@ err_no_map:
     return -1;
 }
 
-static int blk_send_response_one(struct ioreq *ioreq)
+/* completion of a merged submission, split back to the member requests */
+static void qemu_aio_complete_merged(void *opaque, int ret)
+{
+    struct ioreq *ioreq = opaque;
+    struct ioreq *next;
+
+    qemu_iovec_reset(&ioreq->merged);
+    for (; ioreq != NULL; ioreq = next) {
+        next = ioreq->merge_next;
+        ioreq->merge_next = NULL;
+        qemu_aio_complete(ioreq, ret);
+    }
+}
+
+static bool ioreq_can_merge(struct XenBlkQueue *queue, struct ioreq *ioreq)
+{
+    struct ioreq *tail = queue->merge_tail;
+
+    if (ioreq->presync || ioreq->postsync || !ioreq->req.nr_segments) {
+        return false;
+    }
+    if (ioreq->req.operation != BLKIF_OP_READ &&
+        ioreq->req.operation != BLKIF_OP_WRITE) {
+        return false;
+    }
+    if (tail == NULL) {
+        return true;
+    }
+    return tail->req.operation == ioreq->req.operation &&
+        tail->start + tail->v.size == ioreq->start &&
+        queue->merge_size + ioreq->v.size <= queue->blkdev->max_merge_size &&
+        queue->merge_niov + ioreq->v.niov <= IOV_MAX;
+}
+
+/* submit the pending merge group, as a single request where possible */
+static void blk_merge_flush(struct XenBlkQueue *queue)
+{
+    struct XenBlkDev *blkdev = queue->blkdev;
+    struct ioreq *head = queue->merge_head;
+    struct ioreq *ioreq, *next;
+
+    queue->merge_head = queue->merge_tail = NULL;
+    queue->merge_size = 0;
+    queue->merge_niov = 0;
+    if (head == NULL) {
+        return;
+    }
+    if (head->merge_next == NULL) {
+        ioreq_runio_qemu_aio(head);
+        return;
+    }
+
+    for (ioreq = head; ioreq != NULL; ioreq = ioreq->merge_next) {
+        if (ioreq_map(ioreq) == -1) {
+            /* submit one by one, the failing request gets its error */
+            for (ioreq = head; ioreq != NULL; ioreq = next) {
+                next = ioreq->merge_next;
+                ioreq->merge_next = NULL;
+                ioreq_runio_qemu_aio(ioreq);
+            }
+            return;
+        }
+    }
+
+    for (ioreq = head; ioreq != NULL; ioreq = ioreq->merge_next) {
+        qemu_iovec_concat(&head->merged, &ioreq->v, 0, ioreq->v.size);
+        bdrv_acct_start(blkdev->bs, &ioreq->acct, ioreq->v.size,
+                        ioreq->req.operation == BLKIF_OP_READ ?
+                        BDRV_ACCT_READ : BDRV_ACCT_WRITE);
+        ioreq->aio_inflight++;
+        blkdev->merged_requests++;
+    }
+    blkdev->merged_submits++;
+
+    if (head->req.operation == BLKIF_OP_READ) {
+        bdrv_aio_readv(blkdev->bs, head->start / BLOCK_SIZE,
+                       &head->merged, head->merged.size / BLOCK_SIZE,
+                       qemu_aio_complete_merged, head);
+    } else {
+        bdrv_aio_writev(blkdev->bs, head->start / BLOCK_SIZE,
+                        &head->merged, head->merged.size / BLOCK_SIZE,
+                        qemu_aio_complete_merged, head);
+    }
+}
+
+/* submit a parsed request, merging it with contiguous predecessors */
+static void blk_submit(struct XenBlkQueue *queue, struct ioreq *ioreq)
+{
+    if (queue->blkdev->max_merge_size <= 0) {
+        ioreq_runio_qemu_aio(ioreq);
+        return;
+    }
+    if (!ioreq_can_merge(queue, ioreq)) {
+        blk_merge_flush(queue);
+        if (!ioreq_can_merge(queue, ioreq)) {
+            ioreq_runio_qemu_aio(ioreq);
+            return;
+        }
+    }
+    if (queue->merge_tail) {
+        queue->merge_tail->merge_next = ioreq;
+    } else {
+        queue->merge_head = ioreq;
+    }
+    queue->merge_tail = ioreq;
+    queue->merge_size += ioreq->v.size;
+    queue->merge_niov += ioreq->v.niov;
+}
+
+/* place a response on the ring, blk_flush_responses() makes it visible */
+static void blk_send_response_one(struct ioreq *ioreq)
 {
-    struct XenBlkDev  *blkdev = ioreq->blkdev;
-    int               send_notify   = 0;
-    int               have_requests = 0;
+    struct XenBlkQueue *queue = ioreq->queue;
     blkif_response_t  resp;
     void              *dst;
 
@@ -548,117 +846,221 @@ static int blk_send_response_one(struct ioreq *ioreq)
     resp.operation = ioreq->req.operation;
     resp.status    = ioreq->status;
 
+    xen_be_io_done(&ioreq->blkdev->xendev,
+                   ioreq->req.operation == BLKIF_OP_READ ?
+                   XEN_IO_READ : XEN_IO_WRITE,
+                   ioreq->v.size, ioreq->status != BLKIF_RSP_OKAY,
+                   ioreq->start_ns);
+
     /* Place on the response ring for the relevant domain. */
-    switch (blkdev->protocol) {
+    switch (ioreq->blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
-        dst = RING_GET_RESPONSE(&blkdev->rings.native, blkdev->rings.native.rsp_prod_pvt);
+        dst = RING_GET_RESPONSE(&queue->rings.native, queue->rings.native.rsp_prod_pvt);
         break;
     case BLKIF_PROTOCOL_X86_32:
-        dst = RING_GET_RESPONSE(&blkdev->rings.x86_32_part,
-                                blkdev->rings.x86_32_part.rsp_prod_pvt);
+        dst = RING_GET_RESPONSE(&queue->rings.x86_32_part,
+                                queue->rings.x86_32_part.rsp_prod_pvt);
         break;
     case BLKIF_PROTOCOL_X86_64:
-        dst = RING_GET_RESPONSE(&blkdev->rings.x86_64_part,
-                                blkdev->rings.x86_64_part.rsp_prod_pvt);
+        dst = RING_GET_RESPONSE(&queue->rings.x86_64_part,
+                                queue->rings.x86_64_part.rsp_prod_pvt);
         break;
     default:
         dst = NULL;
     }
     memcpy(dst, &resp, sizeof(resp));
-    blkdev->rings.common.rsp_prod_pvt++;
+    queue->rings.common.rsp_prod_pvt++;
+}
+
+static int blk_push_responses(struct XenBlkQueue *queue)
+{
+    int send_notify   = 0;
+    int have_requests = 0;
 
-    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&blkdev->rings.common, send_notify);
-    if (blkdev->rings.common.rsp_prod_pvt == blkdev->rings.common.req_cons) {
+    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&queue->rings.common, send_notify);
+    if (queue->rings.common.rsp_prod_pvt == queue->rings.common.req_cons) {
         /*
          * Tail check for pending requests. Allows frontend to avoid
          * notifications if requests are already in flight (lower
          * overheads and promotes batching).
          */
-        RING_FINAL_CHECK_FOR_REQUESTS(&blkdev->rings.common, have_requests);
-    } else if (RING_HAS_UNCONSUMED_REQUESTS(&blkdev->rings.common)) {
+        RING_FINAL_CHECK_FOR_REQUESTS(&queue->rings.common, have_requests);
+    } else if (RING_HAS_UNCONSUMED_REQUESTS(&queue->rings.common)) {
         have_requests = 1;
     }
 
     if (have_requests) {
-        blkdev->more_work++;
+        queue->more_work++;
     }
     return send_notify;
 }
 
+static void blk_send_notify(struct XenBlkQueue *queue)
+{
+    if (queue->id == 0) {
+        xen_be_send_notify(&queue->blkdev->xendev);
+    } else {
+        queue->blkdev->xendev.io_stats.notify_sent++;
+        xc_evtchn_notify(queue->evtchndev, queue->local_port);
+    }
+}
+
+static void blk_notify_timer(void *opaque)
+{
+    struct XenBlkQueue *queue = opaque;
+
+    if (queue->notify_owed) {
+        queue->notify_owed = false;
+        queue->notify_pending = 0;
+        blk_send_notify(queue);
+    }
+}
+
+/*
+ * Push @nr newly placed responses to the frontend.  With a notification
+ * holdoff configured, the event channel kick is deferred until either
+ * notify_holdoff_count responses are owed or notify_holdoff_us passed.
+ * Once nothing is in flight any more we kick right away: no further
+ * completion would come along to share the notification.
+ */
+static void blk_flush_responses(struct XenBlkQueue *queue, int nr)
+{
+    struct XenBlkDev *blkdev = queue->blkdev;
+
+    if (blk_push_responses(queue)) {
+        queue->notify_owed = true;
+    }
+    if (!queue->notify_owed) {
+        return;
+    }
+    queue->notify_pending += nr;
+
+    if (blkdev->notify_holdoff_us <= 0 ||
+        queue->notify_pending >= blkdev->notify_holdoff_count ||
+        queue->requests_inflight == 0) {
+        qemu_del_timer(queue->notify_timer);
+        queue->notify_owed = false;
+        queue->notify_pending = 0;
+        blk_send_notify(queue);
+        return;
+    }
+    if (!qemu_timer_pending(queue->notify_timer)) {
+        qemu_mod_timer(queue->notify_timer, qemu_get_clock_ns(rt_clock) +
+                       (int64_t)blkdev->notify_holdoff_us * SCALE_US);
+    }
+}
+
 /* walk finished list, send outstanding responses, free requests */
-static void blk_send_response_all(struct XenBlkDev *blkdev)
+static void blk_send_response_all(struct XenBlkQueue *queue)
 {
     struct ioreq *ioreq;
-    int send_notify = 0;
+    int nr = 0;
+    int n = 0;
+
+    if (queue->blkdev->feature_grant_copy) {
+        QLIST_FOREACH(ioreq, &queue->finished, list) {
+            if (ioreq->req.operation == BLKIF_OP_READ &&
+                ioreq->status == BLKIF_RSP_OKAY) {
+                queue->batch[n++] = ioreq;
+            }
+        }
+        if (n) {
+            blk_grant_copy(queue, queue->batch, n);
+        }
+    }
 
-    while (!QLIST_EMPTY(&blkdev->finished)) {
-        ioreq = QLIST_FIRST(&blkdev->finished);
-        send_notify += blk_send_response_one(ioreq);
+    while (!QLIST_EMPTY(&queue->finished)) {
+        ioreq = QLIST_FIRST(&queue->finished);
+        blk_send_response_one(ioreq);
         ioreq_release(ioreq, true);
+        nr++;
     }
-    if (send_notify) {
-        xen_be_send_notify(&blkdev->xendev);
+    if (nr) {
+        blk_flush_responses(queue, nr);
     }
 }
 
-static int blk_get_request(struct XenBlkDev *blkdev, struct ioreq *ioreq, RING_IDX rc)
+static int blk_get_request(struct XenBlkQueue *queue, struct ioreq *ioreq, RING_IDX rc)
 {
-    switch (blkdev->protocol) {
+    switch (queue->blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
-        memcpy(&ioreq->req, RING_GET_REQUEST(&blkdev->rings.native, rc),
+        memcpy(&ioreq->req, RING_GET_REQUEST(&queue->rings.native, rc),
                sizeof(ioreq->req));
         break;
     case BLKIF_PROTOCOL_X86_32:
         blkif_get_x86_32_req(&ioreq->req,
-                             RING_GET_REQUEST(&blkdev->rings.x86_32_part, rc));
+                             RING_GET_REQUEST(&queue->rings.x86_32_part, rc));
         break;
     case BLKIF_PROTOCOL_X86_64:
         blkif_get_x86_64_req(&ioreq->req,
-                             RING_GET_REQUEST(&blkdev->rings.x86_64_part, rc));
+                             RING_GET_REQUEST(&queue->rings.x86_64_part, rc));
         break;
     }
     return 0;
 }
 
-static void blk_handle_requests(struct XenBlkDev *blkdev)
+static void blk_handle_requests(struct XenBlkQueue *queue)
 {
     RING_IDX rc, rp;
     struct ioreq *ioreq;
+    int i, n = 0;
 
-    blkdev->more_work = 0;
+    queue->more_work = 0;
 
-    rc = blkdev->rings.common.req_cons;
-    rp = blkdev->rings.common.sring->req_prod;
+    rc = queue->rings.common.req_cons;
+    rp = queue->rings.common.sring->req_prod;
     xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
-    blk_send_response_all(blkdev);
+    blk_send_response_all(queue);
     while (rc != rp) {
         /* pull request from ring */
-        if (RING_REQUEST_CONS_OVERFLOW(&blkdev->rings.common, rc)) {
+        if (RING_REQUEST_CONS_OVERFLOW(&queue->rings.common, rc)) {
             break;
         }
-        ioreq = ioreq_start(blkdev);
+        ioreq = ioreq_start(queue);
         if (ioreq == NULL) {
-            blkdev->more_work++;
+            queue->more_work++;
             break;
         }
-        blk_get_request(blkdev, ioreq, rc);
-        blkdev->rings.common.req_cons = ++rc;
+        blk_get_request(queue, ioreq, rc);
+        queue->rings.common.req_cons = ++rc;
 
         /* parse them */
         if (ioreq_parse(ioreq) != 0) {
-            if (blk_send_response_one(ioreq)) {
-                xen_be_send_notify(&blkdev->xendev);
-            }
+            blk_send_response_one(ioreq);
+            blk_flush_responses(queue, 1);
             ioreq_release(ioreq, false);
             continue;
         }
 
-        ioreq_runio_qemu_aio(ioreq);
+        if (queue->blkdev->feature_grant_copy &&
+            ioreq->req.operation != BLKIF_OP_READ && ioreq->req.nr_segments) {
+            /* data is fetched for the whole sweep at once, below */
+            ioreq_map(ioreq);
+            queue->batch[n++] = ioreq;
+            continue;
+        }
+
+        blk_submit(queue, ioreq);
+    }
+    blk_merge_flush(queue);
+
+    if (n) {
+        blk_grant_copy(queue, queue->batch, n);
+        for (i = 0; i < n; i++) {
+            ioreq = queue->batch[i];
+            if (ioreq->status == BLKIF_RSP_ERROR) {
+                ioreq_finish(ioreq);
+                qemu_bh_schedule(queue->bh);
+                continue;
+            }
+            blk_submit(queue, ioreq);
+        }
+        blk_merge_flush(queue);
     }
 
-    if (blkdev->more_work && blkdev->requests_inflight < max_requests) {
-        qemu_bh_schedule(blkdev->bh);
+    if (queue->more_work && queue->requests_inflight < queue->max_requests) {
+        qemu_bh_schedule(queue->bh);
     }
 }
 
@@ -666,8 +1068,27 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
 
 static void blk_bh(void *opaque)
 {
-    struct XenBlkDev *blkdev = opaque;
-    blk_handle_requests(blkdev);
+    struct XenBlkQueue *queue = opaque;
+    blk_handle_requests(queue);
+}
+
+/* event channels of queues other than the first one */
+static void blk_queue_event(void *opaque)
+{
+    struct XenBlkQueue *queue = opaque;
+    evtchn_port_t port;
+
+    port = xc_evtchn_pending(queue->evtchndev);
+    if (port != queue->local_port) {
+        xen_be_printf(&queue->blkdev->xendev, 0,
+                      "queue %u: xc_evtchn_pending returned %d (expected %d)\n",
+                      queue->id, port, queue->local_port);
+        return;
+    }
+    xc_evtchn_unmask(queue->evtchndev, port);
+    queue->blkdev->xendev.io_stats.notify_received++;
+
+    qemu_bh_schedule(queue->bh);
 }
 
 /*
@@ -682,16 +1103,29 @@ static void blk_bh(void *opaque)
 static void blk_alloc(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
-
-    QLIST_INIT(&blkdev->inflight);
-    QLIST_INIT(&blkdev->finished);
-    QLIST_INIT(&blkdev->freelist);
-    blkdev->bh = qemu_bh_new(blk_bh, blkdev);
+    unsigned int i;
+
+    for (i = 0; i < MAX_QUEUES; i++) {
+        struct XenBlkQueue *queue = &blkdev->queues[i];
+
+        queue->blkdev = blkdev;
+        queue->id = i;
+        queue->evtchndev = XC_HANDLER_INITIAL_VALUE;
+        queue->local_port = -1;
+        QLIST_INIT(&queue->inflight);
+        QLIST_INIT(&queue->finished);
+        QLIST_INIT(&queue->freelist);
+        queue->bh = qemu_bh_new(blk_bh, queue);
+        queue->notify_timer = qemu_new_timer_ns(rt_clock, blk_notify_timer,
+                                                queue);
+    }
     if (xen_mode != XEN_EMULATE) {
         batch_maps = 1;
     }
     if (xc_gnttab_set_max_grants(xendev->gnttabdev,
-            MAX_GRANTS(max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST)) < 0) {
+            MAX_GRANTS(max_requests * MAX_RING_PAGES * MAX_QUEUES,
+                       BLKIF_MAX_SEGMENTS_PER_REQUEST) +
+            MAX_RING_PAGES * MAX_QUEUES) < 0) {
         xen_be_printf(xendev, 0, "xc_gnttab_set_max_grants failed: %s\n",
                       strerror(errno));
     }
@@ -701,6 +1135,9 @@ static int blk_init(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
     int index, qflags, info = 0;
+#ifdef CONFIG_XEN_GRANT_COPY
+    int copy;
+#endif
 
     /* read xenstore entries */
     if (blkdev->params == NULL) {
@@ -792,9 +1229,37 @@ static int blk_init(struct XenDevice *xendev)
                   blkdev->type, blkdev->fileproto, blkdev->filename,
                   blkdev->file_size, blkdev->file_size >> 20);
 
+    /* completion notification holdoff, tunable per device */
+    if (xenstore_read_be_int(&blkdev->xendev, "notify-holdoff-us",
+                             &blkdev->notify_holdoff_us) != 0) {
+        blkdev->notify_holdoff_us = 0;
+    }
+    if (xenstore_read_be_int(&blkdev->xendev, "notify-holdoff-count",
+                             &blkdev->notify_holdoff_count) != 0) {
+        blkdev->notify_holdoff_count = NOTIFY_HOLDOFF_COUNT;
+    }
+
+    /* merging of contiguous requests, tunable per device */
+    if (xenstore_read_be_int(&blkdev->xendev, "max-merge-size",
+                             &blkdev->max_merge_size) != 0) {
+        blkdev->max_merge_size = MAX_MERGE_SIZE;
+    }
+
+#ifdef CONFIG_XEN_GRANT_COPY
+    /* grant copy data path, selected per device by the toolstack */
+    if (xenstore_read_be_int(&blkdev->xendev, "grant-copy", &copy) == 0) {
+        blkdev->feature_grant_copy = !!copy;
+    }
+#endif
+
     /* fill info */
     xenstore_write_be_int(&blkdev->xendev, "feature-flush-cache", 1);
-    xenstore_write_be_int(&blkdev->xendev, "feature-persistent", 1);
+    xenstore_write_be_int(&blkdev->xendev, "feature-persistent",
+                          !blkdev->feature_grant_copy);
+    xenstore_write_be_int(&blkdev->xendev, "max-ring-page-order",
+                          MAX_RING_PAGE_ORDER);
+    xenstore_write_be_int(&blkdev->xendev, "multi-queue-max-queues",
+                          MAX_QUEUES);
     xenstore_write_be_int(&blkdev->xendev, "info",            info);
     xenstore_write_be_int(&blkdev->xendev, "sector-size",     blkdev->file_blk);
     xenstore_write_be_int(&blkdev->xendev, "sectors",
@@ -815,87 +1280,231 @@ out_error:
     return -1;
 }
 
-static int blk_connect(struct XenDevice *xendev)
+/*
+ * Xenstore nodes of a queue live directly in the frontend directory when
+ * a single queue is used, and in "queue-N/" otherwise.
+ */
+static int blk_read_queue_int(struct XenBlkQueue *queue, const char *node,
+                              int *ival)
 {
-    struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
-    int pers;
+    struct XenBlkDev *blkdev = queue->blkdev;
+    char path[32];
 
-    if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref", &blkdev->ring_ref) == -1) {
-        return -1;
-    }
-    if (xenstore_read_fe_int(&blkdev->xendev, "event-channel",
-                             &blkdev->xendev.remote_port) == -1) {
-        return -1;
-    }
-    if (xenstore_read_fe_int(&blkdev->xendev, "feature-persistent", &pers)) {
-        blkdev->feature_persistent = FALSE;
-    } else {
-        blkdev->feature_persistent = !!pers;
+    if (blkdev->nr_queues == 1) {
+        return xenstore_read_fe_int(&blkdev->xendev, node, ival);
     }
+    snprintf(path, sizeof(path), "queue-%u/%s", queue->id, node);
+    return xenstore_read_fe_int(&blkdev->xendev, path, ival);
+}
 
-    blkdev->protocol = BLKIF_PROTOCOL_NATIVE;
-    if (blkdev->xendev.protocol) {
-        if (strcmp(blkdev->xendev.protocol, XEN_IO_PROTO_ABI_X86_32) == 0) {
-            blkdev->protocol = BLKIF_PROTOCOL_X86_32;
+static int blk_connect_queue(struct XenBlkQueue *queue)
+{
+    struct XenBlkDev *blkdev = queue->blkdev;
+    uint32_t domids[MAX_RING_PAGES];
+    uint32_t refs[MAX_RING_PAGES];
+    size_t ring_size = XC_PAGE_SIZE * blkdev->nr_ring_pages;
+    char node[16];
+    unsigned int i;
+
+    if (blkdev->nr_ring_pages == 1) {
+        if (blk_read_queue_int(queue, "ring-ref", &queue->ring_ref[0]) == -1) {
+            return -1;
         }
-        if (strcmp(blkdev->xendev.protocol, XEN_IO_PROTO_ABI_X86_64) == 0) {
-            blkdev->protocol = BLKIF_PROTOCOL_X86_64;
+    } else {
+        for (i = 0; i < blkdev->nr_ring_pages; i++) {
+            snprintf(node, sizeof(node), "ring-ref%u", i);
+            if (blk_read_queue_int(queue, node, &queue->ring_ref[i]) == -1) {
+                return -1;
+            }
         }
     }
+    if (blk_read_queue_int(queue, "event-channel", &queue->remote_port) == -1) {
+        return -1;
+    }
 
-    blkdev->sring = xc_gnttab_map_grant_ref(blkdev->xendev.gnttabdev,
-                                            blkdev->xendev.dom,
-                                            blkdev->ring_ref,
-                                            PROT_READ | PROT_WRITE);
-    if (!blkdev->sring) {
+    for (i = 0; i < blkdev->nr_ring_pages; i++) {
+        domids[i] = blkdev->xendev.dom;
+        refs[i] = queue->ring_ref[i];
+    }
+    if (blkdev->nr_ring_pages == 1) {
+        queue->sring = xc_gnttab_map_grant_ref(blkdev->xendev.gnttabdev,
+                                               domids[0], refs[0],
+                                               PROT_READ | PROT_WRITE);
+    } else {
+        queue->sring = xc_gnttab_map_grant_refs(blkdev->xendev.gnttabdev,
+                                                blkdev->nr_ring_pages,
+                                                domids, refs,
+                                                PROT_READ | PROT_WRITE);
+    }
+    if (!queue->sring) {
         return -1;
     }
-    blkdev->cnt_map++;
+    blkdev->cnt_map += blkdev->nr_ring_pages;
 
     switch (blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
     {
-        blkif_sring_t *sring_native = blkdev->sring;
-        BACK_RING_INIT(&blkdev->rings.native, sring_native, XC_PAGE_SIZE);
+        blkif_sring_t *sring_native = queue->sring;
+        BACK_RING_INIT(&queue->rings.native, sring_native, ring_size);
         break;
     }
     case BLKIF_PROTOCOL_X86_32:
     {
-        blkif_x86_32_sring_t *sring_x86_32 = blkdev->sring;
+        blkif_x86_32_sring_t *sring_x86_32 = queue->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32, XC_PAGE_SIZE);
+        BACK_RING_INIT(&queue->rings.x86_32_part, sring_x86_32, ring_size);
         break;
     }
     case BLKIF_PROTOCOL_X86_64:
     {
-        blkif_x86_64_sring_t *sring_x86_64 = blkdev->sring;
+        blkif_x86_64_sring_t *sring_x86_64 = queue->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64, XC_PAGE_SIZE);
+        BACK_RING_INIT(&queue->rings.x86_64_part, sring_x86_64, ring_size);
         break;
     }
     }
+    queue->max_requests = MIN(queue->rings.common.nr_ents,
+                              max_requests * blkdev->nr_ring_pages);
+    queue->batch = g_new0(struct ioreq *, queue->max_requests);
+
+    if (queue->id == 0) {
+        blkdev->xendev.remote_port = queue->remote_port;
+        if (xen_be_bind_evtchn(&blkdev->xendev) < 0) {
+            return -1;
+        }
+        queue->local_port = blkdev->xendev.local_port;
+    } else {
+        queue->evtchndev = xen_xc_evtchn_open(NULL, 0);
+        if (queue->evtchndev == XC_HANDLER_INITIAL_VALUE) {
+            xen_be_printf(&blkdev->xendev, 0, "queue %u: can't open evtchn\n",
+                          queue->id);
+            return -1;
+        }
+        fcntl(xc_evtchn_fd(queue->evtchndev), F_SETFD, FD_CLOEXEC);
+        queue->local_port = xc_evtchn_bind_interdomain(queue->evtchndev,
+                                                       blkdev->xendev.dom,
+                                                       queue->remote_port);
+        if (queue->local_port == -1) {
+            xen_be_printf(&blkdev->xendev, 0,
+                          "queue %u: xc_evtchn_bind_interdomain failed\n",
+                          queue->id);
+            return -1;
+        }
+        qemu_set_fd_handler(xc_evtchn_fd(queue->evtchndev),
+                            blk_queue_event, NULL, queue);
+    }
+
+    xen_be_printf(&blkdev->xendev, 1, "queue %u: %u ring page(s), ring-ref %d, "
+                  "remote port %d, local port %d\n", queue->id,
+                  blkdev->nr_ring_pages, queue->ring_ref[0],
+                  queue->remote_port, queue->local_port);
+    return 0;
+}
+
+static void blk_disconnect_queue(struct XenBlkQueue *queue)
+{
+    struct XenBlkDev *blkdev = queue->blkdev;
+
+    if (queue->id == 0) {
+        xen_be_unbind_evtchn(&blkdev->xendev);
+    } else if (queue->evtchndev != XC_HANDLER_INITIAL_VALUE) {
+        if (queue->local_port != -1) {
+            qemu_set_fd_handler(xc_evtchn_fd(queue->evtchndev),
+                                NULL, NULL, NULL);
+            xc_evtchn_unbind(queue->evtchndev, queue->local_port);
+        }
+        xc_evtchn_close(queue->evtchndev);
+        queue->evtchndev = XC_HANDLER_INITIAL_VALUE;
+    }
+    queue->local_port = -1;
+
+    qemu_del_timer(queue->notify_timer);
+    queue->notify_owed = false;
+    queue->notify_pending = 0;
+
+    if (queue->sring) {
+        xc_gnttab_munmap(blkdev->xendev.gnttabdev, queue->sring,
+                         blkdev->nr_ring_pages);
+        blkdev->cnt_map -= blkdev->nr_ring_pages;
+        queue->sring = NULL;
+    }
+    g_free(queue->batch);
+    queue->batch = NULL;
+}
+
+static int blk_connect(struct XenDevice *xendev)
+{
+    struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
+    int pers, order, nr_queues;
+    unsigned int i, j;
+
+    if (xenstore_read_fe_int(&blkdev->xendev, "feature-persistent", &pers)) {
+        blkdev->feature_persistent = FALSE;
+    } else {
+        blkdev->feature_persistent = !!pers && !blkdev->feature_grant_copy;
+    }
+
+    if (xenstore_read_fe_int(&blkdev->xendev, "ring-page-order", &order)) {
+        order = 0;
+    }
+    if (order < 0 || order > MAX_RING_PAGE_ORDER) {
+        xen_be_printf(&blkdev->xendev, 0, "invalid ring-page-order %d\n", order);
+        return -1;
+    }
+    blkdev->nr_ring_pages = 1 << order;
+
+    if (xenstore_read_fe_int(&blkdev->xendev, "multi-queue-num-queues",
+                             &nr_queues)) {
+        nr_queues = 1;
+    }
+    if (nr_queues < 1 || nr_queues > MAX_QUEUES) {
+        xen_be_printf(&blkdev->xendev, 0, "invalid multi-queue-num-queues %d\n",
+                      nr_queues);
+        return -1;
+    }
+    blkdev->nr_queues = nr_queues;
+
+    blkdev->protocol = BLKIF_PROTOCOL_NATIVE;
+    if (blkdev->xendev.protocol) {
+        if (strcmp(blkdev->xendev.protocol, XEN_IO_PROTO_ABI_X86_32) == 0) {
+            blkdev->protocol = BLKIF_PROTOCOL_X86_32;
+        }
+        if (strcmp(blkdev->xendev.protocol, XEN_IO_PROTO_ABI_X86_64) == 0) {
+            blkdev->protocol = BLKIF_PROTOCOL_X86_64;
+        }
+    }
+
+    for (i = 0; i < blkdev->nr_queues; i++) {
+        if (blk_connect_queue(&blkdev->queues[i]) < 0) {
+            for (j = 0; j <= i; j++) {
+                blk_disconnect_queue(&blkdev->queues[j]);
+            }
+            return -1;
+        }
+    }
 
     if (blkdev->feature_persistent) {
         /* Init persistent grants */
-        blkdev->max_grants = max_requests * BLKIF_MAX_SEGMENTS_PER_REQUEST;
+        blkdev->max_grants = 0;
+        for (i = 0; i < blkdev->nr_queues; i++) {
+            blkdev->max_grants += blkdev->queues[i].max_requests *
+                                  BLKIF_MAX_SEGMENTS_PER_REQUEST;
+        }
         blkdev->persistent_gnts = g_tree_new_full((GCompareDataFunc)int_cmp,
                                              NULL, NULL,
                                              (GDestroyNotify)destroy_grant);
         blkdev->persistent_gnt_count = 0;
     }
 
-    xen_be_bind_evtchn(&blkdev->xendev);
-
-    xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, ring-ref %d, "
-                  "remote port %d, local port %d\n",
-                  blkdev->xendev.protocol, blkdev->ring_ref,
-                  blkdev->xendev.remote_port, blkdev->xendev.local_port);
+    xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, %u queue(s)\n",
+                  blkdev->xendev.protocol, blkdev->nr_queues);
     return 0;
 }
 
 static void blk_disconnect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
+    unsigned int i;
 
     if (blkdev->bs) {
         if (!blkdev->dinfo) {
@@ -906,21 +1515,29 @@ static void blk_disconnect(struct XenDevice *xendev)
         }
         blkdev->bs = NULL;
     }
-    xen_be_unbind_evtchn(&blkdev->xendev);
 
-    if (blkdev->sring) {
-        xc_gnttab_munmap(blkdev->xendev.gnttabdev, blkdev->sring, 1);
-        blkdev->cnt_map--;
-        blkdev->sring = NULL;
+    for (i = 0; i < MAX_QUEUES; i++) {
+        blk_disconnect_queue(&blkdev->queues[i]);
     }
+
+    xen_be_printf(&blkdev->xendev, 1, "grant map: %" PRIu64 " pages in %"
+                  PRIu64 " calls, %" PRId64 " us; grant copy: %" PRIu64
+                  " segments in %" PRIu64 " calls, %" PRId64 " us\n",
+                  blkdev->map_pages, blkdev->map_calls, blkdev->map_ns / 1000,
+                  blkdev->copy_segs, blkdev->copy_calls,
+                  blkdev->copy_ns / 1000);
+    xen_be_printf(&blkdev->xendev, 1, "merging: %" PRIu64 " requests in %"
+                  PRIu64 " submissions\n",
+                  blkdev->merged_requests, blkdev->merged_submits);
 }
 
 static int blk_free(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
     struct ioreq *ioreq;
+    unsigned int i;
 
-    if (blkdev->bs || blkdev->sring) {
+    if (blkdev->bs || blkdev->queues[0].sring) {
         blk_disconnect(xendev);
     }
 
@@ -929,11 +1546,19 @@ static int blk_free(struct XenDevice *xendev)
         g_tree_destroy(blkdev->persistent_gnts);
     }
 
-    while (!QLIST_EMPTY(&blkdev->freelist)) {
-        ioreq = QLIST_FIRST(&blkdev->freelist);
-        QLIST_REMOVE(ioreq, list);
-        qemu_iovec_destroy(&ioreq->v);
-        g_free(ioreq);
+    for (i = 0; i < MAX_QUEUES; i++) {
+        struct XenBlkQueue *queue = &blkdev->queues[i];
+
+        while (!QLIST_EMPTY(&queue->freelist)) {
+            ioreq = QLIST_FIRST(&queue->freelist);
+            QLIST_REMOVE(ioreq, list);
+            qemu_iovec_destroy(&ioreq->v);
+            qemu_iovec_destroy(&ioreq->merged);
+            qemu_vfree(ioreq->buf);
+            g_free(ioreq);
+        }
+        qemu_bh_delete(queue->bh);
+        qemu_free_timer(queue->notify_timer);
     }
 
     g_free(blkdev->params);
@@ -941,7 +1566,6 @@ static int blk_free(struct XenDevice *xendev)
     g_free(blkdev->type);
     g_free(blkdev->dev);
     g_free(blkdev->devtype);
-    qemu_bh_delete(blkdev->bh);
     return 0;
 }
 
@@ -949,7 +1573,7 @@ static void blk_event(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
 
-    qemu_bh_schedule(blkdev->bh);
+    qemu_bh_schedule(blkdev->queues[0].bh);
 }
 
 struct XenDevOps xen_blkdev_ops = {
@@ -36,18 +36,43 @@
 #include <sys/wait.h>
 
 #include "hw.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 #include "net/checksum.h"
 #include "net/util.h"
+#include "net/tap.h"
 #include "xen_backend.h"
 
 #include <xen/io/netif.h>
 
+
 /* ------------------------------------------------------------- */
 
-struct XenNetDev {
-    struct XenDevice      xendev;  /* must be first */
-    char                  *mac;
+/* tx/rx queue pairs offered to the frontend */
+#define MAX_QUEUES      4
+
+/* ring slots a single packet may span: 64k of data plus the header page */
+#define MAX_TX_SLOTS    18
+#define MAX_RX_SLOTS    (MAX_TX_SLOTS + 1)  /* + gso extra info */
+
+#define MAX_PACKET_SIZE (MAX_TX_SLOTS * XC_PAGE_SIZE)
+
+/* rx slots gathered for one batched grant copy, at least MAX_RX_SLOTS */
+#define RX_BATCH_SLOTS  64
+
+/* an rx response waiting for the batched copy of its data */
+struct XenNetRxSlot {
+    netif_rx_request_t    req;
+    uint16_t              offset;
+    uint16_t              size;
+    uint16_t              flags;
+    uint16_t              gso_size;  /* extra info slot if non-zero */
+};
+
+struct XenNetQueue {
+    struct XenNetDev      *netdev;
+    unsigned int          id;
+    NetClientState        *nc;
     int                   tx_work;
     int                   tx_ring_ref;
     int                   rx_ring_ref;
@@ -55,165 +80,384 @@ struct XenNetDev {
     struct netif_rx_sring *rxs;
     netif_tx_back_ring_t  tx_ring;
     netif_rx_back_ring_t  rx_ring;
+
+    /* event channel, queue 0 uses the one of the xendev */
+    XenEvtchn             evtchndev;
+    int                   remote_port;
+    int                   local_port;
+
+#ifdef CONFIG_XEN_GRANT_COPY
+    /* rx batch, copied into the guest and pushed from rx_bh */
+    struct XenNetRxSlot   rx_slots[RX_BATCH_SLOTS];
+    xc_gnttab_grant_copy_segment_t rx_segs[RX_BATCH_SLOTS];
+    int                   rx_nr_slots;
+    int                   rx_nr_segs;
+    uint8_t               *rx_buf;
+    QEMUBH                *rx_bh;
+#endif
+};
+
+struct XenNetDev {
+    struct XenDevice      xendev;  /* must be first */
+    char                  *mac;
+    unsigned int          max_queues;
+    unsigned int          nr_queues;
+    struct XenNetQueue    queues[MAX_QUEUES];
+
+    /* peer exchanges packets with a virtio_net_hdr (tap with vnet_hdr) */
+    bool                  has_vnet_hdr;
+
+    /* rx data is grant copied in batches instead of mapped */
+    bool                  rx_grant_copy;
+
+    /* frontend rx capabilities */
+    bool                  rx_sg;
+    bool                  rx_gso;
+    bool                  rx_csum;
+
+    uint8_t               *tmpbuf;
     NICConf               conf;
     NICState              *nic;
 };
 
 /* ------------------------------------------------------------- */
 
-static void net_tx_response(struct XenNetDev *netdev, netif_tx_request_t *txp, int8_t st)
+static void net_send_notify(struct XenNetQueue *queue)
+{
+    if (queue->id == 0) {
+        xen_be_send_notify(&queue->netdev->xendev);
+    } else {
+        queue->netdev->xendev.io_stats.notify_sent++;
+        xc_evtchn_notify(queue->evtchndev, queue->local_port);
+    }
+}
+
+/*
+ * Locate the transport header of an ethernet frame, for checksum and
+ * segmentation offload.  Returns its offset, or -1 for frames we can't
+ * handle.
+ */
+static int net_l4_offset(const uint8_t *pkt, size_t len, uint8_t *proto)
+{
+    size_t l3 = 14;
+    uint16_t type;
+
+    if (len < l3) {
+        return -1;
+    }
+    type = (pkt[12] << 8) | pkt[13];
+    if (type == 0x8100) {
+        if (len < 18) {
+            return -1;
+        }
+        type = (pkt[16] << 8) | pkt[17];
+        l3 = 18;
+    }
+
+    switch (type) {
+    case 0x0800:
+        if (len < l3 + 20) {
+            return -1;
+        }
+        *proto = pkt[l3 + 9];
+        return l3 + (pkt[l3] & 0x0f) * 4;
+    case 0x86dd:
+        /* no extension headers */
+        if (len < l3 + 40) {
+            return -1;
+        }
+        *proto = pkt[l3 + 6];
+        return l3 + 40;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Fill in the offload part of a virtio_net_hdr for a tx packet, the
+ * protocol headers must be in @pkt.
+ */
+static int net_tx_fill_vnet_hdr(struct virtio_net_hdr *hdr, uint16_t flags,
+                                netif_extra_info_t *gso,
+                                const uint8_t *pkt, size_t len)
+{
+    uint8_t proto;
+    int l4;
+
+    memset(hdr, 0, sizeof(*hdr));
+    if (flags & NETTXF_data_validated) {
+        hdr->flags |= VIRTIO_NET_HDR_F_DATA_VALID;
+    }
+    if (!(flags & NETTXF_csum_blank) && !gso) {
+        return 0;
+    }
+
+    l4 = net_l4_offset(pkt, len, &proto);
+    if (l4 < 0) {
+        return -1;
+    }
+    switch (proto) {
+    case 6: /* tcp */
+        if (len < l4 + 20) {
+            return -1;
+        }
+        hdr->csum_offset = 16;
+        break;
+    case 17: /* udp */
+        if (gso) {
+            return -1;
+        }
+        hdr->csum_offset = 6;
+        break;
+    default:
+        return -1;
+    }
+    hdr->flags |= VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = l4;
+
+    if (gso) {
+        if (gso->u.gso.type != XEN_NETIF_GSO_TYPE_TCPV4) {
+            return -1;
+        }
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = gso->u.gso.size;
+        hdr->hdr_len = l4 + (pkt[l4 + 12] >> 4) * 4;
+    }
+    return 0;
+}
+
+static void net_tx_response(struct XenNetQueue *queue, netif_tx_request_t *txp,
+                            int nr_extras, int8_t st)
 {
-    RING_IDX i = netdev->tx_ring.rsp_prod_pvt;
+    RING_IDX i = queue->tx_ring.rsp_prod_pvt;
     netif_tx_response_t *resp;
     int notify;
 
-    resp = RING_GET_RESPONSE(&netdev->tx_ring, i);
+    resp = RING_GET_RESPONSE(&queue->tx_ring, i);
     resp->id     = txp->id;
     resp->status = st;
 
-#if 0
-    if (txp->flags & NETTXF_extra_info) {
-        RING_GET_RESPONSE(&netdev->tx_ring, ++i)->status = NETIF_RSP_NULL;
+    /* extra info slots get a null response each */
+    while (nr_extras-- > 0) {
+        RING_GET_RESPONSE(&queue->tx_ring, ++i)->status = NETIF_RSP_NULL;
     }
-#endif
 
-    netdev->tx_ring.rsp_prod_pvt = ++i;
-    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&netdev->tx_ring, notify);
+    queue->tx_ring.rsp_prod_pvt = ++i;
+    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&queue->tx_ring, notify);
     if (notify) {
-        xen_be_send_notify(&netdev->xendev);
+        net_send_notify(queue);
     }
 
-    if (i == netdev->tx_ring.req_cons) {
+    if (i == queue->tx_ring.req_cons) {
         int more_to_do;
-        RING_FINAL_CHECK_FOR_REQUESTS(&netdev->tx_ring, more_to_do);
+        RING_FINAL_CHECK_FOR_REQUESTS(&queue->tx_ring, more_to_do);
         if (more_to_do) {
-            netdev->tx_work++;
+            queue->tx_work++;
         }
     }
 }
 
-static void net_tx_error(struct XenNetDev *netdev, netif_tx_request_t *txp, RING_IDX end)
+static void net_tx_error(struct XenNetQueue *queue, netif_tx_request_t *txreqs,
+                         int nr_slots, int nr_extras)
 {
-#if 0
-    /*
-     * Hmm, why netback fails everything in the ring?
-     * Should we do that even when not supporting SG and TSO?
-     */
-    RING_IDX cons = netdev->tx_ring.req_cons;
-
-    do {
-        make_tx_response(netif, txp, NETIF_RSP_ERROR);
-        if (cons >= end) {
-            break;
-        }
-        txp = RING_GET_REQUEST(&netdev->tx_ring, cons++);
-    } while (1);
-    netdev->tx_ring.req_cons = cons;
-    netif_schedule_work(netif);
-    netif_put(netif);
-#else
-    net_tx_response(netdev, txp, NETIF_RSP_ERROR);
-#endif
+    int i;
+
+    /* every slot of the packet gets an error response */
+    for (i = 0; i < nr_slots; i++) {
+        net_tx_response(queue, &txreqs[i], i ? 0 : nr_extras, NETIF_RSP_ERROR);
+    }
 }
 
-static void net_tx_packets(struct XenNetDev *netdev)
+static void net_tx_packets(struct XenNetQueue *queue)
 {
-    netif_tx_request_t txreq;
+    struct XenNetDev *netdev = queue->netdev;
+    netif_tx_request_t txreqs[MAX_TX_SLOTS];
+    netif_extra_info_t extra, *gso;
+    uint32_t domids[MAX_TX_SLOTS];
+    uint32_t refs[MAX_TX_SLOTS];
+    struct iovec iov[MAX_TX_SLOTS + 1];
+    struct virtio_net_hdr hdr;
     RING_IDX rc, rp;
-    void *page;
-    void *tmpbuf = NULL;
+    int i, n, nr_extras, niov, size, first_size, err;
+    uint8_t *pages;
 
     for (;;) {
-        rc = netdev->tx_ring.req_cons;
-        rp = netdev->tx_ring.sring->req_prod;
+        rc = queue->tx_ring.req_cons;
+        rp = queue->tx_ring.sring->req_prod;
         xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
         while ((rc != rp)) {
-            if (RING_REQUEST_CONS_OVERFLOW(&netdev->tx_ring, rc)) {
+            if (RING_REQUEST_CONS_OVERFLOW(&queue->tx_ring, rc)) {
                 break;
             }
-            memcpy(&txreq, RING_GET_REQUEST(&netdev->tx_ring, rc), sizeof(txreq));
-            netdev->tx_ring.req_cons = ++rc;
-
-#if 1
-            /* should not happen in theory, we don't announce the *
-             * feature-{sg,gso,whatelse} flags in xenstore (yet?) */
-            if (txreq.flags & NETTXF_extra_info) {
-                xen_be_printf(&netdev->xendev, 0, "FIXME: extra info flag\n");
-                net_tx_error(netdev, &txreq, rc);
-                continue;
+            memcpy(&txreqs[0], RING_GET_REQUEST(&queue->tx_ring, rc),
+                   sizeof(txreqs[0]));
+            queue->tx_ring.req_cons = ++rc;
+            n = 1;
+            nr_extras = 0;
+            gso = NULL;
+            err = 0;
+
+            /* extra info slots follow the first request */
+            if (txreqs[0].flags & NETTXF_extra_info) {
+                do {
+                    if (rc == rp) {
+                        err = 1;
+                        break;
+                    }
+                    memcpy(&extra, RING_GET_REQUEST(&queue->tx_ring, rc),
+                           sizeof(extra));
+                    queue->tx_ring.req_cons = ++rc;
+                    nr_extras++;
+                    if (extra.type == XEN_NETIF_EXTRA_TYPE_GSO) {
+                        gso = &extra;
+                    }
+                } while (extra.flags & XEN_NETIF_EXTRA_FLAG_MORE);
+                if (nr_extras > 1) {
+                    /* only the gso extra is supported */
+                    err = 1;
+                }
             }
-            if (txreq.flags & NETTXF_more_data) {
-                xen_be_printf(&netdev->xendev, 0, "FIXME: more data flag\n");
-                net_tx_error(netdev, &txreq, rc);
+
+            /* scatter-gather: further slots of the same packet */
+            while (!err && (txreqs[n - 1].flags & NETTXF_more_data)) {
+                if (rc == rp || n == MAX_TX_SLOTS) {
+                    err = 1;
+                    break;
+                }
+                memcpy(&txreqs[n], RING_GET_REQUEST(&queue->tx_ring, rc),
+                       sizeof(txreqs[n]));
+                queue->tx_ring.req_cons = ++rc;
+                n++;
+            }
+            if (err) {
+                xen_be_printf(&netdev->xendev, 0, "malformed tx packet "
+                              "(%d slots, %d extras)\n", n, nr_extras);
+                net_tx_error(queue, txreqs, n, nr_extras);
                 continue;
             }
-#endif
 
-            if (txreq.size < 14) {
-                xen_be_printf(&netdev->xendev, 0, "bad packet size: %d\n", txreq.size);
-                net_tx_error(netdev, &txreq, rc);
+            /* the first slot carries the size of the whole packet */
+            size = txreqs[0].size;
+            first_size = size;
+            for (i = 1; i < n; i++) {
+                first_size -= txreqs[i].size;
+            }
+            if (size < 14 || first_size <= 0) {
+                xen_be_printf(&netdev->xendev, 0, "bad packet size: %d\n",
+                              size);
+                net_tx_error(queue, txreqs, n, nr_extras);
                 continue;
             }
+            for (i = 0; i < n; i++) {
+                int len = i ? txreqs[i].size : first_size;
 
-            if ((txreq.offset + txreq.size) > XC_PAGE_SIZE) {
+                if (txreqs[i].offset + len > XC_PAGE_SIZE) {
+                    break;
+                }
+            }
+            if (i < n) {
                 xen_be_printf(&netdev->xendev, 0, "error: page crossing\n");
-                net_tx_error(netdev, &txreq, rc);
+                net_tx_error(queue, txreqs, n, nr_extras);
                 continue;
             }
 
-            xen_be_printf(&netdev->xendev, 3, "tx packet ref %d, off %d, len %d, flags 0x%x%s%s%s%s\n",
-                          txreq.gref, txreq.offset, txreq.size, txreq.flags,
-                          (txreq.flags & NETTXF_csum_blank)     ? " csum_blank"     : "",
-                          (txreq.flags & NETTXF_data_validated) ? " data_validated" : "",
-                          (txreq.flags & NETTXF_more_data)      ? " more_data"      : "",
-                          (txreq.flags & NETTXF_extra_info)     ? " extra_info"     : "");
-
-            page = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                           netdev->xendev.dom,
-                                           txreq.gref, PROT_READ);
-            if (page == NULL) {
+            xen_be_printf(&netdev->xendev, 3, "tx packet ref %d, off %d, len %d, slots %d, flags 0x%x%s%s%s%s\n",
+                          txreqs[0].gref, txreqs[0].offset, size, n,
+                          txreqs[0].flags,
+                          (txreqs[0].flags & NETTXF_csum_blank)     ? " csum_blank"     : "",
+                          (txreqs[0].flags & NETTXF_data_validated) ? " data_validated" : "",
+                          (txreqs[0].flags & NETTXF_more_data)      ? " more_data"      : "",
+                          (txreqs[0].flags & NETTXF_extra_info)     ? " extra_info"     : "");
+
+            for (i = 0; i < n; i++) {
+                domids[i] = netdev->xendev.dom;
+                refs[i] = txreqs[i].gref;
+            }
+            pages = xc_gnttab_map_grant_refs(netdev->xendev.gnttabdev, n,
+                                             domids, refs, PROT_READ);
+            if (pages == NULL) {
                 xen_be_printf(&netdev->xendev, 0, "error: tx gref dereference failed (%d)\n",
-                              txreq.gref);
-                net_tx_error(netdev, &txreq, rc);
+                              txreqs[0].gref);
+                net_tx_error(queue, txreqs, n, nr_extras);
                 continue;
             }
-            if (txreq.flags & NETTXF_csum_blank) {
-                /* have read-only mapping -> can't fill checksum in-place */
-                if (!tmpbuf) {
-                    tmpbuf = g_malloc(XC_PAGE_SIZE);
+            netdev->xendev.io_stats.grant_maps += n;
+
+            niov = 0;
+            if (netdev->has_vnet_hdr) {
+                iov[niov].iov_base = &hdr;
+                iov[niov].iov_len = sizeof(hdr);
+                niov++;
+            }
+            for (i = 0; i < n; i++) {
+                iov[niov].iov_base = pages + i * XC_PAGE_SIZE +
+                                     txreqs[i].offset;
+                iov[niov].iov_len = i ? txreqs[i].size : first_size;
+                niov++;
+            }
+
+            if (!netdev->has_vnet_hdr &&
+                (n > 1 || (txreqs[0].flags & NETTXF_csum_blank))) {
+                /*
+                 * have read-only mapping -> can't fill checksum in-place.
+                 * No offload on the peer side either, so linearize.
+                 */
+                if (gso) {
+                    xen_be_printf(&netdev->xendev, 0, "gso without peer offload\n");
+                    err = 1;
+                } else {
+                    if (!netdev->tmpbuf) {
+                        netdev->tmpbuf = g_malloc(MAX_PACKET_SIZE);
+                    }
+                    iov_to_buf(iov, niov, 0, netdev->tmpbuf, size);
+                    if (txreqs[0].flags & NETTXF_csum_blank) {
+                        net_checksum_calculate(netdev->tmpbuf, size);
+                    }
+                    iov[0].iov_base = netdev->tmpbuf;
+                    iov[0].iov_len = size;
+                    niov = 1;
                 }
-                memcpy(tmpbuf, page + txreq.offset, txreq.size);
-                net_checksum_calculate(tmpbuf, txreq.size);
-                qemu_send_packet(qemu_get_queue(netdev->nic), tmpbuf,
-                                 txreq.size);
-            } else {
-                qemu_send_packet(qemu_get_queue(netdev->nic),
-                                 page + txreq.offset, txreq.size);
+            } else if (netdev->has_vnet_hdr &&
+                       net_tx_fill_vnet_hdr(&hdr, txreqs[0].flags, gso,
+                                            iov[1].iov_base,
+                                            iov[1].iov_len) < 0) {
+                xen_be_printf(&netdev->xendev, 0, "can't offload tx packet\n");
+                err = 1;
+            }
+
+            if (!err) {
+                qemu_sendv_packet(queue->nc, iov, niov);
+            }
+            xen_be_io_count(&netdev->xendev, XEN_IO_WRITE, size, err);
+            xc_gnttab_munmap(netdev->xendev.gnttabdev, pages, n);
+            netdev->xendev.io_stats.grant_unmaps += n;
+            for (i = 0; i < n; i++) {
+                net_tx_response(queue, &txreqs[i], i ? 0 : nr_extras,
+                                err ? NETIF_RSP_ERROR : NETIF_RSP_OKAY);
             }
-            xc_gnttab_munmap(netdev->xendev.gnttabdev, page, 1);
-            net_tx_response(netdev, &txreq, NETIF_RSP_OKAY);
         }
-        if (!netdev->tx_work) {
+        if (!queue->tx_work) {
             break;
         }
-        netdev->tx_work = 0;
+        queue->tx_work = 0;
     }
-    g_free(tmpbuf);
 }
 
 /* ------------------------------------------------------------- */
 
-static void net_rx_response(struct XenNetDev *netdev,
+#define NET_IP_ALIGN 2
+
+/* place a response on the rx ring, net_rx_push() makes it visible */
+static void net_rx_response(struct XenNetQueue *queue,
                             netif_rx_request_t *req, int8_t st,
                             uint16_t offset, uint16_t size,
                             uint16_t flags)
 {
-    RING_IDX i = netdev->rx_ring.rsp_prod_pvt;
+    RING_IDX i = queue->rx_ring.rsp_prod_pvt;
     netif_rx_response_t *resp;
-    int notify;
 
-    resp = RING_GET_RESPONSE(&netdev->rx_ring, i);
+    resp = RING_GET_RESPONSE(&queue->rx_ring, i);
     resp->offset     = offset;
     resp->flags      = flags;
     resp->id         = req->id;
@@ -222,32 +466,40 @@ static void net_rx_response(struct XenNetDev *netdev,
         resp->status = (int16_t)st;
     }
 
-    xen_be_printf(&netdev->xendev, 3, "rx response: idx %d, status %d, flags 0x%x\n",
+    xen_be_printf(&queue->netdev->xendev, 3, "rx response: idx %d, status %d, flags 0x%x\n",
                   i, resp->status, resp->flags);
 
-    netdev->rx_ring.rsp_prod_pvt = ++i;
-    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&netdev->rx_ring, notify);
+    queue->rx_ring.rsp_prod_pvt = ++i;
+}
+
+static void net_rx_push(struct XenNetQueue *queue)
+{
+    int notify;
+
+    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&queue->rx_ring, notify);
     if (notify) {
-        xen_be_send_notify(&netdev->xendev);
+        net_send_notify(queue);
     }
 }
 
-#define NET_IP_ALIGN 2
-
 static int net_rx_ok(NetClientState *nc)
 {
     struct XenNetDev *netdev = qemu_get_nic_opaque(nc);
+    struct XenNetQueue *queue = &netdev->queues[nc->queue_index];
     RING_IDX rc, rp;
 
-    if (netdev->xendev.be_state != XenbusStateConnected) {
+    if (netdev->xendev.be_state != XenbusStateConnected ||
+        nc->queue_index >= netdev->nr_queues) {
         return 0;
     }
 
-    rc = netdev->rx_ring.req_cons;
-    rp = netdev->rx_ring.sring->req_prod;
+    rc = queue->rx_ring.req_cons;
+    rp = queue->rx_ring.sring->req_prod;
     xen_rmb();
 
-    if (rc == rp || RING_REQUEST_CONS_OVERFLOW(&netdev->rx_ring, rc)) {
+    /* room for a packet of maximum size */
+    if (rp - rc < (netdev->rx_sg ? MAX_RX_SLOTS : 1) ||
+        RING_REQUEST_CONS_OVERFLOW(&queue->rx_ring, rc)) {
         xen_be_printf(&netdev->xendev, 2, "%s: no rx buffers (%d/%d)\n",
                       __FUNCTION__, rc, rp);
         return 0;
@@ -255,46 +507,248 @@ static int net_rx_ok(NetClientState *nc)
     return 1;
 }
 
+#ifdef CONFIG_XEN_GRANT_COPY
+/* copy the data of the gathered rx slots in one go and push the responses */
+static void net_rx_flush(struct XenNetQueue *queue)
+{
+    struct XenNetDev *netdev = queue->netdev;
+    netif_extra_info_t *extra;
+    struct XenNetRxSlot *slot;
+    int i, seg, rc = 0;
+
+    if (queue->rx_nr_slots == 0) {
+        return;
+    }
+    if (queue->rx_nr_segs) {
+        netdev->xendev.io_stats.grant_copies += queue->rx_nr_segs;
+        rc = xc_gnttab_grant_copy(netdev->xendev.gnttabdev, queue->rx_nr_segs,
+                                  queue->rx_segs);
+        if (rc) {
+            xen_be_printf(&netdev->xendev, 0, "xc_gnttab_grant_copy failed: %s\n",
+                          strerror(errno));
+        }
+    }
+
+    for (i = 0, seg = 0; i < queue->rx_nr_slots; i++) {
+        slot = &queue->rx_slots[i];
+        if (slot->gso_size) {
+            extra = (netif_extra_info_t *)
+                RING_GET_RESPONSE(&queue->rx_ring, queue->rx_ring.rsp_prod_pvt);
+            memset(extra, 0, sizeof(*extra));
+            extra->type = XEN_NETIF_EXTRA_TYPE_GSO;
+            extra->u.gso.size = slot->gso_size;
+            extra->u.gso.type = XEN_NETIF_GSO_TYPE_TCPV4;
+            queue->rx_ring.rsp_prod_pvt++;
+            continue;
+        }
+        if (rc || queue->rx_segs[seg].status != GNTST_okay) {
+            net_rx_response(queue, &slot->req, NETIF_RSP_ERROR, 0, 0, 0);
+        } else {
+            net_rx_response(queue, &slot->req, NETIF_RSP_OKAY, slot->offset,
+                            slot->size, slot->flags);
+        }
+        seg++;
+    }
+    queue->rx_nr_slots = 0;
+    queue->rx_nr_segs = 0;
+    net_rx_push(queue);
+}
+
+static void net_rx_bh(void *opaque)
+{
+    net_rx_flush(opaque);
+}
+
+static void net_rx_stage(struct XenNetQueue *queue, netif_rx_request_t *req,
+                         uint16_t offset, const uint8_t *data, uint16_t size,
+                         uint16_t flags)
+{
+    struct XenNetDev *netdev = queue->netdev;
+    struct XenNetRxSlot *slot = &queue->rx_slots[queue->rx_nr_slots++];
+    xc_gnttab_grant_copy_segment_t *seg = &queue->rx_segs[queue->rx_nr_segs];
+    uint8_t *page = queue->rx_buf + queue->rx_nr_segs * XC_PAGE_SIZE;
+
+    memcpy(page, data, size);
+    seg->source.virt = page;
+    seg->dest.foreign.ref = req->gref;
+    seg->dest.foreign.domid = netdev->xendev.dom;
+    seg->dest.foreign.offset = offset;
+    seg->len = size;
+    seg->flags = GNTCOPY_dest_gref;
+    queue->rx_nr_segs++;
+
+    slot->req = *req;
+    slot->offset = offset;
+    slot->size = size;
+    slot->flags = flags;
+    slot->gso_size = 0;
+}
+
+/*
+ * Gather a packet for the batched grant copy.  Everything net/queue.c
+ * delivers in one go ends up in the same batch, rx_bh then issues a
+ * single grant copy and pushes all responses together.
+ */
+static void net_rx_packet_copy(struct XenNetQueue *queue,
+                               netif_rx_request_t *rxreqs, int nr_slots,
+                               int gso, const uint8_t *data, size_t len,
+                               uint16_t flags, uint16_t gso_size)
+{
+    size_t chunk, done;
+    int i;
+
+    if (queue->rx_nr_slots + nr_slots + gso > RX_BATCH_SLOTS) {
+        net_rx_flush(queue);
+    }
+
+    chunk = MIN(len, XC_PAGE_SIZE - NET_IP_ALIGN);
+    net_rx_stage(queue, &rxreqs[0], NET_IP_ALIGN, data, chunk,
+                 flags | (nr_slots > 1 ? NETRXF_more_data : 0) |
+                 (gso ? NETRXF_extra_info : 0));
+    if (gso) {
+        struct XenNetRxSlot *slot = &queue->rx_slots[queue->rx_nr_slots++];
+
+        memset(slot, 0, sizeof(*slot));
+        slot->gso_size = gso_size;
+    }
+    for (i = 1, done = chunk; i < nr_slots; i++, done += chunk) {
+        chunk = MIN(len - done, XC_PAGE_SIZE);
+        net_rx_stage(queue, &rxreqs[i + gso], 0, data + done, chunk,
+                     i < nr_slots - 1 ? NETRXF_more_data : 0);
+    }
+    qemu_bh_schedule(queue->rx_bh);
+}
+#endif
+
 static ssize_t net_rx_packet(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     struct XenNetDev *netdev = qemu_get_nic_opaque(nc);
-    netif_rx_request_t rxreq;
+    struct XenNetQueue *queue = &netdev->queues[nc->queue_index];
+    const struct virtio_net_hdr *hdr = NULL;
+    netif_rx_request_t rxreqs[MAX_RX_SLOTS];
+    netif_extra_info_t *extra;
+    uint32_t domids[MAX_RX_SLOTS];
+    uint32_t refs[MAX_RX_SLOTS];
+    const uint8_t *data = buf;
+    size_t len = size, chunk, done;
     RING_IDX rc, rp;
-    void *page;
+    uint16_t flags = 0;
+    int i, nr_slots, gso = 0;
+    uint8_t *pages;
+
+    if (netdev->xendev.be_state != XenbusStateConnected ||
+        nc->queue_index >= netdev->nr_queues) {
+        return -1;
+    }
+
+    if (netdev->has_vnet_hdr) {
+        if (size < sizeof(*hdr)) {
+            return -1;
+        }
+        hdr = (const struct virtio_net_hdr *)buf;
+        data = buf + sizeof(*hdr);
+        len = size - sizeof(*hdr);
+
+        if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            flags |= NETRXF_csum_blank | NETRXF_data_validated;
+        } else if (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+            flags |= NETRXF_data_validated;
+        }
+        switch (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+        case VIRTIO_NET_HDR_GSO_NONE:
+            break;
+        case VIRTIO_NET_HDR_GSO_TCPV4:
+            gso = 1;
+            break;
+        default:
+            xen_be_printf(&netdev->xendev, 0, "unsupported gso type %d\n",
+                          hdr->gso_type);
+            return -1;
+        }
+    }
 
-    if (netdev->xendev.be_state != XenbusStateConnected) {
+    /* first chunk is ip aligned, the others use full pages */
+    nr_slots = 1;
+    if (len > XC_PAGE_SIZE - NET_IP_ALIGN) {
+        nr_slots += DIV_ROUND_UP(len - (XC_PAGE_SIZE - NET_IP_ALIGN),
+                                 XC_PAGE_SIZE);
+    }
+    if (nr_slots > (netdev->rx_sg ? MAX_TX_SLOTS : 1)) {
+        xen_be_printf(&netdev->xendev, 0, "packet too big (%lu > %ld)",
+                      (unsigned long)len, netdev->rx_sg ?
+                      MAX_TX_SLOTS * XC_PAGE_SIZE - NET_IP_ALIGN :
+                      XC_PAGE_SIZE - NET_IP_ALIGN);
         return -1;
     }
 
-    rc = netdev->rx_ring.req_cons;
-    rp = netdev->rx_ring.sring->req_prod;
+    rc = queue->rx_ring.req_cons;
+    rp = queue->rx_ring.sring->req_prod;
     xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
-    if (rc == rp || RING_REQUEST_CONS_OVERFLOW(&netdev->rx_ring, rc)) {
+    if (rp - rc < nr_slots + gso ||
+        RING_REQUEST_CONS_OVERFLOW(&queue->rx_ring, rc)) {
         xen_be_printf(&netdev->xendev, 2, "no buffer, drop packet\n");
         return -1;
     }
-    if (size > XC_PAGE_SIZE - NET_IP_ALIGN) {
-        xen_be_printf(&netdev->xendev, 0, "packet too big (%lu > %ld)",
-                      (unsigned long)size, XC_PAGE_SIZE - NET_IP_ALIGN);
-        return -1;
+
+    for (i = 0; i < nr_slots + gso; i++) {
+        memcpy(&rxreqs[i], RING_GET_REQUEST(&queue->rx_ring, rc),
+               sizeof(rxreqs[i]));
+        queue->rx_ring.req_cons = ++rc;
+    }
+#ifdef CONFIG_XEN_GRANT_COPY
+    if (netdev->rx_grant_copy) {
+        net_rx_packet_copy(queue, rxreqs, nr_slots, gso, data, len, flags,
+                           gso ? hdr->gso_size : 0);
+        xen_be_io_count(&netdev->xendev, XEN_IO_READ, len, false);
+        return size;
     }
+#endif
 
-    memcpy(&rxreq, RING_GET_REQUEST(&netdev->rx_ring, rc), sizeof(rxreq));
-    netdev->rx_ring.req_cons = ++rc;
+    /* the gso extra info takes the second slot, its buffer stays unused */
+    for (i = 0; i < nr_slots; i++) {
+        domids[i] = netdev->xendev.dom;
+        refs[i] = rxreqs[i ? i + gso : 0].gref;
+    }
 
-    page = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                   netdev->xendev.dom,
-                                   rxreq.gref, PROT_WRITE);
-    if (page == NULL) {
+    pages = xc_gnttab_map_grant_refs(netdev->xendev.gnttabdev, nr_slots,
+                                     domids, refs, PROT_WRITE);
+    if (pages == NULL) {
         xen_be_printf(&netdev->xendev, 0, "error: rx gref dereference failed (%d)\n",
-                      rxreq.gref);
-        net_rx_response(netdev, &rxreq, NETIF_RSP_ERROR, 0, 0, 0);
+                      rxreqs[0].gref);
+        for (i = 0; i < nr_slots + gso; i++) {
+            net_rx_response(queue, &rxreqs[i], NETIF_RSP_ERROR, 0, 0, 0);
+        }
+        net_rx_push(queue);
+        xen_be_io_count(&netdev->xendev, XEN_IO_READ, len, true);
         return -1;
     }
-    memcpy(page + NET_IP_ALIGN, buf, size);
-    xc_gnttab_munmap(netdev->xendev.gnttabdev, page, 1);
-    net_rx_response(netdev, &rxreq, NETIF_RSP_OKAY, NET_IP_ALIGN, size, 0);
+    netdev->xendev.io_stats.grant_maps += nr_slots;
+
+    chunk = MIN(len, XC_PAGE_SIZE - NET_IP_ALIGN);
+    memcpy(pages + NET_IP_ALIGN, data, chunk);
+    net_rx_response(queue, &rxreqs[0], NETIF_RSP_OKAY, NET_IP_ALIGN, chunk,
+                    flags | (nr_slots > 1 ? NETRXF_more_data : 0) |
+                    (gso ? NETRXF_extra_info : 0));
+    if (gso) {
+        extra = (netif_extra_info_t *)
+            RING_GET_RESPONSE(&queue->rx_ring, queue->rx_ring.rsp_prod_pvt);
+        memset(extra, 0, sizeof(*extra));
+        extra->type = XEN_NETIF_EXTRA_TYPE_GSO;
+        extra->u.gso.size = hdr->gso_size;
+        extra->u.gso.type = XEN_NETIF_GSO_TYPE_TCPV4;
+        queue->rx_ring.rsp_prod_pvt++;
+    }
+    for (i = 1, done = chunk; i < nr_slots; i++, done += chunk) {
+        chunk = MIN(len - done, XC_PAGE_SIZE);
+        memcpy(pages + i * XC_PAGE_SIZE, data + done, chunk);
+        net_rx_response(queue, &rxreqs[i + gso], NETIF_RSP_OKAY, 0, chunk,
+                        i < nr_slots - 1 ? NETRXF_more_data : 0);
+    }
+    xc_gnttab_munmap(netdev->xendev.gnttabdev, pages, nr_slots);
+    netdev->xendev.io_stats.grant_unmaps += nr_slots;
+    net_rx_push(queue);
+    xen_be_io_count(&netdev->xendev, XEN_IO_READ, len, false);
 
     return size;
 }
@@ -311,6 +765,11 @@ static NetClientInfo net_xen_info = {
 static int net_init(struct XenDevice *xendev)
 {
     struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
+    NetClientState *peer;
+    unsigned int i;
+#ifdef CONFIG_XEN_GRANT_COPY
+    int copy;
+#endif
 
     /* read xenstore entries */
     if (netdev->mac == NULL) {
@@ -333,30 +792,182 @@ static int net_init(struct XenDevice *xendev)
              sizeof(qemu_get_queue(netdev->nic)->info_str),
              "nic: xenbus vif macaddr=%s", netdev->mac);
 
+    /* one tx/rx queue pair per nic queue */
+    netdev->max_queues = MIN(MAX(netdev->conf.queues, 1), MAX_QUEUES);
+    for (i = 0; i < netdev->max_queues; i++) {
+        netdev->queues[i].nc = qemu_get_subqueue(netdev->nic, i);
+    }
+
+    /* offloads need a peer which takes a virtio_net_hdr */
+    peer = qemu_get_queue(netdev->nic)->peer;
+    netdev->has_vnet_hdr = peer &&
+        peer->info->type == NET_CLIENT_OPTIONS_KIND_TAP &&
+        tap_has_vnet_hdr(peer);
+    if (netdev->has_vnet_hdr) {
+        for (i = 0; i < netdev->max_queues; i++) {
+            tap_using_vnet_hdr(netdev->queues[i].nc->peer, true);
+        }
+    }
+
+#ifdef CONFIG_XEN_GRANT_COPY
+    /* batched grant copy rx path, selected per device by the toolstack */
+    if (xenstore_read_be_int(&netdev->xendev, "grant-copy", &copy) == 0) {
+        netdev->rx_grant_copy = !!copy;
+    }
+#endif
+
     /* fill info */
     xenstore_write_be_int(&netdev->xendev, "feature-rx-copy", 1);
     xenstore_write_be_int(&netdev->xendev, "feature-rx-flip", 0);
+    xenstore_write_be_int(&netdev->xendev, "feature-sg", 1);
+    xenstore_write_be_int(&netdev->xendev, "feature-gso-tcpv4",
+                          netdev->has_vnet_hdr);
+    xenstore_write_be_int(&netdev->xendev, "multi-queue-max-queues",
+                          netdev->max_queues);
 
     return 0;
 }
 
-static int net_connect(struct XenDevice *xendev)
+static void net_queue_event(void *opaque)
 {
-    struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
-    int rx_copy;
+    struct XenNetQueue *queue = opaque;
+    evtchn_port_t port;
 
-    if (xenstore_read_fe_int(&netdev->xendev, "tx-ring-ref",
-                             &netdev->tx_ring_ref) == -1) {
+    port = xc_evtchn_pending(queue->evtchndev);
+    if (port != queue->local_port) {
+        xen_be_printf(&queue->netdev->xendev, 0,
+                      "queue %u: xc_evtchn_pending returned %d (expected %d)\n",
+                      queue->id, port, queue->local_port);
+        return;
+    }
+    xc_evtchn_unmask(queue->evtchndev, port);
+    queue->netdev->xendev.io_stats.notify_received++;
+
+    net_tx_packets(queue);
+    qemu_flush_queued_packets(queue->nc);
+}
+
+static int net_read_queue_int(struct XenNetQueue *queue, const char *node,
+                              int *ival)
+{
+    struct XenNetDev *netdev = queue->netdev;
+    char path[32];
+
+    if (netdev->nr_queues == 1) {
+        return xenstore_read_fe_int(&netdev->xendev, node, ival);
+    }
+    snprintf(path, sizeof(path), "queue-%u/%s", queue->id, node);
+    return xenstore_read_fe_int(&netdev->xendev, path, ival);
+}
+
+static int net_connect_queue(struct XenNetQueue *queue)
+{
+    struct XenNetDev *netdev = queue->netdev;
+
+    if (net_read_queue_int(queue, "tx-ring-ref", &queue->tx_ring_ref) == -1) {
         return -1;
     }
-    if (xenstore_read_fe_int(&netdev->xendev, "rx-ring-ref",
-                             &netdev->rx_ring_ref) == -1) {
-        return 1;
+    if (net_read_queue_int(queue, "rx-ring-ref", &queue->rx_ring_ref) == -1) {
+        return -1;
+    }
+    if (net_read_queue_int(queue, "event-channel", &queue->remote_port) == -1) {
+        return -1;
     }
-    if (xenstore_read_fe_int(&netdev->xendev, "event-channel",
-                             &netdev->xendev.remote_port) == -1) {
+
+    queue->txs = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
+                                         netdev->xendev.dom,
+                                         queue->tx_ring_ref,
+                                         PROT_READ | PROT_WRITE);
+    queue->rxs = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
+                                         netdev->xendev.dom,
+                                         queue->rx_ring_ref,
+                                         PROT_READ | PROT_WRITE);
+    if (!queue->txs || !queue->rxs) {
         return -1;
     }
+    BACK_RING_INIT(&queue->tx_ring, queue->txs, XC_PAGE_SIZE);
+    BACK_RING_INIT(&queue->rx_ring, queue->rxs, XC_PAGE_SIZE);
+
+#ifdef CONFIG_XEN_GRANT_COPY
+    if (netdev->rx_grant_copy && !queue->rx_buf) {
+        queue->rx_buf = qemu_memalign(XC_PAGE_SIZE,
+                                      RX_BATCH_SLOTS * XC_PAGE_SIZE);
+    }
+#endif
+
+    if (queue->id == 0) {
+        netdev->xendev.remote_port = queue->remote_port;
+        if (xen_be_bind_evtchn(&netdev->xendev) < 0) {
+            return -1;
+        }
+        queue->local_port = netdev->xendev.local_port;
+    } else {
+        queue->evtchndev = xen_xc_evtchn_open(NULL, 0);
+        if (queue->evtchndev == XC_HANDLER_INITIAL_VALUE) {
+            xen_be_printf(&netdev->xendev, 0, "queue %u: can't open evtchn\n",
+                          queue->id);
+            return -1;
+        }
+        fcntl(xc_evtchn_fd(queue->evtchndev), F_SETFD, FD_CLOEXEC);
+        queue->local_port = xc_evtchn_bind_interdomain(queue->evtchndev,
+                                                       netdev->xendev.dom,
+                                                       queue->remote_port);
+        if (queue->local_port == -1) {
+            xen_be_printf(&netdev->xendev, 0,
+                          "queue %u: xc_evtchn_bind_interdomain failed\n",
+                          queue->id);
+            return -1;
+        }
+        qemu_set_fd_handler(xc_evtchn_fd(queue->evtchndev),
+                            net_queue_event, NULL, queue);
+    }
+
+    xen_be_printf(&netdev->xendev, 1, "queue %u: tx-ring-ref %d, rx-ring-ref %d, "
+                  "remote port %d, local port %d\n", queue->id,
+                  queue->tx_ring_ref, queue->rx_ring_ref,
+                  queue->remote_port, queue->local_port);
+    return 0;
+}
+
+static void net_disconnect_queue(struct XenNetQueue *queue)
+{
+    struct XenNetDev *netdev = queue->netdev;
+
+    if (queue->id == 0) {
+        xen_be_unbind_evtchn(&netdev->xendev);
+    } else if (queue->evtchndev != XC_HANDLER_INITIAL_VALUE) {
+        if (queue->local_port != -1) {
+            qemu_set_fd_handler(xc_evtchn_fd(queue->evtchndev),
+                                NULL, NULL, NULL);
+            xc_evtchn_unbind(queue->evtchndev, queue->local_port);
+        }
+        xc_evtchn_close(queue->evtchndev);
+        queue->evtchndev = XC_HANDLER_INITIAL_VALUE;
+    }
+    queue->local_port = -1;
+
+#ifdef CONFIG_XEN_GRANT_COPY
+    /* the rx ring goes away, drop what's still gathered for it */
+    qemu_bh_cancel(queue->rx_bh);
+    queue->rx_nr_slots = 0;
+    queue->rx_nr_segs = 0;
+#endif
+
+    if (queue->txs) {
+        xc_gnttab_munmap(netdev->xendev.gnttabdev, queue->txs, 1);
+        queue->txs = NULL;
+    }
+    if (queue->rxs) {
+        xc_gnttab_munmap(netdev->xendev.gnttabdev, queue->rxs, 1);
+        queue->rxs = NULL;
+    }
+}
+
+static int net_connect(struct XenDevice *xendev)
+{
+    struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
+    int rx_copy, val, nr_queues;
+    unsigned int i, j;
 
     if (xenstore_read_fe_int(&netdev->xendev, "request-rx-copy", &rx_copy) == -1) {
         rx_copy = 0;
@@ -366,44 +977,60 @@ static int net_connect(struct XenDevice *xendev)
         return -1;
     }
 
-    netdev->txs = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                          netdev->xendev.dom,
-                                          netdev->tx_ring_ref,
-                                          PROT_READ | PROT_WRITE);
-    netdev->rxs = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                          netdev->xendev.dom,
-                                          netdev->rx_ring_ref,
-                                          PROT_READ | PROT_WRITE);
-    if (!netdev->txs || !netdev->rxs) {
+    if (xenstore_read_fe_int(&netdev->xendev, "multi-queue-num-queues",
+                             &nr_queues) == -1) {
+        nr_queues = 1;
+    }
+    if (nr_queues < 1 || nr_queues > netdev->max_queues) {
+        xen_be_printf(&netdev->xendev, 0, "invalid multi-queue-num-queues %d\n",
+                      nr_queues);
         return -1;
     }
-    BACK_RING_INIT(&netdev->tx_ring, netdev->txs, XC_PAGE_SIZE);
-    BACK_RING_INIT(&netdev->rx_ring, netdev->rxs, XC_PAGE_SIZE);
+    netdev->nr_queues = nr_queues;
 
-    xen_be_bind_evtchn(&netdev->xendev);
+    /* what the frontend takes on rx */
+    netdev->rx_sg = xenstore_read_fe_int(&netdev->xendev, "feature-sg",
+                                         &val) == 0 && val;
+    netdev->rx_gso = netdev->rx_sg &&
+        xenstore_read_fe_int(&netdev->xendev, "feature-gso-tcpv4",
+                             &val) == 0 && val;
+    netdev->rx_csum = !(xenstore_read_fe_int(&netdev->xendev,
+                                             "feature-no-csum-offload",
+                                             &val) == 0 && val);
+    if (netdev->has_vnet_hdr) {
+        for (i = 0; i < netdev->max_queues; i++) {
+            tap_set_offload(netdev->queues[i].nc->peer, netdev->rx_csum,
+                            netdev->rx_gso && netdev->rx_csum, 0, 0, 0);
+        }
+    }
 
-    xen_be_printf(&netdev->xendev, 1, "ok: tx-ring-ref %d, rx-ring-ref %d, "
-                  "remote port %d, local port %d\n",
-                  netdev->tx_ring_ref, netdev->rx_ring_ref,
-                  netdev->xendev.remote_port, netdev->xendev.local_port);
+    for (i = 0; i < netdev->nr_queues; i++) {
+        if (net_connect_queue(&netdev->queues[i]) < 0) {
+            for (j = 0; j <= i; j++) {
+                net_disconnect_queue(&netdev->queues[j]);
+            }
+            return -1;
+        }
+    }
+
+    xen_be_printf(&netdev->xendev, 1, "ok: %u queue(s), sg %d, gso %d, "
+                  "csum %d, vnet_hdr %d, rx grant copy %d\n", netdev->nr_queues,
+                  netdev->rx_sg, netdev->rx_gso, netdev->rx_csum,
+                  netdev->has_vnet_hdr, netdev->rx_grant_copy);
 
-    net_tx_packets(netdev);
+    for (i = 0; i < netdev->nr_queues; i++) {
+        net_tx_packets(&netdev->queues[i]);
+    }
     return 0;
 }
 
 static void net_disconnect(struct XenDevice *xendev)
 {
     struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
+    unsigned int i;
 
-    xen_be_unbind_evtchn(&netdev->xendev);
-
-    if (netdev->txs) {
-        xc_gnttab_munmap(netdev->xendev.gnttabdev, netdev->txs, 1);
-        netdev->txs = NULL;
-    }
-    if (netdev->rxs) {
-        xc_gnttab_munmap(netdev->xendev.gnttabdev, netdev->rxs, 1);
-        netdev->rxs = NULL;
+    for (i = 0; i < MAX_QUEUES; i++) {
+        net_disconnect_queue(&netdev->queues[i]);
     }
     if (netdev->nic) {
         qemu_del_nic(netdev->nic);
@@ -414,14 +1041,45 @@ static void net_disconnect(struct XenDevice *xendev)
 static void net_event(struct XenDevice *xendev)
 {
     struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
-    net_tx_packets(netdev);
-    qemu_flush_queued_packets(qemu_get_queue(netdev->nic));
+    net_tx_packets(&netdev->queues[0]);
+    qemu_flush_queued_packets(netdev->queues[0].nc);
+}
+
+static void net_alloc(struct XenDevice *xendev)
+{
+    struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
+    unsigned int i;
+
+    for (i = 0; i < MAX_QUEUES; i++) {
+        netdev->queues[i].netdev = netdev;
+        netdev->queues[i].id = i;
+        netdev->queues[i].evtchndev = XC_HANDLER_INITIAL_VALUE;
+        netdev->queues[i].local_port = -1;
+#ifdef CONFIG_XEN_GRANT_COPY
+        netdev->queues[i].rx_bh = qemu_bh_new(net_rx_bh, &netdev->queues[i]);
+#endif
+    }
+    netdev->nr_queues = 1;
+    if (xc_gnttab_set_max_grants(xendev->gnttabdev,
+                                 MAX_QUEUES * (2 + MAX_RX_SLOTS)) < 0) {
+        xen_be_printf(xendev, 0, "xc_gnttab_set_max_grants failed: %s\n",
+                      strerror(errno));
+    }
 }
 
 static int net_free(struct XenDevice *xendev)
 {
     struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
+#ifdef CONFIG_XEN_GRANT_COPY
+    unsigned int i;
+
+    for (i = 0; i < MAX_QUEUES; i++) {
+        qemu_bh_delete(netdev->queues[i].rx_bh);
+        qemu_vfree(netdev->queues[i].rx_buf);
+    }
+#endif
 
+    g_free(netdev->tmpbuf);
     g_free(netdev->mac);
     return 0;
 }
@@ -431,6 +1089,7 @@ static int net_free(struct XenDevice *xendev)
 struct XenDevOps xen_netdev_ops = {
     .size       = sizeof(struct XenNetDev),
     .flags      = DEVOPS_FLAG_NEED_GNTDEV,
+    .alloc      = net_alloc,
     .init       = net_init,
     .initialise    = net_connect,
     .event      = net_event,
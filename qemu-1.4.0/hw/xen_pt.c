@@ -60,6 +60,7 @@
 #include "xen_pt.h"
 #include "qemu/range.h"
 #include "exec/address-spaces.h"
+#include "qapi-types.h"
 
 #define XEN_PT_NR_IRQS (256)
 static uint8_t xen_pt_mapped_machine_irq[XEN_PT_NR_IRQS] = {0};
@@ -105,6 +106,119 @@ static int xen_pt_pci_config_access_check(PCIDevice *d, uint32_t addr, int len)
     return 0;
 }
 
+/* Config space cache */
+
+/* Header fields that are fixed in hardware */
+static const struct {
+    uint32_t offset;
+    uint32_t size;
+} xen_pt_config_fixed[] = {
+    { PCI_REVISION_ID, 1 },
+    { PCI_CLASS_PROG, 3 },
+    { PCI_HEADER_TYPE, 1 },
+    { PCI_SUBSYSTEM_VENDOR_ID, 2 },
+    { PCI_SUBSYSTEM_ID, 2 },
+};
+
+/* Mark the bytes of a register whose @mask byte is all ones as safe to serve
+ * from the cache */
+void xen_pt_config_set_cacheable(XenPCIPassthroughState *s, uint32_t offset,
+                                 uint32_t size, uint32_t mask)
+{
+    uint32_t i;
+
+    for (i = 0; i < size && offset + i < PCI_CONFIG_SPACE_SIZE; i++) {
+        if (((mask >> (i * 8)) & 0xFF) == 0xFF) {
+            set_bit(offset + i, s->cfg_cacheable);
+        }
+    }
+}
+
+static void xen_pt_config_cache_init(XenPCIPassthroughState *s)
+{
+    int i;
+
+    bitmap_zero(s->cfg_cacheable, PCI_CONFIG_SPACE_SIZE);
+    bitmap_zero(s->cfg_cache_valid, PCI_CONFIG_SPACE_SIZE);
+    memset(s->cfg_stats, 0, sizeof(s->cfg_stats));
+    for (i = 0; i < ARRAY_SIZE(xen_pt_config_fixed); i++) {
+        xen_pt_config_set_cacheable(s, xen_pt_config_fixed[i].offset,
+                                    xen_pt_config_fixed[i].size,
+                                    XEN_PT_BAR_ALLF);
+    }
+}
+
+/* Read the host config space, from the cache when all of it is there */
+static int xen_pt_config_host_read(XenPCIPassthroughState *s, uint32_t addr,
+                                   uint32_t *val, int len, bool *cached)
+{
+    int i, rc;
+    bool hit = true;
+
+    for (i = 0; i < len; i++) {
+        if (!test_bit(addr + i, s->cfg_cache_valid)) {
+            hit = false;
+            break;
+        }
+    }
+    *cached = hit;
+    if (hit) {
+        memcpy(val, s->cfg_cache + addr, len);
+        return 0;
+    }
+
+    rc = xen_host_pci_get_block(&s->real_device, addr, (uint8_t *)val, len);
+    if (rc < 0) {
+        return rc;
+    }
+    for (i = 0; i < len; i++) {
+        if (test_bit(addr + i, s->cfg_cacheable)) {
+            s->cfg_cache[addr + i] = ((uint8_t *)val)[i];
+            set_bit(addr + i, s->cfg_cache_valid);
+        }
+    }
+
+    return rc;
+}
+
+static PciConfigAccessInfoList *xen_pt_query_config_access(PCIDevice *d)
+{
+    XenPCIPassthroughState *s = DO_UPCAST(XenPCIPassthroughState, dev, d);
+    PciConfigAccessInfoList *head = NULL, **tail = &head;
+    PciConfigAccessInfoList *entry;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(s->cfg_stats); i++) {
+        if (!s->cfg_stats[i].reads && !s->cfg_stats[i].writes) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->offset = i * 4;
+        entry->value->size = 4;
+        entry->value->reads = s->cfg_stats[i].reads;
+        entry->value->writes = s->cfg_stats[i].writes;
+        entry->value->cached = s->cfg_stats[i].cached;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
+static PciHostAccessInfo *xen_pt_query_host_access(PCIDevice *d)
+{
+    XenPCIPassthroughState *s = DO_UPCAST(XenPCIPassthroughState, dev, d);
+    PciHostAccessInfo *info = g_malloc0(sizeof(*info));
+
+    info->sysfs_opens = s->real_device.sysfs_opens;
+    info->config_reads = s->real_device.config_reads;
+    info->config_writes = s->real_device.config_writes;
+    info->snapshot_reads = s->real_device.snapshot_reads;
+
+    return info;
+}
+
 int xen_pt_bar_offset_to_index(uint32_t offset)
 {
     int index = 0;
@@ -132,10 +246,12 @@ static uint32_t xen_pt_pci_read_config(PCIDevice *d, uint32_t addr, int len)
     int rc = 0;
     int emul_len = 0;
     uint32_t find_addr = addr;
+    bool cached;
 
     if (xen_pt_pci_config_access_check(d, addr, len)) {
         goto exit;
     }
+    s->cfg_stats[addr >> 2].reads++;
 
     /* find register group entry */
     reg_grp_entry = xen_pt_find_reg_grp(s, addr);
@@ -149,10 +265,12 @@ static uint32_t xen_pt_pci_read_config(PCIDevice *d, uint32_t addr, int len)
     }
 
     /* read I/O device register value */
-    rc = xen_host_pci_get_block(&s->real_device, addr, (uint8_t *)&val, len);
+    rc = xen_pt_config_host_read(s, addr, &val, len, &cached);
     if (rc < 0) {
         XEN_PT_ERR(d, "pci_read_block failed. return value: %d.\n", rc);
         memset(&val, 0xff, len);
+    } else if (cached) {
+        s->cfg_stats[addr >> 2].cached++;
     }
 
     /* just return the I/O device register value for
@@ -239,12 +357,14 @@ static void xen_pt_pci_write_config(PCIDevice *d, uint32_t addr,
     XenPTReg *reg_entry = NULL;
     uint32_t find_addr = addr;
     XenPTRegInfo *reg = NULL;
+    bool cached;
 
     if (xen_pt_pci_config_access_check(d, addr, len)) {
         return;
     }
 
     XEN_PT_LOG_CONFIG(d, addr, val, len);
+    s->cfg_stats[addr >> 2].writes++;
 
     /* check unused BAR register */
     index = xen_pt_bar_offset_to_index(addr);
@@ -266,12 +386,12 @@ static void xen_pt_pci_write_config(PCIDevice *d, uint32_t addr,
         }
     }
 
-    rc = xen_host_pci_get_block(&s->real_device, addr,
-                                (uint8_t *)&read_val, len);
+    rc = xen_pt_config_host_read(s, addr, &read_val, len, &cached);
     if (rc < 0) {
         XEN_PT_ERR(d, "pci_read_block failed. return value: %d.\n", rc);
         memset(&read_val, 0xff, len);
     }
+    bitmap_clear(s->cfg_cache_valid, addr, len);
 
     /* pass directly to the real device for passthrough type register group */
     if (reg_grp_entry == NULL) {
@@ -689,6 +809,7 @@ static int xen_pt_initfn(PCIDevice *d)
     xen_pt_register_regions(s);
 
     /* reinitialize each config register to be emulated */
+    xen_pt_config_cache_init(s);
     if (xen_pt_config_init(s)) {
         XEN_PT_ERR(d, "PCI Config space initialisation failed.\n");
         xen_host_pci_device_put(&s->real_device);
@@ -825,6 +946,8 @@ static void xen_pci_passthrough_class_init(ObjectClass *klass, void *data)
     k->exit = xen_pt_unregister_device;
     k->config_read = xen_pt_pci_read_config;
     k->config_write = xen_pt_pci_write_config;
+    k->query_config_access = xen_pt_query_config_access;
+    k->query_host_access = xen_pt_query_host_access;
     dc->desc = "Assign an host PCI device with Xen";
     dc->props = xen_pci_passthrough_properties;
 };
@@ -5,6 +5,7 @@
 #include "xen_common.h"
 #include "pci/pci.h"
 #include "xen-host-pci-device.h"
+#include "qemu/bitmap.h"
 
 void xen_pt_log(const PCIDevice *d, const char *f, ...) GCC_FMT_ATTR(2, 3);
 
@@ -177,6 +178,9 @@ typedef struct XenPTMSIXEntry {
     uint32_t data;
     uint32_t vector_ctrl;
     bool updated; /* indicate whether MSI ADDR or DATA is updated */
+    bool bound; /* pirq bound with bound_addr and bound_data */
+    uint64_t bound_addr;
+    uint32_t bound_data;
 } XenPTMSIXEntry;
 typedef struct XenPTMSIX {
     uint32_t ctrl_offset;
@@ -188,6 +192,7 @@ typedef struct XenPTMSIX {
     uint64_t mmio_base_addr;
     MemoryRegion mmio;
     void *phys_iomem_base;
+    QEMUBH *update_bh; /* binds the entries unmasked by a burst of writes */
     XenPTMSIXEntry msix_entry[0];
 } XenPTMSIX;
 
@@ -210,6 +215,20 @@ struct XenPCIPassthroughState {
 
     MemoryListener memory_listener;
     MemoryListener io_listener;
+
+    /* Shadow copy of the host config space.  Only bytes in cfg_cacheable,
+     * whose host value is either hidden from the guest or can't change,
+     * are served from it; writes invalidate the bytes they touch. */
+    uint8_t cfg_cache[PCI_CONFIG_SPACE_SIZE];
+    DECLARE_BITMAP(cfg_cacheable, PCI_CONFIG_SPACE_SIZE);
+    DECLARE_BITMAP(cfg_cache_valid, PCI_CONFIG_SPACE_SIZE);
+
+    /* Guest accesses, per dword */
+    struct {
+        uint64_t reads;
+        uint64_t writes;
+        uint64_t cached;
+    } cfg_stats[PCI_CONFIG_SPACE_SIZE / 4];
 };
 
 int xen_pt_config_init(XenPCIPassthroughState *s);
@@ -217,6 +236,8 @@ void xen_pt_config_delete(XenPCIPassthroughState *s);
 XenPTRegGroup *xen_pt_find_reg_grp(XenPCIPassthroughState *s, uint32_t address);
 XenPTReg *xen_pt_find_reg(XenPTRegGroup *reg_grp, uint32_t address);
 int xen_pt_bar_offset_to_index(uint32_t offset);
+void xen_pt_config_set_cacheable(XenPCIPassthroughState *s, uint32_t offset,
+                                 uint32_t size, uint32_t mask);
 
 static inline pcibus_t xen_pt_get_emul_size(XenPTBarFlag flag, pcibus_t r_size)
 {
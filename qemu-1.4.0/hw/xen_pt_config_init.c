@@ -1791,6 +1791,14 @@ static int xen_pt_config_reg_init(XenPCIPassthroughState *s,
     /* list add register entry */
     QLIST_INSERT_HEAD(&reg_grp->reg_tbl_list, reg_entry, entries);
 
+    /* The host value of fully emulated bytes never reaches the guest, and
+     * BAR reads don't look at it at all. */
+    xen_pt_config_set_cacheable(s, reg_grp->base_offset + reg->offset,
+                                reg->size,
+                                (reg->size == 4 &&
+                                 reg->u.dw.read == xen_pt_bar_reg_read) ?
+                                XEN_PT_BAR_ALLF : reg->emu_mask);
+
     return 0;
 }
 
@@ -319,6 +319,13 @@ static int xen_pt_msix_update_one(XenPCIPassthroughState *s, int entry_nr)
         return 0;
     }
 
+    /* Rewritten with the values it is bound with, nothing to tell Xen */
+    if (entry->bound && entry->addr == entry->bound_addr &&
+        entry->data == entry->bound_data) {
+        entry->updated = false;
+        return 0;
+    }
+
     pirq = entry->pirq;
 
     rc = msi_msix_setup(s, entry->addr, entry->data, &pirq, true, entry_nr,
@@ -333,8 +340,11 @@ static int xen_pt_msix_update_one(XenPCIPassthroughState *s, int entry_nr)
     rc = msi_msix_update(s, entry->addr, entry->data, pirq, true,
                          entry_nr, &entry->pirq);
 
+    entry->bound = !rc;
     if (!rc) {
         entry->updated = false;
+        entry->bound_addr = entry->addr;
+        entry->bound_data = entry->data;
     }
 
     return rc;
@@ -366,6 +376,7 @@ void xen_pt_msix_disable(XenPCIPassthroughState *s)
         /* clear MSI-X info */
         entry->pirq = XEN_PT_UNASSIGNED_PIRQ;
         entry->updated = false;
+        entry->bound = false;
     }
 }
 
@@ -388,6 +399,7 @@ int xen_pt_msix_update_remap(XenPCIPassthroughState *s, int bar_index)
                            entry->pirq);
             }
             entry->updated = true;
+            entry->bound = false;
         }
     }
     return xen_pt_msix_update(s);
@@ -468,13 +480,26 @@ static void pci_msix_write(void *opaque, hwaddr addr,
 
     set_entry_value(entry, offset, val);
 
+    /*
+     * Guests program and unmask many entries in a row, when setting up
+     * queues or moving interrupts between CPUs.  Bind them in one pass
+     * once the burst of table writes is over.
+     */
     if (offset == PCI_MSIX_ENTRY_VECTOR_CTRL) {
-        if (msix->enabled && !(val & PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
-            xen_pt_msix_update_one(s, entry_nr);
+        if (msix->enabled && !(val & PCI_MSIX_ENTRY_CTRL_MASKBIT) &&
+            entry->updated) {
+            qemu_bh_schedule(msix->update_bh);
         }
     }
 }
 
+static void pci_msix_update_bh(void *opaque)
+{
+    XenPCIPassthroughState *s = opaque;
+
+    xen_pt_msix_update(s);
+}
+
 static uint64_t pci_msix_read(void *opaque, hwaddr addr,
                               unsigned size)
 {
@@ -543,6 +568,7 @@ int xen_pt_msix_init(XenPCIPassthroughState *s, uint32_t base)
     for (i = 0; i < total_entries; i++) {
         msix->msix_entry[i].pirq = XEN_PT_UNASSIGNED_PIRQ;
     }
+    msix->update_bh = qemu_bh_new(pci_msix_update_bh, s);
 
     memory_region_init_io(&msix->mmio, &pci_msix_ops, s, "xen-pci-pt-msix",
                           (total_entries * PCI_MSIX_ENTRY_SIZE
@@ -590,6 +616,7 @@ int xen_pt_msix_init(XenPCIPassthroughState *s, uint32_t base)
     return 0;
 
 error_out:
+    qemu_bh_delete(msix->update_bh);
     memory_region_destroy(&msix->mmio);
     g_free(s->msix);
     s->msix = NULL;
@@ -612,6 +639,7 @@ void xen_pt_msix_delete(XenPCIPassthroughState *s)
                + msix->table_offset_adjust);
     }
 
+    qemu_bh_delete(msix->update_bh);
     memory_region_del_subregion(&s->bar[msix->bar_index], &msix->mmio);
     memory_region_destroy(&msix->mmio);
 
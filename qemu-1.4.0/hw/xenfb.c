@@ -39,6 +39,7 @@
 #include "ui/console.h"
 #include "char/char.h"
 #include "xen_backend.h"
+#include "qemu/pixel-conv.h"
 
 #include <xen/event_channel.h>
 #include <xen/io/fbif.h>
@@ -67,6 +68,10 @@ struct XenInput {
 
 #define UP_QUEUE 8
 
+struct XenFBRect {
+    int x, y, w, h;
+};
+
 struct XenFB {
     struct common     c;
     size_t            fb_len;
@@ -83,9 +88,7 @@ struct XenFB {
     int               have_console;
     int               do_resize;
 
-    struct {
-	int x,y,w,h;
-    } up_rects[UP_QUEUE];
+    struct XenFBRect  up_rects[UP_QUEUE];
     int               up_count;
     int               up_fullscreen;
 };
@@ -606,6 +609,21 @@ static int xenfb_configure_fb(struct XenFB *xenfb, size_t fb_len_lim,
 	}								\
     }
 
+/* The common 32 bpp surface case goes through the vectorized helpers */
+static void xenfb_conv_lines(struct XenFB *xenfb, PixelConvFunc *conv,
+                             int x, int y, int w, int h)
+{
+    int linesize = ds_get_linesize(xenfb->c.ds);
+    uint8_t *data = ds_get_data(xenfb->c.ds);
+    uint8_t *src = xenfb->pixels;
+    int line;
+
+    for (line = y; line < y + h; line++) {
+        conv(data + line * linesize + x * 4,
+             src + xenfb->offset + line * xenfb->row_stride
+             + x * xenfb->depth / 8, w);
+    }
+}
 
 /*
  * This copies data from the guest framebuffer region, into QEMU's
@@ -626,7 +644,7 @@ static void xenfb_guest_copy(struct XenFB *xenfb, int x, int y, int w, int h)
             if (bpp == 16) {
                 BLT(uint8_t, uint16_t,   3, 3, 2,   5, 6, 5);
             } else if (bpp == 32) {
-                BLT(uint8_t, uint32_t,   3, 3, 2,   8, 8, 8);
+                xenfb_conv_lines(xenfb, pixel_conv_8_to_32, x, y, w, h);
             } else {
                 oops = 1;
             }
@@ -635,7 +653,7 @@ static void xenfb_guest_copy(struct XenFB *xenfb, int x, int y, int w, int h)
             if (bpp == 16) {
                 BLT(uint32_t, uint16_t,  8, 8, 8,   5, 6, 5);
             } else if (bpp == 32) {
-                BLT(uint32_t, uint32_t,  8, 8, 8,   8, 8, 8);
+                xenfb_conv_lines(xenfb, pixel_conv_24_to_32, x, y, w, h);
             } else {
                 oops = 1;
             }
@@ -796,6 +814,87 @@ static void xenfb_invalidate(void *opaque)
     xenfb->up_fullscreen = 1;
 }
 
+static int64_t xenfb_rect_area(const struct XenFBRect *r)
+{
+    return (int64_t)r->w * r->h;
+}
+
+static void xenfb_rect_union(struct XenFBRect *u, const struct XenFBRect *a,
+                             const struct XenFBRect *b)
+{
+    int x1 = MIN(a->x, b->x);
+    int y1 = MIN(a->y, b->y);
+    int x2 = MAX(a->x + a->w, b->x + b->w);
+    int y2 = MAX(a->y + a->h, b->y + b->h);
+
+    u->x = x1;
+    u->y = y1;
+    u->w = x2 - x1;
+    u->h = y2 - y1;
+}
+
+/* Pixels that copying the bounding box of @a and @b would redraw even
+ * though neither of them asked for it.
+ */
+static int64_t xenfb_merge_cost(const struct XenFBRect *a,
+                                const struct XenFBRect *b)
+{
+    struct XenFBRect u;
+    int64_t iw, ih;
+
+    xenfb_rect_union(&u, a, b);
+    iw = MAX(MIN(a->x + a->w, b->x + b->w) - MAX(a->x, b->x), 0);
+    ih = MAX(MIN(a->y + a->h, b->y + b->h) - MAX(a->y, b->y), 0);
+    return xenfb_rect_area(&u) - xenfb_rect_area(a) - xenfb_rect_area(b)
+        + iw * ih;
+}
+
+/*
+ * Add an update rectangle to the queue.  Overlapping and adjacent
+ * rectangles are merged as long as that costs at most a quarter of the
+ * area they cover, so that frontends sending many small updates (text
+ * consoles, cursors) do not each get copied line by line.  When the
+ * queue is full, the cheapest merge is done instead of falling back to
+ * a full screen copy.
+ */
+static void xenfb_queue_update(struct XenFB *xenfb, int x, int y, int w, int h)
+{
+    struct XenFBRect r = { .x = x, .y = y, .w = w, .h = h };
+    struct XenFBRect *q;
+    int64_t cost, best_cost;
+    int i, best;
+
+restart:
+    for (i = 0; i < xenfb->up_count; i++) {
+        q = &xenfb->up_rects[i];
+        cost = xenfb_merge_cost(&r, q);
+        if (cost <= (xenfb_rect_area(&r) + xenfb_rect_area(q)) / 4) {
+            break;
+        }
+    }
+    if (i == xenfb->up_count) {
+        if (xenfb->up_count < UP_QUEUE) {
+            xenfb->up_rects[xenfb->up_count++] = r;
+            return;
+        }
+        best = 0;
+        best_cost = INT64_MAX;
+        for (i = 0; i < xenfb->up_count; i++) {
+            cost = xenfb_merge_cost(&r, &xenfb->up_rects[i]);
+            if (cost < best_cost) {
+                best = i;
+                best_cost = cost;
+            }
+        }
+        i = best;
+    }
+
+    /* The bigger rectangle may now be worth merging with another one */
+    xenfb_rect_union(&r, &r, &xenfb->up_rects[i]);
+    xenfb->up_rects[i] = xenfb->up_rects[--xenfb->up_count];
+    goto restart;
+}
+
 static void xenfb_handle_events(struct XenFB *xenfb)
 {
     uint32_t prod, cons;
@@ -811,8 +910,6 @@ static void xenfb_handle_events(struct XenFB *xenfb)
 
 	switch (event->type) {
 	case XENFB_TYPE_UPDATE:
-	    if (xenfb->up_count == UP_QUEUE)
-		xenfb->up_fullscreen = 1;
 	    if (xenfb->up_fullscreen)
 		break;
 	    x = MAX(event->update.x, 0);
@@ -834,11 +931,7 @@ static void xenfb_handle_events(struct XenFB *xenfb)
 		 * don't bother keeping track of the rectangles then */
 		xenfb->up_fullscreen = 1;
 	    } else {
-		xenfb->up_rects[xenfb->up_count].x = x;
-		xenfb->up_rects[xenfb->up_count].y = y;
-		xenfb->up_rects[xenfb->up_count].w = w;
-		xenfb->up_rects[xenfb->up_count].h = h;
-		xenfb->up_count++;
+		xenfb_queue_update(xenfb, x, y, w, h);
 	    }
 	    break;
 #ifdef XENFB_TYPE_RESIZE
@@ -8,6 +8,8 @@
 #include "xenmou.h"
 #include <linux/input.h>
 #include "pci/pci.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 //#define DEBUG_XENMOU
 
@@ -72,6 +74,10 @@
 
 #define SLOT_NOT_SET    -2
 
+/* Default time an interrupt can be held back while the guest is still
+ * draining the ring, in microseconds */
+#define IRQ_HOLDOFF_US  1000
+
 /* Device Properties: this structure is available on the RAM for the Guest
  * to get the device property and information */
 typedef struct {
@@ -116,6 +122,19 @@ typedef struct PCIXenMouState {
     int8_t bad_ver;
     QEMUPutMouseEntry *relative_handler;
     QEMUPutMouseEntry *absolute_handler;
+
+    /* Interrupt coalescing */
+    uint32_t irq_holdoff_us;
+    QEMUTimer *irq_timer;
+    int ring_was_empty;
+
+    /* Arrival of the oldest event the guest has not been told about */
+    int64_t latency_stamp;
+
+    /* Statistics, reported once per second through trace events */
+    int64_t stats_start;
+    uint32_t stats_events;
+    uint32_t stats_irqs;
 } PCIXenMouState;
 
 static void xenmou_push_config(PCIXenMouState *m);
@@ -183,6 +202,19 @@ static device_property *xenmou_get_devprop(PCIXenMouState *xm)
     return memory_region_get_ram_ptr(&xm->devprop_region);
 }
 
+static void xenmou_latency_stamp(PCIXenMouState *xm)
+{
+    if (!xm->latency_stamp) {
+        xm->latency_stamp = qemu_input_get_stamp();
+    }
+}
+
+static void xenmou_latency_done(PCIXenMouState *xm)
+{
+    qemu_input_latency(INPUT_LATENCY_STAGE_XENMOU, xm->latency_stamp);
+    xm->latency_stamp = 0;
+}
+
 static int xenmou_inject(PCIXenMouState *xm, int x, int y, uint32_t flags)
 {
     XenMouEvent *ev;
@@ -192,6 +224,12 @@ static int xenmou_inject(PCIXenMouState *xm, int x, int y, uint32_t flags)
         return 1;
     }
 
+    if (xm->wptr == *(xenmou_get_rptr_guest(xm))) {
+        xm->ring_was_empty = 1;
+    }
+    xm->stats_events++;
+    xenmou_latency_stamp(xm);
+
     ev = &(xenmou_get_event_queue(xm))[xm->wptr];
     ev->x_and_y = x | (y << 16);
     ev->flags_and_revision = flags | (1 << 16);
@@ -205,11 +243,68 @@ static int xenmou_inject(PCIXenMouState *xm, int x, int y, uint32_t flags)
 
 /* ***xenmou 2 ************************************************************* */
 
+static void xenmou_stats(PCIXenMouState *x)
+{
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    int64_t elapsed = now - x->stats_start;
+
+    if (elapsed < 1000) {
+        return;
+    }
+    trace_xenmou_irq_stats(x->stats_events * 1000ULL / elapsed,
+                           x->stats_irqs * 1000ULL / elapsed);
+    x->stats_start = now;
+    x->stats_events = 0;
+    x->stats_irqs = 0;
+}
+
+static void xenmou_raise(PCIXenMouState *x)
+{
+    if (!(x->isr & XMOU_ISR_INT)) {
+        x->stats_irqs++;
+    }
+    x->isr |= XMOU_ISR_INT;
+    xenmou_update_irq(x);
+    xenmou_latency_done(x);
+}
+
+/*
+ * Signal the end of a batch of events.  The guest drains the ring until
+ * it is empty, so an interrupt is only needed when the batch went into
+ * an empty ring.  Otherwise the guest is still busy with older events and
+ * will most likely pick the new ones up on its own; the holdoff timer
+ * catches the case where it had already finished by the time they landed.
+ * Either way, the latency of the events ends with the interrupt or with
+ * the holdoff.
+ */
 static void interrupt(PCIXenMouState *x)
 {
     if (x->enable_device_interrupts) {
-        x->isr |= XMOU_ISR_INT;
-        xenmou_update_irq(x);
+        if (x->ring_was_empty || !x->irq_holdoff_us) {
+            qemu_del_timer(x->irq_timer);
+            xenmou_raise(x);
+        } else if (!qemu_timer_pending(x->irq_timer)) {
+            trace_xenmou_irq_holdoff(x, x->irq_holdoff_us);
+            qemu_mod_timer(x->irq_timer, qemu_get_clock_ns(vm_clock) +
+                           x->irq_holdoff_us * 1000LL);
+        }
+    } else {
+        /* The guest polls, there is no telling when it saw the events */
+        x->latency_stamp = 0;
+    }
+    x->ring_was_empty = 0;
+    xenmou_stats(x);
+}
+
+static void xenmou_irq_timer(void *opaque)
+{
+    PCIXenMouState *x = opaque;
+
+    if (x->enable_device_interrupts &&
+        x->wptr != *xenmou_get_rptr_guest(x)) {
+        xenmou_raise(x);
+    } else {
+        xenmou_latency_done(x);
     }
 }
 
@@ -223,6 +318,12 @@ static void xenmou_inject_record(PCIXenMouState *xm, uint16_t type,
         return;
     }
 
+    if (xm->wptr == *xenmou_get_rptr_guest(xm)) {
+        xm->ring_was_empty = 1;
+    }
+    xm->stats_events++;
+    xenmou_latency_stamp(xm);
+
     rec = (XenMouEventRecord *)(&((xenmou_get_event_queue(xm))[xm->wptr]));
 
     rec->type = type;
@@ -337,9 +438,8 @@ static void xenmou_event(void *opaque, int x, int y,
     if (z * z == 1)
         schedule_irq += xenmou_inject(xm, -z, 0, VWHEEL);
 
-    if (schedule_irq && xm->enable_device_interrupts) {
-        xm->isr |= XMOU_ISR_INT;
-        xenmou_update_irq(xm);
+    if (schedule_irq) {
+        interrupt(xm);
     }
 
     DEBUG_MSG("WRITE_PTR=%d READ_PTR=%d events_max=%d event_queue=%p "
@@ -722,6 +822,9 @@ static void xenmou_reset(DeviceState *dev)
     m->isr = 0;
     xenmou_update_irq(m);
     m->wptr=0;
+    m->ring_was_empty = 0;
+    m->latency_stamp = 0;
+    qemu_del_timer(m->irq_timer);
 
     /* Reset event region and device properties region */
     ptr = memory_region_get_ram_ptr(&m->event_region);
@@ -765,6 +868,9 @@ static int xenmou_initfn(PCIDevice *dev)
     d->num_dev = 0;
     d->slot = SLOT_NOT_SET;
 
+    d->irq_timer = qemu_new_timer_ns(vm_clock, xenmou_irq_timer, d);
+    d->stats_start = qemu_get_clock_ms(rt_clock);
+
     DEBUG_MSG("set input handlers\n");
     xen_input_set_handlers(xenmou_setslot, xenmou_config,
                            xenmou_config_reset, d);
@@ -774,6 +880,12 @@ static int xenmou_initfn(PCIDevice *dev)
     return 0;
 }
 
+static Property xenmou_properties[] = {
+    DEFINE_PROP_UINT32("irq-holdoff-us", PCIXenMouState, irq_holdoff_us,
+                       IRQ_HOLDOFF_US),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void xenmou_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -789,6 +901,7 @@ static void xenmou_class_init(ObjectClass *klass, void *data)
     dc->desc = "XEN mouse pci device";
     dc->reset = xenmou_reset;
     dc->vmsd = &vmstate_xenmou;
+    dc->props = xenmou_properties;
 }
 
 static TypeInfo xenmou_info = {
@@ -746,7 +746,16 @@ static ssize_t eth_rx(NetClientState *nc, const uint8_t *buf, size_t size)
         size = s->c_rxmem - 4;
     }
 
-    memcpy(s->rxmem, buf, size);
+    /* The payload is summed while it is copied.  An inband FCS is
+       cleared, so it adds nothing to the sum.  */
+    if (size > 14) {
+        memcpy(s->rxmem, buf, 14);
+        csum32 = net_checksum_add_copy(size - 14, s->rxmem + 14,
+                                       buf + 14);
+    } else {
+        memcpy(s->rxmem, buf, size);
+        csum32 = 0;
+    }
     memset(s->rxmem + size, 0, 4); /* Clear the FCS.  */
 
     if (s->rcw[1] & RCW1_FCS) {
@@ -754,7 +763,6 @@ static ssize_t eth_rx(NetClientState *nc, const uint8_t *buf, size_t size)
     }
 
     app[0] = 5 << 28;
-    csum32 = net_checksum_add(size - 14, (uint8_t *)s->rxmem + 14);
     /* Fold it once.  */
     csum32 = (csum32 & 0xffff) + (csum32 >> 16);
     /* And twice to get rid of possible carries.  */
@@ -33,6 +33,8 @@
 #include "qapi/qmp/qerror.h"
 #include "monitor/monitor.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
+#include "qemu/histogram.h"
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
@@ -42,8 +44,9 @@
 #define BLOCK_IO_LIMIT_WRITE    1
 #define BLOCK_IO_LIMIT_TOTAL    2
 
-#define BLOCK_IO_SLICE_TIME     100000000
 #define NANOSECONDS_PER_SECOND  1000000000.0
+/* default number of seconds a burst at the *_max rate may last */
+#define BLOCK_IO_BURST_LENGTH   1
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -63,12 +66,25 @@ typedef struct BdrvTrackedRequest BdrvTrackedRequest;
 typedef struct BlockIOLimit {
     int64_t bps[3];
     int64_t iops[3];
+    /* burst rates; 0 means a bucket only holds 100ms worth of its average */
+    int64_t bps_max[3];
+    int64_t iops_max[3];
+    /* seconds a burst at the *_max rate may last before the average applies */
+    int64_t burst_length;
 } BlockIOLimit;
 
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+/* A leaky bucket: accounted I/O fills it, time drains it at the average
+ * rate, and requests wait while it is full.  With a burst rate configured,
+ * the bucket holds burst_length seconds at that rate and a second, small
+ * bucket drained at the burst rate keeps the burst itself in check.
+ */
+typedef struct BlockIOBucket {
+    double level;
+    double burst_level;
+} BlockIOBucket;
+
+/* Bucket state, shared by all drives in a throttling group */
+typedef struct BlockThrottleGroup BlockThrottleGroup;
 
 struct BlockDriver {
     const char *format_name;
@@ -105,6 +121,8 @@ struct BlockDriver {
     BlockDriverAIOCB *(*bdrv_aio_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_co_readv)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
@@ -158,9 +176,12 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* fill in the driver specific counters of query-blockstats */
+    void (*bdrv_get_cache_stats)(const BlockDriverState *bs,
+                                 BlockDeviceStats *stats);
 
-    int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
-                             int64_t pos, int size);
+    int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
+                             int64_t pos);
     int (*bdrv_load_vmstate)(BlockDriverState *bs, uint8_t *buf,
                              int64_t pos, int size);
 
@@ -204,6 +225,13 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Returns a file descriptor holding the image data unmodified, at the
+     * same offsets, or -ENOTSUP.  Lets callers bypass the block layer for
+     * reads, e.g. to sendfile() them.
+     */
+    int (*bdrv_get_passthrough_fd)(BlockDriverState *bs);
+
     /* XenClient: ATAPI Pass Through
      * Allow the driver to receive command from the device emulation module */
     int (*bdrv_receive_request_from_device)(BlockDriverState *bs,
@@ -252,21 +280,32 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
+    /* I/O throttling */
     BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
+    BlockThrottleGroup *throttle_group;
     CoQueue      throttled_reqs;
     QEMUTimer    *block_timer;
     bool         io_limits_enabled;
 
+    /* metadata cache sizes in bytes requested for the drive, 0 lets the
+     * format driver choose */
+    uint64_t l2_cache_size;
+    uint64_t refcount_cache_size;
+    /* memory cap for decompressed chunks of cloop and dmg images */
+    uint64_t chunk_cache_size;
+
+    /* where blocking requests run, NULL for the default pool; inherited
+     * by the protocol below a format driver */
+    ThreadPool *thread_pool;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
+    uint64_t nr_merged[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    /* NULL unless enabled with block-latency-histogram-set */
+    LatencyHistogram *latency_hist[BDRV_MAX_IOTYPE];
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -284,10 +323,19 @@ struct BlockDriverState {
     BlockDeviceIoStatus iostatus;
     char device_name[32];
     HBitmap *dirty_bitmap;
+    QSLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
-    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    IntervalTree tracked_requests;
+
+    /* Recent bdrv_co_is_allocated() answers, dropped when the range is
+     * written or discarded.  alloc_cache_gen changes on every such drop,
+     * so that a lookup racing with a write does not store a stale answer.
+     */
+    IntervalTree alloc_cache;
+    int alloc_cache_entries;
+    uint64_t alloc_cache_gen;
 
     /* long-running background operation */
     BlockJob *job;
@@ -298,6 +346,8 @@ int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
+void bdrv_set_throttle_group(BlockDriverState *bs, const char *name);
+const char *bdrv_get_throttle_group(BlockDriverState *bs);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -330,6 +380,41 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/*
+ * A named dirty bitmap.  Unlike bs->dirty_bitmap, which belongs to
+ * whichever job enabled dirty tracking, these are created by the user,
+ * can outlive QEMU through @file, and record every write since they were
+ * last emptied by a backup job.
+ */
+struct BdrvDirtyBitmap {
+    char *name;
+    char *file;             /* saved there on close, or NULL */
+    HBitmap *bitmap;
+    int64_t sectors;        /* device size when the bitmap was created */
+    bool busy;              /* in use by a backup job */
+    QSLIST_ENTRY(BdrvDirtyBitmap) next;
+};
+
+/**
+ * backup_start:
+ * @bs: Block device to back up.
+ * @target: Block device to write the changed clusters to.
+ * @bitmap: Dirty bitmap selecting what to copy.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Copy the clusters that are dirty in @bitmap from @bs to @target,
+ * emptying @bitmap as it goes.  Writes done by the guest meanwhile are
+ * copied too; the job ends once @target has caught up with @bs.  If the
+ * job fails or is cancelled, @bitmap gets back everything it lost.
+ */
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  BdrvDirtyBitmap *bitmap, int64_t speed,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp);
+
 /**
  * commit_start:
  * @bs: Top Block device
@@ -346,6 +431,25 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
                  BlockdevOnError on_error, BlockDriverCompletionFunc *cb,
                  void *opaque, Error **errp);
 
+/**
+ * commit_active_start:
+ * @bs: Active block device, the top of the chain
+ * @base: Block device that will be written into, and become the new top
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @on_error: The action to take upon error.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Commit everything above @base into it while the guest keeps running.
+ * This is a mirror job with @base as the target: once it is ready,
+ * completing it makes @bs read from @base and drops the images above it.
+ */
+void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
+                         int64_t speed, BlockdevOnError on_error,
+                         BlockDriverCompletionFunc *cb,
+                         void *opaque, Error **errp);
+
 /*
  * mirror_start:
  * @bs: Block device to operate on.
@@ -50,6 +50,12 @@ typedef struct BlockJobType {
      * manually.
      */
     void (*complete)(BlockJob *job, Error **errp);
+
+    /**
+     * Optional callback for job types that report more than the common
+     * fields in query-block-jobs.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
 } BlockJobType;
 
 /**
@@ -103,6 +109,18 @@ struct BlockJob {
     /** Speed that was set with @block_job_set_speed.  */
     int64_t speed;
 
+    /** Share of the bandwidth set with @block_job_set_bandwidth.  */
+    int weight;
+
+    /** Bytes the job may still copy under the shared bandwidth limit.  */
+    uint64_t credit;
+
+    /** The size of the last request that was held back for bandwidth.  */
+    uint64_t last_request;
+
+    /** Last bandwidth slices in which the job ran, and was held back.  */
+    uint64_t slice_active, slice_throttled;
+
     /** The completion function that will be called when the job completes.  */
     BlockDriverCompletionFunc *cb;
 
@@ -172,6 +190,49 @@ void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp);
  */
 void block_job_cancel(BlockJob *job);
 
+/**
+ * block_job_set_weight:
+ * @job: The job to set the weight for.
+ * @weight: The new value, between 1 and 1000; new jobs start at 100.
+ * @errp: Error object.
+ *
+ * Set the job's share of the bandwidth set with @block_job_set_bandwidth,
+ * relative to the weights of the other jobs that compete for it.
+ */
+void block_job_set_weight(BlockJob *job, int64_t weight, Error **errp);
+
+/**
+ * block_job_set_bandwidth:
+ * @speed: The maximum combined speed of all jobs, in bytes per second, or
+ * 0 for unlimited.
+ * @latency_ns: If non-zero, halve the bandwidth whenever guest requests
+ * take longer than this on average, and win it back slowly once they don't.
+ * @errp: Error object.
+ *
+ * Limit the bandwidth of all block jobs together, on top of the speed of
+ * each job.
+ */
+void block_job_set_bandwidth(int64_t speed, int64_t latency_ns, Error **errp);
+
+/**
+ * block_job_query_bandwidth:
+ *
+ * Return the settings and current state of the shared bandwidth limit.
+ */
+BlockJobBandwidthInfo *block_job_query_bandwidth(void);
+
+/**
+ * block_job_bandwidth_delay:
+ * @job: The job that is about to copy @n sectors.
+ * @n: How many sectors.
+ *
+ * Account @n sectors against the job's share of the bandwidth set with
+ * @block_job_set_bandwidth.  Returns 0 if the job may go ahead, otherwise
+ * how many nanoseconds to sleep before asking again.  Jobs that use
+ * ratelimit.h for their own speed should call this first.
+ */
+int64_t block_job_bandwidth_delay(BlockJob *job, uint64_t n);
+
 /**
  * block_job_complete:
  * @job: The job to be completed.
@@ -0,0 +1,42 @@
+/*
+ * Cache of decompressed chunks for compressed read-only image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_CHUNK_CACHE_H
+#define BLOCK_CHUNK_CACHE_H
+
+#include "qemu-common.h"
+#include "block/coroutine.h"
+
+typedef struct ChunkCache ChunkCache;
+
+#define CHUNK_CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+
+/* Chunks are evicted least recently used first once they take up more than
+ * @max_bytes; 0 means CHUNK_CACHE_DEFAULT_SIZE.  The chunk inserted last is
+ * always kept, however large.
+ */
+ChunkCache *chunk_cache_new(uint64_t max_bytes);
+void chunk_cache_free(ChunkCache *c);
+
+/* Return the data of chunk @index, or NULL if it is not cached.  The data
+ * stays valid until the next chunk_cache_insert().
+ */
+uint8_t *chunk_cache_lookup(ChunkCache *c, uint32_t index);
+
+/* Add chunk @index, taking over @data, which holds @len bytes and was
+ * allocated with g_malloc().
+ */
+void chunk_cache_insert(ChunkCache *c, uint32_t index, uint8_t *data,
+                        size_t len);
+
+/* Inflate the zlib stream @in into exactly @out_len bytes at @out, in a
+ * worker thread.  Returns 0 or -EIO.
+ */
+int coroutine_fn chunk_inflate_co(const uint8_t *in, size_t in_len,
+                                  uint8_t *out, size_t out_len);
+
+#endif
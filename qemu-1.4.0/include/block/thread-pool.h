@@ -23,9 +23,38 @@
 #include "qemu/thread.h"
 #include "block/coroutine.h"
 #include "block/block_int.h"
+#include "qapi/error.h"
 
 typedef int ThreadPoolFunc(void *opaque);
 
+/* Request accounting, updated from the main loop */
+typedef struct ThreadPoolStats {
+    uint64_t submitted;
+    uint64_t completed;
+    int in_flight;          /* queued or running */
+    int max_in_flight;
+    uint64_t total_ns;      /* submission to completion, summed */
+    uint64_t max_ns;
+} ThreadPoolStats;
+
+/* The default pool (NULL) serves everything not assigned elsewhere.  Named
+ * pools keep at least min_threads workers, and run them on the CPUs listed
+ * in cpus (e.g. "0-3,8") or, if cpus is NULL and node >= 0, on the CPUs of
+ * that NUMA node.
+ */
+ThreadPool *thread_pool_new(const char *name, int min_threads,
+                            int max_threads, const char *cpus, int node,
+                            Error **errp);
+ThreadPool *thread_pool_find(const char *name);
+
+typedef void ThreadPoolIterFunc(const char *name, int min_threads,
+                                int max_threads, const ThreadPoolStats *stats,
+                                void *opaque);
+void thread_pool_foreach(ThreadPoolIterFunc *func, void *opaque);
+
+BlockDriverAIOCB *thread_pool_submit_aio_pool(ThreadPool *pool,
+     ThreadPoolFunc *func, void *arg,
+     BlockDriverCompletionFunc *cb, void *opaque);
 BlockDriverAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
      BlockDriverCompletionFunc *cb, void *opaque);
 int coroutine_fn thread_pool_submit_co(ThreadPoolFunc *func, void *arg);
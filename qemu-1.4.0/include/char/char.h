@@ -9,6 +9,7 @@
 #include "qapi/qmp/qobject.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/main-loop.h"
+#include "qemu/notify.h"
 
 /* character device */
 
@@ -56,6 +57,8 @@ typedef void IOEventHandler(void *opaque, int event);
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     void (*chr_update_read_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
     int (*get_msgfd)(struct CharDriverState *s);
@@ -77,6 +80,13 @@ struct CharDriverState {
     int avail_connections;
     QemuOpts *opts;
     QTAILQ_ENTRY(CharDriverState) next;
+
+    /* Output the backend's fd has not taken yet */
+    GByteArray *out_buf;
+    int out_fd;
+    guint out_watch;
+    bool out_stalled;
+    NotifierList out_notifiers;
 };
 
 /**
@@ -165,6 +175,44 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Write data gathered from several buffers, as with @qemu_chr_fe_write.
+ * Backends that write to a file descriptor hand the buffers to writev()
+ * directly; the others get one @qemu_chr_fe_write per buffer.
+ *
+ * @iov the buffers
+ * @iovcnt the number of buffers
+ *
+ * Returns: the number of bytes consumed
+ */
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov, int iovcnt);
+
+/**
+ * @qemu_chr_fe_can_write:
+ *
+ * Backends that write to a file descriptor never block in
+ * @qemu_chr_fe_write; what the descriptor does not take is queued and
+ * written when it becomes writable.  Front ends that can hold back their
+ * own output (a UART can stop draining its transmit FIFO) should check this
+ * before writing, so that the queue stays short.
+ *
+ * Returns: false if the queue is over its high watermark.  The notifiers
+ *          added with @qemu_chr_fe_add_write_notifier are called once it
+ *          drains below the low watermark again.
+ */
+bool qemu_chr_fe_can_write(CharDriverState *s);
+
+/**
+ * @qemu_chr_fe_add_write_notifier:
+ *
+ * Add a notifier to be called each time writing becomes possible again
+ * after @qemu_chr_fe_can_write returned false.  Remove it with
+ * notifier_remove() before the front end goes away.
+ */
+void qemu_chr_fe_add_write_notifier(CharDriverState *s, Notifier *notifier);
+
 /**
  * @qemu_chr_fe_ioctl:
  *
@@ -487,6 +487,8 @@ typedef struct RAMBlock {
     ram_addr_t length;
     uint32_t flags;
     char idstr[256];
+    /* where a migration to a file keeps the block's pages */
+    uint64_t file_offset;
     /* Reads can take either the iothread or the ramlist lock.
      * Writes must take both locks.
      */
@@ -65,7 +65,7 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define EXCP_DEBUG      0x10002 /* cpu stopped after a breakpoint or singlestep */
 #define EXCP_HALTED     0x10003 /* cpu is halted (waiting for external event) */
 
-#define TB_JMP_CACHE_BITS 12
+#define TB_JMP_CACHE_BITS 13
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
 /* Only the bottom TB_JMP_PAGE_BITS of the jump cache hash bits vary for
@@ -108,10 +108,29 @@ typedef struct CPUTLBEntry {
 
 extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BITS) ? 1 : -1];
 
+/* Entries evicted from tlb_table go to a small fully associative victim
+   TLB, which is searched before the page is walked again */
+#define CPU_VTLB_SIZE 8
+
+/* Large pages remembered one by one, so that flushing one of them only
+   drops the entries it covers */
+#define CPU_TLB_LARGE_MAX 8
+
+typedef struct CPUTLBLargePage {
+    target_ulong addr;
+    target_ulong mask;
+} CPUTLBLargePage;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
     hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
+    unsigned int vtlb_index;                                            \
+    CPUTLBLargePage tlb_large[CPU_TLB_LARGE_MAX];                       \
+    int tlb_nb_large;                                                   \
+    /* large pages that did not fit in tlb_large */                     \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;
 
@@ -193,6 +212,7 @@ typedef struct CPUWatchpoint {
     CPUArchState *next_cpu; /* next CPU sharing TB cache */                 \
     uint32_t host_tid; /* host thread ID */                             \
     int running; /* Nonzero if cpu is currently running(usermode).  */  \
+    uint64_t tb_jmp_cache_hits; /* for "info jit" */                    \
     /* user data */                                                     \
     void *opaque;                                                       \
                                                                         \
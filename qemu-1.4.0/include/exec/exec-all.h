@@ -101,6 +101,8 @@ void tlb_flush(CPUArchState *env, int flush_global);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    int access_type, target_ulong addr);
 void tb_invalidate_phys_addr(hwaddr addr);
 #else
 static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
@@ -114,8 +116,10 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* The physical hash starts with 1 << CODE_GEN_PHYS_HASH_BITS chains and
+   doubles whenever it holds twice as many TBs as it has chains */
 #define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_PHYS_HASH_MAX_BITS 22
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -142,6 +146,7 @@ struct TranslationBlock {
     uint16_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+    uint16_t invalid;   /* nonzero once tb_phys_invalidate() removed it */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -183,16 +188,26 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+extern TranslationBlock **tb_phys_hash;
+extern unsigned int tb_phys_hash_bits;
+
+static inline unsigned int tb_phys_hash_func(tb_page_addr_t phys_pc,
+                                             target_ulong pc, uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h = ((uint64_t)phys_pc >> 2) ^ ((uint64_t)pc << 17) ^ flags;
+
+    /* multiplicative hashing: the top bits depend on all of h */
+    return (h * 0x9e3779b97f4a7c15ULL) >> (64 - tb_phys_hash_bits);
 }
 
+/* Lookup statistics for "info jit", jump cache hits are per CPU */
+extern uint64_t tb_phys_hash_lookups;
+extern uint64_t tb_phys_hash_probes;
+
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 
 #if defined(USE_DIRECT_JUMP)
 
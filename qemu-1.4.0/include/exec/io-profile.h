@@ -0,0 +1,37 @@
+/*
+ * Counting profiler for device register accesses
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef IO_PROFILE_H
+#define IO_PROFILE_H
+
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "exec/memory.h"
+
+/* While enabled with mmio-profile-set, every MMIO and port I/O access that
+ * reaches a device is counted per region and offset, together with the
+ * time its handler took.  Disabled, the cost is a test of io_profile_enabled
+ * in the dispatch paths.
+ */
+extern bool io_profile_enabled;
+
+/* Start timing an access; 0 if profiling is off */
+static inline int64_t io_profile_start(void)
+{
+    return unlikely(io_profile_enabled) ? get_clock() : 0;
+}
+
+/* Account an access started at @start_ns.  @mr is NULL for ports registered
+ * with register_ioport_read/write(), and @offset then is the port.
+ */
+void io_profile_record(MemoryRegion *mr, hwaddr offset, bool pio,
+                       bool write, int64_t start_ns);
+
+/* Drop the entries of a region being destroyed */
+void io_profile_forget(MemoryRegion *mr);
+
+#endif
@@ -25,9 +25,10 @@
 typedef struct PhysPageEntry PhysPageEntry;
 
 struct PhysPageEntry {
-    uint16_t is_leaf : 1;
-     /* index into phys_sections (is_leaf) or phys_map_nodes (!is_leaf) */
-    uint16_t ptr : 15;
+    /* how many levels down ptr points, 0 for a leaf */
+    uint32_t skip : 6;
+     /* index into phys_sections (!skip) or phys_map_nodes (skip) */
+    uint32_t ptr : 26;
 };
 
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
@@ -38,6 +39,10 @@ struct AddressSpaceDispatch {
      */
     PhysPageEntry phys_map;
     MemoryListener listener;
+    /* phys_sections index of the last section found, or
+     * PHYS_SECTION_NONE; checked before the map is walked
+     */
+    uint16_t mru_section;
 };
 
 void address_space_init_dispatch(AddressSpace *as);
@@ -134,6 +139,25 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
 
+struct DirtyBitmapSnapshot {
+    ram_addr_t start;           /* page aligned */
+    ram_addr_t end;
+    unsigned long dirty[];      /* one bit per page from start */
+};
+
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+    (ram_addr_t start, ram_addr_t length, int dirty_flags);
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length);
+uint64_t cpu_physical_memory_merge_and_clear_dirty(ram_addr_t start,
+                                                   ram_addr_t length,
+                                                   int dirty_flags,
+                                                   unsigned long *bitmap);
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages);
+
 extern const IORangeOps memory_region_iorange_ops;
 
 #endif
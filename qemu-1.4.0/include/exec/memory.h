@@ -30,6 +30,7 @@ typedef struct MemoryRegionOps MemoryRegionOps;
 typedef struct MemoryRegion MemoryRegion;
 typedef struct MemoryRegionPortio MemoryRegionPortio;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
+typedef struct DirtyBitmapSnapshot DirtyBitmapSnapshot;
 
 /* Must match *_DIRTY_FLAGS in cpu-all.h.  To be replaced with dynamic
  * registration.
@@ -134,6 +135,7 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool thread_safe;
     MemoryRegion *alias;
     hwaddr alias_offset;
     unsigned priority;
@@ -469,6 +471,79 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
  */
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
+/**
+ * memory_region_snapshot_and_clear_dirty: Get a snapshot of the dirty
+ *                                         bitmap of a range and clear it.
+ *
+ * Copies the dirty state of a range of pages for a specified client and
+ * marks the range clean, in a single pass over the dirty bitmap.  This is
+ * cheaper than many memory_region_get_dirty() calls followed by
+ * memory_region_reset_dirty() when a display scans a whole framebuffer.
+ * The snapshot is queried with memory_region_snapshot_get_dirty() and
+ * must be released with g_free().
+ *
+ * @mr: the region being queried.
+ * @addr: the address (relative to the start of the region) of the range.
+ * @size: the size of the range.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ */
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client);
+
+/**
+ * memory_region_set_dirty_lebitmap: Mark the pages set in a bitmap as dirty.
+ *
+ * Like memory_region_set_dirty() for every page whose bit is set, for
+ * bitmaps such as the kernel's dirty log.
+ *
+ * @mr: the memory region being dirtied.
+ * @addr: the address (relative to the start of the region) of the page
+ *        of bit 0.
+ * @bitmap: one bit per host page, in little-endian longs.
+ * @pages: the number of host pages in @bitmap.
+ */
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      unsigned long *bitmap, uint64_t pages);
+
+/**
+ * memory_region_merge_and_clear_dirty: Merge the dirty bitmap of a region
+ *                                      into another bitmap and clear it.
+ *
+ * Sets the bits of the pages of @mr that are dirty for @client, and marks
+ * them clean, a word of @bitmap at a time.  @bitmap has one bit per page of
+ * the ram_addr_t space, so the bit for offset @addr of @mr is
+ * (mr->ram_addr + addr) >> TARGET_PAGE_BITS.  Returns the number of bits
+ * that were not set before.
+ *
+ * @mr: the region being queried.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ * @bitmap: the bitmap to merge into.
+ */
+uint64_t memory_region_merge_and_clear_dirty(MemoryRegion *mr,
+                                            unsigned client,
+                                            unsigned long *bitmap);
+
+/**
+ * memory_region_snapshot_get_dirty: Check whether a range of bytes was dirty
+ *                                   in a snapshot.
+ *
+ * Like memory_region_get_dirty(), but looks at a snapshot taken by
+ * memory_region_snapshot_and_clear_dirty().  The range must lie within
+ * the range of the snapshot.
+ *
+ * @mr: the region the snapshot was taken of.
+ * @snap: the snapshot.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ */
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size);
+
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -582,6 +657,29 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_set_thread_safe: Declare that a region's callbacks may be
+ *                                invoked without the global mutex held.
+ *
+ * Accelerators which dispatch accesses from their own threads (e.g. the Xen
+ * ioreq workers) may then call into the region directly instead of taking
+ * the global mutex first.  The region's MemoryRegionOps must do their own
+ * locking, and must not take the global mutex: removing the region waits
+ * for the callbacks still running.
+ *
+ * @mr: the memory region to be updated.
+ * @thread_safe: whether the callbacks are thread-safe.
+ */
+void memory_region_set_thread_safe(MemoryRegion *mr, bool thread_safe);
+
+/**
+ * memory_region_is_thread_safe: check whether a region's callbacks may be
+ *                               invoked without the global mutex held.
+ *
+ * @mr: the memory region being queried
+ */
+bool memory_region_is_thread_safe(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
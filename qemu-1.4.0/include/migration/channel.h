@@ -0,0 +1,77 @@
+/*
+ * Parallel migration channels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_CHANNEL_H
+#define QEMU_MIGRATION_CHANNEL_H
+
+#include "qemu-common.h"
+#include "qapi/error.h"
+
+/* A tcp migration URI may ask for extra connections with ",channels=N".
+ * RAM pages are then spread over them by address, each connection with a
+ * thread of its own, while the main connection carries everything else.
+ * A given page always takes the same channel, so its copies arrive in the
+ * order they were sent; the main stream only has to wait for the channels
+ * where it needs every page sent so far to be in.
+ */
+#define MIGRATION_CHANNELS_MAX  16
+
+typedef struct MigrationChannelOps {
+    /* Write page @offset of @opaque, mapped at @host, or a sync marker if
+     * @opaque is NULL.  @fill is the byte the page was found to be full of,
+     * -1 if none.  *@last belongs to the channel, for the previous page.
+     */
+    void (*send)(QEMUFile *f, void *opaque, uint64_t offset, void *host,
+                 int fill, void **last);
+    /* Read one record: 1 for a sync marker, 0 for a page, or a negative
+     * error
+     */
+    int (*load)(QEMUFile *f, void **last);
+} MigrationChannelOps;
+
+/* Source side */
+
+/* Remember how many channels tcp address @host_port asks for; NULL forgets */
+void migration_channels_outgoing_init(const char *host_port, Error **errp);
+
+/* Connect the channels asked for and start their threads.  Returns how
+ * many there are, 0 if none were asked for, or a negative error.
+ */
+int migration_channels_connect(const MigrationChannelOps *ops);
+
+/* Queue a page for channel @nr.  @size is what the page takes on the wire;
+ * it is charged to the migration's rate limit right away.
+ */
+int migration_channel_queue(int nr, void *opaque, uint64_t offset,
+                            void *host, int fill, size_t size);
+
+/* Wait until the threads are done with everything queued */
+int migration_channels_flush(void);
+
+/* Put a sync marker on every channel and push it out */
+int migration_channels_barrier(void);
+
+/* Stop the threads and close the channels; with @abort, whatever is still
+ * queued is dropped
+ */
+void migration_channels_close(bool abort);
+
+/* Destination side */
+
+/* Keep listening socket @fd to accept the channels on */
+void migration_channels_incoming_listen(int fd);
+
+/* Accept @n channels and start reading them */
+int migration_channels_accept(int n, const MigrationChannelOps *ops);
+
+/* Wait until every channel has passed its next sync marker */
+int migration_channels_wait(void);
+
+void migration_channels_incoming_cleanup(void);
+
+#endif
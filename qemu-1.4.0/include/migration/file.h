@@ -0,0 +1,110 @@
+/*
+ * Migration to and from a file laid out for fast resume
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_FILE_H
+#define QEMU_MIGRATION_FILE_H
+
+#include "qemu-common.h"
+
+/* "file:<path>" keeps every page of guest RAM at a fixed place in the file
+ * rather than in the migration stream, so that resuming from it can map
+ * RAM straight from the file and let the guest run while it is paged in:
+ *
+ *   0                          header: be32 magic, be32 version, be64 offset
+ *                              of the stream, be32 number of blocks, then
+ *                              for each one a byte len, len bytes of
+ *                              RAMBlock idstr, be64 offset, be64 length
+ *   MIGRATION_FILE_RAM_START   the RAMBlocks, each MIGRATION_FILE_ALIGN
+ *                              aligned; pages never written are holes
+ *   stream offset              the migration stream, without pages
+ *
+ * A page sent again while the guest runs overwrites its older copy.  The
+ * file is written under a temporary name and renamed once complete.  A
+ * guest resumed from the file reads pages it has not touched yet from the
+ * file itself, which therefore must not be modified while it runs.
+ */
+#define MIGRATION_FILE_MAGIC        0x514d4653  /* "QMFS" */
+#define MIGRATION_FILE_VERSION      1
+#define MIGRATION_FILE_RAM_START    (1 << 20)
+#define MIGRATION_FILE_ALIGN        (64 << 10)
+#define MIGRATION_FILE_BLOCKS_MAX   64
+
+#ifndef _WIN32
+
+/* Source side */
+
+/* The file being migrated to, -1 if the migration is not to a file */
+int migration_file_fd(void);
+
+/* Place the next RAMBlock in the file; its pages go to *@offset onwards */
+int migration_file_add_block(const char *idstr, uint64_t length,
+                             uint64_t *offset);
+
+/* Write the header for the blocks added so far */
+int migration_file_write_header(void);
+
+/* Write @size bytes of RAM at file offset @offset */
+int migration_file_write(const void *buf, size_t size, uint64_t offset);
+
+/* Destination side */
+
+/* True if the incoming migration comes from a file */
+bool migration_file_incoming(void);
+
+/* Fill the RAMBlock @idstr at @host from the file.  With @can_map the file
+ * is mapped over it copy-on-write, otherwise it is read in right away.
+ */
+int migration_file_load_block(const char *idstr, void *host, uint64_t length,
+                              bool can_map);
+
+/* Page in the mapped blocks in the background */
+void migration_file_prefetch_start(void);
+
+#else
+
+/* migration-file.c is POSIX only; there RAM never goes to a file */
+static inline int migration_file_fd(void)
+{
+    return -1;
+}
+
+static inline int migration_file_add_block(const char *idstr, uint64_t length,
+                                           uint64_t *offset)
+{
+    return -ENOSYS;
+}
+
+static inline int migration_file_write_header(void)
+{
+    return -ENOSYS;
+}
+
+static inline int migration_file_write(const void *buf, size_t size,
+                                       uint64_t offset)
+{
+    return -ENOSYS;
+}
+
+static inline bool migration_file_incoming(void)
+{
+    return false;
+}
+
+static inline int migration_file_load_block(const char *idstr, void *host,
+                                            uint64_t length, bool can_map)
+{
+    return -ENOSYS;
+}
+
+static inline void migration_file_prefetch_start(void)
+{
+}
+
+#endif
+
+#endif
@@ -54,6 +54,7 @@ struct MigrationState
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
     bool complete;
+    bool postcopy;      /* the guest runs on the destination */
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -82,6 +83,10 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
+
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
@@ -99,6 +104,16 @@ uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 
+/* The guest does not need the contents of RAM at [@addr, @addr + @len) */
+void ram_free_page_hint(uint64_t addr, uint64_t len);
+
+/* Post-copy: whether pre-copy has gone on long enough to switch, sending
+ * the rest of RAM after the switch, and loading it on the destination
+ */
+bool ram_postcopy_ready(void);
+int ram_postcopy_iterate(QEMUFile *f);
+int ram_load_postcopy(QEMUFile *f);
+
 extern SaveVMHandlers savevm_ram_handlers;
 
 uint64_t dup_mig_bytes_transferred(void);
@@ -128,8 +143,19 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
+/* Portable encoder, and the name of the one xbzrle_encode_buffer() uses */
+int xbzrle_encode_buffer_c(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                           uint8_t *dst, int dlen);
+const char *xbzrle_encode_accel_name(void);
+
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+bool migrate_zero_blocks(void);
+bool migrate_compress_blocks(void);
+bool migrate_compress_pages(void);
+bool migrate_auto_converge(void);
+bool migrate_postcopy_ram(void);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 #endif
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -47,27 +47,29 @@ void cache_fini(PageCache *cache);
 bool cache_is_cached(const PageCache *cache, uint64_t addr);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * get_cached_data: Get the data cached for an addr, and mark it as recently
+ * used
  *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
- * cache_insert: insert the page into the cache. the previous value will be overwritten
+ * cache_insert: copy the page into the cache. the previous value will be
+ * overwritten, or else the least recently used page of its set evicted
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
  * @pdata: pointer to the page
  */
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
+void cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_resize: resize the page cache. Cached pages are kept as far as they
+ * fit, the most recently used ones first
  *
  * Returns -1 on error new cache size on success
  *
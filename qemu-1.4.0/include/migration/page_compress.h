@@ -0,0 +1,62 @@
+/*
+ * Parallel page compression for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef PAGE_COMPRESS_H
+#define PAGE_COMPRESS_H
+
+/* A fixed-size batch of pages that worker threads deflate (or inflate) in
+ * parallel.  The caller fills jobs in stream order with page_compress_get(),
+ * calls page_compress_run() once the batch is full or a boundary is
+ * reached, walks the results in the same order and then empties the batch
+ * with page_compress_reset().  Only one thread may drive a pool.
+ */
+typedef struct PageCompressPool PageCompressPool;
+
+typedef struct PageCompressJob {
+    void *opaque;               /* for the caller */
+    uint64_t offset;            /* for the caller */
+
+    /* Compression: the caller copies the page into @page; on return @len
+     * is the size of the deflated data in @data, or 0 if the page did not
+     * shrink and must be sent as is.
+     *
+     * Decompression: the caller points @page at the destination and puts
+     * @len bytes of deflated data into @data.
+     */
+    uint8_t *page;
+    uint8_t *data;
+    unsigned long len;
+    int ret;                    /* 0 or -1 on corrupt input */
+} PageCompressJob;
+
+/**
+ * page_compress_pool_new: Create a pool and start its worker threads
+ *
+ * @threads: number of worker threads
+ * @nb_jobs: number of pages per batch
+ * @page_size: size of a page
+ * @level: zlib level, 1-9, or 0 for a pool that decompresses
+ */
+PageCompressPool *page_compress_pool_new(int threads, int nb_jobs,
+                                         size_t page_size, int level);
+void page_compress_pool_free(PageCompressPool *pool);
+
+/* Maximum size of the deflated data of one page */
+size_t page_compress_bound(PageCompressPool *pool);
+
+/* Return the next free job, or NULL if the batch is full */
+PageCompressJob *page_compress_get(PageCompressPool *pool);
+bool page_compress_full(PageCompressPool *pool);
+int page_compress_count(PageCompressPool *pool);
+PageCompressJob *page_compress_job(PageCompressPool *pool, int i);
+
+/* Process all queued jobs and wait for them.  Returns -1 if any failed. */
+int page_compress_run(PageCompressPool *pool);
+void page_compress_reset(PageCompressPool *pool);
+
+#endif
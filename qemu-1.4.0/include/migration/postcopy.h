@@ -0,0 +1,72 @@
+/*
+ * Post-copy live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_POSTCOPY_H
+#define QEMU_POSTCOPY_H
+
+#include "qemu-common.h"
+#include "qapi-types.h"
+
+/* After a bounded pre-copy phase the source stops the guest, tells the
+ * destination which pages went stale since they were sent and passes it the
+ * device state; the guest then runs on the destination while the source
+ * pushes the remaining pages.  Pages the guest touches before they arrive
+ * are caught with userfaultfd and requested over the migration socket,
+ * which is why post-copy needs a socket transport.
+ *
+ * Messages on that return path, destination to source:
+ *
+ *   POSTCOPY_MSG_REQUEST  be64 offset, byte len, len bytes of RAMBlock idstr
+ *   POSTCOPY_MSG_DONE     be64 faults, be64 total latency, be64 max latency
+ *                         (latencies in microseconds); the last message
+ */
+#define POSTCOPY_MSG_REQUEST    1
+#define POSTCOPY_MSG_DONE       2
+
+/* Source side */
+
+/* Whether @fd can carry the return path */
+bool postcopy_outgoing_possible(int fd);
+
+/* Start reading the return path of @fd */
+void postcopy_outgoing_start(int fd);
+
+/* Pop the oldest page the destination asked for, false if there is none */
+bool postcopy_outgoing_get_request(char *idstr, uint64_t *offset);
+
+/* Wait for the destination's POSTCOPY_MSG_DONE, or with @abort stop reading
+ * right away.  Returns 0 if the destination reported it got everything.
+ */
+int postcopy_outgoing_finish(bool abort);
+
+void postcopy_outgoing_get_info(PostcopyInfo *info);
+
+/* Destination side */
+
+/* Prepare to catch faults on guest RAM; replies go to @fd */
+int postcopy_incoming_init(int fd);
+
+int postcopy_incoming_register(void *host, size_t length, const char *idstr);
+
+/* Drop pages that went stale, so that touching them faults */
+void postcopy_incoming_discard(void *host, size_t length);
+
+/* Hand the rest of @f, the page stream, to a thread of its own; that thread
+ * closes @f once all pages are in.
+ */
+int postcopy_incoming_start(QEMUFile *f);
+
+/* True once the incoming migration has switched to post-copy */
+bool postcopy_incoming_started(void);
+
+/* Fill a missing page and wake whoever waits for it; @data NULL means a
+ * page of zeroes
+ */
+int postcopy_incoming_place_page(void *host, const uint8_t *data);
+
+#endif
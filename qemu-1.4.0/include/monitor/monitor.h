@@ -18,6 +18,10 @@ extern Monitor *default_mon;
 
 /* flags for monitor commands */
 #define MONITOR_CMD_ASYNC       0x0001
+/* May run in the QMP monitor thread, without the global mutex: the command
+ * takes no arguments, cannot fail and only reads state that is safe to read
+ * from any thread. */
+#define MONITOR_CMD_LOCKLESS    0x0002
 
 /* QMP events */
 typedef enum MonitorEvent {
@@ -45,6 +49,7 @@ typedef enum MonitorEvent {
     QEVENT_WAKEUP,
     QEVENT_BALLOON_CHANGE,
     QEVENT_SPICE_MIGRATE_COMPLETED,
+    QEVENT_DUMP_COMPLETED,
 
     /* Add to 'monitor_event_names' array in monitor.c when
      * defining new events here */
@@ -56,6 +61,8 @@ int monitor_cur_is_qmp(void);
 
 void monitor_protocol_event(MonitorEvent event, QObject *data);
 void monitor_init(CharDriverState *chr, int flags);
+/* Serve QMP on the socket @address from a thread of its own */
+void monitor_thread_init(const char *address);
 
 int monitor_suspend(Monitor *mon);
 void monitor_resume(Monitor *mon);
@@ -20,7 +20,22 @@
 
 #include <stdint.h>
 
+/* The sum of @buf as big-endian 16-bit words, to be passed, possibly added
+ * to other such sums, to net_checksum_finish().  Long buffers are summed
+ * with the best vector instructions the host has, which may fold the sum
+ * differently from the portable version but always to the same checksum.
+ */
 uint32_t net_checksum_add(int len, uint8_t *buf);
+/* Copy @len bytes from @src to @dst and return their sum, in one pass */
+uint32_t net_checksum_add_copy(int len, uint8_t *dst, const uint8_t *src);
+
+/* Portable versions of the above, and the name of the implementation
+ * picked at startup, for the tests
+ */
+uint32_t net_checksum_add_c(int len, const uint8_t *buf);
+uint32_t net_checksum_add_copy_c(int len, uint8_t *dst, const uint8_t *src);
+const char *net_checksum_accel_name(void);
+
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
@@ -8,6 +8,7 @@
 #include "net/queue.h"
 #include "migration/vmstate.h"
 #include "qapi-types.h"
+#include "qemu/histogram.h"
 
 #define MAX_QUEUE_NUM 1024
 
@@ -43,6 +44,7 @@ typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
+typedef void (NetReceiveBatch)(NetClientState *, bool start);
 typedef void (NetClientDestructor)(NetClientState *);
 
 typedef struct NetClientInfo {
@@ -55,6 +57,9 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    NetReceiveBatch *receive_batch;
+    /* the NIC fills in tx_latency when it is set */
+    bool tx_latency;
 } NetClientInfo;
 
 struct NetClientState {
@@ -69,6 +74,7 @@ struct NetClientState {
     unsigned receive_disabled : 1;
     NetClientDestructor *destructor;
     unsigned int queue_index;
+    LatencyHistogram *tx_latency;
 };
 
 typedef struct NICState {
@@ -109,6 +115,9 @@ void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+/* Packets sent between these two may be handed to the guest all at once */
+void qemu_send_batch_begin(NetClientState *nc);
+void qemu_send_batch_end(NetClientState *nc);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
@@ -43,6 +43,9 @@ int tap_get_fd(NetClientState *nc);
 struct vhost_net;
 struct vhost_net *tap_get_vhost_net(NetClientState *nc);
 
+/* Statistics of tap queue @nc, or NULL where they are not kept */
+NetdevQueueInfo *tap_get_queue_info(NetClientState *nc);
+
 struct virtio_net_hdr
 {
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM     1       // Use csum_start, csum_offset
@@ -14,6 +14,7 @@
 #ifndef QEMU_JSON_LEXER_H
 #define QEMU_JSON_LEXER_H
 
+#include <glib.h>
 #include "qapi/qmp/qstring.h"
 #include "qapi/qmp/qlist.h"
 
@@ -28,15 +29,24 @@ typedef enum json_token_type {
     JSON_ERROR,
 } JSONTokenType;
 
+/* A token as the streamer hands it to the parser.  The text follows the
+ * structure, so that each token is a single allocation.
+ */
+typedef struct JSONToken {
+    JSONTokenType type;
+    int x, y;
+    char str[];
+} JSONToken;
+
 typedef struct JSONLexer JSONLexer;
 
-typedef void (JSONLexerEmitter)(JSONLexer *, QString *, JSONTokenType, int x, int y);
+typedef void (JSONLexerEmitter)(JSONLexer *, GString *, JSONTokenType, int x, int y);
 
 struct JSONLexer
 {
     JSONLexerEmitter *emit;
     int state;
-    QString *token;
+    GString *token;
     int x, y;
 };
 
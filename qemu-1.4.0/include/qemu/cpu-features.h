@@ -0,0 +1,18 @@
+/*
+ * Host CPU feature detection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPU_FEATURES_H
+#define QEMU_CPU_FEATURES_H
+
+#include <stdbool.h>
+
+/* Whether AVX2 code may run: the CPU has it and the OS saves the upper
+ * halves of the ymm registers.  Always false unless QEMU was built with
+ * CONFIG_AVX2_OPT.  Safe to call from constructors. */
+bool qemu_cpu_has_avx2(void);
+
+#endif
@@ -116,6 +116,45 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_merge:
+ * @a: HBitmap to store the result in.
+ * @b: HBitmap to merge into @a.
+ *
+ * Set in @a every bit that is set in @b.  Return false, leaving @a
+ * untouched, if the two bitmaps differ in size or granularity.
+ */
+bool hbitmap_merge(HBitmap *a, const HBitmap *b);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes hbitmap_serialize needs for @hb.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb);
+
+/**
+ * hbitmap_serialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size(@hb) bytes.
+ *
+ * Store the bits of @hb in @buf, one bit per granularity-sized group with
+ * bit N in bit N % 8 of byte N / 8.  The format does not depend on the host.
+ */
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf);
+
+/**
+ * hbitmap_deserialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size(@hb) bytes.
+ *
+ * Replace the contents of @hb with those stored in @buf by
+ * hbitmap_serialize.  @hb must have the same size and granularity that
+ * the serialized bitmap had.
+ */
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -0,0 +1,52 @@
+/*
+ * Latency histograms
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_HISTOGRAM_H
+#define QEMU_HISTOGRAM_H
+
+#include <stdint.h>
+#include "qapi-types.h"
+#include "qapi/error.h"
+#include "qemu/host-utils.h"
+
+/* A histogram of latencies with log2 bins: [0, min), [min, 2 * min),
+ * [2 * min, 4 * min) and so on, the last bin being open-ended.  Adding a
+ * sample is a division and a count of leading zeros, cheap enough for
+ * every request of a device.  There is no locking; callers serialize.
+ */
+typedef struct LatencyHistogram {
+    uint64_t min_ns;
+    int nbins;
+    uint64_t bins[];
+} LatencyHistogram;
+
+/* 1us to 4s and everything above */
+#define LATENCY_HISTOGRAM_DEFAULT_MIN_NS    1000
+#define LATENCY_HISTOGRAM_DEFAULT_BINS      24
+#define LATENCY_HISTOGRAM_MAX_BINS          64
+
+/* Returns NULL and sets @errp if @min_ns or @nbins are out of range */
+LatencyHistogram *latency_histogram_new(int64_t min_ns, int64_t nbins,
+                                        Error **errp);
+void latency_histogram_free(LatencyHistogram *hist);
+
+static inline void latency_histogram_add(LatencyHistogram *hist, int64_t ns)
+{
+    uint64_t q = ns > 0 ? ns / hist->min_ns : 0;
+    int bin = q ? 64 - clz64(q) : 0;
+
+    hist->bins[bin < hist->nbins ? bin : hist->nbins - 1]++;
+}
+
+/* The end of the bin holding the @pct-th percentile of the samples, or the
+ * start of the last bin if it is there; 0 if @hist is empty */
+int64_t latency_histogram_percentile(const LatencyHistogram *hist, int pct);
+
+/* A snapshot of @hist for the query commands */
+LatencyHistogramInfo *latency_histogram_info(const LatencyHistogram *hist);
+
+#endif
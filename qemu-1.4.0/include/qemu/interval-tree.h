@@ -0,0 +1,59 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* An intrusive set of closed intervals [start, last] that answers "does
+ * anything overlap this range" in O(log n).  It is a treap ordered by start
+ * where every node also records the largest @last of its subtree.
+ *
+ * Embed an IntervalTreeNode in the tracked object and use container_of()
+ * to get back to it.  A zero-initialized IntervalTree is empty.  There is
+ * no locking; callers serialize access.
+ */
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    int64_t start;
+    int64_t last;
+    /* private */
+    int64_t subtree_last;
+    uint32_t priority;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+};
+
+typedef struct IntervalTree {
+    IntervalTreeNode *root;
+    uint32_t seed;
+} IntervalTree;
+
+static inline bool interval_tree_empty(IntervalTree *tree)
+{
+    return tree->root == NULL;
+}
+
+/* Add @node, whose start and last must be set, with start <= last.  Equal
+ * and overlapping intervals may be inserted any number of times.
+ */
+void interval_tree_insert(IntervalTree *tree, IntervalTreeNode *node);
+
+/* Remove @node, which must be in @tree */
+void interval_tree_remove(IntervalTree *tree, IntervalTreeNode *node);
+
+/* Return the node with the lowest start among those overlapping
+ * [start, last], or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_find(IntervalTree *tree,
+                                     int64_t start, int64_t last);
+
+#endif
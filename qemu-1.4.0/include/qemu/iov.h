@@ -57,6 +57,13 @@ size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
 size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, int fillc, size_t bytes);
 
+/*
+ * Check whether `bytes' bytes of the iovec, starting at `offset', are all
+ * zero.  Elements may have any length and alignment.
+ */
+bool iov_is_zero(const struct iovec *iov, const unsigned int iov_cnt,
+                 size_t offset, size_t bytes);
+
 /*
  * Send/recv data from/to iovec buffers directly
  *
@@ -0,0 +1,41 @@
+/*
+ * Pixel format conversion helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_PIXEL_CONV_H
+#define QEMU_PIXEL_CONV_H
+
+#include <stdint.h>
+
+/* Convert one scanline of @width little-endian guest pixels at @s into
+ * host-endian 32-bit pixels at @d.  "32" is x8r8g8b8 and "32bgr" is
+ * x8b8g8r8, and 8 bpp sources are RGB332; the x byte is always written as
+ * zero and the low bits of narrower components are not replicated,
+ * exactly as in vga_template.h and xenfb.c.
+ *
+ * The function pointers start out pointing to the portable versions and
+ * are switched to the best vector implementation the host CPU supports
+ * before main() runs.
+ */
+typedef void PixelConvFunc(uint8_t *d, const uint8_t *s, int width);
+
+extern PixelConvFunc *pixel_conv_8_to_32;
+extern PixelConvFunc *pixel_conv_15_to_32;
+extern PixelConvFunc *pixel_conv_16_to_32;
+extern PixelConvFunc *pixel_conv_24_to_32;
+extern PixelConvFunc *pixel_conv_32_to_32bgr;
+
+/* Portable reference implementations */
+PixelConvFunc pixel_conv_8_to_32_c;
+PixelConvFunc pixel_conv_15_to_32_c;
+PixelConvFunc pixel_conv_16_to_32_c;
+PixelConvFunc pixel_conv_24_to_32_c;
+PixelConvFunc pixel_conv_32_to_32bgr_c;
+
+/* Name of the implementation selected at startup, for diagnostics */
+const char *pixel_conv_accel_name(void);
+
+#endif
@@ -59,6 +59,7 @@ uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts);
 
 void qemu_run_timers(QEMUClock *clock);
 void qemu_run_all_timers(void);
+void qemu_timer_info(fprintf_function mon_printf, void *f);
 void configure_alarms(char const *opt);
 void init_clocks(void);
 int init_timer_alarm(void);
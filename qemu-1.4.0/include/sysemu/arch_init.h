@@ -36,4 +36,7 @@ int xen_available(void);
 
 CpuDefinitionInfoList *arch_query_cpu_definitions(Error **errp);
 
+/* True if all bytes of the target page at @page are the same */
+int is_dup_page(uint8_t *page);
+
 #endif
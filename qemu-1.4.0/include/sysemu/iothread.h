@@ -0,0 +1,45 @@
+/*
+ * Event loop threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef IOTHREAD_H
+#define IOTHREAD_H
+
+#include "qom/object.h"
+#include "block/aio.h"
+
+#define TYPE_IOTHREAD "iothread"
+#define IOTHREAD(obj) OBJECT_CHECK(IOThread, (obj), TYPE_IOTHREAD)
+
+typedef struct IOThread IOThread;
+typedef void IOThreadFunc(void *opaque);
+
+/* An iothread runs aio_poll() on its own AioContext in a thread of its
+ * own, so that the handlers added to the context run outside the main
+ * loop and without the global mutex.  The user creates them with
+ * "-object iothread,id=<name>"; devices then name the one they run in.
+ */
+
+/* The iothread created with id @id, or NULL if there is none */
+IOThread *iothread_find(const char *id);
+
+/* Take a reference to the iothread @id, creating it if needed, or to a new
+ * private iothread if @id is NULL.  The thread starts from the main loop, so
+ * that it inherits the main loop's and not a vcpu's CPU affinity.
+ */
+IOThread *iothread_get(const char *id);
+void iothread_put(IOThread *iothread);
+
+AioContext *iothread_get_aio_context(IOThread *iothread);
+
+/* Run @func in @iothread between two events and wait for it to return.
+ * Handlers are only added to or removed from the context this way, since
+ * the thread may be walking them at any time.
+ */
+void iothread_run(IOThread *iothread, IOThreadFunc *func, void *opaque);
+
+#endif /* IOTHREAD_H */
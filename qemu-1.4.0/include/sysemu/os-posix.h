@@ -48,4 +48,11 @@ int qemu_utimens(const char *path, const qemu_timespec *times);
 
 bool is_daemonized(void);
 
+#ifdef __linux__
+#include <sched.h>
+
+/* Parses a list of host CPUs such as "0-3,8,10-11" into @set */
+int qemu_parse_cpu_list(const char *str, cpu_set_t *set);
+#endif
+
 #endif
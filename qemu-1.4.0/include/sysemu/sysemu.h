@@ -65,6 +65,9 @@ void qemu_remove_exit_notifier(Notifier *notify);
 
 void qemu_add_machine_init_done_notifier(Notifier *notify);
 
+/* Log, with -d startup, the time since the previous phase of startup */
+void qemu_startup_phase(const char *phase);
+
 void do_savevm(Monitor *mon, const QDict *qdict);
 int load_vmstate(const char *name);
 void do_delvm(Monitor *mon, const QDict *qdict);
@@ -73,10 +76,15 @@ void do_info_snapshots(Monitor *mon, const QDict *qdict);
 void qemu_announce_self(void);
 
 bool qemu_savevm_state_blocked(Error **errp);
+/* Called before the state of the VM is saved for migration or a snapshot,
+ * for contents of guest memory that are only filled in on demand.
+ */
+void qemu_add_savevm_begin_notifier(Notifier *notify);
 int qemu_savevm_state_begin(QEMUFile *f,
                             const MigrationParams *params);
 int qemu_savevm_state_iterate(QEMUFile *f);
 int qemu_savevm_state_complete(QEMUFile *f);
+int qemu_savevm_state_postcopy(QEMUFile *f);
 void qemu_savevm_state_cancel(void);
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
 int qemu_loadvm_state(QEMUFile *f);
@@ -91,6 +99,7 @@ typedef enum DisplayType
     DT_SDL,
     DT_NOGRAPHIC,
     DT_SURFMAN,
+    DT_SHM,
     DT_NONE,
 } DisplayType;
 
@@ -133,6 +142,7 @@ extern QEMUClock *rtc_clock;
 extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern unsigned long *node_cpumask[MAX_NODES];
+extern int node_host[MAX_NODES];
 
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
@@ -17,7 +17,7 @@ typedef hwaddr (*phys_offset_to_gaddr_t)(hwaddr start_addr,
 #ifdef CONFIG_XEN
 
 void xen_map_cache_init(phys_offset_to_gaddr_t f,
-                        void *opaque);
+                        void *opaque, uint64_t max_size);
 uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
                        uint8_t lock);
 ram_addr_t xen_ram_addr_from_mapcache(void *ptr);
@@ -27,7 +27,7 @@ void xen_invalidate_map_cache(void);
 #else
 
 static inline void xen_map_cache_init(phys_offset_to_gaddr_t f,
-                                      void *opaque)
+                                      void *opaque, uint64_t max_size)
 {
 }
 
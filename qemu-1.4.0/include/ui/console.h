@@ -61,6 +61,16 @@ void kbd_put_ledstate(int ledstate);
 void kbd_mouse_event(int dx, int dy, int dz, int buttons_state);
 void kbd_mouse_event_absolute(int x, int y, int dz, int buttons_state);
 
+/*
+ * Latency of host input events.  The source of the events sets the time
+ * they arrived while it hands them to the emulated devices; a device that
+ * saves the stamp reports it once the guest can see the event.  A zero
+ * stamp means the events are not timed.
+ */
+void qemu_input_set_stamp(int64_t stamp);
+int64_t qemu_input_get_stamp(void);
+void qemu_input_latency(InputLatencyStage stage, int64_t stamp);
+
 /* Does the current mouse generate absolute events */
 int kbd_mouse_is_absolute(void);
 void qemu_add_mouse_mode_change_notifier(Notifier *notify);
@@ -502,8 +512,12 @@ static inline int vnc_display_pw_expire(DisplayState *ds, time_t expires)
 #endif
 
 #ifdef CONFIG_SURFMAN
+/* shm-display.c */
+void shm_display_init(DisplayState *ds, const char *name);
+
 /* surfman.c */
 void surfman_display_init(DisplayState *ds);
+void surfman_input_activity(void);
 #endif
 
 /* curses.c */
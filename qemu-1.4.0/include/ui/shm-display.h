@@ -0,0 +1,63 @@
+/*
+ * Shared memory display: layout of the shared object
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_SHM_DISPLAY_H
+#define QEMU_SHM_DISPLAY_H
+
+#include <stdint.h>
+
+/*
+ * "-display shm" keeps a copy of the guest's display surface in a POSIX
+ * shared memory object, for a compositor on the same host to map and
+ * scan out or texture from directly.  QEMU is the only writer.  The
+ * object starts with a ShmDisplayHeader; the pixels follow at
+ * data_offset, stride bytes per line, in the pixman format @format.
+ *
+ * The object only grows.  A reader that finds map_size larger than what
+ * it has mapped maps it again.
+ *
+ * Geometry: geometry_seq is odd while width, height, stride, format and
+ * data_offset change.  Read geometry_seq, then the fields, then
+ * geometry_seq again; retry unless both reads give the same even value.
+ * A change of geometry is followed by damage covering the whole surface.
+ *
+ * Damage: QEMU copies the pixels of a rectangle first, then stores the
+ * rectangle at damage[damage_head % SHM_DISPLAY_RING_SIZE] and only then
+ * increments damage_head, with write barriers in between.  A reader keeps
+ * its own tail.  It reads damage_head, then entries tail to head - 1, then
+ * damage_head again.  If either read is more than SHM_DISPLAY_RING_SIZE
+ * ahead of the tail, entries were overwritten: redraw everything and
+ * continue from the last value read.  There is no notification; readers
+ * poll damage_head, typically once per frame of their own.
+ */
+
+#define SHM_DISPLAY_MAGIC       0x51534450  /* "QSDP" */
+#define SHM_DISPLAY_VERSION     1
+#define SHM_DISPLAY_RING_SIZE   256         /* a power of two */
+
+typedef struct ShmDisplayRect {
+    uint16_t x, y, w, h;
+} ShmDisplayRect;
+
+typedef struct ShmDisplayHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t map_size;
+
+    uint32_t geometry_seq;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+    uint32_t data_offset;
+
+    uint32_t damage_head;
+    uint32_t reserved;
+    ShmDisplayRect damage[SHM_DISPLAY_RING_SIZE];
+} ShmDisplayHeader;
+
+#endif
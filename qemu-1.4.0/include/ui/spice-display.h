@@ -93,6 +93,15 @@ struct SimpleSpiceDisplay {
     QTAILQ_HEAD(, SimpleSpiceUpdate) updates;
     QEMUCursor *cursor;
     int mouse_x, mouse_y;
+
+    /*
+     * Released updates kept for reuse.  They are released from the spice
+     * server thread, sometimes with the lock above held, so the pool has
+     * a lock of its own.
+     */
+    QemuMutex pool_lock;
+    QTAILQ_HEAD(, SimpleSpiceUpdate) pool;
+    size_t pool_bytes;
 };
 
 struct SimpleSpiceUpdate {
@@ -100,6 +109,7 @@ struct SimpleSpiceUpdate {
     QXLImage image;
     QXLCommandExt ext;
     uint8_t *bitmap;
+    size_t bitmap_size;
     QTAILQ_ENTRY(SimpleSpiceUpdate) next;
 };
 
@@ -0,0 +1,172 @@
+/*
+ * Counting profiler for device register accesses
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "exec/io-profile.h"
+#include "qemu/thread.h"
+#include "qmp-commands.h"
+
+typedef struct IOProfileKey {
+    MemoryRegion *mr;
+    hwaddr offset;
+    bool pio;
+} IOProfileKey;
+
+typedef struct IOProfileEntry {
+    IOProfileKey key;
+    char *region;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_ns;
+    uint64_t write_ns;
+} IOProfileEntry;
+
+bool io_profile_enabled;
+
+/* Regions marked thread safe are dispatched without the global mutex, so
+ * the table has a lock of its own.
+ */
+static QemuMutex io_profile_lock;
+static GHashTable *io_profile_table;
+
+static guint io_profile_hash(gconstpointer p)
+{
+    const IOProfileKey *key = p;
+
+    return ((uintptr_t)key->mr >> 4) ^ (key->offset * 0x9e3779b1) ^ key->pio;
+}
+
+static gboolean io_profile_equal(gconstpointer a, gconstpointer b)
+{
+    const IOProfileKey *ka = a, *kb = b;
+
+    return ka->mr == kb->mr && ka->offset == kb->offset && ka->pio == kb->pio;
+}
+
+static void io_profile_free_entry(gpointer p)
+{
+    IOProfileEntry *e = p;
+
+    g_free(e->region);
+    g_free(e);
+}
+
+void io_profile_record(MemoryRegion *mr, hwaddr offset, bool pio,
+                       bool write, int64_t start_ns)
+{
+    int64_t ns = get_clock() - start_ns;
+    IOProfileKey key = { .mr = mr, .offset = offset, .pio = pio };
+    IOProfileEntry *e;
+
+    qemu_mutex_lock(&io_profile_lock);
+    e = g_hash_table_lookup(io_profile_table, &key);
+    if (!e) {
+        e = g_malloc0(sizeof(*e));
+        e->key = key;
+        e->region = g_strdup(!mr ? "ioport" :
+                             mr->name ? mr->name : "unnamed");
+        g_hash_table_insert(io_profile_table, &e->key, e);
+    }
+    if (write) {
+        e->writes++;
+        e->write_ns += ns;
+    } else {
+        e->reads++;
+        e->read_ns += ns;
+    }
+    qemu_mutex_unlock(&io_profile_lock);
+}
+
+static gboolean io_profile_match_region(gpointer key, gpointer value,
+                                        gpointer opaque)
+{
+    return ((IOProfileKey *)key)->mr == opaque;
+}
+
+void io_profile_forget(MemoryRegion *mr)
+{
+    if (!io_profile_table) {
+        return;
+    }
+    qemu_mutex_lock(&io_profile_lock);
+    g_hash_table_foreach_remove(io_profile_table, io_profile_match_region, mr);
+    qemu_mutex_unlock(&io_profile_lock);
+}
+
+void qmp_mmio_profile_set(bool enable, Error **errp)
+{
+    if (!io_profile_table) {
+        qemu_mutex_init(&io_profile_lock);
+        io_profile_table = g_hash_table_new_full(io_profile_hash,
+                                                 io_profile_equal, NULL,
+                                                 io_profile_free_entry);
+    }
+
+    /* Starting again starts from zero; stopping keeps the counts around */
+    if (enable) {
+        qemu_mutex_lock(&io_profile_lock);
+        g_hash_table_remove_all(io_profile_table);
+        qemu_mutex_unlock(&io_profile_lock);
+    }
+    io_profile_enabled = enable;
+}
+
+static gint io_profile_compare(gconstpointer a, gconstpointer b)
+{
+    const IOProfileEntry *ea = a, *eb = b;
+    uint64_t na = ea->reads + ea->writes, nb = eb->reads + eb->writes;
+
+    return na < nb ? 1 : na > nb ? -1 : 0;
+}
+
+MmioProfileEntryList *qmp_query_mmio_profile(bool has_limit, int64_t limit,
+                                             Error **errp)
+{
+    MmioProfileEntryList *head = NULL, **tail = &head, *entry;
+    GList *entries, *l;
+
+    if (!io_profile_table) {
+        return NULL;
+    }
+
+    /* Copy the counters so that the lock is not held while sorting */
+    qemu_mutex_lock(&io_profile_lock);
+    entries = g_hash_table_get_values(io_profile_table);
+    for (l = entries; l; l = l->next) {
+        IOProfileEntry *copy = g_memdup(l->data, sizeof(IOProfileEntry));
+
+        copy->region = g_strdup(copy->region);
+        l->data = copy;
+    }
+    qemu_mutex_unlock(&io_profile_lock);
+
+    entries = g_list_sort(entries, io_profile_compare);
+    for (l = entries; l; l = l->next) {
+        IOProfileEntry *e = l->data;
+        MmioProfileEntry *info;
+
+        if (!has_limit || limit-- > 0) {
+            info = g_malloc0(sizeof(*info));
+            info->region = e->region;
+            info->pio = e->key.pio;
+            info->offset = e->key.offset;
+            info->reads = e->reads;
+            info->writes = e->writes;
+            info->read_ns = e->read_ns;
+            info->write_ns = e->write_ns;
+            entry = g_malloc0(sizeof(*entry));
+            entry->value = info;
+            *tail = entry;
+            tail = &entry->next;
+        } else {
+            g_free(e->region);
+        }
+        g_free(e);
+    }
+    g_list_free(entries);
+    return head;
+}
@@ -28,6 +28,7 @@
 #include "exec/ioport.h"
 #include "trace.h"
 #include "exec/memory.h"
+#include "exec/io-profile.h"
 
 /***********************************************************/
 /* IO Port */
@@ -56,6 +57,48 @@ static IOPortDestructor *ioport_destructor_table[MAX_IOPORTS];
 
 static IOPortReadFunc default_ioport_readb, default_ioport_readw, default_ioport_readl;
 static IOPortWriteFunc default_ioport_writeb, default_ioport_writew, default_ioport_writel;
+static IOPortReadFunc ioport_readb_thunk, ioport_readw_thunk, ioport_readl_thunk;
+static IOPortWriteFunc ioport_writeb_thunk, ioport_writew_thunk, ioport_writel_thunk;
+
+/* Ports of memory regions are profiled by memory.c, under their region */
+static uint32_t ioport_read_profiled(IOPortReadFunc *func, int index,
+                                     uint32_t address)
+{
+    static IOPortReadFunc * const thunk_func[3] = {
+        ioport_readb_thunk,
+        ioport_readw_thunk,
+        ioport_readl_thunk
+    };
+    int64_t start;
+    uint32_t val;
+
+    if (func == thunk_func[index]) {
+        return func(ioport_opaque[address], address);
+    }
+    start = get_clock();
+    val = func(ioport_opaque[address], address);
+    io_profile_record(NULL, address, true, false, start);
+    return val;
+}
+
+static void ioport_write_profiled(IOPortWriteFunc *func, int index,
+                                  uint32_t address, uint32_t data)
+{
+    static IOPortWriteFunc * const thunk_func[3] = {
+        ioport_writeb_thunk,
+        ioport_writew_thunk,
+        ioport_writel_thunk
+    };
+    int64_t start;
+
+    if (func == thunk_func[index]) {
+        func(ioport_opaque[address], address, data);
+        return;
+    }
+    start = get_clock();
+    func(ioport_opaque[address], address, data);
+    io_profile_record(NULL, address, true, true, start);
+}
 
 static uint32_t ioport_read(int index, uint32_t address)
 {
@@ -67,6 +110,9 @@ static uint32_t ioport_read(int index, uint32_t address)
     IOPortReadFunc *func = ioport_read_table[index][address];
     if (!func)
         func = default_func[index];
+    if (unlikely(io_profile_enabled)) {
+        return ioport_read_profiled(func, index, address);
+    }
     return func(ioport_opaque[address], address);
 }
 
@@ -80,6 +126,10 @@ static void ioport_write(int index, uint32_t address, uint32_t data)
     IOPortWriteFunc *func = ioport_write_table[index][address];
     if (!func)
         func = default_func[index];
+    if (unlikely(io_profile_enabled)) {
+        ioport_write_profiled(func, index, address, data);
+        return;
+    }
     func(ioport_opaque[address], address, data);
 }
 
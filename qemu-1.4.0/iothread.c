@@ -0,0 +1,203 @@
+/*
+ * Event loop threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "qemu/event_notifier.h"
+#include "qemu/error-report.h"
+#include "qom/object.h"
+#include "sysemu/iothread.h"
+
+struct IOThread {
+    Object parent_obj;
+
+    AioContext *ctx;
+    QemuThread thread;
+    QEMUBH *start_bh;               /* in the main loop, until it starts */
+    bool running;
+    bool stopping;
+    EventNotifier stop_notifier;
+
+    /* Pending iothread_run() request; lock also covers running */
+    QemuMutex lock;
+    QemuCond cond;
+    QEMUBH *run_bh;
+    IOThreadFunc *func;
+    void *opaque;
+};
+
+static void iothread_stop_event(EventNotifier *notifier)
+{
+    event_notifier_test_and_clear(notifier);
+}
+
+/* aio_poll() only waits while some handler says it has work pending; this
+ * one always does, so that an idle thread sleeps rather than spins.
+ */
+static int iothread_stop_flush(EventNotifier *notifier)
+{
+    return 1;
+}
+
+static void *iothread_fn(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    while (!iothread->stopping) {
+        aio_poll(iothread->ctx, true);
+    }
+    return NULL;
+}
+
+static void iothread_run_bh(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    qemu_mutex_lock(&iothread->lock);
+    if (iothread->func) {
+        iothread->func(iothread->opaque);
+        iothread->func = NULL;
+        qemu_cond_broadcast(&iothread->cond);
+    }
+    qemu_mutex_unlock(&iothread->lock);
+}
+
+static void iothread_start_bh(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    qemu_mutex_lock(&iothread->lock);
+    qemu_bh_delete(iothread->start_bh);
+    iothread->start_bh = NULL;
+    iothread->running = true;
+    qemu_thread_create(&iothread->thread, iothread_fn, iothread,
+                       QEMU_THREAD_JOINABLE);
+    qemu_mutex_unlock(&iothread->lock);
+}
+
+void iothread_run(IOThread *iothread, IOThreadFunc *func, void *opaque)
+{
+    qemu_mutex_lock(&iothread->lock);
+    if (!iothread->running) {
+        /* Nothing else can be looking at the handlers yet */
+        func(opaque);
+        qemu_mutex_unlock(&iothread->lock);
+        return;
+    }
+
+    assert(!iothread->func);
+    iothread->func = func;
+    iothread->opaque = opaque;
+    qemu_bh_schedule(iothread->run_bh);
+    while (iothread->func) {
+        qemu_cond_wait(&iothread->cond, &iothread->lock);
+    }
+    qemu_mutex_unlock(&iothread->lock);
+}
+
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    return iothread->ctx;
+}
+
+IOThread *iothread_find(const char *id)
+{
+    Object *container = container_get(object_get_root(), "/objects");
+    Object *obj = object_resolve_path_component(container, id);
+
+    return obj ? (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD) : NULL;
+}
+
+IOThread *iothread_get(const char *id)
+{
+    IOThread *iothread = NULL;
+    Object *obj;
+
+    if (id) {
+        iothread = iothread_find(id);
+    }
+    if (iothread) {
+        object_ref(OBJECT(iothread));
+        return iothread;
+    }
+
+    /* A named thread is shared with the devices that name it later, as if
+     * it had been created with -object.
+     */
+    obj = object_new(TYPE_IOTHREAD);
+    if (id) {
+        object_property_add_child(container_get(object_get_root(),
+                                                "/objects"),
+                                  id, obj, NULL);
+    }
+    return IOTHREAD(obj);
+}
+
+void iothread_put(IOThread *iothread)
+{
+    object_unref(OBJECT(iothread));
+}
+
+static void iothread_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->ctx = aio_context_new();
+    qemu_mutex_init(&iothread->lock);
+    qemu_cond_init(&iothread->cond);
+    iothread->run_bh = aio_bh_new(iothread->ctx, iothread_run_bh, iothread);
+
+    if (event_notifier_init(&iothread->stop_notifier, 0) < 0) {
+        error_report("failed to init iothread stop notifier");
+        exit(1);
+    }
+    aio_set_event_notifier(iothread->ctx, &iothread->stop_notifier,
+                           iothread_stop_event, iothread_stop_flush);
+
+    iothread->start_bh = qemu_bh_new(iothread_start_bh, iothread);
+    qemu_bh_schedule(iothread->start_bh);
+}
+
+static void iothread_finalize(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    /* Stop the thread or cancel its creation */
+    if (iothread->start_bh) {
+        qemu_bh_delete(iothread->start_bh);
+        iothread->start_bh = NULL;
+    } else {
+        iothread->stopping = true;
+        event_notifier_set(&iothread->stop_notifier);
+        qemu_thread_join(&iothread->thread);
+    }
+
+    aio_set_event_notifier(iothread->ctx, &iothread->stop_notifier,
+                           NULL, NULL);
+    event_notifier_cleanup(&iothread->stop_notifier);
+    qemu_bh_delete(iothread->run_bh);
+    aio_context_unref(iothread->ctx);
+    qemu_cond_destroy(&iothread->cond);
+    qemu_mutex_destroy(&iothread->lock);
+}
+
+static const TypeInfo iothread_info = {
+    .name = TYPE_IOTHREAD,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(IOThread),
+    .instance_init = iothread_init,
+    .instance_finalize = iothread_finalize,
+};
+
+static void iothread_register_types(void)
+{
+    type_register_static(&iothread_info);
+}
+
+type_init(iothread_register_types)
@@ -33,6 +33,8 @@
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "qemu/event_notifier.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 /* This check must be after config-host.h is included */
 #ifdef CONFIG_EVENTFD
@@ -79,6 +81,9 @@ struct KVMState
     bool coalesced_flush_in_progress;
     int broken_set_mem_region;
     int migration_log;
+    /* KVM_GET_DIRTY_LOG buffer, kept from one sync to the next */
+    unsigned long *dirty_bitmap;
+    unsigned long dirty_bitmap_size;
     int vcpu_events;
     int robust_singlestep;
     int debugregs;
@@ -96,9 +101,13 @@ struct KVMState
 #ifdef KVM_CAP_IRQ_ROUTING
     struct kvm_irq_routing *irq_routes;
     int nr_allocated_irq_routes;
+    /* irq_routes differs from what the kernel has */
+    bool irq_routes_dirty;
     uint32_t *used_gsi_bitmap;
     unsigned int gsi_count;
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
+    /* dynamic MSI routes, least recently used first */
+    QTAILQ_HEAD(msi_lru, KVMMSIRoute) msi_lru;
     bool direct_msi;
 #endif
 };
@@ -361,30 +370,13 @@ static int kvm_set_migration_log(int enable)
 static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
                                          unsigned long *bitmap)
 {
-    unsigned int i, j;
-    unsigned long page_number, c;
-    hwaddr addr, addr1;
-    unsigned int len = ((section->size / getpagesize()) + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
-    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
-
     /*
      * bitmap-traveling is faster than memory-traveling (for addr...)
      * especially when most of the memory is not dirty.
      */
-    for (i = 0; i < len; i++) {
-        if (bitmap[i] != 0) {
-            c = leul_to_cpu(bitmap[i]);
-            do {
-                j = ffsl(c) - 1;
-                c &= ~(1ul << j);
-                page_number = (i * HOST_LONG_BITS + j) * hpratio;
-                addr1 = page_number * TARGET_PAGE_SIZE;
-                addr = section->offset_within_region + addr1;
-                memory_region_set_dirty(section->mr, addr,
-                                        TARGET_PAGE_SIZE * hpratio);
-            } while (c != 0);
-        }
-    }
+    memory_region_set_dirty_lebitmap(section->mr,
+                                     section->offset_within_region, bitmap,
+                                     section->size / getpagesize());
     return 0;
 }
 
@@ -402,14 +394,14 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
+    unsigned long size;
     KVMDirtyLog d;
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + section->size;
+    int64_t t0;
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
         if (mem == NULL) {
@@ -430,16 +422,15 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (size > s->dirty_bitmap_size) {
+            s->dirty_bitmap = g_realloc(s->dirty_bitmap, size);
+            s->dirty_bitmap_size = size;
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
-
+        /* the kernel writes all of the slot's bitmap, no need to clear it */
+        d.dirty_bitmap = s->dirty_bitmap;
         d.slot = mem->slot;
 
+        t0 = get_clock();
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
             DPRINTF("ioctl failed %d\n", errno);
             ret = -1;
@@ -447,9 +438,10 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+        trace_kvm_sync_dirty_log(mem->slot, mem->start_addr, mem->memory_size,
+                                 (get_clock() - t0) / 1000);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
 
     return ret;
 }
@@ -844,6 +836,8 @@ int kvm_set_irq(KVMState *s, int irq, int level)
 
     assert(kvm_async_interrupts_enabled());
 
+    kvm_irqchip_commit_routes(s);
+
     event.level = level;
     event.irq = irq;
     ret = kvm_vm_ioctl(s, s->irq_set_ioctl, &event);
@@ -859,6 +853,7 @@ int kvm_set_irq(KVMState *s, int irq, int level)
 typedef struct KVMMSIRoute {
     struct kvm_irq_routing_entry kroute;
     QTAILQ_ENTRY(KVMMSIRoute) entry;
+    QTAILQ_ENTRY(KVMMSIRoute) lru;
 } KVMMSIRoute;
 
 static void set_gsi(KVMState *s, unsigned int gsi)
@@ -897,15 +892,23 @@ static void kvm_init_irq_routing(KVMState *s)
         for (i = 0; i < KVM_MSI_HASHTAB_SIZE; i++) {
             QTAILQ_INIT(&s->msi_hashtab[i]);
         }
+        QTAILQ_INIT(&s->msi_lru);
     }
 
     kvm_arch_init_irq_routing(s);
 }
 
-static void kvm_irqchip_commit_routes(KVMState *s)
+/* Route changes only take effect here, so that a batch of them costs a
+ * single ioctl.  Anything that may deliver through a route commits first.
+ */
+void kvm_irqchip_commit_routes(KVMState *s)
 {
     int ret;
 
+    if (!s->irq_routes_dirty) {
+        return;
+    }
+    s->irq_routes_dirty = false;
     s->irq_routes->flags = 0;
     ret = kvm_vm_ioctl(s, KVM_SET_GSI_ROUTING, s->irq_routes);
     assert(ret == 0);
@@ -937,7 +940,7 @@ static void kvm_add_routing_entry(KVMState *s,
 
     set_gsi(s, entry->gsi);
 
-    kvm_irqchip_commit_routes(s);
+    s->irq_routes_dirty = true;
 }
 
 static int kvm_update_routing_entry(KVMState *s,
@@ -956,6 +959,8 @@ static int kvm_update_routing_entry(KVMState *s,
         entry->flags = new_entry->flags;
         entry->u = new_entry->u;
 
+        /* the route may be in use, by a device or an irqfd */
+        s->irq_routes_dirty = true;
         kvm_irqchip_commit_routes(s);
 
         return 0;
@@ -988,6 +993,7 @@ void kvm_irqchip_release_virq(KVMState *s, int virq)
         if (e->gsi == virq) {
             s->irq_routes->nr--;
             *e = s->irq_routes->entries[s->irq_routes->nr];
+            s->irq_routes_dirty = true;
         }
     }
     clear_gsi(s, virq);
@@ -1000,18 +1006,22 @@ static unsigned int kvm_hash_msi(uint32_t data)
     return data & 0xff;
 }
 
-static void kvm_flush_dynamic_msi_routes(KVMState *s)
+/* Drop the dynamic MSI route used least recently to make room for another
+ * one; false if there is none.
+ */
+static bool kvm_evict_dynamic_msi_route(KVMState *s)
 {
-    KVMMSIRoute *route, *next;
-    unsigned int hash;
+    KVMMSIRoute *route = QTAILQ_FIRST(&s->msi_lru);
 
-    for (hash = 0; hash < KVM_MSI_HASHTAB_SIZE; hash++) {
-        QTAILQ_FOREACH_SAFE(route, &s->msi_hashtab[hash], entry, next) {
-            kvm_irqchip_release_virq(s, route->kroute.gsi);
-            QTAILQ_REMOVE(&s->msi_hashtab[hash], route, entry);
-            g_free(route);
-        }
+    if (!route) {
+        return false;
     }
+    kvm_irqchip_release_virq(s, route->kroute.gsi);
+    QTAILQ_REMOVE(&s->msi_hashtab[kvm_hash_msi(route->kroute.u.msi.data)],
+                  route, entry);
+    QTAILQ_REMOVE(&s->msi_lru, route, lru);
+    g_free(route);
+    return true;
 }
 
 static int kvm_irqchip_get_virq(KVMState *s)
@@ -1033,8 +1043,9 @@ again:
     }
     if (!s->direct_msi && retry) {
         retry = false;
-        kvm_flush_dynamic_msi_routes(s);
-        goto again;
+        if (kvm_evict_dynamic_msi_route(s)) {
+            goto again;
+        }
     }
     return -ENOSPC;
 
@@ -1049,6 +1060,8 @@ static KVMMSIRoute *kvm_lookup_msi_route(KVMState *s, MSIMessage msg)
         if (route->kroute.u.msi.address_lo == (uint32_t)msg.address &&
             route->kroute.u.msi.address_hi == (msg.address >> 32) &&
             route->kroute.u.msi.data == msg.data) {
+            QTAILQ_REMOVE(&s->msi_lru, route, lru);
+            QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
             return route;
         }
     }
@@ -1091,6 +1104,7 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
 
         QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg.data)], route,
                            entry);
+        QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
     }
 
     assert(route->kroute.type == KVM_IRQ_ROUTING_MSI);
@@ -1154,6 +1168,10 @@ static int kvm_irqchip_assign_irqfd(KVMState *s, int fd, int virq, bool assign)
         return -ENOSYS;
     }
 
+    /* the eventfd may be signalled right away */
+    if (assign) {
+        kvm_irqchip_commit_routes(s);
+    }
     return kvm_vm_ioctl(s, KVM_IRQFD, &irqfd);
 }
 
@@ -1163,6 +1181,10 @@ static void kvm_init_irq_routing(KVMState *s)
 {
 }
 
+void kvm_irqchip_commit_routes(KVMState *s)
+{
+}
+
 void kvm_irqchip_release_virq(KVMState *s, int virq)
 {
 }
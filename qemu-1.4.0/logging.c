@@ -1,42 +1,254 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <syslog.h>
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
 #include "logging.h"
 
+/*
+ * Messages are formatted by the caller into a ring and written to syslog
+ * by a thread of its own, so that a slow syslog socket never stalls the
+ * main loop or a vcpu.  When the ring is full messages are dropped and
+ * counted rather than waited for.  On top of that each call site may log
+ * at most LOG_SITE_BURST messages per second; further ones are counted
+ * and reported once the next second starts.
+ */
+
+#define LOG_RING_SIZE       1024
+#define LOG_MSG_MAX         512
+#define LOG_SITE_BURST      100
+#define LOG_SITE_WINDOW_NS  1000000000LL
+
+typedef struct LogSlot {
+    volatile unsigned long seq;
+    char msg[LOG_MSG_MAX];
+} LogSlot;
+
+enum {
+    LOG_THREAD_NONE,
+    LOG_THREAD_STARTING,
+    LOG_THREAD_RUNNING,
+};
+
+static LogSlot log_ring[LOG_RING_SIZE];
+static volatile unsigned long log_ring_head;
+static volatile unsigned long log_ring_tail;
+static volatile int log_dropped;
+static volatile int log_thread_state;
+static QemuSemaphore log_sem;
+static QemuThread log_thread;
+
 void logging_set_prefix(const char *ident)
 {
     closelog();
     openlog(ident, LOG_NOWAIT | LOG_PID, LOG_DAEMON);
 }
 
-static inline void __syslog_vfprintf(const char *format, va_list ap)
+/* Multiple producers; may return NULL if the ring is full */
+static LogSlot *log_ring_reserve(unsigned long *ppos)
+{
+    unsigned long pos = log_ring_head;
+    LogSlot *slot;
+
+    for (;;) {
+        long diff;
+
+        slot = &log_ring[pos % LOG_RING_SIZE];
+        diff = (long)(slot->seq - pos);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&log_ring_head, pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;    /* full */
+        }
+        pos = log_ring_head;
+    }
+
+    *ppos = pos;
+    return slot;
+}
+
+static void log_ring_publish(LogSlot *slot, unsigned long pos)
 {
-    vsyslog(LOG_DAEMON | LOG_NOTICE, format, ap);
+    /* Write the message before publishing the slot.  */
+    smp_wmb();
+    slot->seq = pos + 1;
 }
 
-int qemu_log_vfprintf(FILE *stream, const char *format, va_list ap)
+/* The log thread and the atexit flush may both pop, hence the cmpxchg */
+static bool log_ring_pop(char *buf)
 {
-    __syslog_vfprintf(format, ap);
+    unsigned long pos = log_ring_tail;
+    LogSlot *slot;
+
+    for (;;) {
+        long diff;
+
+        slot = &log_ring[pos % LOG_RING_SIZE];
+        diff = (long)(slot->seq - (pos + 1));
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&log_ring_tail, pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;   /* empty */
+        }
+        pos = log_ring_tail;
+    }
+
+    memcpy(buf, slot->msg, LOG_MSG_MAX);
+    /* Read the message before handing the slot back to producers.  */
+    smp_mb();
+    slot->seq = pos + LOG_RING_SIZE;
+    return true;
+}
+
+static void log_flush(void)
+{
+    char buf[LOG_MSG_MAX];
+    int dropped;
+
+    while (log_ring_pop(buf)) {
+        syslog(LOG_DAEMON | LOG_NOTICE, "%s", buf);
+    }
+
+    dropped = __sync_fetch_and_and(&log_dropped, 0);
+    if (dropped) {
+        syslog(LOG_DAEMON | LOG_WARNING,
+               "log ring full, %d messages dropped", dropped);
+    }
+}
+
+static void *log_thread_fn(void *opaque)
+{
+    for (;;) {
+        qemu_sem_wait(&log_sem);
+        log_flush();
+    }
+    return NULL;
+}
+
+static void log_init_ring(void)
+{
+    int i;
+
+    log_ring_head = log_ring_tail = 0;
+    for (i = 0; i < LOG_RING_SIZE; i++) {
+        log_ring[i].seq = i;
+    }
+}
+
+/* Threads do not survive fork(), daemonizing included.  Messages still in
+ * the ring are the parent's to write.
+ */
+static void log_atfork_child(void)
+{
+    log_init_ring();
+    log_thread_state = LOG_THREAD_NONE;
+}
+
+static void log_start_thread(void)
+{
+    static bool once;
+
+    if (!__sync_bool_compare_and_swap(&log_thread_state, LOG_THREAD_NONE,
+                                      LOG_THREAD_STARTING)) {
+        return;
+    }
+
+    log_init_ring();
+    qemu_sem_init(&log_sem, 0);
+    if (!once) {
+        once = true;
+        atexit(log_flush);
+        pthread_atfork(NULL, NULL, log_atfork_child);
+    }
+    qemu_thread_create(&log_thread, log_thread_fn, NULL,
+                       QEMU_THREAD_DETACHED);
+    smp_wmb();
+    log_thread_state = LOG_THREAD_RUNNING;
+}
+
+static bool log_site_allow(QemuLogSite *site, unsigned int *suppressed)
+{
+    int64_t now = get_clock();
+
+    /* Races between threads logging from the same site only make the
+     * limit a little less exact.
+     */
+    if (now - site->window_start >= LOG_SITE_WINDOW_NS) {
+        site->window_start = now;
+        site->count = 0;
+        *suppressed = site->suppressed;
+        site->suppressed = 0;
+    }
+    if (site->count >= LOG_SITE_BURST) {
+        site->suppressed++;
+        return false;
+    }
+    site->count++;
+    return true;
+}
+
+int qemu_log_vfprintf(QemuLogSite *site, FILE *stream, const char *format,
+                      va_list ap)
+{
+    unsigned int suppressed = 0;
+    unsigned long pos;
+    LogSlot *slot;
+    int len;
+
+    if (!log_site_allow(site, &suppressed)) {
+        return 0;
+    }
+
+    if (log_thread_state != LOG_THREAD_RUNNING) {
+        log_start_thread();
+    }
+    if (log_thread_state != LOG_THREAD_RUNNING) {
+        /* Another thread is starting the log thread */
+        vsyslog(LOG_DAEMON | LOG_NOTICE, format, ap);
+        return 0;
+    }
+
+    slot = log_ring_reserve(&pos);
+    if (!slot) {
+        __sync_fetch_and_add(&log_dropped, 1);
+        return 0;
+    }
+
+    len = 0;
+    if (suppressed) {
+        len = snprintf(slot->msg, LOG_MSG_MAX,
+                       "[%u messages suppressed] ", suppressed);
+    }
+    vsnprintf(slot->msg + len, LOG_MSG_MAX - len, format, ap);
+    log_ring_publish(slot, pos);
+    qemu_sem_post(&log_sem);
 
     return 0;
 }
 
-int qemu_log_printf(const char *format, ...)
+int qemu_log_printf(QemuLogSite *site, const char *format, ...)
 {
     va_list ap;
 
     va_start(ap, format);
-    __syslog_vfprintf(format, ap);
+    qemu_log_vfprintf(site, stdout, format, ap);
+    va_end(ap);
 
     return 0;
 }
 
-int qemu_log_fprintf(FILE *stream, const char *format, ...)
+int qemu_log_fprintf(QemuLogSite *site, FILE *stream, const char *format, ...)
 {
     va_list ap;
 
     va_start(ap, format);
-    __syslog_vfprintf(format, ap);
+    qemu_log_vfprintf(site, stream, format, ap);
+    va_end(ap);
 
     return 0;
 }
@@ -14,16 +14,29 @@
 # undef fprintf
 #endif
 
-# define printf(...) qemu_log_printf(__VA_ARGS__)
-# define vfprintf(...) qemu_log_vfprintf(__VA_ARGS__)
-# define fprintf(...) qemu_log_fprintf(__VA_ARGS__)
+/* Per call site state for rate limiting, see logging.c */
+typedef struct QemuLogSite {
+    long long window_start;
+    unsigned int count;
+    unsigned int suppressed;
+} QemuLogSite;
+
+# define QEMU_LOG_SITE(fn, ...) ({                      \
+        static QemuLogSite qemu_log_site_;              \
+        fn(&qemu_log_site_, __VA_ARGS__);               \
+    })
+
+# define printf(...) QEMU_LOG_SITE(qemu_log_printf, __VA_ARGS__)
+# define vfprintf(...) QEMU_LOG_SITE(qemu_log_vfprintf, __VA_ARGS__)
+# define fprintf(...) QEMU_LOG_SITE(qemu_log_fprintf, __VA_ARGS__)
 
 void logging_set_prefix(const char *ident);
-int qemu_log_vfprintf(FILE *stream, const char *format, va_list ap);
-int qemu_log_printf(const char *format, ...)
-  __attribute__ ((format (printf, 1, 2)));
-int qemu_log_fprintf(FILE *stream, const char *format, ...)
+int qemu_log_vfprintf(QemuLogSite *site, FILE *stream, const char *format,
+                      va_list ap);
+int qemu_log_printf(QemuLogSite *site, const char *format, ...)
   __attribute__ ((format (printf, 2, 3)));
+int qemu_log_fprintf(QemuLogSite *site, FILE *stream, const char *format, ...)
+  __attribute__ ((format (printf, 3, 4)));
 
 
 #endif /* !LOGGING_H_ */
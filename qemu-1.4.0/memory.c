@@ -16,6 +16,7 @@
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "exec/ioport.h"
+#include "exec/io-profile.h"
 #include "qemu/bitops.h"
 #include "sysemu/kvm.h"
 #include <assert.h>
@@ -24,6 +25,8 @@
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+/* re-render every address space rather than only what changed */
+static bool memory_region_update_full;
 static bool global_dirty_log = false;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
@@ -380,16 +383,12 @@ static const MemoryRegionPortio *find_portio(MemoryRegion *mr, uint64_t offset,
     return NULL;
 }
 
-static void memory_region_iorange_read(IORange *iorange,
-                                       uint64_t offset,
-                                       unsigned width,
-                                       uint64_t *data)
+static void memory_region_iorange_read1(MemoryRegion *mr,
+                                        MemoryRegionIORange *mrio,
+                                        uint64_t offset,
+                                        unsigned width,
+                                        uint64_t *data)
 {
-    MemoryRegionIORange *mrio
-        = container_of(iorange, MemoryRegionIORange, iorange);
-    MemoryRegion *mr = mrio->mr;
-
-    offset += mrio->offset;
     if (mr->ops->old_portio) {
         const MemoryRegionPortio *mrp = find_portio(mr, offset - mrio->offset,
                                                     width, false);
@@ -412,16 +411,28 @@ static void memory_region_iorange_read(IORange *iorange,
                               memory_region_read_accessor, mr);
 }
 
-static void memory_region_iorange_write(IORange *iorange,
-                                        uint64_t offset,
-                                        unsigned width,
-                                        uint64_t data)
+static void memory_region_iorange_read(IORange *iorange,
+                                       uint64_t offset,
+                                       unsigned width,
+                                       uint64_t *data)
 {
     MemoryRegionIORange *mrio
         = container_of(iorange, MemoryRegionIORange, iorange);
-    MemoryRegion *mr = mrio->mr;
+    int64_t profile = io_profile_start();
 
     offset += mrio->offset;
+    memory_region_iorange_read1(mrio->mr, mrio, offset, width, data);
+    if (profile) {
+        io_profile_record(mrio->mr, offset, true, false, profile);
+    }
+}
+
+static void memory_region_iorange_write1(MemoryRegion *mr,
+                                         MemoryRegionIORange *mrio,
+                                         uint64_t offset,
+                                         unsigned width,
+                                         uint64_t data)
+{
     if (mr->ops->old_portio) {
         const MemoryRegionPortio *mrp = find_portio(mr, offset - mrio->offset,
                                                     width, true);
@@ -442,6 +453,22 @@ static void memory_region_iorange_write(IORange *iorange,
                               memory_region_write_accessor, mr);
 }
 
+static void memory_region_iorange_write(IORange *iorange,
+                                        uint64_t offset,
+                                        unsigned width,
+                                        uint64_t data)
+{
+    MemoryRegionIORange *mrio
+        = container_of(iorange, MemoryRegionIORange, iorange);
+    int64_t profile = io_profile_start();
+
+    offset += mrio->offset;
+    memory_region_iorange_write1(mrio->mr, mrio, offset, width, data);
+    if (profile) {
+        io_profile_record(mrio->mr, offset, true, true, profile);
+    }
+}
+
 static void memory_region_iorange_destructor(IORange *iorange)
 {
     g_free(container_of(iorange, MemoryRegionIORange, iorange));
@@ -574,6 +601,212 @@ static FlatView generate_memory_topology(MemoryRegion *mr)
     return view;
 }
 
+/* Changes made in the current transaction.  For each region changed, the
+ * ranges of each address space it covers are recorded when the change is
+ * made and again at commit, and only those ranges are rendered again.
+ * Past a few changes, everything is rendered again instead.
+ */
+#define MEMORY_CHANGES_MAX  64
+
+typedef struct MemoryChange {
+    AddressSpace *as;
+    AddrRange addr;
+} MemoryChange;
+
+static MemoryChange *memory_changes;
+static unsigned memory_changes_nb;
+static MemoryRegion *memory_changed_regions[MEMORY_CHANGES_MAX];
+static unsigned memory_changed_regions_nb;
+
+static void memory_change_add(AddressSpace *as, AddrRange addr)
+{
+    if (memory_region_update_full) {
+        return;
+    }
+    if (memory_changes_nb == 4 * MEMORY_CHANGES_MAX) {
+        memory_region_update_full = true;
+        return;
+    }
+    if (!memory_changes) {
+        memory_changes = g_new(MemoryChange, 4 * MEMORY_CHANGES_MAX);
+    }
+    memory_changes[memory_changes_nb].as = as;
+    memory_changes[memory_changes_nb].addr = addr;
+    memory_changes_nb++;
+}
+
+/* Record the ranges of @as where @target shows up inside @mr.  Like
+ * render_memory_region(), but no FlatView is built; the ranges may be
+ * partly hidden by other regions.
+ */
+static void memory_change_find(AddressSpace *as, MemoryRegion *mr,
+                               Int128 base, AddrRange clip,
+                               MemoryRegion *target)
+{
+    MemoryRegion *subregion;
+    AddrRange tmp;
+
+    if (!mr->enabled) {
+        return;
+    }
+
+    int128_addto(&base, int128_make64(mr->addr));
+    tmp = addrrange_make(base, mr->size);
+    if (!addrrange_intersects(tmp, clip)) {
+        return;
+    }
+    clip = addrrange_intersection(tmp, clip);
+
+    if (mr == target) {
+        memory_change_add(as, clip);
+        return;
+    }
+
+    if (mr->alias) {
+        int128_subfrom(&base, int128_make64(mr->alias->addr));
+        int128_subfrom(&base, int128_make64(mr->alias_offset));
+        memory_change_find(as, mr->alias, base, clip, target);
+        return;
+    }
+
+    QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+        memory_change_find(as, subregion, base, clip, target);
+    }
+}
+
+static void memory_change_find_all(MemoryRegion *target)
+{
+    AddressSpace *as;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        if (as->root) {
+            memory_change_find(as, as->root, int128_zero(),
+                               addrrange_make(int128_zero(), int128_2_64()),
+                               target);
+        }
+    }
+}
+
+/* @mr is being changed in a way that affects how it is rendered.  Called
+ * while it is still where it used to be; where it ends up is looked at
+ * by memory_region_transaction_commit().
+ */
+static void memory_region_update_region(MemoryRegion *mr)
+{
+    unsigned i;
+
+    memory_region_update_pending = true;
+    if (memory_region_update_full) {
+        return;
+    }
+
+    for (i = 0; i < memory_changed_regions_nb; i++) {
+        if (memory_changed_regions[i] == mr) {
+            break;
+        }
+    }
+    if (i == memory_changed_regions_nb) {
+        if (i == MEMORY_CHANGES_MAX) {
+            memory_region_update_full = true;
+            return;
+        }
+        memory_changed_regions[memory_changed_regions_nb++] = mr;
+    }
+    memory_change_find_all(mr);
+}
+
+static int cmp_addrrange_start(const void *a_, const void *b_)
+{
+    const AddrRange *a = a_, *b = b_;
+
+    if (int128_eq(a->start, b->start)) {
+        return 0;
+    }
+    return int128_lt(a->start, b->start) ? -1 : 1;
+}
+
+static int cmp_flatrange_start(const void *a_, const void *b_)
+{
+    const FlatRange *a = a_, *b = b_;
+
+    return cmp_addrrange_start(&a->addr, &b->addr);
+}
+
+static void flatview_append_part(FlatView *view, FlatRange *fr,
+                                 Int128 start, Int128 end)
+{
+    FlatRange part = *fr;
+
+    part.offset_in_region += int128_get64(int128_sub(start, fr->addr.start));
+    part.addr = addrrange_make(start, int128_sub(end, start));
+    flatview_insert(view, view->nr, &part);
+}
+
+/* Build the new view of @as from the current one: the ranges changed in
+ * this transaction are rendered again, everything else is kept.
+ */
+static FlatView flatview_update(AddressSpace *as)
+{
+    FlatView *old_view = as->current_map;
+    FlatView view;
+    AddrRange *dirty;
+    FlatRange *fr;
+    Int128 start, end;
+    unsigned i, j, nb = 0;
+
+    flatview_init(&view);
+    dirty = g_new(AddrRange, memory_changes_nb + 1);
+    for (i = 0; i < memory_changes_nb; i++) {
+        if (memory_changes[i].as == as) {
+            dirty[nb++] = memory_changes[i].addr;
+        }
+    }
+
+    /* sort and merge what overlaps */
+    qsort(dirty, nb, sizeof(*dirty), cmp_addrrange_start);
+    for (i = 0, j = 0; i < nb; i++) {
+        if (j && int128_le(dirty[i].start, addrrange_end(dirty[j - 1]))) {
+            end = int128_max(addrrange_end(dirty[j - 1]),
+                             addrrange_end(dirty[i]));
+            dirty[j - 1].size = int128_sub(end, dirty[j - 1].start);
+        } else {
+            dirty[j++] = dirty[i];
+        }
+    }
+    nb = j;
+
+    if (as->root) {
+        for (i = 0; i < nb; i++) {
+            render_memory_region(&view, as->root, int128_zero(), dirty[i],
+                                 false);
+        }
+    }
+
+    /* keep whatever lies outside the changed ranges */
+    j = 0;
+    FOR_EACH_FLAT_RANGE(fr, old_view) {
+        start = fr->addr.start;
+        end = addrrange_end(fr->addr);
+        while (j < nb && int128_le(addrrange_end(dirty[j]), start)) {
+            j++;
+        }
+        for (i = j; i < nb && int128_lt(dirty[i].start, end); i++) {
+            if (int128_lt(start, dirty[i].start)) {
+                flatview_append_part(&view, fr, start, dirty[i].start);
+            }
+            start = int128_max(start, addrrange_end(dirty[i]));
+        }
+        if (int128_lt(start, end)) {
+            flatview_append_part(&view, fr, start, end);
+        }
+    }
+    g_free(dirty);
+
+    qsort(view.ranges, view.nr, sizeof(*view.ranges), cmp_flatrange_start);
+    flatview_simplify(&view);
+    return view;
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -720,7 +953,13 @@ static void address_space_update_topology_pass(AddressSpace *as,
 static void address_space_update_topology(AddressSpace *as)
 {
     FlatView old_view = *as->current_map;
-    FlatView new_view = generate_memory_topology(as->root);
+    FlatView new_view;
+
+    if (memory_region_update_full) {
+        new_view = generate_memory_topology(as->root);
+    } else {
+        new_view = flatview_update(as);
+    }
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
@@ -743,7 +982,16 @@ void memory_region_transaction_commit(void)
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth && memory_region_update_pending) {
+        unsigned i;
+
         memory_region_update_pending = false;
+        /* now that the changes are done, see where the regions went */
+        for (i = 0; i < memory_changed_regions_nb; i++) {
+            if (!memory_region_update_full) {
+                memory_change_find_all(memory_changed_regions[i]);
+            }
+        }
+
         MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
         QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
@@ -751,6 +999,10 @@ void memory_region_transaction_commit(void)
         }
 
         MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+
+        memory_region_update_full = false;
+        memory_changes_nb = 0;
+        memory_changed_regions_nb = 0;
     }
 }
 
@@ -816,6 +1068,7 @@ void memory_region_init(MemoryRegion *mr,
     mr->ioeventfd_nb = 0;
     mr->ioeventfds = NULL;
     mr->flush_coalesced_mmio = false;
+    mr->thread_safe = false;
 }
 
 static bool memory_region_access_valid(MemoryRegion *mr,
@@ -889,17 +1142,21 @@ static uint64_t memory_region_dispatch_read(MemoryRegion *mr,
                                             hwaddr addr,
                                             unsigned size)
 {
+    int64_t profile = io_profile_start();
     uint64_t ret;
 
     ret = memory_region_dispatch_read1(mr, addr, size);
     adjust_endianness(mr, &ret, size);
+    if (profile) {
+        io_profile_record(mr, addr, false, false, profile);
+    }
     return ret;
 }
 
-static void memory_region_dispatch_write(MemoryRegion *mr,
-                                         hwaddr addr,
-                                         uint64_t data,
-                                         unsigned size)
+static void memory_region_dispatch_write1(MemoryRegion *mr,
+                                          hwaddr addr,
+                                          uint64_t data,
+                                          unsigned size)
 {
     if (!memory_region_access_valid(mr, addr, size, true)) {
         return; /* FIXME: better signalling */
@@ -919,6 +1176,19 @@ static void memory_region_dispatch_write(MemoryRegion *mr,
                               memory_region_write_accessor, mr);
 }
 
+static void memory_region_dispatch_write(MemoryRegion *mr,
+                                         hwaddr addr,
+                                         uint64_t data,
+                                         unsigned size)
+{
+    int64_t profile = io_profile_start();
+
+    memory_region_dispatch_write1(mr, addr, data, size);
+    if (profile) {
+        io_profile_record(mr, addr, false, true, profile);
+    }
+}
+
 void memory_region_init_io(MemoryRegion *mr,
                            const MemoryRegionOps *ops,
                            void *opaque,
@@ -1024,6 +1294,7 @@ void memory_region_destroy(MemoryRegion *mr)
     assert(memory_region_transaction_depth == 0);
     mr->destructor(mr);
     memory_region_clear_coalescing(mr);
+    io_profile_forget(mr);
     g_free((char *)mr->name);
     g_free(mr->ioeventfds);
 }
@@ -1062,7 +1333,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_region(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1096,6 +1369,41 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
     return ret;
 }
 
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_snapshot_and_clear_dirty(mr->ram_addr + addr,
+                                                        size, 1 << client);
+}
+
+uint64_t memory_region_merge_and_clear_dirty(MemoryRegion *mr,
+                                            unsigned client,
+                                            unsigned long *bitmap)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_merge_and_clear_dirty(mr->ram_addr,
+                                                     int128_get64(mr->size),
+                                                     1 << client, bitmap);
+}
+
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      unsigned long *bitmap, uint64_t pages)
+{
+    assert(mr->terminates);
+    cpu_physical_memory_set_dirty_lebitmap(bitmap, mr->ram_addr + addr, pages);
+}
+
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_snapshot_get_dirty(snap, mr->ram_addr + addr,
+                                                  size);
+}
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
@@ -1116,7 +1424,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_region(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1126,7 +1436,9 @@ void memory_region_rom_device_set_readable(MemoryRegion *mr, bool readable)
     if (mr->readable != readable) {
         memory_region_transaction_begin();
         mr->readable = readable;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_region(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1240,6 +1552,16 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_set_thread_safe(MemoryRegion *mr, bool thread_safe)
+{
+    mr->thread_safe = thread_safe;
+}
+
+bool memory_region_is_thread_safe(MemoryRegion *mr)
+{
+    return mr->thread_safe;
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                hwaddr addr,
                                unsigned size,
@@ -1269,7 +1591,9 @@ void memory_region_add_eventfd(MemoryRegion *mr,
     memmove(&mr->ioeventfds[i+1], &mr->ioeventfds[i],
             sizeof(*mr->ioeventfds) * (mr->ioeventfd_nb-1 - i));
     mr->ioeventfds[i] = mrfd;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_region(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1302,7 +1626,9 @@ void memory_region_del_eventfd(MemoryRegion *mr,
     --mr->ioeventfd_nb;
     mr->ioeventfds = g_realloc(mr->ioeventfds,
                                   sizeof(*mr->ioeventfds)*mr->ioeventfd_nb + 1);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_region(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1346,7 +1672,9 @@ static void memory_region_add_subregion_common(MemoryRegion *mr,
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_region(subregion);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1375,9 +1703,11 @@ void memory_region_del_subregion(MemoryRegion *mr,
 {
     memory_region_transaction_begin();
     assert(subregion->parent == mr);
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_region(subregion);
+    }
     subregion->parent = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
 
@@ -1387,8 +1717,8 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
         return;
     }
     memory_region_transaction_begin();
+    memory_region_update_region(mr);
     mr->enabled = enabled;
-    memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
 
@@ -1423,7 +1753,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_region(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1570,6 +1902,8 @@ void address_space_init(AddressSpace *as, MemoryRegion *root)
     flatview_init(as->current_map);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = NULL;
+    /* its view has yet to be rendered at all */
+    memory_region_update_full = true;
     memory_region_transaction_commit();
     address_space_init_dispatch(as);
 }
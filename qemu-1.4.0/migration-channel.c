@@ -0,0 +1,418 @@
+/*
+ * Parallel migration channels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "migration/channel.h"
+
+//#define DEBUG_MIGRATION_CHANNEL
+
+#ifdef DEBUG_MIGRATION_CHANNEL
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-channel: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* Pages a channel may have queued before the migration thread waits */
+#define CHANNEL_QUEUE_LEN   256
+
+typedef struct ChannelItem {
+    void *opaque;
+    uint64_t offset;
+    void *host;
+    int fill;
+} ChannelItem;
+
+typedef struct MigrationChannel {
+    int fd;
+    QEMUFile *file;
+    QemuThread thread;
+    int error;
+
+    /* source: pending pages, and whether the thread should exit */
+    ChannelItem queue[CHANNEL_QUEUE_LEN];
+    unsigned int head;
+    unsigned int count;
+    QemuCond work;
+    bool quit;
+
+    /* destination: sync markers read so far */
+    unsigned int syncs;
+} MigrationChannel;
+
+/* One lock covers the channels of either side; done is signalled whenever
+ * a thread finishes an item
+ */
+static QemuMutex channel_lock;
+static QemuCond channel_done;
+
+static char *outgoing_host_port;
+static int outgoing_wanted;
+static const MigrationChannelOps *outgoing_ops;
+static MigrationChannel *outgoing;
+static int nr_outgoing;
+
+static int incoming_listen_fd = -1;
+static const MigrationChannelOps *incoming_ops;
+static MigrationChannel *incoming;
+static int nr_incoming;
+static unsigned int incoming_syncs;
+
+/* Source side */
+
+void migration_channels_outgoing_init(const char *host_port, Error **errp)
+{
+    const char *optstr;
+    int n = 0, pos;
+
+    g_free(outgoing_host_port);
+    outgoing_host_port = NULL;
+    outgoing_wanted = 0;
+
+    if (!host_port) {
+        return;
+    }
+
+    optstr = strstr(host_port, ",channels=");
+    if (!optstr) {
+        return;
+    }
+    optstr += strlen(",channels=");
+    if (sscanf(optstr, "%d%n", &n, &pos) != 1 ||
+        (optstr[pos] != '\0' && optstr[pos] != ',') ||
+        n < 0 || n > MIGRATION_CHANNELS_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "channels",
+                  "a number of channels from 0 to 16");
+        return;
+    }
+
+    outgoing_host_port = g_strdup(host_port);
+    outgoing_wanted = n;
+}
+
+static void *channel_send_thread(void *opaque)
+{
+    MigrationChannel *c = opaque;
+    ChannelItem *item;
+    void *last = NULL;
+    int error;
+
+    qemu_mutex_lock(&channel_lock);
+    while (true) {
+        while (!c->count && !c->quit) {
+            qemu_cond_wait(&c->work, &channel_lock);
+        }
+        if (!c->count || c->error) {
+            break;
+        }
+
+        /* the slot stays taken until the item is written */
+        item = &c->queue[c->head];
+        qemu_mutex_unlock(&channel_lock);
+
+        outgoing_ops->send(c->file, item->opaque, item->offset, item->host,
+                           item->fill, &last);
+        if (!item->opaque) {
+            qemu_fflush(c->file);
+        }
+
+        qemu_mutex_lock(&channel_lock);
+        c->head = (c->head + 1) % CHANNEL_QUEUE_LEN;
+        c->count--;
+        if (!c->error) {
+            c->error = qemu_file_get_error(c->file);
+        }
+        qemu_cond_broadcast(&channel_done);
+    }
+    error = c->error;
+    qemu_mutex_unlock(&channel_lock);
+
+    if (!error) {
+        qemu_fflush(c->file);
+    }
+    return NULL;
+}
+
+int migration_channels_connect(const MigrationChannelOps *ops)
+{
+    Error *local_err = NULL;
+    MigrationChannel *c;
+    int i, fd;
+
+    assert(!outgoing);
+    if (!outgoing_wanted) {
+        return 0;
+    }
+
+    qemu_mutex_init(&channel_lock);
+    qemu_cond_init(&channel_done);
+    outgoing_ops = ops;
+    outgoing = g_new0(MigrationChannel, outgoing_wanted);
+
+    for (i = 0; i < outgoing_wanted; i++) {
+        fd = inet_connect(outgoing_host_port, &local_err);
+        if (fd < 0) {
+            error_report("could not open migration channel %d: %s", i,
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            migration_channels_close(true);
+            return -EIO;
+        }
+
+        c = &outgoing[i];
+        c->fd = fd;
+        c->file = qemu_fopen_socket(fd, "wb");
+        qemu_cond_init(&c->work);
+        qemu_thread_create(&c->thread, channel_send_thread, c,
+                           QEMU_THREAD_JOINABLE);
+        nr_outgoing++;
+    }
+
+    DPRINTF("opened %d channels\n", nr_outgoing);
+    return nr_outgoing;
+}
+
+int migration_channel_queue(int nr, void *opaque, uint64_t offset,
+                            void *host, int fill, size_t size)
+{
+    MigrationChannel *c = &outgoing[nr];
+    ChannelItem *item;
+    int ret;
+
+    qemu_mutex_lock(&channel_lock);
+    while (c->count == CHANNEL_QUEUE_LEN && !c->error) {
+        qemu_cond_wait(&channel_done, &channel_lock);
+    }
+    ret = c->error;
+    if (!ret) {
+        item = &c->queue[(c->head + c->count) % CHANNEL_QUEUE_LEN];
+        item->opaque = opaque;
+        item->offset = offset;
+        item->host = host;
+        item->fill = fill;
+        c->count++;
+        qemu_cond_signal(&c->work);
+    }
+    qemu_mutex_unlock(&channel_lock);
+
+    if (ret == 0) {
+        /* the migration thread checks the limit against what it queued,
+           so it holds for all connections together */
+        migrate_get_current()->bytes_xfer += size;
+    }
+    return ret;
+}
+
+int migration_channels_flush(void)
+{
+    MigrationChannel *c;
+    int i, ret = 0;
+
+    qemu_mutex_lock(&channel_lock);
+    for (i = 0; i < nr_outgoing; i++) {
+        c = &outgoing[i];
+        while (c->count && !c->error) {
+            qemu_cond_wait(&channel_done, &channel_lock);
+        }
+        if (c->error && !ret) {
+            ret = c->error;
+        }
+    }
+    qemu_mutex_unlock(&channel_lock);
+    return ret;
+}
+
+int migration_channels_barrier(void)
+{
+    int i, ret;
+
+    for (i = 0; i < nr_outgoing; i++) {
+        ret = migration_channel_queue(i, NULL, 0, NULL, -1, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return migration_channels_flush();
+}
+
+void migration_channels_close(bool abort)
+{
+    MigrationChannel *c;
+    int i;
+
+    if (!outgoing) {
+        return;
+    }
+
+    for (i = 0; i < nr_outgoing; i++) {
+        c = &outgoing[i];
+        qemu_mutex_lock(&channel_lock);
+        c->quit = true;
+        if (abort) {
+            if (!c->error) {
+                c->error = -ECANCELED;
+            }
+            /* a thread stuck in send() gets out with an error */
+            shutdown(c->fd, 2);
+        }
+        qemu_cond_signal(&c->work);
+        qemu_mutex_unlock(&channel_lock);
+
+        qemu_thread_join(&c->thread);
+        qemu_fclose(c->file);
+        qemu_cond_destroy(&c->work);
+    }
+
+    g_free(outgoing);
+    outgoing = NULL;
+    nr_outgoing = 0;
+    qemu_cond_destroy(&channel_done);
+    qemu_mutex_destroy(&channel_lock);
+}
+
+/* Destination side */
+
+void migration_channels_incoming_listen(int fd)
+{
+    if (incoming_listen_fd != -1) {
+        closesocket(incoming_listen_fd);
+    }
+    incoming_listen_fd = fd;
+}
+
+static void *channel_recv_thread(void *opaque)
+{
+    MigrationChannel *c = opaque;
+    void *last = NULL;
+    int ret;
+
+    do {
+        ret = incoming_ops->load(c->file, &last);
+        if (ret == 1) {
+            qemu_mutex_lock(&channel_lock);
+            c->syncs++;
+            qemu_cond_broadcast(&channel_done);
+            qemu_mutex_unlock(&channel_lock);
+        }
+    } while (ret >= 0);
+
+    qemu_mutex_lock(&channel_lock);
+    c->error = ret;
+    qemu_cond_broadcast(&channel_done);
+    qemu_mutex_unlock(&channel_lock);
+    return NULL;
+}
+
+int migration_channels_accept(int n, const MigrationChannelOps *ops)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    MigrationChannel *c;
+    int i, fd;
+
+    if (incoming_listen_fd == -1 || incoming) {
+        error_report("migration channels need a tcp migration");
+        return -EINVAL;
+    }
+    if (n <= 0 || n > MIGRATION_CHANNELS_MAX) {
+        error_report("bad number of migration channels %d", n);
+        return -EINVAL;
+    }
+
+    qemu_mutex_init(&channel_lock);
+    qemu_cond_init(&channel_done);
+    incoming_ops = ops;
+    incoming_syncs = 0;
+    incoming = g_new0(MigrationChannel, n);
+
+    /* the source connected them before telling us, so this does not wait
+       for long */
+    socket_set_block(incoming_listen_fd);
+    for (i = 0; i < n; i++) {
+        do {
+            addrlen = sizeof(addr);
+            fd = qemu_accept(incoming_listen_fd, (struct sockaddr *)&addr,
+                             &addrlen);
+        } while (fd == -1 && socket_error() == EINTR);
+        if (fd == -1) {
+            int err = socket_error();
+
+            error_report("could not accept migration channel");
+            return -err;
+        }
+
+        c = &incoming[i];
+        c->fd = fd;
+        c->file = qemu_fopen_socket(fd, "rb");
+        qemu_thread_create(&c->thread, channel_recv_thread, c,
+                           QEMU_THREAD_JOINABLE);
+        nr_incoming++;
+    }
+
+    closesocket(incoming_listen_fd);
+    incoming_listen_fd = -1;
+    DPRINTF("accepted %d channels\n", nr_incoming);
+    return 0;
+}
+
+int migration_channels_wait(void)
+{
+    MigrationChannel *c;
+    int i, ret = 0;
+
+    if (!incoming) {
+        error_report("migration channel sync without channels");
+        return -EINVAL;
+    }
+
+    incoming_syncs++;
+    qemu_mutex_lock(&channel_lock);
+    for (i = 0; i < nr_incoming && !ret; i++) {
+        c = &incoming[i];
+        while (c->syncs < incoming_syncs && !c->error) {
+            qemu_cond_wait(&channel_done, &channel_lock);
+        }
+        if (c->syncs < incoming_syncs) {
+            error_report("migration channel %d failed", i);
+            ret = c->error;
+        }
+    }
+    qemu_mutex_unlock(&channel_lock);
+    return ret;
+}
+
+void migration_channels_incoming_cleanup(void)
+{
+    MigrationChannel *c;
+    int i;
+
+    migration_channels_incoming_listen(-1);
+    if (!incoming) {
+        return;
+    }
+
+    /* Whatever the channels still carry is not waited for */
+    for (i = 0; i < nr_incoming; i++) {
+        c = &incoming[i];
+        shutdown(c->fd, 2);
+        qemu_thread_join(&c->thread);
+        qemu_fclose(c->file);
+    }
+
+    g_free(incoming);
+    incoming = NULL;
+    nr_incoming = 0;
+    qemu_cond_destroy(&channel_done);
+    qemu_mutex_destroy(&channel_lock);
+}
@@ -0,0 +1,417 @@
+/*
+ * Migration to and from a file laid out for fast resume
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <sys/mman.h>
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "qemu/bswap.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "migration/file.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* How far ahead of the pages it touches the prefetch thread asks for more */
+#define PREFETCH_CHUNK      (2 << 20)
+
+typedef struct MigrationFileBlock {
+    char idstr[256];
+    uint64_t offset;
+    uint64_t length;
+    void *host;                 /* destination: where it is mapped, if it is */
+} MigrationFileBlock;
+
+static int outgoing_fd = -1;
+static char *outgoing_path;
+static char *outgoing_tmp_path;
+static uint64_t outgoing_stream_offset;
+
+static int incoming_fd = -1;
+
+/* The blocks of whichever side is running */
+static MigrationFileBlock blocks[MIGRATION_FILE_BLOCKS_MAX];
+static int nr_blocks;
+static uint64_t ram_end;
+
+/* Source side */
+
+static int file_errno(MigrationState *s)
+{
+    return errno;
+}
+
+static int file_write(MigrationState *s, const void *buf, size_t size)
+{
+    return write(s->fd, buf, size);
+}
+
+static int file_close(MigrationState *s)
+{
+    /* the state only changes once the file is closed */
+    bool complete = migration_is_active(s);
+    int ret;
+
+    DPRINTF("file_close\n");
+    ret = fsync(s->fd);
+    if (ret != 0) {
+        ret = -errno;
+        perror("migration-file: fsync");
+    }
+    if (close(s->fd) != 0 && ret == 0) {
+        ret = -errno;
+        perror("migration-file: close");
+    }
+    s->fd = -1;
+    outgoing_fd = -1;
+
+    /* a guest may still run from an older file of the same name, so that
+       one is replaced rather than written over */
+    if (complete && ret == 0 && rename(outgoing_tmp_path, outgoing_path) != 0) {
+        ret = -errno;
+        perror("migration-file: rename");
+    }
+    if (!complete || ret != 0) {
+        unlink(outgoing_tmp_path);
+    }
+
+    g_free(outgoing_path);
+    g_free(outgoing_tmp_path);
+    outgoing_path = outgoing_tmp_path = NULL;
+    return ret;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    char *tmp_path = g_strdup_printf("%s.part", path);
+    uint64_t stream_offset;
+    int fd;
+
+    fd = qemu_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to create %s", tmp_path);
+        g_free(tmp_path);
+        return;
+    }
+
+    /* leave room for every block with the worst case of alignment */
+    stream_offset = MIGRATION_FILE_RAM_START +
+                    QEMU_ALIGN_UP(ram_bytes_total(), MIGRATION_FILE_ALIGN) +
+                    (uint64_t)MIGRATION_FILE_BLOCKS_MAX * MIGRATION_FILE_ALIGN;
+    if (lseek(fd, stream_offset, SEEK_SET) == (off_t)-1) {
+        error_setg_errno(errp, errno, "failed to seek in %s", tmp_path);
+        close(fd);
+        unlink(tmp_path);
+        g_free(tmp_path);
+        return;
+    }
+
+    outgoing_path = g_strdup(path);
+    outgoing_tmp_path = tmp_path;
+    outgoing_stream_offset = stream_offset;
+    outgoing_fd = fd;
+    nr_blocks = 0;
+    ram_end = MIGRATION_FILE_RAM_START;
+
+    s->fd = fd;
+    s->get_error = file_errno;
+    s->write = file_write;
+    s->close = file_close;
+
+    migrate_fd_connect(s);
+}
+
+int migration_file_fd(void)
+{
+    return outgoing_fd;
+}
+
+int migration_file_add_block(const char *idstr, uint64_t length,
+                             uint64_t *offset)
+{
+    MigrationFileBlock *b;
+
+    if (nr_blocks == MIGRATION_FILE_BLOCKS_MAX ||
+        ram_end + length > outgoing_stream_offset) {
+        error_report("migration-file: no room for RAM block %s", idstr);
+        return -ENOSPC;
+    }
+
+    b = &blocks[nr_blocks++];
+    pstrcpy(b->idstr, sizeof(b->idstr), idstr);
+    b->offset = ram_end;
+    b->length = length;
+    ram_end = QEMU_ALIGN_UP(ram_end + length, MIGRATION_FILE_ALIGN);
+
+    *offset = b->offset;
+    return 0;
+}
+
+int migration_file_write_header(void)
+{
+    uint8_t *buf = g_malloc0(MIGRATION_FILE_RAM_START);
+    uint8_t *p = buf;
+    size_t len;
+    int i, ret;
+
+    stl_be_p(p, MIGRATION_FILE_MAGIC);
+    stl_be_p(p + 4, MIGRATION_FILE_VERSION);
+    stq_be_p(p + 8, outgoing_stream_offset);
+    stl_be_p(p + 16, nr_blocks);
+    p += 20;
+
+    /* MIGRATION_FILE_BLOCKS_MAX entries always fit */
+    for (i = 0; i < nr_blocks; i++) {
+        len = strlen(blocks[i].idstr);
+        *p++ = len;
+        memcpy(p, blocks[i].idstr, len);
+        p += len;
+        stq_be_p(p, blocks[i].offset);
+        stq_be_p(p + 8, blocks[i].length);
+        p += 16;
+    }
+
+    ret = migration_file_write(buf, p - buf, 0);
+    g_free(buf);
+    return ret;
+}
+
+int migration_file_write(const void *buf, size_t size, uint64_t offset)
+{
+    const uint8_t *p = buf;
+    ssize_t len;
+
+    while (size) {
+        len = pwrite(outgoing_fd, p, size, offset);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return len < 0 ? -errno : -EIO;
+        }
+        p += len;
+        size -= len;
+        offset += len;
+    }
+    return 0;
+}
+
+/* Destination side */
+
+static int file_read_header(int fd, uint64_t *stream_offset, Error **errp)
+{
+    uint8_t *buf = g_malloc(MIGRATION_FILE_RAM_START);
+    uint8_t *p = buf, *end;
+    ssize_t len;
+    int i, n, ret = -EINVAL;
+
+    do {
+        len = pread(fd, buf, MIGRATION_FILE_RAM_START, 0);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) {
+        error_setg_errno(errp, errno, "failed to read the migration file");
+        goto out;
+    }
+    end = buf + len;
+
+    if (len < 20 || ldl_be_p(p) != MIGRATION_FILE_MAGIC) {
+        error_setg(errp, "not a migration file");
+        goto out;
+    }
+    if (ldl_be_p(p + 4) != MIGRATION_FILE_VERSION) {
+        error_setg(errp, "unsupported migration file version %d",
+                   ldl_be_p(p + 4));
+        goto out;
+    }
+    *stream_offset = ldq_be_p(p + 8);
+    n = ldl_be_p(p + 16);
+    p += 20;
+    if (n < 0 || n > MIGRATION_FILE_BLOCKS_MAX) {
+        error_setg(errp, "bad number of RAM blocks in the migration file");
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (p >= end || p + 1 + *p + 16 > end) {
+            error_setg(errp, "truncated migration file header");
+            goto out;
+        }
+        memcpy(blocks[i].idstr, p + 1, *p);
+        blocks[i].idstr[*p] = 0;
+        p += 1 + *p;
+        blocks[i].offset = ldq_be_p(p);
+        blocks[i].length = ldq_be_p(p + 8);
+        blocks[i].host = NULL;
+        p += 16;
+        if (blocks[i].offset + blocks[i].length > *stream_offset) {
+            error_setg(errp, "RAM block %s is past the end of RAM in the "
+                       "migration file", blocks[i].idstr);
+            goto out;
+        }
+    }
+    nr_blocks = n;
+    ret = 0;
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    uint64_t stream_offset;
+    QEMUFile *f;
+    int fd;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        return;
+    }
+
+    if (file_read_header(fd, &stream_offset, errp) < 0) {
+        close(fd);
+        return;
+    }
+    if (lseek(fd, stream_offset, SEEK_SET) == (off_t)-1) {
+        error_setg_errno(errp, errno, "failed to seek in %s", path);
+        close(fd);
+        return;
+    }
+
+    f = qemu_fdopen(fd, "rb");
+    if (f == NULL) {
+        error_setg_errno(errp, errno, "failed to open %s", path);
+        close(fd);
+        return;
+    }
+
+    /* RAM is read with pread() and mmap(), which leave the stream alone */
+    incoming_fd = fd;
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+}
+
+bool migration_file_incoming(void)
+{
+    return incoming_fd != -1;
+}
+
+int migration_file_load_block(const char *idstr, void *host, uint64_t length,
+                              bool can_map)
+{
+    MigrationFileBlock *b = NULL;
+    uint64_t done;
+    ssize_t len;
+    int i;
+
+    for (i = 0; i < nr_blocks; i++) {
+        if (!strcmp(blocks[i].idstr, idstr)) {
+            b = &blocks[i];
+            break;
+        }
+    }
+    if (!b || b->length != length) {
+        error_report("migration-file: RAM block %s is not in the file", idstr);
+        return -EINVAL;
+    }
+
+    if (can_map && (uintptr_t)host % getpagesize() == 0 &&
+        b->offset % getpagesize() == 0 && length % getpagesize() == 0) {
+        void *p = mmap(host, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED, incoming_fd, b->offset);
+
+        if (p == host) {
+            /* what the anonymous mapping it replaced was told */
+            qemu_madvise(host, length, QEMU_MADV_DONTFORK);
+            qemu_madvise(host, length, QEMU_MADV_MERGEABLE);
+            b->host = host;
+            DPRINTF("mapped %s at %p\n", idstr, host);
+            return 0;
+        }
+        /* the old mapping is still in place if mmap() failed */
+        DPRINTF("could not map %s: %s\n", idstr, strerror(errno));
+    }
+
+    for (done = 0; done < length; done += len) {
+        len = pread(incoming_fd, host + done, length - done, b->offset + done);
+        if (len < 0 && errno == EINTR) {
+            len = 0;
+            continue;
+        }
+        if (len <= 0) {
+            error_report("migration-file: failed to read RAM block %s",
+                         idstr);
+            return len < 0 ? -errno : -EIO;
+        }
+    }
+    return 0;
+}
+
+static void *file_prefetch_thread(void *opaque)
+{
+    MigrationFileBlock *b;
+    uint64_t offset, next;
+    size_t pagesize = getpagesize();
+    int i;
+
+    for (i = 0; i < nr_blocks; i++) {
+        b = &blocks[i];
+        if (!b->host) {
+            continue;
+        }
+        for (offset = 0; offset < b->length; offset = next) {
+            next = MIN(offset + PREFETCH_CHUNK, b->length);
+            if (next < b->length) {
+                qemu_madvise(b->host + next,
+                             MIN(PREFETCH_CHUNK, b->length - next),
+                             QEMU_MADV_WILLNEED);
+            }
+            /* reading a page maps it without copying it */
+            for (; offset < next; offset += pagesize) {
+                (void)*(volatile uint8_t *)(b->host + offset);
+            }
+        }
+        DPRINTF("prefetched %s\n", b->idstr);
+    }
+    return NULL;
+}
+
+void migration_file_prefetch_start(void)
+{
+    QemuThread thread;
+    int i;
+
+    for (i = 0; i < nr_blocks; i++) {
+        if (blocks[i].host) {
+            qemu_thread_create(&thread, file_prefetch_thread, NULL,
+                               QEMU_THREAD_DETACHED);
+            return;
+        }
+    }
+}
@@ -0,0 +1,517 @@
+/*
+ * Post-copy live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/event_notifier.h"
+#include "qemu/queue.h"
+#include "qemu/error-report.h"
+#include "migration/migration.h"
+#include "migration/postcopy.h"
+#include "trace.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/userfaultfd.h>
+#endif
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = qemu_recv(fd, p, len, 0);
+        if (ret == 0) {
+            return -EIO;
+        } else if (ret < 0) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            return -socket_error();
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* Source side: a thread queues what comes back on the migration socket */
+
+typedef struct PostcopyRequest {
+    char idstr[256];
+    uint64_t offset;
+    QSIMPLEQ_ENTRY(PostcopyRequest) next;
+} PostcopyRequest;
+
+static struct {
+    int fd;
+    QemuThread thread;
+    bool initialized;
+
+    /* Protected by lock */
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, PostcopyRequest) requests;
+    uint64_t nr_requests;
+    uint64_t faults;
+    uint64_t latency_total;
+    uint64_t latency_max;
+    bool done;
+} outgoing;
+
+bool postcopy_outgoing_possible(int fd)
+{
+    int type;
+    socklen_t len = sizeof(type);
+
+    return qemu_getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+           type == SOCK_STREAM;
+}
+
+static void *postcopy_outgoing_thread(void *opaque)
+{
+    PostcopyRequest *req;
+    uint64_t be[3];
+    uint8_t type, len;
+    int fd = outgoing.fd;
+
+    while (recv_all(fd, &type, 1) == 0) {
+        if (type == POSTCOPY_MSG_REQUEST) {
+            req = g_malloc0(sizeof(*req));
+            if (recv_all(fd, be, 8) < 0 || recv_all(fd, &len, 1) < 0 ||
+                recv_all(fd, req->idstr, len) < 0) {
+                g_free(req);
+                break;
+            }
+            req->offset = be64_to_cpu(be[0]);
+            trace_postcopy_outgoing_request(req->idstr, req->offset);
+
+            qemu_mutex_lock(&outgoing.lock);
+            QSIMPLEQ_INSERT_TAIL(&outgoing.requests, req, next);
+            outgoing.nr_requests++;
+            qemu_mutex_unlock(&outgoing.lock);
+        } else if (type == POSTCOPY_MSG_DONE) {
+            if (recv_all(fd, be, sizeof(be)) < 0) {
+                break;
+            }
+            qemu_mutex_lock(&outgoing.lock);
+            outgoing.faults = be64_to_cpu(be[0]);
+            outgoing.latency_total = be64_to_cpu(be[1]);
+            outgoing.latency_max = be64_to_cpu(be[2]);
+            outgoing.done = true;
+            qemu_mutex_unlock(&outgoing.lock);
+            break;
+        } else {
+            error_report("post-copy: unknown message %d from destination",
+                         type);
+            break;
+        }
+    }
+    return NULL;
+}
+
+void postcopy_outgoing_start(int fd)
+{
+    if (!outgoing.initialized) {
+        qemu_mutex_init(&outgoing.lock);
+        QSIMPLEQ_INIT(&outgoing.requests);
+        outgoing.initialized = true;
+    }
+    outgoing.fd = fd;
+    outgoing.nr_requests = 0;
+    outgoing.faults = 0;
+    outgoing.latency_total = 0;
+    outgoing.latency_max = 0;
+    outgoing.done = false;
+
+    qemu_thread_create(&outgoing.thread, postcopy_outgoing_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+}
+
+bool postcopy_outgoing_get_request(char *idstr, uint64_t *offset)
+{
+    PostcopyRequest *req;
+
+    qemu_mutex_lock(&outgoing.lock);
+    req = QSIMPLEQ_FIRST(&outgoing.requests);
+    if (req) {
+        QSIMPLEQ_REMOVE_HEAD(&outgoing.requests, next);
+    }
+    qemu_mutex_unlock(&outgoing.lock);
+
+    if (!req) {
+        return false;
+    }
+    pstrcpy(idstr, sizeof(req->idstr), req->idstr);
+    *offset = req->offset;
+    g_free(req);
+    return true;
+}
+
+int postcopy_outgoing_finish(bool abort)
+{
+    PostcopyRequest *req;
+
+    if (abort) {
+        /* wakes up the thread if it is blocked in recv() */
+        shutdown(outgoing.fd, 2);
+    }
+    qemu_thread_join(&outgoing.thread);
+
+    /* whatever is left was served by the background push */
+    while ((req = QSIMPLEQ_FIRST(&outgoing.requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&outgoing.requests, next);
+        g_free(req);
+    }
+    return outgoing.done ? 0 : -EIO;
+}
+
+void postcopy_outgoing_get_info(PostcopyInfo *info)
+{
+    qemu_mutex_lock(&outgoing.lock);
+    info->requests = outgoing.nr_requests;
+    if (outgoing.done) {
+        info->has_faults = true;
+        info->faults = outgoing.faults;
+        info->has_fault_latency_avg = true;
+        info->fault_latency_avg = outgoing.faults ?
+            outgoing.latency_total / outgoing.faults : 0;
+        info->has_fault_latency_max = true;
+        info->fault_latency_max = outgoing.latency_max;
+    }
+    qemu_mutex_unlock(&outgoing.lock);
+}
+
+/* Destination side */
+
+static bool incoming_started;
+
+bool postcopy_incoming_started(void)
+{
+    return incoming_started;
+}
+
+#ifdef CONFIG_USERFAULTFD
+
+typedef struct PostcopyRegion {
+    uint8_t *host;
+    size_t length;
+    char idstr[256];
+} PostcopyRegion;
+
+static struct {
+    int fd;                     /* the migration socket, for requests */
+    int uffd;
+    size_t page_size;
+    EventNotifier quit;
+    QemuThread fault_thread;
+    QemuThread load_thread;
+
+    /* Protected by lock */
+    QemuMutex lock;
+    GArray *regions;
+    GHashTable *waiting;        /* page -> when it was first missed */
+    uint64_t faults;
+    uint64_t latency_total;     /* microseconds */
+    uint64_t latency_max;
+} incoming;
+
+static PostcopyRegion *postcopy_find_region(uint8_t *host)
+{
+    PostcopyRegion *r;
+    int i;
+
+    for (i = 0; i < incoming.regions->len; i++) {
+        r = &g_array_index(incoming.regions, PostcopyRegion, i);
+        if (host >= r->host && host < r->host + r->length) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static void postcopy_request_page(uint8_t *host)
+{
+    PostcopyRegion *r;
+    uint8_t buf[1 + 8 + 1 + 255];
+    uint64_t offset;
+    int64_t *when;
+    size_t len;
+
+    qemu_mutex_lock(&incoming.lock);
+    r = postcopy_find_region(host);
+    if (!r || g_hash_table_lookup(incoming.waiting, host)) {
+        /* asked for already, another thread is waiting for it too */
+        qemu_mutex_unlock(&incoming.lock);
+        return;
+    }
+    when = g_new(int64_t, 1);
+    *when = get_clock();
+    g_hash_table_insert(incoming.waiting, host, when);
+    incoming.faults++;
+    offset = host - r->host;
+    len = strlen(r->idstr);
+
+    buf[0] = POSTCOPY_MSG_REQUEST;
+    cpu_to_be64wu((uint64_t *)(buf + 1), offset);
+    buf[9] = len;
+    memcpy(buf + 10, r->idstr, len);
+    trace_postcopy_incoming_fault(r->idstr, offset);
+    qemu_mutex_unlock(&incoming.lock);
+
+    if (send_all(incoming.fd, buf, 10 + len) != 10 + len) {
+        error_report("post-copy: failed to request a page: %s",
+                     strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+    uint64_t host;
+    ssize_t ret;
+
+    pfd[0].fd = incoming.uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = event_notifier_get_fd(&incoming.quit);
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("post-copy: poll failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(incoming.uffd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            error_report("post-copy: failed to read userfault: %s",
+                         strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        host = msg.arg.pagefault.address & ~(uint64_t)(incoming.page_size - 1);
+        postcopy_request_page((uint8_t *)(uintptr_t)host);
+    }
+    return NULL;
+}
+
+int postcopy_incoming_init(int fd)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+
+    incoming.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (incoming.uffd < 0) {
+        error_report("post-copy: userfaultfd is not available: %s",
+                     strerror(errno));
+        return -errno;
+    }
+    if (ioctl(incoming.uffd, UFFDIO_API, &api) < 0) {
+        error_report("post-copy: userfaultfd API mismatch: %s",
+                     strerror(errno));
+        close(incoming.uffd);
+        return -ENOSYS;
+    }
+
+    incoming.fd = fd;
+    incoming.page_size = getpagesize();
+    qemu_mutex_init(&incoming.lock);
+    incoming.regions = g_array_new(false, false, sizeof(PostcopyRegion));
+    incoming.waiting = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                             NULL, g_free);
+    event_notifier_init(&incoming.quit, false);
+
+    /* Requests are sent from the fault thread, and the loader must not give
+     * the main loop a chance to touch guest RAM until the page stream has a
+     * thread of its own: both want a blocking socket.
+     */
+    socket_set_block(fd);
+
+    qemu_thread_create(&incoming.fault_thread, postcopy_fault_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+int postcopy_incoming_register(void *host, size_t length, const char *idstr)
+{
+    struct uffdio_register reg = {
+        .range = { .start = (uintptr_t)host, .len = length },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    PostcopyRegion r;
+
+    if (ioctl(incoming.uffd, UFFDIO_REGISTER, &reg) < 0) {
+        error_report("post-copy: cannot register RAM block %s: %s",
+                     idstr, strerror(errno));
+        return -errno;
+    }
+    if (!(reg.ioctls & ((uint64_t)1 << _UFFDIO_COPY))) {
+        error_report("post-copy: RAM block %s cannot be filled in", idstr);
+        return -ENOTSUP;
+    }
+
+    r.host = host;
+    r.length = length;
+    pstrcpy(r.idstr, sizeof(r.idstr), idstr);
+    qemu_mutex_lock(&incoming.lock);
+    g_array_append_val(incoming.regions, r);
+    qemu_mutex_unlock(&incoming.lock);
+    return 0;
+}
+
+void postcopy_incoming_discard(void *host, size_t length)
+{
+    qemu_madvise(host, length, QEMU_MADV_DONTNEED);
+}
+
+int postcopy_incoming_place_page(void *host, const uint8_t *data)
+{
+    int64_t *when, latency;
+    int ret;
+
+    if (data) {
+        struct uffdio_copy copy = {
+            .dst = (uintptr_t)host,
+            .src = (uintptr_t)data,
+            .len = incoming.page_size,
+        };
+        ret = ioctl(incoming.uffd, UFFDIO_COPY, &copy);
+    } else {
+        struct uffdio_zeropage zero = {
+            .range = { .start = (uintptr_t)host, .len = incoming.page_size },
+        };
+        ret = ioctl(incoming.uffd, UFFDIO_ZEROPAGE, &zero);
+    }
+    /* a page that was asked for comes twice if the background push got to
+       it in the meantime */
+    if (ret < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    qemu_mutex_lock(&incoming.lock);
+    when = g_hash_table_lookup(incoming.waiting, host);
+    if (when) {
+        latency = (get_clock() - *when) / 1000;
+        incoming.latency_total += latency;
+        incoming.latency_max = MAX(incoming.latency_max, latency);
+        g_hash_table_remove(incoming.waiting, host);
+    }
+    qemu_mutex_unlock(&incoming.lock);
+    return 0;
+}
+
+static void postcopy_incoming_finish(void)
+{
+    struct uffdio_range range;
+    PostcopyRegion *r;
+    uint64_t msg[3];
+    uint8_t type = POSTCOPY_MSG_DONE;
+    int i;
+
+    event_notifier_set(&incoming.quit);
+    qemu_thread_join(&incoming.fault_thread);
+    event_notifier_cleanup(&incoming.quit);
+
+    /* Every page that had gone stale has arrived, the ones still missing
+     * were zero and are left to the kernel.  Unregistering also wakes
+     * anybody that faulted on them meanwhile.
+     */
+    for (i = 0; i < incoming.regions->len; i++) {
+        r = &g_array_index(incoming.regions, PostcopyRegion, i);
+        range.start = (uintptr_t)r->host;
+        range.len = r->length;
+        ioctl(incoming.uffd, UFFDIO_UNREGISTER, &range);
+    }
+    close(incoming.uffd);
+    g_array_free(incoming.regions, true);
+    g_hash_table_destroy(incoming.waiting);
+
+    trace_postcopy_incoming_done(incoming.faults, incoming.latency_max);
+    msg[0] = cpu_to_be64(incoming.faults);
+    msg[1] = cpu_to_be64(incoming.latency_total);
+    msg[2] = cpu_to_be64(incoming.latency_max);
+    if (send_all(incoming.fd, &type, 1) != 1 ||
+        send_all(incoming.fd, msg, sizeof(msg)) != sizeof(msg)) {
+        error_report("post-copy: failed to report completion: %s",
+                     strerror(errno));
+    }
+}
+
+static void *postcopy_load_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    int ret;
+
+    ret = ram_load_postcopy(f);
+    if (ret < 0) {
+        /* the guest already runs here and cannot go on without its RAM */
+        error_report("post-copy: failed to load RAM: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+    postcopy_incoming_finish();
+    qemu_fclose(f);
+    return NULL;
+}
+
+int postcopy_incoming_start(QEMUFile *f)
+{
+    if (!incoming.regions) {
+        error_report("post-copy: device state came before RAM switched");
+        return -EINVAL;
+    }
+    incoming_started = true;
+    qemu_thread_create(&incoming.load_thread, postcopy_load_thread, f,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+#else
+
+int postcopy_incoming_init(int fd)
+{
+    error_report("post-copy: not supported by this build");
+    return -ENOSYS;
+}
+
+int postcopy_incoming_register(void *host, size_t length, const char *idstr)
+{
+    return -ENOSYS;
+}
+
+void postcopy_incoming_discard(void *host, size_t length)
+{
+}
+
+int postcopy_incoming_place_page(void *host, const uint8_t *data)
+{
+    return -ENOSYS;
+}
+
+int postcopy_incoming_start(QEMUFile *f)
+{
+    return -ENOSYS;
+}
+
+#endif
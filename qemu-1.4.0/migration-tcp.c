@@ -17,6 +17,7 @@
 #include "qemu/sockets.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/channel.h"
 #include "block/block.h"
 
 //#define DEBUG_MIGRATION_TCP
@@ -67,6 +68,14 @@ static void tcp_wait_for_connect(int fd, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    Error *local_err = NULL;
+
+    migration_channels_outgoing_init(host_port, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
     s->get_error = socket_errno;
     s->write = socket_write;
     s->close = tcp_close;
@@ -86,7 +95,8 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && socket_error() == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
+    /* RAM may come on more connections, see migration/channel.h */
+    migration_channels_incoming_listen(s);
 
     DPRINTF("accepted migration\n");
 
@@ -95,7 +105,7 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    f = qemu_fopen_socket(c);
+    f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         fprintf(stderr, "could not qemu_fopen socket\n");
         goto out;
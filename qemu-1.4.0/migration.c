@@ -23,6 +23,9 @@
 #include "migration/block.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
+#include "sysemu/cpus.h"
+#include "migration/postcopy.h"
+#include "migration/channel.h"
 
 //#define DEBUG_MIGRATION
 
@@ -83,6 +86,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -95,7 +100,11 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
+    migration_channels_incoming_cleanup();
+    /* after a switch to post-copy the page loader closes it */
+    if (!postcopy_incoming_started()) {
+        qemu_fclose(f);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
@@ -172,6 +181,17 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
     }
 }
 
+static void get_postcopy_stats(MigrationInfo *info)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->postcopy) {
+        info->has_postcopy = true;
+        info->postcopy = g_malloc0(sizeof(*info->postcopy));
+        postcopy_outgoing_get_info(info->postcopy);
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -200,6 +220,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
 
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -210,9 +234,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_postcopy_stats(info);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_postcopy_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -264,6 +290,9 @@ static int migrate_fd_cleanup(MigrationState *s)
 {
     int ret = 0;
 
+    /* however migration ended, stop slowing down the guest */
+    cpu_throttle_stop();
+
     if (s->file) {
         DPRINTF("closing file\n");
         ret = qemu_fclose(s->file);
@@ -383,6 +412,7 @@ static MigrationState *migrate_init(const MigrationParams *params)
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
     s->total_time = qemu_get_clock_ms(rt_clock);
+    migration_channels_outgoing_init(NULL, NULL);
 
     return s;
 }
@@ -436,6 +466,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -451,7 +483,14 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
 
 void qmp_migrate_cancel(Error **errp)
 {
-    migrate_fd_cancel(migrate_get_current());
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE && s->postcopy) {
+        /* the guest may already have run on the destination */
+        error_setg(errp, "post-copy migration cannot be cancelled");
+        return;
+    }
+    migrate_fd_cancel(s);
 }
 
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
@@ -511,6 +550,51 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_zero_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+bool migrate_compress_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS_BLOCKS];
+}
+
+bool migrate_compress_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS_PAGES];
+}
+
+bool migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
 /* migration thread support */
 
 
@@ -544,6 +628,21 @@ static ssize_t buffered_flush(MigrationState *s)
     return offset;
 }
 
+static void buffered_append(MigrationState *s, const uint8_t *buf, size_t size)
+{
+    if (size > (s->buffer_capacity - s->buffer_size)) {
+        DPRINTF("increasing buffer capacity from %zu by %zu\n",
+                s->buffer_capacity, size + 1024);
+
+        s->buffer_capacity += size + 1024;
+
+        s->buffer = g_realloc(s->buffer, s->buffer_capacity);
+    }
+
+    memcpy(s->buffer + s->buffer_size, buf, size);
+    s->buffer_size += size;
+}
+
 static int buffered_put_buffer(void *opaque, const uint8_t *buf,
                                int64_t pos, int size)
 {
@@ -562,19 +661,58 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf,
         return size;
     }
 
-    if (size > (s->buffer_capacity - s->buffer_size)) {
-        DPRINTF("increasing buffer capacity from %zu by %zu\n",
-                s->buffer_capacity, size + 1024);
+    buffered_append(s, buf, size);
+    return size;
+}
 
-        s->buffer_capacity += size + 1024;
+/* Data that fits in the current rate limit slice is sent straight from
+ * the caller's buffers, which saves copying guest pages into s->buffer.
+ * The rest is queued as by buffered_put_buffer().
+ */
+static int buffered_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
+{
+    MigrationState *s = opaque;
+    ssize_t error, ret;
+    const uint8_t *buf;
+    size_t size;
+    int i, total = 0;
 
-        s->buffer = g_realloc(s->buffer, s->buffer_capacity);
+    error = qemu_file_get_error(s->file);
+    if (error) {
+        DPRINTF("flush when error, bailing: %s\n", strerror(-error));
+        return error;
     }
 
-    memcpy(s->buffer + s->buffer_size, buf, size);
-    s->buffer_size += size;
+    for (i = 0; i < iovcnt; i++) {
+        buf = iov[i].iov_base;
+        size = iov[i].iov_len;
+
+        /* Anything already queued has to go first */
+        while (size > 0 && s->buffer_size == 0 &&
+               s->bytes_xfer < s->xfer_limit) {
+            ret = migrate_fd_put_buffer(s, buf,
+                                        MIN(size, s->xfer_limit - s->bytes_xfer));
+            if (ret < 0) {
+                DPRINTF("error writing data, %zd\n", ret);
+                return ret;
+            } else if (ret == 0) {
+                break;
+            }
+            buf += ret;
+            size -= ret;
+            s->bytes_xfer += ret;
+        }
 
-    return size;
+        if (size > 0) {
+            buffered_append(s, buf, size);
+        }
+        total += iov[i].iov_len;
+    }
+
+    DPRINTF("put %d bytes at %" PRId64 ", %zu queued\n",
+            total, pos, s->buffer_size);
+    return total;
 }
 
 static int buffered_close(void *opaque)
@@ -654,6 +792,93 @@ static int64_t buffered_get_rate_limit(void *opaque)
     return s->xfer_limit;
 }
 
+/* Send everything queued, whatever the rate limit */
+static int buffered_flush_all(MigrationState *s)
+{
+    ssize_t ret;
+
+    while (!qemu_file_get_error(s->file) && s->buffer_size) {
+        s->bytes_xfer = 0;
+        ret = buffered_flush(s);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return qemu_file_get_error(s->file);
+}
+
+/*
+ * Stop the guest and hand it to the destination along with the list of
+ * its pages that went stale.  Called with the iothread lock held.
+ */
+static int migrate_postcopy_start(MigrationState *s)
+{
+    int old_vm_running = runstate_is_running();
+    int64_t start_time = qemu_get_clock_ms(rt_clock);
+    int ret;
+
+    DPRINTF("switching to post-copy\n");
+    postcopy_outgoing_start(s->fd);
+    s->postcopy = true;
+
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    if (old_vm_running) {
+        vm_stop(RUN_STATE_FINISH_MIGRATE);
+    } else {
+        vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    }
+
+    ret = qemu_savevm_state_postcopy(s->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* from now on the destination's guest waits for whatever is queued, so
+       the bandwidth limit no longer applies */
+    s->xfer_limit = INT_MAX;
+    qemu_fflush(s->file);
+    ret = buffered_flush_all(s);
+    s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+    return ret;
+}
+
+/* Send the pages the destination asks for, and the rest in between */
+static int migrate_postcopy_run(MigrationState *s)
+{
+    int ret;
+
+    do {
+        qemu_mutex_lock_iothread();
+        if (s->state != MIG_STATE_ACTIVE) {
+            ret = -EIO;
+        } else {
+            ret = ram_postcopy_iterate(s->file);
+        }
+        qemu_mutex_unlock_iothread();
+        if (ret >= 0) {
+            int err = buffered_flush_all(s);
+            if (err < 0) {
+                ret = err;
+            }
+        }
+    } while (ret == 0);
+
+    if (ret < 0) {
+        postcopy_outgoing_finish(true);
+        return ret;
+    }
+    ret = postcopy_outgoing_finish(false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_mutex_lock_iothread();
+    s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
+    migrate_fd_completed(s);
+    qemu_mutex_unlock_iothread();
+    return 0;
+}
+
 static void *buffered_file_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -690,7 +915,13 @@ static void *buffered_file_thread(void *opaque)
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             DPRINTF("pending size %lu max %lu\n", pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (pending_size && pending_size >= max_size &&
+                migrate_postcopy_ram() && ram_postcopy_ready() &&
+                postcopy_outgoing_possible(s->fd)) {
+                ret = migrate_postcopy_start(s);
+                qemu_mutex_unlock_iothread();
+                break;
+            } else if (pending_size && pending_size >= max_size) {
                 ret = qemu_savevm_state_iterate(s->file);
                 if (ret < 0) {
                     qemu_mutex_unlock_iothread();
@@ -750,6 +981,14 @@ static void *buffered_file_thread(void *opaque)
         }
     }
 
+    if (s->postcopy) {
+        if (ret < 0) {
+            postcopy_outgoing_finish(true);
+        } else {
+            ret = migrate_postcopy_run(s);
+        }
+    }
+
 out:
     if (ret < 0) {
         migrate_fd_error(s);
@@ -761,6 +1000,7 @@ out:
 static const QEMUFileOps buffered_file_ops = {
     .get_fd =         buffered_get_fd,
     .put_buffer =     buffered_put_buffer,
+    .writev_buffer =  buffered_writev_buffer,
     .close =          buffered_close,
     .rate_limit =     buffered_rate_limit,
     .get_rate_limit = buffered_get_rate_limit,
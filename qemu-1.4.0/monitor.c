@@ -67,6 +67,8 @@
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "qemu/thread.h"
+#include "qemu/event_notifier.h"
+#include "qemu/sockets.h"
 
 /* for pic/irq_info */
 #if defined(TARGET_SPARC)
@@ -463,6 +465,7 @@ static const char *monitor_event_names[] = {
     [QEVENT_WAKEUP] = "WAKEUP",
     [QEVENT_BALLOON_CHANGE] = "BALLOON_CHANGE",
     [QEVENT_SPICE_MIGRATE_COMPLETED] = "SPICE_MIGRATE_COMPLETED",
+    [QEVENT_DUMP_COMPLETED] = "DUMP_COMPLETED",
 };
 QEMU_BUILD_BUG_ON(ARRAY_SIZE(monitor_event_names) != QEVENT_MAX)
 
@@ -1766,6 +1769,11 @@ static void do_info_mtree(Monitor *mon, const QDict *qdict)
     mtree_info((fprintf_function)monitor_printf, mon);
 }
 
+static void do_info_timers(Monitor *mon, const QDict *qdict)
+{
+    qemu_timer_info((fprintf_function)monitor_printf, mon);
+}
+
 static void do_info_numa(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -2429,6 +2437,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the network state",
         .mhandler.cmd = do_info_network,
     },
+    {
+        .name       = "netdev-queues",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the traffic and vhost threads of tap queues",
+        .mhandler.cmd = hmp_info_netdev_queues,
+    },
+    {
+        .name       = "xen-backends",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the I/O statistics of Xen PV backends",
+        .mhandler.cmd = hmp_info_xen_backends,
+    },
     {
         .name       = "chardev",
         .args_type  = "",
@@ -2450,6 +2472,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show block device statistics",
         .mhandler.cmd = hmp_info_blockstats,
     },
+    {
+        .name       = "thread-pools",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show I/O thread pools and their statistics",
+        .mhandler.cmd = hmp_info_thread_pools,
+    },
     {
         .name       = "block-jobs",
         .args_type  = "",
@@ -2540,6 +2569,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show memory tree",
         .mhandler.cmd = do_info_mtree,
     },
+    {
+        .name       = "mmio-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the most accessed device registers",
+        .mhandler.cmd = hmp_info_mmio_profile,
+    },
+    {
+        .name       = "timers",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the timers re-armed most often",
+        .mhandler.cmd = do_info_timers,
+    },
     {
         .name       = "jit",
         .args_type  = "",
@@ -2617,6 +2660,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show which guest mouse is receiving events",
         .mhandler.cmd = hmp_info_mice,
     },
+    {
+        .name       = "input-latency",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the latency of host input events",
+        .mhandler.cmd = hmp_info_input_latency,
+    },
     {
         .name       = "vnc",
         .args_type  = "",
@@ -2686,6 +2736,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.cmd = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the result of calc_dirty_rate",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -4465,7 +4522,7 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
 {
     int err;
     QObject *obj;
@@ -4701,7 +4758,7 @@ static void sortcmdlist(void)
  * End:
  */
 
-void monitor_init(CharDriverState *chr, int flags)
+static Monitor *monitor_create(CharDriverState *chr, int flags)
 {
     static int is_first_init = 1;
     Monitor *mon;
@@ -4738,8 +4795,384 @@ void monitor_init(CharDriverState *chr, int flags)
         default_mon = mon;
 
     sortcmdlist();
+    return mon;
 }
 
+void monitor_init(CharDriverState *chr, int flags)
+{
+    monitor_create(chr, flags);
+}
+
+/*
+ * QMP monitor thread
+ *
+ * The thread owns a listening socket and reads QMP requests from its client
+ * itself.  Commands flagged MONITOR_CMD_LOCKLESS are answered right there,
+ * without the global mutex, so that they get through while the main loop is
+ * busy.  Everything else goes to an ordinary QMP monitor, whose chardev
+ * exists only in memory: the request is fed to it from the main loop, and
+ * what it writes, replies and events alike, is passed back to the thread.
+ * A lockless command is only answered by the thread when the main loop has
+ * nothing of the client's left to handle, the greeting included, so that
+ * replies keep the order of the requests.
+ */
+#ifndef _WIN32
+
+typedef struct MonitorThreadRequest {
+    int event;              /* CHR_EVENT_* to deliver, if json is NULL */
+    char *json;
+    QSIMPLEQ_ENTRY(MonitorThreadRequest) next;
+} MonitorThreadRequest;
+
+typedef struct MonitorThread {
+    QemuThread thread;
+    int listen_fd;
+    EventNotifier wakeup;   /* output queued, or a request done */
+    EventNotifier request;  /* requests queued for the main loop */
+    JSONMessageParser parser;
+    CharDriverState *chr;
+    Monitor *mon;
+
+    /* Covers the fields below.  Only the thread changes fd. */
+    QemuMutex lock;
+    int fd;
+    GString *outbuf;
+    QSIMPLEQ_HEAD(, MonitorThreadRequest) requests;
+    int pending;            /* queued items the main loop has not handled */
+    bool closing;           /* CHR_EVENT_CLOSED not delivered yet */
+} MonitorThread;
+
+/* Output of the in-band monitor, in the main loop */
+static int monitor_thread_chr_write(CharDriverState *chr, const uint8_t *buf,
+                                    int len)
+{
+    MonitorThread *mt = chr->opaque;
+
+    qemu_mutex_lock(&mt->lock);
+    if (mt->fd >= 0 && !mt->closing) {
+        g_string_append_len(mt->outbuf, (const char *)buf, len);
+    }
+    qemu_mutex_unlock(&mt->lock);
+    event_notifier_set(&mt->wakeup);
+    return len;
+}
+
+static void monitor_thread_run_requests(EventNotifier *e)
+{
+    MonitorThread *mt = container_of(e, MonitorThread, request);
+    MonitorThreadRequest *req;
+
+    event_notifier_test_and_clear(e);
+
+    qemu_mutex_lock(&mt->lock);
+    while ((req = QSIMPLEQ_FIRST(&mt->requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&mt->requests, next);
+        qemu_mutex_unlock(&mt->lock);
+
+        if (req->json) {
+            qemu_chr_be_write(mt->chr, (uint8_t *)req->json,
+                              strlen(req->json));
+        } else {
+            qemu_chr_be_event(mt->chr, req->event);
+        }
+
+        qemu_mutex_lock(&mt->lock);
+        mt->pending--;
+        if (!req->json && req->event == CHR_EVENT_CLOSED) {
+            mt->closing = false;
+        }
+        g_free(req->json);
+        g_free(req);
+    }
+    qemu_mutex_unlock(&mt->lock);
+
+    event_notifier_set(&mt->wakeup);
+}
+
+/* Takes ownership of @json */
+static void monitor_thread_queue(MonitorThread *mt, int event, char *json)
+{
+    MonitorThreadRequest *req = g_malloc0(sizeof(*req));
+
+    req->event = event;
+    req->json = json;
+
+    qemu_mutex_lock(&mt->lock);
+    QSIMPLEQ_INSERT_TAIL(&mt->requests, req, next);
+    mt->pending++;
+    qemu_mutex_unlock(&mt->lock);
+
+    event_notifier_set(&mt->request);
+}
+
+static void monitor_thread_reply(MonitorThread *mt, QObject *data)
+{
+    QString *json;
+
+    json = mt->mon->flags & MONITOR_USE_PRETTY ? qobject_to_json_pretty(data) :
+                                                 qobject_to_json(data);
+    qemu_mutex_lock(&mt->lock);
+    g_string_append(mt->outbuf, qstring_get_str(json));
+    g_string_append_c(mt->outbuf, '\n');
+    qemu_mutex_unlock(&mt->lock);
+    QDECREF(json);
+}
+
+/* The command @input asks for, if the thread may answer it itself */
+static const mon_cmd_t *monitor_thread_lockless_cmd(MonitorThread *mt,
+                                                    QDict *input)
+{
+    const QDictEntry *ent;
+    const mon_cmd_t *cmd = NULL;
+    QObject *obj;
+    bool idle;
+
+    for (ent = qdict_first(input); ent; ent = qdict_next(input, ent)) {
+        const char *key = qdict_entry_key(ent);
+
+        obj = qdict_entry_value(ent);
+        if (!strcmp(key, "execute")) {
+            if (qobject_type(obj) != QTYPE_QSTRING) {
+                return NULL;
+            }
+            cmd = qmp_find_cmd(qstring_get_str(qobject_to_qstring(obj)));
+        } else if (!strcmp(key, "arguments")) {
+            if (qobject_type(obj) != QTYPE_QDICT ||
+                qdict_size(qobject_to_qdict(obj))) {
+                return NULL;
+            }
+        } else if (strcmp(key, "id")) {
+            return NULL;
+        }
+    }
+    if (!cmd || !(cmd->flags & MONITOR_CMD_LOCKLESS) ||
+        !qmp_cmd_mode(mt->mon)) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&mt->lock);
+    idle = !mt->pending;
+    qemu_mutex_unlock(&mt->lock);
+    return idle ? cmd : NULL;
+}
+
+static void monitor_thread_handle_command(JSONMessageParser *parser,
+                                          GQueue *tokens)
+{
+    MonitorThread *mt = container_of(parser, MonitorThread, parser);
+    const mon_cmd_t *cmd = NULL;
+    QObject *obj, *data = NULL, *id;
+    QDict *input, *args, *rsp;
+    QString *json;
+
+    obj = json_parser_parse(tokens, NULL);
+    if (obj && qobject_type(obj) == QTYPE_QDICT) {
+        cmd = monitor_thread_lockless_cmd(mt, qobject_to_qdict(obj));
+    }
+
+    if (!cmd) {
+        if (obj) {
+            json = qobject_to_json(obj);
+            monitor_thread_queue(mt, -1, g_strdup(qstring_get_str(json)));
+            QDECREF(json);
+        } else {
+            /* An invalid byte makes the monitor report the error itself,
+             * in its place among the replies */
+            monitor_thread_queue(mt, -1, g_strdup("\xff"));
+        }
+        qobject_decref(obj);
+        return;
+    }
+
+    input = qobject_to_qdict(obj);
+    args = qdict_new();
+    cmd->mhandler.cmd_new(mt->mon, args, &data);
+    QDECREF(args);
+
+    rsp = qdict_new();
+    qdict_put_obj(rsp, "return", data ? data : QOBJECT(qdict_new()));
+    id = qdict_get(input, "id");
+    if (id) {
+        qobject_incref(id);
+        qdict_put_obj(rsp, "id", id);
+    }
+    monitor_thread_reply(mt, QOBJECT(rsp));
+    QDECREF(rsp);
+    QDECREF(input);
+}
+
+static void monitor_thread_accept(MonitorThread *mt)
+{
+    int fd;
+
+    fd = qemu_accept(mt->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    socket_set_nonblock(fd);
+    json_message_parser_init(&mt->parser, monitor_thread_handle_command);
+
+    qemu_mutex_lock(&mt->lock);
+    mt->fd = fd;
+    qemu_mutex_unlock(&mt->lock);
+    monitor_thread_queue(mt, CHR_EVENT_OPENED, NULL);
+}
+
+static void monitor_thread_disconnect(MonitorThread *mt)
+{
+    MonitorThreadRequest *req, *tmp;
+
+    json_message_parser_destroy(&mt->parser);
+
+    qemu_mutex_lock(&mt->lock);
+    close(mt->fd);
+    mt->fd = -1;
+    mt->closing = true;
+    g_string_truncate(mt->outbuf, 0);
+    /* nobody is left to read what the requests not started yet answer */
+    QSIMPLEQ_FOREACH_SAFE(req, &mt->requests, next, tmp) {
+        if (req->json) {
+            QSIMPLEQ_REMOVE(&mt->requests, req, MonitorThreadRequest, next);
+            mt->pending--;
+            g_free(req->json);
+            g_free(req);
+        }
+    }
+    qemu_mutex_unlock(&mt->lock);
+    monitor_thread_queue(mt, CHR_EVENT_CLOSED, NULL);
+}
+
+/* Returns false if the client is gone */
+static bool monitor_thread_flush(MonitorThread *mt)
+{
+    bool ok = true;
+    ssize_t ret;
+
+    qemu_mutex_lock(&mt->lock);
+    while (mt->outbuf->len) {
+        ret = write(mt->fd, mt->outbuf->str, mt->outbuf->len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ok = errno == EAGAIN;
+            break;
+        }
+        g_string_erase(mt->outbuf, 0, ret);
+    }
+    qemu_mutex_unlock(&mt->lock);
+    return ok;
+}
+
+static void *monitor_thread_fn(void *opaque)
+{
+    MonitorThread *mt = opaque;
+    GPollFD fds[2];
+    char buf[4096];
+    int nfds;
+    ssize_t len;
+
+    for (;;) {
+        fds[0].fd = event_notifier_get_fd(&mt->wakeup);
+        fds[0].events = G_IO_IN;
+        fds[0].revents = 0;
+        nfds = 1;
+
+        qemu_mutex_lock(&mt->lock);
+        if (mt->fd >= 0) {
+            fds[1].fd = mt->fd;
+            fds[1].events = G_IO_IN | (mt->outbuf->len ? G_IO_OUT : 0);
+            nfds = 2;
+        } else if (!mt->closing) {
+            /* the next client waits until the monitor saw the last go */
+            fds[1].fd = mt->listen_fd;
+            fds[1].events = G_IO_IN;
+            nfds = 2;
+        }
+        fds[1].revents = 0;
+        qemu_mutex_unlock(&mt->lock);
+
+        if (g_poll(fds, nfds, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents) {
+            event_notifier_test_and_clear(&mt->wakeup);
+        }
+        if (nfds < 2 || !fds[1].revents) {
+            continue;
+        }
+
+        if (fds[1].fd == mt->listen_fd) {
+            monitor_thread_accept(mt);
+            continue;
+        }
+        if ((fds[1].revents & G_IO_OUT) && !monitor_thread_flush(mt)) {
+            monitor_thread_disconnect(mt);
+            continue;
+        }
+        if (fds[1].revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+            len = read(mt->fd, buf, sizeof(buf));
+            if (len > 0) {
+                json_message_parser_feed(&mt->parser, buf, len);
+            } else if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+                monitor_thread_disconnect(mt);
+            }
+        }
+    }
+    return NULL;
+}
+
+void monitor_thread_init(const char *address)
+{
+    MonitorThread *mt;
+    SocketAddress *addr;
+    CharDriverState *chr;
+    Error *err = NULL;
+    int fd = -1;
+
+    addr = socket_parse(address, &err);
+    if (addr) {
+        fd = socket_listen(addr, &err);
+        qapi_free_SocketAddress(addr);
+    }
+    if (error_is_set(&err)) {
+        error_report("qmp-thread %s: %s", address, error_get_pretty(err));
+        error_free(err);
+        exit(1);
+    }
+    socket_set_nonblock(fd);
+
+    mt = g_malloc0(sizeof(*mt));
+    mt->listen_fd = fd;
+    mt->fd = -1;
+    mt->outbuf = g_string_new(NULL);
+    QSIMPLEQ_INIT(&mt->requests);
+    qemu_mutex_init(&mt->lock);
+    if (event_notifier_init(&mt->wakeup, 0) < 0 ||
+        event_notifier_init(&mt->request, 0) < 0) {
+        error_report("qmp-thread: cannot create event notifiers");
+        exit(1);
+    }
+    event_notifier_set_handler(&mt->request, monitor_thread_run_requests);
+
+    chr = g_malloc0(sizeof(*chr));
+    chr->label = g_strdup("qmp-thread");
+    chr->chr_write = monitor_thread_chr_write;
+    chr->opaque = mt;
+    mt->chr = chr;
+    mt->mon = monitor_create(chr, MONITOR_USE_CONTROL);
+
+    qemu_thread_create(&mt->thread, monitor_thread_fn, mt,
+                       QEMU_THREAD_DETACHED);
+}
+#else
+void monitor_thread_init(const char *address)
+{
+    error_report("qmp-thread is not supported on this host");
+    exit(1);
+}
+#endif
+
 static void bdrv_password_cb(Monitor *mon, const char *password, void *opaque)
 {
     BlockDriverState *bs = opaque;
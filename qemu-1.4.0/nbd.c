@@ -34,6 +34,7 @@
 
 #ifdef __linux__
 #include <linux/fs.h>
+#include <sys/sendfile.h>
 #endif
 
 #include "qemu/sockets.h"
@@ -85,7 +86,11 @@ typedef struct NBDRequest NBDRequest;
 struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
-    uint8_t *data;
+    uint8_t *data;              /* allocated on first use, then pooled */
+
+    /* If data_fd >= 0, the reply payload is sent from there instead */
+    int data_fd;
+    off_t data_offset;
 };
 
 struct NBDExport {
@@ -804,7 +809,7 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
+#define MAX_NBD_REQUESTS 64
 
 void nbd_client_get(NBDClient *client)
 {
@@ -859,16 +864,26 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 
     if (QSIMPLEQ_EMPTY(&exp->requests)) {
         req = g_malloc0(sizeof(NBDRequest));
-        req->data = qemu_blockalign(exp->bs, NBD_BUFFER_SIZE);
     } else {
         req = QSIMPLEQ_FIRST(&exp->requests);
         QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
     }
     nbd_client_get(client);
     req->client = client;
+    req->data_fd = -1;
     return req;
 }
 
+/* Requests that never touch data, and reads served by sendfile, do not
+ * need a buffer; this keeps many of them in flight cheap.
+ */
+static void nbd_request_alloc_data(NBDRequest *req)
+{
+    if (!req->data) {
+        req->data = qemu_blockalign(req->client->exp->bs, NBD_BUFFER_SIZE);
+    }
+}
+
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
@@ -989,6 +1004,57 @@ static int nbd_can_read(void *opaque);
 static void nbd_read(void *opaque);
 static void nbd_restart_write(void *opaque);
 
+/* Return a file descriptor that reads can be sent from with sendfile(),
+ * or -ENOTSUP.  This is limited to read-only exports of images that the
+ * block layer does not transform, and that are not opened with O_DIRECT.
+ */
+static int nbd_export_passthrough_fd(NBDExport *exp)
+{
+#ifdef __linux__
+    if (!(exp->nbdflags & NBD_FLAG_READ_ONLY) ||
+        (bdrv_get_flags(exp->bs) & BDRV_O_NOCACHE)) {
+        return -ENOTSUP;
+    }
+    return bdrv_get_passthrough_fd(exp->bs);
+#else
+    return -ENOTSUP;
+#endif
+}
+
+static ssize_t nbd_co_sendfile(int csock, int fd, off_t offset, size_t len)
+{
+#ifdef __linux__
+    static uint8_t zeroes[BDRV_SECTOR_SIZE];
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = sendfile(csock, fd, &offset, len - done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                qemu_coroutine_yield();
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* The last sector of the image can be partial */
+            ret = qemu_co_send(csock, zeroes, MIN(len - done, sizeof(zeroes)));
+            if (ret <= 0) {
+                return -EIO;
+            }
+        }
+        done += ret;
+    }
+    return done;
+#else
+    abort();
+#endif
+}
+
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -1007,7 +1073,12 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
         socket_set_cork(csock, 1);
         rc = nbd_send_reply(csock, reply);
         if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
+            if (req->data_fd >= 0) {
+                ret = nbd_co_sendfile(csock, req->data_fd, req->data_offset,
+                                      len);
+            } else {
+                ret = qemu_co_send(csock, req->data, len);
+            }
             if (ret != len) {
                 rc = -EIO;
             }
@@ -1055,6 +1126,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
+        nbd_request_alloc_data(req);
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
             LOG("reading from socket failed");
             rc = -EIO;
@@ -1121,12 +1193,18 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
-        if (ret < 0) {
-            LOG("reading from file failed");
-            reply.error = -ret;
-            goto error_reply;
+        req->data_fd = nbd_export_passthrough_fd(exp);
+        if (req->data_fd >= 0) {
+            req->data_offset = request.from + exp->dev_offset;
+        } else {
+            nbd_request_alloc_data(req);
+            ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
+                            req->data, request.len / 512);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                reply.error = -ret;
+                goto error_reply;
+            }
         }
 
         TRACE("Read %u byte(s)", request.len);
@@ -15,12 +15,26 @@
  *  along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/cpu-features.h"
 #include "net/checksum.h"
 
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <immintrin.h>
+#define NET_CHECKSUM_X86
+#endif
+
+#if defined(__ARM_NEON__) && !defined(HOST_WORDS_BIGENDIAN)
+#include <arm_neon.h>
+#define NET_CHECKSUM_NEON
+#endif
+
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add(int len, uint8_t *buf)
+uint32_t net_checksum_add_c(int len, const uint8_t *buf)
 {
     uint32_t sum = 0;
     int i;
@@ -34,6 +48,239 @@ uint32_t net_checksum_add(int len, uint8_t *buf)
     return sum;
 }
 
+uint32_t net_checksum_add_copy_c(int len, uint8_t *dst, const uint8_t *src)
+{
+    if (len <= 0) {
+        return 0;
+    }
+    memcpy(dst, src, len);
+    return net_checksum_add_c(len, dst);
+}
+
+/* The vector kernels add up the buffer as little-endian 16-bit words into
+ * 32-bit lanes.  The ones' complement sum does not care about byte order
+ * as long as it is swapped back at the end (RFC 1071), so folding the
+ * lanes and swapping the two bytes gives the network order sum.
+ *
+ * A lane takes at most 2 * 0xffff per block, so the lanes are emptied
+ * into a 64-bit total every NET_CHECKSUM_LANE_BLOCKS blocks, before they
+ * can overflow.
+ */
+#define NET_CHECKSUM_LANE_BLOCKS 32768
+
+static inline uint32_t net_checksum_fold_swap(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return bswap16(sum);
+}
+
+#ifdef NET_CHECKSUM_X86
+
+/* As in util/pixel-conv.c, the kernels carry their own target attributes
+ * and only run once CPUID has said the instructions are there.
+ */
+#define SSE2_CHECKSUM(name, copy)                                           \
+static uint64_t __attribute__((target("sse2")))                             \
+name(int len, uint8_t *dst, const uint8_t *src)                             \
+{                                                                           \
+    const __m128i zero = _mm_setzero_si128();                               \
+    uint32_t lanes[4];                                                      \
+    uint64_t sum = 0;                                                       \
+    int n;                                                                  \
+                                                                            \
+    while (len) {                                                           \
+        __m128i acc = zero;                                                 \
+                                                                            \
+        n = MIN(len, 16 * NET_CHECKSUM_LANE_BLOCKS);                        \
+        len -= n;                                                           \
+        for (; n; n -= 16) {                                                \
+            __m128i v = _mm_loadu_si128((const __m128i *)src);              \
+            if (copy) {                                                     \
+                _mm_storeu_si128((__m128i *)dst, v);                        \
+                dst += 16;                                                  \
+            }                                                               \
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));          \
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));          \
+            src += 16;                                                      \
+        }                                                                   \
+        _mm_storeu_si128((__m128i *)lanes, acc);                            \
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];         \
+    }                                                                       \
+    return sum;                                                             \
+}
+
+SSE2_CHECKSUM(net_checksum_add_sse2_body, false)
+SSE2_CHECKSUM(net_checksum_add_copy_sse2_body, true)
+
+/* The lanes are added up in any order, so the AVX2 version does not have
+ * to undo the in-lane behaviour of unpack{lo,hi}.
+ */
+#define AVX2_CHECKSUM(name, copy)                                           \
+static uint64_t __attribute__((target("avx2")))                             \
+name(int len, uint8_t *dst, const uint8_t *src)                             \
+{                                                                           \
+    const __m256i zero = _mm256_setzero_si256();                            \
+    uint32_t lanes[8];                                                      \
+    uint64_t sum = 0;                                                       \
+    int i, n;                                                               \
+                                                                            \
+    while (len) {                                                           \
+        __m256i acc = zero;                                                 \
+                                                                            \
+        n = MIN(len, 32 * NET_CHECKSUM_LANE_BLOCKS);                        \
+        len -= n;                                                           \
+        for (; n; n -= 32) {                                                \
+            __m256i v = _mm256_loadu_si256((const __m256i *)src);           \
+            if (copy) {                                                     \
+                _mm256_storeu_si256((__m256i *)dst, v);                     \
+                dst += 32;                                                  \
+            }                                                               \
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));    \
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));    \
+            src += 32;                                                      \
+        }                                                                   \
+        _mm256_storeu_si256((__m256i *)lanes, acc);                         \
+        for (i = 0; i < 8; i++) {                                           \
+            sum += lanes[i];                                                \
+        }                                                                   \
+    }                                                                       \
+    return sum;                                                             \
+}
+
+AVX2_CHECKSUM(net_checksum_add_avx2_body, false)
+AVX2_CHECKSUM(net_checksum_add_copy_avx2_body, true)
+
+#endif /* NET_CHECKSUM_X86 */
+
+#ifdef NET_CHECKSUM_NEON
+
+/* vpadal adds pairs of 16-bit lanes into the 32-bit accumulator */
+#define NEON_CHECKSUM(name, copy)                                           \
+static uint64_t name(int len, uint8_t *dst, const uint8_t *src)             \
+{                                                                           \
+    uint64_t sum = 0;                                                       \
+    int n;                                                                  \
+                                                                            \
+    while (len) {                                                           \
+        uint32x4_t acc = vdupq_n_u32(0);                                    \
+                                                                            \
+        n = MIN(len, 16 * NET_CHECKSUM_LANE_BLOCKS);                        \
+        len -= n;                                                           \
+        for (; n; n -= 16) {                                                \
+            uint8x16_t v = vld1q_u8(src);                                   \
+            if (copy) {                                                     \
+                vst1q_u8(dst, v);                                           \
+                dst += 16;                                                  \
+            }                                                               \
+            acc = vpadalq_u16(acc, vreinterpretq_u16_u8(v));                \
+            src += 16;                                                      \
+        }                                                                   \
+        sum += (uint64_t)vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +  \
+               vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);             \
+    }                                                                       \
+    return sum;                                                             \
+}
+
+NEON_CHECKSUM(net_checksum_add_neon_body, false)
+NEON_CHECKSUM(net_checksum_add_copy_neon_body, true)
+
+#endif /* NET_CHECKSUM_NEON */
+
+/* Each vector body only handles whole blocks of @block bytes.  The blocks
+ * cover an even number of bytes, so the rest of the buffer starts on a
+ * word and the portable version can finish it.  The result is the sum
+ * folded to 16 bits plus that of the rest, which net_checksum_finish()
+ * turns into the same checksum as the portable sum.
+ */
+#define NET_CHECKSUM_WRAP(name, body, block)                                \
+static uint32_t name(int len, const uint8_t *buf)                           \
+{                                                                           \
+    int n = len > 0 ? len & ~((block) - 1) : 0;                             \
+    uint32_t sum = 0;                                                       \
+                                                                            \
+    if (n) {                                                                \
+        sum = net_checksum_fold_swap(body(n, NULL, buf));                   \
+    }                                                                       \
+    return sum + net_checksum_add_c(len - n, buf + n);                      \
+}
+
+#define NET_CHECKSUM_COPY_WRAP(name, body, block)                           \
+static uint32_t name(int len, uint8_t *dst, const uint8_t *src)             \
+{                                                                           \
+    int n = len > 0 ? len & ~((block) - 1) : 0;                             \
+    uint32_t sum = 0;                                                       \
+                                                                            \
+    if (n) {                                                                \
+        sum = net_checksum_fold_swap(body(n, dst, src));                    \
+    }                                                                       \
+    return sum + net_checksum_add_copy_c(len - n, dst + n, src + n);        \
+}
+
+#ifdef NET_CHECKSUM_X86
+NET_CHECKSUM_WRAP(net_checksum_add_sse2, net_checksum_add_sse2_body, 16)
+NET_CHECKSUM_WRAP(net_checksum_add_avx2, net_checksum_add_avx2_body, 32)
+NET_CHECKSUM_COPY_WRAP(net_checksum_add_copy_sse2,
+                       net_checksum_add_copy_sse2_body, 16)
+NET_CHECKSUM_COPY_WRAP(net_checksum_add_copy_avx2,
+                       net_checksum_add_copy_avx2_body, 32)
+#endif
+
+#ifdef NET_CHECKSUM_NEON
+NET_CHECKSUM_WRAP(net_checksum_add_neon, net_checksum_add_neon_body, 16)
+NET_CHECKSUM_COPY_WRAP(net_checksum_add_copy_neon,
+                       net_checksum_add_copy_neon_body, 16)
+#endif
+
+static uint32_t (*net_checksum_add_fn)(int len, const uint8_t *buf) =
+    net_checksum_add_c;
+static uint32_t (*net_checksum_add_copy_fn)(int len, uint8_t *dst,
+                                            const uint8_t *src) =
+    net_checksum_add_copy_c;
+static const char *net_checksum_accel = "c";
+
+const char *net_checksum_accel_name(void)
+{
+    return net_checksum_accel;
+}
+
+static void __attribute__((constructor)) net_checksum_init(void)
+{
+#ifdef NET_CHECKSUM_X86
+    unsigned a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return;
+    }
+    if (d & bit_SSE2) {
+        net_checksum_add_fn = net_checksum_add_sse2;
+        net_checksum_add_copy_fn = net_checksum_add_copy_sse2;
+        net_checksum_accel = "sse2";
+    }
+    if (qemu_cpu_has_avx2()) {
+        net_checksum_add_fn = net_checksum_add_avx2;
+        net_checksum_add_copy_fn = net_checksum_add_copy_avx2;
+        net_checksum_accel = "avx2";
+    }
+#endif
+#ifdef NET_CHECKSUM_NEON
+    net_checksum_add_fn = net_checksum_add_neon;
+    net_checksum_add_copy_fn = net_checksum_add_copy_neon;
+    net_checksum_accel = "neon";
+#endif
+}
+
+uint32_t net_checksum_add(int len, uint8_t *buf)
+{
+    return net_checksum_add_fn(len, buf);
+}
+
+uint32_t net_checksum_add_copy(int len, uint8_t *dst, const uint8_t *src)
+{
+    return net_checksum_add_copy_fn(len, dst, src);
+}
+
 uint16_t net_checksum_finish(uint32_t sum)
 {
     while (sum>>16)
@@ -38,6 +38,9 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
 int net_init_hubport(const NetClientOptions *opts, const char *name,
                      NetClientState *peer);
 
+int net_init_null(const NetClientOptions *opts, const char *name,
+                  NetClientState *peer);
+
 int net_init_socket(const NetClientOptions *opts, const char *name,
                     NetClientState *peer);
 
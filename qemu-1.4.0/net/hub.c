@@ -17,13 +17,30 @@
 #include "clients.h"
 #include "hub.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * A learning hub remembers the port each source MAC address came from, and
+ * sends unicast frames for a known address to that port alone, as a switch
+ * would.  The table is direct mapped: an address that hashes to a taken slot
+ * replaces the older one, which is then flooded again until seen anew.
  */
 
+#define ETH_ALEN 6
+
+#define NET_HUB_MAC_TABLE_SIZE  256
+#define NET_HUB_MAC_AGEING_MS   (300 * 1000)
+
+typedef struct NetHubMacEntry {
+    uint8_t mac[ETH_ALEN];
+    struct NetHubPort *port;
+    int64_t last_seen;
+} NetHubMacEntry;
+
 typedef struct NetHub NetHub;
 
 typedef struct NetHubPort {
@@ -38,15 +55,69 @@ struct NetHub {
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    NetHubMacEntry *mac_table;
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
+static NetHubMacEntry *net_hub_mac_entry(NetHub *hub, const uint8_t *mac)
+{
+    unsigned int hash = 0;
+    int i;
+
+    for (i = 0; i < ETH_ALEN; i++) {
+        hash = hash * 31 + mac[i];
+    }
+    return &hub->mac_table[hash % NET_HUB_MAC_TABLE_SIZE];
+}
+
+/* Learn the source of @hdr, the start of an ethernet frame, and return the
+ * port its destination is behind, or NULL to flood it
+ */
+static NetHubPort *net_hub_learn(NetHub *hub, NetHubPort *source_port,
+                                 const uint8_t *hdr, size_t len)
+{
+    const uint8_t *dst = hdr, *src = hdr + ETH_ALEN;
+    NetHubMacEntry *entry;
+    int64_t now;
+
+    if (!hub->mac_table || len < 2 * ETH_ALEN) {
+        return NULL;
+    }
+
+    now = qemu_get_clock_ms(rt_clock);
+    if (!(src[0] & 1)) {
+        entry = net_hub_mac_entry(hub, src);
+        memcpy(entry->mac, src, ETH_ALEN);
+        entry->port = source_port;
+        entry->last_seen = now;
+    }
+
+    if (dst[0] & 1) {
+        return NULL;
+    }
+    entry = net_hub_mac_entry(hub, dst);
+    if (entry->port && !memcmp(entry->mac, dst, ETH_ALEN) &&
+        now - entry->last_seen < NET_HUB_MAC_AGEING_MS) {
+        return entry->port;
+    }
+    return NULL;
+}
+
 static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
                                const uint8_t *buf, size_t len)
 {
     NetHubPort *port;
 
+    port = net_hub_learn(hub, source_port, buf, len);
+    if (port) {
+        /* a frame for the port it came from goes nowhere */
+        if (port != source_port) {
+            qemu_send_packet(&port->nc, buf, len);
+        }
+        return len;
+    }
+
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
@@ -62,6 +133,18 @@ static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
 {
     NetHubPort *port;
     ssize_t len = iov_size(iov, iovcnt);
+    uint8_t hdr[2 * ETH_ALEN];
+
+    if (hub->mac_table) {
+        port = net_hub_learn(hub, source_port, hdr,
+                             iov_to_buf(iov, iovcnt, 0, hdr, sizeof(hdr)));
+        if (port) {
+            if (port != source_port) {
+                qemu_sendv_packet(&port->nc, iov, iovcnt);
+            }
+            return len;
+        }
+    }
 
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
@@ -81,6 +164,7 @@ static NetHub *net_hub_new(int id)
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
+    hub->mac_table = NULL;
 
     QLIST_INSERT_HEAD(&hubs, hub, next);
 
@@ -122,11 +206,39 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
     return net_hub_receive_iov(port->hub, port, iov, iovcnt);
 }
 
+static void net_hub_port_receive_batch(NetClientState *nc, bool start)
+{
+    NetHubPort *port;
+    NetHubPort *src_port = DO_UPCAST(NetHubPort, nc, nc);
+
+    QLIST_FOREACH(port, &src_port->hub->ports, next) {
+        if (port == src_port) {
+            continue;
+        }
+
+        if (start) {
+            qemu_send_batch_begin(&port->nc);
+        } else {
+            qemu_send_batch_end(&port->nc);
+        }
+    }
+}
+
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+    NetHub *hub = port->hub;
+    int i;
 
     QLIST_REMOVE(port, next);
+
+    if (hub->mac_table) {
+        for (i = 0; i < NET_HUB_MAC_TABLE_SIZE; i++) {
+            if (hub->mac_table[i].port == port) {
+                hub->mac_table[i].port = NULL;
+            }
+        }
+    }
 }
 
 static NetClientInfo net_hub_port_info = {
@@ -135,6 +247,7 @@ static NetClientInfo net_hub_port_info = {
     .can_receive = net_hub_port_can_receive,
     .receive = net_hub_port_receive,
     .receive_iov = net_hub_port_receive_iov,
+    .receive_batch = net_hub_port_receive_batch,
     .cleanup = net_hub_port_cleanup,
 };
 
@@ -243,7 +356,8 @@ void net_hub_info(Monitor *mon)
     NetHubPort *port;
 
     QLIST_FOREACH(hub, &hubs, next) {
-        monitor_printf(mon, "hub %d\n", hub->id);
+        monitor_printf(mon, "hub %d%s\n", hub->id,
+                       hub->mac_table ? " (learning)" : "");
         QLIST_FOREACH(port, &hub->ports, next) {
             if (port->nc.peer) {
                 monitor_printf(mon, " \\ ");
@@ -281,6 +395,7 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
                      NetClientState *peer)
 {
     const NetdevHubPortOptions *hubport;
+    NetHubPort *port;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_HUBPORT);
     hubport = opts->hubport;
@@ -290,7 +405,10 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
         return -EINVAL;
     }
 
-    net_hub_add_port(hubport->hubid, name);
+    port = DO_UPCAST(NetHubPort, nc, net_hub_add_port(hubport->hubid, name));
+    if (hubport->has_learning && hubport->learning && !port->hub->mac_table) {
+        port->hub->mac_table = g_new0(NetHubMacEntry, NET_HUB_MAC_TABLE_SIZE);
+    }
     return 0;
 }
 
@@ -322,6 +440,7 @@ void net_hub_check_clients(void)
             case NET_CLIENT_OPTIONS_KIND_TAP:
             case NET_CLIENT_OPTIONS_KIND_SOCKET:
             case NET_CLIENT_OPTIONS_KIND_VDE:
+            case NET_CLIENT_OPTIONS_KIND_NULL:
                 has_host_dev = 1;
                 break;
             default:
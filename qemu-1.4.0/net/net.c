@@ -27,6 +27,7 @@
 #include "clients.h"
 #include "hub.h"
 #include "net/slirp.h"
+#include "net/tap.h"
 #include "util.h"
 
 #include "monitor/monitor.h"
@@ -311,6 +312,9 @@ static void qemu_free_net_client(NetClientState *nc)
     if (nc->peer) {
         nc->peer->peer = NULL;
     }
+    if (nc->tx_latency) {
+        latency_histogram_free(nc->tx_latency);
+    }
     g_free(nc->name);
     g_free(nc->model);
     if (nc->destructor) {
@@ -443,6 +447,25 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
     return ret;
 }
 
+static void qemu_send_batch(NetClientState *sender, bool start)
+{
+    NetClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, start);
+    }
+}
+
+void qemu_send_batch_begin(NetClientState *sender)
+{
+    qemu_send_batch(sender, true);
+}
+
+void qemu_send_batch_end(NetClientState *sender)
+{
+    qemu_send_batch(sender, false);
+}
+
 void qemu_purge_queued_packets(NetClientState *nc)
 {
     if (!nc->peer) {
@@ -738,6 +761,7 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+        [NET_CLIENT_OPTIONS_KIND_NULL]      = net_init_null,
 };
 
 
@@ -768,6 +792,7 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+        case NET_CLIENT_OPTIONS_KIND_NULL:
             break;
 
         default:
@@ -846,7 +871,7 @@ int net_client_init(QemuOpts *opts, int is_netdev, Error **errp)
 static int net_host_check_device(const char *device)
 {
     int i;
-    const char *valid_param_list[] = { "tap", "socket", "dump"
+    const char *valid_param_list[] = { "tap", "socket", "dump", "null"
 #ifdef CONFIG_NET_BRIDGE
                                        , "bridge"
 #endif
@@ -1000,6 +1025,100 @@ void do_info_network(Monitor *mon, const QDict *qdict)
     }
 }
 
+NetdevQueueInfoList *qmp_query_netdev_queues(Error **errp)
+{
+    NetdevQueueInfoList *head = NULL, **tail = &head, *entry;
+    NetdevQueueInfo *info;
+    NetClientState *nc;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (nc->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+            continue;
+        }
+        info = tap_get_queue_info(nc);
+        if (!info) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+NicQueueLatencyInfoList *qmp_query_nic_latency(Error **errp)
+{
+    NicQueueLatencyInfoList *head = NULL, **tail = &head, *entry;
+    NicQueueLatencyInfo *info;
+    NetClientState *nc;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (!nc->tx_latency) {
+            continue;
+        }
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(nc->name);
+        info->queue = nc->queue_index;
+        info->tx_latency_histogram = latency_histogram_info(nc->tx_latency);
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+void qmp_nic_latency_histogram_set(const char *name, bool has_enable,
+                                   bool enable, bool has_min_ns,
+                                   int64_t min_ns, bool has_bins,
+                                   int64_t bins, Error **errp)
+{
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    LatencyHistogram *hist[MAX_QUEUE_NUM];
+    NetClientState *nc;
+    int queues = 0, i;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC &&
+            !strcmp(nc->name, name) && queues < MAX_QUEUE_NUM) {
+            ncs[queues++] = nc;
+        }
+    }
+    if (queues == 0) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, name);
+        return;
+    }
+    if (!ncs[0]->info->tx_latency) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "name",
+                  "a network adapter that collects latencies");
+        return;
+    }
+
+    if (!has_enable || enable) {
+        for (i = 0; i < queues; i++) {
+            hist[i] = latency_histogram_new(
+                has_min_ns ? min_ns : LATENCY_HISTOGRAM_DEFAULT_MIN_NS,
+                has_bins ? bins : LATENCY_HISTOGRAM_DEFAULT_BINS, errp);
+            if (!hist[i]) {
+                while (i--) {
+                    latency_histogram_free(hist[i]);
+                }
+                return;
+            }
+        }
+    } else {
+        memset(hist, 0, sizeof(hist));
+    }
+
+    for (i = 0; i < queues; i++) {
+        if (ncs[i]->tx_latency) {
+            latency_histogram_free(ncs[i]->tx_latency);
+        }
+        ncs[i]->tx_latency = hist[i];
+    }
+}
+
 void qmp_set_link(const char *name, bool up, Error **errp)
 {
     NetClientState *ncs[MAX_QUEUE_NUM];
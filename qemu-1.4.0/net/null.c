@@ -0,0 +1,142 @@
+/*
+ * Null network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "net/net.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/timer.h"
+
+/*
+ * Packets sent to this backend are dropped as soon as they arrive, so a NIC
+ * can transmit as fast as its emulation allows.  With rx-pps set, the
+ * backend also sends broadcast frames of rx-size bytes towards the NIC at
+ * that rate.  vm_clock paces the frames, so none arrive while the guest is
+ * stopped.  If the NIC cannot keep up, frames wait in its send queue.  No
+ * more are generated until that queue drains.
+ */
+
+#define NULL_RX_TICK_NS     (SCALE_MS)
+#define NULL_RX_SIZE_MIN    60
+#define NULL_RX_SIZE_MAX    65535
+
+typedef struct NullState {
+    NetClientState nc;
+    QEMUTimer *rx_timer;
+    uint8_t *rx_frame;
+    uint32_t rx_size;
+    uint32_t rx_pps;
+    uint32_t rx_credit;     /* packets per second owed, times 1000 */
+    bool rx_blocked;        /* the peer queued a frame, wait for it */
+} NullState;
+
+static ssize_t null_receive(NetClientState *nc, const uint8_t *buf,
+                            size_t size)
+{
+    return size;
+}
+
+static ssize_t null_receive_iov(NetClientState *nc, const struct iovec *iov,
+                                int iovcnt)
+{
+    return iov_size(iov, iovcnt);
+}
+
+static void null_rx_sent(NetClientState *nc, ssize_t len)
+{
+    NullState *s = DO_UPCAST(NullState, nc, nc);
+
+    s->rx_blocked = false;
+}
+
+static void null_rx_timer(void *opaque)
+{
+    NullState *s = opaque;
+    uint32_t n;
+
+    s->rx_credit += s->rx_pps;
+    n = s->rx_credit / 1000;
+    s->rx_credit %= 1000;
+
+    while (n-- > 0 && !s->rx_blocked) {
+        if (qemu_send_packet_async(&s->nc, s->rx_frame, s->rx_size,
+                                   null_rx_sent) == 0) {
+            s->rx_blocked = true;
+        }
+    }
+
+    qemu_mod_timer(s->rx_timer,
+                   qemu_get_clock_ns(vm_clock) + NULL_RX_TICK_NS);
+}
+
+static void null_cleanup(NetClientState *nc)
+{
+    NullState *s = DO_UPCAST(NullState, nc, nc);
+
+    if (s->rx_timer) {
+        qemu_del_timer(s->rx_timer);
+        qemu_free_timer(s->rx_timer);
+    }
+    g_free(s->rx_frame);
+}
+
+static NetClientInfo net_null_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_NULL,
+    .size = sizeof(NullState),
+    .receive = null_receive,
+    .receive_iov = null_receive_iov,
+    .cleanup = null_cleanup,
+};
+
+int net_init_null(const NetClientOptions *opts, const char *name,
+                  NetClientState *peer)
+{
+    const NetdevNullOptions *null;
+    NetClientState *nc;
+    NullState *s;
+    uint32_t pps = 0;
+    uint64_t size = NULL_RX_SIZE_MIN;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_NULL);
+    null = opts->null;
+
+    if (null->has_rx_pps) {
+        pps = null->rx_pps;
+    }
+    if (null->has_rx_size) {
+        size = null->rx_size;
+        if (size < NULL_RX_SIZE_MIN || size > NULL_RX_SIZE_MAX) {
+            error_report("null: rx-size must be between %d and %d",
+                         NULL_RX_SIZE_MIN, NULL_RX_SIZE_MAX);
+            return -1;
+        }
+    }
+
+    nc = qemu_new_net_client(&net_null_info, peer, "null", name);
+    s = DO_UPCAST(NullState, nc, nc);
+
+    if (pps) {
+        s->rx_pps = pps;
+        s->rx_size = size;
+        s->rx_frame = g_malloc0(size);
+        memset(s->rx_frame, 0xff, 6);       /* broadcast */
+        s->rx_frame[6] = 0x02;              /* locally administered source */
+        s->rx_frame[12] = 0x88;             /* local experimental ethertype */
+        s->rx_frame[13] = 0xb5;
+
+        s->rx_timer = qemu_new_timer_ns(vm_clock, null_rx_timer, s);
+        qemu_mod_timer(s->rx_timer,
+                       qemu_get_clock_ns(vm_clock) + NULL_RX_TICK_NS);
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "null: rx %u pps of %u bytes", s->rx_pps, s->rx_size);
+    } else {
+        snprintf(nc->info_str, sizeof(nc->info_str), "null");
+    }
+
+    return 0;
+}
@@ -37,14 +37,30 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * A caller that provides a sent callback must also leave the packet's
+ * buffers alone until the callback has run, or until it has purged its
+ * packets.  We then queue a reference to them rather than a copy; the
+ * packets that hold such references are recycled through a small pool.
+ */
+
+/* References to at most this many iovecs fit in a pooled packet; longer
+ * lists are copied as if there was no sent callback.
  */
+#define NET_PACKET_IOV_MAX  64
+#define NET_QUEUE_POOL_SIZE 64
 
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
+    bool pooled;
+    /* the sender's buffers, or NULL and 0 when the payload is in data; with
+       iovcnt, data holds the iovecs, hence the pointers just before it */
+    int iovcnt;
     NetPacketSent *sent_cb;
+    const uint8_t *buf;
     uint8_t data[0];
 };
 
@@ -52,6 +68,8 @@ struct NetQueue {
     void *opaque;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) pool;
+    int pool_len;
 
     unsigned delivering : 1;
 };
@@ -65,6 +83,7 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->opaque = opaque;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool);
 
     queue->delivering = 0;
 
@@ -79,10 +98,39 @@ void qemu_del_net_queue(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
+    QTAILQ_FOREACH_SAFE(packet, &queue->pool, entry, next) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        g_free(packet);
+    }
 
     g_free(queue);
 }
 
+static NetPacket *qemu_net_queue_get_packet(NetQueue *queue)
+{
+    NetPacket *packet = QTAILQ_FIRST(&queue->pool);
+
+    if (packet) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        queue->pool_len--;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) +
+                          NET_PACKET_IOV_MAX * sizeof(struct iovec));
+        packet->pooled = true;
+    }
+    return packet;
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->pooled && queue->pool_len < NET_QUEUE_POOL_SIZE) {
+        QTAILQ_INSERT_HEAD(&queue->pool, packet, entry);
+        queue->pool_len++;
+    } else {
+        g_free(packet);
+    }
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -92,12 +140,20 @@ static void qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    packet = g_malloc(sizeof(NetPacket) + size);
+    if (sent_cb) {
+        packet = qemu_net_queue_get_packet(queue);
+        packet->buf = buf;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + size);
+        packet->pooled = false;
+        packet->buf = NULL;
+        memcpy(packet->data, buf, size);
+    }
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
+    packet->iovcnt = 0;
 
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
@@ -109,6 +165,7 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
                                       int iovcnt,
                                       NetPacketSent *sent_cb)
 {
+    NetClientState *nc = queue->opaque;
     NetPacket *packet;
     size_t max_len = 0;
     int i;
@@ -117,7 +174,26 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
+    /* A receiver without receive_iov needs the packet in one piece */
+    if (sent_cb && nc->info->receive_iov && !(flags & QEMU_NET_PACKET_FLAG_RAW)
+        && iovcnt <= NET_PACKET_IOV_MAX) {
+        packet = qemu_net_queue_get_packet(queue);
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->size = max_len;
+        packet->buf = NULL;
+        packet->iovcnt = iovcnt;
+        memcpy(packet->data, iov, iovcnt * sizeof(struct iovec));
+
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        return;
+    }
+
     packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet->pooled = false;
+    packet->buf = NULL;
+    packet->iovcnt = 0;
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -220,7 +296,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
@@ -234,21 +310,30 @@ bool qemu_net_queue_flush(NetQueue *queue)
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iovcnt) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             (struct iovec *)packet->data,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->buf ?: packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
             return false;
         }
 
+        /* the sender may reuse its buffers from here, and send again */
         if (packet->sent_cb) {
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
     return true;
 }
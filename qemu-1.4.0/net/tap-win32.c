@@ -755,6 +755,11 @@ struct vhost_net *tap_get_vhost_net(NetClientState *nc)
     return NULL;
 }
 
+NetdevQueueInfo *tap_get_queue_info(NetClientState *nc)
+{
+    return NULL;
+}
+
 int tap_has_vnet_hdr_len(NetClientState *nc, int len)
 {
     return 0;
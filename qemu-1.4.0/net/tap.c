@@ -49,6 +49,9 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Packets read per wakeup, so that one busy tap cannot hog the main loop */
+#define TAP_RX_BATCH 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -62,6 +65,12 @@ typedef struct TAPState {
     bool enabled;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
+    int queue;
+    /* Traffic QEMU itself moved, that is not counting what vhost did */
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
 } TAPState;
 
 static int launch_script(const char *setup_script, const char *ifname, int fd);
@@ -113,6 +122,10 @@ static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt
         return 0;
     }
 
+    if (len > 0) {
+        s->tx_packets++;
+        s->tx_bytes += len - s->host_vnet_hdr_len;
+    }
     return len;
 }
 
@@ -193,8 +206,10 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    int size, packets = 0;
 
+    /* one guest notification for everything read here */
+    qemu_send_batch_begin(&s->nc);
     do {
         uint8_t *buf = s->buf;
 
@@ -202,6 +217,8 @@ static void tap_send(void *opaque)
         if (size <= 0) {
             break;
         }
+        s->rx_packets++;
+        s->rx_bytes += size - s->host_vnet_hdr_len;
 
         if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
             buf  += s->host_vnet_hdr_len;
@@ -212,7 +229,9 @@ static void tap_send(void *opaque)
         if (size == 0) {
             tap_read_poll(s, false);
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (size > 0 && ++packets < TAP_RX_BATCH &&
+             qemu_can_send_packet(&s->nc));
+    qemu_send_batch_end(&s->nc);
 }
 
 bool tap_has_ufo(NetClientState *nc)
@@ -589,19 +608,44 @@ static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
 
 #define MAX_TAP_QUEUES 1024
 
+/* The CPUs for the vhost thread of @queue: vhostaffinity= has a CPU list
+ * per queue, separated by colons, and they are taken in turn if there are
+ * fewer lists than queues
+ */
+static char *tap_vhost_cpus(const NetdevTapOptions *tap, int queue)
+{
+    gchar **lists;
+    char *cpus = NULL;
+    guint n;
+
+    if (!tap->has_vhostaffinity) {
+        return NULL;
+    }
+    lists = g_strsplit(tap->vhostaffinity, ":", -1);
+    n = g_strv_length(lists);
+    if (n) {
+        cpus = g_strdup(lists[queue % n]);
+    }
+    g_strfreev(lists);
+    return cpus;
+}
+
 static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
                             const char *model, const char *name,
                             const char *ifname, const char *script,
                             const char *downscript, const char *vhostfdname,
-                            int vnet_hdr, int fd)
+                            int vnet_hdr, int fd, int queue)
 {
     TAPState *s;
+    char *vhostcpus;
+    int r;
 
     s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
     if (!s) {
         close(fd);
         return -1;
     }
+    s->queue = queue;
 
     if (tap_set_sndbuf(s->fd, tap) < 0) {
         return -1;
@@ -643,9 +687,22 @@ static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
             error_report("vhost-net requested but could not be initialized");
             return -1;
         }
+        vhostcpus = tap_vhost_cpus(tap, queue);
+        r = vhostcpus ? vhost_net_set_affinity(s->vhost_net, vhostcpus) : 0;
+        if (r < 0) {
+            error_report("could not pin the vhost thread of queue %d to "
+                         "CPUs %s: %s", queue, vhostcpus, strerror(-r));
+        }
+        g_free(vhostcpus);
+        if (r < 0) {
+            return -1;
+        }
     } else if (tap->has_vhostfd || tap->has_vhostfds) {
         error_report("vhostfd= is not valid without vhost");
         return -1;
+    } else if (tap->has_vhostaffinity) {
+        error_report("vhostaffinity= is not valid without vhost");
+        return -1;
     }
 
     return 0;
@@ -713,7 +770,7 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         if (net_init_tap_one(tap, peer, "tap", name, NULL,
                              script, downscript,
-                             vhostfdname, vnet_hdr, fd)) {
+                             vhostfdname, vnet_hdr, fd, 0)) {
             return -1;
         }
     } else if (tap->has_fds) {
@@ -757,7 +814,7 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
             if (net_init_tap_one(tap, peer, "tap", name, ifname,
                                  script, downscript,
                                  tap->has_vhostfds ? vhost_fds[i] : NULL,
-                                 vnet_hdr, fd)) {
+                                 vnet_hdr, fd, i)) {
                 return -1;
             }
         }
@@ -779,7 +836,7 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         if (net_init_tap_one(tap, peer, "bridge", name, ifname,
                              script, downscript, vhostfdname,
-                             vnet_hdr, fd)) {
+                             vnet_hdr, fd, 0)) {
             return -1;
         }
     } else {
@@ -810,7 +867,7 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
             if (net_init_tap_one(tap, peer, "tap", name, ifname,
                                  i >= 1 ? "no" : script,
                                  i >= 1 ? "no" : downscript,
-                                 vhostfdname, vnet_hdr, fd)) {
+                                 vhostfdname, vnet_hdr, fd, i)) {
                 return -1;
             }
         }
@@ -826,6 +883,32 @@ VHostNetState *tap_get_vhost_net(NetClientState *nc)
     return s->vhost_net;
 }
 
+NetdevQueueInfo *tap_get_queue_info(NetClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    NetdevQueueInfo *info = g_malloc0(sizeof(*info));
+    int cpu;
+
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP);
+    info->netdev = g_strdup(nc->name);
+    info->queue = s->queue;
+    info->vhost = s->vhost_net != NULL;
+    info->rx_packets = s->rx_packets;
+    info->rx_bytes = s->rx_bytes;
+    info->tx_packets = s->tx_packets;
+    info->tx_bytes = s->tx_bytes;
+    if (s->vhost_net && vhost_net_get_worker(s->vhost_net)) {
+        info->has_thread_id = true;
+        info->thread_id = vhost_net_get_worker(s->vhost_net);
+        cpu = vhost_net_get_worker_cpu(s->vhost_net);
+        if (cpu >= 0) {
+            info->has_cpu = true;
+            info->cpu = cpu;
+        }
+    }
+    return info;
+}
+
 int tap_enable(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
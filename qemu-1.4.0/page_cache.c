@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -34,6 +34,13 @@
     do { } while (0)
 #endif
 
+/* The cache is split in sets of CACHE_WAYS pages.  A page can only live in
+ * the set picked by its address, in whichever way is free or else holds the
+ * least recently used page of the set.  Page data lives in one buffer
+ * allocated up front, one slot per item, so inserting never allocates.
+ */
+#define CACHE_WAYS 2
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -44,8 +51,11 @@ struct CacheItem {
 
 struct PageCache {
     CacheItem *page_cache;
+    uint8_t *page_data;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
 };
@@ -61,25 +71,35 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         return NULL;
     }
 
-    cache = g_malloc(sizeof(*cache));
-
     /* round down to the nearest power of 2 */
     if (!is_power_of_2(num_pages)) {
         num_pages = pow2floor(num_pages);
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
+
+    cache = g_malloc(sizeof(*cache));
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->num_ways);
+
+    cache->page_data = g_try_malloc(num_pages * page_size);
+    if (!cache->page_data) {
+        DPRINTF("could not allocate %" PRId64 " pages\n", num_pages);
+        g_free(cache);
+        return NULL;
+    }
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
 
     for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_data = cache->page_data + i * page_size;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
     }
@@ -89,84 +109,102 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
-
     g_free(cache->page_cache);
+    g_free(cache->page_data);
     cache->page_cache = NULL;
+    cache->page_data = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
-{
-    size_t pos;
-
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
-}
-
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
-
-    pos = cache_get_cache_pos(cache, addr);
+    size_t set;
 
-    return (cache->page_cache[pos].it_addr == addr);
+    g_assert(cache->num_sets);
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return &cache->page_cache[pos];
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    CacheItem *it = NULL;
+    if (!it) {
+        return NULL;
+    }
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
+}
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+/* Store a copy of @pdata for @addr unless that would evict a page used more
+ * recently than @age.
+ */
+static void cache_insert_aged(PageCache *cache, uint64_t addr,
+                              const uint8_t *pdata, uint64_t age)
+{
+    CacheItem *set, *it;
+    unsigned int i;
 
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (!it->it_data) {
-        cache->num_items++;
+    if (!it) {
+        /* free way, or else the least recently used one */
+        set = cache_get_set(cache, addr);
+        it = &set[0];
+        for (i = 0; i < cache->num_ways && it->it_addr != -1; i++) {
+            if (set[i].it_addr == -1 || set[i].it_age < it->it_age) {
+                it = &set[i];
+            }
+        }
+        if (it->it_addr == -1) {
+            cache->num_items++;
+        } else if (it->it_age > age) {
+            return;
+        }
     }
 
-    it->it_data = pdata;
-    it->it_age = ++cache->max_item_age;
+    memcpy(it->it_data, pdata, cache->page_size);
+    it->it_age = age;
     it->it_addr = addr;
 }
 
+void cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    cache_insert_aged(cache, addr, pdata, ++cache->max_item_age);
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
     int64_t i;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it;
 
     g_assert(cache);
 
@@ -186,31 +224,18 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /* move all data from old cache; on collision the MRU pages win */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data) {
-                /* keep the MRU page */
-                if (new_it->it_age >= old_it->it_age) {
-                    g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
-                }
-            } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
-            }
+            cache_insert_aged(new_cache, old_it->it_addr, old_it->it_data,
+                              old_it->it_age);
         }
     }
 
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
+    cache_fini(cache);
+    new_cache->max_item_age = cache->max_item_age;
+    *cache = *new_cache;
 
     g_free(new_cache);
 
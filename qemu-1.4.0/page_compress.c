@@ -0,0 +1,216 @@
+/*
+ * Parallel page compression for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <zlib.h>
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "migration/page_compress.h"
+
+struct PageCompressPool {
+    size_t page_size;
+    size_t bound;
+    int level;                  /* 0 for decompression */
+
+    PageCompressJob *jobs;
+    int nb_jobs;
+    int nb_queued;
+
+    QemuThread *threads;
+    int nb_threads;
+
+    /* Protected by lock */
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    int nb_dispatched;          /* jobs handed to the workers for this run */
+    int next;                   /* next of those to be picked up */
+    int nb_done;
+    bool quit;
+};
+
+static void page_compress_do_job(PageCompressPool *pool, PageCompressJob *job)
+{
+    uLongf len;
+
+    if (pool->level) {
+        len = pool->bound;
+        if (compress2(job->data, &len, job->page, pool->page_size,
+                      pool->level) != Z_OK || len >= pool->page_size) {
+            len = 0;
+        }
+        job->len = len;
+        job->ret = 0;
+    } else {
+        len = pool->page_size;
+        if (uncompress(job->page, &len, job->data, job->len) != Z_OK ||
+            len != pool->page_size) {
+            job->ret = -1;
+        } else {
+            job->ret = 0;
+        }
+    }
+}
+
+static void *page_compress_thread(void *opaque)
+{
+    PageCompressPool *pool = opaque;
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    while (!pool->quit) {
+        if (pool->next >= pool->nb_dispatched) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+            continue;
+        }
+
+        i = pool->next++;
+        qemu_mutex_unlock(&pool->lock);
+        page_compress_do_job(pool, &pool->jobs[i]);
+        qemu_mutex_lock(&pool->lock);
+
+        if (++pool->nb_done == pool->nb_dispatched) {
+            qemu_cond_signal(&pool->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+PageCompressPool *page_compress_pool_new(int threads, int nb_jobs,
+                                         size_t page_size, int level)
+{
+    PageCompressPool *pool;
+    int i;
+
+    assert(threads > 0 && nb_jobs > 0);
+    assert(level >= 0 && level <= 9);
+
+    pool = g_new0(PageCompressPool, 1);
+    pool->page_size = page_size;
+    pool->bound = compressBound(page_size);
+    pool->level = level;
+
+    pool->nb_jobs = nb_jobs;
+    pool->jobs = g_new0(PageCompressJob, nb_jobs);
+    for (i = 0; i < nb_jobs; i++) {
+        if (level) {
+            pool->jobs[i].page = g_malloc(page_size);
+        }
+        pool->jobs[i].data = g_malloc(pool->bound);
+    }
+
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+
+    pool->nb_threads = threads;
+    pool->threads = g_new0(QemuThread, threads);
+    for (i = 0; i < threads; i++) {
+        qemu_thread_create(&pool->threads[i], page_compress_thread, pool,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return pool;
+}
+
+void page_compress_pool_free(PageCompressPool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nb_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    g_free(pool->threads);
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+
+    for (i = 0; i < pool->nb_jobs; i++) {
+        if (pool->level) {
+            g_free(pool->jobs[i].page);
+        }
+        g_free(pool->jobs[i].data);
+    }
+    g_free(pool->jobs);
+    g_free(pool);
+}
+
+size_t page_compress_bound(PageCompressPool *pool)
+{
+    return pool->bound;
+}
+
+PageCompressJob *page_compress_get(PageCompressPool *pool)
+{
+    PageCompressJob *job;
+
+    if (page_compress_full(pool)) {
+        return NULL;
+    }
+    job = &pool->jobs[pool->nb_queued++];
+    if (!pool->level) {
+        job->page = NULL;
+    }
+    job->len = 0;
+    job->ret = 0;
+    return job;
+}
+
+bool page_compress_full(PageCompressPool *pool)
+{
+    return pool->nb_queued == pool->nb_jobs;
+}
+
+int page_compress_count(PageCompressPool *pool)
+{
+    return pool->nb_queued;
+}
+
+PageCompressJob *page_compress_job(PageCompressPool *pool, int i)
+{
+    assert(i < pool->nb_queued);
+    return &pool->jobs[i];
+}
+
+int page_compress_run(PageCompressPool *pool)
+{
+    int i, ret = 0;
+
+    if (pool->nb_queued == 0) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    pool->next = 0;
+    pool->nb_done = 0;
+    pool->nb_dispatched = pool->nb_queued;
+    qemu_cond_broadcast(&pool->work_cond);
+    while (pool->nb_done < pool->nb_dispatched) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pool->nb_dispatched = 0;
+    pool->next = 0;
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nb_queued; i++) {
+        if (pool->jobs[i].ret < 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+void page_compress_reset(PageCompressPool *pool)
+{
+    pool->nb_queued = 0;
+}
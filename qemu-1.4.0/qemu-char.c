@@ -26,6 +26,7 @@
 #include "ui/console.h"
 #include "sysemu/sysemu.h"
 #include "qemu/timer.h"
+#include "qemu/iov.h"
 #include "char/char.h"
 #include "hw/usb.h"
 #include "hw/baum.h"
@@ -144,6 +145,26 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov, int iovcnt)
+{
+    int i, ret, total = 0;
+
+    if (s->chr_writev) {
+        return s->chr_writev(s, iov, iovcnt);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        ret = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return total ? total : ret;
+        }
+        total += ret;
+        if (ret < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
 int qemu_chr_fe_ioctl(CharDriverState *s, int cmd, void *arg)
 {
     if (!s->chr_ioctl)
@@ -539,6 +560,187 @@ int send_all(int fd, const void *_buf, int len1)
 }
 #endif /* !_WIN32 */
 
+/*
+ * Output queue for backends that write to a file descriptor.  While nothing
+ * is queued, writes go straight to the (non-blocking) fd; what it does not
+ * take is queued and written from a G_IO_OUT watch.  A slow reader on the
+ * other end then holds up the front end, through qemu_chr_fe_can_write(),
+ * rather than the main loop.
+ */
+#define CHR_OUT_LOW_WATER   (16 * 1024)
+#define CHR_OUT_HIGH_WATER  (64 * 1024)
+/* Front ends that ignore qemu_chr_fe_can_write() wait for the reader
+   beyond this, as they always did */
+#define CHR_OUT_MAX         (1024 * 1024)
+
+static CharDriverState *qemu_chr_out_chr(CharDriverState *s)
+{
+    /* the front ends of a mux share the output of the chardev below it */
+    if (s->chr_write == mux_chr_write) {
+        return ((MuxDriver *)s->opaque)->drv;
+    }
+    return s;
+}
+
+static void chr_out_wake(CharDriverState *s)
+{
+    if (s->out_stalled) {
+        s->out_stalled = false;
+        notifier_list_notify(&s->out_notifiers, s);
+    }
+}
+
+#ifndef _WIN32
+/* Drop whatever is queued, e.g. because the fd is going away */
+static void chr_out_discard(CharDriverState *s)
+{
+    if (s->out_watch) {
+        g_source_remove(s->out_watch);
+        s->out_watch = 0;
+    }
+    if (s->out_buf) {
+        g_byte_array_set_size(s->out_buf, 0);
+    }
+}
+
+/* Returns false on errors other than EAGAIN */
+static bool chr_out_flush(CharDriverState *s)
+{
+    GByteArray *buf = s->out_buf;
+    int ret;
+
+    while (buf->len) {
+        ret = write(s->out_fd, buf->data, buf->len);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            return ret == 0 || errno == EAGAIN;
+        }
+        g_byte_array_remove_range(buf, 0, ret);
+    }
+    return true;
+}
+
+static gboolean chr_out_writable(GIOChannel *chan, GIOCondition cond,
+                                 void *opaque)
+{
+    CharDriverState *s = opaque;
+
+    if (!chr_out_flush(s)) {
+        /* the reader is gone; the read side will notice */
+        g_byte_array_set_size(s->out_buf, 0);
+    }
+    if (s->out_buf->len <= CHR_OUT_LOW_WATER) {
+        chr_out_wake(s);
+    }
+    /* the notifiers may have queued more */
+    if (s->out_buf->len) {
+        return TRUE;
+    }
+    s->out_watch = 0;
+    return FALSE;
+}
+
+static int chr_out_writev(CharDriverState *s, int fd, const struct iovec *iov,
+                          int iovcnt)
+{
+    GIOChannel *chan;
+    size_t len = iov_size(iov, iovcnt), skip = 0;
+    int i, ret;
+
+    if (!s->out_buf) {
+        s->out_buf = g_byte_array_new();
+    }
+    if (s->out_fd != fd) {
+        chr_out_discard(s);
+        s->out_fd = fd;
+    }
+
+    if (!s->out_buf->len) {
+        do {
+            ret = writev(fd, iov, MIN(iovcnt, IOV_MAX));
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            if (errno != EAGAIN) {
+                return -1;
+            }
+            ret = 0;
+        }
+        if (ret == len) {
+            return len;
+        }
+        skip = ret;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        g_byte_array_append(s->out_buf, (uint8_t *)iov[i].iov_base + skip,
+                            iov[i].iov_len - skip);
+        skip = 0;
+    }
+
+    if (s->out_buf->len > CHR_OUT_MAX) {
+        ret = send_all(fd, s->out_buf->data, s->out_buf->len);
+        g_byte_array_set_size(s->out_buf, 0);
+        return ret < 0 ? -1 : len;
+    }
+
+    if (!s->out_watch) {
+        chan = g_io_channel_unix_new(fd);
+        s->out_watch = g_io_add_watch(chan, G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                                      chr_out_writable, s);
+        g_io_channel_unref(chan);
+    }
+    return len;
+}
+#else
+static void chr_out_discard(CharDriverState *s)
+{
+}
+
+static int chr_out_writev(CharDriverState *s, int fd, const struct iovec *iov,
+                          int iovcnt)
+{
+    int i, ret, total = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = send_all(fd, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return total ? total : -1;
+        }
+        total += ret;
+    }
+    return total;
+}
+#endif
+
+static int chr_out_write(CharDriverState *s, int fd, const uint8_t *buf,
+                         int len)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+    return chr_out_writev(s, fd, &iov, 1);
+}
+
+bool qemu_chr_fe_can_write(CharDriverState *s)
+{
+    s = qemu_chr_out_chr(s);
+    if (s->out_buf && s->out_buf->len > CHR_OUT_HIGH_WATER) {
+        s->out_stalled = true;
+        return false;
+    }
+    return true;
+}
+
+void qemu_chr_fe_add_write_notifier(CharDriverState *s, Notifier *notifier)
+{
+    notifier_list_add(&qemu_chr_out_chr(s)->out_notifiers, notifier);
+}
+
 #define STDIO_MAX_CLIENTS 1
 static int stdio_nb_clients;
 
@@ -553,7 +755,14 @@ typedef struct {
 static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     FDCharDriver *s = chr->opaque;
-    return send_all(s->fd_out, buf, len);
+    return chr_out_write(chr, s->fd_out, buf, len);
+}
+
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+    return chr_out_writev(chr, s->fd_out, iov, iovcnt);
 }
 
 static int fd_chr_read_poll(void *opaque)
@@ -627,8 +836,10 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     s = g_malloc0(sizeof(FDCharDriver));
     s->fd_in = fd_in;
     s->fd_out = fd_out;
+    socket_set_nonblock(fd_out);
     chr->opaque = s;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -878,7 +1089,19 @@ static int pty_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
         pty_chr_update_read_handler(chr);
         return 0;
     }
-    return send_all(s->fd, buf, len);
+    return chr_out_write(chr, s->fd, buf, len);
+}
+
+static int pty_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    PtyCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        pty_chr_update_read_handler(chr);
+        return 0;
+    }
+    return chr_out_writev(chr, s->fd, iov, iovcnt);
 }
 
 static int pty_chr_read_poll(void *opaque)
@@ -940,6 +1163,8 @@ static void pty_chr_state(CharDriverState *chr, int connected)
         qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
         s->connected = 0;
         s->polling = 0;
+        chr_out_discard(chr);
+        chr_out_wake(chr);
         /* (re-)connect poll interval for idle guests: once per second.
          * We check more frequently in case the guests sends data to
          * the virtual device linked to our pty. */
@@ -1023,10 +1248,12 @@ static CharDriverState *qemu_chr_open_pty(QemuOpts *opts)
     s = g_malloc0(sizeof(PtyCharDriver));
     chr->opaque = s;
     chr->chr_write = pty_chr_write;
+    chr->chr_writev = pty_chr_writev;
     chr->chr_update_read_handler = pty_chr_update_read_handler;
     chr->chr_close = pty_chr_close;
 
     s->fd = master_fd;
+    socket_set_nonblock(master_fd);
     s->timer = qemu_new_timer_ms(rt_clock, pty_chr_timer, chr);
 
     return chr;
@@ -2159,13 +2386,24 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     TCPCharDriver *s = chr->opaque;
     if (s->connected) {
-        return send_all(s->fd, buf, len);
+        return chr_out_write(chr, s->fd, buf, len);
     } else {
         /* XXX: indicate an error ? */
         return len;
     }
 }
 
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    if (s->connected) {
+        return chr_out_writev(chr, s->fd, iov, iovcnt);
+    } else {
+        return iov_size(iov, iovcnt);
+    }
+}
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2319,8 +2557,10 @@ static void tcp_chr_read(void *opaque)
             qemu_set_fd_handler2(s->listen_fd, NULL, tcp_chr_accept, NULL, chr);
         }
         qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+        chr_out_discard(chr);
         closesocket(s->fd);
         s->fd = -1;
+        chr_out_wake(chr);
         qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
     } else if (size > 0) {
         if (s->do_telnetopt)
@@ -2491,6 +2731,7 @@ static CharDriverState *qemu_chr_open_socket_fd(int fd, bool do_nodelay,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+    chr->chr_writev = tcp_chr_writev;
     chr->chr_close = tcp_chr_close;
     chr->get_msgfd = tcp_get_msgfd;
     chr->chr_add_client = tcp_chr_add_client;
@@ -3123,9 +3364,13 @@ void qemu_chr_fe_close(struct CharDriverState *chr)
 void qemu_chr_delete(CharDriverState *chr)
 {
     QTAILQ_REMOVE(&chardevs, chr, next);
+    chr_out_discard(chr);
     if (chr->chr_close) {
         chr->chr_close(chr);
     }
+    if (chr->out_buf) {
+        g_byte_array_free(chr->out_buf, TRUE);
+    }
     g_free(chr->filename);
     g_free(chr->label);
     if (chr->opts) {
@@ -88,6 +88,8 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for convert (1 to 16, default 8)\n"
+           "  '-W' allow convert to write out of order to the destination\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -95,6 +97,8 @@ static void help(void)
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
            "       kinds of errors, with a higher risk of choosing the wrong fix or\n"
            "       hiding corruption that has already occurred.\n"
+           "  '-d' skips the check if the image header says the image was closed\n"
+           "       cleanly (qcow2 with lazy_refcounts=on, qed)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -390,11 +394,12 @@ static int img_check(int argc, char **argv)
     BlockDriverState *bs;
     BdrvCheckResult result;
     int fix = 0;
+    bool dirty_only = false;
     int flags = BDRV_O_FLAGS | BDRV_O_CHECK;
 
     fmt = NULL;
     for(;;) {
-        c = getopt(argc, argv, "f:hr:");
+        c = getopt(argc, argv, "f:hr:d");
         if (c == -1) {
             break;
         }
@@ -417,6 +422,9 @@ static int img_check(int argc, char **argv)
                 help();
             }
             break;
+        case 'd':
+            dirty_only = true;
+            break;
         }
     }
     if (optind >= argc) {
@@ -428,6 +436,9 @@ static int img_check(int argc, char **argv)
     if (!bs) {
         return 1;
     }
+    if (dirty_only) {
+        fix |= BDRV_CHECK_IF_DIRTY;
+    }
     ret = bdrv_check(bs, &result, fix);
 
     if (ret == -ENOTSUP) {
@@ -436,6 +447,12 @@ static int img_check(int argc, char **argv)
         return 1;
     }
 
+    if (result.skipped) {
+        printf("The image was closed cleanly, check skipped.\n");
+        bdrv_delete(bs);
+        return 0;
+    }
+
     if (result.corruptions_fixed || result.leaks_fixed) {
         printf("The following inconsistencies were found and repaired:\n\n"
                "    %d leaked clusters\n"
@@ -578,6 +595,13 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         return 0;
     }
     is_zero = buffer_is_zero(buf, 512);
+    if (is_zero &&
+        can_use_buffer_find_nonzero_offset(buf, n * BDRV_SECTOR_SIZE)) {
+        /* zero runs are long, skip them a few vectors at a time */
+        *pnum = buffer_find_nonzero_offset(buf, n * BDRV_SECTOR_SIZE)
+                / BDRV_SECTOR_SIZE;
+        return 0;
+    }
     for(i = 1; i < n; i++) {
         buf += 512;
         if (is_zero != buffer_is_zero(buf, 512)) {
@@ -662,10 +686,247 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 }
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
+#define MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    int min_sparse;
+    int buf_sectors;
+    bool wr_in_order;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    /* sector a coroutine waits to become wr_offs before writing, or -1 */
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int64_t sector_num;     /* next chunk to hand out */
+    int64_t wr_offs;        /* in order mode, everything before is written */
+    int64_t bytes_written;
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret, n;
+
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        if (!s->has_zero_init || s->target_has_backing) {
+            n = nb_sectors;
+        } else if (!is_allocated_sectors_min(buf, nb_sectors, &n,
+                                             s->min_sparse)) {
+            goto next;
+        }
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64 ": %s",
+                         sector_num, strerror(-ret));
+            return ret;
+        }
+        s->bytes_written += n * BDRV_SECTOR_SIZE;
+next:
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/* Let the coroutine waiting to write at wr_offs go */
+static void convert_wake_next(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            qemu_coroutine_enter(s->co[i], NULL);
+            break;
+        }
+    }
+}
+
+/* After an error nobody will advance wr_offs; let all waiters see it */
+static void convert_wake_all(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1) {
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+/*
+ * Each coroutine repeatedly claims the next chunk, reads it and writes it
+ * out, so reads of one chunk overlap with writes of others.  Unless
+ * out-of-order writes are allowed, a chunk is only written once everything
+ * before it is, which keeps the output allocated in guest order.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int index = -1;
+    int i, ret;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+        }
+    }
+    assert(index >= 0);
+
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (s->ret == -EINPROGRESS) {
+        int64_t sector_num, src_cur_offset;
+        int n, n1, src_cur;
+        bool copy = true;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        sector_num = s->sector_num;
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(s->total_sectors - sector_num, s->buf_sectors);
+        n = MIN(n, src_cur_offset + s->src_sectors[src_cur] - sector_num);
+
+        /* If the output image is being created as a copy on write image,
+           assume that sectors which are unallocated in the input image
+           are present in both the output's and input's base images (no
+           need to copy them). */
+        if (s->has_zero_init && s->target_has_backing) {
+            ret = bdrv_co_is_allocated(s->src[src_cur],
+                                       sector_num - src_cur_offset, n, &n1);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num - src_cur_offset, strerror(-ret));
+                s->ret = ret;
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+            copy = ret;
+            n = n1;
+        }
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (copy) {
+            QEMUIOVector qiov;
+            struct iovec iov;
+
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                                n, &qiov);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num - src_cur_offset, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+
+        if (copy) {
+            ret = convert_co_write(s, sector_num, n, buf);
+            if (ret < 0) {
+                s->ret = ret;
+                break;
+            }
+        }
+
+        qemu_progress_print(100.0 * n / s->total_sectors, 100);
+        if (s->wr_in_order) {
+            s->wr_offs = sector_num + n;
+            convert_wake_next(s);
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (s->ret != -EINPROGRESS) {
+        convert_wake_all(s);
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    s->ret = -EINPROGRESS;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    qemu_co_mutex_init(&s->lock);
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    return s->ret == -EINPROGRESS ? 0 : s->ret;
+}
 
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
@@ -673,7 +934,6 @@ static int img_convert(int argc, char **argv)
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -681,6 +941,9 @@ static int img_convert(int argc, char **argv)
     const char *snapshot_name = NULL;
     float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
+    int64_t start_time, copy_ns = 0, bytes_written = 0;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -688,7 +951,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -742,6 +1005,22 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -989,95 +1268,40 @@ static int img_convert(int argc, char **argv)
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
+        ImgConvertState state = {
+            .src                = bs,
+            .src_num            = bs_n,
+            .total_sectors      = total_sectors,
+            .target             = out_bs,
+            .has_zero_init      = bdrv_has_zero_init(out_bs),
+            .target_has_backing = (out_baseimg != NULL),
+            .min_sparse         = min_sparse,
+            .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+            .wr_in_order        = wr_in_order,
+            .num_coroutines     = num_coroutines,
+        };
 
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
+        state.src_sectors = g_new(int64_t, bs_n);
+        for (bs_i = 0; bs_i < bs_n; bs_i++) {
+            bdrv_get_geometry(bs[bs_i], &bs_sectors);
+            state.src_sectors[bs_i] = bs_sectors;
         }
 
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+        start_time = get_clock();
+        ret = convert_do_copy(&state);
+        g_free(state.src_sectors);
+        copy_ns = get_clock() - start_time;
+        bytes_written = state.bytes_written;
     }
 out:
     qemu_progress_end();
+    if (progress && ret == 0 && copy_ns > 0) {
+        double mib = (double)bytes_written / (1024 * 1024);
+        double secs = copy_ns / 1000000000.0;
+
+        printf("%.1f MiB written in %.1f s (%.1f MiB/s)\n",
+               mib, secs, mib / secs);
+    }
     free_option_parameters(create_options);
     free_option_parameters(param);
     qemu_vfree(buf);
@@ -1990,6 +2214,285 @@ out:
     return 0;
 }
 
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t start;
+    bool write;
+} BenchRequest;
+
+struct BenchData {
+    BlockDriverState *bs;
+    int bufsize;
+    int64_t image_sectors;
+    int n;              /* requests still to be submitted */
+    int in_flight;
+    int done;
+    int read_pct;
+    bool random;
+    int64_t offset;     /* next sector, sequential pattern */
+    uint64_t seed;
+    int64_t *latency;
+    int64_t bytes[2];
+    int ret;
+};
+
+/* xorshift64*: fast and repeatable, which is all a benchmark needs */
+static uint64_t bench_rand(BenchData *b)
+{
+    b->seed ^= b->seed >> 12;
+    b->seed ^= b->seed << 25;
+    b->seed ^= b->seed >> 27;
+    return b->seed * 2685821657736338717ULL;
+}
+
+static int64_t bench_next_sector(BenchData *b)
+{
+    int64_t nb_slots = b->image_sectors / (b->bufsize >> BDRV_SECTOR_BITS);
+    int64_t sector;
+
+    if (b->random) {
+        sector = bench_rand(b) % nb_slots;
+        return sector * (b->bufsize >> BDRV_SECTOR_BITS);
+    }
+
+    sector = b->offset;
+    b->offset += b->bufsize >> BDRV_SECTOR_BITS;
+    if (b->offset + (b->bufsize >> BDRV_SECTOR_BITS) > b->image_sectors) {
+        b->offset = 0;
+    }
+    return sector;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchRequest *req)
+{
+    BenchData *b = req->b;
+    int nb_sectors = b->bufsize >> BDRV_SECTOR_BITS;
+    int64_t sector = bench_next_sector(b);
+    BlockDriverAIOCB *acb;
+
+    b->n--;
+    req->write = b->read_pct < 100 &&
+                 (b->read_pct == 0 || bench_rand(b) % 100 >= b->read_pct);
+    req->start = get_clock();
+
+    if (req->write) {
+        acb = bdrv_aio_writev(b->bs, sector, &req->qiov, nb_sectors,
+                              bench_cb, req);
+    } else {
+        acb = bdrv_aio_readv(b->bs, sector, &req->qiov, nb_sectors,
+                             bench_cb, req);
+    }
+    if (!acb) {
+        error_report("Failed to issue request");
+        b->ret = -EIO;
+        b->n = 0;
+        return;
+    }
+    b->in_flight++;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    b->in_flight--;
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        b->ret = ret;
+        b->n = 0;
+    } else {
+        b->latency[b->done] = get_clock() - req->start;
+        b->bytes[req->write] += b->bufsize;
+    }
+    b->done++;
+
+    if (b->n > 0) {
+        bench_submit(req);
+    }
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_print_percentile(BenchData *b, int count, double pct)
+{
+    int i = MIN(count - 1, (int)(count * pct / 100));
+
+    printf("  %6.2f%%: %10.1f us\n", pct, b->latency[i] / 1000.0);
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0, flags = 0, i;
+    const char *filename, *fmt = NULL, *cache = BDRV_DEFAULT_CACHE;
+    BlockDriverState *bs = NULL;
+    int count = 75000, depth = 64, bufsize = 4096, read_pct = 100;
+    bool random = false;
+    BenchData data = {};
+    BenchRequest *reqs = NULL;
+    uint8_t *buf = NULL;
+    int64_t start, elapsed, sum = 0;
+    double secs;
+    char *end;
+
+    for (;;) {
+        c = getopt(argc, argv, "c:d:f:hM:rs:t:w");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'c':
+            count = strtol(optarg, &end, 10);
+            if (*end || count <= 0) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        case 'd':
+            depth = strtol(optarg, &end, 10);
+            if (*end || depth <= 0 || depth > 1024) {
+                error_report("Invalid queue depth specified (1 to 1024)");
+                return 1;
+            }
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'M':
+            read_pct = strtol(optarg, &end, 10);
+            if (*end || read_pct < 0 || read_pct > 100) {
+                error_report("Invalid read percentage specified (0 to 100)");
+                return 1;
+            }
+            break;
+        case 'r':
+            random = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || *end || sval % BDRV_SECTOR_SIZE ||
+                sval > INT_MAX) {
+                error_report("Invalid buffer size specified, it must be a "
+                             "multiple of 512");
+                return 1;
+            }
+            bufsize = sval;
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            read_pct = 0;
+            break;
+        }
+    }
+
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    if (read_pct < 100) {
+        flags |= BDRV_O_RDWR;
+    }
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, flags, true);
+    if (!bs) {
+        return 1;
+    }
+
+    data = (BenchData) {
+        .bs             = bs,
+        .bufsize        = bufsize,
+        .image_sectors  = bdrv_getlength(bs) >> BDRV_SECTOR_BITS,
+        .n              = count,
+        .read_pct       = read_pct,
+        .random         = random,
+        .seed           = 0x2545f4914f6cdd1dULL,
+    };
+    if (data.image_sectors < (bufsize >> BDRV_SECTOR_BITS)) {
+        error_report("Image is smaller than the buffer size");
+        ret = -EINVAL;
+        goto out;
+    }
+    data.latency = g_new(int64_t, count);
+
+    printf("Sending %d %s requests, %d bytes each, %d in parallel, "
+           "%d%% reads\n", count, random ? "random" : "sequential",
+           bufsize, depth, read_pct);
+
+    depth = MIN(depth, count);
+    buf = qemu_blockalign(bs, (size_t)depth * bufsize);
+    memset(buf, 0xa5, (size_t)depth * bufsize);
+    reqs = g_new0(BenchRequest, depth);
+
+    start = get_clock();
+    for (i = 0; i < depth && data.n > 0; i++) {
+        reqs[i].b = &data;
+        reqs[i].iov.iov_base = buf + (size_t)i * bufsize;
+        reqs[i].iov.iov_len = bufsize;
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+        bench_submit(&reqs[i]);
+    }
+    while (data.in_flight > 0) {
+        qemu_aio_wait();
+    }
+    elapsed = get_clock() - start;
+
+    ret = data.ret;
+    if (ret < 0) {
+        goto out;
+    }
+
+    secs = elapsed / 1000000000.0;
+    printf("Run completed in %.3f seconds.\n", secs);
+    printf("IOPS: %.0f  read: %.1f MiB/s  write: %.1f MiB/s\n",
+           count / secs, data.bytes[0] / secs / (1024 * 1024),
+           data.bytes[1] / secs / (1024 * 1024));
+
+    qsort(data.latency, count, sizeof(data.latency[0]), compare_int64);
+    for (i = 0; i < count; i++) {
+        sum += data.latency[i];
+    }
+    printf("Latency: avg %.1f us, min %.1f us, max %.1f us\n",
+           (double)sum / count / 1000.0, data.latency[0] / 1000.0,
+           data.latency[count - 1] / 1000.0);
+    bench_print_percentile(&data, count, 50);
+    bench_print_percentile(&data, count, 90);
+    bench_print_percentile(&data, count, 99);
+    bench_print_percentile(&data, count, 99.9);
+
+out:
+    qemu_vfree(buf);
+    g_free(reqs);
+    g_free(data.latency);
+    bdrv_delete(bs);
+    return ret < 0 ? 1 : 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
@@ -124,6 +124,8 @@ const CPULogItem cpu_log_items[] = {
     { LOG_GUEST_ERROR, "guest_errors",
       "log when the guest OS does something invalid (eg accessing a\n"
       "non-existent register)" },
+    { LOG_STARTUP, "startup",
+      "show how long each phase of startup took" },
     { 0, NULL, NULL },
 };
 
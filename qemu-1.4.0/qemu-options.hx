@@ -95,12 +95,14 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node][,hostnode=node]\n",
+    QEMU_ARCH_ALL)
 STEXI
 @item -numa @var{opts}
 @findex -numa
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
-are split equally.
+are split equally.  With @option{hostnode}, the guest RAM of the node is
+allocated from that host NUMA node only (Linux hosts).
 ETEXI
 
 DEF("fda", HAS_ARG, QEMU_OPTION_fda,
@@ -150,7 +152,12 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,l2-cache-size=size][,refcount-cache-size=size][,aio-pool=name]\n"
+    "       [,chunk-cache-size=size]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [,burst_length=s][,throttle_group=name]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -204,6 +211,33 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size}
+@itemx refcount-cache-size=@var{size}
+Size in bytes of the qcow2 L2 table and refcount block caches. By default the
+L2 cache is large enough to map the whole image, up to 32 MB, and the refcount
+cache is a quarter of it.  QED images use @option{l2-cache-size} for their L2
+table cache, which by default also maps the whole image up to 32 MB but holds
+at least 50 tables.  For VMDK it caps the grain table cache shared by all
+extents, by default 16 tables per extent and at least 1 MB.
+@item chunk-cache-size=@var{size}
+Memory in bytes for decompressed chunks of cloop and dmg images, 16 MB by
+default.  The least recently used chunks are dropped first.
+@item aio-pool=@var{name}
+Run the blocking requests of this drive in the thread pool @var{name}, defined
+with @option{-aio-pool}, instead of the default pool.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w},iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the drive to an average of @var{b} bytes (@var{i} operations) per second
+overall, or to separate read and write rates.  Short peaks of about 100ms
+worth of I/O are let through at full speed.
+@item bps_max=@var{bm},bps_rd_max=@var{rm},bps_wr_max=@var{wm},iops_max=@var{im},iops_rd_max=@var{irm},iops_wr_max=@var{iwm}
+Allow bursts above the matching average limit, at up to this many bytes
+(operations) per second.  A burst lasts at most @option{burst_length} seconds
+(default 1) and is earned back by running below the average.
+@item throttle_group=@var{name}
+Share the limits above with every other drive in throttling group @var{name}:
+the group as a whole is held to them.  Setting limits on one member, here or
+with @code{block_set_io_throttle}, changes them for the whole group; a member
+given no limits of its own uses the group's.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -321,6 +355,40 @@ qemu-system-i386
 @end example
 ETEXI
 
+DEF("aio-pool", HAS_ARG, QEMU_OPTION_aio_pool,
+    "-aio-pool id=name[,min-threads=n][,max-threads=n][,cpus=list][,node=n]\n"
+    "                define a thread pool for blocking disk I/O\n", QEMU_ARCH_ALL)
+STEXI
+@item -aio-pool id=@var{name}[,min-threads=@var{n}][,max-threads=@var{n}][,cpus=@var{list}][,node=@var{n}]
+@findex -aio-pool
+
+Define a named pool of worker threads for the blocking requests of the
+drives that select it with @option{-drive aio-pool=@var{name}}, such as
+@code{aio=threads} reads and writes, flushes and discards.  Other drives
+use the default pool of up to 64 threads, so a slow backend only ties up
+the workers of its own pool.  Valid options are:
+
+@table @option
+@item min-threads=@var{n}
+Number of threads kept even when idle (default 0).
+@item max-threads=@var{n}
+Maximum number of threads (default 64).
+@item cpus=@var{list}
+Run the workers on these host CPUs, e.g. @code{0-3,8}.
+@item node=@var{n}
+Run the workers on the CPUs of host NUMA node @var{n}, if @option{cpus}
+is not given.  Only supported on Linux hosts.
+@end table
+
+Queue depth and latency statistics of each pool are shown by
+@code{info thread-pools}.
+
+@example
+qemu-system-i386 -aio-pool id=nfs,max-threads=8,node=1 \
+                 -drive file=/nfs/disk.img,aio-pool=nfs
+@end example
+ETEXI
+
 DEF("set", HAS_ARG, QEMU_OPTION_set,
     "-set group.id.arg=value\n"
     "                set <arg> parameter for item <id> of type <group>\n"
@@ -451,11 +519,12 @@ ETEXI
 
 #ifdef MAP_POPULATE
 DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
-    "-mem-prealloc   preallocate guest memory (use with -mem-path)\n",
+    "-mem-prealloc   preallocate guest memory\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -mem-prealloc
-Preallocate memory when using -mem-path.
+Preallocate guest memory before the guest starts, from @option{-mem-path}
+if given.  The pages are touched by several threads in parallel.
 ETEXI
 #endif
 
@@ -624,12 +693,12 @@ DEFHEADING(File system options:)
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
     "-fsdev fsdriver,id=id[,path=path,][security_model={mapped-xattr|mapped-file|passthrough|none}]\n"
-    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd][,threads=n]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,threads=@var{n}]
 @findex -fsdev
 Define a new file system device. Valid options are:
 @table @option
@@ -670,6 +739,10 @@ with virtfs-proxy-helper
 Enables proxy filesystem driver to use passed socket descriptor for
 communicating with virtfs-proxy-helper. Usually a helper like libvirt
 will create socketpair and pass one of the fds as sock_fd
+@item threads=@var{n}
+Limits the number of worker threads that run file system calls for this
+export to @var{n}, at most 256.  By default a thread is started for every
+outstanding request.
 @end table
 
 -fsdev option is used along with -device driver "virtio-9p-pci".
@@ -690,12 +763,12 @@ DEFHEADING(Virtual File system pass-through options:)
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
     "-virtfs local,path=path,mount_tag=tag,security_model=[mapped-xattr|mapped-file|passthrough|none]\n"
-    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd][,threads=n]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,threads=@var{n}]
 @findex -virtfs
 
 The general form of a Virtual File system pass-through options are:
@@ -737,6 +810,10 @@ will create socketpair and pass one of the fds as sock_fd
 @item sock_fd
 Enables proxy filesystem driver to use passed 'sock_fd' as the socket
 descriptor for interfacing with virtfs-proxy-helper
+@item threads=@var{n}
+Limits the number of worker threads that run file system calls for this
+export to @var{n}, at most 256.  By default a thread is started for every
+outstanding request.
 @end table
 ETEXI
 
@@ -788,7 +865,7 @@ ETEXI
 
 DEF("display", HAS_ARG, QEMU_OPTION_display,
     "-display sdl[,frame=on|off][,alt_grab=on|off][,ctrl_grab=on|off]\n"
-    "            [,window_close=on|off]|curses|none|\n"
+    "            [,window_close=on|off]|curses|none|shm[,name=<name>]|\n"
     "            vnc=<display>[,<optargs>]\n"
     "                select display type\n", QEMU_ARCH_ALL)
 STEXI
@@ -806,6 +883,12 @@ support a text mode, QEMU can display this output using a
 curses/ncurses interface. Nothing is displayed when the graphics
 device is in graphical mode or if the graphics device does not support
 a text mode. Generally only the VGA device models support text mode.
+@item shm[,name=@var{name}]
+Keep a copy of the display in the POSIX shared memory object @var{name},
+by default @code{/qemu-display-}@var{pid}, for a compositor on the same
+host to map.  Changed areas are announced in a ring of rectangles in the
+object's header; the layout is described in @file{include/ui/shm-display.h}.
+The object is removed when QEMU exits.
 @item none
 Do not display video output. The guest will still see an emulated
 graphics card, but its output will not be displayed to the QEMU
@@ -1204,6 +1287,26 @@ This can be really helpful to save bandwidth when playing videos. Disabling
 adaptive encodings allows to restore the original static behavior of encodings
 like Tight.
 
+@item threads=@var{n}
+
+Encode framebuffer updates in @var{n} threads, from 1 to 16 (default 1).
+Each client's updates are encoded by one thread at a time, in order, so
+this helps when several clients are connected.
+
+@item detect-scroll
+
+Look for scrolled regions when a tall area of the screen changes, and
+send the rows that only moved as a copy of what the client already has.
+This saves bandwidth when windows scroll, for clients that support the
+CopyRect encoding.
+
+@item jpeg-encoder=@var{name}
+
+Compress the JPEG images of the Tight encoding sent for frequently updated
+regions, such as video windows, with encoder @var{name} rather than with
+libjpeg, which is the only encoder built in so far.  Smaller and less
+often updated rectangles always go through libjpeg.
+
 @item share=[allow-exclusive|force-shared|ignore]
 
 Set display sharing policy.  'allow-exclusive' allows clients to ask
@@ -1346,7 +1449,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,vhostaffinity=cpus[:cpus...]]\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1363,6 +1466,8 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'vhostaffinity=cpus[:cpus...]' to pin the vhost thread of each\n"
+    "                queue to a host CPU list such as 0-3,,8 (one list per queue)\n"
     "-net bridge[,vlan=n][,name=str][,br=bridge][,helper=helper]\n"
     "                connects a host TAP network interface to a host bridge device 'br'\n"
     "                (default=" DEFAULT_BRIDGE_INTERFACE ") using the program 'helper'\n"
@@ -1384,6 +1489,9 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
+    "-net null[,vlan=n][,name=str][,rx-pps=n][,rx-size=n]\n"
+    "                drop all traffic on vlan 'n', and send it n frames per second\n"
+    "                of 'rx-size' bytes (default 60)\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
     "                is provided, the default is '-net nic -net user'\n", QEMU_ARCH_ALL)
 DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
@@ -1396,6 +1504,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #ifdef CONFIG_VDE
     "vde|"
 #endif
+    "null|"
     "socket],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
 STEXI
 @item -net nic[,vlan=@var{n}][,macaddr=@var{mac}][,model=@var{type}] [,name=@var{name}][,addr=@var{addr}][,vectors=@var{v}]
@@ -1722,6 +1831,13 @@ Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap}
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
 libpcap, so it can be analyzed with tools such as tcpdump or Wireshark.
 
+@item -net null[,vlan=@var{n}][,name=@var{name}][,rx-pps=@var{pps}][,rx-size=@var{size}]
+@item -netdev null,id=@var{id}[,rx-pps=@var{pps}][,rx-size=@var{size}]
+Drop every packet sent on VLAN @var{n}. If @var{pps} is set, also send
+@var{pps} broadcast frames of @var{size} bytes (60 by default) per second of
+guest time. This measures the cost of the NIC emulation without any host
+networking. Frames the guest is too slow to take are not generated.
+
 @item -net none
 Indicate that no network devices should be configured. It is used to
 override the default configuration (@option{-net nic -net user}) which
@@ -2049,7 +2165,7 @@ ETEXI
 DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
-    "       [,initiator-name=iqn]\n"
+    "       [,initiator-name=iqn][,sessions=n][,max-outstanding=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
@@ -2425,6 +2541,23 @@ STEXI
 Like -monitor but opens in 'control' mode.
 ETEXI
 
+DEF("qmp-thread", HAS_ARG, QEMU_OPTION_qmp_thread, \
+    "-qmp-thread addr\n"
+    "                serve QMP on socket 'addr' from a thread of its own\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -qmp-thread @var{addr}
+@findex -qmp-thread
+Listen for one QMP client at a time on @var{addr}, which is either
+@code{unix:}@var{path} or @var{host}:@var{port}.  The connection is served by
+a thread of its own: commands that only read state safe to read without the
+global lock (@code{query-status}, @code{query-version}, @code{query-name},
+@code{query-uuid} and @code{query-kvm}) are answered there even while the
+main loop is busy, provided no earlier request of the client is still
+waiting for the main loop.  All other commands, and events, go through the
+main loop as with @option{-qmp}.
+ETEXI
+
 DEF("mon", HAS_ARG, QEMU_OPTION_mon, \
     "-mon chardev=[name][,mode=readline|control][,default]\n", QEMU_ARCH_ALL)
 STEXI
@@ -45,7 +45,14 @@
 #define QEMU_CLOCK_HOST     2
 
 struct QEMUClock {
-    QEMUTimer *active_timers;
+    /* Pending timers, a binary min-heap on expire_time: the next one to
+       fire is heap[0], and re-arming one costs O(log n) however many
+       there are */
+    QEMUTimer **heap;
+    int nr_timers;
+    int heap_size;
+    /* orders timers that expire at the same time by when they were armed */
+    uint64_t seq;
 
     NotifierList reset_notifiers;
     int64_t last;
@@ -59,10 +66,19 @@ struct QEMUTimer {
     QEMUClock *clock;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    int heap_idx;               /* in clock->heap, -1 if not pending */
+    uint64_t seq;
     int scale;
+
+    /* for "info timers" */
+    uint64_t nr_mods;
+    uint64_t last_nr_mods;
+    QLIST_ENTRY(QEMUTimer) list;
 };
 
+static QLIST_HEAD(, QEMUTimer) all_timers = QLIST_HEAD_INITIALIZER(all_timers);
+static int64_t timer_info_last;
+
 struct qemu_alarm_timer {
     char const *name;
     int (*start)(struct qemu_alarm_timer *t);
@@ -85,24 +101,80 @@ static bool qemu_timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+static QEMUTimer *qemu_clock_head(QEMUClock *clock)
+{
+    return clock->nr_timers ? clock->heap[0] : NULL;
+}
+
+static bool timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+static void timer_heap_set(QEMUClock *clock, int idx, QEMUTimer *ts)
+{
+    clock->heap[idx] = ts;
+    ts->heap_idx = idx;
+}
+
+static void timer_heap_up(QEMUClock *clock, int idx)
+{
+    QEMUTimer *ts = clock->heap[idx];
+    int parent;
+
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (!timer_before(ts, clock->heap[parent])) {
+            break;
+        }
+        timer_heap_set(clock, idx, clock->heap[parent]);
+        idx = parent;
+    }
+    timer_heap_set(clock, idx, ts);
+}
+
+static void timer_heap_down(QEMUClock *clock, int idx)
+{
+    QEMUTimer *ts = clock->heap[idx];
+    int child;
+
+    for (;;) {
+        child = 2 * idx + 1;
+        if (child >= clock->nr_timers) {
+            break;
+        }
+        if (child + 1 < clock->nr_timers &&
+            timer_before(clock->heap[child + 1], clock->heap[child])) {
+            child++;
+        }
+        if (!timer_before(clock->heap[child], ts)) {
+            break;
+        }
+        timer_heap_set(clock, idx, clock->heap[child]);
+        idx = child;
+    }
+    timer_heap_set(clock, idx, ts);
+}
+
 static int64_t qemu_next_alarm_deadline(void)
 {
     int64_t delta = INT64_MAX;
     int64_t rtdelta;
 
-    if (!use_icount && vm_clock->enabled && vm_clock->active_timers) {
-        delta = vm_clock->active_timers->expire_time -
+    if (!use_icount && vm_clock->enabled && vm_clock->nr_timers) {
+        delta = vm_clock->heap[0]->expire_time -
                      qemu_get_clock_ns(vm_clock);
     }
-    if (host_clock->enabled && host_clock->active_timers) {
-        int64_t hdelta = host_clock->active_timers->expire_time -
+    if (host_clock->enabled && host_clock->nr_timers) {
+        int64_t hdelta = host_clock->heap[0]->expire_time -
                  qemu_get_clock_ns(host_clock);
         if (hdelta < delta) {
             delta = hdelta;
         }
     }
-    if (rt_clock->enabled && rt_clock->active_timers) {
-        rtdelta = (rt_clock->active_timers->expire_time -
+    if (rt_clock->enabled && rt_clock->nr_timers) {
+        rtdelta = (rt_clock->heap[0]->expire_time -
                  qemu_get_clock_ns(rt_clock));
         if (rtdelta < delta) {
             delta = rtdelta;
@@ -254,13 +326,13 @@ void qemu_clock_enable(QEMUClock *clock, bool enabled)
 
 int64_t qemu_clock_has_timers(QEMUClock *clock)
 {
-    return !!clock->active_timers;
+    return !!clock->nr_timers;
 }
 
 int64_t qemu_clock_expired(QEMUClock *clock)
 {
-    return (clock->active_timers &&
-            clock->active_timers->expire_time < qemu_get_clock_ns(clock));
+    return (clock->nr_timers &&
+            clock->heap[0]->expire_time < qemu_get_clock_ns(clock));
 }
 
 int64_t qemu_clock_deadline(QEMUClock *clock)
@@ -268,8 +340,8 @@ int64_t qemu_clock_deadline(QEMUClock *clock)
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
 
-    if (clock->active_timers) {
-        delta = clock->active_timers->expire_time - qemu_get_clock_ns(clock);
+    if (clock->nr_timers) {
+        delta = clock->heap[0]->expire_time - qemu_get_clock_ns(clock);
     }
     if (delta < 0) {
         delta = 0;
@@ -287,31 +359,37 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
     ts->cb = cb;
     ts->opaque = opaque;
     ts->scale = scale;
+    ts->heap_idx = -1;
+    QLIST_INSERT_HEAD(&all_timers, ts, list);
     return ts;
 }
 
 void qemu_free_timer(QEMUTimer *ts)
 {
+    /* a pending timer would be left behind in the heap */
+    qemu_del_timer(ts);
+    QLIST_REMOVE(ts, list);
     g_free(ts);
 }
 
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    QEMUClock *clock = ts->clock;
+    int idx = ts->heap_idx;
+    QEMUTimer *last;
 
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    if (idx < 0) {
+        return;
+    }
+    ts->heap_idx = -1;
+
+    /* the last timer fills the hole, then moves to where it belongs */
+    last = clock->heap[--clock->nr_timers];
+    if (last != ts) {
+        timer_heap_set(clock, idx, last);
+        timer_heap_down(clock, idx);
+        timer_heap_up(clock, last->heap_idx);
     }
 }
 
@@ -319,27 +397,25 @@ void qemu_del_timer(QEMUTimer *ts)
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    qemu_del_timer(ts);
+    QEMUClock *clock = ts->clock;
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!qemu_timer_expired_ns(t, expire_time)) {
-            break;
+    ts->expire_time = expire_time;
+    ts->seq = clock->seq++;
+    ts->nr_mods++;
+
+    /* a pending timer is moved within the heap rather than taken out */
+    if (ts->heap_idx < 0) {
+        if (clock->nr_timers == clock->heap_size) {
+            clock->heap_size = MAX(16, clock->heap_size * 2);
+            clock->heap = g_renew(QEMUTimer *, clock->heap, clock->heap_size);
         }
-        pt = &t->next;
+        timer_heap_set(clock, clock->nr_timers++, ts);
     }
-    ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    timer_heap_up(clock, ts->heap_idx);
+    timer_heap_down(clock, ts->heap_idx);
 
     /* Rearm if necessary  */
-    if (pt == &ts->clock->active_timers) {
+    if (ts->heap_idx == 0) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -358,13 +434,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 bool qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for (t = ts->clock->active_timers; t != NULL; t = t->next) {
-        if (t == ts) {
-            return true;
-        }
-    }
-    return false;
+    return ts->heap_idx >= 0;
 }
 
 bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -382,13 +452,12 @@ void qemu_run_timers(QEMUClock *clock)
 
     current_time = qemu_get_clock_ns(clock);
     for(;;) {
-        ts = clock->active_timers;
+        ts = qemu_clock_head(clock);
         if (!qemu_timer_expired_ns(ts, current_time)) {
             break;
         }
-        /* remove timer from the list before calling the callback */
-        clock->active_timers = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        qemu_del_timer(ts);
 
         /* run the callback (the timer list can be modified) */
         ts->cb(ts->opaque);
@@ -436,6 +505,7 @@ void init_clocks(void)
         rt_clock = qemu_new_clock(QEMU_CLOCK_REALTIME);
         vm_clock = qemu_new_clock(QEMU_CLOCK_VIRTUAL);
         host_clock = qemu_new_clock(QEMU_CLOCK_HOST);
+        timer_info_last = get_clock();
     }
 }
 
@@ -444,6 +514,88 @@ uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts)
     return qemu_timer_pending(ts) ? ts->expire_time : -1;
 }
 
+typedef struct TimerInfo {
+    QEMUTimerCB *cb;
+    QEMUClock *clock;
+    int nr_timers;
+    int nr_pending;
+    uint64_t nr_mods;
+    uint64_t nr_new_mods;
+} TimerInfo;
+
+static gint timer_info_cmp(gconstpointer a, gconstpointer b)
+{
+    const TimerInfo *ia = a, *ib = b;
+
+    if (ia->nr_new_mods != ib->nr_new_mods) {
+        return ia->nr_new_mods < ib->nr_new_mods ? 1 : -1;
+    }
+    return ia->nr_mods < ib->nr_mods ? 1 : ia->nr_mods > ib->nr_mods ? -1 : 0;
+}
+
+static const char *clock_name(QEMUClock *clock)
+{
+    switch (clock->type) {
+    case QEMU_CLOCK_REALTIME:
+        return "rt";
+    case QEMU_CLOCK_VIRTUAL:
+        return "vm";
+    default:
+        return "host";
+    }
+}
+
+#define TIMER_INFO_MAX 20
+
+/* Timers that share a callback are the same timer of different devices
+   and add up; they are listed by how often they were re-armed since the
+   last time this was asked, busiest first */
+void qemu_timer_info(fprintf_function mon_printf, void *f)
+{
+    GArray *infos = g_array_new(false, false, sizeof(TimerInfo));
+    int64_t now = get_clock();
+    double secs = (now - timer_info_last) / (double)get_ticks_per_sec();
+    TimerInfo *info;
+    QEMUTimer *ts;
+    int i;
+
+    QLIST_FOREACH(ts, &all_timers, list) {
+        for (i = 0; i < infos->len; i++) {
+            info = &g_array_index(infos, TimerInfo, i);
+            if (info->cb == ts->cb && info->clock == ts->clock) {
+                break;
+            }
+        }
+        if (i == infos->len) {
+            g_array_set_size(infos, i + 1);
+            info = &g_array_index(infos, TimerInfo, i);
+            info->cb = ts->cb;
+            info->clock = ts->clock;
+        }
+        info->nr_timers++;
+        info->nr_pending += qemu_timer_pending(ts);
+        info->nr_mods += ts->nr_mods;
+        info->nr_new_mods += ts->nr_mods - ts->last_nr_mods;
+        ts->last_nr_mods = ts->nr_mods;
+    }
+    g_array_sort(infos, timer_info_cmp);
+
+    mon_printf(f, "%d vm, %d rt, %d host timers pending\n",
+               vm_clock->nr_timers, rt_clock->nr_timers,
+               host_clock->nr_timers);
+    mon_printf(f, "%-18s %-5s %6s %8s %12s %10s\n", "callback", "clock",
+               "timers", "pending", "rearms", "rearms/s");
+    for (i = 0; i < infos->len && i < TIMER_INFO_MAX; i++) {
+        info = &g_array_index(infos, TimerInfo, i);
+        mon_printf(f, "%-18p %-5s %6d %8d %12" PRIu64 " %10.0f\n",
+                   info->cb, clock_name(info->clock), info->nr_timers,
+                   info->nr_pending, info->nr_mods, info->nr_new_mods / secs);
+    }
+
+    timer_info_last = now;
+    g_array_free(infos, true);
+}
+
 void qemu_run_all_timers(void)
 {
     alarm_timer->pending = false;
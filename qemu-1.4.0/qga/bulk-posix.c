@@ -0,0 +1,493 @@
+/*
+ * QEMU Guest Agent bulk file transfer, POSIX implementation
+ *
+ * File contents are streamed over a second channel (-B/--bulk-path)
+ * in binary frames instead of being base64-encoded into JSON replies.
+ * guest-file-copy-out/guest-file-copy-in only set a transfer up; the
+ * data is moved from the main loop as the channel becomes writable or
+ * readable.  Every frame starts with a GuestBulkHeader, all fields big
+ * endian, followed by @len bytes of payload:
+ *
+ *   magic    QGA_BULK_MAGIC
+ *   id       the transfer id returned by the command
+ *   flags    QGA_BULK_COMPRESSED: the payload is zlib data that inflates
+ *                                 to @raw_len bytes
+ *            QGA_BULK_END:        last frame of the transfer, no payload
+ *            QGA_BULK_ERROR:      transfer aborted, the payload is a
+ *                                 message
+ *   len      payload bytes that follow the header
+ *   raw_len  payload bytes after decompression
+ *
+ * A frame never holds more than QGA_BULK_CHUNK_SIZE bytes of file data.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "qga/guest-agent-core.h"
+#include "qga-qmp-commands.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/queue.h"
+#include "qemu/bswap.h"
+
+#define QGA_BULK_MAGIC          0x51474142  /* "QGAB" */
+#define QGA_BULK_COMPRESSED     (1 << 0)
+#define QGA_BULK_END            (1 << 1)
+#define QGA_BULK_ERROR          (1 << 2)
+#define QGA_BULK_CHUNK_SIZE     (1024 * 1024)
+/* frames moved per main loop iteration, so that commands still get in */
+#define QGA_BULK_FRAMES_PER_CB  4
+
+typedef struct QEMU_PACKED GuestBulkHeader {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t flags;
+    uint32_t len;
+    uint32_t raw_len;
+} GuestBulkHeader;
+
+typedef struct GuestBulkTransfer {
+    int64_t id;
+    bool in;
+    int fd;
+    bool compress;
+    int64_t remaining;          /* copy-out only, -1 for up to EOF */
+    int64_t bytes;
+    bool done;
+    char *error;
+    QTAILQ_ENTRY(GuestBulkTransfer) next;
+} GuestBulkTransfer;
+
+static struct {
+    int fd;
+    GIOChannel *channel;
+    int64_t last_id;
+    QTAILQ_HEAD(, GuestBulkTransfer) transfers;
+    GuestBulkTransfer *out, *in;
+
+    /* frame being sent for the copy-out transfer */
+    uint8_t *out_buf;
+    size_t out_len, out_pos;
+    uint8_t *raw_buf;
+
+    /* frame being received for the copy-in transfer */
+    uint8_t *in_buf;
+    size_t in_pos;
+} guest_bulk_state = {
+    .fd = -1,
+};
+
+static bool guest_bulk_open(Error **err)
+{
+    const char *path = ga_bulk_path(ga_state);
+
+    if (guest_bulk_state.channel) {
+        return true;
+    }
+    if (!path) {
+        error_setg(err, "no bulk transfer channel, start qemu-ga with -B");
+        return false;
+    }
+
+    guest_bulk_state.fd = qemu_open(path, O_RDWR | O_NONBLOCK);
+    if (guest_bulk_state.fd == -1) {
+        error_setg_errno(err, errno, "failed to open bulk channel '%s'", path);
+        return false;
+    }
+    guest_bulk_state.channel = g_io_channel_unix_new(guest_bulk_state.fd);
+    guest_bulk_state.out_buf = g_malloc(sizeof(GuestBulkHeader) +
+                                        compressBound(QGA_BULK_CHUNK_SIZE));
+    guest_bulk_state.in_buf = g_malloc(sizeof(GuestBulkHeader) +
+                                       compressBound(QGA_BULK_CHUNK_SIZE));
+    guest_bulk_state.raw_buf = g_malloc(QGA_BULK_CHUNK_SIZE);
+    return true;
+}
+
+static GuestBulkTransfer *guest_bulk_transfer_new(int fd, bool in)
+{
+    GuestBulkTransfer *t = g_malloc0(sizeof(*t));
+
+    t->id = ++guest_bulk_state.last_id;
+    t->in = in;
+    t->fd = fd;
+    t->remaining = -1;
+    QTAILQ_INSERT_TAIL(&guest_bulk_state.transfers, t, next);
+    return t;
+}
+
+static void guest_bulk_transfer_finish(GuestBulkTransfer *t, const char *error)
+{
+    if (error && !t->error) {
+        t->error = g_strdup(error);
+        slog("guest-file-copy %" PRId64 " failed: %s", t->id, error);
+    }
+    t->done = true;
+    if (t->fd != -1) {
+        close(t->fd);
+        t->fd = -1;
+    }
+    if (guest_bulk_state.out == t) {
+        guest_bulk_state.out = NULL;
+    }
+    if (guest_bulk_state.in == t) {
+        guest_bulk_state.in = NULL;
+    }
+}
+
+static void guest_bulk_put_frame(GuestBulkTransfer *t, uint32_t flags,
+                                 uint32_t len, uint32_t raw_len)
+{
+    GuestBulkHeader *hdr = (GuestBulkHeader *)guest_bulk_state.out_buf;
+
+    hdr->magic = cpu_to_be32(QGA_BULK_MAGIC);
+    hdr->id = cpu_to_be32(t->id);
+    hdr->flags = cpu_to_be32(flags);
+    hdr->len = cpu_to_be32(len);
+    hdr->raw_len = cpu_to_be32(raw_len);
+    guest_bulk_state.out_len = sizeof(*hdr) + len;
+    guest_bulk_state.out_pos = 0;
+}
+
+/* Build the next frame of a copy-out transfer from the file */
+static void guest_bulk_fill_frame(GuestBulkTransfer *t)
+{
+    uint8_t *payload = guest_bulk_state.out_buf + sizeof(GuestBulkHeader);
+    size_t count = QGA_BULK_CHUNK_SIZE;
+    uLongf zlen;
+    ssize_t ret;
+
+    if (t->remaining >= 0 && t->remaining < count) {
+        count = t->remaining;
+    }
+
+    do {
+        ret = count ? read(t->fd, guest_bulk_state.raw_buf, count) : 0;
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        const char *msg = strerror(errno);
+
+        memcpy(payload, msg, strlen(msg));
+        guest_bulk_put_frame(t, QGA_BULK_ERROR, strlen(msg), strlen(msg));
+        guest_bulk_transfer_finish(t, msg);
+        return;
+    }
+    if (ret == 0) {
+        guest_bulk_put_frame(t, QGA_BULK_END, 0, 0);
+        guest_bulk_transfer_finish(t, NULL);
+        return;
+    }
+
+    t->bytes += ret;
+    if (t->remaining >= 0) {
+        t->remaining -= ret;
+    }
+
+    zlen = compressBound(ret);
+    if (t->compress &&
+        compress2(payload, &zlen, guest_bulk_state.raw_buf, ret,
+                  Z_BEST_SPEED) == Z_OK && zlen < ret) {
+        guest_bulk_put_frame(t, QGA_BULK_COMPRESSED, zlen, ret);
+    } else {
+        memcpy(payload, guest_bulk_state.raw_buf, ret);
+        guest_bulk_put_frame(t, 0, ret, ret);
+    }
+}
+
+static gboolean guest_bulk_out_cb(GIOChannel *channel, GIOCondition condition,
+                                  gpointer opaque)
+{
+    GuestBulkTransfer *t;
+    int frames = 0;
+    ssize_t ret;
+
+    for (;;) {
+        if (guest_bulk_state.out_pos == guest_bulk_state.out_len) {
+            t = guest_bulk_state.out;
+            if (!t || frames++ == QGA_BULK_FRAMES_PER_CB) {
+                /* the last frame of a transfer is out */
+                return t != NULL;
+            }
+            guest_bulk_fill_frame(t);
+        }
+
+        ret = write(guest_bulk_state.fd,
+                    guest_bulk_state.out_buf + guest_bulk_state.out_pos,
+                    guest_bulk_state.out_len - guest_bulk_state.out_pos);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return true;
+            }
+            const char *msg = strerror(errno);
+
+            g_warning("error writing bulk channel: %s", msg);
+            guest_bulk_state.out_pos = guest_bulk_state.out_len = 0;
+            if (guest_bulk_state.out) {
+                guest_bulk_transfer_finish(guest_bulk_state.out, msg);
+            }
+            return false;
+        }
+        guest_bulk_state.out_pos += ret;
+    }
+}
+
+/* Consume one complete frame of the copy-in transfer */
+static void guest_bulk_take_frame(GuestBulkTransfer *t)
+{
+    GuestBulkHeader *hdr = (GuestBulkHeader *)guest_bulk_state.in_buf;
+    uint8_t *payload = guest_bulk_state.in_buf + sizeof(*hdr);
+    uint32_t flags = be32_to_cpu(hdr->flags);
+    uint32_t len = be32_to_cpu(hdr->len);
+    uLongf raw_len = be32_to_cpu(hdr->raw_len);
+    ssize_t ret;
+
+    if (flags & QGA_BULK_ERROR) {
+        guest_bulk_transfer_finish(t, "transfer aborted by the host");
+        return;
+    }
+    if (flags & QGA_BULK_END) {
+        if (fsync(t->fd) < 0) {
+            guest_bulk_transfer_finish(t, strerror(errno));
+            return;
+        }
+        guest_bulk_transfer_finish(t, NULL);
+        return;
+    }
+
+    if (flags & QGA_BULK_COMPRESSED) {
+        if (raw_len > QGA_BULK_CHUNK_SIZE ||
+            uncompress(guest_bulk_state.raw_buf, &raw_len, payload,
+                       len) != Z_OK) {
+            guest_bulk_transfer_finish(t, "corrupt compressed frame");
+            return;
+        }
+        payload = guest_bulk_state.raw_buf;
+        len = raw_len;
+    }
+
+    while (len) {
+        ret = write(t->fd, payload, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            guest_bulk_transfer_finish(t, strerror(errno));
+            return;
+        }
+        payload += ret;
+        len -= ret;
+        t->bytes += ret;
+    }
+}
+
+static gboolean guest_bulk_in_cb(GIOChannel *channel, GIOCondition condition,
+                                 gpointer opaque)
+{
+    GuestBulkHeader *hdr = (GuestBulkHeader *)guest_bulk_state.in_buf;
+    GuestBulkTransfer *t = guest_bulk_state.in;
+    size_t need, max_len = compressBound(QGA_BULK_CHUNK_SIZE);
+    int frames = 0;
+    ssize_t ret;
+
+    while (t && frames < QGA_BULK_FRAMES_PER_CB) {
+        need = sizeof(*hdr);
+        if (guest_bulk_state.in_pos >= sizeof(*hdr)) {
+            if (be32_to_cpu(hdr->magic) != QGA_BULK_MAGIC ||
+                be32_to_cpu(hdr->id) != t->id ||
+                be32_to_cpu(hdr->len) > max_len) {
+                guest_bulk_state.in_pos = 0;
+                guest_bulk_transfer_finish(t, "bad frame on bulk channel");
+                break;
+            }
+            need += be32_to_cpu(hdr->len);
+        }
+
+        if (guest_bulk_state.in_pos == need) {
+            guest_bulk_take_frame(t);
+            guest_bulk_state.in_pos = 0;
+            t = guest_bulk_state.in;
+            frames++;
+            continue;
+        }
+
+        ret = read(guest_bulk_state.fd,
+                   guest_bulk_state.in_buf + guest_bulk_state.in_pos,
+                   need - guest_bulk_state.in_pos);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /* virtio-serial reads 0 while the host side is not connected;
+             * don't spin on it, as channel_event_cb doesn't either
+             */
+            if (ret == 0) {
+                usleep(100 * 1000);
+            }
+            return true;
+        }
+        guest_bulk_state.in_pos += ret;
+    }
+
+    return guest_bulk_state.in != NULL;
+}
+
+static void guest_bulk_init(void)
+{
+    QTAILQ_INIT(&guest_bulk_state.transfers);
+}
+
+static void guest_bulk_cleanup(void)
+{
+    GuestBulkTransfer *t, *tmp;
+
+    QTAILQ_FOREACH_SAFE(t, &guest_bulk_state.transfers, next, tmp) {
+        guest_bulk_transfer_finish(t, NULL);
+        QTAILQ_REMOVE(&guest_bulk_state.transfers, t, next);
+        g_free(t->error);
+        g_free(t);
+    }
+    if (guest_bulk_state.channel) {
+        g_io_channel_unref(guest_bulk_state.channel);
+        close(guest_bulk_state.fd);
+        g_free(guest_bulk_state.out_buf);
+        g_free(guest_bulk_state.in_buf);
+        g_free(guest_bulk_state.raw_buf);
+    }
+}
+
+void ga_bulk_command_state_init(GACommandState *cs)
+{
+    ga_command_state_add(cs, guest_bulk_init, guest_bulk_cleanup);
+}
+
+GuestFileCopy *qmp_guest_file_copy_out(const char *path, bool has_offset,
+                                       int64_t offset, bool has_length,
+                                       int64_t length, bool has_compress,
+                                       bool compress, Error **err)
+{
+    GuestBulkTransfer *t;
+    GuestFileCopy *copy;
+    struct stat st;
+    int fd;
+
+    slog("guest-file-copy-out called, filepath: %s", path);
+    if (!guest_bulk_open(err)) {
+        return NULL;
+    }
+    if (guest_bulk_state.out ||
+        guest_bulk_state.out_pos < guest_bulk_state.out_len) {
+        /* including the last frame of a finished one not sent yet */
+        error_setg(err, "a copy-out transfer is still in progress");
+        return NULL;
+    }
+    if ((has_offset && offset < 0) || (has_length && length < 0)) {
+        error_set(err, QERR_INVALID_PARAMETER,
+                  has_length && length < 0 ? "length" : "offset");
+        return NULL;
+    }
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd == -1) {
+        error_setg_errno(err, errno, "failed to open file '%s'", path);
+        return NULL;
+    }
+    if (has_offset && lseek(fd, offset, SEEK_SET) == (off_t)-1) {
+        error_setg_errno(err, errno, "failed to seek file '%s'", path);
+        close(fd);
+        return NULL;
+    }
+
+    t = guest_bulk_transfer_new(fd, false);
+    t->compress = has_compress && compress;
+    if (has_length) {
+        t->remaining = length;
+    }
+    guest_bulk_state.out = t;
+    g_io_add_watch(guest_bulk_state.channel, G_IO_OUT, guest_bulk_out_cb,
+                   NULL);
+
+    copy = g_malloc0(sizeof(*copy));
+    copy->id = t->id;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        copy->has_size = true;
+        copy->size = MAX(st.st_size - (has_offset ? offset : 0), 0);
+        if (has_length) {
+            copy->size = MIN(copy->size, length);
+        }
+    }
+    return copy;
+}
+
+GuestFileCopy *qmp_guest_file_copy_in(const char *path, bool has_append,
+                                      bool append, Error **err)
+{
+    GuestBulkTransfer *t;
+    GuestFileCopy *copy;
+    int fd;
+
+    slog("guest-file-copy-in called, filepath: %s", path);
+    if (!guest_bulk_open(err)) {
+        return NULL;
+    }
+    if (guest_bulk_state.in) {
+        error_setg(err, "copy-in %" PRId64 " is still in progress",
+                   guest_bulk_state.in->id);
+        return NULL;
+    }
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT |
+                   (has_append && append ? O_APPEND : O_TRUNC), 0600);
+    if (fd == -1) {
+        error_setg_errno(err, errno, "failed to open file '%s'", path);
+        return NULL;
+    }
+
+    t = guest_bulk_transfer_new(fd, true);
+    guest_bulk_state.in = t;
+    guest_bulk_state.in_pos = 0;
+    g_io_add_watch(guest_bulk_state.channel, G_IO_IN, guest_bulk_in_cb, NULL);
+
+    copy = g_malloc0(sizeof(*copy));
+    copy->id = t->id;
+    return copy;
+}
+
+GuestFileCopyStatus *qmp_guest_file_copy_status(int64_t id, Error **err)
+{
+    GuestBulkTransfer *t;
+    GuestFileCopyStatus *status;
+
+    QTAILQ_FOREACH(t, &guest_bulk_state.transfers, next) {
+        if (t->id == id) {
+            break;
+        }
+    }
+    if (!t) {
+        error_setg(err, "transfer '%" PRId64 "' has not been found", id);
+        return NULL;
+    }
+
+    status = g_malloc0(sizeof(*status));
+    status->bytes = t->bytes;
+    status->done = t->done;
+    if (t->error) {
+        status->has_error = true;
+        status->error = g_strdup(t->error);
+    }
+
+    /* a finished transfer is reported once */
+    if (t->done) {
+        QTAILQ_REMOVE(&guest_bulk_state.transfers, t, next);
+        g_free(t->error);
+        g_free(t);
+    }
+    return status;
+}
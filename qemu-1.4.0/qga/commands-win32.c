@@ -126,6 +126,28 @@ GuestFileRead *qmp_guest_file_read(int64_t handle, bool has_count,
     return 0;
 }
 
+GuestFileCopy *qmp_guest_file_copy_out(const char *path, bool has_offset,
+                                       int64_t offset, bool has_length,
+                                       int64_t length, bool has_compress,
+                                       bool compress, Error **err)
+{
+    error_set(err, QERR_UNSUPPORTED);
+    return 0;
+}
+
+GuestFileCopy *qmp_guest_file_copy_in(const char *path, bool has_append,
+                                      bool append, Error **err)
+{
+    error_set(err, QERR_UNSUPPORTED);
+    return 0;
+}
+
+GuestFileCopyStatus *qmp_guest_file_copy_status(int64_t id, Error **err)
+{
+    error_set(err, QERR_UNSUPPORTED);
+    return 0;
+}
+
 GuestFileWrite *qmp_guest_file_write(int64_t handle, const char *buf_b64,
                                      bool has_count, int64_t count, Error **err)
 {
@@ -35,6 +35,8 @@ bool ga_is_frozen(GAState *s);
 void ga_set_frozen(GAState *s);
 void ga_unset_frozen(GAState *s);
 const char *ga_fsfreeze_hook(GAState *s);
+const char *ga_bulk_path(GAState *s);
+void ga_bulk_command_state_init(GACommandState *cs);
 
 #ifndef _WIN32
 void reopen_fd_to_null(int fd);
@@ -76,6 +76,7 @@ struct GAState {
 #ifdef CONFIG_FSFREEZE
     const char *fsfreeze_hook;
 #endif
+    const char *bulk_path;
 };
 
 struct GAState *ga_state;
@@ -163,6 +164,8 @@ static void usage(const char *cmd)
 "                    isa-serial (virtio-serial is the default)\n"
 "  -p, --path        device/socket path (the default for virtio-serial is:\n"
 "                    %s)\n"
+"  -B, --bulk-path   device path of a second virtio-serial port to use for\n"
+"                    guest-file-copy-in/out transfers\n"
 "  -l, --logfile     set logfile path, logs to stderr by default\n"
 "  -f, --pidfile     specify pidfile (default is %s)\n"
 #ifdef CONFIG_FSFREEZE
@@ -448,6 +451,11 @@ const char *ga_fsfreeze_hook(GAState *s)
 }
 #endif
 
+const char *ga_bulk_path(GAState *s)
+{
+    return s->bulk_path;
+}
+
 static void become_daemon(const char *pidfile)
 {
 #ifndef _WIN32
@@ -543,7 +551,7 @@ static void process_command(GAState *s, QDict *req)
 }
 
 /* handle requests/control events coming in over the channel */
-static void process_event(JSONMessageParser *parser, QList *tokens)
+static void process_event(JSONMessageParser *parser, GQueue *tokens)
 {
     GAState *s = container_of(parser, GAState, parser);
     QObject *obj;
@@ -726,8 +734,8 @@ VOID WINAPI service_main(DWORD argc, TCHAR *argv[])
 
 int main(int argc, char **argv)
 {
-    const char *sopt = "hVvdm:p:l:f:F::b:s:t:";
-    const char *method = NULL, *path = NULL;
+    const char *sopt = "hVvdm:p:B:l:f:F::b:s:t:";
+    const char *method = NULL, *path = NULL, *bulk_path = NULL;
     const char *log_filepath = NULL;
     const char *pid_filepath = QGA_PIDFILE_DEFAULT;
 #ifdef CONFIG_FSFREEZE
@@ -748,6 +756,7 @@ int main(int argc, char **argv)
         { "verbose", 0, NULL, 'v' },
         { "method", 1, NULL, 'm' },
         { "path", 1, NULL, 'p' },
+        { "bulk-path", 1, NULL, 'B' },
         { "daemonize", 0, NULL, 'd' },
         { "blacklist", 1, NULL, 'b' },
 #ifdef _WIN32
@@ -771,6 +780,9 @@ int main(int argc, char **argv)
         case 'p':
             path = optarg;
             break;
+        case 'B':
+            bulk_path = optarg;
+            break;
         case 'l':
             log_filepath = optarg;
             break;
@@ -848,6 +860,7 @@ int main(int argc, char **argv)
 #ifdef CONFIG_FSFREEZE
     s->fsfreeze_hook = fsfreeze_hook;
 #endif
+    s->bulk_path = bulk_path;
     g_log_set_default_handler(ga_log, s);
     g_log_set_fatal_mask(NULL, G_LOG_LEVEL_ERROR);
     ga_enable_logging(s);
@@ -557,6 +557,69 @@ Example:
      "arguments": { "filename": "/tmp/save" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "xen-save-devices-state-stats",
+        .args_type  = "filename:F,incremental:b?",
+    .mhandler.cmd_new = qmp_marshal_input_xen_save_devices_state_stats,
+    },
+
+SQMP
+xen-save-devices-state-stats
+----------------------------
+
+Like xen-save-devices-state, but the save may be incremental, and
+statistics of the save are returned.
+
+Arguments:
+
+- "filename": the file to save the state of the devices to (json-string)
+- "incremental": only save the devices whose state differs from the last
+                 full save, on top of which the file must be loaded
+                 (json-bool, optional)
+
+Returns statistics of the save:
+
+- "save-time": time spent saving, in microseconds (json-int)
+- "sections": number of device state sections (json-int)
+- "sections-saved": number of sections written (json-int)
+- "bytes": size of the file (json-int)
+
+Example:
+
+-> { "execute": "xen-save-devices-state-stats",
+     "arguments": { "filename": "/tmp/save.1", "incremental": true } }
+<- { "return": { "save-time": 412, "sections": 41, "sections-saved": 6,
+                 "bytes": 9822 } }
+
+EQMP
+
+    {
+        .name       = "xen-load-devices-state",
+        .args_type  = "filename:F,base:F?",
+    .mhandler.cmd_new = qmp_marshal_input_xen_load_devices_state,
+    },
+
+SQMP
+xen-load-devices-state
+-------
+
+Load the state of devices from a file written by xen-save-devices-state.
+The guest is stopped while it is loaded.
+
+Arguments:
+
+- "filename": the file to load the state of the devices from
+- "base": a full save to load first, when "filename" is incremental
+          (json-string, optional)
+
+Example:
+
+-> { "execute": "xen-load-devices-state",
+     "arguments": { "filename": "/tmp/save.1", "base": "/tmp/save" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -581,6 +644,89 @@ Example:
      "arguments": { "enable": true } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-xen-mapcache",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_xen_mapcache,
+    },
+
+SQMP
+query-xen-mapcache
+------------------
+
+Show statistics of the Xen map cache.  The counters are cumulative.
+
+- "bucket-size": size of a map cache bucket in bytes (json-int)
+- "mapped": number of buckets currently mapped (json-int)
+- "max-mapped": number of buckets kept mapped before eviction (json-int)
+- "hits": lookups satisfied by an existing mapping (json-int)
+- "misses": lookups that had to map a bucket (json-int)
+- "remaps": misses that replaced another bucket's mapping (json-int)
+- "evictions": buckets unmapped to honour "max-mapped" (json-int)
+
+Example:
+
+-> { "execute": "query-xen-mapcache" }
+<- { "return": { "bucket-size": 1048576, "mapped": 512,
+                 "max-mapped": 32768, "hits": 1893730, "misses": 2210,
+                 "remaps": 0, "evictions": 0 } }
+
+EQMP
+
+    {
+        .name       = "query-xen-backends",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_xen_backends,
+    },
+
+SQMP
+query-xen-backends
+------------------
+
+Show the I/O statistics of the Xen PV backend devices.  The counters are
+cumulative.  For network devices reads are packets received by the guest,
+writes are packets it sent.
+
+Return a json-array of json-objects, one per backend, each with:
+
+- "type": backend type, such as "qdisk" or "vif" (json-string)
+- "domain": domain of the frontend (json-int)
+- "dev": device number (json-int)
+- "state": xenbus state of the backend (json-string)
+- "rd-ops", "rd-bytes": read requests or received packets, and their bytes
+  (json-int)
+- "wr-ops", "wr-bytes": the same for writes or sent packets (json-int)
+- "errors": requests or packets that failed (json-int)
+- "inflight": requests being processed (json-int)
+- "inflight-max": the largest "inflight" seen (json-int)
+- "grant-maps", "grant-unmaps": grant references mapped and unmapped for
+  requests or packets, not counting the rings (json-int)
+- "grant-copies": segments moved with grant copy (json-int)
+- "notify-sent", "notify-received": event channel notifications sent to and
+  received from the frontend (json-int)
+- "latency-histogram": latencies from taking a request off the ring to
+  responding, for devices that queue requests (json-object, optional)
+
+Example:
+
+-> { "execute": "query-xen-backends" }
+<- { "return": [
+       { "type": "qdisk", "domain": 3, "dev": 51712, "state": "Connected",
+         "rd-ops": 8177, "rd-bytes": 180256768, "wr-ops": 1204,
+         "wr-bytes": 9863168, "errors": 0, "inflight": 2,
+         "inflight-max": 32, "grant-maps": 51930, "grant-unmaps": 51916,
+         "grant-copies": 0, "notify-sent": 6011, "notify-received": 5563,
+         "latency-histogram": { "min-ns": 1000, "bins": [
+           { "start-ns": 0, "count": 0 }, ... ] } },
+       { "type": "vif", "domain": 3, "dev": 0, "state": "Connected",
+         "rd-ops": 1405, "rd-bytes": 2003318, "wr-ops": 988,
+         "wr-bytes": 81366, "errors": 0, "inflight": 0,
+         "inflight-max": 0, "grant-maps": 988, "grant-unmaps": 988,
+         "grant-copies": 1405, "notify-sent": 1102,
+         "notify-received": 761 } ] }
+
 EQMP
 
     {
@@ -613,6 +759,14 @@ Notes:
 (2) All boolean arguments default to false
 (3) The user Monitor's "detach" argument is invalid in QMP and should not
     be used
+(4) A tcp URI may end in ",channels=N" to have RAM pages sent over N more
+    connections in parallel, e.g. "tcp:0:4446,channels=4".  The destination
+    listens with a plain tcp URI.  Channels are not used together with the
+    "xbzrle" or "compress-pages" capabilities
+(5) "file:PATH" saves to a file that keeps guest RAM apart from the rest of
+    the state; "-incoming file:PATH" resumes from it mapping RAM from the
+    file, so the guest runs before all of it is read.  The file must not
+    be changed while such a guest runs
 
 EQMP
 
@@ -679,6 +833,74 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i,sample-pages:i?",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring how fast the guest dirties its memory.  A sample of the
+pages of each RAM block is hashed at the start and at the end of the
+measurement, and the pages whose hash changed are counted as dirtied.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, 1 to 60 (json-int)
+- "sample-pages": pages to sample per GiB of RAM, 1 to 65536, default 512
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the result of the last dirty rate measurement.
+
+Return a json-object with the following information:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "start-time": when the measurement started, in milliseconds of the host
+  real time clock (json-int, optional)
+- "calc-time": requested length of the measurement in seconds (json-int,
+  optional)
+- "page-size": size of a guest page in bytes (json-int, optional)
+- "dirty-rate": estimated pages dirtied per second (json-int, optional)
+- "blocks": json-array of json-objects, one per RAM block, each with
+  - "id": name of the block (json-string)
+  - "size": size of the block in bytes (json-int)
+  - "sampled": number of pages sampled (json-int)
+  - "dirty": number of sampled pages found dirty (json-int)
+  - "dirty-rate": estimated pages dirtied per second (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured", "start-time": 1330997, "calc-time": 2,
+        "page-size": 4096, "dirty-rate": 2560,
+        "blocks": [ { "id": "pc.ram", "size": 1073741824, "sampled": 512,
+                      "dirty": 10, "dirty-rate": 2560 },
+                    { "id": "pc.bios", "size": 131072, "sampled": 1,
+                      "dirty": 0, "dirty-rate": 0 } ] } }
+
 EQMP
 
     {
@@ -765,7 +987,7 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?,detach:b?",
         .params     = "-p protocol [begin] [length]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
@@ -787,12 +1009,23 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "format": "elf" (default), "kdump-zlib", "kdump-lzo" or "kdump-snappy".
+            The kdump-compressed formats skip zero pages, compress the others
+            on several threads and need a seekable file; they cannot be used
+            together with paging, begin or length (json-string, optional)
+- "detach": write guest memory in the background while the guest runs again;
+            DUMP_COMPLETED is emitted at the end (json-bool, optional)
 
 Example:
 
 -> { "execute": "dump-guest-memory", "arguments": { "protocol": "fd:dump" } }
 <- { "return": {} }
 
+-> { "execute": "dump-guest-memory",
+     "arguments": { "paging": false, "protocol": "file:/var/crash/vmcore",
+                    "format": "kdump-zlib", "detach": true } }
+<- { "return": {} }
+
 Notes:
 
 (1) All boolean arguments default to false
@@ -894,6 +1127,24 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_block_job_set_speed,
     },
 
+    {
+        .name       = "block-job-set-weight",
+        .args_type  = "device:B,weight:i",
+        .mhandler.cmd_new = qmp_marshal_input_block_job_set_weight,
+    },
+
+    {
+        .name       = "block-job-set-bandwidth",
+        .args_type  = "speed:o,latency-target:i?",
+        .mhandler.cmd_new = qmp_marshal_input_block_job_set_bandwidth,
+    },
+
+    {
+        .name       = "query-block-job-bandwidth",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_block_job_bandwidth,
+    },
+
     {
         .name       = "block-job-cancel",
         .args_type  = "device:B,force:b?",
@@ -1056,6 +1307,97 @@ Example:
                                                "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,file:s?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Start recording the writes to a device in a named dirty bitmap.  With
+"file", the bitmap is loaded from the file if it exists, and saved to it
+when the drive is closed.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the bitmap (json-string)
+- "granularity": bytes covered by each bit, default 65536 (json-int, optional)
+- "file": file to keep the bitmap in (json-string, optional)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "ide-hd0",
+                                                         "name": "nightly",
+                                                         "file": "/var/lib/hd0.dbm" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Stop recording writes in a named dirty bitmap and drop it.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "ide-hd0",
+                                                            "name": "nightly" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "drive-backup-incremental",
+        .args_type  = "device:B,bitmap:s,target:s,format:s?,mode:s?,speed:o?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_backup_incremental,
+    },
+
+SQMP
+drive-backup-incremental
+------------------------
+
+Copy the clusters that are dirty in a named dirty bitmap to target, as
+a "backup" block job.  The job completes once target has caught up with
+the device, and leaves the bitmap empty.  A new target image is created
+without a backing file and with the format of the device, unless format
+is given.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "bitmap": name of the dirty bitmap (json-string)
+- "target": name of the backup image (json-string)
+- "format": format of the backup image (json-string, optional)
+- "mode": how the image should be created (NewImageMode, optional,
+  default 'absolute-paths')
+- "speed": maximum speed of the job, in bytes per second (json-int, optional)
+
+Example:
+
+-> { "execute": "drive-backup-incremental", "arguments": { "device": "ide-hd0",
+                                                           "bitmap": "nightly",
+                                                           "target": "/backup/hd0-inc.qcow2",
+                                                           "format": "qcow2" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1103,6 +1445,108 @@ Example:
 -> { "execute": "set_link", "arguments": { "name": "e1000.0", "up": false } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-netdev-queues",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_netdev_queues,
+    },
+
+SQMP
+query-netdev-queues
+-------------------
+
+Show the traffic through each queue of the tap network backends.
+
+Return a json-array of json-objects, one per queue, each with:
+
+- "netdev": id of the backend (json-string)
+- "queue": index of the queue (json-int)
+- "vhost": true if the queue has a vhost-net device (json-bool); packets
+  moved by vhost are not counted
+- "rx-packets", "rx-bytes": packets read from the tap by QEMU, and their
+  size without any virtio-net header (json-int)
+- "tx-packets", "tx-bytes": the same for packets written to the tap
+  (json-int)
+- "thread-id": host thread of the vhost-net device, optional (json-int)
+- "cpu": host CPU that thread last ran on, optional (json-int)
+
+Example:
+
+-> { "execute": "query-netdev-queues" }
+<- { "return": [
+       { "netdev": "net0", "queue": 0, "vhost": true,
+         "rx-packets": 12, "rx-bytes": 1320,
+         "tx-packets": 9, "tx-bytes": 906,
+         "thread-id": 4511, "cpu": 2 },
+       { "netdev": "net0", "queue": 1, "vhost": true,
+         "rx-packets": 0, "rx-bytes": 0,
+         "tx-packets": 0, "tx-bytes": 0,
+         "thread-id": 4512, "cpu": 6 } ] }
+
+EQMP
+
+    {
+        .name       = "query-nic-latency",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_nic_latency,
+    },
+
+SQMP
+query-nic-latency
+-----------------
+
+Show the latency histograms of the guest network adapters that collect
+them, see nic-latency-histogram-set.
+
+Return a json-array of json-objects, one per queue, each with:
+
+- "name": id of the adapter (json-string)
+- "queue": index of the queue (json-int)
+- "tx-latency-histogram": time from the guest's notification to the
+  completion of each sent packet, in the format of the histograms of
+  query-blockstats (json-object)
+
+Example:
+
+-> { "execute": "query-nic-latency" }
+<- { "return": [
+       { "name": "nic0", "queue": 0,
+         "tx-latency-histogram": {
+           "min-ns": 100000,
+           "bins": [ { "start-ns": 0, "count": 5102 },
+                     { "start-ns": 100000, "count": 311 },
+                     { "start-ns": 200000, "count": 2 } ] } } ] }
+
+EQMP
+
+    {
+        .name       = "nic-latency-histogram-set",
+        .args_type  = "name:s,enable:b?,min-ns:l?,bins:l?",
+        .mhandler.cmd_new = qmp_marshal_input_nic_latency_histogram_set,
+    },
+
+SQMP
+nic-latency-histogram-set
+-------------------------
+
+Start collecting latency histograms for every queue of a guest network
+adapter, or restart them from zero.  Only virtio-net collects them.
+
+Arguments:
+
+- "name": id of the adapter (json-string)
+- "enable": false to stop collecting, default true (json-bool, optional)
+- "min-ns": end of the first bin, default 1000 (json-int, optional)
+- "bins": number of bins, 1 to 64, default 24 (json-int, optional)
+
+Example:
+
+-> { "execute": "nic-latency-histogram-set",
+     "arguments": { "name": "nic0", "min-ns": 100000, "bins": 3 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1312,7 +1756,9 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,burst_length:l?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1331,6 +1777,13 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total burst rate in bytes per second(json-int, optional)
+- "bps_rd_max":  read burst rate in bytes per second(json-int, optional)
+- "bps_wr_max":  write burst rate in bytes per second(json-int, optional)
+- "iops_max":  total burst rate in I/O operations per second(json-int, optional)
+- "iops_rd_max":  read burst rate in I/O operations per second(json-int, optional)
+- "iops_wr_max":  write burst rate in I/O operations per second(json-int, optional)
+- "burst_length":  seconds a burst may last, default 1(json-int, optional)
 
 Example:
 
@@ -1343,6 +1796,36 @@ Example:
                                                "iops_wr": "0" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,enable:b?,min-ns:l?,bins:l?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Start collecting latency histograms of the reads, writes and flushes of a
+block device, or restart them from zero.  Bin n > 0 counts the requests that
+took between min-ns * 2^(n-1) and min-ns * 2^n nanoseconds; the last bin
+has no upper bound.  The histograms are reported by query-blockstats.
+
+Arguments:
+
+- "device": device name (json-string)
+- "enable": false to stop collecting, default true (json-bool, optional)
+- "min-ns": end of the first bin, default 1000 (json-int, optional)
+- "bins": number of bins, 1 to 64, default 24 (json-int, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0", "min-ns": 10000, "bins": 16 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1531,6 +2014,7 @@ EQMP
         .name       = "query-version",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_version,
+        .flags      = MONITOR_CMD_LOCKLESS,
     },
 
 SQMP
@@ -1681,6 +2165,12 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max", "bps_rd_max", "bps_wr_max", "iops_max", "iops_rd_max",
+           "iops_wr_max": burst rates, only present if set (json-int)
+         - "burst_length": seconds a burst may last, only present if a
+           burst rate is set (json-int)
+         - "group": throttling group, only present if the device is in one
+           (json-string)
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
@@ -1765,6 +2255,27 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_merged": read requests merged into another one (json-int)
+    - "wr_merged": write requests merged into another one (json-int)
+    - "l2_cache_hits": L2 table cache hits (json-int, optional)
+    - "l2_cache_misses": L2 table cache misses (json-int, optional)
+    - "refcount_cache_hits": refcount block cache hits (json-int, optional)
+    - "refcount_cache_misses": refcount block cache misses (json-int, optional)
+    - "rd_latency_histogram": read latencies, only present once enabled with
+      block-latency-histogram-set (json-object, optional)
+        - "min-ns": end of the first bin (json-int)
+        - "bins": the bins (json-array of json-object)
+            - "start-ns": shortest latency of the bin (json-int)
+            - "count": requests in the bin (json-int)
+    - "wr_latency_histogram": write latencies (json-object, optional)
+    - "flush_latency_histogram": flush latencies (json-object, optional)
+    - "backend_inflight": operations in flight on a storage cluster, e.g.
+      for rbd (json-int, optional)
+    - "backend_operations": operations sent to the cluster (json-int, optional)
+    - "backend_total_time_ns": total time spent on those operations in
+      nano-seconds (json-int, optional)
+    - "backend_merged": writes sent as part of an adjacent write's
+      operation (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2142,6 +2653,7 @@ EQMP
         .name       = "query-kvm",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_kvm,
+        .flags      = MONITOR_CMD_LOCKLESS,
     },
 
 SQMP
@@ -2182,6 +2694,7 @@ EQMP
         .name       = "query-status",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_status,
+        .flags      = MONITOR_CMD_LOCKLESS,
     },
 
 SQMP
@@ -2228,6 +2741,66 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_mice,
     },
 
+SQMP
+query-input-latency
+-------------------
+
+Show the latency of host input events, from their arrival from the Xen input
+server to each stage they reach in QEMU.
+
+Arguments:
+
+- "reset": clear the statistics after reading them (json-bool, optional)
+
+Each stage is represented by a json-object, the returned value is a json-array
+of the stages that saw events.
+
+The stage json-object contains the following:
+
+- "stage": "dispatch", "ps2" or "xenmou" (json-string)
+- "count": number of events (json-int)
+- "p50-ns": median latency in nanoseconds, rounded up to a power of two
+            times the histogram start (json-int)
+- "p99-ns": 99th percentile, rounded up the same way (json-int)
+- "max-ns": longest latency in nanoseconds (json-int)
+- "histogram": the latencies, in the format of the histograms of
+               query-blockstats (json-object)
+
+Example:
+
+-> { "execute": "query-input-latency" }
+<- {
+      "return":[
+         {
+            "stage":"dispatch",
+            "count":1520,
+            "p50-ns":8000,
+            "p99-ns":512000,
+            "max-ns":1890211,
+            "histogram":{ "min-ns":1000,
+                          "bins":[ { "start-ns":0, "count":2 },
+                                   { "start-ns":1000, "count":51 },
+                                   ... ] }
+         },
+         {
+            "stage":"xenmou",
+            "count":301,
+            "p50-ns":64000,
+            "p99-ns":1024000,
+            "max-ns":2210343,
+            "histogram":{ "min-ns":1000, "bins":[ ... ] }
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-input-latency",
+        .args_type  = "reset:b?",
+        .mhandler.cmd_new = qmp_marshal_input_query_input_latency,
+    },
+
 SQMP
 query-vnc
 ---------
@@ -2390,6 +2963,7 @@ EQMP
         .name       = "query-name",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_name,
+        .flags      = MONITOR_CMD_LOCKLESS,
     },
 
 SQMP
@@ -2413,6 +2987,7 @@ EQMP
         .name       = "query-uuid",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_uuid,
+        .flags      = MONITOR_CMD_LOCKLESS,
     },
 
 SQMP
@@ -2457,6 +3032,15 @@ The main json-object contains the following:
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of cache misses
          - "overflow": number of XBZRLE overflows
+- "postcopy": only present once migration has switched to post-copy.
+  It is a json-object with the following information:
+         - "requests": pages the destination asked for (json-int)
+         - "faults": page faults on the destination, once it has
+                     all pages (json-int, optional)
+         - "fault-latency-avg": average wait for a missing page in us,
+                                likewise (json-int, optional)
+         - "fault-latency-max": longest wait for a missing page in us,
+                                likewise (json-int, optional)
 Examples:
 
 1. Before the first migration
@@ -2572,6 +3156,11 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "zero-blocks": send all-zero block migration chunks as a flag
+- "compress-blocks": zlib-compress block migration chunks
+- "compress-pages": zlib-compress RAM pages in worker threads
+- "auto-converge": throttle the vCPUs if the guest dirties memory too fast
+- "postcopy-ram": finish migration with the guest running on the destination
 
 Arguments:
 
@@ -2774,4 +3363,69 @@ Example:
 -> { "execute": "chardev-remove", "arguments": { "id" : "foo" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-mmio-profile",
+        .args_type  = "limit:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_mmio_profile,
+    },
+
+SQMP
+query-mmio-profile
+------------------
+
+Show how often the guest accessed each device register since the profile
+was started with mmio-profile-set, and how long the device took to handle
+the accesses.  The most accessed registers come first.
+
+Arguments:
+
+- "limit": return at most this many entries (json-int, optional)
+
+Return a json-array of json-objects, each with:
+
+- "region": name of the memory region, or "ioport" for ports registered
+  outside the memory API (json-string)
+- "pio": true for port I/O, false for MMIO (json-bool)
+- "offset": offset within the region, or the port for "ioport" (json-int)
+- "reads", "writes": number of accesses (json-int)
+- "read-ns", "write-ns": time spent in the handlers (json-int)
+
+Example:
+
+-> { "execute": "query-mmio-profile", "arguments": { "limit": 2 } }
+<- { "return": [
+       { "region": "rtc", "pio": true, "offset": 1,
+         "reads": 52311, "writes": 0,
+         "read-ns": 14874102, "write-ns": 0 },
+       { "region": "rtc", "pio": true, "offset": 0,
+         "reads": 0, "writes": 52311,
+         "read-ns": 0, "write-ns": 9105477 } ] }
+
+EQMP
+
+    {
+        .name       = "mmio-profile-set",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_mmio_profile_set,
+    },
+
+SQMP
+mmio-profile-set
+----------------
+
+Start counting the MMIO and port I/O accesses of the guest, from zero, or
+stop counting.  Profiling costs a clock read and a hash table lookup per
+access while it is on.
+
+Arguments:
+
+- "enable": whether to count (json-bool)
+
+Example:
+
+-> { "execute": "mmio-profile-set", "arguments": { "enable": true } }
+<- { "return": {} }
+
 EQMP
@@ -268,11 +268,25 @@ static const uint8_t json_lexer[][256] =  {
     },
 };
 
+/* The token buffer is reused, but does not keep the memory of a big one */
+#define TOKEN_BUF_SIZE 64
+#define TOKEN_BUF_KEEP 4096
+
+static void json_lexer_reset_token(JSONLexer *lexer)
+{
+    if (lexer->token->allocated_len > TOKEN_BUF_KEEP) {
+        g_string_free(lexer->token, true);
+        lexer->token = g_string_sized_new(TOKEN_BUF_SIZE);
+    } else {
+        g_string_truncate(lexer->token, 0);
+    }
+}
+
 void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func)
 {
     lexer->emit = func;
     lexer->state = IN_START;
-    lexer->token = qstring_new();
+    lexer->token = g_string_sized_new(TOKEN_BUF_SIZE);
     lexer->x = lexer->y = 0;
 }
 
@@ -290,7 +304,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
         new_state = json_lexer[lexer->state][(uint8_t)ch];
         char_consumed = !TERMINAL_NEEDED_LOOKAHEAD(lexer->state, new_state);
         if (char_consumed) {
-            qstring_append_chr(lexer->token, ch);
+            g_string_append_c(lexer->token, ch);
         }
 
         switch (new_state) {
@@ -303,8 +317,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
             lexer->emit(lexer, lexer->token, new_state, lexer->x, lexer->y);
             /* fall through */
         case JSON_SKIP:
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            json_lexer_reset_token(lexer);
             new_state = IN_START;
             break;
         case IN_ERROR:
@@ -322,8 +335,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
              * induce an error/flush state.
              */
             lexer->emit(lexer, lexer->token, JSON_ERROR, lexer->x, lexer->y);
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            json_lexer_reset_token(lexer);
             new_state = IN_START;
             lexer->state = new_state;
             return 0;
@@ -336,10 +348,9 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
     /* Do not let a single token grow to an arbitrarily large size,
      * this is a security consideration.
      */
-    if (lexer->token->length > MAX_TOKEN_SIZE) {
+    if (lexer->token->len > MAX_TOKEN_SIZE) {
         lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
-        QDECREF(lexer->token);
-        lexer->token = qstring_new();
+        json_lexer_reset_token(lexer);
         lexer->state = IN_START;
     }
 
@@ -369,5 +380,5 @@ int json_lexer_flush(JSONLexer *lexer)
 
 void json_lexer_destroy(JSONLexer *lexer)
 {
-    QDECREF(lexer->token);
+    g_string_free(lexer->token, true);
 }
@@ -39,6 +39,8 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qemu/bitops.h"
+#include "qemu/iov.h"
+#include "migration/postcopy.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -113,6 +115,7 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -125,6 +128,11 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /* When writing through writev_buffer, what to write next: pieces of buf
+     * and buffers queued with qemu_put_buffer_async(), in stream order */
+    struct iovec iov[MAX_IOV_SIZE];
+    unsigned int iovcnt;
+
     int last_error;
 };
 
@@ -198,6 +206,26 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return len;
 }
 
+static int socket_put_buffer(void *opaque, const uint8_t *buf, int64_t pos,
+                             int size)
+{
+    QEMUFileSocket *s = opaque;
+    ssize_t len;
+    int offset = 0;
+
+    while (offset < size) {
+        len = send(s->fd, (const void *)(buf + offset), size - offset, 0);
+        if (len == -1) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            return -socket_error();
+        }
+        offset += len;
+    }
+    return size;
+}
+
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -354,12 +382,30 @@ static const QEMUFileOps socket_read_ops = {
     .close =      socket_close
 };
 
-QEMUFile *qemu_fopen_socket(int fd)
+static const QEMUFileOps socket_write_ops = {
+    .get_fd =     socket_get_fd,
+    .put_buffer = socket_put_buffer,
+    .close =      socket_close
+};
+
+/* Writing needs a blocking socket */
+QEMUFile *qemu_fopen_socket(int fd, const char *mode)
 {
-    QEMUFileSocket *s = g_malloc0(sizeof(QEMUFileSocket));
+    QEMUFileSocket *s;
 
+    if (mode == NULL || (mode[0] != 'r' && mode[0] != 'w') ||
+        mode[1] != 'b' || mode[2] != 0) {
+        fprintf(stderr, "qemu_fopen_socket: Argument validity check failed\n");
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(QEMUFileSocket));
     s->fd = fd;
-    s->file = qemu_fopen_ops(s, &socket_read_ops);
+    if (mode[0] == 'r') {
+        s->file = qemu_fopen_ops(s, &socket_read_ops);
+    } else {
+        s->file = qemu_fopen_ops(s, &socket_write_ops);
+    }
     return s->file;
 }
 
@@ -398,6 +444,22 @@ static int block_put_buffer(void *opaque, const uint8_t *buf,
     return size;
 }
 
+/* RAM pages queued with qemu_put_buffer_async() go to the image as they are,
+ * without being copied into the QEMUFile buffer first */
+static int block_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                               int64_t pos)
+{
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, iov, iovcnt);
+    ret = bdrv_writev_vmstate(opaque, &qiov, pos);
+    if (ret < 0) {
+        return ret;
+    }
+    return qiov.size;
+}
+
 static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
     return bdrv_load_vmstate(opaque, buf, pos, size);
@@ -414,8 +476,9 @@ static const QEMUFileOps bdrv_read_ops = {
 };
 
 static const QEMUFileOps bdrv_write_ops = {
-    .put_buffer = block_put_buffer,
-    .close =      bdrv_fclose
+    .put_buffer =    block_put_buffer,
+    .writev_buffer = block_writev_buffer,
+    .close =         bdrv_fclose
 };
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
@@ -425,6 +488,42 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
 
+/* In-memory files, for device state that is sent in one piece */
+static int mem_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    g_byte_array_append(opaque, buf, size);
+    return size;
+}
+
+static int mem_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    GByteArray *mem = opaque;
+
+    if (pos >= mem->len) {
+        return 0;
+    }
+    size = MIN(size, mem->len - pos);
+    memcpy(buf, mem->data + pos, size);
+    return size;
+}
+
+static int mem_fclose(void *opaque)
+{
+    g_byte_array_free(opaque, true);
+    return 0;
+}
+
+static const QEMUFileOps mem_read_ops = {
+    .get_buffer = mem_get_buffer,
+    .close =      mem_fclose
+};
+
+static const QEMUFileOps mem_write_ops = {
+    .put_buffer = mem_put_buffer,
+    .close =      mem_fclose
+};
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 {
     QEMUFile *f;
@@ -443,7 +542,7 @@ int qemu_file_get_error(QEMUFile *f)
     return f->last_error;
 }
 
-static void qemu_file_set_error(QEMUFile *f, int ret)
+void qemu_file_set_error(QEMUFile *f, int ret)
 {
     if (f->last_error == 0) {
         f->last_error = ret;
@@ -452,11 +551,28 @@ static void qemu_file_set_error(QEMUFile *f, int ret)
 
 /** Flushes QEMUFile buffer
  *
+ * This also finishes with the buffers passed to qemu_put_buffer_async().
+ * Errors are recorded in the file as well as returned.
  */
-static int qemu_fflush(QEMUFile *f)
+int qemu_fflush(QEMUFile *f)
 {
     int ret = 0;
 
+    if (f->ops->writev_buffer) {
+        if (f->is_write && f->iovcnt > 0) {
+            ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                        f->buf_offset);
+            if (ret >= 0) {
+                f->buf_offset += ret;
+            } else {
+                qemu_file_set_error(f, ret);
+            }
+        }
+        f->buf_index = 0;
+        f->iovcnt = 0;
+        return ret;
+    }
+
     if (!f->ops->put_buffer)
         return 0;
 
@@ -470,6 +586,27 @@ static int qemu_fflush(QEMUFile *f)
     return ret;
 }
 
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt ? &f->iov[f->iovcnt - 1] : NULL;
+
+    /* coalesce with the previous piece if it is adjacent */
+    if (last && buf == (uint8_t *)last->iov_base + last->iov_len) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt++].iov_len = size;
+    }
+
+    f->is_write = 1;
+    if (f->iovcnt >= MAX_IOV_SIZE) {
+        int ret = qemu_fflush(f);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+}
+
 static void qemu_fill_buffer(QEMUFile *f)
 {
     int len;
@@ -557,6 +694,9 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         memcpy(f->buf + f->buf_index, buf, l);
         f->is_write = 1;
         f->buf_index += l;
+        if (f->ops->writev_buffer) {
+            add_to_iovec(f, f->buf + f->buf_index - l, l);
+        }
         buf += l;
         size -= l;
         if (f->buf_index >= IO_BUF_SIZE) {
@@ -583,6 +723,9 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
+    if (f->ops->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index - 1, 1);
+    }
     if (f->buf_index >= IO_BUF_SIZE) {
         int ret = qemu_fflush(f);
         if (ret < 0) {
@@ -591,6 +734,34 @@ void qemu_put_byte(QEMUFile *f, int v)
     }
 }
 
+/* Like qemu_put_buffer(), but @buf is not copied if the file supports
+ * vectored writes.  It must stay valid until the next qemu_fflush(), which
+ * happens at the latest when the file is closed.  If its contents change in
+ * the meanwhile the new data may be sent, so use this for guest RAM only
+ * when the dirty log will cause a changed page to be sent again.
+ */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->ops->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (f->last_error) {
+        return;
+    }
+
+    if (f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    if (size > 0) {
+        add_to_iovec(f, buf, size);
+    }
+}
+
 static void qemu_file_skip(QEMUFile *f, int size)
 {
     if (f->buf_index + size <= f->buf_size) {
@@ -676,7 +847,9 @@ int qemu_get_byte(QEMUFile *f)
 int64_t qemu_ftell(QEMUFile *f)
 {
     /* buf_offset excludes buffer for writing but includes it for reading */
-    if (f->is_write) {
+    if (f->is_write && f->ops->writev_buffer) {
+        return f->buf_offset + iov_size(f->iov, f->iovcnt);
+    } else if (f->is_write) {
         return f->buf_offset + f->buf_index;
     } else {
         return f->buf_offset - f->buf_size + f->buf_index;
@@ -1203,6 +1376,8 @@ typedef struct SaveStateEntry {
     CompatEntry *compat;
     int no_migrate;
     int is_ram;
+    /* the device data of the last full xen-save-devices-state */
+    GByteArray *saved_state;
 } SaveStateEntry;
 
 
@@ -1329,6 +1504,9 @@ void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
             if (se->compat) {
                 g_free(se->compat);
             }
+            if (se->saved_state) {
+                g_byte_array_free(se->saved_state, true);
+            }
             g_free(se->ops);
             g_free(se);
         }
@@ -1398,6 +1576,9 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
             if (se->compat) {
                 g_free(se->compat);
             }
+            if (se->saved_state) {
+                g_byte_array_free(se->saved_state, true);
+            }
             g_free(se);
         }
     }
@@ -1408,6 +1589,250 @@ static void vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
 static int vmstate_subsection_load(QEMUFile *f, const VMStateDescription *vmsd,
                                    void *opaque);
 
+static void *vmstate_base_addr(const VMStateField *field, void *opaque,
+                               int *n_elems, int *size)
+{
+    void *base_addr = opaque + field->offset;
+
+    *n_elems = 1;
+    *size = field->size;
+    if (field->flags & VMS_VBUFFER) {
+        *size = *(int32_t *)(opaque+field->size_offset);
+        if (field->flags & VMS_MULTIPLY) {
+            *size *= field->size;
+        }
+    }
+    if (field->flags & VMS_ARRAY) {
+        *n_elems = field->num;
+    } else if (field->flags & VMS_VARRAY_INT32) {
+        *n_elems = *(int32_t *)(opaque+field->num_offset);
+    } else if (field->flags & VMS_VARRAY_UINT32) {
+        *n_elems = *(uint32_t *)(opaque+field->num_offset);
+    } else if (field->flags & VMS_VARRAY_UINT16) {
+        *n_elems = *(uint16_t *)(opaque+field->num_offset);
+    } else if (field->flags & VMS_VARRAY_UINT8) {
+        *n_elems = *(uint8_t *)(opaque+field->num_offset);
+    }
+    if (field->flags & VMS_POINTER) {
+        base_addr = *(void **)base_addr + field->start;
+    }
+    return base_addr;
+}
+
+static int vmstate_load_field(QEMUFile *f, const VMStateField *field,
+                              void *opaque, int version_id)
+{
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        int i, n_elems, size, ret;
+        void *base_addr = vmstate_base_addr(field, opaque, &n_elems, &size);
+
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, addr, field->vmsd->version_id);
+            } else {
+                ret = field->info->get(f, addr, size);
+
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+static void vmstate_save_field(QEMUFile *f, const VMStateField *field,
+                               void *opaque, int version_id)
+{
+    if (!field->field_exists ||
+        field->field_exists(opaque, version_id)) {
+        int i, n_elems, size;
+        void *base_addr = vmstate_base_addr(field, opaque, &n_elems, &size);
+
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                vmstate_save_state(f, field->vmsd, addr);
+            } else {
+                field->info->put(f, addr, size);
+            }
+        }
+    }
+}
+
+/*
+ * The fields of a VMStateDescription are compiled into a plan the first
+ * time the description is saved or loaded.  Runs of plain integers and
+ * buffers that are adjacent both in the device state and in the stream
+ * become a single bulk step, copied with qemu_put_buffer() and
+ * qemu_get_buffer() and byte swapped only on little endian hosts.  All
+ * other fields are steps of their own and go through the VMStateInfo as
+ * before.  The plan only describes the current version of the section,
+ * older versions are loaded field by field.
+ *
+ * Descriptions are static, so plans are never freed.
+ */
+
+#define VMSTATE_BULK_CHUNK  512
+
+typedef struct VMStateStep {
+    const VMStateField *field;  /* first field of the step */
+    size_t offset;              /* bulk steps only: bytes at opaque+offset */
+    size_t len;                 /* 0 for a single field */
+    int elem_size;              /* size of each big endian value */
+} VMStateStep;
+
+typedef struct VMStatePlan {
+    int nb_steps;
+    VMStateStep steps[];
+} VMStatePlan;
+
+static GHashTable *vmstate_plans;
+
+/* Size of the values of a field that can be copied in bulk, else 0 */
+static int vmstate_bulk_elem_size(const VMStateDescription *vmsd,
+                                  const VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+    int elem_size;
+
+    if (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER) ||
+        field->field_exists || field->version_id > vmsd->version_id) {
+        return 0;
+    }
+    if (info == &vmstate_info_buffer) {
+        return 1;
+    }
+    if (info == &vmstate_info_bool || info == &vmstate_info_int8 ||
+        info == &vmstate_info_uint8) {
+        elem_size = 1;
+    } else if (info == &vmstate_info_int16 || info == &vmstate_info_uint16) {
+        elem_size = 2;
+    } else if (info == &vmstate_info_int32 || info == &vmstate_info_uint32) {
+        elem_size = 4;
+    } else if (info == &vmstate_info_int64 || info == &vmstate_info_uint64) {
+        elem_size = 8;
+    } else {
+        return 0;
+    }
+    return field->size == elem_size ? elem_size : 0;
+}
+
+static VMStatePlan *vmstate_compile_plan(const VMStateDescription *vmsd)
+{
+    const VMStateField *field;
+    VMStatePlan *plan;
+    VMStateStep *step = NULL;
+    int nb_fields = 0, nb_bulk = 0;
+
+    for (field = vmsd->fields; field->name; field++) {
+        nb_fields++;
+    }
+    plan = g_malloc0(sizeof(*plan) + nb_fields * sizeof(plan->steps[0]));
+
+    for (field = vmsd->fields; field->name; field++) {
+        int elem_size = vmstate_bulk_elem_size(vmsd, field);
+        size_t len = field->size * (field->flags & VMS_ARRAY ? field->num : 1);
+
+        if (elem_size && step && step->len && step->elem_size == elem_size &&
+            step->offset + step->len == field->offset) {
+            step->len += len;
+            continue;
+        }
+        step = &plan->steps[plan->nb_steps++];
+        step->field = field;
+        if (elem_size && len) {
+            step->offset = field->offset;
+            step->len = len;
+            step->elem_size = elem_size;
+            nb_bulk++;
+        }
+    }
+    trace_vmstate_compile_plan(vmsd->name, nb_fields, plan->nb_steps, nb_bulk);
+    return plan;
+}
+
+static VMStatePlan *vmstate_get_plan(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan;
+
+    if (!vmstate_plans) {
+        vmstate_plans = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    plan = g_hash_table_lookup(vmstate_plans, vmsd);
+    if (!plan) {
+        plan = vmstate_compile_plan(vmsd);
+        g_hash_table_insert(vmstate_plans, (gpointer)vmsd, plan);
+    }
+    return plan;
+}
+
+static void vmstate_bswap_bulk(uint8_t *buf, size_t len, int elem_size)
+{
+    size_t i;
+
+    switch (elem_size) {
+    case 2:
+        for (i = 0; i < len; i += 2) {
+            bswap16s((uint16_t *)(buf + i));
+        }
+        break;
+    case 4:
+        for (i = 0; i < len; i += 4) {
+            bswap32s((uint32_t *)(buf + i));
+        }
+        break;
+    case 8:
+        for (i = 0; i < len; i += 8) {
+            bswap64s((uint64_t *)(buf + i));
+        }
+        break;
+    }
+}
+
+static void vmstate_put_bulk(QEMUFile *f, const uint8_t *buf, size_t len,
+                             int elem_size)
+{
+#ifndef HOST_WORDS_BIGENDIAN
+    if (elem_size > 1) {
+        uint8_t tmp[VMSTATE_BULK_CHUNK];
+
+        while (len > 0) {
+            size_t l = MIN(len, sizeof(tmp));
+
+            memcpy(tmp, buf, l);
+            vmstate_bswap_bulk(tmp, l, elem_size);
+            qemu_put_buffer(f, tmp, l);
+            buf += l;
+            len -= l;
+        }
+        return;
+    }
+#endif
+    qemu_put_buffer(f, buf, len);
+}
+
+static void vmstate_get_bulk(QEMUFile *f, uint8_t *buf, size_t len,
+                             int elem_size)
+{
+    qemu_get_buffer(f, buf, len);
+#ifndef HOST_WORDS_BIGENDIAN
+    vmstate_bswap_bulk(buf, len, elem_size);
+#endif
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
@@ -1428,53 +1853,31 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
         if (ret)
             return ret;
     }
-    while(field->name) {
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *base_addr = opaque + field->offset;
-            int i, n_elems = 1;
-            int size = field->size;
-
-            if (field->flags & VMS_VBUFFER) {
-                size = *(int32_t *)(opaque+field->size_offset);
-                if (field->flags & VMS_MULTIPLY) {
-                    size *= field->size;
-                }
-            }
-            if (field->flags & VMS_ARRAY) {
-                n_elems = field->num;
-            } else if (field->flags & VMS_VARRAY_INT32) {
-                n_elems = *(int32_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT32) {
-                n_elems = *(uint32_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT16) {
-                n_elems = *(uint16_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT8) {
-                n_elems = *(uint8_t *)(opaque+field->num_offset);
-            }
-            if (field->flags & VMS_POINTER) {
-                base_addr = *(void **)base_addr + field->start;
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
+    if (version_id == vmsd->version_id) {
+        VMStatePlan *plan = vmstate_get_plan(vmsd);
+        int i;
 
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, addr, field->vmsd->version_id);
-                } else {
-                    ret = field->info->get(f, addr, size);
+        for (i = 0; i < plan->nb_steps; i++) {
+            VMStateStep *step = &plan->steps[i];
 
-                }
-                if (ret < 0) {
-                    return ret;
-                }
+            if (step->len) {
+                vmstate_get_bulk(f, opaque + step->offset, step->len,
+                                 step->elem_size);
+                continue;
+            }
+            ret = vmstate_load_field(f, step->field, opaque, version_id);
+            if (ret < 0) {
+                return ret;
             }
         }
-        field++;
+    } else {
+        while (field->name) {
+            ret = vmstate_load_field(f, field, opaque, version_id);
+            if (ret < 0) {
+                return ret;
+            }
+            field++;
+        }
     }
     ret = vmstate_subsection_load(f, vmsd, opaque);
     if (ret != 0) {
@@ -1489,71 +1892,49 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque)
 {
-    VMStateField *field = vmsd->fields;
+    VMStatePlan *plan = vmstate_get_plan(vmsd);
+    int i;
 
     if (vmsd->pre_save) {
         vmsd->pre_save(opaque);
     }
-    while(field->name) {
-        if (!field->field_exists ||
-            field->field_exists(opaque, vmsd->version_id)) {
-            void *base_addr = opaque + field->offset;
-            int i, n_elems = 1;
-            int size = field->size;
-
-            if (field->flags & VMS_VBUFFER) {
-                size = *(int32_t *)(opaque+field->size_offset);
-                if (field->flags & VMS_MULTIPLY) {
-                    size *= field->size;
-                }
-            }
-            if (field->flags & VMS_ARRAY) {
-                n_elems = field->num;
-            } else if (field->flags & VMS_VARRAY_INT32) {
-                n_elems = *(int32_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT32) {
-                n_elems = *(uint32_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT16) {
-                n_elems = *(uint16_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT8) {
-                n_elems = *(uint8_t *)(opaque+field->num_offset);
-            }
-            if (field->flags & VMS_POINTER) {
-                base_addr = *(void **)base_addr + field->start;
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
+    for (i = 0; i < plan->nb_steps; i++) {
+        VMStateStep *step = &plan->steps[i];
 
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    vmstate_save_state(f, field->vmsd, addr);
-                } else {
-                    field->info->put(f, addr, size);
-                }
-            }
+        if (step->len) {
+            vmstate_put_bulk(f, opaque + step->offset, step->len,
+                             step->elem_size);
+        } else {
+            vmstate_save_field(f, step->field, opaque, vmsd->version_id);
         }
-        field++;
     }
     vmstate_subsection_save(f, vmsd, opaque);
 }
 
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se, int version_id)
 {
+    int64_t start = get_clock();
+    int ret;
+
     if (!se->vmsd) {         /* Old style */
-        return se->ops->load_state(f, se->opaque, version_id);
+        ret = se->ops->load_state(f, se->opaque, version_id);
+    } else {
+        ret = vmstate_load_state(f, se->vmsd, se->opaque, version_id);
     }
-    return vmstate_load_state(f, se->vmsd, se->opaque, version_id);
+    trace_vmstate_load_device(se->idstr, se->instance_id, get_clock() - start);
+    return ret;
 }
 
 static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 {
+    int64_t start = get_clock();
+
     if (!se->vmsd) {         /* Old style */
         se->ops->save_state(f, se->opaque);
-        return;
+    } else {
+        vmstate_save_state(f,se->vmsd, se->opaque);
     }
-    vmstate_save_state(f,se->vmsd, se->opaque);
+    trace_vmstate_save_device(se->idstr, se->instance_id, get_clock() - start);
 }
 
 #define QEMU_VM_FILE_MAGIC           0x5145564d
@@ -1566,6 +1947,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY             0x06
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1580,12 +1962,22 @@ bool qemu_savevm_state_blocked(Error **errp)
     return false;
 }
 
+static NotifierList savevm_begin_notifiers =
+    NOTIFIER_LIST_INITIALIZER(savevm_begin_notifiers);
+
+void qemu_add_savevm_begin_notifier(Notifier *notify)
+{
+    notifier_list_add(&savevm_begin_notifiers, notify);
+}
+
 int qemu_savevm_state_begin(QEMUFile *f,
                             const MigrationParams *params)
 {
     SaveStateEntry *se;
     int ret;
 
+    notifier_list_notify(&savevm_begin_notifiers, NULL);
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->set_params) {
             continue;
@@ -1683,17 +2075,19 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-int qemu_savevm_state_complete(QEMUFile *f)
+/* With @postcopy, sections that go on after the switch are left out */
+static int savevm_state_complete(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
         }
+        if (postcopy && se->ops->save_live_postcopy) {
+            continue;
+        }
         if (se->ops && se->ops->is_active) {
             if (!se->ops->is_active(se->opaque)) {
                 continue;
@@ -1739,6 +2133,63 @@ int qemu_savevm_state_complete(QEMUFile *f)
     return qemu_file_get_error(f);
 }
 
+int qemu_savevm_state_complete(QEMUFile *f)
+{
+    cpu_synchronize_all_states();
+
+    return savevm_state_complete(f, false);
+}
+
+/*
+ * Switch to post-copy: sections that can go on once the guest runs on the
+ * destination end here, and the device state follows as one
+ * QEMU_VM_POSTCOPY blob.  The destination loads the blob while it already
+ * serves page faults, since loading devices may touch guest RAM.
+ */
+int qemu_savevm_state_postcopy(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    GByteArray *mem;
+    QEMUFile *mf;
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_live_postcopy) {
+            continue;
+        }
+        if (se->ops->is_active && !se->ops->is_active(se->opaque)) {
+            continue;
+        }
+        trace_savevm_section_start();
+        qemu_put_byte(f, QEMU_VM_SECTION_END);
+        qemu_put_be32(f, se->section_id);
+
+        ret = se->ops->save_live_postcopy(f, se->opaque);
+        trace_savevm_section_end(se->section_id);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    mem = g_byte_array_new();
+    mf = qemu_fopen_ops(mem, &mem_write_ops);
+    ret = savevm_state_complete(mf, true);
+    if (ret == 0) {
+        ret = qemu_fflush(mf);
+    }
+    if (ret >= 0) {
+        qemu_put_byte(f, QEMU_VM_POSTCOPY);
+        qemu_put_be32(f, mem->len);
+        qemu_put_buffer(f, mem->data, mem->len);
+        ret = qemu_file_get_error(f);
+    }
+    qemu_fclose(mf);
+
+    return ret;
+}
+
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
 {
     SaveStateEntry *se;
@@ -1802,9 +2253,21 @@ out:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+/* Whether every section has its data of a full save to compare with */
+static bool device_state_saved;
+
+/*
+ * Save the state of all devices but RAM.  An incremental save only writes
+ * the sections whose data differ from the last full save, so that it is
+ * loaded on top of that.  Each section is put together in memory first,
+ * which is small enough for device state, to compare it.
+ */
+static int qemu_save_device_state(QEMUFile *f, bool incremental,
+                                  XenSaveDevicesInfo *info)
 {
     SaveStateEntry *se;
+    GByteArray *mem;
+    QEMUFile *mf;
 
     qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
@@ -1820,6 +2283,25 @@ static int qemu_save_device_state(QEMUFile *f)
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
+        info->sections++;
+
+        mem = g_byte_array_new();
+        mf = qemu_fopen_ops(mem, &mem_write_ops);
+        vmstate_save(mf, se);
+        qemu_fflush(mf);
+
+        if (!incremental) {
+            if (se->saved_state) {
+                g_byte_array_free(se->saved_state, true);
+            }
+            se->saved_state = g_byte_array_sized_new(mem->len);
+            g_byte_array_append(se->saved_state, mem->data, mem->len);
+        } else if (se->saved_state && se->saved_state->len == mem->len &&
+                   !memcmp(se->saved_state->data, mem->data, mem->len)) {
+            qemu_fclose(mf);
+            continue;
+        }
+        info->sections_saved++;
 
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_FULL);
@@ -1833,11 +2315,15 @@ static int qemu_save_device_state(QEMUFile *f)
         qemu_put_be32(f, se->instance_id);
         qemu_put_be32(f, se->version_id);
 
-        vmstate_save(f, se);
+        qemu_put_buffer(f, mem->data, mem->len);
+        qemu_fclose(mf);
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
+    if (!incremental && !qemu_file_get_error(f)) {
+        device_state_saved = true;
+    }
     return qemu_file_get_error(f);
 }
 
@@ -1941,12 +2427,47 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntryList;
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntryList *loadvm_handlers);
+
+/* The device state after the switch to post-copy, see
+ * qemu_savevm_state_postcopy().  The rest of @f is the page stream.
+ */
+static int qemu_loadvm_postcopy(QEMUFile *f,
+                                LoadStateEntryList *loadvm_handlers)
+{
+    GByteArray *mem;
+    QEMUFile *mf;
+    uint32_t size;
+    int ret;
+
+    size = qemu_get_be32(f);
+    mem = g_byte_array_sized_new(size);
+    g_byte_array_set_size(mem, size);
+    if (qemu_get_buffer(f, mem->data, size) != size) {
+        g_byte_array_free(mem, true);
+        return -EIO;
+    }
+
+    ret = postcopy_incoming_start(f);
+    if (ret < 0) {
+        g_byte_array_free(mem, true);
+        return ret;
+    }
+
+    mf = qemu_fopen_ops(mem, &mem_read_ops);
+    ret = qemu_loadvm_state_main(mf, loadvm_handlers);
+    qemu_fclose(mf);
+    return ret;
+}
+
 int qemu_loadvm_state(QEMUFile *f)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
+    LoadStateEntryList loadvm_handlers =
         QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
     unsigned int v;
     int ret;
 
@@ -1966,6 +2487,26 @@ int qemu_loadvm_state(QEMUFile *f)
     if (v != QEMU_VM_FILE_VERSION)
         return -ENOTSUP;
 
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret == 0) {
+        cpu_synchronize_all_post_init();
+    }
+
+    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+
+    return ret;
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntryList *loadvm_handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
+
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
@@ -1987,16 +2528,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -2005,59 +2544,46 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(loadvm_handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY:
+            /* nothing follows the device state on this level */
+            return qemu_loadvm_postcopy(f, loadvm_handlers);
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
-
-    ret = 0;
-
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
-    }
-
-    if (ret == 0) {
-        ret = qemu_file_get_error(f);
-    }
-
-    return ret;
+    return qemu_file_get_error(f);
 }
 
 static int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
@@ -2206,12 +2732,22 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         vm_start();
 }
 
-void qmp_xen_save_devices_state(const char *filename, Error **errp)
+XenSaveDevicesInfo *qmp_xen_save_devices_state_stats(const char *filename,
+                                                     bool has_incremental,
+                                                     bool incremental,
+                                                     Error **errp)
 {
+    XenSaveDevicesInfo *info = NULL;
+    int64_t start_time;
     QEMUFile *f;
     int saved_vm_running;
     int ret;
 
+    if (has_incremental && incremental && !device_state_saved) {
+        error_setg(errp, "No full save of the device state to compare with");
+        return NULL;
+    }
+
     saved_vm_running = runstate_is_running();
     vm_stop(RUN_STATE_SAVE_VM);
 
@@ -2220,11 +2756,63 @@ void qmp_xen_save_devices_state(const char *filename, Error **errp)
         error_set(errp, QERR_OPEN_FILE_FAILED, filename);
         goto the_end;
     }
-    ret = qemu_save_device_state(f);
+    info = g_malloc0(sizeof(*info));
+    start_time = qemu_get_clock_ns(rt_clock);
+    ret = qemu_save_device_state(f, has_incremental && incremental, info);
+    info->bytes = qemu_ftell(f);
+    if (qemu_fclose(f) < 0 && ret == 0) {
+        ret = -EIO;
+    }
+    info->save_time = (qemu_get_clock_ns(rt_clock) - start_time) / 1000;
+    if (ret < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        qapi_free_XenSaveDevicesInfo(info);
+        info = NULL;
+    }
+
+ the_end:
+    if (saved_vm_running)
+        vm_start();
+    return info;
+}
+
+void qmp_xen_save_devices_state(const char *filename, Error **errp)
+{
+    qapi_free_XenSaveDevicesInfo(
+        qmp_xen_save_devices_state_stats(filename, false, false, errp));
+}
+
+static int load_device_state_file(const char *filename, Error **errp)
+{
+    QEMUFile *f;
+    int ret;
+
+    f = qemu_fopen(filename, "rb");
+    if (!f) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, filename);
+        return -ENOENT;
+    }
+    ret = qemu_loadvm_state(f);
     qemu_fclose(f);
     if (ret < 0) {
         error_set(errp, QERR_IO_ERROR);
     }
+    return ret;
+}
+
+void qmp_xen_load_devices_state(const char *filename, bool has_base,
+                                const char *base, Error **errp)
+{
+    int saved_vm_running;
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_RESTORE_VM);
+
+    /* an incremental save only has the sections that changed */
+    if (has_base && load_device_state_file(base, errp) < 0) {
+        goto the_end;
+    }
+    load_device_state_file(filename, errp);
 
  the_end:
     if (saved_vm_running)
@@ -174,6 +174,7 @@ icmp_input(struct mbuf *m, int hlen)
       so->so_fport = htons(7);
       so->so_laddr = ip->ip_src;
       so->so_lport = htons(9);
+      sohash_insert(&slirp->udb_hash, so);
       so->so_iptos = ip->ip_tos;
       so->so_type = IPPROTO_ICMP;
       so->so_state = SS_ISFCONNECTED;
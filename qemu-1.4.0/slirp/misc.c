@@ -253,6 +253,25 @@ void lprint(const char *format, ...)
     va_end(args);
 }
 
+static void sohash_info(Monitor *mon, const char *name, struct sohash *h)
+{
+    u_int i, len, used = 0, longest = 0;
+    struct socket *so;
+
+    for (i = 0; i < SO_HASH_SIZE; i++) {
+        len = 0;
+        for (so = h->chain[i]; so; so = so->so_hnext) {
+            len++;
+        }
+        used += len != 0;
+        longest = MAX(longest, len);
+    }
+    monitor_printf(mon, "  %s lookup: %u sockets in %u/%u chains, longest %u, "
+                   "%.2f compares per lookup\n", name, h->nsockets, used,
+                   SO_HASH_SIZE, longest,
+                   h->lookups ? (double)h->compares / h->lookups : 0.0);
+}
+
 void slirp_connection_info(Slirp *slirp, Monitor *mon)
 {
     const char * const tcpstates[] = {
@@ -340,4 +359,7 @@ void slirp_connection_info(Slirp *slirp, Monitor *mon)
         monitor_printf(mon, "%15s  -    %5d %5d\n", inet_ntoa(dst_addr),
                        so->so_rcv.sb_cc, so->so_snd.sb_cc);
     }
+
+    sohash_info(mon, "TCP", &slirp->tcb_hash);
+    sohash_info(mon, "UDP", &slirp->udb_hash);
 }
@@ -40,7 +40,6 @@ static const uint8_t special_ethaddr[ETH_ALEN] = {
 static const uint8_t zero_ethaddr[ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
 
 /* XXX: suppress those select globals */
-fd_set *global_readfds, *global_writefds, *global_xfds;
 
 u_int curtime;
 static u_int time_fasttimo, last_slowtimo;
@@ -261,7 +260,6 @@ void slirp_cleanup(Slirp *slirp)
 
 #define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
-#define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
 
 void slirp_update_timeout(uint32_t *timeout)
 {
@@ -270,23 +268,15 @@ void slirp_update_timeout(uint32_t *timeout)
     }
 }
 
-void slirp_select_fill(int *pnfds,
-                       fd_set *readfds, fd_set *writefds, fd_set *xfds)
+void slirp_pollfds_fill(GArray *pollfds)
 {
     Slirp *slirp;
     struct socket *so, *so_next;
-    int nfds;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
     }
 
-    /* fail safe */
-    global_readfds = NULL;
-    global_writefds = NULL;
-    global_xfds = NULL;
-
-    nfds = *pnfds;
 	/*
 	 * First, TCP sockets
 	 */
@@ -302,8 +292,12 @@ void slirp_select_fill(int *pnfds,
 
 		for (so = slirp->tcb.so_next; so != &slirp->tcb;
 		     so = so_next) {
+			int events = 0;
+
 			so_next = so->so_next;
 
+			so->pollfds_idx = -1;
+
 			/*
 			 * See if we need a tcp_fasttimo
 			 */
@@ -321,8 +315,12 @@ void slirp_select_fill(int *pnfds,
 			 * Set for reading sockets which are accepting
 			 */
 			if (so->so_state & SS_FACCEPTCONN) {
-                                FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
+				GPollFD pfd = {
+					.fd = so->s,
+					.events = G_IO_IN | G_IO_HUP | G_IO_ERR,
+				};
+				so->pollfds_idx = pollfds->len;
+				g_array_append_val(pollfds, pfd);
 				continue;
 			}
 
@@ -330,8 +328,12 @@ void slirp_select_fill(int *pnfds,
 			 * Set for writing sockets which are connecting
 			 */
 			if (so->so_state & SS_ISFCONNECTING) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
+				GPollFD pfd = {
+					.fd = so->s,
+					.events = G_IO_OUT | G_IO_ERR,
+				};
+				so->pollfds_idx = pollfds->len;
+				g_array_append_val(pollfds, pfd);
 				continue;
 			}
 
@@ -340,8 +342,7 @@ void slirp_select_fill(int *pnfds,
 			 * we have something to send
 			 */
 			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
+				events |= G_IO_OUT | G_IO_ERR;
 			}
 
 			/*
@@ -349,9 +350,16 @@ void slirp_select_fill(int *pnfds,
 			 * receive more, and we have room for it XXX /2 ?
 			 */
 			if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-				FD_SET(so->s, readfds);
-				FD_SET(so->s, xfds);
-				UPD_NFDS(so->s);
+				events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+			}
+
+			if (events) {
+				GPollFD pfd = {
+					.fd = so->s,
+					.events = events,
+				};
+				so->pollfds_idx = pollfds->len;
+				g_array_append_val(pollfds, pfd);
 			}
 		}
 
@@ -362,6 +370,8 @@ void slirp_select_fill(int *pnfds,
 		     so = so_next) {
 			so_next = so->so_next;
 
+			so->pollfds_idx = -1;
+
 			/*
 			 * See if it's timed out
 			 */
@@ -384,8 +394,12 @@ void slirp_select_fill(int *pnfds,
 			 * (XXX <= 4 ?)
 			 */
 			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-				FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
+				GPollFD pfd = {
+					.fd = so->s,
+					.events = G_IO_IN | G_IO_HUP | G_IO_ERR,
+				};
+				so->pollfds_idx = pollfds->len;
+				g_array_append_val(pollfds, pfd);
 			}
 		}
 
@@ -396,6 +410,8 @@ void slirp_select_fill(int *pnfds,
                      so = so_next) {
                     so_next = so->so_next;
 
+                    so->pollfds_idx = -1;
+
                     /*
                      * See if it's timed out
                      */
@@ -409,17 +425,18 @@ void slirp_select_fill(int *pnfds,
                     }
 
                     if (so->so_state & SS_ISFCONNECTED) {
-                        FD_SET(so->s, readfds);
-                        UPD_NFDS(so->s);
+                        GPollFD pfd = {
+                            .fd = so->s,
+                            .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
+                        };
+                        so->pollfds_idx = pollfds->len;
+                        g_array_append_val(pollfds, pfd);
                     }
                 }
 	}
-
-        *pnfds = nfds;
 }
 
-void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
-                       int select_error)
+void slirp_pollfds_poll(GArray *pollfds, int select_error)
 {
     Slirp *slirp;
     struct socket *so, *so_next;
@@ -429,10 +446,6 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
         return;
     }
 
-    global_readfds = readfds;
-    global_writefds = writefds;
-    global_xfds = xfds;
-
     curtime = qemu_get_clock_ms(rt_clock);
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
@@ -458,26 +471,30 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 		 */
 		for (so = slirp->tcb.so_next; so != &slirp->tcb;
 		     so = so_next) {
+			int revents;
+
 			so_next = so->so_next;
 
-			/*
-			 * FD_ISSET is meaningless on these sockets
-			 * (and they can crash the program)
-			 */
+			revents = 0;
+			if (so->pollfds_idx != -1) {
+				revents = g_array_index(pollfds, GPollFD,
+							so->pollfds_idx).revents;
+			}
+
 			if (so->so_state & SS_NOFDREF || so->s == -1)
 			   continue;
 
 			/*
 			 * Check for URG data
 			 * This will soread as well, so no need to
-			 * test for readfds below if this succeeds
+			 * test for G_IO_IN below if this succeeds
 			 */
-			if (FD_ISSET(so->s, xfds))
+			if (revents & G_IO_PRI)
 			   sorecvoob(so);
 			/*
 			 * Check sockets for reading
 			 */
-			else if (FD_ISSET(so->s, readfds)) {
+			else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
 				/*
 				 * Check for incoming connections
 				 */
@@ -495,7 +512,8 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 			/*
 			 * Check sockets for writing
 			 */
-			if (FD_ISSET(so->s, writefds)) {
+			if (!(so->so_state & SS_NOFDREF) &&
+			    (revents & (G_IO_OUT | G_IO_ERR))) {
 			  /*
 			   * Check for non-blocking, still-connecting sockets
 			   */
@@ -578,9 +596,15 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 		     so = so_next) {
 			so_next = so->so_next;
 
-			if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                            sorecvfrom(so);
-                        }
+			if (so->pollfds_idx != -1) {
+				int revents = g_array_index(pollfds, GPollFD,
+							    so->pollfds_idx).revents;
+
+				if (so->s != -1 &&
+				    (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+					sorecvfrom(so);
+				}
+			}
 		}
 
                 /*
@@ -590,23 +614,20 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
                      so = so_next) {
                      so_next = so->so_next;
 
-                    if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                        icmp_receive(so);
+                    if (so->pollfds_idx != -1) {
+                        int revents = g_array_index(pollfds, GPollFD,
+                                                    so->pollfds_idx).revents;
+
+                        if (so->s != -1 &&
+                            (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+                            icmp_receive(so);
+                        }
                     }
                 }
 	}
 
         if_start(slirp);
     }
-
-	/* clear global file descriptor sets.
-	 * these reside on the stack in vl.c
-	 * so they're unusable if we're not in
-	 * slirp_select_fill or slirp_select_poll.
-	 */
-	 global_readfds = NULL;
-	 global_writefds = NULL;
-	 global_xfds = NULL;
 }
 
 static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
@@ -1071,6 +1092,7 @@ static int slirp_socket_load(QEMUFile *f, struct socket *so)
     so->so_laddr.s_addr = qemu_get_be32(f);
     so->so_fport = qemu_get_be16(f);
     so->so_lport = qemu_get_be16(f);
+    sohash_insert(&so->slirp->tcb_hash, so);
     so->so_iptos = qemu_get_byte(f);
     so->so_emu = qemu_get_byte(f);
     so->so_type = qemu_get_byte(f);
@@ -15,24 +15,72 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+static u_int
+sohash_bucket(struct sohash *h, struct in_addr laddr, u_int lport,
+              struct in_addr faddr, u_int fport)
+{
+    uint32_t hash = laddr.s_addr ^ (lport << 16);
+
+    if (!h->local_only) {
+        hash ^= faddr.s_addr * 0x9e3779b1 ^ fport;
+    }
+    return (hash * 0x9e3779b1) >> (32 - SO_HASH_BITS);
+}
+
 struct socket *
-solookup(struct socket *head, struct in_addr laddr, u_int lport,
+solookup(struct sohash *h, struct in_addr laddr, u_int lport,
          struct in_addr faddr, u_int fport)
 {
-	struct socket *so;
-
-	for (so = head->so_next; so != head; so = so->so_next) {
-		if (so->so_lport == lport &&
-		    so->so_laddr.s_addr == laddr.s_addr &&
-		    so->so_faddr.s_addr == faddr.s_addr &&
-		    so->so_fport == fport)
-		   break;
-	}
+    struct socket *so;
+
+    h->lookups++;
+    for (so = h->chain[sohash_bucket(h, laddr, lport, faddr, fport)];
+         so; so = so->so_hnext) {
+        h->compares++;
+        if (so->so_lport == lport &&
+            so->so_laddr.s_addr == laddr.s_addr &&
+            (h->local_only ||
+             (so->so_faddr.s_addr == faddr.s_addr &&
+              so->so_fport == fport))) {
+            break;
+        }
+    }
+    return so;
+}
 
-	if (so == head)
-	   return (struct socket *)NULL;
-	return so;
+/*
+ * File so in h under its current addresses; call it again whenever
+ * they change
+ */
+void
+sohash_insert(struct sohash *h, struct socket *so)
+{
+    sohash_remove(so);
+
+    so->so_hbucket = sohash_bucket(h, so->so_laddr, so->so_lport,
+                                   so->so_faddr, so->so_fport);
+    so->so_hnext = h->chain[so->so_hbucket];
+    h->chain[so->so_hbucket] = so;
+    so->so_hash = h;
+    h->nsockets++;
+}
 
+void
+sohash_remove(struct socket *so)
+{
+    struct sohash *h = so->so_hash;
+    struct socket **pso;
+
+    if (!h) {
+        return;
+    }
+    for (pso = &h->chain[so->so_hbucket]; *pso != so;
+         pso = &(*pso)->so_hnext) {
+        /* nothing */
+    }
+    *pso = so->so_hnext;
+    so->so_hash = NULL;
+    h->nsockets--;
 }
 
 /*
@@ -51,6 +99,7 @@ socreate(Slirp *slirp)
     so->so_state = SS_NOFDREF;
     so->s = -1;
     so->slirp = slirp;
+    so->pollfds_idx = -1;
   }
   return(so);
 }
@@ -67,11 +116,8 @@ sofree(struct socket *so)
 	sofree(so->extra);
 	so->extra=NULL;
   }
-  if (so == slirp->tcp_last_so) {
-      slirp->tcp_last_so = &slirp->tcb;
-  } else if (so == slirp->udp_last_so) {
-      slirp->udp_last_so = &slirp->udb;
-  } else if (so == slirp->icmp_last_so) {
+  sohash_remove(so);
+  if (so == slirp->icmp_last_so) {
       slirp->icmp_last_so = &slirp->icmp;
   }
   m_free(so->so_m);
@@ -649,6 +695,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = slirp->vhost_addr;
 	else
 	   so->so_faddr = addr.sin_addr;
+	sohash_insert(&slirp->tcb_hash, so);
 
 	so->s = s;
 	return so;
@@ -680,9 +727,6 @@ sofcantrcvmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
 		shutdown(so->s,0);
-		if(global_writefds) {
-		  FD_CLR(so->s,global_writefds);
-		}
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTSENDMORE) {
@@ -698,12 +742,6 @@ sofcantsendmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
             shutdown(so->s,1);           /* send FIN to fhost */
-            if (global_readfds) {
-                FD_CLR(so->s,global_readfds);
-            }
-            if (global_xfds) {
-                FD_CLR(so->s,global_xfds);
-            }
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTRCVMORE) {
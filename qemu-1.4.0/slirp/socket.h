@@ -11,14 +11,35 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+/*
+ * Sockets are also filed in a hash table, so that incoming segments find
+ * theirs without walking the whole list.  TCP sockets are keyed on all of
+ * laddr/lport/faddr/fport; UDP ones on the guest's end only, since a UDP
+ * socket sends to whatever destination the guest uses.
+ */
+#define SO_HASH_BITS 8
+#define SO_HASH_SIZE (1 << SO_HASH_BITS)
+
+struct sohash {
+  struct socket *chain[SO_HASH_SIZE];
+  bool local_only;		/* key is laddr/lport only */
+  u_int nsockets;
+  uint64_t lookups;		/* statistics for "info usernet" */
+  uint64_t compares;
+};
+
 /*
  * Our socket structure
  */
 
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
+  struct socket *so_hnext;         /* Next in its hash chain */
+  struct sohash *so_hash;          /* Hash table it is filed in, or NULL */
+  u_int so_hbucket;                /* ... and the chain */
 
   int s;                           /* The actual socket */
+  int pollfds_idx;                 /* GPollFD GArray index */
 
   Slirp *slirp;			   /* managing slirp instance */
 
@@ -74,7 +95,9 @@ struct socket {
 #define SS_HOSTFWD		0x1000	/* Socket describes host->guest forwarding */
 #define SS_INCOMING		0x2000	/* Connection was initiated by a host on the internet */
 
-struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
+struct socket * solookup(struct sohash *, struct in_addr, u_int, struct in_addr, u_int);
+void sohash_insert(struct sohash *, struct socket *);
+void sohash_remove(struct socket *);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
 int soread(struct socket *);
@@ -38,8 +38,13 @@ typedef	uint32_t tcp_seq;
 #define      PR_SLOWHZ       2               /* 2 slow timeouts per second (approx) */
 #define      PR_FASTHZ       5               /* 5 fast timeouts per second (not important) */
 
-#define TCP_SNDSPACE 8192
-#define TCP_RCVSPACE 8192
+/*
+ * Socket buffer sizes.  Without window scaling the guest is never offered
+ * more than TCP_MAXWIN, but a larger so_snd lets one readv() pick up what
+ * the host has for several windows' worth of segments.
+ */
+#define TCP_SNDSPACE (128 * 1024)
+#define TCP_RCVSPACE (128 * 1024)
 
 /*
  * TCP header.
@@ -52,7 +52,6 @@ tcp_init(Slirp *slirp)
 {
     slirp->tcp_iss = 1;		/* wrong */
     slirp->tcb.so_next = slirp->tcb.so_prev = &slirp->tcb;
-    slirp->tcp_last_so = &slirp->tcb;
 }
 
 void tcp_cleanup(Slirp *slirp)
@@ -261,9 +260,6 @@ tcp_close(struct tcpcb *tp)
 	}
 	free(tp);
         so->so_tcpcb = NULL;
-	/* clobber input socket cache if we're closing the cached connection */
-	if (so == slirp->tcp_last_so)
-		slirp->tcp_last_so = &slirp->tcb;
 	closesocket(so->s);
 	sbfree(&so->so_rcv);
 	sbfree(&so->so_snd);
@@ -440,6 +436,7 @@ tcp_connect(struct socket *inso)
             (loopback_addr.s_addr & loopback_mask)) {
             so->so_faddr = slirp->vhost_addr;
         }
+	sohash_insert(&slirp->tcb_hash, so);
 
 	/* Close the accept() socket, set right state */
 	if (inso->so_state & SS_FACCEPTONCE) {
@@ -0,0 +1,9 @@
+#include "qemu-common.h"
+#include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
+
+XenBackendInfoList *qmp_query_xen_backends(Error **errp)
+{
+    error_set(errp, QERR_FEATURE_DISABLED, "xen");
+    return NULL;
+}
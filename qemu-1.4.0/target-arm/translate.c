@@ -3522,8 +3522,8 @@ static void gen_nop_hint(DisasContext *s, int val)
 static inline void gen_neon_add(int size, TCGv t0, TCGv t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_add_u8(t0, t0, t1); break;
-    case 1: gen_helper_neon_add_u16(t0, t0, t1); break;
+    case 0: tcg_gen_vec_add8_i32(t0, t0, t1); break;
+    case 1: tcg_gen_vec_add16_i32(t0, t0, t1); break;
     case 2: tcg_gen_add_i32(t0, t0, t1); break;
     default: abort();
     }
@@ -3532,8 +3532,8 @@ static inline void gen_neon_add(int size, TCGv t0, TCGv t1)
 static inline void gen_neon_rsb(int size, TCGv t0, TCGv t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_sub_u8(t0, t1, t0); break;
-    case 1: gen_helper_neon_sub_u16(t0, t1, t0); break;
+    case 0: tcg_gen_vec_sub8_i32(t0, t1, t0); break;
+    case 1: tcg_gen_vec_sub16_i32(t0, t1, t0); break;
     case 2: tcg_gen_sub_i32(t0, t1, t0); break;
     default: return;
     }
@@ -4714,8 +4714,8 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
                 gen_neon_add(size, tmp, tmp2);
             } else { /* VSUB */
                 switch (size) {
-                case 0: gen_helper_neon_sub_u8(tmp, tmp, tmp2); break;
-                case 1: gen_helper_neon_sub_u16(tmp, tmp, tmp2); break;
+                case 0: tcg_gen_vec_sub8_i32(tmp, tmp, tmp2); break;
+                case 1: tcg_gen_vec_sub16_i32(tmp, tmp, tmp2); break;
                 case 2: tcg_gen_sub_i32(tmp, tmp, tmp2); break;
                 default: abort();
                 }
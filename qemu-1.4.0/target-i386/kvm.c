@@ -2234,6 +2234,7 @@ static int kvm_assign_irq_internal(KVMState *s, uint32_t dev_id,
         .flags = irq_type,
     };
 
+    kvm_irqchip_commit_routes(s);
     if (kvm_check_extension(s, KVM_CAP_ASSIGN_DEV_IRQ)) {
         return kvm_vm_ioctl(s, KVM_ASSIGN_DEV_IRQ, &assigned_irq);
     } else {
@@ -2316,6 +2317,7 @@ int kvm_device_msix_set_vector(KVMState *s, uint32_t dev_id, uint32_t vector,
         .entry = vector,
     };
 
+    kvm_irqchip_commit_routes(s);
     return kvm_vm_ioctl(s, KVM_ASSIGN_SET_MSIX_ENTRY, &msix_entry);
 }
 
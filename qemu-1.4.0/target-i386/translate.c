@@ -3169,6 +3169,80 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0x63] = SSE42_OP(pcmpistri),
 };
 
+/* Logical ops and wrapping adds/subs are expanded inline, 64 bits at a
+   time, instead of calling the helper.  Returns false for anything else.  */
+static bool gen_sse_inline(int b, int op1_offset, int op2_offset, int is_xmm)
+{
+    TCGv_i64 t0 = cpu_tmp1_i64;
+    TCGv_i64 t1;
+    int i;
+
+    switch (b) {
+    case 0x54 ... 0x57: /* andps, andnps, orps, xorps */
+    case 0xd4: /* paddq */
+    case 0xdb: /* pand */
+    case 0xdf: /* pandn */
+    case 0xeb: /* por */
+    case 0xef: /* pxor */
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+    case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+        break;
+    default:
+        return false;
+    }
+
+    t1 = tcg_temp_new_i64();
+    for (i = 0; i < (is_xmm ? 2 : 1); i++) {
+        tcg_gen_ld_i64(t0, cpu_env, op1_offset + i * 8);
+        tcg_gen_ld_i64(t1, cpu_env, op2_offset + i * 8);
+        switch (b) {
+        case 0x54:
+        case 0xdb:
+            tcg_gen_and_i64(t0, t0, t1);
+            break;
+        case 0x55:
+        case 0xdf:
+            tcg_gen_andc_i64(t0, t1, t0);
+            break;
+        case 0x56:
+        case 0xeb:
+            tcg_gen_or_i64(t0, t0, t1);
+            break;
+        case 0x57:
+        case 0xef:
+            tcg_gen_xor_i64(t0, t0, t1);
+            break;
+        case 0xfc:
+            tcg_gen_vec_add8_i64(t0, t0, t1);
+            break;
+        case 0xfd:
+            tcg_gen_vec_add16_i64(t0, t0, t1);
+            break;
+        case 0xfe:
+            tcg_gen_vec_add32_i64(t0, t0, t1);
+            break;
+        case 0xd4:
+            tcg_gen_add_i64(t0, t0, t1);
+            break;
+        case 0xf8:
+            tcg_gen_vec_sub8_i64(t0, t0, t1);
+            break;
+        case 0xf9:
+            tcg_gen_vec_sub16_i64(t0, t0, t1);
+            break;
+        case 0xfa:
+            tcg_gen_vec_sub32_i64(t0, t0, t1);
+            break;
+        case 0xfb:
+            tcg_gen_sub_i64(t0, t0, t1);
+            break;
+        }
+        tcg_gen_st_i64(t0, cpu_env, op1_offset + i * 8);
+    }
+    tcg_temp_free_i64(t1);
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4185,6 +4259,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_inline(b, op1_offset, op2_offset, is_xmm)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
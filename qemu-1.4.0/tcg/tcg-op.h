@@ -2312,6 +2312,138 @@ static inline void tcg_gen_movcond_i64(TCGCond cond, TCGv_i64 ret,
 #endif
 }
 
+/* Lane-wise add/sub of integers packed in a 32 or 64 bit value, as used
+   by SIMD instructions.  @m has the most significant bit of each lane
+   set: the low bits of the lanes are added with the MSBs cleared so that
+   no carry crosses into the next lane, and the MSBs are fixed up with a
+   xor afterwards.  For subtraction the MSBs of @a are set instead, which
+   absorbs the borrow.  */
+static inline void tcg_gen_vec_add_mask_i64(TCGv_i64 d, TCGv_i64 a,
+                                            TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t3);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+}
+
+static inline void tcg_gen_vec_sub_mask_i64(TCGv_i64 d, TCGv_i64 a,
+                                            TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t3);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+}
+
+static inline void tcg_gen_vec_add8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(d, a, b, 0x8080808080808080ull);
+}
+
+static inline void tcg_gen_vec_add16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(d, a, b, 0x8000800080008000ull);
+}
+
+static inline void tcg_gen_vec_add32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(d, a, b, 0x8000000080000000ull);
+}
+
+static inline void tcg_gen_vec_sub8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(d, a, b, 0x8080808080808080ull);
+}
+
+static inline void tcg_gen_vec_sub16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(d, a, b, 0x8000800080008000ull);
+}
+
+static inline void tcg_gen_vec_sub32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(d, a, b, 0x8000000080000000ull);
+}
+
+static inline void tcg_gen_vec_add_mask_i32(TCGv_i32 d, TCGv_i32 a,
+                                            TCGv_i32 b, uint32_t m)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    TCGv_i32 t2 = tcg_temp_new_i32();
+    TCGv_i32 t3 = tcg_temp_new_i32();
+
+    tcg_gen_andi_i32(t1, a, ~m);
+    tcg_gen_andi_i32(t2, b, ~m);
+    tcg_gen_xor_i32(t3, a, b);
+    tcg_gen_add_i32(d, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(d, d, t3);
+
+    tcg_temp_free_i32(t3);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t1);
+}
+
+static inline void tcg_gen_vec_sub_mask_i32(TCGv_i32 d, TCGv_i32 a,
+                                            TCGv_i32 b, uint32_t m)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    TCGv_i32 t2 = tcg_temp_new_i32();
+    TCGv_i32 t3 = tcg_temp_new_i32();
+
+    tcg_gen_ori_i32(t1, a, m);
+    tcg_gen_andi_i32(t2, b, ~m);
+    tcg_gen_eqv_i32(t3, a, b);
+    tcg_gen_sub_i32(d, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(d, d, t3);
+
+    tcg_temp_free_i32(t3);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t1);
+}
+
+static inline void tcg_gen_vec_add8_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_add_mask_i32(d, a, b, 0x80808080);
+}
+
+static inline void tcg_gen_vec_add16_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_add_mask_i32(d, a, b, 0x80008000);
+}
+
+static inline void tcg_gen_vec_sub8_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_sub_mask_i32(d, a, b, 0x80808080);
+}
+
+static inline void tcg_gen_vec_sub16_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_sub_mask_i32(d, a, b, 0x80008000);
+}
+
 /***************************************/
 /* QEMU specific operations. Their type depend on the QEMU CPU
    type. */
@@ -1211,6 +1211,159 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* Dead stores to env: a store that a later one in the same basic block
+   overwrites, with nothing reading the field in between, is removed.
+   Walking backwards, the liveness pass keeps the ranges stored to later
+   on; anything that may read env memory it cannot see drops them all. */
+#define TCG_MAX_STORE_RANGES 16
+
+typedef struct TCGStoreRanges {
+    int nb;
+    tcg_target_long start[TCG_MAX_STORE_RANGES];
+    tcg_target_long end[TCG_MAX_STORE_RANGES];
+} TCGStoreRanges;
+
+static void tcg_ds_kill(TCGStoreRanges *r, tcg_target_long start,
+                        tcg_target_long end)
+{
+    int i;
+
+    for (i = 0; i < r->nb; ) {
+        if (r->start[i] < end && start < r->end[i]) {
+            r->nb--;
+            r->start[i] = r->start[r->nb];
+            r->end[i] = r->end[r->nb];
+        } else {
+            i++;
+        }
+    }
+}
+
+static bool tcg_ds_covered(TCGStoreRanges *r, tcg_target_long start,
+                           tcg_target_long end)
+{
+    int i;
+
+    for (i = 0; i < r->nb; i++) {
+        if (r->start[i] <= start && end <= r->end[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool tcg_arg_is_env(TCGContext *s, TCGArg arg)
+{
+    return arg < s->nb_globals && s->temps[arg].fixed_reg &&
+           s->temps[arg].reg == TCG_AREG0;
+}
+
+/* Reading global @arg may load it from env */
+static void tcg_ds_use_global(TCGContext *s, TCGStoreRanges *r, TCGArg arg)
+{
+    TCGTemp *ts;
+
+    if (arg >= s->nb_globals || !r->nb) {
+        return;
+    }
+    ts = &s->temps[arg];
+    if (ts->fixed_reg) {
+        return;
+    }
+    if (ts->mem_reg != TCG_AREG0) {
+        r->nb = 0;
+        return;
+    }
+    tcg_ds_kill(r, ts->mem_offset,
+                ts->mem_offset + (ts->type == TCG_TYPE_I32 ? 4 : 8));
+}
+
+/* Track the env access of load or store @op, if it is one; true if it is a
+   store that can go */
+static bool tcg_ds_access(TCGContext *s, TCGStoreRanges *r, TCGOpcode op,
+                          const TCGArg *args)
+{
+    tcg_target_long start, end;
+    bool is_store = false;
+    int size;
+
+    switch (op) {
+    case INDEX_op_st8_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_st8_i64:
+#endif
+        is_store = true;
+        /* fall through */
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+#endif
+        size = 1;
+        break;
+    case INDEX_op_st16_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_st16_i64:
+#endif
+        is_store = true;
+        /* fall through */
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+#endif
+        size = 2;
+        break;
+    case INDEX_op_st_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_st32_i64:
+#endif
+        is_store = true;
+        /* fall through */
+    case INDEX_op_ld_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+#endif
+        size = 4;
+        break;
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_st_i64:
+        is_store = true;
+        /* fall through */
+    case INDEX_op_ld_i64:
+        size = 8;
+        break;
+#endif
+    default:
+        return false;
+    }
+
+    if (!tcg_arg_is_env(s, args[1])) {
+        /* it may point anywhere into env */
+        r->nb = 0;
+        return false;
+    }
+
+    start = args[2];
+    end = start + size;
+    if (!is_store) {
+        tcg_ds_kill(r, start, end);
+        return false;
+    }
+    if (tcg_ds_covered(r, start, end)) {
+        return true;
+    }
+    if (r->nb < TCG_MAX_STORE_RANGES) {
+        r->start[r->nb] = start;
+        r->end[r->nb] = end;
+        r->nb++;
+    }
+    return false;
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1223,6 +1376,7 @@ static void tcg_liveness_analysis(TCGContext *s)
     uint8_t *dead_temps, *mem_temps;
     uint16_t dead_args;
     uint8_t sync_args;
+    TCGStoreRanges stores = { .nb = 0 };
     
     s->gen_opc_ptr++; /* skip end */
 
@@ -1251,6 +1405,8 @@ static void tcg_liveness_analysis(TCGContext *s)
                 nb_oargs = args[0] >> 16;
                 args++;
                 call_flags = args[nb_oargs + nb_iargs];
+                /* helpers may read any of env */
+                stores.nb = 0;
 
                 /* pure functions can be removed if their result is not
                    used */
@@ -1378,6 +1534,13 @@ static void tcg_liveness_analysis(TCGContext *s)
             nb_iargs = def->nb_iargs;
             nb_oargs = def->nb_oargs;
 
+            if (tcg_ds_access(s, &stores, op, args)) {
+#ifdef CONFIG_PROFILER
+                s->del_st_count++;
+#endif
+                goto do_remove;
+            }
+
             /* Test if the operation can be removed because all
                its outputs are dead. We assume that nb_oargs == 0
                implies side effects */
@@ -1414,9 +1577,13 @@ static void tcg_liveness_analysis(TCGContext *s)
                 /* if end of basic block, update */
                 if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s, dead_temps, mem_temps);
+                    stores.nb = 0;
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
                     memset(mem_temps, 1, s->nb_globals);
+                    /* and env may be read, e.g. when a guest access
+                       faults */
+                    stores.nb = 0;
                 }
 
                 /* input args are live */
@@ -1426,6 +1593,7 @@ static void tcg_liveness_analysis(TCGContext *s)
                         dead_args |= (1 << i);
                     }
                     dead_temps[arg] = 0;
+                    tcg_ds_use_global(s, &stores, arg);
                 }
                 s->op_dead_args[op_index] = dead_args;
                 s->op_sync_args[op_index] = sync_args;
@@ -2377,6 +2545,9 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "  of which stores   %0.2f\n",
+                s->tb_count ?
+                (double)s->del_st_count / s->tb_count : 0);
     cpu_fprintf(f, "avg temps/TB        %0.2f max=%d\n",
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
@@ -438,6 +438,7 @@ struct TCGContext {
     int64_t temp_count;
     int temp_count_max;
     int64_t del_op_count;
+    int64_t del_st_count; /* stores to env removed as dead */
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t interm_time;
@@ -26,6 +26,8 @@
  * - See TODO comments in code.
  */
 
+#include "tci-fused.h"
+
 /* Marker for missing code. */
 #define TODO() \
     do { \
@@ -48,6 +50,10 @@
 /* TODO: documentation. */
 static uint8_t *tb_ret_addr;
 
+/* Last operation written and where it ended, for superinstructions. */
+static uint8_t *tci_last_op;
+static uint8_t *tci_last_op_end;
+
 /* Macros used in tcg_target_op_defs. */
 #define R       "r"
 #define RI      "ri"
@@ -440,6 +446,60 @@ static void tcg_out_op_t(TCGContext *s, TCGOpcode op)
     tcg_out8(s, 0);
 }
 
+/* Return the superinstruction for first followed by second, or -1. */
+static int tci_fused_op(int first, int second)
+{
+#define FUSED(a, b) \
+    if (first == INDEX_op_##a && second == INDEX_op_##b) { \
+        return INDEX_op_tci_##a##_##b; \
+    }
+    TCI_FUSED_OPS(FUSED)
+#undef FUSED
+    return -1;
+}
+
+/* Test whether a label was set at ptr, so that code may jump there. */
+static bool tci_label_at(TCGContext *s, uint8_t *ptr)
+{
+    int i;
+
+    for (i = 0; i < s->nb_labels; i++) {
+        if (s->labels[i].has_value &&
+            s->labels[i].u.value == (tcg_target_long)ptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Start an operation, merged with the previous one if they form a
+   superinstruction.  Returns the start of the encoded operation. */
+static uint8_t *tci_out_op_begin(TCGContext *s, TCGOpcode op)
+{
+    uint8_t *op_ptr = tci_last_op;
+    int fused;
+
+    if (op_ptr && op_ptr >= s->code_buf && tci_last_op_end == s->code_ptr) {
+        fused = tci_fused_op(op_ptr[0], op);
+        if (fused >= 0 && !tci_label_at(s, s->code_ptr)) {
+            op_ptr[0] = fused;
+            return op_ptr;
+        }
+    }
+    op_ptr = s->code_ptr;
+    tcg_out_op_t(s, op);
+    return op_ptr;
+}
+
+/* Finish the operation started at op_ptr by writing its size. */
+static void tci_out_op_end(TCGContext *s, uint8_t *op_ptr)
+{
+    assert(s->code_ptr - op_ptr <= UINT8_MAX);
+    op_ptr[1] = s->code_ptr - op_ptr;
+    tci_last_op = op_ptr;
+    tci_last_op_end = s->code_ptr;
+}
+
 /* Write register. */
 static void tcg_out_r(TCGContext *s, TCGArg t0)
 {
@@ -501,16 +561,16 @@ static void tci_out_label(TCGContext *s, TCGArg arg)
 static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
                        tcg_target_long arg2)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    uint8_t *old_code_ptr;
     if (type == TCG_TYPE_I32) {
-        tcg_out_op_t(s, INDEX_op_ld_i32);
+        old_code_ptr = tci_out_op_begin(s, INDEX_op_ld_i32);
         tcg_out_r(s, ret);
         tcg_out_r(s, arg1);
         tcg_out32(s, arg2);
     } else {
         assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
-        tcg_out_op_t(s, INDEX_op_ld_i64);
+        old_code_ptr = tci_out_op_begin(s, INDEX_op_ld_i64);
         tcg_out_r(s, ret);
         tcg_out_r(s, arg1);
         assert(arg2 == (uint32_t)arg2);
@@ -519,51 +579,51 @@ static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_op_end(s, old_code_ptr);
 }
 
 static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    uint8_t *old_code_ptr;
     assert(ret != arg);
 #if TCG_TARGET_REG_BITS == 32
-    tcg_out_op_t(s, INDEX_op_mov_i32);
+    old_code_ptr = tci_out_op_begin(s, INDEX_op_mov_i32);
 #else
-    tcg_out_op_t(s, INDEX_op_mov_i64);
+    old_code_ptr = tci_out_op_begin(s, INDEX_op_mov_i64);
 #endif
     tcg_out_r(s, ret);
     tcg_out_r(s, arg);
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_op_end(s, old_code_ptr);
 }
 
 static void tcg_out_movi(TCGContext *s, TCGType type,
                          TCGReg t0, tcg_target_long arg)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    uint8_t *old_code_ptr;
     uint32_t arg32 = arg;
     if (type == TCG_TYPE_I32 || arg == arg32) {
-        tcg_out_op_t(s, INDEX_op_movi_i32);
+        old_code_ptr = tci_out_op_begin(s, INDEX_op_movi_i32);
         tcg_out_r(s, t0);
         tcg_out32(s, arg32);
     } else {
         assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
-        tcg_out_op_t(s, INDEX_op_movi_i64);
+        old_code_ptr = tci_out_op_begin(s, INDEX_op_movi_i64);
         tcg_out_r(s, t0);
         tcg_out64(s, arg);
 #else
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_op_end(s, old_code_ptr);
 }
 
 static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
                        const int *const_args)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    uint8_t *old_code_ptr;
 
-    tcg_out_op_t(s, opc);
+    old_code_ptr = tci_out_op_begin(s, opc);
 
     switch (opc) {
     case INDEX_op_exit_tb:
@@ -849,22 +909,22 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         fprintf(stderr, "Missing: %s\n", tcg_op_defs[opc].name);
         tcg_abort();
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_op_end(s, old_code_ptr);
 }
 
 static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
                        tcg_target_long arg2)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    uint8_t *old_code_ptr;
     if (type == TCG_TYPE_I32) {
-        tcg_out_op_t(s, INDEX_op_st_i32);
+        old_code_ptr = tci_out_op_begin(s, INDEX_op_st_i32);
         tcg_out_r(s, arg);
         tcg_out_r(s, arg1);
         tcg_out32(s, arg2);
     } else {
         assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
-        tcg_out_op_t(s, INDEX_op_st_i64);
+        old_code_ptr = tci_out_op_begin(s, INDEX_op_st_i64);
         tcg_out_r(s, arg);
         tcg_out_r(s, arg1);
         tcg_out32(s, arg2);
@@ -872,7 +932,7 @@ static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_op_end(s, old_code_ptr);
 }
 
 /* Test if a constant matches the constraint. */
@@ -894,6 +954,7 @@ static void tcg_target_init(TCGContext *s)
 
     /* The current code uses uint8_t for tcg operations. */
     assert(ARRAY_SIZE(tcg_op_defs) <= UINT8_MAX);
+    assert(TCI_NB_OPS <= UINT8_MAX);
 
     /* Registers available for 32 bit operations. */
     tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0,
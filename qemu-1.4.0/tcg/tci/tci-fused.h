@@ -0,0 +1,63 @@
+/*
+ * Tiny Code Interpreter for QEMU - superinstructions
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(TCI_FUSED_H)
+#define TCI_FUSED_H
+
+/*
+ * A superinstruction is a pair of TCG operations which the code generator
+ * found next to each other, with no label in between.  It is encoded like
+ * the first operation, with opcode INDEX_op_tci_<first>_<second>, and the
+ * operands of the second operation follow straight after those of the
+ * first one.  The interpreter then runs both without dispatching twice.
+ *
+ * The first operation of a pair must not call helpers, so that tci_tb_ptr
+ * need not point to the second one.
+ */
+
+#define TCI_FUSED_OPS_32(FUSED)         \
+    FUSED(ld_i32, add_i32)              \
+    FUSED(ld_i32, sub_i32)              \
+    FUSED(ld_i32, and_i32)              \
+    FUSED(ld_i32, or_i32)               \
+    FUSED(ld_i32, xor_i32)              \
+    FUSED(ld_i32, brcond_i32)           \
+    FUSED(setcond_i32, brcond_i32)
+
+#if TCG_TARGET_REG_BITS == 64
+#define TCI_FUSED_OPS(FUSED)            \
+    TCI_FUSED_OPS_32(FUSED)             \
+    FUSED(ld_i64, add_i64)              \
+    FUSED(ld_i64, sub_i64)              \
+    FUSED(ld_i64, and_i64)              \
+    FUSED(ld_i64, or_i64)               \
+    FUSED(ld_i64, xor_i64)              \
+    FUSED(ld_i64, brcond_i64)           \
+    FUSED(setcond_i64, brcond_i64)
+#else
+#define TCI_FUSED_OPS(FUSED) TCI_FUSED_OPS_32(FUSED)
+#endif
+
+typedef enum {
+    INDEX_op_tci_last = NB_OPS - 1,
+#define FUSED(first, second) INDEX_op_tci_##first##_##second,
+    TCI_FUSED_OPS(FUSED)
+#undef FUSED
+    TCI_NB_OPS,
+} TCIFusedOpcode;
+
+#endif /* TCI_FUSED_H */
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "exec/exec-all.h"           /* MAX_OPC_PARAM_IARGS */
 #include "tcg-op.h"
+#include "tci-fused.h"
 
 /* Marker for missing code. */
 #define TODO() \
@@ -429,9 +430,281 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
     return result;
 }
 
+/* Operations which can start a superinstruction, see tci-fused.h. */
+
+static inline void tci_exec_ld_i32(uint8_t **tb_ptr)
+{
+    TCGReg t0 = *(*tb_ptr)++;
+    tcg_target_ulong t1 = tci_read_r(tb_ptr);
+    tcg_target_ulong t2 = tci_read_i32(tb_ptr);
+    tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
+}
+
+static inline void tci_exec_setcond_i32(uint8_t **tb_ptr)
+{
+    TCGReg t0 = *(*tb_ptr)++;
+    uint32_t t1 = tci_read_r32(tb_ptr);
+    uint32_t t2 = tci_read_ri32(tb_ptr);
+    TCGCond condition = *(*tb_ptr)++;
+    tci_write_reg32(t0, tci_compare32(t1, t2, condition));
+}
+
+#if TCG_TARGET_REG_BITS == 64
+static inline void tci_exec_ld_i64(uint8_t **tb_ptr)
+{
+    TCGReg t0 = *(*tb_ptr)++;
+    tcg_target_ulong t1 = tci_read_r(tb_ptr);
+    tcg_target_ulong t2 = tci_read_i32(tb_ptr);
+    tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
+}
+
+static inline void tci_exec_setcond_i64(uint8_t **tb_ptr)
+{
+    TCGReg t0 = *(*tb_ptr)++;
+    uint64_t t1 = tci_read_r64(tb_ptr);
+    uint64_t t2 = tci_read_ri64(tb_ptr);
+    TCGCond condition = *(*tb_ptr)++;
+    tci_write_reg64(t0, tci_compare64(t1, t2, condition));
+}
+#endif
+
+/*
+ * Every operation has a label as well as a case, so superinstructions can
+ * jump to their second half.  Compilers which support labels as values
+ * dispatch through tci_dispatch[] instead of the switch: the indirect jump
+ * is then copied to the end of each operation, which the host CPU predicts
+ * far better than the single jump of the switch.
+ */
+#define CASE(op) case INDEX_op_##op: tci_op_##op
+
+#if defined(__GNUC__)
+# define TCI_THREADED
+#endif
+
+#if defined(GETPC)
+# define TCI_FETCH_TB_PTR() (tci_tb_ptr = (uintptr_t)tb_ptr)
+#else
+# define TCI_FETCH_TB_PTR() ((void)0)
+#endif
+#if !defined(NDEBUG)
+# define TCI_FETCH_SIZE() (op_size = tb_ptr[1], old_code_ptr = tb_ptr)
+#else
+# define TCI_FETCH_SIZE() ((void)0)
+#endif
+
+/* Read the opcode of the next operation, then skip opcode and size. */
+#define TCI_FETCH()                             \
+    do {                                        \
+        TCI_FETCH_TB_PTR();                     \
+        TCI_FETCH_SIZE();                       \
+        opc = tb_ptr[0];                        \
+        tb_ptr += 2;                            \
+    } while (0)
+
+/* Continue with the operation at tb_ptr, and the one after the current
+   operation, respectively. */
+#if defined(TCI_THREADED)
+# define TCI_DISPATCH()                         \
+    do {                                        \
+        TCI_FETCH();                            \
+        assert(opc < TCI_NB_OPS && tci_dispatch[opc]); \
+        goto *tci_dispatch[opc];                \
+    } while (0)
+# define TCI_NEXT()                             \
+    do {                                        \
+        assert(tb_ptr == old_code_ptr + op_size); \
+        TCI_DISPATCH();                         \
+    } while (0)
+#else
+# define TCI_DISPATCH() continue
+# define TCI_NEXT() break
+#endif
+
 /* Interpret pseudo code in tb. */
 tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
 {
+#if defined(TCI_THREADED)
+    /* Keep in sync with the cases of the switch below. */
+    static const void *const tci_dispatch[TCI_NB_OPS] = {
+        [INDEX_op_end] = &&tci_op_end,
+        [INDEX_op_nop] = &&tci_op_nop,
+        [INDEX_op_nop1] = &&tci_op_nop1,
+        [INDEX_op_nop2] = &&tci_op_nop2,
+        [INDEX_op_nop3] = &&tci_op_nop3,
+        [INDEX_op_nopn] = &&tci_op_nopn,
+        [INDEX_op_discard] = &&tci_op_discard,
+        [INDEX_op_set_label] = &&tci_op_set_label,
+        [INDEX_op_call] = &&tci_op_call,
+        [INDEX_op_br] = &&tci_op_br,
+        [INDEX_op_setcond_i32] = &&tci_op_setcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_setcond2_i32] = &&tci_op_setcond2_i32,
+#elif TCG_TARGET_REG_BITS == 64
+        [INDEX_op_setcond_i64] = &&tci_op_setcond_i64,
+#endif
+        [INDEX_op_mov_i32] = &&tci_op_mov_i32,
+        [INDEX_op_movi_i32] = &&tci_op_movi_i32,
+        [INDEX_op_ld8u_i32] = &&tci_op_ld8u_i32,
+        [INDEX_op_ld8s_i32] = &&tci_op_ld8s_i32,
+        [INDEX_op_ld16u_i32] = &&tci_op_ld16u_i32,
+        [INDEX_op_ld16s_i32] = &&tci_op_ld16s_i32,
+        [INDEX_op_ld_i32] = &&tci_op_ld_i32,
+        [INDEX_op_st8_i32] = &&tci_op_st8_i32,
+        [INDEX_op_st16_i32] = &&tci_op_st16_i32,
+        [INDEX_op_st_i32] = &&tci_op_st_i32,
+        [INDEX_op_add_i32] = &&tci_op_add_i32,
+        [INDEX_op_sub_i32] = &&tci_op_sub_i32,
+        [INDEX_op_mul_i32] = &&tci_op_mul_i32,
+#if TCG_TARGET_HAS_div_i32
+        [INDEX_op_div_i32] = &&tci_op_div_i32,
+        [INDEX_op_divu_i32] = &&tci_op_divu_i32,
+        [INDEX_op_rem_i32] = &&tci_op_rem_i32,
+        [INDEX_op_remu_i32] = &&tci_op_remu_i32,
+#elif TCG_TARGET_HAS_div2_i32
+        [INDEX_op_div2_i32] = &&tci_op_div2_i32,
+        [INDEX_op_divu2_i32] = &&tci_op_divu2_i32,
+#endif
+        [INDEX_op_and_i32] = &&tci_op_and_i32,
+        [INDEX_op_or_i32] = &&tci_op_or_i32,
+        [INDEX_op_xor_i32] = &&tci_op_xor_i32,
+        [INDEX_op_shl_i32] = &&tci_op_shl_i32,
+        [INDEX_op_shr_i32] = &&tci_op_shr_i32,
+        [INDEX_op_sar_i32] = &&tci_op_sar_i32,
+#if TCG_TARGET_HAS_rot_i32
+        [INDEX_op_rotl_i32] = &&tci_op_rotl_i32,
+        [INDEX_op_rotr_i32] = &&tci_op_rotr_i32,
+#endif
+#if TCG_TARGET_HAS_deposit_i32
+        [INDEX_op_deposit_i32] = &&tci_op_deposit_i32,
+#endif
+        [INDEX_op_brcond_i32] = &&tci_op_brcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_add2_i32] = &&tci_op_add2_i32,
+        [INDEX_op_sub2_i32] = &&tci_op_sub2_i32,
+        [INDEX_op_brcond2_i32] = &&tci_op_brcond2_i32,
+        [INDEX_op_mulu2_i32] = &&tci_op_mulu2_i32,
+#endif
+#if TCG_TARGET_HAS_ext8s_i32
+        [INDEX_op_ext8s_i32] = &&tci_op_ext8s_i32,
+#endif
+#if TCG_TARGET_HAS_ext16s_i32
+        [INDEX_op_ext16s_i32] = &&tci_op_ext16s_i32,
+#endif
+#if TCG_TARGET_HAS_ext8u_i32
+        [INDEX_op_ext8u_i32] = &&tci_op_ext8u_i32,
+#endif
+#if TCG_TARGET_HAS_ext16u_i32
+        [INDEX_op_ext16u_i32] = &&tci_op_ext16u_i32,
+#endif
+#if TCG_TARGET_HAS_bswap16_i32
+        [INDEX_op_bswap16_i32] = &&tci_op_bswap16_i32,
+#endif
+#if TCG_TARGET_HAS_bswap32_i32
+        [INDEX_op_bswap32_i32] = &&tci_op_bswap32_i32,
+#endif
+#if TCG_TARGET_HAS_not_i32
+        [INDEX_op_not_i32] = &&tci_op_not_i32,
+#endif
+#if TCG_TARGET_HAS_neg_i32
+        [INDEX_op_neg_i32] = &&tci_op_neg_i32,
+#endif
+#if TCG_TARGET_REG_BITS == 64
+        [INDEX_op_mov_i64] = &&tci_op_mov_i64,
+        [INDEX_op_movi_i64] = &&tci_op_movi_i64,
+        [INDEX_op_ld8u_i64] = &&tci_op_ld8u_i64,
+        [INDEX_op_ld8s_i64] = &&tci_op_ld8s_i64,
+        [INDEX_op_ld16u_i64] = &&tci_op_ld16u_i64,
+        [INDEX_op_ld16s_i64] = &&tci_op_ld16s_i64,
+        [INDEX_op_ld32u_i64] = &&tci_op_ld32u_i64,
+        [INDEX_op_ld32s_i64] = &&tci_op_ld32s_i64,
+        [INDEX_op_ld_i64] = &&tci_op_ld_i64,
+        [INDEX_op_st8_i64] = &&tci_op_st8_i64,
+        [INDEX_op_st16_i64] = &&tci_op_st16_i64,
+        [INDEX_op_st32_i64] = &&tci_op_st32_i64,
+        [INDEX_op_st_i64] = &&tci_op_st_i64,
+        [INDEX_op_add_i64] = &&tci_op_add_i64,
+        [INDEX_op_sub_i64] = &&tci_op_sub_i64,
+        [INDEX_op_mul_i64] = &&tci_op_mul_i64,
+#if TCG_TARGET_HAS_div_i64
+        [INDEX_op_div_i64] = &&tci_op_div_i64,
+        [INDEX_op_divu_i64] = &&tci_op_divu_i64,
+        [INDEX_op_rem_i64] = &&tci_op_rem_i64,
+        [INDEX_op_remu_i64] = &&tci_op_remu_i64,
+#elif TCG_TARGET_HAS_div2_i64
+        [INDEX_op_div2_i64] = &&tci_op_div2_i64,
+        [INDEX_op_divu2_i64] = &&tci_op_divu2_i64,
+#endif
+        [INDEX_op_and_i64] = &&tci_op_and_i64,
+        [INDEX_op_or_i64] = &&tci_op_or_i64,
+        [INDEX_op_xor_i64] = &&tci_op_xor_i64,
+        [INDEX_op_shl_i64] = &&tci_op_shl_i64,
+        [INDEX_op_shr_i64] = &&tci_op_shr_i64,
+        [INDEX_op_sar_i64] = &&tci_op_sar_i64,
+#if TCG_TARGET_HAS_rot_i64
+        [INDEX_op_rotl_i64] = &&tci_op_rotl_i64,
+        [INDEX_op_rotr_i64] = &&tci_op_rotr_i64,
+#endif
+#if TCG_TARGET_HAS_deposit_i64
+        [INDEX_op_deposit_i64] = &&tci_op_deposit_i64,
+#endif
+        [INDEX_op_brcond_i64] = &&tci_op_brcond_i64,
+#if TCG_TARGET_HAS_ext8u_i64
+        [INDEX_op_ext8u_i64] = &&tci_op_ext8u_i64,
+#endif
+#if TCG_TARGET_HAS_ext8s_i64
+        [INDEX_op_ext8s_i64] = &&tci_op_ext8s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16s_i64
+        [INDEX_op_ext16s_i64] = &&tci_op_ext16s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16u_i64
+        [INDEX_op_ext16u_i64] = &&tci_op_ext16u_i64,
+#endif
+#if TCG_TARGET_HAS_ext32s_i64
+        [INDEX_op_ext32s_i64] = &&tci_op_ext32s_i64,
+#endif
+#if TCG_TARGET_HAS_ext32u_i64
+        [INDEX_op_ext32u_i64] = &&tci_op_ext32u_i64,
+#endif
+#if TCG_TARGET_HAS_bswap16_i64
+        [INDEX_op_bswap16_i64] = &&tci_op_bswap16_i64,
+#endif
+#if TCG_TARGET_HAS_bswap32_i64
+        [INDEX_op_bswap32_i64] = &&tci_op_bswap32_i64,
+#endif
+#if TCG_TARGET_HAS_bswap64_i64
+        [INDEX_op_bswap64_i64] = &&tci_op_bswap64_i64,
+#endif
+#if TCG_TARGET_HAS_not_i64
+        [INDEX_op_not_i64] = &&tci_op_not_i64,
+#endif
+#if TCG_TARGET_HAS_neg_i64
+        [INDEX_op_neg_i64] = &&tci_op_neg_i64,
+#endif
+#endif /* TCG_TARGET_REG_BITS == 64 */
+        [INDEX_op_debug_insn_start] = &&tci_op_debug_insn_start,
+        [INDEX_op_exit_tb] = &&tci_op_exit_tb,
+        [INDEX_op_goto_tb] = &&tci_op_goto_tb,
+        [INDEX_op_qemu_ld8u] = &&tci_op_qemu_ld8u,
+        [INDEX_op_qemu_ld8s] = &&tci_op_qemu_ld8s,
+        [INDEX_op_qemu_ld16u] = &&tci_op_qemu_ld16u,
+        [INDEX_op_qemu_ld16s] = &&tci_op_qemu_ld16s,
+#if TCG_TARGET_REG_BITS == 64
+        [INDEX_op_qemu_ld32u] = &&tci_op_qemu_ld32u,
+        [INDEX_op_qemu_ld32s] = &&tci_op_qemu_ld32s,
+#endif
+        [INDEX_op_qemu_ld32] = &&tci_op_qemu_ld32,
+        [INDEX_op_qemu_ld64] = &&tci_op_qemu_ld64,
+        [INDEX_op_qemu_st8] = &&tci_op_qemu_st8,
+        [INDEX_op_qemu_st16] = &&tci_op_qemu_st16,
+        [INDEX_op_qemu_st32] = &&tci_op_qemu_st32,
+        [INDEX_op_qemu_st64] = &&tci_op_qemu_st64,
+#define FUSED(first, second) \
+        [INDEX_op_tci_##first##_##second] = &&tci_op_tci_##first##_##second,
+        TCI_FUSED_OPS(FUSED)
+#undef FUSED
+    };
+#endif
     tcg_target_ulong next_tb = 0;
 
     env = cpustate;
@@ -439,13 +712,10 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
     assert(tb_ptr);
 
     for (;;) {
-#if defined(GETPC)
-        tci_tb_ptr = (uintptr_t)tb_ptr;
-#endif
-        TCGOpcode opc = tb_ptr[0];
+        unsigned opc;
 #if !defined(NDEBUG)
-        uint8_t op_size = tb_ptr[1];
-        uint8_t *old_code_ptr = tb_ptr;
+        uint8_t op_size;
+        uint8_t *old_code_ptr;
 #endif
         tcg_target_ulong t0;
         tcg_target_ulong t1;
@@ -464,24 +734,26 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
         uint64_t v64;
 #endif
 
-        /* Skip opcode and size entry. */
-        tb_ptr += 2;
-
+        TCI_FETCH();
+#if defined(TCI_THREADED)
+        assert(opc < TCI_NB_OPS && tci_dispatch[opc]);
+        goto *tci_dispatch[opc];
+#endif
         switch (opc) {
-        case INDEX_op_end:
-        case INDEX_op_nop:
-            break;
-        case INDEX_op_nop1:
-        case INDEX_op_nop2:
-        case INDEX_op_nop3:
-        case INDEX_op_nopn:
-        case INDEX_op_discard:
+        CASE(end):
+        CASE(nop):
+            TCI_NEXT();
+        CASE(nop1):
+        CASE(nop2):
+        CASE(nop3):
+        CASE(nopn):
+        CASE(discard):
             TODO();
-            break;
-        case INDEX_op_set_label:
+            TCI_NEXT();
+        CASE(set_label):
             TODO();
-            break;
-        case INDEX_op_call:
+            TCI_NEXT();
+        CASE(call):
             t0 = tci_read_ri(&tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
             tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
@@ -504,193 +776,182 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
                                           tci_read_reg(TCG_REG_R5));
             tci_write_reg(TCG_REG_R0, tmp64);
 #endif
-            break;
-        case INDEX_op_br:
+            TCI_NEXT();
+        CASE(br):
             label = tci_read_label(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr = (uint8_t *)label;
-            continue;
-        case INDEX_op_setcond_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            condition = *tb_ptr++;
-            tci_write_reg32(t0, tci_compare32(t1, t2, condition));
-            break;
+            TCI_DISPATCH();
+        CASE(setcond_i32):
+            tci_exec_setcond_i32(&tb_ptr);
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_setcond2_i32:
+        CASE(setcond2_i32):
             t0 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            condition = *tb_ptr++;
-            tci_write_reg64(t0, tci_compare64(t1, t2, condition));
-            break;
+        CASE(setcond_i64):
+            tci_exec_setcond_i64(&tb_ptr);
+            TCI_NEXT();
 #endif
-        case INDEX_op_mov_i32:
+        CASE(mov_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
-        case INDEX_op_movi_i32:
+            TCI_NEXT();
+        CASE(movi_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (32 bit). */
 
-        case INDEX_op_ld8u_i32:
+        CASE(ld8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i32:
-        case INDEX_op_ld16u_i32:
+            TCI_NEXT();
+        CASE(ld8s_i32):
+        CASE(ld16u_i32):
             TODO();
-            break;
-        case INDEX_op_ld16s_i32:
+            TCI_NEXT();
+        CASE(ld16s_i32):
             TODO();
-            break;
-        case INDEX_op_ld_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i32:
+            TCI_NEXT();
+        CASE(ld_i32):
+            tci_exec_ld_i32(&tb_ptr);
+            TCI_NEXT();
+        CASE(st8_i32):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i32:
+            TCI_NEXT();
+        CASE(st16_i32):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i32:
+            TCI_NEXT();
+        CASE(st_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
 
             /* Arithmetic operations (32 bit). */
 
-        case INDEX_op_add_i32:
+        CASE(add_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i32:
+            TCI_NEXT();
+        CASE(sub_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i32:
+            TCI_NEXT();
+        CASE(mul_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 * t2);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i32
-        case INDEX_op_div_i32:
+        CASE(div_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 / (int32_t)t2);
-            break;
-        case INDEX_op_divu_i32:
+            TCI_NEXT();
+        CASE(divu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 / t2);
-            break;
-        case INDEX_op_rem_i32:
+            TCI_NEXT();
+        CASE(rem_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 % (int32_t)t2);
-            break;
-        case INDEX_op_remu_i32:
+            TCI_NEXT();
+        CASE(remu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 % t2);
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i32
-        case INDEX_op_div2_i32:
-        case INDEX_op_divu2_i32:
+        CASE(div2_i32):
+        CASE(divu2_i32):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_and_i32:
+        CASE(and_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i32:
+            TCI_NEXT();
+        CASE(or_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i32:
+            TCI_NEXT();
+        CASE(xor_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 ^ t2);
-            break;
+            TCI_NEXT();
 
             /* Shift/rotate operations (32 bit). */
 
-        case INDEX_op_shl_i32:
+        CASE(shl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i32:
+            TCI_NEXT();
+        CASE(shr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i32:
+            TCI_NEXT();
+        CASE(sar_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, ((int32_t)t1 >> t2));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i32
-        case INDEX_op_rotl_i32:
+        CASE(rotl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (t1 << t2) | (t1 >> (32 - t2)));
-            break;
-        case INDEX_op_rotr_i32:
+            TCI_NEXT();
+        CASE(rotr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (t1 >> t2) | (t1 << (32 - t2)));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_deposit_i32
-        case INDEX_op_deposit_i32:
+        CASE(deposit_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_r32(&tb_ptr);
@@ -698,9 +959,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *tb_ptr++;
             tmp32 = (((1 << tmp8) - 1) << tmp16);
             tci_write_reg32(t0, (t1 & ~tmp32) | ((t2 << tmp16) & tmp32));
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i32:
+        CASE(brcond_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
@@ -708,25 +969,25 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare32(t0, t1, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_DISPATCH();
             }
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_add2_i32:
+        CASE(add2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 += tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_sub2_i32:
+            TCI_NEXT();
+        CASE(sub2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 -= tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_brcond2_i32:
+            TCI_NEXT();
+        CASE(brcond2_i32):
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -734,221 +995,218 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare64(tmp64, v64, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_DISPATCH();
             }
-            break;
-        case INDEX_op_mulu2_i32:
+            TCI_NEXT();
+        CASE(mulu2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             t2 = tci_read_r32(&tb_ptr);
             tmp64 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t1, t0, t2 * tmp64);
-            break;
+            TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 32 */
 #if TCG_TARGET_HAS_ext8s_i32
-        case INDEX_op_ext8s_i32:
+        CASE(ext8s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i32
-        case INDEX_op_ext16s_i32:
+        CASE(ext16s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8u_i32
-        case INDEX_op_ext8u_i32:
+        CASE(ext8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i32
-        case INDEX_op_ext16u_i32:
+        CASE(ext16u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i32
-        case INDEX_op_bswap16_i32:
+        CASE(bswap16_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, bswap16(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i32
-        case INDEX_op_bswap32_i32:
+        CASE(bswap32_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, bswap32(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i32
-        case INDEX_op_not_i32:
+        CASE(not_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, ~t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i32
-        case INDEX_op_neg_i32:
+        CASE(neg_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, -t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
+        CASE(mov_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
-        case INDEX_op_movi_i64:
+            TCI_NEXT();
+        CASE(movi_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_i64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (64 bit). */
 
-        case INDEX_op_ld8u_i64:
+        CASE(ld8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i64:
-        case INDEX_op_ld16u_i64:
-        case INDEX_op_ld16s_i64:
+            TCI_NEXT();
+        CASE(ld8s_i64):
+        CASE(ld16u_i64):
+        CASE(ld16s_i64):
             TODO();
-            break;
-        case INDEX_op_ld32u_i64:
+            TCI_NEXT();
+        CASE(ld32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld32s_i64:
+            TCI_NEXT();
+        CASE(ld32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i64:
+            TCI_NEXT();
+        CASE(ld_i64):
+            tci_exec_ld_i64(&tb_ptr);
+            TCI_NEXT();
+        CASE(st8_i64):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i64:
+            TCI_NEXT();
+        CASE(st16_i64):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st32_i64:
+            TCI_NEXT();
+        CASE(st32_i64):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i64:
+            TCI_NEXT();
+        CASE(st_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint64_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
 
             /* Arithmetic operations (64 bit). */
 
-        case INDEX_op_add_i64:
+        CASE(add_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i64:
+            TCI_NEXT();
+        CASE(sub_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i64:
+            TCI_NEXT();
+        CASE(mul_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 * t2);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i64
-        case INDEX_op_div_i64:
-        case INDEX_op_divu_i64:
-        case INDEX_op_rem_i64:
-        case INDEX_op_remu_i64:
+        CASE(div_i64):
+        CASE(divu_i64):
+        CASE(rem_i64):
+        CASE(remu_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i64
-        case INDEX_op_div2_i64:
-        case INDEX_op_divu2_i64:
+        CASE(div2_i64):
+        CASE(divu2_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_and_i64:
+        CASE(and_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i64:
+            TCI_NEXT();
+        CASE(or_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i64:
+            TCI_NEXT();
+        CASE(xor_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 ^ t2);
-            break;
+            TCI_NEXT();
 
             /* Shift/rotate operations (64 bit). */
 
-        case INDEX_op_shl_i64:
+        CASE(shl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i64:
+            TCI_NEXT();
+        CASE(shr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i64:
+            TCI_NEXT();
+        CASE(sar_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, ((int64_t)t1 >> t2));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i64
-        case INDEX_op_rotl_i64:
-        case INDEX_op_rotr_i64:
+        CASE(rotl_i64):
+        CASE(rotr_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_deposit_i64
-        case INDEX_op_deposit_i64:
+        CASE(deposit_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_r64(&tb_ptr);
@@ -956,9 +1214,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *tb_ptr++;
             tmp64 = (((1ULL << tmp8) - 1) << tmp16);
             tci_write_reg64(t0, (t1 & ~tmp64) | ((t2 << tmp16) & tmp64));
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i64:
+        CASE(brcond_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -966,110 +1224,110 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare64(t0, t1, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_DISPATCH();
             }
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_ext8u_i64
-        case INDEX_op_ext8u_i64:
+        CASE(ext8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8s_i64
-        case INDEX_op_ext8s_i64:
+        CASE(ext8s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i64
-        case INDEX_op_ext16s_i64:
+        CASE(ext16s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i64
-        case INDEX_op_ext16u_i64:
+        CASE(ext16u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32s_i64
-        case INDEX_op_ext32s_i64:
+        CASE(ext32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32u_i64
-        case INDEX_op_ext32u_i64:
+        CASE(ext32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i64
-        case INDEX_op_bswap16_i64:
+        CASE(bswap16_i64):
             TODO();
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, bswap16(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i64
-        case INDEX_op_bswap32_i64:
+        CASE(bswap32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, bswap32(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap64_i64
-        case INDEX_op_bswap64_i64:
+        CASE(bswap64_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, bswap64(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i64
-        case INDEX_op_not_i64:
+        CASE(not_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, ~t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i64
-        case INDEX_op_neg_i64:
+        CASE(neg_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, -t1);
-            break;
+            TCI_NEXT();
 #endif
 #endif /* TCG_TARGET_REG_BITS == 64 */
 
             /* QEMU specific operations. */
 
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
-        case INDEX_op_debug_insn_start:
+        CASE(debug_insn_start):
             TODO();
-            break;
+            TCI_NEXT();
 #else
-        case INDEX_op_debug_insn_start:
+        CASE(debug_insn_start):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_exit_tb:
+        CASE(exit_tb):
             next_tb = *(uint64_t *)tb_ptr;
             goto exit;
             break;
-        case INDEX_op_goto_tb:
+        CASE(goto_tb):
             t0 = tci_read_i32(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr += (int32_t)t0;
-            continue;
-        case INDEX_op_qemu_ld8u:
+            TCI_DISPATCH();
+        CASE(qemu_ld8u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1080,8 +1338,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld8s:
+            TCI_NEXT();
+        CASE(qemu_ld8s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1092,8 +1350,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8s(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld16u:
+            TCI_NEXT();
+        CASE(qemu_ld16u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1104,8 +1362,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16(t0, tmp16);
-            break;
-        case INDEX_op_qemu_ld16s:
+            TCI_NEXT();
+        CASE(qemu_ld16s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1116,9 +1374,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16s(t0, tmp16);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_qemu_ld32u:
+        CASE(qemu_ld32u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1129,8 +1387,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld32s:
+            TCI_NEXT();
+        CASE(qemu_ld32s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1141,9 +1399,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32s(t0, tmp32);
-            break;
+            TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 64 */
-        case INDEX_op_qemu_ld32:
+        CASE(qemu_ld32):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1154,8 +1412,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld64:
+            TCI_NEXT();
+        CASE(qemu_ld64):
             t0 = *tb_ptr++;
 #if TCG_TARGET_REG_BITS == 32
             t1 = *tb_ptr++;
@@ -1172,8 +1430,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
 #if TCG_TARGET_REG_BITS == 32
             tci_write_reg(t1, tmp64 >> 32);
 #endif
-            break;
-        case INDEX_op_qemu_st8:
+            TCI_NEXT();
+        CASE(qemu_st8):
             t0 = tci_read_r8(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1184,8 +1442,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint8_t *)(host_addr + GUEST_BASE) = t0;
 #endif
-            break;
-        case INDEX_op_qemu_st16:
+            TCI_NEXT();
+        CASE(qemu_st16):
             t0 = tci_read_r16(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1196,8 +1454,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint16_t *)(host_addr + GUEST_BASE) = tswap16(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st32:
+            TCI_NEXT();
+        CASE(qemu_st32):
             t0 = tci_read_r32(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1208,8 +1466,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint32_t *)(host_addr + GUEST_BASE) = tswap32(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st64:
+            TCI_NEXT();
+        CASE(qemu_st64):
             tmp64 = tci_read_r64(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1220,7 +1478,18 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint64_t *)(host_addr + GUEST_BASE) = tswap64(tmp64);
 #endif
-            break;
+            TCI_NEXT();
+
+            /* Superinstructions: run the first operation, then jump to the
+               code of the second one, whose operands follow. */
+
+#define FUSED(first, second) \
+        CASE(tci_##first##_##second): \
+            tci_exec_##first(&tb_ptr); \
+            goto tci_op_##second;
+        TCI_FUSED_OPS(FUSED)
+#undef FUSED
+
         default:
             TODO();
             break;
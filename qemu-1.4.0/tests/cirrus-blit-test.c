@@ -0,0 +1,271 @@
+/*
+ * QTest testcase and benchmark for the Cirrus Logic blitter
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * VRAM is reached through the 0xa0000 window, one 4K-granular bank at a
+ * time, and blits are programmed through the graphics controller ports the
+ * way a guest driver does it.  Expected results come from a byte-at-a-time
+ * model of the blitter, so the fast paths in the ROP functions have to give
+ * exactly what the plain loops would, overlapping copies included.  With
+ * -m perf the benchmark times full-screen fills and copies; the figures
+ * include the qtest round trips for programming the registers.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+
+#define VGA_SEQ_I       0x3c4
+#define VGA_SEQ_D       0x3c5
+#define VGA_GFX_I       0x3ce
+#define VGA_GFX_D       0x3cf
+
+#define WINDOW_BASE     0xa0000
+#define BANK_SIZE       0x8000
+
+#define BLT_START       0x02
+#define BLT_BUSY        0x01
+#define BLTMODE_BACKWARDS       0x01
+#define BLTMODE_PATTERNCOPY     0x40
+#define BLTMODE_COLOREXPAND     0x80
+#define BLTMODEEXT_SOLIDFILL    0x04
+#define ROP_SRC         0x0d
+
+#define PITCH           2048
+#define AREA_SIZE       (256 * 1024)
+
+static void sr_write(uint8_t idx, uint8_t val)
+{
+    outb(VGA_SEQ_I, idx);
+    outb(VGA_SEQ_D, val);
+}
+
+static void gr_write(uint8_t idx, uint8_t val)
+{
+    outb(VGA_GFX_I, idx);
+    outb(VGA_GFX_D, val);
+}
+
+static uint8_t gr_read(uint8_t idx)
+{
+    outb(VGA_GFX_I, idx);
+    return inb(VGA_GFX_D);
+}
+
+static void unlock_extensions(void)
+{
+    sr_write(0x06, 0x12);
+    /* extended (linear) addressing of the 0xa0000 window */
+    sr_write(0x07, 0x01);
+    /* single 4K-granular bank */
+    gr_write(0x0b, 0x00);
+}
+
+static void vram_access(uint32_t offset, uint8_t *buf, size_t len, bool write)
+{
+    while (len) {
+        uint32_t in_bank = offset & 0xfff;
+        size_t chunk = MIN(len, BANK_SIZE - in_bank);
+
+        gr_write(0x09, offset >> 12);
+        if (write) {
+            memwrite(WINDOW_BASE + in_bank, buf, chunk);
+        } else {
+            memread(WINDOW_BASE + in_bank, buf, chunk);
+        }
+        offset += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
+static void blit(uint32_t dst, uint32_t src, int width, int height,
+                 int pitch, uint8_t mode, uint8_t modeext)
+{
+    gr_write(0x20, (width - 1) & 0xff);
+    gr_write(0x21, (width - 1) >> 8);
+    gr_write(0x22, (height - 1) & 0xff);
+    gr_write(0x23, (height - 1) >> 8);
+    gr_write(0x24, pitch & 0xff);
+    gr_write(0x25, pitch >> 8);
+    gr_write(0x26, pitch & 0xff);
+    gr_write(0x27, pitch >> 8);
+    gr_write(0x28, dst & 0xff);
+    gr_write(0x29, dst >> 8);
+    gr_write(0x2a, dst >> 16);
+    gr_write(0x2c, src & 0xff);
+    gr_write(0x2d, src >> 8);
+    gr_write(0x2e, src >> 16);
+    gr_write(0x30, mode);
+    gr_write(0x32, ROP_SRC);
+    gr_write(0x33, modeext);
+    gr_write(0x31, BLT_START);
+    g_assert_cmphex(gr_read(0x31) & (BLT_START | BLT_BUSY), ==, 0);
+}
+
+static void set_fgcol(uint32_t color)
+{
+    gr_write(0x01, color);
+    gr_write(0x11, color >> 8);
+    gr_write(0x13, color >> 16);
+    gr_write(0x15, color >> 24);
+}
+
+/* Fill the test area with a pattern and return a copy of it */
+static uint8_t *area_init(uint32_t base)
+{
+    uint8_t *buf = g_malloc(AREA_SIZE);
+    int i;
+
+    for (i = 0; i < AREA_SIZE; i++) {
+        buf[i] = i * 13 + (i >> 8);
+    }
+    vram_access(base, buf, AREA_SIZE, true);
+    return buf;
+}
+
+static void area_check(uint32_t base, const uint8_t *expected)
+{
+    uint8_t *buf = g_malloc(AREA_SIZE);
+
+    vram_access(base, buf, AREA_SIZE, false);
+    g_assert(memcmp(buf, expected, AREA_SIZE) == 0);
+    g_free(buf);
+}
+
+/* What the blitter does for ROP_SRC, one byte at a time */
+static void model_copy(uint8_t *mem, int dst, int src, int width, int height,
+                       int pitch, bool backwards)
+{
+    int step = backwards ? -1 : 1;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            mem[dst + x * step] = mem[src + x * step];
+        }
+        dst += pitch * step;
+        src += pitch * step;
+    }
+}
+
+static void check_copy(int dst, int src, int width, int height,
+                       bool backwards)
+{
+    const uint32_t base = 0x100000;
+    uint8_t *expected = area_init(base);
+
+    model_copy(expected, dst, src, width, height, PITCH, backwards);
+    blit(base + dst, base + src, width, height, PITCH,
+         backwards ? BLTMODE_BACKWARDS : 0, 0);
+    area_check(base, expected);
+    g_free(expected);
+}
+
+static void test_copy_forward(void)
+{
+    unlock_extensions();
+    /* disjoint, then overlapping with the destination below the source */
+    check_copy(0x10000, 0x100, 600, 40, false);
+    check_copy(0x100, 0x100 + 3 * PITCH + 5, 700, 30, false);
+    /* destination just right of the source on the same rows: the byte loop
+       replicates the first bytes, which a memmove would not */
+    check_copy(0x200 + 4, 0x200, 300, 10, false);
+}
+
+static void test_copy_backward(void)
+{
+    unlock_extensions();
+    /* addresses point at the last byte of the last row */
+    check_copy(0x20000 + 40 * PITCH, 0x8000 + 40 * PITCH, 500, 40, true);
+    check_copy(0x8000 + 20 * PITCH + 7, 0x8000 + 20 * PITCH, 500, 20, true);
+    /* destination just left of the source: replicates again */
+    check_copy(0x9000 + 10 * PITCH, 0x9000 + 10 * PITCH + 3, 200, 10, true);
+}
+
+static void check_fill(int bytes_pp, uint8_t pixelwidth, uint32_t color)
+{
+    const uint32_t base = 0x100000;
+    const int dst = 0x1000 + 3, width = 101 * bytes_pp, height = 25;
+    uint8_t *expected = area_init(base);
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            expected[dst + y * PITCH + x] = color >> (8 * (x % bytes_pp));
+        }
+    }
+    set_fgcol(color);
+    blit(base + dst, 0, width, height, PITCH,
+         BLTMODE_COLOREXPAND | BLTMODE_PATTERNCOPY | pixelwidth,
+         BLTMODEEXT_SOLIDFILL);
+    area_check(base, expected);
+    g_free(expected);
+}
+
+static void test_fill(void)
+{
+    unlock_extensions();
+    check_fill(1, 0x00, 0x5a);
+    check_fill(2, 0x10, 0xa55a);
+    check_fill(3, 0x20, 0x123456);
+    check_fill(4, 0x30, 0x89abcdef);
+}
+
+static void bench_blits(const char *name, uint8_t mode, uint8_t modeext,
+                        uint32_t src, int rounds)
+{
+    const int width = 1024 * 4, height = 768, pitch = 1024 * 4;
+    GTimer *timer = g_timer_new();
+    double secs;
+    int i;
+
+    for (i = 0; i < rounds; i++) {
+        blit(0, src, width, height, pitch, mode, modeext);
+    }
+    secs = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    g_test_message("%s: %.1f MB/s", name,
+                   (double)rounds * width * height / secs / (1 << 20));
+}
+
+static void test_bench(void)
+{
+    unlock_extensions();
+    set_fgcol(0x00c0ffee);
+    bench_blits("fill 32bpp",
+                BLTMODE_COLOREXPAND | BLTMODE_PATTERNCOPY | 0x30,
+                BLTMODEEXT_SOLIDFILL, 0, 200);
+    /* scrolling a 1024x768x32 screen up by 16 lines */
+    bench_blits("copy 32bpp", 0, 0, 16 * 1024 * 4, 200);
+}
+
+int main(int argc, char **argv)
+{
+    QTestState *s = NULL;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    s = qtest_start("-vga cirrus -display none");
+
+    qtest_add_func("/cirrus-blit/copy-forward", test_copy_forward);
+    qtest_add_func("/cirrus-blit/copy-backward", test_copy_backward);
+    qtest_add_func("/cirrus-blit/fill", test_fill);
+    if (g_test_perf()) {
+        qtest_add_func("/cirrus-blit/bench", test_bench);
+    }
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+
+    return ret;
+}
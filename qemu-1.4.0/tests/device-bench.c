@@ -0,0 +1,616 @@
+/*
+ * QTest benchmarks for device emulation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Each benchmark starts its own QEMU with the device under test in slot 4
+ * and drives it the way a guest driver would: BARs are assigned here since
+ * no firmware runs under qtest, rings live in guest RAM, and doorbells are
+ * plain register writes.  The backends are the null ones: NICs transmit
+ * to "-netdev null", which drops every packet, and virtio-blk reads from
+ * null-co, which completes requests without any I/O.
+ *
+ * Results are reported with g_test_maximized_result(), so that
+ * "gtester -m=perf -o report.xml" (which is what "make check-bench" runs)
+ * records them in its XML report.  Every figure includes the qtest round
+ * trips that a real guest would not pay; compare them between builds, not
+ * against bare-metal numbers.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+
+#define DEV_DEVFN       (4 << 3)
+
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+#define PCI_VENDOR_ID   0x00
+#define PCI_COMMAND     0x04
+#define PCI_BAR0        0x10
+#define PCI_COMMAND_IO      0x1
+#define PCI_COMMAND_MEMORY  0x2
+#define PCI_COMMAND_MASTER  0x4
+
+/* Inside the i440FX PCI hole, clear of the IOAPIC and HPET */
+#define PCI_IO_BASE     0xc000
+#define PCI_MEM_BASE    0xe0000000
+
+#define RING_BASE       0x1000000   /* descriptor rings */
+#define BUF_BASE        0x2000000   /* request headers and data */
+
+#define MMIO_ROUNDS     20000
+#define RING_ROUNDS     200
+
+static uint32_t pci_io_next, pci_mem_next;
+
+static void bench_report(const char *name, const char *unit, double count,
+                         GTimer *timer)
+{
+    double rate = count / g_timer_elapsed(timer, NULL);
+
+    g_test_maximized_result(rate, "%s %.0f %s/s", name, rate, unit);
+}
+
+static uint32_t readl(uint64_t addr)
+{
+    uint32_t val;
+
+    memread(addr, &val, sizeof(val));
+    return le32_to_cpu(val);
+}
+
+static void writel(uint64_t addr, uint32_t val)
+{
+    val = cpu_to_le32(val);
+    memwrite(addr, &val, sizeof(val));
+}
+
+static uint16_t readw(uint64_t addr)
+{
+    uint16_t val;
+
+    memread(addr, &val, sizeof(val));
+    return le16_to_cpu(val);
+}
+
+static void writew(uint64_t addr, uint16_t val)
+{
+    val = cpu_to_le16(val);
+    memwrite(addr, &val, sizeof(val));
+}
+
+static void clear_mem(uint64_t addr, size_t size)
+{
+    void *zero = g_malloc0(size);
+
+    memwrite(addr, zero, size);
+    g_free(zero);
+}
+
+/*
+ * PCI
+ */
+
+static uint32_t pci_config_readl(int devfn, int offset)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (devfn << 8) | offset);
+    return inl(PCI_CONFIG_DATA);
+}
+
+static void pci_config_writel(int devfn, int offset, uint32_t val)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (devfn << 8) | offset);
+    outl(PCI_CONFIG_DATA, val);
+}
+
+/* Size the BAR and give it the next free, naturally aligned address */
+static uint32_t pci_map_bar(int devfn, int bar)
+{
+    int offset = PCI_BAR0 + bar * 4;
+    uint32_t val, size, addr;
+
+    pci_config_writel(devfn, offset, 0xffffffff);
+    val = pci_config_readl(devfn, offset);
+    g_assert(val != 0);
+
+    if (val & 1) {
+        size = ~(val & 0xfffc) + 1;
+        size &= 0xffff;
+        addr = (pci_io_next + size - 1) & ~(size - 1);
+        pci_io_next = addr + size;
+    } else {
+        size = ~(val & ~0xf) + 1;
+        addr = (pci_mem_next + size - 1) & ~(size - 1);
+        pci_mem_next = addr + size;
+    }
+    pci_config_writel(devfn, offset, addr);
+    return addr;
+}
+
+static void pci_enable(int devfn, uint16_t vendor, uint16_t device)
+{
+    uint32_t id = pci_config_readl(devfn, PCI_VENDOR_ID);
+
+    g_assert_cmphex(id, ==, vendor | (device << 16));
+    pci_config_writel(devfn, PCI_COMMAND, PCI_COMMAND_IO |
+                      PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+}
+
+static void bench_start(const char *extra_args)
+{
+    char *args = g_strdup_printf("-display none -net none %s", extra_args);
+
+    qtest_start(args);
+    g_free(args);
+    pci_io_next = PCI_IO_BASE;
+    pci_mem_next = PCI_MEM_BASE;
+}
+
+static void bench_end(void)
+{
+    qtest_quit(global_qtest);
+    global_qtest = NULL;
+}
+
+/*
+ * Raw dispatch: the POST port and the speaker port for PIO, the HPET for
+ * MMIO.  None of these accesses has side effects worth mentioning.
+ */
+
+#define HPET_BASE       0xfed00000
+#define HPET_CFG        0x010
+
+static void test_dispatch(void)
+{
+    GTimer *timer;
+    int i;
+
+    bench_start("");
+
+    timer = g_timer_new();
+    for (i = 0; i < MMIO_ROUNDS; i++) {
+        outb(0x80, i);
+    }
+    bench_report("pio-write", "accesses", MMIO_ROUNDS, timer);
+
+    g_timer_start(timer);
+    for (i = 0; i < MMIO_ROUNDS; i++) {
+        inb(0x61);
+    }
+    bench_report("pio-read", "accesses", MMIO_ROUNDS, timer);
+
+    g_timer_start(timer);
+    for (i = 0; i < MMIO_ROUNDS; i++) {
+        readl(HPET_BASE);
+    }
+    bench_report("mmio-read", "accesses", MMIO_ROUNDS, timer);
+
+    g_timer_start(timer);
+    for (i = 0; i < MMIO_ROUNDS; i++) {
+        writel(HPET_BASE + HPET_CFG, 0);
+    }
+    bench_report("mmio-write", "accesses", MMIO_ROUNDS, timer);
+    g_timer_destroy(timer);
+
+    bench_end();
+}
+
+/*
+ * virtio (legacy PCI interface, no features negotiated)
+ */
+
+#define VIRTIO_VENDOR_ID        0x1af4
+#define VIRTIO_NET_DEVICE_ID    0x1000
+#define VIRTIO_BLK_DEVICE_ID    0x1001
+
+#define VIRTIO_PCI_GUEST_FEATURES       4
+#define VIRTIO_PCI_QUEUE_PFN            8
+#define VIRTIO_PCI_QUEUE_NUM            12
+#define VIRTIO_PCI_QUEUE_SEL            14
+#define VIRTIO_PCI_QUEUE_NOTIFY         16
+#define VIRTIO_PCI_STATUS               18
+
+#define VIRTIO_STATUS_ACK       1
+#define VIRTIO_STATUS_DRIVER    2
+#define VIRTIO_STATUS_DRIVER_OK 4
+
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2
+#define VRING_ALIGN             4096
+
+typedef struct BenchVring {
+    uint16_t iobase;
+    uint16_t index;
+    uint16_t num;
+    uint16_t avail_idx;
+    uint64_t desc, avail, used;
+} BenchVring;
+
+static void vring_init(BenchVring *vr, uint16_t iobase, uint16_t index,
+                       uint64_t addr)
+{
+    vr->iobase = iobase;
+    vr->index = index;
+    vr->avail_idx = 0;
+
+    outw(iobase + VIRTIO_PCI_QUEUE_SEL, index);
+    vr->num = inw(iobase + VIRTIO_PCI_QUEUE_NUM);
+    g_assert(vr->num > 0);
+
+    vr->desc = addr;
+    vr->avail = addr + vr->num * 16;
+    vr->used = (vr->avail + 4 + vr->num * 2 + 2 + VRING_ALIGN - 1) &
+               ~(uint64_t)(VRING_ALIGN - 1);
+    clear_mem(addr, vr->used + 4 + vr->num * 8 + 2 - addr);
+    outl(iobase + VIRTIO_PCI_QUEUE_PFN, addr / VRING_ALIGN);
+}
+
+static void vring_set_desc(BenchVring *vr, int i, uint64_t addr,
+                           uint32_t len, uint16_t flags, uint16_t next)
+{
+    struct {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t flags;
+        uint16_t next;
+    } QEMU_PACKED desc = {
+        .addr = cpu_to_le64(addr),
+        .len = cpu_to_le32(len),
+        .flags = cpu_to_le16(flags),
+        .next = cpu_to_le16(next),
+    };
+
+    memwrite(vr->desc + i * sizeof(desc), &desc, sizeof(desc));
+}
+
+/* Make the n chains starting at heads[] available, kick, and wait for them */
+static void vring_run(BenchVring *vr, const uint16_t *heads, int n)
+{
+    uint16_t ring[n];
+    uint16_t first = vr->avail_idx % vr->num;
+    int i, part;
+
+    for (i = 0; i < n; i++) {
+        ring[i] = cpu_to_le16(heads[i]);
+    }
+    part = MIN(n, vr->num - first);
+    memwrite(vr->avail + 4 + first * 2, ring, part * 2);
+    if (part < n) {
+        memwrite(vr->avail + 4, ring + part, (n - part) * 2);
+    }
+    vr->avail_idx += n;
+    writew(vr->avail + 2, vr->avail_idx);
+
+    outw(vr->iobase + VIRTIO_PCI_QUEUE_NOTIFY, vr->index);
+    while (readw(vr->used + 2) != vr->avail_idx) {
+        /* completions arrive from the main loop, between qtest commands */
+    }
+}
+
+static uint16_t virtio_start(uint16_t device_id)
+{
+    uint16_t iobase;
+
+    iobase = pci_map_bar(DEV_DEVFN, 0);
+    pci_enable(DEV_DEVFN, VIRTIO_VENDOR_ID, device_id);
+
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+    outl(iobase + VIRTIO_PCI_GUEST_FEATURES, 0);
+    return iobase;
+}
+
+static void virtio_driver_ok(uint16_t iobase)
+{
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK |
+         VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+}
+
+#define VIRTIO_BLK_T_IN         0
+#define BLK_REQ_SIZE            4096
+
+static void test_virtio_blk(void)
+{
+    BenchVring vr;
+    GTimer *timer;
+    uint16_t *heads;
+    uint8_t *status;
+    int i, batch;
+    uint16_t iobase;
+
+    bench_start("-drive if=none,id=d0,file=null-co://,format=raw "
+                "-device virtio-blk-pci,drive=d0,addr=04.0");
+
+    iobase = virtio_start(VIRTIO_BLK_DEVICE_ID);
+    vring_init(&vr, iobase, 0, RING_BASE);
+    virtio_driver_ok(iobase);
+
+    /* header, data-in and status descriptors for each request */
+    batch = vr.num / 3;
+    heads = g_new(uint16_t, batch);
+    for (i = 0; i < batch; i++) {
+        uint64_t hdr = BUF_BASE + i * 32;
+        uint64_t data = BUF_BASE + 0x10000 + i * BLK_REQ_SIZE;
+        struct {
+            uint32_t type;
+            uint32_t ioprio;
+            uint64_t sector;
+        } QEMU_PACKED req = {
+            .type = cpu_to_le32(VIRTIO_BLK_T_IN),
+            .sector = cpu_to_le64(i * (BLK_REQ_SIZE / 512)),
+        };
+
+        memwrite(hdr, &req, sizeof(req));
+        vring_set_desc(&vr, i * 3, hdr, sizeof(req), VRING_DESC_F_NEXT,
+                       i * 3 + 1);
+        vring_set_desc(&vr, i * 3 + 1, data, BLK_REQ_SIZE,
+                       VRING_DESC_F_WRITE | VRING_DESC_F_NEXT, i * 3 + 2);
+        vring_set_desc(&vr, i * 3 + 2, hdr + 16, 1, VRING_DESC_F_WRITE, 0);
+        heads[i] = i * 3;
+    }
+
+    timer = g_timer_new();
+    for (i = 0; i < RING_ROUNDS; i++) {
+        vring_run(&vr, heads, batch);
+    }
+    bench_report("virtio-blk-read-4k", "requests", RING_ROUNDS * batch, timer);
+    g_timer_destroy(timer);
+
+    status = g_malloc(batch);
+    for (i = 0; i < batch; i++) {
+        memread(BUF_BASE + i * 32 + 16, &status[i], 1);
+        g_assert_cmpint(status[i], ==, 0);
+    }
+    g_free(status);
+    g_free(heads);
+
+    bench_end();
+}
+
+#define VIRTIO_NET_HDR_SIZE     10
+#define NET_FRAME_SIZE          64
+
+static void test_virtio_net(void)
+{
+    BenchVring vr;
+    GTimer *timer;
+    uint16_t *heads;
+    uint8_t frame[VIRTIO_NET_HDR_SIZE + NET_FRAME_SIZE];
+    int i, batch;
+    uint16_t iobase;
+
+    bench_start("-netdev null,id=n0 "
+                "-device virtio-net-pci,netdev=n0,addr=04.0");
+
+    iobase = virtio_start(VIRTIO_NET_DEVICE_ID);
+    vring_init(&vr, iobase, 1, RING_BASE);
+    virtio_driver_ok(iobase);
+
+    /* one descriptor per packet, virtio-net header included */
+    memset(frame, 0, sizeof(frame));
+    memset(frame + VIRTIO_NET_HDR_SIZE, 0xff, 6);
+    memwrite(BUF_BASE, frame, sizeof(frame));
+
+    batch = vr.num / 2;
+    heads = g_new(uint16_t, batch);
+    for (i = 0; i < batch; i++) {
+        vring_set_desc(&vr, i, BUF_BASE, sizeof(frame), 0, 0);
+        heads[i] = i;
+    }
+
+    timer = g_timer_new();
+    for (i = 0; i < RING_ROUNDS; i++) {
+        vring_run(&vr, heads, batch);
+    }
+    bench_report("virtio-net-tx-64", "packets", RING_ROUNDS * batch, timer);
+    g_timer_destroy(timer);
+    g_free(heads);
+
+    bench_end();
+}
+
+/*
+ * e1000 transmit
+ */
+
+#define E1000_VENDOR_ID         0x8086
+#define E1000_DEVICE_ID         0x100e
+
+#define E1000_TCTL              0x00400
+#define E1000_TDBAL             0x03800
+#define E1000_TDBAH             0x03804
+#define E1000_TDLEN             0x03808
+#define E1000_TDH               0x03810
+#define E1000_TDT               0x03818
+#define E1000_TCTL_EN           0x00000002
+#define E1000_TXD_CMD_EOP       0x01000000
+#define E1000_TXD_CMD_RS        0x08000000
+
+#define E1000_RING_SIZE         256
+#define E1000_BATCH             32
+
+static void test_e1000(void)
+{
+    GTimer *timer;
+    uint8_t frame[NET_FRAME_SIZE];
+    uint32_t mmio, tdt = 0;
+    int i;
+
+    bench_start("-netdev null,id=n0 -device e1000,netdev=n0,addr=04.0");
+
+    mmio = pci_map_bar(DEV_DEVFN, 0);
+    pci_enable(DEV_DEVFN, E1000_VENDOR_ID, E1000_DEVICE_ID);
+
+    memset(frame, 0, sizeof(frame));
+    memset(frame, 0xff, 6);
+    memwrite(BUF_BASE, frame, sizeof(frame));
+
+    /* legacy descriptors, all pointing at the same frame */
+    for (i = 0; i < E1000_RING_SIZE; i++) {
+        struct {
+            uint64_t buffer_addr;
+            uint32_t lower;
+            uint32_t upper;
+        } QEMU_PACKED desc = {
+            .buffer_addr = cpu_to_le64(BUF_BASE),
+            .lower = cpu_to_le32(E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS |
+                                 sizeof(frame)),
+        };
+
+        memwrite(RING_BASE + i * sizeof(desc), &desc, sizeof(desc));
+    }
+    writel(mmio + E1000_TDBAL, RING_BASE);
+    writel(mmio + E1000_TDBAH, 0);
+    writel(mmio + E1000_TDLEN, E1000_RING_SIZE * 16);
+    writel(mmio + E1000_TDH, 0);
+    writel(mmio + E1000_TDT, 0);
+    writel(mmio + E1000_TCTL, E1000_TCTL_EN);
+
+    /* the device processes the descriptors before the TDT write returns */
+    timer = g_timer_new();
+    for (i = 0; i < RING_ROUNDS * 10; i++) {
+        tdt = (tdt + E1000_BATCH) % E1000_RING_SIZE;
+        writel(mmio + E1000_TDT, tdt);
+    }
+    bench_report("e1000-tx-64", "descriptors",
+                 RING_ROUNDS * 10 * E1000_BATCH, timer);
+    g_timer_destroy(timer);
+    g_assert_cmpint(readl(mmio + E1000_TDH), ==, tdt);
+
+    bench_end();
+}
+
+/*
+ * VGA: a full refresh of a 1024x768x32 Bochs VBE mode, as done for
+ * screendump.  The PPM goes to /dev/null but is still formatted.
+ */
+
+#define VBE_DISPI_IOPORT_INDEX  0x1ce
+#define VBE_DISPI_IOPORT_DATA   0x1cf
+#define VBE_DISPI_INDEX_XRES    0x1
+#define VBE_DISPI_INDEX_YRES    0x2
+#define VBE_DISPI_INDEX_BPP     0x3
+#define VBE_DISPI_INDEX_ENABLE  0x4
+#define VBE_DISPI_ENABLED       0x01
+#define VBE_DISPI_LFB_ENABLED   0x40
+
+#define VGA_ROUNDS              50
+
+static void vbe_write(uint16_t index, uint16_t val)
+{
+    outw(VBE_DISPI_IOPORT_INDEX, index);
+    outw(VBE_DISPI_IOPORT_DATA, val);
+}
+
+static void test_vga(void)
+{
+    GTimer *timer;
+    int i;
+
+    bench_start("-vga std");
+
+    vbe_write(VBE_DISPI_INDEX_ENABLE, 0);
+    vbe_write(VBE_DISPI_INDEX_XRES, 1024);
+    vbe_write(VBE_DISPI_INDEX_YRES, 768);
+    vbe_write(VBE_DISPI_INDEX_BPP, 32);
+    vbe_write(VBE_DISPI_INDEX_ENABLE,
+              VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED);
+
+    timer = g_timer_new();
+    for (i = 0; i < VGA_ROUNDS; i++) {
+        qmp("{ 'execute': 'screendump',"
+            "  'arguments': { 'filename': '/dev/null' } }");
+    }
+    bench_report("vga-refresh-1024x768x32", "frames", VGA_ROUNDS, timer);
+    g_timer_destroy(timer);
+
+    bench_end();
+}
+
+#ifdef CONFIG_XEN_BACKEND
+/*
+ * Xen platform device and xenmou registers
+ */
+
+#define XEN_VENDOR_ID           0x5853
+#define XEN_PLATFORM_DEVICE_ID  0x0001
+#define XENMOU_DEVICE_ID        0xc110
+
+#define XEN_PLATFORM_IOPORT     0x10
+#define XEN_PLATFORM_MAGIC      0x49d2
+
+#define XMOU_MAGIC              0x00000
+#define XMOU_ISR                0x00110
+#define XMOU_MAGIC_VALUE        0x584d4f55
+
+static void test_xen_platform(void)
+{
+    GTimer *timer;
+    uint16_t bar;
+    int i;
+
+    bench_start("-device xen-platform,addr=04.0");
+
+    bar = pci_map_bar(DEV_DEVFN, 0);
+    pci_enable(DEV_DEVFN, XEN_VENDOR_ID, XEN_PLATFORM_DEVICE_ID);
+    g_assert_cmphex(inw(XEN_PLATFORM_IOPORT), ==, XEN_PLATFORM_MAGIC);
+
+    timer = g_timer_new();
+    for (i = 0; i < MMIO_ROUNDS; i++) {
+        inw(XEN_PLATFORM_IOPORT);
+    }
+    bench_report("xen-platform-fixed-read", "accesses", MMIO_ROUNDS, timer);
+
+    g_timer_start(timer);
+    for (i = 0; i < MMIO_ROUNDS; i++) {
+        inb(bar);
+    }
+    bench_report("xen-platform-bar-read", "accesses", MMIO_ROUNDS, timer);
+    g_timer_destroy(timer);
+
+    bench_end();
+}
+
+static void test_xenmou(void)
+{
+    GTimer *timer;
+    uint32_t mmio;
+    int i;
+
+    bench_start("-device xenmou,addr=04.0");
+
+    mmio = pci_map_bar(DEV_DEVFN, 0);
+    pci_enable(DEV_DEVFN, XEN_VENDOR_ID, XENMOU_DEVICE_ID);
+    g_assert_cmphex(readl(mmio + XMOU_MAGIC), ==, XMOU_MAGIC_VALUE);
+
+    timer = g_timer_new();
+    for (i = 0; i < MMIO_ROUNDS; i++) {
+        readl(mmio + XMOU_ISR);
+    }
+    bench_report("xenmou-reg-read", "accesses", MMIO_ROUNDS, timer);
+    g_timer_destroy(timer);
+
+    bench_end();
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/device-bench/dispatch", test_dispatch);
+    qtest_add_func("/device-bench/virtio-blk", test_virtio_blk);
+    qtest_add_func("/device-bench/virtio-net", test_virtio_net);
+    qtest_add_func("/device-bench/e1000", test_e1000);
+    qtest_add_func("/device-bench/vga", test_vga);
+#ifdef CONFIG_XEN_BACKEND
+    qtest_add_func("/device-bench/xen-platform", test_xen_platform);
+    qtest_add_func("/device-bench/xenmou", test_xenmou);
+#endif
+
+    return g_test_run();
+}
@@ -0,0 +1,110 @@
+/*
+ * QTest testcase and benchmark for physical address dispatch
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Every "read" and "write" qtest command goes through address_space_rw(),
+ * which looks up the section of each page it touches.  The benchmark,
+ * run with -m perf, times lookups that hit the same section over and over
+ * and lookups that jump between RAM, ROM and unassigned space, which is
+ * what the last-hit cache and the compacted map are meant to help.  The
+ * figures include the qtest round trip, so compare them against each
+ * other and against older builds, not as absolute costs.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+
+#define RAM_SIZE    (128 << 20)
+#define PAGE_SIZE   4096
+
+static void check_rw(uint64_t addr, size_t size)
+{
+    uint8_t *out = g_malloc(size), *in = g_malloc0(size);
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        out[i] = addr + i * 7;
+    }
+    memwrite(addr, out, size);
+    memread(addr, in, size);
+    g_assert(memcmp(in, out, size) == 0);
+
+    g_free(out);
+    g_free(in);
+}
+
+static void test_ram_rw(void)
+{
+    /* pages in the same section one after the other, and from either end
+       of RAM, so the cached section has to be checked and replaced */
+    check_rw(0x100000, 3 * PAGE_SIZE);
+    check_rw(0x100000 + PAGE_SIZE - 2, 4);
+    check_rw(RAM_SIZE - PAGE_SIZE, PAGE_SIZE);
+    check_rw(0x1000, 16);
+    check_rw(RAM_SIZE - 8, 8);
+    check_rw(0x9f000, PAGE_SIZE);
+}
+
+static void bench_lookups(const char *name, const uint64_t *addrs,
+                          int nb_addrs, int rounds)
+{
+    GTimer *timer = g_timer_new();
+    uint32_t val;
+    double secs;
+    int i, j;
+
+    for (i = 0; i < rounds; i++) {
+        for (j = 0; j < nb_addrs; j++) {
+            memread(addrs[j], &val, sizeof(val));
+        }
+    }
+    secs = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    g_test_message("%s: %.0f lookups/s", name,
+                   (double)rounds * nb_addrs / secs);
+}
+
+static void test_bench(void)
+{
+    static const uint64_t mixed[] = {
+        0x100000, 0xfffffff0, 0xa0000, 0x7ff0000, 0xe0000000, 0x2000,
+        0xfec00000, 0x4000000,
+    };
+    uint64_t same[G_N_ELEMENTS(mixed)];
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(same); i++) {
+        same[i] = 0x200000 + i * 64 * PAGE_SIZE;
+    }
+    bench_lookups("same section", same, G_N_ELEMENTS(same), 2000);
+    bench_lookups("mixed sections", mixed, G_N_ELEMENTS(mixed), 2000);
+}
+
+int main(int argc, char **argv)
+{
+    QTestState *s = NULL;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    s = qtest_start("-display none -m 128");
+
+    qtest_add_func("/phys-dispatch/ram-rw", test_ram_rw);
+    if (g_test_perf()) {
+        qtest_add_func("/phys-dispatch/bench", test_bench);
+    }
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+
+    return ret;
+}
@@ -0,0 +1,148 @@
+/*
+ *  Floating point speed test: runs add, sub, mul, div, sqrt and
+ *  multiply-add over arrays of single and double precision values and
+ *  prints a checksum and the time taken for each.  Compare the times of
+ *  a native run with a run under QEMU; the 'speed-fp' make target does
+ *  this.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+
+#define N       1024
+#define ROUNDS  2000
+
+enum { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_SQRT, OP_MULADD, OP_MAX };
+
+static const char *op_names[OP_MAX] = {
+    "add", "sub", "mul", "div", "sqrt", "muladd"
+};
+
+static float fa[N], fb[N], fc[N];
+static double da[N], db[N], dc[N];
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void init(void)
+{
+    volatile double third = 1.0;
+    int i;
+
+    /* Raise the inexact flag, as any real program soon does */
+    third /= 3.0;
+
+    /* Normal values only, results stay well away from overflow */
+    for (i = 0; i < N; i++) {
+        da[i] = fa[i] = 1.0 + (i % 97) / 64.0;
+        db[i] = fb[i] = 0.5 + (i % 89) / 128.0;
+        dc[i] = fc[i] = 0.0;
+    }
+}
+
+static float run_float(int op)
+{
+    float sum = 0;
+    int i, r;
+
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < N; i++) {
+            switch (op) {
+            case OP_ADD:
+                fc[i] = fa[i] + fb[i];
+                break;
+            case OP_SUB:
+                fc[i] = fa[i] - fb[i];
+                break;
+            case OP_MUL:
+                fc[i] = fa[i] * fb[i];
+                break;
+            case OP_DIV:
+                fc[i] = fa[i] / fb[i];
+                break;
+            case OP_SQRT:
+                fc[i] = sqrtf(fa[i]);
+                break;
+            case OP_MULADD:
+                fc[i] = fmaf(fa[i], fb[i], fc[i] * 0.5f);
+                break;
+            }
+        }
+    }
+    for (i = 0; i < N; i++) {
+        sum += fc[i];
+    }
+    return sum;
+}
+
+static double run_double(int op)
+{
+    double sum = 0;
+    int i, r;
+
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < N; i++) {
+            switch (op) {
+            case OP_ADD:
+                dc[i] = da[i] + db[i];
+                break;
+            case OP_SUB:
+                dc[i] = da[i] - db[i];
+                break;
+            case OP_MUL:
+                dc[i] = da[i] * db[i];
+                break;
+            case OP_DIV:
+                dc[i] = da[i] / db[i];
+                break;
+            case OP_SQRT:
+                dc[i] = sqrt(da[i]);
+                break;
+            case OP_MULADD:
+                dc[i] = fma(da[i], db[i], dc[i] * 0.5);
+                break;
+            }
+        }
+    }
+    for (i = 0; i < N; i++) {
+        sum += dc[i];
+    }
+    return sum;
+}
+
+int main(int argc, char **argv)
+{
+    double t;
+    int op;
+
+    init();
+    for (op = 0; op < OP_MAX; op++) {
+        t = now();
+        printf("float32 %-6s sum=%.6e", op_names[op], run_float(op));
+        printf(" %.3fs\n", now() - t);
+
+        t = now();
+        printf("float64 %-6s sum=%.15e", op_names[op], run_double(op));
+        printf(" %.3fs\n", now() - t);
+    }
+    return 0;
+}
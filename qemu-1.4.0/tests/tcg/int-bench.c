@@ -0,0 +1,161 @@
+/*
+ *  Integer speed test: runs loops dominated by loads, ALU operations and
+ *  compare-and-branch, the bread and butter of translated code, and prints
+ *  a checksum and the time taken for each.  It is meant mostly for the TCG
+ *  interpreter, where the cost of dispatching each operation shows up
+ *  directly.  Compare the times of a native run with a run under QEMU; the
+ *  'speed-int' make target does this.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define N       4096
+#define ROUNDS  2000
+
+static uint32_t data[N];
+static uint8_t sieve[N * 16];
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void init(void)
+{
+    uint32_t x = 12345;
+    int i;
+
+    for (i = 0; i < N; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = x >> 8;
+    }
+}
+
+/* Loads feeding add, xor, and, or */
+static uint32_t run_alu(void)
+{
+    uint32_t a = 0, b = 0, c = 0, d = 0;
+    int i, r;
+
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < N; i++) {
+            a += data[i];
+            b ^= data[i] + a;
+            c |= data[i] & b;
+            d -= data[i] ^ c;
+        }
+        c &= 0x0f0f0f0f;
+    }
+    return a ^ b ^ c ^ d;
+}
+
+/* A taken or not-taken branch after every load and compare */
+static uint32_t run_branch(void)
+{
+    uint32_t count = 0, limit;
+    int i, r;
+
+    for (r = 0; r < ROUNDS; r++) {
+        limit = 0x400000 + r * 16;
+        for (i = 0; i < N; i++) {
+            if (data[i] < limit) {
+                count++;
+            } else if (data[i] == limit) {
+                count += 2;
+            }
+        }
+    }
+    return count;
+}
+
+/* Binary search, branches that the host CPU cannot predict either */
+static uint32_t run_search(void)
+{
+    static uint32_t sorted[N];
+    uint32_t found = 0, key;
+    int i, r, lo, hi, mid;
+
+    for (i = 0; i < N; i++) {
+        sorted[i] = i * 3;
+    }
+    for (r = 0; r < ROUNDS * 64; r++) {
+        key = (r * 2654435761u) % (N * 3);
+        lo = 0;
+        hi = N - 1;
+        while (lo <= hi) {
+            mid = (lo + hi) / 2;
+            if (sorted[mid] == key) {
+                found++;
+                break;
+            } else if (sorted[mid] < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+    }
+    return found;
+}
+
+/* Sieve of Eratosthenes, byte loads and stores */
+static uint32_t run_sieve(void)
+{
+    uint32_t primes = 0;
+    int i, j, r;
+
+    for (r = 0; r < ROUNDS / 20; r++) {
+        memset(sieve, 1, sizeof(sieve));
+        primes = 0;
+        for (i = 2; i < sizeof(sieve); i++) {
+            if (sieve[i]) {
+                primes++;
+                for (j = i + i; j < sizeof(sieve); j += i) {
+                    sieve[j] = 0;
+                }
+            }
+        }
+    }
+    return primes;
+}
+
+static const struct {
+    const char *name;
+    uint32_t (*fn)(void);
+} tests[] = {
+    { "alu", run_alu },
+    { "branch", run_branch },
+    { "search", run_search },
+    { "sieve", run_sieve },
+};
+
+int main(int argc, char **argv)
+{
+    double t;
+    int i;
+
+    init();
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        t = now();
+        printf("%-6s sum=0x%08x", tests[i].name, tests[i].fn());
+        printf(" %.3fs\n", now() - t);
+    }
+    return 0;
+}
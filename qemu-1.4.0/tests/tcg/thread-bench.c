@@ -0,0 +1,100 @@
+/*
+ *  Threaded speed test: a rough stand-in for a parallel build.  Each
+ *  thread walks a table of many small distinct functions through
+ *  indirect calls, so that the run is dominated by TB lookups and by
+ *  translating new code, and allocates and frees small buffers like a
+ *  compiler does.  The same work is timed with 1, 2, 4 and 8 threads;
+ *  under QEMU the time should not grow much faster than natively.  The
+ *  'speed-threads' make target runs it both ways.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define MAX_THREADS 8
+#define ROUNDS      20000
+
+typedef unsigned (*step_fn)(unsigned);
+
+#define STEP(n) \
+    static unsigned step##n(unsigned x) { return (x * (2 * n + 1)) ^ (x >> (n % 13 + 1)); }
+#define STEP4(n) STEP(n##0) STEP(n##1) STEP(n##2) STEP(n##3)
+#define STEP16(n) STEP4(n##0) STEP4(n##1) STEP4(n##2) STEP4(n##3)
+
+STEP16(1) STEP16(2) STEP16(3) STEP16(4)
+
+#define REF(n) step##n,
+#define REF4(n) REF(n##0) REF(n##1) REF(n##2) REF(n##3)
+#define REF16(n) REF4(n##0) REF4(n##1) REF4(n##2) REF4(n##3)
+
+static const step_fn steps[] = {
+    REF16(1) REF16(2) REF16(3) REF16(4)
+};
+
+#define NSTEPS (sizeof(steps) / sizeof(steps[0]))
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *worker(void *opaque)
+{
+    unsigned x = (unsigned)(unsigned long)opaque;
+    int i, j;
+
+    for (i = 0; i < ROUNDS; i++) {
+        char *buf = malloc(64 + (x & 255));
+
+        for (j = 0; j < NSTEPS; j++) {
+            x = steps[x % NSTEPS](x + j);
+        }
+        memset(buf, x, 64);
+        x += buf[x & 63];
+        free(buf);
+    }
+    return (void *)(unsigned long)x;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[MAX_THREADS];
+    unsigned sum;
+    double start;
+    int n, i;
+
+    for (n = 1; n <= MAX_THREADS; n *= 2) {
+        sum = 0;
+        start = now();
+        for (i = 0; i < n; i++) {
+            pthread_create(&threads[i], NULL, worker,
+                           (void *)(unsigned long)(i + 1));
+        }
+        for (i = 0; i < n; i++) {
+            void *ret;
+
+            pthread_join(threads[i], &ret);
+            sum += (unsigned)(unsigned long)ret;
+        }
+        printf("%d threads: %08x %.3f s\n", n, sum, now() - start);
+    }
+    return 0;
+}
@@ -226,6 +226,32 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static void test_buffer_find_nonzero_offset(void)
+{
+    size_t len = 4096, unit;
+    uint8_t *buf = g_malloc0(len + sizeof(VECTYPE));
+    uint8_t *p = buf + sizeof(VECTYPE) - ((uintptr_t)buf % sizeof(VECTYPE));
+    size_t i;
+
+    unit = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE);
+    g_assert(can_use_buffer_find_nonzero_offset(p, len));
+    g_assert(!can_use_buffer_find_nonzero_offset(p + 1, len));
+    g_assert(!can_use_buffer_find_nonzero_offset(p, len - 1));
+
+    g_assert_cmpint(buffer_find_nonzero_offset(p, len), ==, len);
+    g_assert(buffer_is_zero(p, len));
+
+    for (i = 0; i < len; i += 37) {
+        p[i] = 1;
+        g_assert_cmpint(buffer_find_nonzero_offset(p, len), ==,
+                        i / unit * unit);
+        g_assert(!buffer_is_zero(p, len));
+        p[i] = 0;
+    }
+
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +272,8 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
 
     return g_test_run();
 }
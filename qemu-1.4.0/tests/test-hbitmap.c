@@ -369,6 +369,98 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *other;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L3, L2);
+
+    other = hbitmap_alloc(L3 * 2, 0);
+    hbitmap_set(other, L2 - 1, L3);
+    g_assert(hbitmap_merge(data->hb, other));
+    hbitmap_free(other);
+
+    /* Apply the same to the shadow bitmap, which also compares them */
+    hbitmap_test_set(data, L2 - 1, L3);
+
+    other = hbitmap_alloc(L3, 0);
+    g_assert(!hbitmap_merge(data->hb, other));
+    hbitmap_free(other);
+    hbitmap_test_check(data, 0);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    HBitmap *copy;
+    uint8_t *buf;
+    uint64_t len;
+
+    hbitmap_test_init(data, L2 + 5, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L2, 5);
+
+    len = hbitmap_serialization_size(data->hb);
+    g_assert_cmpint(len, ==, ((L2 + 5 + 63) / 64) * 8);
+    buf = g_malloc(len);
+    hbitmap_serialize(data->hb, buf);
+    g_assert_cmpint(buf[0], ==, 1);
+    g_assert_cmpint(buf[(L2 + 4) / 8], ==, 0x1f << (L2 % 8));
+
+    /* Garbage in the padding must not show up */
+    buf[len - 1] = 0xff;
+    copy = hbitmap_alloc(L2 + 5, 0);
+    hbitmap_deserialize(copy, buf);
+    g_free(buf);
+
+    hbitmap_free(data->hb);
+    data->hb = copy;
+    hbitmap_test_check(data, 0);
+    g_assert(hbitmap_get(copy, L2 + 4));
+}
+
+/* Not a correctness test: run with -m perf to time range operations,
+ * iteration and serialization on the dirty bitmap of a 2 TB disk with
+ * 64 KB chunks.
+ */
+static void test_hbitmap_perf(TestHBitmapData *data,
+                              const void *unused)
+{
+    const uint64_t size = 1ULL << 32;
+    uint64_t i;
+    uint8_t *buf;
+    HBitmapIter hbi;
+    int n = 0;
+
+    data->hb = hbitmap_alloc(size, 7);
+    g_test_timer_start();
+    for (i = 0; i < size; i += 1 << 20) {
+        hbitmap_set(data->hb, i, (1 << 20) - (1 << 12));
+    }
+    for (i = 0; i < size; i += 1 << 24) {
+        hbitmap_reset(data->hb, i + (1 << 16), 1 << 23);
+    }
+    g_test_minimized_result(g_test_timer_elapsed(), "set/reset");
+
+    g_test_timer_start();
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    while (hbitmap_iter_next(&hbi) >= 0) {
+        n++;
+    }
+    g_test_minimized_result(g_test_timer_elapsed(), "iterate %d bits", n);
+
+    g_test_timer_start();
+    buf = g_malloc(hbitmap_serialization_size(data->hb));
+    hbitmap_serialize(data->hb, buf);
+    hbitmap_deserialize(data->hb, buf);
+    g_free(buf);
+    g_test_minimized_result(g_test_timer_elapsed(), "serialize round trip");
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -395,6 +487,11 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
+    if (g_test_perf()) {
+        hbitmap_test_add("/hbitmap/perf", test_hbitmap_perf);
+    }
     g_test_run();
 
     return 0;
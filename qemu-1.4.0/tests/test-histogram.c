@@ -0,0 +1,113 @@
+/*
+ * Latency histogram unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/histogram.h"
+
+static void test_bins(void)
+{
+    LatencyHistogram *hist = latency_histogram_new(1000, 4, NULL);
+
+    latency_histogram_add(hist, -5);
+    latency_histogram_add(hist, 0);
+    latency_histogram_add(hist, 999);
+    latency_histogram_add(hist, 1000);
+    latency_histogram_add(hist, 1999);
+    latency_histogram_add(hist, 2000);
+    latency_histogram_add(hist, 3999);
+    /* everything from 4000 on lands in the last bin */
+    latency_histogram_add(hist, 4000);
+    latency_histogram_add(hist, 1000000000);
+    latency_histogram_add(hist, INT64_MAX);
+
+    g_assert_cmpint(hist->bins[0], ==, 3);
+    g_assert_cmpint(hist->bins[1], ==, 2);
+    g_assert_cmpint(hist->bins[2], ==, 2);
+    g_assert_cmpint(hist->bins[3], ==, 3);
+    latency_histogram_free(hist);
+}
+
+static void test_info(void)
+{
+    LatencyHistogram *hist = latency_histogram_new(500, 3, NULL);
+    LatencyHistogramInfo *info;
+    LatencyHistogramBinList *bin;
+    int64_t start[] = { 0, 500, 1000 };
+    int i = 0;
+
+    latency_histogram_add(hist, 700);
+    info = latency_histogram_info(hist);
+    g_assert_cmpint(info->min_ns, ==, 500);
+    for (bin = info->bins; bin; bin = bin->next, i++) {
+        g_assert_cmpint(i, <, 3);
+        g_assert_cmpint(bin->value->start_ns, ==, start[i]);
+        g_assert_cmpint(bin->value->count, ==, i == 1);
+    }
+    g_assert_cmpint(i, ==, 3);
+
+    qapi_free_LatencyHistogramInfo(info);
+    latency_histogram_free(hist);
+}
+
+static void test_percentile(void)
+{
+    LatencyHistogram *hist = latency_histogram_new(1000, 4, NULL);
+    int i;
+
+    g_assert_cmpint(latency_histogram_percentile(hist, 50), ==, 0);
+
+    for (i = 0; i < 90; i++) {
+        latency_histogram_add(hist, 500);
+    }
+    for (i = 0; i < 9; i++) {
+        latency_histogram_add(hist, 1500);
+    }
+    latency_histogram_add(hist, 5000);
+
+    g_assert_cmpint(latency_histogram_percentile(hist, 50), ==, 1000);
+    g_assert_cmpint(latency_histogram_percentile(hist, 90), ==, 1000);
+    g_assert_cmpint(latency_histogram_percentile(hist, 99), ==, 2000);
+    /* the last bin has no end */
+    g_assert_cmpint(latency_histogram_percentile(hist, 100), ==, 4000);
+    latency_histogram_free(hist);
+}
+
+static void test_invalid(void)
+{
+    Error *err = NULL;
+
+    g_assert(!latency_histogram_new(0, 8, &err));
+    g_assert(err);
+    error_free(err);
+    err = NULL;
+
+    g_assert(!latency_histogram_new(1000, 0, &err));
+    g_assert(err);
+    error_free(err);
+    err = NULL;
+
+    g_assert(!latency_histogram_new(1000, 65, &err));
+    g_assert(err);
+    error_free(err);
+    err = NULL;
+
+    /* the last bin would start at 1000 * 2^62 */
+    g_assert(!latency_histogram_new(1000, 64, &err));
+    g_assert(err);
+    error_free(err);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/histogram/bins", test_bins);
+    g_test_add_func("/histogram/info", test_info);
+    g_test_add_func("/histogram/percentile", test_percentile);
+    g_test_add_func("/histogram/invalid", test_invalid);
+    return g_test_run();
+}
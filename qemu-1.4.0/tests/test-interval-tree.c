@@ -0,0 +1,161 @@
+/*
+ * Interval tree unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/interval-tree.h"
+
+#define NODES        512
+#define SPACE        4096
+
+typedef struct {
+    IntervalTreeNode node;
+    bool in_tree;
+} TestInterval;
+
+/* reference answer: lowest start among the overlapping intervals */
+static TestInterval *find_slow(TestInterval *iv, int n,
+                               int64_t start, int64_t last)
+{
+    TestInterval *best = NULL;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!iv[i].in_tree ||
+            iv[i].node.start > last || iv[i].node.last < start) {
+            continue;
+        }
+        if (!best || iv[i].node.start < best->node.start) {
+            best = &iv[i];
+        }
+    }
+    return best;
+}
+
+static void check_queries(IntervalTree *tree, TestInterval *iv, int n)
+{
+    IntervalTreeNode *node;
+    TestInterval *expected;
+    int64_t start, last;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        start = g_test_rand_int_range(0, SPACE);
+        last = start + g_test_rand_int_range(0, 64);
+        node = interval_tree_find(tree, start, last);
+        expected = find_slow(iv, n, start, last);
+        if (!expected) {
+            g_assert(node == NULL);
+        } else {
+            /* another interval with the same start is just as good */
+            g_assert(node != NULL);
+            g_assert_cmpint(node->start, ==, expected->node.start);
+            g_assert(node->start <= last && node->last >= start);
+        }
+    }
+}
+
+static void test_empty(void)
+{
+    IntervalTree tree = {};
+
+    g_assert(interval_tree_empty(&tree));
+    g_assert(interval_tree_find(&tree, 0, INT64_MAX) == NULL);
+}
+
+static void test_basic(void)
+{
+    IntervalTree tree = {};
+    TestInterval a = { .node = { .start = 10, .last = 19 } };
+    TestInterval b = { .node = { .start = 30, .last = 39 } };
+
+    interval_tree_insert(&tree, &a.node);
+    interval_tree_insert(&tree, &b.node);
+
+    g_assert(interval_tree_find(&tree, 0, 9) == NULL);
+    g_assert(interval_tree_find(&tree, 0, 10) == &a.node);
+    g_assert(interval_tree_find(&tree, 19, 30) == &a.node);
+    g_assert(interval_tree_find(&tree, 20, 29) == NULL);
+    g_assert(interval_tree_find(&tree, 25, 35) == &b.node);
+    g_assert(interval_tree_find(&tree, 40, 100) == NULL);
+
+    interval_tree_remove(&tree, &a.node);
+    g_assert(interval_tree_find(&tree, 0, 100) == &b.node);
+    interval_tree_remove(&tree, &b.node);
+    g_assert(interval_tree_empty(&tree));
+}
+
+/* one long interval hidden under many short ones to its right */
+static void test_nested(void)
+{
+    IntervalTree tree = {};
+    TestInterval iv[NODES];
+    int i;
+
+    iv[0] = (TestInterval) { .node = { .start = 0, .last = SPACE } };
+    interval_tree_insert(&tree, &iv[0].node);
+    for (i = 1; i < NODES; i++) {
+        iv[i] = (TestInterval) { .node = { .start = i * 2, .last = i * 2 } };
+        interval_tree_insert(&tree, &iv[i].node);
+    }
+
+    g_assert(interval_tree_find(&tree, SPACE, SPACE) == &iv[0].node);
+    g_assert(interval_tree_find(&tree, 3, 3) == &iv[0].node);
+    interval_tree_remove(&tree, &iv[0].node);
+    g_assert(interval_tree_find(&tree, 3, 3) == NULL);
+    g_assert(interval_tree_find(&tree, 3, 4) == &iv[2].node);
+}
+
+static void test_random(void)
+{
+    IntervalTree tree = {};
+    TestInterval iv[NODES];
+    int i, round;
+
+    for (i = 0; i < NODES; i++) {
+        iv[i].node.start = g_test_rand_int_range(0, SPACE);
+        iv[i].node.last = iv[i].node.start + g_test_rand_int_range(0, 128);
+        iv[i].in_tree = true;
+        interval_tree_insert(&tree, &iv[i].node);
+    }
+    check_queries(&tree, iv, NODES);
+
+    /* churn, like requests completing and new ones being submitted */
+    for (round = 0; round < 2000; round++) {
+        i = g_test_rand_int_range(0, NODES);
+        if (iv[i].in_tree) {
+            interval_tree_remove(&tree, &iv[i].node);
+            iv[i].in_tree = false;
+        } else {
+            iv[i].node.start = g_test_rand_int_range(0, SPACE);
+            iv[i].node.last = iv[i].node.start +
+                              g_test_rand_int_range(0, 128);
+            interval_tree_insert(&tree, &iv[i].node);
+            iv[i].in_tree = true;
+        }
+        if (round % 100 == 0) {
+            check_queries(&tree, iv, NODES);
+        }
+    }
+
+    for (i = 0; i < NODES; i++) {
+        if (iv[i].in_tree) {
+            interval_tree_remove(&tree, &iv[i].node);
+        }
+    }
+    g_assert(interval_tree_empty(&tree));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/basic", test_basic);
+    g_test_add_func("/interval-tree/nested", test_nested);
+    g_test_add_func("/interval-tree/random", test_random);
+    return g_test_run();
+}
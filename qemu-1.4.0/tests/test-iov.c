@@ -145,6 +145,47 @@ static void test_to_from_buf(void)
     }
 }
 
+static void test_is_zero(void)
+{
+    unsigned niov, i, j;
+    struct iovec *iov;
+    size_t sz, pos;
+
+    for (i = 0; i < 100; ++i) {
+        iov_random(&iov, &niov);
+        sz = iov_size(iov, niov);
+        iov_memset(iov, niov, 0, 0, sz);
+        g_assert(iov_is_zero(iov, niov, 0, sz));
+
+        /* a single non-zero byte is found wherever it is, and only inside
+         * the checked range */
+        pos = g_test_rand_int_range(0, sz);
+        iov_memset(iov, niov, pos, 0x5a, 1);
+        g_assert(!iov_is_zero(iov, niov, 0, sz));
+        g_assert(!iov_is_zero(iov, niov, pos, -1));
+        g_assert(iov_is_zero(iov, niov, 0, pos));
+        g_assert(iov_is_zero(iov, niov, pos + 1, -1));
+
+        iov_free(iov, niov);
+    }
+
+    /* large and misaligned buffers go through buffer_is_zero() */
+    {
+        struct iovec big;
+        uint8_t *buf = g_malloc0(4096 + 3);
+
+        big.iov_base = buf + 3;
+        big.iov_len = 4096;
+        g_assert(iov_is_zero(&big, 1, 0, 4096));
+        for (j = 0; j < 4096; j += 511) {
+            buf[3 + j] = 1;
+            g_assert(!iov_is_zero(&big, 1, 0, 4096));
+            buf[3 + j] = 0;
+        }
+        g_free(buf);
+    }
+}
+
 static void test_io(void)
 {
 #ifndef _WIN32
@@ -398,13 +439,53 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_qiov_grow(void)
+{
+    static char buf[200];
+    QEMUIOVector qiov;
+    struct iovec *iov;
+    int i;
+
+    /* small vectors use the inline array */
+    qemu_iovec_init(&qiov, 1);
+    g_assert(qiov.iov == qiov.local_iov);
+
+    /* growing keeps the entries added so far */
+    for (i = 0; i < 100; i++) {
+        qemu_iovec_add(&qiov, buf + i, i + 1);
+        g_assert(qiov.niov <= qiov.nalloc);
+    }
+    g_assert(qiov.iov != qiov.local_iov);
+    g_assert_cmpint(qiov.niov, ==, 100);
+    g_assert_cmpint(qiov.size, ==, 100 * 101 / 2);
+    for (i = 0; i < 100; i++) {
+        g_assert(qiov.iov[i].iov_base == buf + i);
+        g_assert_cmpint(qiov.iov[i].iov_len, ==, i + 1);
+    }
+    qemu_iovec_destroy(&qiov);
+
+    /* arrays are rounded up to a size class and can be reused */
+    qemu_iovec_init(&qiov, 7);
+    g_assert_cmpint(qiov.nalloc, >=, 7);
+    iov = qiov.iov;
+    qemu_iovec_destroy(&qiov);
+    qemu_iovec_init(&qiov, 5);
+    g_assert_cmpint(qiov.nalloc, >=, 5);
+#ifdef __linux__
+    g_assert(qiov.iov == iov);
+#endif
+    qemu_iovec_destroy(&qiov);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_rand_int();
     g_test_add_func("/basic/iov/from-to-buf", test_to_from_buf);
+    g_test_add_func("/basic/iov/is-zero", test_is_zero);
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/qiov-grow", test_qiov_grow);
     return g_test_run();
 }
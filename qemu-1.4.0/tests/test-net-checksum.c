@@ -0,0 +1,113 @@
+/*
+ * Internet checksum unit tests and microbenchmark.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "net/checksum.h"
+
+/* The 32-bit partial sum of the portable version overflows past this */
+#define MAX_LEN      65536
+#define GUARD        64
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+/* The selected implementation may return a different partial sum than the
+ * portable one, but it must fold to the same checksum.
+ */
+static void check_sum(const uint8_t *buf, int len)
+{
+    uint8_t *copy = g_malloc(len + GUARD);
+
+    g_assert_cmpint(net_checksum_finish(net_checksum_add(len, (uint8_t *)buf)),
+                    ==, net_checksum_finish(net_checksum_add_c(len, buf)));
+
+    memset(copy, 0xaa, len + GUARD);
+    g_assert_cmpint(net_checksum_finish(net_checksum_add_copy(len, copy, buf)),
+                    ==, net_checksum_finish(net_checksum_add_c(len, buf)));
+    if (len > 0) {
+        g_assert(memcmp(copy, buf, len) == 0);
+    }
+    g_assert(copy[MAX(len, 0)] == 0xaa);
+
+    g_free(copy);
+}
+
+static void test_sum(void)
+{
+    uint8_t *buf = g_malloc(MAX_LEN + GUARD);
+    int len, off;
+
+    fill_random(buf, MAX_LEN + GUARD);
+    for (off = 0; off < 4; off++) {
+        for (len = 0; len <= 300; len++) {
+            check_sum(buf + off, len);
+        }
+    }
+    check_sum(buf, 1514);
+    check_sum(buf + 1, 65535);
+    check_sum(buf, MAX_LEN);
+
+    g_free(buf);
+}
+
+/* All ones is where carries out of the 16-bit lanes pile up fastest */
+static void test_sum_ones(void)
+{
+    uint8_t *buf = g_malloc(MAX_LEN);
+
+    memset(buf, 0xff, MAX_LEN);
+    check_sum(buf, 4096);
+    check_sum(buf + 3, 65533);
+    check_sum(buf, MAX_LEN);
+
+    g_free(buf);
+}
+
+static void perf_sum(void)
+{
+    int loops = 20000, len = 65536, i;
+    uint8_t *buf = g_malloc(len);
+    double c, accel;
+
+    fill_random(buf, len);
+    g_test_timer_start();
+    for (i = 0; i < loops; i++) {
+        net_checksum_add_c(len, buf);
+    }
+    c = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < loops; i++) {
+        net_checksum_add(len, buf);
+    }
+    accel = g_test_timer_elapsed();
+
+    g_test_message("%d sums of %d bytes, c %f s, %s %f s (%.1fx)\n",
+                   loops, len, c, net_checksum_accel_name(), accel,
+                   c / accel);
+
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net-checksum/sum", test_sum);
+    g_test_add_func("/net-checksum/sum-ones", test_sum_ones);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/net-checksum/sum", perf_sum);
+    }
+    return g_test_run();
+}
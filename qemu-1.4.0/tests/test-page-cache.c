@@ -0,0 +1,120 @@
+/*
+ * Page cache unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define PAGES     64
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, (addr / PAGE_SIZE) & 0xff, PAGE_SIZE);
+}
+
+static bool check_page(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data = get_cached_data(cache, addr);
+
+    fill_page(page, addr);
+    return data && memcmp(data, page, PAGE_SIZE) == 0;
+}
+
+static void test_insert(void)
+{
+    PageCache *cache = cache_init(PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    for (addr = 0; addr < PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        cache_insert(cache, addr, page);
+    }
+    /* the data was copied */
+    memset(page, 0xff, PAGE_SIZE);
+
+    for (addr = 0; addr < PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+        g_assert(check_page(cache, addr));
+    }
+    g_assert(!cache_is_cached(cache, PAGES * PAGE_SIZE));
+    g_assert(get_cached_data(cache, PAGES * PAGE_SIZE) == NULL);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+/* pages that map to the same set share it instead of evicting each other */
+static void test_collision(void)
+{
+    PageCache *cache = cache_init(PAGES, PAGE_SIZE);
+    uint64_t a = 0, b = PAGES * PAGE_SIZE, c = 2 * PAGES * PAGE_SIZE;
+    uint8_t page[PAGE_SIZE];
+
+    fill_page(page, a);
+    cache_insert(cache, a, page);
+    fill_page(page, b);
+    cache_insert(cache, b, page);
+    g_assert(check_page(cache, a));
+    g_assert(check_page(cache, b));
+
+    /* a was used last, so b goes */
+    g_assert(check_page(cache, a));
+    fill_page(page, c);
+    cache_insert(cache, c, page);
+    g_assert(cache_is_cached(cache, a));
+    g_assert(!cache_is_cached(cache, b));
+    g_assert(check_page(cache, c));
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+    int n;
+
+    for (addr = 0; addr < PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        cache_insert(cache, addr, page);
+    }
+
+    /* growing keeps everything */
+    g_assert_cmpint(cache_resize(cache, PAGES * 4), ==, PAGES * 4);
+    for (addr = 0; addr < PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(check_page(cache, addr));
+    }
+
+    /* shrinking keeps as much as fits */
+    g_assert_cmpint(cache_resize(cache, PAGES / 2), ==, PAGES / 2);
+    n = 0;
+    for (addr = 0; addr < PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (cache_is_cached(cache, addr)) {
+            g_assert(check_page(cache, addr));
+            n++;
+        }
+    }
+    g_assert_cmpint(n, ==, PAGES / 2);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert", test_insert);
+    g_test_add_func("/page-cache/collision", test_collision);
+    g_test_add_func("/page-cache/resize", test_resize);
+    return g_test_run();
+}
@@ -0,0 +1,112 @@
+/*
+ * Parallel page compression unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page_compress.h"
+
+#define PAGE_SIZE    4096
+#define THREADS      3
+#define BATCH        16
+
+static void fill_page(uint8_t *page, int i)
+{
+    int j;
+
+    if (i % 4 == 0) {
+        /* random data does not shrink */
+        for (j = 0; j < PAGE_SIZE; j++) {
+            page[j] = g_test_rand_int();
+        }
+    } else {
+        memset(page, 0, PAGE_SIZE);
+        for (j = 0; j < PAGE_SIZE; j += 64 * i) {
+            page[j] = i;
+        }
+    }
+}
+
+static void test_roundtrip(void)
+{
+    PageCompressPool *c = page_compress_pool_new(THREADS, BATCH, PAGE_SIZE, 1);
+    PageCompressPool *d = page_compress_pool_new(THREADS, BATCH, PAGE_SIZE, 0);
+    uint8_t *src = g_malloc(BATCH * PAGE_SIZE);
+    uint8_t *dst = g_malloc0(BATCH * PAGE_SIZE);
+    PageCompressJob *job, *out;
+    int i, round;
+
+    for (round = 0; round < 4; round++) {
+        for (i = 0; i < BATCH; i++) {
+            fill_page(src + i * PAGE_SIZE, i + round);
+            job = page_compress_get(c);
+            g_assert(job != NULL);
+            job->offset = i;
+            memcpy(job->page, src + i * PAGE_SIZE, PAGE_SIZE);
+        }
+        g_assert(page_compress_full(c));
+        g_assert(page_compress_get(c) == NULL);
+        g_assert_cmpint(page_compress_run(c), ==, 0);
+
+        for (i = 0; i < page_compress_count(c); i++) {
+            job = page_compress_job(c, i);
+            g_assert_cmpint(job->offset, ==, i);
+            if ((i + round) % 4 == 0) {
+                g_assert_cmpint(job->len, ==, 0);
+                memcpy(dst + i * PAGE_SIZE, job->page, PAGE_SIZE);
+                continue;
+            }
+            g_assert_cmpint(job->len, >, 0);
+            g_assert_cmpint(job->len, <, PAGE_SIZE);
+
+            out = page_compress_get(d);
+            out->page = dst + i * PAGE_SIZE;
+            out->len = job->len;
+            memcpy(out->data, job->data, job->len);
+        }
+        page_compress_reset(c);
+        g_assert_cmpint(page_compress_run(d), ==, 0);
+        page_compress_reset(d);
+
+        g_assert(memcmp(src, dst, BATCH * PAGE_SIZE) == 0);
+    }
+
+    g_free(src);
+    g_free(dst);
+    page_compress_pool_free(c);
+    page_compress_pool_free(d);
+}
+
+static void test_corrupt(void)
+{
+    PageCompressPool *d = page_compress_pool_new(THREADS, BATCH, PAGE_SIZE, 0);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    PageCompressJob *job;
+
+    job = page_compress_get(d);
+    job->page = dst;
+    job->len = 16;
+    memset(job->data, 0xa5, job->len);
+    g_assert_cmpint(page_compress_run(d), ==, -1);
+    g_assert_cmpint(page_compress_job(d, 0)->ret, ==, -1);
+    page_compress_reset(d);
+
+    /* an empty batch is a no-op */
+    g_assert_cmpint(page_compress_count(d), ==, 0);
+    g_assert_cmpint(page_compress_run(d), ==, 0);
+
+    g_free(dst);
+    page_compress_pool_free(d);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-compress/roundtrip", test_roundtrip);
+    g_test_add_func("/page-compress/corrupt", test_corrupt);
+    return g_test_run();
+}
@@ -0,0 +1,127 @@
+/*
+ * Pixel format conversion unit tests and microbenchmark.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/pixel-conv.h"
+
+#define MAX_WIDTH    1920
+#define GUARD        64
+
+typedef struct {
+    const char *name;
+    PixelConvFunc **func;
+    PixelConvFunc *ref;
+    int src_bpp;
+} ConvTest;
+
+static const ConvTest conv_tests[] = {
+    { "8_to_32", &pixel_conv_8_to_32, pixel_conv_8_to_32_c, 1 },
+    { "15_to_32", &pixel_conv_15_to_32, pixel_conv_15_to_32_c, 2 },
+    { "16_to_32", &pixel_conv_16_to_32, pixel_conv_16_to_32_c, 2 },
+    { "24_to_32", &pixel_conv_24_to_32, pixel_conv_24_to_32_c, 3 },
+    { "32_to_32bgr", &pixel_conv_32_to_32bgr, pixel_conv_32_to_32bgr_c, 4 },
+};
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+/* Compare the selected implementation against the portable one for every
+ * width up to a few vector blocks, and at a few unaligned offsets, and
+ * check that nothing is written past the end of the line.
+ */
+static void test_conv(gconstpointer opaque)
+{
+    const ConvTest *t = opaque;
+    size_t src_len = MAX_WIDTH * t->src_bpp + GUARD;
+    size_t dst_len = MAX_WIDTH * 4 + GUARD;
+    uint8_t *src = g_malloc(src_len);
+    uint8_t *out = g_malloc(dst_len);
+    uint8_t *ref = g_malloc(dst_len);
+    int width, off;
+
+    fill_random(src, src_len);
+    for (off = 0; off < 4; off++) {
+        for (width = 1; width <= 128; width++) {
+            memset(out, 0xaa, dst_len);
+            memset(ref, 0xaa, dst_len);
+            (*t->func)(out + off * 4, src + off, width);
+            t->ref(ref + off * 4, src + off, width);
+            g_assert(memcmp(out, ref, dst_len) == 0);
+        }
+    }
+
+    memset(out, 0xaa, dst_len);
+    memset(ref, 0xaa, dst_len);
+    (*t->func)(out, src, MAX_WIDTH);
+    t->ref(ref, src, MAX_WIDTH);
+    g_assert(memcmp(out, ref, dst_len) == 0);
+
+    g_free(src);
+    g_free(out);
+    g_free(ref);
+}
+
+static double perf_one(PixelConvFunc *f, uint8_t *dst, const uint8_t *src,
+                       int lines)
+{
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < lines; i++) {
+        f(dst, src, MAX_WIDTH);
+    }
+    return g_test_timer_elapsed();
+}
+
+static void perf_conv(gconstpointer opaque)
+{
+    const ConvTest *t = opaque;
+    int lines = 200000;
+    uint8_t *src = g_malloc(MAX_WIDTH * t->src_bpp);
+    uint8_t *dst = g_malloc(MAX_WIDTH * 4);
+    double c, accel;
+
+    fill_random(src, MAX_WIDTH * t->src_bpp);
+    c = perf_one(t->ref, dst, src, lines);
+    accel = perf_one(*t->func, dst, src, lines);
+
+    g_test_message("%s: %d lines of %d pixels, c %f s, %s %f s (%.1fx)\n",
+                   t->name, lines, MAX_WIDTH, c, pixel_conv_accel_name(),
+                   accel, c / accel);
+
+    g_free(src);
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    char *path;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(conv_tests); i++) {
+        path = g_strdup_printf("/pixel-conv/%s", conv_tests[i].name);
+        g_test_add_data_func(path, &conv_tests[i], test_conv);
+        g_free(path);
+    }
+    if (g_test_perf()) {
+        for (i = 0; i < ARRAY_SIZE(conv_tests); i++) {
+            path = g_strdup_printf("/perf/pixel-conv/%s", conv_tests[i].name);
+            g_test_add_data_func(path, &conv_tests[i], perf_conv);
+            g_free(path);
+        }
+    }
+    return g_test_run();
+}
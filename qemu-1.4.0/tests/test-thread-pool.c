@@ -139,6 +139,58 @@ static void test_submit_many(void)
     }
 }
 
+static void pool_stats_cb(const char *name, int min_threads, int max_threads,
+                          const ThreadPoolStats *stats, void *opaque)
+{
+    ThreadPoolStats *out = opaque;
+
+    if (!strcmp(name, "test")) {
+        *out = *stats;
+    }
+}
+
+static void test_submit_pool(void)
+{
+    WorkerTestData data[20];
+    ThreadPoolStats stats;
+    ThreadPool *pool;
+    Error *err = NULL;
+    int i;
+
+    pool = thread_pool_new("test", 1, 2, NULL, -1, &err);
+    g_assert(pool != NULL);
+    g_assert(!error_is_set(&err));
+    g_assert(thread_pool_find("test") == pool);
+
+    /* names are unique */
+    g_assert(thread_pool_new("test", 0, 1, NULL, -1, &err) == NULL);
+    g_assert(error_is_set(&err));
+    error_free(err);
+    err = NULL;
+
+    for (i = 0; i < 20; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio_pool(pool, worker_cb, &data[i],
+                                    done_cb, &data[i]);
+    }
+
+    active = 20;
+    while (active > 0) {
+        qemu_aio_wait();
+    }
+    for (i = 0; i < 20; i++) {
+        g_assert_cmpint(data[i].n, ==, 1);
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+
+    thread_pool_foreach(pool_stats_cb, &stats);
+    g_assert_cmpint(stats.submitted, ==, 20);
+    g_assert_cmpint(stats.completed, ==, 20);
+    g_assert_cmpint(stats.in_flight, ==, 0);
+    g_assert_cmpint(stats.max_in_flight, >=, 1);
+}
+
 static void test_cancel(void)
 {
     WorkerTestData data[100];
@@ -219,6 +271,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/submit-pool", test_submit_pool);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     return g_test_run();
 }
@@ -179,8 +179,105 @@ static void test_encode_decode(void)
     }
 }
 
+/* A page where a few scattered spans changed, as after typical guest
+ * writes; @spans and @max_len control how dirty it is.
+ */
+static void make_delta(uint8_t *old, uint8_t *new, int spans, int max_len)
+{
+    int i, j, start, len;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, PAGE_SIZE);
+    for (i = 0; i < spans; i++) {
+        start = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_len + 1);
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            new[j] = ~old[j];
+        }
+    }
+}
+
+/* the vector encoders must produce exactly the portable encoder's output */
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *ref = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    int i, dlen, ref_len, out_len;
+
+    for (i = 0; i < 10000; i++) {
+        make_delta(old, new, g_test_rand_int_range(0, 64),
+                   g_test_rand_int_range(1, 256));
+        dlen = g_test_rand_int_range(0, PAGE_SIZE + 1);
+        ref_len = xbzrle_encode_buffer_c(old, new, PAGE_SIZE, ref, dlen);
+        out_len = xbzrle_encode_buffer(old, new, PAGE_SIZE, out, dlen);
+        g_assert_cmpint(out_len, ==, ref_len);
+        if (ref_len > 0) {
+            g_assert(memcmp(out, ref, ref_len) == 0);
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(out);
+}
+
+typedef struct {
+    const char *name;
+    int spans;
+    int max_len;
+} DeltaPerf;
+
+static const DeltaPerf delta_perfs[] = {
+    { "sparse", 4, 8 },
+    { "medium", 32, 32 },
+    { "dense", 128, 16 },
+};
+
+static double perf_one(int (*encode)(uint8_t *, uint8_t *, int,
+                                     uint8_t *, int),
+                       uint8_t *old, uint8_t *new, uint8_t *dst, int pages)
+{
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < pages; i++) {
+        encode(old, new, PAGE_SIZE, dst, PAGE_SIZE);
+    }
+    return g_test_timer_elapsed();
+}
+
+static void perf_encode(gconstpointer opaque)
+{
+    const DeltaPerf *t = opaque;
+    int pages = 200000;
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    double c, accel;
+
+    make_delta(old, new, t->spans, t->max_len);
+    c = perf_one(xbzrle_encode_buffer_c, old, new, dst, pages);
+    accel = perf_one(xbzrle_encode_buffer, old, new, dst, pages);
+
+    g_test_message("%s: %d pages, c %f s, %s %f s (%.1fx)\n",
+                   t->name, pages, c, xbzrle_encode_accel_name(),
+                   accel, c / accel);
+
+    g_free(old);
+    g_free(new);
+    g_free(dst);
+}
+
 int main(int argc, char **argv)
 {
+    char *path;
+    int i;
+
     g_test_init(&argc, &argv, NULL);
     g_test_rand_int();
     g_test_add_func("/xbzrle/uleb", test_uleb);
@@ -191,6 +288,14 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    if (g_test_perf()) {
+        for (i = 0; i < ARRAY_SIZE(delta_perfs); i++) {
+            path = g_strdup_printf("/perf/xbzrle/%s", delta_perfs[i].name);
+            g_test_add_data_func(path, &delta_perfs[i], perf_encode);
+            g_free(path);
+        }
+    }
 
     return g_test_run();
 }
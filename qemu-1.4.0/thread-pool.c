@@ -23,8 +23,10 @@
 #include "block/block_int.h"
 #include "qemu/event_notifier.h"
 #include "block/thread-pool.h"
-
-static void do_spawn_thread(void);
+#include "qemu/timer.h"
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 typedef struct ThreadPoolElement ThreadPoolElement;
 
@@ -32,71 +34,213 @@ enum ThreadState {
     THREAD_QUEUED,
     THREAD_ACTIVE,
     THREAD_DONE,
-    THREAD_CANCELED,
+    THREAD_CANCELED,    /* cancelled while queued, still in the ring */
+    THREAD_ABANDONED,   /* cancelled and out of the ring, can be freed */
 };
 
 struct ThreadPoolElement {
     BlockDriverAIOCB common;
+    ThreadPool *pool;
     ThreadPoolFunc *func;
     void *arg;
+    int64_t submit_ns;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* State leaves THREAD_QUEUED with a compare-and-swap, either by the
+     * worker that dequeues the element or by thread_pool_cancel().  After
+     * that, only the worker thread can write to it.  Reads and writes of
+     * state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Requests that did not fit in the ring wait here.  Only the main
+     * loop touches this list.  */
+    bool overflow;
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
-static EventNotifier notifier;
-static QemuMutex lock;
-static QemuCond check_cancel;
-static QemuSemaphore sem;
-static int max_threads = 64;
-static QEMUBH *new_thread_bh;
-
-/* The following variables are protected by the global mutex.  */
-static QLIST_HEAD(, ThreadPoolElement) head;
-
-/* The following variables are protected by lock.  */
-static QTAILQ_HEAD(, ThreadPoolElement) request_list;
-static int cur_threads;
-static int idle_threads;
-static int new_threads;     /* backlog of threads we need to create */
-static int pending_threads; /* threads created but not running yet */
-static int pending_cancellations; /* whether we need a cond_broadcast */
-
-static void *worker_thread(void *unused)
+/* Bounded multi-producer, multi-consumer queue: a slot can be filled when
+ * its sequence number equals the enqueue position, and emptied when it is
+ * one more than the dequeue position.  Positions only ever grow.
+ */
+#define THREAD_POOL_RING_SIZE 1024
+
+typedef struct ThreadPoolSlot {
+    volatile unsigned long seq;
+    ThreadPoolElement *elem;
+} ThreadPoolSlot;
+
+struct ThreadPool {
+    char *name;
+    EventNotifier notifier;
+    QemuMutex lock;
+    QemuCond check_cancel;
+    QemuSemaphore sem;
+    int min_threads;
+    int max_threads;
+    QEMUBH *new_thread_bh;
+#ifdef __linux__
+    bool has_cpus;
+    cpu_set_t cpus;
+#endif
+
+    /* The following variables are protected by the global mutex.  */
+    QLIST_HEAD(, ThreadPoolElement) head;
+    QTAILQ_HEAD(, ThreadPoolElement) overflow;
+    ThreadPoolStats stats;
+    QTAILQ_ENTRY(ThreadPool) next;
+
+    /* Lock-free request queue, see thread_pool_ring_push/pop.  */
+    ThreadPoolSlot ring[THREAD_POOL_RING_SIZE];
+    volatile unsigned long ring_head;
+    volatile unsigned long ring_tail;
+
+    /* Updated atomically.  */
+    volatile int idle_threads;
+    volatile int completions;   /* since the main loop last looked */
+
+    /* The following variables are protected by lock.  */
+    int cur_threads;
+    int new_threads;     /* backlog of threads we need to create */
+    int pending_threads; /* threads created but not running yet */
+    volatile int pending_cancellations; /* whether we need a cond_broadcast */
+};
+
+static ThreadPool *default_pool;
+static QTAILQ_HEAD(, ThreadPool) pools = QTAILQ_HEAD_INITIALIZER(pools);
+
+static void do_spawn_thread(ThreadPool *pool);
+
+static bool thread_pool_ring_push(ThreadPool *pool, ThreadPoolElement *req)
+{
+    unsigned long pos = pool->ring_head;
+    ThreadPoolSlot *slot;
+
+    for (;;) {
+        long diff;
+
+        slot = &pool->ring[pos % THREAD_POOL_RING_SIZE];
+        diff = (long)(slot->seq - pos);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&pool->ring_head, pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;   /* full */
+        }
+        pos = pool->ring_head;
+    }
+
+    slot->elem = req;
+    /* Write elem before publishing the slot.  */
+    smp_wmb();
+    slot->seq = pos + 1;
+    return true;
+}
+
+static ThreadPoolElement *thread_pool_ring_pop(ThreadPool *pool)
+{
+    unsigned long pos = pool->ring_tail;
+    ThreadPoolSlot *slot;
+    ThreadPoolElement *req;
+
+    for (;;) {
+        long diff;
+
+        slot = &pool->ring[pos % THREAD_POOL_RING_SIZE];
+        diff = (long)(slot->seq - (pos + 1));
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&pool->ring_tail, pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;    /* empty */
+        }
+        pos = pool->ring_tail;
+    }
+
+    req = slot->elem;
+    /* Read elem before handing the slot back to producers.  */
+    smp_mb();
+    slot->seq = pos + THREAD_POOL_RING_SIZE;
+    return req;
+}
+
+/* Only the first completion since the main loop last looked writes to
+ * the event notifier.  */
+static void thread_pool_notify(ThreadPool *pool)
 {
-    qemu_mutex_lock(&lock);
-    pending_threads--;
-    do_spawn_thread();
+    if (__sync_fetch_and_add(&pool->completions, 1) == 0) {
+        event_notifier_set(&pool->notifier);
+    }
+}
+
+/* Called by a worker after an idle timeout.  */
+static bool thread_pool_worker_exit(ThreadPool *pool)
+{
+    bool stop = false;
+
+    qemu_mutex_lock(&pool->lock);
+    if (pool->cur_threads > pool->min_threads &&
+        pool->ring[pool->ring_tail % THREAD_POOL_RING_SIZE].seq !=
+        pool->ring_tail + 1) {
+        pool->cur_threads--;
+        stop = true;
+    }
+    qemu_mutex_unlock(&pool->lock);
+    return stop;
+}
+
+static void *worker_thread(void *opaque)
+{
+    ThreadPool *pool = opaque;
+
+#ifdef __linux__
+    if (pool->has_cpus) {
+        sched_setaffinity(0, sizeof(pool->cpus), &pool->cpus);
+    }
+#endif
+
+    qemu_mutex_lock(&pool->lock);
+    pool->pending_threads--;
+    do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
     while (1) {
         ThreadPoolElement *req;
-        int ret;
-
-        do {
-            idle_threads++;
-            qemu_mutex_unlock(&lock);
-            ret = qemu_sem_timedwait(&sem, 10000);
-            qemu_mutex_lock(&lock);
-            idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&request_list));
-        if (ret == -1) {
-            break;
+        int ret = 0;
+
+        req = thread_pool_ring_pop(pool);
+        if (!req) {
+            /* Count as idle before looking again, so that a submitter
+             * either sees us idle and posts the semaphore, or we see its
+             * request.  Both sides go through a full barrier.
+             */
+            __sync_fetch_and_add(&pool->idle_threads, 1);
+            req = thread_pool_ring_pop(pool);
+            if (!req) {
+                ret = qemu_sem_timedwait(&pool->sem, 10000);
+            }
+            __sync_fetch_and_sub(&pool->idle_threads, 1);
+            if (!req) {
+                if (ret == -1 && thread_pool_worker_exit(pool)) {
+                    break;
+                }
+                continue;
+            }
         }
 
-        req = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&lock);
+        if (!__sync_bool_compare_and_swap(&req->state, THREAD_QUEUED,
+                                          THREAD_ACTIVE)) {
+            /* thread_pool_cancel() got there first; let the main loop
+             * free the element.  */
+            req->state = THREAD_ABANDONED;
+            thread_pool_notify(pool);
+            continue;
+        }
 
         ret = req->func(req->arg);
 
@@ -105,45 +249,48 @@ static void *worker_thread(void *unused)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&lock);
-        if (pending_cancellations) {
-            qemu_cond_broadcast(&check_cancel);
+        /* Write state before checking for waiters.  */
+        smp_mb();
+        if (pool->pending_cancellations) {
+            qemu_mutex_lock(&pool->lock);
+            qemu_cond_broadcast(&pool->check_cancel);
+            qemu_mutex_unlock(&pool->lock);
         }
 
-        event_notifier_set(&notifier);
+        thread_pool_notify(pool);
     }
 
-    cur_threads--;
-    qemu_mutex_unlock(&lock);
     return NULL;
 }
 
-static void do_spawn_thread(void)
+static void do_spawn_thread(ThreadPool *pool)
 {
     QemuThread t;
 
     /* Runs with lock taken.  */
-    if (!new_threads) {
+    if (!pool->new_threads) {
         return;
     }
 
-    new_threads--;
-    pending_threads++;
+    pool->new_threads--;
+    pool->pending_threads++;
 
-    qemu_thread_create(&t, worker_thread, NULL, QEMU_THREAD_DETACHED);
+    qemu_thread_create(&t, worker_thread, pool, QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
 {
-    qemu_mutex_lock(&lock);
-    do_spawn_thread();
-    qemu_mutex_unlock(&lock);
+    ThreadPool *pool = opaque;
+
+    qemu_mutex_lock(&pool->lock);
+    do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 }
 
-static void spawn_thread(void)
+static void spawn_thread(ThreadPool *pool)
 {
-    cur_threads++;
-    new_threads++;
+    pool->cur_threads++;
+    pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
      * starving the current vcpu.
@@ -151,24 +298,70 @@ static void spawn_thread(void)
      * If there are no idle threads, ask the main thread to create one, so we
      * inherit the correct affinity instead of the vcpu affinity.
      */
-    if (!pending_threads) {
-        qemu_bh_schedule(new_thread_bh);
+    if (!pool->pending_threads) {
+        qemu_bh_schedule(pool->new_thread_bh);
+    }
+}
+
+/* Wake up a worker for a request that was just queued in the ring.  */
+static void thread_pool_kick(ThreadPool *pool)
+{
+    /* Pairs with the idle_threads increment in worker_thread().  */
+    smp_mb();
+    if (pool->idle_threads > 0) {
+        qemu_sem_post(&pool->sem);
+        return;
+    }
+
+    /* cur_threads can only be trusted under the lock: a worker that timed
+     * out may be about to leave.  Either it takes the lock first and we see
+     * it gone, or it sees our request in the ring and stays.  */
+    qemu_mutex_lock(&pool->lock);
+    if (pool->cur_threads < pool->max_threads) {
+        spawn_thread(pool);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/* Move requests that did not fit into the ring, oldest first.  */
+static void thread_pool_refill(ThreadPool *pool)
+{
+    ThreadPoolElement *req;
+
+    while ((req = QTAILQ_FIRST(&pool->overflow)) != NULL) {
+        QTAILQ_REMOVE(&pool->overflow, req, reqs);
+        req->overflow = false;
+        if (!thread_pool_ring_push(pool, req)) {
+            req->overflow = true;
+            QTAILQ_INSERT_HEAD(&pool->overflow, req, reqs);
+            break;
+        }
+        thread_pool_kick(pool);
     }
 }
 
 static void event_notifier_ready(EventNotifier *notifier)
 {
+    ThreadPool *pool = container_of(notifier, ThreadPool, notifier);
     ThreadPoolElement *elem, *next;
 
     event_notifier_test_and_clear(notifier);
+    /* Completions from now on need a new notification.  */
+    __sync_fetch_and_and(&pool->completions, 0);
 restart:
-    QLIST_FOREACH_SAFE(elem, &head, all, next) {
-        if (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
+    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
+        if (elem->state != THREAD_ABANDONED && elem->state != THREAD_DONE) {
             continue;
         }
         if (elem->state == THREAD_DONE) {
+            int64_t ns = get_clock() - elem->submit_ns;
+
             trace_thread_pool_complete(elem, elem->common.opaque, elem->ret);
+            pool->stats.completed++;
+            pool->stats.total_ns += ns;
+            pool->stats.max_ns = MAX(pool->stats.max_ns, ns);
         }
+        pool->stats.in_flight--;
         if (elem->state == THREAD_DONE && elem->common.cb) {
             QLIST_REMOVE(elem, all);
             /* Read state before ret.  */
@@ -182,38 +375,47 @@ restart:
             qemu_aio_release(elem);
         }
     }
+
+    thread_pool_refill(pool);
 }
 
 static int thread_pool_active(EventNotifier *notifier)
 {
-    return !QLIST_EMPTY(&head);
+    ThreadPool *pool = container_of(notifier, ThreadPool, notifier);
+
+    return !QLIST_EMPTY(&pool->head);
 }
 
 static void thread_pool_cancel(BlockDriverAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
+    ThreadPool *pool = elem->pool;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
+    if (__sync_bool_compare_and_swap(&elem->state, THREAD_QUEUED,
+                                     THREAD_CANCELED)) {
+        /* No thread has yet started working on elem.  If it is in the
+         * ring, the worker that dequeues it will drop it.
          */
-        qemu_sem_timedwait(&sem, 0) == 0) {
-        QTAILQ_REMOVE(&request_list, elem, reqs);
-        elem->state = THREAD_CANCELED;
-        event_notifier_set(&notifier);
-    } else {
-        pending_cancellations++;
-        while (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
-            qemu_cond_wait(&check_cancel, &lock);
+        if (elem->overflow) {
+            QTAILQ_REMOVE(&pool->overflow, elem, reqs);
+            elem->overflow = false;
+            elem->state = THREAD_ABANDONED;
+            event_notifier_set(&pool->notifier);
         }
-        pending_cancellations--;
+        return;
     }
-    qemu_mutex_unlock(&lock);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->pending_cancellations++;
+    /* Pairs with the barrier after setting THREAD_DONE.  */
+    smp_mb();
+    while (elem->state != THREAD_DONE) {
+        qemu_cond_wait(&pool->check_cancel, &pool->lock);
+    }
+    pool->pending_cancellations--;
+    qemu_mutex_unlock(&pool->lock);
 }
 
 static const AIOCBInfo thread_pool_aiocb_info = {
@@ -221,30 +423,48 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .cancel             = thread_pool_cancel,
 };
 
-BlockDriverAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
+BlockDriverAIOCB *thread_pool_submit_aio_pool(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
 
+    if (!pool) {
+        pool = default_pool;
+    }
+
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
+    req->pool = pool;
     req->func = func;
     req->arg = arg;
     req->state = THREAD_QUEUED;
+    req->overflow = false;
+    req->submit_ns = get_clock();
 
-    QLIST_INSERT_HEAD(&head, req, all);
+    QLIST_INSERT_HEAD(&pool->head, req, all);
+    pool->stats.submitted++;
+    pool->stats.in_flight++;
+    pool->stats.max_in_flight = MAX(pool->stats.max_in_flight,
+                                    pool->stats.in_flight);
 
     trace_thread_pool_submit(req, arg);
 
-    qemu_mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads) {
-        spawn_thread();
+    /* Keep FIFO order behind requests that are still waiting for room.  */
+    if (QTAILQ_EMPTY(&pool->overflow) && thread_pool_ring_push(pool, req)) {
+        thread_pool_kick(pool);
+    } else {
+        req->overflow = true;
+        QTAILQ_INSERT_TAIL(&pool->overflow, req, reqs);
     }
-    QTAILQ_INSERT_TAIL(&request_list, req, reqs);
-    qemu_mutex_unlock(&lock);
-    qemu_sem_post(&sem);
     return &req->common;
 }
 
+BlockDriverAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return thread_pool_submit_aio_pool(NULL, func, arg, cb, opaque);
+}
+
 typedef struct ThreadPoolCo {
     Coroutine *co;
     int ret;
@@ -272,18 +492,118 @@ void thread_pool_submit(ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(func, arg, NULL, NULL);
 }
 
-static void thread_pool_init(void)
+#ifdef __linux__
+/* The CPUs of a NUMA node, as listed by sysfs */
+static int parse_node_cpus(int node, cpu_set_t *set)
+{
+    char path[64];
+    char *contents;
+    int ret;
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/node/node%d/cpulist", node);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return -ENOENT;
+    }
+    ret = qemu_parse_cpu_list(contents, set);
+    g_free(contents);
+    return ret;
+}
+#endif
+
+ThreadPool *thread_pool_new(const char *name, int min_threads,
+                            int max_threads, const char *cpus, int node,
+                            Error **errp)
 {
-    QLIST_INIT(&head);
-    event_notifier_init(&notifier, false);
-    qemu_mutex_init(&lock);
-    qemu_cond_init(&check_cancel);
-    qemu_sem_init(&sem, 0);
-    qemu_aio_set_event_notifier(&notifier, event_notifier_ready,
+    ThreadPool *pool;
+    int i;
+
+    if (thread_pool_find(name)) {
+        error_setg(errp, "thread pool '%s' already exists", name);
+        return NULL;
+    }
+    if (max_threads < 1 || min_threads < 0 || min_threads > max_threads) {
+        error_setg(errp, "invalid thread count for pool '%s'", name);
+        return NULL;
+    }
+
+    pool = g_malloc0(sizeof(*pool));
+
+#ifdef __linux__
+    if (cpus && qemu_parse_cpu_list(cpus, &pool->cpus) < 0) {
+        error_setg(errp, "invalid CPU list '%s'", cpus);
+        g_free(pool);
+        return NULL;
+    }
+    if (!cpus && node >= 0 && parse_node_cpus(node, &pool->cpus) < 0) {
+        error_setg(errp, "cannot find the CPUs of NUMA node %d", node);
+        g_free(pool);
+        return NULL;
+    }
+    pool->has_cpus = cpus || node >= 0;
+#else
+    if (cpus || node >= 0) {
+        error_setg(errp, "thread pool CPU affinity is not supported "
+                   "on this host");
+        g_free(pool);
+        return NULL;
+    }
+#endif
+
+    pool->name = g_strdup(name);
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+
+    QLIST_INIT(&pool->head);
+    event_notifier_init(&pool->notifier, false);
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->check_cancel);
+    qemu_sem_init(&pool->sem, 0);
+    qemu_aio_set_event_notifier(&pool->notifier, event_notifier_ready,
                                 thread_pool_active);
 
-    QTAILQ_INIT(&request_list);
-    new_thread_bh = qemu_bh_new(spawn_thread_bh_fn, NULL);
+    QTAILQ_INIT(&pool->overflow);
+    for (i = 0; i < THREAD_POOL_RING_SIZE; i++) {
+        pool->ring[i].seq = i;
+    }
+    pool->new_thread_bh = qemu_bh_new(spawn_thread_bh_fn, pool);
+
+    /* Start the threads that are kept around even when idle */
+    qemu_mutex_lock(&pool->lock);
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    QTAILQ_INSERT_TAIL(&pools, pool, next);
+    return pool;
+}
+
+ThreadPool *thread_pool_find(const char *name)
+{
+    ThreadPool *pool;
+
+    QTAILQ_FOREACH(pool, &pools, next) {
+        if (!strcmp(pool->name, name)) {
+            return pool;
+        }
+    }
+    return NULL;
+}
+
+void thread_pool_foreach(ThreadPoolIterFunc *func, void *opaque)
+{
+    ThreadPool *pool;
+
+    QTAILQ_FOREACH(pool, &pools, next) {
+        func(pool->name, pool->min_threads, pool->max_threads,
+             &pool->stats, opaque);
+    }
+}
+
+static void thread_pool_init(void)
+{
+    default_pool = thread_pool_new("default", 0, 64, NULL, -1, NULL);
 }
 
 block_init(thread_pool_init)
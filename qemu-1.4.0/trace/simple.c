@@ -16,7 +16,9 @@
 #include <signal.h>
 #include <pthread.h>
 #endif
+#include <string.h>
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 #include "trace/control.h"
 
@@ -32,12 +34,16 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Each thread that traces gets a ring buffer of its own, so that recording
+ * an event takes neither a lock nor an atomic operation: the thread is the
+ * only writer of its ring, and the writeout thread the only reader.  Records
+ * are laid out in the ring exactly as in the trace file, so the writeout
+ * thread copies whatever has been published to the file as it is.  Records
+ * from different threads are therefore not in timestamp order in the file.
+ *
+ * The writeout thread waits for a ring to fill past a threshold, or for an
+ * explicit flush, writes out all rings, and then waits again.
  */
 static GStaticMutex trace_lock = G_STATIC_MUTEX_INIT;
 
@@ -56,14 +62,22 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 32,  /* per thread, a power of two */
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+typedef struct TraceRing {
+    struct TraceRing *next;     /* on trace_rings, never removed */
+    volatile unsigned int head; /* published end of records, by the owner */
+    volatile unsigned int tail; /* end of written out records, by writeout */
+    volatile gint dropped;
+    volatile gint dead;         /* the owner exited; the ring can be reused */
+    bool busy;                  /* a record is being written */
+    uint8_t buf[TRACE_BUF_LEN];
+} TraceRing;
+
+static TraceRing *volatile trace_rings;
+static volatile gint trace_kicked;
 static FILE *trace_fp;
 static char *trace_file_name;
 
@@ -82,54 +96,76 @@ typedef struct {
     uint64_t header_version;  /* HEADER_VERSION  */
 } TraceLogHeader;
 
+static void trace_ring_exit(gpointer opaque)
+{
+    TraceRing *ring = opaque;
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+    g_atomic_int_set(&ring->dead, 1);
+}
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+#if GLIB_CHECK_VERSION(2, 32, 0)
+static GPrivate trace_ring_key = G_PRIVATE_INIT(trace_ring_exit);
+#define trace_ring_key_get()        g_private_get(&trace_ring_key)
+#define trace_ring_key_set(ring)    g_private_set(&trace_ring_key, ring)
+#else
+static GStaticPrivate trace_ring_key = G_STATIC_PRIVATE_INIT;
+#define trace_ring_key_get()        g_static_private_get(&trace_ring_key)
+#define trace_ring_key_set(ring)    \
+    g_static_private_set(&trace_ring_key, ring, trace_ring_exit)
+#endif
+
+/* This thread's ring, taken over from an exited thread if possible */
+static TraceRing *trace_ring_get(void)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
+    TraceRing *ring = trace_ring_key_get();
+    TraceRing *first;
+
+    if (ring) {
+        return ring;
+    }
+
+    for (ring = trace_rings; ring; ring = ring->next) {
+        if (g_atomic_int_compare_and_exchange(&ring->dead, 1, 0)) {
+            break;
+        }
+    }
+    if (!ring) {
+        /* dont use g_malloc, can deadlock when traced */
+        ring = calloc(1, sizeof(*ring));
+        if (!ring) {
+            return NULL;
         }
-        trace_buf[idx++] = 0;
-        num++;
+        do {
+            first = trace_rings;
+            ring->next = first;
+        } while (!g_atomic_pointer_compare_and_exchange(
+                     (volatile gpointer *)&trace_rings, first, ring));
     }
+    trace_ring_key_set(ring);
+    return ring;
 }
-/**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
- *
- * Returns false if the record is not valid.
- */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+
+/* Copy in or out of a ring, at a free-running index */
+static void ring_write(TraceRing *ring, unsigned int idx, const void *data,
+                       size_t size)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t n = MIN(size, TRACE_BUF_LEN - off);
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
-    }
+    memcpy(ring->buf + off, data, n);
+    memcpy(ring->buf, (const uint8_t *)data + n, size - n);
+}
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+static void ring_writeout(TraceRing *ring, unsigned int idx, size_t size)
+{
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t n = MIN(size, TRACE_BUF_LEN - off);
+    size_t unused __attribute__ ((unused));
+
+    unused = fwrite(ring->buf + off, n, 1, trace_fp);
+    if (size > n) {
+        unused = fwrite(ring->buf, size - n, 1, trace_fp);
+    }
 }
 
 /**
@@ -164,36 +200,39 @@ static void wait_for_trace_records_available(void)
 
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
+    TraceRing *ring;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
+    unsigned int head, tail;
     int dropped_count;
     size_t unused __attribute__ ((unused));
 
     for (;;) {
         wait_for_trace_records_available();
+        g_atomic_int_set(&trace_kicked, 0);
+
+        for (ring = trace_rings; ring; ring = ring->next) {
+            dropped_count = g_atomic_int_get(&ring->dropped);
+            if (dropped_count) {
+                g_atomic_int_add(&ring->dropped, -dropped_count);
+                dropped.rec.event = DROPPED_EVENT_ID,
+                dropped.rec.timestamp_ns = get_clock();
+                dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
+                dropped.rec.reserved = 0;
+                dropped.rec.arguments[0] = dropped_count;
+                unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+            }
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.reserved = 0;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
-        }
-
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+            head = ring->head;
+            tail = ring->tail;
+            smp_rmb(); /* read the records only after their head */
+            if (head != tail) {
+                ring_writeout(ring, tail, head - tail);
+                smp_mb(); /* done with the records before freeing them */
+                ring->tail = head;
+            }
         }
 
         fflush(trace_fp);
@@ -203,82 +242,56 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    ring_write(rec->ring, rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off += sizeof(uint64_t);
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    ring_write(rec->ring, rec->rec_off, &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    ring_write(rec->ring, rec->rec_off + sizeof(slen), s, slen);
+    rec->rec_off += sizeof(slen) + slen;
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceRing *ring = trace_ring_get();
+    TraceRecord hdr;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t timestamp_ns = get_clock();
-
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
+    if (!ring) {
+        return -ENOMEM;
+    }
+    if (ring->busy || ring->head + rec_len - ring->tail > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, or a signal handler interrupted a record */
+        g_atomic_int_inc(&ring->dropped);
+        return -ENOSPC;
+    }
+    ring->busy = true;
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event, sizeof(event));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
+    hdr.event = event;
+    hdr.timestamp_ns = get_clock();
+    hdr.length = rec_len;
+    hdr.reserved = 0;
+    ring_write(ring, ring->head, &hdr, sizeof(hdr));
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->ring = ring;
+    rec->rec_off = ring->head + sizeof(TraceRecord);
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+void trace_record_finish(TraceBufferRecord *rec)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
+    TraceRing *ring = rec->ring;
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
-}
+    smp_wmb(); /* write barrier before publishing the record */
+    ring->head = rec->rec_off;
+    ring->busy = false;
 
-void trace_record_finish(TraceBufferRecord *rec)
-{
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (ring->head - ring->tail > TRACE_BUF_FLUSH_THRESHOLD &&
+        g_atomic_int_compare_and_exchange(&trace_kicked, 0, 1)) {
         flush_trace_file(false);
     }
 }
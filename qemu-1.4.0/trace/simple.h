@@ -28,7 +28,7 @@ bool st_set_trace_file(const char *file);
 void st_flush_trace_buffer(void);
 
 typedef struct {
-    unsigned int tbuf_idx;
+    struct TraceRing *ring;
     unsigned int rec_off;
 } TraceBufferRecord;
 
@@ -75,7 +75,10 @@
 /* Code generation and translation blocks */
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+TranslationBlock **tb_phys_hash;
+unsigned int tb_phys_hash_bits;
+/* TBs in tb_phys_hash, which leaves out the invalidated ones */
+static unsigned int tb_phys_hash_count;
 static int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
@@ -87,6 +90,28 @@ static size_t code_gen_buffer_size;
 static size_t code_gen_buffer_max_size;
 static uint8_t *code_gen_ptr;
 
+/* The code buffer is split into regions that are filled one after the
+ * other.  Once the last one is full the oldest is emptied, invalidating its
+ * TBs one by one, which unlinks the jumps into them; the rest of the code
+ * stays.  The TBs of a region sit in a slice of tbs[] in the order of their
+ * code, so tb_find_pc() only searches that slice.
+ */
+#define CODE_GEN_REGIONS    8
+
+typedef struct CodeGenRegion {
+    uint8_t *start;
+    uint8_t *end;               /* no TB starts at or past this */
+    uint8_t *ptr;               /* end of its code, unless it is current */
+    TranslationBlock *tbs;
+    int nb_tbs;
+} CodeGenRegion;
+
+static CodeGenRegion code_gen_regions[CODE_GEN_REGIONS];
+static int nb_code_gen_regions;
+static size_t code_gen_region_size;
+static int code_gen_region_max_blocks;
+static CodeGenRegion *cur_region;
+
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
     TranslationBlock *first_tb;
@@ -136,6 +161,10 @@ static void *l1_map[V_L1_SIZE];
 /* statistics */
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+uint64_t tb_phys_hash_lookups;
+uint64_t tb_phys_hash_probes;
+static int tb_phys_hash_resize_count;
+static int tb_evict_count;
 
 /* code generation context */
 TCGContext tcg_ctx;
@@ -405,11 +434,19 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
         P = mmap(NULL, SIZE, PROT_READ | PROT_WRITE,    \
                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);   \
     } while (0)
+# define FREE(P, SIZE) \
+    do { munmap(P, SIZE); } while (0)
 #else
 # define ALLOC(P, SIZE) \
     do { P = g_malloc0(SIZE); } while (0)
+# define FREE(P, SIZE) \
+    do { g_free(P); } while (0)
 #endif
 
+    /* Guest threads translating and changing mappings at the same time
+       can both find a level missing.  The loser of the cmpxchg frees its
+       copy and uses the winner's, so no lock is needed here.  */
+
     /* Level 1.  Always allocated.  */
     lp = l1_map + ((index >> V_L1_SHIFT) & (V_L1_SIZE - 1));
 
@@ -422,7 +459,10 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
                 return NULL;
             }
             ALLOC(p, sizeof(void *) * L2_SIZE);
-            *lp = p;
+            if (!__sync_bool_compare_and_swap(lp, NULL, p)) {
+                FREE(p, sizeof(void *) * L2_SIZE);
+                p = *lp;
+            }
         }
 
         lp = p + ((index >> (i * L2_BITS)) & (L2_SIZE - 1));
@@ -434,10 +474,14 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
             return NULL;
         }
         ALLOC(pd, sizeof(PageDesc) * L2_SIZE);
-        *lp = pd;
+        if (!__sync_bool_compare_and_swap(lp, NULL, pd)) {
+            FREE(pd, sizeof(PageDesc) * L2_SIZE);
+            pd = *lp;
+        }
     }
 
 #undef ALLOC
+#undef FREE
 
     return pd + (index & (L2_SIZE - 1));
 }
@@ -595,6 +639,35 @@ static inline void code_gen_alloc(size_t tb_size)
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
     tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+
+    tb_phys_hash_bits = CODE_GEN_PHYS_HASH_BITS;
+    tb_phys_hash = g_new0(TranslationBlock *, 1 << tb_phys_hash_bits);
+}
+
+static void code_gen_regions_init(void)
+{
+    size_t margin = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    CodeGenRegion *r;
+    int i;
+
+    /* a region must hold a good number of TBs past the margin a single
+       TB may need */
+    nb_code_gen_regions = MIN(CODE_GEN_REGIONS,
+                              code_gen_buffer_size / (4 * margin));
+    nb_code_gen_regions = MAX(nb_code_gen_regions, 1);
+    code_gen_region_size = (code_gen_buffer_size / nb_code_gen_regions) &
+                           ~(CODE_GEN_ALIGN - 1);
+    code_gen_region_max_blocks = code_gen_max_blocks / nb_code_gen_regions;
+
+    for (i = 0; i < nb_code_gen_regions; i++) {
+        r = &code_gen_regions[i];
+        r->start = code_gen_buffer + i * code_gen_region_size;
+        r->end = r->start + code_gen_region_size - margin;
+        r->ptr = r->start;
+        r->tbs = tbs + i * code_gen_region_max_blocks;
+        r->nb_tbs = 0;
+    }
+    cur_region = &code_gen_regions[0];
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -604,6 +677,7 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
+    code_gen_regions_init();
     code_gen_ptr = code_gen_buffer;
     tcg_register_jit(code_gen_buffer, code_gen_buffer_size);
     page_init();
@@ -625,13 +699,15 @@ static TranslationBlock *tb_alloc(target_ulong pc)
 {
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size) {
+    if (cur_region->nb_tbs >= code_gen_region_max_blocks ||
+        code_gen_ptr >= cur_region->end) {
         return NULL;
     }
-    tb = &tbs[nb_tbs++];
+    tb = &cur_region->tbs[cur_region->nb_tbs++];
+    nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = 0;
     return tb;
 }
 
@@ -640,8 +716,10 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (cur_region->nb_tbs > 0 &&
+        tb == &cur_region->tbs[cur_region->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
+        cur_region->nb_tbs--;
         nb_tbs--;
     }
 }
@@ -693,6 +771,7 @@ static void page_flush_tb(void)
 void tb_flush(CPUArchState *env1)
 {
     CPUArchState *env;
+    int i;
 
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -705,12 +784,18 @@ void tb_flush(CPUArchState *env1)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
     }
     nb_tbs = 0;
+    for (i = 0; i < nb_code_gen_regions; i++) {
+        code_gen_regions[i].nb_tbs = 0;
+        code_gen_regions[i].ptr = code_gen_regions[i].start;
+    }
+    cur_region = &code_gen_regions[0];
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
     }
 
-    memset(tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+    memset(tb_phys_hash, 0, (1 << tb_phys_hash_bits) * sizeof(void *));
+    tb_phys_hash_count = 0;
     page_flush_tb();
 
     code_gen_ptr = code_gen_buffer;
@@ -727,7 +812,7 @@ static void tb_invalidate_check(target_ulong address)
     int i;
 
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
+    for (i = 0; i < (1 << tb_phys_hash_bits); i++) {
         for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
@@ -745,7 +830,7 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
+    for (i = 0; i < (1 << tb_phys_hash_bits); i++) {
         for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
@@ -837,8 +922,9 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
+    h = tb_phys_hash_func(phys_pc, tb->pc, tb->flags);
     tb_hash_remove(&tb_phys_hash[h], tb);
+    tb_phys_hash_count--;
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -881,6 +967,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
+    tb->invalid = 1;
     tb_phys_invalidate_count++;
 }
 
@@ -940,6 +1027,37 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+/* Move code generation on to the next region, throwing out what it held */
+static void tb_next_region(CPUArchState *env)
+{
+    CodeGenRegion *r;
+    int i;
+
+    if (nb_code_gen_regions == 1) {
+        tb_flush(env);
+        return;
+    }
+
+    cur_region->ptr = code_gen_ptr;
+    r = cur_region + 1;
+    if (r == &code_gen_regions[nb_code_gen_regions]) {
+        r = &code_gen_regions[0];
+    }
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        if (!r->tbs[i].invalid) {
+            tb_phys_invalidate(&r->tbs[i], -1);
+        }
+    }
+    nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->ptr = r->start;
+
+    cur_region = r;
+    code_gen_ptr = r->start;
+    tb_evict_count++;
+}
+
 TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -953,8 +1071,8 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* the next region must be emptied */
+        tb_next_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1263,6 +1381,41 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif /* TARGET_HAS_SMC */
 }
 
+/* Double the number of chains in the physical hash, keeping the order of
+   each chain's TBs */
+static void tb_phys_hash_grow(void)
+{
+    unsigned int old_size = 1 << tb_phys_hash_bits;
+    TranslationBlock **old_hash = tb_phys_hash;
+    TranslationBlock *tb, *next, **tail;
+    tb_page_addr_t phys_pc;
+    unsigned int i, h;
+    TranslationBlock ***tails;
+
+    tb_phys_hash_bits++;
+    tb_phys_hash = g_new0(TranslationBlock *, 1 << tb_phys_hash_bits);
+    tails = g_new(TranslationBlock **, 1 << tb_phys_hash_bits);
+    for (i = 0; i < (1 << tb_phys_hash_bits); i++) {
+        tails[i] = &tb_phys_hash[i];
+    }
+
+    for (i = 0; i < old_size; i++) {
+        for (tb = old_hash[i]; tb != NULL; tb = next) {
+            next = tb->phys_hash_next;
+            phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+            h = tb_phys_hash_func(phys_pc, tb->pc, tb->flags);
+            tail = tails[h];
+            tb->phys_hash_next = NULL;
+            *tail = tb;
+            tails[h] = &tb->phys_hash_next;
+        }
+    }
+
+    g_free(tails);
+    g_free(old_hash);
+    tb_phys_hash_resize_count++;
+}
+
 /* add a new TB and link it to the physical page tables. phys_page2 is
    (-1) to indicate that only one page contains the TB. */
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
@@ -1275,10 +1428,15 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
        before we are done.  */
     mmap_lock();
     /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
+    if (tb_phys_hash_count >= (2u << tb_phys_hash_bits) &&
+        tb_phys_hash_bits < CODE_GEN_PHYS_HASH_MAX_BITS) {
+        tb_phys_hash_grow();
+    }
+    h = tb_phys_hash_func(phys_pc, tb->pc, tb->flags);
     ptb = &tb_phys_hash[h];
     tb->phys_hash_next = *ptb;
     *ptb = tb;
+    tb_phys_hash_count++;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1324,20 +1482,27 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
+    CodeGenRegion *r;
+    uint8_t *end;
 
-    if (nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)code_gen_buffer) {
+        return NULL;
+    }
+    m = (tc_ptr - (uintptr_t)code_gen_buffer) / code_gen_region_size;
+    if (m >= nb_code_gen_regions) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+    r = &code_gen_regions[m];
+    end = r == cur_region ? code_gen_ptr : r->ptr;
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)end) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1347,7 +1512,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1561,41 +1726,68 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    unsigned int chains_used, max_chain, len;
+    uint64_t lookups, jmp_cache_hits;
+    ptrdiff_t host_code_size;
     TranslationBlock *tb;
+    CodeGenRegion *r;
+    CPUArchState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
+    host_code_size = 0;
+    for (r = code_gen_regions; r < &code_gen_regions[nb_code_gen_regions];
+         r++) {
+        host_code_size += (r == cur_region ? code_gen_ptr : r->ptr) - r->start;
+        for (tb = r->tbs; tb < &r->tbs[r->nb_tbs]; tb++) {
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
+            }
         }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
+    }
+    chains_used = 0;
+    max_chain = 0;
+    for (i = 0; i < (1 << tb_phys_hash_bits); i++) {
+        len = 0;
+        for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+            len++;
         }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
-            }
+        if (len) {
+            chains_used++;
+            max_chain = MAX(max_chain, len);
         }
     }
+    jmp_cache_hits = 0;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        jmp_cache_hits += env->tb_jmp_cache_hits;
+    }
+    lookups = jmp_cache_hits + tb_phys_hash_lookups;
+
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %td/%zd in %d regions\n",
+                host_code_size, code_gen_buffer_max_size, nb_code_gen_regions);
     cpu_fprintf(f, "TB count            %d/%d\n",
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer)
+                nb_tbs ? host_code_size / nb_tbs : 0,
+                target_code_size ? (double) host_code_size
                 / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
@@ -1605,8 +1797,20 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+    cpu_fprintf(f, "TB hash chains      %u/%u used, avg length %0.2f max %u\n",
+                chains_used, 1 << tb_phys_hash_bits,
+                chains_used ? (double) tb_phys_hash_count / chains_used : 0,
+                max_chain);
     cpu_fprintf(f, "\nStatistics:\n");
+    cpu_fprintf(f, "TB lookups          %" PRIu64 " (jump cache hits %d%%)\n",
+                lookups,
+                lookups ? (int)(jmp_cache_hits * 100 / lookups) : 0);
+    cpu_fprintf(f, "TB hash probes      %0.2f per lookup\n",
+                tb_phys_hash_lookups ?
+                (double) tb_phys_hash_probes / tb_phys_hash_lookups : 0);
+    cpu_fprintf(f, "TB hash resizes     %d\n", tb_phys_hash_resize_count);
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n", tb_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
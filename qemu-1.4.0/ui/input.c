@@ -28,6 +28,9 @@
 #include "qapi/error.h"
 #include "qmp-commands.h"
 #include "qapi-types.h"
+#include "qemu/histogram.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 static QEMUPutKBDEvent *qemu_put_kbd_event;
 static void *qemu_put_kbd_event_opaque;
@@ -37,6 +40,17 @@ static QTAILQ_HEAD(, QEMUPutMouseEntry) mouse_handlers =
 static NotifierList mouse_mode_notifiers = 
     NOTIFIER_LIST_INITIALIZER(mouse_mode_notifiers);
 
+/* Host time at which the events being handed to the devices arrived */
+static int64_t input_stamp;
+
+typedef struct InputLatency {
+    LatencyHistogram *hist;
+    uint64_t count;
+    int64_t max_ns;
+} InputLatency;
+
+static InputLatency input_latency[INPUT_LATENCY_STAGE_MAX];
+
 static const int key_defs[] = {
     [Q_KEY_CODE_SHIFT] = 0x2a,
     [Q_KEY_CODE_SHIFT_R] = 0x36,
@@ -493,6 +507,74 @@ int kbd_mouse_has_absolute(void)
     return 0;
 }
 
+void qemu_input_set_stamp(int64_t stamp)
+{
+    input_stamp = stamp;
+}
+
+int64_t qemu_input_get_stamp(void)
+{
+    return input_stamp;
+}
+
+void qemu_input_latency(InputLatencyStage stage, int64_t stamp)
+{
+    InputLatency *l = &input_latency[stage];
+    int64_t ns;
+
+    if (!stamp) {
+        return;
+    }
+    ns = get_clock() - stamp;
+    trace_qemu_input_latency(InputLatencyStage_lookup[stage], ns);
+
+    if (!l->hist) {
+        l->hist = latency_histogram_new(LATENCY_HISTOGRAM_DEFAULT_MIN_NS,
+                                        LATENCY_HISTOGRAM_DEFAULT_BINS, NULL);
+    }
+    latency_histogram_add(l->hist, ns);
+    l->count++;
+    if (ns > l->max_ns) {
+        l->max_ns = ns;
+    }
+}
+
+InputLatencyInfoList *qmp_query_input_latency(bool has_reset, bool reset,
+                                              Error **errp)
+{
+    InputLatencyInfoList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < INPUT_LATENCY_STAGE_MAX; i++) {
+        InputLatency *l = &input_latency[i];
+        InputLatencyInfoList *entry;
+        InputLatencyInfo *info;
+
+        if (!l->count) {
+            continue;
+        }
+        info = g_malloc0(sizeof(*info));
+        info->stage = i;
+        info->count = l->count;
+        info->p50_ns = latency_histogram_percentile(l->hist, 50);
+        info->p99_ns = latency_histogram_percentile(l->hist, 99);
+        info->max_ns = l->max_ns;
+        info->histogram = latency_histogram_info(l->hist);
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+
+        if (has_reset && reset) {
+            latency_histogram_free(l->hist);
+            memset(l, 0, sizeof(*l));
+        }
+    }
+
+    return head;
+}
+
 MouseInfoList *qmp_query_mice(Error **errp)
 {
     MouseInfoList *mice_list = NULL;
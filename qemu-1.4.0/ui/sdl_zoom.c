@@ -12,7 +12,8 @@
  */
 
 #include "sdl_zoom.h"
-#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "ui/qemu-pixman.h"
 #include <glib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -29,6 +30,77 @@ static void sdl_zoom_rgb32(SDL_Surface *src, SDL_Surface *dst, int smooth,
 #include  "sdl_zoom_template.h"
 #undef BPP
 
+/* Return the pixman format of an SDL surface, or 0 if pixman cannot use it */
+static pixman_format_code_t sdl_zoom_pixman_format(SDL_Surface *sfc)
+{
+    SDL_PixelFormat *pf = sfc->format;
+    pixman_format_code_t format;
+    int type;
+
+    /* pixman wants 32 bit aligned lines */
+    if (((uintptr_t)sfc->pixels | sfc->pitch) & 3) {
+        return 0;
+    }
+    type = qemu_pixman_get_type(pf->Rshift, pf->Gshift, pf->Bshift);
+    if (type == PIXMAN_TYPE_OTHER) {
+        return 0;
+    }
+    format = PIXMAN_FORMAT(pf->BitsPerPixel, type,
+                           pf->Amask ? 8 - pf->Aloss : 0, 8 - pf->Rloss,
+                           8 - pf->Gloss, 8 - pf->Bloss);
+    if (!pixman_format_supported_source(format) ||
+        !pixman_format_supported_destination(format)) {
+        return 0;
+    }
+    return format;
+}
+
+/*
+ * Scale the part of src that ends up in the rectangle zoom of dst, using
+ * pixman's (SIMD accelerated where available) scaled composite.  Returns
+ * -1 if either surface has a layout that pixman does not handle.
+ */
+static int sdl_zoom_pixman(SDL_Surface *src, SDL_Surface *dst, int smooth,
+                           SDL_Rect *zoom)
+{
+    pixman_format_code_t src_format = sdl_zoom_pixman_format(src);
+    pixman_format_code_t dst_format = sdl_zoom_pixman_format(dst);
+    pixman_image_t *src_image, *dst_image;
+    pixman_transform_t scale;
+
+    if (!src_format || !dst_format) {
+        return -1;
+    }
+
+    src_image = pixman_image_create_bits(src_format, src->w, src->h,
+                                         src->pixels, src->pitch);
+    dst_image = pixman_image_create_bits(dst_format, dst->w, dst->h,
+                                         dst->pixels, dst->pitch);
+    if (!src_image || !dst_image) {
+        qemu_pixman_image_unref(src_image);
+        qemu_pixman_image_unref(dst_image);
+        return -1;
+    }
+
+    pixman_transform_init_scale(&scale,
+                                pixman_double_to_fixed((double)src->w / dst->w),
+                                pixman_double_to_fixed((double)src->h / dst->h));
+    pixman_image_set_transform(src_image, &scale);
+    pixman_image_set_filter(src_image, smooth ? PIXMAN_FILTER_BILINEAR
+                                              : PIXMAN_FILTER_NEAREST,
+                            NULL, 0);
+    /* Keep the edges from blending with transparent black */
+    pixman_image_set_repeat(src_image, PIXMAN_REPEAT_PAD);
+
+    pixman_image_composite(PIXMAN_OP_SRC, src_image, NULL, dst_image,
+                           zoom->x, zoom->y, 0, 0, zoom->x, zoom->y,
+                           zoom->w, zoom->h);
+
+    pixman_image_unref(src_image);
+    pixman_image_unref(dst_image);
+    return 0;
+}
+
 int sdl_zoom_blit(SDL_Surface *src_sfc, SDL_Surface *dst_sfc, int smooth,
                   SDL_Rect *in_rect)
 {
@@ -79,7 +151,9 @@ int sdl_zoom_blit(SDL_Surface *src_sfc, SDL_Surface *dst_sfc, int smooth,
     /* The rectangle (zoom.x, zoom.y, zoom.w, zoom.h) is the area on the
      * destination surface that needs to be updated.
      */
-    if (src_sfc->format->BitsPerPixel == 32)
+    if (sdl_zoom_pixman(src_sfc, dst_sfc, smooth, &zoom) == 0) {
+        /* done */
+    } else if (src_sfc->format->BitsPerPixel == 32)
         sdl_zoom_rgb32(src_sfc, dst_sfc, smooth, &zoom);
     else if (src_sfc->format->BitsPerPixel == 16)
         sdl_zoom_rgb16(src_sfc, dst_sfc, smooth, &zoom);
@@ -0,0 +1,238 @@
+/*
+ * Shared memory display
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
+#include "ui/console.h"
+#include "ui/shm-display.h"
+
+/* Damage is collected over a refresh and merged into this many rectangles */
+#define SHM_DISPLAY_PENDING_MAX 16
+
+typedef struct ShmDisplay {
+    DisplayState *ds;
+    char *name;
+    int fd;
+    ShmDisplayHeader *hdr;
+    size_t map_size;
+    Notifier exit_notifier;
+
+    ShmDisplayRect pending[SHM_DISPLAY_PENDING_MAX];
+    int nr_pending;
+} ShmDisplay;
+
+static ShmDisplay *shm_display;
+
+static bool shm_rect_touches(const ShmDisplayRect *a, const ShmDisplayRect *b)
+{
+    return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+           a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
+
+static void shm_rect_union(ShmDisplayRect *a, const ShmDisplayRect *b)
+{
+    int x2 = MAX(a->x + a->w, b->x + b->w);
+    int y2 = MAX(a->y + a->h, b->y + b->h);
+
+    a->x = MIN(a->x, b->x);
+    a->y = MIN(a->y, b->y);
+    a->w = x2 - a->x;
+    a->h = y2 - a->y;
+}
+
+static void shm_add_damage(ShmDisplay *sd, int x, int y, int w, int h)
+{
+    ShmDisplayRect r = { .x = x, .y = y, .w = w, .h = h };
+    int i;
+
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+    for (i = 0; i < sd->nr_pending; i++) {
+        if (shm_rect_touches(&sd->pending[i], &r)) {
+            shm_rect_union(&sd->pending[i], &r);
+            return;
+        }
+    }
+    if (sd->nr_pending == SHM_DISPLAY_PENDING_MAX) {
+        /* Out of slots: fold everything into one */
+        for (i = 1; i < sd->nr_pending; i++) {
+            shm_rect_union(&sd->pending[0], &sd->pending[i]);
+        }
+        shm_rect_union(&sd->pending[0], &r);
+        sd->nr_pending = 1;
+        return;
+    }
+    sd->pending[sd->nr_pending++] = r;
+}
+
+/* Copy the damaged pixels, then tell readers about them */
+static void shm_flush_damage(ShmDisplay *sd)
+{
+    DisplayState *ds = sd->ds;
+    ShmDisplayHeader *hdr = sd->hdr;
+    int linesize = ds_get_linesize(ds);
+    int bpp = ds_get_bytes_per_pixel(ds);
+    uint8_t *data = (uint8_t *)hdr + hdr->data_offset;
+    uint32_t head = hdr->damage_head;
+    int i, y;
+
+    for (i = 0; i < sd->nr_pending; i++) {
+        ShmDisplayRect *r = &sd->pending[i];
+        size_t offset = r->y * linesize + r->x * bpp;
+
+        for (y = 0; y < r->h; y++) {
+            memcpy(data + offset, ds_get_data(ds) + offset, r->w * bpp);
+            offset += linesize;
+        }
+    }
+    smp_wmb();
+
+    for (i = 0; i < sd->nr_pending; i++) {
+        hdr->damage[head % SHM_DISPLAY_RING_SIZE] = sd->pending[i];
+        smp_wmb();
+        hdr->damage_head = ++head;
+    }
+    sd->nr_pending = 0;
+}
+
+static int shm_grow(ShmDisplay *sd, size_t size)
+{
+    void *map;
+
+    if (size <= sd->map_size) {
+        return 0;
+    }
+    if (ftruncate(sd->fd, size) < 0) {
+        error_report("shm display: cannot grow %s to %zu bytes: %s",
+                     sd->name, size, strerror(errno));
+        return -1;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sd->fd, 0);
+    if (map == MAP_FAILED) {
+        error_report("shm display: cannot map %zu bytes of %s: %s",
+                     size, sd->name, strerror(errno));
+        return -1;
+    }
+    munmap(sd->hdr, sd->map_size);
+    sd->hdr = map;
+    sd->map_size = size;
+    sd->hdr->map_size = size;
+    return 0;
+}
+
+static void shm_dpy_gfx_update(DisplayState *ds, int x, int y, int w, int h)
+{
+    shm_add_damage(shm_display, x, y, w, h);
+}
+
+static void shm_dpy_gfx_setdata(DisplayState *ds)
+{
+    ShmDisplay *sd = shm_display;
+
+    sd->nr_pending = 0;
+    shm_add_damage(sd, 0, 0, ds_get_width(ds), ds_get_height(ds));
+}
+
+static void shm_dpy_gfx_resize(DisplayState *ds)
+{
+    ShmDisplay *sd = shm_display;
+    ShmDisplayHeader *hdr;
+    size_t data_offset = QEMU_ALIGN_UP(sizeof(*hdr), getpagesize());
+    size_t size = data_offset + (size_t)ds_get_linesize(ds) * ds_get_height(ds);
+
+    sd->nr_pending = 0;
+    if (shm_grow(sd, size) < 0) {
+        /* Keep the old geometry; readers go on seeing the last frame */
+        return;
+    }
+
+    hdr = sd->hdr;
+    hdr->geometry_seq++;
+    smp_wmb();
+    hdr->width = ds_get_width(ds);
+    hdr->height = ds_get_height(ds);
+    hdr->stride = ds_get_linesize(ds);
+    hdr->format = ds_get_format(ds);
+    hdr->data_offset = data_offset;
+    smp_wmb();
+    hdr->geometry_seq++;
+
+    shm_add_damage(sd, 0, 0, ds_get_width(ds), ds_get_height(ds));
+}
+
+static void shm_dpy_refresh(DisplayState *ds)
+{
+    ShmDisplay *sd = shm_display;
+
+    vga_hw_update();
+    if (sd->nr_pending &&
+        sd->hdr->data_offset + (size_t)ds_get_linesize(ds) *
+        ds_get_height(ds) <= sd->map_size) {
+        shm_flush_damage(sd);
+    }
+}
+
+static void shm_display_exit(Notifier *n, void *data)
+{
+    ShmDisplay *sd = container_of(n, ShmDisplay, exit_notifier);
+
+    shm_unlink(sd->name);
+}
+
+void shm_display_init(DisplayState *ds, const char *name)
+{
+    DisplayChangeListener *dcl;
+    ShmDisplay *sd;
+    size_t size = QEMU_ALIGN_UP(sizeof(ShmDisplayHeader), getpagesize());
+
+    sd = g_malloc0(sizeof(*sd));
+    sd->ds = ds;
+    sd->name = name ? g_strdup(name)
+                    : g_strdup_printf("/qemu-display-%d", (int)getpid());
+
+    sd->fd = shm_open(sd->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (sd->fd < 0) {
+        error_report("shm display: cannot create %s: %s",
+                     sd->name, strerror(errno));
+        exit(1);
+    }
+    if (ftruncate(sd->fd, size) < 0) {
+        error_report("shm display: cannot size %s: %s",
+                     sd->name, strerror(errno));
+        shm_unlink(sd->name);
+        exit(1);
+    }
+    sd->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sd->fd, 0);
+    if (sd->hdr == MAP_FAILED) {
+        error_report("shm display: cannot map %s: %s",
+                     sd->name, strerror(errno));
+        shm_unlink(sd->name);
+        exit(1);
+    }
+    sd->map_size = size;
+    sd->hdr->magic = SHM_DISPLAY_MAGIC;
+    sd->hdr->version = SHM_DISPLAY_VERSION;
+    sd->hdr->map_size = size;
+    sd->hdr->data_offset = size;
+
+    sd->exit_notifier.notify = shm_display_exit;
+    qemu_add_exit_notifier(&sd->exit_notifier);
+    shm_display = sd;
+
+    dcl = g_malloc0(sizeof(*dcl));
+    dcl->dpy_refresh = shm_dpy_refresh;
+    dcl->dpy_gfx_update = shm_dpy_gfx_update;
+    dcl->dpy_gfx_resize = shm_dpy_gfx_resize;
+    dcl->dpy_gfx_setdata = shm_dpy_gfx_setdata;
+    register_displaychangelistener(ds, dcl);
+}
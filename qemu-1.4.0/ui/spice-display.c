@@ -143,6 +143,71 @@ int qemu_spice_display_is_running(SimpleSpiceDisplay *ssd)
     return spice_display_is_running;
 }
 
+/* Don't keep more than this much bitmap memory around for reuse */
+#define SPICE_UPDATE_POOL_BYTES (16 * 1024 * 1024)
+
+static SimpleSpiceUpdate *qemu_spice_get_update(SimpleSpiceDisplay *ssd,
+                                                size_t bitmap_size)
+{
+    SimpleSpiceUpdate *update;
+    uint8_t *bitmap = NULL;
+    size_t size = 0;
+
+    qemu_mutex_lock(&ssd->pool_lock);
+    update = QTAILQ_FIRST(&ssd->pool);
+    if (update) {
+        QTAILQ_REMOVE(&ssd->pool, update, next);
+        ssd->pool_bytes -= update->bitmap_size;
+    }
+    qemu_mutex_unlock(&ssd->pool_lock);
+
+    if (update) {
+        bitmap = update->bitmap;
+        size = update->bitmap_size;
+        memset(update, 0, sizeof(*update));
+    } else {
+        update = g_malloc0(sizeof(*update));
+    }
+    if (size < bitmap_size) {
+        g_free(bitmap);
+        bitmap = g_malloc(bitmap_size);
+        size = bitmap_size;
+    }
+    update->bitmap = bitmap;
+    update->bitmap_size = size;
+    return update;
+}
+
+/*
+ * Compare a line of the guest surface with the mirror and bring the mirror
+ * up to date in the same pass.  Returns true if the line had changed.
+ */
+static bool qemu_spice_cmp_copy(uint8_t *mirror, const uint8_t *guest,
+                                size_t len)
+{
+    VECTYPE *m = (VECTYPE *)mirror;
+    const VECTYPE *g = (const VECTYPE *)guest;
+    size_t i, n;
+
+    if (((uintptr_t)mirror | (uintptr_t)guest | len) % sizeof(VECTYPE)) {
+        if (memcmp(mirror, guest, len) == 0) {
+            return false;
+        }
+        memcpy(mirror, guest, len);
+        return true;
+    }
+
+    n = len / sizeof(VECTYPE);
+    for (i = 0; i < n; i++) {
+        if (!ALL_EQ(m[i], g[i])) {
+            memcpy(m + i, g + i, (n - i) * sizeof(VECTYPE));
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The mirror already holds the new contents of the rect */
 static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
                                          QXLRect *rect)
 {
@@ -158,15 +223,14 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
            rect->left, rect->right,
            rect->top, rect->bottom);
 
-    update   = g_malloc0(sizeof(*update));
+    bw       = rect->right - rect->left;
+    bh       = rect->bottom - rect->top;
+
+    update   = qemu_spice_get_update(ssd, bw * bh * 4);
     drawable = &update->drawable;
     image    = &update->image;
     cmd      = &update->ext.cmd;
 
-    bw       = rect->right - rect->left;
-    bh       = rect->bottom - rect->top;
-    update->bitmap = g_malloc(bw * bh * 4);
-
     drawable->bbox            = *rect;
     drawable->clip.type       = SPICE_CLIP_TYPE_NONE;
     drawable->effect          = QXL_EFFECT_OPAQUE;
@@ -197,9 +261,6 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
 
     dest = pixman_image_create_bits(PIXMAN_x8r8g8b8, bw, bh,
                                     (void *)update->bitmap, bw * 4);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, ssd->mirror,
-                           rect->left, rect->top, 0, 0,
-                           rect->left, rect->top, bw, bh);
     pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, dest,
                            rect->left, rect->top, 0, 0,
                            0, 0, bw, bh);
@@ -242,9 +303,9 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
             xoff = x * bpp;
             blk = x / blksize;
             bw = MIN(blksize, ssd->dirty.right - x);
-            if (memcmp(guest + yoff + xoff,
-                       mirror + yoff + xoff,
-                       bw * bpp) == 0) {
+            if (!qemu_spice_cmp_copy(mirror + yoff + xoff,
+                                     guest + yoff + xoff,
+                                     bw * bpp)) {
                 if (dirty_top[blk] != -1) {
                     QXLRect update = {
                         .top    = dirty_top[blk],
@@ -286,11 +347,22 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
  * We do *not* hold the global qemu mutex here, so extra care is needed
  * when calling qemu functions.  QEMU interfaces used:
  *    - g_free (underlying glibc free is re-entrant).
+ *    - qemu_mutex_lock on the pool lock, which nothing else nests in.
  */
 void qemu_spice_destroy_update(SimpleSpiceDisplay *sdpy, SimpleSpiceUpdate *update)
 {
-    g_free(update->bitmap);
-    g_free(update);
+    qemu_mutex_lock(&sdpy->pool_lock);
+    if (sdpy->pool_bytes + update->bitmap_size <= SPICE_UPDATE_POOL_BYTES) {
+        sdpy->pool_bytes += update->bitmap_size;
+        QTAILQ_INSERT_HEAD(&sdpy->pool, update, next);
+        update = NULL;
+    }
+    qemu_mutex_unlock(&sdpy->pool_lock);
+
+    if (update) {
+        g_free(update->bitmap);
+        g_free(update);
+    }
 }
 
 void qemu_spice_create_host_memslot(SimpleSpiceDisplay *ssd)
@@ -339,6 +411,8 @@ void qemu_spice_display_init_common(SimpleSpiceDisplay *ssd, DisplayState *ds)
     ssd->ds = ds;
     qemu_mutex_init(&ssd->lock);
     QTAILQ_INIT(&ssd->updates);
+    qemu_mutex_init(&ssd->pool_lock);
+    QTAILQ_INIT(&ssd->pool);
     ssd->mouse_x = -1;
     ssd->mouse_y = -1;
     if (ssd->num_surfaces == 0) {
@@ -1,4 +1,9 @@
 #include "surfman.h"
+#include "qemu/timer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* HACK: Offset at which we copy ds->surface if the buffer is not shared between the emulation and the guest. */
 #define HIDDEN_LFB_OFFSET   0xa00000
@@ -8,31 +13,184 @@ static struct SurfmanState *ss = NULL;
  * DisplayState is created by the "hardware" through graphic_console_init().
  */
 
-/* Called every DisplayChangeListener::gui_timer_interval. */
+/* Copy a line to the hidden LFB, bypassing the cache where we can. */
+static void surfman_copy_line(uint8_t *dest, const uint8_t *src, size_t len)
+{
+#ifdef __SSE2__
+    size_t head = -(uintptr_t)dest & 15;
+
+    if (len >= 64 + head && ((uintptr_t)src & 15) == ((uintptr_t)dest & 15)) {
+        memcpy(dest, src, head);
+        dest += head;
+        src += head;
+        len -= head;
+        for (; len >= 64; len -= 64, dest += 64, src += 64) {
+            const __m128i *s = (const __m128i *)src;
+            __m128i *d = (__m128i *)dest;
+
+            _mm_stream_si128(d, _mm_load_si128(s));
+            _mm_stream_si128(d + 1, _mm_load_si128(s + 1));
+            _mm_stream_si128(d + 2, _mm_load_si128(s + 2));
+            _mm_stream_si128(d + 3, _mm_load_si128(s + 3));
+        }
+    }
+#endif
+    memcpy(dest, src, len);
+}
+
+static void surfman_copy_rect(struct DisplayState *ds,
+                              const struct surfman_rect *r)
+{
+    unsigned int linesize = ds_get_linesize(ds);     // Somehow, the pixman_image_t is 64b aligned ... always?
+    unsigned int Bpp = ds_get_bytes_per_pixel(ds);
+    uint8_t *dest = ss->vram_ptr + HIDDEN_LFB_OFFSET + r->y * linesize + r->x * Bpp;
+    uint8_t *src = ds_get_data(ds) + r->y * linesize + r->x * Bpp;
+    int i;
+
+    surfman_debug("update vram:%#"HWADDR_PRIx" src:%p dest:%p %d,%d (%dx%d).",
+                  ss->vram->addr, src, dest, r->x, r->y, r->w, r->h);
+    for (i = 0; i < r->h; ++i) {
+        surfman_copy_line(dest, src, r->w * Bpp);
+        dest += linesize;
+        src += linesize;
+    }
+}
+
+static bool surfman_rect_touches(const struct surfman_rect *a,
+                                 const struct surfman_rect *b)
+{
+    return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+           a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
+
+static void surfman_rect_union(struct surfman_rect *a,
+                               const struct surfman_rect *b)
+{
+    int x2 = MAX(a->x + a->w, b->x + b->w);
+    int y2 = MAX(a->y + a->h, b->y + b->h);
+
+    a->x = MIN(a->x, b->x);
+    a->y = MIN(a->y, b->y);
+    a->w = x2 - a->x;
+    a->h = y2 - a->y;
+}
+
+/* Record damage, merging it with the rectangles it overlaps or touches. */
+static void surfman_add_dirty(struct SurfmanState *ss, int x, int y, int w, int h)
+{
+    struct surfman_rect r = { x, y, w, h };
+    unsigned int i;
+    bool merged;
+
+    do {
+        /* The grown rectangle may touch others now, so start over. */
+        merged = false;
+        for (i = 0; i < ss->nr_dirty; ++i) {
+            if (surfman_rect_touches(&ss->dirty[i], &r)) {
+                surfman_rect_union(&r, &ss->dirty[i]);
+                ss->dirty[i] = ss->dirty[--ss->nr_dirty];
+                merged = true;
+                break;
+            }
+        }
+    } while (merged);
+    if (ss->nr_dirty == SURFMAN_MAX_DIRTY_RECTS) {
+        /* Out of slots, fall back to the bounding box. */
+        for (i = 0; i < ss->nr_dirty; ++i) {
+            surfman_rect_union(&r, &ss->dirty[i]);
+        }
+        ss->nr_dirty = 0;
+    }
+    ss->dirty[ss->nr_dirty++] = r;
+}
+
+/* Propagate the damage of the last tick: hidden LFB copy and surfman. */
+static void surfman_flush_dirty(struct SurfmanState *ss)
+{
+    struct DisplayState *ds = ss->ds;
+    unsigned int i;
+#ifdef CONFIG_DMBUS_DIRTY_RECTS
+    struct msg_display_dirty_rects msg;
+#endif
+
+    if (!ss->nr_dirty) {
+        return;
+    }
+    if (!is_buffer_shared(ds->surface)) {
+        for (i = 0; i < ss->nr_dirty; ++i) {
+            surfman_copy_rect(ds, &ss->dirty[i]);
+        }
+#ifdef __SSE2__
+        _mm_sfence();
+#endif
+    }
+
+#ifdef CONFIG_DMBUS_DIRTY_RECTS
+    memset(&msg, 0, sizeof (msg));
+    msg.DisplayID = 0;
+    if (ss->nr_dirty > DMBUS_MAX_DIRTY_RECTS) {
+        /* More than the message holds, send the bounding box. */
+        for (i = 1; i < ss->nr_dirty; ++i) {
+            surfman_rect_union(&ss->dirty[0], &ss->dirty[i]);
+        }
+        ss->nr_dirty = 1;
+    }
+    msg.count = ss->nr_dirty;
+    for (i = 0; i < ss->nr_dirty; ++i) {
+        msg.rects[i].x = ss->dirty[i].x;
+        msg.rects[i].y = ss->dirty[i].y;
+        msg.rects[i].w = ss->dirty[i].w;
+        msg.rects[i].h = ss->dirty[i].h;
+    }
+    dmbus_send(ss->dmbus_service, DMBUS_MSG_DISPLAY_DIRTY_RECTS, &msg, sizeof (msg));
+#endif
+    ss->nr_dirty = 0;
+}
+
+/* Called every DisplayChangeListener::gui_timer_interval.
+ * The "hardware" is only asked for an update as often as this VM's display
+ * needs it: never while Surfman doesn't show it, and backing off
+ * exponentially while the guest doesn't draw. */
 static void surfman_dpy_refresh(struct DisplayState *ds)
 {
-    (void) ds;
+    int64_t now = qemu_get_clock_ms(rt_clock);
+
+    if (!ss->visible || now < ss->next_refresh) {
+        return;
+    }
     vga_hw_update();    /* "Hardware" updates the framebuffer. */
+    if (ss->nr_dirty) {
+        ss->refresh_interval = GUI_REFRESH_INTERVAL;
+    } else {
+        ss->refresh_interval = MIN(ss->refresh_interval * 2, ss->refresh_max);
+    }
+    ss->next_refresh = now + ss->refresh_interval;
+    surfman_flush_dirty(ss);
 }
 
-/* A rectangular portion of the framebuffer (Surface) of DisplayState /s/ has changed. */
+/* Back to full refresh rate. */
+static void surfman_refresh_reset(struct SurfmanState *ss)
+{
+    ss->refresh_interval = GUI_REFRESH_INTERVAL;
+    ss->next_refresh = 0;
+}
+
+void surfman_input_activity(void)
+{
+    if (ss) {
+        surfman_refresh_reset(ss);
+    }
+}
+
+/* A rectangular portion of the framebuffer (Surface) of DisplayState /s/ has changed.
+ * Damage is coalesced and handled once per refresh tick. */
 static void surfman_dpy_gfx_update(struct DisplayState *ds, int x, int y, int w, int h)
 {
-    if (!is_buffer_shared(ds->surface)) {
-        unsigned int linesize = ds_get_linesize(ds);     // Somehow, the pixman_image_t is 64b aligned ... always?
-        unsigned int Bpp = ds_get_bytes_per_pixel(ds);
-        uint8_t *dest = ss->vram_ptr + HIDDEN_LFB_OFFSET + y * linesize + x * Bpp;
-        uint8_t *src = ds_get_data(ds) + y * linesize + x * Bpp;
-        unsigned int i;
-
-        surfman_debug("update vram:%#"HWADDR_PRIx" src:%p dest:%p %d,%d (%dx%d).",
-                      ss->vram->addr, src, dest, x, y, w, h);
-        for (i = 0; i < h; ++i) {
-            memcpy(dest, src, w * Bpp);
-            dest += linesize;
-            src += linesize;
-        }
+    (void) ds;
+    if (w <= 0 || h <= 0) {
+        return;
     }
+    surfman_add_dirty(ss, x, y, w, h);
 }
 
 static void surfman_lfb_state_save(struct SurfmanState *ss)
@@ -58,15 +216,28 @@ static int surfman_lfb_state_compare(const struct lfb_state *s, struct DisplaySt
              (s->addr == lfb_addr));
 }
 
-/* The geometry of the framebuffer (Surface) of DisplayState has changed. */
+static void surfman_resize_done(void *opaque, const void *reply, size_t len)
+{
+    struct SurfmanState *ss = opaque;
+
+    if (!reply) {
+        /* Lost on the way, make sure the next resize goes through. */
+        memset(&ss->current, 0, sizeof (ss->current));
+    }
+}
+
+/* The geometry of the framebuffer (Surface) of DisplayState has changed.
+ * Surfman's acknowledgement is handled asynchronously, so mode switches
+ * don't stall the main loop on the round trip. */
 static void surfman_dpy_gfx_resize(struct DisplayState *ds)
 {
     struct msg_display_resize msg;
-    struct msg_empty_reply reply;
 
     if (!surfman_lfb_state_compare(&ss->current, ds)) {
         return;
     }
+    /* Damage recorded against the old geometry is meaningless now. */
+    ss->nr_dirty = 0;
     msg.DisplayID = 0;  /* Not supported anyway. */
     msg.width = ds_get_width(ds);
     msg.height = ds_get_height(ds);
@@ -93,8 +264,10 @@ static void surfman_dpy_gfx_resize(struct DisplayState *ds)
                  ds->have_text ? "have text" : "",
                  ds->have_gfx ? "have gfx" : "");
 
-    dmbus_send(ss->dmbus_service, DMBUS_MSG_DISPLAY_RESIZE, &msg, sizeof (msg));
-    dmbus_sync_recv(ss->dmbus_service, DMBUS_MSG_EMPTY_REPLY, &reply, sizeof (reply));
+    if (dmbus_send_async(ss->dmbus_service, DMBUS_MSG_DISPLAY_RESIZE, &msg, sizeof (msg),
+                         DMBUS_MSG_EMPTY_REPLY, surfman_resize_done, ss) < 0) {
+        return;
+    }
     surfman_lfb_state_save(ss);
 }
 
@@ -115,30 +288,101 @@ static void surfman_dpy_gfx_setdata(struct DisplayState *ds)
 //static void surfman_dpy_mouse_set(struct DisplayState *s, int x, int y, int on);
 //static void surfman_dpy_cursor_define(struct DisplayState *s, QEMUCursor *cursor);
 
+static void surfman_set_display_info(struct SurfmanState *ss,
+                                     uint16_t max_xres, uint16_t max_yres,
+                                     uint16_t align)
+{
+    ss->info.max_xres = max_xres;
+    ss->info.max_yres = max_yres;
+    ss->info.align = align;
+    ss->info_valid = true;
+}
+
+static void surfman_display_info_done(void *opaque, const void *reply, size_t len)
+{
+    struct SurfmanState *ss = opaque;
+    const struct msg_display_info *info = reply;
+
+    if (info && len >= sizeof (*info)) {
+        surfman_set_display_info(ss, info->max_xres, info->max_yres, info->align);
+    }
+}
+
+/* Refresh the cached display limits in the background. */
+static void surfman_query_display_info(struct SurfmanState *ss)
+{
+    struct msg_display_get_info msg;
+
+    msg.DisplayID = 0;
+    dmbus_send_async(ss->dmbus_service, DMBUS_MSG_DISPLAY_GET_INFO, &msg, sizeof (msg),
+                     DMBUS_MSG_DISPLAY_INFO, surfman_display_info_done, ss);
+}
+
 static void surfman_dpy_get_display_limits(DisplayState *ds,
                                            unsigned int *width_max, unsigned int *height_max,
                                            unsigned int *stride_alignment)
 {
-    struct msg_display_get_info msg;
-    struct msg_display_info reply;
+    if (!ss->info_valid) {
+        /* Nothing cached yet, there is no way around asking now. */
+        struct msg_display_get_info msg;
+        struct msg_display_info reply;
 
-    msg.DisplayID = 0;
-    dmbus_send(ss->dmbus_service, DMBUS_MSG_DISPLAY_GET_INFO, &msg, sizeof (msg));
-    dmbus_sync_recv(ss->dmbus_service, DMBUS_MSG_DISPLAY_INFO, &reply, sizeof (reply));
+        msg.DisplayID = 0;
+        dmbus_send(ss->dmbus_service, DMBUS_MSG_DISPLAY_GET_INFO, &msg, sizeof (msg));
+        if (dmbus_sync_recv(ss->dmbus_service, DMBUS_MSG_DISPLAY_INFO, &reply, sizeof (reply)) < 0) {
+            return;
+        }
+        surfman_set_display_info(ss, reply.max_xres, reply.max_yres, reply.align);
+    }
 
     if (width_max)
-        *width_max = reply.max_xres;
+        *width_max = ss->info.max_xres;
     if (height_max)
-        *height_max = reply.max_yres;
+        *height_max = ss->info.max_yres;
     if (stride_alignment)
-        *stride_alignment = reply.align;
+        *stride_alignment = ss->info.align;
 
-    surfman_debug("display_limits: %ux%u stride aligned on %u.", *width_max, *height_max, *stride_alignment);
+    surfman_debug("display_limits: %ux%u stride aligned on %u.",
+                  ss->info.max_xres, ss->info.max_yres, ss->info.align);
+}
+
+/* Surfman announces new limits on its own, e.g. on monitor hotplug. */
+static void surfman_on_display_info(void *opaque, uint8_t DisplayID, uint16_t max_xres,
+                                    uint16_t max_yres, uint16_t align)
+{
+    if (DisplayID == 0) {
+        surfman_set_display_info(opaque, max_xres, max_yres, align);
+    }
+}
+
+/* Surfman tells us whether the VM is on screen, and how slow we may go. */
+static void surfman_on_display_visibility(void *opaque, uint8_t DisplayID, int visible,
+                                          uint32_t refresh_interval)
+{
+    struct SurfmanState *ss = opaque;
+
+    if (DisplayID != 0) {
+        return;
+    }
+    surfman_debug("visibility: %s, max refresh interval %ums.",
+                  visible ? "visible" : "hidden", refresh_interval);
+    ss->visible = !!visible;
+    ss->refresh_max = refresh_interval ? MAX(refresh_interval, GUI_REFRESH_INTERVAL)
+                                       : SURFMAN_REFRESH_MAX;
+    surfman_refresh_reset(ss);
 }
 
 static void surfman_on_reconnect(void *opaque)
 {
+    struct SurfmanState *ss = opaque;
+
+    /* Surfman may have been restarted with different limits. */
+    ss->info_valid = false;
+    ss->visible = true;
+    surfman_refresh_reset(ss);
+    memset(&ss->current, 0, sizeof (ss->current));
     surfman_dpy_gfx_resize(ss->ds);
+    surfman_query_display_info(ss);
 }
 
 static struct dmbus_ops surfman_dmbus_ops = {
@@ -146,8 +390,9 @@ static struct dmbus_ops surfman_dmbus_ops = {
     .dom0_input_pvm = NULL,
     .input_config = NULL,
     .input_config_reset = NULL,
-    .display_info = NULL,
+    .display_info = surfman_on_display_info,
     .display_edid = NULL,
+    .display_visibility = surfman_on_display_visibility,
     .reconnect = surfman_on_reconnect
 };
 
@@ -160,6 +405,9 @@ void surfman_display_init(DisplayState *ds)
 
     ss = g_malloc0(sizeof (*ss));
     ss->ds = ds;
+    ss->visible = true;
+    ss->refresh_max = SURFMAN_REFRESH_MAX;
+    surfman_refresh_reset(ss);
     ss->vram = xen_get_framebuffer();
     if (!ss->vram) {
         surfman_error("Could not recover VRAM MemoryRegion.");
@@ -171,6 +419,7 @@ void surfman_display_init(DisplayState *ds)
         surfman_error("Could not initialize dmbus.");
         goto err_dmbus;
     }
+    surfman_query_display_info(ss);
 
     dcl = g_malloc0(sizeof (*dcl));
     dcl->idle = 0;
@@ -186,5 +435,6 @@ void surfman_display_init(DisplayState *ds)
 err_dmbus:
 err_vram:
     g_free(ss);
+    ss = NULL;
 }
 
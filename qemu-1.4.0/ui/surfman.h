@@ -30,12 +30,33 @@ struct lfb_state {
     FramebufferFormat format;
     hwaddr addr;
 };
+/* Idle refresh back off, doubling from GUI_REFRESH_INTERVAL up to this. */
+#define SURFMAN_REFRESH_MAX     1000
+
+/* Damage accumulated during one refresh tick. */
+#define SURFMAN_MAX_DIRTY_RECTS 16
+struct surfman_rect {
+    int x, y, w, h;
+};
+
 struct SurfmanState {
     struct DisplayState *ds;
     dmbus_service_t dmbus_service;
     MemoryRegion *vram;         // VRAM region hackishly recovered.
     uint8_t *vram_ptr;		// Pointer to the vram mapped in the mapcache.
     struct lfb_state current;
+    struct surfman_rect dirty[SURFMAN_MAX_DIRTY_RECTS];
+    unsigned int nr_dirty;
+    struct {
+        uint16_t max_xres;
+        uint16_t max_yres;
+        uint16_t align;
+    } info;                     // Display limits, as last reported by Surfman.
+    bool info_valid;
+    bool visible;               // Surfman shows this VM at the moment.
+    unsigned int refresh_interval;      // Current refresh interval (ms).
+    unsigned int refresh_max;           // Upper bound of the idle back off (ms).
+    int64_t next_refresh;
 };
 
 static inline FramebufferFormat surfman_get_format(pixman_format_code_t format)
@@ -0,0 +1,138 @@
+/*
+ * QEMU VNC display driver: JPEG encoders
+ *
+ * Copyright (C) 2010 Corentin Chary <corentin.chary@gmail.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "config-host.h"
+
+/* This needs to be before jpeglib.h line because of conflict with
+   INT32 definitions between jmorecfg.h (included by jpeglib.h) and
+   Win32 basetsd.h (included by windows.h). */
+#include "qemu-common.h"
+
+#include <stdio.h>
+#include <jpeglib.h>
+
+#include "vnc.h"
+#include "vnc-enc-jpeg.h"
+
+/*
+ * libjpeg, with a destination manager that writes to a Buffer.
+ */
+
+/* This is called once per encoding */
+static void jpeg_init_destination(j_compress_ptr cinfo)
+{
+    Buffer *buffer = cinfo->client_data;
+
+    cinfo->dest->next_output_byte = (JOCTET *)buffer->buffer + buffer->offset;
+    cinfo->dest->free_in_buffer = (size_t)(buffer->capacity - buffer->offset);
+}
+
+/* This is called when we ran out of buffer (shouldn't happen!) */
+static boolean jpeg_empty_output_buffer(j_compress_ptr cinfo)
+{
+    Buffer *buffer = cinfo->client_data;
+
+    buffer->offset = buffer->capacity;
+    buffer_reserve(buffer, 2048);
+    jpeg_init_destination(cinfo);
+    return TRUE;
+}
+
+/* This is called when we are done processing data */
+static void jpeg_term_destination(j_compress_ptr cinfo)
+{
+    Buffer *buffer = cinfo->client_data;
+
+    buffer->offset = buffer->capacity - cinfo->dest->free_in_buffer;
+}
+
+static int libjpeg_compress(pixman_image_t *src, int x, int y, int w, int h,
+                            int quality, Buffer *out)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_destination_mgr manager;
+    pixman_image_t *linebuf;
+    JSAMPROW row[1];
+    uint8_t *buf;
+    int dy;
+
+    buffer_reserve(out, 2048);
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    cinfo.client_data = out;
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, true);
+
+    manager.init_destination = jpeg_init_destination;
+    manager.empty_output_buffer = jpeg_empty_output_buffer;
+    manager.term_destination = jpeg_term_destination;
+    cinfo.dest = &manager;
+
+    jpeg_start_compress(&cinfo, true);
+
+    linebuf = qemu_pixman_linebuf_create(PIXMAN_BE_r8g8b8, w);
+    buf = (uint8_t *)pixman_image_get_data(linebuf);
+    row[0] = buf;
+    for (dy = 0; dy < h; dy++) {
+        qemu_pixman_linebuf_fill(linebuf, src, w, x, y + dy);
+        jpeg_write_scanlines(&cinfo, row, 1);
+    }
+    qemu_pixman_image_unref(linebuf);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+}
+
+static const VncJpegEncoder vnc_jpeg_libjpeg = {
+    .name = "libjpeg",
+    .compress = libjpeg_compress,
+};
+
+/* Encoders other than libjpeg go here */
+static const VncJpegEncoder *vnc_jpeg_encoders[] = {
+    &vnc_jpeg_libjpeg,
+};
+
+const VncJpegEncoder *vnc_jpeg_find_encoder(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(vnc_jpeg_encoders); i++) {
+        const VncJpegEncoder *enc = vnc_jpeg_encoders[i];
+
+        if (!strcmp(enc->name, name)) {
+            return !enc->probe || enc->probe() ? enc : NULL;
+        }
+    }
+    return NULL;
+}
+
+int vnc_jpeg_compress(VncState *vs, int x, int y, int w, int h,
+                      int quality, bool video, Buffer *out)
+{
+    const VncJpegEncoder *enc = vs->vd->jpeg_encoder;
+    size_t offset = out->offset;
+
+    if (enc && enc != &vnc_jpeg_libjpeg && video && w * h >= enc->min_pixels) {
+        if (enc->compress(vs->vd->server, x, y, w, h, quality, out) == 0) {
+            return 0;
+        }
+        out->offset = offset;
+    }
+    return libjpeg_compress(vs->vd->server, x, y, w, h, quality, out);
+}
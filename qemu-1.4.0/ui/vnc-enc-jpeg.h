@@ -0,0 +1,45 @@
+/*
+ * QEMU VNC display driver: JPEG encoders
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef VNC_ENCODING_JPEG_H
+#define VNC_ENCODING_JPEG_H
+
+#include "vnc.h"
+
+/*
+ * Tight JPEG rectangles are compressed by libjpeg unless -vnc
+ * jpeg-encoder=<name> picks another encoder, e.g. one that offloads the
+ * work to a hardware codec.  Setting up such a codec costs more than
+ * libjpeg does for a small rectangle, so the other encoder only gets the
+ * regions that the update frequency statistics say are video-like, and
+ * only from min_pixels up.
+ */
+struct VncJpegEncoder {
+    const char *name;
+    int min_pixels;
+
+    /* Whether the encoder can be used on this host; may be NULL */
+    bool (*probe)(void);
+
+    /* Append the JPEG image of the w x h pixels at (x, y) of @src, of
+     * @quality from 0 to 100, to @out.  The VNC worker threads may call
+     * it concurrently.  Returns 0, or -1 to fall back to libjpeg.
+     */
+    int (*compress)(pixman_image_t *src, int x, int y, int w, int h,
+                    int quality, Buffer *out);
+};
+
+/* The encoder called @name, or NULL if there is none usable */
+const VncJpegEncoder *vnc_jpeg_find_encoder(const char *name);
+
+/* Compress a rectangle of the server surface into @out; @video is set for
+ * rectangles in frequently updated regions.
+ */
+int vnc_jpeg_compress(VncState *vs, int x, int y, int w, int h,
+                      int quality, bool video, Buffer *out);
+
+#endif /* VNC_ENCODING_JPEG_H */
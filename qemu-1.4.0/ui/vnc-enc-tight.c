@@ -39,15 +39,11 @@
 #define PNG_SKIP_SETJMP_CHECK
 #include <png.h>
 #endif
-#ifdef CONFIG_VNC_JPEG
-#include <stdio.h>
-#include <jpeglib.h>
-#endif
-
 #include "qemu/bswap.h"
 #include "qapi/qmp/qint.h"
 #include "vnc.h"
 #include "vnc-enc-tight.h"
+#include "vnc-enc-jpeg.h"
 #include "vnc-palette.h"
 
 /* Compression level stuff. The following array contains various
@@ -96,6 +92,13 @@ static const struct {
     { 0.4, 14, 0, 0 },
     { 0.5, 16, 0, 0 },
 };
+
+/* The client's JPEG quality, lowered if the link is too slow for it */
+static int tight_jpeg_quality(VncState *vs)
+{
+    return tight_conf[MIN(vs->tight.quality,
+                          vs->link.quality_max)].jpeg_quality;
+}
 #endif
 
 #ifdef CONFIG_VNC_PNG
@@ -1139,86 +1142,13 @@ static int send_palette_rect(VncState *vs, int x, int y,
  * JPEG compression stuff.
  */
 #ifdef CONFIG_VNC_JPEG
-/*
- * Destination manager implementation for JPEG library.
- */
-
-/* This is called once per encoding */
-static void jpeg_init_destination(j_compress_ptr cinfo)
+static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h,
+                          int quality, bool video)
 {
-    VncState *vs = cinfo->client_data;
-    Buffer *buffer = &vs->tight.jpeg;
-
-    cinfo->dest->next_output_byte = (JOCTET *)buffer->buffer + buffer->offset;
-    cinfo->dest->free_in_buffer = (size_t)(buffer->capacity - buffer->offset);
-}
-
-/* This is called when we ran out of buffer (shouldn't happen!) */
-static boolean jpeg_empty_output_buffer(j_compress_ptr cinfo)
-{
-    VncState *vs = cinfo->client_data;
-    Buffer *buffer = &vs->tight.jpeg;
-
-    buffer->offset = buffer->capacity;
-    buffer_reserve(buffer, 2048);
-    jpeg_init_destination(cinfo);
-    return TRUE;
-}
-
-/* This is called when we are done processing data */
-static void jpeg_term_destination(j_compress_ptr cinfo)
-{
-    VncState *vs = cinfo->client_data;
-    Buffer *buffer = &vs->tight.jpeg;
-
-    buffer->offset = buffer->capacity - cinfo->dest->free_in_buffer;
-}
-
-static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
-{
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    struct jpeg_destination_mgr manager;
-    pixman_image_t *linebuf;
-    JSAMPROW row[1];
-    uint8_t *buf;
-    int dy;
-
     if (ds_get_bytes_per_pixel(vs->ds) == 1)
         return send_full_color_rect(vs, x, y, w, h);
 
-    buffer_reserve(&vs->tight.jpeg, 2048);
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-
-    cinfo.client_data = vs;
-    cinfo.image_width = w;
-    cinfo.image_height = h;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, true);
-
-    manager.init_destination = jpeg_init_destination;
-    manager.empty_output_buffer = jpeg_empty_output_buffer;
-    manager.term_destination = jpeg_term_destination;
-    cinfo.dest = &manager;
-
-    jpeg_start_compress(&cinfo, true);
-
-    linebuf = qemu_pixman_linebuf_create(PIXMAN_BE_r8g8b8, w);
-    buf = (uint8_t *)pixman_image_get_data(linebuf);
-    row[0] = buf;
-    for (dy = 0; dy < h; dy++) {
-        qemu_pixman_linebuf_fill(linebuf, vs->vd->server, w, x, y + dy);
-        jpeg_write_scanlines(&cinfo, row, 1);
-    }
-    qemu_pixman_image_unref(linebuf);
-
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    vnc_jpeg_compress(vs, x, y, w, h, quality, video, &vs->tight.jpeg);
 
     vnc_write_u8(vs, VNC_TIGHT_JPEG << 4);
 
@@ -1428,9 +1358,9 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
     if (colors == 0) {
         if (force || (tight_jpeg_conf[vs->tight.quality].jpeg_full &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight.quality].jpeg_quality;
+            int quality = tight_jpeg_quality(vs);
 
-            ret = send_jpeg_rect(vs, x, y, w, h, quality);
+            ret = send_jpeg_rect(vs, x, y, w, h, quality, force);
         } else {
             ret = send_full_color_rect(vs, x, y, w, h);
         }
@@ -1442,9 +1372,9 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
         if (force || (colors > 96 &&
                       tight_jpeg_conf[vs->tight.quality].jpeg_idx &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight.quality].jpeg_quality;
+            int quality = tight_jpeg_quality(vs);
 
-            ret = send_jpeg_rect(vs, x, y, w, h, quality);
+            ret = send_jpeg_rect(vs, x, y, w, h, quality, force);
         } else {
             ret = send_palette_rect(vs, x, y, w, h, palette);
         }
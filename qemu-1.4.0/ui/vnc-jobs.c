@@ -41,28 +41,37 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds the VncDisplay global lock
+ * shared with the other workers to avoid screen corruption (this does not
+ * block vnc_refresh() because it uses trylock()) but the output lock is not
+ * held because the thread works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Several workers can take jobs from the queue, but only one at a time
+ * encodes for a given client: the zlib streams of the tight, zlib and ZRLE
+ * encoders carry over from one update to the next, so each client's updates
+ * are encoded in order.
  */
 
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
     bool exit;
+    int nr_threads;
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
+typedef struct VncWorker {
+    VncJobQueue *queue;
+    QemuThread thread;
+    Buffer buffer;
+} VncWorker;
+
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue for all the encoding threads
  */
 static VncJobQueue *queue;
 
@@ -76,6 +85,16 @@ static void vnc_unlock_queue(VncJobQueue *queue)
     qemu_mutex_unlock(&queue->mutex);
 }
 
+static void vnc_job_free(VncJob *job)
+{
+    VncRectEntry *entry, *tmp;
+
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        g_free(entry);
+    }
+    g_free(job);
+}
+
 VncJob *vnc_job_new(VncState *vs)
 {
     VncJob *job = g_malloc0(sizeof(VncJob));
@@ -106,7 +125,7 @@ void vnc_job_push(VncJob *job)
 {
     vnc_lock_queue(queue);
     if (queue->exit || QLIST_EMPTY(&job->rectangles)) {
-        g_free(job);
+        vnc_job_free(job);
     } else {
         QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
         qemu_cond_broadcast(&queue->cond);
@@ -142,8 +161,10 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* A job being encoded is removed by its worker */
+        if ((job->vs == vs || !vs) && !job->running) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
+            vnc_job_free(job);
         }
     }
     vnc_unlock_queue(queue);
@@ -166,7 +187,9 @@ void vnc_jobs_consume_buffer(VncState *vs)
     vnc_lock_output(vs);
     if (vs->jobs_buffer.offset) {
         vnc_write(vs, vs->jobs_buffer.buffer, vs->jobs_buffer.offset);
+        vnc_link_queued(vs, vs->jobs_buffer.offset);
         buffer_reset(&vs->jobs_buffer);
+        vnc_fence_probe(vs);
     }
     flush = vs->csock != -1 && vs->abort != true;
     vnc_unlock_output(vs);
@@ -179,7 +202,8 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *buffer)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -189,17 +213,19 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->write_pixels = orig->write_pixels;
     local->client_pf = orig->client_pf;
     local->client_be = orig->client_be;
+    local->link.quality_max = orig->link.quality_max;
     local->tight = orig->tight;
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output = *buffer;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncState *orig, VncState *local,
+                                   Buffer *buffer)
 {
     orig->tight = local->tight;
     orig->zlib = local->zlib;
@@ -207,11 +233,33 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    *buffer = local->output;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+/* The oldest job whose client no other worker is encoding for */
+static VncJob *vnc_queue_next_job(VncJobQueue *queue)
 {
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->running) {
+            continue;
+        }
+        QTAILQ_FOREACH(prev, &queue->jobs, next) {
+            if (prev == job || prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static int vnc_worker_thread_loop(VncWorker *worker)
+{
+    VncJobQueue *queue = worker->queue;
     VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs;
@@ -219,16 +267,15 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!queue->exit && !(job = vnc_queue_next_job(queue))) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->running = true;
+    vnc_unlock_queue(queue);
 
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
@@ -238,7 +285,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(job->vs, &vs, &worker->buffer);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -247,12 +294,14 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
+            /* keep the buffer for the next job */
+            worker->buffer = vs.output;
             goto disconnected;
         }
 
@@ -262,9 +311,10 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         if (n >= 0) {
             n_rectangles += n;
         }
+        QLIST_REMOVE(entry, next);
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -276,9 +326,11 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
                       vs.output.offset);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(job->vs, &vs, &worker->buffer);
 
 	qemu_bh_schedule(job->vs->bh);
+    } else {
+        worker->buffer = vs.output;
     }
     vnc_unlock_output(job->vs);
 
@@ -287,7 +339,7 @@ disconnected:
     QTAILQ_REMOVE(&queue->jobs, job, next);
     vnc_unlock_queue(queue);
     qemu_cond_broadcast(&queue->cond);
-    g_free(job);
+    vnc_job_free(job);
     return 0;
 }
 
@@ -305,19 +357,30 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
 
 static void *vnc_worker_thread(void *arg)
 {
-    VncJobQueue *queue = arg;
+    VncWorker *worker = arg;
+    VncJobQueue *queue = worker->queue;
+    bool last;
 
-    qemu_thread_get_self(&queue->thread);
+    qemu_thread_get_self(&worker->thread);
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    while (!vnc_worker_thread_loop(worker)) ;
+
+    buffer_free(&worker->buffer);
+    g_free(worker);
+
+    /* The last worker out frees the queue */
+    vnc_lock_queue(queue);
+    last = --queue->nr_threads == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -326,6 +389,16 @@ static bool vnc_worker_thread_running(void)
     return queue; /* Check global queue */
 }
 
+static void vnc_add_worker_thread(VncJobQueue *q)
+{
+    VncWorker *worker = g_malloc0(sizeof(VncWorker));
+
+    worker->queue = q;
+    q->nr_threads++;
+    qemu_thread_create(&worker->thread, vnc_worker_thread, worker,
+                       QEMU_THREAD_DETACHED);
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
@@ -334,10 +407,22 @@ void vnc_start_worker_thread(void)
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q, QEMU_THREAD_DETACHED);
+    vnc_add_worker_thread(q);
     queue = q; /* Set global queue */
 }
 
+void vnc_set_worker_threads(int n)
+{
+    if (!vnc_worker_thread_running())
+        return ;
+
+    vnc_lock_queue(queue);
+    while (queue->nr_threads < n) {
+        vnc_add_worker_thread(queue);
+    }
+    vnc_unlock_queue(queue);
+}
+
 void vnc_stop_worker_thread(void)
 {
     if (!vnc_worker_thread_running())
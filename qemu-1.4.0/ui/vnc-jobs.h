@@ -30,6 +30,8 @@
 #ifndef VNC_JOBS_H
 #define VNC_JOBS_H
 
+#define VNC_WORKER_THREADS_MAX 16
+
 /* Jobs */
 VncJob *vnc_job_new(VncState *vs);
 int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h);
@@ -41,11 +43,20 @@ void vnc_jobs_join(VncState *vs);
 void vnc_jobs_consume_buffer(VncState *vs);
 void vnc_start_worker_thread(void);
 void vnc_stop_worker_thread(void);
+void vnc_set_worker_threads(int n);
 
 /* Locks */
+/* Fails while the display is locked or workers hold it shared */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -EBUSY;
+    }
+    if (vd->nr_encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -EBUSY;
+    }
+    return 0;
 }
 
 static inline void vnc_lock_display(VncDisplay *vd)
@@ -58,6 +69,21 @@ static inline void vnc_unlock_display(VncDisplay *vd)
     qemu_mutex_unlock(&vd->mutex);
 }
 
+/* Taken by the workers, which only read the server surface */
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->nr_encoders++;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->nr_encoders--;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
 static inline void vnc_lock_output(VncState *vs)
 {
     qemu_mutex_lock(&vs->output_mutex);
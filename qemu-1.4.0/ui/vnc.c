@@ -26,6 +26,7 @@
 
 #include "vnc.h"
 #include "vnc-jobs.h"
+#include "vnc-enc-jpeg.h"
 #include "sysemu/sysemu.h"
 #include "qemu/sockets.h"
 #include "qemu/timer.h"
@@ -40,6 +41,23 @@
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
+/* Link estimation, for clients that do fences */
+#define VNC_LINK_MIN_SAMPLE       (32 * 1024)     /* bytes */
+#define VNC_LINK_MIN_WINDOW       (256 * 1024)    /* bytes */
+#define VNC_LINK_QUALITY_MAX      9
+#define VNC_FENCE_TIMEOUT         (2 * 1000000000LL)  /* ns */
+
+/* JPEG quality level cap for links slower than the given bytes/s */
+static const struct {
+    uint64_t bandwidth;
+    uint8_t quality_max;
+} vnc_link_quality[] = {
+    { 256 << 10, 2 },
+    {   1 << 20, 4 },
+    {   4 << 20, 6 },
+    {  16 << 20, 8 },
+};
+
 #include "vnc_keysym.h"
 #include "d3des.h"
 
@@ -735,16 +753,19 @@ static void vnc_copy(VncState *vs, int src_x, int src_y, int dst_x, int dst_y, i
     vnc_flush(vs);
 }
 
-static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
+/* Move a region of the server surface, and have the clients that can do
+ * it move it too.  They are brought up to date with the server surface
+ * first.
+ */
+static void vnc_server_copy(VncDisplay *vd, int src_x, int src_y,
+                            int dst_x, int dst_y, int w, int h)
 {
-    VncDisplay *vd = ds->opaque;
     VncState *vs, *vn;
     uint8_t *src_row;
     uint8_t *dst_row;
     int i, x, y, pitch, inc, w_lim, s;
     int cmp_bytes;
 
-    vnc_refresh_server_surface(vd);
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
         if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
             vs->force_update = 1;
@@ -806,6 +827,14 @@ static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int
     }
 }
 
+static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
+{
+    VncDisplay *vd = ds->opaque;
+
+    vnc_refresh_server_surface(vd);
+    vnc_server_copy(vd, src_x, src_y, dst_x, dst_y, w, h);
+}
+
 static void vnc_mouse_set(DisplayState *ds, int x, int y, int visible)
 {
     /* can we ask the client(s) to move the pointer ??? */
@@ -869,6 +898,28 @@ static int find_and_clear_dirty_height(struct VncState *vs,
     return h;
 }
 
+/*
+ * Whether a client that does fences still has more than the link can carry
+ * in one round trip to get through.  Only the minimum round trip time
+ * counts: the smoothed one grows with the queue this is meant to avoid.
+ */
+static bool vnc_link_congested(VncState *vs)
+{
+    VncLink *link = &vs->link;
+    uint64_t window;
+
+    if (!link->probe_pending || !link->bandwidth) {
+        return false;
+    }
+    if (qemu_get_clock_ns(rt_clock) - link->probe_time > VNC_FENCE_TIMEOUT) {
+        /* a late or lost echo must not stall the client */
+        return false;
+    }
+    window = link->bandwidth * link->rtt_min / 1000000000 * 2;
+    window = MAX(window, VNC_LINK_MIN_WINDOW);
+    return link->bytes_queued - link->acked_pos > window;
+}
+
 static int vnc_update_client_sync(VncState *vs, int has_dirty)
 {
     int ret = vnc_update_client(vs, has_dirty);
@@ -881,7 +932,8 @@ static int vnc_update_client(VncState *vs, int has_dirty)
     if (vs->need_update && vs->csock != -1) {
         VncDisplay *vd = vs->vd;
         VncJob *job;
-        int y;
+        int y, y0 = 0;
+        int x0 = 0, x1;
         int width, height;
         int n = 0;
 
@@ -890,6 +942,10 @@ static int vnc_update_client(VncState *vs, int has_dirty)
             /* kernel send buffers are full -> drop frames to throttle */
             return 0;
 
+        if (vnc_link_congested(vs) && !vs->force_update)
+            /* more would only queue up in front of a slow link */
+            return 0;
+
         if (!has_dirty && !vs->audio_cap && !vs->force_update)
             return 0;
 
@@ -903,11 +959,18 @@ static int vnc_update_client(VncState *vs, int has_dirty)
 
         width = MIN(pixman_image_get_width(vd->server), vs->client_width);
         height = MIN(pixman_image_get_height(vd->server), vs->client_height);
+        x1 = width / 16;
+        if (vs->continuous_updates) {
+            y0 = MIN(vs->cu_y, height);
+            height = MIN(vs->cu_y + vs->cu_h, height);
+            x0 = MIN(vs->cu_x / 16, x1);
+            x1 = MIN(DIV_ROUND_UP(vs->cu_x + vs->cu_w, 16), x1);
+        }
 
-        for (y = 0; y < height; y++) {
+        for (y = y0; y < height; y++) {
             int x;
             int last_x = -1;
-            for (x = 0; x < width / 16; x++) {
+            for (x = x0; x < x1; x++) {
                 if (test_and_clear_bit(x, vs->dirty[y])) {
                     if (last_x == -1) {
                         last_x = x;
@@ -1813,10 +1876,181 @@ static void send_ext_audio_ack(VncState *vs)
     vnc_flush(vs);
 }
 
+static void vnc_write_fence(VncState *vs, uint32_t flags,
+                            const uint8_t *data, uint8_t len)
+{
+    vnc_write_u8(vs, VNC_MSG_SERVER_FENCE);
+    vnc_write_u8(vs, 0);
+    vnc_write_u16(vs, 0);
+    vnc_write_u32(vs, flags);
+    vnc_write_u8(vs, len);
+    vnc_write(vs, data, len);
+}
+
+void vnc_link_queued(VncState *vs, size_t len)
+{
+    VncLink *link = &vs->link;
+
+    if (link->bytes_queued == link->acked_pos) {
+        link->busy_since = qemu_get_clock_ns(rt_clock);
+    }
+    link->bytes_queued += len;
+}
+
+void vnc_fence_probe(VncState *vs)
+{
+    VncLink *link = &vs->link;
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    uint8_t seq[4];
+
+    if (!vnc_has_feature(vs, VNC_FEATURE_FENCE)) {
+        return;
+    }
+    if (link->probe_pending && now - link->probe_time < VNC_FENCE_TIMEOUT) {
+        return;
+    }
+
+    link->probe_pending = true;
+    link->probe_seq++;
+    link->probe_time = now;
+    link->probe_pos = link->bytes_queued;
+    seq[0] = link->probe_seq >> 24;
+    seq[1] = link->probe_seq >> 16;
+    seq[2] = link->probe_seq >> 8;
+    seq[3] = link->probe_seq;
+    vnc_write_fence(vs, VNC_FENCE_REQUEST | VNC_FENCE_BLOCK_BEFORE,
+                    seq, sizeof(seq));
+}
+
+/* The client echoed the probe: it has processed everything before it */
+static void vnc_link_sample(VncState *vs)
+{
+    VncLink *link = &vs->link;
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int64_t rtt = MAX(now - link->probe_time, 1);
+    uint64_t bytes = link->probe_pos - link->acked_pos;
+    int i;
+
+    link->rtt = link->rtt ? (link->rtt * 7 + rtt) / 8 : rtt;
+    if (!link->rtt_min || rtt < link->rtt_min) {
+        link->rtt_min = rtt;
+    }
+
+    /* A few bytes only measure the latency.  With more, whatever took
+     * longer than an empty round trip is the time they took to drain.
+     */
+    if (bytes >= VNC_LINK_MIN_SAMPLE) {
+        int64_t busy = MAX(now - link->busy_since - link->rtt_min,
+                           1000000);
+        uint64_t bw = bytes * 1000000000ULL / busy;
+
+        link->bandwidth = link->bandwidth ?
+                          (link->bandwidth * 3 + bw) / 4 : bw;
+    }
+
+    link->acked_pos = link->probe_pos;
+    link->busy_since = now;
+    link->probe_pending = false;
+
+    link->quality_max = VNC_LINK_QUALITY_MAX;
+    if (link->bandwidth && !vs->vd->non_adaptive) {
+        for (i = 0; i < ARRAY_SIZE(vnc_link_quality); i++) {
+            if (link->bandwidth < vnc_link_quality[i].bandwidth) {
+                link->quality_max = vnc_link_quality[i].quality_max;
+                break;
+            }
+        }
+    }
+}
+
+static void vnc_fence_reply(VncState *vs, uint32_t flags,
+                            const uint8_t *data, uint8_t len)
+{
+    if (flags & VNC_FENCE_BLOCK_BEFORE) {
+        /* the updates already under way go first */
+        vnc_jobs_join(vs);
+    }
+    vnc_lock_output(vs);
+    vnc_write_fence(vs, flags, data, len);
+    vnc_unlock_output(vs);
+    vnc_flush(vs);
+}
+
+static void vnc_fence_sync_reply(VncState *vs)
+{
+    vs->fence_sync_pending = false;
+    vnc_fence_reply(vs, vs->fence_sync_flags, vs->fence_sync_data,
+                    vs->fence_sync_len);
+}
+
+static void client_fence(VncState *vs, uint32_t flags,
+                         uint8_t *data, uint8_t len)
+{
+    if (!vnc_has_feature(vs, VNC_FEATURE_FENCE)) {
+        VNC_DEBUG("Fence without the Fence pseudo-encoding\n");
+        vnc_client_error(vs);
+        return;
+    }
+
+    if (!(flags & VNC_FENCE_REQUEST)) {
+        if (vs->link.probe_pending && len == 4 &&
+            read_u32(data, 0) == vs->link.probe_seq) {
+            vnc_link_sample(vs);
+        }
+        return;
+    }
+
+    if (vs->fence_sync_pending) {
+        vnc_fence_sync_reply(vs);
+    }
+    flags &= VNC_FENCE_FLAGS_SUPPORTED;
+    if (flags & VNC_FENCE_SYNC_NEXT) {
+        /* answered once the next message has been processed */
+        vs->fence_sync_pending = true;
+        vs->fence_sync_flags = flags;
+        vs->fence_sync_len = len;
+        memcpy(vs->fence_sync_data, data, len);
+        return;
+    }
+    vnc_fence_reply(vs, flags, data, len);
+}
+
+static void vnc_end_continuous_updates(VncState *vs)
+{
+    vnc_jobs_join(vs);
+    vnc_lock_output(vs);
+    vnc_write_u8(vs, VNC_MSG_SERVER_END_OF_CONTINUOUS_UPDATES);
+    vnc_unlock_output(vs);
+    vnc_flush(vs);
+}
+
+static void enable_continuous_updates(VncState *vs, int enable,
+                                      int x, int y, int w, int h)
+{
+    if (!vnc_has_feature(vs, VNC_FEATURE_CONTINUOUS_UPDATES)) {
+        VNC_DEBUG("EnableContinuousUpdates without the pseudo-encoding\n");
+        vnc_client_error(vs);
+        return;
+    }
+
+    if (enable) {
+        vs->continuous_updates = true;
+        vs->cu_x = x;
+        vs->cu_y = y;
+        vs->cu_w = w;
+        vs->cu_h = h;
+        vs->need_update = 1;
+    } else {
+        vs->continuous_updates = false;
+        vnc_end_continuous_updates(vs);
+    }
+}
+
 static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
 {
     int i;
     unsigned int enc = 0;
+    uint32_t old_features = vs->features;
 
     vs->features = 0;
     vs->vnc_encoding = 0;
@@ -1879,6 +2113,12 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
         case VNC_ENCODING_AUDIO:
             send_ext_audio_ack(vs);
             break;
+        case VNC_ENCODING_FENCE:
+            vs->features |= VNC_FEATURE_FENCE_MASK;
+            break;
+        case VNC_ENCODING_CONTINUOUS_UPDATES:
+            vs->features |= VNC_FEATURE_CONTINUOUS_UPDATES_MASK;
+            break;
         case VNC_ENCODING_WMVi:
             vs->features |= VNC_FEATURE_WMVI_MASK;
             break;
@@ -1897,6 +2137,19 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
     }
     vnc_desktop_resize(vs);
     check_pointer_type_change(&vs->mouse_mode_notifier, NULL);
+
+    if (!vnc_has_feature(vs, VNC_FEATURE_CONTINUOUS_UPDATES)) {
+        vs->continuous_updates = false;
+    } else if (!(old_features & VNC_FEATURE_CONTINUOUS_UPDATES_MASK)) {
+        /* this is how the client learns that the server does them */
+        vnc_end_continuous_updates(vs);
+    }
+    if (vnc_has_feature(vs, VNC_FEATURE_FENCE)) {
+        vnc_lock_output(vs);
+        vnc_fence_probe(vs);
+        vnc_unlock_output(vs);
+        vnc_flush(vs);
+    }
 }
 
 static void set_pixel_conversion(VncState *vs)
@@ -2006,7 +2259,7 @@ static int protocol_client_msg(VncState *vs, uint8_t *data, size_t len)
     uint16_t limit;
     VncDisplay *vd = vs->vd;
 
-    if (data[0] > 3) {
+    if (data[0] > 3 && data[0] != VNC_MSG_CLIENT_FENCE) {
         vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
         if (!qemu_timer_expired(vd->timer, qemu_get_clock_ms(rt_clock) + vd->timer_interval))
             qemu_mod_timer(vd->timer, qemu_get_clock_ms(rt_clock) + vd->timer_interval);
@@ -2073,6 +2326,31 @@ static int protocol_client_msg(VncState *vs, uint8_t *data, size_t len)
 
         client_cut_text(vs, read_u32(data, 4), data + 8);
         break;
+    case VNC_MSG_CLIENT_ENABLE_CONTINUOUS_UPDATES:
+        if (len == 1)
+            return 10;
+
+        enable_continuous_updates(vs, read_u8(data, 1),
+                                  read_u16(data, 2), read_u16(data, 4),
+                                  read_u16(data, 6), read_u16(data, 8));
+        break;
+    case VNC_MSG_CLIENT_FENCE:
+        if (len == 1)
+            return 9;
+
+        if (len == 9) {
+            uint8_t dlen = read_u8(data, 8);
+            if (dlen > VNC_FENCE_PAYLOAD_MAX) {
+                VNC_DEBUG("Fence payload of %d bytes\n", dlen);
+                vnc_client_error(vs);
+                break;
+            }
+            if (dlen > 0)
+                return 9 + dlen;
+        }
+
+        client_fence(vs, read_u32(data, 4), data + 9, read_u8(data, 8));
+        break;
     case VNC_MSG_CLIENT_QEMU:
         if (len == 1)
             return 2;
@@ -2139,6 +2417,10 @@ static int protocol_client_msg(VncState *vs, uint8_t *data, size_t len)
         break;
     }
 
+    if (vs->fence_sync_pending && data[0] != VNC_MSG_CLIENT_FENCE) {
+        vnc_fence_sync_reply(vs);
+    }
+
     vnc_read_when(vs, protocol_client_msg, 1);
     return 0;
 }
@@ -2641,6 +2923,153 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     return has_dirty;
 }
 
+/* Rows hashed over the columns of a dirty band; equal rows hash equal so
+ * that a row of the guest surface can be looked up among server rows.
+ */
+static uint64_t vnc_row_hash(const uint8_t *p, int bytes)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t w;
+    int i;
+
+    for (i = 0; i < bytes; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/*
+ * When the guest scrolls a window, a tall band of rows becomes dirty
+ * whose content is mostly in the server surface already, a few rows up or
+ * down.  Look for such a shift in the tallest dirty band and, if enough
+ * rows moved with it, send them as a CopyRect: the normal pass then finds
+ * those rows unchanged and sends only what scrolled into view.
+ */
+static void vnc_detect_scroll(VncDisplay *vd)
+{
+    int width = pixman_image_get_width(vd->guest.fb);
+    int height = MIN(pixman_image_get_height(vd->guest.fb),
+                     pixman_image_get_height(vd->server));
+    uint64_t *gh = vd->scroll_guest_hash, *sh = vd->scroll_server_hash;
+    int y, b0 = 0, b1 = 0, x0 = VNC_DIRTY_BITS, x1 = 0;
+    int dys[VNC_SCROLL_CANDIDATES], nr_dys = 0;
+    int best_dy = 0, best_y = 0, best_h = 0, best_changed = 0;
+    int i, bytes, gstride;
+    uint8_t *gdata;
+    VncState *vs;
+
+    if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
+        return;
+    }
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
+            break;
+        }
+    }
+    if (!vs) {
+        return;
+    }
+
+    /* The tallest run of dirty rows */
+    for (y = 0; y < height; ) {
+        int start;
+
+        while (y < height && bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
+            y++;
+        }
+        start = y;
+        while (y < height && !bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
+            y++;
+        }
+        if (y - start > b1 - b0) {
+            b0 = start;
+            b1 = y;
+        }
+    }
+    if (b1 - b0 < VNC_SCROLL_MIN_ROWS) {
+        return;
+    }
+
+    /* and the columns dirty in it */
+    for (y = b0; y < b1; y++) {
+        int first = find_first_bit(vd->guest.dirty[y], VNC_DIRTY_BITS);
+        int last = find_last_bit(vd->guest.dirty[y], VNC_DIRTY_BITS);
+
+        x0 = MIN(x0, first);
+        x1 = MAX(x1, last + 1);
+    }
+    x1 = MIN(x1, width / 16);
+    if (x1 - x0 < VNC_SCROLL_MIN_COLS) {
+        return;
+    }
+
+    bytes = (x1 - x0) * 16 * VNC_SERVER_FB_BYTES;
+    gdata = (uint8_t *)pixman_image_get_data(vd->guest.fb);
+    gstride = pixman_image_get_stride(vd->guest.fb);
+    for (y = b0; y < b1; y++) {
+        gh[y] = vnc_row_hash(gdata + y * gstride +
+                             x0 * 16 * VNC_SERVER_FB_BYTES, bytes);
+        sh[y] = vnc_row_hash(vnc_server_fb_ptr(vd, x0 * 16, y), bytes);
+    }
+
+    /* Candidate shifts: where a few changed rows are found in the server */
+    for (i = 1; i < 8 && nr_dys < ARRAY_SIZE(dys); i++) {
+        int gy = b0 + (b1 - b0) * i / 8;
+        int sy, j;
+
+        if (gh[gy] == sh[gy]) {
+            continue;
+        }
+        for (sy = b0; sy < b1 && nr_dys < ARRAY_SIZE(dys); sy++) {
+            if (sh[sy] != gh[gy]) {
+                continue;
+            }
+            for (j = 0; j < nr_dys && dys[j] != sy - gy; j++) {
+                ;
+            }
+            if (j == nr_dys) {
+                dys[nr_dys++] = sy - gy;
+            }
+        }
+    }
+
+    /* The shift that covers the most changed rows in one piece */
+    for (i = 0; i < nr_dys; i++) {
+        int dy = dys[i];
+        int start = -1, changed = 0;
+
+        for (y = MAX(b0, b0 - dy); y <= MIN(b1, b1 - dy); y++) {
+            bool match = y < MIN(b1, b1 - dy) && gh[y] == sh[y + dy] &&
+                !memcmp(gdata + y * gstride + x0 * 16 * VNC_SERVER_FB_BYTES,
+                        vnc_server_fb_ptr(vd, x0 * 16, y + dy), bytes);
+
+            if (match) {
+                if (start < 0) {
+                    start = y;
+                    changed = 0;
+                }
+                changed += gh[y] != sh[y];
+            } else if (start >= 0) {
+                if (changed > best_changed) {
+                    best_changed = changed;
+                    best_dy = dy;
+                    best_y = start;
+                    best_h = y - start;
+                }
+                start = -1;
+            }
+        }
+    }
+    if (best_changed < VNC_SCROLL_MIN_ROWS) {
+        return;
+    }
+
+    vnc_server_copy(vd, x0 * 16, best_y + best_dy, x0 * 16, best_y,
+                    (x1 - x0) * 16, best_h);
+}
+
 static void vnc_refresh(void *opaque)
 {
     VncDisplay *vd = opaque;
@@ -2649,6 +3078,10 @@ static void vnc_refresh(void *opaque)
 
     vga_hw_update();
 
+    if (vd->detect_scroll) {
+        vnc_detect_scroll(vd);
+    }
+
     if (vnc_trylock_display(vd)) {
         vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
         qemu_mod_timer(vd->timer, qemu_get_clock_ms(rt_clock) +
@@ -2719,6 +3152,8 @@ static void vnc_connect(VncDisplay *vd, int csock, int skipauth, bool websocket)
 #endif
     }
 
+    vs->link.quality_max = VNC_LINK_QUALITY_MAX;
+
     vs->lossy_rect = g_malloc0(VNC_STAT_ROWS * sizeof (*vs->lossy_rect));
     for (i = 0; i < VNC_STAT_ROWS; ++i) {
         vs->lossy_rect[i] = g_malloc0(VNC_STAT_COLS * sizeof (uint8_t));
@@ -3074,6 +3509,32 @@ void vnc_display_open(DisplayState *ds, const char *display, Error **errp)
             vs->lossy = true;
         } else if (strncmp(options, "non-adaptive", 12) == 0) {
             vs->non_adaptive = true;
+        } else if (strncmp(options, "detect-scroll", 13) == 0) {
+            vs->detect_scroll = true;
+        } else if (strncmp(options, "threads=", 8) == 0) {
+            int n = atoi(options + 8);
+
+            if (n < 1 || n > VNC_WORKER_THREADS_MAX) {
+                error_setg(errp, "vnc threads= must be between 1 and %d",
+                           VNC_WORKER_THREADS_MAX);
+                goto fail;
+            }
+            vnc_set_worker_threads(n);
+#ifdef CONFIG_VNC_JPEG
+        } else if (strncmp(options, "jpeg-encoder=", 13) == 0) {
+            const char *end = strchr(options, ',');
+            int len = end ? end - (options + 13) : strlen(options + 13);
+            char *name = g_strndup(options + 13, len);
+
+            vs->jpeg_encoder = vnc_jpeg_find_encoder(name);
+            if (!vs->jpeg_encoder) {
+                error_setg(errp, "vnc JPEG encoder '%s' is not available",
+                           name);
+                g_free(name);
+                goto fail;
+            }
+            g_free(name);
+#endif
         } else if (strncmp(options, "share=", 6) == 0) {
             if (strncmp(options+6, "ignore", 6) == 0) {
                 vs->share_policy = VNC_SHARE_POLICY_IGNORE;
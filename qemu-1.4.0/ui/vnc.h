@@ -84,6 +84,13 @@ typedef void VncSendHextileTile(VncState *vs,
 /* VNC_DIRTY_BITS is the number of bits in the dirty bitmap. */
 #define VNC_DIRTY_BITS (VNC_MAX_WIDTH / 16)
 
+/* detect-scroll: smallest scroll worth a CopyRect, in rows and 16 pixel
+ * columns, and how many shifts are tried
+ */
+#define VNC_SCROLL_MIN_ROWS 32
+#define VNC_SCROLL_MIN_COLS 4
+#define VNC_SCROLL_CANDIDATES 16
+
 #define VNC_STAT_RECT  64
 #define VNC_STAT_COLS (VNC_MAX_WIDTH / VNC_STAT_RECT)
 #define VNC_STAT_ROWS (VNC_MAX_HEIGHT / VNC_STAT_RECT)
@@ -91,6 +98,7 @@ typedef void VncSendHextileTile(VncState *vs,
 #define VNC_AUTH_CHALLENGE_SIZE 16
 
 typedef struct VncDisplay VncDisplay;
+typedef struct VncJpegEncoder VncJpegEncoder;
 
 #ifdef CONFIG_VNC_TLS
 #include "vnc-tls.h"
@@ -154,6 +162,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int nr_encoders;            /* workers holding mutex shared */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -168,6 +177,10 @@ struct VncDisplay
     int auth;
     bool lossy;
     bool non_adaptive;
+    bool detect_scroll;
+    const VncJpegEncoder *jpeg_encoder;
+    uint64_t scroll_guest_hash[VNC_MAX_HEIGHT];
+    uint64_t scroll_server_hash[VNC_MAX_HEIGHT];
 #ifdef CONFIG_VNC_TLS
     int subauth; /* Used by VeNCrypt */
     VncDisplayTLS tls;
@@ -207,6 +220,28 @@ typedef struct VncZlib {
     int level;
 } VncZlib;
 
+#define VNC_FENCE_PAYLOAD_MAX 64
+
+/*
+ * What the server knows of the link to a client that does fences.  After
+ * each framebuffer update a fence request goes out with a sequence number;
+ * the client echoes it once it has processed everything before it, which
+ * gives both the round trip time and how fast updates drain.
+ */
+typedef struct VncLink {
+    bool probe_pending;
+    uint32_t probe_seq;
+    int64_t probe_time;         /* rt_clock ns, when the probe was queued */
+    uint64_t probe_pos;         /* update bytes queued before the probe */
+    uint64_t bytes_queued;      /* update bytes queued since connect */
+    uint64_t acked_pos;         /* update bytes the client has processed */
+    int64_t busy_since;         /* when bytes past acked_pos were queued */
+    int64_t rtt;                /* smoothed round trip time, ns */
+    int64_t rtt_min;
+    uint64_t bandwidth;         /* smoothed, bytes/s; 0 until measured */
+    uint8_t quality_max;        /* cap on the tight JPEG quality level */
+} VncLink;
+
 typedef struct VncZrle {
     int type;
     Buffer fb;
@@ -238,6 +273,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running;               /* a worker is encoding it */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -265,6 +301,18 @@ struct VncState
 
     uint32_t vnc_encoding;
 
+    /* ContinuousUpdates: send what changes in this area, unrequested */
+    bool continuous_updates;
+    int cu_x, cu_y, cu_w, cu_h;
+
+    /* A SyncNext fence whose reply waits for the next message */
+    bool fence_sync_pending;
+    uint32_t fence_sync_flags;
+    uint8_t fence_sync_len;
+    uint8_t fence_sync_data[VNC_FENCE_PAYLOAD_MAX];
+
+    VncLink link;
+
     int major;
     int minor;
 
@@ -386,6 +434,8 @@ enum {
 #define VNC_ENCODING_EXT_KEY_EVENT        0XFFFFFEFE /* -258 */
 #define VNC_ENCODING_AUDIO                0XFFFFFEFD /* -259 */
 #define VNC_ENCODING_TIGHT_PNG            0xFFFFFEFC /* -260 */
+#define VNC_ENCODING_FENCE                0xFFFFFEC8 /* -312 */
+#define VNC_ENCODING_CONTINUOUS_UPDATES   0xFFFFFEC7 /* -313 */
 #define VNC_ENCODING_WMVi                 0x574D5669
 
 /*****************************************************************************
@@ -424,6 +474,8 @@ enum {
 #define VNC_FEATURE_TIGHT_PNG                8
 #define VNC_FEATURE_ZRLE                     9
 #define VNC_FEATURE_ZYWRLE                  10
+#define VNC_FEATURE_FENCE                   11
+#define VNC_FEATURE_CONTINUOUS_UPDATES      12
 
 #define VNC_FEATURE_RESIZE_MASK              (1 << VNC_FEATURE_RESIZE)
 #define VNC_FEATURE_HEXTILE_MASK             (1 << VNC_FEATURE_HEXTILE)
@@ -436,6 +488,8 @@ enum {
 #define VNC_FEATURE_TIGHT_PNG_MASK           (1 << VNC_FEATURE_TIGHT_PNG)
 #define VNC_FEATURE_ZRLE_MASK                (1 << VNC_FEATURE_ZRLE)
 #define VNC_FEATURE_ZYWRLE_MASK              (1 << VNC_FEATURE_ZYWRLE)
+#define VNC_FEATURE_FENCE_MASK               (1 << VNC_FEATURE_FENCE)
+#define VNC_FEATURE_CONTINUOUS_UPDATES_MASK  (1 << VNC_FEATURE_CONTINUOUS_UPDATES)
 
 
 /* Client -> Server message IDs */
@@ -446,6 +500,8 @@ enum {
 #define VNC_MSG_CLIENT_POINTER_EVENT              5
 #define VNC_MSG_CLIENT_CUT_TEXT                   6
 #define VNC_MSG_CLIENT_VMWARE_0                   127
+#define VNC_MSG_CLIENT_ENABLE_CONTINUOUS_UPDATES  150
+#define VNC_MSG_CLIENT_FENCE                      248
 #define VNC_MSG_CLIENT_CALL_CONTROL               249
 #define VNC_MSG_CLIENT_XVP                        250
 #define VNC_MSG_CLIENT_SET_DESKTOP_SIZE           251
@@ -460,6 +516,8 @@ enum {
 #define VNC_MSG_SERVER_BELL                       2
 #define VNC_MSG_SERVER_CUT_TEXT                   3
 #define VNC_MSG_SERVER_VMWARE_0                   127
+#define VNC_MSG_SERVER_END_OF_CONTINUOUS_UPDATES  150
+#define VNC_MSG_SERVER_FENCE                      248
 #define VNC_MSG_SERVER_CALL_CONTROL               249
 #define VNC_MSG_SERVER_XVP                        250
 #define VNC_MSG_SERVER_TIGHT                      252
@@ -488,6 +546,14 @@ enum {
 #define VNC_MSG_SERVER_QEMU_AUDIO_BEGIN           1
 #define VNC_MSG_SERVER_QEMU_AUDIO_DATA            2
 
+/* Fence message flags */
+#define VNC_FENCE_BLOCK_BEFORE                    (1 << 0)
+#define VNC_FENCE_BLOCK_AFTER                     (1 << 1)
+#define VNC_FENCE_SYNC_NEXT                       (1 << 2)
+#define VNC_FENCE_REQUEST                         (1U << 31)
+#define VNC_FENCE_FLAGS_SUPPORTED                 (VNC_FENCE_BLOCK_BEFORE | \
+                                                   VNC_FENCE_BLOCK_AFTER | \
+                                                   VNC_FENCE_SYNC_NEXT)
 
 /*****************************************************************************
  *
@@ -542,6 +608,10 @@ static inline uint32_t vnc_has_feature(VncState *vs, int feature) {
     return (vs->features & (1 << feature));
 }
 
+/* Fences; called with the output lock held */
+void vnc_fence_probe(VncState *vs);
+void vnc_link_queued(VncState *vs, size_t len);
+
 /* Framebuffer */
 void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
                             int32_t encoding);
@@ -3,6 +3,8 @@
 #include "ui/console.h"
 #include "qemu-common.h"
 #include "xen-input.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 #define DEBUG_INPUT
 
@@ -41,6 +43,8 @@ typedef struct XenInput {
     xen_input_config_reset_cb_t config_reset_handler;
     void *opaque;
     QEMUPutLEDEntry *leds;
+    /* Arrival of the first event of the report being put together */
+    int64_t report_stamp;
 } XenInput;
 
 static XenInput input = { .service = 0 };
@@ -266,7 +270,12 @@ static void input_event(void *opaque, uint16_t type,
     static int use_abs = 0;
     static int deferbutton = 0;
     static int slot = 0;
+    int64_t stamp = qemu_input_get_stamp();
 
+#ifdef CONFIG_SURFMAN
+    /* The user is interacting, refresh the display at full rate. */
+    surfman_input_activity();
+#endif
 
     if (type == EV_DEV && code == DEV_SET) {
         slot = value;
@@ -283,6 +292,10 @@ static void input_event(void *opaque, uint16_t type,
         return;
     }
 
+    if (!x->report_stamp) {
+        x->report_stamp = stamp;
+    }
+
     switch (type) {
     case EV_KEY:
         if (code >= BTN_MOUSE) {
@@ -345,6 +358,13 @@ static void input_event(void *opaque, uint16_t type,
             break;
         }
 
+        /* The devices see the report as old as its first event */
+        if (x->report_stamp) {
+            trace_xen_input_report(get_clock() - x->report_stamp);
+        }
+        qemu_input_set_stamp(x->report_stamp);
+        x->report_stamp = 0;
+
         if (relative.count || (!absolute.count && !use_abs && mouse_key)) {
             kbd_mouse_event(relative.x, relative.y,
                             relative.z, mouse_button_state);
@@ -367,6 +387,7 @@ static void input_event(void *opaque, uint16_t type,
         }
         mouse_key = 0;
         deferbutton = 0;
+        qemu_input_set_stamp(stamp);
 
         break;
     }
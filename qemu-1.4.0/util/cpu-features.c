@@ -0,0 +1,39 @@
+/*
+ * Host CPU feature detection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/cpu-features.h"
+
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+
+/* cpuid alone is not enough, xgetbv tells whether the OS saves the ymm
+ * state */
+bool qemu_cpu_has_avx2(void)
+{
+    unsigned a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE)) {
+        return false;
+    }
+    asm("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & (1 << 5);
+}
+#else
+bool qemu_cpu_has_avx2(void)
+{
+    return false;
+}
+#endif
@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -45,6 +46,9 @@
  *
  * Setting or clearing a range of m bits on all levels, the work to perform
  * is O(m + m/W + m/W^2 + ...), which is O(m) like on a regular bitmap.
+ * Each level is walked once, and whole words are written at a time; the
+ * number of bits that change in the last level is computed with popcount
+ * while writing it, so that hbitmap_count is always up to date.
  *
  * When iterating on a bitmap, each bit (on any level) is only visited
  * once.  Hence, The total cost of visiting a bitmap with m bits in it is
@@ -182,40 +186,12 @@ uint64_t hbitmap_count(const HBitmap *hb)
     return hb->count << hb->granularity;
 }
 
-/* Count the number of set bits between start and end, not accounting for
- * the granularity.  Also an example of how to use hbitmap_iter_next_word.
- */
-static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
-{
-    HBitmapIter hbi;
-    uint64_t count = 0;
-    uint64_t end = last + 1;
-    unsigned long cur;
-    size_t pos;
-
-    hbitmap_iter_init(&hbi, hb, start << hb->granularity);
-    for (;;) {
-        pos = hbitmap_iter_next_word(&hbi, &cur);
-        if (pos >= (end >> BITS_PER_LEVEL)) {
-            break;
-        }
-        count += popcountl(cur);
-    }
-
-    if (pos == (end >> BITS_PER_LEVEL)) {
-        /* Drop bits representing the END-th and subsequent items.  */
-        int bit = end & (BITS_PER_LONG - 1);
-        cur &= (1UL << bit) - 1;
-        count += popcountl(cur);
-    }
-
-    return count;
-}
-
 /* Setting starts at the last layer and propagates up if an element
- * changes from zero to non-zero.
+ * changes from zero to non-zero.  *added counts the bits that were
+ * clear before.
  */
-static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t last)
+static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t last,
+                               uint64_t *added)
 {
     unsigned long mask;
     bool changed;
@@ -226,33 +202,40 @@ static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t las
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
     changed = (*elem == 0);
+    *added += popcountl(mask & ~*elem);
     *elem |= mask;
     return changed;
 }
 
-/* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)... */
-static void hb_set_between(HBitmap *hb, int level, uint64_t start, uint64_t last)
+/* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
+ * Returns the number of bits that were set in this level.
+ */
+static uint64_t hb_set_between(HBitmap *hb, int level, uint64_t start,
+                               uint64_t last)
 {
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
+    unsigned long *elem = hb->levels[level];
     bool changed = false;
+    uint64_t added = 0;
     size_t i;
 
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(&elem[i], start, next - 1, &added);
         for (;;) {
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            changed |= (elem[i] == 0);
+            added += BITS_PER_LONG - popcountl(elem[i]);
+            elem[i] = ~0UL;
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(&elem[i], start, last, &added);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -260,6 +243,7 @@ static void hb_set_between(HBitmap *hb, int level, uint64_t start, uint64_t last
     if (level > 0 && changed) {
         hb_set_between(hb, level - 1, pos, lastpos);
     }
+    return added;
 }
 
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
@@ -272,16 +256,15 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 
     start >>= hb->granularity;
     last >>= hb->granularity;
-    count = last - start + 1;
 
-    hb->count += count - hb_count_between(hb, start, last);
-    hb_set_between(hb, HBITMAP_LEVELS - 1, start, last);
+    hb->count += hb_set_between(hb, HBITMAP_LEVELS - 1, start, last);
 }
 
 /* Resetting works the other way round: propagate up if the new
- * value is zero.
+ * value is zero.  *removed counts the bits that were set before.
  */
-static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t last)
+static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t last,
+                                 uint64_t *removed)
 {
     unsigned long mask;
     bool blanked;
@@ -292,16 +275,22 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
     blanked = *elem != 0 && ((*elem & ~mask) == 0);
+    *removed += popcountl(*elem & mask);
     *elem &= ~mask;
     return blanked;
 }
 
-/* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)... */
-static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t last)
+/* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
+ * Returns the number of bits that were cleared in this level.
+ */
+static uint64_t hb_reset_between(HBitmap *hb, int level, uint64_t start,
+                                 uint64_t last)
 {
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
+    unsigned long *elem = hb->levels[level];
     bool changed = false;
+    uint64_t removed = 0;
     size_t i;
 
     i = pos;
@@ -313,7 +302,7 @@ static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t la
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_elem(&elem[i], start, next - 1, &removed)) {
             changed = true;
         } else {
             pos++;
@@ -325,13 +314,14 @@ static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t la
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            changed |= (elem[i] != 0);
+            removed += popcountl(elem[i]);
+            elem[i] = 0UL;
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_elem(&elem[i], start, last, &removed)) {
         changed = true;
     } else {
         lastpos--;
@@ -340,6 +330,7 @@ static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t la
     if (level > 0 && changed) {
         hb_reset_between(hb, level - 1, pos, lastpos);
     }
+    return removed;
 }
 
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
@@ -353,8 +344,7 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     start >>= hb->granularity;
     last >>= hb->granularity;
 
-    hb->count -= hb_count_between(hb, start, last);
-    hb_reset_between(hb, HBITMAP_LEVELS - 1, start, last);
+    hb->count -= hb_reset_between(hb, HBITMAP_LEVELS - 1, start, last);
 }
 
 bool hbitmap_get(const HBitmap *hb, uint64_t item)
@@ -366,6 +356,118 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+/* Number of longs in each level for a bitmap of @size bits (after
+ * applying the granularity).
+ */
+static size_t hb_level_size(uint64_t size, unsigned level)
+{
+    unsigned i;
+
+    for (i = HBITMAP_LEVELS; i-- > level; ) {
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+    }
+    return size;
+}
+
+/* Recompute the upper levels and the count from the last level.  */
+static void hb_rebuild(HBitmap *hb)
+{
+    unsigned long *elem = hb->levels[HBITMAP_LEVELS - 1];
+    size_t n = hb_level_size(hb->size, HBITMAP_LEVELS - 1);
+    size_t i;
+    int level;
+
+    hb->count = 0;
+    for (i = 0; i < n; i++) {
+        hb->count += popcountl(elem[i]);
+    }
+
+    for (level = HBITMAP_LEVELS - 1; level > 0; level--) {
+        unsigned long *upper = hb->levels[level - 1];
+
+        memset(upper, 0, hb_level_size(hb->size, level - 1) *
+                         sizeof(unsigned long));
+        for (i = 0; i < n; i++) {
+            if (hb->levels[level][i]) {
+                upper[i >> BITS_PER_LEVEL] |= 1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+        n = hb_level_size(hb->size, level - 1);
+    }
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+}
+
+bool hbitmap_merge(HBitmap *a, const HBitmap *b)
+{
+    unsigned level;
+    size_t i, n;
+
+    if (a->size != b->size || a->granularity != b->granularity) {
+        return false;
+    }
+
+    /* A word is nonzero in the union iff it is nonzero in either bitmap,
+     * so every level, sentinel included, can simply be or-ed.
+     */
+    for (level = 0; level < HBITMAP_LEVELS; level++) {
+        n = hb_level_size(a->size, level);
+        for (i = 0; i < n; i++) {
+            a->levels[level][i] |= b->levels[level][i];
+        }
+    }
+
+    a->count = 0;
+    for (i = 0; i < n; i++) {
+        a->count += popcountl(a->levels[HBITMAP_LEVELS - 1][i]);
+    }
+    return true;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb)
+{
+    /* Always a multiple of 64 bits, so that the format does not depend
+     * on the size of a long.
+     */
+    return ((hb->size + 63) >> 6) * 8;
+}
+
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf)
+{
+    const unsigned long *elem = hb->levels[HBITMAP_LEVELS - 1];
+    size_t n = hb_level_size(hb->size, HBITMAP_LEVELS - 1);
+    uint64_t len = hbitmap_serialization_size(hb);
+    size_t i;
+
+    /* Bit N of the bitmap is bit N % 8 of byte N / 8.  That is exactly
+     * an array of little-endian longs, whatever their size.
+     */
+    for (i = 0; i < n && (i + 1) * sizeof(unsigned long) <= len; i++) {
+        unsigned long l = leul_to_cpu(elem[i]);
+        memcpy(buf + i * sizeof(unsigned long), &l, sizeof(l));
+    }
+    memset(buf + i * sizeof(unsigned long), 0, len - i * sizeof(unsigned long));
+}
+
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf)
+{
+    unsigned long *elem = hb->levels[HBITMAP_LEVELS - 1];
+    size_t n = hb_level_size(hb->size, HBITMAP_LEVELS - 1);
+    uint64_t len = hbitmap_serialization_size(hb);
+    size_t i;
+
+    for (i = 0; i < n && (i + 1) * sizeof(unsigned long) <= len; i++) {
+        unsigned long l;
+        memcpy(&l, buf + i * sizeof(unsigned long), sizeof(l));
+        elem[i] = leul_to_cpu(l);
+    }
+
+    /* Do not trust the padding.  */
+    if (hb->size & (BITS_PER_LONG - 1)) {
+        elem[n - 1] &= (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+    }
+    hb_rebuild(hb);
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -387,15 +489,15 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     hb->size = size;
     hb->granularity = granularity;
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
-        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
-        hb->levels[i] = g_malloc0(size * sizeof(unsigned long));
+        hb->levels[i] = g_malloc0(hb_level_size(hb->size, i) *
+                                  sizeof(unsigned long));
     }
 
     /* We necessarily have free bits in level 0 due to the definition
      * of HBITMAP_LEVELS, so use one for a sentinel.  This speeds up
      * hbitmap_iter_skip_words.
      */
-    assert(size == 1);
+    assert(hb_level_size(hb->size, 0) == 1);
     hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
     return hb;
 }
@@ -0,0 +1,87 @@
+/*
+ * Latency histograms
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu/histogram.h"
+#include "qapi/qmp/qerror.h"
+
+LatencyHistogram *latency_histogram_new(int64_t min_ns, int64_t nbins,
+                                        Error **errp)
+{
+    LatencyHistogram *hist;
+
+    if (min_ns <= 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "min-ns",
+                  "a positive number of nanoseconds");
+        return NULL;
+    }
+    if (nbins < 1 || nbins > LATENCY_HISTOGRAM_MAX_BINS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "bins",
+                  "a number of bins between 1 and 64");
+        return NULL;
+    }
+    if (nbins > 1 && min_ns > (INT64_MAX >> (nbins - 2))) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "bins",
+                  "fewer bins, the last one would start past 2^63 ns");
+        return NULL;
+    }
+
+    hist = g_malloc0(sizeof(*hist) + nbins * sizeof(hist->bins[0]));
+    hist->min_ns = min_ns;
+    hist->nbins = nbins;
+    return hist;
+}
+
+void latency_histogram_free(LatencyHistogram *hist)
+{
+    g_free(hist);
+}
+
+int64_t latency_histogram_percentile(const LatencyHistogram *hist, int pct)
+{
+    uint64_t total = 0, rank, seen = 0;
+    int i;
+
+    for (i = 0; i < hist->nbins; i++) {
+        total += hist->bins[i];
+    }
+    if (!total) {
+        return 0;
+    }
+
+    /* The smallest sample with at least pct% of them at or below it */
+    rank = (total * pct + 99) / 100;
+    if (!rank) {
+        rank = 1;
+    }
+    for (i = 0; i < hist->nbins - 1; i++) {
+        seen += hist->bins[i];
+        if (seen >= rank) {
+            return hist->min_ns << i;
+        }
+    }
+    return hist->nbins > 1 ? hist->min_ns << (hist->nbins - 2) : 0;
+}
+
+LatencyHistogramInfo *latency_histogram_info(const LatencyHistogram *hist)
+{
+    LatencyHistogramInfo *info = g_malloc0(sizeof(*info));
+    LatencyHistogramBinList **tail = &info->bins;
+    int i;
+
+    info->min_ns = hist->min_ns;
+    for (i = 0; i < hist->nbins; i++) {
+        LatencyHistogramBinList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->start_ns = i ? hist->min_ns << (i - 1) : 0;
+        entry->value->count = hist->bins[i];
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return info;
+}
@@ -0,0 +1,155 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include "qemu/interval-tree.h"
+
+/* Nodes get a pseudo-random priority and the tree is kept a max-heap on
+ * it, which keeps the expected depth logarithmic whatever the insertion
+ * order.  Ties on start are broken by address so that every node has
+ * a unique position, which is what lets remove find it again.
+ */
+
+static inline int64_t subtree_last(IntervalTreeNode *n)
+{
+    return n ? n->subtree_last : INT64_MIN;
+}
+
+static void update(IntervalTreeNode *n)
+{
+    int64_t last = n->last;
+
+    if (subtree_last(n->left) > last) {
+        last = n->left->subtree_last;
+    }
+    if (subtree_last(n->right) > last) {
+        last = n->right->subtree_last;
+    }
+    n->subtree_last = last;
+}
+
+static inline bool node_before(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    return a->start < b->start ||
+           (a->start == b->start && (uintptr_t)a < (uintptr_t)b);
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *n)
+{
+    IntervalTreeNode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    update(n);
+    update(l);
+    return l;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *n)
+{
+    IntervalTreeNode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    update(n);
+    update(r);
+    return r;
+}
+
+static IntervalTreeNode *insert(IntervalTreeNode *root, IntervalTreeNode *node)
+{
+    if (!root) {
+        return node;
+    }
+
+    if (node_before(node, root)) {
+        root->left = insert(root->left, node);
+        if (root->left->priority > root->priority) {
+            return rotate_right(root);
+        }
+    } else {
+        root->right = insert(root->right, node);
+        if (root->right->priority > root->priority) {
+            return rotate_left(root);
+        }
+    }
+    update(root);
+    return root;
+}
+
+static IntervalTreeNode *remove_node(IntervalTreeNode *root,
+                                     IntervalTreeNode *node)
+{
+    assert(root);
+
+    if (root == node) {
+        if (!node->left) {
+            return node->right;
+        }
+        if (!node->right) {
+            return node->left;
+        }
+        /* push the node down until it has at most one child */
+        if (node->left->priority > node->right->priority) {
+            root = rotate_right(node);
+            root->right = remove_node(root->right, node);
+        } else {
+            root = rotate_left(node);
+            root->left = remove_node(root->left, node);
+        }
+    } else if (node_before(node, root)) {
+        root->left = remove_node(root->left, node);
+    } else {
+        root->right = remove_node(root->right, node);
+    }
+    update(root);
+    return root;
+}
+
+void interval_tree_insert(IntervalTree *tree, IntervalTreeNode *node)
+{
+    assert(node->start <= node->last);
+
+    /* a linear congruential generator is plenty for balancing */
+    tree->seed = tree->seed * 1103515245 + 12345;
+    node->priority = tree->seed;
+    node->left = node->right = NULL;
+    node->subtree_last = node->last;
+
+    tree->root = insert(tree->root, node);
+}
+
+void interval_tree_remove(IntervalTree *tree, IntervalTreeNode *node)
+{
+    tree->root = remove_node(tree->root, node);
+    node->left = node->right = NULL;
+}
+
+IntervalTreeNode *interval_tree_find(IntervalTree *tree,
+                                     int64_t start, int64_t last)
+{
+    IntervalTreeNode *n = tree->root;
+
+    while (n) {
+        /* If something on the left reaches @start, the leftmost overlap is
+         * there if anywhere: whatever it is, everything from here on starts
+         * no earlier than it does.
+         */
+        if (subtree_last(n->left) >= start) {
+            n = n->left;
+            continue;
+        }
+        if (n->start > last) {
+            return NULL;
+        }
+        if (n->last >= start) {
+            return n;
+        }
+        n = n->right;
+    }
+    return NULL;
+}
@@ -17,6 +17,7 @@
  */
 
 #include "qemu/iov.h"
+#include "qemu/tls.h"
 
 #ifdef _WIN32
 # include <windows.h>
@@ -83,6 +84,53 @@ size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
     return done;
 }
 
+static bool iov_buf_is_zero(const uint8_t *p, size_t len)
+{
+    /* buffer_is_zero() wants whole, long aligned blocks of four longs */
+    const size_t block = 4 * sizeof(long);
+    size_t head = MIN(len, -(uintptr_t)p & (sizeof(long) - 1));
+    size_t body;
+
+    for (; head; head--, len--) {
+        if (*p++) {
+            return false;
+        }
+    }
+
+    body = len & ~(block - 1);
+    if (body && !buffer_is_zero(p, body)) {
+        return false;
+    }
+
+    for (p += body, len -= body; len; len--) {
+        if (*p++) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool iov_is_zero(const struct iovec *iov, const unsigned int iov_cnt,
+                 size_t offset, size_t bytes)
+{
+    size_t done;
+    unsigned int i;
+    for (i = 0, done = 0; (offset || done < bytes) && i < iov_cnt; i++) {
+        if (offset < iov[i].iov_len) {
+            size_t len = MIN(iov[i].iov_len - offset, bytes - done);
+            if (!iov_buf_is_zero(iov[i].iov_base + offset, len)) {
+                return false;
+            }
+            done += len;
+            offset = 0;
+        } else {
+            offset -= iov[i].iov_len;
+        }
+    }
+    assert(offset == 0);
+    return true;
+}
+
 size_t iov_size(const struct iovec *iov, const unsigned int iov_cnt)
 {
     size_t len;
@@ -254,11 +302,81 @@ unsigned iov_copy(struct iovec *dst_iov, unsigned int dst_iov_cnt,
 
 /* io vectors */
 
+/*
+ * Arrays of more than QEMU_IOVEC_INLINE iovecs come in a few size classes,
+ * and each thread keeps the ones it frees for the next requests.  Only Linux
+ * has real thread-local variables, see qemu/tls.h, elsewhere every array is
+ * simply allocated and freed.
+ */
+#define IOVEC_POOL_MIN      8       /* iovecs in the smallest class */
+#define IOVEC_POOL_CLASSES  4       /* 8, 16, 32 and 64 iovecs */
+#define IOVEC_POOL_DEPTH    8       /* arrays kept for each class */
+
+typedef struct IOVecPool {
+    struct iovec *free[IOVEC_POOL_CLASSES][IOVEC_POOL_DEPTH];
+    int nfree[IOVEC_POOL_CLASSES];
+} IOVecPool;
+
+#ifdef __linux__
+static DEFINE_TLS(IOVecPool, iovec_pool);
+#endif
+
+/* Returns the size class for @nalloc iovecs, or -1 if it is too large */
+static int iovec_pool_class(int nalloc)
+{
+    int cls = 0;
+
+    while ((IOVEC_POOL_MIN << cls) < nalloc) {
+        if (++cls == IOVEC_POOL_CLASSES) {
+            return -1;
+        }
+    }
+    return cls;
+}
+
+/* Allocates at least *@nalloc iovecs and updates *@nalloc to their number */
+static struct iovec *iovec_alloc(int *nalloc)
+{
+    int cls = iovec_pool_class(*nalloc);
+
+    if (cls < 0) {
+        return g_new(struct iovec, *nalloc);
+    }
+    *nalloc = IOVEC_POOL_MIN << cls;
+#ifdef __linux__
+    if (tls_var(iovec_pool).nfree[cls]) {
+        IOVecPool *pool = &tls_var(iovec_pool);
+        return pool->free[cls][--pool->nfree[cls]];
+    }
+#endif
+    return g_new(struct iovec, *nalloc);
+}
+
+static void iovec_free(struct iovec *iov, int nalloc)
+{
+#ifdef __linux__
+    int cls = iovec_pool_class(nalloc);
+
+    if (cls >= 0 && (IOVEC_POOL_MIN << cls) == nalloc &&
+        tls_var(iovec_pool).nfree[cls] < IOVEC_POOL_DEPTH) {
+        IOVecPool *pool = &tls_var(iovec_pool);
+        pool->free[cls][pool->nfree[cls]++] = iov;
+        return;
+    }
+#endif
+    g_free(iov);
+}
+
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint)
 {
-    qiov->iov = g_malloc(alloc_hint * sizeof(struct iovec));
+    if (alloc_hint <= QEMU_IOVEC_INLINE) {
+        qiov->iov = qiov->local_iov;
+        qiov->nalloc = QEMU_IOVEC_INLINE;
+    } else {
+        qiov->nalloc = alloc_hint;
+        qiov->iov = iovec_alloc(&qiov->nalloc);
+    }
     qiov->niov = 0;
-    qiov->nalloc = alloc_hint;
     qiov->size = 0;
 }
 
@@ -279,8 +397,17 @@ void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
     assert(qiov->nalloc != -1);
 
     if (qiov->niov == qiov->nalloc) {
+        struct iovec *old_iov = qiov->iov;
+        int old_nalloc = qiov->nalloc;
+
         qiov->nalloc = 2 * qiov->nalloc + 1;
-        qiov->iov = g_realloc(qiov->iov, qiov->nalloc * sizeof(struct iovec));
+        qiov->iov = iovec_alloc(&qiov->nalloc);
+        if (qiov->niov) {
+            memcpy(qiov->iov, old_iov, qiov->niov * sizeof(struct iovec));
+        }
+        if (old_iov != qiov->local_iov) {
+            iovec_free(old_iov, old_nalloc);
+        }
     }
     qiov->iov[qiov->niov].iov_base = base;
     qiov->iov[qiov->niov].iov_len = len;
@@ -343,7 +470,9 @@ void qemu_iovec_destroy(QEMUIOVector *qiov)
     assert(qiov->nalloc != -1);
 
     qemu_iovec_reset(qiov);
-    g_free(qiov->iov);
+    if (qiov->iov != qiov->local_iov) {
+        iovec_free(qiov->iov, qiov->nalloc);
+    }
     qiov->nalloc = 0;
     qiov->iov = NULL;
 }
@@ -374,6 +503,11 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
     return iov_memset(qiov->iov, qiov->niov, offset, fillc, bytes);
 }
 
+bool qemu_iovec_is_zero(QEMUIOVector *qiov, size_t offset, size_t bytes)
+{
+    return iov_is_zero(qiov->iov, qiov->niov, offset, bytes);
+}
+
 size_t iov_discard_front(struct iovec **iov, unsigned int *iov_cnt,
                          size_t bytes)
 {
@@ -223,3 +223,44 @@ int qemu_utimens(const char *path, const struct timespec *times)
 
     return utimes(path, &tv[0]);
 }
+
+#ifdef __linux__
+/* Parses a list such as "0-3,8,10-11" */
+int qemu_parse_cpu_list(const char *str, cpu_set_t *set)
+{
+    char *end;
+
+    CPU_ZERO(set);
+    while (*str) {
+        unsigned long first, last;
+
+        first = last = strtoul(str, &end, 10);
+        if (end == str) {
+            return -EINVAL;
+        }
+        if (*end == '-') {
+            str = end + 1;
+            last = strtoul(str, &end, 10);
+            if (end == str || last < first) {
+                return -EINVAL;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -EINVAL;
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, set);
+        }
+
+        str = end;
+        if (*str == ',') {
+            str++;
+        } else if (*str && *str != '\n') {
+            return -EINVAL;
+        } else {
+            break;
+        }
+    }
+    return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+#endif
@@ -0,0 +1,454 @@
+/*
+ * Pixel format conversion helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/pixel-conv.h"
+#include "qemu/cpu-features.h"
+
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <immintrin.h>
+#define PIXEL_CONV_X86
+#endif
+
+#if defined(__ARM_NEON__) && !defined(HOST_WORDS_BIGENDIAN)
+#include <arm_neon.h>
+#define PIXEL_CONV_NEON
+#endif
+
+static inline uint32_t rgb_to_pixel32(uint32_t r, uint32_t g, uint32_t b)
+{
+    return (r << 16) | (g << 8) | b;
+}
+
+static inline uint32_t rgb_to_pixel32bgr(uint32_t r, uint32_t g, uint32_t b)
+{
+    return (b << 16) | (g << 8) | r;
+}
+
+/* 8 bpp is fixed RGB332, as the Xen framebuffer uses it */
+void pixel_conv_8_to_32_c(uint8_t *d, const uint8_t *s, int width)
+{
+    uint32_t v;
+
+    for (; width > 0; width--) {
+        v = *s++;
+        *(uint32_t *)d = rgb_to_pixel32(v & 0xe0, (v << 3) & 0xe0,
+                                        (v << 6) & 0xc0);
+        d += 4;
+    }
+}
+
+void pixel_conv_15_to_32_c(uint8_t *d, const uint8_t *s, int width)
+{
+    uint32_t v, r, g, b;
+
+    for (; width > 0; width--) {
+        v = s[0] | (s[1] << 8);
+        r = (v >> 7) & 0xf8;
+        g = (v >> 2) & 0xf8;
+        b = (v << 3) & 0xf8;
+        *(uint32_t *)d = rgb_to_pixel32(r, g, b);
+        s += 2;
+        d += 4;
+    }
+}
+
+void pixel_conv_16_to_32_c(uint8_t *d, const uint8_t *s, int width)
+{
+    uint32_t v, r, g, b;
+
+    for (; width > 0; width--) {
+        v = s[0] | (s[1] << 8);
+        r = (v >> 8) & 0xf8;
+        g = (v >> 3) & 0xfc;
+        b = (v << 3) & 0xf8;
+        *(uint32_t *)d = rgb_to_pixel32(r, g, b);
+        s += 2;
+        d += 4;
+    }
+}
+
+void pixel_conv_24_to_32_c(uint8_t *d, const uint8_t *s, int width)
+{
+    for (; width > 0; width--) {
+        *(uint32_t *)d = rgb_to_pixel32(s[2], s[1], s[0]);
+        s += 3;
+        d += 4;
+    }
+}
+
+void pixel_conv_32_to_32bgr_c(uint8_t *d, const uint8_t *s, int width)
+{
+    for (; width > 0; width--) {
+        *(uint32_t *)d = rgb_to_pixel32bgr(s[2], s[1], s[0]);
+        s += 4;
+        d += 4;
+    }
+}
+
+#ifdef PIXEL_CONV_X86
+
+/* The x86 kernels are built with per-function target attributes so that
+ * the rest of QEMU keeps its baseline ISA; they are only ever called after
+ * CPUID says the instructions are there.
+ *
+ * For 15/16 bpp the components are extracted in 16-bit lanes, g and b are
+ * packed into the low half of each output pixel and r into the high half,
+ * and the two halves are interleaved with unpack{lo,hi}.
+ */
+
+#define SSE2_RGB16(name, rs, gs, gm)                                        \
+static void __attribute__((target("sse2")))                                 \
+name(uint8_t *d, const uint8_t *s, int width)                               \
+{                                                                           \
+    const __m128i mask_rb = _mm_set1_epi16(0xf8);                           \
+    const __m128i mask_g = _mm_set1_epi16(gm);                              \
+                                                                            \
+    for (; width >= 8; width -= 8) {                                        \
+        __m128i v = _mm_loadu_si128((const __m128i *)s);                    \
+        __m128i r = _mm_and_si128(_mm_srli_epi16(v, rs), mask_rb);          \
+        __m128i g = _mm_and_si128(_mm_srli_epi16(v, gs), mask_g);           \
+        __m128i b = _mm_and_si128(_mm_slli_epi16(v, 3), mask_rb);           \
+        __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);                 \
+        _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(gb, r));          \
+        _mm_storeu_si128((__m128i *)(d + 16), _mm_unpackhi_epi16(gb, r));   \
+        s += 16;                                                            \
+        d += 32;                                                            \
+    }                                                                       \
+}
+
+SSE2_RGB16(pixel_conv_15_to_32_sse2_body, 7, 2, 0xf8)
+SSE2_RGB16(pixel_conv_16_to_32_sse2_body, 8, 3, 0xfc)
+
+/* unpack{lo,hi} work within 128-bit lanes, so the AVX2 variant has to
+ * put pixels 0-7 and 8-15 back together with a cross-lane permute.
+ */
+#define AVX2_RGB16(name, rs, gs, gm)                                        \
+static void __attribute__((target("avx2")))                                 \
+name(uint8_t *d, const uint8_t *s, int width)                               \
+{                                                                           \
+    const __m256i mask_rb = _mm256_set1_epi16(0xf8);                        \
+    const __m256i mask_g = _mm256_set1_epi16(gm);                           \
+                                                                            \
+    for (; width >= 16; width -= 16) {                                      \
+        __m256i v = _mm256_loadu_si256((const __m256i *)s);                 \
+        __m256i r = _mm256_and_si256(_mm256_srli_epi16(v, rs), mask_rb);    \
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(v, gs), mask_g);     \
+        __m256i b = _mm256_and_si256(_mm256_slli_epi16(v, 3), mask_rb);     \
+        __m256i gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);           \
+        __m256i lo = _mm256_unpacklo_epi16(gb, r);                          \
+        __m256i hi = _mm256_unpackhi_epi16(gb, r);                          \
+        _mm256_storeu_si256((__m256i *)d,                                   \
+                            _mm256_permute2x128_si256(lo, hi, 0x20));       \
+        _mm256_storeu_si256((__m256i *)(d + 32),                            \
+                            _mm256_permute2x128_si256(lo, hi, 0x31));       \
+        s += 32;                                                            \
+        d += 64;                                                            \
+    }                                                                       \
+}
+
+AVX2_RGB16(pixel_conv_15_to_32_avx2_body, 7, 2, 0xf8)
+AVX2_RGB16(pixel_conv_16_to_32_avx2_body, 8, 3, 0xfc)
+
+/* RGB332: each byte is widened to a whole pixel, after which all three
+ * components can be moved into place with one shift and mask apiece.
+ */
+static inline __m128i __attribute__((target("sse2")))
+sse2_rgb332(__m128i v)
+{
+    __m128i r = _mm_and_si128(_mm_slli_epi32(v, 16), _mm_set1_epi32(0xe00000));
+    __m128i g = _mm_and_si128(_mm_slli_epi32(v, 11), _mm_set1_epi32(0xe000));
+    __m128i b = _mm_and_si128(_mm_slli_epi32(v, 6), _mm_set1_epi32(0xc0));
+    return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+static void __attribute__((target("sse2")))
+pixel_conv_8_to_32_sse2_body(uint8_t *d, const uint8_t *s, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; width >= 16; width -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i *)d,
+                         sse2_rgb332(_mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128((__m128i *)(d + 16),
+                         sse2_rgb332(_mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128((__m128i *)(d + 32),
+                         sse2_rgb332(_mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128((__m128i *)(d + 48),
+                         sse2_rgb332(_mm_unpackhi_epi16(hi, zero)));
+        s += 16;
+        d += 64;
+    }
+}
+
+static inline __m256i __attribute__((target("avx2")))
+avx2_rgb332(__m256i v)
+{
+    __m256i r = _mm256_and_si256(_mm256_slli_epi32(v, 16),
+                                 _mm256_set1_epi32(0xe00000));
+    __m256i g = _mm256_and_si256(_mm256_slli_epi32(v, 11),
+                                 _mm256_set1_epi32(0xe000));
+    __m256i b = _mm256_and_si256(_mm256_slli_epi32(v, 6),
+                                 _mm256_set1_epi32(0xc0));
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+static void __attribute__((target("avx2")))
+pixel_conv_8_to_32_avx2_body(uint8_t *d, const uint8_t *s, int width)
+{
+    for (; width >= 16; width -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        _mm256_storeu_si256((__m256i *)d,
+                            avx2_rgb332(_mm256_cvtepu8_epi32(v)));
+        _mm256_storeu_si256((__m256i *)(d + 32),
+                            avx2_rgb332(_mm256_cvtepu8_epi32(
+                                            _mm_srli_si128(v, 8))));
+        s += 16;
+        d += 64;
+    }
+}
+
+/* 24 bpp: 16 pixels are exactly three vectors, which are realigned with
+ * palignr so that each shuffle sees four whole pixels and the source is
+ * never read past the end of the line.
+ */
+static void __attribute__((target("ssse3")))
+pixel_conv_24_to_32_ssse3_body(uint8_t *d, const uint8_t *s, int width)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                       6, 7, 8, -1, 9, 10, 11, -1);
+
+    for (; width >= 16; width -= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        _mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(a, shuf));
+        _mm_storeu_si128((__m128i *)(d + 16),
+                         _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), shuf));
+        _mm_storeu_si128((__m128i *)(d + 32),
+                         _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), shuf));
+        _mm_storeu_si128((__m128i *)(d + 48),
+                         _mm_shuffle_epi8(_mm_srli_si128(c, 4), shuf));
+        s += 48;
+        d += 64;
+    }
+}
+
+static void __attribute__((target("ssse3")))
+pixel_conv_32_to_32bgr_ssse3_body(uint8_t *d, const uint8_t *s, int width)
+{
+    const __m128i shuf = _mm_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1,
+                                       10, 9, 8, -1, 14, 13, 12, -1);
+
+    for (; width >= 4; width -= 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        _mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(v, shuf));
+        s += 16;
+        d += 16;
+    }
+}
+
+static void __attribute__((target("avx2")))
+pixel_conv_32_to_32bgr_avx2_body(uint8_t *d, const uint8_t *s, int width)
+{
+    const __m256i shuf = _mm256_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1,
+                                          10, 9, 8, -1, 14, 13, 12, -1,
+                                          2, 1, 0, -1, 6, 5, 4, -1,
+                                          10, 9, 8, -1, 14, 13, 12, -1);
+
+    for (; width >= 8; width -= 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)s);
+        _mm256_storeu_si256((__m256i *)d, _mm256_shuffle_epi8(v, shuf));
+        s += 32;
+        d += 32;
+    }
+}
+
+#endif /* PIXEL_CONV_X86 */
+
+#ifdef PIXEL_CONV_NEON
+
+/* NEON has structured loads and stores, so the kernels just compute the
+ * three components as byte planes and let vst4 interleave them.
+ */
+
+static void pixel_conv_8_to_32_neon_body(uint8_t *d, const uint8_t *s,
+                                         int width)
+{
+    uint8x8x4_t out;
+
+    out.val[3] = vdup_n_u8(0);
+    for (; width >= 8; width -= 8) {
+        uint8x8_t v = vld1_u8(s);
+        out.val[2] = vand_u8(v, vdup_n_u8(0xe0));
+        out.val[1] = vand_u8(vshl_n_u8(v, 3), vdup_n_u8(0xe0));
+        out.val[0] = vshl_n_u8(v, 6);
+        vst4_u8(d, out);
+        s += 8;
+        d += 32;
+    }
+}
+
+#define NEON_RGB16(name, rs, gs, gm)                                        \
+static void name(uint8_t *d, const uint8_t *s, int width)                   \
+{                                                                           \
+    uint8x8x4_t out;                                                        \
+                                                                            \
+    out.val[3] = vdup_n_u8(0);                                              \
+    for (; width >= 8; width -= 8) {                                        \
+        uint16x8_t v = vld1q_u16((const uint16_t *)s);                      \
+        out.val[2] = vand_u8(vmovn_u16(vshrq_n_u16(v, rs)), vdup_n_u8(0xf8)); \
+        out.val[1] = vand_u8(vmovn_u16(vshrq_n_u16(v, gs)), vdup_n_u8(gm)); \
+        out.val[0] = vand_u8(vmovn_u16(vshlq_n_u16(v, 3)), vdup_n_u8(0xf8)); \
+        vst4_u8(d, out);                                                    \
+        s += 16;                                                            \
+        d += 32;                                                            \
+    }                                                                       \
+}
+
+NEON_RGB16(pixel_conv_15_to_32_neon_body, 7, 2, 0xf8)
+NEON_RGB16(pixel_conv_16_to_32_neon_body, 8, 3, 0xfc)
+
+static void pixel_conv_24_to_32_neon_body(uint8_t *d, const uint8_t *s,
+                                          int width)
+{
+    uint8x8x3_t in;
+    uint8x8x4_t out;
+
+    out.val[3] = vdup_n_u8(0);
+    for (; width >= 8; width -= 8) {
+        in = vld3_u8(s);
+        out.val[0] = in.val[0];
+        out.val[1] = in.val[1];
+        out.val[2] = in.val[2];
+        vst4_u8(d, out);
+        s += 24;
+        d += 32;
+    }
+}
+
+static void pixel_conv_32_to_32bgr_neon_body(uint8_t *d, const uint8_t *s,
+                                             int width)
+{
+    uint8x8x4_t in, out;
+
+    out.val[3] = vdup_n_u8(0);
+    for (; width >= 8; width -= 8) {
+        in = vld4_u8(s);
+        out.val[0] = in.val[2];
+        out.val[1] = in.val[1];
+        out.val[2] = in.val[0];
+        vst4_u8(d, out);
+        s += 32;
+        d += 32;
+    }
+}
+
+#endif /* PIXEL_CONV_NEON */
+
+/* Each vector body only handles whole blocks of @block pixels; the
+ * wrapper finishes the line with the portable version.
+ */
+#define PIXEL_CONV_WRAP(name, body, tail, block, sbpp)                      \
+static void name(uint8_t *d, const uint8_t *s, int width)                   \
+{                                                                           \
+    int n = width & ~((block) - 1);                                         \
+                                                                            \
+    if (n) {                                                                \
+        body(d, s, n);                                                      \
+    }                                                                       \
+    tail(d + n * 4, s + n * (sbpp), width - n);                             \
+}
+
+#ifdef PIXEL_CONV_X86
+PIXEL_CONV_WRAP(pixel_conv_8_to_32_sse2, pixel_conv_8_to_32_sse2_body,
+                pixel_conv_8_to_32_c, 16, 1)
+PIXEL_CONV_WRAP(pixel_conv_8_to_32_avx2, pixel_conv_8_to_32_avx2_body,
+                pixel_conv_8_to_32_c, 16, 1)
+PIXEL_CONV_WRAP(pixel_conv_15_to_32_sse2, pixel_conv_15_to_32_sse2_body,
+                pixel_conv_15_to_32_c, 8, 2)
+PIXEL_CONV_WRAP(pixel_conv_16_to_32_sse2, pixel_conv_16_to_32_sse2_body,
+                pixel_conv_16_to_32_c, 8, 2)
+PIXEL_CONV_WRAP(pixel_conv_15_to_32_avx2, pixel_conv_15_to_32_avx2_body,
+                pixel_conv_15_to_32_c, 16, 2)
+PIXEL_CONV_WRAP(pixel_conv_16_to_32_avx2, pixel_conv_16_to_32_avx2_body,
+                pixel_conv_16_to_32_c, 16, 2)
+PIXEL_CONV_WRAP(pixel_conv_24_to_32_ssse3, pixel_conv_24_to_32_ssse3_body,
+                pixel_conv_24_to_32_c, 16, 3)
+PIXEL_CONV_WRAP(pixel_conv_32_to_32bgr_ssse3,
+                pixel_conv_32_to_32bgr_ssse3_body,
+                pixel_conv_32_to_32bgr_c, 4, 4)
+PIXEL_CONV_WRAP(pixel_conv_32_to_32bgr_avx2, pixel_conv_32_to_32bgr_avx2_body,
+                pixel_conv_32_to_32bgr_c, 8, 4)
+#endif
+
+#ifdef PIXEL_CONV_NEON
+PIXEL_CONV_WRAP(pixel_conv_8_to_32_neon, pixel_conv_8_to_32_neon_body,
+                pixel_conv_8_to_32_c, 8, 1)
+PIXEL_CONV_WRAP(pixel_conv_15_to_32_neon, pixel_conv_15_to_32_neon_body,
+                pixel_conv_15_to_32_c, 8, 2)
+PIXEL_CONV_WRAP(pixel_conv_16_to_32_neon, pixel_conv_16_to_32_neon_body,
+                pixel_conv_16_to_32_c, 8, 2)
+PIXEL_CONV_WRAP(pixel_conv_24_to_32_neon, pixel_conv_24_to_32_neon_body,
+                pixel_conv_24_to_32_c, 8, 3)
+PIXEL_CONV_WRAP(pixel_conv_32_to_32bgr_neon, pixel_conv_32_to_32bgr_neon_body,
+                pixel_conv_32_to_32bgr_c, 8, 4)
+#endif
+
+PixelConvFunc *pixel_conv_8_to_32 = pixel_conv_8_to_32_c;
+PixelConvFunc *pixel_conv_15_to_32 = pixel_conv_15_to_32_c;
+PixelConvFunc *pixel_conv_16_to_32 = pixel_conv_16_to_32_c;
+PixelConvFunc *pixel_conv_24_to_32 = pixel_conv_24_to_32_c;
+PixelConvFunc *pixel_conv_32_to_32bgr = pixel_conv_32_to_32bgr_c;
+
+static const char *pixel_conv_accel = "c";
+
+const char *pixel_conv_accel_name(void)
+{
+    return pixel_conv_accel;
+}
+
+static void __attribute__((constructor)) pixel_conv_init(void)
+{
+#ifdef PIXEL_CONV_X86
+    unsigned a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return;
+    }
+    if (d & bit_SSE2) {
+        pixel_conv_8_to_32 = pixel_conv_8_to_32_sse2;
+        pixel_conv_15_to_32 = pixel_conv_15_to_32_sse2;
+        pixel_conv_16_to_32 = pixel_conv_16_to_32_sse2;
+        pixel_conv_accel = "sse2";
+    }
+    if (c & bit_SSSE3) {
+        pixel_conv_24_to_32 = pixel_conv_24_to_32_ssse3;
+        pixel_conv_32_to_32bgr = pixel_conv_32_to_32bgr_ssse3;
+        pixel_conv_accel = "ssse3";
+    }
+    if (qemu_cpu_has_avx2()) {
+        pixel_conv_8_to_32 = pixel_conv_8_to_32_avx2;
+        pixel_conv_15_to_32 = pixel_conv_15_to_32_avx2;
+        pixel_conv_16_to_32 = pixel_conv_16_to_32_avx2;
+        pixel_conv_32_to_32bgr = pixel_conv_32_to_32bgr_avx2;
+        pixel_conv_accel = "avx2";
+    }
+#endif
+#ifdef PIXEL_CONV_NEON
+    pixel_conv_8_to_32 = pixel_conv_8_to_32_neon;
+    pixel_conv_15_to_32 = pixel_conv_15_to_32_neon;
+    pixel_conv_16_to_32 = pixel_conv_16_to_32_neon;
+    pixel_conv_24_to_32 = pixel_conv_24_to_32_neon;
+    pixel_conv_32_to_32bgr = pixel_conv_32_to_32bgr_neon;
+    pixel_conv_accel = "neon";
+#endif
+}
@@ -141,6 +141,7 @@ int main(int argc, char **argv)
 #include "sysemu/sysemu.h"
 #include "exec/gdbstub.h"
 #include "qemu/timer.h"
+#include "qemu/log.h"
 #include "char/char.h"
 #include "qemu/cache-utils.h"
 #include "sysemu/blockdev.h"
@@ -176,6 +177,7 @@ int main(int argc, char **argv)
 
 #include "ui/qemu-spice.h"
 #include "qapi/string-input-visitor.h"
+#include "block/thread-pool.h"
 #include "ui/xen-input.h"
 
 /* XenClient: battery
@@ -212,6 +214,9 @@ static int full_screen = 0;
 #ifdef CONFIG_SDL
 static int no_frame = 0;
 #endif
+#ifdef CONFIG_POSIX
+static const char *shm_display_name;
+#endif
 int no_quit = 0;
 CharDriverState *serial_hds[MAX_SERIAL_PORTS];
 CharDriverState *parallel_hds[MAX_PARALLEL_PORTS];
@@ -264,6 +269,7 @@ static QTAILQ_HEAD(, FWBootEntry) fw_boot_order =
 int nb_numa_nodes;
 uint64_t node_mem[MAX_NODES];
 unsigned long *node_cpumask[MAX_NODES];
+int node_host[MAX_NODES];
 
 uint8_t qemu_uuid[16];
 
@@ -449,10 +455,28 @@ static QemuOptsList qemu_machine_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "emulate Xen default devices (i440FX, PIIX3-xen,"
                     " xen-platform, PIIX4_PM, i8042, elcr, rtc)"
+        }, {
+            .name = "xen_devices",
+            .type = QEMU_OPT_STRING,
+            .help = "colon-separated list of the only PCI devices this"
+                    " Xen device model emulates",
         }, {
             .name = "emulate_ide",
             .type = QEMU_OPT_BOOL,
             .help = "emulate IDE (default on)"
+        }, {
+            .name = "xen_ioreq_workers",
+            .type = QEMU_OPT_BOOL,
+            .help = "service each Xen vcpu's ioreqs from its own thread"
+        }, {
+            .name = "xen_dmbus_thread",
+            .type = QEMU_OPT_BOOL,
+            .help = "service dmbus connections from a dedicated thread"
+        }, {
+            .name = "xen_mapcache_size",
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum amount of guest memory kept mapped by the"
+                    " Xen map cache",
         },
         { /* End of list */ }
     },
@@ -508,6 +532,31 @@ static QemuOptsList qemu_add_fd_opts = {
     },
 };
 
+static QemuOptsList qemu_aio_pool_opts = {
+    .name = "aio-pool",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_aio_pool_opts.head),
+    .desc = {
+        {
+            .name = "min-threads",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of worker threads kept when idle",
+        },{
+            .name = "max-threads",
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum number of worker threads",
+        },{
+            .name = "cpus",
+            .type = QEMU_OPT_STRING,
+            .help = "host CPUs to run the workers on, e.g. 0-3,8",
+        },{
+            .name = "node",
+            .type = QEMU_OPT_NUMBER,
+            .help = "host NUMA node to run the workers on",
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_object_opts = {
     .name = "object",
     .implied_opt_name = "qom-type",
@@ -1099,6 +1148,28 @@ static int cleanup_add_fd(QemuOpts *opts, void *opaque)
 #define MTD_OPTS ""
 #define SD_OPTS ""
 
+static int aio_pool_init_func(QemuOpts *opts, void *opaque)
+{
+    const char *id = qemu_opts_id(opts);
+    Error *err = NULL;
+
+    if (!id) {
+        error_report("aio-pool: id is required");
+        return -1;
+    }
+
+    thread_pool_new(id, qemu_opt_get_number(opts, "min-threads", 0),
+                    qemu_opt_get_number(opts, "max-threads", 64),
+                    qemu_opt_get(opts, "cpus"),
+                    qemu_opt_get_number(opts, "node", -1), &err);
+    if (error_is_set(&err)) {
+        error_report("aio-pool %s: %s", id, error_get_pretty(err));
+        error_free(err);
+        return -1;
+    }
+    return 0;
+}
+
 static int drive_init_func(QemuOpts *opts, void *opaque)
 {
     BlockInterfaceType *block_default_type = opaque;
@@ -1359,6 +1430,18 @@ static void numa_add(const char *optarg)
         if (get_param_value(option, 128, "cpus", optarg) != 0) {
             numa_node_parse_cpus(nodenr, option);
         }
+        if (get_param_value(option, 128, "hostnode", optarg) == 0) {
+            node_host[nodenr] = -1;
+        } else {
+            unsigned long long hostnode;
+
+            if (parse_uint_full(option, &hostnode, 10) < 0 ||
+                hostnode >= MAX_NODES) {
+                fprintf(stderr, "qemu: invalid NUMA hostnode: %s\n", option);
+                exit(1);
+            }
+            node_host[nodenr] = hostnode;
+        }
         nb_numa_nodes++;
     } else {
         fprintf(stderr, "Invalid -numa option: %s\n", option);
@@ -2238,6 +2321,19 @@ static DisplayType select_display(const char *p)
 #else
         fprintf(stderr, "Surfman support is disabled\n");
         exit(1);
+#endif
+    } else if (strstart(p, "shm", &opts)) {
+#ifdef CONFIG_POSIX
+        display = DT_SHM;
+        if (strstart(opts, ",name=", &opts)) {
+            shm_display_name = opts;
+        } else if (*opts) {
+            fprintf(stderr, "Invalid shm display option string: %s\n", p);
+            exit(1);
+        }
+#else
+        fprintf(stderr, "Shared memory display is not supported\n");
+        exit(1);
 #endif
     } else if (strstart(p, "none", &opts)) {
         display = DT_NONE;
@@ -2721,6 +2817,18 @@ static void qemu_run_machine_init_done_notifiers(void)
     notifier_list_notify(&machine_init_done_notifiers, NULL);
 }
 
+static int64_t startup_begin_ns, startup_last_ns;
+
+void qemu_startup_phase(const char *phase)
+{
+    int64_t now = get_clock();
+
+    qemu_log_mask(LOG_STARTUP, "startup: %-16s %8.3f ms, %8.3f ms total\n",
+                  phase, (now - startup_last_ns) / 1e6,
+                  (now - startup_begin_ns) / 1e6);
+    startup_last_ns = now;
+}
+
 static const QEMUOption *lookup_opt(int argc, char **argv,
                                     const char **poptarg, int *poptind)
 {
@@ -2848,6 +2956,7 @@ int main(int argc, char **argv, char **envp)
     const char *vga_model = "none";
     const char *pid_file = NULL;
     const char *incoming = NULL;
+    const char *qmp_thread = NULL;
 #ifdef CONFIG_VNC
     int show_vnc_port = 0;
 #endif
@@ -2863,6 +2972,7 @@ int main(int argc, char **argv, char **envp)
     const char *trace_events = NULL;
     const char *trace_file = NULL;
 
+    startup_begin_ns = startup_last_ns = get_clock();
     atexit(qemu_run_exit_notifiers);
     error_set_progname(argv[0]);
 
@@ -2892,6 +3002,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_boot_opts);
     qemu_add_opts(&qemu_sandbox_opts);
     qemu_add_opts(&qemu_add_fd_opts);
+    qemu_add_opts(&qemu_aio_pool_opts);
     qemu_add_opts(&qemu_object_opts);
 
     runstate_init();
@@ -2915,6 +3026,7 @@ int main(int argc, char **argv, char **envp)
     for (i = 0; i < MAX_NODES; i++) {
         node_mem[i] = 0;
         node_cpumask[i] = bitmap_new(MAX_CPUMASK_BITS);
+        node_host[i] = -1;
     }
 
     nb_numa_nodes = 0;
@@ -3351,6 +3463,9 @@ int main(int argc, char **argv, char **envp)
                 monitor_parse(optarg, "control");
                 default_monitor = 0;
                 break;
+            case QEMU_OPTION_qmp_thread:
+                qmp_thread = optarg;
+                break;
             case QEMU_OPTION_mon:
                 opts = qemu_opts_parse(qemu_find_opts("mon"), optarg, 1);
                 if (!opts) {
@@ -3378,7 +3493,7 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_virtfs: {
                 QemuOpts *fsdev;
                 QemuOpts *device;
-                const char *writeout, *sock_fd, *socket;
+                const char *writeout, *sock_fd, *socket, *threads;
 
                 olist = qemu_find_opts("virtfs");
                 if (!olist) {
@@ -3426,6 +3541,10 @@ int main(int argc, char **argv, char **envp)
                 if (sock_fd) {
                     qemu_opt_set(fsdev, "sock_fd", sock_fd);
                 }
+                threads = qemu_opt_get(opts, "threads");
+                if (threads) {
+                    qemu_opt_set(fsdev, "threads", threads);
+                }
 
                 qemu_opt_set_bool(fsdev, "readonly",
                                 qemu_opt_get_bool(opts, "readonly", 0));
@@ -3850,6 +3969,12 @@ int main(int argc, char **argv, char **envp)
                 exit(1);
 #endif
                 break;
+            case QEMU_OPTION_aio_pool:
+                opts = qemu_opts_parse(qemu_find_opts("aio-pool"), optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_object:
                 opts = qemu_opts_parse(qemu_find_opts("object"), optarg, 1);
                 if (!opts) {
@@ -3919,6 +4044,7 @@ int main(int argc, char **argv, char **envp)
         }
         set_cpu_log(log_mask);
     }
+    qemu_startup_phase("options");
 
     if (!trace_backend_init(trace_events, trace_file)) {
         exit(1);
@@ -4051,6 +4177,8 @@ int main(int argc, char **argv, char **envp)
     }
 #endif
 
+    qemu_startup_phase("chardevs");
+
     os_daemonize();
 
     if (pid_file && qemu_create_pidfile(pid_file) != 0) {
@@ -4069,6 +4197,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     configure_accelerator();
+    qemu_startup_phase("accelerator");
 
     machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
     if (machine_opts) {
@@ -4122,6 +4251,7 @@ int main(int argc, char **argv, char **envp)
     if (net_init_clients() < 0) {
         exit(1);
     }
+    qemu_startup_phase("netdevs");
 
     /* init the bluetooth world */
     if (foreach_device_config(DEV_BT, bt_parse))
@@ -4141,6 +4271,11 @@ int main(int argc, char **argv, char **envp)
 
     blk_mig_init();
 
+    if (qemu_opts_foreach(qemu_find_opts("aio-pool"), aio_pool_init_func,
+                          NULL, 1) != 0) {
+        exit(1);
+    }
+
     /* open the virtual block devices */
     if (snapshot)
         qemu_opts_foreach(qemu_find_opts("drive"), drive_enable_snapshot, NULL, 0);
@@ -4153,6 +4288,7 @@ int main(int argc, char **argv, char **envp)
                   CDROM_OPTS);
     default_drive(default_floppy, snapshot, IF_FLOPPY, 0, FD_OPTS);
     default_drive(default_sdcard, snapshot, IF_SD, 0, SD_OPTS);
+    qemu_startup_phase("drives");
 
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 
@@ -4202,6 +4338,9 @@ int main(int argc, char **argv, char **envp)
     if (qemu_opts_foreach(qemu_find_opts("mon"), mon_init_func, NULL, 1) != 0) {
         exit(1);
     }
+    if (qmp_thread) {
+        monitor_thread_init(qmp_thread);
+    }
 
     if (foreach_device_config(DEV_SERIAL, serial_parse) < 0)
         exit(1);
@@ -4214,6 +4353,7 @@ int main(int argc, char **argv, char **envp)
     }
     if (foreach_device_config(DEV_DEBUGCON, debugcon_parse) < 0)
         exit(1);
+    qemu_startup_phase("monitors");
 
     /* If no default VGA is requested, the default is "none".  */
     if (default_vga) {
@@ -4247,6 +4387,7 @@ int main(int argc, char **argv, char **envp)
                                  .initrd_filename = initrd_filename,
                                  .cpu_model = cpu_model };
     machine->init(&args);
+    qemu_startup_phase("machine");
 
     cpu_synchronize_all_post_init();
 
@@ -4263,6 +4404,7 @@ int main(int argc, char **argv, char **envp)
     /* init generic devices */
     if (qemu_opts_foreach(qemu_find_opts("device"), device_init_func, NULL, 1) != 0)
         exit(1);
+    qemu_startup_phase("devices");
 
     net_check_clients();
 
@@ -4306,6 +4448,11 @@ int main(int argc, char **argv, char **envp)
         xen_input_init();
         surfman_display_init(ds);
         break;
+#endif
+#if defined(CONFIG_POSIX)
+    case DT_SHM:
+        shm_display_init(ds, shm_display_name);
+        break;
 #endif
     default:
         break;
@@ -4340,6 +4487,7 @@ int main(int argc, char **argv, char **envp)
 
     /* display setup */
     text_consoles_set_display(ds);
+    qemu_startup_phase("displays");
 
     if (foreach_device_config(DEV_GDB, gdbserver_start) < 0) {
         exit(1);
@@ -4351,6 +4499,7 @@ int main(int argc, char **argv, char **envp)
         fprintf(stderr, "rom loading failed\n");
         exit(1);
     }
+    qemu_startup_phase("roms");
 
     /* TODO: once all bus devices are qdevified, this should be done
      * when bus is created by qdev.c */
@@ -4377,6 +4526,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     os_setup_post();
+    qemu_startup_phase("ready");
 
     resume_all_vcpus();
     main_loop();
@@ -11,8 +11,16 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
+#include "qemu/cpu-features.h"
 #include "include/migration/migration.h"
 
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <immintrin.h>
+#define XBZRLE_X86
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -23,8 +31,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+int xbzrle_encode_buffer_c(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                           uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -123,6 +131,134 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#ifdef XBZRLE_X86
+/* The vector encoders produce exactly the same output as the scalar one.
+ * Only finding the end of each run differs: a whole vector is compared at
+ * a time and the movemask of the equality result locates the first byte
+ * that ends the run.  zrun ends at the first differing byte, nzrun at the
+ * first equal one.
+ */
+#define XBZRLE_ENCODE(name, isa, vlen, type, load, cmpeq, movemask)         \
+static inline int __attribute__((target(isa)))                              \
+name##_zrun(const uint8_t *o, const uint8_t *n, int i, int slen)            \
+{                                                                           \
+    uint32_t eq;                                                            \
+                                                                            \
+    for (; i + (vlen) <= slen; i += (vlen)) {                               \
+        eq = movemask(cmpeq(load((const type *)(o + i)),                    \
+                            load((const type *)(n + i))));                  \
+        if (eq != (uint32_t)((1ULL << (vlen)) - 1)) {                       \
+            return i + ctz32(~eq);                                          \
+        }                                                                   \
+    }                                                                       \
+    while (i < slen && o[i] == n[i]) {                                      \
+        i++;                                                                \
+    }                                                                       \
+    return i;                                                               \
+}                                                                           \
+                                                                            \
+static inline int __attribute__((target(isa)))                              \
+name##_nzrun(const uint8_t *o, const uint8_t *n, int i, int slen)           \
+{                                                                           \
+    uint32_t eq;                                                            \
+                                                                            \
+    for (; i + (vlen) <= slen; i += (vlen)) {                               \
+        eq = movemask(cmpeq(load((const type *)(o + i)),                    \
+                            load((const type *)(n + i))));                  \
+        if (eq) {                                                           \
+            return i + ctz32(eq);                                           \
+        }                                                                   \
+    }                                                                       \
+    while (i < slen && o[i] != n[i]) {                                      \
+        i++;                                                                \
+    }                                                                       \
+    return i;                                                               \
+}                                                                           \
+                                                                            \
+static int __attribute__((target(isa)))                                     \
+name(uint8_t *old_buf, uint8_t *new_buf, int slen, uint8_t *dst, int dlen)  \
+{                                                                           \
+    int d = 0, i = 0, start;                                                \
+    uint32_t len;                                                           \
+                                                                            \
+    while (i < slen) {                                                      \
+        if (d + 2 > dlen) {                                                 \
+            return -1;                                                      \
+        }                                                                   \
+                                                                            \
+        start = i;                                                          \
+        i = name##_zrun(old_buf, new_buf, i, slen);                         \
+        if (i - start == slen) {                                            \
+            return 0;                                                       \
+        }                                                                   \
+        if (i == slen) {                                                    \
+            return d;                                                       \
+        }                                                                   \
+        d += uleb128_encode_small(dst + d, i - start);                      \
+                                                                            \
+        if (d + 2 > dlen) {                                                 \
+            return -1;                                                      \
+        }                                                                   \
+                                                                            \
+        start = i;                                                          \
+        i = name##_nzrun(old_buf, new_buf, i, slen);                        \
+        len = i - start;                                                    \
+        d += uleb128_encode_small(dst + d, len);                            \
+        if (d + len > dlen) {                                               \
+            return -1;                                                      \
+        }                                                                   \
+        memcpy(dst + d, new_buf + start, len);                              \
+        d += len;                                                           \
+    }                                                                       \
+                                                                            \
+    return d;                                                               \
+}
+
+XBZRLE_ENCODE(xbzrle_encode_buffer_sse2, "sse2", 16, __m128i,
+              _mm_loadu_si128, _mm_cmpeq_epi8, _mm_movemask_epi8)
+XBZRLE_ENCODE(xbzrle_encode_buffer_avx2, "avx2", 32, __m256i,
+              _mm256_loadu_si256, _mm256_cmpeq_epi8, _mm256_movemask_epi8)
+#endif
+
+typedef int XbzrleEncodeFunc(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen);
+
+static XbzrleEncodeFunc *xbzrle_encode = xbzrle_encode_buffer_c;
+static const char *xbzrle_accel = "c";
+
+static void __attribute__((constructor)) xbzrle_init(void)
+{
+#ifdef XBZRLE_X86
+    unsigned a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d) && (d & bit_SSE2)) {
+        xbzrle_encode = xbzrle_encode_buffer_sse2;
+        xbzrle_accel = "sse2";
+    }
+    if (qemu_cpu_has_avx2()) {
+        xbzrle_encode = xbzrle_encode_buffer_avx2;
+        xbzrle_accel = "avx2";
+    }
+#endif
+}
+
+const char *xbzrle_encode_accel_name(void)
+{
+    return xbzrle_accel;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen);
+}
+
+/* Decoding is a sequence of memcpy()s into the page and gains nothing from
+ * hand-written vector code.
+ */
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -18,9 +18,12 @@
 
 #include "char/char.h"
 #include "qemu/range.h"
+#include "qemu/bitmap.h"
+#include "qemu/thread.h"
 #include "sysemu/xen-mapcache.h"
 #include "trace.h"
 #include "exec/address-spaces.h"
+#include "exec/exec-all.h"
 
 #include <xen/hvm/ioreq.h>
 #include <xen/hvm/params.h>
@@ -45,6 +48,28 @@ static uint32_t xen_dmid = ~0;
 
 static bool xen_emulate_default_dev = true;
 
+/*
+ * With -machine xen_devices=NAME[:NAME...] this QEMU is one of several
+ * ioreq servers of the domain.  It registers only the listed PCI devices
+ * and the I/O ranges they decode, so the others can be served by other
+ * device models.  NULL means every device is emulated here.
+ */
+static char **xen_devices;
+static PCIBus *xen_pci_bus;
+
+/* Ranges that PCI devices decode outside of their BARs, by region name.
+ * Subregions of these are included. */
+static const struct {
+    const char *device;
+    const char *regions[6];
+} xen_legacy_ranges[] = {
+    { "VGA", { "vga", "vbe", "openxt", "vga-lowmem", "vga.chain4", NULL } },
+    { "cirrus-vga", { "cirrus-io", "cirrus-lowmem-container", NULL } },
+    { "piix3-ide", { "ide", NULL } },
+    { "piix3-ide-xen", { "ide", NULL } },
+    { "piix4-ide", { "ide", NULL } },
+};
+
 /* Compatibility with older version */
 #if __XEN_LATEST_INTERFACE_VERSION__ < 0x0003020a
 static inline uint32_t xen_vcpu_eport(shared_iopage_t *shared_page, int i)
@@ -107,6 +132,85 @@ typedef struct XenPhysmap {
     QLIST_ENTRY(XenPhysmap) list;
 } XenPhysmap;
 
+/* A range of guest memory whose dirty pages are read back from Xen */
+typedef struct XenDirtyRange {
+    MemoryRegion *mr;
+    hwaddr offset_within_region;
+    hwaddr start_addr;
+    ram_addr_t size;
+
+    QLIST_ENTRY(XenDirtyRange) list;
+} XenDirtyRange;
+
+/* Xen tracks a single range of guest frames at a time, so ranges that are
+ * adjacent are asked for together if they span at most this many pages;
+ * otherwise each sync moves the tracking to the range it is for, and Xen
+ * reports a range it just started tracking as all dirty.  Ranges with a gap
+ * between them are never merged, that would put the guest RAM in the gap
+ * in log-dirty mode too.
+ */
+#define XEN_DIRTY_SPAN_MAX  (32768)
+
+/* Section of a thread-safe MemoryRegion, which ioreq workers may dispatch to
+ * without taking the global mutex.  A worker holds a use of the range while
+ * it calls into the region, so that it can drop xen_lockless_lock; unmapping
+ * the section waits for the uses to go away. */
+typedef struct XenLocklessRange {
+    hwaddr start_addr;
+    uint64_t size;
+    hwaddr offset_within_region;
+    MemoryRegion *mr;
+    int is_mmio;
+    unsigned int users;
+
+    QLIST_ENTRY(XenLocklessRange) list;
+} XenLocklessRange;
+
+static QLIST_HEAD(, XenLocklessRange) xen_lockless_ranges =
+    QLIST_HEAD_INITIALIZER(xen_lockless_ranges);
+static QemuMutex xen_lockless_lock;
+static QemuCond xen_lockless_cond;
+
+/* Doorbell registered with memory_region_add_eventfd().  A write that hits
+ * one only sets the notifier, see xen_ioreq_signal_eventfd(). */
+typedef struct XenIOEventFD {
+    hwaddr addr;
+    uint64_t size;
+    bool match_data;
+    uint64_t data;
+    EventNotifier *e;
+    int is_mmio;
+
+    QLIST_ENTRY(XenIOEventFD) list;
+} XenIOEventFD;
+
+/* Protected by xen_lockless_lock, ioreq workers look them up too */
+static QLIST_HEAD(, XenIOEventFD) xen_ioeventfds =
+    QLIST_HEAD_INITIALIZER(xen_ioeventfds);
+
+/* Range of a region set up with memory_region_add_coalescing() */
+typedef struct XenCoalescedRange {
+    hwaddr start_addr;
+    uint64_t size;
+    int is_mmio;
+
+    QLIST_ENTRY(XenCoalescedRange) list;
+} XenCoalescedRange;
+
+/* Writes to coalesced ranges that may wait to be dispatched at once */
+#define XEN_COALESCED_MAX  (64)
+
+struct XenIOState;
+
+/* Per-vcpu ioreq service thread, see xen_ioreq_worker_thread() */
+typedef struct XenIOWorker {
+    struct XenIOState *state;
+    QemuThread thread;
+    XenEvtchn xce_handle;
+    evtchn_port_t local_port;
+    int vcpu;
+} XenIOWorker;
+
 typedef struct XenIOState {
     shared_iopage_t *shared_page;
     buffered_iopage_t *buffered_io_page;
@@ -115,22 +219,36 @@ typedef struct XenIOState {
     evtchn_port_t *ioreq_local_port;
     /* evtchn local port for buffered io */
     evtchn_port_t bufioreq_local_port;
+    /* scratch space for draining the buffered io page */
+    ioreq_t buffered_reqs[IOREQ_BUFFER_SLOT_NUM];
+    /* writes to coalesced ranges, answered before they are dispatched */
+    QLIST_HEAD(, XenCoalescedRange) coalesced_ranges;
+    ioreq_t coalesced_reqs[XEN_COALESCED_MAX];
+    int coalesced_count;
+    bool coalesced_flush_in_progress;
+    QEMUBH *coalesced_bh;
     /* the evtchn fd for polling */
     XenEvtchn xce_handle;
     /* which vcpu we are serving */
     int send_vcpu;
+    /* per-vcpu threads, used instead of ioreq_local_port when enabled */
+    bool ioreq_workers;
+    bool ioreq_workers_started;
+    XenIOWorker *workers;
 
     struct xs_handle *xenstore;
     MemoryListener memory_listener;
     MemoryListener io_listener;
     QLIST_HEAD(, XenPhysmap) physmap;
     hwaddr free_phys_offset;
-    const XenPhysmap *log_for_dirtybit;
+    QLIST_HEAD(, XenDirtyRange) dirty_ranges;
 
     Notifier exit;
     Notifier suspend;
 } XenIOState;
 
+static XenIOState *xen_io_state;
+
 /* Xen specific function for piix pci */
 
 int xen_pci_slot_get_pirq(PCIDevice *pci_dev, int irq_num)
@@ -144,8 +262,71 @@ void xen_piix3_set_irq(void *opaque, int irq_num, int level)
                               irq_num & 3, level);
 }
 
+static bool xen_device_selected(const char *name)
+{
+    int i;
+
+    if (!xen_devices) {
+        return true;
+    }
+    for (i = 0; xen_devices[i]; i++) {
+        if (!strcmp(xen_devices[i], name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Is @mr, or a region containing it, decoded by a device we emulate? */
+static bool xen_region_selected(MemoryRegion *mr)
+{
+    PCIDevice *d;
+    int devfn, i, j;
+
+    if (!xen_devices) {
+        return true;
+    }
+
+    for (; mr; mr = mr->parent) {
+        for (i = 0; i < ARRAY_SIZE(xen_legacy_ranges); i++) {
+            if (!xen_device_selected(xen_legacy_ranges[i].device)) {
+                continue;
+            }
+            for (j = 0; xen_legacy_ranges[i].regions[j]; j++) {
+                if (mr->name &&
+                    !strcmp(mr->name, xen_legacy_ranges[i].regions[j])) {
+                    return true;
+                }
+            }
+        }
+
+        if (!xen_pci_bus) {
+            continue;
+        }
+        for (devfn = 0; devfn < 256; devfn++) {
+            d = pci_find_device(xen_pci_bus, pci_bus_num(xen_pci_bus), devfn);
+            if (!d || !xen_device_selected(d->name)) {
+                continue;
+            }
+            for (i = 0; i < PCI_NUM_REGIONS; i++) {
+                if (d->io_regions[i].memory == mr) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
 int xen_register_pcidev(PCIDevice *pci_dev)
 {
+    if (!xen_pci_bus) {
+        xen_pci_bus = pci_dev->bus;
+    }
+    if (!xen_device_selected(pci_dev->name)) {
+        return 0;
+    }
+
     /* List of default devices */
     if (!xen_emulate_default_dev) {
         if (!strcmp("i440FX", pci_dev->name)
@@ -239,9 +420,27 @@ static void xen_map_iorange(MemoryRegionSection *section, int is_mmio)
         return;
     }
 
+    if (!xen_region_selected(section->mr)) {
+        return;
+    }
+
     DPRINTF("map %s %s 0x"TARGET_FMT_plx" - 0x"TARGET_FMT_plx"\n",
             (is_mmio) ? "mmio" : "io", name, addr, addr + size - 1);
 
+    if (memory_region_is_thread_safe(section->mr)) {
+        XenLocklessRange *range = g_malloc0(sizeof(*range));
+
+        range->start_addr = addr;
+        range->size = size;
+        range->offset_within_region = section->offset_within_region;
+        range->mr = section->mr;
+        range->is_mmio = is_mmio;
+
+        qemu_mutex_lock(&xen_lockless_lock);
+        QLIST_INSERT_HEAD(&xen_lockless_ranges, range, list);
+        qemu_mutex_unlock(&xen_lockless_lock);
+    }
+
     xen_xc_hvm_map_io_range_to_ioreq_server(xen_xc, xen_domid, serverid,
                                             is_mmio, addr, addr + size - 1);
 }
@@ -249,15 +448,35 @@ static void xen_map_iorange(MemoryRegionSection *section, int is_mmio)
 static void xen_unmap_iorange(MemoryRegionSection *section, int is_mmio)
 {
     hwaddr addr = section->offset_within_address_space;
+    XenLocklessRange *range, *next;
 
     if (memory_region_is_ram(section->mr)) {
         return;
     }
 
+    /* Once off the list a range gets no new users; wait for any worker
+     * still dispatching to the region being removed. */
+    qemu_mutex_lock(&xen_lockless_lock);
+    QLIST_FOREACH_SAFE(range, &xen_lockless_ranges, list, next) {
+        if (range->mr == section->mr && range->start_addr == addr &&
+            range->is_mmio == is_mmio) {
+            QLIST_REMOVE(range, list);
+            while (range->users) {
+                qemu_cond_wait(&xen_lockless_cond, &xen_lockless_lock);
+            }
+            g_free(range);
+        }
+    }
+    qemu_mutex_unlock(&xen_lockless_lock);
+
     DPRINTF("unmap %s %s 0x"TARGET_FMT_plx" - 0x"TARGET_FMT_plx"\n",
             (is_mmio) ? "mmio" : "io", section->mr->name,
             addr, addr + section->size - 1);
 
+    if (!xen_region_selected(section->mr)) {
+        return;
+    }
+
     xen_xc_hvm_unmap_io_range_from_ioreq_server(xen_xc, xen_domid, serverid,
                                                 is_mmio, addr);
 }
@@ -391,6 +610,79 @@ static hwaddr xen_phys_offset_to_gaddr(hwaddr start_addr,
     return start_addr;
 }
 
+static XenDirtyRange *xen_dirty_range_find(XenIOState *state,
+                                           hwaddr start_addr)
+{
+    XenDirtyRange *range;
+
+    QLIST_FOREACH(range, &state->dirty_ranges, list) {
+        if (range->start_addr == start_addr) {
+            return range;
+        }
+    }
+    return NULL;
+}
+
+static XenDirtyRange *xen_dirty_range_add(XenIOState *state,
+                                          MemoryRegionSection *section)
+{
+    hwaddr start_addr = section->offset_within_address_space;
+    XenDirtyRange *range = xen_dirty_range_find(state, start_addr);
+
+    if (range) {
+        return range;
+    }
+    /* only regions mapped by xen_add_to_physmap() can be tracked */
+    if (!get_physmapping(state, start_addr, section->size)) {
+        return NULL;
+    }
+
+    range = g_new0(XenDirtyRange, 1);
+    range->mr = section->mr;
+    range->offset_within_region = section->offset_within_region;
+    range->start_addr = start_addr;
+    range->size = section->size;
+    QLIST_INSERT_HEAD(&state->dirty_ranges, range, list);
+    return range;
+}
+
+static void xen_dirty_range_del(XenIOState *state,
+                                hwaddr start_addr, ram_addr_t size)
+{
+    XenDirtyRange *range, *next;
+
+    QLIST_FOREACH_SAFE(range, &state->dirty_ranges, list, next) {
+        if (range_covers_byte(start_addr, size, range->start_addr)) {
+            QLIST_REMOVE(range, list);
+            g_free(range);
+        }
+    }
+    if (QLIST_EMPTY(&state->dirty_ranges)) {
+        /* Disable dirty bit tracking */
+        xc_hvm_track_dirty_vram(xen_xc, xen_domid, 0, 0, NULL);
+    }
+}
+
+/* Mark the pages of @range set in @bitmap dirty, a run of them at a time;
+ * bit @base of @bitmap is the first page of @range.
+ */
+static void xen_dirty_range_import(XenDirtyRange *range,
+                                   const unsigned long *bitmap,
+                                   unsigned long base)
+{
+    unsigned long end = base + (range->size >> TARGET_PAGE_BITS);
+    unsigned long first, last;
+
+    first = find_next_bit(bitmap, end, base);
+    while (first < end) {
+        last = find_next_zero_bit(bitmap, end, first);
+        memory_region_set_dirty(range->mr, range->offset_within_region +
+                                ((hwaddr)(first - base) << TARGET_PAGE_BITS),
+                                (hwaddr)(last - first) << TARGET_PAGE_BITS);
+        first = find_next_bit(bitmap, end, last);
+    }
+}
+
 #if CONFIG_XEN_CTRL_INTERFACE_VERSION >= 340
 static int xen_add_to_physmap(XenIOState *state,
                               hwaddr start_addr,
@@ -412,11 +704,11 @@ static int xen_add_to_physmap(XenIOState *state,
         return -1;
     }
 
-    /* Xen can only handle a single dirty log region for now and we want
-     * the linear framebuffer to be that region.
-     * Avoid tracking any regions that is not videoram and avoid tracking
-     * the legacy vga region. */
-    if (mr == framebuffer && start_addr > 0xbffff) {
+    /* Dirty logging needs the region mapped where the guest sees it: the
+     * linear framebuffer and any other logged region, but not the legacy
+     * vga window, which aliases videoram. */
+    if ((mr == framebuffer || memory_region_is_logging(mr)) &&
+        start_addr > 0xbffff) {
         goto go_physmap;
     }
     return -1;
@@ -523,9 +815,7 @@ static int xen_remove_from_physmap(XenIOState *state,
     }
 
     QLIST_REMOVE(physmap, list);
-    if (state->log_for_dirtybit == physmap) {
-        state->log_for_dirtybit = NULL;
-    }
+    xen_dirty_range_del(state, physmap->start_addr, physmap->size);
     free(physmap);
 
     return 0;
@@ -608,51 +898,63 @@ static void xen_region_del(MemoryListener *listener,
 }
 
 static void xen_sync_dirty_bitmap(XenIOState *state,
-                                  hwaddr start_addr,
-                                  ram_addr_t size)
+                                  MemoryRegionSection *section)
 {
-    hwaddr npages = size >> TARGET_PAGE_BITS;
-    const int width = sizeof(unsigned long) * 8;
-    unsigned long bitmap[(npages + width - 1) / width];
-    int rc, i, j;
-    const XenPhysmap *physmap = NULL;
+    XenDirtyRange *range, *r;
+    hwaddr first, last;
+    unsigned long *bitmap;
+    bool grown;
+    int rc;
 
-    physmap = get_physmapping(state, start_addr, size);
-    if (physmap == NULL) {
+    range = xen_dirty_range_add(state, section);
+    if (range == NULL) {
         /* not handled */
         return;
     }
 
-    if (state->log_for_dirtybit == NULL) {
-        state->log_for_dirtybit = physmap;
-    } else if (state->log_for_dirtybit != physmap) {
-        /* Only one range for dirty bitmap can be tracked. */
-        return;
+    first = range->start_addr;
+    last = range->start_addr + range->size;
+    do {
+        grown = false;
+        QLIST_FOREACH(r, &state->dirty_ranges, list) {
+            if (r->start_addr > last || r->start_addr + r->size < first) {
+                continue;
+            }
+            if (r->start_addr < first || r->start_addr + r->size > last) {
+                first = MIN(first, r->start_addr);
+                last = MAX(last, r->start_addr + r->size);
+                grown = true;
+            }
+        }
+    } while (grown);
+    if ((last - first) >> TARGET_PAGE_BITS > XEN_DIRTY_SPAN_MAX) {
+        first = range->start_addr;
+        last = range->start_addr + range->size;
     }
 
+    bitmap = bitmap_new((last - first) >> TARGET_PAGE_BITS);
     rc = xc_hvm_track_dirty_vram(xen_xc, xen_domid,
-                                 start_addr >> TARGET_PAGE_BITS, npages,
+                                 first >> TARGET_PAGE_BITS,
+                                 (last - first) >> TARGET_PAGE_BITS,
                                  bitmap);
-    if (rc < 0) {
-        if (rc != -ENODATA) {
-            memory_region_set_dirty(framebuffer, 0, size);
-            DPRINTF("xen: track_dirty_vram failed (0x" TARGET_FMT_plx
-                    ", 0x" TARGET_FMT_plx "): %s\n",
-                    start_addr, start_addr + size, strerror(-rc));
-        }
-        return;
+    if (rc < 0 && rc != -ENODATA) {
+        DPRINTF("xen: track_dirty_vram failed (0x" TARGET_FMT_plx
+                ", 0x" TARGET_FMT_plx "): %s\n",
+                first, last, strerror(-rc));
     }
 
-    for (i = 0; i < ARRAY_SIZE(bitmap); i++) {
-        unsigned long map = bitmap[i];
-        while (map != 0) {
-            j = ffsl(map) - 1;
-            map &= ~(1ul << j);
-            memory_region_set_dirty(framebuffer,
-                                    (i * width + j) * TARGET_PAGE_SIZE,
-                                    TARGET_PAGE_SIZE);
-        };
+    QLIST_FOREACH(r, &state->dirty_ranges, list) {
+        if (r->start_addr < first || r->start_addr + r->size > last) {
+            continue;
+        }
+        if (rc == 0) {
+            xen_dirty_range_import(r, bitmap,
+                                   (r->start_addr - first) >> TARGET_PAGE_BITS);
+        } else if (rc != -ENODATA) {
+            memory_region_set_dirty(r->mr, r->offset_within_region, r->size);
+        }
     }
+    g_free(bitmap);
 }
 
 static void xen_log_start(MemoryListener *listener,
@@ -660,25 +962,22 @@ static void xen_log_start(MemoryListener *listener,
 {
     XenIOState *state = container_of(listener, XenIOState, memory_listener);
 
-    xen_sync_dirty_bitmap(state, section->offset_within_address_space,
-                          section->size);
+    xen_sync_dirty_bitmap(state, section);
 }
 
 static void xen_log_stop(MemoryListener *listener, MemoryRegionSection *section)
 {
     XenIOState *state = container_of(listener, XenIOState, memory_listener);
 
-    state->log_for_dirtybit = NULL;
-    /* Disable dirty bit tracking */
-    xc_hvm_track_dirty_vram(xen_xc, xen_domid, 0, 0, NULL);
+    xen_dirty_range_del(state, section->offset_within_address_space,
+                        section->size);
 }
 
 static void xen_log_sync(MemoryListener *listener, MemoryRegionSection *section)
 {
     XenIOState *state = container_of(listener, XenIOState, memory_listener);
 
-    xen_sync_dirty_bitmap(state, section->offset_within_address_space,
-                          section->size);
+    xen_sync_dirty_bitmap(state, section);
 }
 
 static void xen_log_global_start(MemoryListener *listener)
@@ -693,9 +992,117 @@ static void xen_log_global_stop(MemoryListener *listener)
     xen_in_migration = false;
 }
 
+/*
+ * Writes that fall within a coalesced range are answered as soon as they
+ * are read from the shared page, and only dispatched later, like KVM does
+ * with its coalesced MMIO ring.  See xen_handle_ioreq().
+ */
+static void xen_coalesced_range_add(XenIOState *state, hwaddr start,
+                                    hwaddr size, int is_mmio)
+{
+    XenCoalescedRange *range = g_malloc0(sizeof(*range));
+
+    range->start_addr = start;
+    range->size = size;
+    range->is_mmio = is_mmio;
+    QLIST_INSERT_HEAD(&state->coalesced_ranges, range, list);
+    trace_xen_coalesced_range_add(start, size, is_mmio);
+}
+
+static void xen_coalesced_range_del(XenIOState *state, hwaddr start,
+                                    hwaddr size, int is_mmio)
+{
+    XenCoalescedRange *range, *next;
+
+    QLIST_FOREACH_SAFE(range, &state->coalesced_ranges, list, next) {
+        if (range->is_mmio == is_mmio && range->start_addr >= start &&
+            range->start_addr + range->size <= start + size) {
+            QLIST_REMOVE(range, list);
+            g_free(range);
+        }
+    }
+}
+
+static void xen_coalesced_mmio_add(MemoryListener *listener,
+                                   MemoryRegionSection *section,
+                                   hwaddr start, hwaddr size)
+{
+    XenIOState *state = container_of(listener, XenIOState, memory_listener);
+
+    xen_coalesced_range_add(state, start, size, 1);
+}
+
+static void xen_coalesced_mmio_del(MemoryListener *listener,
+                                   MemoryRegionSection *section,
+                                   hwaddr start, hwaddr size)
+{
+    XenIOState *state = container_of(listener, XenIOState, memory_listener);
+
+    xen_coalesced_range_del(state, start, size, 1);
+}
+
+static void xen_ioeventfd_add(MemoryRegionSection *section, bool match_data,
+                              uint64_t data, EventNotifier *e, int is_mmio)
+{
+    XenIOEventFD *ioeventfd = g_malloc0(sizeof(*ioeventfd));
+
+    ioeventfd->addr = section->offset_within_address_space;
+    ioeventfd->size = section->size;
+    ioeventfd->match_data = match_data;
+    ioeventfd->data = data;
+    ioeventfd->e = e;
+    ioeventfd->is_mmio = is_mmio;
+
+    qemu_mutex_lock(&xen_lockless_lock);
+    QLIST_INSERT_HEAD(&xen_ioeventfds, ioeventfd, list);
+    qemu_mutex_unlock(&xen_lockless_lock);
+    trace_xen_ioeventfd_add(ioeventfd->addr, ioeventfd->size, match_data,
+                            data, is_mmio);
+}
+
+static void xen_ioeventfd_del(MemoryRegionSection *section, bool match_data,
+                              uint64_t data, EventNotifier *e, int is_mmio)
+{
+    XenIOEventFD *ioeventfd, *next;
+
+    /* Taking the lock also waits for a worker that may be signalling @e */
+    qemu_mutex_lock(&xen_lockless_lock);
+    QLIST_FOREACH_SAFE(ioeventfd, &xen_ioeventfds, list, next) {
+        if (ioeventfd->e == e && ioeventfd->is_mmio == is_mmio &&
+            ioeventfd->addr == section->offset_within_address_space &&
+            ioeventfd->match_data == match_data &&
+            (!match_data || ioeventfd->data == data)) {
+            QLIST_REMOVE(ioeventfd, list);
+            g_free(ioeventfd);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&xen_lockless_lock);
+}
+
+static void xen_mem_ioeventfd_add(MemoryListener *listener,
+                                  MemoryRegionSection *section,
+                                  bool match_data, uint64_t data,
+                                  EventNotifier *e)
+{
+    xen_ioeventfd_add(section, match_data, data, e, 1);
+}
+
+static void xen_mem_ioeventfd_del(MemoryListener *listener,
+                                  MemoryRegionSection *section,
+                                  bool match_data, uint64_t data,
+                                  EventNotifier *e)
+{
+    xen_ioeventfd_del(section, match_data, data, e, 1);
+}
+
 static MemoryListener xen_memory_listener = {
     .region_add = xen_region_add,
     .region_del = xen_region_del,
+    .coalesced_mmio_add = xen_coalesced_mmio_add,
+    .coalesced_mmio_del = xen_coalesced_mmio_del,
+    .eventfd_add = xen_mem_ioeventfd_add,
+    .eventfd_del = xen_mem_ioeventfd_del,
     .log_start = xen_log_start,
     .log_stop = xen_log_stop,
     .log_sync = xen_log_sync,
@@ -725,9 +1132,47 @@ static void xen_io_region_del(MemoryListener *listener,
     xen_unmap_iorange(section, 0);
 }
 
+static void xen_coalesced_pio_add(MemoryListener *listener,
+                                  MemoryRegionSection *section,
+                                  hwaddr start, hwaddr size)
+{
+    XenIOState *state = container_of(listener, XenIOState, io_listener);
+
+    xen_coalesced_range_add(state, start, size, 0);
+}
+
+static void xen_coalesced_pio_del(MemoryListener *listener,
+                                  MemoryRegionSection *section,
+                                  hwaddr start, hwaddr size)
+{
+    XenIOState *state = container_of(listener, XenIOState, io_listener);
+
+    xen_coalesced_range_del(state, start, size, 0);
+}
+
+static void xen_io_ioeventfd_add(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 bool match_data, uint64_t data,
+                                 EventNotifier *e)
+{
+    xen_ioeventfd_add(section, match_data, data, e, 0);
+}
+
+static void xen_io_ioeventfd_del(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 bool match_data, uint64_t data,
+                                 EventNotifier *e)
+{
+    xen_ioeventfd_del(section, match_data, data, e, 0);
+}
+
 static MemoryListener xen_io_listener = {
     .region_add = xen_io_region_add,
     .region_del = xen_io_region_del,
+    .coalesced_mmio_add = xen_coalesced_pio_add,
+    .coalesced_mmio_del = xen_coalesced_pio_del,
+    .eventfd_add = xen_io_ioeventfd_add,
+    .eventfd_del = xen_io_ioeventfd_del,
     .priority = 10,
 };
 
@@ -970,12 +1415,17 @@ static void cpu_ioreq_event(ioreq_t *req)
 }
 
 
-static void handle_ioreq(ioreq_t *req)
+static inline void ioreq_mask_data(ioreq_t *req)
 {
     if (!req->data_is_ptr && (req->dir == IOREQ_WRITE) &&
             (req->size < sizeof (target_ulong))) {
         req->data &= ((target_ulong) 1 << (8 * req->size)) - 1;
     }
+}
+
+static void handle_ioreq(ioreq_t *req)
+{
+    ioreq_mask_data(req);
 
     switch (req->type) {
         case IOREQ_TYPE_PIO:
@@ -1000,44 +1450,166 @@ static void handle_ioreq(ioreq_t *req)
     }
 }
 
+/* Upper bound, in bytes, of a run of buffered writes merged into one
+ * memory access */
+#define BUFFERED_IO_RUN_MAX  512
+
+static bool buffered_ioreq_extends_run(const ioreq_t *first,
+                                       const ioreq_t *last,
+                                       const ioreq_t *next)
+{
+    return next->type == IOREQ_TYPE_COPY && next->dir == IOREQ_WRITE &&
+           next->size == first->size &&
+           next->addr == last->addr + last->size &&
+           next->addr + next->size - first->addr <= BUFFERED_IO_RUN_MAX;
+}
+
+/*
+ * Dispatch a run of contiguous, same-sized buffered MMIO writes.  The target
+ * is looked up once for the whole run.  RAM targets (e.g. VRAM) are written
+ * with a single copy, so the range is marked dirty once; other regions get
+ * one callback per original write, with the original access size.
+ */
+static void handle_buffered_write_run(ioreq_t *reqs, int n)
+{
+    hwaddr addr = reqs[0].addr;
+    uint64_t len = reqs[n - 1].addr + reqs[n - 1].size - addr;
+    MemoryRegionSection section;
+    uint8_t buf[BUFFERED_IO_RUN_MAX];
+    int i;
+
+    section = memory_region_find(get_system_memory(), addr, len);
+    if (!section.mr || section.offset_within_address_space != addr ||
+        section.size != len) {
+        for (i = 0; i < n; i++) {
+            handle_ioreq(&reqs[i]);
+        }
+        return;
+    }
+
+    if (memory_region_is_ram(section.mr)) {
+        for (i = 0; i < n; i++) {
+            ioreq_mask_data(&reqs[i]);
+            memcpy(buf + (reqs[i].addr - addr), &reqs[i].data, reqs[i].size);
+        }
+        cpu_physical_memory_write(addr, buf, len);
+    } else {
+        for (i = 0; i < n; i++) {
+            ioreq_mask_data(&reqs[i]);
+            io_mem_write(section.mr, section.offset_within_region +
+                         (reqs[i].addr - addr), reqs[i].data, reqs[i].size);
+        }
+    }
+}
+
+/* Dispatch @n ioreqs in order, merging runs of contiguous MMIO writes */
+static void handle_ioreq_batch(ioreq_t *reqs, int n)
+{
+    int i, j;
+
+    for (i = 0; i < n; i = j) {
+        j = i + 1;
+        if (reqs[i].type == IOREQ_TYPE_COPY && reqs[i].dir == IOREQ_WRITE) {
+            while (j < n &&
+                   buffered_ioreq_extends_run(&reqs[i], &reqs[j - 1], &reqs[j])) {
+                j++;
+            }
+        }
+
+        if (j - i > 1) {
+            handle_buffered_write_run(&reqs[i], j - i);
+        } else {
+            handle_ioreq(&reqs[i]);
+        }
+    }
+}
+
+/* Dispatch the writes to coalesced ranges that were already answered */
+static void xen_coalesced_flush(XenIOState *state)
+{
+    if (state->coalesced_count == 0 || state->coalesced_flush_in_progress) {
+        return;
+    }
+
+    state->coalesced_flush_in_progress = true;
+    trace_xen_coalesced_flush(state->coalesced_count);
+    handle_ioreq_batch(state->coalesced_reqs, state->coalesced_count);
+    state->coalesced_count = 0;
+    state->coalesced_flush_in_progress = false;
+}
+
+static void xen_coalesced_flush_bh(void *opaque)
+{
+    xen_coalesced_flush(opaque);
+}
+
+void xen_flush_coalesced_mmio_buffer(void)
+{
+    if (xen_io_state) {
+        xen_coalesced_flush(xen_io_state);
+    }
+}
+
+/* Writes to ioeventfds are recognized when the ioreq is fetched, as soon as
+ * the ioreq listeners are registered. */
+int xen_has_ioeventfds(void)
+{
+    return xen_io_state != NULL;
+}
+
 static int handle_buffered_iopage(XenIOState *state)
 {
+    buffered_iopage_t *page = state->buffered_io_page;
     buf_ioreq_t *buf_req = NULL;
-    ioreq_t req;
+    ioreq_t *reqs = state->buffered_reqs;
+    uint32_t read_pointer, write_pointer;
+    int n = 0;
     int qw;
 
-    if (!state->buffered_io_page) {
+    if (!page) {
         return 0;
     }
 
-    memset(&req, 0x00, sizeof(req));
-
-    while (state->buffered_io_page->read_pointer != state->buffered_io_page->write_pointer) {
-        buf_req = &state->buffered_io_page->buf_ioreq[
-            state->buffered_io_page->read_pointer % IOREQ_BUFFER_SLOT_NUM];
-        req.size = 1UL << buf_req->size;
-        req.count = 1;
-        req.addr = buf_req->addr;
-        req.data = buf_req->data;
-        req.state = STATE_IOREQ_READY;
-        req.dir = buf_req->dir;
-        req.df = 1;
-        req.type = buf_req->type;
-        req.data_is_ptr = 0;
-        qw = (req.size == 8);
+    /* Walk the whole ring at once, then hand the slots back to Xen with a
+     * single read_pointer update. */
+    read_pointer = page->read_pointer;
+    write_pointer = page->write_pointer;
+    xen_rmb(); /* see write_pointer /then/ read the slots it covers */
+
+    /* Coalesced writes were issued before anything still in the ring */
+    if (read_pointer != write_pointer) {
+        xen_coalesced_flush(state);
+    }
+
+    while (read_pointer != write_pointer) {
+        ioreq_t *req = &reqs[n++];
+
+        buf_req = &page->buf_ioreq[read_pointer % IOREQ_BUFFER_SLOT_NUM];
+        memset(req, 0x00, sizeof(*req));
+        req->size = 1UL << buf_req->size;
+        req->count = 1;
+        req->addr = buf_req->addr;
+        req->data = buf_req->data;
+        req->state = STATE_IOREQ_READY;
+        req->dir = buf_req->dir;
+        req->df = 1;
+        req->type = buf_req->type;
+        req->data_is_ptr = 0;
+        qw = (req->size == 8);
         if (qw) {
-            buf_req = &state->buffered_io_page->buf_ioreq[
-                (state->buffered_io_page->read_pointer + 1) % IOREQ_BUFFER_SLOT_NUM];
-            req.data |= ((uint64_t)buf_req->data) << 32;
+            buf_req = &page->buf_ioreq[(read_pointer + 1) %
+                                       IOREQ_BUFFER_SLOT_NUM];
+            req->data |= ((uint64_t)buf_req->data) << 32;
         }
+        read_pointer += qw ? 2 : 1;
+    }
 
-        handle_ioreq(&req);
+    handle_ioreq_batch(reqs, n);
 
-        xen_mb();
-        state->buffered_io_page->read_pointer += qw ? 2 : 1;
-    }
+    xen_mb();
+    page->read_pointer = read_pointer;
 
-    return req.count;
+    return n;
 }
 
 static void handle_buffered_io(void *opaque)
@@ -1053,6 +1625,132 @@ static void handle_buffered_io(void *opaque)
     }
 }
 
+static bool cpu_ioreq_check_state(ioreq_t *req)
+{
+    if (req->state != STATE_IOREQ_INPROCESS) {
+        fprintf(stderr, "Badness in I/O request ... not in service?!: "
+                "%x, ptr: %x, port: %"PRIx64", "
+                "data: %"PRIx64", count: %" FMT_ioreq_size ", size: %" FMT_ioreq_size "\n",
+                req->state, req->data_is_ptr, req->addr,
+                req->data, req->count, req->size);
+        destroy_hvm_domain(false);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * We do this before we send the response so that the tools
+ * have the opportunity to pick up on the reset before the
+ * guest resumes and does a hlt with interrupts disabled which
+ * causes Xen to powerdown the domain.
+ */
+static void cpu_ioreq_check_shutdown(void)
+{
+    if (runstate_is_running()) {
+        if (qemu_shutdown_requested_get()) {
+            destroy_hvm_domain(false);
+        }
+        if (qemu_reset_requested_get()) {
+            qemu_system_reset(VMRESET_REPORT);
+            destroy_hvm_domain(true);
+        }
+    }
+}
+
+static bool xen_ioreq_is_coalesced(XenIOState *state, ioreq_t *req)
+{
+    XenCoalescedRange *range;
+    int is_mmio;
+
+    if (req->dir != IOREQ_WRITE || req->data_is_ptr || req->count != 1) {
+        return false;
+    }
+    if (req->type == IOREQ_TYPE_PIO) {
+        is_mmio = 0;
+    } else if (req->type == IOREQ_TYPE_COPY) {
+        is_mmio = 1;
+    } else {
+        return false;
+    }
+
+    QLIST_FOREACH(range, &state->coalesced_ranges, list) {
+        if (range->is_mmio == is_mmio &&
+            range_covers_byte(range->start_addr, range->size, req->addr) &&
+            range_covers_byte(range->start_addr, range->size,
+                              req->addr + req->size - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * If @req is a plain write to an ioeventfd, set its notifier instead of
+ * dispatching the write, and return true.  The device picks the kick up from
+ * its own handler, while the vcpu is already running again.
+ */
+static bool xen_ioreq_signal_eventfd(ioreq_t *req)
+{
+    XenIOEventFD *ioeventfd;
+    EventNotifier *e = NULL;
+    uint64_t data;
+    int is_mmio;
+
+    if (req->dir != IOREQ_WRITE || req->data_is_ptr || req->count != 1) {
+        return false;
+    }
+    if (req->type == IOREQ_TYPE_PIO) {
+        is_mmio = 0;
+    } else if (req->type == IOREQ_TYPE_COPY) {
+        is_mmio = 1;
+    } else {
+        return false;
+    }
+
+    data = req->data;
+    if (req->size < sizeof(data)) {
+        data &= (1ULL << (8 * req->size)) - 1;
+    }
+
+    qemu_mutex_lock(&xen_lockless_lock);
+    QLIST_FOREACH(ioeventfd, &xen_ioeventfds, list) {
+        if (ioeventfd->is_mmio == is_mmio && ioeventfd->addr == req->addr &&
+            ioeventfd->size == req->size &&
+            (!ioeventfd->match_data || ioeventfd->data == data)) {
+            e = ioeventfd->e;
+            event_notifier_set(e);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&xen_lockless_lock);
+
+    return e != NULL;
+}
+
+/*
+ * Handle @req under the global mutex.  A write to a coalesced range is only
+ * queued, so the vcpu can resume without waiting for the device model; the
+ * queue is dispatched from a bottom half, before any other ioreq, or when a
+ * device calls qemu_flush_coalesced_mmio_buffer().
+ */
+static void xen_handle_ioreq(XenIOState *state, ioreq_t *req)
+{
+    if (xen_ioreq_is_coalesced(state, req)) {
+        if (state->coalesced_count == XEN_COALESCED_MAX) {
+            xen_coalesced_flush(state);
+        }
+        state->coalesced_reqs[state->coalesced_count++] = *req;
+        qemu_bh_schedule(state->coalesced_bh);
+        return;
+    }
+
+    xen_coalesced_flush(state);
+    if (!xen_ioreq_signal_eventfd(req)) {
+        handle_ioreq(req);
+    }
+}
+
 static void cpu_handle_ioreq(void *opaque)
 {
     XenIOState *state = opaque;
@@ -1060,38 +1758,192 @@ static void cpu_handle_ioreq(void *opaque)
 
     handle_buffered_iopage(state);
     if (req) {
-        handle_ioreq(req);
+        xen_handle_ioreq(state, req);
 
-        if (req->state != STATE_IOREQ_INPROCESS) {
-            fprintf(stderr, "Badness in I/O request ... not in service?!: "
-                    "%x, ptr: %x, port: %"PRIx64", "
-                    "data: %"PRIx64", count: %" FMT_ioreq_size ", size: %" FMT_ioreq_size "\n",
-                    req->state, req->data_is_ptr, req->addr,
-                    req->data, req->count, req->size);
-            destroy_hvm_domain(false);
+        if (!cpu_ioreq_check_state(req)) {
             return;
         }
 
         xen_wmb(); /* Update ioreq contents /then/ update state. */
 
-        /*
-         * We do this before we send the response so that the tools
-         * have the opportunity to pick up on the reset before the
-         * guest resumes and does a hlt with interrupts disabled which
-         * causes Xen to powerdown the domain.
-         */
-        if (runstate_is_running()) {
-            if (qemu_shutdown_requested_get()) {
-                destroy_hvm_domain(false);
-            }
-            if (qemu_reset_requested_get()) {
-                qemu_system_reset(VMRESET_REPORT);
-                destroy_hvm_domain(true);
+        cpu_ioreq_check_shutdown();
+
+        req->state = STATE_IORESP_READY;
+        xc_evtchn_notify(state->xce_handle, state->ioreq_local_port[state->send_vcpu]);
+    }
+}
+
+/*
+ * ioreq workers
+ *
+ * With -machine xen_ioreq_workers=on each vcpu's event channel is bound on a
+ * private handle and serviced by its own thread.  Every vcpu owns a distinct
+ * slot of the shared page, so fetching the ioreq and posting the response
+ * need no locking.  Simple accesses to regions flagged with
+ * memory_region_set_thread_safe() are dispatched straight to the region,
+ * and kicks of ioeventfds only set the notifier; everything else is
+ * handled under the global mutex.
+ */
+
+/* Returns true if the request was handled without the global mutex */
+static bool handle_ioreq_lockless(XenIOState *state, ioreq_t *req)
+{
+    XenLocklessRange *range;
+    hwaddr addr;
+    int is_mmio;
+
+    if (req->data_is_ptr || req->count != 1) {
+        return false;
+    }
+    if (req->type == IOREQ_TYPE_PIO) {
+        is_mmio = 0;
+    } else if (req->type == IOREQ_TYPE_COPY) {
+        is_mmio = 1;
+    } else {
+        return false;
+    }
+    if (req->dir != IOREQ_READ && req->dir != IOREQ_WRITE) {
+        return false;
+    }
+
+    /* Buffered and coalesced ioreqs were issued earlier, keep them ordered
+     * before us */
+    if (state->buffered_io_page &&
+        state->buffered_io_page->read_pointer !=
+        state->buffered_io_page->write_pointer) {
+        return false;
+    }
+    if (state->coalesced_count) {
+        return false;
+    }
+
+    if (xen_ioreq_signal_eventfd(req)) {
+        return true;
+    }
+
+    qemu_mutex_lock(&xen_lockless_lock);
+    QLIST_FOREACH(range, &xen_lockless_ranges, list) {
+        if (range->is_mmio == is_mmio &&
+            range_covers_byte(range->start_addr, range->size, req->addr) &&
+            range_covers_byte(range->start_addr, range->size,
+                              req->addr + req->size - 1)) {
+            range->users++;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&xen_lockless_lock);
+    if (!range) {
+        return false;
+    }
+
+    /* Workers of other vcpus may be in the region at the same time */
+    ioreq_mask_data(req);
+    addr = req->addr - range->start_addr + range->offset_within_region;
+    if (req->dir == IOREQ_READ) {
+        req->data = io_mem_read(range->mr, addr, req->size);
+    } else {
+        io_mem_write(range->mr, addr, req->data, req->size);
+    }
+
+    qemu_mutex_lock(&xen_lockless_lock);
+    if (--range->users == 0) {
+        qemu_cond_broadcast(&xen_lockless_cond);
+    }
+    qemu_mutex_unlock(&xen_lockless_lock);
+
+    return true;
+}
+
+static void *xen_ioreq_worker_thread(void *opaque)
+{
+    XenIOWorker *worker = opaque;
+    XenIOState *state = worker->state;
+    evtchn_port_or_error_t port;
+    ioreq_t *req;
+
+    for (;;) {
+        port = xc_evtchn_pending(worker->xce_handle);
+        if (port == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
             }
+            fprintf(stderr, "xen: ioreq worker for vcpu %d: %s\n",
+                    worker->vcpu, strerror(errno));
+            break;
+        }
+        xc_evtchn_unmask(worker->xce_handle, port);
+
+        req = cpu_get_ioreq_from_shared_memory(state, worker->vcpu);
+        if (!req) {
+            continue;
+        }
+
+        if (!handle_ioreq_lockless(state, req)) {
+            qemu_mutex_lock_iothread();
+            handle_buffered_iopage(state);
+            xen_handle_ioreq(state, req);
+            qemu_mutex_unlock_iothread();
+        }
+
+        if (!cpu_ioreq_check_state(req)) {
+            break;
+        }
+
+        xen_wmb(); /* Update ioreq contents /then/ update state. */
+
+        if (qemu_shutdown_requested_get() || qemu_reset_requested_get()) {
+            qemu_mutex_lock_iothread();
+            cpu_ioreq_check_shutdown();
+            qemu_mutex_unlock_iothread();
         }
 
         req->state = STATE_IORESP_READY;
-        xc_evtchn_notify(state->xce_handle, state->ioreq_local_port[state->send_vcpu]);
+        xc_evtchn_notify(worker->xce_handle, worker->local_port);
+    }
+
+    return NULL;
+}
+
+static int xen_ioreq_workers_init(XenIOState *state)
+{
+    int i, rc;
+
+    state->workers = g_malloc0(smp_cpus * sizeof (XenIOWorker));
+    for (i = 0; i < smp_cpus; i++) {
+        XenIOWorker *worker = &state->workers[i];
+
+        worker->state = state;
+        worker->vcpu = i;
+        worker->xce_handle = xen_xc_evtchn_open(NULL, 0);
+        if (worker->xce_handle == XC_HANDLER_INITIAL_VALUE) {
+            perror("xen: ioreq worker event channel open");
+            return -1;
+        }
+        rc = xc_evtchn_bind_interdomain(worker->xce_handle, xen_domid,
+                                        xen_vcpu_eport(state->shared_page, i));
+        if (rc == -1) {
+            fprintf(stderr, "bind interdomain ioctl error %d\n", errno);
+            return -1;
+        }
+        worker->local_port = rc;
+        state->ioreq_local_port[i] = rc;
+    }
+
+    return 0;
+}
+
+static void xen_ioreq_workers_start(XenIOState *state)
+{
+    int i;
+
+    if (state->ioreq_workers_started) {
+        return;
+    }
+    state->ioreq_workers_started = true;
+
+    for (i = 0; i < smp_cpus; i++) {
+        qemu_thread_create(&state->workers[i].thread, xen_ioreq_worker_thread,
+                           &state->workers[i], QEMU_THREAD_DETACHED);
     }
 }
 
@@ -1201,6 +2053,10 @@ static void xen_main_loop_prepare(XenIOState *state)
     if (evtchn_fd != -1) {
         qemu_set_fd_handler(evtchn_fd, cpu_handle_ioreq, NULL, state);
     }
+
+    if (state->ioreq_workers) {
+        xen_ioreq_workers_start(state);
+    }
 }
 
 
@@ -1221,13 +2077,21 @@ static void xen_hvm_change_state_handler(void *opaque, int running,
     XenIOState *xstate = opaque;
     if (running) {
         xen_main_loop_prepare(xstate);
+    } else {
+        xen_coalesced_flush(xstate);
     }
 }
 
 static void xen_exit_notifier(Notifier *n, void *data)
 {
     XenIOState *state = container_of(n, XenIOState, exit);
+    int i;
 
+    if (state->workers) {
+        for (i = 0; i < smp_cpus; i++) {
+            xc_evtchn_close(state->workers[i].xce_handle);
+        }
+    }
     xc_evtchn_close(state->xce_handle);
     xs_daemon_close(state->xenstore);
 }
@@ -1312,6 +2176,9 @@ int xen_hvm_init(void)
     XenIOState *state;
     QemuOpts *machine_opts;
     bool emulate_ide = true;
+    bool ioreq_workers = false;
+    uint64_t mapcache_size = 0;
+    const char *devices = NULL;
 
     machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
     if (machine_opts) {
@@ -1319,9 +2186,22 @@ int xen_hvm_init(void)
         xen_emulate_default_dev = qemu_opt_get_bool(machine_opts,
                                                     "xen_default_dev", true);
         emulate_ide = qemu_opt_get_bool(machine_opts, "emulate_ide", true);
+        ioreq_workers = qemu_opt_get_bool(machine_opts, "xen_ioreq_workers",
+                                          false);
+        mapcache_size = qemu_opt_get_size(machine_opts, "xen_mapcache_size",
+                                          0);
+        devices = qemu_opt_get(machine_opts, "xen_devices");
+    }
+    if (devices && *devices) {
+        /* The default devices are left to another device model */
+        xen_devices = g_strsplit(devices, ":", 0);
+        xen_emulate_default_dev = false;
     }
 
     state = g_malloc0(sizeof (XenIOState));
+    state->ioreq_workers = ioreq_workers;
+    qemu_mutex_init(&xen_lockless_lock);
+    qemu_cond_init(&xen_lockless_cond);
 
     state->xce_handle = xen_xc_evtchn_open(NULL, 0);
     if (state->xce_handle == XC_HANDLER_INITIAL_VALUE) {
@@ -1369,14 +2249,20 @@ int xen_hvm_init(void)
     state->ioreq_local_port = g_malloc0(smp_cpus * sizeof (evtchn_port_t));
 
     /* FIXME: how about if we overflow the page here? */
-    for (i = 0; i < smp_cpus; i++) {
-        rc = xc_evtchn_bind_interdomain(state->xce_handle, xen_domid,
-                                        xen_vcpu_eport(state->shared_page, i));
-        if (rc == -1) {
-            fprintf(stderr, "bind interdomain ioctl error %d\n", errno);
+    if (state->ioreq_workers) {
+        if (xen_ioreq_workers_init(state) < 0) {
             return -1;
         }
-        state->ioreq_local_port[i] = rc;
+    } else {
+        for (i = 0; i < smp_cpus; i++) {
+            rc = xc_evtchn_bind_interdomain(state->xce_handle, xen_domid,
+                                            xen_vcpu_eport(state->shared_page, i));
+            if (rc == -1) {
+                fprintf(stderr, "bind interdomain ioctl error %d\n", errno);
+                return -1;
+            }
+            state->ioreq_local_port[i] = rc;
+        }
     }
 
     rc = xen_buffered_channel();
@@ -1396,15 +2282,18 @@ int xen_hvm_init(void)
     state->bufioreq_local_port = rc;
 
     /* Init RAM management */
-    xen_map_cache_init(xen_phys_offset_to_gaddr, state);
+    xen_map_cache_init(xen_phys_offset_to_gaddr, state, mapcache_size);
     xen_ram_init(ram_size);
 
     qemu_add_vm_change_state_handler(xen_hvm_change_state_handler, state);
 
     state->memory_listener = xen_memory_listener;
     QLIST_INIT(&state->physmap);
+    QLIST_INIT(&state->dirty_ranges);
+    QLIST_INIT(&state->coalesced_ranges);
+    state->coalesced_bh = qemu_bh_new(xen_coalesced_flush_bh, state);
+    xen_io_state = state;
     memory_listener_register(&state->memory_listener, &address_space_memory);
-    state->log_for_dirtybit = NULL;
 
     state->io_listener = xen_io_listener;
     memory_listener_register(&state->io_listener, &address_space_io);
@@ -1422,6 +2311,7 @@ int xen_hvm_init(void)
     if (emulate_ide) {
         xen_be_register("qdisk", &xen_blkdev_ops);
     }
+    qemu_startup_phase("xen backends");
     xen_read_physmap(state);
 
     return 0;
@@ -4,22 +4,137 @@
 #include "xen-dmbus.h"
 #include "hw/xen.h"
 #include "qemu/timer.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "qemu/config-file.h"
+#include "ui/console.h"
+#include "trace.h"
+
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/* Room for several messages, so that one read can pick up a burst. */
+#define DMBUS_RECV_BUFF_LEN     (4 * DMBUS_MAX_MSG_LEN)
+
+/* Reads done by one invocation of the fd handler before yielding. */
+#define DMBUS_READ_BUDGET       16
+
+/* Request waiting for its reply, replies come back in order. */
+struct pending_reply {
+    int type;
+    dmbus_reply_cb cb;
+    void *opaque;
+    QTAILQ_ENTRY(pending_reply) next;
+};
 
+/*
+ * Received data lives in buff[rd, len).  Complete messages are handed to
+ * handle_message() in place; the view stays valid until the handler
+ * returns, even if it receives more messages itself, because the buffer
+ * is never compacted below /pin/.
+ */
 struct service {
     int fd;
+    uint64_t id;
     v4v_addr_t peer;
     const struct dmbus_ops *ops;
     void *opaque;
     struct dmbus_conn_prologue prologue;
 
-    char buff[DMBUS_MAX_MSG_LEN];
+    char buff[DMBUS_RECV_BUFF_LEN] __attribute__((aligned(8)));
+    int rd;
     int len;
+    int pin;
+
+    /* Host time of the read that completed the messages being handled, and
+     * of the dmbus thread's wakeup if it is waiting for the global mutex */
+    int64_t recv_ns;
+    int64_t wake_ns;
 
     QEMUTimer *reconnect_timer;
+
+    QTAILQ_HEAD(, pending_reply) pending;
+    QLIST_ENTRY(service) link;
 };
 
+static QLIST_HEAD(, service) services = QLIST_HEAD_INITIALIZER(services);
+static uint64_t next_service_id;
+
+/* With -machine xen_dmbus_thread=on, all service sockets are waited on
+ * by a single epoll thread instead of the main loop. */
+static int dmbus_epfd = -1;
+static QemuThread dmbus_thread;
+
+static void dmbus_fd_handler(void *opaque);
+
+static void service_watch(struct service *s)
+{
+#ifdef CONFIG_EPOLL
+    if (dmbus_epfd != -1) {
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.u64 = s->id,
+        };
+
+        if (epoll_ctl(dmbus_epfd, EPOLL_CTL_ADD, s->fd, &ev) == -1) {
+            fprintf(stderr, "%s: epoll_ctl failed: %s\n",
+                    __func__, strerror(errno));
+        }
+        return;
+    }
+#endif
+    qemu_set_fd_handler(s->fd, dmbus_fd_handler, NULL, s);
+}
+
+static void service_unwatch(struct service *s)
+{
+#ifdef CONFIG_EPOLL
+    if (dmbus_epfd != -1) {
+        epoll_ctl(dmbus_epfd, EPOLL_CTL_DEL, s->fd, NULL);
+        return;
+    }
+#endif
+    qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+}
+
+/* Does /m/ answer the oldest outstanding asynchronous request? */
+static bool is_pending_reply(struct service *s, union dmbus_msg *m)
+{
+    struct pending_reply *p = QTAILQ_FIRST(&s->pending);
+
+    return p && p->type == m->hdr.msg_type;
+}
+
+static void complete_pending(struct service *s, union dmbus_msg *m)
+{
+    struct pending_reply *p = QTAILQ_FIRST(&s->pending);
+
+    QTAILQ_REMOVE(&s->pending, p, next);
+    if (m) {
+        p->cb(p->opaque, m, m->hdr.msg_len);
+    } else {
+        p->cb(p->opaque, NULL, 0);
+    }
+    free(p);
+}
+
+/* The peer is gone, none of the outstanding requests will be answered. */
+static void fail_pending(struct service *s)
+{
+    while (!QTAILQ_EMPTY(&s->pending)) {
+        complete_pending(s, NULL);
+    }
+}
+
 static void handle_message(struct service *s, union dmbus_msg *m)
 {
+    if (is_pending_reply(s, m)) {
+        complete_pending(s, m);
+        return;
+    }
+
     if (!s->ops) {
         return;
     }
@@ -30,8 +145,13 @@ static void handle_message(struct service *s, union dmbus_msg *m)
         struct msg_dom0_input_event *msg = &m->dom0_input_event;
 
         if (s->ops->dom0_input_event) {
+            trace_dmbus_input_event(msg->type, msg->code, msg->value,
+                                    get_clock() - s->recv_ns);
+            qemu_input_latency(INPUT_LATENCY_STAGE_DISPATCH, s->recv_ns);
+            qemu_input_set_stamp(s->recv_ns);
             s->ops->dom0_input_event(s->opaque, msg->type,
                                      msg->code, msg->value);
+            qemu_input_set_stamp(0);
         }
         break;
     }
@@ -57,6 +177,19 @@ static void handle_message(struct service *s, union dmbus_msg *m)
         }
         break;
     }
+#ifdef CONFIG_DMBUS_DISPLAY_VISIBILITY
+    case DMBUS_MSG_DISPLAY_VISIBILITY:
+    {
+        struct msg_display_visibility *msg = &m->display_visibility;
+
+        if (s->ops->display_visibility) {
+            s->ops->display_visibility(s->opaque, msg->DisplayID,
+                                                  msg->visible,
+                                                  msg->refresh_interval);
+        }
+        break;
+    }
+#endif
     case DMBUS_MSG_DEVICE_MODEL_READY:
     {
          /* This space in intentionally left blank. */
@@ -86,42 +219,98 @@ static void handle_message(struct service *s, union dmbus_msg *m)
     }
 }
 
-static void pop_message(struct service *s)
+static void handle_disconnect(struct service *s)
 {
+    if (s->fd == -1 || qemu_timer_pending(s->reconnect_timer)) {
+        return;
+    }
 
-    union dmbus_msg *m = (union dmbus_msg *)s->buff;
-    int len = m->hdr.msg_len;
+    service_unwatch(s);
+    v4v_close(s->fd);
+    s->fd = -1;
+    /* Whatever is left belongs to the old stream. */
+    s->rd = s->len = s->pin;
+    fail_pending(s);
+    fprintf(stderr, "Remote service disconnected, scheduling reconnection.\n");
+    qemu_mod_timer(s->reconnect_timer, qemu_get_clock_ms(rt_clock) + 1000);
+}
 
-    if ((s->len < sizeof(struct dmbus_msg_hdr)) ||
-        (s->len < len)) {
-        return;
+/* Next complete message in the buffer, if any. */
+static union dmbus_msg *peek_message(struct service *s)
+{
+    union dmbus_msg *m = (union dmbus_msg *)(s->buff + s->rd);
+    int avail = s->len - s->rd;
+
+    if (avail < sizeof(struct dmbus_msg_hdr)) {
+        return NULL;
+    }
+    if (m->hdr.msg_len < sizeof(struct dmbus_msg_hdr) ||
+        m->hdr.msg_len > DMBUS_MAX_MSG_LEN) {
+        fprintf(stderr, "%s: bad message length %d, dropping connection\n",
+                __func__, m->hdr.msg_len);
+        handle_disconnect(s);
+        return NULL;
+    }
+    if (avail < m->hdr.msg_len) {
+        return NULL;
     }
 
-    memmove(s->buff,  s->buff + len,  s->len - len);
-    s->len -= len;
+    return m;
 }
 
-static void handle_disconnect(struct service *s)
+static void pop_message(struct service *s, union dmbus_msg *m)
 {
-    if (qemu_timer_pending(s->reconnect_timer)) {
-        return;
+    s->rd += m->hdr.msg_len;
+    if (s->rd == s->len) {
+        s->rd = s->len = s->pin;
     }
+}
 
-    qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
-    v4v_close(s->fd);
-    fprintf(stderr, "Remote service disconnected, scheduling reconnection.\n");
-    qemu_mod_timer(s->reconnect_timer, qemu_get_clock_ms(rt_clock) + 1000);
+static void dispatch_message(struct service *s, union dmbus_msg *m)
+{
+    int pin = s->pin;
+
+    s->rd += m->hdr.msg_len;
+    s->pin = s->rd;
+    handle_message(s, m);
+    s->pin = pin;
+    if (s->rd == s->len) {
+        s->rd = s->len = s->pin;
+    }
+}
+
+/* Read as much as is available, keeping at least one maximum sized
+ * message worth of room at the end of the buffer. */
+static int fill_buffer(struct service *s, int flags)
+{
+    int space;
+
+    if (sizeof(s->buff) - s->len < DMBUS_MAX_MSG_LEN && s->rd > s->pin) {
+        memmove(s->buff + s->pin, s->buff + s->rd, s->len - s->rd);
+        s->len -= s->rd - s->pin;
+        s->rd = s->pin;
+    }
+
+    space = sizeof(s->buff) - s->len;
+    if (space <= 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    return v4v_recv(s->fd, s->buff + s->len, space, flags);
 }
 
 static union dmbus_msg *sync_recv(struct service *s)
 {
+    union dmbus_msg *m;
     int rc;
-    union dmbus_msg *m = (union dmbus_msg *)s->buff;
 
-    while ((s->len < sizeof(struct dmbus_msg_hdr)) ||
-           (s->len < m->hdr.msg_len)) {
+    while (!(m = peek_message(s))) {
+        if (s->fd == -1) {
+            return NULL;
+        }
 
-        rc = v4v_recv(s->fd, s->buff + s->len, sizeof(s->buff) - s->len, 0);
+        rc = fill_buffer(s, 0);
         switch (rc) {
         case 0:
             handle_disconnect(s);
@@ -135,8 +324,8 @@ static union dmbus_msg *sync_recv(struct service *s)
             return NULL;
         default:
             s->len += rc;
+            s->recv_ns = get_clock();
         }
-
     }
 
     return m;
@@ -144,14 +333,15 @@ static union dmbus_msg *sync_recv(struct service *s)
 
 static void dmbus_fd_handler(void *opaque)
 {
-    int rc;
     struct service *s = opaque;
-    union dmbus_msg *m = (union dmbus_msg *)s->buff;
-
-    do {
-        rc = v4v_recv(s->fd, s->buff + s->len, sizeof(s->buff) - s->len,
-                      MSG_DONTWAIT);
+    union dmbus_msg *m;
+    int budget = DMBUS_READ_BUDGET;
+    int64_t wake_ns = s->wake_ns;
+    int rc;
 
+    s->wake_ns = 0;
+    while (s->fd != -1 && budget--) {
+        rc = fill_buffer(s, MSG_DONTWAIT);
         switch (rc) {
         case 0:
             handle_disconnect(s);
@@ -160,23 +350,20 @@ static void dmbus_fd_handler(void *opaque)
             if (errno == EINTR) {
                 continue;
             }
-            fprintf(stderr, "%s: recv error: %s\n",
-                    __func__, strerror(errno));
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "%s: recv error: %s\n",
+                        __func__, strerror(errno));
+            }
             return;
         default:
             s->len += rc;
+            s->recv_ns = wake_ns ? wake_ns : get_clock();
+            wake_ns = 0;
         }
-    } while (rc <= 0);
-    m = sync_recv(s);
-    if (!m) {
-        return;
-    }
-
-    while ((s->len >= sizeof(struct dmbus_msg_hdr)) &&
-           (s->len >= m->hdr.msg_len)) {
 
-        handle_message(s, m);
-        pop_message(s);
+        while ((m = peek_message(s))) {
+            dispatch_message(s, m);
+        }
     }
 }
 
@@ -191,9 +378,9 @@ int dmbus_sync_recv(dmbus_service_t service, int type,
         return -1;
     }
 
-    while (m->hdr.msg_type != type) {
-        handle_message(s, m);
-        pop_message(s);
+    /* A reply owed to an earlier asynchronous request isn't ours. */
+    while (m->hdr.msg_type != type || is_pending_reply(s, m)) {
+        dispatch_message(s, m);
         m = sync_recv(s);
         if (!m) {
             return -1;
@@ -205,7 +392,7 @@ int dmbus_sync_recv(dmbus_service_t service, int type,
     }
 
     memcpy(data, m, size);
-    pop_message(s);
+    pop_message(s, m);
 
     return size;
 }
@@ -221,26 +408,111 @@ static void try_reconnect(void *opaque)
     }
     rc = v4v_connect(s->fd, &s->peer);
     if (rc == -1) {
-        v4v_close(s->fd);
-        goto rearm;
+        goto close;
     }
     rc = v4v_send(s->fd, &s->prologue, sizeof(s->prologue), 0);
     if (rc != sizeof(s->prologue)) {
-        v4v_close(s->fd);
-        goto rearm;
+        goto close;
     }
 
     if (s->ops->reconnect) {
         s->ops->reconnect(s->opaque);
     }
 
-    qemu_set_fd_handler(s->fd, dmbus_fd_handler, NULL, s);
+    service_watch(s);
 
     return;
+close:
+    v4v_close(s->fd);
+    s->fd = -1;
 rearm:
     qemu_mod_timer(s->reconnect_timer, qemu_get_clock_ms(rt_clock) + 1000);
 }
 
+static struct service *find_service(uint64_t id)
+{
+    struct service *s;
+
+    QLIST_FOREACH(s, &services, link) {
+        if (s->id == id) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+#ifdef CONFIG_EPOLL
+/* The handlers run under the global mutex, exactly as they would from
+ * the main loop, but don't have to wait for it to get around to polling. */
+static void *dmbus_thread_fn(void *opaque)
+{
+    struct epoll_event ev[8];
+    struct service *s;
+    int64_t now;
+    int i, n;
+
+    for (;;) {
+        n = epoll_wait(dmbus_epfd, ev, ARRAY_SIZE(ev), -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: epoll_wait failed: %s\n",
+                    __func__, strerror(errno));
+            break;
+        }
+
+        /* Input latency includes the wait for the mutex */
+        now = get_clock();
+        qemu_mutex_lock_iothread();
+        for (i = 0; i < n; i++) {
+            /* The service may have gone away since epoll_wait() returned. */
+            s = find_service(ev[i].data.u64);
+            if (s) {
+                s->wake_ns = now;
+                dmbus_fd_handler(s);
+            }
+        }
+        qemu_mutex_unlock_iothread();
+        qemu_notify_event();
+    }
+
+    return NULL;
+}
+#endif
+
+static void dmbus_init(void)
+{
+    static bool initialized;
+    QemuOpts *machine_opts;
+
+    if (initialized) {
+        return;
+    }
+    initialized = true;
+
+    machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (!machine_opts ||
+        !qemu_opt_get_bool(machine_opts, "xen_dmbus_thread", false)) {
+        return;
+    }
+
+#ifdef CONFIG_EPOLL
+    dmbus_epfd = epoll_create(8);
+    if (dmbus_epfd == -1) {
+        fprintf(stderr, "%s: epoll_create failed: %s, using the main loop\n",
+                __func__, strerror(errno));
+        return;
+    }
+    qemu_set_cloexec(dmbus_epfd);
+    qemu_thread_create(&dmbus_thread, dmbus_thread_fn, NULL,
+                       QEMU_THREAD_DETACHED);
+#else
+    fprintf(stderr, "%s: xen_dmbus_thread needs epoll, using the main loop\n",
+            __func__);
+#endif
+}
+
 static void fill_hash(uint8_t *h)
 {
     const char *hash_str = DMBUS_SHA1_STRING;
@@ -263,6 +535,8 @@ dmbus_service_connect(int service,
     struct service *s;
     int rc;
 
+    dmbus_init();
+
     s = calloc(1, sizeof(*s));
     if (!s) {
         return NULL;
@@ -299,9 +573,12 @@ dmbus_service_connect(int service,
 
     s->opaque = opaque;
     s->ops = ops;
+    s->id = next_service_id++;
+    QTAILQ_INIT(&s->pending);
     s->reconnect_timer = qemu_new_timer_ms(rt_clock, try_reconnect, s);
+    QLIST_INSERT_HEAD(&services, s, link);
 
-    qemu_set_fd_handler(s->fd, dmbus_fd_handler, NULL, s);
+    service_watch(s);
 
     return s;
 close:
@@ -315,9 +592,14 @@ dmbus_service_disconnect(dmbus_service_t service)
 {
     struct service *s = service;
 
-    qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    QLIST_REMOVE(s, link);
+    if (s->fd != -1) {
+        service_unwatch(s);
+        v4v_close(s->fd);
+    }
+    fail_pending(s);
+    qemu_del_timer(s->reconnect_timer);
     qemu_free_timer(s->reconnect_timer);
-    v4v_close(s->fd);
     free(s);
 }
 
@@ -332,6 +614,11 @@ dmbus_send(dmbus_service_t service,
     int rc;
     size_t b = 0;
 
+    if (s->fd == -1) {
+        /* Waiting for the reconnection */
+        return -1;
+    }
+
     hdr->msg_type = msgtype;
     hdr->msg_len = len;
 
@@ -352,3 +639,40 @@ dmbus_send(dmbus_service_t service,
 
     return b;
 }
+
+/*
+ * Send a request without waiting for the answer: /cb/ is called from the
+ * main loop once a message of type /reply_type/ arrives for it.  If the
+ * request can't be sent, -1 is returned and /cb/ is never called.
+ */
+int
+dmbus_send_async(dmbus_service_t service,
+                 int msgtype,
+                 void *data,
+                 size_t len,
+                 int reply_type,
+                 dmbus_reply_cb cb,
+                 void *opaque)
+{
+    struct service *s = service;
+    struct pending_reply *p;
+    int rc;
+
+    p = calloc(1, sizeof(*p));
+    if (!p) {
+        return -1;
+    }
+    p->type = reply_type;
+    p->cb = cb;
+    p->opaque = opaque;
+
+    rc = dmbus_send(service, msgtype, data, len);
+    if (rc == -1) {
+        free(p);
+        return -1;
+    }
+    /* Replies are only processed from the main loop, after we return. */
+    QTAILQ_INSERT_TAIL(&s->pending, p, next);
+
+    return rc;
+}
@@ -14,6 +14,8 @@ struct dmbus_ops {
   void (*display_info)(void *opaque, uint8_t DisplayID, uint16_t max_xres,
                        uint16_t max_yres, uint16_t align);
   void (*display_edid)(void *opaque, uint8_t DisplayID, uint8_t *buff);
+  void (*display_visibility)(void *opaque, uint8_t DisplayID, int visible,
+                             uint32_t refresh_interval);
   void (*reconnect)(void *opaque);
 };
 
@@ -25,4 +27,14 @@ int dmbus_sync_recv(dmbus_service_t service, int type,
                     void *data, size_t size);
 int dmbus_send(dmbus_service_t service, int msgtype, void *data, size_t len);
 
+/*
+ * Completion of an asynchronous request.  @reply is NULL if the service
+ * went away before answering.
+ */
+typedef void (*dmbus_reply_cb)(void *opaque, const void *reply, size_t len);
+
+int dmbus_send_async(dmbus_service_t service, int msgtype, void *data,
+                     size_t len, int reply_type, dmbus_reply_cb cb,
+                     void *opaque);
+
 #endif /* XEN_DMBUS_H_ */
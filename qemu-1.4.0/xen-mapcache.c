@@ -15,11 +15,15 @@
 #include "hw/xen_backend.h"
 #include "sysemu/blockdev.h"
 #include "qemu/bitmap.h"
+#include "qemu/thread.h"
+#include "qemu/tls.h"
+#include "qemu/main-loop.h"
 
 #include <xen/hvm/params.h>
 #include <sys/mman.h>
 
 #include "sysemu/xen-mapcache.h"
+#include "qmp-commands.h"
 #include "trace.h"
 
 
@@ -49,9 +53,6 @@
  */
 #define NON_MCACHE_MEMORY_SIZE (80 * 1024 * 1024)
 
-#define mapcache_lock()   ((void)0)
-#define mapcache_unlock() ((void)0)
-
 typedef struct MapCacheEntry {
     hwaddr paddr_index;
     uint8_t *vaddr_base;
@@ -59,6 +60,8 @@ typedef struct MapCacheEntry {
     uint8_t lock;
     hwaddr size;
     struct MapCacheEntry *next;
+    /* Only buckets embedded in MapCache.entry are on the LRU list */
+    QTAILQ_ENTRY(MapCacheEntry) lru;
 } MapCacheEntry;
 
 typedef struct MapCacheRev {
@@ -73,18 +76,68 @@ typedef struct MapCache {
     unsigned long nr_buckets;
     QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
 
-    /* For most cases (>99.9%), the page address is the same. */
-    hwaddr last_address_index;
-    uint8_t *last_address_vaddr;
+    /* Bumped whenever a bucket is unmapped, invalidating every L1 */
+    unsigned int generation;
     unsigned long max_mcache_size;
     unsigned int mcache_bucket_shift;
 
+    /* Mapped buckets, least recently used first */
+    QTAILQ_HEAD(map_cache_lru, MapCacheEntry) lru;
+    unsigned long nr_mapped;
+    unsigned long max_mapped;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t remaps;
+    uint64_t evictions;
+
     phys_offset_to_gaddr_t phys_offset_to_gaddr;
     void *opaque;
+
+    QemuMutex lock;
 } MapCache;
 
 static MapCache *mapcache;
 
+/*
+ * Per-thread cache of the last bucket returned for an unlocked mapping.
+ * For most cases (>99.9%), the page address is the same, and this lets
+ * them skip the mapcache lock entirely.
+ */
+typedef struct MapCacheL1 {
+    hwaddr address_index;
+    uint8_t *vaddr;
+    unsigned int generation;
+} MapCacheL1;
+
+static DEFINE_TLS(MapCacheL1, mapcache_l1) = { .address_index = -1 };
+
+/*
+ * Locking
+ *
+ * The buckets, the LRU and the locked entries are protected by
+ * mapcache->lock, so that I/O threads can map guest memory without the
+ * global mutex.  Unlocked mappings (lock == 0) stay valid only until the
+ * next map cache call made under the global mutex: threads that do not
+ * hold it must use locked mappings, and never remap or evict a live
+ * unlocked bucket themselves.
+ */
+static inline void mapcache_lock(void)
+{
+    qemu_mutex_lock(&mapcache->lock);
+}
+
+static inline void mapcache_unlock(void)
+{
+    qemu_mutex_unlock(&mapcache->lock);
+}
+
+static inline void mapcache_l1_invalidate(void)
+{
+    tls_var(mapcache_l1).address_index = -1;
+    tls_var(mapcache_l1).vaddr = NULL;
+}
+
 static inline int test_bits(int nr, int size, const unsigned long *addr)
 {
     unsigned long res = find_next_zero_bit(addr, size + nr, nr);
@@ -94,7 +147,48 @@ static inline int test_bits(int nr, int size, const unsigned long *addr)
         return 0;
 }
 
-void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
+static inline bool mapcache_entry_is_bucket(MapCacheEntry *entry)
+{
+    return entry >= mapcache->entry &&
+           entry < mapcache->entry + mapcache->nr_buckets;
+}
+
+static void xen_unmap_bucket(MapCacheEntry *entry)
+{
+    if (munmap(entry->vaddr_base, entry->size) != 0) {
+        perror("unmap fails");
+        exit(-1);
+    }
+    if (mapcache_entry_is_bucket(entry)) {
+        QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+    }
+    mapcache->generation++;
+    mapcache->nr_mapped--;
+
+    entry->paddr_index = 0;
+    entry->vaddr_base = NULL;
+    entry->size = 0;
+    g_free(entry->valid_mapping);
+    entry->valid_mapping = NULL;
+}
+
+/* Unmap the least recently used unlocked bucket, other than @keep */
+static void xen_map_cache_evict(MapCacheEntry *keep)
+{
+    MapCacheEntry *entry;
+
+    QTAILQ_FOREACH(entry, &mapcache->lru, lru) {
+        if (entry != keep && !entry->lock) {
+            trace_xen_map_cache_evict(entry->paddr_index);
+            xen_unmap_bucket(entry);
+            mapcache->evictions++;
+            return;
+        }
+    }
+}
+
+void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque,
+                        uint64_t max_size)
 {
     unsigned long size;
     struct rlimit rlimit_as;
@@ -105,7 +199,8 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     mapcache->opaque = opaque;
 
     QTAILQ_INIT(&mapcache->locked_entries);
-    mapcache->last_address_index = -1;
+    QTAILQ_INIT(&mapcache->lru);
+    qemu_mutex_init(&mapcache->lock);
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
@@ -139,6 +234,12 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     DPRINTF("%s, nr_buckets = %lx size %lu\n", __func__,
             mapcache->nr_buckets, size);
     mapcache->entry = g_malloc0(size);
+
+    /* Working set cap, by default every bucket may stay mapped */
+    mapcache->max_mapped = mapcache->nr_buckets;
+    if (max_size) {
+        mapcache->max_mapped = MAX(max_size >> MCACHE_BUCKET_SHIFT, 1);
+    }
 }
 
 static void xen_remap_bucket(MapCacheEntry *entry,
@@ -157,14 +258,11 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     err = g_malloc0(nb_pfn * sizeof (int));
 
     if (entry->vaddr_base != NULL) {
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-    }
-    if (entry->valid_mapping != NULL) {
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
+        mapcache->remaps++;
+        xen_unmap_bucket(entry);
+    } else if (mapcache->nr_mapped >= mapcache->max_mapped &&
+               qemu_mutex_iothread_locked()) {
+        xen_map_cache_evict(entry);
     }
 
     for (i = 0; i < nb_pfn; i++) {
@@ -181,6 +279,10 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     entry->vaddr_base = vaddr_base;
     entry->paddr_index = address_index;
     entry->size = size;
+    if (mapcache_entry_is_bucket(entry)) {
+        QTAILQ_INSERT_TAIL(&mapcache->lru, entry, lru);
+    }
+    mapcache->nr_mapped++;
     entry->valid_mapping = (unsigned long *) g_malloc0(sizeof(unsigned long) *
             BITS_TO_LONGS(size >> XC_PAGE_SHIFT));
 
@@ -195,26 +297,21 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     g_free(err);
 }
 
-uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
-                       uint8_t lock)
+static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
+                                       uint8_t lock)
 {
     MapCacheEntry *entry, *pentry = NULL;
+    MapCacheL1 *l1 = &tls_var(mapcache_l1);
     hwaddr address_index;
     hwaddr address_offset;
     hwaddr __size = size;
     bool translated = false;
+    bool may_remap = qemu_mutex_iothread_locked();
 
 tryagain:
     address_index  = phys_addr >> MCACHE_BUCKET_SHIFT;
     address_offset = phys_addr & (MCACHE_BUCKET_SIZE - 1);
 
-    trace_xen_map_cache(phys_addr);
-
-    if (address_index == mapcache->last_address_index && !lock && !__size) {
-        trace_xen_map_cache_return(mapcache->last_address_vaddr + address_offset);
-        return mapcache->last_address_vaddr + address_offset;
-    }
-
     /* size is always a multiple of MCACHE_BUCKET_SIZE */
     if (size) {
         __size = size + address_offset;
@@ -227,7 +324,7 @@ tryagain:
 
     entry = &mapcache->entry[address_index % mapcache->nr_buckets];
 
-    while (entry && entry->lock && entry->vaddr_base &&
+    while (entry && (entry->lock || !may_remap) && entry->vaddr_base &&
             (entry->paddr_index != address_index || entry->size != __size ||
              !test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
                  entry->valid_mapping))) {
@@ -237,41 +334,77 @@ tryagain:
     if (!entry) {
         entry = g_malloc0(sizeof (MapCacheEntry));
         pentry->next = entry;
+        mapcache->misses++;
         xen_remap_bucket(entry, __size, address_index);
     } else if (!entry->lock) {
         if (!entry->vaddr_base || entry->paddr_index != address_index ||
                 entry->size != __size ||
                 !test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
                     entry->valid_mapping)) {
+            mapcache->misses++;
             xen_remap_bucket(entry, __size, address_index);
+        } else {
+            __sync_fetch_and_add(&mapcache->hits, 1);
         }
+    } else {
+        __sync_fetch_and_add(&mapcache->hits, 1);
+    }
+
+    if (mapcache_entry_is_bucket(entry) &&
+        entry != QTAILQ_LAST(&mapcache->lru, map_cache_lru)) {
+        QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+        QTAILQ_INSERT_TAIL(&mapcache->lru, entry, lru);
     }
 
     if(!test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
                 entry->valid_mapping)) {
-        mapcache->last_address_index = -1;
+        mapcache_l1_invalidate();
         if (!translated && mapcache->phys_offset_to_gaddr) {
             phys_addr = mapcache->phys_offset_to_gaddr(phys_addr, size, mapcache->opaque);
             translated = true;
             goto tryagain;
         }
-        trace_xen_map_cache_return(NULL);
         return NULL;
     }
 
-    mapcache->last_address_index = address_index;
-    mapcache->last_address_vaddr = entry->vaddr_base;
+    l1->address_index = address_index;
+    l1->vaddr = entry->vaddr_base;
+    l1->generation = mapcache->generation;
     if (lock) {
         MapCacheRev *reventry = g_malloc0(sizeof(MapCacheRev));
         entry->lock++;
-        reventry->vaddr_req = mapcache->last_address_vaddr + address_offset;
-        reventry->paddr_index = mapcache->last_address_index;
+        reventry->vaddr_req = entry->vaddr_base + address_offset;
+        reventry->paddr_index = address_index;
         reventry->size = entry->size;
         QTAILQ_INSERT_HEAD(&mapcache->locked_entries, reventry, next);
     }
 
-    trace_xen_map_cache_return(mapcache->last_address_vaddr + address_offset);
-    return mapcache->last_address_vaddr + address_offset;
+    return entry->vaddr_base + address_offset;
+}
+
+uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
+                       uint8_t lock)
+{
+    MapCacheL1 *l1 = &tls_var(mapcache_l1);
+    uint8_t *p;
+
+    trace_xen_map_cache(phys_addr);
+
+    if (!lock && !size &&
+        l1->address_index == (phys_addr >> MCACHE_BUCKET_SHIFT) &&
+        l1->generation == mapcache->generation) {
+        __sync_fetch_and_add(&mapcache->hits, 1);
+        p = l1->vaddr + (phys_addr & (MCACHE_BUCKET_SIZE - 1));
+        trace_xen_map_cache_return(p);
+        return p;
+    }
+
+    mapcache_lock();
+    p = xen_map_cache_unlocked(phys_addr, size, lock);
+    mapcache_unlock();
+
+    trace_xen_map_cache_return(p);
+    return p;
 }
 
 ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
@@ -280,8 +413,10 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
     MapCacheRev *reventry;
     hwaddr paddr_index;
     hwaddr size;
+    ram_addr_t raddr;
     int found = 0;
 
+    mapcache_lock();
     QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
         if (reventry->vaddr_req == ptr) {
             paddr_index = reventry->paddr_index;
@@ -306,13 +441,17 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
     }
     if (!entry) {
         DPRINTF("Trying to find address %p that is not in the mapcache!\n", ptr);
+        mapcache_unlock();
         return 0;
     }
-    return (reventry->paddr_index << MCACHE_BUCKET_SHIFT) +
+    raddr = (reventry->paddr_index << MCACHE_BUCKET_SHIFT) +
         ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
+    mapcache_unlock();
+
+    return raddr;
 }
 
-void xen_invalidate_map_cache_entry(uint8_t *buffer)
+static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
 {
     MapCacheEntry *entry = NULL, *pentry = NULL;
     MapCacheRev *reventry;
@@ -338,9 +477,8 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
     QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
     g_free(reventry);
 
-    if (mapcache->last_address_index == paddr_index) {
-        mapcache->last_address_index = -1;
-        mapcache->last_address_vaddr = NULL;
+    if (tls_var(mapcache_l1).address_index == paddr_index) {
+        mapcache_l1_invalidate();
     }
 
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
@@ -358,14 +496,17 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
     }
 
     pentry->next = entry->next;
-    if (munmap(entry->vaddr_base, entry->size) != 0) {
-        perror("unmap fails");
-        exit(-1);
-    }
-    g_free(entry->valid_mapping);
+    xen_unmap_bucket(entry);
     g_free(entry);
 }
 
+void xen_invalidate_map_cache_entry(uint8_t *buffer)
+{
+    mapcache_lock();
+    xen_invalidate_map_cache_entry_unlocked(buffer);
+    mapcache_unlock();
+}
+
 void xen_invalidate_map_cache(void)
 {
     unsigned long i;
@@ -374,14 +515,14 @@ void xen_invalidate_map_cache(void)
     /* Flush pending AIO before destroying the mapcache */
     bdrv_drain_all();
 
+    mapcache_lock();
+
     QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
         DPRINTF("There should be no locked mappings at this time, "
                 "but "TARGET_FMT_plx" -> %p is present\n",
                 reventry->paddr_index, reventry->vaddr_req);
     }
 
-    mapcache_lock();
-
     for (i = 0; i < mapcache->nr_buckets; i++) {
         MapCacheEntry *entry = &mapcache->entry[i];
 
@@ -392,20 +533,28 @@ void xen_invalidate_map_cache(void)
             continue;
         }
 
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-
-        entry->paddr_index = 0;
-        entry->vaddr_base = NULL;
-        entry->size = 0;
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
+        xen_unmap_bucket(entry);
     }
 
-    mapcache->last_address_index = -1;
-    mapcache->last_address_vaddr = NULL;
+    mapcache->generation++;
+    mapcache_l1_invalidate();
+
+    mapcache_unlock();
+}
+
+XenMapCacheInfo *qmp_query_xen_mapcache(Error **errp)
+{
+    XenMapCacheInfo *info = g_malloc0(sizeof(*info));
 
+    mapcache_lock();
+    info->bucket_size = MCACHE_BUCKET_SIZE;
+    info->mapped = mapcache->nr_mapped;
+    info->max_mapped = mapcache->max_mapped;
+    info->hits = mapcache->hits;
+    info->misses = mapcache->misses;
+    info->remaps = mapcache->remaps;
+    info->evictions = mapcache->evictions;
     mapcache_unlock();
+
+    return info;
 }
@@ -12,6 +12,7 @@
 #include "hw/xen.h"
 #include "exec/memory.h"
 #include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
 
 void xenstore_store_pv_console_info(int i, CharDriverState *chr)
 {
@@ -61,10 +62,25 @@ void xen_register_framebuffer(MemoryRegion *mr)
 {
 }
 
+void xen_flush_coalesced_mmio_buffer(void)
+{
+}
+
+int xen_has_ioeventfds(void)
+{
+    return 0;
+}
+
 void qmp_xen_set_global_dirty_log(bool enable, Error **errp)
 {
 }
 
+XenMapCacheInfo *qmp_query_xen_mapcache(Error **errp)
+{
+    error_set(errp, QERR_FEATURE_DISABLED, "xen");
+    return NULL;
+}
+
 void xen_modified_memory(ram_addr_t start, ram_addr_t length)
 {
 }